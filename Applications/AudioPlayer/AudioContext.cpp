@@ -2,10 +2,14 @@
 
 #include <Lemon/Core/Logger.h>
 #include <Lemon/System/ABI/Audio.h>
+#include <Lemon/System/Util.h>
+
+#include <algorithm>
 
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <time.h>
@@ -40,10 +44,53 @@ extern "C" {
 // Samples are written using write() to the device file
 // which passes sample data to the audio driver.
 //
+// Instead of write(), the ring the kernel mixer reads our samples from
+// is mapped with IoCtlOutputMapRing and samples are copied straight into it,
+// IoCtlOutputGetPosition tells us how far the mixer has got
+// and IoCtlOutputCommit lets it play what has been written.
+//
 // Audio samples are read sequentially, in a FIFO (first-in first-out) manner
 
+void AudioContext::WriteToRing(const uint8_t* data, size_t size) {
+    // Time taken to play one period
+    int frameSize = m_pcmChannels * (m_pcmBitDepth / 8);
+    useconds_t periodTime = (uint64_t)m_ringInfo.periodSize / frameSize * 1000000 / m_pcmSampleRate;
+
+    while (size > 0) {
+        int position = ioctl(m_pcmOut, IoCtlOutputGetPosition);
+        if (position < 0) {
+            Lemon::Logger::Warning("/dev/snd/pcm IoCtlOutputGetPosition: {}", strerror(errno));
+            return;
+        }
+
+        // Keep a period free so the write position never laps the mixer
+        size_t queued = (m_ringWritePos + m_ringInfo.size - position) % m_ringInfo.size;
+        size_t space = m_ringInfo.size - m_ringInfo.periodSize - queued;
+        if (queued + m_ringInfo.periodSize >= m_ringInfo.size || space < (size_t)frameSize) {
+            usleep(periodTime);
+            continue;
+        }
+
+        size_t count = std::min({size, space, m_ringInfo.size - m_ringWritePos});
+        count -= count % frameSize;
+
+        memcpy(m_ring + m_ringWritePos, data, count);
+        if (ioctl(m_pcmOut, IoCtlOutputCommit, count) < 0) {
+            Lemon::Logger::Warning("/dev/snd/pcm IoCtlOutputCommit: {}", strerror(errno));
+            return;
+        }
+
+        m_ringWritePos = (m_ringWritePos + count) % m_ringInfo.size;
+        data += count;
+        size -= count;
+    }
+}
+
 // Repsonible for sending samples to the audio driver
 void AudioContext::PlayAudio() {
+    // Avoid audio dropouts when the system is busy
+    Lemon::SetSchedulingClass(0, SchedulingClassInteractive);
+
     // The audio file to be played
     int fd = m_pcmOut;
 
@@ -57,9 +104,12 @@ void AudioContext::PlayAudio() {
     AudioContext::SampleBuffer* buffers = sampleBuffers;
 
     while (!m_shouldThreadsDie) {
-        if (!m_shouldPlayAudio) {
+        {
+            // PlaybackStart is only called once the decoder is running
             std::unique_lock lockStatus{m_playerStatusLock};
-            playerShouldRunCondition.wait(lockStatus, [this]() -> bool { return m_shouldPlayAudio; });
+            playerShouldRunCondition.wait(lockStatus, [this]() -> bool {
+                return (m_shouldPlayAudio && m_isDecoderRunning) || m_shouldThreadsDie;
+            });
         }
 
         // If the decoder has stopped, exit this loop
@@ -67,9 +117,19 @@ void AudioContext::PlayAudio() {
             // If there aren't any valid audio buffers,
             // wait for the decoder to catch up
             if (!numValidBuffers) {
-                // Instead of busy waiting just sleep 5ms
-                // as not to chew through CPU time
-                usleep(5000);
+                std::unique_lock lock{sampleBuffersLock};
+
+                // Playback ran dry in the middle of a track,
+                // keep more audio decoded ahead from now on
+                if (m_playerPrimed && !m_decoderDraining && !numValidBuffers) {
+                    m_bufferTarget = std::min(m_bufferTarget * 2, AUDIOCONTEXT_MAX_BUFFERED);
+                    m_playerPrimed = false;
+                    decoderWaitCondition.notify_all();
+                }
+
+                playerWaitCondition.wait(lock, [this]() -> bool {
+                    return numValidBuffers || !m_shouldPlayAudio || !m_isDecoderRunning;
+                });
                 continue;
             };
 
@@ -80,14 +140,26 @@ void AudioContext::PlayAudio() {
             auto& buffer = buffers[currentSampleBuffer];
             m_lastTimestamp = buffer.timestamp;
 
+            // The decoder carries on into the queued track without stopping,
+            // let the main thread know once we get to its audio
+            if (TrackInfo* track = buffer.track; track && track != m_playingTrack) {
+                if (m_playingTrack.exchange(track)) {
+                    m_trackChanged = true;
+                }
+            }
+
             // Write the buffer to the device file
             // If the buffer queue is full,
             // waiting for the audio hardware to process the audio,
             // this call to write will block program execution until
             // it has written all the data
-            int ret = write(fd, buffer.data, buffer.samples * channels * sampleSize);
-            if (ret < 0) {
-                Lemon::Logger::Warning("/snd/dev/pcm: Error writing samples: {}", strerror(errno));
+            if (m_ring) {
+                WriteToRing(buffer.data, buffer.samples * channels * sampleSize);
+            } else {
+                int ret = write(fd, buffer.data, buffer.samples * channels * sampleSize);
+                if (ret < 0) {
+                    Lemon::Logger::Warning("/snd/dev/pcm: Error writing samples: {}", strerror(errno));
+                }
             }
 
             // Now that the buffer has been processed by the audio buffer,
@@ -100,11 +172,17 @@ void AudioContext::PlayAudio() {
             // the packet will become in
             if (numValidBuffers > 0) {
                 numValidBuffers--;
+                m_playerPrimed = true;
             }
+
+            // The decoder sleeps until half of the buffers have been played
+            // rather than waking for every one
+            bool wakeDecoder = DecoderShouldRefill();
             lock.unlock();
 
-            // Let the decoder know that we have processed a buffer
-            decoderWaitCondition.notify_all();
+            if (wakeDecoder) {
+                decoderWaitCondition.notify_all();
+            }
         }
     }
 }
@@ -164,6 +242,11 @@ AudioContext::AudioContext() {
         exit(1);
     }
 
+    // Queue samples straight into the ring of our mixer stream
+    if (ioctl(m_pcmOut, IoCtlOutputMapRing, &m_ringInfo) == 0) {
+        m_ring = reinterpret_cast<uint8_t*>(m_ringInfo.base);
+    }
+
     // ~100ms of audio per buffer (1 / 10 seconds)
     // samples per buffer = sample rate / 10
     samplesPerBuffer = m_pcmSampleRate / 10;
@@ -185,6 +268,75 @@ AudioContext::~AudioContext() {
     PlaybackStop();
 }
 
+int AudioContext::OpenTrackDecoder(TrackInfo* info, TrackDecoder& decoder) {
+    assert(!decoder.format);
+    decoder.format = avformat_alloc_context();
+
+    // Opens the audio file
+    if (int err = avformat_open_input(&decoder.format, info->filepath.c_str(), NULL, NULL); err) {
+        Lemon::Logger::Error("Failed to open {}", info->filepath);
+        // avformat_open_input frees the context on failure
+        decoder = {};
+        return err;
+    }
+
+    // Gets metadata and information about the audio contained in the file
+    if (int err = avformat_find_stream_info(decoder.format, NULL); err) {
+        Lemon::Logger::Error("Failed to get stream info for {}", info->filepath);
+        CloseTrackDecoder(decoder);
+        return err;
+    }
+
+    // Data is organised into 'streams'
+    // Search for the 'best' audio stream
+    // Any album art may be placed in a video stream
+    int streamIndex = av_find_best_stream(decoder.format, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+    if (streamIndex < 0) {
+        Lemon::Logger::Error("Failed to get audio stream for {}", info->filepath);
+        CloseTrackDecoder(decoder);
+        return streamIndex;
+    }
+
+    decoder.stream = decoder.format->streams[streamIndex];
+    decoder.streamIndex = streamIndex;
+
+    // Find a decoder for the audio data we have been given
+    const AVCodec* codec = avcodec_find_decoder(decoder.stream->codecpar->codec_id);
+    if (!codec) {
+        Lemon::Logger::Error("Failed to find codec for '{}'", info->filepath);
+        CloseTrackDecoder(decoder);
+        return 1;
+    }
+
+    decoder.codec = avcodec_alloc_context3(codec);
+    if (avcodec_parameters_to_context(decoder.codec, decoder.stream->codecpar)) {
+        Lemon::Logger::Error("Failed to initialie codec context.");
+        CloseTrackDecoder(decoder);
+        return 1;
+    }
+
+    if (avcodec_open2(decoder.codec, codec, NULL) < 0) {
+        Lemon::Logger::Error("Failed to open codec!");
+        CloseTrackDecoder(decoder);
+        return 1;
+    }
+
+    decoder.track = info;
+    return 0;
+}
+
+void AudioContext::CloseTrackDecoder(TrackDecoder& decoder) {
+    if (decoder.codec) {
+        avcodec_free_context(&decoder.codec);
+    }
+
+    if (decoder.format) {
+        avformat_close_input(&decoder.format);
+    }
+
+    decoder = {};
+}
+
 // Turns encoded audio data (such as MPEG-2 or FLAC) into raw audio samples
 void AudioContext::DecodeAudio() {
     // Start the player thread
@@ -199,38 +351,6 @@ void AudioContext::DecodeAudio() {
         }
 
         m_decoderLock.lock();
-        m_resampler = swr_alloc();
-
-        // Check how many channels are in the audio file
-        if (m_avcodec->channels == 1) {
-            av_opt_set_int(m_resampler, "in_channel_layout", AV_CH_LAYOUT_MONO, 0);
-        } else {
-            if (m_avcodec->channels != 2) {
-                Lemon::Logger::Warning("Unsupported number of audio channels {}, taking first 2 and playing as stereo.",
-                                       m_avcodec->channels);
-            }
-
-            av_opt_set_int(m_resampler, "in_channel_layout", AV_CH_LAYOUT_STEREO, 0);
-        }
-        av_opt_set_int(m_resampler, "in_sample_rate", m_avcodec->sample_rate, 0);
-        av_opt_set_sample_fmt(m_resampler, "in_sample_fmt", m_avcodec->sample_fmt, 0);
-
-        // Check the channel count of the audio device,
-        // probably stereo (2 channel)
-        if (m_pcmChannels == 1) {
-            av_opt_set_int(m_resampler, "out_channel_layout", AV_CH_LAYOUT_MONO, 0);
-        } else {
-            av_opt_set_int(m_resampler, "out_channel_layout", AV_CH_LAYOUT_STEREO, 0);
-        }
-
-        // Get the sample rate of the audio device
-        // (amount of audio samples processed in one second)
-        // For the AC97 audio hardware this will be 48000 Hz
-        av_opt_set_int(m_resampler, "out_sample_rate", m_pcmSampleRate, 0);
-
-        // Output is signed 16-bit PCM packed
-        av_opt_set_sample_fmt(m_resampler, "out_sample_fmt", AV_SAMPLE_FMT_S16, 0);
-        assert(m_pcmBitDepth == 16);
 
         // Reset the sample buffer read and write indexes
         lastSampleBuffer = 0;
@@ -240,12 +360,13 @@ void AudioContext::DecodeAudio() {
         // Reset all sample buffers,
         // some may still contain old audio data
         FlushSampleBuffers();
+        m_playingTrack = nullptr;
 
-        if (swr_init(m_resampler)) {
+        if (DecoderConfigureResampler()) {
             // If we failed to initialize the resampler,
             // set decoder as not running, preventing any audio from being decoded
             Lemon::Logger::Error("Could not initialize software resampler");
-            
+
             std::unique_lock lockStatus{m_decoderStatusLock};
             m_isDecoderRunning = false;
         } else {
@@ -256,39 +377,50 @@ void AudioContext::DecodeAudio() {
         AVPacket* packet = av_packet_alloc();
         AVFrame* frame = av_frame_alloc();
 
-        int frameResult = 0;
-        while (m_isDecoderRunning && (frameResult = av_read_frame(m_avfmt, packet)) >= 0) {
-            if (packet->stream_index != m_currentStreamIndex) {
+        // Set if we got to the end of the last track without errors
+        bool reachedEnd = false;
+        while (m_isDecoderRunning) {
+            if (int frameResult = av_read_frame(m_current.format, packet); frameResult < 0) {
+                if (frameResult != AVERROR_EOF) {
+                    Lemon::Logger::Error("Could not read packet: {}", frameResult);
+                    break;
+                }
+
+                // Get the last frames out of the codec
+                avcodec_send_packet(m_current.codec, NULL);
+                DecoderReceiveFrames(frame);
+
+                // Carry on filling the sample buffers with the next track
+                if (DecoderAdvanceTrack()) {
+                    continue;
+                }
+
+                DecoderDrainBuffers();
+
+                // The user may seek back whilst the last buffers are playing
+                if (m_isDecoderRunning && m_requestSeek) {
+                    DecoderDoSeek();
+                    continue;
+                }
+
+                reachedEnd = m_isDecoderRunning;
+                break;
+            }
+
+            if (packet->stream_index != m_current.streamIndex) {
                 // May be a video stream such as album art, drop it
                 av_packet_unref(packet);
                 continue;
             }
 
             // Send the packet to the decoder
-            if (int ret = avcodec_send_packet(m_avcodec, packet); ret) {
+            if (int ret = avcodec_send_packet(m_current.codec, packet); ret) {
                 Lemon::Logger::Error("Could not send packet for decoding");
+                av_packet_unref(packet);
                 break;
             }
 
-            ssize_t ret = 0;
-            while (!IsDecoderPacketInvalid() && ret >= 0) {
-                // Decodes the audio
-                ret = avcodec_receive_frame(m_avcodec, frame);
-                if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) {
-                    // Get the next packet and retry
-                    break;
-                } else if (ret) {
-                    Lemon::Logger::Error("Could not decode frame: {}", ret);
-                    // Stop decoding audio
-                    m_isDecoderRunning = false;
-                    break;
-                }
-
-                DecoderDecodeFrame(frame);
-                
-                av_frame_unref(frame);
-            }
-
+            DecoderReceiveFrames(frame);
             av_packet_unref(packet);
 
             // If the decoder should still run
@@ -296,30 +428,41 @@ void AudioContext::DecodeAudio() {
             if (m_isDecoderRunning && m_requestSeek) {
                 DecoderDoSeek();
             }
+
+            // The player has plenty of audio to get through whilst the next track is opened
+            DecoderPrefetchNextTrack();
         }
 
-        // If we got to the end of file (did not encounter errors)
-        // let the main thread know to play the next track
-        if (frameResult == AVERROR_EOF) {
-            // We finished playing
+        av_frame_free(&frame);
+        av_packet_free(&packet);
+
+        // Let the main thread know to play the next track,
+        // only reached when nothing was queued to carry on into
+        if (reachedEnd) {
             m_shouldPlayNextTrack = true;
         }
 
         // Clean up after ourselves
         // Set the decoder as not running
-        std::unique_lock lockStatus{m_decoderStatusLock};
-        m_isDecoderRunning = false;
-        numValidBuffers = 0;
+        {
+            std::unique_lock lockStatus{m_decoderStatusLock};
+            m_isDecoderRunning = false;
+        }
+
+        {
+            std::scoped_lock lock{sampleBuffersLock};
+            numValidBuffers = 0;
+        }
+        // The player may be waiting for samples
+        playerWaitCondition.notify_all();
 
         // Free the resampler
         swr_free(&m_resampler);
         m_resampler = nullptr;
 
         // Free the codec and format contexts
-        avcodec_free_context(&m_avcodec);
-
-        avformat_free_context(m_avfmt);
-        m_avfmt = nullptr;
+        CloseTrackDecoder(m_current);
+        CloseTrackDecoder(m_next);
 
         // Unlock the decoder lock letting the other threads
         // know this thread is almost done
@@ -330,6 +473,27 @@ void AudioContext::DecodeAudio() {
     playerThread.join();
 }
 
+void AudioContext::DecoderReceiveFrames(AVFrame* frame) {
+    int ret = 0;
+    while (!IsDecoderPacketInvalid() && ret >= 0) {
+        // Decodes the audio
+        ret = avcodec_receive_frame(m_current.codec, frame);
+        if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) {
+            // Get the next packet and retry
+            break;
+        } else if (ret) {
+            Lemon::Logger::Error("Could not decode frame: {}", ret);
+            // Stop decoding audio
+            m_isDecoderRunning = false;
+            break;
+        }
+
+        DecoderDecodeFrame(frame);
+
+        av_frame_unref(frame);
+    }
+}
+
 void AudioContext::DecoderDecodeFrame(AVFrame* frame) {
     // Bytes per audio sample
     int outputSampleSize = (m_pcmBitDepth / 8);
@@ -344,8 +508,8 @@ void AudioContext::DecoderDecodeFrame(AVFrame* frame) {
     // as the sample rate of the output device likely does not match
     // the source audio.
     int samplesToWrite =
-        av_rescale_rnd(swr_get_delay(m_resampler, m_avcodec->sample_rate) + frame->nb_samples,
-                        m_pcmSampleRate, m_avcodec->sample_rate, AV_ROUND_UP);
+        av_rescale_rnd(swr_get_delay(m_resampler, m_current.codec->sample_rate) + frame->nb_samples,
+                        m_pcmSampleRate, m_current.codec->sample_rate, AV_ROUND_UP);
 
     int bufferIndex = DecoderGetNextSampleBufferOrWait(samplesToWrite);
     if(bufferIndex < 0) {
@@ -363,13 +527,15 @@ void AudioContext::DecoderDecodeFrame(AVFrame* frame) {
     // and pcmChannels is the number of channels for the audio output
     uint8_t* outputData = buffer->data + (buffer->samples * outputSampleSize) * m_pcmChannels;
 
-    // Resample the audio to match the output device
+    // Resample the audio to match the output device,
+    // this is the only copy made of the samples before they reach the ring
     int samplesWritten = swr_convert(m_resampler, &outputData, (int)(samplesPerBuffer - buffer->samples),
                                         (const uint8_t**)frame->extended_data, frame->nb_samples);
     buffer->samples += samplesWritten;
 
-    // Set the timestamp for the buffer
-    buffer->timestamp = frame->best_effort_timestamp / m_currentStream->time_base.den;
+    // Set the timestamp and track for the buffer
+    buffer->timestamp = frame->best_effort_timestamp * av_q2d(m_current.stream->time_base);
+    buffer->track = m_current.track;
 }
 
 int AudioContext::DecoderGetNextSampleBufferOrWait(int samplesToWrite) {
@@ -378,23 +544,9 @@ int AudioContext::DecoderGetNextSampleBufferOrWait(int samplesToWrite) {
     // we wrap around to the beginning.
     int nextValidBuffer = (lastSampleBuffer + 1) % AUDIOCONTEXT_NUM_SAMPLE_BUFFERS;
 
-    // Checks whether or not to keep waiting for a buffer.
-    // Checks for three cases.
-    //
-    // 1. Checks if the next valid buffer (buffer after lastSampleBuffer) is
-    // not ahead of PlayAudio, meaning the buffers are not full.
-    // 2. numValidBuffers is 0 meaning that there is no audio data at all in the buffers
-    // 3. The current packet is invalid
-    auto hasBuffer = [&]() -> bool {
-        return nextValidBuffer != currentSampleBuffer || numValidBuffers == 0 || IsDecoderPacketInvalid();
-    };
-
     // Prevent the player thread from taking another buffer until the new audio data
     // is added
     std::unique_lock lock{sampleBuffersLock};
-    // Lock the sample buffers, check if hasBuffer() is true, if it is false release the lock
-    // and wait.
-    decoderWaitCondition.wait(lock, hasBuffer);
 
     // If a seek has been requested or m_decoderIsRunning has been set to false
     // the current packet is no longer valid
@@ -409,15 +561,22 @@ int AudioContext::DecoderGetNextSampleBufferOrWait(int samplesToWrite) {
     if (samplesToWrite + buffer->samples > samplesPerBuffer) {
         lastSampleBuffer = nextValidBuffer;
         numValidBuffers++;
+        playerWaitCondition.notify_all();
+
+        // m_bufferTarget is below AUDIOCONTEXT_NUM_SAMPLE_BUFFERS
+        // so the buffer after lastSampleBuffer is always free.
+        // Once enough audio has been decoded ahead, sleep until half of it has been played
+        // rather than waking up for every buffer.
+        if (numValidBuffers >= m_bufferTarget) {
+            decoderWaitCondition.wait(lock,
+                                      [this]() -> bool { return DecoderShouldRefill() || IsDecoderPacketInvalid(); });
+        }
 
-        nextValidBuffer = (lastSampleBuffer + 1) % AUDIOCONTEXT_NUM_SAMPLE_BUFFERS;
-        // hasBuffer checks if nextValidBuffer is a free sample buffer to take.
-        // Otherwise, release the lock until hasBuffer returns true
-        // so the player thread can process the existing audio in the buffers
-        decoderWaitCondition.wait(lock, hasBuffer);
         if (IsDecoderPacketInvalid()) {
             return -1;
         }
+
+        nextValidBuffer = (lastSampleBuffer + 1) % AUDIOCONTEXT_NUM_SAMPLE_BUFFERS;
     }
 
     // We have found a buffer, let the player thread continue
@@ -427,6 +586,23 @@ int AudioContext::DecoderGetNextSampleBufferOrWait(int samplesToWrite) {
 void AudioContext::DecoderDoSeek() {
     assert(m_requestSeek);
 
+    // The decoder may have already moved on to the queued track
+    // whilst the end of the one being seeked in is still playing,
+    // in which case reopen it and keep the queued track for afterwards
+    if (TrackInfo* playing = m_playingTrack; playing && playing != m_current.track) {
+        TrackDecoder decoder;
+        if (OpenTrackDecoder(playing, decoder) == 0) {
+            CloseTrackDecoder(m_next);
+            m_next = m_current;
+            m_current = decoder;
+
+            if (DecoderConfigureResampler()) {
+                Lemon::Logger::Error("Could not initialize software resampler");
+                m_isDecoderRunning = false;
+            }
+        }
+    }
+
     // Since all buffers need to be reset to prevent playing old audio,
     // lock the sample buffers so the player thread does not interfere
     std::scoped_lock lock{sampleBuffersLock};
@@ -436,19 +612,134 @@ void AudioContext::DecoderDoSeek() {
     FlushSampleBuffers();
 
     // Flush the decoder and resampler buffers
-    avcodec_flush_buffers(m_avcodec);
-    swr_convert(m_resampler, NULL, 0, NULL, 0);
+    avcodec_flush_buffers(m_current.codec);
+    if (m_resampler) {
+        swr_convert(m_resampler, NULL, 0, NULL, 0);
+    }
 
     // Seek to the new timestamp
     float timestamp = m_seekTimestamp;
-    av_seek_frame(m_avfmt, m_currentStreamIndex,
-                    (long)(timestamp / av_q2d(m_currentStream->time_base)), 0);
+    av_seek_frame(m_current.format, m_current.streamIndex,
+                    (long)(timestamp / av_q2d(m_current.stream->time_base)), 0);
 
     m_lastTimestamp = m_seekTimestamp;
     // Set m_requestSeek to false indicating that seeking has finished
     m_requestSeek = false;
 }
 
+int AudioContext::DecoderConfigureResampler() {
+    AVCodecContext* codec = m_current.codec;
+
+    // Samples are only converted once, straight into the sample buffers.
+    // Keep the resampler along with the samples it is holding on to between tracks
+    // of the same format, so the join between them is seamless.
+    if (m_resampler && codec->channels == m_resamplerChannels && codec->sample_rate == m_resamplerSampleRate &&
+        codec->sample_fmt == m_resamplerFormat) {
+        return 0;
+    }
+
+    swr_free(&m_resampler);
+    m_resampler = swr_alloc();
+
+    // Check how many channels are in the audio file
+    if (codec->channels == 1) {
+        av_opt_set_int(m_resampler, "in_channel_layout", AV_CH_LAYOUT_MONO, 0);
+    } else {
+        if (codec->channels != 2) {
+            Lemon::Logger::Warning("Unsupported number of audio channels {}, taking first 2 and playing as stereo.",
+                                   codec->channels);
+        }
+
+        av_opt_set_int(m_resampler, "in_channel_layout", AV_CH_LAYOUT_STEREO, 0);
+    }
+    av_opt_set_int(m_resampler, "in_sample_rate", codec->sample_rate, 0);
+    av_opt_set_sample_fmt(m_resampler, "in_sample_fmt", codec->sample_fmt, 0);
+
+    // Check the channel count of the audio device,
+    // probably stereo (2 channel)
+    if (m_pcmChannels == 1) {
+        av_opt_set_int(m_resampler, "out_channel_layout", AV_CH_LAYOUT_MONO, 0);
+    } else {
+        av_opt_set_int(m_resampler, "out_channel_layout", AV_CH_LAYOUT_STEREO, 0);
+    }
+
+    // Get the sample rate of the audio device
+    // (amount of audio samples processed in one second)
+    // For the AC97 audio hardware this will be 48000 Hz
+    av_opt_set_int(m_resampler, "out_sample_rate", m_pcmSampleRate, 0);
+
+    // Output is signed 16-bit PCM packed
+    av_opt_set_sample_fmt(m_resampler, "out_sample_fmt", AV_SAMPLE_FMT_S16, 0);
+    assert(m_pcmBitDepth == 16);
+
+    if (int err = swr_init(m_resampler); err) {
+        swr_free(&m_resampler);
+        m_resampler = nullptr;
+        return err;
+    }
+
+    m_resamplerChannels = codec->channels;
+    m_resamplerSampleRate = codec->sample_rate;
+    m_resamplerFormat = codec->sample_fmt;
+    return 0;
+}
+
+void AudioContext::DecoderPrefetchNextTrack() {
+    TrackInfo* queued;
+    {
+        std::scoped_lock lock{m_queuedTrackLock};
+        if (m_prefetchedSerial == m_queuedSerial) {
+            return;
+        }
+
+        m_prefetchedSerial = m_queuedSerial;
+        queued = m_queuedTrack;
+    }
+
+    CloseTrackDecoder(m_next);
+    if (queued && OpenTrackDecoder(queued, m_next)) {
+        Lemon::Logger::Warning("Could not open the next track {}", queued->filepath);
+    }
+}
+
+bool AudioContext::DecoderAdvanceTrack() {
+    // The track may have been queued since the last packet
+    DecoderPrefetchNextTrack();
+    if (!m_next.codec) {
+        return false;
+    }
+
+    CloseTrackDecoder(m_current);
+    m_current = m_next;
+    m_next = {};
+
+    // The sample buffers are left as they are,
+    // the player gets to the new track once it has played the last of the old one
+    if (DecoderConfigureResampler()) {
+        Lemon::Logger::Error("Could not initialize software resampler");
+        return false;
+    }
+
+    return true;
+}
+
+void AudioContext::DecoderDrainBuffers() {
+    std::unique_lock lock{sampleBuffersLock};
+
+    // Buffers are only queued once they are full,
+    // so queue whatever is left of the track
+    int nextValidBuffer = (lastSampleBuffer + 1) % AUDIOCONTEXT_NUM_SAMPLE_BUFFERS;
+    if (sampleBuffers[nextValidBuffer].samples > 0 && !IsDecoderPacketInvalid()) {
+        lastSampleBuffer = nextValidBuffer;
+        numValidBuffers++;
+        playerWaitCondition.notify_all();
+    }
+
+    m_decoderDraining = true;
+    decoderWaitCondition.wait(lock, [this]() -> bool { return !numValidBuffers || IsDecoderPacketInvalid(); });
+    m_decoderDraining = false;
+}
+
 float AudioContext::PlaybackProgress() const {
     if (!m_isDecoderRunning) {
         return 0;
@@ -477,11 +768,16 @@ void AudioContext::PlaybackStop() {
         m_shouldPlayAudio = false;
         // Make the decoder stop waiting for a free sample buffer
         decoderWaitCondition.notify_all();
+
+        // and the player stop waiting for samples
+        std::scoped_lock lock{sampleBuffersLock};
+        playerWaitCondition.notify_all();
     }
 
     // Only set m_currentTrack in the main thread
     // to avoid race conditions and worrying about synchronization
     m_currentTrack = nullptr;
+    m_trackChanged = false;
 }
 
 void AudioContext::PlaybackSeek(float timestamp) {
@@ -496,6 +792,15 @@ void AudioContext::PlaybackSeek(float timestamp) {
     }
 }
 
+bool AudioContext::PollTrackChange() {
+    if (!m_trackChanged.exchange(false)) {
+        return false;
+    }
+
+    m_currentTrack = m_playingTrack;
+    return true;
+}
+
 int AudioContext::PlayTrack(TrackInfo* info) {
     // Stop any audio currently playing
     if (m_isDecoderRunning) {
@@ -505,61 +810,22 @@ int AudioContext::PlayTrack(TrackInfo* info) {
     // Block the decoder from running until we are done here
     std::lock_guard lockDecoder(m_decoderLock);
 
-    assert(!m_avfmt);
-    m_avfmt = avformat_alloc_context();
+    // Anything queued was to follow the last track
+    QueueNextTrack(nullptr);
 
-    // Opens the audio file
-    if (int err = avformat_open_input(&m_avfmt, info->filepath.c_str(), NULL, NULL); err) {
-        Lemon::Logger::Error("Failed to open {}", info->filepath);
-        return err;
-    }
-
-    // Gets metadata and information about the audio contained in the file
-    if (int err = avformat_find_stream_info(m_avfmt, NULL); err) {
-        Lemon::Logger::Error("Failed to get stream info for {}", info->filepath);
+    if (int err = OpenTrackDecoder(info, m_current); err) {
         return err;
     }
 
     // Update track metadata in case the file has changed
-    GetTrackInfo(m_avfmt, info);
-
-    // Data is organised into 'streams'
-    // Search for the 'best' audio stream
-    // Any album art may be placed in a video stream
-    int streamIndex = av_find_best_stream(m_avfmt, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
-    if (streamIndex < 0) {
-        Lemon::Logger::Error("Failed to get audio stream for {}", info->filepath);
-        return streamIndex;
-    }
-
-    m_currentStream = m_avfmt->streams[streamIndex];
-    m_currentStreamIndex = streamIndex;
-
-    // Find a decoder for the audio data we have been given
-    const AVCodec* decoder = avcodec_find_decoder(m_currentStream->codecpar->codec_id);
-    if (!decoder) {
-        Lemon::Logger::Error("Failed to find codec for '{}'", info->filepath);
-        return 1;
-    }
-
-    m_avcodec = avcodec_alloc_context3(decoder);
-    assert(decoder);
-
-    if (avcodec_parameters_to_context(m_avcodec, m_currentStream->codecpar)) {
-        Lemon::Logger::Error("Failed to initialie codec context.");
-        return 1;
-    }
-
-    if (avcodec_open2(m_avcodec, decoder, NULL) < 0) {
-        Lemon::Logger::Error("Failed to open codec!");
-        return 1;
-    }
+    GetTrackInfo(m_current.format, info);
 
     // Set the current track so it can be accessed by PlayerWidget
     m_currentTrack = info;
 
     m_requestSeek = false;
     m_shouldPlayNextTrack = false;
+    m_trackChanged = false;
 
     // Notify the decoder thread and mark the decoder as running
     std::scoped_lock lockDecoderStatus{m_decoderStatusLock};
@@ -568,6 +834,12 @@ int AudioContext::PlayTrack(TrackInfo* info) {
     return 0;
 }
 
+void AudioContext::QueueNextTrack(TrackInfo* info) {
+    std::scoped_lock lock{m_queuedTrackLock};
+    m_queuedTrack = info;
+    m_queuedSerial++;
+}
+
 int AudioContext::LoadTrack(std::string filepath, TrackInfo* info) {
     AVFormatContext* fmt = avformat_alloc_context();
     if (int r = avformat_open_input(&fmt, filepath.c_str(), NULL, NULL); r) {
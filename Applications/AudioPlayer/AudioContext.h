@@ -1,12 +1,19 @@
 #pragma once
 
+#include <atomic>
 #include <condition_variable>
 #include <mutex>
 #include <thread>
 
 #include "AudioTrack.h"
 
-#define AUDIOCONTEXT_NUM_SAMPLE_BUFFERS 16
+#include <Lemon/System/ABI/Audio.h>
+
+#define AUDIOCONTEXT_NUM_SAMPLE_BUFFERS 32
+// Amount of buffers the decoder fills before sleeping, raised whenever playback runs dry
+// and never more than AUDIOCONTEXT_NUM_SAMPLE_BUFFERS - 1 so the ring cannot fill up
+#define AUDIOCONTEXT_MIN_BUFFERED 8
+#define AUDIOCONTEXT_MAX_BUFFERED (AUDIOCONTEXT_NUM_SAMPLE_BUFFERS - 1)
 
 class AudioContext {
     friend void PlayAudio(AudioContext*);
@@ -18,6 +25,8 @@ public:
 
         // Timestamp in seconds of last frame in buffer
         float timestamp;
+        // Track the last frame in the buffer came from
+        TrackInfo* track;
     };
 
     AudioContext();
@@ -26,6 +35,9 @@ public:
     inline bool HasLoadedAudio() const { return m_isDecoderRunning; }
     inline bool IsAudioPlaying() const { return m_shouldPlayAudio; }
     inline bool ShouldPlayNextTrack() const { return m_shouldPlayNextTrack; }
+    // Returns true once playback has moved on to the queued track by itself,
+    // CurrentTrack() then returns the queued track
+    bool PollTrackChange();
 
     // Gets progress into song in seconds
     float PlaybackProgress() const;
@@ -43,7 +55,10 @@ public:
     // Play the track given in info
     // returns 0 on success
     int PlayTrack(TrackInfo* info);
-    
+    // Track to play once the current one finishes, nullptr for none.
+    // It is opened and decoded ahead of time so there is no gap between the tracks.
+    void QueueNextTrack(TrackInfo* info);
+
     // Get TrackInfo struct for the given file
     // returns 0 on success
     int LoadTrack(std::string filepath, TrackInfo* info);
@@ -62,25 +77,60 @@ public:
     std::condition_variable decoderShouldRunCondition;
     // Player thread will block whilst it is not playing audio samples
     std::condition_variable playerShouldRunCondition;
+    // Player waits for the decoder to fill a buffer
+    std::condition_variable playerWaitCondition;
     int numValidBuffers;
 
 private:
+    // Everything needed to decode one file
+    struct TrackDecoder {
+        TrackInfo* track = nullptr;
+
+        struct AVFormatContext* format = nullptr;
+        struct AVCodecContext* codec = nullptr;
+
+        struct AVStream* stream = nullptr;
+        int streamIndex = 0;
+    };
+
+    // Open the file of info for decoding
+    // returns 0 on success
+    int OpenTrackDecoder(TrackInfo* info, TrackDecoder& decoder);
+    void CloseTrackDecoder(TrackDecoder& decoder);
+
     // Audio decoder loop
     void DecodeAudio();
     // Decodes a frame of audio and fills the next available buffer
     void DecoderDecodeFrame(struct AVFrame* frame);
+    // Receive and resample all the frames available from the codec
+    void DecoderReceiveFrames(struct AVFrame* frame);
     // Perform the requested seek to m_seekTimestamp
     void DecoderDoSeek();
+    // (Re)create the resampler for the format of the current track
+    // returns 0 on success
+    int DecoderConfigureResampler();
+    // Open the queued track if it has changed since it was last opened
+    void DecoderPrefetchNextTrack();
+    // Carry on into the queued track at the end of the current one,
+    // returns false if there is nothing to carry on into
+    bool DecoderAdvanceTrack();
+    // Queue the partially filled buffer and wait for the player to run out of samples
+    void DecoderDrainBuffers();
 
     // Audio playeer loop.
     // Reads buffers from sampleBuffers and sends them to the audio device
     void PlayAudio();
+    // Copies samples into the ring as space frees up, waiting on the mixer
+    void WriteToRing(const uint8_t* data, size_t size);
     
     // Get the next buffer that can hold samplesToWrite number of samples
     // if the buffer after the write pointer is too full,
     // increments the write pointer and returns the buffer after.
     int DecoderGetNextSampleBufferOrWait(int samplesToWrite);
 
+    // Whether the decoder needs to be woken to fill buffers
+    inline bool DecoderShouldRefill() const { return numValidBuffers <= m_bufferTarget / 2; }
+
     // A packet is considered invalid if we need to seek
     // or the decoder is not marked as running
     inline bool IsDecoderPacketInvalid() {
@@ -93,7 +143,11 @@ private:
         for (int i = 0; i < AUDIOCONTEXT_NUM_SAMPLE_BUFFERS; i++) {
             sampleBuffers[i].samples = 0;
             sampleBuffers[i].timestamp = 0;
+            sampleBuffers[i].track = nullptr;
         }
+
+        // Running dry after a flush is not an underrun
+        m_playerPrimed = false;
     }
 
     // File descriptor for pcm output
@@ -102,7 +156,22 @@ private:
     int m_pcmChannels;
     int m_pcmBitDepth;
 
+    // Ring of our mixer stream, nullptr if it could not be mapped and samples are written with write()
+    uint8_t* m_ring = nullptr;
+    AudioRingInfo m_ringInfo;
+    size_t m_ringWritePos = 0; // Offset in the ring where the next samples go
+
     TrackInfo* m_currentTrack;
+    // Track of the buffer being played, set by the player thread
+    std::atomic<TrackInfo*> m_playingTrack = nullptr;
+    std::atomic<bool> m_trackChanged = false;
+
+    // Track given to QueueNextTrack, m_queuedSerial is incremented every time it is set
+    // so the decoder knows when to open it
+    std::mutex m_queuedTrackLock;
+    TrackInfo* m_queuedTrack = nullptr;
+    unsigned m_queuedSerial = 0;
+    unsigned m_prefetchedSerial = 0;
 
     // Thread which writes PCM samples to the audio driver,
     // reduces audio lag and prevents blocking the main thread
@@ -130,10 +199,22 @@ private:
     // Last timestamp played by the playback thread
     float m_lastTimestamp;
 
-    struct AVFormatContext* m_avfmt = nullptr;
-    struct AVCodecContext* m_avcodec = nullptr;
-    struct SwrContext* m_resampler = nullptr;
+    // Buffers filled by the decoder before it sleeps,
+    // it is woken again once half of them have been played
+    int m_bufferTarget = AUDIOCONTEXT_MIN_BUFFERED;
+    // Set once a buffer has been played since the buffers were flushed
+    bool m_playerPrimed = false;
+    // Set whilst the decoder waits for the last buffers of the last track to be played
+    bool m_decoderDraining = false;
 
-    struct AVStream* m_currentStream = nullptr;
-    int m_currentStreamIndex = 0;
+    // Track being decoded and the track after it
+    TrackDecoder m_current;
+    TrackDecoder m_next;
+
+    // Reused between tracks whilst the input format stays the same
+    struct SwrContext* m_resampler = nullptr;
+    // Input format m_resampler was set up for
+    int m_resamplerChannels = 0;
+    int m_resamplerSampleRate = 0;
+    int m_resamplerFormat = -1;
 };
@@ -16,6 +16,7 @@
 #include "AudioContext.h"
 #include "AudioTrack.h"
 
+#include <algorithm>
 #include <unordered_map>
 
 using namespace Lemon;
@@ -59,7 +60,10 @@ public:
         srand(time(NULL));
     }
 
-    void ToggleShuffle() { m_trackQueueShuffle = !m_trackQueueShuffle; }
+    void ToggleShuffle() {
+        m_trackQueueShuffle = !m_trackQueueShuffle;
+        QueueNextTrack();
+    }
 
     bool ShuffleIsOn() const { return m_trackQueueShuffle; }
 
@@ -77,6 +81,9 @@ public:
         m_trackList.push_back(&m_tracks.at(filepath));
 
         m_listView->UpdateData();
+
+        // The new track may be the one to play next
+        QueueNextTrack();
         return 0;
     }
 
@@ -134,7 +141,12 @@ public:
         }
 
         m_trackIndex = index;
-        return m_ctx->PlayTrack(m_trackList.at(index));
+        if (int r = m_ctx->PlayTrack(m_trackList.at(index)); r) {
+            return r;
+        }
+
+        QueueNextTrack();
+        return 0;
     }
 
     int RemoveTrack(int index) {
@@ -150,6 +162,7 @@ public:
         m_listView->UpdateData();
         
         ResetQueue();
+        QueueNextTrack();
 
         return 0;
     }
@@ -193,45 +206,33 @@ public:
 
         if (m_trackList.size() > 0) {
             if (m_trackQueueShuffle) {
-                // If there are too many tracks in the queue
-                // remove the entry at the front
-                if (m_trackQueuePrevious.size() >= m_trackQueueMax) {
-                    m_trackQueuePrevious.pop_front();
-                }
-
-                // If m_trackIndex is valid, add it to the previous queue
-                // When the 'Prev' button is pressed and PrevTrack() is called,
-                // the previous track can be popped from the queue
-                if (m_trackIndex > 0) {
-                    m_trackQueuePrevious.push_back(m_trackIndex);
-                }
-
-                int newTrack = m_trackIndex;
-                // Check if there is more than 1 track
-                if (m_trackList.size() > 1) {
-                    // Keep generating a new track index
-                    // until we get a different track
-                    while (newTrack == m_trackIndex)
-                        newTrack = rand() % m_trackList.size();
-                } else {
-                    newTrack = 0;
-                }
+                PushPreviousTrack();
+            }
 
-                PlayTrack(newTrack);
+            if (m_nextTrackIndex < 0) {
+                // If we are at the end of the track list, just stop playback for now.
+                // If NextTrack is called again, trackIndex will become 0 and the first song will be played.
+                m_trackIndex = -1;
+                QueueNextTrack();
             } else {
-                // Go to the next track in queue sequentially
-                m_trackIndex++;
-                if (m_trackIndex >= (int)m_trackList.size()) {
-                    // If we are at the end of the track list, just stop playback for now.
-                    // If NextTrack is called again, trackIndex will become 0 and the first song will be played.
-                    m_trackIndex = -1;
-                } else {
-                    PlayTrack(m_trackIndex);
-                }
+                PlayTrack(m_nextTrackIndex);
             }
         }
     }
 
+    // Called when the AudioContext has carried on into the queued track by itself
+    void OnTrackChanged() {
+        if (m_trackQueueShuffle) {
+            PushPreviousTrack();
+        }
+
+        // The track list may have changed since the track was queued
+        auto it = std::find(m_trackList.begin(), m_trackList.end(), m_ctx->CurrentTrack());
+        m_trackIndex = (it == m_trackList.end()) ? -1 : (int)(it - m_trackList.begin());
+
+        QueueNextTrack();
+    }
+
     void PrevTrack() {
         m_ctx->PlaybackStop();
 
@@ -257,6 +258,45 @@ public:
 private:
     void ResetQueue() { m_trackQueuePrevious.clear(); }
 
+    void PushPreviousTrack() {
+        // If there are too many tracks in the queue
+        // remove the entry at the front
+        if (m_trackQueuePrevious.size() >= m_trackQueueMax) {
+            m_trackQueuePrevious.pop_front();
+        }
+
+        // If m_trackIndex is valid, add it to the previous queue
+        // When the 'Prev' button is pressed and PrevTrack() is called,
+        // the previous track can be popped from the queue
+        if (m_trackIndex > 0) {
+            m_trackQueuePrevious.push_back(m_trackIndex);
+        }
+    }
+
+    // Pick the track to play after the current one and queue it in the AudioContext,
+    // which opens and decodes it ahead of time so it follows without a gap
+    void QueueNextTrack() {
+        m_nextTrackIndex = -1;
+
+        if (m_trackQueueShuffle) {
+            // Check if there is more than 1 track
+            if (m_trackList.size() > 1) {
+                // Keep generating a new track index
+                // until we get a different track
+                do {
+                    m_nextTrackIndex = rand() % m_trackList.size();
+                } while (m_nextTrackIndex == m_trackIndex);
+            } else if (m_trackList.size()) {
+                m_nextTrackIndex = 0;
+            }
+        } else if (m_trackIndex + 1 < (int)m_trackList.size()) {
+            // Go to the next track in queue sequentially
+            m_nextTrackIndex = m_trackIndex + 1;
+        }
+
+        m_ctx->QueueNextTrack((m_nextTrackIndex >= 0) ? m_trackList.at(m_nextTrackIndex) : nullptr);
+    }
+
     static const int s_numFields = 3;
     static constexpr const char* s_fields[s_numFields]{"File", "Track", "Duration"};
     static constexpr int s_fieldSizes[s_numFields]{200, 200, 60};
@@ -275,6 +315,8 @@ private:
     const unsigned m_trackQueueMax = 50;
     // Index in m_trackList
     int m_trackIndex = -1;
+    // Index in m_trackList of the track queued to play next, -1 for none
+    int m_nextTrackIndex = -1;
     // Previously played tracks
     std::list<int> m_trackQueuePrevious;
 };
@@ -590,6 +632,10 @@ int main(int argc, char** argv) {
     }
 
     while (!window->closed) {
+        if (audio->PollTrackChange()) {
+            tracks->OnTrackChanged();
+        }
+
         if (audio->ShouldPlayNextTrack()) {
             tracks->NextTrack();
         }
@@ -10,6 +10,9 @@ struct Device{
 	std::string instanceName;
 	long type;
 	long id;
+
+	bool hasDiskStats;
+	DiskStatistics diskStats;
 };
 
 class DeviceModel : public Lemon::GUI::DataModel {
@@ -63,6 +66,17 @@ public:
 				case Lemon::DeviceTypeUSBHID:
 					return "USB HID";
 			}
+			return 0;
+		case 3: {
+			if(!dev.hasDiskStats){
+				return std::string("");
+			}
+
+			char io[64];
+			snprintf(io, 63, "%.1f MB read, %.1f MB written", dev.diskStats.bytesRead / 1024 / 1024.0, dev.diskStats.bytesWritten / 1024 / 1024.0);
+
+			return std::string(io);
+		}
 		default:
 			return 0;
 		}
@@ -74,6 +88,8 @@ public:
         case 1: // Instance name
 		case 2: // Type
             return 132;
+		case 3: // I/O
+            return 200;
         default:
             return 76;
         }
@@ -108,16 +124,19 @@ public:
 
 			instanceName = nameBuf;
 
-			devices.push_back({ .name = std::move(name), .instanceName = std::move(instanceName), .type = type, .id = rootDevices[i]});
+			DiskStatistics diskStats = {};
+			bool hasDiskStats = (type == Lemon::DeviceTypeStorageDevice) && !Lemon::DeviceGetDiskStatistics(rootDevices[i], diskStats);
+
+			devices.push_back({ .name = std::move(name), .instanceName = std::move(instanceName), .type = type, .id = rootDevices[i], .hasDiskStats = hasDiskStats, .diskStats = diskStats });
 		}
 	}
 private:
 	std::vector<Device> devices;
-    std::vector<Column> columns = { Column("Name"), Column("Instance"), Column("Type") };
+    std::vector<Column> columns = { Column("Name"), Column("Instance"), Column("Type"), Column("I/O") };
 };
 
 int main(int argc, char** argv){
-	window = new Lemon::GUI::Window("Device Manager", {400, 480}, 0, Lemon::GUI::WindowType::GUI);
+	window = new Lemon::GUI::Window("Device Manager", {600, 480}, 0, Lemon::GUI::WindowType::GUI);
 
 	Lemon::GUI::ListView* lv = new Lemon::GUI::ListView({0, 0, 0, 0});
 	lv->SetLayout(Lemon::GUI::Stretch, Lemon::GUI::Stretch);
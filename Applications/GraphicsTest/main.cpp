@@ -5,6 +5,14 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
+#include <getopt.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <vector>
+
+using Lemon::Graphics::GraphicsKernelSet;
 
 Surface imageSurf;
 
@@ -13,7 +21,247 @@ void OnPaint(surface_t* surface){
     surface->Blit(&imageSurf, {0, 0});
 }
 
-int main(){
+// Sizes and alignments each drawing function is timed over,
+// alignments are in pixels from the start of a row, which is 16 byte aligned
+static const Vector2i benchSizes[] = {{16, 16}, {64, 64}, {256, 256}, {1024, 768}};
+static const int benchAlignments[] = {0, 1, 3};
+
+static const struct {
+    GraphicsKernelSet set;
+    const char* name;
+} kernelSets[] = {
+    {Lemon::Graphics::KernelsScalar, "scalar"},
+    {Lemon::Graphics::KernelsSSE2, "sse2"},
+    {Lemon::Graphics::KernelsAVX2, "avx2"},
+};
+
+#define KERNEL_SET_COUNT (sizeof(kernelSets) / sizeof(*kernelSets))
+
+struct BenchResult {
+    const char* test;
+    Vector2i size;
+    int align;
+    uint64_t pixels;
+    uint64_t us[KERNEL_SET_COUNT]; // 0 when the set was not run
+};
+
+static uint64_t benchPixels = 64 * 1000000; // Drawn by each test
+static unsigned decodeIterations = 8;
+static const char* benchImage = "/system/lemon/resources/alphatest.png";
+static bool machineReadable = false;
+
+static uint64_t NowUs() {
+    timespec t;
+    clock_gettime(CLOCK_BOOTTIME, &t);
+    return t.tv_sec * 1000000ULL + t.tv_nsec / 1000;
+}
+
+static Surface CreateSurface(int width, int height, bool translucent) {
+    Surface surface = {.width = width, .height = height, .depth = 32, .buffer = new uint8_t[width * height * 4]};
+
+    // Mix of opaque, transparent and partly transparent pixels, as blended by windows and icons
+    uint32_t* pixels = reinterpret_cast<uint32_t*>(surface.buffer);
+    for (int i = 0; i < width * height; i++) {
+        uint32_t alpha = translucent ? ((i % 3 == 0) ? 0xff : ((i % 3 == 1) ? 0 : (i * 7) & 0xff)) : 0xff;
+        pixels[i] = (alpha << 24) | ((i * 2654435761u) & 0xffffff);
+    }
+
+    return surface;
+}
+
+// Run draw enough times to cover benchPixels, at least once, returning the time taken
+template <typename F> static uint64_t Time(uint64_t pixelsPerDraw, uint64_t& pixels, F draw) {
+    uint64_t iterations = std::max<uint64_t>(1, benchPixels / std::max<uint64_t>(1, pixelsPerDraw));
+
+    uint64_t start = NowUs();
+    for (uint64_t i = 0; i < iterations; i++) {
+        draw();
+    }
+
+    pixels = pixelsPerDraw * iterations;
+    return std::max<uint64_t>(1, NowUs() - start);
+}
+
+static int RunBenchmarks(const std::vector<size_t>& sets) {
+    std::vector<BenchResult> results;
+
+    Vector2i maxSize = benchSizes[sizeof(benchSizes) / sizeof(*benchSizes) - 1];
+    Surface dest = CreateSurface(maxSize.x + 16, maxSize.y, false);
+    Surface opaque = CreateSurface(maxSize.x, maxSize.y, false);
+    Surface translucent = CreateSurface(maxSize.x, maxSize.y, true);
+
+    const char* text = "The quick brown fox jumps over the lazy dog";
+    Vector2i textSize = {Lemon::Graphics::GetTextLength(text), Lemon::Graphics::DefaultFont()->lineHeight};
+
+    for (const Vector2i& size : benchSizes) {
+        for (int align : benchAlignments) {
+            BenchResult blit = {"blit", size, align, 0, {}};
+            BenchResult alphaBlit = {"alphablit", size, align, 0, {}};
+            BenchResult rect = {"rect", size, align, 0, {}};
+            BenchResult gradient = {"gradient", size, align, 0, {}};
+            uint64_t area = static_cast<uint64_t>(size.x) * size.y;
+
+            for (size_t set : sets) {
+                Lemon::Graphics::UseGraphicsKernels(kernelSets[set].set);
+
+                blit.us[set] = Time(area, blit.pixels, [&] { dest.Blit(&opaque, {align, 0}, {{0, 0}, size}); });
+                alphaBlit.us[set] = Time(area, alphaBlit.pixels,
+                                         [&] { dest.AlphaBlit(&translucent, {align, 0}, {{0, 0}, size}); });
+                rect.us[set] = Time(area, rect.pixels, [&] {
+                    Lemon::Graphics::DrawRect(align, 0, size.x, size.y, {0x20, 0x40, 0x80, 0xff}, &dest);
+                });
+                gradient.us[set] = Time(area, gradient.pixels, [&] {
+                    Lemon::Graphics::DrawGradient(align, 0, size.x, size.y, {0x20, 0x40, 0x80, 0xff},
+                                                  {0x80, 0x40, 0x20, 0xff}, &dest);
+                });
+            }
+
+            results.push_back(blit);
+            results.push_back(alphaBlit);
+            results.push_back(rect);
+            results.push_back(gradient);
+        }
+    }
+
+    for (int align : benchAlignments) {
+        BenchResult string = {"string", textSize, align, 0, {}};
+        for (size_t set : sets) {
+            Lemon::Graphics::UseGraphicsKernels(kernelSets[set].set);
+            string.us[set] = Time(static_cast<uint64_t>(textSize.x) * textSize.y, string.pixels, [&] {
+                Lemon::Graphics::DrawString(text, align, 0, 0xff, 0xff, 0xff, &dest);
+            });
+        }
+        results.push_back(string);
+    }
+
+    // Decoding is timed separately as it is much slower per pixel
+    for (const Vector2i& size : benchSizes) {
+        BenchResult decode = {"decode", size, 0, 0, {}};
+        for (size_t set : sets) {
+            Lemon::Graphics::UseGraphicsKernels(kernelSets[set].set);
+
+            uint64_t start = NowUs();
+            for (unsigned i = 0; i < decodeIterations; i++) {
+                if (Lemon::Graphics::LoadImage(benchImage, 0, 0, size.x, size.y, &dest, false)) {
+                    fprintf(stderr, "GraphicsTest: Failed to load '%s'\n", benchImage);
+                    return 1;
+                }
+            }
+
+            decode.us[set] = std::max<uint64_t>(1, NowUs() - start);
+            decode.pixels = static_cast<uint64_t>(size.x) * size.y * decodeIterations;
+        }
+        results.push_back(decode);
+    }
+
+    Lemon::Graphics::UseGraphicsKernels(Lemon::Graphics::KernelsAuto);
+
+    if (machineReadable) {
+        for (const BenchResult& r : results) {
+            for (size_t set : sets) {
+                printf("%s,%dx%d,%d,%s,%lu,%lu\n", r.test, r.size.x, r.size.y, r.align, kernelSets[set].name,
+                       r.pixels, r.us[set]);
+            }
+        }
+    } else {
+        printf("%-10s %-10s %5s", "test", "size", "align");
+        for (size_t set : sets) {
+            printf(" %9s", kernelSets[set].name);
+        }
+        printf("  (Mpx/s)\n");
+
+        for (const BenchResult& r : results) {
+            char size[24];
+            snprintf(size, sizeof(size), "%dx%d", r.size.x, r.size.y);
+
+            printf("%-10s %-10s %5d", r.test, size, r.align);
+            for (size_t set : sets) {
+                printf(" %9.1f", static_cast<double>(r.pixels) / r.us[set]);
+            }
+            printf("\n");
+        }
+    }
+
+    delete[] dest.buffer;
+    delete[] opaque.buffer;
+    delete[] translucent.buffer;
+    return 0;
+}
+
+int main(int argc, char** argv){
+    bool benchmark = false;
+    std::vector<size_t> sets;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "bk:p:n:i:m")) >= 0) {
+        switch (opt) {
+        case 'b':
+            benchmark = true;
+            break;
+        case 'k': {
+            size_t set = 0;
+            while (set < KERNEL_SET_COUNT && strcmp(kernelSets[set].name, optarg)) {
+                set++;
+            }
+
+            if (set == KERNEL_SET_COUNT) {
+                fprintf(stderr, "GraphicsTest: Unknown kernels '%s'\n", optarg);
+                return 2;
+            }
+            sets.push_back(set);
+            break;
+        }
+        case 'p':
+            benchPixels = strtoull(optarg, NULL, 10) * 1000000;
+            break;
+        case 'n':
+            decodeIterations = strtoul(optarg, NULL, 10);
+            break;
+        case 'i':
+            benchImage = optarg;
+            break;
+        case 'm':
+            machineReadable = true;
+            break;
+        case '?':
+            printf("Usage: %s [-b [-k kernels]... [-p megapixels] [-n decodes] [-i image] [-m]]\n"
+                   "  -b  Benchmark the graphics functions instead of showing the test window\n"
+                   "  -k  Kernels to compare, scalar, sse2 or avx2 (default all the CPU supports)\n"
+                   "  -p  Megapixels drawn by each test (default 64)\n"
+                   "  -n  Times the image is decoded at each size (default 8)\n"
+                   "  -i  Image to decode (default %s)\n"
+                   "  -m  Machine readable output, one line of test,size,align,kernels,pixels,us for each result\n",
+                   argv[0], benchImage);
+            return 2;
+        }
+    }
+
+    if (benchmark) {
+        if (sets.empty()) {
+            for (size_t set = 0; set < KERNEL_SET_COUNT; set++) {
+                sets.push_back(set);
+            }
+        }
+
+        // Drop kernels the CPU or OS cannot run
+        std::vector<size_t> supported;
+        for (size_t set : sets) {
+            if (Lemon::Graphics::UseGraphicsKernels(kernelSets[set].set)) {
+                supported.push_back(set);
+            } else if (!machineReadable) {
+                printf("Skipping %s kernels, not supported\n", kernelSets[set].name);
+            }
+        }
+        Lemon::Graphics::UseGraphicsKernels(Lemon::Graphics::KernelsAuto);
+
+        if (!benchPixels || !decodeIterations || supported.empty()) {
+            fprintf(stderr, "GraphicsTest: Nothing to benchmark\n");
+            return 2;
+        }
+
+        return RunBenchmarks(supported);
+    }
+
     Lemon::Graphics::LoadImage("/system/lemon/resources/alphatest.png", &imageSurf);
 
     Lemon::GUI::Window* win = new Lemon::GUI::Window("Test Window", {imageSurf.width, imageSurf.height}, WINDOW_FLAGS_TRANSPARENT, Lemon::GUI::WindowType::Basic);
@@ -40,4 +288,4 @@ int main(){
 
     delete win;
     return 0;
-}
\ No newline at end of file
+}
@@ -1,174 +1,497 @@
-#include <stdio.h> 
-#include <pthread.h>
-#include <sys/socket.h>
-#include <sys/un.h>
+#include <Lemon/Core/Benchmark.h>
+#include <Lemon/IPC/Endpoint.h>
+#include <Lemon/IPC/Interface.h>
+#include <Lemon/System/IPC.h>
+#include <Lemon/System/KernelObject.h>
+#include <Lemon/System/Waitable.h>
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
-#include <sys/time.h>
-#include <stdlib.h>
+#include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
-#include <lemon/syscall.h>
+// IPC benchmarks, run with "ipctest.lef [name]". Each result is printed on one line as either
+//   bench <name> samples=<n> iterations=<n> best=<value> median=<value> avg=<value> unit=<unit>
+//   bench <name> samples=<n> p50=<value> p90=<value> p99=<value> max=<value> unit=ns
+// in the same format as "tests.lef bench" (see Lemon::Benchmark::Report) so runs can be compared
+// before and after a change.
+//
+// Everything using Lemon::Endpoint runs twice, names ending in -copy send messages through the kernel queue
+// and names ending in -ring send them through the shared rings (see Endpoint::EnableRing).
+
+#define BENCH_SAMPLES 7
+#define BENCH_SERVICE "lemon.ipcbench"
+#define BENCH_MESSAGE_SIZE 4096 // Largest payload, used as the message size of the interfaces
+
+#define BENCH_RATE_MESSAGES 20000   // Messages sent for each sample of the message rate
+#define BENCH_LATENCY_ROUNDS 10000  // Round trips timed for the latency percentiles
+#define BENCH_LATENCY_PAYLOAD 64
+#define BENCH_FAN_MESSAGES 20000    // Messages for each sample of fan in and fan out, split between the clients
+#define BENCH_FAN_PAYLOAD 64
+
+enum {
+    MessageData = 100, // Only counted
+    MessageEcho,       // Sent back as is
+    MessageCall,       // Answered with ResponseCall
+    ResponseCall,
+    MessageHello,      // Sent by fan in clients once connected
+    MessageBurst,      // Asks a fan in client to send a BurstRequest worth of MessageData
+    MessageQuit,
+};
+
+struct BurstRequest {
+    uint32_t count;
+    uint16_t size;
+};
+
+Lemon::Handle service;
+Lemon::Handle pairInterface; // Accepted by hand so the server side is an Endpoint as well
+Lemon::Interface* fanInInterface;
+
+const char* pairPath = BENCH_SERVICE "/pair";
+const char* fanInPath = BENCH_SERVICE "/fanin";
+
+using Lemon::Benchmark::NowNs;
+
+inline const char* PathName(bool ring) { return ring ? "ring" : "copy"; }
+
+// Print the line for a message rate, sorts samples
+inline void ReportRate(const char* name, unsigned iterations, double* samples) {
+    Lemon::Benchmark::Report(name, iterations, samples, BENCH_SAMPLES, "msg/s", true);
+}
+
+// Print the percentiles of round trip times in ns, sorts latencies
+void ReportPercentiles(const char* name, std::vector<uint64_t>& latencies) {
+    std::sort(latencies.begin(), latencies.end());
+
+    auto percentile = [&](unsigned p) -> double { return latencies[(latencies.size() - 1) * p / 100]; };
+    printf("bench %s samples=%zu p50=%.1f p90=%.1f p99=%.1f max=%.1f unit=ns\n", name, latencies.size(),
+           percentile(50), percentile(90), percentile(99), static_cast<double>(latencies.back()));
+}
 
-const int msgCount = 8000;
-long avgTime = 0;
+// Wait for the next message, returns its ID or a negative error code
+long Receive(Lemon::Endpoint& endp, Lemon::Message& m) {
+    long ret;
+    while (!(ret = endp.Poll(m))) {
+        endp.Wait();
+    }
 
-unsigned int operator-(const timespec& t1, const timespec& t2){
-    return (t1.tv_sec - t2.tv_sec) * 1000000000 + (t1.tv_nsec - t2.tv_nsec);
+    return ret < 0 ? ret : static_cast<long>(m.id());
 }
-timespec timer[msgCount];
-timespec newTimer[msgCount];
 
-sockaddr_un udsAddr;
-void* UDSThread(void* n){
-    int udsClient = socket(AF_UNIX, SOCK_STREAM, 0);
-    if(connect(udsClient, reinterpret_cast<sockaddr*>(&udsAddr), sizeof(sockaddr_un))){
-        perror("Error connecting to socket:");
-        exit(1);
+// Connect local to remote through pairInterface, mapping the rings of both when ring is set.
+// Connecting waits for the connection to be accepted so it is done from another thread.
+bool ConnectPair(Lemon::Endpoint& local, Lemon::Endpoint& remote, bool ring) {
+    std::thread connector([&]() { remote = Lemon::Endpoint(pairPath); });
+
+    handle_t h;
+    while (!(h = Lemon::InterfaceAccept(pairInterface.get()))) {
+        Lemon::WaitForKernelObject(pairInterface.get(), 1000);
+    }
+    connector.join();
+
+    if (h < 0) {
+        printf("Failed to accept connection: %s\n", strerror(-h));
+        return false;
     }
+    local = Lemon::Endpoint(Lemon::Handle(h));
 
-    char buf[64];
-    for(int i = 0; i < msgCount; i++){
-        recv(udsClient, buf, 64, 0);
-        
-        clock_gettime(CLOCK_BOOTTIME, &newTimer[i]);
+    if (ring) {
+        if (long ret = local.EnableRing(); ret || (ret = remote.EnableRing())) {
+            printf("Failed to map message rings: %s\n", strerror(-ret));
+            return false;
+        }
     }
+    return true;
+}
 
-    int low = newTimer[0] - timer[0];
-    int high = 0;
-    for(int i = 0; i < msgCount; i++){
-        int diff = (newTimer[i] - timer[i]);
-        if(diff / 1000 < low){
-            low = diff / 1000;
+// Answer messages on endp until told to quit or the peer goes away
+void EchoThread(Lemon::Endpoint* endp) {
+    for (;;) {
+        Lemon::Message m;
+        long id = Receive(*endp, m);
+        if (id < 0 || id == MessageQuit) {
+            return;
         }
 
-        if(diff / 1000 > high){
-            high = diff / 1000;
+        if (id == MessageEcho) {
+            endp->Queue(MessageEcho, m.data(), m.length());
+        } else if (id == MessageCall) {
+            endp->Queue(ResponseCall, m.data(), m.length());
         }
+    }
+}
+
+// A peer running EchoThread on the other end of an endpoint
+class EchoPeer {
+public:
+    Lemon::Endpoint endpoint;
+
+    bool Start(bool ring) {
+        if (!ConnectPair(endpoint, m_remote, ring)) {
+            return false;
+        }
+
+        m_thread = std::thread(EchoThread, &m_remote);
+        return true;
+    }
 
-        avgTime += diff;
+    ~EchoPeer() {
+        if (m_thread.joinable()) {
+            endpoint.Queue(MessageQuit, nullptr, 0);
+            m_thread.join();
+        }
     }
-    avgTime = avgTime / msgCount / 1000;
 
-    printf("Recieved messagees: avg time: %ldus, low: %dus, high %dus\n", avgTime, low, high);
+private:
+    Lemon::Endpoint m_remote;
+    std::thread m_thread;
+};
+
+// Returns once everything queued on endp before it has been handled by the peer
+long Sync(Lemon::Endpoint& endp) {
+    uint8_t payload = 0;
+    Lemon::Message response;
+    return endp.Call(Lemon::Message(MessageCall, payload), response, ResponseCall);
+}
+
+// Queue messages of size bytes as fast as possible, until the peer has handled all of them
+int MessageRate(uint16_t size, bool ring) {
+    char name[48];
+    snprintf(name, sizeof(name), "ipc-rate-%u-%s", size, PathName(ring));
+
+    EchoPeer peer;
+    if (!peer.Start(ring)) {
+        return 1;
+    }
+
+    uint8_t buffer[BENCH_MESSAGE_SIZE];
+    memset(buffer, 0xAB, size);
+
+    double samples[BENCH_SAMPLES];
+    for (int s = -1; s < BENCH_SAMPLES; s++) {
+        uint64_t start = NowNs();
+        for (unsigned i = 0; i < BENCH_RATE_MESSAGES; i++) {
+            if (long ret = peer.endpoint.Queue(MessageData, buffer, size); ret) {
+                printf("bench %s failed: %s\n", name, strerror(-ret));
+                return 1;
+            }
+        }
+
+        if (long ret = Sync(peer.endpoint); ret) {
+            printf("bench %s failed: %s\n", name, strerror(-ret));
+            return 1;
+        }
+        uint64_t end = NowNs();
+
+        if (s >= 0) {
+            samples[s] = BENCH_RATE_MESSAGES / ((end - start) / 1000000000.0);
+        }
+    }
+
+    ReportRate(name, BENCH_RATE_MESSAGES, samples);
+    return 0;
+}
+
+// Time each round trip of op after a warm up
+template <typename F> int MeasureRoundTrips(const char* name, F&& op) {
+    std::vector<uint64_t> latencies;
+    latencies.reserve(BENCH_LATENCY_ROUNDS);
+
+    for (int i = -BENCH_LATENCY_ROUNDS / 10; i < BENCH_LATENCY_ROUNDS; i++) {
+        uint64_t start = NowNs();
+        if (long ret = op(); ret) {
+            printf("bench %s failed: %s\n", name, strerror(-ret));
+            return 1;
+        }
+        uint64_t end = NowNs();
+
+        if (i >= 0) {
+            latencies.push_back(end - start);
+        }
+    }
+
+    ReportPercentiles(name, latencies);
+    return 0;
+}
+
+// Endpoint::Call, which always waits for the response in the kernel
+int CallLatency(bool ring) {
+    char name[48];
+    snprintf(name, sizeof(name), "ipc-call-%s", PathName(ring));
+
+    EchoPeer peer;
+    if (!peer.Start(ring)) {
+        return 1;
+    }
 
-    close(udsClient);
-    
-    return nullptr;
+    uint8_t buffer[BENCH_LATENCY_PAYLOAD] = {};
+    Lemon::Message call(MessageCall, buffer);
+    return MeasureRoundTrips(name, [&]() -> long {
+        Lemon::Message response;
+        return peer.endpoint.Call(call, response, ResponseCall);
+    });
 }
 
-void* LemonIPCThread(void* n){
-    long endpHandle = syscall(SYS_INTERFACE_CONNECT, "lemon.testservice/testif", 0, 0, 0, 0);
-    if(endpHandle <= 0){
-        printf("Failed to connect to interface %s!", "lemon.testservice/testif");
-        return nullptr;
+// Queue a message and wait for it to be sent back, as a client waiting on events does
+int PingPongLatency(bool ring) {
+    char name[48];
+    snprintf(name, sizeof(name), "ipc-pingpong-%s", PathName(ring));
+
+    EchoPeer peer;
+    if (!peer.Start(ring)) {
+        return 1;
     }
-    
-    char buf[64];
-    uint64_t id;
-    uint32_t size;
 
-    avgTime = 0;
+    uint8_t buffer[BENCH_LATENCY_PAYLOAD] = {};
+    return MeasureRoundTrips(name, [&]() -> long {
+        if (long ret = peer.endpoint.Queue(MessageEcho, buffer, sizeof(buffer)); ret) {
+            return ret;
+        }
+
+        Lemon::Message m;
+        long id = Receive(peer.endpoint, m);
+        return id < 0 ? id : (id == MessageEcho ? 0 : -EPROTO);
+    });
+}
+
+// The same round trip over a UNIX socket for comparison
+int UnixPingPongLatency() {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+        perror("socketpair");
+        return 1;
+    }
 
-    for(int i = 0; i < msgCount; i++){
-        long ret = syscall(SYS_ENDPOINT_DEQUEUE, endpHandle, &id, &size, buf, 0);
-        while(!ret){
-            ret = syscall(SYS_ENDPOINT_DEQUEUE, endpHandle, &id, &size, buf, 0);
+    std::thread peer([fd = fds[1]]() {
+        uint8_t buffer[BENCH_LATENCY_PAYLOAD];
+        while (read(fd, buffer, sizeof(buffer)) == sizeof(buffer)) {
+            if (write(fd, buffer, sizeof(buffer)) != sizeof(buffer)) {
+                return;
+            }
         }
+    });
 
-        if(ret <= 0){
-            printf("Error on endpoint dequeue!\n");
-            return nullptr;
+    uint8_t buffer[BENCH_LATENCY_PAYLOAD] = {};
+    int e = MeasureRoundTrips("unix-pingpong", [&]() -> long {
+        if (write(fds[0], buffer, sizeof(buffer)) != sizeof(buffer) ||
+            read(fds[0], buffer, sizeof(buffer)) != sizeof(buffer)) {
+            return -errno;
         }
+        return 0;
+    });
+
+    close(fds[0]);
+    peer.join();
+    close(fds[1]);
+    return e;
+}
 
-        clock_gettime(CLOCK_BOOTTIME, &newTimer[i]);
+// Connect to the fan in interface and send MessageData to it when asked
+void FanInClient(bool ring) {
+    Lemon::Endpoint endp(fanInPath);
+    if (ring && endp.EnableRing()) {
+        return;
     }
 
-    int low = newTimer[0] - timer[0];
-    int high = 0;
-    for(int i = 0; i < msgCount; i++){
-        int diff = (newTimer[i] - timer[i]);
-        if(diff / 1000 < low){
-            low = diff / 1000;
+    uint8_t buffer[BENCH_MESSAGE_SIZE] = {};
+    endp.Queue(MessageHello, nullptr, 0);
+    for (;;) {
+        Lemon::Message m;
+        long id = Receive(endp, m);
+        if (id < 0 || id == MessageQuit) {
+            return;
         }
 
-        if(diff / 1000 > high){
-            high = diff / 1000;
+        BurstRequest burst;
+        if (id != MessageBurst || m.length() < sizeof(burst)) {
+            continue;
         }
 
-        avgTime += diff;
+        memcpy(&burst, m.data(), sizeof(burst));
+        for (uint32_t i = 0; i < burst.count; i++) {
+            if (endp.Queue(MessageData, buffer, burst.size)) {
+                return;
+            }
+        }
     }
-    avgTime = avgTime / msgCount / 1000;
+}
 
-    printf("Recieved messagees: avg time: %ldus, low: %dus, high %dus\n", avgTime, low, high);
+// Poll fanInInterface until count messages with id have arrived, the clients they came from are added to clients
+void FanInReceive(Lemon::Waiter& waiter, uint64_t id, unsigned count, std::vector<Lemon::Handle>* clients) {
+    Lemon::Handle client;
+    while (count) {
+        Lemon::Message m;
+        if (!fanInInterface->Poll(client, m)) {
+            waiter.Wait(1000000);
+            continue;
+        }
 
-    return nullptr;
+        if (m.id() == id) {
+            count--;
+            if (clients) {
+                clients->push_back(client);
+            }
+        }
+    }
 }
 
-pthread_t t1;
-pthread_t t2;
+// clientCount clients all sending to one Lemon::Interface, as applications do to the window manager
+int FanIn(unsigned clientCount, bool ring) {
+    char name[48];
+    snprintf(name, sizeof(name), "ipc-fanin-%u-%s", clientCount, PathName(ring));
 
-long svcHandle;
-long ifHandle;
-long endpHandle;
+    Lemon::Waiter waiter;
+    waiter.WaitOnAll(fanInInterface);
 
-int udsListener;
-int main(){
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < clientCount; i++) {
+        threads.emplace_back(FanInClient, ring);
+    }
 
-    udsAddr.sun_family = AF_UNIX;
-    strcpy(udsAddr.sun_path, "testsocket");
+    std::vector<Lemon::Handle> clients;
+    FanInReceive(waiter, MessageHello, clientCount, &clients);
 
-    udsListener = socket(AF_UNIX, SOCK_STREAM, 0);
+    BurstRequest burst = {BENCH_FAN_MESSAGES / clientCount, BENCH_FAN_PAYLOAD};
+    unsigned total = burst.count * clientCount;
 
-    if(bind(udsListener, reinterpret_cast<sockaddr*>(&udsAddr), sizeof(sockaddr_un) ) < 0){
-        printf("Error binding socket to address!\n");
-        return 1;
+    double samples[BENCH_SAMPLES];
+    for (int s = -1; s < BENCH_SAMPLES; s++) {
+        uint64_t start = NowNs();
+        for (auto& client : clients) {
+            Lemon::EndpointQueue(client.get(), MessageBurst, burst);
+        }
+
+        FanInReceive(waiter, MessageData, total, nullptr);
+        uint64_t end = NowNs();
+
+        if (s >= 0) {
+            samples[s] = total / ((end - start) / 1000000000.0);
+        }
     }
 
-    listen(udsListener, 0);
+    for (auto& client : clients) {
+        Lemon::EndpointQueue(client.get(), MessageQuit, 0, 0);
+    }
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
 
-    pthread_create(&t1, nullptr, UDSThread, nullptr);
+    waiter.StopWaitingOnAll(fanInInterface);
 
-    int fd = accept(udsListener, nullptr, nullptr);
+    ReportRate(name, total, samples);
+    return 0;
+}
 
-    char msg[64];
-    for(int i = 0; i < msgCount; i++){
-        clock_gettime(CLOCK_BOOTTIME, &timer[i]);
+// One thread queueing messages to peerCount peers in turn, as a server broadcasting events does
+int FanOut(unsigned peerCount, bool ring) {
+    char name[48];
+    snprintf(name, sizeof(name), "ipc-fanout-%u-%s", peerCount, PathName(ring));
 
-        send(fd, msg, 64, 0);
+    std::vector<EchoPeer> peers(peerCount);
+    for (auto& peer : peers) {
+        if (!peer.Start(ring)) {
+            return 1;
+        }
     }
 
-    pthread_join(t1, nullptr);
+    uint8_t buffer[BENCH_FAN_PAYLOAD] = {};
+    unsigned total = BENCH_FAN_MESSAGES / peerCount * peerCount;
+
+    double samples[BENCH_SAMPLES];
+    for (int s = -1; s < BENCH_SAMPLES; s++) {
+        uint64_t start = NowNs();
+        for (unsigned i = 0; i < total; i++) {
+            if (long ret = peers[i % peerCount].endpoint.Queue(MessageData, buffer, sizeof(buffer)); ret) {
+                printf("bench %s failed: %s\n", name, strerror(-ret));
+                return 1;
+            }
+        }
+
+        for (auto& peer : peers) {
+            if (long ret = Sync(peer.endpoint); ret) {
+                printf("bench %s failed: %s\n", name, strerror(-ret));
+                return 1;
+            }
+        }
+        uint64_t end = NowNs();
+
+        if (s >= 0) {
+            samples[s] = total / ((end - start) / 1000000000.0);
+        }
+    }
 
-    svcHandle = syscall(SYS_CREATE_SERVICE, "lemon.testservice", 0, 0, 0, 0);
-    if(svcHandle <= 0){
-        printf("Failed to create service!");
+    ReportRate(name, total, samples);
+    return 0;
+}
+
+struct Entry {
+    const char* name;
+    int (*func)(bool ring);
+};
+
+const Entry benchmarks[] = {
+    {"rate", [](bool ring) -> int {
+         int e = 0;
+         for (uint16_t size : {16, 64, 256, 1024, 4096}) {
+             e |= MessageRate(size, ring);
+         }
+         return e;
+     }},
+    {"latency", [](bool ring) -> int { return CallLatency(ring) | PingPongLatency(ring); }},
+    {"fanin", [](bool ring) -> int { return FanIn(1, ring) | FanIn(4, ring) | FanIn(16, ring); }},
+    {"fanout", [](bool ring) -> int { return FanOut(1, ring) | FanOut(4, ring) | FanOut(16, ring); }},
+};
+
+int main(int argc, char** argv) {
+    const char* only = argc > 1 ? argv[1] : nullptr;
+
+    service = Lemon::Handle(Lemon::CreateService(BENCH_SERVICE));
+    if (service.get() <= 0) {
+        printf("Failed to create service %s: %s\n", BENCH_SERVICE, strerror(-service.get()));
         return 1;
     }
 
-    ifHandle = syscall(SYS_CREATE_INTERFACE, svcHandle, "testif", 64, 0, 0);
-    if(svcHandle <= 0){
-        printf("Failed to create interface!");
+    pairInterface = Lemon::Handle(Lemon::CreateInterface(service.get(), "pair", BENCH_MESSAGE_SIZE));
+    if (pairInterface.get() <= 0) {
+        printf("Failed to create interface: %s\n", strerror(-pairInterface.get()));
         return 1;
     }
 
-    pthread_create(&t2, nullptr, LemonIPCThread, nullptr);
+    fanInInterface = new Lemon::Interface(service, "fanin", BENCH_MESSAGE_SIZE);
 
-    long endpHandle = syscall(SYS_INTERFACE_ACCEPT, ifHandle, 0, 0, 0, 0);
-    while(!endpHandle){
-        endpHandle = syscall(SYS_INTERFACE_ACCEPT, ifHandle, 0, 0, 0, 0);
-    }
+    int e = 0;
+    bool found = false;
+    for (const Entry& bench : benchmarks) {
+        if (only && strcmp(only, bench.name)) {
+            continue;
+        }
 
-    if(endpHandle <= 0){
-        printf("Error accepting connection on interface!");
-        return 0;
+        found = true;
+        e |= bench.func(false) | bench.func(true);
     }
 
-    for(int i = 0; i < msgCount; i++){
-        clock_gettime(CLOCK_BOOTTIME, &timer[i]);
-        syscall(SYS_ENDPOINT_QUEUE, endpHandle, 0xDEADBEEF, 64, msg, 0);
+    if (!only || !strcmp(only, "unix")) {
+        found = true;
+        e |= UnixPingPongLatency();
     }
 
-    pthread_join(t2, nullptr);
+    if (!found) {
+        printf("Unknown benchmark '%s', expected one of:", only);
+        for (const Entry& bench : benchmarks) {
+            printf(" %s", bench.name);
+        }
+        printf(" unix\n");
+        return 1;
+    }
 
-    return 0;
-}
\ No newline at end of file
+    return e;
+}
@@ -0,0 +1,449 @@
+#include "ImageView.h"
+
+#include <Lemon/Core/Keyboard.h>
+#include <Lemon/GUI/Theme.h>
+#include <Lemon/GUI/Window.h>
+#include <Lemon/Graphics/Graphics.h>
+
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+
+#define IMGVIEW_PAN_STEP 64 // Pixels moved by the arrow keys
+
+namespace {
+
+inline uint64_t NowNs() {
+    timespec t;
+    clock_gettime(CLOCK_BOOTTIME, &t);
+    return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+// Average of four pixels, two channels at a time
+inline uint32_t Average4(uint32_t a, uint32_t b, uint32_t c, uint32_t d) {
+    uint32_t rb = (a & 0xff00ff) + (b & 0xff00ff) + (c & 0xff00ff) + (d & 0xff00ff) + 0x00020002;
+    uint32_t ag = ((a >> 8) & 0xff00ff) + ((b >> 8) & 0xff00ff) + ((c >> 8) & 0xff00ff) + ((d >> 8) & 0xff00ff) +
+                  0x00020002;
+
+    return ((rb >> 2) & 0xff00ff) | (((ag >> 2) & 0xff00ff) << 8);
+}
+
+// Blend of a and b, weight (0-256) is how much of b to take, two channels at a time
+inline uint32_t Lerp(uint32_t a, uint32_t b, uint32_t weight) {
+    uint32_t rb = (((a & 0xff00ff) * (256 - weight) + (b & 0xff00ff) * weight) >> 8) & 0xff00ff;
+    uint32_t ag = (((a >> 8) & 0xff00ff) * (256 - weight) + ((b >> 8) & 0xff00ff) * weight) & 0xff00ff00;
+
+    return rb | ag;
+}
+
+} // namespace
+
+ImageView::ImageView(rect_t bounds) : Widget(bounds) {}
+
+ImageView::~ImageView() { FreeImage(); }
+
+int ImageView::Load(const char* path) {
+    int width, height;
+    if (int e = Lemon::Graphics::GetImageSize(path, width, height); e) {
+        return e;
+    }
+
+    // Anything bigger than we are willing to keep is decoded straight to a smaller size
+    double pixels = static_cast<double>(width) * height;
+    if (pixels > IMGVIEW_MAX_PIXELS) {
+        double scale = sqrt(IMGVIEW_MAX_PIXELS / pixels);
+        width = std::max(1, static_cast<int>(width * scale));
+        height = std::max(1, static_cast<int>(height * scale));
+    }
+
+    Surface image = {.width = width, .height = height, .depth = 32, .buffer = new uint8_t[width * height * 4]};
+    if (int e = Lemon::Graphics::LoadImage(path, 0, 0, width, height, &image, false); e) {
+        delete[] image.buffer;
+        return e;
+    }
+
+    FreeImage();
+
+    m_levels.push_back(image);
+    m_width = width;
+    m_height = height;
+    BuildMipLevels();
+
+    m_offset = {0, 0};
+    if (m_scaling == ScaleFree) {
+        m_scaling = ScaleFit;
+    }
+    UpdateFixedBounds();
+
+    Invalidate();
+    return 0;
+}
+
+void ImageView::SetScaling(Scaling scaling) {
+    m_scaling = scaling;
+    UpdateFixedBounds();
+
+    Invalidate();
+}
+
+void ImageView::Zoom(double factor) {
+    if (m_levels.empty()) {
+        return;
+    }
+
+    double zoom = std::clamp(m_zoom * factor, IMGVIEW_MIN_ZOOM, IMGVIEW_MAX_ZOOM);
+
+    // Point of the image in the centre of the view
+    vector2i_t origin = ImageOrigin();
+    double centreX = (fixedBounds.pos.x + fixedBounds.size.x / 2 - origin.x) / m_zoom;
+    double centreY = (fixedBounds.pos.y + fixedBounds.size.y / 2 - origin.y) / m_zoom;
+
+    m_scaling = ScaleFree;
+    m_zoom = zoom;
+    m_offset = {static_cast<int>(centreX * zoom) - fixedBounds.size.x / 2,
+                static_cast<int>(centreY * zoom) - fixedBounds.size.y / 2};
+    ClampOffset();
+
+    Invalidate();
+}
+
+void ImageView::Paint(surface_t* surface) {
+    const Colour& background = Lemon::GUI::Theme::Current().ColourContentBackground();
+    if (m_levels.empty()) {
+        Lemon::Graphics::DrawRect(fixedBounds, background, surface);
+        return;
+    }
+
+    m_frame++;
+
+    vector2i_t origin = ImageOrigin();
+    vector2i_t size = ZoomedSize();
+
+    // Part of the zoomed image in view
+    int left = std::max(fixedBounds.pos.x - origin.x, 0);
+    int top = std::max(fixedBounds.pos.y - origin.y, 0);
+    int right = std::min(fixedBounds.pos.x + fixedBounds.size.x - origin.x, size.x);
+    int bottom = std::min(fixedBounds.pos.y + fixedBounds.size.y - origin.y, size.y);
+
+    // Fill around the image when it is smaller than the view
+    int viewBottom = fixedBounds.pos.y + fixedBounds.size.y;
+    if (origin.y > fixedBounds.pos.y) {
+        Lemon::Graphics::DrawRect(fixedBounds.pos.x, fixedBounds.pos.y, fixedBounds.size.x,
+                                  origin.y - fixedBounds.pos.y, background, surface);
+    }
+    if (origin.y + bottom < viewBottom) {
+        Lemon::Graphics::DrawRect(fixedBounds.pos.x, origin.y + bottom, fixedBounds.size.x,
+                                  viewBottom - (origin.y + bottom), background, surface);
+    }
+    if (origin.x > fixedBounds.pos.x) {
+        Lemon::Graphics::DrawRect(fixedBounds.pos.x, origin.y + top, origin.x - fixedBounds.pos.x, bottom - top,
+                                  background, surface);
+    }
+    if (origin.x + right < fixedBounds.pos.x + fixedBounds.size.x) {
+        Lemon::Graphics::DrawRect(origin.x + right, origin.y + top,
+                                  fixedBounds.pos.x + fixedBounds.size.x - (origin.x + right), bottom - top,
+                                  background, surface);
+    }
+
+    if (left >= right || top >= bottom) {
+        m_refinePending = false;
+        return;
+    }
+
+    // Indices rather than pointers, as m_tiles may grow whilst getting tiles
+    std::vector<size_t> visible;
+    for (int ty = top / IMGVIEW_TILE_SIZE; ty <= (bottom - 1) / IMGVIEW_TILE_SIZE; ty++) {
+        for (int tx = left / IMGVIEW_TILE_SIZE; tx <= (right - 1) / IMGVIEW_TILE_SIZE; tx++) {
+            visible.push_back(&GetTile(tx, ty) - m_tiles.data());
+        }
+    }
+
+    // Refine as many drafts as we can in our budget, the rest are done on later paints
+    uint64_t deadline = NowNs() + IMGVIEW_REFINE_BUDGET;
+    m_refinePending = false;
+    for (size_t index : visible) {
+        Tile& tile = m_tiles[index];
+        if (!tile.draft) {
+            continue;
+        }
+
+        if (NowNs() > deadline) {
+            m_refinePending = true;
+            break;
+        }
+
+        DrawTile(tile, false);
+    }
+
+    for (size_t index : visible) {
+        Tile& tile = m_tiles[index];
+
+        int tileX = tile.x * IMGVIEW_TILE_SIZE;
+        int tileY = tile.y * IMGVIEW_TILE_SIZE;
+
+        // Clip the tile to the part of the image in view
+        rect_t region;
+        region.pos = {std::max(left - tileX, 0), std::max(top - tileY, 0)};
+        region.size = {std::min(right - tileX, IMGVIEW_TILE_SIZE) - region.pos.x,
+                       std::min(bottom - tileY, IMGVIEW_TILE_SIZE) - region.pos.y};
+
+        Lemon::Graphics::surfacecpy(surface, &tile.surface, origin + vector2i_t{tileX, tileY} + region.pos, region);
+    }
+}
+
+void ImageView::OnMouseDown(vector2i_t mousePos) {
+    m_dragging = true;
+    m_dragStart = mousePos;
+    m_dragOffset = m_offset;
+}
+
+void ImageView::OnMouseUp(vector2i_t) { m_dragging = false; }
+
+void ImageView::OnMouseMove(vector2i_t mousePos) {
+    if (!m_dragging) {
+        return;
+    }
+
+    m_offset = m_dragOffset - (mousePos - m_dragStart);
+    ClampOffset();
+
+    Invalidate();
+}
+
+void ImageView::OnKeyPress(int key) {
+    switch (key) {
+    case KEY_ARROW_LEFT:
+        m_offset.x -= IMGVIEW_PAN_STEP;
+        break;
+    case KEY_ARROW_RIGHT:
+        m_offset.x += IMGVIEW_PAN_STEP;
+        break;
+    case KEY_ARROW_UP:
+        m_offset.y -= IMGVIEW_PAN_STEP;
+        break;
+    case KEY_ARROW_DOWN:
+        m_offset.y += IMGVIEW_PAN_STEP;
+        break;
+    case '+':
+    case '=':
+        Zoom(IMGVIEW_ZOOM_STEP);
+        return;
+    case '-':
+        Zoom(1 / IMGVIEW_ZOOM_STEP);
+        return;
+    case '0':
+        SetScaling(ScaleNone);
+        return;
+    default:
+        return;
+    }
+
+    ClampOffset();
+    Invalidate();
+}
+
+void ImageView::OnCommand(unsigned short command) {
+    // Menu commands come to us once we are active, the window handles them
+    if (window && window->OnMenuCmd) {
+        window->OnMenuCmd(command, window);
+    }
+}
+
+void ImageView::UpdateFixedBounds() {
+    Widget::UpdateFixedBounds();
+
+    if (m_levels.empty()) {
+        return;
+    }
+
+    double xScale = static_cast<double>(fixedBounds.size.x) / m_width;
+    double yScale = static_cast<double>(fixedBounds.size.y) / m_height;
+    if (m_scaling == ScaleNone) {
+        m_zoom = 1;
+    } else if (m_scaling == ScaleFit) {
+        m_zoom = std::min(xScale, yScale);
+    } else if (m_scaling == ScaleFill) {
+        m_zoom = std::max(xScale, yScale);
+    }
+    m_zoom = std::clamp(m_zoom, IMGVIEW_MIN_ZOOM, IMGVIEW_MAX_ZOOM);
+
+    ClampOffset();
+}
+
+void ImageView::FreeImage() {
+    for (Surface& level : m_levels) {
+        delete[] level.buffer;
+    }
+    m_levels.clear();
+
+    for (Tile& tile : m_tiles) {
+        delete[] tile.surface.buffer;
+    }
+    m_tiles.clear();
+
+    m_width = m_height = 0;
+}
+
+void ImageView::BuildMipLevels() {
+    while (std::max(m_levels.back().width, m_levels.back().height) > IMGVIEW_TILE_SIZE) {
+        const Surface& src = m_levels.back();
+        const uint32_t* srcBuffer = reinterpret_cast<const uint32_t*>(src.buffer);
+
+        Surface level = {.width = std::max(src.width / 2, 1), .height = std::max(src.height / 2, 1), .depth = 32};
+        level.buffer = new uint8_t[level.BufferSize()];
+        uint32_t* buffer = reinterpret_cast<uint32_t*>(level.buffer);
+
+        for (int y = 0; y < level.height; y++) {
+            // Clamped for when the source is a single pixel high or wide
+            const uint32_t* row0 = srcBuffer + std::min(y * 2, src.height - 1) * src.width;
+            const uint32_t* row1 = srcBuffer + std::min(y * 2 + 1, src.height - 1) * src.width;
+
+            for (int x = 0; x < level.width; x++) {
+                int x0 = std::min(x * 2, src.width - 1);
+                int x1 = std::min(x * 2 + 1, src.width - 1);
+
+                *(buffer++) = Average4(row0[x0], row0[x1], row1[x0], row1[x1]);
+            }
+        }
+
+        m_levels.push_back(level);
+    }
+}
+
+int ImageView::LevelForZoom() const {
+    vector2i_t size = ZoomedSize();
+
+    int level = 0;
+    while (level + 1 < static_cast<int>(m_levels.size()) && m_levels[level + 1].width >= size.x &&
+           m_levels[level + 1].height >= size.y) {
+        level++;
+    }
+
+    return level;
+}
+
+vector2i_t ImageView::ZoomedSize() const {
+    return {std::max(static_cast<int>(m_width * m_zoom), 1), std::max(static_cast<int>(m_height * m_zoom), 1)};
+}
+
+vector2i_t ImageView::ImageOrigin() const {
+    vector2i_t size = ZoomedSize();
+    vector2i_t origin = fixedBounds.pos - m_offset;
+
+    // Centred when smaller than the view
+    if (size.x < fixedBounds.size.x) {
+        origin.x = fixedBounds.pos.x + (fixedBounds.size.x - size.x) / 2;
+    }
+    if (size.y < fixedBounds.size.y) {
+        origin.y = fixedBounds.pos.y + (fixedBounds.size.y - size.y) / 2;
+    }
+
+    return origin;
+}
+
+void ImageView::ClampOffset() {
+    vector2i_t size = ZoomedSize();
+
+    m_offset.x = std::clamp(m_offset.x, 0, std::max(size.x - fixedBounds.size.x, 0));
+    m_offset.y = std::clamp(m_offset.y, 0, std::max(size.y - fixedBounds.size.y, 0));
+}
+
+ImageView::Tile& ImageView::GetTile(int x, int y) {
+    Tile* lru = nullptr;
+    for (Tile& tile : m_tiles) {
+        if (tile.zoom == m_zoom && tile.x == x && tile.y == y) {
+            tile.lastUsed = m_frame;
+            return tile;
+        }
+
+        if (!lru || tile.lastUsed < lru->lastUsed) {
+            lru = &tile;
+        }
+    }
+
+    // Only grow past the cache size when every tile is in view
+    Tile* tile = lru;
+    if (m_tiles.size() < IMGVIEW_TILE_CACHE || !lru || lru->lastUsed == m_frame) {
+        Surface surface = {.width = IMGVIEW_TILE_SIZE, .height = IMGVIEW_TILE_SIZE, .depth = 32};
+        surface.buffer = new uint8_t[surface.BufferSize()];
+
+        tile = &m_tiles.emplace_back(Tile{.surface = surface});
+    }
+
+    tile->zoom = m_zoom;
+    tile->x = x;
+    tile->y = y;
+    tile->lastUsed = m_frame;
+
+    DrawTile(*tile, true);
+    return *tile;
+}
+
+void ImageView::DrawTile(Tile& tile, bool draft) {
+    const Surface& level = m_levels[LevelForZoom()];
+    const uint32_t* src = reinterpret_cast<const uint32_t*>(level.buffer);
+    uint32_t* dest = reinterpret_cast<uint32_t*>(tile.surface.buffer);
+
+    vector2i_t size = ZoomedSize();
+    int tileX = tile.x * IMGVIEW_TILE_SIZE;
+    int tileY = tile.y * IMGVIEW_TILE_SIZE;
+    int width = std::min(size.x - tileX, IMGVIEW_TILE_SIZE);
+    int height = std::min(size.y - tileY, IMGVIEW_TILE_SIZE);
+
+    // Distance in the level between pixels of the tile in 16.16 fixed point,
+    // pixel centres are lined up so the image is not shifted by scaling
+    int64_t xStep = (static_cast<int64_t>(level.width) << 16) / size.x;
+    int64_t yStep = (static_cast<int64_t>(level.height) << 16) / size.y;
+
+    tile.draft = draft;
+    if (draft) {
+        int columns[IMGVIEW_TILE_SIZE];
+        for (int x = 0; x < width; x++) {
+            columns[x] = std::min(static_cast<int>(((tileX + x) * xStep + xStep / 2) >> 16), level.width - 1);
+        }
+
+        for (int y = 0; y < height; y++) {
+            int row = std::min(static_cast<int>(((tileY + y) * yStep + yStep / 2) >> 16), level.height - 1);
+            const uint32_t* srcRow = src + row * level.width;
+            uint32_t* destRow = dest + y * IMGVIEW_TILE_SIZE;
+
+            for (int x = 0; x < width; x++) {
+                destRow[x] = srcRow[columns[x]];
+            }
+        }
+        return;
+    }
+
+    // Bilinear, the columns to blend and their weights are the same for every row
+    int columns0[IMGVIEW_TILE_SIZE];
+    int columns1[IMGVIEW_TILE_SIZE];
+    uint32_t columnWeights[IMGVIEW_TILE_SIZE];
+    for (int x = 0; x < width; x++) {
+        int64_t fx = std::max<int64_t>((tileX + x) * xStep + xStep / 2 - 0x8000, 0);
+
+        columns0[x] = std::min(static_cast<int>(fx >> 16), level.width - 1);
+        columns1[x] = std::min(columns0[x] + 1, level.width - 1);
+        columnWeights[x] = (fx >> 8) & 0xff;
+    }
+
+    for (int y = 0; y < height; y++) {
+        int64_t fy = std::max<int64_t>((tileY + y) * yStep + yStep / 2 - 0x8000, 0);
+
+        int row0 = std::min(static_cast<int>(fy >> 16), level.height - 1);
+        int row1 = std::min(row0 + 1, level.height - 1);
+        uint32_t rowWeight = (fy >> 8) & 0xff;
+
+        const uint32_t* srcRow0 = src + row0 * level.width;
+        const uint32_t* srcRow1 = src + row1 * level.width;
+        uint32_t* destRow = dest + y * IMGVIEW_TILE_SIZE;
+
+        for (int x = 0; x < width; x++) {
+            uint32_t upper = Lerp(srcRow0[columns0[x]], srcRow0[columns1[x]], columnWeights[x]);
+            uint32_t lower = Lerp(srcRow1[columns0[x]], srcRow1[columns1[x]], columnWeights[x]);
+
+            destRow[x] = Lerp(upper, lower, rowWeight);
+        }
+    }
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <Lemon/GUI/Widgets.h>
+
+#include <stdint.h>
+#include <vector>
+
+#define IMGVIEW_TILE_SIZE 256
+// Tiles kept at the scale they are shown, 256KB each
+#define IMGVIEW_TILE_CACHE 96
+// Larger images are decoded scaled down to about this many pixels (64MB), so memory use is bounded
+#define IMGVIEW_MAX_PIXELS (4096 * 4096)
+// Time spent refining draft tiles each paint, in ns
+#define IMGVIEW_REFINE_BUDGET 8000000
+
+#define IMGVIEW_MIN_ZOOM (1.0 / 64)
+#define IMGVIEW_MAX_ZOOM 32.0
+#define IMGVIEW_ZOOM_STEP 1.25
+
+/////////////////////////////
+/// \brief Pannable, zoomable view of an image
+///
+/// The image is decoded once into a pyramid of mip levels, each half the size of the last.
+/// What is visible is drawn in tiles at the current zoom, sampled from the smallest level no smaller
+/// than the zoomed image. Tiles are first drawn as a quick draft then refined over the next paints,
+/// so zooming and panning never wait on scaling the whole image.
+/////////////////////////////
+class ImageView : public Lemon::GUI::Widget {
+public:
+    enum Scaling {
+        ScaleNone, // Actual size
+        ScaleFit,  // Whole image in view
+        ScaleFill, // View filled, cropping the image
+        ScaleFree, // Zoomed by the user
+    };
+
+    ImageView(rect_t bounds);
+    ~ImageView();
+
+    // Returns 0 on success, otherwise the error from decoding the image
+    int Load(const char* path);
+
+    void SetScaling(Scaling scaling);
+    // Zoom by factor, keeping the centre of the view in place
+    void Zoom(double factor);
+
+    // Whether tiles in view are still drafts, the view should be painted again soon
+    inline bool NeedsRefinement() const { return m_refinePending; }
+
+    void Paint(surface_t* surface) override;
+
+    void OnMouseDown(vector2i_t mousePos) override;
+    void OnMouseUp(vector2i_t mousePos) override;
+    void OnMouseMove(vector2i_t mousePos) override;
+    void OnKeyPress(int key) override;
+    void OnCommand(unsigned short command) override;
+
+    void UpdateFixedBounds() override;
+
+private:
+    struct Tile {
+        double zoom = 0;     // Zoom the tile was drawn at
+        int x = 0, y = 0;    // Position in tiles
+        bool draft = true;   // Drawn with nearest neighbour sampling, yet to be refined
+        uint64_t lastUsed = 0;
+        Surface surface;
+    };
+
+    void FreeImage();
+
+    // Build the levels below the first by averaging each 2x2 block
+    void BuildMipLevels();
+    // Level to sample from at the current zoom
+    int LevelForZoom() const;
+
+    // Size of the image at the current zoom
+    vector2i_t ZoomedSize() const;
+    // Position of the top left of the zoomed image relative to the widget
+    vector2i_t ImageOrigin() const;
+    void ClampOffset();
+
+    Tile& GetTile(int x, int y);
+    void DrawTile(Tile& tile, bool draft);
+
+    std::vector<Surface> m_levels; // The first level is the decoded image
+    int m_width = 0;               // Size of the first level
+    int m_height = 0;
+
+    std::vector<Tile> m_tiles;
+    uint64_t m_frame = 0;
+    bool m_refinePending = false;
+
+    Scaling m_scaling = ScaleFit;
+    double m_zoom = 1;
+    vector2i_t m_offset = {0, 0}; // Part of the zoomed image at the top left of the view
+
+    bool m_dragging = false;
+    vector2i_t m_dragStart;
+    vector2i_t m_dragOffset;
+};
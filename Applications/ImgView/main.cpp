@@ -3,6 +3,8 @@
 #include <Lemon/GUI/Messagebox.h>
 #include <Lemon/GUI/FileDialog.h>
 
+#include "ImageView.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -10,14 +12,18 @@
 #define IMGVIEW_SCALING_NONE 0x11
 #define IMGVIEW_SCALING_FIT 0x12
 #define IMGVIEW_SCALING_FILL 0x13
+#define IMGVIEW_ZOOM_IN 0x14
+#define IMGVIEW_ZOOM_OUT 0x15
 
 Lemon::GUI::Window* window;
-Lemon::GUI::Image* imgWidget;
+ImageView* imgWidget;
 Lemon::GUI::WindowMenu fileMenu = { "File", {{.id = IMGVIEW_OPEN, .name = std::string("Open...")}} };
 Lemon::GUI::WindowMenu viewMenu = { "View", {
     { .id = IMGVIEW_SCALING_NONE, .name = std::string("No Scaling") },
     { .id = IMGVIEW_SCALING_FIT, .name = std::string("Fit Image") },
-    { .id = IMGVIEW_SCALING_FILL, .name = std::string("Fill Image") }
+    { .id = IMGVIEW_SCALING_FILL, .name = std::string("Fill Image") },
+    { .id = IMGVIEW_ZOOM_IN, .name = std::string("Zoom In (+)") },
+    { .id = IMGVIEW_ZOOM_OUT, .name = std::string("Zoom Out (-)") }
 } };
 
 int LoadImage(char* path){
@@ -46,19 +52,23 @@ void OnWindowCmd(unsigned short cmd, Lemon::GUI::Window* win){
             exit(-1);
         }
     } else if(cmd == IMGVIEW_SCALING_NONE){
-        imgWidget->SetScaling(Lemon::Graphics::Texture::TextureScaling::ScaleNone);
+        imgWidget->SetScaling(ImageView::ScaleNone);
     } else if(cmd == IMGVIEW_SCALING_FIT){
-        imgWidget->SetScaling(Lemon::Graphics::Texture::TextureScaling::ScaleFit);
+        imgWidget->SetScaling(ImageView::ScaleFit);
     } else if(cmd == IMGVIEW_SCALING_FILL){
-        imgWidget->SetScaling(Lemon::Graphics::Texture::TextureScaling::ScaleFill);
+        imgWidget->SetScaling(ImageView::ScaleFill);
+    } else if(cmd == IMGVIEW_ZOOM_IN){
+        imgWidget->Zoom(IMGVIEW_ZOOM_STEP);
+    } else if(cmd == IMGVIEW_ZOOM_OUT){
+        imgWidget->Zoom(1 / IMGVIEW_ZOOM_STEP);
     }
 }
 
 int main(int argc, char** argv){
 
-    imgWidget = new Lemon::GUI::Image({{0, 0}, {0, 0}});
+    imgWidget = new ImageView({{0, 0}, {0, 0}});
     imgWidget->SetLayout(Lemon::GUI::LayoutSize::Stretch, Lemon::GUI::LayoutSize::Stretch);
-    imgWidget->SetScaling(Lemon::Graphics::Texture::TextureScaling::ScaleFit);
+    imgWidget->SetScaling(ImageView::ScaleFit);
 
     if(argc > 1){
         if(LoadImage(argv[1])){
@@ -82,7 +92,14 @@ int main(int argc, char** argv){
 
 		window->GUIPollEvents();
 
+        // Keep painting whilst tiles in view are being refined
+        if(imgWidget->NeedsRefinement()){
+            imgWidget->Invalidate();
+        }
+
         window->Paint();
-        Lemon::WindowServer::Instance()->Wait();
+        if(!imgWidget->NeedsRefinement()){
+            Lemon::WindowServer::Instance()->Wait();
+        }
 	}
 }
\ No newline at end of file
@@ -10,7 +10,7 @@ void PrintObject(JSONValue& json);
 
 void PrintArray(JSONValue& json){
     std::cout << "Array[ ";
-    for(auto& v : *json.data.array){
+    for(auto& v : json.AsArray()){
         if(v.IsObject()){
             PrintObject(v);
         } else if(v.IsArray()){
@@ -33,20 +33,20 @@ void PrintArray(JSONValue& json){
 
 void PrintObject(JSONValue& json){
     std::cout << "Object{ ";
-    for(auto& v : *json.data.object){
-        std::cout << "key: \"" << v.first << "\", value: ";
-        if(v.second.IsObject()){
-            PrintObject(v.second);
-        } else if(v.second.IsArray()){
-            PrintArray(v.second);
-        } else if(v.second.IsFloat()){
-            std::cout << v.second.AsFloat();
-        } else if(v.second.IsString()){
-            std::cout << v.second.AsString();
-        } else if(v.second.IsNumber()){
-            std::cout << v.second.AsSignedNumber();
-        } else if(v.second.IsBool()){
-            std::cout << (v.second.AsBool() ? "true" : "false");
+    for(auto& v : json.AsObject()){
+        std::cout << "key: \"" << v.key << "\", value: ";
+        if(v.value.IsObject()){
+            PrintObject(v.value);
+        } else if(v.value.IsArray()){
+            PrintArray(v.value);
+        } else if(v.value.IsFloat()){
+            std::cout << v.value.AsFloat();
+        } else if(v.value.IsString()){
+            std::cout << v.value.AsString();
+        } else if(v.value.IsNumber()){
+            std::cout << v.value.AsSignedNumber();
+        } else if(v.value.IsBool()){
+            std::cout << (v.value.AsBool() ? "true" : "false");
         } else {
             std::cout << "null";
         }
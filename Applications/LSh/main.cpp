@@ -12,6 +12,7 @@
 #include <termios.h>
 #include <unistd.h>
 #include <stack>
+#include <unordered_map>
 #include <vector>
 
 termios execAttributes; // Set before executing
@@ -31,6 +32,12 @@ typedef struct {
 char currentDir[PATH_MAX];
 
 std::list<std::string> path;
+// Value of PATH that path was built from
+std::string pathEnv;
+
+// Full paths of commands found in PATH, so the directories are not searched every time.
+// Cleared whenever PATH changes.
+std::unordered_map<std::string, std::string> commandCache;
 
 std::list<builtin_t> builtins;
 
@@ -77,11 +84,133 @@ int LShBuiltin_Clear(int argc, char** argv) {
 
 [[noreturn]] int LShBuiltin_Exit(int argc, char** argv) { exit(0); }
 
+int LShBuiltin_Echo(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        if (i > 1) {
+            putc(' ', stdout);
+        }
+        fputs(argv[i], stdout);
+    }
+    putc('\n', stdout);
+
+    return 0;
+}
+
+int LShBuiltin_True(int, char**) { return 0; }
+
+int LShBuiltin_False(int, char**) { return 1; }
+
+int LShBuiltin_Hash(int argc, char** argv) {
+    if (argc == 2 && !strcmp(argv[1], "-r")) {
+        commandCache.clear();
+        return 0;
+    } else if (argc > 1) {
+        printf("Usage: hash [-r]\n");
+        return 1;
+    }
+
+    for (auto& [name, file] : commandCache) {
+        printf("%s\t%s\n", name.c_str(), file.c_str());
+    }
+
+    return 0;
+}
+
+int LShBuiltin_Type(int argc, char** argv);
+
 builtin_t builtinCd = {.name = "cd", .func = LShBuiltin_Cd};
 builtin_t builtinPwd = {.name = "pwd", .func = LShBuiltin_Pwd};
 builtin_t builtinExport = {.name = "export", .func = LShBuiltin_Export};
 builtin_t builtinClear = {.name = "clear", .func = LShBuiltin_Clear};
 builtin_t builtinExit = {.name = "exit", .func = LShBuiltin_Exit};
+builtin_t builtinEcho = {.name = "echo", .func = LShBuiltin_Echo};
+builtin_t builtinTrue = {.name = "true", .func = LShBuiltin_True};
+builtin_t builtinFalse = {.name = "false", .func = LShBuiltin_False};
+builtin_t builtinHash = {.name = "hash", .func = LShBuiltin_Hash};
+builtin_t builtinType = {.name = "type", .func = LShBuiltin_Type};
+
+// Rebuild path if PATH has changed since it was last read
+void UpdatePath() {
+    const char* env = getenv("PATH");
+    if (!env) {
+        env = "";
+    }
+
+    if (pathEnv == env && !path.empty()) {
+        return;
+    }
+
+    pathEnv = env;
+    path.clear();
+    commandCache.clear();
+
+    std::string temp = "";
+    for (char c : pathEnv) {
+        if (c == ':') {
+            if (!temp.empty()) {
+                path.push_back(temp);
+                temp.clear();
+            }
+        } else {
+            temp += c;
+        }
+    }
+    if (temp.length()) {
+        path.push_back(temp);
+        temp.clear();
+    }
+}
+
+// Find the executable for command in PATH
+// returns false if it could not be found
+bool LookupCommand(const char* command, std::string& file) {
+    UpdatePath();
+
+    if (auto it = commandCache.find(command); it != commandCache.end()) {
+        file = it->second;
+        return true;
+    }
+
+    for (std::string& dir : path) {
+        assert(!dir.empty());
+
+        std::string candidate = dir + "/" + command;
+        if (access(candidate.c_str(), X_OK) == 0) {
+            commandCache[command] = candidate;
+            file = std::move(candidate);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+int LShBuiltin_Type(int argc, char** argv) {
+    int ret = 0;
+    for (int i = 1; i < argc; i++) {
+        bool isBuiltin = false;
+        for (builtin_t& builtin : builtins) {
+            if (!strcmp(builtin.name, argv[i])) {
+                isBuiltin = true;
+                break;
+            }
+        }
+
+        std::string file;
+        if (isBuiltin) {
+            printf("%s is a shell builtin\n", argv[i]);
+        } else if (strchr(argv[i], '/') && access(argv[i], X_OK) == 0) {
+            printf("%s is %s\n", argv[i], argv[i]);
+        } else if (!strchr(argv[i], '/') && LookupCommand(argv[i], file)) {
+            printf("%s is %s\n", argv[i], file.c_str());
+        } else {
+            printf("%s: not found\n", argv[i]);
+            ret = 1;
+        }
+    }
+
+    return ret;
+}
 
 pid_t job = -1;
 
@@ -323,35 +452,38 @@ void ParseLine() {
         }
     }
 
-    errno = 0;
+    // Spawn rather than fork, there is no need to copy our address space just to exec
+    if (strchr(argv[0], '/')) {
+        job = Lemon::Spawn(argv[0], argv.data());
+    } else {
+        errno = ENOENT;
+        job = -1;
 
-    job = fork();
-    if(job == 0) {
-        if (strchr(argv[0], '/')) {
-            execv(argv[0], argv.data());
-            if(errno == ENOENT) {
-                printf("Command not found: %s\n", argv[0]);
-            } else {
-                printf("%s: %s\n", strerror(errno), argv[0]);
-            }
-            
-            exit(errno);
-        } else {
-            for (std::string path : path) {
-                assert(!path.empty());
+        std::string file;
+        if (LookupCommand(argv[0], file)) {
+            job = Lemon::Spawn(file.c_str(), argv.data());
 
-                errno = execv((path + "/" + argv[0]).c_str(), argv.data());
+            // The cached executable may have been removed since, search PATH again
+            if (job < 0 && errno == ENOENT) {
+                commandCache.erase(argv[0]);
+                if (LookupCommand(argv[0], file)) {
+                    job = Lemon::Spawn(file.c_str(), argv.data());
+                } else {
+                    errno = ENOENT;
+                }
             }
+        }
+    }
 
-            if(errno == ENOENT) {
-                printf("Command not found: %s\n", argv[0]);
-            } else {
-                printf("%s: %s\n", strerror(errno), argv[0]);
-            }
-            
-            exit(errno);
+    if (job < 0) {
+        if (errno == ENOENT) {
+            printf("Command not found: %s\n", argv[0]);
+        } else {
+            printf("%s: %s\n", strerror(errno), argv[0]);
         }
-    } else if (job > 0) {
+
+        commandResult = errno;
+    } else {
         int status = 0;
         int ret = 0;
         while ((ret = waitpid(job, &status, 0)) == 0 || (ret < 0 && errno == EINTR))
@@ -360,8 +492,6 @@ void ParseLine() {
         commandResult = WEXITSTATUS(status);
 
         job = -1;
-    } else {
-        perror("Error spawning process");
     }
 
     job = -1;
@@ -403,21 +533,13 @@ int main() {
     builtins.push_back(builtinExport);
     builtins.push_back(builtinClear);
     builtins.push_back(builtinExit);
+    builtins.push_back(builtinEcho);
+    builtins.push_back(builtinTrue);
+    builtins.push_back(builtinFalse);
+    builtins.push_back(builtinHash);
+    builtins.push_back(builtinType);
 
-    std::string pathEnv = getenv("PATH");
-    std::string temp = "";
-    for (char c : pathEnv) {
-        if (c == ':' && !temp.empty()) {
-            path.push_back(temp);
-            temp.clear();
-        } else {
-            temp += c;
-        }
-    }
-    if (temp.length()) {
-        path.push_back(temp);
-        temp.clear();
-    }
+    UpdatePath();
 
     fflush(stdin);
 
@@ -1,9 +1,10 @@
 #include <Lemon/GUI/Window.h>
 #include <Lemon/GUI/Model.h>
 
-#include <Lemon/System/Util.h>
-#include <Lemon/System/Info.h>
+#include <Lemon/System/Metrics.h>
 
+#include <algorithm>
+#include <memory>
 #include <vector>
 #include <map>
 #include <stdexcept>
@@ -17,16 +18,25 @@ Lemon::GUI::ListView* listView;
 class ProcessModel : public Lemon::GUI::DataModel {
 public:
     struct ProcessEntry {
-        lemon_process_info_t info;
+        lemon_metrics_process_t info;
 
         uint64_t activeTimeDiff;
         uint64_t lastActiveUs;
 
+        uint64_t migrationsDiff; // CPU migrations since the last refresh
+        uint64_t switchesDiff;   // Context switches since the last refresh
+        uint64_t ioDiff;         // Bytes read and written since the last refresh
+
         bool operator==(const int pid){
             return info.pid == pid;
         }
     };
 
+    // Returns 0 on success
+    int Initialize(){
+        return metrics.Map();
+    }
+
     int ColumnCount() const {
         return columns.size();
     }
@@ -64,6 +74,15 @@ public:
             snprintf(uptime, 39, "%lum %lus", process.info.runningTime / 60, process.info.runningTime % 60);
 
             return std::string(uptime);
+        } case 5:
+            return static_cast<long>(process.migrationsDiff);
+        case 6:
+            return static_cast<long>(process.switchesDiff);
+        case 7: {
+            char io[40];
+            snprintf(io, 39, "%.1f KB", process.ioDiff / 1024.0);
+
+            return std::string(io);
         } default:
             return 0;
         }
@@ -80,46 +99,66 @@ public:
         case 3: // Memory Usage
             return 100;
         case 4: // Uptime
+            return 76;
+        case 5: // Migrations
+            return 64;
+        case 6: // Context Switches
+            return 64;
+        case 7: // I/O
         default:
             return 76;
         }
     }
 
     void Refresh(){
-        lemon_process_info_t info;
-        pid_t pid = 0;
+        // The kernel keeps the metrics up to date, reading them does not need any system calls
+        metrics.Read(*snapshot);
+
+        std::vector<ProcessEntry> updated;
+        updated.reserve(snapshot->processCount);
 
         activeTimeSum = 0; // Get the sum of the amount of time the processes have been active to calculate CPU usage 
-        while(!Lemon::GetNextProcessInfo(&pid, info)){
+        for(uint32_t i = 0; i < snapshot->processCount; i++){
+            const lemon_metrics_process_t& info = snapshot->processes[i];
+            uint64_t io = info.ioReadBytes + info.ioWriteBytes;
+
             if(auto it = std::find(processes.begin(), processes.end(), info.pid); it != processes.end()){
                 uint64_t diff = (info.activeUs - it->lastActiveUs);
                 activeTimeSum += diff;
 
-                *it = { .info = info, .activeTimeDiff = diff, .lastActiveUs = info.activeUs };
+                updated.push_back({ .info = info, .activeTimeDiff = diff, .lastActiveUs = info.activeUs, .migrationsDiff = info.migrations - it->info.migrations, .switchesDiff = info.contextSwitches - it->info.contextSwitches, .ioDiff = io - (it->info.ioReadBytes + it->info.ioWriteBytes) });
             } else {
-                processes.push_back({ .info = info, .activeTimeDiff = 0, .lastActiveUs = info.activeUs });
+                updated.push_back({ .info = info, .activeTimeDiff = 0, .lastActiveUs = info.activeUs, .migrationsDiff = 0, .switchesDiff = 0, .ioDiff = 0 });
             }
         }
 
-        std::vector<lemon_process_info_t> pv;
-        Lemon::GetProcessList(pv);
+        // Processes that have exited are left out
+        processes = std::move(updated);
     }
 private:
     uint64_t activeTimeSum = 0;
 
-    std::vector<Column> columns = { Column("Name"), Column("PID"), Column("CPU"), Column("Memory"), Column("Uptime") };
+    std::vector<Column> columns = { Column("Name"), Column("PID"), Column("CPU"), Column("Memory"), Column("Uptime"), Column("Migrations"), Column("Switches"), Column("I/O") };
     std::vector<ProcessEntry> processes;
+
+    Lemon::SystemMetrics metrics;
+    std::unique_ptr<lemon_metrics_t> snapshot = std::make_unique<lemon_metrics_t>();
 };
 
 int main(int argc, char** argv){
-    window = new Lemon::GUI::Window("LemonMonitor", {424, 480}, 0, Lemon::GUI::WindowType::GUI);
+    ProcessModel model;
+    if(model.Initialize()){
+        perror("LemonMonitor: Failed to map system metrics");
+        return 1;
+    }
+
+    window = new Lemon::GUI::Window("LemonMonitor", {628, 480}, 0, Lemon::GUI::WindowType::GUI);
     
     listView = new Lemon::GUI::ListView({0, 0, 0, 0});
     listView->SetLayout(Lemon::GUI::LayoutSize::Stretch, Lemon::GUI::LayoutSize::Stretch);
 
     window->AddWidget(listView);
 
-    ProcessModel model;
     listView->SetModel(&model);
 
     timespec lastTime;
@@ -215,6 +215,9 @@ int main() {
                                      Lemon::GUI::WindowType::GUI, {0, 0});
     taskbar->OnPaint = OnTaskbarPaint;
     taskbar->rootContainer.background = {0, 0, 0, 0};
+    // Only the rounded corners and the margin around the taskbar need blending
+    taskbar->SetOpaqueRegion({{12, 2, taskbar->GetSize().x - 24, taskbar->GetSize().y - 4},
+                              {2, 12, taskbar->GetSize().x - 4, taskbar->GetSize().y - 24}});
     taskbarWindowsContainer = new Lemon::GUI::LayoutContainer(
         {40, 4, static_cast<int>(screenBounds.x) - 108, static_cast<int>(screenBounds.y)}, {160, 24});
     taskbarWindowsContainer->background = {0, 0, 0, 0};
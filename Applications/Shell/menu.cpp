@@ -206,6 +206,13 @@ Lemon::GUI::Window* InitializeMenu() {
     menuWindow->rootContainer.background.a = 0;
     menuWindow->OnPaint = OnMenuPaint;
 
+    // Only the rounded corners need blending, as long as the background is opaque
+    if (Lemon::GUI::Theme::Current().ColourContainerBackground().a == 255) {
+        int cornerRadius = Lemon::GUI::Theme::Current().WindowCornerRaidus();
+        menuWindow->SetOpaqueRegion({{cornerRadius, 0, MENU_WIDTH - cornerRadius * 2, MENU_HEIGHT},
+                                     {0, cornerRadius, MENU_WIDTH, MENU_HEIGHT - cornerRadius * 2}});
+    }
+
     vector2i_t screenBounds = Lemon::WindowServer::Instance()->GetScreenBounds();
     menuWindow->Relocate({screenBounds.x / 2 - 200, screenBounds.y / 2 - 150});
 
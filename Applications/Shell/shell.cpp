@@ -2,10 +2,12 @@
 #include <Lemon/Core/Shell.h>
 #include <Lemon/Core/URL.h>
 #include <Lemon/IPC/Interface.h>
+#include <Lemon/System/Spawn.h>
 #include <stdexcept>
 #include <unordered_map>
 #include <vector>
 
+#include <errno.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -36,8 +38,8 @@ void ShellInstance::OnPeerDisconnect(const Lemon::Handle& client) {
     // Do nothing
 }
 
-void ShellInstance::OnOpen(const Lemon::Handle& client, const std::string& urlString) {
-    Lemon::URL url(urlString.c_str());
+void ShellInstance::OnOpen(const Lemon::Handle& client, std::string_view urlString) {
+    Lemon::URL url(std::string(urlString).c_str());
 
     Shell::OpenResponse response{ EINVAL };
     if(url.IsValid()) {
@@ -61,13 +63,13 @@ void ShellInstance::OnOpen(const Lemon::Handle& client, const std::string& urlSt
             }
 
             if(launchArguments[0]) {
-                if(fork() == 0) {
-                    execv(launchArguments[0], launchArguments);
-                } else {
-                    int i = 0;
-                    while(launchArguments[i]) {
-                        free(launchArguments[i++]);
-                    }
+                if(Lemon::Spawn(launchArguments[0], launchArguments) < 0) {
+                    Lemon::Logger::Warning("Failed to launch {}: {}", launchArguments[0], strerror(errno));
+                }
+
+                int i = 0;
+                while(launchArguments[i]) {
+                    free(launchArguments[i++]);
                 }
             }
 
@@ -27,7 +27,7 @@ public:
     ShellInstance(const Lemon::Handle& svc, const char* ifName);
 
     void OnPeerDisconnect(const Lemon::Handle& client) override;
-    void OnOpen(const Lemon::Handle& client, const std::string& url) override;
+    void OnOpen(const Lemon::Handle& client, std::string_view url) override;
     void OnToggleMenu(const Lemon::Handle& client) override;
 
     void SetMenu(Lemon::GUI::Window* menu);
@@ -1,6 +1,6 @@
+#include <algorithm>
 #include <cassert>
 #include <cstdlib>
-#include <thread>
 #include <vector>
 
 #include <fcntl.h>
@@ -11,13 +11,16 @@
 #include <unistd.h>
 
 #include <Lemon/Core/Keyboard.h>
+#include <Lemon/Core/Unicode.h>
 #include <Lemon/GUI/Window.h>
 #include <Lemon/GUI/WindowServer.h>
+#include <Lemon/System/EventLoop.h>
 
 #include "colours.h"
 #include "escape.h"
 
 #define SCROLLBACK_BUFFER_MAX 400
+#define PTY_READ_SIZE 16384
 
 using namespace Lemon;
 
@@ -49,56 +52,150 @@ struct TerminalChar {
 
 using TerminalLine = std::vector<TerminalChar>;
 
-std::vector<TerminalLine> scrollbackBuffer;
+// Lines are kept in a ring, once full the oldest line is reused rather than every line being moved up
+class Scrollback {
+public:
+    inline size_t Size() const { return m_lines.size(); }
+
+    // Line i from the oldest
+    inline TerminalLine& operator[](size_t i) { return m_lines[(m_head + i) % m_lines.size()]; }
+
+    // Add a blank line after the newest
+    void PushBack(int width) {
+        if (m_lines.size() < SCROLLBACK_BUFFER_MAX) {
+            m_lines.push_back(TerminalLine(width, TerminalChar(0)));
+            return;
+        }
+
+        TerminalLine& ln = m_lines[m_head];
+        m_head = (m_head + 1) % m_lines.size();
+
+        ln.assign(width, TerminalChar(0));
+    }
+
+    // Replace everything with blank lines
+    void Reset(int lines, int width) {
+        m_lines.assign(lines, TerminalLine(width, TerminalChar(0)));
+        m_head = 0;
+    }
+
+private:
+    std::vector<TerminalLine> m_lines;
+    size_t m_head = 0; // Index of the oldest line
+};
+
+Scrollback scrollbackBuffer;
+
+// Cells changed since they were last drawn, one for each cell on screen
+std::vector<uint8_t> dirtyCells;
+int pendingScroll = 0; // Lines the screen has scrolled since it was last drawn
+
+Surface terminalSurface; // Cells as they were last drawn, the window surface is swapped each frame
+Vector2i drawnCursorPosition = {1, 1};
+
+void MarkAllDirty() {
+    dirtyCells.assign(terminalSize.x * terminalSize.y, 1);
+    pendingScroll = 0;
+}
+
+void MarkDirty(int cursorX, int cursorY) {
+    if (cursorX >= 1 && cursorX <= terminalSize.x && cursorY >= 1 && cursorY <= terminalSize.y) {
+        dirtyCells[(cursorY - 1) * terminalSize.x + (cursorX - 1)] = 1;
+    }
+}
+
+void MarkLinesDirty(int firstY, int lastY) {
+    firstY = std::max(firstY, 1);
+    lastY = std::min(lastY, terminalSize.y);
+    if (firstY <= lastY) {
+        std::fill(dirtyCells.begin() + (firstY - 1) * terminalSize.x, dirtyCells.begin() + lastY * terminalSize.x, 1);
+    }
+}
 
 TerminalLine& GetLine(int cursorY) {
-    assert(scrollbackBuffer.size() >= static_cast<unsigned>(terminalSize.y));
+    assert(scrollbackBuffer.Size() >= static_cast<unsigned>(terminalSize.y));
 
     // Cursor starts at (1, 1)
-    TerminalLine& ln = scrollbackBuffer[scrollbackBuffer.size() - terminalSize.y + (cursorY - 1)];
+    TerminalLine& ln = scrollbackBuffer[scrollbackBuffer.Size() - terminalSize.y + (cursorY - 1)];
 
     // Ensure the line is the right size
     if (ln.size() != static_cast<unsigned>(terminalSize.x))
-        ln.resize(terminalSize.x);
+        ln.resize(terminalSize.x, TerminalChar(0));
     return ln;
 }
 
-inline auto FirstLine() { return scrollbackBuffer.begin() + (scrollbackBuffer.size() - terminalSize.y); }
+void DrawCell(const TerminalChar& c, const Vector2i& pos) {
+    Lemon::Graphics::DrawRect(Rect{pos, characterSize}, c.background, &terminalSurface);
+    if (c.ch) {
+        Lemon::Graphics::DrawChar(c.ch, pos.x, pos.y, c.foreground, &terminalSurface, terminalFont);
+    }
+}
 
 void OnPaint(Surface* surf) {
-    assert(scrollbackBuffer.size() >= static_cast<unsigned>(terminalSize.y));
+    assert(scrollbackBuffer.Size() >= static_cast<unsigned>(terminalSize.y));
+
+    Vector2i gridSize = {terminalSize.x * characterSize.x, terminalSize.y * characterSize.y};
+    if (terminalSurface.width != gridSize.x || terminalSurface.height != gridSize.y) {
+        delete[] terminalSurface.buffer;
+        terminalSurface = {.width = gridSize.x,
+                           .height = gridSize.y,
+                           .depth = 32,
+                           .buffer = new uint8_t[gridSize.x * gridSize.y * 4]};
+        MarkAllDirty();
+    }
 
-    Vector2i screenPos = {0, 0};
-    for (unsigned i = scrollbackBuffer.size() - terminalSize.y; i < scrollbackBuffer.size(); i++) {
-        screenPos.x = 0;
-        for (auto& c : scrollbackBuffer[i]) {
-            Lemon::Graphics::DrawRect(Rect{screenPos, characterSize}, c.background, surf);
-            Lemon::Graphics::DrawChar(c.ch, screenPos.x, screenPos.y, c.foreground, surf, terminalFont);
-            screenPos.x += characterSize.x;
+    // Text still on screen after scrolling is moved up rather than drawn again,
+    // scrolling a whole screen or more has already marked every cell
+    if (pendingScroll > 0 && pendingScroll < terminalSize.y) {
+        int scrollPixels = pendingScroll * characterSize.y;
+        terminalSurface.Blit(&terminalSurface, {0, 0}, {0, scrollPixels, gridSize.x, gridSize.y - scrollPixels});
+    }
 
-            if(screenPos.x >= surf->width) {
-                break;
+    // The old cursor moved up with the text
+    MarkDirty(drawnCursorPosition.x, drawnCursorPosition.y - pendingScroll);
+    MarkDirty(cursorPosition.x, cursorPosition.y);
+    pendingScroll = 0;
+
+    for (int y = 1; y <= terminalSize.y; y++) {
+        uint8_t* dirty = &dirtyCells[(y - 1) * terminalSize.x];
+        if (std::find(dirty, dirty + terminalSize.x, 1) == dirty + terminalSize.x) {
+            continue;
+        }
+
+        TerminalLine& ln = GetLine(y);
+        for (int x = 0; x < terminalSize.x; x++) {
+            if (dirty[x]) {
+                DrawCell(ln[x], {x * characterSize.x, (y - 1) * characterSize.y});
+                dirty[x] = 0;
             }
         }
-        screenPos.y += characterSize.y;
     }
 
     Lemon::Graphics::DrawRect(
         Rect{{(cursorPosition.x - 1) * characterSize.x, (cursorPosition.y - 1) * characterSize.y}, characterSize},
-        currentForegroundColour, surf);
+        currentForegroundColour, &terminalSurface);
+    drawnCursorPosition = cursorPosition;
+
+    surf->Blit(&terminalSurface);
 }
 
 void ClearScrollbackBuffer() {
-    scrollbackBuffer = std::vector<TerminalLine>(terminalSize.y, TerminalLine(terminalSize.x, TerminalChar(0)));
+    scrollbackBuffer.Reset(terminalSize.y, terminalSize.x);
+    MarkAllDirty();
 }
 
 void AddLine() {
-    if (scrollbackBuffer.size() < SCROLLBACK_BUFFER_MAX) {
-        scrollbackBuffer.push_back(TerminalLine(terminalSize.x, TerminalChar(0)));
-    } else {
-        scrollbackBuffer.erase(scrollbackBuffer.begin());
-        scrollbackBuffer.push_back(TerminalLine(terminalSize.x, TerminalChar(0)));
+    scrollbackBuffer.PushBack(terminalSize.x);
+
+    // Cells move up with their lines
+    if (dirtyCells.size() != static_cast<unsigned>(terminalSize.x * terminalSize.y)) {
+        MarkAllDirty();
+        return;
     }
+
+    std::copy(dirtyCells.begin() + terminalSize.x, dirtyCells.end(), dirtyCells.begin());
+    std::fill(dirtyCells.end() - terminalSize.x, dirtyCells.end(), 1);
+    pendingScroll++;
 }
 
 void AdvanceCursorY() {
@@ -127,6 +224,7 @@ void PutChar(uint32_t ch) {
 
     TerminalLine& line = GetLine(cursorPosition.y);
     line.at(cursorPosition.x - 1) = TerminalChar(ch);
+    MarkDirty(cursorPosition.x, cursorPosition.y);
 }
 
 // Print a char on screen and advance the cursor
@@ -308,9 +406,10 @@ void ParseChar(char ch) {
                     ln.insert(ln.end(), terminalSize.x - (cursorPosition.x - 1), TerminalChar(0));
 
                     assert(ln.size() == static_cast<unsigned>(terminalSize.x));
-                    scrollbackBuffer.erase(FirstLine() + (cursorPosition.y - 1) + 1, scrollbackBuffer.end());
-                    scrollbackBuffer.insert(scrollbackBuffer.end(), terminalSize.y - (cursorPosition.y - 1),
-                                            TerminalLine(terminalSize.x, TerminalChar(0)));
+                    for (int y = cursorPosition.y + 1; y <= terminalSize.y; y++) {
+                        GetLine(y).assign(terminalSize.x, TerminalChar(0));
+                    }
+                    MarkLinesDirty(cursorPosition.y, terminalSize.y);
                     break;
                 case 1: // Clear screen and move cursor
                 case 2: // Same as 1 but delete everything in the scrollback buffer
@@ -345,6 +444,7 @@ void ParseChar(char ch) {
 
                 if (ln.size() != static_cast<unsigned>(terminalSize.x))
                     ln.resize(terminalSize.x);
+                MarkLinesDirty(cursorPosition.y, cursorPosition.y);
                 break;
             }
             case ANSI_CSI_IL: // Insert blank lines
@@ -363,7 +463,9 @@ void ParseChar(char ch) {
                     amount = atoi(escapeBuffer.c_str());
                 }
 
-                scrollbackBuffer.insert(scrollbackBuffer.end(), amount, TerminalLine(terminalSize.x, TerminalChar(0)));
+                while (amount-- > 0) {
+                    AddLine();
+                }
                 break;
             }
             case ANSI_CSI_SD: { // Scroll Down
@@ -372,7 +474,16 @@ void ParseChar(char ch) {
                     amount = atoi(escapeBuffer.c_str());
                 }
 
-                scrollbackBuffer.insert(FirstLine(), amount, TerminalLine(terminalSize.x, TerminalChar(0)));
+                // Move the lines on screen down, leaving blank lines at the top
+                amount = std::min(amount, terminalSize.y);
+                for (int y = terminalSize.y; y > amount; y--) {
+                    std::swap(GetLine(y), GetLine(y - amount));
+                }
+
+                for (int y = 1; y <= amount; y++) {
+                    GetLine(y).assign(terminalSize.x, TerminalChar(0));
+                }
+                MarkLinesDirty(1, terminalSize.y);
                 break;
             }
             default:
@@ -439,9 +550,52 @@ void ParseChar(char ch) {
     }
 }
 
+// Print a run of printable ASCII, a line at a time
+void PrintASCII(const char* str, size_t length) {
+    while (length) {
+        if (cursorPosition.x > terminalSize.x) {
+            cursorPosition.x = 1;
+            AdvanceCursorY();
+        }
+
+        int count = std::min<size_t>(length, terminalSize.x - cursorPosition.x + 1);
+        if (count <= 0) {
+            return; // Too small to show anything
+        }
+
+        TerminalLine& line = GetLine(cursorPosition.y);
+        for (int i = 0; i < count; i++) {
+            line.at(cursorPosition.x - 1 + i) = TerminalChar(static_cast<uint8_t>(str[i]));
+            MarkDirty(cursorPosition.x + i, cursorPosition.y);
+        }
+
+        // Same as PrintChar, the cursor is left past the end of the line until the next char
+        cursorPosition.x += count;
+        str += count;
+        length -= count;
+    }
+}
+
+// Parse output from the shell, printable ASCII is the common case so is printed in runs
+void ParseText(const char* str, size_t length) {
+    while (length) {
+        if (parseState == State_Normal) {
+            size_t run = Lemon::ASCIIPrintablePrefix(str, length);
+            if (run) {
+                PrintASCII(str, run);
+                str += run;
+                length -= run;
+                continue;
+            }
+        }
+
+        ParseChar(*str);
+        str++;
+        length--;
+    }
+}
+
 bool shouldPaint = true;
-std::mutex paintMutex;
-std::mutex bufferMutex;
 
 bool isOpen = true;
 int ptyMasterFd = -1;
@@ -450,28 +604,15 @@ void SIGCHLDHandler(int){
     isOpen = false; // Shell has closed
 }
 
-void* PTYThread() {
-    pollfd pollFd = {.fd = ptyMasterFd, .events = POLLIN};
-    while (isOpen) {
-        if (poll(&pollFd, 1, 500000) > 0) {
-            char buf[512];
-            ssize_t r;
-            bufferMutex.lock();
-            while ((r = read(ptyMasterFd, buf, 512)) > 0) {
-                int i = 0;
-                while (r--) {
-                    ParseChar(buf[i++]);
-                }
-            }
-            bufferMutex.unlock();
-
-            std::unique_lock lock(paintMutex);
-            terminalWindow->Paint();
-            shouldPaint = false;
-        }
+// Called by the event loop when the shell has written to the PTY
+void OnPTYReadable() {
+    static char buf[PTY_READ_SIZE]; // Read as much as the PTY has at once
+    ssize_t r;
+    while ((r = read(ptyMasterFd, buf, PTY_READ_SIZE)) > 0) {
+        ParseText(buf, r);
     }
 
-    return nullptr;
+    shouldPaint = true;
 }
 
 int main(int argc, char** argv) {
@@ -490,8 +631,7 @@ int main(int argc, char** argv) {
         Vector2i{terminalWindow->GetSize().x / characterSize.x, terminalWindow->GetSize().y / characterSize.y};
 
     ClearScrollbackBuffer();
-    assert(FirstLine() == scrollbackBuffer.begin());
-    assert(&GetLine(1) == &scrollbackBuffer.at(0));
+    assert(&GetLine(1) == &scrollbackBuffer[0]);
 
     int ptySlaveFd = -1;
 
@@ -558,7 +698,11 @@ int main(int argc, char** argv) {
 
     close(ptySlaveFd);
 
-    std::thread ptyThread(PTYThread);
+    // The PTY and window server are waited on together, rather than by a thread each
+    Lemon::EventLoop eventLoop;
+    eventLoop.WatchFile(ptyMasterFd, OnPTYReadable);
+    eventLoop.Watch(Lemon::WindowServer::Instance(), []() {});
+
     while (isOpen) {
         Lemon::WindowServer::Instance()->Poll();
 
@@ -606,27 +750,20 @@ int main(int argc, char** argv) {
 
         if (shouldResize) {
             int linesToAdd = newSize.y / characterSize.y - terminalSize.y;
-            int colsToAdd = newSize.x / characterSize.x - terminalSize.x;
-
-            // Make sure we repaint the window and stop other thread from painting
-            std::unique_lock lock(bufferMutex);
-            std::unique_lock lockPaint(paintMutex);
 
             terminalSize = Vector2i{newSize.x / characterSize.x, newSize.y / characterSize.y};
 
-            for (auto it = FirstLine(); it != scrollbackBuffer.end(); ++it) {
-                if (colsToAdd > 0) {
-                    it->insert(it->end(), colsToAdd, TerminalChar(0));
-                }
-
-                it->resize(terminalSize.x);
-            }
-
             while (linesToAdd > 0) {
                 AddLine();
                 linesToAdd--;
             }
 
+            // GetLine fills new columns with blank cells
+            for (int y = 1; y <= terminalSize.y; y++) {
+                GetLine(y);
+            }
+            MarkAllDirty();
+
             // Round to nearest character
             terminalWindow->Resize({terminalSize.x * characterSize.x, terminalSize.y * characterSize.y});
             wSz = {
@@ -641,10 +778,14 @@ int main(int argc, char** argv) {
             shouldPaint = true;
         }
 
-        Lemon::WindowServer::Instance()->Wait();
+        if (shouldPaint) {
+            terminalWindow->Paint();
+            shouldPaint = false;
+        }
+
+        eventLoop.RunOnce();
     }
 
-    ptyThread.join();
     delete terminalWindow;
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,351 @@
+#pragma once
+
+#include <algorithm>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <Lemon/Core/Benchmark.h>
+#include <Lemon/Core/SHA.h>
+#include <Lemon/System/Spawn.h>
+#include <lemon/syscall.h>
+
+// Benchmarks are run with "tests.lef bench [name]", each result is printed on one line (see Lemon::Benchmark::Report)
+// so runs can be compared before and after a kernel change.
+// Every sample times the given iterations, the best sample is usually the most stable figure.
+// Latencies are in nanoseconds per iteration, throughput in MB/s.
+
+#define BENCH_SAMPLES 7
+#define BENCH_EXIT_ARG "bench-exit" // Exits straight away, used for the exec benchmarks
+
+#define BENCH_PIPE_BYTES (4 * 1024 * 1024)
+#define BENCH_TOUCH_SIZE (16 * 1024 * 1024)
+#define BENCH_HASH_SIZE (16 * 1024 * 1024)
+#define BENCH_HASH_BUFFERS 64 // Buffers hashed together by HashMany, BENCH_HASH_SIZE in total
+
+namespace Benchmark {
+
+const char* executablePath = "/system/bin/tests.lef";
+
+using Lemon::Benchmark::NowNs;
+
+inline void ReportLatency(const char* name, unsigned iterations, double* samples) {
+    Lemon::Benchmark::Report(name, iterations, samples, BENCH_SAMPLES, "ns", false);
+}
+
+inline void ReportThroughput(const char* name, unsigned iterations, double* samples) {
+    Lemon::Benchmark::Report(name, iterations, samples, BENCH_SAMPLES, "MB/s", true);
+}
+
+// Time op (returning 0 on success) over BENCH_SAMPLES samples of iterations, after a warm up sample
+template <typename F> int MeasureLatency(const char* name, unsigned iterations, F&& op) {
+    double samples[BENCH_SAMPLES];
+    for (int s = -1; s < BENCH_SAMPLES; s++) {
+        uint64_t start = NowNs();
+        for (unsigned i = 0; i < iterations; i++) {
+            if (op()) {
+                printf("bench %s failed: %s\n", name, strerror(errno));
+                return 1;
+            }
+        }
+        uint64_t end = NowNs();
+
+        if (s >= 0) {
+            samples[s] = static_cast<double>(end - start) / iterations;
+        }
+    }
+
+    ReportLatency(name, iterations, samples);
+    return 0;
+}
+
+int NullSyscall() {
+    return MeasureLatency("null-syscall", 100000, []() -> int {
+        syscall(SYS_GETPID);
+        return 0;
+    });
+}
+
+// A child writes BENCH_PIPE_BYTES in writes of size bytes for each sample whilst we read it
+int PipeThroughput(size_t size) {
+    char name[32];
+    snprintf(name, sizeof(name), "pipe-throughput-%zu", size);
+
+    int fds[2];
+    if (pipe(fds)) {
+        perror("pipe");
+        return 1;
+    }
+
+    pid_t child = fork();
+    if (!child) {
+        close(fds[0]);
+
+        uint8_t* buffer = new uint8_t[size];
+        memset(buffer, 0xAB, size);
+        for (int s = -1; s < BENCH_SAMPLES; s++) {
+            for (size_t written = 0; written < BENCH_PIPE_BYTES;) {
+                ssize_t r = write(fds[1], buffer, std::min(size, BENCH_PIPE_BYTES - written));
+                if (r <= 0) {
+                    _exit(1);
+                }
+                written += r;
+            }
+        }
+        _exit(0);
+    }
+    close(fds[1]);
+
+    uint8_t* buffer = new uint8_t[size];
+    double samples[BENCH_SAMPLES];
+    for (int s = -1; s < BENCH_SAMPLES; s++) {
+        uint64_t start = NowNs();
+        for (size_t received = 0; received < BENCH_PIPE_BYTES;) {
+            ssize_t r = read(fds[0], buffer, std::min(size, BENCH_PIPE_BYTES - received));
+            if (r <= 0) {
+                printf("bench %s failed: %s\n", name, r ? strerror(errno) : "Unexpected end of pipe");
+                return 1;
+            }
+            received += r;
+        }
+        uint64_t end = NowNs();
+
+        if (s >= 0) {
+            samples[s] = (BENCH_PIPE_BYTES / (1024.0 * 1024.0)) / ((end - start) / 1000000000.0);
+        }
+    }
+
+    delete[] buffer;
+    close(fds[0]);
+    waitpid(child, nullptr, 0);
+
+    ReportThroughput(name, BENCH_PIPE_BYTES / size, samples);
+    return 0;
+}
+
+// Round trip of a byte through a child and back
+int PipePingPong() {
+    int request[2];
+    int response[2];
+    if (pipe(request) || pipe(response)) {
+        perror("pipe");
+        return 1;
+    }
+
+    pid_t child = fork();
+    if (!child) {
+        close(request[1]);
+        close(response[0]);
+
+        char c;
+        while (read(request[0], &c, 1) == 1) {
+            if (write(response[1], &c, 1) != 1) {
+                _exit(1);
+            }
+        }
+        _exit(0);
+    }
+    close(request[0]);
+    close(response[1]);
+
+    int e = MeasureLatency("pipe-pingpong", 10000, [&]() -> int {
+        char c = 'p';
+        return write(request[1], &c, 1) != 1 || read(response[0], &c, 1) != 1;
+    });
+
+    close(request[1]);
+    close(response[0]);
+    waitpid(child, nullptr, 0);
+    return e;
+}
+
+int Fork() {
+    return MeasureLatency("fork-exit-wait", 200, []() -> int {
+        pid_t child = fork();
+        if (!child) {
+            _exit(0);
+        }
+
+        return child < 0 || waitpid(child, nullptr, 0) != child;
+    });
+}
+
+int ForkExec() {
+    return MeasureLatency("fork-exec-wait", 50, []() -> int {
+        pid_t child = fork();
+        if (!child) {
+            char* const argv[] = {const_cast<char*>(executablePath), const_cast<char*>(BENCH_EXIT_ARG), nullptr};
+            execv(executablePath, argv);
+            _exit(1);
+        }
+
+        int status = 0;
+        return child < 0 || waitpid(child, &status, 0) != child || WEXITSTATUS(status);
+    });
+}
+
+int Spawn() {
+    return MeasureLatency("spawn-wait", 50, []() -> int {
+        char* const argv[] = {const_cast<char*>(executablePath), const_cast<char*>(BENCH_EXIT_ARG), nullptr};
+        pid_t child = Lemon::Spawn(executablePath, argv);
+
+        int status = 0;
+        return child < 0 || waitpid(child, &status, 0) != child || WEXITSTATUS(status);
+    });
+}
+
+volatile sig_atomic_t signalsReceived = 0;
+
+// From sending a signal to ourselves until the handler has run and returned
+int Signal() {
+    struct sigaction action = {};
+    action.sa_handler = [](int) { signalsReceived = signalsReceived + 1; };
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGUSR1, &action, nullptr)) {
+        perror("sigaction");
+        return 1;
+    }
+
+    int e = MeasureLatency("signal-self", 10000, []() -> int {
+        sig_atomic_t received = signalsReceived;
+        if (kill(getpid(), SIGUSR1)) {
+            return 1;
+        }
+
+        // Delivered on the way out of kill
+        return signalsReceived == received;
+    });
+
+    signal(SIGUSR1, SIG_DFL);
+    return e;
+}
+
+int MapUnmap() {
+    return MeasureLatency("mmap-munmap-64k", 10000, []() -> int {
+        void* p = mmap(nullptr, 0x10000, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return p == MAP_FAILED || munmap(p, 0x10000);
+    });
+}
+
+// First write to each 4KB page of fresh anonymous memory, per page.
+// Includes the kernel's fault-around and 2MB pages, as seen by a program.
+int AnonymousTouch() {
+    constexpr unsigned pages = BENCH_TOUCH_SIZE / 4096;
+
+    double samples[BENCH_SAMPLES];
+    for (int s = -1; s < BENCH_SAMPLES; s++) {
+        uint8_t* p = reinterpret_cast<uint8_t*>(
+            mmap(nullptr, BENCH_TOUCH_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (p == MAP_FAILED) {
+            perror("mmap");
+            return 1;
+        }
+
+        uint64_t start = NowNs();
+        for (unsigned i = 0; i < pages; i++) {
+            p[i * 4096] = 1;
+        }
+        uint64_t end = NowNs();
+
+        munmap(p, BENCH_TOUCH_SIZE);
+        if (s >= 0) {
+            samples[s] = static_cast<double>(end - start) / pages;
+        }
+    }
+
+    ReportLatency("anon-first-touch", pages, samples);
+    return 0;
+}
+
+// SHA-256 of BENCH_HASH_SIZE as one stream and as many smaller buffers
+int SHA256Throughput() {
+    uint8_t* data = new uint8_t[BENCH_HASH_SIZE];
+    memset(data, 0xAB, BENCH_HASH_SIZE);
+
+    constexpr size_t bufferSize = BENCH_HASH_SIZE / BENCH_HASH_BUFFERS;
+    const void* buffers[BENCH_HASH_BUFFERS];
+    size_t lengths[BENCH_HASH_BUFFERS];
+    uint8_t digests[BENCH_HASH_BUFFERS][SHA256_HASH_SIZE];
+    for (int i = 0; i < BENCH_HASH_BUFFERS; i++) {
+        buffers[i] = data + i * bufferSize;
+        lengths[i] = bufferSize;
+    }
+
+    double single[BENCH_SAMPLES];
+    double many[BENCH_SAMPLES];
+    for (int s = -1; s < BENCH_SAMPLES; s++) {
+        uint64_t start = NowNs();
+        SHA256 sha;
+        sha.Update(data, BENCH_HASH_SIZE);
+        sha.GetDigest(digests[0]);
+        uint64_t end = NowNs();
+
+        SHA256::HashMany(buffers, lengths, digests, BENCH_HASH_BUFFERS);
+        uint64_t manyEnd = NowNs();
+
+        if (s >= 0) {
+            single[s] = (BENCH_HASH_SIZE / (1024.0 * 1024.0)) / ((end - start) / 1000000000.0);
+            many[s] = (BENCH_HASH_SIZE / (1024.0 * 1024.0)) / ((manyEnd - end) / 1000000000.0);
+        }
+    }
+
+    delete[] data;
+
+    ReportThroughput("sha256", 1, single);
+    ReportThroughput("sha256-many", BENCH_HASH_BUFFERS, many);
+    return 0;
+}
+
+struct Entry {
+    const char* name;
+    int (*func)();
+};
+
+const Entry benchmarks[] = {
+    {"syscall", NullSyscall},
+    {"pipe", []() -> int {
+         int e = 0;
+         for (size_t size : {64, 512, 4096, 65536}) {
+             e |= PipeThroughput(size);
+         }
+         return e | PipePingPong();
+     }},
+    {"process", []() -> int { return Fork() | ForkExec() | Spawn(); }},
+    {"signal", Signal},
+    {"memory", []() -> int { return MapUnmap() | AnonymousTouch(); }},
+    {"hash", SHA256Throughput},
+};
+
+// Run every benchmark or only the group called only, returns 0 on success
+int Run(const char* only) {
+    int e = 0;
+    bool found = false;
+    for (const Entry& bench : benchmarks) {
+        if (only && strcmp(only, bench.name)) {
+            continue;
+        }
+
+        found = true;
+        e |= bench.func();
+    }
+
+    if (!found) {
+        printf("Unknown benchmark '%s', expected one of:", only);
+        for (const Entry& bench : benchmarks) {
+            printf(" %s", bench.name);
+        }
+        printf("\n");
+        return 1;
+    }
+
+    return e;
+}
+
+} // namespace Benchmark
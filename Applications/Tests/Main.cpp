@@ -2,19 +2,23 @@
 
 #include <unordered_map>
 
+#include <string.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 #include "Audio.h"
+#include "Benchmark.h"
 #include "Pipe.h"
 #include "Terminal.h"
 #include "Syscall.h"
+#include "Unicode.h"
 
 const std::unordered_map<std::string, Test> tests = {
     {"pipe", pipeTest},
     {"terminal", termTest},
     {"audio", audioTest},
     {"syscall", syscallTest},
+    {"unicode", unicodeTest},
 };
 
 void ExecuteTest(const Test& test) {
@@ -33,6 +37,13 @@ void ExecuteTest(const Test& test) {
 }
 
 int main(int argc, char** argv) {
+    if (argc > 1 && !strcmp(argv[1], BENCH_EXIT_ARG)) {
+        return 0;
+    } else if (argc > 1 && !strcmp(argv[1], "bench")) {
+        // Benchmarks run in this process, so results are not mixed up with the OK/FAIL lines
+        return Benchmark::Run((argc > 2) ? argv[2] : nullptr);
+    }
+
     if (argc <= 1) {
         for (auto& test : tests) {
             ExecuteTest(test.second);
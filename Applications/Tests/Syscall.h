@@ -6,6 +6,7 @@
 #include <unistd.h>
 #include <time.h>
 
+#include <Lemon/System/PerfCounters.h>
 #include <lemon/syscall.h>
 
 inline static timespec operator-(const timespec& l, const timespec& r) {
@@ -29,11 +30,29 @@ int RunSyscallTest() {
     timespec t2;
     long writeTime = 0;
 
+    // Hardware events are optional, not every CPU (or VM) has performance counters
+    Lemon::PerfCounters perf;
+    bool countEvents = !perf.Start();
+    uint64_t events[PerfEventCount] = {};
+
     for(int i = 0; i < 5; i++) {
+        uint64_t before[PerfEventCount];
+        uint64_t after[PerfEventCount];
+        if(countEvents) {
+            perf.Read(before);
+        }
+
         clock_gettime(CLOCK_BOOTTIME, &t1);
         write(tempFile, buf, 0);
         clock_gettime(CLOCK_BOOTTIME, &t2);
         writeTime += uSecondsFromTimespec(t2 - t1);
+
+        if(countEvents) {
+            perf.Read(after);
+            for(int j = 0; j < PerfEventCount; j++) {
+                events[j] += after[j] - before[j];
+            }
+        }
     }
 
     writeTime /= 5;
@@ -42,6 +61,15 @@ int RunSyscallTest() {
     unlink("/tmp/syscallbenchmark");
 
     printf("empty write: avg %ld us\n", writeTime);
+    if(countEvents) {
+        perf.Stop();
+
+        for(int i = 0; i < PerfEventCount; i++) {
+            if(perf.IsCounting(i)) {
+                printf("empty write: avg %lu %s\n", events[i] / 5, Lemon::PerfCounters::EventName(i));
+            }
+        }
+    }
     return 0;
 }
 
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <Lemon/Core/Unicode.h>
+
+#include <stdio.h>
+
+#include "Test.h"
+
+// UTF8Strlen and UTF8SkipCodepoints must agree with UTF8ToUTF32 on malformed input,
+// which gives one U+FFFD for each byte of an invalid or truncated sequence
+int RunUnicodeTest() {
+    const std::string inputs[] = {
+        "Hello, world!",
+        "\xc3\xa9t\xc3\xa9 \xe2\x82\xac \xf0\x9f\x8d\x8b",                      // Valid multibyte
+        "\x80\xbf stray continuations",                                         // Continuations without a lead
+        "\xe2\x82 truncated \xf0\x9f\x8d",                                      // Truncated sequences
+        "\xc0\xaf overlong \xed\xa0\x80 surrogate \xf4\x90\x80\x80 too large", // Decode to invalid codepoints
+        "Padding past sixteen bytes to use the SIMD path \xe2\x82\xac\xe2\x82\xff\xfe\xc3", // Invalid after 16 bytes
+    };
+
+    int e = 0;
+    for (const std::string& input : inputs) {
+        std::vector<int32_t> codepoints = Lemon::UTF8ToUTF32(input);
+        if (Lemon::UTF8Strlen(input) != codepoints.size() ||
+            Lemon::UTF8Strlen(input.data(), input.length()) != codepoints.size()) {
+            printf("UTF8Strlen gave %u for \"%s\", expected %zu\n", Lemon::UTF8Strlen(input), input.c_str(),
+                   codepoints.size());
+            e = 1;
+        }
+
+        // Skipping every codepoint lands exactly on the end
+        if (Lemon::UTF8SkipCodepoints(input, codepoints.size()) != input.length()) {
+            printf("UTF8SkipCodepoints did not reach the end of \"%s\"\n", input.c_str());
+            e = 1;
+        }
+    }
+
+    return e;
+}
+
+static Test unicodeTest = {
+    .func = RunUnicodeTest,
+    .prettyName = "UTF-8 length of malformed input",
+};
@@ -27,6 +27,7 @@ int main(int argc, char** argv) {
     ctx->surfaceLock.unlock();
     
     ctx->FlipBuffers = FlipBuffers;
+    ctx->SetVideoWindow(window);
 
     if(int e = ctx->PlayTrack(argv[1]); e) {
         return e;
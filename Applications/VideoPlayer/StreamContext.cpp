@@ -1,9 +1,12 @@
 #include "StreamContext.h"
 
 #include <Lemon/Core/Logger.h>
+#include <Lemon/GUI/Window.h>
 #include <Lemon/Graphics/Surface.h>
 #include <Lemon/System/ABI/Audio.h>
 
+#include <algorithm>
+
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -82,6 +85,10 @@ void StreamContext::PlayAudio() {
             auto& buffer = buffers[currentSampleBuffer];
             m_lastTimestamp = buffer.timestamp;
 
+            // The buffer starts playing about now,
+            // write only blocks once the audio driver has enough samples queued
+            SetAudioClock(buffer.startTimestamp);
+
             // Write the buffer to the device file
             // If the buffer queue is full,
             // waiting for the audio hardware to process the audio,
@@ -199,14 +206,15 @@ void StreamContext::SetDisplaySurface(Surface* s, Rect blitRect) {
 }
 
 void StreamContext::DecodeVideo(AVPacket* packet) {
-    AVFrame* frame = av_frame_alloc();
-
     // Send the packet to the decoder
     if (int ret = avcodec_send_packet(m_vcodec, packet); ret) {
         Lemon::Logger::Error("Could not send packet for decoding");
+        av_packet_unref(packet);
         return;
     }
 
+    AVFrame* frame = av_frame_alloc();
+
     ssize_t ret = 0;
     while (!IsDecoderPacketInvalid() && ret >= 0) {
         // Decodes the audio
@@ -221,21 +229,95 @@ void StreamContext::DecodeVideo(AVPacket* packet) {
             break;
         }
 
-        std::unique_lock lockSurface{surfaceLock};
+        // Wait for the presenter to make room in the queue
+        std::unique_lock lockQueue{m_frameQueueLock};
+        m_frameQueueCondition.wait(lockQueue, [this]() -> bool {
+            return m_frameQueue.size() < StreamContext_MAX_QUEUED_FRAMES || IsDecoderPacketInvalid();
+        });
 
-        // Decode video frame
-        int stride = 4 * m_surface->width;
-        uint8_t* buffer = m_surface->buffer + m_surfaceBlitRegion.y * stride + m_surfaceBlitRegion.x * 4;
+        if (IsDecoderPacketInvalid()) {
+            av_frame_unref(frame);
+            break;
+        }
 
-        sws_scale(m_rescaler, frame->data, frame->linesize, 0, m_vcodec->height, &buffer, &stride);
-        FlipBuffers();
+        // The presenter frees the frame once it has been shown
+        m_frameQueue.push_back(frame);
+        frame = av_frame_alloc();
 
-        av_frame_unref(frame);
+        lockQueue.unlock();
+        m_frameQueueCondition.notify_all();
     }
 
+    av_frame_free(&frame);
     av_packet_unref(packet);
 }
 
+void StreamContext::PresentVideo() {
+    while (!m_shouldThreadsDie) {
+        std::unique_lock lockQueue{m_frameQueueLock};
+        if (m_frameQueue.empty()) {
+            m_frameQueueCondition.wait_for(lockQueue, std::chrono::milliseconds(100));
+            continue;
+        }
+
+        AVFrame* frame = m_frameQueue.front();
+        float clock = AudioClock();
+
+        // Wait for the frame to be due, waking early if the queue gets flushed.
+        // Whilst paused the audio clock stands still so keep checking for a seek or stop
+        if (float delay = VideoFrameTimestamp(frame) - clock; delay > 0) {
+            m_frameQueueCondition.wait_for(lockQueue, std::chrono::duration<float>(std::min(delay, 0.02f)));
+            continue;
+        }
+
+        m_frameQueue.pop_front();
+
+        // If the next frame is due as well we are behind,
+        // so skip this one to catch up with the audio
+        bool shouldDrop = !m_frameQueue.empty() && VideoFrameTimestamp(m_frameQueue.front()) <= clock;
+
+        lockQueue.unlock();
+        m_frameQueueCondition.notify_all();
+
+        if (shouldDrop) {
+            m_droppedFrames++;
+        } else {
+            std::unique_lock lockSurface{surfaceLock};
+
+            // The rescaler is freed once the decoder has stopped
+            if (m_rescaler && m_useVideoSurface) {
+                // LemonWM scales the frame and converts it to RGB as it composites
+                Lemon::Graphics::VideoFrame video = m_videoWindow->VideoBackFrame();
+                sws_scale(m_rescaler, frame->data, frame->linesize, 0, frame->height, video.planes, video.strides);
+                m_videoWindow->PresentVideoFrame(m_surfaceBlitRegion);
+            } else if (m_rescaler) {
+                int stride = 4 * m_surface->width;
+                uint8_t* buffer = m_surface->buffer + m_surfaceBlitRegion.y * stride + m_surfaceBlitRegion.x * 4;
+
+                sws_scale(m_rescaler, frame->data, frame->linesize, 0, frame->height, &buffer, &stride);
+                FlipBuffers();
+            }
+        }
+
+        av_frame_free(&frame);
+    }
+}
+
+float StreamContext::VideoFrameTimestamp(AVFrame* frame) const {
+    return frame->best_effort_timestamp * av_q2d(m_videoStream->time_base);
+}
+
+void StreamContext::FlushFrameQueue() {
+    std::unique_lock lockQueue{m_frameQueueLock};
+    for (AVFrame* frame : m_frameQueue) {
+        av_frame_free(&frame);
+    }
+    m_frameQueue.clear();
+
+    lockQueue.unlock();
+    m_frameQueueCondition.notify_all();
+}
+
 // Turns encoded audio data (such as MPEG-2 or FLAC) into raw audio samples
 void StreamContext::DecodeAudio(AVPacket* packet) {
     AVFrame* frame = av_frame_alloc();
@@ -266,12 +348,6 @@ void StreamContext::DecodeAudio(AVPacket* packet) {
     }
 
     av_packet_unref(packet);
-
-    // If the decoder should still run
-    // and m_requestSeek is true, seek to a new point in the audio
-    if (m_isDecoderRunning && m_requestSeek) {
-        DecoderDoSeek();
-    }
 }
 
 void StreamContext::Decode() {
@@ -279,6 +355,8 @@ void StreamContext::Decode() {
     // The player thread sends audio to the driver
     // whilst this thread decodes the audio data
     std::thread playerThread(&StreamContext::PlayAudio, this);
+    // The presenter thread shows the video frames in time with the audio
+    std::thread presenterThread(&StreamContext::PresentVideo, this);
 
     while (!m_shouldThreadsDie) {
         {
@@ -333,6 +411,9 @@ void StreamContext::Decode() {
         // some may still contain old audio data
         FlushSampleBuffers();
 
+        SetAudioClock(0);
+        m_droppedFrames = 0;
+
         if (swr_init(m_resampler)) {
             // If we failed to initialize the resampler,
             // set decoder as not running, preventing any audio from being decoded
@@ -356,21 +437,43 @@ void StreamContext::Decode() {
             } else {
                 av_packet_unref(packet);
             }
+
+            // If the decoder should still run
+            // and m_requestSeek is true, seek to a new point in the file
+            if (m_isDecoderRunning && m_requestSeek) {
+                DecoderDoSeek();
+            }
         }
 
+        av_packet_free(&packet);
+
         // If we got to the end of file (did not encounter errors)
         // let the main thread know to play the next track
         if (frameResult == AVERROR_EOF) {
+            // Let the presenter show the remaining frames
+            std::unique_lock lockQueue{m_frameQueueLock};
+            m_frameQueueCondition.wait(lockQueue,
+                                       [this]() -> bool { return m_frameQueue.empty() || IsDecoderPacketInvalid(); });
+
             // We finished playing
             m_shouldPlayNextTrack = true;
         }
 
+        FlushFrameQueue();
+        if (m_droppedFrames) {
+            Lemon::Logger::Debug("Dropped {} video frames", m_droppedFrames);
+        }
+
         // Clean up after ourselves
-        // Set the decoder as not running
-        std::unique_lock lockStatus{m_decoderStatusLock};
+        // Set the decoder as not running,
+        // the surface lock is held so the presenter is not using the rescaler
+        std::scoped_lock lockStatus{surfaceLock, m_decoderStatusLock};
         m_isDecoderRunning = false;
         numValidBuffers = 0;
 
+        sws_freeContext(m_rescaler);
+        m_rescaler = nullptr;
+
         // Free the resampler
         swr_free(&m_resampler);
         m_resampler = nullptr;
@@ -387,8 +490,9 @@ void StreamContext::Decode() {
         m_decoderLock.unlock();
     }
 
-    // Wait for playerThread to finish
+    // Wait for playerThread and presenterThread to finish
     playerThread.join();
+    presenterThread.join();
 }
 
 void StreamContext::DecoderDecodeFrame(AVFrame* frame) {
@@ -415,6 +519,9 @@ void StreamContext::DecoderDecodeFrame(AVFrame* frame) {
     }
 
     auto* buffer = &sampleBuffers[bufferIndex];
+    if (!buffer->samples) {
+        buffer->startTimestamp = frame->best_effort_timestamp * av_q2d(m_audioStream->time_base);
+    }
 
     // Get the position in the buffer:
     // samples * outputSampleSize * pcmChannels
@@ -429,7 +536,7 @@ void StreamContext::DecoderDecodeFrame(AVFrame* frame) {
     buffer->samples += samplesWritten;
 
     // Set the timestamp for the buffer
-    buffer->timestamp = frame->best_effort_timestamp / m_audioStream->time_base.den;
+    buffer->timestamp = frame->best_effort_timestamp * av_q2d(m_audioStream->time_base);
 }
 
 int StreamContext::DecoderGetNextSampleBufferOrWait(int samplesToWrite) {
@@ -499,11 +606,16 @@ void StreamContext::DecoderDoSeek() {
     avcodec_flush_buffers(m_acodec);
     swr_convert(m_resampler, NULL, 0, NULL, 0);
 
+    // Throw away any video frames from before the seek
+    avcodec_flush_buffers(m_vcodec);
+    FlushFrameQueue();
+
     // Seek to the new timestamp
     float timestamp = m_seekTimestamp;
     av_seek_frame(m_avfmt, m_audioStreamIndex, (long)(timestamp / av_q2d(m_audioStream->time_base)), 0);
 
     m_lastTimestamp = m_seekTimestamp;
+    SetAudioClock(m_seekTimestamp);
     // Set m_requestSeek to false indicating that seeking has finished
     m_requestSeek = false;
 }
@@ -515,10 +627,32 @@ void StreamContext::InitializeRescaler() {
         sws_freeContext(m_rescaler);
     }
 
+    if (m_useVideoSurface) {
+        // Only converted to planar YUV, the size of the window does not matter
+        m_rescaler = sws_getContext(m_vcodec->width, m_vcodec->height, m_vcodec->pix_fmt, m_vcodec->width,
+                                    m_vcodec->height, AV_PIX_FMT_YUV420P, SWS_BILINEAR, NULL, NULL, NULL);
+        return;
+    }
+
     m_rescaler = sws_getContext(m_vcodec->width, m_vcodec->height, m_vcodec->pix_fmt, m_surface->width,
                                 m_surface->height, AV_PIX_FMT_RGB32, SWS_BILINEAR, NULL, NULL, NULL);
 }
 
+void StreamContext::InitializeVideoSurface() {
+    m_useVideoSurface = false;
+    if (!m_videoWindow) {
+        return;
+    }
+
+    if (int e = m_videoWindow->CreateVideoSurface(Lemon::Graphics::VideoFormatYUV420, {m_vcodec->width, m_vcodec->height});
+        e) {
+        Lemon::Logger::Warning("Failed to create video surface ({}), scaling frames into the window", e);
+        return;
+    }
+
+    m_useVideoSurface = true;
+}
+
 float StreamContext::PlaybackProgress() const {
     if (!m_isDecoderRunning) {
         return 0;
@@ -528,14 +662,39 @@ float StreamContext::PlaybackProgress() const {
     return m_lastTimestamp;
 }
 
+float StreamContext::AudioClock() {
+    std::scoped_lock lockClock{m_audioClockLock};
+    if (!m_shouldPlayAudio) {
+        return m_audioClockBase;
+    }
+
+    return m_audioClockBase + std::chrono::duration<float>(std::chrono::steady_clock::now() - m_audioClockTime).count();
+}
+
+void StreamContext::SetAudioClock(float timestamp) {
+    std::scoped_lock lockClock{m_audioClockLock};
+    m_audioClockBase = timestamp;
+    m_audioClockTime = std::chrono::steady_clock::now();
+}
+
 void StreamContext::PlaybackStart() {
     std::unique_lock lockStatus{m_playerStatusLock};
-    m_shouldPlayAudio = true;
+    {
+        // Resume the audio clock from where it was paused
+        std::scoped_lock lockClock{m_audioClockLock};
+        m_audioClockTime = std::chrono::steady_clock::now();
+        m_shouldPlayAudio = true;
+    }
     playerShouldRunCondition.notify_all();
 }
 
 void StreamContext::PlaybackPause() {
     std::unique_lock lockStatus{m_playerStatusLock};
+    std::scoped_lock lockClock{m_audioClockLock};
+    if (m_shouldPlayAudio) {
+        // Stop the audio clock
+        m_audioClockBase += std::chrono::duration<float>(std::chrono::steady_clock::now() - m_audioClockTime).count();
+    }
     m_shouldPlayAudio = false;
 }
 
@@ -547,6 +706,7 @@ void StreamContext::PlaybackStop() {
         m_shouldPlayAudio = false;
         // Make the decoder stop waiting for a free sample buffer
         decoderWaitCondition.notify_all();
+        m_frameQueueCondition.notify_all();
     }
 }
 
@@ -557,6 +717,7 @@ void StreamContext::PlaybackSeek(float timestamp) {
 
         // Let the decoder thread know that we want to seek
         decoderWaitCondition.notify_all();
+        m_frameQueueCondition.notify_all();
         while (m_requestSeek)
             usleep(1000); // Wait for seek to finish, just wait 1ms as not to hog the CPU
     }
@@ -643,11 +804,19 @@ int StreamContext::PlayTrack(std::string file) {
         return 1;
     }
 
+    // Decode video on a thread per CPU (0 lets libavcodec decide),
+    // frames come out in order but the decoder works on several at once
+    m_vcodec->thread_count = std::thread::hardware_concurrency();
+    m_vcodec->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
     if (avcodec_open2(m_vcodec, decoder, NULL) < 0) {
         Lemon::Logger::Error("Failed to open codec!");
         return 1;
     }
 
+    // The decoder is not running so the presenter is not using the video surface
+    InitializeVideoSurface();
+
     m_requestSeek = false;
     m_shouldPlayNextTrack = false;
 
@@ -1,12 +1,21 @@
 #pragma once
 
+#include <chrono>
 #include <condition_variable>
+#include <deque>
 #include <mutex>
 #include <thread>
 
 #include <Lemon/Graphics/Rect.h>
 
+namespace Lemon::GUI {
+class Window;
+}
+
 #define StreamContext_NUM_SAMPLE_BUFFERS 16
+// Decoded video frames waiting to be shown,
+// bounds how far the decoder can get ahead of the presenter
+#define StreamContext_MAX_QUEUED_FRAMES 16
 
 class StreamContext {
     friend void PlayAudio(StreamContext*);
@@ -16,6 +25,8 @@ public:
         uint8_t* data;
         int samples;
 
+        // Timestamp in seconds of first frame in buffer
+        float startTimestamp;
         // Timestamp in seconds of last frame in buffer
         float timestamp;
     };
@@ -24,6 +35,10 @@ public:
     ~StreamContext();
 
     void SetDisplaySurface(struct Surface* surf, Rect blitRect);
+    // Show video through a video surface of window, composited by LemonWM from the decoded frames.
+    // Frames are scaled into the display surface when there is no window or LemonWM refuses.
+    // Must be called from the thread handling window events
+    inline void SetVideoWindow(Lemon::GUI::Window* window) { m_videoWindow = window; }
 
     inline bool HasLoadedAudio() const { return m_isDecoderRunning; }
     inline bool IsAudioPlaying() const { return m_shouldPlayAudio; }
@@ -73,6 +88,20 @@ private:
     // Perform the requested seek to m_seekTimestamp
     void DecoderDoSeek();
 
+    // Video presenter loop.
+    // Takes frames from m_frameQueue and shows them once the audio clock reaches their timestamp,
+    // dropping frames when behind
+    void PresentVideo();
+    // Timestamp in seconds of a decoded video frame
+    float VideoFrameTimestamp(struct AVFrame* frame) const;
+    // Free all frames waiting to be shown
+    void FlushFrameQueue();
+
+    // Time in seconds of the audio currently being played
+    float AudioClock();
+    // Set the audio clock to timestamp as of now
+    void SetAudioClock(float timestamp);
+
     // Audio playeer loop.
     // Reads buffers from sampleBuffers and sends them to the audio device
     void PlayAudio();
@@ -91,11 +120,14 @@ private:
     inline void FlushSampleBuffers() {
         for (int i = 0; i < StreamContext_NUM_SAMPLE_BUFFERS; i++) {
             sampleBuffers[i].samples = 0;
+            sampleBuffers[i].startTimestamp = 0;
             sampleBuffers[i].timestamp = 0;
         }
     }
 
     void InitializeRescaler();
+    // Create a video surface for the frames of the track being loaded
+    void InitializeVideoSurface();
 
     // File descriptor for pcm output
     int m_pcmOut;
@@ -129,6 +161,21 @@ private:
     // Last timestamp played by the playback thread
     float m_lastTimestamp;
 
+    // Decoded video frames in presentation order
+    std::deque<struct AVFrame*> m_frameQueue;
+    std::mutex m_frameQueueLock;
+    // Notified when a frame is queued or taken from the queue,
+    // and when a seek or stop is requested
+    std::condition_variable m_frameQueueCondition;
+    // Frames not shown as the presenter was behind
+    int m_droppedFrames = 0;
+
+    // The audio clock is the timestamp of the audio being played as of m_audioClockTime,
+    // it advances with real time whilst audio is playing
+    std::mutex m_audioClockLock;
+    float m_audioClockBase = 0;
+    std::chrono::steady_clock::time_point m_audioClockTime;
+
     struct AVFormatContext* m_avfmt = nullptr;
     struct AVCodecContext* m_acodec = nullptr;
     struct AVCodecContext* m_vcodec = nullptr;
@@ -143,4 +190,8 @@ private:
     struct Surface* m_surface;
     // Where on the surface to blit to
     Rect m_surfaceBlitRegion;
+
+    Lemon::GUI::Window* m_videoWindow = nullptr;
+    // Whether frames are presented to the video surface of m_videoWindow
+    bool m_useVideoSurface = false;
 };
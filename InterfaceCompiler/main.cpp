@@ -272,10 +272,12 @@ void Parse(){
 struct CppType{
     std::string typeName = ""; // e.g. int32_t, std::string
     bool constReference = false; // e.g. pass std::string parameters as std::string&
+    std::string parameterTypeName = ""; // Type of request parameters if not typeName, decoded in place over the message
+    bool fixedSize = true; // Encoded as sizeof(typeName) bytes, false for strings which are prefixed with their length
 };
 
 std::map<Type, CppType> cppTypes = {
-    {TypeString, {"std::string", true}},
+    {TypeString, {"std::string", true, "std::string_view", false}},
     {TypeBool, {"bool", false}},
     {TypeU8, {"uint8_t", false}},
     {TypeU16, {"uint16_t", false}},
@@ -287,6 +289,126 @@ std::map<Type, CppType> cppTypes = {
     {TypeS64, {"int64_t", false}}
 };
 
+// First message ID of an interface, IDs below are used by Lemon::CoreMessageIDs
+static const uint64_t firstMessageID = 100;
+
+struct GeneratedParameters{
+    std::string declarations; // e.g. int64_t windowID, std::string_view title
+    std::string names; // e.g. windowID, title
+    std::string locals; // Local variables the server decodes the request into
+    std::string size; // Size of the request if all parameters have a fixed size, e.g. sizeof(int64_t) + sizeof(uint32_t)
+};
+
+GeneratedParameters GenerateParameters(const ParameterList& list){
+    GeneratedParameters generated;
+
+    std::stringstream declarations;
+    std::stringstream names;
+    std::stringstream locals;
+    std::stringstream size;
+
+    bool fixedSize = true;
+    for(auto it = list.parameters.begin(); it != list.parameters.end();){
+        auto& param = *it;
+
+        auto typeIt = cppTypes.find(param.first);
+        if(typeIt == cppTypes.end()){
+            fprintf(stderr, "No mapping for type %d!\n", param.first);
+            exit(5);
+        }
+        const CppType& type = typeIt->second;
+
+        if(type.parameterTypeName.length()){
+            // e.g. strings are passed as a std::string_view over the message buffer
+            declarations << type.parameterTypeName << " " << param.second; // TYPE IDENTIFIER
+            locals << "        " << type.parameterTypeName << " " << param.second << ";\n";
+        } else {
+            if(type.constReference){
+                declarations << "const " << type.typeName << "& " << param.second; // TYPE IDENTIFIER
+            } else {
+                declarations << type.typeName << " " << param.second; // TYPE IDENTIFIER
+            }
+
+            locals << "        " << type.typeName << " " << param.second << ";\n";
+        }
+
+        if(type.fixedSize){
+            size << "sizeof(" << type.typeName << ")";
+        } else {
+            fixedSize = false;
+        }
+
+        names << param.second;
+
+        it++;
+        if(it != list.parameters.end()){
+            declarations << ", "; // Not at the end so add a separator
+            names << ", ";
+            size << " + ";
+        }
+    }
+
+    generated.declarations = declarations.str();
+    generated.names = names.str();
+    generated.locals = locals.str();
+    if(fixedSize){
+        generated.size = size.str();
+    }
+
+    return generated;
+}
+
+// Client code to queue a request without waiting for a response
+void GenerateQueueRequest(std::ostream& out, const std::string& interfaceName, const std::string& methodName, const GeneratedParameters& params){
+    std::string requestID = interfaceName + "::Request" + methodName;
+
+    if(!params.names.length()){
+        out << "        Queue(" << requestID << ", nullptr, 0);\n";
+    } else if(params.size.length()){
+        // Size is known at compile time, encode on the stack
+        out << "        uint8_t buffer[" << interfaceName << "::Request" << methodName << "Size];\n"
+            << "        Lemon::Message::Encode(buffer, sizeof(buffer), " << params.names << ");\n"
+            << "        Queue(" << requestID << ", buffer, sizeof(buffer));\n";
+    } else {
+        out << "        uint16_t size = Lemon::Message::GetSize(" << params.names << ");\n" // Get size of message
+            << "        uint8_t* buffer = new uint8_t[size];\n\n"
+            << "        Lemon::Message m = Lemon::Message(buffer, size, " << requestID << ", " << params.names << ");\n" // Create message object using our calculated size
+            << "        Queue(m.id(), m.data(), m.length());\n"; // Queue message
+    }
+}
+
+// Client code to build a request as a Lemon::Message, so several can be queued at once with Queue(messages, count)
+void GenerateRequestMessage(std::ostream& out, const std::string& interfaceName, const std::string& methodName, const GeneratedParameters& params){
+    out << "    static Lemon::Message " << methodName << "Message(" << params.declarations << ") {\n";
+    if(params.names.length()){
+        out << "        return Lemon::Message(" << interfaceName << "::Request" << methodName << ", " << params.names << ");\n";
+    } else {
+        out << "        return Lemon::Message(" << interfaceName << "::Request" << methodName << ");\n";
+    }
+    out << "    }\n\n";
+}
+
+// Server code to decode a request and call its handler
+void GenerateRequestHandler(std::ostream& out, const std::string& interfaceName, const std::string& methodName, const GeneratedParameters& params, bool synchronous){
+    out << "    static int Handle" << methodName << "(" << interfaceName << "* self, const Lemon::Handle& client, const Lemon::Message& m) {\n";
+
+    if(params.names.length()){
+        out << params.locals
+            << "        if(m.Decode(" << params.names << ")) { // Check for error decoding request\n"
+            << "            return 1;\n"
+            << "        }\n\n"
+            << "        self->On" << methodName << "(client, " << params.names << ");";
+    } else {
+        out << "        self->On" << methodName << "(client);";
+    }
+
+    if(synchronous){
+        out << " // It is expected that the handler sends the response";
+    }
+
+    out << "\n        return 0;\n"
+        << "    }\n\n";
+}
 
 void Generate(std::ostream& out){
     out << "#pragma once\n\n"
@@ -300,34 +422,32 @@ void Generate(std::ostream& out){
         
         if(st->type == StatementDeclareInterface){
             auto interfaceStatement = std::dynamic_pointer_cast<InterfaceDeclarationStatement, Statement>(st);
+            const std::string& interfaceName = interfaceStatement->interfaceName;
 
             std::stringstream client;
 
             std::stringstream server;
 
-            client << "class " << interfaceStatement->interfaceName << "Endpoint : public Lemon::Endpoint {\n"
+            client << "class " << interfaceName << "Endpoint : public Lemon::Endpoint {\n"
                 << "public:\n"
-                << "    " << interfaceStatement->interfaceName << "Endpoint(const Lemon::Handle& handle) : Endpoint(std::move(handle)) {}\n"
-                << "    " << interfaceStatement->interfaceName << "Endpoint(const std::string& interface) : Endpoint(interface) {}\n\n"
-                << "    virtual ~" << interfaceStatement->interfaceName << "Endpoint() = default;\n\n";
+                << "    " << interfaceName << "Endpoint(const Lemon::Handle& handle) : Endpoint(std::move(handle)) {}\n"
+                << "    " << interfaceName << "Endpoint(const std::string& interface) : Endpoint(interface) {}\n\n"
+                << "    virtual ~" << interfaceName << "Endpoint() = default;\n\n";
 
 			std::stringstream requestIDs; // Request IDs
             std::stringstream responseIDs; // Response IDs
+            std::stringstream requestSizes; // Sizes of requests with only fixed size parameters
 
 			std::stringstream clientRequests; // Client code for sending requests
             std::stringstream serverRequestHandlers; // Server handlers for requests
             serverRequestHandlers << "    virtual void OnPeerDisconnect(const Lemon::Handle& client) = 0;\n";
 
-            std::stringstream serverRequestCondition; // Swtich statement condition for request
-            serverRequestCondition
-                << "        case Lemon::MessagePeerDisconnect: {\n"
-                << "            OnPeerDisconnect(client);\n"
-                << "            return 0;\n"
-                << "        } ";
+            std::stringstream serverDispatchers; // Server functions decoding each request
+            std::vector<std::string> dispatchTable; // Dispatcher of each message ID from firstMessageID, responses have none
 
 			std::stringstream responses;
 
-			uint64_t nextID = 100;
+			uint64_t nextID = firstMessageID;
 
 			requestIDs << "    enum RequestID : uint64_t {\n";
 			responseIDs << "    enum ResponseID : uint64_t {\n";
@@ -337,224 +457,123 @@ void Generate(std::ostream& out){
                 {
                 case StatementAsynchronousMethod: {
                     auto async = std::dynamic_pointer_cast<ASynchronousMethod, Statement>(st);
+                    GeneratedParameters params = GenerateParameters(async->parameters);
 
-                    clientRequests << "    void " << async->methodName << "("; // void NAME (
-                    serverRequestHandlers << "    virtual void On" << async->methodName << "(const Lemon::Handle& client";
+					requestIDs << "        Request" << async->methodName << " = " << nextID++ << ",\n"; // $(interfaceName)$(methodName)% = $(nextID);
+                    if(params.size.length()){
+                        requestSizes << "    static constexpr uint16_t Request" << async->methodName << "Size = " << params.size << ";\n";
+                    }
 
                     /// For each request, the following code is generated for the server
                     ///
-                    /// type1 parameter1
-                    /// type... parameter...
-                    /// if(m.Decode(parameter1, parameter...)){
-                    ///     // Error out   
-                    /// }
+                    /// static int Handle$(methodName)(self, client, m) {
+                    ///     type1 parameter1
+                    ///     type... parameter...
+                    ///     if(m.Decode(parameter1, parameter...)){
+                    ///         // Error out
+                    ///     }
                     ///
-                    /// OnRequest(parameter1, parameter...)
-
-                    serverRequestCondition << "case " << "Request" << async->methodName << ": {\n";
-
-					requestIDs << "        Request" << async->methodName << " = " << nextID++ << ",\n"; // $(interfaceName)$(methodName)% = $(nextID);
-
-                    if(async->parameters.parameters.size()){
-                        std::stringstream parameters;
-                        std::stringstream parameterDeclarations;
-                        auto it = async->parameters.parameters.begin();
-                        while(it != async->parameters.parameters.end()){
-                            auto& param = *it;
-
-                            try{
-                                CppType type = cppTypes[param.first];
-
-                                if(type.constReference){
-                                    parameterDeclarations << "const " << type.typeName << "& " << param.second; // TYPE IDENTIFIER
-                                } else {
-                                    parameterDeclarations << type.typeName << " " << param.second; // TYPE IDENTIFIER
-                                }
+                    ///     self->On$(methodName)(parameter1, parameter...)
+                    /// }
+                    GenerateRequestHandler(serverDispatchers, interfaceName, async->methodName, params, false);
+                    dispatchTable.push_back("Handle" + async->methodName);
 
-                                serverRequestCondition << "            " << type.typeName << " " << param.second << ";\n"; // Declare local variables for message decoding
+                    clientRequests << "    void " << async->methodName << "(" << params.declarations << ") {\n"; // void NAME (
+                    GenerateQueueRequest(clientRequests, interfaceName, async->methodName, params);
+                    clientRequests << "    }\n\n";
 
-                                parameters << param.second;
-                            } catch(const std::out_of_range& e){
-                                fprintf(stderr, "No mapping for type %d!\n", param.first);
-                                exit(5);
-                            }
+                    GenerateRequestMessage(clientRequests, interfaceName, async->methodName, params);
 
-                            it++;
-                            if(it != async->parameters.parameters.end()){
-                                parameters << ", "; // Not at the end so add a separator
-                                parameterDeclarations << ", "; // Not at the end so add a separator
-                            }
-                        }
-                        
-                        std::string parameterDeclarationString = parameterDeclarations.str();
-                        std::string parameterString = parameters.str();
-
-                        serverRequestCondition
-                            << "            if(m.Decode(" << parameterString << ")) { // Check for error decoding request\n"
-                            << "                return 1;\n"
-                            << "            }\n\n"
-                            << "            On" << async->methodName << "(client, " << parameterString << ");\n"
-                            << "            return 0;\n        } ";
-
-                        clientRequests << parameterDeclarationString << ") {\n"
-                            << "        uint16_t size = Lemon::Message::GetSize(" << parameterString << ");\n" // Get size of message
-                            << "        uint8_t* buffer = new uint8_t[size];\n\n"
-                            << "        Lemon::Message m = Lemon::Message(buffer, size, " << interfaceStatement->interfaceName << "::Request" << async->methodName << ", " << parameterString << ");\n" // Create message object using our calculated size and stack buffer
-                            << "        Queue(m.id(), m.data(), m.length());\n" // Queue message
-                            << "    }\n\n";
-
-                        serverRequestHandlers << ", " << parameterDeclarationString << ") = 0;\n"; // virtual void On$(methodName)(Handle client, $(parameters)) = 0; // Pure virtual function call to the handler
-                    } else { // No parameters so avoid all the extra stuff
-                        clientRequests << ") {\n"
-                            << "        Queue(" << interfaceStatement->interfaceName << "::Request" << async->methodName << ", nullptr, 0);\n"
-                            << "    }\n\n";
-
-                        serverRequestHandlers << ") = 0;\n";
-
-                        serverRequestCondition
-                            << "            On" << async->methodName << "(client);\n"
-                            << "            return 0;\n        } ";
+                    serverRequestHandlers << "    virtual void On" << async->methodName << "(const Lemon::Handle& client"; // virtual void On$(methodName)(Handle client, $(parameters)) = 0; // Pure virtual function call to the handler
+                    if(params.declarations.length()){
+                        serverRequestHandlers << ", " << params.declarations;
                     }
+                    serverRequestHandlers << ") = 0;\n";
                     break;
                 } case StatementSynchronousMethod: {
                     auto sync = std::dynamic_pointer_cast<SynchronousMethod, Statement>(st);
+                    GeneratedParameters params = GenerateParameters(sync->parameters);
+                    GeneratedParameters returnParams = GenerateParameters(sync->returnParameters);
 
-                    std::stringstream parameters;
-                    std::stringstream parameterDeclarations;
+					requestIDs << "        Request" << sync->methodName << " = " << nextID++ << ",\n"; // $(interfaceName)$(methodName)% = $(nextID);
+					responseIDs << "        Response" << sync->methodName << " = " << nextID++ << ",\n"; // $(interfaceName)$(methodName)% = $(nextID);
+                    if(params.size.length()){
+                        requestSizes << "    static constexpr uint16_t Request" << sync->methodName << "Size = " << params.size << ";\n";
+                    }
 
-                    clientRequests << "    " << interfaceStatement->interfaceName << "::" << sync->methodName << "Response " << sync->methodName << "("; // $(interfaceName)::$(methodName)Response  $(methodName)(
-                    serverRequestHandlers << "    virtual void On" << sync->methodName << "(const Lemon::Handle& client"; // $(methodName)Response  $(methodName)(
-                    
                     /// For each request, the following code is generated for the server
                     ///
-                    /// type1 parameter1
-                    /// type... parameter...
-                    /// if(m.Decode(parameter1, parameter...)){
-                    ///     // Error out   
-                    /// }
+                    /// static int Handle$(methodName)(self, client, m) {
+                    ///     type1 parameter1
+                    ///     type... parameter...
+                    ///     if(m.Decode(parameter1, parameter...)){
+                    ///         // Error out
+                    ///     }
                     ///
-                    /// client.Queue(Lemon::Message(responseID, OnRequest(parameter1, parameter...));
-
-                    serverRequestCondition << "case " << "Request" << sync->methodName << ": {\n";
+                    ///     self->On$(methodName)(parameter1, parameter...) // Handler sends the response
+                    /// }
+                    GenerateRequestHandler(serverDispatchers, interfaceName, sync->methodName, params, true);
+                    dispatchTable.push_back("Handle" + sync->methodName);
+                    dispatchTable.push_back("nullptr"); // Response
 
-					requestIDs << "        Request" << sync->methodName << " = " << nextID++ << ",\n"; // $(interfaceName)$(methodName)% = $(nextID);
-					responseIDs << "        Response" << sync->methodName << " = " << nextID++ << ",\n"; // $(interfaceName)$(methodName)% = $(nextID);
-                    
-                    if(sync->parameters.parameters.size()){
-                        std::stringstream parameters;
-                        std::stringstream parameterDeclarations;
-                        auto it = sync->parameters.parameters.begin();
-                        while(it != sync->parameters.parameters.end()){
-                            auto& param = *it;
-
-                            try{
-                                CppType type = cppTypes[param.first];
-
-                                if(type.constReference){
-                                    parameterDeclarations << "const " << type.typeName << "& " << param.second; // TYPE IDENTIFIER
-                                } else {
-                                    parameterDeclarations << type.typeName << " " << param.second; // TYPE IDENTIFIER
-                                }
-
-                                serverRequestCondition << "            " << type.typeName << " " << param.second << ";\n"; // Declare local variables for message decoding
-
-                                parameters << param.second;
-                            } catch(const std::out_of_range& e){
-                                fprintf(stderr, "No mapping for type %d!\n", param.first);
-                                exit(5);
-                            }
+                    serverRequestHandlers << "    virtual void On" << sync->methodName << "(const Lemon::Handle& client";
+                    if(params.declarations.length()){
+                        serverRequestHandlers << ", " << params.declarations;
+                    }
+                    serverRequestHandlers << ") = 0;\n";
 
-                            it++;
-                            if(it != sync->parameters.parameters.end()){
-                                parameters << ", "; // Not at the end so add a separator
-                                parameterDeclarations << ", "; // Not at the end so add a separator
-                            }
-                        }
-                        
-                        std::string parameterDeclarationString = parameterDeclarations.str();
-                        std::string parameterString = parameters.str();
-
-                        serverRequestCondition
-                            << "            if(m.Decode(" << parameterString << ")) { // Check for error decoding request\n"
-                            << "                return 1;\n"
-                            << "            }\n\n"
-                            << "            On" << sync->methodName << "(client, " << parameterString << "); // It is expected that the handler sends the response\n"
-                            << "            return 0;\n        } ";
-
-                        clientRequests << parameterDeclarationString << ") {\n"
-                            << "        uint16_t size = Lemon::Message::GetSize(" << parameterString << ");\n"
+                    clientRequests << "    " << interfaceName << "::" << sync->methodName << "Response " << sync->methodName << "(" << params.declarations << ") {\n"; // $(interfaceName)::$(methodName)Response  $(methodName)(
+                    if(params.names.length()){
+                        clientRequests << "        uint16_t size = Lemon::Message::GetSize(" << params.names << ");\n"
                             << "        uint8_t* buffer = new uint8_t[m_msgSize];\n\n"
-                            << "        Lemon::Message m = Lemon::Message(buffer, size, " << interfaceStatement->interfaceName << "::Request" << sync->methodName << ", " << parameterString << ");\n"
-                            << "        if(Call(m, " << interfaceStatement->interfaceName << "::Response" << sync->methodName << ")) throw std::runtime_error(\"Failed calling " << sync->methodName << "\");\n\n"
-                            << "        " << interfaceStatement->interfaceName << "::" << sync->methodName << "Response response;\n" // $(methodName)Response response;
-                            << "        if(m.Decode(";
-                            
-                        // The struct may not be trivally copyable,
-                        // We pass each member individually
-                        for(auto param = sync->returnParameters.parameters.begin(); param != sync->returnParameters.parameters.end();){
-                            clientRequests << "response." << param->second;
+                            << "        Lemon::Message m = Lemon::Message(buffer, size, " << interfaceName << "::Request" << sync->methodName << ", " << params.names << ");\n";
+                    } else {
+                        clientRequests << "        uint8_t* buffer = new uint8_t[m_msgSize];\n\n"
+                            << "        Lemon::Message m = Lemon::Message(buffer, 0, " << interfaceName << "::Request" << sync->methodName << ");\n";
+                    }
 
-                            param++;
-                            // Make sure we dont insert a comma at the end
-                            if(param != sync->returnParameters.parameters.end()){
-                                clientRequests << ", ";
-                            }
-                        }
+                    clientRequests << "        if(Call(m, " << interfaceName << "::Response" << sync->methodName << ")) throw std::runtime_error(\"Failed calling " << sync->methodName << "\");\n\n"
+                        << "        " << interfaceName << "::" << sync->methodName << "Response response;\n" // $(methodName)Response response;
+                        << "        if(" << interfaceName << "::Decode" << sync->methodName << "Response(m, response)){\n"
+                        << "            throw std::runtime_error(\"Invalid response to request " << sync->methodName << "!\");\n"
+                        << "            return response; // Error decoding response\n"
+                        << "        }\n\n"
+                        << "        return response;\n"
+                        << "    }\n\n";
 
-                        clientRequests << ")){\n"
-                            << "            throw std::runtime_error(\"Invalid response to request " << sync->methodName << "!\");\n"
-                            << "            return response; // Error decoding response\n"
-                            << "        }\n\n"
-                            << "        return response;\n"
-                            << "    }\n\n";
+                    // Send the request without waiting, the response is received like any other message
+                    // and decoded with Decode$(methodName)Response
+                    clientRequests << "    void " << sync->methodName << "Async(" << params.declarations << ") {\n";
+                    GenerateQueueRequest(clientRequests, interfaceName, sync->methodName, params);
+                    clientRequests << "    }\n\n";
 
-                        serverRequestHandlers << ", " << parameterDeclarationString << ") = 0;\n";
-                    } else {
-                        clientRequests << ") {\n"
-                            << "        uint8_t* buffer = new uint8_t[m_msgSize];\n\n"
-                            << "        Lemon::Message m = Lemon::Message(buffer, 0, " << interfaceStatement->interfaceName << "::Request" << sync->methodName << ");\n"
-                            << "        if(Call(m, " << interfaceStatement->interfaceName << "::Response" << sync->methodName << ")) throw std::runtime_error(\"Failed calling " << sync->methodName << "\");\n\n"
-                            << "        " << interfaceStatement->interfaceName << "::" << sync->methodName << "Response response;\n" // $(methodName)Response response;
-                            << "        if(m.Decode(";
-                            
-                        // The struct may not be trivally copyable,
-                        // We pass each member individually
+                    GenerateRequestMessage(clientRequests, interfaceName, sync->methodName, params);
+
+					responses << "    struct " << sync->methodName << "Response {\n    "; // struct $(methodName)Response { $(parameterType) $(parameterName) ... };
+					for(auto& param : sync->returnParameters.parameters){
+                        responses << "    " << cppTypes[param.first].typeName << " " << param.second << ";\n    ";
+					}
+					responses << "};\n\n";
+
+                    // The struct may not be trivally copyable,
+                    // We pass each member individually
+                    responses << "    static long Decode" << sync->methodName << "Response(const Lemon::Message& m, " << sync->methodName << "Response& response) {\n";
+                    if(returnParams.names.length()){
+                        responses << "        return m.Decode(";
                         for(auto param = sync->returnParameters.parameters.begin(); param != sync->returnParameters.parameters.end();){
-                            clientRequests << "response." << param->second;
+                            responses << "response." << param->second;
 
                             param++;
                             // Make sure we dont insert a comma at the end
                             if(param != sync->returnParameters.parameters.end()){
-                                clientRequests << ", ";
+                                responses << ", ";
                             }
                         }
-
-                        clientRequests << ")){\n"
-                            << "            throw std::runtime_error(\"Invalid response to request " << sync->methodName << "!\");\n"
-                            << "            return response; // Error decoding response\n"
-                            << "        }\n\n"
-                            << "        return response;\n"
-                            << "    }\n\n";
-                        
-                        serverRequestHandlers << ") = 0;\n";
-
-                        serverRequestCondition
-                            << "            On" << sync->methodName << "(client);\n"
-                            << "            return 0;\n        } ";
+                        responses << ");\n";
+                    } else {
+                        responses << "        return 0;\n";
                     }
-
-					responses << "    struct " << sync->methodName << "Response {\n    "; // struct $(methodName)Response { $(parameterType) $(parameterName) ... };
-					for(auto& param : sync->returnParameters.parameters){
-                        try{
-                            CppType type = cppTypes[param.first];
-
-                            responses << "    " << type.typeName << " " << param.second << ";\n    ";
-                        } catch(const std::out_of_range& e){
-                            fprintf(stderr, "No mapping for type %d!\n", param.first);
-                            exit(5);
-                        }
-					}
-					responses << "};\n\n";
+                    responses << "    }\n\n";
                     break;
                 } default:
                     break;
@@ -568,11 +587,15 @@ void Generate(std::ostream& out){
             client << "};\n";
 
 
-            server << "class " << interfaceStatement->interfaceName << " {\n"
+            server << "class " << interfaceName << " {\n"
                 << "public:\n"
-                << "    virtual ~" << interfaceStatement->interfaceName << "() = default;\n\n"
+                << "    virtual ~" << interfaceName << "() = default;\n\n"
 			    << requestIDs.rdbuf();
 
+            if(requestSizes.tellp() > 0){
+                server << requestSizes.rdbuf() << "\n";
+            }
+
             if(responses.tellp() > 0){ // Check that there are actually responses
                 server
                     << responseIDs.rdbuf()
@@ -582,13 +605,37 @@ void Generate(std::ostream& out){
             server
                 << "protected:\n"
                 << serverRequestHandlers.rdbuf()
-                << "\n";
+                << "\n"
+                << serverDispatchers.rdbuf();
 
+            /// Requests are dispatched through a table indexed by message ID,
+            /// the table is a constant so it is not built at runtime
             server
                 << "    int HandleMessage(const Lemon::Handle& client, const Lemon::Message& m){\n"
-                << "        switch(m.id()) {\n"
-                << serverRequestCondition.rdbuf()
-                << "\n        }\n"
+                << "        if(m.id() == Lemon::MessagePeerDisconnect) {\n"
+                << "            OnPeerDisconnect(client);\n"
+                << "            return 0;\n"
+                << "        }\n\n";
+
+            if(dispatchTable.size()){
+                server
+                    << "        using Dispatcher = int (*)(" << interfaceName << "*, const Lemon::Handle&, const Lemon::Message&);\n"
+                    << "        static constexpr Dispatcher dispatchTable[] = { // Indexed by message ID - " << firstMessageID << "\n";
+                for(auto& dispatcher : dispatchTable){
+                    server << "            " << dispatcher << ",\n";
+                }
+                server
+                    << "        };\n\n"
+                    << "        uint64_t index = m.id() - " << firstMessageID << ";\n"
+                    << "        if(index >= sizeof(dispatchTable) / sizeof(*dispatchTable) || !dispatchTable[index]) {\n"
+                    << "            return 1; // Unknown request\n"
+                    << "        }\n\n"
+                    << "        return dispatchTable[index](this, client, m);\n";
+            } else {
+                server << "        return 1; // Unknown request\n";
+            }
+
+            server
                 << "    }\n"
                 << "};\n";
 
@@ -3,6 +3,7 @@
 #include <Fs/FsVolume.h>
 #include <Hash.h>
 #include <Lock.h>
+#include <Storage/BlockCache.h>
 #include <String.h>
 #include <Vector.h>
 
@@ -45,10 +46,17 @@
 #define EXT2_DOUBLY_INDIRECT_INDEX 13
 #define EXT2_TRIPLY_INDIRECT_INDEX 14
 
-// When block cache reaches 96MB, use existing cached blocks
-#define EXT2_BLOCKCACHE_LIMIT 96 * 1024 * 1024
+#define EXT2_INDEX_FL 0x1000   // Directory is indexed by a hash tree (htree)
+#define EXT2_HTREE_MAX_LEVELS 3 // Most levels of index nodes, including the root
 
-//#define EXT2_NO_CACHE
+#define EXT2_MAX_UNUSED_NODES 1024 // Nodes without handles kept cached before the least recently used are freed
+#define EXT2_MAX_DIRTY_NODES 64    // Inodes changed before they are written back together
+
+#define EXT2_JOURNAL_MAGIC 0xC03B3998U        // Fields of the journal are big endian
+#define EXT2_JOURNAL_MAX_TRANSACTION 1024     // Blocks in a transaction before it is committed
+#define EXT2_JOURNAL_COMMIT_INTERVAL 5000000  // Most microseconds metadata changes wait to be committed
+
+#define EXT2_EXTENT_MAP_BATCH 1024 // Most blocks added to the extent cache of a node at once
 
 namespace fs {
 class Ext2 : public fs::FsDriver {
@@ -91,6 +99,20 @@ public:
         BinaryTree = 0x4, // Binary tree directory structure
     };
 
+    enum MiscFlags {
+        SignedHash = 0x1,   // Directory index hashes treat characters as signed
+        UnsignedHash = 0x2, // Directory index hashes treat characters as unsigned
+    };
+
+    enum DirectoryHash {
+        HashLegacy = 0,
+        HashHalfMD4 = 1,
+        HashTEA = 2,
+        HashLegacyUnsigned = 3,
+        HashHalfMD4Unsigned = 4,
+        HashTEAUnsigned = 5,
+    };
+
     enum CreatorOS {
         Linux,   // Linux
         HURD,    // GNU HURD
@@ -110,7 +132,32 @@ public:
     };
 
 #define EXT2_READONLY_FEATURE_SUPPORT (ReadonlyFeatures::Sparse | ReadonlyFeatures::LargeFiles)
-#define EXT2_INCOMPAT_FEATURE_SUPPORT (IncompatibleFeatures::Filetype)
+#define EXT2_INCOMPAT_FEATURE_SUPPORT (IncompatibleFeatures::Filetype | IncompatibleFeatures::Recover)
+
+    enum JournalBlockType {
+        JournalDescriptor = 1,   // Followed by the blocks described by its tags
+        JournalCommit = 2,       // End of a transaction
+        JournalSuperblockV1 = 3, // ext3 journal
+        JournalSuperblockV2 = 4, // ext3 journal with features
+        JournalRevoke = 5,       // Blocks not to be replayed from earlier transactions
+    };
+
+    enum JournalTagFlags {
+        TagEscaped = 0x1,  // Block started with the journal magic, which was zeroed
+        TagSameUUID = 0x2, // Not followed by a UUID, only the first tag of a descriptor is
+        TagDeleted = 0x4,
+        TagLast = 0x8, // Last tag of the descriptor
+    };
+
+    enum JournalIncompatibleFeatures {
+        JournalRevokeRecords = 0x1,
+        Journal64Bit = 0x2,
+        JournalAsyncCommit = 0x4,
+        JournalChecksumV2 = 0x8,
+        JournalChecksumV3 = 0x10,
+    };
+
+#define EXT2_JOURNAL_INCOMPAT_SUPPORT (JournalIncompatibleFeatures::JournalRevokeRecords)
 
     typedef struct {
         uint32_t inodeCount;     // Number of inodes (used + free) in the file system
@@ -156,6 +203,24 @@ public:
         uint8_t preallocatedBlocks; // Blocks to preallocate when a file is created
         uint8_t preallocdDirBlocks; // Blocks to preallocate when a directory is created
         uint16_t align;
+        uint8_t journalUUID[16];     // UUID of the journal superblock (ext3)
+        uint32_t journalInode;       // Inode of the journal file (ext3)
+        uint32_t journalDevice;      // Device of the journal file (ext3)
+        uint32_t lastOrphan;         // First inode to delete (ext3)
+        uint32_t hashSeed[4];        // Seed of the directory index hash
+        uint8_t defaultHashVersion;  // Hash used by new directory indexes
+        uint8_t journalBackupType;   // (ext3)
+        uint16_t descriptorSize;     // (ext4)
+        uint32_t defaultMountOpts;   // Default mount options
+        uint32_t firstMetaBlockGroup;
+        uint32_t mkfsTime;           // When the filesystem was created in UNIX time
+        uint32_t journalBlocks[17];  // Backup of the journal inode blocks (ext3)
+        uint32_t blockCountHigh;     // (ext4)
+        uint32_t resvBlockCountHigh; // (ext4)
+        uint32_t freeBlockCountHigh; // (ext4)
+        uint16_t minExtraInodeSize;
+        uint16_t wantExtraInodeSize;
+        uint32_t flags; // Miscellaneous flags (see MiscFlags)
     } __attribute__((packed)) ext2_superblock_extended_t; // Ext2 extended superblock
 
     typedef struct {
@@ -203,8 +268,89 @@ public:
         char name[];
     } __attribute__((packed)) ext2_directory_entry_t;
 
+    // Directory index (htree) structures
+    //
+    // The first block of an indexed directory holds '.' and '..', with the record of '..' covering the rest of the
+    // block where the root of the index is kept. Other index nodes are blocks holding a single unused record.
+    // Leaves are ordinary directory blocks, so directories can still be read linearly.
+    typedef struct {
+        uint32_t reservedZero;
+        uint8_t hashVersion;    // See DirectoryHash
+        uint8_t infoLength;     // Length of this structure
+        uint8_t indirectLevels; // Levels of index nodes below the root
+        uint8_t unusedFlags;
+    } __attribute__((packed)) ext2_dx_root_info_t;
+
+    typedef struct {
+        uint16_t limit; // Most entries that fit in the index node
+        uint16_t count; // Entries in the index node, including the first
+    } __attribute__((packed)) ext2_dx_countlimit_t;
+
+    typedef struct {
+        uint32_t hash;  // Lowest hash in the block, replaced by ext2_dx_countlimit_t in the first entry
+        uint32_t block; // Index of the block in the directory
+    } __attribute__((packed)) ext2_dx_entry_t;
+
+    // Journal structures, all fields are big endian
+    typedef struct {
+        uint32_t magic;     // EXT2_JOURNAL_MAGIC
+        uint32_t blockType; // See JournalBlockType
+        uint32_t sequence;  // Transaction the block belongs to
+    } __attribute__((packed)) ext2_journal_header_t;
+
+    typedef struct {
+        ext2_journal_header_t header;
+
+        uint32_t blocksize;
+        uint32_t maxLength; // Blocks in the journal
+        uint32_t first;     // First block of the log
+
+        uint32_t sequence; // First transaction expected in the log
+        uint32_t start;    // Block of the log the transaction starts at, 0 if the log is empty
+        uint32_t error;
+
+        // Version 2 only
+        uint32_t featuresCompat;
+        uint32_t featuresIncompat; // See JournalIncompatibleFeatures
+        uint32_t featuresRoCompat;
+        uint8_t uuid[16];
+    } __attribute__((packed)) ext2_journal_superblock_t;
+
+    typedef struct {
+        uint32_t block; // Block on the volume the logged block belongs at
+        uint32_t flags; // See JournalTagFlags, only the lower 16 bits are flags
+    } __attribute__((packed)) ext2_journal_tag_t;
+
+    typedef struct {
+        ext2_journal_header_t header;
+        uint32_t size; // Bytes used in the block including the header, followed by the revoked blocks
+    } __attribute__((packed)) ext2_journal_revoke_header_t;
+
     class Ext2Volume;
 
+    // Run of blocks of an inode, contiguous both in the inode blocklist and on disk
+    struct BlockExtent {
+        uint32_t index; // Index of the first block in the inode blocklist
+        uint32_t block; // First block on disk, 0 if the run is a hole
+        uint32_t count;
+    };
+
+    // Data of a block, used in place in the BlockCache where possible (see Ext2Volume::GetBlock)
+    class BlockRef final {
+        friend class Ext2Volume;
+
+    public:
+        ~BlockRef() { delete[] m_copy; }
+
+        ALWAYS_INLINE const uint8_t* Data() const { return m_data; }
+        template <typename T> ALWAYS_INLINE const T* As() const { return reinterpret_cast<const T*>(m_data); }
+
+    private:
+        BlockCache::PinnedPage m_page;
+        uint8_t* m_copy = nullptr; // Holds the block when it could not be pinned
+        const uint8_t* m_data = nullptr;
+    };
+
     class Ext2Node : public FsNode {
     protected:
         Ext2Volume* vol;
@@ -217,12 +363,27 @@ public:
         // Cache directory entries
         HashMap<String, uint32_t> directoryCache;
 
+        // Cache of the blocklist as extents, covering the first mappedBlocks blocks of the inode.
+        // Built as blocks are looked up (see Ext2Volume::GetNodeBlocks), protected by extentLock
+        Vector<BlockExtent> extents;
+        uint32_t mappedBlocks = 0;
+        Mutex extentLock;
+
+        // Protected by the inodes lock of the volume
+        bool inodeDirty = false; // e2inode changed since it was written back
+        bool unused = false;     // On the unused list of the volume
+
     public:
+        // Links in the unused list of the volume
+        Ext2Node* next = nullptr;
+        Ext2Node* prev = nullptr;
+
         Ext2Node(Ext2Volume* vol, ext2_inode_t& ino, ino_t inode);
 
         ssize_t Read(size_t, size_t, uint8_t*);
         ssize_t Write(size_t, size_t, uint8_t*);
         int ReadDir(DirectoryEntry*, uint32_t);
+        int ReadDirBatch(DirectoryEntry* entries, int count, off_t& cursor);
         FsNode* FindDir(const char* name);
         int Create(DirectoryEntry*, uint32_t);
         int CreateDirectory(DirectoryEntry*, uint32_t);
@@ -233,12 +394,15 @@ public:
         int Truncate(off_t length);
 
         void Close();
-        void Sync();
+        int Sync();
     };
 
     class Ext2Volume : public FsVolume {
     private:
         FsNode* m_device;
+        // Disk caching the device and the offset of the device on it, nullptr if blocks cannot be pinned
+        DiskDevice* m_cacheDisk;
+        uint64_t m_cacheOffset;
 
         struct {
             ext2_superblock_t super;
@@ -249,43 +413,79 @@ public:
         uint32_t rootInode = EXT2_ROOT_INODE_INDEX; // Inode number of the root directory
         uint32_t firstBlockGroupIndex;              // Block ID of the first block group descriptor
         uint32_t blocksize;                         // Volume block size
+        uint32_t hashSeed[4];                       // Copy of superext.hashSeed, which cannot be passed by pointer as it is packed
 
         ext2_blockgrp_desc_t* blockGroups;
         uint32_t blockGroupCount;
 
+        // Allocation state of a block group, protected by m_allocLock
+        struct BlockGroupState {
+            uint32_t blockHint; // Bit in the block bitmap to start searching from
+            uint32_t inodeHint; // Bit in the inode bitmap to start searching from
+            bool dirty;         // Descriptor changed since it was last written
+        };
+        BlockGroupState* blockGroupStates;
+        bool superblockDirty = false; // Free counts changed since the superblock was last written
+
+        // Held when changing the bitmaps and free counts, across disk I/O
+        Mutex m_allocLock;
+
         int error = false;
         bool readOnly = false;
 
         bool sparse, largeFiles, filetype;
         uint32_t inodeSize = 128;
 
-        lock_t m_inodesLock = 0;
-        lock_t m_blocksLock = 0;
+        // Held across disk I/O
+        Mutex m_inodesLock;
         HashMap<uint32_t, Ext2Node*> inodeCache;
-
-        struct CachedBlock {
-            // When last accessed
-            uint64_t timestamp = 0;
-            uint32_t block = 0;
-
-            CachedBlock* prev = nullptr;
-            CachedBlock* next = nullptr;
-
-            // Block data
-            uint8_t data[];
+        // Cached nodes without handles, least recently used at the front. May hold nodes opened since
+        FastList<Ext2Node*> unusedNodes;
+        // Nodes with inodes to be written back by WriteInodes
+        Vector<Ext2Node*> dirtyNodes;
+
+        // Metadata blocks written since the last commit of the journal.
+        // Blocks are only written in place once committed, until then reads are given the copy in the transaction
+        struct Transaction {
+            struct Block {
+                uint32_t block;
+                uint8_t* data;
+                bool forgotten; // Used for file data since, it is neither logged nor written in place
+            };
+
+            uint32_t sequence;
+            uint64_t started; // When the first block was added in microseconds since boot
+            Vector<Block> blocks;
+            HashMap<uint32_t, unsigned> index; // Index in blocks of each block
+
+            ~Transaction();
         };
 
-        CachedBlock* AllocateCachedBlock() {
-            CachedBlock* cb = (CachedBlock*)kmalloc(sizeof(CachedBlock) + blocksize);
-            
-            new (cb) CachedBlock();
-            return cb;
-        }
-
-        HashMap<uint32_t, CachedBlock*> blockCache = HashMap<uint32_t, CachedBlock*>(1024);
-        FastList<CachedBlock*> cachedBlockList;
-        HashMap<uint32_t, uint8_t*> bitmapCache = HashMap<uint32_t, uint8_t*>(256);
-        unsigned blockCacheMemoryUsage = 0;
+        bool journaled = false;         // Metadata is written through the journal
+        Vector<uint32_t> journalBlocks; // Block on the volume of each block of the journal
+        ext2_journal_superblock_t journalSuper;
+        uint32_t journalFirst;           // First block of the log
+        uint32_t journalSequence;        // Sequence of the transaction after the last commit
+        uint32_t journalTags;            // Tags that fit in a descriptor block
+        uint32_t journalLimit;           // Most blocks in a transaction, so a commit fits in the log
+        uint64_t journalCheckpoints = 0; // Changed once the blocks of a commit have been written in place
+        uint32_t journalEnd = 0;         // Position in the log after the last commit block, m_commitLock must be held
+
+        // Blocks of the log on disk, which are replayed after a crash, to the transaction that logged them.
+        // nullptr once the log is known to be empty. Protected by m_journalLock, only changed with m_commitLock held
+        HashMap<uint32_t, uint32_t>* m_logged = nullptr;
+
+        Transaction* m_running = nullptr;    // Blocks to be committed
+        Transaction* m_committing = nullptr; // Blocks being committed, written in place once committed
+        Mutex m_journalLock;                 // Protects the transactions
+        Mutex m_commitLock;                  // Held whilst committing, across disk I/O
+
+        // The running transaction is only committed between operations, so each operation is in one transaction.
+        // Protected by m_journalLock
+        unsigned m_journalOperations = 0; // Operations part way through changing metadata
+        bool m_commitPending = false;     // Waiting for the operations to finish to commit, new operations wait
+        unsigned m_commitWaiting = 0;     // Threads waiting for the pending commit
+        Semaphore m_commitWaiters = Semaphore(0);
 
         inline uint32_t LocationToBlock(uint64_t l) { return (l >> super.logBlockSize) >> 10; }
         inline uint32_t BlockToLocation(uint64_t b) { return (b << super.logBlockSize) << 10; }
@@ -305,33 +505,175 @@ public:
         Vector<uint32_t> GetInodeBlocks(uint32_t index, uint32_t count, ext2_inode_t& inode);
         void SetInodeBlock(uint32_t index, ext2_inode_t& inode, uint32_t block);
 
+        /////////////////////////////
+        /// \brief Get blocks of a file using its extent cache
+        ///
+        /// Walks the indirect blocklists only for blocks not yet in the cache.
+        /// Blocks past the end of the file are 0.
+        ///
+        /// \param index Index of the first block in the inode blocklist
+        /// \param count Amount of blocks
+        /////////////////////////////
+        Vector<uint32_t> GetNodeBlocks(Ext2Node* node, uint32_t index, uint32_t count);
+        // Add the blocks of node before limit (or the end of the file) to its extent cache, extentLock must be held
+        int MapExtents(Ext2Node* node, uint32_t limit);
+        // Forget the cached blocks of node from index onwards, called when its blocklist changes
+        void InvalidateExtents(Ext2Node* node, uint32_t index);
+        // Find the extent containing a mapped block, extentLock must be held
+        unsigned FindExtent(Ext2Node* node, uint32_t index);
+
         int ReadInode(uint32_t num, ext2_inode_t& inode);
         int WriteInode(uint32_t num, ext2_inode_t& inode);
 
+        // Blocks are cached by the BlockCache of the device
         int ReadBlock(uint32_t block, void* buffer);
-        int ReadBlockCached(uint32_t block, void* buffer);
-
         int WriteBlock(uint32_t block, void* buffer);
-        int WriteBlockCached(uint32_t block, void* buffer);
+        // Read or write count contiguous blocks with one request to the device.
+        // WriteBlock writes metadata, through the journal if there is one, WriteBlocks writes file data
+        int ReadBlocks(uint32_t block, uint32_t count, void* buffer);
+        int WriteBlocks(uint32_t block, uint32_t count, void* buffer);
+        // Read or write the device directly, ignoring the journal
+        int ReadDeviceBlocks(uint32_t block, uint32_t count, void* buffer);
+        int WriteDeviceBlocks(uint32_t block, uint32_t count, void* buffer);
+        // Amount of blocks from index in blocks contiguous on disk, at most limit
+        uint32_t ContiguousBlocks(const Vector<uint32_t>& blocks, unsigned index, uint32_t limit);
+
+        /////////////////////////////
+        /// \brief Get the data of a block without copying it where possible
+        ///
+        /// The block is pinned in the BlockCache whilst \a ref holds it,
+        /// otherwise (e.g. the block spans two pages) it is read into a buffer kept by \a ref.
+        /// Calling again with the same \a ref releases the block it held.
+        ///
+        /// \return 0 on success, otherwise an error code
+        /////////////////////////////
+        int GetBlock(uint32_t block, BlockRef& ref);
 
         Ext2Node* CreateNode();
         int EraseInode(ext2_inode_t& e2inode, uint32_t inode);
         void SyncInode(ext2_inode_t& e2ino, uint32_t inode);
 
-        uint32_t AllocateBlock();
+        /////////////////////////////
+        /// \brief Allocate blocks contiguous on disk
+        ///
+        /// Allocates from \a goal if it is free, otherwise the first free block after it,
+        /// moving on to the following block groups when its group is full.
+        /// The descriptor and superblock are written back by WriteMetadata.
+        ///
+        /// \param goal Block to allocate from (e.g. the one after the last block of a file), 0 for any
+        /// \param count Most blocks to allocate, set to the amount allocated
+        ///
+        /// \return First block allocated, 0 if there are no free blocks
+        /////////////////////////////
+        uint32_t AllocateBlocks(uint32_t goal, uint32_t& count);
+        uint32_t AllocateBlock(uint32_t goal = 0);
         int FreeBlock(uint32_t block);
 
+        // Find the first clear bit of bitmap in [start, end), returns end if there are none
+        static uint32_t FindClearBit(const uint64_t* bitmap, uint32_t start, uint32_t end);
+        // Write back the block group descriptors and superblock changed by allocations
+        void WriteMetadata();
+
         int ListDir(Ext2Node* node, List<DirectoryEntry>& entries);
         int WriteDir(Ext2Node* node, List<DirectoryEntry>& entries);
         int InsertDir(Ext2Node* node, List<DirectoryEntry>& entries);
         int InsertDir(Ext2Node* node, DirectoryEntry& ent);
 
+        static void FillDirectoryEntry(const ext2_directory_entry_t& e2dirent, DirectoryEntry& dirent);
+
+        // Leaf of an indexed directory found by DxFindLeaf
+        struct DxLeaf {
+            uint32_t hash;     // Hash of the name looked up
+            int hashVersion;   // Hash used by the directory (see DirectoryHash)
+            uint32_t block;    // Index of the leaf in the directory
+            uint32_t parent;   // Index of the index node pointing to the leaf in the directory
+            uint32_t entries;  // Offset of the entries in the parent
+            unsigned position; // Entry in the parent pointing to the leaf
+            bool hasNext;      // The parent has an entry after the leaf
+            uint32_t nextHash;
+            uint32_t nextBlock;
+        };
+
+        // Indexed directories are used through the index if the volume supports it
+        ALWAYS_INLINE bool IsIndexed(Ext2Node* node) const {
+            return (superext.featuresCompat & CompatibleFeatures::DirectoryIndexing) &&
+                   (node->e2inode.flags & EXT2_INDEX_FL);
+        }
+
+        // The DxX functions return a positive value when the index is unusable (e.g. corrupt) or the
+        // change cannot be made in place, in which case the directory should be used linearly.
+
+        // Find the leaf of an indexed directory that holds name
+        int DxFindLeaf(Ext2Node* node, const char* name, DxLeaf& leaf);
+        // Look up name in an indexed directory, returns 0 if found or -ENOENT
+        int DxFind(Ext2Node* node, const char* name, uint32_t& inode);
+        // Add an entry to an indexed directory, splitting the leaf if it is full and canSplit is true
+        int DxInsert(Ext2Node* node, DirectoryEntry& ent, bool canSplit = true);
+        // Remove name from an indexed directory, returns 0 if removed
+        int DxRemove(Ext2Node* node, const char* name);
+        // Move the upper half of a full leaf to a new block
+        int DxSplitLeaf(Ext2Node* node, const DxLeaf& leaf);
+
+        /////////////////////////////
+        /// \brief Load the journal, replaying any transactions committed but not yet written in place
+        ///
+        /// Volumes without a journal, or whose journal uses unsupported features, are left unjournaled.
+        ///
+        /// \return 0 on success, otherwise an error code. The volume should not be mounted on failure
+        /////////////////////////////
+        int OpenJournal();
+        // Replay the log from journalSuper.start
+        int RecoverJournal();
+
+        enum ScanPass {
+            ScanEnd,    // Find the end of the last committed transaction
+            ScanRevoke, // Record the revoked blocks
+            ScanReplay, // Write the logged blocks in place
+        };
+
+        /////////////////////////////
+        /// \brief Go through the committed transactions of the log
+        ///
+        /// \param end Set by ScanEnd to the sequence after the last committed transaction, used by the later passes
+        /// \param revoked Block to the last transaction revoking it, set by ScanRevoke
+        /////////////////////////////
+        int ScanJournal(ScanPass pass, uint32_t& end, HashMap<uint32_t, uint32_t>& revoked);
+        int ReadJournalBlock(uint32_t index, void* buffer);
+        int WriteJournalBlock(uint32_t index, void* buffer);
+        int WriteJournalSuperblock();
+
+        // Add a metadata block to the running transaction
+        int JournalBlock(uint32_t block, const void* buffer);
+        // The running transaction is large or has been running for too long, m_journalLock must be held
+        bool CommitDue();
+        // Commit once the last operation has finished and wake the threads waiting, m_commitPending must be set
+        int FinishPendingCommit();
+        // Copy the blocks in a transaction not yet written in place over buffer (if not nullptr),
+        // returns the amount found
+        unsigned ReadJournaled(uint32_t block, uint32_t count, void* buffer);
+        // Blocks written as file data are no longer metadata to be written in place,
+        // any of them still in the log on disk are revoked so they are not replayed over the data
+        void ForgetJournaled(uint32_t block, uint32_t count);
+
+        /////////////////////////////
+        /// \brief Commit a revoke record for the blocks still in the log on disk
+        ///
+        /// Appended to the log after the last commit as a transaction of its own, and synced before returning.
+        /// If the log has no room left it is emptied instead.
+        /////////////////////////////
+        int RevokeJournaled(uint32_t block, uint32_t count);
+        // Mark the log as empty, the blocks of the last commit must have been written in place.
+        // m_commitLock must be held
+        int EmptyJournal();
+
     public:
         Ext2Volume(FsNode* device, const char* name);
 
         ssize_t Read(Ext2Node* node, size_t offset, size_t size, uint8_t* buffer);
         ssize_t Write(Ext2Node* node, size_t offset, size_t size, uint8_t* buffer);
         int ReadDir(Ext2Node* node, DirectoryEntry* dirent, uint32_t index);
+        // The cursor is the byte offset of the next directory record
+        int ReadDirBatch(Ext2Node* node, DirectoryEntry* entries, int count, off_t& cursor);
         FsNode* FindDir(Ext2Node* node, const char* name);
         int Create(Ext2Node* node, DirectoryEntry* ent, uint32_t mode);
         int CreateDirectory(Ext2Node* node, DirectoryEntry* ent, uint32_t mode);
@@ -341,14 +683,71 @@ public:
         int Truncate(Ext2Node* node, off_t length);
 
         void SyncNode(Ext2Node* node);
+        // Remove a node from the cache and free it, erasing its inode if it has no links. m_inodesLock must be held
         void CleanNode(Ext2Node* node);
+        // Drop a handle to a node, keeping it cached if it is still linked
+        void CloseNode(Ext2Node* node);
+
+        // Add a node to the inode cache, m_inodesLock must be held
+        void CacheNode(Ext2Node* node);
+        // Move a node without handles to the back of the unused list, m_inodesLock must be held
+        void MarkUnused(Ext2Node* node);
+        // Free unused nodes until at most EXT2_MAX_UNUSED_NODES are left, m_inodesLock must be held
+        void EvictNodes();
+
+        /////////////////////////////
+        /// \brief Write back the inodes of dirtyNodes
+        ///
+        /// Inodes in the same inode table block are written with one read and write of the block.
+        /// m_inodesLock must be held.
+        /////////////////////////////
+        void WriteInodes();
+
+        // Write back the blocks of the volume cached by the device
+        int SyncDevice();
+
+        /////////////////////////////
+        /// \brief Commit the running transaction of the journal and write its blocks in place
+        ///
+        /// Blocks are logged with one sequential write, then written in place through the BlockCache.
+        /// Writes of file data and the blocks of the last commit reach the disk before the log is written.
+        ///
+        /// \return 0 on success, otherwise an error code
+        /////////////////////////////
+        int CommitJournal();
+        // The running transaction is due to be committed, either it is large or it has been running for too long
+        bool JournalCommitDue();
+
+        /////////////////////////////
+        /// \brief Commit the running transaction once no operation is part way through changing it
+        ///
+        /// Must not be called during an operation.
+        ///
+        /// \param wait Wait for the commit, otherwise it is left to the last operation to finish
+        /// \return 0 on success, otherwise an error code
+        /////////////////////////////
+        int CommitJournalAtBoundary(bool wait);
+
+        // Operations changing metadata are started before their first change and ended after their last,
+        // waiting whilst a full transaction is being committed
+        void StartJournalOperation();
+        void EndJournalOperation();
+
+        class JournalOperation final {
+        public:
+            ALWAYS_INLINE JournalOperation(Ext2Volume* vol) : m_vol(vol) { m_vol->StartJournalOperation(); }
+            ALWAYS_INLINE ~JournalOperation() { m_vol->EndJournalOperation(); }
+
+        private:
+            Ext2Volume* m_vol;
+        };
+
+        ALWAYS_INLINE bool IsJournaled() const { return journaled; }
 
         int Error() { return error; }
     };
 
 public:
-    unsigned totalBlockCacheMemoryUsage = 0;
-
     Ext2();
     ~Ext2() override;
 
@@ -361,7 +760,11 @@ public:
     static Ext2& Instance();
 
 private:
+    // Commits the journals of the volumes every EXT2_JOURNAL_COMMIT_INTERVAL
+    static void JournalThread();
+
     List<FsVolume*> m_extVolumes;
+    bool m_journalThread = false; // JournalThread has been started
 
     static lock_t m_instanceLock;
     static Ext2* m_instance;
@@ -0,0 +1,543 @@
+#include "Ext2.h"
+
+#include <Errno.h>
+#include <Logging.h>
+#include <Math.h>
+
+#define DX_ROOT_INFO_OFFSET 24   // After the records of '.' and '..'
+#define DX_NODE_ENTRIES_OFFSET 8 // After the unused record covering the node
+
+#define DX_HASH_EOF 0x7FFFFFFF // Reserved by readdir cookies, never the hash of a name
+
+namespace fs {
+
+namespace {
+
+ALWAYS_INLINE uint32_t RotateLeft(uint32_t x, unsigned s) { return (x << s) | (x >> (32 - s)); }
+
+// Original hash of ext3 directory indexes
+template <typename Char> uint32_t LegacyHash(const char* name, int len) {
+    uint32_t hash;
+    uint32_t hash0 = 0x12A3FE2D;
+    uint32_t hash1 = 0x37ABE8F9;
+
+    const Char* c = reinterpret_cast<const Char*>(name);
+    while (len--) {
+        hash = hash1 + (hash0 ^ (static_cast<int>(*c++) * 7152373));
+
+        if (hash & 0x80000000) {
+            hash -= 0x7FFFFFFF;
+        }
+        hash1 = hash0;
+        hash0 = hash;
+    }
+
+    return hash0 << 1;
+}
+
+// Pack up to num words of the name into buf, padded with its length
+template <typename Char> void NameToHashBuffer(const char* name, int len, uint32_t* buf, int num) {
+    uint32_t pad = static_cast<uint32_t>(len) | (static_cast<uint32_t>(len) << 8);
+    pad |= pad << 16;
+
+    uint32_t val = pad;
+    if (len > num * 4) {
+        len = num * 4;
+    }
+
+    const Char* c = reinterpret_cast<const Char*>(name);
+    for (int i = 0; i < len; i++) {
+        val = static_cast<int>(c[i]) + (val << 8);
+        if ((i % 4) == 3) {
+            *buf++ = val;
+            val = pad;
+            num--;
+        }
+    }
+
+    if (--num >= 0) {
+        *buf++ = val;
+    }
+
+    while (--num >= 0) {
+        *buf++ = pad;
+    }
+}
+
+#define MD4_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MD4_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define MD4_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD4_ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + x, a = RotateLeft(a, s))
+
+#define MD4_K2 013240474631U
+#define MD4_K3 015666365641U
+
+// Cut down MD4 transform, only three rounds of eight
+void HalfMD4Transform(uint32_t buf[4], const uint32_t in[8]) {
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    MD4_ROUND(MD4_F, a, b, c, d, in[0], 3);
+    MD4_ROUND(MD4_F, d, a, b, c, in[1], 7);
+    MD4_ROUND(MD4_F, c, d, a, b, in[2], 11);
+    MD4_ROUND(MD4_F, b, c, d, a, in[3], 19);
+    MD4_ROUND(MD4_F, a, b, c, d, in[4], 3);
+    MD4_ROUND(MD4_F, d, a, b, c, in[5], 7);
+    MD4_ROUND(MD4_F, c, d, a, b, in[6], 11);
+    MD4_ROUND(MD4_F, b, c, d, a, in[7], 19);
+
+    MD4_ROUND(MD4_G, a, b, c, d, in[1] + MD4_K2, 3);
+    MD4_ROUND(MD4_G, d, a, b, c, in[3] + MD4_K2, 5);
+    MD4_ROUND(MD4_G, c, d, a, b, in[5] + MD4_K2, 9);
+    MD4_ROUND(MD4_G, b, c, d, a, in[7] + MD4_K2, 13);
+    MD4_ROUND(MD4_G, a, b, c, d, in[0] + MD4_K2, 3);
+    MD4_ROUND(MD4_G, d, a, b, c, in[2] + MD4_K2, 5);
+    MD4_ROUND(MD4_G, c, d, a, b, in[4] + MD4_K2, 9);
+    MD4_ROUND(MD4_G, b, c, d, a, in[6] + MD4_K2, 13);
+
+    MD4_ROUND(MD4_H, a, b, c, d, in[3] + MD4_K3, 3);
+    MD4_ROUND(MD4_H, d, a, b, c, in[7] + MD4_K3, 9);
+    MD4_ROUND(MD4_H, c, d, a, b, in[2] + MD4_K3, 11);
+    MD4_ROUND(MD4_H, b, c, d, a, in[6] + MD4_K3, 15);
+    MD4_ROUND(MD4_H, a, b, c, d, in[1] + MD4_K3, 3);
+    MD4_ROUND(MD4_H, d, a, b, c, in[5] + MD4_K3, 9);
+    MD4_ROUND(MD4_H, c, d, a, b, in[0] + MD4_K3, 11);
+    MD4_ROUND(MD4_H, b, c, d, a, in[4] + MD4_K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+void TEATransform(uint32_t buf[4], const uint32_t in[4]) {
+    uint32_t sum = 0;
+    uint32_t b0 = buf[0], b1 = buf[1];
+    uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+
+    for (int n = 0; n < 16; n++) {
+        sum += 0x9E3779B9;
+        b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+        b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    }
+
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+// Hash of a name in a directory index, the lowest bit is always clear
+uint32_t NameHash(const char* name, int len, int version, const uint32_t seed[4]) {
+    uint32_t buf[4] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476};
+    if (seed[0] || seed[1] || seed[2] || seed[3]) {
+        memcpy(buf, seed, sizeof(buf));
+    }
+
+    uint32_t in[8];
+    uint32_t hash = 0;
+    switch (version) {
+    case Ext2::HashLegacy:
+        hash = LegacyHash<signed char>(name, len);
+        break;
+    case Ext2::HashLegacyUnsigned:
+        hash = LegacyHash<unsigned char>(name, len);
+        break;
+    case Ext2::HashHalfMD4:
+    case Ext2::HashHalfMD4Unsigned:
+        for (; len > 0; len -= 32, name += 32) {
+            if (version == Ext2::HashHalfMD4) {
+                NameToHashBuffer<signed char>(name, len, in, 8);
+            } else {
+                NameToHashBuffer<unsigned char>(name, len, in, 8);
+            }
+            HalfMD4Transform(buf, in);
+        }
+        hash = buf[1];
+        break;
+    case Ext2::HashTEA:
+    case Ext2::HashTEAUnsigned:
+        for (; len > 0; len -= 16, name += 16) {
+            if (version == Ext2::HashTEA) {
+                NameToHashBuffer<signed char>(name, len, in, 4);
+            } else {
+                NameToHashBuffer<unsigned char>(name, len, in, 4);
+            }
+            TEATransform(buf, in);
+        }
+        hash = buf[0];
+        break;
+    }
+
+    hash &= ~1U;
+    if (hash == (DX_HASH_EOF << 1)) {
+        hash = (DX_HASH_EOF - 1) << 1;
+    }
+
+    return hash;
+}
+
+// Space taken by a record in a directory block
+ALWAYS_INLINE uint16_t RecordSize(unsigned nameLength) {
+    return (sizeof(Ext2::ext2_directory_entry_t) + nameLength + 3) & ~3U;
+}
+
+} // namespace
+
+int Ext2::Ext2Volume::DxFindLeaf(Ext2Node* node, const char* name, DxLeaf& leaf) {
+    uint32_t dirBlocks = node->e2inode.size / blocksize;
+
+    BlockRef ref;
+    if (int e = GetBlock(GetInodeBlock(0, node->e2inode), ref)) {
+        return e > 0 ? e : 1;
+    }
+
+    const ext2_dx_root_info_t* info = reinterpret_cast<const ext2_dx_root_info_t*>(ref.Data() + DX_ROOT_INFO_OFFSET);
+    if (info->reservedZero || info->infoLength != sizeof(ext2_dx_root_info_t) ||
+        info->indirectLevels >= EXT2_HTREE_MAX_LEVELS || info->hashVersion > HashTEA) {
+        Log::Warning("[Ext2] Unsupported or corrupt directory index (inode %d)", node->inode);
+        return 1;
+    }
+
+    leaf.hashVersion = info->hashVersion;
+    if (superext.flags & MiscFlags::UnsignedHash) {
+        leaf.hashVersion += HashLegacyUnsigned;
+    }
+    leaf.hash = NameHash(name, strlen(name), leaf.hashVersion, hashSeed);
+
+    unsigned levels = info->indirectLevels;
+    leaf.parent = 0;
+    leaf.entries = DX_ROOT_INFO_OFFSET + info->infoLength;
+    for (unsigned level = 0;; level++) {
+        const ext2_dx_entry_t* entries = reinterpret_cast<const ext2_dx_entry_t*>(ref.Data() + leaf.entries);
+        const ext2_dx_countlimit_t* countLimit = reinterpret_cast<const ext2_dx_countlimit_t*>(entries);
+        if (!countLimit->count || countLimit->count > countLimit->limit ||
+            countLimit->limit > (blocksize - leaf.entries) / sizeof(ext2_dx_entry_t)) {
+            Log::Warning("[Ext2] Corrupt directory index node (inode %d)", node->inode);
+            return 1;
+        }
+
+        // Last entry with a hash no greater than ours, the first covers every hash below the second
+        unsigned first = 1;
+        unsigned last = countLimit->count;
+        while (first < last) {
+            unsigned mid = (first + last) / 2;
+            if (entries[mid].hash <= leaf.hash) {
+                first = mid + 1;
+            } else {
+                last = mid;
+            }
+        }
+
+        unsigned position = first - 1;
+        uint32_t block = entries[position].block & 0x0FFFFFFF;
+        if (block >= dirBlocks) {
+            Log::Warning("[Ext2] Directory index points past the end of the directory (inode %d)", node->inode);
+            return 1;
+        }
+
+        if (level == levels) {
+            leaf.block = block;
+            leaf.position = position;
+            leaf.hasNext = position + 1 < countLimit->count;
+            if (leaf.hasNext) {
+                leaf.nextHash = entries[position + 1].hash;
+                leaf.nextBlock = entries[position + 1].block & 0x0FFFFFFF;
+            }
+            return 0;
+        }
+
+        if (int e = GetBlock(GetInodeBlock(block, node->e2inode), ref)) {
+            return e > 0 ? e : 1;
+        }
+
+        leaf.parent = block;
+        leaf.entries = DX_NODE_ENTRIES_OFFSET;
+    }
+}
+
+int Ext2::Ext2Volume::DxFind(Ext2Node* node, const char* name, uint32_t& inode) {
+    DxLeaf leaf;
+    if (DxFindLeaf(node, name, leaf)) {
+        return 1;
+    }
+
+    size_t nameLength = strlen(name);
+    for (bool continued = false;; continued = true) {
+        BlockRef ref;
+        if (GetBlock(GetInodeBlock(leaf.block, node->e2inode), ref)) {
+            return 1;
+        }
+
+        for (uint32_t offset = 0; offset + sizeof(ext2_directory_entry_t) <= blocksize;) {
+            const ext2_directory_entry_t* e2dirent =
+                reinterpret_cast<const ext2_directory_entry_t*>(ref.Data() + offset);
+            if (e2dirent->recordLength < 8 || offset + e2dirent->recordLength > blocksize) {
+                return 1; // Corrupt
+            }
+
+            if (e2dirent->inode && e2dirent->nameLength == nameLength &&
+                !strncmp(e2dirent->name, name, nameLength)) {
+                if (e2dirent->inode > super.inodeCount) {
+                    return 1; // Let the linear search report it
+                }
+
+                inode = e2dirent->inode;
+                return 0;
+            }
+
+            offset += e2dirent->recordLength;
+        }
+
+        if (continued) {
+            // Names with this hash may carry on even further, leave it to a linear search
+            return 1;
+        }
+
+        // Names with the same hash can carry on into the next leaf, marked by the lowest bit of its hash
+        if (!leaf.hasNext || leaf.nextHash != (leaf.hash | 1)) {
+            return -ENOENT;
+        }
+
+        leaf.block = leaf.nextBlock;
+    }
+}
+
+int Ext2::Ext2Volume::DxInsert(Ext2Node* node, DirectoryEntry& ent, bool canSplit) {
+    DxLeaf leaf;
+    if (DxFindLeaf(node, ent.name, leaf)) {
+        return 1;
+    }
+
+    uint32_t block = GetInodeBlock(leaf.block, node->e2inode);
+    uint8_t buffer[blocksize];
+    if (!block || ReadBlock(block, buffer)) {
+        return 1;
+    }
+
+    size_t nameLength = strlen(ent.name);
+    uint16_t needed = RecordSize(nameLength);
+
+    // Record with enough space after its name for the new one
+    ext2_directory_entry_t* slot = nullptr;
+    for (uint32_t offset = 0; offset + sizeof(ext2_directory_entry_t) <= blocksize;) {
+        ext2_directory_entry_t* e2dirent = reinterpret_cast<ext2_directory_entry_t*>(buffer + offset);
+        if (e2dirent->recordLength < 8 || offset + e2dirent->recordLength > blocksize) {
+            return 1; // Corrupt
+        }
+
+        if (e2dirent->inode && e2dirent->nameLength == nameLength && !strncmp(e2dirent->name, ent.name, nameLength)) {
+            return -EEXIST;
+        }
+
+        uint16_t used = e2dirent->inode ? RecordSize(e2dirent->nameLength) : 0;
+        if (!slot && e2dirent->recordLength - used >= needed) {
+            slot = e2dirent;
+        }
+
+        offset += e2dirent->recordLength;
+    }
+
+    if (!slot) {
+        if (!canSplit) {
+            return 1;
+        }
+
+        if (int e = DxSplitLeaf(node, leaf)) {
+            return e;
+        }
+
+        // The name belongs in one of the halves, both of which now have space
+        return DxInsert(node, ent, false);
+    }
+
+    if (slot->inode) {
+        // Split the record
+        uint16_t used = RecordSize(slot->nameLength);
+        ext2_directory_entry_t* next =
+            reinterpret_cast<ext2_directory_entry_t*>(reinterpret_cast<uint8_t*>(slot) + used);
+        next->recordLength = slot->recordLength - used;
+        slot->recordLength = used;
+        slot = next;
+    }
+
+    slot->inode = ent.inode;
+    slot->nameLength = nameLength;
+    slot->fileType = ent.flags;
+    memcpy(slot->name, ent.name, nameLength);
+
+    if (int e = WriteBlock(block, buffer)) {
+        Log::Error("[Ext2] DxInsert: Failed to write directory block");
+        error = DiskWriteError;
+        return e > 0 ? -EIO : e;
+    }
+
+    return 0;
+}
+
+int Ext2::Ext2Volume::DxRemove(Ext2Node* node, const char* name) {
+    DxLeaf leaf;
+    if (DxFindLeaf(node, name, leaf)) {
+        return 1;
+    }
+
+    uint32_t block = GetInodeBlock(leaf.block, node->e2inode);
+    uint8_t buffer[blocksize];
+    if (!block || ReadBlock(block, buffer)) {
+        return 1;
+    }
+
+    size_t nameLength = strlen(name);
+    ext2_directory_entry_t* previous = nullptr;
+    for (uint32_t offset = 0; offset + sizeof(ext2_directory_entry_t) <= blocksize;) {
+        ext2_directory_entry_t* e2dirent = reinterpret_cast<ext2_directory_entry_t*>(buffer + offset);
+        if (e2dirent->recordLength < 8 || offset + e2dirent->recordLength > blocksize) {
+            return 1; // Corrupt
+        }
+
+        if (e2dirent->inode && e2dirent->nameLength == nameLength && !strncmp(e2dirent->name, name, nameLength)) {
+            // Give the space to the previous record, the first record of a block is marked unused instead
+            if (previous) {
+                previous->recordLength += e2dirent->recordLength;
+            } else {
+                e2dirent->inode = 0;
+            }
+
+            if (int e = WriteBlock(block, buffer)) {
+                Log::Error("[Ext2] DxRemove: Failed to write directory block");
+                error = DiskWriteError;
+                return e > 0 ? -EIO : e;
+            }
+            return 0;
+        }
+
+        previous = e2dirent;
+        offset += e2dirent->recordLength;
+    }
+
+    return 1; // Not in the leaf it hashes to, possibly in a continuation
+}
+
+int Ext2::Ext2Volume::DxSplitLeaf(Ext2Node* node, const DxLeaf& leaf) {
+    // Make sure the parent has space for the new leaf first
+    uint32_t parentBlock = GetInodeBlock(leaf.parent, node->e2inode);
+    uint8_t parent[blocksize];
+    if (!parentBlock || ReadBlock(parentBlock, parent)) {
+        return 1;
+    }
+
+    ext2_dx_entry_t* entries = reinterpret_cast<ext2_dx_entry_t*>(parent + leaf.entries);
+    ext2_dx_countlimit_t* countLimit = reinterpret_cast<ext2_dx_countlimit_t*>(entries);
+    if (countLimit->count >= countLimit->limit) {
+        return 1; // Splitting index nodes is not supported
+    }
+
+    uint32_t leafBlock = GetInodeBlock(leaf.block, node->e2inode);
+    uint8_t buffer[blocksize];
+    if (!leafBlock || ReadBlock(leafBlock, buffer)) {
+        return 1;
+    }
+
+    struct Record {
+        uint32_t hash;
+        uint32_t offset;
+    };
+
+    // Records of the leaf sorted by hash
+    Record* records = new Record[blocksize / sizeof(ext2_directory_entry_t)];
+    unsigned recordCount = 0;
+    for (uint32_t offset = 0; offset + sizeof(ext2_directory_entry_t) <= blocksize;) {
+        ext2_directory_entry_t* e2dirent = reinterpret_cast<ext2_directory_entry_t*>(buffer + offset);
+        if (e2dirent->recordLength < 8 || offset + e2dirent->recordLength > blocksize) {
+            delete[] records;
+            return 1; // Corrupt
+        }
+
+        if (e2dirent->inode) {
+            Record record = {NameHash(e2dirent->name, e2dirent->nameLength, leaf.hashVersion, hashSeed),
+                             offset};
+
+            unsigned i = recordCount++;
+            for (; i > 0 && records[i - 1].hash > record.hash; i--) {
+                records[i] = records[i - 1];
+            }
+            records[i] = record;
+        }
+
+        offset += e2dirent->recordLength;
+    }
+
+    if (recordCount < 2) {
+        delete[] records;
+        return 1;
+    }
+
+    // Names with the same hash are kept together where possible,
+    // otherwise the new leaf is marked as continuing the hash of the last
+    unsigned split = recordCount / 2;
+    uint32_t splitHash = records[split].hash;
+    bool continued = records[split - 1].hash == splitHash;
+
+    // Write both halves compactly, the last record of each covers the rest of its block
+    uint8_t lower[blocksize];
+    uint8_t upper[blocksize];
+    auto fill = [&](uint8_t* out, unsigned first, unsigned end) {
+        uint32_t offset = 0;
+        ext2_directory_entry_t* last = nullptr;
+        for (unsigned i = first; i < end; i++) {
+            const ext2_directory_entry_t* e2dirent =
+                reinterpret_cast<const ext2_directory_entry_t*>(buffer + records[i].offset);
+
+            last = reinterpret_cast<ext2_directory_entry_t*>(out + offset);
+            memcpy(last, e2dirent, sizeof(ext2_directory_entry_t) + e2dirent->nameLength);
+            last->recordLength = RecordSize(e2dirent->nameLength);
+            offset += last->recordLength;
+        }
+
+        last->recordLength += blocksize - offset;
+    };
+
+    fill(lower, 0, split);
+    fill(upper, split, recordCount);
+    delete[] records;
+
+    // Append the new leaf to the directory, following the last block
+    uint32_t newIndex = node->e2inode.size / blocksize;
+    uint32_t newBlock = AllocateBlock(GetInodeBlock(newIndex - 1, node->e2inode) + 1);
+    if (!newBlock) {
+        return -ENOSPC;
+    }
+
+    InvalidateExtents(node, newIndex);
+    SetInodeBlock(newIndex, node->e2inode, newBlock);
+    node->e2inode.blockCount += blocksize / 512;
+    node->e2inode.size += blocksize;
+    node->size = node->e2inode.size;
+
+    // Write the new leaf before anything points to it
+    if (int e = WriteBlock(newBlock, upper)) {
+        Log::Error("[Ext2] DxSplitLeaf: Failed to write directory block");
+        error = DiskWriteError;
+        SyncNode(node);
+        return e > 0 ? -EIO : e;
+    }
+
+    for (unsigned i = countLimit->count; i > leaf.position + 1; i--) {
+        entries[i] = entries[i - 1];
+    }
+    entries[leaf.position + 1] = {.hash = splitHash | continued, .block = newIndex};
+    countLimit->count++;
+
+    int e = WriteBlock(parentBlock, parent);
+    if (!e) {
+        e = WriteBlock(leafBlock, lower);
+    }
+
+    SyncNode(node);
+    if (e) {
+        Log::Error("[Ext2] DxSplitLeaf: Failed to write directory block");
+        error = DiskWriteError;
+        return e > 0 ? -EIO : e;
+    }
+
+    return 0;
+}
+
+} // namespace fs
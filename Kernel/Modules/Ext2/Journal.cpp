@@ -0,0 +1,759 @@
+#include "Ext2.h"
+
+#include <Assert.h>
+#include <CString.h>
+#include <Errno.h>
+#include <Logging.h>
+#include <Math.h>
+#include <Objects/Process.h>
+#include <Thread.h>
+#include <Timer.h>
+
+// ext3 compatible journal
+//
+// Metadata blocks written by the volume are collected in the running transaction, which is committed
+// to the log with one sequential write once it is full, has been running for EXT2_JOURNAL_COMMIT_INTERVAL,
+// or the volume is synced. Only then are the blocks written in place, so a crash leaves either the old
+// metadata or a committed transaction that is replayed on the next mount.
+// Commits wait for the operations changing metadata (see JournalOperation) to finish,
+// so an operation is never split between two transactions.
+// All commits start at the beginning of the log. The blocks of a commit are written in place and synced
+// before the log is marked as empty again, so the log only ever holds the last transaction.
+// Until then blocks of the log reused for file data are revoked, so they are not replayed over the data.
+
+namespace fs {
+
+namespace {
+
+ALWAYS_INLINE uint32_t BE32(uint32_t value) { return __builtin_bswap32(value); }
+
+void FillHeader(void* block, uint32_t type, uint32_t sequence) {
+    Ext2::ext2_journal_header_t* header = reinterpret_cast<Ext2::ext2_journal_header_t*>(block);
+    header->magic = BE32(EXT2_JOURNAL_MAGIC);
+    header->blockType = BE32(type);
+    header->sequence = BE32(sequence);
+}
+
+} // namespace
+
+Ext2::Ext2Volume::Transaction::~Transaction() {
+    for (Block& b : blocks) {
+        delete[] b.data;
+    }
+}
+
+int Ext2::Ext2Volume::ReadJournalBlock(uint32_t index, void* buffer) {
+    if (index >= journalBlocks.get_length() || !journalBlocks[index]) {
+        return -EIO;
+    }
+
+    return ReadDeviceBlocks(journalBlocks[index], 1, buffer);
+}
+
+int Ext2::Ext2Volume::WriteJournalBlock(uint32_t index, void* buffer) {
+    if (index >= journalBlocks.get_length() || !journalBlocks[index]) {
+        return -EIO;
+    }
+
+    return WriteDeviceBlocks(journalBlocks[index], 1, buffer);
+}
+
+int Ext2::Ext2Volume::WriteJournalSuperblock() {
+    uint8_t buffer[blocksize];
+    if (int e = ReadJournalBlock(0, buffer)) {
+        return e;
+    }
+
+    memcpy(buffer, &journalSuper, sizeof(ext2_journal_superblock_t));
+    return WriteJournalBlock(0, buffer);
+}
+
+int Ext2::Ext2Volume::OpenJournal() {
+    bool needsRecovery = superext.featuresIncompat & IncompatibleFeatures::Recover;
+    if (!(superext.featuresCompat & CompatibleFeatures::Journal) || !superext.journalInode) {
+        if (needsRecovery) {
+            Log::Error("[Ext2] Volume needs recovery but has no journal");
+            return -EINVAL;
+        }
+        return 0;
+    }
+
+    ext2_inode_t ino;
+    if (int e = ReadInode(superext.journalInode, ino)) {
+        return e;
+    }
+
+    uint32_t count = ino.size / blocksize;
+    if (count < 2) {
+        Log::Error("[Ext2] Journal (inode %u) is too small", superext.journalInode);
+        return -EINVAL;
+    }
+    for (uint32_t block : GetInodeBlocks(0, count, ino)) {
+        journalBlocks.add_back(block);
+    }
+
+    uint8_t buffer[blocksize];
+    if (int e = ReadJournalBlock(0, buffer)) {
+        return e;
+    }
+    memcpy(&journalSuper, buffer, sizeof(ext2_journal_superblock_t));
+
+    uint32_t type = BE32(journalSuper.header.blockType);
+    uint32_t maxLength = BE32(journalSuper.maxLength);
+    journalFirst = BE32(journalSuper.first);
+    if (BE32(journalSuper.header.magic) != EXT2_JOURNAL_MAGIC ||
+        (type != JournalSuperblockV1 && type != JournalSuperblockV2) || BE32(journalSuper.blocksize) != blocksize ||
+        maxLength > count || !journalFirst || journalFirst + 2 >= maxLength) {
+        Log::Error("[Ext2] Journal superblock is invalid");
+        return -EINVAL;
+    }
+
+    if (type == JournalSuperblockV1) {
+        // No features or UUID
+        journalSuper.featuresCompat = journalSuper.featuresIncompat = journalSuper.featuresRoCompat = 0;
+        memset(journalSuper.uuid, 0, sizeof(journalSuper.uuid));
+    }
+
+    if (uint32_t incompat = BE32(journalSuper.featuresIncompat); incompat & ~EXT2_JOURNAL_INCOMPAT_SUPPORT) {
+        if (journalSuper.start) {
+            Log::Error("[Ext2] Journal needs recovery but uses unsupported features (%x)", incompat);
+            return -EINVAL;
+        }
+
+        // The log is empty, the volume is consistent without it
+        Log::Warning("[Ext2] Journal uses unsupported features (%x), metadata will be written in place", incompat);
+        return 0;
+    }
+
+    // The first tag of a descriptor is followed by the UUID of the journal
+    journalTags =
+        (blocksize - sizeof(ext2_journal_header_t) - sizeof(journalSuper.uuid)) / sizeof(ext2_journal_tag_t);
+    // Leave room for the descriptors and commit block of the transaction
+    uint32_t logLength = maxLength - journalFirst;
+    journalLimit = static_cast<uint64_t>(logLength - 1) * journalTags / (journalTags + 1) - 1;
+    journalSequence = BE32(journalSuper.sequence);
+
+    if (journalSuper.start) {
+        if (int e = RecoverJournal()) {
+            return e;
+        }
+    }
+
+    // Marked as needing recovery whilst mounted, as ext3 does, so the journal is checked after a crash
+    if (!needsRecovery) {
+        superext.featuresIncompat |= IncompatibleFeatures::Recover;
+        WriteSuperblock();
+    }
+
+    m_running = new Transaction();
+    m_running->sequence = journalSequence;
+    journaled = true;
+
+    Log::Info("[Ext2] Journal: %u blocks, transactions of up to %u blocks", logLength, journalLimit);
+    return 0;
+}
+
+int Ext2::Ext2Volume::RecoverJournal() {
+    HashMap<uint32_t, uint32_t> revoked;
+    uint32_t first = BE32(journalSuper.sequence);
+    uint32_t end;
+
+    ScanPass passes[] = {ScanEnd, ScanRevoke, ScanReplay};
+    for (ScanPass pass : passes) {
+        if (int e = ScanJournal(pass, end, revoked)) {
+            Log::Error("[Ext2] Failed to recover journal: %d", e);
+            return e;
+        }
+    }
+    Log::Info("[Ext2] Replayed %u transactions from the journal", end - first);
+
+    // The blocks must be in place before the log is emptied
+    if (int e = m_device->Sync()) {
+        return e;
+    }
+
+    journalSequence = end;
+    journalSuper.sequence = BE32(end);
+    journalSuper.start = 0;
+    if (int e = WriteJournalSuperblock()) {
+        return e;
+    }
+
+    if (int e = m_device->Sync()) {
+        return e;
+    }
+
+    // Replaying may have changed the superblock and block group descriptors
+    size_t superSize = sizeof(ext2_superblock_t) + sizeof(ext2_superblock_extended_t);
+    if (fs::Read(m_device, EXT2_SUPERBLOCK_LOCATION, superSize, &super) != static_cast<ssize_t>(superSize)) {
+        return -EIO;
+    }
+
+    size_t descriptorsSize = blockGroupCount * sizeof(ext2_blockgrp_desc_t);
+    if (fs::Read(m_device, BlockToLocation(superBlockIndex + 1), descriptorsSize, blockGroups) !=
+        static_cast<ssize_t>(descriptorsSize)) {
+        return -EIO;
+    }
+
+    return 0;
+}
+
+int Ext2::Ext2Volume::ScanJournal(ScanPass pass, uint32_t& end, HashMap<uint32_t, uint32_t>& revoked) {
+    uint32_t maxLength = BE32(journalSuper.maxLength);
+    uint32_t position = BE32(journalSuper.start);
+    uint32_t sequence = BE32(journalSuper.sequence);
+
+    // The log wraps around to the first block
+    auto next = [&](uint32_t pos) { return (pos + 1 >= maxLength) ? journalFirst : pos + 1; };
+
+    uint8_t buffer[blocksize];
+    uint8_t data[blocksize];
+    for (;;) {
+        if (pass != ScanEnd && sequence == end) {
+            break; // Transactions after the last commit are incomplete
+        }
+
+        if (int e = ReadJournalBlock(position, buffer)) {
+            return e;
+        }
+
+        const ext2_journal_header_t* header = reinterpret_cast<ext2_journal_header_t*>(buffer);
+        if (BE32(header->magic) != EXT2_JOURNAL_MAGIC || BE32(header->sequence) != sequence) {
+            break; // End of the log
+        }
+
+        uint32_t type = BE32(header->blockType);
+        if (type == JournalDescriptor) {
+            uint32_t offset = sizeof(ext2_journal_header_t);
+            while (offset + sizeof(ext2_journal_tag_t) <= blocksize) {
+                const ext2_journal_tag_t* tag = reinterpret_cast<ext2_journal_tag_t*>(buffer + offset);
+                uint32_t flags = BE32(tag->flags) & 0xFFFF;
+                uint32_t block = BE32(tag->block);
+                position = next(position);
+
+                // Revoked by this or a later transaction
+                uint32_t revokedBy;
+                if (pass == ScanReplay && !(revoked.get(block, revokedBy) && revokedBy >= sequence)) {
+                    if (int e = ReadJournalBlock(position, data)) {
+                        return e;
+                    }
+
+                    if (flags & TagEscaped) {
+                        *reinterpret_cast<uint32_t*>(data) = BE32(EXT2_JOURNAL_MAGIC);
+                    }
+
+                    if (int e = WriteDeviceBlocks(block, 1, data)) {
+                        return e;
+                    }
+                }
+
+                offset += sizeof(ext2_journal_tag_t) + ((flags & TagSameUUID) ? 0 : sizeof(journalSuper.uuid));
+                if (flags & TagLast) {
+                    break;
+                }
+            }
+        } else if (type == JournalCommit) {
+            sequence++;
+        } else if (type == JournalRevoke) {
+            if (pass == ScanRevoke) {
+                const ext2_journal_revoke_header_t* revoke = reinterpret_cast<ext2_journal_revoke_header_t*>(buffer);
+                uint32_t size = MIN(BE32(revoke->size), blocksize);
+                for (uint32_t offset = sizeof(ext2_journal_revoke_header_t); offset + sizeof(uint32_t) <= size;
+                     offset += sizeof(uint32_t)) {
+                    uint32_t block = BE32(*reinterpret_cast<uint32_t*>(buffer + offset));
+                    if (uint32_t revokedBy; !revoked.get(block, revokedBy) || revokedBy < sequence) {
+                        revoked.insert(block, sequence);
+                    }
+                }
+            }
+        } else {
+            break;
+        }
+
+        position = next(position);
+    }
+
+    if (pass == ScanEnd) {
+        end = sequence;
+    }
+    return 0;
+}
+
+int Ext2::Ext2Volume::JournalBlock(uint32_t block, const void* buffer) {
+    bool full;
+    {
+        ScopedMutexLock lockJournal(m_journalLock);
+        Transaction* t = m_running;
+
+        if (unsigned i; t->index.get(block, i)) {
+            memcpy(t->blocks[i].data, buffer, blocksize);
+            return 0;
+        }
+
+        uint8_t* data = new uint8_t[blocksize];
+        memcpy(data, buffer, blocksize);
+
+        if (!t->blocks.get_length()) {
+            t->started = Timer::UsecondsSinceBoot();
+        }
+
+        t->index.insert(block, t->blocks.get_length());
+        t->blocks.add_back({block, data, false});
+        full = t->blocks.get_length() >= journalLimit;
+
+        // Stop new operations joining, the transaction is committed when the running ones finish
+        if (!m_commitPending && CommitDue()) {
+            m_commitPending = true;
+        }
+    }
+
+    // Only an operation larger than the log gets here,
+    // it cannot be committed in one transaction so commit what it has changed so far
+    if (full) {
+        Log::Warning("[Ext2] Operation is too large for the journal, committing it in parts");
+        return CommitJournal();
+    }
+    return 0;
+}
+
+unsigned Ext2::Ext2Volume::ReadJournaled(uint32_t block, uint32_t count, void* buffer) {
+    uint8_t* out = reinterpret_cast<uint8_t*>(buffer);
+    unsigned found = 0;
+
+    ScopedMutexLock lockJournal(m_journalLock);
+    for (uint32_t i = 0; i < count; i++) {
+        // The running transaction holds the latest copy
+        Transaction* t = nullptr;
+        unsigned index;
+        if (m_running && m_running->index.get(block + i, index)) {
+            t = m_running;
+        } else if (m_committing && m_committing->index.get(block + i, index)) {
+            t = m_committing;
+        } else {
+            continue;
+        }
+
+        if (out) {
+            memcpy(out + i * blocksize, t->blocks[index].data, blocksize);
+        }
+        found++;
+    }
+
+    return found;
+}
+
+void Ext2::Ext2Volume::ForgetJournaled(uint32_t block, uint32_t count) {
+    bool logged = false;
+    {
+        ScopedMutexLock lockJournal(m_journalLock);
+
+        Transaction* transactions[] = {m_running, m_committing};
+        for (Transaction* t : transactions) {
+            if (!t || !t->index.get_length()) {
+                continue;
+            }
+
+            for (uint32_t i = 0; i < count; i++) {
+                // Kept until the transaction is freed, a commit may be logging it
+                if (unsigned index; t->index.get(block + i, index)) {
+                    t->index.remove(block + i);
+                    t->blocks[index].forgotten = true;
+
+                    logged |= (t == m_committing);
+                }
+            }
+        }
+
+        for (uint32_t i = 0; m_logged && !logged && i < count; i++) {
+            logged = m_logged->find(block + i);
+        }
+    }
+
+    if (logged) {
+        RevokeJournaled(block, count);
+    }
+}
+
+int Ext2::Ext2Volume::RevokeJournaled(uint32_t block, uint32_t count) {
+    // Waits for any commit to finish writing the log
+    ScopedMutexLock lockCommit(m_commitLock);
+
+    Vector<uint32_t> revoked;
+    {
+        ScopedMutexLock lockJournal(m_journalLock);
+        for (uint32_t i = 0; m_logged && i < count; i++) {
+            if (m_logged->find(block + i)) {
+                revoked.add_back(block + i);
+            }
+        }
+    }
+
+    if (!revoked.get_length()) {
+        return 0;
+    }
+
+    // Once the checkpoint is synced the log is only waiting for the superblock marking it as empty to reach the disk
+    uint32_t perBlock = (blocksize - sizeof(ext2_journal_revoke_header_t)) / sizeof(uint32_t);
+    uint32_t revokeBlocks = (revoked.get_length() + perBlock - 1) / perBlock;
+    if (!journalSuper.start || journalEnd + revokeBlocks + 1 > BE32(journalSuper.maxLength)) {
+        return EmptyJournal();
+    }
+
+    // The revoke takes the sequence of the running transaction, as it is committed first
+    uint32_t sequence;
+    {
+        ScopedMutexLock lockJournal(m_journalLock);
+        sequence = m_running->sequence++;
+    }
+
+    uint8_t buffer[blocksize];
+    uint32_t position = journalEnd;
+    int e = 0;
+    for (unsigned i = 0; !e && i < revoked.get_length();) {
+        memset(buffer, 0, blocksize);
+        FillHeader(buffer, JournalRevoke, sequence);
+
+        uint32_t offset = sizeof(ext2_journal_revoke_header_t);
+        for (; i < revoked.get_length() && offset + sizeof(uint32_t) <= blocksize; i++) {
+            *reinterpret_cast<uint32_t*>(buffer + offset) = BE32(revoked[i]);
+            offset += sizeof(uint32_t);
+        }
+        reinterpret_cast<ext2_journal_revoke_header_t*>(buffer)->size = BE32(offset);
+
+        e = WriteJournalBlock(position++, buffer);
+    }
+
+    if (!e) {
+        memset(buffer, 0, blocksize);
+        FillHeader(buffer, JournalCommit, sequence);
+        e = WriteJournalBlock(position++, buffer);
+    }
+
+    // Must be on disk before the blocks are written over
+    if (!e) {
+        e = m_device->Sync();
+    }
+
+    if (e) {
+        Log::Error("[Ext2] Failed to revoke %u blocks: %d", revoked.get_length(), e);
+        error = DiskWriteError;
+        return e;
+    }
+
+    journalEnd = position;
+
+    ScopedMutexLock lockJournal(m_journalLock);
+    for (uint32_t b : revoked) {
+        m_logged->remove(b);
+    }
+    return 0;
+}
+
+int Ext2::Ext2Volume::EmptyJournal() {
+    // The blocks of the last commit must be in place before the log is dropped
+    int e = m_device->Sync();
+    if (!e && journalSuper.start) {
+        {
+            // Start after every sequence used in the log, so none of its blocks are taken for later transactions
+            ScopedMutexLock lockJournal(m_journalLock);
+            journalSuper.sequence = BE32(m_running->sequence);
+        }
+        journalSuper.start = 0;
+
+        e = WriteJournalSuperblock();
+        if (!e) {
+            e = m_device->Sync();
+        }
+    }
+
+    if (e) {
+        Log::Error("[Ext2] Failed to empty journal: %d", e);
+        error = DiskWriteError;
+        return e;
+    }
+
+    journalEnd = 0;
+
+    ScopedMutexLock lockJournal(m_journalLock);
+    delete m_logged;
+    m_logged = nullptr;
+    return 0;
+}
+
+bool Ext2::Ext2Volume::CommitDue() {
+    if (!journaled || !m_running->blocks.get_length()) {
+        return false;
+    }
+
+    // Leaves half the log for the operations still running
+    return m_running->blocks.get_length() >= MIN(EXT2_JOURNAL_MAX_TRANSACTION, journalLimit / 2) ||
+           Timer::UsecondsSinceBoot() - m_running->started >= EXT2_JOURNAL_COMMIT_INTERVAL;
+}
+
+bool Ext2::Ext2Volume::JournalCommitDue() {
+    ScopedMutexLock lockJournal(m_journalLock);
+    return CommitDue();
+}
+
+void Ext2::Ext2Volume::StartJournalOperation() {
+    if (!journaled) {
+        return;
+    }
+
+    for (;;) {
+        {
+            ScopedMutexLock lockJournal(m_journalLock);
+            if (!m_commitPending) {
+                m_journalOperations++;
+                return;
+            }
+
+            m_commitWaiting++;
+        }
+
+        if (m_commitWaiters.Wait()) {
+            ScopedMutexLock lockJournal(m_journalLock);
+            if (m_commitWaiting) {
+                m_commitWaiting--; // Not woken by the commit
+            }
+        }
+    }
+}
+
+void Ext2::Ext2Volume::EndJournalOperation() {
+    if (!journaled) {
+        return;
+    }
+
+    {
+        ScopedMutexLock lockJournal(m_journalLock);
+        if (!m_commitPending && CommitDue()) {
+            m_commitPending = true;
+        }
+
+        if (--m_journalOperations || !m_commitPending) {
+            return;
+        }
+    }
+
+    // We were the last operation in the transaction
+    FinishPendingCommit();
+}
+
+int Ext2::Ext2Volume::CommitJournalAtBoundary(bool wait) {
+    if (!journaled) {
+        return 0;
+    }
+
+    {
+        ScopedMutexLock lockJournal(m_journalLock);
+        bool pending = m_commitPending;
+        m_commitPending = true;
+
+        if (pending || m_journalOperations) {
+            // The last operation to finish (or whoever set m_commitPending) commits
+            if (!wait) {
+                return 0;
+            }
+
+            m_commitWaiting++;
+        } else {
+            wait = false;
+        }
+    }
+
+    if (wait) {
+        if (m_commitWaiters.Wait()) {
+            ScopedMutexLock lockJournal(m_journalLock);
+            if (m_commitWaiting) {
+                m_commitWaiting--;
+            }
+            return -EINTR;
+        }
+        return error ? -EIO : 0;
+    }
+
+    return FinishPendingCommit();
+}
+
+int Ext2::Ext2Volume::FinishPendingCommit() {
+    int e = CommitJournal();
+
+    unsigned waiting;
+    {
+        ScopedMutexLock lockJournal(m_journalLock);
+        m_commitPending = false;
+        waiting = m_commitWaiting;
+        m_commitWaiting = 0;
+    }
+
+    while (waiting--) {
+        m_commitWaiters.Signal();
+    }
+    return e;
+}
+
+int Ext2::Ext2Volume::CommitJournal() {
+    if (!journaled) {
+        return 0;
+    }
+
+    ScopedMutexLock lockCommit(m_commitLock);
+
+    Transaction* t;
+    {
+        ScopedMutexLock lockJournal(m_journalLock);
+        if (!m_running->blocks.get_length()) {
+            return 0;
+        }
+
+        t = m_committing = m_running;
+        m_running = new Transaction();
+        m_running->sequence = t->sequence + 1;
+    }
+
+    // File data written before the commit and the blocks of the last commit must reach the disk
+    // before the log is overwritten
+    int e = m_device->Sync();
+    if (!e && !journalSuper.start) {
+        // The superblock marking the log as empty is on disk
+        ScopedMutexLock lockJournal(m_journalLock);
+        delete m_logged;
+        m_logged = nullptr;
+        journalEnd = 0;
+    }
+
+    // Blocks written to the log, they are in the log on disk once it is committed
+    HashMap<uint32_t, uint32_t>* logged = new HashMap<uint32_t, uint32_t>();
+
+    uint8_t descriptor[blocksize];
+    uint8_t block[blocksize];
+    uint32_t position = journalFirst;
+    unsigned i = 0;
+    while (!e && i < t->blocks.get_length()) {
+        memset(descriptor, 0, blocksize);
+        FillHeader(descriptor, JournalDescriptor, t->sequence);
+
+        // The descriptor is followed by the blocks of its tags
+        uint32_t descriptorPosition = position++;
+        uint32_t offset = sizeof(ext2_journal_header_t);
+        ext2_journal_tag_t* last = nullptr;
+        for (; i < t->blocks.get_length() && offset + sizeof(ext2_journal_tag_t) <= blocksize; i++) {
+            Transaction::Block& b = t->blocks[i];
+            if (b.forgotten) {
+                continue;
+            }
+
+            if (!last && offset + sizeof(ext2_journal_tag_t) + sizeof(journalSuper.uuid) > blocksize) {
+                break;
+            }
+
+            uint32_t flags = last ? TagSameUUID : 0;
+            memcpy(block, b.data, blocksize);
+            // Blocks cannot start with the magic, they would be taken for journal blocks
+            if (BE32(*reinterpret_cast<uint32_t*>(block)) == EXT2_JOURNAL_MAGIC) {
+                *reinterpret_cast<uint32_t*>(block) = 0;
+                flags |= TagEscaped;
+            }
+
+            ext2_journal_tag_t* tag = reinterpret_cast<ext2_journal_tag_t*>(descriptor + offset);
+            tag->block = BE32(b.block);
+            tag->flags = BE32(flags);
+            offset += sizeof(ext2_journal_tag_t);
+            if (!last) {
+                memcpy(descriptor + offset, journalSuper.uuid, sizeof(journalSuper.uuid));
+                offset += sizeof(journalSuper.uuid);
+            }
+            last = tag;
+
+            if ((e = WriteJournalBlock(position++, block))) {
+                break;
+            }
+            logged->insert(b.block, t->sequence);
+        }
+
+        if (!last) {
+            position--; // Every block left was forgotten
+            break;
+        }
+
+        last->flags |= BE32(TagLast);
+        if (!e) {
+            e = WriteJournalBlock(descriptorPosition, descriptor);
+        }
+    }
+
+    if (!e) {
+        memset(descriptor, 0, blocksize);
+        FillHeader(descriptor, JournalCommit, t->sequence);
+        e = WriteJournalBlock(position, descriptor);
+    }
+
+    if (!e) {
+        // A log holding an incomplete transaction is taken as empty, so the order these reach the disk in
+        // does not matter
+        journalSuper.sequence = BE32(t->sequence);
+        journalSuper.start = BE32(journalFirst);
+        e = WriteJournalSuperblock();
+    }
+
+    if (!e) {
+        e = m_device->Sync();
+    }
+
+    if (e) {
+        // The blocks are still written in place, the volume is as consistent as it would be without a journal
+        Log::Error("[Ext2] Failed to commit transaction %u: %d", t->sequence, e);
+        error = DiskWriteError;
+        delete logged;
+    } else {
+        // The last log has been overwritten
+        ScopedMutexLock lockJournal(m_journalLock);
+        delete m_logged;
+        m_logged = logged;
+        journalEnd = position + 1;
+    }
+
+    for (Transaction::Block& b : t->blocks) {
+        ScopedMutexLock lockJournal(m_journalLock);
+        if (!b.forgotten) {
+            WriteDeviceBlocks(b.block, 1, b.data);
+        }
+    }
+
+    {
+        ScopedMutexLock lockJournal(m_journalLock);
+        m_committing = nullptr;
+        __atomic_add_fetch(&journalCheckpoints, 1, __ATOMIC_RELEASE);
+    }
+
+    delete t;
+
+    // Once the checkpoint is on disk the log is no longer needed.
+    // The superblock marking it as empty reaches the disk with the next sync, until then
+    // blocks of the log reused for file data are handled by RevokeJournaled.
+    if (!e && journalSuper.start && !(e = m_device->Sync())) {
+        {
+            ScopedMutexLock lockJournal(m_journalLock);
+            journalSuper.sequence = BE32(m_running->sequence);
+        }
+        journalSuper.start = 0;
+        e = WriteJournalSuperblock();
+    }
+    return e;
+}
+
+void Ext2::JournalThread() {
+    for (;;) {
+        Thread::Current()->Sleep(EXT2_JOURNAL_COMMIT_INTERVAL);
+
+        for (FsVolume* volume : Instance().m_extVolumes) {
+            Ext2Volume* vol = static_cast<Ext2Volume*>(volume);
+            if (vol->JournalCommitDue()) {
+                vol->CommitJournalAtBoundary(false);
+            }
+        }
+    }
+}
+
+} // namespace fs
@@ -5,6 +5,9 @@
 #include <Logging.h>
 #include <Math.h>
 #include <Module.h>
+#include <Objects/Process.h>
+#include <Paging.h>
+#include <PhysicalAllocator.h>
 
 #include <Debug.h>
 
@@ -31,8 +34,13 @@ DECLARE_MODULE("ext2fs", "Ext2 Filesystem Driver", ModuleInit, ModuleExit);
 lock_t Ext2::m_instanceLock = 0;
 Ext2* Ext2::m_instance = nullptr;
 
-Ext2::Ext2() { fs::RegisterDriver(this); }
-Ext2::~Ext2() { fs::UnregisterDriver(this); }
+Ext2::Ext2() {
+    fs::RegisterDriver(this);
+}
+
+Ext2::~Ext2() {
+    fs::UnregisterDriver(this);
+}
 
 Ext2& Ext2::Instance() {
     if (m_instance) {
@@ -56,6 +64,12 @@ FsVolume* Ext2::Mount(FsNode* device, const char* name) {
     }
 
     m_extVolumes.add_back(vol);
+
+    // One thread commits the journals of every volume
+    if (vol->IsJournaled() && !m_journalThread) {
+        m_journalThread = true;
+        Process::CreateKernelProcess((void*)JournalThread, "Ext2Journal", nullptr)->Start();
+    }
     return vol;
 }
 
@@ -80,6 +94,9 @@ Ext2::Ext2Volume::Ext2Volume(FsNode* device, const char* name) {
     m_device = device;
     assert(device->IsCharDevice() || device->IsBlockDevice());
 
+    m_cacheOffset = 0;
+    m_cacheDisk = device->CacheDisk(m_cacheOffset);
+
     if (fs::Read(m_device, EXT2_SUPERBLOCK_LOCATION, sizeof(ext2_superblock_t), &super) != sizeof(ext2_superblock_t)) {
         Log::Error("[Ext2] Disk Error Initializing Volume");
         error = DiskReadError;
@@ -121,6 +138,7 @@ Ext2::Ext2Volume::Ext2Volume(FsNode* device, const char* name) {
     } else {
         memset(&superext, 0, sizeof(ext2_superblock_extended_t));
     }
+    memcpy(hashSeed, superext.hashSeed, sizeof(hashSeed));
 
     blockGroupCount = (super.blockCount % super.blocksPerGroup) ? (super.blockCount / super.blocksPerGroup + 1)
                                                                 : (super.blockCount / super.blocksPerGroup); // Round up
@@ -155,6 +173,7 @@ Ext2::Ext2Volume::Ext2Volume(FsNode* device, const char* name) {
     }
 
     blockGroups = (ext2_blockgrp_desc_t*)kmalloc(blockGroupCount * sizeof(ext2_blockgrp_desc_t));
+    blockGroupStates = new BlockGroupState[blockGroupCount]{};
 
     uint64_t blockGroupOffset =
         BlockToLocation(LocationToBlock(EXT2_SUPERBLOCK_LOCATION) + 1); // One block from the superblock
@@ -166,6 +185,11 @@ Ext2::Ext2Volume::Ext2Volume(FsNode* device, const char* name) {
         return; // Disk Error
     }
 
+    if (OpenJournal()) {
+        error = IncompatibleError;
+        return;
+    }
+
     ext2_inode_t root;
     if (ReadInode(EXT2_ROOT_INODE_INDEX, root)) {
         Log::Error("[Ext2] Disk Error Initializing Volume");
@@ -187,7 +211,7 @@ void Ext2::Ext2Volume::WriteSuperblock() {
     uint8_t buffer[blocksize];
 
     uint32_t superindex = LocationToBlock(EXT2_SUPERBLOCK_LOCATION);
-    if (ReadBlockCached(superindex, buffer)) {
+    if (ReadBlock(superindex, buffer)) {
         Log::Info("[Ext2] WriteBlock: Error reading block %d", superindex);
         return;
     }
@@ -195,7 +219,7 @@ void Ext2::Ext2Volume::WriteSuperblock() {
     memcpy(buffer + (EXT2_SUPERBLOCK_LOCATION % blocksize), &super,
            sizeof(ext2_superblock_t) + sizeof(ext2_superblock_extended_t));
 
-    if (WriteBlockCached(superindex, buffer)) {
+    if (WriteBlock(superindex, buffer)) {
         Log::Info("[Ext2] WriteBlock: Error writing block %d", superindex);
         return;
     }
@@ -206,7 +230,7 @@ void Ext2::Ext2Volume::WriteBlockGroupDescriptor(uint32_t index) {
     uint32_t block = firstBlockGroup + LocationToBlock(index * sizeof(ext2_blockgrp_desc_t));
     uint8_t buffer[blocksize];
 
-    if (ReadBlockCached(block, buffer)) {
+    if (ReadBlock(block, buffer)) {
         Log::Info("[Ext2] WriteBlock: Error reading block %d", block);
         return;
     }
@@ -214,7 +238,7 @@ void Ext2::Ext2Volume::WriteBlockGroupDescriptor(uint32_t index) {
     memcpy(buffer + ((index * sizeof(ext2_blockgrp_desc_t)) % blocksize), &blockGroups[index],
            sizeof(ext2_blockgrp_desc_t));
 
-    if (WriteBlockCached(block, buffer)) {
+    if (WriteBlock(block, buffer)) {
         Log::Info("[Ext2] WriteBlock: Error writing block %d", block);
         return;
     }
@@ -234,35 +258,32 @@ uint32_t Ext2::Ext2Volume::GetInodeBlock(uint32_t index, ext2_inode_t& ino) {
         return ino.blocks[index];
     } else if (index < doublyIndirectStart) {
         // Index lies within the singly indirect blocklist
-        uint32_t buffer[blocksize / sizeof(uint32_t)];
-
-        if (int e = ReadBlockCached(ino.blocks[EXT2_SINGLY_INDIRECT_INDEX], buffer)) {
+        BlockRef ref;
+        if (int e = GetBlock(ino.blocks[EXT2_SINGLY_INDIRECT_INDEX], ref)) {
             (void)e;
             error = DiskReadError;
             return 0;
         }
 
-        return buffer[index - singlyIndirectStart];
+        return ref.As<uint32_t>()[index - singlyIndirectStart];
     } else if (index < triplyIndirectStart) {
         // Index lies within the doubly indirect blocklist
-        uint32_t blockPointers[blocksize / sizeof(uint32_t)];
-        uint32_t buffer[blocksize / sizeof(uint32_t)];
-
-        if (int e = ReadBlockCached(ino.blocks[EXT2_DOUBLY_INDIRECT_INDEX], blockPointers)) {
+        BlockRef ref;
+        if (int e = GetBlock(ino.blocks[EXT2_DOUBLY_INDIRECT_INDEX], ref)) {
             (void)e;
             error = DiskReadError;
             return 0;
         }
 
-        uint32_t blockPointer = blockPointers[(index - doublyIndirectStart) / blocksPerPointer];
+        uint32_t blockPointer = ref.As<uint32_t>()[(index - doublyIndirectStart) / blocksPerPointer];
 
-        if (int e = ReadBlockCached(blockPointer, buffer)) {
+        if (int e = GetBlock(blockPointer, ref)) {
             (void)e;
             error = DiskReadError;
             return 0;
         }
 
-        return buffer[(index - doublyIndirectStart) % blocksPerPointer];
+        return ref.As<uint32_t>()[(index - doublyIndirectStart) % blocksPerPointer];
     } else {
         assert(!"Yet to support triply indirect");
         return 0;
@@ -290,9 +311,8 @@ Vector<uint32_t> Ext2::Ext2Volume::GetInodeBlocks(uint32_t index, uint32_t count
 
     if (i < doublyIndirectStart && i < index + count) {
         // Index lies within the singly indirect blocklist
-        uint32_t buffer[blocksize / sizeof(uint32_t)];
-
-        if (int e = ReadBlockCached(ino.blocks[EXT2_SINGLY_INDIRECT_INDEX], buffer)) {
+        BlockRef ref;
+        if (int e = GetBlock(ino.blocks[EXT2_SINGLY_INDIRECT_INDEX], ref)) {
             Log::Info("[Ext2] GetInodeBlocks: Error %i reading block %u (singly indirect block)", e,
                       ino.blocks[EXT2_SINGLY_INDIRECT_INDEX]);
             error = DiskReadError;
@@ -301,6 +321,7 @@ Vector<uint32_t> Ext2::Ext2Volume::GetInodeBlocks(uint32_t index, uint32_t count
             return blocks;
         }
 
+        const uint32_t* buffer = ref.As<uint32_t>();
         while (i < doublyIndirectStart && i < index + count) {
             uint32_t block = buffer[(i++) - singlyIndirectStart];
             if (block >= super.blockCount) {
@@ -313,10 +334,9 @@ Vector<uint32_t> Ext2::Ext2Volume::GetInodeBlocks(uint32_t index, uint32_t count
 
     if (i < triplyIndirectStart && i < index + count) {
         // Index lies within the doubly indirect blocklist
-        uint32_t blockPointers[blocksize / sizeof(uint32_t)];
-        uint32_t buffer[blocksize / sizeof(uint32_t)];
-
-        if (int e = ReadBlockCached(ino.blocks[EXT2_DOUBLY_INDIRECT_INDEX], blockPointers)) {
+        BlockRef pointersRef;
+        BlockRef ref;
+        if (int e = GetBlock(ino.blocks[EXT2_DOUBLY_INDIRECT_INDEX], pointersRef)) {
             Log::Info("[Ext2] GetInodeBlocks: Error %i reading block %u (doubly indirect block)", e,
                       ino.blocks[EXT2_DOUBLY_INDIRECT_INDEX]);
             error = DiskReadError;
@@ -325,10 +345,11 @@ Vector<uint32_t> Ext2::Ext2Volume::GetInodeBlocks(uint32_t index, uint32_t count
             return blocks;
         }
 
+        const uint32_t* blockPointers = pointersRef.As<uint32_t>();
         while (i < triplyIndirectStart && i < index + count) {
             uint32_t blockPointer = blockPointers[(i - doublyIndirectStart) / blocksPerPointer];
 
-            if (int e = ReadBlockCached(blockPointer, buffer)) {
+            if (int e = GetBlock(blockPointer, ref)) {
                 Log::Info("[Ext2] GetInodeBlocks: Error %i reading block %u (doubly indirect block pointer)", e,
                           blockPointer);
                 error = DiskReadError;
@@ -337,6 +358,7 @@ Vector<uint32_t> Ext2::Ext2Volume::GetInodeBlocks(uint32_t index, uint32_t count
                 return blocks;
             }
 
+            const uint32_t* buffer = ref.As<uint32_t>();
             uint32_t blockPointerEnd = i + (blocksPerPointer - (i - doublyIndirectStart) % blocksPerPointer);
             while (i < blockPointerEnd && i < index + count) {
                 uint32_t block = buffer[(i - doublyIndirectStart) % blocksPerPointer];
@@ -380,7 +402,7 @@ void Ext2::Ext2Volume::SetInodeBlock(uint32_t index, ext2_inode_t& ino, uint32_t
             ino.blocks[EXT2_SINGLY_INDIRECT_INDEX] = AllocateBlock();
         }
 
-        if (int e = ReadBlockCached(ino.blocks[EXT2_SINGLY_INDIRECT_INDEX], buffer)) {
+        if (int e = ReadBlock(ino.blocks[EXT2_SINGLY_INDIRECT_INDEX], buffer)) {
             (void)e;
             error = DiskReadError;
             return;
@@ -388,7 +410,7 @@ void Ext2::Ext2Volume::SetInodeBlock(uint32_t index, ext2_inode_t& ino, uint32_t
 
         buffer[index - singlyIndirectStart] = block;
 
-        if (int e = WriteBlockCached(ino.blocks[EXT2_SINGLY_INDIRECT_INDEX], buffer)) {
+        if (int e = WriteBlock(ino.blocks[EXT2_SINGLY_INDIRECT_INDEX], buffer)) {
             (void)e;
             error = DiskWriteError;
             return;
@@ -399,7 +421,7 @@ void Ext2::Ext2Volume::SetInodeBlock(uint32_t index, ext2_inode_t& ino, uint32_t
         uint32_t blockPointers[blocksize / sizeof(uint32_t)];
         uint32_t buffer[blocksize / sizeof(uint32_t)];
 
-        if (int e = ReadBlockCached(ino.blocks[EXT2_DOUBLY_INDIRECT_INDEX],
+        if (int e = ReadBlock(ino.blocks[EXT2_DOUBLY_INDIRECT_INDEX],
                                     blockPointers)) { // Read indirect block pointer list
             (void)e;
             error = DiskReadError;
@@ -408,7 +430,7 @@ void Ext2::Ext2Volume::SetInodeBlock(uint32_t index, ext2_inode_t& ino, uint32_t
 
         uint32_t blockPointer = blockPointers[(index - doublyIndirectStart) / blocksPerPointer];
 
-        if (int e = ReadBlockCached(blockPointer, buffer)) { // Read blocklist
+        if (int e = ReadBlock(blockPointer, buffer)) { // Read blocklist
             (void)e;
             error = DiskReadError;
             return;
@@ -416,7 +438,7 @@ void Ext2::Ext2Volume::SetInodeBlock(uint32_t index, ext2_inode_t& ino, uint32_t
 
         buffer[(index - doublyIndirectStart) % blocksPerPointer] = block; // Update the index
 
-        if (int e = WriteBlockCached(blockPointer, buffer)) { // Write our updated blocklist
+        if (int e = WriteBlock(blockPointer, buffer)) { // Write our updated blocklist
             (void)e;
             error = DiskWriteError;
             return;
@@ -428,313 +450,456 @@ void Ext2::Ext2Volume::SetInodeBlock(uint32_t index, ext2_inode_t& ino, uint32_t
     }
 }
 
+Vector<uint32_t> Ext2::Ext2Volume::GetNodeBlocks(Ext2Node* node, uint32_t index, uint32_t count) {
+    ScopedMutexLock lockExtents(node->extentLock);
+    if (index + count > node->mappedBlocks && MapExtents(node, index + count)) {
+        return GetInodeBlocks(index, count, node->e2inode);
+    }
+
+    Vector<uint32_t> blocks;
+    blocks.reserve(count);
+
+    uint32_t end = index + count;
+    uint32_t i = index;
+    for (unsigned e = FindExtent(node, index); e < node->extents.size() && i < end; e++) {
+        const BlockExtent& extent = node->extents[e];
+
+        uint32_t extentEnd = MIN(extent.index + extent.count, end);
+        for (; i < extentEnd; i++) {
+            blocks.add_back(extent.block ? extent.block + (i - extent.index) : 0);
+        }
+    }
+
+    // Past the end of the blocklist
+    for (; i < end; i++) {
+        blocks.add_back(0);
+    }
+
+    return blocks;
+}
+
+int Ext2::Ext2Volume::MapExtents(Ext2Node* node, uint32_t limit) {
+    uint32_t fileBlocks = (node->e2inode.size + blocksize - 1) / blocksize;
+
+    // Map ahead so sequential access does not walk the blocklist each time
+    limit = MAX(limit, node->mappedBlocks + EXT2_EXTENT_MAP_BATCH);
+    limit = MIN(limit, fileBlocks);
+
+    while (node->mappedBlocks < limit) {
+        uint32_t count = MIN(limit - node->mappedBlocks, EXT2_EXTENT_MAP_BATCH);
+
+        Vector<uint32_t> blocks = GetInodeBlocks(node->mappedBlocks, count, node->e2inode);
+        if (blocks.size() != count) {
+            return DiskReadError;
+        }
+
+        for (uint32_t block : blocks) {
+            if (node->extents.size()) {
+                BlockExtent& last = node->extents[node->extents.size() - 1];
+                // Extend the last extent if the block follows on from it
+                if ((!last.block && !block) || (last.block && block == last.block + last.count)) {
+                    last.count++;
+                    node->mappedBlocks++;
+                    continue;
+                }
+            }
+
+            node->extents.add_back({.index = node->mappedBlocks, .block = block, .count = 1});
+            node->mappedBlocks++;
+        }
+    }
+
+    return 0;
+}
+
+void Ext2::Ext2Volume::InvalidateExtents(Ext2Node* node, uint32_t index) {
+    ScopedMutexLock lockExtents(node->extentLock);
+    if (index >= node->mappedBlocks) {
+        return;
+    }
+
+    while (node->extents.size()) {
+        BlockExtent& last = node->extents[node->extents.size() - 1];
+        if (last.index < index) {
+            last.count = MIN(last.count, index - last.index);
+            break;
+        }
+
+        node->extents.pop_back();
+    }
+
+    node->mappedBlocks = index;
+}
+
+unsigned Ext2::Ext2Volume::FindExtent(Ext2Node* node, uint32_t index) {
+    // Extents are sorted by index and start at 0
+    unsigned first = 0;
+    unsigned last = node->extents.size();
+    while (last - first > 1) {
+        unsigned mid = (first + last) / 2;
+        if (node->extents[mid].index <= index) {
+            first = mid;
+        } else {
+            last = mid;
+        }
+    }
+
+    return first;
+}
+
 int Ext2::Ext2Volume::ReadInode(uint32_t num, ext2_inode_t& inode) {
-    uint8_t buf[512];
+    // Read through the block so changes to the inode table still in the journal are seen
+    BlockRef ref;
+    uint64_t off = InodeOffset(num);
 
-    if (int e = fs::Read(m_device, InodeOffset(num) & (~511U), 512, buf); e != 512) {
+    if (int e = GetBlock(off / blocksize, ref); e) {
         Log::Error("[Ext2] Disk Error (%d) Reading Inode %d", e, num);
         error = DiskReadError;
         return e;
     }
 
-    inode = *(ext2_inode_t*)(buf + ((ResolveInodeBlockGroupIndex(num) * inodeSize) & (512 - 1)));
+    inode = *reinterpret_cast<const ext2_inode_t*>(ref.Data() + off % blocksize);
     return 0;
 }
 
-int Ext2::Ext2Volume::ReadBlock(uint32_t block, void* buffer) {
-    if (block > super.blockCount)
-        return 1;
+int Ext2::Ext2Volume::ReadBlock(uint32_t block, void* buffer) { return ReadBlocks(block, 1, buffer); }
 
-    if (int e = fs::Read(m_device, BlockToLocation(block), blocksize, buffer); e != blocksize) {
-        Log::Error("[Ext2] Disk error (%d) reading block %d (blocksize: %d)", e, block, blocksize);
-        return e;
+int Ext2::Ext2Volume::ReadBlocks(uint32_t block, uint32_t count, void* buffer) {
+    if (!journaled) {
+        return ReadDeviceBlocks(block, count, buffer);
     }
 
-    return 0;
+    for (;;) {
+        // Read again if blocks were written in place (and so left the journal) whilst we read
+        uint64_t checkpoints = __atomic_load_n(&journalCheckpoints, __ATOMIC_ACQUIRE);
+        if (int e = ReadDeviceBlocks(block, count, buffer)) {
+            return e;
+        }
+
+        ReadJournaled(block, count, buffer);
+        if (checkpoints == __atomic_load_n(&journalCheckpoints, __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+    }
 }
 
-int Ext2::Ext2Volume::WriteBlock(uint32_t block, void* buffer) {
-    if (block > super.blockCount)
+int Ext2::Ext2Volume::ReadDeviceBlocks(uint32_t block, uint32_t count, void* buffer) {
+    if (block + count - 1 > super.blockCount)
         return 1;
 
-    if (int e = fs::Write(m_device, BlockToLocation(block), blocksize, buffer); e != blocksize) {
-        Log::Error("[Ext2] Disk error (%e) reading block %d (blocksize: %d)", e, block, blocksize);
-        return e;
+    size_t size = static_cast<size_t>(count) * blocksize;
+    if (ssize_t e = fs::Read(m_device, BlockToLocation(block), size, buffer); e != static_cast<ssize_t>(size)) {
+        Log::Error("[Ext2] Disk error (%d) reading %u blocks from block %d (blocksize: %d)", e, count, block,
+                   blocksize);
+        return e ? e : 1;
     }
 
     return 0;
 }
 
-int Ext2::Ext2Volume::ReadBlockCached(uint32_t block, void* buffer) {
+int Ext2::Ext2Volume::GetBlock(uint32_t block, BlockRef& ref) {
     if (block > super.blockCount)
-        return -EINVAL;
+        return 1;
 
-#ifndef EXT2_NO_CACHE
-    ScopedSpinLock lockBlockCache(m_blocksLock);
+    // Blocks in the journal are newer than the BlockCache, they are copied instead
+    bool inJournal = journaled && ReadJournaled(block, 1, nullptr);
+    if (m_cacheDisk && !inJournal) {
+        uint64_t offset = m_cacheOffset + BlockToLocation(block);
+        size_t pageOffset = offset & (PAGE_SIZE_4K - 1);
 
-    CachedBlock* cachedBlock;
-    if (blockCache.get(block, cachedBlock)) {
-        cachedBlock->timestamp = Timer::UsecondsSinceBoot();
-        memcpy(buffer, cachedBlock->data, blocksize);
+        if (pageOffset + blocksize <= PAGE_SIZE_4K && !BlockCache::Pin(m_cacheDisk, offset, ref.m_page)) {
+            ref.m_data = ref.m_page.Data() + pageOffset;
+            return 0;
+        }
+    }
 
-        // Move block to the end of the list
-        cachedBlockList.remove(cachedBlock);
-        cachedBlockList.add_back(cachedBlock);
-    } else {
-        if(blockCacheMemoryUsage >= EXT2_BLOCKCACHE_LIMIT) {
-            // Remove cached blocks until we are at the trim value
-            cachedBlock = cachedBlockList.remove_at(0);
+    ref.m_page.Release();
+    if (!ref.m_copy) {
+        ref.m_copy = new uint8_t[blocksize];
+    }
 
-            assert(blockCache.find(cachedBlock->block));
-            blockCache.remove(cachedBlock->block);
-        } else {
-            cachedBlock = AllocateCachedBlock();
+    ref.m_data = ref.m_copy;
+    return ReadBlock(block, ref.m_copy);
+}
 
-            blockCacheMemoryUsage += blocksize;
-            Ext2::Instance().totalBlockCacheMemoryUsage += blocksize;
-        }
+int Ext2::Ext2Volume::WriteBlock(uint32_t block, void* buffer) {
+    if (journaled) {
+        if (block > super.blockCount)
+            return 1;
 
-        cachedBlock->block = block;
-        cachedBlock->timestamp = Timer::UsecondsSinceBoot();
+        return JournalBlock(block, buffer);
+    }
 
-        if (int e = fs::Read(m_device, BlockToLocation(block), blocksize, cachedBlock->data); e != blocksize) {
-            Log::Error("[Ext2] Disk error (%d) reading block %d (blocksize: %d)", e, block, blocksize);
-            
-            // Since we didnt end up using this block, place it at the front of the list
-            // so it gets reused first
-            cachedBlockList.add_front(cachedBlock);
-            return e;
-        }
-        
-        cachedBlockList.add_back(cachedBlock);
-        blockCache.insert(block, cachedBlock);
+    return WriteDeviceBlocks(block, 1, buffer);
+}
 
-        memcpy(buffer, cachedBlock->data, blocksize);
+int Ext2::Ext2Volume::WriteBlocks(uint32_t block, uint32_t count, void* buffer) {
+    if (journaled) {
+        // The blocks may have been metadata before they were freed, the old contents must not be written over them
+        ForgetJournaled(block, count);
     }
-#else
-    if (int e = fs::Read(m_device, BlockToLocation(block), blocksize, buffer); e != blocksize) {
-        Log::Error("[Ext2] Disk error (%d) reading block %d (blocksize: %d)", e, block, blocksize);
-        return e;
-    }
-#endif
-    return 0;
+
+    return WriteDeviceBlocks(block, count, buffer);
 }
 
-int Ext2::Ext2Volume::WriteBlockCached(uint32_t block, void* buffer) {
-    if (block > super.blockCount)
-        return -EINVAL;
+int Ext2::Ext2Volume::WriteDeviceBlocks(uint32_t block, uint32_t count, void* buffer) {
+    if (block + count - 1 > super.blockCount)
+        return 1;
 
-#ifndef EXT2_NO_CACHE
-    ScopedSpinLock lockBlockCache(m_blocksLock);
-    
-    CachedBlock* cachedBlock;
-    if ((blockCache.get(block, cachedBlock))) {
-        memcpy(cachedBlock->data, buffer, blocksize);
-        cachedBlock->timestamp = Timer::UsecondsSinceBoot();
+    size_t size = static_cast<size_t>(count) * blocksize;
+    if (ssize_t e = fs::Write(m_device, BlockToLocation(block), size, buffer); e != static_cast<ssize_t>(size)) {
+        Log::Error("[Ext2] Disk error (%d) writing %u blocks from block %d (blocksize: %d)", e, count, block,
+                   blocksize);
+        return e ? e : 1;
     }
-#endif
 
-    if (int e = fs::Write(m_device, BlockToLocation(block), blocksize, buffer); e != blocksize) {
-        Log::Error("[Ext2] Disk error (%d) reading block %d (blocksize: %d)", e, block, blocksize);
-        return e;
+    return 0;
+}
+
+uint32_t Ext2::Ext2Volume::ContiguousBlocks(const Vector<uint32_t>& blocks, unsigned index, uint32_t limit) {
+    uint32_t count = 1;
+    // Holes (block 0) are never contiguous
+    while (count < limit && index + count < blocks.size() && blocks[index] &&
+           blocks[index + count] == blocks[index] + count) {
+        count++;
     }
 
-    return 0;
+    return count;
 }
 
-uint32_t Ext2::Ext2Volume::AllocateBlock() {
-    for (unsigned i = 0; i < blockGroupCount; i++) {
+uint32_t Ext2::Ext2Volume::AllocateBlocks(uint32_t goal, uint32_t& count) {
+    assert(count);
+    ScopedMutexLock lockAlloc(m_allocLock);
+
+    if (goal >= super.blockCount) {
+        goal = 0;
+    }
+
+    uint64_t bitmap[blocksize / sizeof(uint64_t)];
+    unsigned goalGroup = goal / super.blocksPerGroup;
+    for (unsigned n = 0; n < blockGroupCount; n++) {
+        unsigned i = (goalGroup + n) % blockGroupCount;
         ext2_blockgrp_desc_t& group = blockGroups[i];
 
         if (group.freeBlockCount <= 0)
             continue; // No free blocks in this blockgroup
 
-        uint8_t bitmap[blocksize / sizeof(uint8_t)];
+        if (int e = ReadBlock(group.blockBitmap, bitmap)) {
+            Log::Error("[Ext2] Disk error (%d) reading block bitmap (group %d)", e, i);
+            error = DiskReadError;
+            count = 0;
+            return 0;
+        }
 
-        if (uint8_t * cachedBitmap; bitmapCache.get(group.blockBitmap, cachedBitmap)) {
-            memcpy(bitmap, cachedBitmap, blocksize);
-        } else {
-            if (int e = ReadBlockCached(group.blockBitmap, bitmap)) {
-                Log::Error("[Ext2] Disk error (%d) reading block bitmap (group %d)", e, i);
-                error = DiskReadError;
-                return 0;
-            }
+        // The last group may be smaller
+        uint32_t groupBlocks = MIN(super.blocksPerGroup, super.blockCount - i * super.blocksPerGroup);
+        uint32_t start = (n == 0 && goal) ? goal % super.blocksPerGroup : blockGroupStates[i].blockHint;
+        if (start >= groupBlocks) {
+            start = 0;
         }
 
-        uint32_t block = 0;
-        unsigned e = 0;
-        for (; e < blocksize / sizeof(uint8_t); e++) {
-            if (bitmap[e] == UINT8_MAX)
+        uint32_t bit = FindClearBit(bitmap, start, groupBlocks);
+        if (bit == groupBlocks) {
+            bit = FindClearBit(bitmap, 0, start);
+            if (bit == start) {
                 continue; // Full
-
-            for (uint8_t b = 0; b < sizeof(uint8_t) * 8; b++) { // Iterate through all bits in the entry
-                if (((bitmap[e] >> b) & 0x1) == 0) {
-                    bitmap[e] |= (1U << b);
-                    block = (i * super.blocksPerGroup) + e * (sizeof(uint8_t) * 8) +
-                            b; // Block Number = (Group number * blocks per group) + (bitmap entry * 8 (8 bits per
-                               // byte)) + bit (block 0 is least significant bit, block 7 is most significant)
-                    break;
-                }
             }
-
-            if (block)
-                break;
-        }
-
-        if (!block) {
-            continue;
         }
 
-        if (uint8_t * cachedBitmap; bitmapCache.get(group.blockBitmap, cachedBitmap)) {
-            memcpy(cachedBitmap, bitmap, blocksize);
+        uint32_t run = 0;
+        while (run < count && bit + run < groupBlocks &&
+               !(bitmap[(bit + run) / 64] & (1ULL << ((bit + run) % 64)))) {
+            bitmap[(bit + run) / 64] |= 1ULL << ((bit + run) % 64);
+            run++;
         }
 
-        if (int e = WriteBlockCached(group.blockBitmap, bitmap)) {
+        if (int e = WriteBlock(group.blockBitmap, bitmap)) {
             Log::Error("[Ext2] Disk error (%d) write block bitmap (group %d)", e, i);
             error = DiskWriteError;
+            count = 0;
             return 0;
         }
 
-        super.freeBlockCount--;
-        blockGroups[i].freeBlockCount--;
+        super.freeBlockCount -= run;
+        group.freeBlockCount -= run;
 
-        WriteBlockGroupDescriptor(i);
-        WriteSuperblock();
+        blockGroupStates[i].blockHint = bit + run;
+        blockGroupStates[i].dirty = true;
+        superblockDirty = true;
 
-        return block;
+        count = run;
+        // Block Number = (Group number * blocks per group) + bit (block 0 is the least significant bit)
+        return i * super.blocksPerGroup + bit;
     }
 
     Log::Error("[Ext2] No space left on filesystem!");
+    count = 0;
     return 0;
 }
 
+uint32_t Ext2::Ext2Volume::AllocateBlock(uint32_t goal) {
+    uint32_t count = 1;
+    return AllocateBlocks(goal, count);
+}
+
 int Ext2::Ext2Volume::FreeBlock(uint32_t block) {
-    if (block > super.blockCount)
+    if (!block || block > super.blockCount)
         return -1;
 
-    ext2_blockgrp_desc_t& group = blockGroups[block / super.blocksPerGroup];
+    ScopedMutexLock lockAlloc(m_allocLock);
 
-    uint8_t bitmap[blocksize / sizeof(uint8_t)];
+    unsigned groupIndex = block / super.blocksPerGroup;
+    ext2_blockgrp_desc_t& group = blockGroups[groupIndex];
 
-    if (uint8_t * cachedBitmap; bitmapCache.get(group.blockBitmap, cachedBitmap)) {
-        memcpy(bitmap, cachedBitmap, blocksize);
-    } else {
-        if (int e = ReadBlockCached(group.blockBitmap, bitmap)) {
-            if (e == -EINTR) {
-                return -EINTR;
-            }
-
-            Log::Error("[Ext2] Disk error (%d) reading block bitmap (group %d)", e, block / super.blocksPerGroup);
-            error = DiskReadError;
-            return -1;
+    uint8_t bitmap[blocksize / sizeof(uint8_t)];
+    if (int e = ReadBlock(group.blockBitmap, bitmap)) {
+        if (e == -EINTR) {
+            return -EINTR;
         }
-    }
 
-    int bmapIndex = (block % super.blocksPerGroup) / (sizeof(uint8_t) * 8);
-    int bitmask = ~(1 << (block % 8));
-    bitmap[bmapIndex] &= bitmask;
-
-    if (uint8_t * cachedBitmap; bitmapCache.get(group.blockBitmap, cachedBitmap)) {
-        memcpy(cachedBitmap, bitmap, blocksize);
+        Log::Error("[Ext2] Disk error (%d) reading block bitmap (group %d)", e, groupIndex);
+        error = DiskReadError;
+        return -1;
     }
 
-    if (int e = WriteBlockCached(group.blockBitmap, bitmap)) {
-        Log::Error("[Ext2] Disk error (%d) write block bitmap (group %d)", e, block / super.blocksPerGroup);
+    uint32_t bit = block % super.blocksPerGroup;
+    bitmap[bit / 8] &= ~(1U << (bit % 8));
+
+    if (int e = WriteBlock(group.blockBitmap, bitmap)) {
+        Log::Error("[Ext2] Disk error (%d) write block bitmap (group %d)", e, groupIndex);
         error = DiskWriteError;
         return -1;
     }
 
     super.freeBlockCount++;
-    blockGroups[block / super.blocksPerGroup].freeBlockCount++;
+    group.freeBlockCount++;
 
-    WriteBlockGroupDescriptor(block / super.blocksPerGroup);
-    WriteSuperblock();
+    blockGroupStates[groupIndex].dirty = true;
+    superblockDirty = true;
 
     return 0;
 }
 
-Ext2::Ext2Node* Ext2::Ext2Volume::CreateNode() {
-    ScopedSpinLock lockInodes(m_inodesLock);
-    for (unsigned i = 0; i < blockGroupCount; i++) {
-        ext2_blockgrp_desc_t& group = blockGroups[i];
+uint32_t Ext2::Ext2Volume::FindClearBit(const uint64_t* bitmap, uint32_t start, uint32_t end) {
+    uint32_t i = start;
+    while (i < end) {
+        // Ignore the bits before i
+        uint64_t clear = ~bitmap[i / 64] & (~0ULL << (i % 64));
+        if (clear) {
+            uint32_t bit = (i & ~63U) + __builtin_ctzll(clear);
+            return MIN(bit, end);
+        }
 
-        if (group.freeInodeCount <= 0)
-            continue; // No free inodes in this blockgroup
+        i = (i & ~63U) + 64;
+    }
 
-        uint8_t bitmap[blocksize / sizeof(uint8_t)];
+    return end;
+}
 
-        if (int e = ReadBlockCached(group.inodeBitmap, bitmap)) {
-            Log::Error("[Ext2] Disk error (%d) reading inode bitmap (group %d)", e, i);
-            error = DiskReadError;
-            return nullptr;
+void Ext2::Ext2Volume::WriteMetadata() {
+    ScopedMutexLock lockAlloc(m_allocLock);
+    for (unsigned i = 0; i < blockGroupCount; i++) {
+        if (blockGroupStates[i].dirty) {
+            WriteBlockGroupDescriptor(i);
+            blockGroupStates[i].dirty = false;
         }
+    }
 
-        uint32_t inode = 0;
+    if (superblockDirty) {
+        WriteSuperblock();
+        superblockDirty = false;
+    }
+}
 
-        for (unsigned e = 0; e < blocksize / sizeof(uint8_t); e++) {
-            if (bitmap[e] == UINT8_MAX)
-                continue; // Full
+Ext2::Ext2Node* Ext2::Ext2Volume::CreateNode() {
+    ScopedMutexLock lockInodes(m_inodesLock);
 
-            for (uint8_t b = 0; b < sizeof(uint8_t) * 8; b++) { // Iterate through all bits in the entry
-                if (((bitmap[e] >> b) & 0x1) == 0) {
-                    inode = (i * super.inodesPerGroup) + e * (sizeof(uint8_t) * 8) + b +
-                            1; // Inode Number = (Group number * inodes per group) + (bitmap entry * 8 (8 bits per
-                               // byte)) + bit (inode 1 is least significant bit, block 8 is most significant) + 1
-                               // (inodes start at 1)
+    uint32_t inode = 0;
+    unsigned i = 0;
+    {
+        ScopedMutexLock lockAlloc(m_allocLock);
 
-                    if ((inode > superext.firstInode || super.revLevel == 0) && inode > 11) {
-                        bitmap[e] |= (1U << b);
-                        break;
-                    }
+        uint64_t bitmap[blocksize / sizeof(uint64_t)];
+        for (; i < blockGroupCount; i++) {
+            ext2_blockgrp_desc_t& group = blockGroups[i];
+
+            if (group.freeInodeCount <= 0)
+                continue; // No free inodes in this blockgroup
+
+            if (int e = ReadBlock(group.inodeBitmap, bitmap)) {
+                Log::Error("[Ext2] Disk error (%d) reading inode bitmap (group %d)", e, i);
+                error = DiskReadError;
+                return nullptr;
+            }
+
+            // Inodes up to the first non-reserved inode are never allocated, inode 1 is bit 0
+            uint32_t reserved = 0;
+            if (i == 0) {
+                reserved = (super.revLevel == 0) ? 11 : MAX(superext.firstInode, 11U);
+            }
+
+            uint32_t start = MAX(blockGroupStates[i].inodeHint, reserved);
+            if (start >= super.inodesPerGroup) {
+                start = reserved;
+            }
+
+            uint32_t bit = FindClearBit(bitmap, start, super.inodesPerGroup);
+            if (bit == super.inodesPerGroup) {
+                bit = FindClearBit(bitmap, reserved, start);
+                if (bit == start) {
+                    continue; // Full
                 }
             }
 
-            if (inode)
-                break;
-        }
+            bitmap[bit / 64] |= 1ULL << (bit % 64);
+            if (int e = WriteBlock(group.inodeBitmap, bitmap)) {
+                Log::Error("[Ext2] Disk error (%d) write inode bitmap (group %d)", e, i);
+                error = DiskWriteError;
+                return nullptr;
+            }
 
-        if (!inode)
-            continue;
+            // Inode Number = (Group number * inodes per group) + bit + 1 (inodes start at 1)
+            inode = i * super.inodesPerGroup + bit + 1;
 
-        if (int e = WriteBlockCached(group.inodeBitmap, bitmap)) {
-            Log::Error("[Ext2] Disk error (%d) write inode bitmap (group %d)", e, i);
-            error = DiskWriteError;
-            return nullptr;
-        }
+            super.freeInodeCount--;
+            group.freeInodeCount--;
 
-        ext2_inode_t ino;
+            blockGroupStates[i].inodeHint = bit + 1;
+            blockGroupStates[i].dirty = true;
+            superblockDirty = true;
+            break;
+        }
+    }
 
-        memset(&ino, 0, sizeof(ext2_inode_t));
+    if (!inode) {
+        Log::Error("[Ext2] No inodes left on the filesystem!");
+        return nullptr;
+    }
 
-        ino.blocks[0] = AllocateBlock(); // Give it one block
-        ino.uid = 0;
-        ino.mode = 0644;
-        ino.accessTime = ino.createTime = ino.deleteTime = ino.modTime = 0;
-        ino.gid = 0;
-        ino.blockCount = blocksize / 512;
-        ino.linkCount = 0;
-        ino.size = ino.sizeHigh = 0;
-        ino.fragAddr = 0;
-        ino.fileACL = 0;
+    ext2_inode_t ino;
 
-        super.freeInodeCount--;
-        blockGroups[i].freeInodeCount--;
+    memset(&ino, 0, sizeof(ext2_inode_t));
 
-        WriteSuperblock();
-        WriteBlockGroupDescriptor(i);
-        SyncInode(ino, inode);
+    ino.blocks[0] = AllocateBlock(i * super.blocksPerGroup); // Give it one block, near the inode
+    ino.uid = 0;
+    ino.mode = 0644;
+    ino.accessTime = ino.createTime = ino.deleteTime = ino.modTime = 0;
+    ino.gid = 0;
+    ino.blockCount = blocksize / 512;
+    ino.linkCount = 0;
+    ino.size = ino.sizeHigh = 0;
+    ino.fragAddr = 0;
+    ino.fileACL = 0;
 
-        Ext2Node* node = new Ext2Node(this, ino, inode);
+    SyncInode(ino, inode);
 
-        if (debugLevelExt2 >= DebugLevelVerbose) {
-            Log::Info("[Ext2] Created inode %d", node->inode);
-        }
+    Ext2Node* node = new Ext2Node(this, ino, inode);
 
-        return node;
+    if (debugLevelExt2 >= DebugLevelVerbose) {
+        Log::Info("[Ext2] Created inode %d", node->inode);
     }
 
-    Log::Error("[Ext2] No inodes left on the filesystem!");
-    return nullptr;
+    return node;
 }
 
 int Ext2::Ext2Volume::EraseInode(ext2_inode_t& e2inode, uint32_t inode) {
@@ -746,12 +911,11 @@ int Ext2::Ext2Volume::EraseInode(ext2_inode_t& e2inode, uint32_t inode) {
         return -2;
     }
 
-    for (unsigned i = 0; i < e2inode.blockCount * (blocksize / 512); i++) {
+    // blockCount includes the indirect blocklists
+    uint32_t dataBlocks = MIN(e2inode.blockCount / (blocksize / 512), (e2inode.size + blocksize - 1) / blocksize);
+    for (unsigned i = 0; i < dataBlocks; i++) {
         uint32_t block = GetInodeBlock(i, e2inode);
         FreeBlock(block);
-        if (blockCache.find(block)) {
-            blockCache.remove(block);
-        }
     }
 
     if (e2inode.blocks[EXT2_SINGLY_INDIRECT_INDEX]) {
@@ -759,7 +923,7 @@ int Ext2::Ext2Volume::EraseInode(ext2_inode_t& e2inode, uint32_t inode) {
         if (e2inode.blocks[EXT2_DOUBLY_INDIRECT_INDEX]) {
             uint32_t blockPointers[blocksize / sizeof(uint32_t)];
 
-            if (int e = ReadBlockCached(e2inode.blocks[EXT2_DOUBLY_INDIRECT_INDEX], blockPointers)) {
+            if (int e = ReadBlock(e2inode.blocks[EXT2_DOUBLY_INDIRECT_INDEX], blockPointers)) {
                 (void)e;
                 error = DiskReadError;
                 return 0;
@@ -767,9 +931,6 @@ int Ext2::Ext2Volume::EraseInode(ext2_inode_t& e2inode, uint32_t inode) {
 
             for (unsigned i = 0; i < (blocksize / sizeof(uint32_t)) && blockPointers[i] != 0; i++) {
                 FreeBlock(blockPointers[i]);
-                if (blockCache.find(blockPointers[i])) {
-                    blockCache.remove(blockPointers[i]);
-                }
             }
 
             FreeBlock(e2inode.blocks[EXT2_DOUBLY_INDIRECT_INDEX]);
@@ -780,43 +941,36 @@ int Ext2::Ext2Volume::EraseInode(ext2_inode_t& e2inode, uint32_t inode) {
         }
     }
 
-    ext2_blockgrp_desc_t& group = blockGroups[inode / super.inodesPerGroup];
+    ScopedMutexLock lockAlloc(m_allocLock);
 
-    uint8_t bitmap[blocksize / sizeof(uint8_t)];
+    unsigned groupIndex = (inode - 1) / super.inodesPerGroup; // Inodes start at 1
+    ext2_blockgrp_desc_t& group = blockGroups[groupIndex];
 
-    if (uint8_t * cachedBitmap; bitmapCache.get(group.inodeBitmap, cachedBitmap)) {
-        memcpy(bitmap, cachedBitmap, blocksize);
-    } else {
-        if (int e = ReadBlockCached(group.inodeBitmap, bitmap)) {
-            if (e == -EINTR) {
-                return -EINTR;
-            }
-
-            Log::Error("[Ext2] Disk error (%d) reading inode bitmap (group %d)", e, inode / super.inodesPerGroup);
-            error = DiskReadError;
-            return -1;
+    uint8_t bitmap[blocksize / sizeof(uint8_t)];
+    if (int e = ReadBlock(group.inodeBitmap, bitmap)) {
+        if (e == -EINTR) {
+            return -EINTR;
         }
-    }
-
-    int bmapIndex = (inode % super.inodesPerGroup) / (sizeof(uint8_t) * 8);
-    int bitmask = ~(1 << (inode % 8));
-    bitmap[bmapIndex] &= bitmask;
 
-    if (uint8_t * cachedBitmap; bitmapCache.get(group.inodeBitmap, cachedBitmap)) {
-        memcpy(cachedBitmap, bitmap, blocksize);
+        Log::Error("[Ext2] Disk error (%d) reading inode bitmap (group %d)", e, groupIndex);
+        error = DiskReadError;
+        return -1;
     }
 
-    if (int e = WriteBlockCached(group.blockBitmap, bitmap)) {
-        Log::Error("[Ext2] Disk error (%d) write block bitmap (group %d)", e, inode / super.inodesPerGroup);
+    uint32_t bit = (inode - 1) % super.inodesPerGroup;
+    bitmap[bit / 8] &= ~(1U << (bit % 8));
+
+    if (int e = WriteBlock(group.inodeBitmap, bitmap)) {
+        Log::Error("[Ext2] Disk error (%d) write inode bitmap (group %d)", e, groupIndex);
         error = DiskWriteError;
         return -1;
     }
 
     super.freeInodeCount++;
-    blockGroups[inode / super.inodesPerGroup].freeInodeCount++;
+    group.freeInodeCount++;
 
-    WriteBlockGroupDescriptor(inode / super.inodesPerGroup);
-    WriteSuperblock();
+    blockGroupStates[groupIndex].dirty = true;
+    superblockDirty = true;
 
     return 0;
 }
@@ -842,7 +996,7 @@ int Ext2::Ext2Volume::ListDir(Ext2Node* node, List<DirectoryEntry>& entries) {
 
     ext2_directory_entry_t* e2dirent = (ext2_directory_entry_t*)buffer;
 
-    if (int e = ReadBlockCached(GetInodeBlock(currentBlockIndex, ino), buffer)) {
+    if (int e = ReadBlock(GetInodeBlock(currentBlockIndex, ino), buffer)) {
         if (e == -EINTR) {
             return -EINTR;
         }
@@ -877,7 +1031,7 @@ int Ext2::Ext2Volume::ListDir(Ext2Node* node, List<DirectoryEntry>& entries) {
             }
 
             blockOffset = 0;
-            if (int e = ReadBlockCached(GetInodeBlock(currentBlockIndex, ino), buffer)) {
+            if (int e = ReadBlock(GetInodeBlock(currentBlockIndex, ino), buffer)) {
                 if (e == -EINTR) {
                     return -EINTR;
                 }
@@ -904,6 +1058,8 @@ int Ext2::Ext2Volume::WriteDir(Ext2Node* node, List<DirectoryEntry>& entries) {
     }
 
     ext2_inode_t& ino = node->e2inode;
+    // Entries are written in a linear list, any index would no longer match them
+    ino.flags &= ~EXT2_INDEX_FL;
 
     uint8_t buffer[blocksize];
     uint32_t currentBlockIndex = 0;
@@ -945,7 +1101,7 @@ int Ext2::Ext2Volume::WriteDir(Ext2Node* node, List<DirectoryEntry>& entries) {
         totalOffset += e2dirent->recordLength;
 
         if (blockOffset >= blocksize) {
-            if (WriteBlockCached(GetInodeBlock(currentBlockIndex, ino), buffer)) {
+            if (WriteBlock(GetInodeBlock(currentBlockIndex, ino), buffer)) {
                 Log::Error("[Ext2] WriteDir: Failed to write directory block");
                 error = DiskWriteError;
                 return -1;
@@ -954,10 +1110,11 @@ int Ext2::Ext2Volume::WriteDir(Ext2Node* node, List<DirectoryEntry>& entries) {
             currentBlockIndex++;
 
             if (currentBlockIndex > ino.blockCount / (blocksize / 512)) {
-                // Allocate a new block
-                SetInodeBlock(currentBlockIndex, node->e2inode, AllocateBlock());
+                // Allocate a new block following the last
+                InvalidateExtents(node, currentBlockIndex);
+                SetInodeBlock(currentBlockIndex, node->e2inode,
+                              AllocateBlock(GetInodeBlock(currentBlockIndex - 1, node->e2inode) + 1));
                 node->e2inode.blockCount += blocksize / 512;
-                WriteSuperblock();
             }
 
             blockOffset = 0;
@@ -992,6 +1149,12 @@ int Ext2::Ext2Volume::InsertDir(Ext2Node* node, List<DirectoryEntry>& newEntries
 }
 
 int Ext2::Ext2Volume::InsertDir(Ext2Node* node, DirectoryEntry& ent) {
+    if (IsIndexed(node)) {
+        if (int e = DxInsert(node, ent); e <= 0) {
+            return e;
+        }
+    }
+
     List<DirectoryEntry> ents;
     ents.add_back(ent);
 
@@ -1016,7 +1179,7 @@ int Ext2::Ext2Volume::ReadDir(Ext2Node* node, DirectoryEntry* dirent, uint32_t i
 
     ext2_directory_entry_t* e2dirent = (ext2_directory_entry_t*)buffer;
 
-    if (ReadBlockCached(GetInodeBlock(currentBlockIndex, ino), buffer)) {
+    if (ReadBlock(GetInodeBlock(currentBlockIndex, ino), buffer)) {
         Log::Warning("[Ext2] Failed to read block %d", GetInodeBlock(currentBlockIndex, ino));
         error = DiskReadError;
         return -EIO;
@@ -1049,7 +1212,7 @@ int Ext2::Ext2Volume::ReadDir(Ext2Node* node, DirectoryEntry* dirent, uint32_t i
             }
 
             blockOffset = 0;
-            if (ReadBlockCached(GetInodeBlock(currentBlockIndex, ino), buffer)) {
+            if (ReadBlock(GetInodeBlock(currentBlockIndex, ino), buffer)) {
                 Log::Warning("[Ext2] Failed to read block");
                 return -EIO;
             }
@@ -1058,38 +1221,104 @@ int Ext2::Ext2Volume::ReadDir(Ext2Node* node, DirectoryEntry* dirent, uint32_t i
         e2dirent = (ext2_directory_entry_t*)(buffer + blockOffset);
     }
 
-    // Insert the retrived directory entry into the cache 
-    node->directoryCache.insert(e2dirent->name, e2dirent->inode);
+    FillDirectoryEntry(*e2dirent, *dirent);
+
+    // Insert the retrived directory entry into the cache
+    node->directoryCache.insert(dirent->name, e2dirent->inode);
+    return 1;
+}
+
+int Ext2::Ext2Volume::ReadDirBatch(Ext2Node* node, DirectoryEntry* entries, int count, off_t& cursor) {
+    if ((node->flags & FS_NODE_TYPE) != FS_NODE_DIRECTORY) {
+        return -ENOTDIR;
+    }
+
+    if (node->inode < 1) {
+        Log::Warning("[Ext2] ReadDirBatch: Invalid inode: %d", node->inode);
+        return -EIO;
+    }
+
+    if (cursor < 0) {
+        return -EINVAL;
+    }
+
+    ext2_inode_t& ino = node->e2inode;
+
+    BlockRef ref;
+    uint32_t blockCount = ino.blockCount / (blocksize / 512);
+    uint32_t currentBlockIndex = cursor / blocksize;
+    uint32_t blockOffset = cursor % blocksize;
 
-    strncpy(dirent->name, e2dirent->name, e2dirent->nameLength);
-    dirent->name[e2dirent->nameLength] = 0; // Null terminate
-    dirent->flags = e2dirent->fileType;
+    int read = 0;
+    while (read < count && currentBlockIndex < blockCount) {
+        if (GetBlock(GetInodeBlock(currentBlockIndex, ino), ref)) {
+            Log::Warning("[Ext2] Failed to read block %d", GetInodeBlock(currentBlockIndex, ino));
+            error = DiskReadError;
+            return read ? read : -EIO;
+        }
+
+        while (read < count && blockOffset < blocksize) {
+            const ext2_directory_entry_t* e2dirent = (const ext2_directory_entry_t*)(ref.Data() + blockOffset);
+            if (e2dirent->recordLength < 8 || blockOffset + e2dirent->recordLength > blocksize) {
+                IF_DEBUG(debugLevelExt2 >= DebugLevelNormal, {
+                    Log::Warning("[Ext2] Error (inode: %d) record length of directory entry is invalid (value: %d)!",
+                                 node->inode, e2dirent->recordLength);
+                });
 
-    switch (e2dirent->fileType) {
+                // Treat the rest of the directory as empty
+                cursor = static_cast<off_t>(blockCount) * blocksize;
+                return read;
+            }
+
+            blockOffset += e2dirent->recordLength;
+            if (e2dirent->inode == 0) {
+                continue; // Unused
+            }
+
+            FillDirectoryEntry(*e2dirent, entries[read]);
+            node->directoryCache.insert(entries[read].name, e2dirent->inode);
+            read++;
+        }
+
+        if (blockOffset >= blocksize) {
+            currentBlockIndex++;
+            blockOffset = 0;
+        }
+    }
+
+    cursor = static_cast<off_t>(currentBlockIndex) * blocksize + blockOffset;
+    return read;
+}
+
+void Ext2::Ext2Volume::FillDirectoryEntry(const ext2_directory_entry_t& e2dirent, DirectoryEntry& dirent) {
+    strncpy(dirent.name, e2dirent.name, e2dirent.nameLength);
+    dirent.name[e2dirent.nameLength] = 0; // Null terminate
+    dirent.inode = e2dirent.inode;
+    dirent.flags = e2dirent.fileType;
+
+    switch (e2dirent.fileType) {
     case EXT2_FT_REG_FILE:
-        dirent->flags = DT_REG;
+        dirent.flags = DT_REG;
         break;
     case EXT2_FT_DIR:
-        dirent->flags = DT_DIR;
+        dirent.flags = DT_DIR;
         break;
     case EXT2_FT_CHRDEV:
-        dirent->flags = DT_CHR;
+        dirent.flags = DT_CHR;
         break;
     case EXT2_FT_BLKDEV:
-        dirent->flags = DT_BLK;
+        dirent.flags = DT_BLK;
         break;
     case EXT2_FT_FIFO:
-        dirent->flags = DT_FIFO;
+        dirent.flags = DT_FIFO;
         break;
     case EXT2_FT_SOCK:
-        dirent->flags = DT_SOCK;
+        dirent.flags = DT_SOCK;
         break;
     case EXT2_FT_SYMLINK:
-        dirent->flags = DT_LNK;
+        dirent.flags = DT_LNK;
         break;
     }
-
-    return 1;
 }
 
 FsNode* Ext2::Ext2Volume::FindDir(Ext2Node* node, const char* name) {
@@ -1105,87 +1334,101 @@ FsNode* Ext2::Ext2Volume::FindDir(Ext2Node* node, const char* name) {
     uint32_t inode;
     // Check if we have the inode number cached
     if(!node->directoryCache.get(name, inode)) {
-        ext2_inode_t& ino = node->e2inode;
-
-        uint8_t buffer[blocksize];
-        uint32_t currentBlockIndex = 0;
-        uint32_t blockOffset = 0;
-        uint32_t totalOffset = 0;
-
-        ext2_directory_entry_t* e2dirent = (ext2_directory_entry_t*)buffer;
-
-        if (ReadBlockCached(GetInodeBlock(currentBlockIndex, ino), buffer)) {
-            Log::Info("[Ext2] Failed to read block %d", GetInodeBlock(currentBlockIndex, ino));
+        // Indexed directories are searched through the index, unless it cannot be used
+        int e = IsIndexed(node) ? DxFind(node, name, inode) : 1;
+        if (e < 0) {
             return nullptr;
         }
 
-        while (currentBlockIndex < ino.blockCount / (blocksize / 512)) {
-            if (e2dirent->recordLength < 8) {
-                IF_DEBUG(debugLevelExt2 >= DebugLevelNormal, {
-                    Log::Warning("[Ext2] Error (inode: %d) record length of directory entry is invalid (value: %d)!",
-                                node->inode, e2dirent->recordLength);
-                });
-                break;
+        if (e > 0) {
+            ext2_inode_t& ino = node->e2inode;
+
+            BlockRef ref;
+            uint32_t currentBlockIndex = 0;
+            uint32_t blockOffset = 0;
+            uint32_t totalOffset = 0;
+
+            if (GetBlock(GetInodeBlock(currentBlockIndex, ino), ref)) {
+                Log::Info("[Ext2] Failed to read block %d", GetInodeBlock(currentBlockIndex, ino));
+                return nullptr;
             }
 
-            if (e2dirent->inode > 0) {
-                IF_DEBUG(debugLevelExt2 >= DebugLevelVerbose, {
-                    char buf[e2dirent->nameLength + 1];
-                    strncpy(buf, e2dirent->name, e2dirent->nameLength);
-                    buf[e2dirent->nameLength] = 0;
-                    Log::Info("Checking name '%s' (name len %d), inode %d, len %d (parent inode: %d)", buf,
-                            e2dirent->nameLength, e2dirent->inode, e2dirent->recordLength, node->inode);
-                });
+            const ext2_directory_entry_t* e2dirent = ref.As<ext2_directory_entry_t>();
 
-                if (strlen(name) == e2dirent->nameLength && strncmp(name, e2dirent->name, e2dirent->nameLength) == 0) {
-                    Log::Debug(debugLevelExt2, DebugLevelVerbose, "Found '%s'!", name);
+            while (currentBlockIndex < ino.blockCount / (blocksize / 512)) {
+                if (e2dirent->recordLength < 8) {
+                    IF_DEBUG(debugLevelExt2 >= DebugLevelNormal, {
+                        Log::Warning(
+                            "[Ext2] Error (inode: %d) record length of directory entry is invalid (value: %d)!",
+                            node->inode, e2dirent->recordLength);
+                    });
                     break;
                 }
-            }
-
-            blockOffset += e2dirent->recordLength;
-            totalOffset += e2dirent->recordLength;
 
-            if (totalOffset > ino.size)
-                return nullptr;
+                if (e2dirent->inode > 0) {
+                    IF_DEBUG(debugLevelExt2 >= DebugLevelVerbose, {
+                        char buf[e2dirent->nameLength + 1];
+                        strncpy(buf, e2dirent->name, e2dirent->nameLength);
+                        buf[e2dirent->nameLength] = 0;
+                        Log::Info("Checking name '%s' (name len %d), inode %d, len %d (parent inode: %d)", buf,
+                                e2dirent->nameLength, e2dirent->inode, e2dirent->recordLength, node->inode);
+                    });
+
+                    if (strlen(name) == e2dirent->nameLength &&
+                        strncmp(name, e2dirent->name, e2dirent->nameLength) == 0) {
+                        Log::Debug(debugLevelExt2, DebugLevelVerbose, "Found '%s'!", name);
+                        break;
+                    }
+                }
 
-            if (blockOffset >= blocksize) {
-                currentBlockIndex++;
+                blockOffset += e2dirent->recordLength;
+                totalOffset += e2dirent->recordLength;
 
-                if (currentBlockIndex >= ino.blockCount / (blocksize / 512)) {
-                    // End of dir
+                if (totalOffset > ino.size)
                     return nullptr;
-                }
 
-                blockOffset = 0;
+                if (blockOffset >= blocksize) {
+                    currentBlockIndex++;
 
-                if (ReadBlockCached(GetInodeBlock(currentBlockIndex, ino), buffer)) {
-                    Log::Error("[Ext2] Failed to read block");
-                    return nullptr;
+                    if (currentBlockIndex >= ino.blockCount / (blocksize / 512)) {
+                        // End of dir
+                        return nullptr;
+                    }
+
+                    blockOffset = 0;
+
+                    if (GetBlock(GetInodeBlock(currentBlockIndex, ino), ref)) {
+                        Log::Error("[Ext2] Failed to read block");
+                        return nullptr;
+                    }
                 }
+
+                e2dirent = (const ext2_directory_entry_t*)(ref.Data() + blockOffset);
             }
 
-            e2dirent = (ext2_directory_entry_t*)(buffer + blockOffset);
-        }
+            if (strlen(name) != e2dirent->nameLength || strncmp(e2dirent->name, name, e2dirent->nameLength) != 0) {
+                // Not found
+                return nullptr;
+            }
 
-        if (strlen(name) != e2dirent->nameLength || strncmp(e2dirent->name, name, e2dirent->nameLength) != 0) {
-            // Not found
-            return nullptr;
-        }
+            if (!e2dirent->inode || e2dirent->inode > super.inodeCount) {
+                Log::Error("[Ext2] Directory Entry %s contains invalid inode %d", name, e2dirent->inode);
+                return nullptr;
+            }
 
-        if (!e2dirent->inode || e2dirent->inode > super.inodeCount) {
-            Log::Error("[Ext2] Directory Entry %s contains invalid inode %d", name, e2dirent->inode);
-            return nullptr;
+            inode = e2dirent->inode;
         }
-
-        inode = e2dirent->inode;
         // Insert inode number into dcache
         node->directoryCache.insert(name, inode);
     }
 
     Ext2Node* returnNode = nullptr;
-    ScopedSpinLock lockInodes(m_inodesLock);
-    if (!inodeCache.get(inode, returnNode) || !returnNode) { // Could not locate inode in cache
+    ScopedMutexLock lockInodes(m_inodesLock);
+    if (inodeCache.get(inode, returnNode) && returnNode) {
+        if (returnNode->unused) {
+            MarkUnused(returnNode); // Used recently
+        }
+    } else { // Could not locate inode in cache
         ext2_inode_t direntInode;
         if (ReadInode(inode, direntInode)) {
             Log::Error("[Ext2] Failed to read inode of directory (inode %d) entry %s", node->inode, name);
@@ -1197,7 +1440,7 @@ FsNode* Ext2::Ext2Volume::FindDir(Ext2Node* node, const char* name) {
 
         returnNode = new Ext2Node(this, direntInode, inode);
 
-        inodeCache.insert(inode, returnNode);
+        CacheNode(returnNode);
     }
 
     assert(returnNode);
@@ -1212,7 +1455,7 @@ ssize_t Ext2::Ext2Volume::Read(Ext2Node* node, size_t offset, size_t size, uint8
 
     uint32_t blockIndex = LocationToBlock(offset);
     uint32_t blockLimit = LocationToBlock(offset + size);
-    uint8_t blockBuffer[blocksize];
+    BlockRef ref; // Partial blocks are copied straight from the cache
 
     /*if(debugLevelExt2 >= DebugLevelVerbose){
         Log::Info("[Ext2] Reading: Block index: %d, Block limit: %d, Offset: %d, Size: %d, Node size: %d", blockIndex,
@@ -1224,7 +1467,7 @@ ssize_t Ext2::Ext2Volume::Read(Ext2Node* node, size_t offset, size_t size, uint8
 #endif
 
     ssize_t ret = size;
-    Vector<uint32_t> blocks = GetInodeBlocks(blockIndex, blockLimit - blockIndex + 1, node->e2inode);
+    Vector<uint32_t> blocks = GetNodeBlocks(node, blockIndex, blockLimit - blockIndex + 1);
     assert(blocks.size() == (blockLimit - blockIndex + 1));
 
 #ifdef EXT2_ENABLE_TIMER
@@ -1232,14 +1475,16 @@ ssize_t Ext2::Ext2Volume::Read(Ext2Node* node, size_t offset, size_t size, uint8
     long readtv1 = Timer::UsecondsSinceBoot();
 #endif
 
-    for (uint32_t block : blocks) {
+    for (unsigned i = 0; i < blocks.size(); i++) {
         if (size <= 0)
             break;
 
+        uint32_t block = blocks[i];
+
         // Check if offset is a full block
         long offsetRemainder = offset & (blocksize - 1);
         if (offsetRemainder) {
-            if (int e = ReadBlockCached(block, blockBuffer); e) {
+            if (int e = GetBlock(block, ref); e) {
                 Log::Info("[Ext2] Error %i reading block %u", e, block);
                 error = DiskReadError;
                 return e;
@@ -1250,27 +1495,31 @@ ssize_t Ext2::Ext2Volume::Read(Ext2Node* node, size_t offset, size_t size, uint8
                 readSize = size;
             }
 
-            memcpy(buffer, blockBuffer + offsetRemainder, readSize);
+            memcpy(buffer, ref.Data() + offsetRemainder, readSize);
 
             size -= readSize;
             buffer += readSize;
             offset += readSize;
         } else if (size >= blocksize) {
-            if (int e = ReadBlockCached(block, buffer); e) {
-                Log::Info("[Ext2] Error %i reading block %u", e, block);
+            // Read every whole block contiguous on disk with one request
+            uint32_t count = ContiguousBlocks(blocks, i, size / blocksize);
+            if (int e = ReadBlocks(block, count, buffer); e) {
+                Log::Info("[Ext2] Error %i reading %u blocks from block %u", e, count, block);
                 error = DiskReadError;
                 break;
             }
-            size -= blocksize;
-            buffer += blocksize;
-            offset += blocksize;
+
+            size -= count * blocksize;
+            buffer += count * blocksize;
+            offset += count * blocksize;
+            i += count - 1;
         } else {
-            if (int e = ReadBlockCached(block, blockBuffer); e) {
+            if (int e = GetBlock(block, ref); e) {
                 Log::Info("[Ext2] Error %i reading block %u", e, block);
                 error = DiskReadError;
                 break;
             }
-            memcpy(buffer, blockBuffer, size);
+            memcpy(buffer, ref.Data(), size);
 
             size = 0;
             break;
@@ -1316,13 +1565,26 @@ ssize_t Ext2::Ext2Volume::Write(Ext2Node* node, size_t offset, size_t size, uint
         if (debugLevelExt2 >= DebugLevelVerbose) {
             Log::Info("[Ext2] Allocating blocks for inode %d", node->inode);
         }
-        for (unsigned i = fileBlockCount; i <= blockLimit; i++) {
-            uint32_t block = AllocateBlock();
-            SetInodeBlock(i, node->e2inode, block);
+        InvalidateExtents(node, fileBlockCount);
+
+        // Allocate runs of blocks following on from the end of the file
+        uint32_t goal = fileBlockCount ? GetInodeBlock(fileBlockCount - 1, node->e2inode) + 1 : 0;
+        for (unsigned i = fileBlockCount; i <= blockLimit;) {
+            uint32_t count = blockLimit - i + 1;
+            uint32_t block = AllocateBlocks(goal, count);
+            if (!block) {
+                node->e2inode.blockCount = i * (blocksize / 512);
+                SyncNode(node);
+                return -ENOSPC;
+            }
+
+            for (uint32_t j = 0; j < count; j++) {
+                SetInodeBlock(i++, node->e2inode, block + j);
+            }
+            goal = block + count;
         }
         node->e2inode.blockCount = (blockLimit + 1) * (blocksize / 512);
 
-        WriteSuperblock();
         sync = true;
     }
 
@@ -1343,14 +1605,15 @@ ssize_t Ext2::Ext2Volume::Write(Ext2Node* node, size_t offset, size_t size, uint
     }
 
     ssize_t ret = size;
-    Vector<uint32_t> blocks = GetInodeBlocks(blockIndex, blockLimit - blockIndex + 1, node->e2inode);
+    Vector<uint32_t> blocks = GetNodeBlocks(node, blockIndex, blockLimit - blockIndex + 1);
 
-    for (uint32_t block : blocks) {
+    for (unsigned i = 0; i < blocks.size(); i++) {
         if (size <= 0)
             break;
 
+        uint32_t block = blocks[i];
         if (offset % blocksize) {
-            ReadBlockCached(block, blockBuffer);
+            ReadBlock(block, blockBuffer);
 
             size_t writeSize = blocksize - (offset % blocksize);
             size_t writeOffset = (offset % blocksize);
@@ -1359,8 +1622,8 @@ ssize_t Ext2::Ext2Volume::Write(Ext2Node* node, size_t offset, size_t size, uint
                 writeSize = size;
 
             memcpy(blockBuffer + writeOffset, buffer, writeSize);
-            if (int e = WriteBlockCached(block, blockBuffer); e) {
-                if (int e = WriteBlockCached(block, blockBuffer); e) { // Try again
+            if (int e = WriteBlocks(block, 1, blockBuffer); e) {
+                if (int e = WriteBlocks(block, 1, blockBuffer); e) { // Try again
                     Log::Warning("[Ext2] Error %i writing block %u", e, block);
                     error = DiskReadError;
                     break;
@@ -1371,21 +1634,23 @@ ssize_t Ext2::Ext2Volume::Write(Ext2Node* node, size_t offset, size_t size, uint
             buffer += writeSize;
             offset += writeSize;
         } else if (size >= blocksize) {
-            memcpy(blockBuffer, buffer, blocksize);
-            if (int e = WriteBlockCached(block, blockBuffer); e) {
-                if (int e = WriteBlockCached(block, blockBuffer); e) { // Try again
-                    Log::Warning("[Ext2] Error %i writing block %u", e, block);
+            // Write every whole block contiguous on disk with one request
+            uint32_t count = ContiguousBlocks(blocks, i, size / blocksize);
+            if (int e = WriteBlocks(block, count, buffer); e) {
+                if (int e = WriteBlocks(block, count, buffer); e) { // Try again
+                    Log::Warning("[Ext2] Error %i writing %u blocks from block %u", e, count, block);
                     error = DiskReadError;
                     break;
                 }
             }
 
-            size -= blocksize;
-            buffer += blocksize;
-            offset += blocksize;
+            size -= count * blocksize;
+            buffer += count * blocksize;
+            offset += count * blocksize;
+            i += count - 1;
         } else {
-            if (int e = ReadBlockCached(block, blockBuffer); e) {
-                if (int e = ReadBlockCached(block, blockBuffer); e) { // Try again
+            if (int e = ReadBlock(block, blockBuffer); e) {
+                if (int e = ReadBlock(block, blockBuffer); e) { // Try again
                     Log::Info("[Ext2] Error %i reading block %u", e, block);
                     error = DiskReadError;
                     break;
@@ -1394,8 +1659,8 @@ ssize_t Ext2::Ext2Volume::Write(Ext2Node* node, size_t offset, size_t size, uint
 
             memcpy(blockBuffer, buffer, size);
 
-            if (int e = WriteBlockCached(block, blockBuffer); e) {
-                if (int e = WriteBlockCached(block, blockBuffer); e) { // Try again
+            if (int e = WriteBlocks(block, 1, blockBuffer); e) {
+                if (int e = WriteBlocks(block, 1, blockBuffer); e) { // Try again
                     Log::Warning("[Ext2] Error %i writing block %u", e, block);
                     error = DiskReadError;
                     break;
@@ -1423,15 +1688,15 @@ void Ext2::Ext2Volume::SyncInode(ext2_inode_t& e2inode, uint32_t inode) {
     uint8_t buf[blocksize];
     uint64_t off = InodeOffset(inode);
 
-    if (int e = fs::Read(m_device, off & (~511U), blocksize, buf); e != blocksize) {
+    if (int e = ReadBlock(off / blocksize, buf)) {
         Log::Error("[Ext2] Sync: Disk Error (%d) Reading Inode %d", e, inode);
         error = DiskReadError;
         return;
     }
 
-    *(ext2_inode_t*)(buf + (off & (511U))) = e2inode;
+    *(ext2_inode_t*)(buf + off % blocksize) = e2inode;
 
-    if (int e = fs::Write(m_device, off & (~511U), blocksize, buf); e != blocksize) {
+    if (int e = WriteBlock(off / blocksize, buf)) {
         Log::Error("[Ext2] Sync: Disk Error (%d) Writing Inode %d", e, inode);
         error = DiskWriteError;
         return;
@@ -1439,8 +1704,74 @@ void Ext2::Ext2Volume::SyncInode(ext2_inode_t& e2inode, uint32_t inode) {
 }
 
 void Ext2::Ext2Volume::SyncNode(Ext2Node* node) {
-    ScopedSpinLock lockInodes(m_inodesLock);
-    SyncInode(node->e2inode, node->inode);
+    {
+        ScopedMutexLock lockInodes(m_inodesLock);
+        if (!node->inodeDirty) {
+            node->inodeDirty = true;
+            dirtyNodes.add_back(node);
+        }
+
+        if (dirtyNodes.get_length() >= EXT2_MAX_DIRTY_NODES) {
+            WriteInodes();
+        }
+
+        // Allocations for the node are written back with it
+        WriteMetadata();
+    }
+}
+
+void Ext2::Ext2Volume::WriteInodes() {
+    // Sort by inode number so inodes in the same table block are next to each other
+    for (unsigned i = 1; i < dirtyNodes.get_length(); i++) {
+        Ext2Node* node = dirtyNodes[i];
+        unsigned j = i;
+        for (; j > 0 && dirtyNodes[j - 1]->inode > node->inode; j--) {
+            dirtyNodes[j] = dirtyNodes[j - 1];
+        }
+        dirtyNodes[j] = node;
+    }
+
+    uint8_t buffer[blocksize];
+    for (unsigned i = 0; i < dirtyNodes.get_length();) {
+        uint32_t block = InodeOffset(dirtyNodes[i]->inode) / blocksize;
+        if (int e = ReadBlock(block, buffer)) {
+            Log::Error("[Ext2] WriteInodes: Disk Error (%d) Reading Inode %d", e, dirtyNodes[i]->inode);
+            error = DiskReadError;
+            break;
+        }
+
+        unsigned first = i;
+        uint64_t start = BlockToLocation(block);
+        for (; i < dirtyNodes.get_length() && InodeOffset(dirtyNodes[i]->inode) - start < blocksize; i++) {
+            Ext2Node* node = dirtyNodes[i];
+            *reinterpret_cast<ext2_inode_t*>(buffer + (InodeOffset(node->inode) - start)) = node->e2inode;
+        }
+
+        if (int e = WriteBlock(block, buffer)) {
+            Log::Error("[Ext2] WriteInodes: Disk Error (%d) Writing Inode %d", e, dirtyNodes[first]->inode);
+            error = DiskWriteError;
+            break;
+        }
+    }
+
+    // Inodes that failed to be written are not retried either, the volume is marked as having an error
+    for (Ext2Node* node : dirtyNodes) {
+        node->inodeDirty = false;
+    }
+    dirtyNodes.clear();
+}
+
+int Ext2::Ext2Volume::SyncDevice() {
+    {
+        ScopedMutexLock lockInodes(m_inodesLock);
+        WriteInodes();
+    }
+
+    WriteMetadata();
+    if (int e = CommitJournalAtBoundary(true)) {
+        return e;
+    }
+    return m_device->Sync();
 }
 
 int Ext2::Ext2Volume::Create(Ext2Node* node, DirectoryEntry* ent, uint32_t mode) {
@@ -1466,7 +1797,10 @@ int Ext2::Ext2Volume::Create(Ext2Node* node, DirectoryEntry* ent, uint32_t mode)
     // File is only references by one directory
     file->nlink = 1;
     file->e2inode.linkCount = 1;
-    inodeCache.insert(file->inode, file);
+    {
+        ScopedMutexLock lockInodes(m_inodesLock);
+        CacheNode(file);
+    }
 
     // Update the directory entry with the inode
     ent->node = file;
@@ -1506,7 +1840,10 @@ int Ext2::Ext2Volume::CreateDirectory(Ext2Node* node, DirectoryEntry* ent, uint3
     dir->flags = FS_NODE_DIRECTORY;
     dir->e2inode.linkCount = 1;
 
-    inodeCache.insert(dir->inode, dir);
+    {
+        ScopedMutexLock lockInodes(m_inodesLock);
+        CacheNode(dir);
+    }
     ent->node = dir;
     ent->inode = dir->inode;
     ent->flags = EXT2_FT_DIR;
@@ -1572,6 +1909,19 @@ int Ext2::Ext2Volume::Link(Ext2Node* node, Ext2Node* file, DirectoryEntry* ent)
         return -EXDEV; // Different filesystem
     }
 
+    if (IsIndexed(node)) {
+        int e = DxInsert(node, *ent);
+        if (e < 0) {
+            return e;
+        } else if (!e) {
+            file->nlink++;
+            file->e2inode.linkCount++;
+
+            SyncNode(file);
+            return 0;
+        }
+    }
+
     List<DirectoryEntry> entries;
     if (int e = ListDir(node, entries)) {
         Log::Error("[Ext2] Link: Error listing directory!", ent->inode);
@@ -1596,19 +1946,26 @@ int Ext2::Ext2Volume::Link(Ext2Node* node, Ext2Node* file, DirectoryEntry* ent)
 }
 
 int Ext2::Ext2Volume::Unlink(Ext2Node* node, DirectoryEntry* ent, bool unlinkDirectories) {
-    List<DirectoryEntry> entries;
-    if (int e = ListDir(node, entries)) {
-        Log::Error("[Ext2] Unlink: Error listing directory!", ent->inode);
-        return e;
-    }
-
     // Remove from cache if cached
     node->directoryCache.remove(ent->name);
 
-    for (unsigned i = 0; i < entries.get_length(); i++) {
-        if (strcmp(entries[i].name, ent->name) == 0) {
-            ent->inode = entries.remove_at(i).inode;
-            goto found;
+    if (uint32_t inode; IsIndexed(node) && !DxFind(node, ent->name, inode)) {
+        ent->inode = inode;
+        goto found;
+    }
+
+    {
+        List<DirectoryEntry> entries;
+        if (int e = ListDir(node, entries)) {
+            Log::Error("[Ext2] Unlink: Error listing directory!", ent->inode);
+            return e;
+        }
+
+        for (DirectoryEntry& dirent : entries) {
+            if (strcmp(dirent.name, ent->name) == 0) {
+                ent->inode = dirent.inode;
+                goto found;
+            }
         }
     }
 
@@ -1622,7 +1979,7 @@ found:
     }
 
     {
-        ScopedSpinLock lockInodes(m_inodesLock);
+        ScopedMutexLock lockInodes(m_inodesLock);
         if (Ext2Node * file; inodeCache.get(ent->inode, file)) {
             if ((file->flags & FS_NODE_TYPE) == FS_NODE_DIRECTORY) {
                 if (!unlinkDirectories) {
@@ -1633,8 +1990,13 @@ found:
             file->nlink--;
             file->e2inode.linkCount--;
 
+            // Still linked elsewhere, the link count is written back with the inode
+            if (file->e2inode.linkCount && !file->inodeDirty) {
+                file->inodeDirty = true;
+                dirtyNodes.add_back(file);
+            }
+
             if (!file->handleCount) {
-                inodeCache.remove(file->inode);
                 CleanNode(file);
             }
         } else {
@@ -1661,6 +2023,25 @@ found:
         }
     }
 
+    if (IsIndexed(node)) {
+        if (int e = DxRemove(node, ent->name); e <= 0) {
+            return e;
+        }
+    }
+
+    List<DirectoryEntry> entries;
+    if (int e = ListDir(node, entries)) {
+        Log::Error("[Ext2] Unlink: Error listing directory!", ent->inode);
+        return e;
+    }
+
+    for (unsigned i = 0; i < entries.get_length(); i++) {
+        if (strcmp(entries[i].name, ent->name) == 0) {
+            entries.remove_at(i);
+            break;
+        }
+    }
+
     return WriteDir(node, entries);
 }
 
@@ -1673,13 +2054,29 @@ int Ext2::Ext2Volume::Truncate(Ext2Node* node, off_t length) {
         uint64_t blocksNeeded = (length + blocksize - 1) / blocksize;
         uint64_t blocksAllocated = node->e2inode.blockCount / (blocksize / 512);
 
+        InvalidateExtents(node, blocksAllocated);
+
+        uint32_t goal = blocksAllocated ? GetInodeBlock(blocksAllocated - 1, node->e2inode) + 1 : 0;
         while (blocksAllocated < blocksNeeded) {
-            SetInodeBlock(blocksAllocated++, node->e2inode, AllocateBlock());
+            uint32_t count = blocksNeeded - blocksAllocated;
+            uint32_t block = AllocateBlocks(goal, count);
+            if (!block) {
+                node->e2inode.blockCount = blocksAllocated * (blocksize / 512);
+                SyncNode(node);
+                return -ENOSPC;
+            }
+
+            for (uint32_t j = 0; j < count; j++) {
+                SetInodeBlock(blocksAllocated++, node->e2inode, block + j);
+            }
+            goal = block + count;
         }
 
         node->e2inode.blockCount = blocksNeeded * (blocksize / 512);
     }
 
+    // Blocks past the end of the file are mapped as 0
+    InvalidateExtents(node, (length + blocksize - 1) / blocksize);
     node->size = node->e2inode.size = length; // TODO: Actually free blocks in inode if possible
 
     SyncNode(node);
@@ -1695,12 +2092,73 @@ void Ext2::Ext2Volume::CleanNode(Ext2Node* node) {
 
     if (node->e2inode.linkCount == 0) { // No links to file
         EraseInode(node->e2inode, node->inode);
+        if (node->inodeDirty) {
+            dirtyNodes.remove(node);
+        }
+    } else if (node->inodeDirty) {
+        WriteInodes();
     }
 
-    inodeCache.remove(node->inode);
+    if (node->unused) {
+        unusedNodes.remove(node);
+    }
+
+    if (Ext2Node* cached; inodeCache.get(node->inode, cached) && cached == node) {
+        inodeCache.remove(node->inode);
+    }
     delete node;
 }
 
+void Ext2::Ext2Volume::CloseNode(Ext2Node* node) {
+    ScopedMutexLock lockInodes(m_inodesLock);
+    if (--node->handleCount) {
+        return;
+    }
+
+    if (node == mountPoint) {
+        return; // Owned by the volume
+    }
+
+    if (!node->e2inode.linkCount) {
+        CleanNode(node); // Last handle to an unlinked file
+        return;
+    }
+
+    MarkUnused(node);
+    EvictNodes();
+}
+
+void Ext2::Ext2Volume::CacheNode(Ext2Node* node) {
+    inodeCache.insert(node->inode, node);
+
+    // Nodes are only used through handles once found
+    MarkUnused(node);
+    EvictNodes();
+}
+
+void Ext2::Ext2Volume::MarkUnused(Ext2Node* node) {
+    if (node->unused) {
+        unusedNodes.remove(node);
+    }
+
+    unusedNodes.add_back(node);
+    node->unused = true;
+}
+
+void Ext2::Ext2Volume::EvictNodes() {
+    while (unusedNodes.get_length() > EXT2_MAX_UNUSED_NODES) {
+        Ext2Node* node = unusedNodes.get_front();
+        unusedNodes.remove(node);
+        node->unused = false;
+
+        if (node->handleCount) {
+            continue; // Opened since, put back on the list when closed
+        }
+
+        CleanNode(node);
+    }
+}
+
 Ext2::Ext2Node::Ext2Node(Ext2Volume* vol, ext2_inode_t& ino, ino_t inode) {
     this->vol = vol;
     volumeID = vol->volumeID;
@@ -1719,6 +2177,7 @@ Ext2::Ext2Node::Ext2Node(Ext2Volume* vol, ext2_inode_t& ino, ino_t inode) {
         break;
     case EXT2_S_IFDIR:
         flags = FS_NODE_DIRECTORY;
+        cacheDirectoryEntries = true; // Entries only change through Create, Link, etc.
         break;
     case EXT2_S_IFLNK:
         flags = FS_NODE_SYMLINK;
@@ -1728,6 +2187,7 @@ Ext2::Ext2Node::Ext2Node(Ext2Volume* vol, ext2_inode_t& ino, ino_t inode) {
         break;
     default:
         flags = FS_NODE_FILE;
+        readahead = true;
         break;
     }
 
@@ -1741,6 +2201,13 @@ int Ext2::Ext2Node::ReadDir(DirectoryEntry* ent, uint32_t idx) {
     return ret;
 }
 
+int Ext2::Ext2Node::ReadDirBatch(DirectoryEntry* entries, int count, off_t& cursor) {
+    flock.AcquireRead();
+    auto ret = vol->ReadDirBatch(this, entries, count, cursor);
+    flock.ReleaseRead();
+    return ret;
+}
+
 FsNode* Ext2::Ext2Node::FindDir(const char* name) {
     flock.AcquireRead();
     auto ret = vol->FindDir(this, name);
@@ -1757,6 +2224,7 @@ ssize_t Ext2::Ext2Node::Read(size_t offset, size_t size, uint8_t* buffer) {
 
 ssize_t Ext2::Ext2Node::Write(size_t offset, size_t size, uint8_t* buffer) {
     flock.AcquireWrite();
+    Ext2Volume::JournalOperation op(vol);
     auto ret = vol->Write(this, offset, size, buffer);
     flock.ReleaseWrite();
     return ret;
@@ -1764,6 +2232,7 @@ ssize_t Ext2::Ext2Node::Write(size_t offset, size_t size, uint8_t* buffer) {
 
 int Ext2::Ext2Node::Create(DirectoryEntry* ent, uint32_t mode) {
     flock.AcquireWrite();
+    Ext2Volume::JournalOperation op(vol);
     auto ret = vol->Create(this, ent, mode);
     flock.ReleaseWrite();
     return ret;
@@ -1771,6 +2240,7 @@ int Ext2::Ext2Node::Create(DirectoryEntry* ent, uint32_t mode) {
 
 int Ext2::Ext2Node::CreateDirectory(DirectoryEntry* ent, uint32_t mode) {
     flock.AcquireWrite();
+    Ext2Volume::JournalOperation op(vol);
     auto ret = vol->CreateDirectory(this, ent, mode);
     flock.ReleaseWrite();
     return ret;
@@ -1790,6 +2260,7 @@ int Ext2::Ext2Node::Link(FsNode* n, DirectoryEntry* d) {
     }
 
     flock.AcquireWrite();
+    Ext2Volume::JournalOperation op(vol);
     auto ret = vol->Link(this, (Ext2Node*)n, d);
     flock.ReleaseWrite();
     return ret;
@@ -1797,6 +2268,7 @@ int Ext2::Ext2Node::Link(FsNode* n, DirectoryEntry* d) {
 
 int Ext2::Ext2Node::Unlink(DirectoryEntry* d, bool unlinkDirectories) {
     flock.AcquireWrite();
+    Ext2Volume::JournalOperation op(vol);
     auto ret = vol->Unlink(this, d, unlinkDirectories);
     flock.ReleaseWrite();
     return ret;
@@ -1804,19 +2276,23 @@ int Ext2::Ext2Node::Unlink(DirectoryEntry* d, bool unlinkDirectories) {
 
 int Ext2::Ext2Node::Truncate(off_t length) {
     flock.AcquireWrite();
+    Ext2Volume::JournalOperation op(vol);
     auto ret = vol->Truncate(this, length);
     flock.ReleaseWrite();
     return ret;
 }
 
-void Ext2::Ext2Node::Sync() { vol->SyncNode(this); }
+int Ext2::Ext2Node::Sync() {
+    {
+        Ext2Volume::JournalOperation op(vol);
+        vol->SyncNode(this);
+    }
+    return vol->SyncDevice();
+}
 
 void Ext2::Ext2Node::Close() {
-    handleCount--;
-
-    if (handleCount == 0) {
-        vol->CleanNode(this); // Remove from the cache
-        return;
-    }
+    // The last handle to an unlinked file frees its inode and blocks
+    Ext2Volume::JournalOperation op(vol);
+    vol->CloseNode(this);
 }
 } // namespace fs
\ No newline at end of file
@@ -11,7 +11,9 @@
 #define I8254_REGISTER_EEPROM       0x14
 #define I8254_REGISTER_CTRL_EXT     0x18
 #define I8254_REGISTER_INT_READ     0xC0
+#define I8254_REGISTER_ITR          0xC4 // Interrupt Throttling
 #define I8254_REGISTER_INT_MASK     0xD0
+#define I8254_REGISTER_INT_MASK_CLEAR 0xD8
 
 #define I8254_REGISTER_RCTRL        0x100
 #define I8254_REGISTER_RDESC_LO     0x2800
@@ -27,6 +29,7 @@
 #define I8254_REGISTER_TDESC_HEAD   0x3810
 #define I8254_REGISTER_TDESC_TAIL   0x3818
 
+#define I8254_REGISTER_RXCSUM       0x5000
 #define I8254_REGISTER_MTA          0x5200
 
 #define CTRL_FD (1 << 0)        // Full Duplex
@@ -55,6 +58,22 @@
 
 #define BSIZE_4096 (RCTRL_G_BSIZE(3) | RCTRL_BSEX)
 
+#define INT_LSC (1 << 2)    // Link Status Change
+#define INT_RXDMT0 (1 << 4) // Receive Descriptor Minimum Threshold
+#define INT_RXO (1 << 6)    // Receiver Overrun
+#define INT_RXT0 (1 << 7)   // Receiver Timer
+#define INT_RX (INT_RXDMT0 | INT_RXO | INT_RXT0)
+
+#define RSTATUS_DD (1 << 0)  // Descriptor Done
+#define RSTATUS_EOP (1 << 1) // End of Packet
+#define RSTATUS_IXSM (1 << 2) // Ignore Checksum Indication
+#define RSTATUS_TCPCS (1 << 5) // TCP/UDP Checksum Calculated
+
+#define RERROR_TCPE (1 << 5) // TCP/UDP Checksum Error
+
+#define RXCSUM_IPOFL (1 << 8) // IP Checksum Offload Enable
+#define RXCSUM_TUOFL (1 << 9) // TCP/UDP Checksum Offload Enable
+
 #define TCMD_EOP (1 << 0) // End of packet
 #define TCMD_IFCS (1 << 1) // Insert FCS
 #define TCMD_IC (1 << 2) // Insert Checksum
@@ -62,6 +81,24 @@
 #define TCMD_VLE (1 << 6) // VLAN Packet Enable
 #define TCMD_IDE (1 << 7) // Interrupt Delay Enable
 
+#define TUCMD_TCP (1 << 0) // Context is for TCP rather than UDP
+#define TUCMD_IP (1 << 1) // Context is for IPv4
+#define TUCMD_TSE (1 << 2) // TCP Segmentation Enable
+#define TUCMD_RS (1 << 3) // Report Status
+#define TUCMD_DEXT (1 << 5) // Extended descriptor
+
+#define TDCMD_EOP (1 << 0) // End of packet
+#define TDCMD_IFCS (1 << 1) // Insert FCS
+#define TDCMD_TSE (1 << 2) // TCP Segmentation Enable
+#define TDCMD_RS (1 << 3) // Report Status
+#define TDCMD_DEXT (1 << 5) // Extended descriptor
+
+#define TDTYP_CONTEXT (0 << 20)
+#define TDTYP_DATA (1 << 20)
+
+#define TPOPTS_IXSM (1 << 0) // Insert IP checksum
+#define TPOPTS_TXSM (1 << 1) // Insert TCP/UDP checksum
+
 #define TSTATUS_DD (1 << 0) // Descriptor Done
 #define TSTATUS_EC (1 << 1) // Excess Collisions
 #define TSTATUS_LC (1 << 2) // Late collision
@@ -77,11 +114,25 @@
 #define RX_DESC_COUNT 256
 #define TX_DESC_COUNT 256
 
+#define RX_POLL_BUDGET 64 // Descriptors handled before the receive thread yields
+
+#define ITR_INTERVAL_NS 256 // ITR is in 256ns units
+
 class Intel8254x final : public Network::NetworkAdapter, private PCIDevice {
 public:
     Intel8254x(const PCIInfo& device);
 
     void SendPacket(void* data, size_t len);
+    void SendPacket(NetworkPacket* pkt);
+
+    /////////////////////////////
+    /// \brief Limit how often the card interrupts
+    ///
+    /// Events that arrive in between are reported together by the next interrupt.
+    ///
+    /// \param rate Maximum interrupts per second, 0 for no limit
+    /////////////////////////////
+    void SetInterruptRate(unsigned rate);
 
 private:
     typedef struct {
@@ -98,19 +149,45 @@ private:
         uint16_t length;
         uint8_t cso; // Checksum Offset
         uint8_t cmd; // Command
-        uint8_t reserved : 4; // Reserved
-        uint8_t status : 4; // Status
+        uint8_t status; // Status in the low 4 bits, the rest is reserved
         uint8_t css; // Checksum start field
         uint16_t special; // Special
     } __attribute__((packed)) t_desc_t;
 
+    // Offsets and MSS used to cut up the data descriptors that follow
+    typedef struct {
+        uint8_t ipcss; // IP checksum start
+        uint8_t ipcso; // IP checksum offset
+        uint16_t ipcse; // IP checksum end, inclusive
+        uint8_t tucss; // TCP checksum start
+        uint8_t tucso; // TCP checksum offset
+        uint16_t tucse; // TCP checksum end, 0 for the end of the packet
+        uint32_t cmdAndLength; // Payload length in bits 0-19, type in bits 20-23 and TUCMD in bits 24-31
+        uint8_t status; // Status in the low 4 bits, the rest is reserved
+        uint8_t hdrlen; // Length of the headers copied in front of each segment
+        uint16_t mss; // Payload of each segment
+    } __attribute__((packed)) t_context_desc_t;
+
+    typedef struct {
+        uint64_t addr; // Buffer Address
+        uint32_t cmdAndLength; // Length in bits 0-19, type in bits 20-23 and DCMD in bits 24-31
+        uint8_t status; // Status in the low 4 bits, the rest is reserved
+        uint8_t popts; // Packet options
+        uint16_t special; // Special
+    } __attribute__((packed)) t_data_desc_t;
+
     r_desc_t* rxDescriptors;
     t_desc_t* txDescriptors;
-    void** txDescriptorsVirt;
-    void** rxDescriptorsVirt;
+    // The card DMAs straight into and out of these packets
+    NetworkPacket* txPackets[TX_DESC_COUNT] = {}; // Kept until the card is done with them
+    NetworkPacket* rxPackets[RX_DESC_COUNT] = {};
 
     unsigned txTail = 0;
-    unsigned rxTail = 0;
+    lock_t txLock = 0;
+    unsigned rxTail = 0; // Last descriptor given back to the card
+
+    // Signalled by the IRQ handler after masking receive interrupts
+    Semaphore rxSemaphore = Semaphore(0);
 
     uint64_t memBase;
     void* memBaseVirt;
@@ -129,7 +206,32 @@ private:
     void InitializeRx();
     void InitializeTx();
 
+    // Wait for the card to finish with the descriptor at txTail, returns the packet that was in it if any. txLock must be held
+    NetworkPacket* ReclaimTxDescriptor();
+    /////////////////////////////
+    /// \brief Queue a packet for the card to cut into segments of pkt->segmentSize
+    ///
+    /// Takes a context descriptor and a data descriptor, txTail is left on the data descriptor. txLock must be held
+    ///
+    /// \return The packet previously in the data descriptor, if any
+    /////////////////////////////
+    NetworkPacket* QueueSegmentation(NetworkPacket* pkt);
+
     void UpdateLink();
     void OnInterrupt();
     static void InterruptHandler(Intel8254x* card, RegisterContext* r);
+
+    /////////////////////////////
+    /// \brief Move received packets from the ring to the queue
+    ///
+    /// The tail is written once for the whole batch.
+    ///
+    /// \param budget Maximum amount of descriptors to handle
+    ///
+    /// \return Amount of descriptors handled
+    /////////////////////////////
+    unsigned PollRx(unsigned budget);
+    // Whether the card has filled the next descriptor
+    bool RxPending() const;
+    [[noreturn]] static void RxThread(Intel8254x* card);
 };
\ No newline at end of file
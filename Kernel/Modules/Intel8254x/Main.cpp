@@ -7,9 +7,12 @@
 #include <IOPorts.h>
 #include <Logging.h>
 #include <Net/Net.h>
+#include <Objects/Process.h>
 #include <PCI.h>
 #include <Paging.h>
 #include <PhysicalAllocator.h>
+#include <Scheduler.h>
+#include <Thread.h>
 #include <Timer.h>
 #include <Vector.h>
 
@@ -97,39 +100,90 @@ bool Intel8254x::CheckForEEPROM() {
 void Intel8254x::OnInterrupt() {
     uint32_t status = ReadMem32(I8254_REGISTER_INT_READ);
 
-    if (status & 0x4) {
+    if (status & INT_LSC) {
         Log::Info("[i8254x] Initializing Link...");
 
         WriteMem32(I8254_REGISTER_CTRL, ReadMem32(I8254_REGISTER_CTRL) | CTRL_SLU | CTRL_ASDE);
 
         UpdateLink();
-    } else if (status & 0x80) {
-        do {
-            rxTail = ReadMem32(I8254_REGISTER_RDESC_TAIL);
-            if (rxTail == ReadMem32(I8254_REGISTER_RDESC_HEAD))
-                return;
-            rxTail = (rxTail + 1) % RX_DESC_COUNT;
-
-            if (!(rxDescriptors[rxTail].status & 0x1))
-                break;
+    }
 
-            rxDescriptors[rxTail].status = 0;
+    if (status & INT_RX) {
+        // Leave the ring to the receive thread, receive interrupts stay off until it has emptied the ring
+        WriteMem32(I8254_REGISTER_INT_MASK_CLEAR, INT_RX);
+        rxSemaphore.Signal();
+    }
+}
 
-            if (rxDescriptors[rxTail].length <= ETHERNET_MAX_PACKET_SIZE && cache.get_length()) {
-                NetworkPacket* pkt = cache.remove_at(0);
+bool Intel8254x::RxPending() const {
+    return __atomic_load_n(&rxDescriptors[(rxTail + 1) % RX_DESC_COUNT].status, __ATOMIC_ACQUIRE) & RSTATUS_DD;
+}
 
-                pkt->length = rxDescriptors[rxTail].length;
-                memcpy(pkt->data, rxDescriptorsVirt[rxTail], pkt->length);
+unsigned Intel8254x::PollRx(unsigned budget) {
+    unsigned tail = rxTail;
+    unsigned count = 0;
 
-                queue.add_back(pkt);
-                packetSemaphore.Signal();
-                Network::packetQueueSemaphore.Signal();
-            } else {
-                // TODO: Do something that isn't dropping the packet when the cache is empty
+    for (; count < budget; count++) {
+        unsigned next = (tail + 1) % RX_DESC_COUNT;
+        r_desc_t& desc = rxDescriptors[next];
+
+        if (!(__atomic_load_n(&desc.status, __ATOMIC_ACQUIRE) & RSTATUS_DD)) {
+            break;
+        }
+
+        if ((desc.status & RSTATUS_EOP) && desc.length <= ETHERNET_MAX_PACKET_SIZE) {
+            // Pass the packet the card wrote into up the stack and give the card an empty one in its place
+            NetworkPacket* pkt = rxPackets[next];
+            pkt->offset = 0;
+            pkt->length = desc.length;
+            pkt->checksumVerified = (desc.status & (RSTATUS_TCPCS | RSTATUS_IXSM)) == RSTATUS_TCPCS && !(desc.errors & RERROR_TCPE);
+
+            rxPackets[next] = AllocatePacket();
+            desc.addr = rxPackets[next]->physicalAddress;
+
+            Receive(pkt);
+        } else {
+            // Too large for a packet, drop it
+        }
+
+        desc.status = 0;
+        tail = next;
+    }
+
+    if (count) {
+        rxTail = tail;
+        WriteMem32(I8254_REGISTER_RDESC_TAIL, rxTail); // Give the whole batch back to the card at once
+    }
+
+    return count;
+}
+
+void Intel8254x::RxThread(Intel8254x* card) {
+    for (;;) {
+        if (card->rxSemaphore.Wait()) {
+            continue;
+        }
+
+        for (;;) {
+            if (card->QueueSize() >= RX_DESC_COUNT) {
+                // The network stack has fallen behind, leave packets in the ring until the pool has been recycled
+                Thread::Current()->Sleep(1000);
+                continue;
             }
 
-            WriteMem32(I8254_REGISTER_RDESC_TAIL, rxTail);
-        } while (1);
+            if (card->PollRx(RX_POLL_BUDGET) == RX_POLL_BUDGET) {
+                Scheduler::Yield(); // There may be more, let everything else run first
+                continue;
+            }
+
+            card->WriteMem32(I8254_REGISTER_INT_MASK, INT_RX);
+
+            // A packet may have arrived before receive interrupts were unmasked
+            if (!card->RxPending()) {
+                break;
+            }
+            card->WriteMem32(I8254_REGISTER_INT_MASK_CLEAR, INT_RX);
+        }
     }
 }
 
@@ -179,8 +233,7 @@ void Intel8254x::InitializeRx() {
     uint32_t rxLen = 4096; // Memory block size
     uint32_t rxHead = 0;
     uint32_t _rxTail = RX_DESC_COUNT - 1; // Offset from base
-
-    rxDescriptorsVirt = (void**)kmalloc(RX_DESC_COUNT * sizeof(void*));
+    rxTail = _rxTail;
 
     WriteMem32(I8254_REGISTER_RDESC_LO, rxLow);
     WriteMem32(I8254_REGISTER_RDESC_HI, rxHigh);
@@ -190,14 +243,13 @@ void Intel8254x::InitializeRx() {
 
     for (int i = 0; i < RX_DESC_COUNT; i++) {
         r_desc_t* rxd = &rxDescriptors[i];
-        uint64_t phys = Memory::AllocatePhysicalMemoryBlock();
-        rxd->addr = phys;
+        rxPackets[i] = AllocatePacket();
+        rxd->addr = rxPackets[i]->physicalAddress; // Whole page, the same as the buffer size
         rxd->status = 0;
-
-        rxDescriptorsVirt[i] = Memory::KernelAllocate4KPages(1);
-        Memory::KernelMapVirtualMemory4K(phys, (uintptr_t)rxDescriptorsVirt[i], 1);
     }
 
+    WriteMem32(I8254_REGISTER_RXCSUM, RXCSUM_IPOFL | RXCSUM_TUOFL); // Check TCP and UDP checksums of received packets
+
     WriteMem32(I8254_REGISTER_RCTRL,
                (RCTRL_ENABLE | RCTRL_SBP | RCTRL_UPE | RCTRL_MPE | RCTRL_LPE | RCTRL_BAM | RCTRL_SECRC | BSIZE_4096));
 }
@@ -209,9 +261,7 @@ void Intel8254x::InitializeTx() {
     uint32_t txHigh = txDescPhys >> 32;
     uint32_t txLen = 4096; // Memory block size
     uint32_t txHead = 0;
-    uint32_t _txTail = RX_DESC_COUNT; // Offset from base
-
-    txDescriptorsVirt = (void**)kmalloc(TX_DESC_COUNT * sizeof(void*));
+    uint32_t _txTail = 0; // Offset from base, the same as the head as there is nothing to send
 
     WriteMem32(I8254_REGISTER_TDESC_LO, txLow);
     WriteMem32(I8254_REGISTER_TDESC_HI, txHigh);
@@ -221,12 +271,8 @@ void Intel8254x::InitializeTx() {
 
     for (int i = 0; i < TX_DESC_COUNT; i++) {
         t_desc_t* txd = &txDescriptors[i];
-        uint64_t phys = Memory::AllocatePhysicalMemoryBlock();
-        txd->addr = phys;
-        txd->status = 0;
-
-        txDescriptorsVirt[i] = Memory::KernelAllocate4KPages(1);
-        Memory::KernelMapVirtualMemory4K(phys, (uintptr_t)txDescriptorsVirt[i], 1);
+        txd->addr = 0; // Set to the packet being sent
+        txd->status = TSTATUS_DD; // Free
     }
 
     WriteMem32(I8254_REGISTER_TCTRL, (TCTRL_ENABLE | TCTRL_PSP));
@@ -304,27 +350,128 @@ Intel8254x::Intel8254x(const PCIInfo& device)
     InitializeRx();
     InitializeTx();
 
+    offloads = OffloadTxChecksum | OffloadRxChecksum | OffloadTcpSegmentation;
+
     dState = DriverState::OK;
 
-    maxCache = 256;
-    for (unsigned i = 0; i < maxCache; i++) {
-        cache.add_back(new NetworkPacket()); // Fill the cache
-    }
+    // Packets to replace those in the ring, packets are given back by the network stack and reused
+    packetCache.Fill(RX_DESC_COUNT);
 
+    auto proc = Process::CreateKernelProcess((void*)RxThread, "e1kRx", nullptr);
+    proc->GetMainThread()->registers.rdi = reinterpret_cast<uintptr_t>(this);
+    proc->Start();
+
+    SetInterruptRate(interruptRate);
     WriteMem32(I8254_REGISTER_INT_MASK, 0x1F6DF); // Set the interrupt mask to enable all interrupts
     UpdateLink();
 }
 
+void Intel8254x::SetInterruptRate(unsigned rate) {
+    WriteMem32(I8254_REGISTER_ITR, rate ? 1000000000 / (rate * ITR_INTERVAL_NS) : 0);
+}
+
 void Intel8254x::SendPacket(void* data, size_t len) {
-    asm("cli");
+    if (len > NETWORK_PACKET_SIZE - NETWORK_PACKET_HEADROOM) {
+        return;
+    }
+
+    NetworkPacket* pkt = AllocatePacket();
+    memcpy(pkt->Put(len), data, len);
+
+    SendPacket(pkt);
+}
+
+NetworkPacket* Intel8254x::ReclaimTxDescriptor() {
     t_desc_t* txd = &(txDescriptors[txTail]);
 
-    memcpy(txDescriptorsVirt[txTail], data, len);
-    txd->length = len;
-    txd->cmd = TCMD_EOP | TCMD_IFCS | TCMD_RS;
+    // The ring may have wrapped around, wait for the card to finish with this descriptor
+    while (!(__atomic_load_n(&txd->status, __ATOMIC_ACQUIRE) & TSTATUS_DD))
+        asm volatile("pause");
 
+    NetworkPacket* sent = txPackets[txTail];
+    txPackets[txTail] = nullptr;
+    return sent;
+}
+
+NetworkPacket* Intel8254x::QueueSegmentation(NetworkPacket* pkt) {
+    uint8_t* data = pkt->Data();
+    unsigned tcpStart = pkt->checksumStart - pkt->offset;
+    unsigned headerLength = tcpStart + (data[tcpStart + 12] >> 4) * 4; // Up to the end of the TCP options
+
+    // The card fills in the IPv4 length and checksum of each segment
+    data[sizeof(EthernetFrame) + 2] = data[sizeof(EthernetFrame) + 3] = 0;
+    data[sizeof(EthernetFrame) + 10] = data[sizeof(EthernetFrame) + 11] = 0;
+
+    t_context_desc_t* ctx = reinterpret_cast<t_context_desc_t*>(&txDescriptors[txTail]);
+    ctx->ipcss = sizeof(EthernetFrame);
+    ctx->ipcso = sizeof(EthernetFrame) + 10;
+    ctx->ipcse = tcpStart - 1;
+    ctx->tucss = tcpStart;
+    ctx->tucso = pkt->checksumOffset - pkt->offset;
+    ctx->tucse = 0;
+    ctx->cmdAndLength = (pkt->length - headerLength) | TDTYP_CONTEXT |
+                        ((TUCMD_TCP | TUCMD_IP | TUCMD_TSE | TUCMD_RS | TUCMD_DEXT) << 24);
+    ctx->hdrlen = headerLength;
+    ctx->mss = pkt->segmentSize;
+    ctx->status = 0;
+
+    // The packet itself goes in the next descriptor
     txTail = (txTail + 1) % TX_DESC_COUNT;
+    NetworkPacket* sent = ReclaimTxDescriptor();
+
+    txPackets[txTail] = pkt;
 
-    WriteMem32(I8254_REGISTER_TDESC_TAIL, txTail);
-    asm("sti");
-}
\ No newline at end of file
+    t_data_desc_t* txd = reinterpret_cast<t_data_desc_t*>(&txDescriptors[txTail]);
+    txd->addr = pkt->PhysicalData();
+    txd->cmdAndLength = pkt->length | TDTYP_DATA |
+                        ((TDCMD_EOP | TDCMD_IFCS | TDCMD_TSE | TDCMD_RS | TDCMD_DEXT) << 24);
+    txd->popts = TPOPTS_IXSM | TPOPTS_TXSM;
+    txd->special = 0;
+    txd->status = 0;
+
+    return sent;
+}
+
+void Intel8254x::SendPacket(NetworkPacket* pkt) {
+    NetworkPacket* sent = nullptr;
+    NetworkPacket* sentSecond = nullptr;
+
+    {
+        ScopedSpinLock<true> lockTx(txLock);
+        sent = ReclaimTxDescriptor();
+
+        if (pkt->segmentSize) {
+            sentSecond = QueueSegmentation(pkt);
+        } else {
+            t_desc_t* txd = &(txDescriptors[txTail]);
+            txPackets[txTail] = pkt;
+
+            txd->addr = pkt->PhysicalData();
+            txd->length = pkt->length;
+            txd->cmd = TCMD_EOP | TCMD_IFCS | TCMD_RS;
+            txd->status = 0;
+
+            if (pkt->checksumStart) {
+                // Sum from css to the end of the packet into cso, the stack left the pseudo header sum at cso
+                txd->css = pkt->checksumStart - pkt->offset;
+                txd->cso = pkt->checksumOffset - pkt->offset;
+                txd->cmd |= TCMD_IC;
+            } else {
+                txd->css = 0;
+                txd->cso = 0;
+            }
+        }
+
+        txTail = (txTail + 1) % TX_DESC_COUNT;
+
+        WriteMem32(I8254_REGISTER_TDESC_TAIL, txTail);
+    }
+
+    if (sent) {
+        sent->Release();
+    }
+
+    if (sentSecond) {
+        sentSecond->Release();
+    }
+}
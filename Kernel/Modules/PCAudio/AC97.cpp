@@ -75,6 +75,19 @@ AC97Controller::AC97Controller(const PCIInfo& info) : PCIDevice(info) {
     }
     m_samplesPerBuffer = PAGE_SIZE_4K / m_pcmSampleSize / m_pcmNumChannels;
 
+    m_ring = new SampleRingVMObject(AC97_RING_SIZE);
+    KernelAllocateMappedBlock(&m_ringListPhys, &m_ringList);
+    assert(m_ringListPhys < 0xFFFFFFFF);
+
+    for (unsigned e = 0; e < AC97_BDL_ENTRIES; e++) {
+        uintptr_t entryPhys = m_ring->PhysicalAddress(e * AC97_RING_PERIOD);
+        assert(entryPhys < 0xFFFFFFFF);
+
+        m_ringList[e] = BufferDescriptor{.address = (uint32_t)entryPhys,
+                                         .sampleCount = (uint16_t)(AC97_RING_PERIOD / m_pcmSampleSize),
+                                         .flags = 0};
+    }
+
     outportl(m_nabmPort + PO_BufferDescriptorList, bufferDescriptorListPhys);
     outportl(m_nabmPort + NBGlobalControl, globalControl);
 
@@ -128,6 +141,14 @@ int AC97Controller::WriteSamples(void* output, uint8_t* buffer, size_t size, boo
         return -EINVAL; // Must be writing exact frame
     }
 
+    if (m_ringMode) {
+        ScopedSpinLock lockController(m_lock);
+
+        // Take the output back from the ring
+        m_ringMode = false;
+        SwitchBufferDescriptorList(bufferDescriptorListPhys);
+    }
+
     int totalSamplesWritten = 0;
     int buffersToWrite = (((int)size + PAGE_SIZE_4K - 1) >> PAGE_SHIFT_4K);
 
@@ -210,6 +231,75 @@ int AC97Controller::WriteSamples(void* output, uint8_t* buffer, size_t size, boo
     return totalSamplesWritten;
 }
 
+FancyRefPtr<SampleRingVMObject> AC97Controller::OutputMapRing(void* output, size_t& periodSize) {
+    ScopedSpinLock lockController(m_lock);
+
+    // Anything left in the ring from the last time it was mapped is not to be played
+    memset(m_ring->KernelMapping(), 0, AC97_RING_SIZE);
+
+    m_ringMode = true;
+    m_ringCommitted = 0;
+    SwitchBufferDescriptorList(m_ringListPhys);
+
+    periodSize = AC97_RING_PERIOD;
+    return m_ring;
+}
+
+int AC97Controller::OutputRingPosition(void* output) {
+    ScopedSpinLock lockController(m_lock);
+    if (!m_ringMode) {
+        return -EINVAL;
+    }
+
+    if (!IsDMARunning()) {
+        // Stopped after playing every committed period, or yet to start
+        return (m_ringCommitted / AC97_RING_PERIOD * AC97_RING_PERIOD) % AC97_RING_SIZE;
+    }
+
+    // The position register holds the samples left in the current entry
+    unsigned entry = inportb(m_nabmPort + PO_CurrentEntry) % AC97_BDL_ENTRIES;
+    unsigned remaining = MIN(inportw(m_nabmPort + PO_NumTransferredSamples) * m_pcmSampleSize, AC97_RING_PERIOD);
+
+    return entry * AC97_RING_PERIOD + AC97_RING_PERIOD - remaining;
+}
+
+int AC97Controller::OutputRingCommit(void* output, size_t size) {
+    if (size % (m_pcmSampleSize * m_pcmNumChannels)) {
+        return -EINVAL; // Must be committing exact frames
+    }
+
+    ScopedSpinLock lockController(m_lock);
+    if (!m_ringMode) {
+        return -EINVAL;
+    }
+
+    m_ringCommitted += size;
+
+    // Only whole periods are handed to the hardware
+    uint64_t periods = m_ringCommitted / AC97_RING_PERIOD;
+    if (!periods) {
+        return 0;
+    }
+
+    outportb(m_nabmPort + PO_LastValidEntry, (periods - 1) % AC97_BDL_ENTRIES);
+    if (!IsDMARunning()) {
+        StartDMA();
+    }
+
+    return 0;
+}
+
+void AC97Controller::SwitchBufferDescriptorList(uintptr_t listPhys) {
+    StopDMA();
+
+    uint16_t nabmTransferControl = m_nabmPort + PO_TransferControl;
+    outportb(nabmTransferControl, inportb(nabmTransferControl) | NBTransferReset);
+    while (inportb(nabmTransferControl) & NBTransferReset)
+        ;
+
+    outportl(m_nabmPort + PO_BufferDescriptorList, listPhys);
+}
+
 void AC97Controller::OnIRQ() {
     Log::Info("AC97 IRQ!!");
 
@@ -28,6 +28,10 @@
 
 #define AC97_SAMPLE_RATE 48000
 
+// Bytes in each entry of the DMA ring mapped by user space, 256 frames (~5ms) of 16-bit stereo
+#define AC97_RING_PERIOD 1024
+#define AC97_RING_SIZE (AC97_RING_PERIOD * AC97_BDL_ENTRIES)
+
 namespace Audio {
 
 class AC97Controller : public AudioController, public PCIDevice {
@@ -49,6 +53,10 @@ public:
 
     int WriteSamples(void* output, uint8_t* buffer, size_t size, bool async) override;
 
+    FancyRefPtr<SampleRingVMObject> OutputMapRing(void* output, size_t& periodSize) override;
+    int OutputRingPosition(void* output) override;
+    int OutputRingCommit(void* output, size_t size) override;
+
     void OnIRQ();
 
 private:
@@ -64,6 +72,9 @@ private:
         return !(inportw(m_nabmPort + PO_TransferStatus) & NBDMAStatus);
     }
 
+    // Stop and reset PCM out, then have it play from the given buffer descriptor list. m_lock must be held
+    void SwitchBufferDescriptorList(uintptr_t listPhys);
+
     // Native Audio Bus Master Registers
     struct NABMBufferDescriptor {
         uint32_t pAddr; // Physical addr of buffer
@@ -172,6 +183,13 @@ private:
     uint16_t* sampleBuffers[32];
     // Amount of samples per channel in each buffer
     int m_samplesPerBuffer;
+
+    // Ring that user space writes samples into, played with its own buffer descriptor list
+    FancyRefPtr<SampleRingVMObject> m_ring;
+    uintptr_t m_ringListPhys;
+    BufferDescriptor* m_ringList;
+    bool m_ringMode = false; // Whether PCM out is playing from the ring
+    uint64_t m_ringCommitted = 0; // Bytes committed since the ring was mapped
 };
 
 }
\ No newline at end of file
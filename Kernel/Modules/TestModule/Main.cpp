@@ -10,6 +10,11 @@ Test tests[TEST_COUNT]{
 	ThreadingTest,
 };
 
+#define BENCHMARK_COUNT 1
+Test benchmarks[BENCHMARK_COUNT]{
+	SchedulerBenchmark,
+};
+
 static int ModuleInit(){
 	Log::Info("Hello, Module World!");
 
@@ -20,6 +25,14 @@ static int ModuleInit(){
 		}
 	}
 
+	// Run benchmarks once the tests have passed so that the numbers can be compared between kernels
+	for(unsigned i = 0; i < BENCHMARK_COUNT; i++){
+		int ret = benchmarks[i]();
+		if(ret != 0){
+			Log::Info("[TestModule] Benchmark failed with code %d", ret);
+		}
+	}
+
 	return 0;
 }
 
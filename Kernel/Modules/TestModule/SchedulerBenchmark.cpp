@@ -0,0 +1,221 @@
+#include <Scheduler.h>
+
+#include <Lock.h>
+#include <Logging.h>
+#include <SMP.h>
+#include <Timer.h>
+
+// Numbers are printed in TSC cycles and nanoseconds so results from different machines
+// and different scheduler changes can be compared. Latencies measured across CPUs
+// assume the TSCs are synchronised (invariant TSC).
+
+#define BENCHMARK_YIELD_ITERATIONS 10000
+#define BENCHMARK_PINGPONG_ITERATIONS 5000
+#define BENCHMARK_SPAWN_COUNT 64
+
+static ALWAYS_INLINE uint64_t ReadTSC() {
+    uint32_t low, high;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+    return (static_cast<uint64_t>(high) << 32) | low;
+}
+
+static uint64_t tscPerUs = 1;
+
+static void CalibrateTSC() {
+    uint64_t start = Timer::UsecondsSinceBoot();
+    uint64_t tscStart = ReadTSC();
+
+    while (Timer::UsecondsSinceBoot() - start < 10000)
+        ; // Spin for 10ms
+
+    uint64_t tscEnd = ReadTSC();
+    uint64_t elapsed = Timer::UsecondsSinceBoot() - start;
+
+    tscPerUs = (tscEnd - tscStart) / elapsed;
+    if (!tscPerUs) {
+        tscPerUs = 1;
+    }
+}
+
+static ALWAYS_INLINE uint64_t CyclesToNs(uint64_t cycles) { return cycles * 1000 / tscPerUs; }
+
+static void WaitOn(Semaphore& sema) {
+    while (sema.Wait())
+        ; // Interrupted, keep waiting
+}
+
+// Move the calling thread onto the CPUs in mask
+static void PinCurrentThread(uint64_t mask) {
+    Scheduler::SetAffinity(Thread::Current(), mask);
+    while (!Scheduler::CPUAllowed(Thread::Current(), GetCPULocal())) {
+        Scheduler::Yield();
+    }
+}
+
+static void ExitBenchmarkThread() {
+    acquireLock(&Thread::Current()->kernelLock);
+    Process::Current()->Die();
+}
+
+// Started with the kernel process entry point, so state is passed through globals.
+// Only one benchmark runs at a time.
+static struct {
+    Semaphore ping = Semaphore(0);
+    Semaphore pong = Semaphore(0);
+    Semaphore exited = Semaphore(0);
+
+    volatile bool done = false;
+    volatile uint64_t wakeStamp = 0;
+
+    uint64_t wakeLatencyTotal = 0;
+    uint64_t wakeLatencyMax = 0;
+} benchmark;
+
+static void YieldPartner() {
+    while (!benchmark.done) {
+        Scheduler::Yield();
+    }
+
+    benchmark.exited.Signal();
+    ExitBenchmarkThread();
+}
+
+static void PingPongPartner() {
+    for (unsigned i = 0; i < BENCHMARK_PINGPONG_ITERATIONS; i++) {
+        WaitOn(benchmark.ping);
+
+        uint64_t latency = ReadTSC() - benchmark.wakeStamp;
+        benchmark.wakeLatencyTotal += latency;
+        if (latency > benchmark.wakeLatencyMax) {
+            benchmark.wakeLatencyMax = latency;
+        }
+
+        benchmark.pong.Signal();
+    }
+
+    benchmark.exited.Signal();
+    ExitBenchmarkThread();
+}
+
+static void SpawnedThread() {
+    benchmark.exited.Signal();
+    ExitBenchmarkThread();
+}
+
+static FancyRefPtr<Process> StartPinned(void* entry, const char* name, uint64_t mask) {
+    FancyRefPtr<Process> proc = Process::CreateKernelProcess(entry, name, nullptr);
+    proc->GetMainThread()->affinity = mask;
+    proc->Start();
+
+    return proc;
+}
+
+// Yield with nothing else to run, then with another thread on the same CPU
+// so that every yield is a switch to the partner and back
+static void BenchmarkYield() {
+    PinCurrentThread(1);
+
+    uint64_t start = ReadTSC();
+    for (unsigned i = 0; i < BENCHMARK_YIELD_ITERATIONS; i++) {
+        Scheduler::Yield();
+    }
+    uint64_t alone = (ReadTSC() - start) / BENCHMARK_YIELD_ITERATIONS;
+
+    benchmark.done = false;
+    FancyRefPtr<Process> partner = StartPinned((void*)YieldPartner, "bench_yield", 1);
+
+    start = ReadTSC();
+    for (unsigned i = 0; i < BENCHMARK_YIELD_ITERATIONS; i++) {
+        Scheduler::Yield();
+    }
+    uint64_t roundTrip = (ReadTSC() - start) / BENCHMARK_YIELD_ITERATIONS;
+
+    benchmark.done = true;
+    WaitOn(benchmark.exited);
+
+    Log::Info("[TestModule] [Benchmark] Yield (no partner): %lu cycles (%lu ns)", alone, CyclesToNs(alone));
+    Log::Info("[TestModule] [Benchmark] Yield round trip (2 switches): %lu cycles (%lu ns)", roundTrip,
+              CyclesToNs(roundTrip));
+}
+
+// Wake a thread on cpuMask and wait for it to wake us back,
+// this covers blocking, wakeup (and the IPI if remote) and two context switches
+static void BenchmarkPingPong(const char* name, uint64_t partnerMask) {
+    PinCurrentThread(1);
+
+    benchmark.wakeLatencyTotal = 0;
+    benchmark.wakeLatencyMax = 0;
+    FancyRefPtr<Process> partner = StartPinned((void*)PingPongPartner, "bench_pingpong", partnerMask);
+
+    uint64_t total = 0;
+    for (unsigned i = 0; i < BENCHMARK_PINGPONG_ITERATIONS; i++) {
+        uint64_t start = ReadTSC();
+        benchmark.wakeStamp = start;
+        benchmark.ping.Signal();
+
+        WaitOn(benchmark.pong);
+        total += ReadTSC() - start;
+    }
+
+    WaitOn(benchmark.exited);
+
+    uint64_t roundTrip = total / BENCHMARK_PINGPONG_ITERATIONS;
+    uint64_t wakeLatency = benchmark.wakeLatencyTotal / BENCHMARK_PINGPONG_ITERATIONS;
+    Log::Info("[TestModule] [Benchmark] Ping-pong (%s): round trip %lu cycles (%lu ns), wakeup to run avg %lu ns max "
+              "%lu ns",
+              name, roundTrip, CyclesToNs(roundTrip), CyclesToNs(wakeLatency), CyclesToNs(benchmark.wakeLatencyMax));
+}
+
+// Create and start threads that exit immediately, spread over the CPUs in mask
+static void BenchmarkSpawn(unsigned cpuCount) {
+    uint64_t mask = (cpuCount >= 64) ? ~0ULL : ((1ULL << cpuCount) - 1);
+    PinCurrentThread(mask);
+
+    uint64_t start = ReadTSC();
+    for (unsigned i = 0; i < BENCHMARK_SPAWN_COUNT; i++) {
+        StartPinned((void*)SpawnedThread, "bench_spawn", mask);
+    }
+
+    for (unsigned i = 0; i < BENCHMARK_SPAWN_COUNT; i++) {
+        WaitOn(benchmark.exited);
+    }
+    uint64_t elapsed = ReadTSC() - start;
+
+    uint64_t perThread = elapsed / BENCHMARK_SPAWN_COUNT;
+    uint64_t ns = CyclesToNs(perThread);
+    Log::Info("[TestModule] [Benchmark] Thread create/exit (%u CPUs): %lu cycles (%lu ns) per thread, %lu threads/s",
+              cpuCount, perThread, ns, ns ? 1000000000 / ns : 0);
+}
+
+int SchedulerBenchmark() {
+    Log::Info("[TestModule] Running Scheduler Benchmarks...");
+
+    CalibrateTSC();
+    Log::Info("[TestModule] [Benchmark] %u CPUs, TSC: %lu cycles/us", SMP::processorCount, tscPerUs);
+
+    uint64_t oldAffinity = Thread::Current()->affinity;
+
+    BenchmarkYield();
+
+    BenchmarkPingPong("same CPU", 1);
+    if (SMP::processorCount > 1) {
+        // Prefer a CPU that does not share a cache with CPU 0
+        unsigned remote = 1;
+        for (unsigned i = 1; i < SMP::processorCount && i < 64; i++) {
+            if (SMP::cpus[i]->cacheID != SMP::cpus[0]->cacheID) {
+                remote = i;
+                break;
+            }
+        }
+
+        BenchmarkPingPong("cross CPU", 1ULL << remote);
+    }
+
+    for (unsigned cpuCount = 1; cpuCount < SMP::processorCount; cpuCount *= 2) {
+        BenchmarkSpawn(cpuCount);
+    }
+    BenchmarkSpawn(SMP::processorCount);
+
+    PinCurrentThread(oldAffinity);
+    return 0;
+}
@@ -3,4 +3,6 @@
 using Test = int (*)();
 
 int StringTest();
-int ThreadingTest();
\ No newline at end of file
+int ThreadingTest();
+
+int SchedulerBenchmark();
\ No newline at end of file
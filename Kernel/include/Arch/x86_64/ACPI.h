@@ -51,6 +51,54 @@ typedef struct LocalAPICAddressOverride { // Local APIC Address Override - Type
   uint64_t address; // 64-bit Address of Local APIC
 } __attribute__ ((packed)) apic_local_address_override_t;
 
+typedef struct SRAT{
+  acpi_header_t header;
+  uint32_t reserved1; // Reserved, must be 1
+  uint64_t reserved2;
+} __attribute__ ((packed)) acpi_srat_t;
+
+typedef struct SRATEntry{
+  uint8_t type;
+  uint8_t length;
+} __attribute__ ((packed)) acpi_srat_entry_t;
+
+typedef struct SRATProcessorAffinity{ // Processor Local APIC Affinity - Type 0
+  acpi_srat_entry_t entry; // SRAT Entry Structure
+  uint8_t domainLow; // Bits 0-7 of the proximity domain
+  uint8_t apicID; // APIC ID
+  uint32_t flags; // Flags - (bit 0 = enabled)
+  uint8_t sapicEID; // Local SAPIC EID
+  uint8_t domainHigh[3]; // Bits 8-31 of the proximity domain
+  uint32_t clockDomain; // Clock Domain
+} __attribute__ ((packed)) srat_processor_affinity_t;
+
+typedef struct SRATMemoryAffinity{ // Memory Affinity - Type 1
+  acpi_srat_entry_t entry; // SRAT Entry Structure
+  uint32_t domain; // Proximity domain
+  uint16_t reserved1;
+  uint64_t base; // Base address of the memory range
+  uint64_t length; // Length of the memory range
+  uint32_t reserved2;
+  uint32_t flags; // Flags - (bit 0 = enabled, bit 1 = hot pluggable, bit 2 = non volatile)
+  uint64_t reserved3;
+} __attribute__ ((packed)) srat_memory_affinity_t;
+
+typedef struct SRATx2APICAffinity{ // Processor Local x2APIC Affinity - Type 2
+  acpi_srat_entry_t entry; // SRAT Entry Structure
+  uint16_t reserved1;
+  uint32_t domain; // Proximity domain
+  uint32_t x2apicID; // x2APIC ID
+  uint32_t flags; // Flags - (bit 0 = enabled)
+  uint32_t clockDomain; // Clock Domain
+  uint32_t reserved2;
+} __attribute__ ((packed)) srat_x2apic_affinity_t;
+
+typedef struct SLIT{
+  acpi_header_t header;
+  uint64_t localityCount; // Amount of system localities (proximity domains)
+  uint8_t distances[]; // localityCount * localityCount relative distances, 10 is local
+} __attribute__ ((packed)) acpi_slit_t;
+
 typedef struct PCIMCFGBaseAddress{
   uint64_t baseAddress; // Base address of configuration space
   uint16_t segmentGroupNumber; // PCI Segment group number
@@ -65,9 +113,30 @@ typedef struct PCIMCFG {
   PCIMCFGBaseAddress baseAddresses[];
 } __attribute__ ((packed)) pci_mcfg_table_t;
 
+#define NUMA_MAX_NODES 8
+#define NUMA_MAX_MEMORY_RANGES 32
+#define NUMA_LOCAL_DISTANCE 10 // SLIT distance of a node to itself
+#define NUMA_REMOTE_DISTANCE 20 // Assumed distance between nodes without a SLIT
+
+typedef struct NUMAMemoryRange{
+  uint64_t base;
+  uint64_t length;
+  unsigned node; // Node index, not the ACPI proximity domain
+} numa_memory_range_t;
+
 namespace ACPI{
   extern uint8_t processors[];
   extern int processorCount;
+
+  // NUMA topology from the SRAT and SLIT, a single node covering everything when there is no SRAT
+  extern unsigned numaNodeCount;
+  extern unsigned numaMemoryRangeCount;
+  extern numa_memory_range_t numaMemoryRanges[NUMA_MAX_MEMORY_RANGES];
+
+  // Gets the NUMA node index of the processor with APIC ID apicID
+  unsigned NUMANodeOfProcessor(uint32_t apicID);
+  // Gets the relative distance between two NUMA nodes, NUMA_LOCAL_DISTANCE when a == b
+  unsigned NUMADistance(unsigned a, unsigned b);
   
 	extern List<apic_iso_t*>* isos;
 
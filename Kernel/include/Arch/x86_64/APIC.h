@@ -30,6 +30,10 @@
 
 #define LOCAL_APIC_BASE 0xFFFFFFFFFF000
 
+#define LOCAL_APIC_LVT_MASKED (1 << 16)
+#define LOCAL_APIC_LVT_TIMER_PERIODIC (1 << 17)
+#define LOCAL_APIC_TIMER_DIVIDE_16 0x3
+
 #define ICR_VECTOR(x) (x & 0xFF)
 #define ICR_MESSAGE_TYPE_FIXED 0
 #define ICR_MESSAGE_TYPE_LOW_PRIORITY (1 << 8)
@@ -62,6 +66,28 @@ namespace APIC{
         void Enable();
 
         void SendIPI(uint8_t apicID, uint32_t dsh, uint32_t type, uint8_t vector);
+
+        /////////////////////////////
+        /// \brief Measure the Local APIC timer frequency against the system timer
+        ///
+        /// Must be called with interrupts enabled after the system timer has been initialized.
+        /////////////////////////////
+        void CalibrateTimer();
+
+        /////////////////////////////
+        /// \brief Whether the Local APIC timer can be used
+        /////////////////////////////
+        bool TimerAvailable();
+
+        /////////////////////////////
+        /// \brief Start the Local APIC timer of the executing CPU firing \a vector at \a frequency Hz
+        /////////////////////////////
+        void StartTimer(uint32_t frequency, uint8_t vector);
+
+        /////////////////////////////
+        /// \brief Stop (mask) the Local APIC timer of the executing CPU
+        /////////////////////////////
+        void StopTimer();
     }
 
     namespace IO{
@@ -1,13 +1,22 @@
 #pragma once
 
+#include <ABI/Process.h>
 #include <Compiler.h>
 #include <TSS.h>
+#include <TicketLock.h>
 #include <stdint.h>
 
 class Process;
 struct Thread;
+struct PageMap;
+struct SyscallCounter;
 template <typename T> class FastList;
 
+#define CPU_PAGE_CACHE_SIZE 64 // Free physical pages kept by each CPU
+#define CPU_PCID_COUNT 8       // Page maps each CPU keeps TLB entries for when PCIDs are supported
+#define CPU_SLAB_CLASS_COUNT 7 // kmalloc size classes with per-CPU caches (16 to 1024 bytes)
+#define CPU_SLAB_CACHE_SIZE 64 // Free objects of each size class kept by each CPU
+
 typedef struct {
     uint16_t limit;
     uint64_t base;
@@ -33,9 +42,57 @@ struct CPU {
 
     Thread* idleThread = nullptr;
     Process* idleProcess;
-    volatile int runQueueLock = 0;
-    FastList<Thread*>* runQueue;
-} __attribute__((packed));
+    TicketLock runQueueLock __attribute__((aligned(8)));
+    FastList<Thread*>* runQueues[SchedulingClassCount]; // One run queue per scheduling class
+    unsigned starvedPasses = 0; // Times a runnable lower class thread has been passed over
+
+    uint32_t cacheID = 0;           // ID of the last level cache used by this CPU
+    unsigned numaNode = 0;          // NUMA node of this CPU, physical memory is allocated from this node first
+    uint64_t migrations = 0;        // Amount of threads migrated onto this CPU
+    uint64_t cacheMigrations = 0;   // Migrations from a CPU not sharing our last level cache
+    uint64_t nodeMigrations = 0;    // Migrations from a CPU on another NUMA node
+
+    uint64_t contextSwitches = 0; // Amount of context switches on this CPU
+    uint64_t handoffs = 0;        // Switches made straight to a thread woken by IPC (see Thread::handoff)
+    uint64_t idleUs = 0;          // Time spent running the idle thread
+    uint64_t idleSince = 0;       // When the CPU last switched to the idle thread
+
+    // Thread whose FPU/SSE state is loaded, CR0.TS is clear whilst this is set
+    // so that any other thread using the FPU will raise #NM
+    Thread* fpuOwner __attribute__((aligned(8))) = nullptr;
+    uint64_t fpuRestores = 0; // Amount of times FPU state has been lazily restored
+
+    // Page map loaded in CR3, read by other CPUs to decide whether to send a TLB shootdown
+    PageMap* currentPageMap = nullptr;
+    // IDs of the page maps given PCIDs 1 to CPU_PCID_COUNT, see Memory::ActivatePageMap
+    uint64_t pcidPageMaps[CPU_PCID_COUNT] = {};
+    uint64_t kernelMappingGeneration = 0; // Generation of the kernel mappings when the PCIDs were last flushed
+    unsigned nextPCID = 0;
+
+    bool idle = true;          // Set when there is nothing to run, the CPU will only be woken by an IPI
+    bool timerRunning = false; // Whether the Local APIC timer is ticking for this CPU
+    bool migrationPending = false; // A thread no longer allowed on this CPU is queued to be moved off it
+    uint32_t perfEvents = 0;   // Events counted by the performance counters for the current thread, see PerfCounters.h
+
+    // Last RCU grace period this CPU has passed through a quiescent state in, read by other CPUs (see RCU.h)
+    uint64_t rcuSequence __attribute__((aligned(8))) = 0;
+
+    // Free physical pages so that most allocations and frees do not take the allocator lock,
+    // only used by this CPU with interrupts disabled. The lock is only contended
+    // when another CPU is out of memory and takes the cached pages back (see StealPageCaches)
+    TicketLock pageCacheLock;
+    unsigned pageCacheCount = 0;
+    uint64_t pageCache[CPU_PAGE_CACHE_SIZE]; // Block indices
+
+    // Free kmalloc objects of each size class, linked through their first word.
+    // Only used by this CPU with interrupts disabled
+    void* slabCaches[CPU_SLAB_CLASS_COUNT] = {};
+    unsigned slabCacheCounts[CPU_SLAB_CLASS_COUNT] = {};
+
+    // Calls and cycles spent in each syscall on this CPU, allocated by InitializeSyscallStatistics.
+    // Only updated by this CPU with interrupts disabled
+    SyscallCounter* syscallCounters = nullptr;
+}; // Not packed, the offsets used by assembly (CPU_LOCAL_*) are checked below
 
 #define CPU_LOCAL_SELF 0x0
 #define CPU_LOCAL_ID 0x8
@@ -44,9 +101,16 @@ struct CPU {
 #define CPU_LOCAL_TSS 0x20
 #define CPU_LOCAL_TSS_RSP0 (CPU_LOCAL_TSS + 0x4)
 
+static_assert(offsetof(CPU, self) == CPU_LOCAL_SELF);
+static_assert(offsetof(CPU, id) == CPU_LOCAL_ID);
+static_assert(offsetof(CPU, scratch) == CPU_LOCAL_SCRATCH);
 static_assert(offsetof(CPU, tss) == CPU_LOCAL_TSS);
 static_assert(offsetof(CPU, tss) + offsetof(tss_t, rsp0) == CPU_LOCAL_TSS_RSP0);
 static_assert(offsetof(CPU, currentThread) == CPU_LOCAL_THREAD);
+static_assert(offsetof(CPU, runQueueLock) % 8 == 0); // Accessed atomically by other CPUs
+static_assert(offsetof(CPU, fpuOwner) % 8 == 0);
+static_assert(offsetof(CPU, currentPageMap) % 8 == 0);
+static_assert(offsetof(CPU, rcuSequence) % 8 == 0);
 
 enum {
     CPUID_ECX_SSE3 = 1 << 0,
@@ -162,7 +226,41 @@ ALWAYS_INLINE static bool CheckInterrupts() {
     return (flags & 0x200) != 0;
 }
 
+ALWAYS_INLINE static uint64_t ReadTimestampCounter() {
+    uint32_t low, high;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+    return (static_cast<uint64_t>(high) << 32) | low;
+}
+
+// Hardware performance monitoring of the executing CPU
+typedef struct {
+    bool isAMD;
+    uint8_t version;  // Intel architectural performance monitoring version, 0 if unsupported
+    uint8_t counters; // General purpose counters, 0 if unsupported
+    uint8_t counterWidth;
+    bool amdCoreExtension;      // AMD counters are at the core performance extension MSRs
+    uint32_t unavailableEvents; // Intel architectural events that are not available (EBX of leaf 0xA)
+} cpuid_pmu_info_t;
+
 cpuid_info_t CPUID();
+// Get an ID for the last level cache of the executing CPU,
+// CPUs with the same ID share their last level cache
+uint32_t CPUIDLastLevelCacheID();
+cpuid_pmu_info_t CPUIDPerformanceMonitoring();
+// Whether the TSC runs at a constant rate regardless of power states
+bool CPUIDInvariantTSC();
+// Whether rep movsb is enhanced (ERMS), fastShort is set if it is also fast for short copies (FSRM)
+bool CPUIDFastStrings(bool& fastShort);
+
+static ALWAYS_INLINE uint64_t ReadMSR(uint32_t msr) {
+    uint32_t low, high;
+    asm volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+    return (static_cast<uint64_t>(high) << 32) | low;
+}
+
+static ALWAYS_INLINE void WriteMSR(uint32_t msr, uint64_t value) {
+    asm volatile("wrmsr" ::"a"(value & 0xFFFFFFFF), "d"(value >> 32), "c"(msr));
+}
 
 ALWAYS_INLINE uintptr_t GetRBP() {
     volatile uintptr_t val;
@@ -186,28 +284,38 @@ static ALWAYS_INLINE void SetCPULocal(CPU* val) {
                  "d"(((uintptr_t)val >> 32) & 0xFFFFFFFF) /*Value high*/, "c"(0xC0000101) /*Set Kernel GS Base*/);
 }
 
+// The kernel GS base is loaded whilst in the kernel, swapgs is done on every entry from and exit to usermode.
+// Reading the pointer is a single instruction so there is no need to disable interrupts
 static ALWAYS_INLINE CPU* GetCPULocal() {
     CPU* ret;
-    int intEnable = CheckInterrupts();
-    asm("cli");
-    asm volatile("swapgs; movq %%gs:0, %0; swapgs;"
-                 : "=r"(ret)); // CPU info is 16-byte aligned as per liballoc alignment
-    if (intEnable)
-        asm("sti");
+    asm volatile("movq %%gs:0, %0" : "=r"(ret));
     return ret;
 }
 
 static ALWAYS_INLINE Thread* GetCurrentThread() {
     Thread* ret;
-    int intEnable = CheckInterrupts();
-    asm("cli");
-    asm volatile("swapgs; movq %%gs:16, %0; swapgs;"
-                 : "=r"(ret)); // CPU info is 16-byte aligned as per liballoc alignment
-    if (intEnable)
-        asm("sti");
+    asm volatile("movq %%gs:16, %0" : "=r"(ret));
     return ret;
 }
 
+// Any FPU/SSE instruction will raise #NM whilst CR0.TS is set
+static ALWAYS_INLINE void SetCR0TS() {
+    uintptr_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile("mov %0, %%cr0" ::"r"(cr0 | (1 << 3)));
+}
+
+static ALWAYS_INLINE void ClearCR0TS() {
+    asm volatile("clts");
+}
+
+// Allow rdpmc outside of ring 0
+static ALWAYS_INLINE void SetCR4PCE() {
+    uintptr_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    asm volatile("mov %0, %%cr4" ::"r"(cr4 | (1 << 8)));
+}
+
 static ALWAYS_INLINE void DisableInterrupts() {
     asm volatile("cli");
 }
@@ -225,6 +333,8 @@ public:
         }
     }
 
+    ALWAYS_INLINE bool InterruptsWereEnabled() const { return m_intsWereEnabled; }
+
 private:
     bool m_intsWereEnabled = false;
 };
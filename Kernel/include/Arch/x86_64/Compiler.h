@@ -2,6 +2,8 @@
 
 #define ALWAYS_INLINE __attribute__(( always_inline )) inline
 
+#define CACHE_LINE_SIZE 64
+
 #include <stddef.h>
 ALWAYS_INLINE void* operator new(size_t, void* p){
 	return p;
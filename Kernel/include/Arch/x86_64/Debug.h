@@ -42,4 +42,8 @@ extern const int debugLevelUsermodeMM;
 extern const int debugLevelNetwork;
 
 #define REFPTR_ASSERTIONS
-//#define REFPTR_DEBUG
\ No newline at end of file
+//#define REFPTR_DEBUG
+
+// Record where every kmalloc allocation is made from, readable from /dev/kheapprof.
+// Adds a 16 byte header to every allocation.
+//#define KERNEL_HEAP_PROFILE
\ No newline at end of file
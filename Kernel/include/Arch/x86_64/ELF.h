@@ -2,6 +2,8 @@
 
 #include <stdint.h>
 
+#include <RefPtr.h>
+
 typedef struct ELF64Header {
 	unsigned char id[16];
 	uint16_t type;
@@ -178,6 +180,11 @@ using ELFRelocation = ELF64Relocation;
 using ELFRelocationA = ELF64RelocationA;
 
 class Process;
+class UNIXOpenFile;
 
 int VerifyELF(void* elf);
-elf_info_t LoadELFSegments(Process* proc, void* elf, uintptr_t base);
\ No newline at end of file
+// Reads and verifies the ELF header of a file
+int VerifyELF(const FancyRefPtr<UNIXOpenFile>& file);
+elf_info_t LoadELFSegments(Process* proc, void* elf, uintptr_t base);
+// Maps the segments of an ELF file from the page cache, only the headers are read whilst loading
+elf_info_t LoadELFSegments(Process* proc, const FancyRefPtr<UNIXOpenFile>& file, uintptr_t base);
\ No newline at end of file
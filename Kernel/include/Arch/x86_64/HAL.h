@@ -12,6 +12,7 @@ namespace HAL{
     extern bool disableSMP;
     extern bool useKCon;
     extern bool runTests;
+    extern uint64_t isolatedCPUs; // CPUs kept out of the general scheduling pool (isolcpus=)
 
     void InitCore();
 
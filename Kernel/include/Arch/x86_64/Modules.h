@@ -42,11 +42,12 @@ namespace ModuleManager {
     int UnloadModule(const char* name);
     void UnloadModule(Module* module);
 
-    int LoadModuleSegments(Module* module, FsNode* file, elf64_header_t& header);
+    // Load a module from its whole ELF image, which is only needed whilst loading
+    int LoadModuleSegments(Module* module, const uint8_t* image, size_t imageSize);
 }
 
 class Module {
-    friend int ModuleManager::LoadModuleSegments(Module* module, FsNode* file, elf64_header_t& header);
+    friend int ModuleManager::LoadModuleSegments(Module* module, const uint8_t* image, size_t imageSize);
     friend void ModuleManager::UnloadModule(Module* module);
 
 public:
@@ -75,6 +75,14 @@
 #define PCI_CAP_MSI_CONTROL_MMC(x) ((x >> 1) & 0x7) // Multiple Message Capable
 #define PCI_CAP_MSI_CONTROL_ENABLE (1 << 0) // MSI Enable
 
+#define PCI_CAP_MSIX_CONTROL_TABLE_SIZE(x) (((x) & 0x7FF) + 1) // Table size is encoded as N - 1
+#define PCI_CAP_MSIX_CONTROL_FUNCTION_MASK (1 << 14) // Mask all vectors
+#define PCI_CAP_MSIX_CONTROL_ENABLE (1 << 15) // MSI-X Enable
+#define PCI_CAP_MSIX_BIR(x) ((x) & 0x7) // BAR containing the table
+#define PCI_CAP_MSIX_OFFSET(x) ((x) & ~0x7U) // Offset of the table in the BAR
+
+#define PCI_MSIX_VECTOR_MASKED (1 << 0)
+
 enum PCIConfigRegisters{
 	PCIDeviceID = 0x2,
 	PCIVendorID = 0x0,
@@ -107,13 +115,15 @@ enum PCIConfigRegisters{
 
 enum PCICapabilityIDs{
 	PCICapMSI = 0x5,
+	PCICapMSIX = 0x11,
 };
 
 enum PCIVectors{
 	PCIVectorLegacy = 0x1, // Legacy IRQ
 	PCIVectorAPIC = 0x2, // I/O APIC
 	PCIVectorMSI = 0x4, // Message Signaled Interrupt
-	PCIVectorAny = 0x7, // (PCIVectorLegacy | PCIVectorAPIC | PCIVectorMSI)
+	PCIVectorMSIX = 0x8, // MSI-X, uses the first table entry
+	PCIVectorAny = 0xF, // (PCIVectorLegacy | PCIVectorAPIC | PCIVectorMSI | PCIVectorMSIX)
 };
 
 struct PCIMSICapability{
@@ -164,6 +174,33 @@ struct PCIMSICapability{
 	}
 } __attribute__((packed));
 
+struct PCIMSIXCapability{
+	union{
+		struct{
+			uint32_t capID : 8; // Should be PCICapMSIX
+			uint32_t nextCap : 8; // Next Capability
+			uint32_t msixControl : 16; // MSI-X control register
+		} __attribute__((packed));
+		uint32_t register0;
+	};
+	union{
+		uint32_t tableOffset; // BAR indicator and offset of the vector table
+		uint32_t register1;
+	};
+	union{
+		uint32_t pbaOffset; // BAR indicator and offset of the pending bit array
+		uint32_t register2;
+	};
+} __attribute__((packed));
+
+struct PCIMSIXTableEntry{
+	uint32_t addressLow; // Message Address Low
+	uint32_t addressHigh; // Message Address High
+	uint32_t data; // Message Data
+	uint32_t vectorControl; // Bit 0 masks the vector
+} __attribute__((packed));
+static_assert(sizeof(PCIMSIXTableEntry) == 16);
+
 struct PCIInfo{
 	uint16_t deviceID;
 	uint16_t vendorID;
@@ -186,6 +223,7 @@ namespace PCI{
 	uint16_t ReadWord(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
 
 	uint32_t ConfigReadDword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
+	void ConfigWriteDword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t data);
 
 	uint16_t ConfigReadWord(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
 	void ConfigWriteWord(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint16_t data);
@@ -203,6 +241,15 @@ namespace PCI{
 	void EnumeratePCIDevices(uint16_t deviceID, uint16_t vendorID, void(*func)(const PCIInfo&));
 	void EnumerateGenericPCIDevices(uint8_t classCode, uint8_t subclass, void(*func)(const PCIInfo&));
 
+	/////////////////////////////
+	/// \brief Pick the CPU the next message signaled interrupt is sent to
+	///
+	/// CPUs are handed out in turn so device interrupts are spread across all of them.
+	///
+	/// \return APIC ID of the CPU
+	/////////////////////////////
+	unsigned NextInterruptCPU();
+
 	void Init();
 }
 
@@ -216,7 +263,7 @@ public:
 
 		uintptr_t bar = PCI::ConfigReadDword(bus, slot, func, PCIBAR0 + (idx * sizeof(uint32_t)));
 		if(!(bar & 0x1) /* Not IO */ && bar & 0x4 /* 64-bit */ && idx < 5){
-			bar |= static_cast<uintptr_t>(PCI::ConfigReadDword(bus, slot, func, PCIBAR0 + ((bar + 1) * sizeof(uint32_t)))) << 32;
+			bar |= static_cast<uintptr_t>(PCI::ConfigReadDword(bus, slot, func, PCIBAR0 + ((idx + 1) * sizeof(uint32_t)))) << 32;
 		}
 
 		return (bar & 0x1) ? (bar & 0xFFFFFFFFFFFFFFFC) : (bar & 0xFFFFFFFFFFFFFFF0);
@@ -247,7 +294,33 @@ public:
 	inline uint16_t DeviceID() { return deviceID; }
 	inline uint16_t VendorID() { return vendorID; }
 
+	inline bool MSICapable() { return msiCapable; }
+	inline bool MSIXCapable() { return msixCapable; }
+	inline unsigned MSIXVectorCount() { return msixCapable ? PCI_CAP_MSIX_CONTROL_TABLE_SIZE(msixCap.msixControl) : 0; }
+
+	/////////////////////////////
+	/// \brief Allocate an interrupt for the device
+	///
+	/// MSI-X is preferred over MSI, which is preferred over the legacy interrupt pin.
+	/// Message signaled interrupts are sent to the CPU given by PCI::NextInterruptCPU.
+	///
+	/// \param type Acceptable interrupt types
+	///
+	/// \return Interrupt vector, 0xFF on failure
+	/////////////////////////////
 	uint8_t AllocateVector(PCIVectors type);
+
+	/////////////////////////////
+	/// \brief Allocate an interrupt for an MSI-X table entry
+	///
+	/// MSI-X is enabled on first use, entries which have not been allocated stay masked.
+	///
+	/// \param entry Index into the MSI-X table
+	/// \param cpu APIC ID of the CPU to send the interrupt to
+	///
+	/// \return Interrupt vector, 0xFF on failure
+	/////////////////////////////
+	uint8_t AllocateMSIXVector(unsigned entry, unsigned cpu);
 private:
 	uint16_t deviceID = 0xffff;
 	uint16_t vendorID = 0xffff;
@@ -265,4 +338,9 @@ private:
 	uint8_t msiPtr;
 	PCIMSICapability msiCap;
 	bool msiCapable = false;
+
+	uint8_t msixPtr;
+	PCIMSIXCapability msixCap;
+	bool msixCapable = false;
+	volatile PCIMSIXTableEntry* msixTable = nullptr; // Mapped on first use
 };
\ No newline at end of file
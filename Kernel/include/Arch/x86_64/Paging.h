@@ -5,6 +5,8 @@
 
 #define KERNEL_VIRTUAL_BASE 0xFFFFFFFF80000000ULL
 #define IO_VIRTUAL_BASE (KERNEL_VIRTUAL_BASE - 0x100000000ULL) // KERNEL_VIRTUAL_BASE - 4GB
+#define USER_ADDRESS_LIMIT 0x800000000000ULL // End of the lower half, usermode memory lies below it
+#define KERNEL_HEAP_VIRTUAL_BASE 0xFFFFFFFFC0000000ULL // Last 1GB, memory from KernelAllocate4KPages
 
 #define PML4_GET_INDEX(addr) (((addr) >> 39) & 0x1FF)
 #define PDPT_GET_INDEX(addr) (((addr) >> 30) & 0x1FF)
@@ -34,11 +36,21 @@
 #define PAGE_USER (1 << 2)
 #define PAGE_WRITETHROUGH (1 << 3)
 #define PAGE_CACHE_DISABLED (1 << 4)
+#define PAGE_ACCESSED (1 << 5)       // Set by the CPU when the page (or 2MB page) is accessed
 #define PAGE_FRAME 0xFFFFFFFFFF000ULL
 #define PAGE_PAT (1 << 7)
-#define PAGE_PAT_WRITE_COMBINING                                                                                       \
-    (PAGE_PAT | PAGE_CACHE_DISABLED |                                                                                  \
-     PAGE_WRITETHROUGH) // We set PA7 to write combining, PAGE_PAT is the high bit of the PAT index
+#define PAGE_SHARED (1 << 9)         // Available to software, page belongs to a shared mapping
+#define PAGE_COPY_ON_WRITE (1 << 10) // Available to software, page is shared copy on write
+
+// Memory types, selecting an entry of the PAT programmed by InitializePAT.
+// PAGE_PAT, PAGE_CACHE_DISABLED and PAGE_WRITETHROUGH form the index (high to low bit).
+// Entries 0-3 are left as the power on defaults so PCD/PWT mean the same with or without PAT support.
+#define PAGE_MEMORY_WB 0                                         // Write back, normal memory
+#define PAGE_MEMORY_WT (PAGE_WRITETHROUGH)                       // Write through
+#define PAGE_MEMORY_UC_MINUS (PAGE_CACHE_DISABLED)               // Uncached, can be overridden by MTRRs
+#define PAGE_MEMORY_UC (PAGE_CACHE_DISABLED | PAGE_WRITETHROUGH) // Uncached, for MMIO registers
+#define PAGE_MEMORY_WC (PAGE_PAT | PAGE_CACHE_DISABLED | PAGE_WRITETHROUGH) // Write combining, for framebuffers
+#define PAGE_MEMORY_TYPE_MASK (PAGE_PAT | PAGE_CACHE_DISABLED | PAGE_WRITETHROUGH)
 
 #define PAGE_SIZE_4K 4096U
 #define PAGE_SIZE_2M 0x200000U
@@ -55,6 +67,12 @@
 #define PAGE_SHIFT_4K 12
 #define PAGE_COUNT_4K(size) (((size) + (PAGE_SIZE_4K - 1)) >> 12)
 
+#define CR3_PCID_MASK 0xFFFULL
+#define CR3_NO_FLUSH (1ULL << 63) // Keep TLB entries tagged with the PCID being loaded
+#define CR4_PCIDE (1 << 17)
+
+#define TLB_FLUSH_ALL_PAGES 64 // Invalidations larger than this flush every entry of the address space instead
+
 typedef uint64_t page_t;
 typedef uint64_t pd_entry_t;
 typedef uint64_t pdpt_entry_t;
@@ -77,6 +95,15 @@ typedef struct PageMap { // Each process will have a maximum of 96GB of virtual
     pml4_entry_t* pml4;
     uint64_t pdptPhys;
     uint64_t pml4Phys;
+
+    uint64_t id;                  // Unique ID, used to tell which page map a CPU's PCIDs belong to
+    volatile uint64_t activeCPUs; // CPUs that have loaded the page map and may have TLB entries for it
+    volatile uint64_t staleCPUs;  // CPUs that must flush their TLB entries for the page map before using it again
+
+    // Counts of present usermode pages, kept up to date on map and unmap
+    volatile uint64_t residentPages;
+    volatile uint64_t sharedPages; // Mapped with PAGE_SHARED
+    volatile uint64_t cowPages;    // Mapped with PAGE_COPY_ON_WRITE
 } __attribute__((packed)) page_map_t;
 
 // Allows handling of page faults without kernel panic
@@ -145,6 +172,20 @@ void MapVirtualMemory4K(uint64_t phys, uint64_t virt, uint64_t amount, PageMap*
 /////////////////////////////
 void MapVirtualMemory4K(uint64_t phys, uint64_t virt, uint64_t amount, uint64_t flags, PageMap* pageMap);
 
+/////////////////////////////
+/// \brief Map 2MB Pages
+///
+/// Any page table previously covering the mapping is freed,
+/// 4KB mappings made later inside a 2MB page will split it back into a page table.
+///
+/// \param phys Physical address to map to, must be 2MB aligned
+/// \param virt Virtual address of the mapping, must be 2MB aligned
+/// \param amount Amount of 2MB pages to map
+/// \param flags Page Flags
+/// \param pageMap PageMap to map pages
+/////////////////////////////
+void MapVirtualMemory2M(uint64_t phys, uint64_t virt, uint64_t amount, uint64_t flags, PageMap* pageMap);
+
 uintptr_t GetIOMapping(uintptr_t addr);
 
 bool CheckKernelPointer(uintptr_t addr, uint64_t len);
@@ -152,8 +193,94 @@ bool CheckUsermodePointer(uintptr_t addr, uint64_t len, AddressSpace* addressSpa
 uint64_t VirtualToPhysicalAddress(uint64_t addr);
 uint64_t VirtualToPhysicalAddress(uint64_t addr, page_map_t* addressSpace);
 
+/////////////////////////////
+/// \brief Test and clear the accessed bit of a usermode page
+///
+/// The TLB is not flushed, so an access through a cached translation may not set the bit again.
+/// This is good enough to tell which pages are in use.
+///
+/// \param large Set to whether the page is part of a 2MB page, where one bit covers the whole 2MB
+///
+/// \return 1 if the page has been accessed since the bit was cleared, 0 if not and -1 if it is not present
+/////////////////////////////
+int TestAndClearAccessed(uintptr_t virt, PageMap* pageMap, bool& large);
+
 void SwitchPageDirectory(uint64_t phys);
 
+/////////////////////////////
+/// \brief Initialize TLB features (PCIDs) for the executing CPU
+/////////////////////////////
+void InitializeTLB();
+
+/////////////////////////////
+/// \brief Program the PAT of the executing CPU for the PAGE_MEMORY_* types
+///
+/// Every CPU must use the same PAT, called by each CPU before it touches memory mapped write combining.
+/////////////////////////////
+void InitializePAT();
+
+/////////////////////////////
+/// \brief Mark a page map as loaded on the executing CPU
+///
+/// Interrupts must be disabled until the returned value is loaded into CR3.
+/// When PCIDs are supported, TLB entries from the last time the page map was loaded
+/// on this CPU are kept unless they have since gone stale.
+///
+/// \param pageMap Page map about to be loaded
+///
+/// \return Value to load into CR3
+/////////////////////////////
+uint64_t ActivatePageMap(PageMap* pageMap);
+
+/////////////////////////////
+/// \brief Load a page map on the executing CPU
+///
+/// Interrupts must be disabled if the thread is going to switch back to its own page map.
+/////////////////////////////
+inline void SwitchPageMap(PageMap* pageMap) {
+    asm volatile("mov %0, %%cr3" ::"r"(ActivatePageMap(pageMap)) : "memory");
+}
+
+/////////////////////////////
+/// \brief Invalidate TLB entries for a page map on every CPU
+///
+/// Called after present entries have been changed or removed.
+/// Only CPUs currently running the page map are sent an IPI,
+/// others are marked to flush their entries when they next load it.
+///
+/// \param pageMap Page map that was changed
+/// \param base Virtual address of the first changed page
+/// \param pages Amount of 4KB pages changed
+/////////////////////////////
+void InvalidatePages(PageMap* pageMap, uintptr_t base, uint64_t pages);
+
+/////////////////////////////
+/// \brief Batch TLB invalidations
+///
+/// Whilst a batch is open, invalidations of its page map made by the owning thread
+/// are merged and sent to other CPUs at once when the batch is flushed or destroyed,
+/// rather than an IPI being sent for every change.
+/// Until the batch is flushed any CPU, including this one, may still use the old mappings,
+/// so it must be flushed before the old physical pages are freed.
+/////////////////////////////
+class TLBShootdownBatch final {
+public:
+    TLBShootdownBatch(PageMap* pageMap);
+    ~TLBShootdownBatch();
+
+    void Add(uintptr_t base, uint64_t pages);
+    void Flush();
+
+    inline PageMap* GetPageMap() const { return m_pageMap; }
+
+private:
+    PageMap* m_pageMap;
+    struct Thread* m_thread;
+
+    uintptr_t m_start = 0;
+    uintptr_t m_end = 0;
+};
+
 void RegisterPageFaultTrap(PageFaultTrap trap);
 void PageFaultHandler(void*, RegisterContext* regs);
 
@@ -161,6 +288,9 @@ inline void SetPageFrame(uint64_t* page, uint64_t addr) { *page = (*page & ~PAGE
 
 inline void SetPageFlags(uint64_t* page, uint64_t flags) { *page |= flags; }
 
+// Page flags for a 2MB PDE, where the PAT bit is bit 12 as bit 7 is the page size
+inline uint64_t PageFlagsToPDE(uint64_t flags) { return (flags & PAGE_PAT) ? ((flags & ~PAGE_PAT) | PDE_PAT) : flags; }
+
 inline uint32_t GetPageFrame(uint64_t p) { return (p & PAGE_FRAME) >> 12; }
 
 inline void invlpg(uintptr_t addr) { asm volatile("invlpg (%0)" ::"r"(addr)); }
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <Compiler.h>
+#include <Thread.h>
+
+#include <ABI/PerfCounters.h>
+
+// Counts of a thread using the performance counters
+struct PerfCounterState {
+    uint32_t events = 0;   // Events being counted
+    bool running = false;  // Counting whenever the thread is running
+    uint64_t counts[PerfEventCount] = {}; // Counts up to when the thread was last switched out or stopped
+};
+
+/////////////////////////////
+/// \brief Per thread hardware performance counters
+///
+/// Each event is given the general purpose counter of the same index,
+/// counters are only programmed whilst a thread that started counting is running.
+/// When the counters can be written in full they are restored on switch,
+/// so rdpmc in user space reads the count of the calling thread.
+/////////////////////////////
+namespace PerfCounters {
+
+// Detect the counters and allow rdpmc on the executing CPU
+void InitializeCPU();
+
+// Save the counts of previous and load those of next,
+// called by the scheduler with interrupts disabled
+void SwitchThreads(CPU* cpu, Thread* previous, Thread* next);
+
+ALWAYS_INLINE static void Switch(CPU* cpu, Thread* previous, Thread* next) {
+    if (__builtin_expect(cpu->perfEvents || next->perfCounters, 0)) {
+        SwitchThreads(cpu, previous, next);
+    }
+}
+
+// Start counting events (a mask of PERF_EVENT_BIT) for the calling thread, resetting the counts.
+// Returns the events that will be counted, events not supported by the CPU are left out
+uint32_t Start(uint32_t events, lemon_perf_counters_t& info);
+// Stop counting for the calling thread, the counts are kept
+void Stop();
+// Get the counts of the calling thread, events that are not counted are 0
+void Read(uint64_t counts[PerfEventCount]);
+
+} // namespace PerfCounters
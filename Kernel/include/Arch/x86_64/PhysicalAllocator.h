@@ -14,6 +14,14 @@
 // The size of the memory bitmap in dwords
 #define PHYSALLOC_BITMAP_SIZE_DWORDS 524488 // 64GB
 
+// Largest contiguous allocation is 2^PHYSALLOC_MAX_ORDER blocks
+#define PHYSALLOC_MAX_ORDER 10 // 4MB
+#define PHYSALLOC_LARGE_BLOCK_ORDER 9 // 2MB
+
+// Idle CPUs keep up to PHYSALLOC_ZEROED_POOL_SIZE pages zeroed, zeroing PHYSALLOC_ZERO_BATCH at a time
+#define PHYSALLOC_ZEROED_POOL_SIZE 512 // 2MB
+#define PHYSALLOC_ZERO_BATCH 16
+
 extern void* kernel_end;
 
 namespace Memory {
@@ -21,6 +29,9 @@ namespace Memory {
 // Initialize the physical page allocator
 void InitializePhysicalAllocator(memory_info_t* mem_info);
 
+// Split physical memory into NUMA nodes so CPUs allocate memory from their own node, ACPI must be initialized
+void InitializeNUMA();
+
 // Finds the first free block in physical memory
 uint64_t GetFirstFreeMemoryBlock();
 
@@ -33,13 +44,69 @@ void MarkMemoryRegionFree(uint64_t base, size_t size);
 // Allocates a block of physical memory
 uint64_t AllocatePhysicalMemoryBlock();
 
+// Allocates 2^order physically contiguous blocks, aligned to their size
+// Returns 0 if there is no contiguous run large enough
+uint64_t AllocatePhysicalMemoryBlocks(unsigned order);
+
 // Allocates a 2MB block of physical memory
 uint64_t AllocateLargePhysicalMemoryBlock();
 
+// Takes a block of physical memory that has already been zeroed
+// Returns 0 if there are no zeroed blocks, the caller should allocate and zero a block itself
+uint64_t AllocateZeroedPhysicalMemoryBlock();
+
 // Frees a block of physical memory
 void FreePhysicalMemoryBlock(uint64_t addr);
 
+// Frees 2^order physically contiguous blocks
+// The blocks may also be freed one at a time with FreePhysicalMemoryBlock
+void FreePhysicalMemoryBlocks(uint64_t addr, unsigned order);
+
+// Frees a 2MB block of physical memory
+void FreeLargePhysicalMemoryBlock(uint64_t addr);
+
+// Start filling the pool of zeroed blocks, the reclaimer must be initialized
+void InitializeZeroedPool();
+
+/////////////////////////////
+/// \brief Zero a batch of free blocks for the zeroed pool
+///
+/// Called by idle threads with interrupts enabled.
+///
+/// \param window PHYSALLOC_ZERO_BATCH pages of kernel virtual memory used to map the blocks
+///
+/// \return false if the pool is full or memory is low, otherwise true
+/////////////////////////////
+bool ZeroFreeBlocks(void* window);
+
+// Gets the smallest order that will fit size bytes
+inline unsigned PhysicalAllocationOrder(size_t size) {
+    unsigned order = 0;
+    while ((static_cast<size_t>(PHYSALLOC_BLOCK_SIZE) << order) < size) {
+        order++;
+    }
+
+    return order;
+}
+
 // Used Blocks of Memory
 extern uint64_t usedPhysicalBlocks;
 extern uint64_t maxPhysicalBlocks;
+
+// What physical memory is being used for, each user of memory accounts for its own allocations
+enum MemoryUsage {
+    MemoryUsageKernelHeap,  // Mapped into the kernel heap by kmalloc
+    MemoryUsagePageCache,   // Pages of mapped files and of files in tmpfs
+    MemoryUsageBlockCache,  // Disk contents cached by the BlockCache
+    MemoryUsageAnonymous,   // Process memory not backed by a file
+    MemoryUsageSwapPool,    // Compressed pages of swapped out memory
+    MemoryUsageCount,
+};
+
+// Bytes of memory used for each MemoryUsage
+extern int64_t memoryUsage[MemoryUsageCount];
+
+inline void AccountMemory(MemoryUsage usage, int64_t bytes) {
+    __atomic_add_fetch(&memoryUsage[usage], bytes, __ATOMIC_RELAXED);
+}
 } // namespace Memory
\ No newline at end of file
@@ -6,6 +6,11 @@ namespace SMP{
     extern CPU* cpus[];
     extern unsigned processorCount;
 
+    // Mask of online CPUs (bit n for CPU n), CPUs past 63 are not represented
+    inline uint64_t OnlineCPUMask(){
+        return (processorCount >= 64) ? ~0ULL : ((1ULL << processorCount) - 1);
+    }
+
     void InitializeCPU(uint16_t id);
     void InitializeCPU0Context();
     void Initialize();
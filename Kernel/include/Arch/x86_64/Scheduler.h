@@ -26,13 +26,28 @@ class ProcessStateThreadBlocker;
 }
 
 namespace Scheduler {
-extern lock_t processesLock;
+extern ReadWriteLock processesLock;
 extern lock_t destroyedProcessesLock;
 extern List<FancyRefPtr<Process>>* destroyedProcesses;
 
+struct ReaperStatistics {
+    uint64_t queued = 0;     // Processes queued for destruction
+    uint64_t reaped = 0;     // Processes torn down by the reaper
+    uint64_t deferred = 0;   // Times a process was put back as it was still locked
+    uint64_t batches = 0;    // Amount of times the reaper has emptied the queue
+    unsigned backlog = 0;    // Processes currently waiting to be reaped
+    unsigned maxBacklog = 0; // Longest the queue has been
+    uint64_t lastBatchUs = 0; // Time taken to tear down the last batch
+};
+
 void RegisterProcess(FancyRefPtr<Process> proc);
 void MarkProcessForDestruction(Process* proc);
 
+/////////////////////////////
+/// \brief Get statistics about destroyed process reaping
+/////////////////////////////
+const ReaperStatistics& GetReaperStatistics();
+
 ALWAYS_INLINE static Process* GetCurrentProcess() {
     return Thread::Current()->parent;
 }
@@ -46,12 +61,87 @@ ALWAYS_INLINE bool CheckUsermodePointer(T* ptr, AddressSpace* addressSpace = Get
 void Yield();
 void Schedule(void* data, RegisterContext* r);
 void DoSwitch(CPU* cpu);
+// Write back the FPU state of the previous owner before switching, the run queue lock of cpu must be held
+void ReleaseFPU(CPU* cpu);
 
 pid_t GetNextPID();
 FancyRefPtr<Process> FindProcessByPID(pid_t pid);
 pid_t GetNextProcessPID(pid_t pid);
+// Find the process with the lowest PID greater than pid without waiting for the process list,
+// returns nullptr if there is none or the list is being changed
+FancyRefPtr<Process> TryFindNextProcess(pid_t pid);
 void InsertNewThreadIntoQueue(Thread* thread);
-void BalanceRunQueues();
+
+/////////////////////////////
+/// \brief Get the total amount of threads in all of a CPU's run queues
+/////////////////////////////
+ALWAYS_INLINE static unsigned RunQueueLength(CPU* cpu) {
+    unsigned length = 0;
+    for (int i = 0; i < SchedulingClassCount; i++) {
+        length += __atomic_load_n(&cpu->runQueues[i]->num, __ATOMIC_RELAXED);
+    }
+
+    return length;
+}
+
+/////////////////////////////
+/// \brief Get the default timeslice (in ticks) for a scheduling class
+/////////////////////////////
+uint32_t TimeSliceForClass(int schedClass);
+
+/////////////////////////////
+/// \brief Set the scheduling class of a thread
+///
+/// Moves the thread into the run queue for \a schedClass
+/// and updates its timeslice.
+/////////////////////////////
+void SetSchedulingClass(Thread* thread, int schedClass);
+
+/////////////////////////////
+/// \brief Get the mask of CPUs \a thread may be scheduled on
+///
+/// Threads without an affinity mask may run on any CPU not isolated with isolcpus=.
+/// If the mask contains no online CPUs, every CPU is allowed.
+/////////////////////////////
+uint64_t AllowedCPUs(Thread* thread);
+
+/////////////////////////////
+/// \brief Check whether \a thread may be scheduled on \a cpu
+///
+/// CPUs with an ID of 64 or more cannot be represented in a mask and are always allowed.
+/////////////////////////////
+ALWAYS_INLINE static bool CPUAllowed(Thread* thread, CPU* cpu) {
+    return cpu->id >= 64 || ((AllowedCPUs(thread) >> cpu->id) & 1);
+}
+
+/////////////////////////////
+/// \brief Set the affinity mask of a thread
+///
+/// If the thread is queued on a CPU outside of \a mask it is moved to an allowed CPU,
+/// a thread running on a disallowed CPU is moved the next time it is rescheduled.
+///
+/// \param mask Mask of allowed CPUs, 0 for the default (all CPUs that are not isolated)
+/////////////////////////////
+void SetAffinity(Thread* thread, uint64_t mask);
+
+/////////////////////////////
+/// \brief Steal a runnable thread from another CPU
+///
+/// Takes a runnable thread from the CPU with the longest run queue
+/// and places it on \a cpu's run queue. Never waits on another CPU's run queue lock.
+/// \a cpu's run queue lock must be held.
+///
+/// \return Stolen thread, nullptr if no thread could be stolen
+/////////////////////////////
+Thread* StealThread(CPU* cpu);
+
+/////////////////////////////
+/// \brief Wake \a cpu if it is idle
+///
+/// Idle CPUs do not receive timer ticks,
+/// this should be called whenever a CPU may have been given work.
+/////////////////////////////
+void WakeIdleCPU(CPU* cpu);
 
 void Initialize();
 void Tick(RegisterContext* r);
@@ -3,6 +3,8 @@
 #include <Logging.h>
 #include <Paging.h>
 
+#define STACK_TRACE_MAX_FRAME_SIZE 0x10000
+
 inline static void PrintStackTrace(uint64_t _rbp){
 	uint64_t* rbp = (uint64_t*)_rbp;
 	uint64_t rip = 0;
@@ -13,6 +15,43 @@ inline static void PrintStackTrace(uint64_t _rbp){
 	}
 }
 
+// Fill trace with the return addresses of up to max frames from _rbp, returns the amount of frames.
+// Does not check the page tables so it can be used with the kernel page table locks held,
+// instead frames are only followed whilst they move up the same kernel stack.
+inline static unsigned GetStackTrace(uint64_t _rbp, uintptr_t* trace, unsigned max){
+	uint64_t* rbp = (uint64_t*)_rbp;
+	unsigned count = 0;
+	while(count < max && (uintptr_t)rbp >= KERNEL_VIRTUAL_BASE && !((uintptr_t)rbp & 7)){
+		trace[count++] = *(rbp + 1);
+
+		uint64_t* next = (uint64_t*)(*rbp);
+		if(next <= rbp || (uintptr_t)next - (uintptr_t)rbp > STACK_TRACE_MAX_FRAME_SIZE){
+			break;
+		}
+		rbp = next;
+	}
+
+	return count;
+}
+
+// Like GetStackTrace but only follows frames within [low, high), e.g. the kernel stack of a thread.
+// Safe to use from an interrupt handler on whatever was interrupted.
+inline static unsigned GetStackTraceWithin(uint64_t _rbp, uintptr_t low, uintptr_t high, uintptr_t* trace, unsigned max){
+	uint64_t* rbp = (uint64_t*)_rbp;
+	unsigned count = 0;
+	while(count < max && (uintptr_t)rbp >= low && (uintptr_t)rbp + 16 <= high && !((uintptr_t)rbp & 7)){
+		trace[count++] = *(rbp + 1);
+
+		uint64_t* next = (uint64_t*)(*rbp);
+		if(next <= rbp){
+			break;
+		}
+		rbp = next;
+	}
+
+	return count;
+}
+
 inline static void UserPrintStackTrace(uint64_t _rbp, AddressSpace* addressSpace){
 	uint64_t* rbp = (uint64_t*)_rbp;
 	uint64_t rip = 0;
@@ -3,7 +3,7 @@
 #include <CPU.h>
 
 #include <ABI/Syscall.h>
-#define NUM_SYSCALLS 112
+#define NUM_SYSCALLS 145
 
 #define SC_ARG0(r) ((r)->rdi)
 #define SC_ARG1(r) ((r)->rsi)
@@ -16,6 +16,60 @@ void DumpLastSyscall(struct Thread*);
 
 typedef long (*syscall_t)(RegisterContext*);
 
+// Registers saved by the syscall fast path in Syscall.asm, the SC_ARG macros work on it
+struct SyscallFastFrame {
+    uint64_t rax; // Syscall number
+    uint64_t r10;
+    uint64_t r9;
+    uint64_t r8;
+    uint64_t rdx;
+    uint64_t rsi;
+    uint64_t rdi;
+    uint64_t err;
+    uint64_t rip;
+    uint64_t cs;
+    uint64_t rflags;
+    uint64_t rsp;
+    uint64_t ss;
+};
+
+/////////////////////////////
+/// \brief Syscall which can be handled without saving every register
+///
+/// Runs like any other syscall, but pending signals are not checked on return so it must not block.
+/// Returns SYSCALL_FAST_FALLBACK to have the syscall handled by the regular syscall_t instead,
+/// which must be done before anything has been changed.
+/////////////////////////////
+typedef long (*fast_syscall_t)(SyscallFastFrame*);
+
+#define SYSCALL_FAST_FALLBACK (-4096L) // Outside of the errno range, keep in sync with Syscall.asm
+
+struct SyscallCounter {
+    uint64_t calls;
+    uint64_t fastCalls; // Calls handled by the fast path
+    uint64_t cycles;    // Time stamp counter cycles, including any time spent blocked
+    uint64_t maxCycles;
+};
+
+// Account a syscall to the current CPU, interrupts must be disabled
+ALWAYS_INLINE void AccountSyscall(uint64_t num, uint64_t cycles, bool fast) {
+    SyscallCounter* counters = GetCPULocal()->syscallCounters;
+    if (!counters) {
+        return; // Not yet allocated
+    }
+
+    SyscallCounter& counter = counters[num];
+    counter.calls++;
+    counter.fastCalls += fast;
+    counter.cycles += cycles;
+    if (cycles > counter.maxCycles) {
+        counter.maxCycles = cycles;
+    }
+}
+
+// Allocate per CPU syscall counters and create /dev/syscallstat
+void InitializeSyscallStatistics();
+
 #define SC_TRY_OR_ERROR(func)                                                                                          \
     ({                                                                                                                 \
         auto result = func;                                                                                            \
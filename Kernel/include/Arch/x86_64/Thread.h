@@ -1,6 +1,7 @@
 #pragma once
 
 #include <CPU.h>
+#include <IntrusiveList.h>
 #include <List.h>
 #include <MiscHdr.h>
 #include <Signal.h>
@@ -11,6 +12,10 @@
 #include <abi-bits/pid_t.h>
 
 #define THREAD_TIMESLICE_DEFAULT 10
+#define THREAD_TIMESLICE_REALTIME 5
+#define THREAD_TIMESLICE_BATCH 40
+
+#define THREAD_KERNEL_STACK_SIZE 524288
 
 enum {
     ThreadStateRunning = 0, // Thread is running
@@ -22,6 +27,10 @@ enum {
 class Process;
 struct Thread;
 
+namespace Memory {
+class TLBShootdownBatch;
+}
+
 class ThreadBlocker {
     friend struct Thread;
 
@@ -34,6 +43,8 @@ protected:
     bool interrupted = false; // Returned by Block so the thread knows it has been interrupted
     bool removed = false;     // Has the blocker been removed from queue(s)?
 public:
+    IntrusiveListNode queueNode; // Lets whatever the thread is waiting on queue the blocker without allocating
+
     virtual ~ThreadBlocker() = default;
 
     virtual void Interrupt(); // A blocker may get interrupted because a thread is getting killed.
@@ -48,8 +59,6 @@ public:
     inline void Interrupt() {}
 };
 
-using FutexThreadBlocker = GenericThreadBlocker;
-
 struct Thread {
     lock_t stateLock = 0; // Thread lock
     lock_t kernelLock = 0; // Indicates whether the thread is executing kernel code
@@ -64,8 +73,6 @@ struct Thread {
     
     uint32_t timeSlice = THREAD_TIMESLICE_DEFAULT;
     uint32_t timeSliceDefault = THREAD_TIMESLICE_DEFAULT;
-    uint32_t ticksSinceBalance = 0; // Ticks since run queue rebalance
-    uint32_t ticksGivenSinceBalance = 0;
     RegisterContext registers;   // Registers
     struct {
         RegisterContext regs; // Last system call
@@ -74,18 +81,46 @@ struct Thread {
     void* fxState;               // State of the extended registers
 
     int cpu = -1; // CPU the thread is scheduled on
+    uint64_t affinity = 0; // Mask of CPUs the thread may run on, 0 for any CPU that is not isolated
+    uint64_t migrations = 0; // Amount of times the thread has been moved to another CPU
+
+    // Scheduler statistics
+    uint64_t activeTicks = 0;         // How many ticks this thread has been running
+    uint64_t contextSwitches = 0;     // Times the thread has been switched out
+    uint64_t voluntarySwitches = 0;   // Switched out due to blocking or yielding
+    uint64_t involuntarySwitches = 0; // Switched out due to the timeslice running out
+    uint64_t runnableSince = 0;       // When the thread was last made runnable but not running (uptime in us)
+    uint64_t runQueueWaitUs = 0;      // Total time spent runnable whilst waiting for a CPU
+    uint64_t maxRunQueueWaitUs = 0;   // Longest time spent waiting for a CPU
+    bool yielded = false;             // The thread gave up its timeslice
+
+    // Direct handoff for synchronous IPC, whilst handoffArmed is set the next thread woken by this thread
+    // is recorded in handoff and the scheduler switches straight to it when this thread next blocks or yields.
+    // handoff is only a hint, the thread may have exited by the time it is used
+    // so it is not dereferenced until the scheduler finds it in the run queue of handoffCPU.
+    Thread* handoff = nullptr;
+    int handoffCPU = -1; // CPU handoff was scheduled on when it was woken
+    bool handoffArmed = false;
 
     Thread* next = nullptr; // Next thread in queue
     Thread* prev = nullptr; // Previous thread in queue
 
     uint8_t priority = 0;               // Thread priority
     uint8_t state = ThreadStateRunning; // Thread state
+    uint8_t schedulingClass = SchedulingClassNormal;
 
     uint64_t fsBase = 0;
 
     bool blockTimedOut = false;
     ThreadBlocker* blocker = nullptr;
 
+    unsigned rcuReadDepth = 0; // Nesting of RCU read sections, the thread is not preempted whilst non zero
+    bool pageFaultsDisabled = false; // User memory copies fail instead of faulting pages in (see CopyFromUserAtomic)
+
+    Memory::TLBShootdownBatch* tlbShootdownBatch = nullptr; // Open TLB shootdown batch, if any
+
+    struct PerfCounterState* perfCounters = nullptr; // Hardware performance counters, if in use
+
     uint64_t pendingSignals = 0; // Bitmap of pending signals
     uint64_t signalMask = 0;     // Masked signals
 
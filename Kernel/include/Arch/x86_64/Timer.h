@@ -14,6 +14,7 @@ static inline bool operator<(timeval l, timeval r){
 namespace Timer{
     uint64_t GetSystemUptime();
     uint64_t UsecondsSinceBoot();
+    uint64_t GetTicks();
     uint32_t GetFrequency();
 
     timeval GetSystemUptimeStruct();
@@ -3,6 +3,8 @@
 #include <ABI/Audio.h>
 
 #include <Device.h>
+#include <MM/VMObject.h>
+#include <RefPtr.h>
 
 namespace Audio {
 
@@ -11,6 +13,25 @@ struct PCMOutput {
     void* output;
 };
 
+// Physical pages holding samples, mapped by both the kernel and user space
+class SampleRingVMObject final : public PhysicalVMObject {
+public:
+    SampleRingVMObject(size_t size);
+    ~SampleRingVMObject();
+
+    ALWAYS_INLINE uint8_t* KernelMapping() { return m_kernelMapping; }
+    // Physical address of the byte at offset, the pages are not contiguous
+    ALWAYS_INLINE uintptr_t PhysicalAddress(size_t offset) const {
+        return (static_cast<uintptr_t>(physicalBlocks[offset >> PAGE_SHIFT_4K]) << PAGE_SHIFT_4K) +
+               (offset & (PAGE_SIZE_4K - 1));
+    }
+
+    ALWAYS_INLINE bool CanMunmap() const override { return true; }
+
+private:
+    uint8_t* m_kernelMapping;
+};
+
 class AudioController : public Device {
 public:
     AudioController();
@@ -30,6 +51,22 @@ public:
     virtual int OutputSetNumberOfChannels(int channels) = 0;
 
     virtual int WriteSamples(void* output, uint8_t* buffer, size_t size, bool async) = 0;
+
+    /////////////////////////////
+    /// \brief Switch an output over to a DMA ring that the mixer writes samples into
+    ///
+    /// The output plays from the ring until samples are next written with WriteSamples.
+    /// The default is for controllers without a ring.
+    ///
+    /// \param periodSize Set to the bytes the hardware takes at a time
+    ///
+    /// \return The ring, nullptr if the output has none
+    /////////////////////////////
+    virtual FancyRefPtr<SampleRingVMObject> OutputMapRing(void* output, size_t& periodSize);
+    // Byte offset into the ring the hardware is playing from, or an error
+    virtual int OutputRingPosition(void* output);
+    // Let the hardware play size more bytes written to the ring
+    virtual int OutputRingCommit(void* output, size_t size);
 private:
 
 };
@@ -37,6 +74,8 @@ private:
 void InitializeSystem();
 
 void RegisterPCMOut(PCMOutput* out);
+// The output being played through, nullptr if there are none
+PCMOutput* CurrentPCMOut();
 Error UnregisterPCMOut(PCMOutput* out);
 
 }
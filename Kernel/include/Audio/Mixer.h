@@ -0,0 +1,89 @@
+#pragma once
+
+#include <Audio/Audio.h>
+
+#include <Lock.h>
+
+#define AUDIO_MIXER_PERIOD_FRAMES 256 // Frames mixed at a time when the output has no ring, ~5ms at 48kHz
+#define AUDIO_MIXER_LATENCY_PERIODS 3 // Periods the mixer keeps queued ahead of the hardware
+#define AUDIO_MIXER_MAX_CHANNELS 2
+
+#define AUDIO_STREAM_RING_SIZE 32768 // Bytes of samples buffered for each client, ~170ms of 16-bit stereo at 48kHz
+#define AUDIO_STREAM_MIN_RATE 8000
+#define AUDIO_STREAM_MAX_RATE 192000
+
+namespace Audio {
+
+/////////////////////////////
+/// \brief A client of the mixer, created for each open of /dev/snd/pcm
+///
+/// Samples are queued in a ring, either with write() or by mapping the ring and committing what was written.
+/// The mixer converts them to the format and rate of the output and adds them to every other stream.
+/////////////////////////////
+class MixerStream final : public FsNode {
+public:
+    MixerStream();
+    ~MixerStream();
+
+    ssize_t Write(size_t off, size_t size, uint8_t* buffer) override;
+    int Ioctl(uint64_t cmd, uint64_t arg) override;
+    void Close() override;
+
+    // Whether the stream has samples queued
+    bool HasSamples() const { return m_written != m_read; }
+
+    /////////////////////////////
+    /// \brief Add the stream to an output period
+    ///
+    /// Called by the mixer thread with the streams lock held.
+    ///
+    /// \param mix Interleaved samples at the output rate, in the 16-bit range before clipping
+    /// \param frames Frames in the period
+    /// \param volume Master volume, 0x10000 being unity
+    /////////////////////////////
+    void Mix(int32_t* mix, unsigned frames, int outputRate, int outputChannels, int32_t volume);
+
+private:
+    // Drop queued samples and start resampling afresh, m_lock must be held
+    void Reset();
+    // Change the format of the stream, dropping anything queued
+    int SetFormat(SoundEncoding encoding, int channels, int rate);
+    // Read the next frame from the ring as 16-bit samples, m_lock must be held
+    void ReadFrame(int32_t* frame);
+
+    ALWAYS_INLINE unsigned FrameSize() const { return m_channels * (m_encoding == PCMS32LE ? 4 : 2); }
+
+    FancyRefPtr<SampleRingVMObject> m_ring;
+    uint8_t* m_samples;
+
+    lock_t m_lock = 0;  // Protects the ring pointers and format against the mixer
+    Mutex m_writeLock;  // Serializes writers, which may fault on their buffers
+    Semaphore m_space = Semaphore(0); // Signalled as the mixer frees space in the ring
+
+    uint64_t m_written = 0; // Bytes queued in the ring since the stream was reset
+    uint64_t m_read = 0;    // Bytes taken by the mixer
+
+    SoundEncoding m_encoding = PCMS16LE;
+    int m_channels = 2;
+    int m_rate = 48000;
+    int m_volume = 100; // Percentage
+    bool m_async = false;
+
+    // Linear interpolation between the last two input frames
+    uint64_t m_phase;   // Position between them, 32.32 fixed point
+    int32_t m_previous[AUDIO_MIXER_MAX_CHANNELS];
+    int32_t m_next[AUDIO_MIXER_MAX_CHANNELS];
+};
+
+void InitializeMixer();
+
+void MixerAddStream(MixerStream* stream);
+void MixerRemoveStream(MixerStream* stream);
+
+// Let the mixer know a stream has samples queued
+void MixerWake();
+
+int MixerSetMasterVolume(int percentage);
+int MixerGetMasterVolume();
+
+} // namespace Audio
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+
+#define BOOT_TRACE_MAX_EVENTS 256
+#define BOOT_TRACE_NAME_LENGTH 56
+
+/////////////////////////////
+/// \brief Timestamped points of the boot, readable after boot from /dev/boottrace as a timeline
+///
+/// Points are marked with the TSC of the processor they were marked on,
+/// which is converted to time since the first point when the timeline is read.
+/// Userspace (e.g. Lemond) can add points by writing a line to /dev/boottrace for each.
+/////////////////////////////
+namespace BootTrace {
+
+/////////////////////////////
+/// \brief Add a point to the timeline
+///
+/// Can be called from any processor once its CPU local data is set, from the start of HAL::InitCore.
+/// Does not allocate or lock, points past BOOT_TRACE_MAX_EVENTS are dropped.
+///
+/// \param name Name of the point, copied
+/// \param detail Appended to the name if not null (e.g. the path of a module)
+/////////////////////////////
+void Mark(const char* name, const char* detail = nullptr);
+
+// Creates /dev/boottrace, called once the timer is running
+void Initialize();
+
+} // namespace BootTrace
@@ -3,16 +3,17 @@
 #define CHARBUFFER_START_SIZE 1024
 
 #include <stddef.h>
+#include <stdint.h>
 #include <Types.h>
 
 class CharacterBuffer{
 public:
     size_t bufferSize = CHARBUFFER_START_SIZE;
     size_t maxBufferSize = 2097152;
-    size_t bufferPos = 0;
+    size_t bufferPos = 0; // Amount of data in the buffer
     int lines = 0;
     char* buffer = nullptr;
-    bool ignoreBackspace = false;
+    char erase = '\b'; // Removes the last character of the line when not raw
 
     CharacterBuffer();
     ~CharacterBuffer();
@@ -20,7 +21,27 @@ public:
     ssize_t Write(char* buffer, size_t size);
     ssize_t Read(char* buffer, size_t count);
 
+    // Raw buffers copy data in and out as is, without handling backspace or counting lines.
+    // Lines are counted again when the buffer stops being raw.
+    void SetRaw(bool raw);
+    inline bool IsRaw() const { return raw; }
+
+    /////////////////////////////
+    /// \brief Find the first occurrence of any of a, b or c in data
+    ///
+    /// Looks at 8 bytes at a time so that runs of plain characters can be copied in bulk.
+    ///
+    /// \return Offset of the first occurrence, len if there is none
+    /////////////////////////////
+    static size_t Scan(const char* data, size_t len, char a, char b, char c);
+
     void Flush();
 private:
+    // Make room for size more bytes after the data, lock must be held
+    void Reserve(size_t size);
+
+    size_t start = 0; // Data starts at buffer + start
+    bool raw = false;
+
     volatile int lock = 0;
-};
\ No newline at end of file
+};
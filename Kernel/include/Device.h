@@ -8,6 +8,8 @@
 #include <List.h>
 #include <Logging.h>
 
+#include <ABI/Disk.h>
+
 struct DevicePCIInformation {
     uint16_t vendorID; // PCI Vendor ID
     uint16_t deviceID; // PCI Device ID
@@ -42,6 +44,7 @@ enum DeviceType {
     DeviceTypeUSBHID,
     DeviceTypeAudioController,
     DeviceTypeAudioOutput,
+    DeviceTypeDisplayAdapter,
 };
 
 enum DeviceBus {
@@ -92,29 +95,146 @@ protected:
 
 class PartitionDevice;
 
+#define DISK_REQUEST_MERGE_MAX 131072 // Most bytes passed to the driver at once when merging requests
+#define DISK_REQUEST_BATCH_MAX 32     // Most requests merged together
+#define DISK_READ_EXPIRE 50000        // Microseconds a read can be passed over by the elevator
+#define DISK_WRITE_EXPIRE 500000      // Microseconds a write can be passed over by the elevator
+
+struct DiskRequest;
+
+// Links a DiskRequest into the order requests were submitted in, alongside the elevator order
+struct DiskRequestLink {
+    DiskRequestLink* next = nullptr;
+    DiskRequestLink* prev = nullptr;
+    DiskRequest* request = nullptr;
+};
+
+struct DiskRequest {
+    enum Operation {
+        Read,
+        Write,
+    };
+
+    // Called once the request has completed, from one of the disk's I/O threads.
+    // The request is not touched by the disk after the callback is called, so it may free it.
+    using Callback = void (*)(DiskRequest* req, void* data);
+
+    DiskRequest(Operation op, uint64_t lba, uint32_t count, void* buffer, Callback callback = nullptr,
+                void* callbackData = nullptr)
+        : op(op), lba(lba), count(count), buffer(reinterpret_cast<uint8_t*>(buffer)), callback(callback),
+          callbackData(callbackData) {}
+
+    Operation op;
+    uint64_t lba;
+    uint32_t count;  // In bytes like ReadDiskBlock, only requests of whole blocks are merged
+    uint8_t* buffer; // Must be kernel memory as the request is carried out by another thread
+
+    Callback callback;
+    void* callbackData;
+
+    int status = 0; // 0 on success, the driver's error otherwise
+
+    // Used whilst queued
+    uint64_t submitted = 0; // Time the request was queued, in microseconds since boot
+    uint64_t deadline = 0; // Dispatched ahead of the elevator once passed
+    DiskRequest* next = nullptr;
+    DiskRequest* prev = nullptr;
+    DiskRequestLink fifo;
+};
+
 class DiskDevice : public Device {
     friend class PartitionDevice;
 
 protected:
     int nextPartitionNumber = 0;
 
+    // I/O threads started for the disk, drivers which can do several transfers at once raise it
+    unsigned ioThreads = 1;
+
+    /////////////////////////////
+    /// \brief Carry out a batch of requests
+    ///
+    /// The requests are all of the same operation and cover adjacent blocks in LBA order.
+    /// Called from an I/O thread, which completes every request in the batch with the return value.
+    /// The default passes the batch to Transfer as one transfer.
+    ///
+    /// \param mergeBuffer DISK_REQUEST_MERGE_MAX bytes belonging to the I/O thread
+    ///
+    /// \return 0 on success, the driver's error otherwise
+    /////////////////////////////
+    virtual int Dispatch(DiskRequest** batch, unsigned count, uint8_t* mergeBuffer);
+
+    /////////////////////////////
+    /// \brief Whether the driver can DMA straight to or from buffer instead of bouncing the transfer
+    ///
+    /// Only kernel heap memory can be translated to physical pages with Memory::VirtualToPhysicalAddress,
+    /// which includes BlockCache pages and buffers of queued requests.
+    ///
+    /// \param alignment Alignment the hardware needs for the start of the buffer
+    /////////////////////////////
+    bool CanDMA(const void* buffer, uint32_t count, uintptr_t alignment) const;
+
 public:
     DiskDevice();
 
     int InitializePartitions();
 
+    // Driver interface, transfers count bytes synchronously
     virtual int ReadDiskBlock(uint64_t lba, uint32_t count, void* buffer);
     virtual int WriteDiskBlock(uint64_t lba, uint32_t count, void* buffer);
 
+    // Pass a transfer straight to the driver, counting it in the disk's statistics.
+    // Used instead of calling ReadDiskBlock or WriteDiskBlock.
+    int Transfer(DiskRequest::Operation op, uint64_t lba, uint32_t count, void* buffer);
+
+    // Get the I/O counters of the disk
+    void GetStatistics(DiskStatistics& stats);
+
+    /////////////////////////////
+    /// \brief Queue a request without waiting for it
+    ///
+    /// Requests are sorted by LBA and serviced in one direction (C-LOOK),
+    /// unless one has waited past its deadline. Adjacent requests are merged into one transfer.
+    /// req->callback is called once it completes.
+    /////////////////////////////
+    void Submit(DiskRequest* req);
+
+    // Queue a request and block until it completes, returns the driver's error or 0
+    int SubmitWait(DiskRequest::Operation op, uint64_t lba, uint32_t count, void* buffer);
+
     virtual ssize_t Read(size_t off, size_t size, uint8_t* buffer);
     virtual ssize_t Write(size_t off, size_t size, uint8_t* buffer);
 
+    int Sync() override; // Writes back the disk's dirty pages in the BlockCache
+
+    DiskDevice* CacheDisk(uint64_t& offset) override {
+        offset = 0;
+        return this;
+    }
+
     virtual ~DiskDevice();
 
     List<PartitionDevice*> partitions;
     int blocksize = 512;
 
 private:
+    static void IOThread(DiskDevice* disk);
+
+    // Take the next batch of requests off the queue, requestLock must be held
+    unsigned NextBatch(DiskRequest** batch);
+
+    lock_t requestLock = 0;
+    FastList<DiskRequest*> requests;     // Sorted by LBA
+    FastList<DiskRequestLink*> readFifo;  // Reads in the order they were submitted
+    FastList<DiskRequestLink*> writeFifo; // Writes in the order they were submitted
+    uint64_t headLBA = 0;                 // Block after the last batch, where the elevator continues from
+    Semaphore requestSemaphore = Semaphore(0);
+
+    bool ioThreadsStarted = false;
+
+    lock_t statsLock = 0;
+    DiskStatistics ioStats = {}; // Protected by statsLock
+    uint64_t busySince = 0;      // Start of the current busy period whilst transfers are in flight
 };
 
 class PartitionDevice final : public Device {
@@ -125,9 +245,23 @@ public:
     int ReadBlock(uint64_t lba, uint32_t count, void* buffer);
     int WriteBlock(uint64_t lba, uint32_t count, void* buffer);
 
+    // Transfer straight to or from the disk without going through the BlockCache (e.g. for swap),
+    // offset and count are in bytes and must be block aligned
+    int TransferUncached(DiskRequest::Operation op, uint64_t offset, uint32_t count, void* buffer);
+
+    // Size of the partition in bytes
+    ALWAYS_INLINE uint64_t PartitionSize() const { return (m_endLBA - m_startLBA) * parentDisk->blocksize; }
+
     ssize_t Read(size_t off, size_t size, uint8_t* buffer) override;
     ssize_t Write(size_t off, size_t size, uint8_t* buffer) override;
 
+    int Sync() override; // Writes back the partition's dirty pages in the BlockCache
+
+    DiskDevice* CacheDisk(uint64_t& offset) override {
+        offset = m_startLBA * parentDisk->blocksize;
+        return parentDisk;
+    }
+
     virtual ~PartitionDevice();
 
     DiskDevice* parentDisk;
@@ -151,6 +285,7 @@ enum DeviceManagementRequests {
     RequestDeviceGetType,
     RequestDeviceGetChildCount,
     RequestDeviceEnumerateChildren,
+    RequestDeviceGetDiskStatistics,
 };
 
 void Initialize();
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+class FsNode;
+
+#define DENTRY_CACHE_MAX 4096 // Entries kept before the least recently used are evicted
+#define DENTRY_NAME_MAX 47    // Longer names are not cached
+
+// Cache of directory lookups (directory and name to FsNode) used by fs::FindDir
+//
+// Only directories with cacheDirectoryEntries set are cached, as their entries only change
+// through fs::Create, fs::CreateDirectory, fs::Link and fs::Unlink which invalidate the cache.
+// Names which do not exist are cached as negative entries (node is nullptr).
+// Entries referring to a node are purged when the node is destroyed.
+// Lookups take no locks, entries are freed through RCU (see RCU.h).
+namespace fs::DentryCache {
+
+/////////////////////////////
+/// \brief Find a cached lookup
+///
+/// \param dir Directory to look in
+/// \param name Name of the entry
+/// \param node Set to the cached node, nullptr if the name is cached as not existing
+///
+/// \return true if the lookup was cached
+/////////////////////////////
+bool Lookup(FsNode* dir, const char* name, FsNode*& node);
+
+// Current generation of the cache, changed whenever an entry is invalidated
+uint64_t Generation();
+
+/////////////////////////////
+/// \brief Cache a lookup
+///
+/// \param node Node found, nullptr for a negative entry
+/// \param generation Generation() from before the lookup,
+/// nothing is cached if it has since changed as the result may be stale
+/////////////////////////////
+void Insert(FsNode* dir, const char* name, FsNode* node, uint64_t generation);
+
+// Remove the entry for name in dir
+void Invalidate(FsNode* dir, const char* name);
+
+// Remove every entry referring to node, either as the directory or the entry
+void Purge(FsNode* node);
+
+} // namespace fs::DentryCache
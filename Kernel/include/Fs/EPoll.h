@@ -3,29 +3,97 @@
 #include <ABI/EPoll.h>
 #include <Fs/Filesystem.h>
 #include <List.h>
-#include <Pair.h>
+#include <Lock.h>
+#include <UserPointer.h>
+#include <Vector.h>
 
 namespace fs {
 
-class EPoll :
-    public FsNode {
+class EPoll;
+
+// A file watched by an EPoll, signalled by the file whenever it may have events
+class EPollItem final : public FilesystemWatcher {
+    friend class EPoll;
+    friend FastList<EPollItem*>;
+
+public:
+    EPollItem(EPoll* epoll, int fd, UNIXOpenFile* file, const epoll_event& event)
+        : epoll(epoll), fd(fd), file(file), node(file->node), event(event) {}
+
+    void Signal() override;
+
+private:
+    EPoll* epoll;
+    int fd;
+
+    UNIXOpenFile* file; // nullptr once the item is no longer on the file's list
+    FsNode* node;
+    epoll_event event;
+
+    bool ready = false;    // On the ready list
+    bool rearm = false;    // Watch the file again when taken off the ready list (EPOLLET)
+    bool disabled = false; // Reported once with EPOLLONESHOT, waiting for EPOLL_CTL_MOD
+
+    // Ready list of the EPoll
+    EPollItem* next = nullptr;
+    EPollItem* prev = nullptr;
+
+    // Items of the file (UNIXOpenFile::epollItems)
+    EPollItem* fileNext = nullptr;
+    EPollItem* filePrev = nullptr;
+};
+
+// Files are only polled when they are taken off the ready list, which they are put on by their
+// FilesystemWatcher callback (EPollItem::Signal), so waiting costs O(ready files) rather than O(watched files).
+// Level triggered files go back on the ready list after being reported until they have no events.
+class EPoll : public FsNode {
+    friend class EPollItem;
+
 public:
     EPoll() = default;
+    ~EPoll();
+
+    void Close() override;
+
+    bool IsEPoll() const override { return true; }
+
+    // EPOLL_CTL_ADD, EPOLL_CTL_MOD and EPOLL_CTL_DEL, 0 on success otherwise a negative error code
+    int Add(int fd, UNIXOpenFile* file, const epoll_event& event);
+    int Modify(int fd, const epoll_event& event);
+    int Remove(int fd);
+
+    /////////////////////////////
+    /// \brief Wait for events on the watched files
+    ///
+    /// \param timeout Timeout in microseconds, 0 to return immediately and negative to wait indefinitely
+    ///
+    /// \return Amount of events stored in \a events, -EINTR when interrupted, -EFAULT on a bad buffer
+    /////////////////////////////
+    long Wait(UserBuffer<epoll_event> events, int maxEvents, long timeout);
+
+    // Stop a file being watched by any EPoll once it is closed
+    static void FileClosed(UNIXOpenFile* file);
 
-    void Close() override {
-        handleCount--;
+private:
+    // Put an item on the ready list, waking threads waiting on the EPoll if wake is set
+    void Queue(EPollItem* item, bool wake);
+    // Watch the file of the item for its events, queueing it if it already has any
+    void Arm(EPollItem* item);
+    // Stop watching the item's file and free it, epLock must be held and the item already unlinked from the file
+    void Detach(EPollItem* item);
+    // Take an item off the list of its file, fileItemsLock must be held
+    static void UnlinkFile(EPollItem* item);
+    // Report events of items on the ready list, epLock must be held
+    int Collect(UserBuffer<epoll_event>& events, int maxEvents);
 
-        if(handleCount <= 0){
-            delete this;
-        }
-    }
+    Vector<EPollItem*> items; // Watched files indexed by fd, nullptr when the fd is not watched
+    Mutex epLock;             // Held when changing items or reporting events
 
-    bool IsEPoll() const override {
-        return true;
-    }
+    FastList<EPollItem*> ready;
+    lock_t readyLock = 0;
 
-    List<Pair<int, epoll_event>> fds;
-    lock_t epLock = 0;
+    Semaphore waiters{0};
+    unsigned waiting = 0; // Threads waiting on waiters, readyLock must be held
 };
 
-}
+} // namespace fs
@@ -5,6 +5,9 @@
 #include <Device.h>
 #include <Fs/Filesystem.h>
 #include <Fs/FsVolume.h>
+#include <Lock.h>
+#include <Spinlock.h>
+#include <Vector.h>
 
 #define FAT_ATTR_READ_ONLY 0x1
 #define FAT_ATTR_HIDDEN 0x2
@@ -13,6 +16,10 @@
 #define FAT_ATTR_DIRECTORY 0x10
 #define FAT_ATTR_ARCHIVE 0x20
 
+#define FAT32_FAT_BLOCK_SIZE 4096 // The FAT is read and cached in blocks of this size
+#define FAT32_CLUSTER_END 0x0FFFFFF8 // Clusters from here mark the end of a chain
+#define FAT32_MAX_READ (1024 * 1024) // Most bytes read from the disk in one request
+
 typedef struct {
     uint8_t jmp[3]; // Can be ignored
     int8_t oem[8]; // OEM identifier
@@ -95,6 +102,11 @@ namespace fs::FAT32{
 
     class Fat32Node : public FsNode {
     public:
+        Fat32Node() {
+            cacheDirectoryEntries = true; // Read only, lookups are kept so the same node is returned
+            readahead = true;
+        }
+
         ssize_t Read(size_t, size_t, uint8_t *);
         ssize_t Write(size_t, size_t, uint8_t *);
         //fs_fd_t* Open(size_t flags);
@@ -103,6 +115,9 @@ namespace fs::FAT32{
         FsNode* FindDir(const char* name);
 
         Fat32Volume* vol;
+
+        Vector<uint32_t> clusters; // Clusters of the file found so far, in order (see Fat32Volume::GetCluster)
+        Mutex clusterLock;
     };
 
     class Fat32Volume : public FsVolume {
@@ -118,13 +133,19 @@ namespace fs::FAT32{
 
     private:
         uint64_t ClusterToLBA(uint32_t cluster);
-        List<uint32_t>* GetClusterChain(uint32_t cluster);
+        // Cluster following cluster in its chain, 0 at the end of the chain or on disk error
+        uint32_t NextCluster(uint32_t cluster);
+        // Cluster index of the file, 0 if the file has less clusters
+        uint32_t GetCluster(Fat32Node* node, uint32_t index);
         void* ReadClusterChain(uint32_t cluster, int* count);
-        void* ReadClusterChain(uint32_t cluster, int* count, size_t max);
 
         PartitionDevice* part;
         fat32_boot_record_t* bootRecord;
 
+        uint32_t** fatBlocks = nullptr; // Blocks of the FAT read so far, nullptr if not yet read
+        uint32_t fatBlockCount = 0;
+        lock_t fatLock = 0; // Held when adding a block to fatBlocks
+
         int clusterSizeBytes;
         Fat32Node fat32MountPoint;
     };
@@ -14,10 +14,13 @@
 #include <abi-bits/fcntl.h>
 #include <abi-bits/uid_t.h>
 
+struct iovec;
+
 #define FD_SETSIZE 1024
 
 #define PATH_MAX 4096
 #define NAME_MAX 255
+#define IOV_MAX 1024 // Most buffers in a vectored read or write
 
 #define S_IFMT 0xF000
 #define S_IFBLK 0x6000
@@ -128,17 +131,36 @@ static inline void FD_SET(int fd, fd_set_t* fds) {
 
 class FilesystemWatcher;
 class DirectoryEntry;
+class DiskDevice;
+
+namespace fs {
+class EPollItem;
+}
 
 class UNIXOpenFile : public KernelObject {
     DECLARE_KOBJECT(UNIXOpenFile);
 public:
     ~UNIXOpenFile();
 
+    // Lets SysKernelObjectWait wait on files along with other kernel objects, until the file is readable
+    void Watch(KernelObjectWatcher& watcher, int events) override;
+    void Unwatch(KernelObjectWatcher& watcher) override;
+
     lock_t dataLock = 0;
 
     class FsNode* node = nullptr;
     off_t pos = 0;
     mode_t mode = 0;
+
+    // Sequential read detection (see fs::Readahead)
+    size_t readaheadNext = 0;   // Where the next read is expected if the file is being read sequentially
+    size_t readaheadEnd = 0;    // End of what has been queued for readahead
+    size_t readaheadWindow = 0; // Size of the last readahead
+
+    fs::EPollItem* epollItems = nullptr; // EPolls watching the file, see fs::EPoll::FileClosed
+
+    lock_t objectWatchersLock = 0;
+    List<class FileObjectWatcher*> objectWatchers; // See Watch
 };
 
 class FsNode {
@@ -185,10 +207,75 @@ public:
     /////////////////////////////
     virtual ssize_t Write(size_t off, size_t size, uint8_t* buffer); // Write Data
 
+    /////////////////////////////
+    /// \brief Read data from filesystem node into several buffers
+    ///
+    /// The default implementation reads each buffer in turn with Read,
+    /// stopping at a short read or once nothing more can be read without blocking.
+    ///
+    /// \param off Offset of data to read
+    /// \param iov Buffers to read into
+    /// \param iovcnt Amount of buffers
+    ///
+    /// \return Bytes read or if negative an error code
+    /////////////////////////////
+    virtual ssize_t ReadV(size_t off, const struct iovec* iov, int iovcnt);
+
+    /////////////////////////////
+    /// \brief Write data from several buffers to filesystem node
+    ///
+    /// The default implementation writes each buffer in turn with Write, stopping at a short write.
+    ///
+    /// \param off Offset where data should be written
+    /// \param iov Buffers to write from
+    /// \param iovcnt Amount of buffers
+    ///
+    /// \return Bytes written or if negative an error code
+    /////////////////////////////
+    virtual ssize_t WriteV(size_t off, const struct iovec* iov, int iovcnt);
+
+    /////////////////////////////
+    /// \brief Read data from the front of a stream without taking it
+    ///
+    /// Lets Splice leave data it could not write in the stream. Blocks like Read when the stream is empty.
+    /// The data is taken with Consume.
+    ///
+    /// \param size Amount of data (in bytes) to read
+    /// \param position Set to the position of the data in the stream, passed to Consume
+    ///
+    /// \return Bytes read or if negative an error code, -ENOSYS if the node cannot peek
+    /////////////////////////////
+    virtual ssize_t Peek(size_t, uint8_t*, size_t&) { return -ENOSYS; }
+
+    /////////////////////////////
+    /// \brief Take data read by Peek off the stream
+    ///
+    /// Nothing is taken if another reader has taken the data since.
+    ///
+    /// \param position Position given by Peek
+    /// \param size Amount of data (in bytes) to take, may be less than was peeked
+    /////////////////////////////
+    virtual void Consume(size_t, size_t) {}
+
     virtual ErrorOr<UNIXOpenFile*> Open(size_t flags); // Open
     virtual void Close();                           // Close
 
     virtual int ReadDir(DirectoryEntry*, uint32_t); // Read Directory
+
+    /////////////////////////////
+    /// \brief Read several directory entries from a cursor
+    ///
+    /// The default implementation calls ReadDir with the cursor as the entry index.
+    /// File systems where reaching an index means walking the directory should override it
+    /// and use an opaque position (e.g. a byte offset) as the cursor instead.
+    ///
+    /// \param entries Filled with the entries read
+    /// \param count Most entries to read
+    /// \param cursor Position to start reading from, 0 for the start of the directory. Advanced past the entries read
+    ///
+    /// \return Amount of entries read, 0 at the end of the directory, negative error code on failure
+    /////////////////////////////
+    virtual int ReadDirBatch(DirectoryEntry* entries, int count, off_t& cursor);
     virtual FsNode* FindDir(const char* name);            // Find in directory
 
     virtual int Create(DirectoryEntry* ent, uint32_t mode);
@@ -201,7 +288,32 @@ public:
     virtual int Truncate(off_t length);
 
     virtual int Ioctl(uint64_t cmd, uint64_t arg); // I/O Control
-    virtual void Sync();                           // Sync node to device
+    virtual int Sync();                            // Sync node to device, returns 0 on success
+
+    /////////////////////////////
+    /// \brief Find the disk caching the data of the node in the BlockCache
+    ///
+    /// Lets filesystems on the node use cached blocks in place (see BlockCache::Pin).
+    ///
+    /// \param offset Set to the offset of the node's data on the disk
+    ///
+    /// \return Disk caching the node's data, nullptr if it does not go through the BlockCache
+    /////////////////////////////
+    virtual DiskDevice* CacheDisk(uint64_t&) { return nullptr; }
+
+    /////////////////////////////
+    /// \brief Get the physical page holding the data of the node at page \a index
+    ///
+    /// Lets the PageCache map the pages of nodes kept in memory (see InMemory) in place instead of copying them.
+    /// The page stays valid whilst the node has a PageCache.
+    ///
+    /// \param allocate Allocate a zeroed page when there is none
+    ///
+    /// \return Physical address of the page, 0 if there is none
+    /////////////////////////////
+    virtual uintptr_t MemoryPage(uint64_t, bool) { return 0; }
+    // Whether the data of the node is kept in pages which can be mapped with MemoryPage
+    virtual bool InMemory() { return false; }
 
     virtual bool CanRead() { return true; }
     virtual bool CanWrite() { return true; }
@@ -219,9 +331,29 @@ public:
 
     void UnblockAll();
 
+    /////////////////////////////
+    /// \brief Unblock up to count threads blocked on the node, oldest first
+    ///
+    /// Used when only some of the waiters can make progress, e.g. when one reader can take all of the available data.
+    ///
+    /// \return Whether threads are still blocked on the node
+    /////////////////////////////
+    bool UnblockWaiters(unsigned count);
+
     FsNode* link;
     FsNode* parent;
 
+    class PageCache* pageCache = nullptr; // Pages of the file whilst it is memory mapped, see PageCache::Acquire
+
+    // FindDir results can be kept in the dentry cache (see fs::DentryCache),
+    // only set if entries are only ever added or removed through fs::Create, fs::Link, etc.
+    bool cacheDirectoryEntries = false;
+    unsigned dentryCount = 0; // Dentry cache entries referring to the node
+
+    // Sequential reads through open files are read ahead (see fs::Readahead),
+    // only worth setting if reads go through the BlockCache
+    bool readahead = false;
+
     FilesystemLock nodeLock; // Lock on FsNode info
 };
 
@@ -275,6 +407,9 @@ class FilesystemWatcher : public Semaphore {
 public:
     FilesystemWatcher() : Semaphore(0) {}
 
+    // Called by watched nodes when they may be ready
+    virtual void Signal() { Semaphore::Signal(); }
+
     inline void WatchNode(FsNode* node, int events) {
         ErrorOr<UNIXOpenFile*> desc = node->Open(0);
         assert(!desc.HasError() && desc.Value());
@@ -294,6 +429,16 @@ public:
     }
 };
 
+// Passes the signals of a file on to a KernelObjectWatcher
+class FileObjectWatcher final : public FilesystemWatcher {
+public:
+    FileObjectWatcher(KernelObjectWatcher& watcher) : watcher(watcher) {}
+
+    void Signal() override { watcher.Signal(); }
+
+    KernelObjectWatcher& watcher;
+};
+
 class FilesystemBlocker : public ThreadBlocker {
     friend FsNode;
     friend FastList<FilesystemBlocker*>;
@@ -467,17 +612,48 @@ ssize_t Read(FsNode* node, size_t offset, size_t size, void* buffer);
 /// \return Bytes written or if negative an error code
 /////////////////////////////
 ssize_t Write(FsNode* node, size_t offset, size_t size, void* buffer);
+
+// Vectored versions of fs::Read and fs::Write, see FsNode::ReadV and FsNode::WriteV
+ssize_t ReadV(FsNode* node, size_t offset, const struct iovec* iov, int iovcnt);
+ssize_t WriteV(FsNode* node, size_t offset, const struct iovec* iov, int iovcnt);
+
 ErrorOr<UNIXOpenFile*> Open(FsNode* node, uint32_t flags = 0);
 void Close(FsNode* node);
 void Close(UNIXOpenFile* openFile);
 int ReadDir(FsNode* node, DirectoryEntry* dirent, uint32_t index);
+int ReadDirBatch(FsNode* node, DirectoryEntry* entries, int count, off_t& cursor);
 FsNode* FindDir(FsNode* node, const char* name);
 
 ssize_t Read(const FancyRefPtr<UNIXOpenFile>& handle, size_t size, uint8_t* buffer);
 ssize_t Write(const FancyRefPtr<UNIXOpenFile>& handle, size_t size, uint8_t* buffer);
+ssize_t ReadV(const FancyRefPtr<UNIXOpenFile>& handle, const struct iovec* iov, int iovcnt);
+ssize_t WriteV(const FancyRefPtr<UNIXOpenFile>& handle, const struct iovec* iov, int iovcnt);
 int ReadDir(const FancyRefPtr<UNIXOpenFile>& handle, DirectoryEntry* dirent, uint32_t index);
+// Reads from the file position of the handle
+int ReadDirBatch(const FancyRefPtr<UNIXOpenFile>& handle, DirectoryEntry* entries, int count);
 FsNode* FindDir(const FancyRefPtr<UNIXOpenFile>& handle, const char* name);
 
+/////////////////////////////
+/// \brief Copy data from one open file to another without going through the process
+///
+/// Pages of \a in found in its page cache are written out directly,
+/// anything else is read into a kernel buffer first.
+/// Data is only taken from streams which support Peek once it has been written,
+/// from other streams data that could not be written is lost.
+/// Stops at the end of \a in, at a short write or once \a in would block after something has been copied.
+///
+/// \param out File to write to at its file position
+/// \param in File to read from
+/// \param inOffset Offset to read from and advanced past the data copied, nullptr to use the file position of \a in
+/// \param count Most bytes to copy
+///
+/// \return Bytes copied or if negative an error code
+/////////////////////////////
+ssize_t Splice(const FancyRefPtr<UNIXOpenFile>& out, const FancyRefPtr<UNIXOpenFile>& in, off_t* inOffset,
+               size_t count);
+
+int Create(FsNode* dir, DirectoryEntry* ent, uint32_t mode);
+int CreateDirectory(FsNode* dir, DirectoryEntry* ent, uint32_t mode);
 int Link(FsNode*, FsNode*, DirectoryEntry*);
 int Unlink(FsNode*, DirectoryEntry*, bool unlinkDirectories = false);
 
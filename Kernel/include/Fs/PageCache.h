@@ -0,0 +1,103 @@
+#pragma once
+
+#include <Compiler.h>
+#include <Lock.h>
+#include <Paging.h>
+#include <stddef.h>
+#include <stdint.h>
+
+class FsNode;
+
+// Pages of a file shared by every mapping of it (see FileVMObject),
+// created when the file is first mapped and freed once the last mapping is gone.
+// Files kept in memory (see FsNode::InMemory) are mapped using their own pages which are never copied.
+class PageCache final {
+public:
+    /////////////////////////////
+    /// \brief Get the page cache of a node
+    ///
+    /// Creates the cache if the node has none, each call must be matched with a call to Release().
+    /////////////////////////////
+    static PageCache* Acquire(FsNode* node);
+
+    // Get the page cache of a node only if the node is mapped, otherwise nullptr
+    static PageCache* AcquireIfCached(FsNode* node);
+
+    /////////////////////////////
+    /// \brief Drop a reference to the page cache
+    ///
+    /// When the last reference is dropped dirty pages are written back and the cache is freed.
+    /////////////////////////////
+    void Release();
+
+    /////////////////////////////
+    /// \brief Get a page of the file, reading it if it is not cached
+    ///
+    /// May block whilst the page is read, do not call with spinlocks held.
+    /// Any part of the page past the end of the file is zeroed.
+    ///
+    /// \param index Index of the 4KB page in the file
+    ///
+    /// \return Physical address of the page, 0 on failure
+    /////////////////////////////
+    uintptr_t GetPage(uint64_t index);
+
+    /////////////////////////////
+    /// \brief Get a page of the file if it is cached
+    ///
+    /// \return Physical address of the page, 0 if not cached
+    /////////////////////////////
+    uintptr_t FindPage(uint64_t index);
+
+    // Mark a page as mapped into a writable shared mapping, it will be written back to the file
+    void MarkDirty(uint64_t index);
+
+    // Called by shared mappings when they are created and destroyed,
+    // dirty pages cannot be cleaned whilst any exist as they may still be written
+    void AddSharedMapping();
+    void RemoveSharedMapping();
+
+    /////////////////////////////
+    /// \brief Write dirty pages back to the file
+    ///
+    /// Pages are clean once written unless a shared mapping may still write to them.
+    ///
+    /// \return 0 on success, otherwise an error code
+    /////////////////////////////
+    int WriteBack();
+
+    /////////////////////////////
+    /// \brief Re-read the part of cached pages in a range of the file
+    ///
+    /// Called after the file is written without going through a mapping
+    /// so that mappings stay coherent with the file.
+    /// Only the written range is read, anything written through a mapping outside of it is kept.
+    /////////////////////////////
+    void Update(size_t offset, size_t size);
+
+    ALWAYS_INLINE bool HasDirtyPages() const { return m_dirtyCount; }
+    ALWAYS_INLINE size_t CachedPages() const { return m_cachedCount; }
+
+private:
+    PageCache(FsNode* node);
+    ~PageCache();
+
+    bool IsDirty(uint64_t index) const { return m_dirty[index >> 5] & (1U << (index & 31)); }
+    // Grow the page arrays to hold at least count pages, m_lock must be held
+    void Reserve(uint64_t count);
+    // Read the bytes from start to end of the page into the physical block at phys
+    int ReadPage(uint64_t index, uintptr_t phys, size_t start = 0, size_t end = PAGE_SIZE_4K);
+
+    FsNode* m_node;
+    unsigned m_refCount = 1;
+    bool m_inMemory; // Pages are the node's own, nothing is cached, written back or updated
+
+    lock_t m_lock = 0;
+    uint32_t* m_blocks = nullptr; // Physical block of each page, 0 if not cached
+    uint32_t* m_dirty = nullptr;  // Bitmap of pages written through a shared mapping
+    uint64_t m_capacity = 0;      // Amount of pages the arrays can hold
+    size_t m_cachedCount = 0;
+    size_t m_dirtyCount = 0;
+    unsigned m_sharedMappings = 0;
+    unsigned m_sharedMappingsAdded = 0; // Changes whenever a shared mapping is created
+};
@@ -1,23 +1,122 @@
 #pragma once
 
+#include <Compiler.h>
 #include <Fs/Filesystem.h>
+#include <Lock.h>
 #include <RefPtr.h>
-#include <Stream.h>
+
+#ifndef PIPE_BUF
+#define PIPE_BUF 4096 // Writes up to this size are atomic
+#endif
+
+#ifndef F_SETPIPE_SZ
+#define F_SETPIPE_SZ 1031
+#endif
+
+#ifndef F_GETPIPE_SZ
+#define F_GETPIPE_SZ 1032
+#endif
+
+#define PIPE_DEFAULT_SIZE 65536
+#define PIPE_MAX_SIZE 1048576
+
+// Fixed size ring of pages shared by both ends of a pipe.
+// head and tail only ever increase, the reader only writes tail and the writer only writes head,
+// so a reader and a writer never wait on each other. readLock and writeLock serialize readers and writers.
+class PipeBuffer final {
+public:
+    // Capacity() is 0 if the ring could not be allocated
+    PipeBuffer(size_t capacity);
+    ~PipeBuffer();
+
+    // Copy up to size bytes out of the ring, readLock must be held
+    size_t Read(uint8_t* buffer, size_t size);
+    // Copy up to size bytes out of the ring, leaving them there. readLock must be held
+    size_t Peek(uint8_t* buffer, size_t size) const;
+    // Take size bytes peeked at position, false if they have already been read. readLock must be held
+    bool Consume(size_t position, size_t size);
+    // Copy up to size bytes into the ring, writeLock must be held
+    size_t Write(const uint8_t* buffer, size_t size);
+
+    /////////////////////////////
+    /// \brief Change the capacity of the ring
+    ///
+    /// \param capacity New capacity, rounded up to a power of two amount of pages
+    ///
+    /// \return New capacity, -EBUSY if there is more data in the ring, -EINVAL if too large,
+    /// -ENOMEM if the new ring could not be allocated
+    /////////////////////////////
+    long Resize(size_t capacity);
+
+    ALWAYS_INLINE size_t Used() const {
+        return __atomic_load_n(&m_head, __ATOMIC_SEQ_CST) - __atomic_load_n(&m_tail, __ATOMIC_SEQ_CST);
+    }
+    ALWAYS_INLINE size_t Free() const { return m_capacity - Used(); }
+    ALWAYS_INLINE size_t Capacity() const { return m_capacity; }
+
+    // Stream offsets of the next byte read and the next byte written
+    ALWAYS_INLINE size_t ReadPosition() const { return __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE); }
+    ALWAYS_INLINE size_t WritePosition() const { return __atomic_load_n(&m_head, __ATOMIC_ACQUIRE); }
+
+    Mutex readLock;
+    Mutex writeLock;
+
+    // Set by a reader or writer before waiting, then checked by the other side after changing the ring
+    bool readerWaiting = false;
+    bool writerWaiting = false;
+
+    lock_t endLock = 0; // Held whilst using UNIXPipe::otherEnd
+
+private:
+    // Returns nullptr if out of memory
+    static uint8_t* AllocateRing(size_t capacity);
+    static void FreeRing(uint8_t* ring, size_t capacity);
+
+    uint8_t* m_ring = nullptr;
+    size_t m_capacity = 0;
+
+    size_t m_head = 0; // Written up to
+    size_t m_tail = 0; // Read up to
+};
 
 class UNIXPipe final : public FsNode {
 public:
-    UNIXPipe(int end, FancyRefPtr<DataStream> stream);
+    UNIXPipe(int end, FancyRefPtr<PipeBuffer> pipe);
 
     ssize_t Read(size_t off, size_t size, uint8_t* buffer);
     ssize_t Write(size_t off, size_t size, uint8_t* buffer);
 
+    ssize_t Peek(size_t size, uint8_t* buffer, size_t& position);
+    void Consume(size_t position, size_t size);
+
+    // Supports F_GETPIPE_SZ and F_SETPIPE_SZ
+    int Ioctl(uint64_t cmd, uint64_t arg);
+
+    bool CanRead();
+    bool CanWrite();
+
     void Watch(FilesystemWatcher& watcher, int events);
     void Unwatch(FilesystemWatcher& watcher);
 
     void Close();
 
-    static void CreatePipe(UNIXPipe*& read, UNIXPipe*& write);
+    // Returns 0 on success, -ENOMEM if the pipe buffer could not be allocated
+    static int CreatePipe(UNIXPipe*& read, UNIXPipe*& write);
 protected:
+    // Wait for data and copy it out, taking it unless position is not null (see Peek)
+    ssize_t ReadData(size_t size, uint8_t* buffer, size_t* position);
+    // Wake writers and the next reader once data has been taken
+    void FinishRead();
+
+    // Signal watchers and unblock the oldest thread waiting on this end.
+    // Only one thread is unblocked as it can take all the data (or space) there is,
+    // it unblocks the next with UnblockNext if it leaves any.
+    void Wake();
+    void WakeOtherEnd();
+
+    void SignalWatchers();
+    void UnblockNext();
+
     enum {
         InvalidPipe,
         ReadEnd,
@@ -25,10 +124,10 @@ protected:
     } end = InvalidPipe;
 
     bool widowed = false;
-    UNIXPipe* otherEnd = nullptr;
+    UNIXPipe* otherEnd = nullptr; // Protected by PipeBuffer::endLock
+
+    FancyRefPtr<PipeBuffer> pipe;
 
-    FancyRefPtr<DataStream> stream;
-    
     List<FilesystemWatcher*> watching;
     lock_t watchingLock = 0;
-};
\ No newline at end of file
+};
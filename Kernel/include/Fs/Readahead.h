@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <RefPtr.h>
+
+class UNIXOpenFile;
+
+#define READAHEAD_MIN_WINDOW (16 * 1024)  // Window of the first readahead of a sequential reader
+#define READAHEAD_MAX_WINDOW (256 * 1024) // The window doubles each time it is used up to this size
+#define READAHEAD_QUEUE_SIZE 32           // Requests waiting on the readahead thread, more are dropped
+
+// Asynchronous readahead for sequential reads through open files (fs::Read on a UNIXOpenFile)
+//
+// Each open file tracks where its next read is expected (see UNIXOpenFile).
+// Once a file is read sequentially the readahead thread reads the next window of the file,
+// so the blocks are in the BlockCache by the time the reader gets to them.
+// A read that is not where the last one ended resets the window.
+// Only nodes with readahead set are read ahead, i.e. those backed by a disk.
+namespace fs::Readahead {
+
+// Start the readahead thread, files are not read ahead until it is running
+void Initialize();
+
+/////////////////////////////
+/// \brief Update the readahead state of a file after a read and queue readahead if needed
+///
+/// The dataLock of the file must be held.
+///
+/// \param offset Offset of the read
+/// \param size Amount of bytes read
+/////////////////////////////
+void Update(const FancyRefPtr<UNIXOpenFile>& handle, size_t offset, size_t size);
+
+} // namespace fs::Readahead
@@ -3,6 +3,8 @@
 #include <stdint.h>
 #include <Fs/Filesystem.h>
 #include <Fs/FsVolume.h>
+#include <Hash.h>
+#include <StringView.h>
 
 #define TAR_TYPE_FILE '0'
 #define TAR_TYPE_LINK_HARD '1'
@@ -15,6 +17,9 @@
 #define TAR_TYPE_GLOBAL_EXTENDED_HEADER 'g'
 #define TAR_TYPE_EXTENDED_HEADER 'g'
 
+#define TAR_PATH_MAX 258 // Filename prefix, separator, filename and null terminator
+#define TAR_PATH_BUCKETS 1024
+
 typedef struct {
     char name[100]; // Filename
     char mode[8]; // File mode
@@ -59,11 +64,14 @@ namespace fs::tar {
     class TarNode : public FsNode {
     public:
         char name[256];
+        char* path; // Path in the archive, nullptr for the volume
         tar_header_t* header;
 
         ino_t parentInode;
         int entryCount; // For Directories - Amount of child nodes
         ino_t* children; // For Directories - Inodes of children
+
+        TarNode() { cacheDirectoryEntries = true; } // Read only
         
         ssize_t Read(size_t, size_t, uint8_t *);
         ssize_t Write(size_t, size_t, uint8_t *);
@@ -82,8 +90,10 @@ namespace fs::tar {
 
         ino_t nextNode = 1;
 
-        int ReadDirectory(int index, ino_t parent);
-        void MakeNode(tar_header_t* header, TarNode* n, ino_t inode, ino_t parent, tar_header_t* dirHeader = nullptr);
+        // Every entry in the archive by path, built at mount and never modified after
+        HashMap<StringView, TarNode*> paths{TAR_PATH_BUCKETS};
+
+        void MakeNode(tar_header_t* header, TarNode* n, ino_t inode, ino_t parent, const char* name);
 
     public:
         TarNode* nodes;
@@ -4,14 +4,21 @@
 #include <Fs/FsVolume.h>
 
 #include <Hash.h>
+#include <Paging.h>
 #include <Spinlock.h>
 
-#define TEMP_BUFFER_CHUNK_SIZE 1024UL // Must be power of two
-static_assert((TEMP_BUFFER_CHUNK_SIZE & (TEMP_BUFFER_CHUNK_SIZE - 1)) == 0);
+#define TEMP_TABLE_SHIFT 9 // Each table of the radix tree is one page of entries
+#define TEMP_TABLE_SIZE (1UL << TEMP_TABLE_SHIFT)
 
 namespace fs::Temp{
     class TempVolume;
 
+    // Table in the radix tree holding the pages of a file
+    struct TempChunkTable {
+        uint64_t entries[TEMP_TABLE_SIZE]; // Next level tables, physical addresses of pages in the last level
+    };
+    static_assert(sizeof(TempChunkTable) == PAGE_SIZE_4K);
+
     class TempNode final : public FsNode {
         friend class TempVolume;
     protected:
@@ -24,12 +31,24 @@ namespace fs::Temp{
             };
             struct {
                 ReadWriteLock bufferLock;
-                uint8_t* buffer;
-                size_t bufferSize;
+                TempChunkTable* chunks; // Root of the radix tree, file data is kept in 4KB pages with holes left out
+                unsigned chunkLevels; // Height of the tree, it holds TEMP_TABLE_SIZE^chunkLevels pages
+                bool mapped; // Set once a page is handed to the PageCache, mappings may write past the end of the file
             };
         };
 
         TempNode* Find(const char* name);
+
+        // Get the entry in the radix tree for page index, growing the tree when allocate is set
+        uint64_t* ChunkEntry(uint64_t index, bool allocate);
+        // Physical address of page index, 0 for holes
+        uintptr_t FindChunk(uint64_t index);
+        // Physical address of page index, allocating a zeroed page for holes. 0 when out of memory
+        uintptr_t AllocateChunk(uint64_t index);
+        // Free the pages of table from first onwards, or zero them (mapped at window) if window is set
+        void TrimChunks(TempChunkTable* table, unsigned level, uint64_t first, uint8_t* window);
+        // Clear everything past the end of the file after the size has changed from oldSize
+        void Resize(size_t oldSize);
     public:
         TempNode(TempVolume* v, int flags);
         ~TempNode();
@@ -39,6 +58,9 @@ namespace fs::Temp{
 
         int Truncate(off_t length); // Truncate file
 
+        uintptr_t MemoryPage(uint64_t index, bool allocate);
+        inline bool InMemory() { return IsFile(); }
+
         int ReadDir(DirectoryEntry*, uint32_t); // Read Directory
         FsNode* FindDir(const char* name); // Find in directory
 
@@ -58,15 +80,14 @@ namespace fs::Temp{
         uint32_t nextInode = 1;
         HashMap<uint32_t, TempNode*> nodes;
         TempNode* tempMountPoint;
-        unsigned memoryUsage = 0;
+        size_t memoryUsage = 0; // Bytes of file data, updated atomically
 
-        void ReallocateNode(TempNode* node, size_t old);
     public:
 
         TempVolume(const char* name);
 
         void SetVolumeID(volume_id_t id);
 
-        inline unsigned GetMemoryUsage() { return memoryUsage; }
+        inline size_t GetMemoryUsage() { return __atomic_load_n(&memoryUsage, __ATOMIC_RELAXED); }
     };
 }
\ No newline at end of file
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Threads waiting on futexes are kept in a hash table shared by all processes, keyed by the futex.
+// Private futexes are identified by address space and virtual address,
+// futexes in shared memory by physical address so that every process mapping the memory sees the same futex.
+namespace Futex {
+
+/////////////////////////////
+/// \brief Wait on a futex of the current process
+///
+/// Blocks whilst *futex is equal to expected until the futex is woken.
+///
+/// \param shared Whether the futex may be in memory shared with other processes
+/// \param bitset Only wakes with a bitset sharing a bit with this one wake the thread
+/// \param timeout Maximum time to wait in microseconds, 0 to wait indefinitely
+///
+/// \return 0 when woken, -EAGAIN if the value was not expected, -ETIMEDOUT or -EINTR
+/////////////////////////////
+long Wait(uintptr_t futex, bool shared, int expected, uint32_t bitset, long timeout);
+
+/////////////////////////////
+/// \brief Wake threads waiting on a futex of the current process
+///
+/// \return Amount of threads woken, negative error code on failure
+/////////////////////////////
+long Wake(uintptr_t futex, bool shared, int count, uint32_t bitset);
+
+/////////////////////////////
+/// \brief Wake threads waiting on futex and move others to wait on target
+///
+/// Lets a condition variable broadcast wake one thread and move the rest to wait on the mutex
+/// instead of waking every thread only for all but one to block on the mutex again.
+///
+/// \param wakeCount Maximum amount of threads to wake
+/// \param requeueCount Maximum amount of threads to move to target
+/// \param expected When not null, fails with -EAGAIN unless *futex is equal to *expected
+///
+/// \return Amount of threads woken and moved, negative error code on failure
+/////////////////////////////
+long Requeue(uintptr_t futex, uintptr_t target, bool shared, int wakeCount, int requeueCount, const int* expected);
+
+} // namespace Futex
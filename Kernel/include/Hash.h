@@ -1,11 +1,18 @@
 #pragma once
 
 #include <stdint.h>
+
+#include <Assert.h>
+#include <Compiler.h>
 #include <List.h>
+#include <Move.h>
+#include <Spinlock.h>
+
+#define HASHMAP_MIN_CAPACITY 8
 
 static inline unsigned HashU(unsigned value){
 	unsigned hash = value;
-	
+
 	hash = ((hash >> 5) ^ hash) * 47499631;
 	hash = ((hash >> 5) ^ hash) * 47499631;
 	hash = (hash >> 5) ^ hash;
@@ -13,188 +20,230 @@ static inline unsigned HashU(unsigned value){
 	return hash;
 }
 
+// Hash of a null terminated string, every string type hashes the same so they can be looked up by each other
+unsigned HashString(const char* str);
+
 template<typename T>
 unsigned Hash(const T& value);
 
+/////////////////////////////
+/// \brief Lets a HashMap with keys of type K be searched with keys of type Q without constructing a K
+///
+/// Specialisations provide Hash(const Q&), giving the same hash as Hash<K> for equal keys,
+/// and Equals(const K&, const Q&).
+/////////////////////////////
+template<typename K, typename Q>
+struct HashKeyCompatible {};
+
+/////////////////////////////
+/// \brief Open addressing hash map
+///
+/// Entries are stored inline in a single array of slots and placed with Robin Hood hashing,
+/// so a lookup walks a short run of neighbouring slots rather than chasing list nodes.
+/// The map doubles in size once it is 7/8 full and removals shift entries back
+/// rather than leaving tombstones.
+/////////////////////////////
 template<typename K, typename T> // Key, Value
 class HashMap{
-public:
-	class KeyValuePair{
-		friend class HashMap;
-		friend class HashMapIterator;
-
-	protected:
-		T value;
+	struct Entry {
 		K key;
+		T value;
+	};
+
+	struct Slot {
+		unsigned distance; // Distance from the slot the hash points to plus one, 0 if empty
+		unsigned hash;
+		alignas(Entry) uint8_t storage[sizeof(Entry)];
 
-		KeyValuePair(K key, T value) : value(value), key(key){}
+		ALWAYS_INLINE Entry& entry() { return *reinterpret_cast<Entry*>(storage); }
 	};
 
+public:
 	class HashMapIterator {
 		friend class HashMap<K, T>;
 	protected:
 		HashMap<K, T>* map;
+		unsigned index;
 
-		unsigned bucketIndex = 0;
-		List<KeyValuePair>* bucket;
-
-		ListIterator<KeyValuePair> listIt;
+		void SkipEmpty(){
+			while(index < map->capacity && !map->slots[index].distance){
+				index++;
+			}
+		}
 	public:
 		HashMapIterator() = default;
 		HashMapIterator(const HashMapIterator&) = default;
 
 		HashMapIterator& operator++(){
-			assert(listIt != bucket->end());
-
-			listIt++;
+			assert(index < map->capacity);
 
-			if(listIt == bucket->end() && bucketIndex < map->bucketCount - 1){
-				bucket = map->buckets[++bucketIndex];
-				listIt = bucket->begin();
-			}
+			index++;
+			SkipEmpty();
 
 			return *this;
 		}
 
-		HashMapIterator& operator++(int){
-			ListIterator<KeyValuePair> v = ListIterator<KeyValuePair>(*this);
-
-			assert(listIt != bucket->end());
-
-			listIt++;
-
-			if(listIt == bucket->end() && bucketIndex < map->bucketCount - 1){
-				bucket = map->buckets[++bucketIndex];
-				listIt = bucket->begin();
-			}
+		HashMapIterator operator++(int){
+			HashMapIterator v = *this;
+			++(*this);
 
 			return v;
 		}
 
 		T& operator*(){
-			return listIt.operator*().value;
+			return map->slots[index].entry().value;
 		}
 
 		T* operator->(){
-			return &listIt.operator->()->value;
+			return &map->slots[index].entry().value;
+		}
+
+		const K& Key(){
+			return map->slots[index].entry().key;
 		}
 
 		friend bool operator==(const HashMapIterator& l, const HashMapIterator& r){
-			if(l.listIt == r.listIt){
-				return true;
-			} else {
-				return false;
-			}
+			return l.index == r.index;
 		}
 
 		friend bool operator!=(const HashMapIterator& l, const HashMapIterator& r){
-			if(l.listIt != r.listIt){
-				return true;
-			} else {
-				return false;
-			}
+			return l.index != r.index;
 		}
 	};
 
-	HashMap(){
-		buckets = new List<KeyValuePair>[bucketCount];
-		lock = 0;
-	}
+	HashMap() : HashMap(HASHMAP_MIN_CAPACITY){}
 
-	HashMap(unsigned bCount){
-		bucketCount = bCount;
+	// Sized to hold count entries before growing
+	HashMap(unsigned count){
+		capacity = HASHMAP_MIN_CAPACITY;
+		while(capacity * 7 / 8 < count){
+			capacity <<= 1;
+		}
 
-		buckets = new List<KeyValuePair>[bucketCount];
-		lock = 0;
+		slots = AllocateSlots(capacity);
 	}
 
+	HashMap(const HashMap&) = delete;
+	HashMap& operator=(const HashMap&) = delete;
+
 	void insert(K key, const T& value){
 		unsigned keyHash = Hash(key);
-		auto& bucket = buckets[keyHash % bucketCount];
 
 		acquireLock(&lock);
-		for(KeyValuePair& v : bucket){
-			if(v.key == key){ // Already exists, just replace
-				v.value = value;
+		if(long index = Lookup(key, keyHash); index >= 0){ // Already exists, just replace
+			slots[index].entry().value = value;
 
-				itemCount++;
+			releaseLock(&lock);
+			return;
+		}
 
-				releaseLock(&lock);
-				return;
-			}
+		if((itemCount + 1) * 8 > capacity * 7){
+			Grow();
 		}
 
-		bucket.add_back(KeyValuePair(key, value));
+		Place(keyHash, Entry{std::move(key), value});
+		itemCount++;
 		releaseLock(&lock);
 	}
 
 	T remove(K key){
-		auto& bucket = buckets[Hash(key) % bucketCount];
+		unsigned keyHash = Hash(key);
 
 		acquireLock(&lock);
-		for(unsigned i = 0; i < bucket.get_length(); i++){
-			if(bucket[i].key == key){
-				auto pair = bucket.remove_at(i);
+		long index = Lookup(key, keyHash);
+		if(index < 0){
+			releaseLock(&lock);
+			return T();
+		}
 
-				itemCount--;
+		T value = std::move(slots[index].entry().value);
+		RemoveAt(index);
 
-				releaseLock(&lock);
-				return pair.value;
-			}
-		}
 		releaseLock(&lock);
-
-		return T();
+		return value;
 	}
 
 	void removeValue(T value){
 		acquireLock(&lock);
-		for(unsigned b = 0; b < bucketCount; b++){
-			auto& bucket = buckets[b];
-
-			for(unsigned i = 0; i < bucket.get_length(); i++){
-				if(bucket[i].value == value){
-					bucket.remove_at(i);
-
-					itemCount--;
-					releaseLock(&lock);
-					
-					return;
-				}
+		for(unsigned i = 0; i < capacity; i++){
+			if(slots[i].distance && slots[i].entry().value == value){
+				RemoveAt(i);
+				break;
 			}
 		}
 		releaseLock(&lock);
-
-		return;
 	}
 
 	int get(const K& key, T& value){
-		auto& bucket = buckets[Hash(key) % bucketCount];
+		unsigned keyHash = Hash(key);
 
 		acquireLock(&lock);
-		for(KeyValuePair& val : bucket){
-			if(val.key == key){
-				releaseLock(&lock);
+		long index = Lookup(key, keyHash);
+		if(index >= 0){
+			value = slots[index].entry().value; // Copy before releasing the lock as the entry may get removed
+		}
+		releaseLock(&lock);
 
-				value = val.value;
-				return 1;
-			}
+		return index >= 0;
+	}
+
+	template<typename Q>
+	requires requires(const Q& q){ HashKeyCompatible<K, Q>::Hash(q); }
+	int get(const Q& key, T& value){
+		unsigned keyHash = HashKeyCompatible<K, Q>::Hash(key);
+
+		acquireLock(&lock);
+		long index = Lookup(key, keyHash);
+		if(index >= 0){
+			value = slots[index].entry().value;
 		}
 		releaseLock(&lock);
 
-		return 0;
+		return index >= 0;
 	}
 
-	int find(K key){
-		auto& bucket = buckets[Hash(key) % bucketCount];
+	// Same as get() without taking the map's lock,
+	// the caller is responsible for making sure the map is not modified whilst reading
+	int get_unlocked(const K& key, T& value){
+		long index = Lookup(key, Hash(key));
+		if(index >= 0){
+			value = slots[index].entry().value;
+		}
 
-		for(KeyValuePair& val : bucket){
-			if(val.key == key){
-				return 1;
-			}
+		return index >= 0;
+	}
+
+	template<typename Q>
+	requires requires(const Q& q){ HashKeyCompatible<K, Q>::Hash(q); }
+	int get_unlocked(const Q& key, T& value){
+		long index = Lookup(key, HashKeyCompatible<K, Q>::Hash(key));
+		if(index >= 0){
+			value = slots[index].entry().value;
 		}
 
-		return 0;
+		return index >= 0;
+	}
+
+	int find(const K& key){
+		unsigned keyHash = Hash(key);
+
+		acquireLock(&lock);
+		long index = Lookup(key, keyHash);
+		releaseLock(&lock);
+
+		return index >= 0;
+	}
+
+	template<typename Q>
+	requires requires(const Q& q){ HashKeyCompatible<K, Q>::Hash(q); }
+	int find(const Q& key){
+		unsigned keyHash = HashKeyCompatible<K, Q>::Hash(key);
+
+		acquireLock(&lock);
+		long index = Lookup(key, keyHash);
+		releaseLock(&lock);
+
+		return index >= 0;
 	}
 
 	unsigned get_length(){
@@ -204,12 +253,9 @@ public:
 	HashMapIterator begin(){
 		HashMapIterator it;
 
-		it.bucket = buckets[0];
-		it.bucketIndex = 0;
-
 		it.map = this;
-
-		it.listIt = it.bucket->begin();
+		it.index = 0;
+		it.SkipEmpty();
 
 		return it;
 	}
@@ -217,24 +263,146 @@ public:
 	HashMapIterator end(){
 		HashMapIterator it;
 
-		it.bucket = buckets[bucketCount - 1];
-		it.bucketIndex = bucketCount - 1;
-
 		it.map = this;
-
-		it.listIt = it.bucket->end();
+		it.index = capacity;
 
 		return it;
 	}
 
 	~HashMap(){
-		delete[](buckets);
+		for(unsigned i = 0; i < capacity; i++){
+			if(slots[i].distance){
+				slots[i].entry().~Entry();
+			}
+		}
+
+		delete[] slots;
 	}
 private:
-	List<KeyValuePair>* buckets;
-	unsigned bucketCount = 512;
+	static Slot* AllocateSlots(unsigned count){
+		Slot* s = new Slot[count];
+		for(unsigned i = 0; i < count; i++){
+			s[i].distance = 0;
+		}
+
+		return s;
+	}
+
+	template<typename Q>
+	ALWAYS_INLINE static bool KeyEquals(const K& key, const Q& other){
+		if constexpr(requires { HashKeyCompatible<K, Q>::Equals(key, other); }){
+			return HashKeyCompatible<K, Q>::Equals(key, other);
+		} else {
+			return key == other;
+		}
+	}
+
+	// Returns the index of the slot holding key, -1 if it is not in the map
+	template<typename Q>
+	long Lookup(const Q& key, unsigned keyHash){
+		unsigned mask = capacity - 1;
+		unsigned index = keyHash & mask;
+
+		// An entry further from its slot than the key would be cannot be passed over,
+		// so the search stops there
+		for(unsigned distance = 1;; distance++){
+			Slot& slot = slots[index];
+			if(slot.distance < distance){
+				return -1;
+			}
+
+			if(slot.hash == keyHash && KeyEquals(slot.entry().key, key)){
+				return index;
+			}
+
+			index = (index + 1) & mask;
+		}
+	}
+
+	// Entries closer to their slot give way to those further from theirs
+	void Place(unsigned keyHash, Entry&& e){
+		unsigned mask = capacity - 1;
+		unsigned index = keyHash & mask;
+		unsigned distance = 1;
+
+		Entry entry = std::move(e);
+		while(true){
+			Slot& slot = slots[index];
+			if(!slot.distance){
+				slot.distance = distance;
+				slot.hash = keyHash;
+				new (slot.storage) Entry(std::move(entry));
+				return;
+			}
+
+			if(slot.distance < distance){
+				Entry displaced = std::move(slot.entry());
+				slot.entry().~Entry();
+				new (slot.storage) Entry(std::move(entry));
+
+				entry.~Entry();
+				new (&entry) Entry(std::move(displaced));
+
+				unsigned displacedDistance = slot.distance;
+				unsigned displacedHash = slot.hash;
+				slot.distance = distance;
+				slot.hash = keyHash;
+
+				distance = displacedDistance;
+				keyHash = displacedHash;
+			}
+
+			index = (index + 1) & mask;
+			distance++;
+		}
+	}
+
+	// Shift the entries after index back a slot until one is empty or already where it hashes to
+	void RemoveAt(unsigned index){
+		unsigned mask = capacity - 1;
+
+		slots[index].entry().~Entry();
+		slots[index].distance = 0;
+		itemCount--;
+
+		unsigned next = (index + 1) & mask;
+		while(slots[next].distance > 1){
+			Slot& from = slots[next];
+			Slot& to = slots[index];
+
+			new (to.storage) Entry(std::move(from.entry()));
+			from.entry().~Entry();
+
+			to.distance = from.distance - 1;
+			to.hash = from.hash;
+			from.distance = 0;
+
+			index = next;
+			next = (next + 1) & mask;
+		}
+	}
+
+	void Grow(){
+		Slot* oldSlots = slots;
+		unsigned oldCapacity = capacity;
+
+		capacity <<= 1;
+		slots = AllocateSlots(capacity);
+
+		for(unsigned i = 0; i < oldCapacity; i++){
+			if(oldSlots[i].distance){
+				Place(oldSlots[i].hash, std::move(oldSlots[i].entry()));
+				oldSlots[i].entry().~Entry();
+			}
+		}
+
+		delete[] oldSlots;
+	}
+
+	Slot* slots;
+	unsigned capacity; // Always a power of two
 
 	unsigned itemCount = 0;
 
 	lock_t lock = 0;
-};
\ No newline at end of file
+};
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <Assert.h>
+#include <Compiler.h>
+
+#include <stdint.h>
+
+// Embedded in an object for each list it can be in
+struct IntrusiveListNode {
+    IntrusiveListNode* next = nullptr;
+    IntrusiveListNode* prev = nullptr;
+
+    ALWAYS_INLINE bool IsLinked() const { return next != nullptr; }
+};
+
+/////////////////////////////
+/// \brief Doubly linked list of objects linked through an IntrusiveListNode member
+///
+/// Unlike List, adding an object never allocates and removal is O(1) as the links live in the object.
+/// Unlike FastList, an object can be in as many lists as it has nodes.
+/// Not locked, the owner of the list is expected to hold its own lock.
+/////////////////////////////
+template <typename T, IntrusiveListNode T::*Node> class IntrusiveList final {
+public:
+    class Iterator {
+        friend class IntrusiveList;
+
+    public:
+        ALWAYS_INLINE Iterator& operator++() {
+            node = node->next;
+            return *this;
+        }
+
+        ALWAYS_INLINE T* operator*() const { return Owner(node); }
+
+        ALWAYS_INLINE friend bool operator==(const Iterator& l, const Iterator& r) { return l.node == r.node; }
+        ALWAYS_INLINE friend bool operator!=(const Iterator& l, const Iterator& r) { return l.node != r.node; }
+
+    private:
+        IntrusiveListNode* node;
+    };
+
+    IntrusiveList() { m_head.next = m_head.prev = &m_head; }
+
+    IntrusiveList(const IntrusiveList&) = delete;
+    IntrusiveList& operator=(const IntrusiveList&) = delete;
+
+    ~IntrusiveList() { clear(); }
+
+    void add_back(T* obj) { InsertBefore(&(obj->*Node), &m_head); }
+    void add_front(T* obj) { InsertBefore(&(obj->*Node), m_head.next); }
+
+    // Does nothing if obj is not in a list
+    void remove(T* obj) {
+        IntrusiveListNode* node = &(obj->*Node);
+        if (!node->IsLinked()) {
+            return;
+        }
+
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        node->next = node->prev = nullptr;
+
+        m_count--;
+    }
+
+    T* pop_front() {
+        if (!m_count) {
+            return nullptr;
+        }
+
+        T* obj = Owner(m_head.next);
+        remove(obj);
+
+        return obj;
+    }
+
+    // Unlinks everything
+    void clear() {
+        while (m_count) {
+            pop_front();
+        }
+    }
+
+    ALWAYS_INLINE T* get_front() const { return m_count ? Owner(m_head.next) : nullptr; }
+    ALWAYS_INLINE T* get_back() const { return m_count ? Owner(m_head.prev) : nullptr; }
+
+    ALWAYS_INLINE unsigned get_length() const { return m_count; }
+
+    // Removing the current object whilst iterating is not allowed
+    Iterator begin() {
+        Iterator it;
+        it.node = m_head.next;
+        return it;
+    }
+
+    Iterator end() {
+        Iterator it;
+        it.node = &m_head;
+        return it;
+    }
+
+private:
+    ALWAYS_INLINE static T* Owner(IntrusiveListNode* node) {
+        // Work back from the member to the object it is embedded in
+        uintptr_t offset = reinterpret_cast<uintptr_t>(&(reinterpret_cast<T*>(0)->*Node));
+        return reinterpret_cast<T*>(reinterpret_cast<uintptr_t>(node) - offset);
+    }
+
+    ALWAYS_INLINE void InsertBefore(IntrusiveListNode* node, IntrusiveListNode* existing) {
+        assert(!node->IsLinked());
+
+        node->next = existing;
+        node->prev = existing->prev;
+        existing->prev->next = node;
+        existing->prev = node;
+
+        m_count++;
+    }
+
+    IntrusiveListNode m_head; // Sentinel, the list is circular through it
+    unsigned m_count = 0;
+};
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <ABI/KernelData.h>
+
+class Process;
+
+/////////////////////////////
+/// \brief Read only pages mapped into user processes at KERNEL_DATA_ADDRESS
+///
+/// The first page holds the boot time clock, updated on every timer tick along with the TSC
+/// so user space can interpolate between ticks. It is the same physical page in every process.
+/// The second page holds information about the process it is mapped into (its PID).
+/// This lets libc serve clock_gettime and getpid without a system call.
+/////////////////////////////
+namespace KernelData {
+
+// Allocates the clock page, the timer must be running
+void Initialize();
+
+// Called by the timer on every tick
+void UpdateClock();
+
+// Map the pages into the address space of process before it starts running,
+// replacing those of the parent if the address space was forked
+void MapIntoProcess(Process* process);
+
+} // namespace KernelData
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <Types.h>
+
+// Compression using the LZ4 block format, used for data kept compressed in memory (e.g. swapped pages).
+// Only inputs up to LZ4_MAX_INPUT_SIZE are supported as match offsets are 16-bit.
+
+#define LZ4_MAX_INPUT_SIZE 65535
+#define LZ4_HASH_BITS 12
+
+namespace LZ4 {
+
+// Scratch space for Compress, kept by the caller so it does not need to be on the stack
+struct Workspace {
+    uint16_t table[1U << LZ4_HASH_BITS]; // Last position of each hashed sequence of 4 bytes
+};
+
+// Largest compressed size of size bytes of input
+constexpr size_t CompressBound(size_t size) { return size + size / 255 + 16; }
+
+/////////////////////////////
+/// \brief Compress a block of data
+///
+/// \param src Data to compress, at most LZ4_MAX_INPUT_SIZE bytes
+/// \param dst Buffer for the compressed data
+/// \param capacity Size of dst, compression gives up once the output would not fit
+///
+/// \return Compressed size, 0 if it does not fit in capacity
+/////////////////////////////
+size_t Compress(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity, Workspace& workspace);
+
+/////////////////////////////
+/// \brief Decompress a block compressed with Compress
+///
+/// Malformed input is detected rather than reading or writing out of bounds.
+///
+/// \return Decompressed size, -1 if the input is malformed or does not fit in capacity
+/////////////////////////////
+ssize_t Decompress(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity);
+
+} // namespace LZ4
@@ -258,6 +258,14 @@ public:
 
     __attribute__((always_inline)) inline T get_back() const { return back; }
 
+    // Move the front to the back, the list is circular so no links change
+    __attribute__((always_inline)) inline void rotate() {
+        if (front) {
+            back = front;
+            front = front->next;
+        }
+    }
+
 public:
     T front;
     T back;
@@ -427,12 +435,15 @@ public:
         if (!pos) {
             add_front(obj);
             return;
+        } else if (pos >= num) {
+            add_back(obj);
+            return;
         }
 
         acquireLock(&lock);
         ListNode<T>* current = front;
 
-        for (unsigned int i = 0; i < pos && i < num && current->next; i++)
+        for (unsigned int i = 0; i < pos && current->next; i++)
             current = current->next;
 
         ListNode<T>* node = AllocateNode();
@@ -440,7 +451,7 @@ public:
         assert(node);
 
         new (&node->obj) T(obj);
-        InsertNodeAfter(current);
+        InsertNodeBefore(node, current); // The new node takes position pos
 
         releaseLock(&lock);
     }
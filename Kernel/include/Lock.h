@@ -81,8 +81,78 @@ public:
     void Signal();
 };
 
+#define MUTEX_SPIN_COUNT 1000 // Times to try the mutex before blocking
+
+/////////////////////////////
+/// \brief Lock for sections that may block or run for a long time
+///
+/// Spins for a short while in case the owner is about to release the mutex, then blocks the thread.
+/// Must not be acquired with interrupts disabled or spinlocks held.
+/// Not recursive, the owner is tracked so recursion and unlocking from another thread are caught.
+/////////////////////////////
+class Mutex final {
+    class MutexBlocker final : public ThreadBlocker {
+    public:
+        MutexBlocker* next = nullptr;
+        MutexBlocker* prev = nullptr;
+
+        // Interrupt() only wakes the thread, it removes itself from the waiters
+
+        inline bool WasRemoved() const { return removed; }
+    };
+
+public:
+    ALWAYS_INLINE Mutex() {}
+
+    Mutex(const Mutex&) = delete;
+    Mutex& operator=(const Mutex&) = delete;
+
+    ALWAYS_INLINE void Lock(){
+        if(!TryLock()){
+            LockSlow();
+        }
+    }
+
+    // Returns true if the mutex was acquired
+    ALWAYS_INLINE bool TryLock(){
+        Thread* expected = nullptr;
+        return __atomic_compare_exchange_n(&m_owner, &expected, CurrentOwner(), false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+    }
+
+    void Unlock();
+
+    ALWAYS_INLINE bool IsLocked() const { return __atomic_load_n(&m_owner, __ATOMIC_RELAXED); }
+    ALWAYS_INLINE bool IsHeldByCurrentThread() const { return __atomic_load_n(&m_owner, __ATOMIC_RELAXED) == CurrentOwner(); }
+
+private:
+    // Before the scheduler starts there is no thread to own the mutex
+    static ALWAYS_INLINE Thread* CurrentOwner(){
+        Thread* thread = Thread::Current();
+        return thread ? thread : reinterpret_cast<Thread*>(1);
+    }
+
+    void LockSlow();
+
+    Thread* m_owner = nullptr;
+    unsigned m_waiterCount = 0; // Threads trying to block, checked by Unlock() without taking m_waitersLock
+
+    lock_t m_waitersLock = 0;
+    FastList<MutexBlocker*> m_waiters;
+};
+
+class ScopedMutexLock final {
+public:
+    ALWAYS_INLINE ScopedMutexLock(Mutex& mutex) : m_mutex(mutex) { m_mutex.Lock(); }
+    ALWAYS_INLINE ~ScopedMutexLock() { m_mutex.Unlock(); }
+
+private:
+    Mutex& m_mutex;
+};
+
 class ReadWriteLock {
     unsigned activeReaders = 0;
+    // Plain spinlocks rather than ticket locks, the locks are waited on and held by preemptible threads
+    // (often across blocking I/O) and a preempted thread holding a ticket would hold up every waiter behind it
     lock_t fileLock = 0;
     lock_t lock = 0;
 
@@ -123,6 +193,36 @@ public:
         return false;
     }
 
+    // Returns true if the lock could not be acquired straight away
+    ALWAYS_INLINE bool TryAcquireRead(){
+        if(acquireTestLock(&lock)){
+            return true;
+        }
+
+        if(__atomic_add_fetch(&activeReaders, 1, __ATOMIC_ACQUIRE) == 1 && acquireTestLock(&fileLock)){
+            __atomic_sub_fetch(&activeReaders, 1, __ATOMIC_RELEASE);
+            releaseLock(&lock);
+            return true;
+        }
+
+        releaseLock(&lock);
+        return false;
+    }
+
+    // Unlike TryAcquireWrite nothing is left held on failure, for callers that give up rather than retry
+    ALWAYS_INLINE bool TryAcquireWriteOnce(){
+        if(acquireTestLock(&lock)){
+            return true;
+        }
+
+        if(acquireTestLock(&fileLock)){
+            releaseLock(&lock);
+            return true;
+        }
+
+        return false;
+    }
+
     ALWAYS_INLINE void ReleaseRead(){
         if(__atomic_sub_fetch(&activeReaders, 1, __ATOMIC_RELEASE) == 0){
             releaseLock(&fileLock);
@@ -135,6 +235,11 @@ public:
     }
 
     ALWAYS_INLINE bool IsWriteLocked() const { return lock && activeReaders == 0; }
+
+    // fileLock is held by writers and the readers as a group, lock only whilst a thread is let in
+    ALWAYS_INLINE void RegisterStatistics(const char* name){
+        RegisterLockStatistics(&fileLock, name);
+    }
 };
 
 using FilesystemLock = ReadWriteLock;
\ No newline at end of file
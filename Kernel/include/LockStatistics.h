@@ -0,0 +1,49 @@
+#pragma once
+
+#include <Compiler.h>
+#include <stdint.h>
+
+// Count acquisitions, contention, spin time and hold time of locks registered with RegisterLockStatistics(),
+// readable from /dev/lockstat. Locks are identified by their address so any kind of lock can be registered.
+//#define LOCK_STATISTICS
+
+//#define LOCK_STATISTICS_MAX_LOCKS 256 // Must be a power of two
+
+#ifdef LOCK_STATISTICS
+
+// Counters of a registered lock, only changed whilst the lock is held.
+// Times are in TSC cycles.
+struct LockStatistics {
+    const volatile void* lock;
+    const char* name;
+
+    uint64_t acquisitions;
+    uint64_t contended; // Acquisitions that had to spin
+    uint64_t spinCycles;
+    uint64_t holdCycles;
+    uint64_t maxHoldCycles;
+
+    uint64_t acquiredAt; // When the current holder got the lock, 0 if unknown
+};
+
+/////////////////////////////
+/// \brief Start keeping statistics for a lock
+///
+/// \param name Name shown in /dev/lockstat, must stay valid, several locks may share a name
+/////////////////////////////
+void RegisterLockStatistics(const volatile void* lock, const char* name);
+
+// Statistics of a lock, nullptr if it is not registered
+LockStatistics* FindLockStatistics(const volatile void* lock);
+
+void LockStatisticsAcquired(const volatile void* lock, uint64_t spinCycles);
+void LockStatisticsReleased(const volatile void* lock);
+
+#else
+
+ALWAYS_INLINE static void RegisterLockStatistics(const volatile void*, const char*) {}
+
+#endif
+
+// Creates /dev/lockstat when built with LOCK_STATISTICS
+void InitializeLockStatistics();
@@ -5,12 +5,27 @@
 
 #include <Debug.h>
 
+#define LOG_MAX_CPUS 64 // CPUs past this write directly
+#define LOG_CPU_BUFFER_SIZE 16384 // Must be a power of two, messages are dropped when full
+#define LOG_DRAIN_INTERVAL 10000 // Microseconds the drain thread sleeps when there is nothing to write
+
 namespace Log{
     extern VideoConsole* console;
 
     void LateInitialize();
     void SetVideoConsole(VideoConsole* con);
 
+    /////////////////////////////
+    /// \brief Stop writing log messages directly
+    ///
+    /// Messages are written to a ring buffer of the CPU they were logged on,
+    /// then written to serial, the console and /dev/kernellog by a drain thread.
+    /// Needs the scheduler and every CPU to be running.
+    /////////////////////////////
+    void StartDrainThread();
+    // Write everything still in the CPU buffers and go back to writing directly
+    void FlushForPanic();
+
     void DisableBuffer();
     void EnableBuffer();
 
@@ -32,14 +47,14 @@ namespace Log{
     //void Info(const char* str);
     void Info(unsigned long long num, bool hex = true);
     void Info(const char* __restrict fmt, ...);
+    void InfoF(const char* __restrict fmt, va_list args);
 
     #ifdef KERNEL_DEBUG
     __attribute__((always_inline)) inline static void Debug(const int& var, const int lvl, const char* __restrict fmt, ...){
         if(var >= lvl){
-		    Write("\r\n[INFO]    ");
             va_list args;
             va_start(args, fmt);
-            WriteF(fmt, args);
+            InfoF(fmt, args);
             va_end(args);
         }
     }
@@ -6,6 +6,9 @@
 #include <RefPtr.h>
 #include <Vector.h>
 
+#include <bits/posix/iovec.h>
+
+#include <MM/RegionTree.h>
 #include <MM/VMObject.h>
 
 class AddressSpace final {
@@ -50,6 +53,15 @@ public:
     /////////////////////////////
     bool RangeInRegion(uintptr_t base, size_t size);
 
+    /////////////////////////////
+    /// \brief Check if every buffer of an iovec array is in a valid region
+    ///
+    /// Same as calling RangeInRegion for each buffer, without locking the address space for each one.
+    ///
+    /// \return True if every buffer is valid
+    /////////////////////////////
+    bool RangesInRegion(const iovec* iov, size_t count);
+
     /////////////////////////////
     /// \brief Unmap a region object
     ///
@@ -65,7 +77,25 @@ public:
 
     long UnmapMemory(uintptr_t base, size_t size);
 
-    size_t UsedPhysicalMemory() const;
+    /////////////////////////////
+    /// \brief Swap out memory that has not been accessed recently
+    ///
+    /// Carries on from the region looked at last time. Nothing is waited on,
+    /// the address space or regions are skipped if they are locked.
+    ///
+    /// \param maxPages Most pages to swap out
+    ///
+    /// \return Amount of pages swapped out
+    /////////////////////////////
+    unsigned SwapOut(unsigned maxPages);
+
+    // Memory mapped into the address space (resident set), in bytes
+    ALWAYS_INLINE size_t UsedPhysicalMemory() const { return m_pageMap->residentPages << PAGE_SHIFT_4K; }
+    // Resident memory in shared mappings, in bytes
+    ALWAYS_INLINE size_t SharedPhysicalMemory() const { return m_pageMap->sharedPages << PAGE_SHIFT_4K; }
+    // Resident memory shared copy on write, in bytes
+    ALWAYS_INLINE size_t CopyOnWritePhysicalMemory() const { return m_pageMap->cowPages << PAGE_SHIFT_4K; }
+
     void DumpRegions();
 
     ALWAYS_INLINE PageMap* GetPageMap() { return m_pageMap; }
@@ -75,6 +105,7 @@ public:
 protected:
     MappedRegion* FindAvailableRegion(size_t size);
     MappedRegion* AllocateRegionAt(uintptr_t base, size_t size);
+    bool RangeInRegionUnlocked(uintptr_t base, size_t size);
 
     ALWAYS_INLINE bool IsKernel() const { return this == m_kernel; }
 
@@ -86,7 +117,9 @@ protected:
     lock_t m_lock = 0;
 
     PageMap* m_pageMap = nullptr;
-    List<MappedRegion> m_regions;
+    RegionTree m_regions;
 
     AddressSpace* m_parent = nullptr;
+
+    uintptr_t m_swapHand = 0; // End of the region last swapped out from
 };
@@ -5,3 +5,6 @@
 void* kmalloc(size_t);
 void kfree(void*);
 void* krealloc(void*, size_t);
+
+// Creates /dev/kheapprof when built with KERNEL_HEAP_PROFILE (see Debug.h)
+void InitializeHeapProfiler();
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <CPU.h>
+#include <Compiler.h>
+#include <Spinlock.h>
+
+#define OBJECT_CACHE_MAX_CPUS 64       // CPUs past this only use the shared depot
+#define OBJECT_CACHE_DEFAULT_PER_CPU 16 // Objects kept by each CPU
+
+// Cache of constructed objects of type T for objects that are allocated and freed often.
+//
+// Objects given back with Free() are kept as they are (not destroyed) and handed out again by Allocate(),
+// the user resets whatever state it needs. Each CPU has a small stack of free objects used with
+// interrupts disabled, objects move between it and a shared depot in batches so objects freed
+// on one CPU and allocated on another (e.g. packets received in an IRQ and freed by the network thread)
+// are still reused. Only when both are empty or full is kmalloc used.
+template <typename T, unsigned perCPU = OBJECT_CACHE_DEFAULT_PER_CPU> class ObjectCache final {
+    static_assert(perCPU >= 2);
+
+    // Free objects of a CPU, allocated the first time the CPU uses the cache
+    struct Magazine {
+        unsigned count = 0;
+        T* objects[perCPU];
+
+        uint64_t hits = 0; // Allocations served from the magazine
+        uint64_t frees = 0;
+    };
+
+public:
+    struct Statistics {
+        uint64_t hits;   // Allocations given a cached object
+        uint64_t misses; // Allocations that had to construct a new object
+        uint64_t frees;
+        uint64_t destroyed; // Objects freed whilst the cache was full
+        size_t cached;      // Objects currently held in the depot
+    };
+
+    /////////////////////////////
+    /// \param depotSize Maximum amount of objects kept in the shared depot
+    /////////////////////////////
+    explicit ObjectCache(size_t depotSize = perCPU * 4) : m_depotSize(depotSize) {}
+
+    ObjectCache(const ObjectCache&) = delete;
+    ObjectCache& operator=(const ObjectCache&) = delete;
+
+    ~ObjectCache() {
+        for (Magazine* mag : m_magazines) {
+            if (mag) {
+                while (mag->count) {
+                    delete mag->objects[--mag->count];
+                }
+                delete mag;
+            }
+        }
+
+        while (m_depotCount) {
+            delete m_depot[--m_depotCount];
+        }
+        delete[] m_depot;
+    }
+
+    // Get a cached object, or a new default constructed object if there are none
+    T* Allocate() {
+        InterruptDisabler disableInterrupts;
+
+        Magazine* mag = GetMagazine();
+        if (mag) {
+            if (__builtin_expect(!mag->count, 0)) {
+                Exchange(mag, false);
+            }
+
+            if (mag->count) {
+                mag->hits++;
+                return mag->objects[--mag->count];
+            }
+        } else if (T* obj = TakeFromDepot()) {
+            __atomic_add_fetch(&m_depotHits, 1, __ATOMIC_RELAXED);
+            return obj;
+        }
+
+        __atomic_add_fetch(&m_misses, 1, __ATOMIC_RELAXED);
+        return new T();
+    }
+
+    // Give an object back to the cache, it is destroyed if the cache is full
+    void Free(T* obj) {
+        InterruptDisabler disableInterrupts;
+
+        Magazine* mag = GetMagazine();
+        if (__builtin_expect(mag && mag->count >= perCPU, 0)) {
+            Exchange(mag, true);
+        }
+
+        if (mag && mag->count < perCPU) {
+            mag->frees++;
+            mag->objects[mag->count++] = obj;
+            return;
+        }
+
+        if (!GiveToDepot(obj)) {
+            __atomic_add_fetch(&m_destroyed, 1, __ATOMIC_RELAXED);
+            delete obj;
+        }
+    }
+
+    // Add count new objects to the depot so they are ready before they are first needed
+    void Fill(size_t count) {
+        while (count--) {
+            T* obj = new T();
+            if (!GiveToDepot(obj)) {
+                delete obj;
+                break;
+            }
+        }
+    }
+
+    Statistics GetStatistics() const {
+        Statistics stats = {
+            .hits = m_depotHits,
+            .misses = m_misses,
+            .frees = 0,
+            .destroyed = m_destroyed,
+            .cached = m_depotCount,
+        };
+
+        for (Magazine* mag : m_magazines) {
+            if (mag) {
+                stats.hits += mag->hits;
+                stats.frees += mag->frees;
+            }
+        }
+
+        return stats;
+    }
+
+private:
+    // Interrupts must be disabled
+    ALWAYS_INLINE Magazine* GetMagazine() {
+        unsigned id = GetCPULocal()->id;
+        if (id >= OBJECT_CACHE_MAX_CPUS) {
+            return nullptr;
+        }
+
+        if (__builtin_expect(!m_magazines[id], 0)) {
+            m_magazines[id] = new Magazine();
+        }
+        return m_magazines[id];
+    }
+
+    // Move half a magazine to (full is true) or from the depot, interrupts must be disabled
+    void Exchange(Magazine* mag, bool full) {
+        ScopedSpinLock lockDepot(m_depotLock);
+        if (!m_depot) {
+            m_depot = new T*[m_depotSize];
+        }
+
+        for (unsigned i = 0; i < perCPU / 2; i++) {
+            if (full) {
+                if (m_depotCount >= m_depotSize) {
+                    break;
+                }
+                m_depot[m_depotCount++] = mag->objects[--mag->count];
+            } else {
+                if (!m_depotCount) {
+                    break;
+                }
+                mag->objects[mag->count++] = m_depot[--m_depotCount];
+            }
+        }
+    }
+
+    T* TakeFromDepot() {
+        ScopedSpinLock lockDepot(m_depotLock);
+        return m_depotCount ? m_depot[--m_depotCount] : nullptr;
+    }
+
+    bool GiveToDepot(T* obj) {
+        InterruptDisabler disableInterrupts;
+        ScopedSpinLock lockDepot(m_depotLock);
+        if (!m_depot) {
+            m_depot = new T*[m_depotSize];
+        }
+
+        if (m_depotCount >= m_depotSize) {
+            return false;
+        }
+
+        m_depot[m_depotCount++] = obj;
+        return true;
+    }
+
+    Magazine* m_magazines[OBJECT_CACHE_MAX_CPUS] = {};
+
+    lock_t m_depotLock = 0;
+    T** m_depot = nullptr;
+    size_t m_depotSize;
+    size_t m_depotCount = 0;
+
+    uint64_t m_depotHits = 0; // Allocations from CPUs without a magazine
+    uint64_t m_misses = 0;
+    uint64_t m_destroyed = 0;
+};
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Reclaim starts when free memory drops below the low watermark
+// and carries on in the background until the high watermark is reached
+#define RECLAIM_LOW_WATERMARK_DIVISOR 64 // 1/64th of physical memory
+#define RECLAIM_LOW_WATERMARK_MIN 256    // 1MB
+#define RECLAIM_BATCH_SIZE (1024 * 1024)
+// Reclaim passes an allocation waits for before giving up
+#define RECLAIM_WAIT_ATTEMPTS 16
+
+namespace Memory {
+
+// Holds memory that can be given back when physical memory is running low (e.g. caches)
+class Reclaimer {
+public:
+    virtual ~Reclaimer() = default;
+
+    /////////////////////////////
+    /// \brief Free up to bytes of memory, least recently used first
+    ///
+    /// May be called by a thread whose allocation failed (with interrupts disabled),
+    /// so it must not block. Locks that the caller could be holding should be taken with acquireTestLock
+    /// and skipped if they are held.
+    ///
+    /// \return Amount of memory freed in bytes
+    /////////////////////////////
+    virtual size_t Reclaim(size_t bytes) = 0;
+};
+
+struct ReclaimStatistics {
+    uint64_t wakeups = 0;        // Times the reclaim thread was woken by the low watermark
+    uint64_t directReclaims = 0; // Times an allocation had to reclaim memory itself
+    uint64_t bytesReclaimed = 0;
+};
+
+void RegisterReclaimer(Reclaimer* reclaimer);
+void UnregisterReclaimer(Reclaimer* reclaimer);
+
+// Set the watermarks and start the reclaim thread
+void InitializeReclaimer();
+
+/////////////////////////////
+/// \brief Ask reclaimers to free up to bytes of memory
+///
+/// \param bytes Amount of memory to free
+/// \param direct Whether an allocation is waiting on the memory (as opposed to the reclaim thread)
+///
+/// \return Amount of memory freed in bytes
+/////////////////////////////
+size_t ReclaimMemory(size_t bytes, bool direct = false);
+
+// Wake the reclaim thread if free memory is below the low watermark,
+// used by the physical allocator so must not allocate
+void CheckMemoryPressure();
+
+// Whether free memory is below the low watermark
+bool IsMemoryLow();
+
+/////////////////////////////
+/// \brief Wait for the reclaim thread to finish a pass, for an allocation that has run out of memory
+///
+/// Swapping out memory is left to the reclaim thread, so allocations that can block
+/// wait for it rather than failing. Interrupts are enabled whilst waiting.
+///
+/// \return Whether memory may have been freed, false if the caller should give up
+/////////////////////////////
+bool WaitForReclaim();
+
+const ReclaimStatistics& GetReclaimStatistics();
+
+} // namespace Memory
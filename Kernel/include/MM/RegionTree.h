@@ -0,0 +1,127 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <Compiler.h>
+#include <MM/VMObject.h>
+
+// Balanced (AVL) tree of non-overlapping regions ordered by base address.
+// Each node also keeps the largest free gap between regions in its subtree
+// so free space can be found without walking every region.
+class RegionTree {
+    struct Node {
+        MappedRegion region; // Must stay first so a MappedRegion* can be turned back into its Node*
+
+        Node* parent = nullptr;
+        Node* left = nullptr;
+        Node* right = nullptr;
+        int height = 1;
+
+        uintptr_t gap = 0;    // Free space between this region and the previous one (or 0 for the first region)
+        uintptr_t maxGap = 0; // Largest gap within this subtree
+
+        ALWAYS_INLINE Node(MappedRegion&& r) : region(std::move(r)) {}
+    };
+
+public:
+    class Iterator {
+        friend class RegionTree;
+
+    public:
+        ALWAYS_INLINE MappedRegion& operator*() { return m_node->region; }
+        ALWAYS_INLINE MappedRegion* operator->() { return &m_node->region; }
+
+        ALWAYS_INLINE Iterator& operator++() {
+            m_node = NextNode(m_node);
+            return *this;
+        }
+
+        ALWAYS_INLINE Iterator operator++(int) {
+            Iterator it = *this;
+            m_node = NextNode(m_node);
+            return it;
+        }
+
+        ALWAYS_INLINE friend bool operator==(const Iterator& l, const Iterator& r) { return l.m_node == r.m_node; }
+        ALWAYS_INLINE friend bool operator!=(const Iterator& l, const Iterator& r) { return l.m_node != r.m_node; }
+
+    private:
+        ALWAYS_INLINE Iterator(Node* node) : m_node(node) {}
+
+        Node* m_node;
+    };
+
+    RegionTree() = default;
+    ALWAYS_INLINE ~RegionTree() { clear(); }
+
+    RegionTree(const RegionTree&) = delete;
+    RegionTree& operator=(const RegionTree&) = delete;
+
+    /////////////////////////////
+    /// \brief Find the region containing address
+    ///
+    /// \return Region on success, nullptr if no region contains address
+    /////////////////////////////
+    MappedRegion* find(uintptr_t address);
+
+    /////////////////////////////
+    /// \brief Find the first region that ends after address
+    ///
+    /// \return Region on success, nullptr if there are no regions past address
+    /////////////////////////////
+    MappedRegion* lower_bound(uintptr_t address);
+
+    /////////////////////////////
+    /// \brief Insert a region, it must not overlap any existing regions
+    ///
+    /// \return Pointer to the inserted region, which stays valid until it is removed
+    /////////////////////////////
+    MappedRegion* insert(MappedRegion&& region);
+
+    /////////////////////////////
+    /// \brief Remove and destroy a region previously returned by the tree
+    /////////////////////////////
+    void remove(MappedRegion* region);
+
+    /////////////////////////////
+    /// \brief Find the lowest free range of size bytes
+    ///
+    /// \param size Size of the range
+    /// \param alignment Alignment of the range base, must be a power of two
+    /// \param start Lowest address of the range
+    /// \param end Address that the range must end at or below
+    ///
+    /// \return Base of the range on success, 0 if there is no space
+    /////////////////////////////
+    uintptr_t find_gap(size_t size, uintptr_t alignment, uintptr_t start, uintptr_t end) const;
+
+    void clear();
+
+    ALWAYS_INLINE unsigned get_length() const { return m_count; }
+
+    ALWAYS_INLINE Iterator begin() const { return Iterator(FirstNode(m_root)); }
+    ALWAYS_INLINE Iterator end() const { return Iterator(nullptr); }
+
+private:
+    ALWAYS_INLINE static Node* NodeOf(MappedRegion* region) { return reinterpret_cast<Node*>(region); }
+
+    ALWAYS_INLINE static int Height(const Node* node) { return node ? node->height : 0; }
+    ALWAYS_INLINE static uintptr_t MaxGap(const Node* node) { return node ? node->maxGap : 0; }
+    static void Update(Node* node);
+
+    static Node* FirstNode(Node* node);
+    static Node* LastNode(Node* node);
+    static Node* NextNode(Node* node);
+    static Node* PrevNode(Node* node);
+
+    static uintptr_t SearchGap(const Node* node, size_t size, uintptr_t alignment, uintptr_t start);
+
+    void Replace(Node* parent, Node* old, Node* node);
+    Node* RotateLeft(Node* node);
+    Node* RotateRight(Node* node);
+    void Retrace(Node* node);
+
+    Node* m_root = nullptr;
+    unsigned m_count = 0;
+};
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <Compiler.h>
+
+class PartitionDevice;
+
+// Blocks of a PhysicalVMObject with this bit set have been swapped out,
+// the rest of the block is the swap slot holding the page
+#define SWAP_ENTRY_BIT 0x80000000U
+#define SWAP_MAX_SLOTS (1U << 24) // 64GB of swapped out pages
+
+// Pages compressing to more than this are left in memory
+#define SWAP_MAX_COMPRESSED_SIZE 3072
+// The compressed pool uses at most 1/SWAP_POOL_DIVISOR of physical memory
+#define SWAP_POOL_DIVISOR 4
+// Blocks looked at in an address space before moving on to the next process
+#define SWAP_SCAN_BATCH 1024
+
+namespace Memory {
+
+struct SwapStatistics {
+    uint64_t swappedPages = 0;    // Pages currently swapped out, including zero filled pages
+    uint64_t zeroPages = 0;       // Swapped out pages that were zero filled and take no space
+    uint64_t poolPages = 0;       // Physical pages used by the compressed pool
+    uint64_t compressedBytes = 0; // Compressed data in the pool
+    uint64_t diskPages = 0;       // Swapped out pages written to the swap partition
+    uint64_t diskTotal = 0;       // Pages available in the swap partition
+    uint64_t swapOuts = 0;
+    uint64_t swapIns = 0;
+    uint64_t incompressible = 0; // Pages left in memory as they did not compress
+};
+
+ALWAYS_INLINE bool IsSwapEntry(uint32_t block) { return block & SWAP_ENTRY_BIT; }
+
+// Size the compressed pool and start the thread writing it out to the swap partition
+void InitializeSwap();
+
+// Whether swap partitions may be used, set with swap on the kernel command line
+extern bool swapPartitionsEnabled;
+
+/////////////////////////////
+/// \brief Write the compressed pool out to part once it fills up
+///
+/// Only used if swapPartitionsEnabled is set and page 0 of the partition is an mkswap header,
+/// only the first such partition is used.
+/////////////////////////////
+void AddSwapPartition(PartitionDevice* part);
+
+/////////////////////////////
+/// \brief Swap out anonymous memory that has not been accessed recently
+///
+/// Processes are visited in turn, pages accessed since the last visit get another chance.
+/// Only called by the reclaim thread, once the caches have nothing left to give back.
+///
+/// \return Amount of memory freed in bytes
+/////////////////////////////
+size_t SwapOut(size_t bytes);
+
+/////////////////////////////
+/// \brief Store a page in swap
+///
+/// On success the swap owns phys, it is freed (or reused for the compressed pool).
+///
+/// \return Swap entry (with SWAP_ENTRY_BIT set), 0 if the page did not compress or the pool is full
+/////////////////////////////
+uint32_t SwapStore(uintptr_t phys);
+
+/////////////////////////////
+/// \brief Read a swapped out page into phys
+///
+/// The caller keeps its reference to entry, drop it with SwapFree once phys is in use.
+/// May block whilst the page is read from the swap partition.
+///
+/// \return 0 on success, -EIO if the page could not be read
+/////////////////////////////
+int SwapIn(uint32_t entry, uintptr_t phys);
+
+// Add a reference to a swapped out page (e.g. when forked)
+void SwapDuplicate(uint32_t entry);
+// Drop a reference to a swapped out page, freeing it when there are none left
+void SwapFree(uint32_t entry);
+
+// Whether the compressed pool cannot take any more pages
+bool SwapPoolFull();
+
+const SwapStatistics& GetSwapStatistics();
+
+} // namespace Memory
@@ -10,6 +10,12 @@
 
 #define PHYS_BLOCK_MAX (0xffffffff << PAGE_SHIFT_4K)
 
+#define VMOBJECT_FAULT_AROUND_DEFAULT 16 // 64KB
+#define VMOBJECT_FAULT_AROUND_MAX 64
+
+class PageCache;
+class UNIXOpenFile;
+
 class VMObject {
     friend class AddressSpace;
     friend void ::Memory::PageFaultHandler(void*, struct RegisterContext*);
@@ -18,14 +24,32 @@ public:
     virtual ~VMObject() = default;
 
     virtual int Hit(uintptr_t base, uintptr_t offset, PageMap* pMap);
+    // Write to a copy on write object that is only referenced by one address space
+    virtual int CopyOnWriteHit(uintptr_t base, uintptr_t offset, PageMap* pMap);
     virtual void MapAllocatedBlocks(uintptr_t base, PageMap* pMap) = 0;
 
     virtual VMObject* Clone() = 0;
+    // Create a copy on write copy of the object for a forked address space, where blocks are
+    // only copied when written. Returns nullptr if the object has to be shared copy on write as a whole.
+    virtual VMObject* Fork() { return nullptr; }
     virtual VMObject* Split(uintptr_t offset);
 
     ALWAYS_INLINE size_t Size() const { return size; }
     virtual size_t UsedPhysicalMemory() const { return 0; }
 
+    /////////////////////////////
+    /// \brief Swap out blocks that have not been accessed since they were last looked at
+    ///
+    /// The region mapping the object must be write locked.
+    ///
+    /// \param base Base of the region mapping the object
+    /// \param maxPages Most pages to swap out
+    /// \param scanBudget Blocks left to look at, reduced by the blocks looked at
+    ///
+    /// \return Amount of pages swapped out
+    /////////////////////////////
+    virtual unsigned SwapOut(uintptr_t, PageMap*, unsigned, unsigned&) { return 0; }
+
     ALWAYS_INLINE bool IsAnonymous() const { return anonymous; }
     ALWAYS_INLINE bool IsShared() const { return shared; }
     ALWAYS_INLINE bool IsCopyOnWrite() const { return copyOnWrite; }
@@ -34,6 +58,11 @@ public:
     ALWAYS_INLINE virtual bool CanMunmap() const { return false; }
     ALWAYS_INLINE size_t ReferenceCount() const { return refCount; }
 protected:
+    // Software page flags telling the page map how the object's pages are shared
+    ALWAYS_INLINE uint64_t SharingPageFlags() const {
+        return (shared ? PAGE_SHARED : 0) | (copyOnWrite ? PAGE_COPY_ON_WRITE : 0);
+    }
+
     size_t size;
 
     size_t refCount = 0; // References to the VM object
@@ -51,15 +80,47 @@ public:
     virtual ~PhysicalVMObject();
 
     int Hit(uintptr_t base, uintptr_t offset, PageMap* pMap) final;
+    int CopyOnWriteHit(uintptr_t base, uintptr_t offset, PageMap* pMap) final;
     void ForceAllocate(); // Force allocate all blocks
     virtual void MapAllocatedBlocks(uintptr_t base, PageMap* pMap);
 
     virtual VMObject* Clone();
+    virtual VMObject* Fork();
 
     virtual size_t UsedPhysicalMemory() const;
 
+    unsigned SwapOut(uintptr_t base, PageMap* pMap, unsigned maxPages, unsigned& scanBudget) override;
+
+    // Amount of blocks (power of two, at most VMOBJECT_FAULT_AROUND_MAX) allocated around
+    // a faulting block of an anonymous object, 1 disables fault-around. Set with faultaround= on boot.
+    static unsigned faultAroundPages;
+
 protected:
+    // Copy on write copy of parent, sharing all of its blocks
+    explicit PhysicalVMObject(PhysicalVMObject* parent);
+
+    // Allocate, zero and (if pMap is not null) map any unallocated blocks in [first, first + count)
+    int AllocateBlocks(unsigned first, unsigned count, uintptr_t base, PageMap* pMap);
+    // Allocate a 2MB physically contiguous run for the (unallocated) blocks [first, first + 512),
+    // zero it and (if pMap is not null) map it with a 2MB page
+    int AllocateLargeBlock(unsigned first, uintptr_t base, PageMap* pMap);
+    // Allocate and zero any unallocated blocks in [first, end) without mapping them,
+    // returns 1 if any could not be allocated
+    int AllocateRange(unsigned first, unsigned end);
+    // Whether blocks [first, first + 512) are one 2MB aligned physically contiguous run
+    bool IsLargeBlock(unsigned first) const;
+    // Read a swapped out block back in and map it
+    int SwapInBlock(unsigned index, uintptr_t base, PageMap* pMap);
+    // Store the blocks in victims (already unmapped) in swap, remapping any that could not be stored
+    unsigned SwapOutBlocks(const unsigned* victims, unsigned count, uintptr_t base, PageMap* pMap);
+    // Move cowScan past blocks no longer shared with another object,
+    // stops being copy on write once there are none left. blockLock must be held
+    void UpdateCopyOnWrite();
+
     uint32_t* physicalBlocks = nullptr; // A bit of an optimization, since one physical block is 4KB, we can shift by 12
+    lock_t blockLock = 0; // Held whilst copy on write blocks are shared or replaced, or blocks are swapped out
+    unsigned swapHand = 0; // Block to look at next when swapping out
+    unsigned cowScan = 0; // Blocks before this are no longer shared copy on write, protected by blockLock
 };
 
 class ProcessImageVMObject final : public PhysicalVMObject {
@@ -67,7 +128,10 @@ public:
     ProcessImageVMObject(uintptr_t base, size_t size, bool write);
 
     void MapAllocatedBlocks(uintptr_t base, PageMap* pMap);
+    VMObject* Fork();
 protected:
+    explicit ProcessImageVMObject(ProcessImageVMObject* parent);
+
     bool write : 1 = true;
 
     uintptr_t base;
@@ -81,6 +145,44 @@ class AnonymousVMObject : public PhysicalVMObject{
     ALWAYS_INLINE bool CanMunmap() const override { return true; }
 };
 
+// VMObject mapping a file through its page cache, pages are read from the file when first touched.
+// Shared mappings map the cache pages writable and are written back to the file,
+// private mappings map them read only and copy a page the first time it is written.
+class FileVMObject final : public VMObject {
+public:
+    /////////////////////////////
+    /// \brief Map part of a file
+    ///
+    /// \param file Open file to map, kept open whilst the object exists
+    /// \param offset Offset into the file, must be page aligned
+    /// \param size Size of the mapping, must be page aligned
+    /// \param shared Whether writes should be shared and written back to the file
+    /////////////////////////////
+    FileVMObject(FancyRefPtr<UNIXOpenFile> file, size_t offset, size_t size, bool shared);
+    ~FileVMObject();
+
+    int Hit(uintptr_t base, uintptr_t offset, PageMap* pMap) override;
+    int CopyOnWriteHit(uintptr_t base, uintptr_t offset, PageMap* pMap) override;
+    void MapAllocatedBlocks(uintptr_t base, PageMap* pMap) override;
+
+    VMObject* Clone() override;
+
+    size_t UsedPhysicalMemory() const override;
+
+    // Write pages written through shared mappings back to the file
+    int Sync();
+
+private:
+    FileVMObject(const FileVMObject& other);
+
+    FancyRefPtr<UNIXOpenFile> m_file;
+    PageCache* m_cache;
+    uint64_t m_firstPage; // Page of the file at the start of the object
+
+    lock_t m_blockLock = 0;
+    uint32_t* m_privateBlocks = nullptr; // Pages of a private mapping that have been written, 0 if unwritten
+};
+
 struct MappedRegion {
     uintptr_t base;
     size_t size;
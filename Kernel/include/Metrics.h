@@ -0,0 +1,26 @@
+#pragma once
+
+#include <ABI/Metrics.h>
+
+#include <stdint.h>
+
+class Process;
+
+/////////////////////////////
+/// \brief System metrics in read only pages shared with user space
+///
+/// A kernel thread snapshots CPU time, memory use and the statistics of each process
+/// every METRICS_UPDATE_INTERVAL_US whilst the pages are mapped by anyone.
+/// Snapshots are built aside and copied in under a sequence count,
+/// so monitors read a consistent snapshot at any refresh rate without a system call.
+/////////////////////////////
+namespace Metrics {
+
+// Allocates the pages and starts the thread updating them, the scheduler must be running
+void Initialize();
+
+// Map the pages read only into process, address is set to where they were mapped
+// returns 0 on success, negative error code on failure
+long MapIntoProcess(Process* process, uintptr_t& address);
+
+} // namespace Metrics
@@ -1,9 +1,16 @@
 #pragma once
 
 #include <Device.h>
+#include <MM/ObjectCache.h>
 #include <Net/Net.h>
+#include <RingBuffer.h>
 #include <Scheduler.h>
 
+#define NETWORK_RX_QUEUES 4 // Most threads processing the received packets of an adapter
+#define NETWORK_RX_BACKLOG 512 // Packets waiting on each receive queue before more are dropped, a power of two
+#define NETWORK_RX_BATCH 32 // Packets taken off a receive queue at once
+#define NETWORK_INTERRUPT_RATE_DEFAULT 8000 // Default limit on interrupts per second of adapters that moderate them
+
 enum {
     LinkDown,
     LinkUp,
@@ -26,6 +33,13 @@ namespace Network{
         };
         DriverState dState = Uninitialized;
 
+        enum Offload {
+            OffloadTxChecksum = 1, // Completes TCP and UDP checksums, see NetworkPacket::checksumStart
+            OffloadRxChecksum = 2, // Checks TCP and UDP checksums and sets NetworkPacket::checksumVerified
+            OffloadTcpSegmentation = 4, // Splits TCP packets larger than the MTU, see NetworkPacket::segmentSize
+        };
+        unsigned offloads = 0;
+
         MACAddress mac;
 
         // All of these are big-endian
@@ -33,20 +47,43 @@ namespace Network{
         IPv4Address gatewayIP = 0; // 0.0.0.0
         IPv4Address subnetMask = 0xFFFFFFFF; // 255.255.255.255 (no subnet)
         int adapterIndex = 0; // Index in the adapters list
+
+        // Most interrupts per second taken by adapters that can moderate them, 0 for no limit.
+        // Set with netirqrate= on the kernel command line
+        static unsigned interruptRate;
         
         NetworkAdapter(AdapterType aType);
 
         virtual int Ioctl(uint64_t cmd, uint64_t arg);
         
         virtual void SendPacket(void* data, size_t len);
+        // Send a packet from AllocatePacket, taking the reference to it.
+        // By default the data is copied out and sent with SendPacket(void*, size_t)
+        virtual void SendPacket(NetworkPacket* pkt);
+
+        ALWAYS_INLINE bool IsLoopback() const { return type == NetworkAdapterLoopback; }
 
         virtual int GetLink() const;
+        // Amount of received packets waiting to be processed
         virtual int QueueSize() const;
 
-        virtual NetworkPacket* Dequeue();
-        virtual NetworkPacket* DequeueBlocking();
+        /////////////////////////////
+        /// \brief Queue a received frame for processing
+        ///
+        /// Packets of the same flow (IPv4 addresses, protocol and ports) always go to the same
+        /// processing thread so they are processed in order, different flows are processed in parallel.
+        ///
+        /// \param pkt Received frame, the reference to it is taken
+        /////////////////////////////
+        void Receive(NetworkPacket* pkt);
+        // Start the processing threads, called when the adapter is registered
+        void StartProcessing();
+
         virtual void CachePacket(NetworkPacket* pkt);
 
+        // Get an empty packet with NETWORK_PACKET_HEADROOM bytes of room in front for headers
+        NetworkPacket* AllocatePacket();
+
         void BindToSocket(IPSocket* sock);
         void UnbindSocket(IPSocket* sock);
         void UnbindAllSockets();
@@ -55,19 +92,26 @@ namespace Network{
 
     protected:
         static int nextDeviceNumber;
-        unsigned maxCache = 256; // Maximum amount of cached packets, NIC drivers are free to change this
-    
         int linkState = LinkDown;
 
-        FastList<NetworkPacket*> cache;
-        FastList<NetworkPacket*> queue;
+        // Free packets for received and sent data, packets return here when they are released
+        ObjectCache<NetworkPacket, 32> packetCache{256};
 
-        Semaphore packetSemaphore = Semaphore(0);
+        struct ReceiveQueue {
+            NetworkAdapter* adapter;
 
-        lock_t cacheLock = 0;
-        lock_t queueLock = 0;
+            // Pushed by drivers from any CPU (usually in their interrupt handler), popped by the processing thread
+            MPSCRingBuffer<NetworkPacket*, NETWORK_RX_BACKLOG> packets;
 
-        lock_t threadLock = 0;
+            bool sleeping = false; // Set by the processing thread before waiting, whoever clears it signals
+            Semaphore semaphore = Semaphore(0);
+        };
+
+        ReceiveQueue rxQueues[NETWORK_RX_QUEUES];
+        unsigned rxQueueCount = 1;
+        int queuedPackets = 0;
+
+        [[noreturn]] static void ProcessingThread(ReceiveQueue* queue);
 
         AdapterType type;
 
@@ -75,5 +119,19 @@ namespace Network{
         List<class ::IPSocket*> boundSockets; // If an adapter is destroyed, we need to know what sockets are bound to it
     };
 
+    // Every registered adapter, replaced as a whole when one is added or removed.
+    // Read within an RCU read section (see RCU.h), changed by NetFS with adaptersLock held
+    struct AdapterTable {
+        unsigned count = 0;
+        NetworkAdapter** adapters = nullptr;
+
+        ~AdapterTable() { delete[] adapters; }
+
+        ALWAYS_INLINE NetworkAdapter** begin() { return adapters; }
+        ALWAYS_INLINE NetworkAdapter** end() { return adapters + count; }
+    };
+
+    extern AdapterTable* adapterTable;
+
     void AddAdapter(NetworkAdapter* a);
 }
\ No newline at end of file
@@ -2,7 +2,9 @@
 
 #include <Net/If.h>
 
+#include <Assert.h>
 #include <CString.h>
+#include <Compiler.h>
 #include <Device.h>
 #include <Endian.h>
 #include <stddef.h>
@@ -11,6 +13,8 @@
 class Socket;
 
 #define	TCP_NODELAY 1
+#define TCP_CORK 3 // Only send full segments until uncorked
+#define TCP_CONGESTION 13 // Name of the congestion control algorithm, "reno" or "cubic"
 
 #define PORT_MAX UINT16_MAX
 
@@ -19,20 +23,122 @@ class Socket;
 
 #define ETHERNET_MAX_PACKET_SIZE 1518
 
+#define NETWORK_PACKET_SIZE 4096    // A page, so the buffer is physically contiguous
+#define NETWORK_PACKET_HEADROOM 128 // Room kept in front of outbound data for the headers of each layer
+
+#define NEIGHBOUR_TABLE_SIZE 256 // Buckets
+#define NEIGHBOUR_QUEUE_MAX 8 // Packets held for each neighbour whilst its MAC address is resolved
+#define NEIGHBOUR_REACHABLE_TIME 30000000 // How long a MAC address is used before it is confirmed again, 30s
+#define NEIGHBOUR_STALE_TIME 60000000 // Entries not confirmed for this long are freed, 60s
+#define NEIGHBOUR_RETRANSMIT_TIME 1000000 // Between ARP requests for the same neighbour, 1s
+#define NEIGHBOUR_MAX_PROBES 3 // ARP requests sent before packets waiting on a neighbour are dropped
+#define NEIGHBOUR_TIMER_INTERVAL 250000 // 250ms
+
+#define UDP_RECEIVE_BUFFER 212992 // Default SO_RCVBUF, payload bytes queued before datagrams are dropped
+#define UDP_RECEIVE_BUFFER_MIN 2048
+#define UDP_RECEIVE_BUFFER_MAX 4194304
+
 #define TCP_RETRY_MIN 200000   // 200 ms minimum retry period
 #define TCP_RETRY_MAX 32000000 // 32s
+#define TCP_RETRY_INITIAL 1000000 // Retransmission timeout until the round trip time is known
+#define TCP_DELAYED_ACK 40000 // Longest an ACK is held back waiting for more data or a reply to carry it, 40ms
+#define TCP_CORK_TIMEOUT 200000 // Longest a partial segment is held whilst corked, 200ms
+#define TCP_MAX_RETRANSMITS 12     // Timeouts in a row before the connection is given up on
+#define TCP_TIMER_INTERVAL 10000   // How often the retransmission timers are checked (10 ms)
+
+#define TCP_DEFAULT_MSS 536 // Used when the peer does not send the MSS option
+#define TCP_MSS (ETHERNET_MAX_PACKET_SIZE - 18 - 20 - 20) // Frame less the Ethernet, IPv4 and TCP headers
+#define TCP_SEGMENTATION_MAX (NETWORK_PACKET_SIZE - NETWORK_PACKET_HEADROOM - 60) // Largest offloaded send, a packet less the TCP header
+
+#define TCP_RECEIVE_BUFFER 262144
+#define TCP_SEND_BUFFER 262144 // Must be a power of two
+#define TCP_WINDOW_SCALE 3     // TCP_RECEIVE_BUFFER >> TCP_WINDOW_SCALE must fit in the 16 bit window
+#define TCP_MAX_SACK_BLOCKS 3  // SACK blocks sent in an ACK
+#define TCP_SACK_SCOREBOARD 8  // Ranges the peer has SACKed that are remembered
+
+#define TCP_DUPACK_THRESHOLD 3
+#define TCP_CUBIC_BETA 7 // Multiplicative decrease of CUBIC in tenths
+#define TCP_CUBIC_C 4    // Scaling constant of CUBIC in tenths
 
 namespace Network {
 class NetworkAdapter;
 }
+// Reference counted buffer holding a frame.
+// NICs DMA straight into and out of the buffer. Each layer of the stack pulls its header
+// off the front of a received packet, or pushes one on the front of an outbound packet,
+// so the payload is never copied between layers.
 struct NetworkPacket {
-    size_t length;
-    uint8_t data[1518];
+    NetworkPacket();
+    ~NetworkPacket();
+
+    NetworkPacket(const NetworkPacket&) = delete;
+    NetworkPacket& operator=(const NetworkPacket&) = delete;
+
+    uint8_t* buffer;
+    uintptr_t physicalAddress; // Physical address of buffer
+
+    size_t offset = 0; // Start of the data in buffer
+    size_t length = 0;
+
+    Network::NetworkAdapter* adapter = nullptr; // Adapter whose cache the packet goes back to
+    unsigned refCount = 1;
+
+    // Received, set by adapters with NetworkAdapter::OffloadRxChecksum that have checked the TCP or UDP checksum
+    bool checksumVerified = false;
+
+    // Sent, used by adapters with NetworkAdapter::OffloadTxChecksum. Offsets into buffer, 0 if the checksum is done.
+    // The checksum field holds the pseudo header sum, the adapter adds everything from checksumStart
+    // to the end of the packet and stores the result at checksumOffset.
+    uint16_t checksumStart = 0;
+    uint16_t checksumOffset = 0;
 
-    Network::NetworkAdapter* adapter;
+    // Sent, TCP payload of each segment for adapters with NetworkAdapter::OffloadTcpSegmentation to split the packet into.
+    // 0 if the packet is to be sent as is.
+    uint16_t segmentSize = 0;
 
     NetworkPacket* next;
     NetworkPacket* prev;
+
+    ALWAYS_INLINE uint8_t* Data() { return buffer + offset; }
+    ALWAYS_INLINE uintptr_t PhysicalData() const { return physicalAddress + offset; }
+
+    // Remove size bytes from the front, returns the new start of the data
+    ALWAYS_INLINE uint8_t* Pull(size_t size) {
+        assert(size <= length);
+
+        offset += size;
+        length -= size;
+        return Data();
+    }
+
+    // Add size bytes to the front for a header, returns the new start of the data
+    ALWAYS_INLINE uint8_t* Push(size_t size) {
+        assert(size <= offset);
+
+        offset -= size;
+        length += size;
+        return Data();
+    }
+
+    // Add size bytes to the end, returns the start of them
+    ALWAYS_INLINE uint8_t* Put(size_t size) {
+        assert(offset + length + size <= NETWORK_PACKET_SIZE);
+
+        uint8_t* end = Data() + length;
+        length += size;
+        return end;
+    }
+
+    // Drop anything past size bytes, such as Ethernet padding
+    ALWAYS_INLINE void Trim(size_t size) {
+        if (size < length) {
+            length = size;
+        }
+    }
+
+    ALWAYS_INLINE void Reference() { __atomic_add_fetch(&refCount, 1, __ATOMIC_RELAXED); }
+    // Give the packet back to its adapter once the last reference is gone
+    void Release();
 };
 
 struct IPv4Address {
@@ -162,6 +268,15 @@ struct UDPHeader {
     uint8_t data[];
 } __attribute__((packed));
 
+enum TCPOption {
+    TCPOptionEnd = 0,
+    TCPOptionNOP = 1,
+    TCPOptionMSS = 2,
+    TCPOptionWindowScale = 3,
+    TCPOptionSACKPermitted = 4,
+    TCPOptionSACK = 5,
+};
+
 struct TCPHeader {
     enum Flags {
         FIN = 0x1,
@@ -213,8 +328,6 @@ struct ICMPHeader {
 } __attribute__((packed));
 
 namespace Network {
-extern Semaphore packetQueueSemaphore;
-
 enum {
     EtherTypeIPv4 = 0x800,
     EtherTypeARP = 0x806,
@@ -245,43 +358,104 @@ public:
     inline static NetFS* GetInstance() { return instance; }
 };
 
-static inline BigEndian<uint16_t> CaclulateChecksum(void* data, uint16_t size) {
-    uint16_t* ptr = (uint16_t*)data;
-    size_t count = size;
-    uint32_t checksum = 0;
-
-    while (count >= 2) {
-        checksum += *ptr++;
-        count -= 2;
-    }
-
-    checksum = (checksum & 0xFFFF) + (checksum >> 16);
-    if (checksum > UINT16_MAX) {
-        checksum += 1;
-    }
+/////////////////////////////
+/// \brief One's complement sum of data for the internet checksum (RFC 1071)
+///
+/// A sum can be continued over several pieces by passing the sum so far,
+/// every piece but the last must be an even amount of bytes.
+///
+/// \return Sum, neither folded nor inverted
+/////////////////////////////
+uint64_t ChecksumAdd(const void* data, size_t size, uint64_t sum = 0);
+// Sum of the IPv4 pseudo header covered by TCP and UDP checksums
+uint64_t PseudoHeaderSum(const IPv4Address& source, const IPv4Address& destination, uint8_t protocol, uint16_t length);
+
+// Fold a sum from ChecksumAdd into 16 bits, a block containing a valid checksum folds to 0xFFFF
+ALWAYS_INLINE uint16_t ChecksumFold(uint64_t sum) {
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return sum;
+}
 
+ALWAYS_INLINE BigEndian<uint16_t> ChecksumFinish(uint64_t sum) {
     BigEndian<uint16_t> ret;
-    ret.value = ~checksum;
+    ret.value = ~ChecksumFold(sum);
     return ret;
 }
 
-void InitializeConnections();
+ALWAYS_INLINE BigEndian<uint16_t> Checksum(const void* data, size_t size) {
+    return ChecksumFinish(ChecksumAdd(data, size));
+}
 
-int IPLookup(NetworkAdapter* adapter, const IPv4Address& ip, MACAddress& mac);
-int Route(const IPv4Address& local, const IPv4Address& dest, MACAddress& mac, NetworkAdapter*& adapter);
+// Update a checksum after a 16-bit field it covers changes from oldValue to newValue (RFC 1624)
+ALWAYS_INLINE BigEndian<uint16_t> ChecksumUpdate(BigEndian<uint16_t> checksum, BigEndian<uint16_t> oldValue,
+                                                 BigEndian<uint16_t> newValue) {
+    uint64_t sum = static_cast<uint16_t>(~checksum.value);
+    sum += static_cast<uint16_t>(~oldValue.value);
+    sum += newValue.value;
+    return ChecksumFinish(sum);
+}
 
-void InitializeNetworkThread();
+void InitializeConnections();
+// Register the loopback adapter (lo, 127.0.0.1/8)
+void InitializeLoopback();
+
+// Get the MAC address of a neighbour if it is known, never blocks
+bool NeighbourLookup(NetworkAdapter* adapter, const IPv4Address& ip, MACAddress& mac);
+
+/////////////////////////////
+/// \brief Send pkt to a neighbour, never blocks
+///
+/// If the MAC address of the neighbour is not known an ARP request is sent and pkt is held until the reply,
+/// it is dropped if no reply comes.
+///
+/// \param ip Address of the neighbour, the next hop
+/// \param pkt Packet starting at the Ethernet header, the destination is filled in. The reference is taken. nullptr to only resolve the neighbour
+/////////////////////////////
+void NeighbourOutput(NetworkAdapter* adapter, const IPv4Address& ip, NetworkPacket* pkt);
+// Record the MAC address of a neighbour and send the packets waiting on it
+void NeighbourUpdate(NetworkAdapter* adapter, const IPv4Address& ip, const MACAddress& mac);
+// Forget the neighbours of an adapter that is going away
+void NeighbourFlush(NetworkAdapter* adapter);
+
+/////////////////////////////
+/// \brief Find the adapter and next hop for dest
+///
+/// \param nextHop Set to dest, or the gateway if dest is not on the subnet of the adapter
+/// \param adapter The adapter to use. If nullptr it is set to the best adapter
+///
+/// \return 0 on success, negative error code on failure
+/////////////////////////////
+int Route(const IPv4Address& local, const IPv4Address& dest, IPv4Address& nextHop, NetworkAdapter*& adapter);
+
+// Process a received frame, takes the reference to pkt
+void OnReceive(NetworkAdapter* adapter, NetworkPacket* pkt);
 
 void Send(void* data, size_t length, NetworkAdapter* adapter = nullptr);
+// Takes the reference to pkt
+void Send(NetworkPacket* pkt, NetworkAdapter* adapter);
 int SendIPv4(void* data, size_t length, IPv4Address& source, IPv4Address& destination, uint8_t protocol,
              NetworkAdapter* adapter = nullptr);
 
+/////////////////////////////
+/// \brief Push the IPv4 and Ethernet headers in front of pkt and send it
+///
+/// \param pkt Packet from adapter holding the IPv4 payload, the reference to it is taken whether sending succeeds or not
+///
+/// \return 0 on success, negative error code on failure
+/////////////////////////////
+int SendIPv4(NetworkPacket* pkt, IPv4Address& source, IPv4Address& destination, uint8_t protocol,
+             NetworkAdapter* adapter);
+
 namespace UDP {
 class UDPSocket;
 
 int SendUDP(void* data, size_t length, IPv4Address& source, IPv4Address& destination, BigEndian<uint16_t> sourcePort,
             BigEndian<uint16_t> destinationPort, NetworkAdapter* adapter = nullptr);
-void OnReceiveUDP(IPv4Header& ipHeader, void* data, size_t length);
+// pkt starts at the UDP header, sockets take their own reference
+void OnReceiveUDP(IPv4Header& ipHeader, NetworkPacket* pkt);
 } // namespace UDP
 
 namespace TCP {
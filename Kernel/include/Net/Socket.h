@@ -1,10 +1,12 @@
 #pragma once
 
 #include <Fs/Filesystem.h>
+#include <Fs/Pipe.h>
 
 #include <Net/If.h>
 #include <Net/Net.h>
 
+#include <IntrusiveList.h>
 #include <List.h>
 #include <Lock.h>
 #include <Stream.h>
@@ -18,8 +20,25 @@
 
 #define CONNECTION_BACKLOG 128
 
+#define MMSG_MAX 1024 // Most messages moved by one sendmmsg or recvmmsg
+
+#ifndef MSG_WAITFORONE
+#define MSG_WAITFORONE 0x10000
+#endif
+
+#ifndef SCM_RIGHTS
+#define SCM_RIGHTS 1
+#endif
+
+#ifndef MSG_CMSG_CLOEXEC
+#define MSG_CMSG_CLOEXEC 0x40000000
+#endif
+
 #define STREAM_MAX_BUFSIZE 0x20000 // 128 KB
 
+#define LOCAL_SOCKET_BUFFER_SIZE 65536 // Size of the ring in each direction of a local stream socket
+#define LOCAL_SOCKET_MAX_RIGHTS 16     // Most file descriptors passed with one message
+
 struct rtentry {
     unsigned long rt_pad1;
     struct sockaddr rt_dst;
@@ -53,6 +72,12 @@ struct sockaddr_un {
     char sun_path[108];     /* Pathname */
 };
 
+// Used by sendmmsg and recvmmsg
+struct mmsghdr {
+    struct msghdr msg_hdr;
+    unsigned int msg_len; // Bytes sent or received
+};
+
 struct poll {
     int fd;
     short events;
@@ -104,7 +129,7 @@ class Socket : public FsNode {
     virtual int Listen(int backlog);
 
     virtual int64_t ReceiveFrom(void* buffer, size_t len, int flags, sockaddr* src, socklen_t* addrlen,
-                                const void* ancillary = nullptr, size_t ancillaryLen = 0);
+                                void* ancillary = nullptr, size_t* ancillaryLen = nullptr);
     virtual int64_t Receive(void* buffer, size_t len, int flags);
     virtual ssize_t Read(size_t offset, size_t size, uint8_t* buffer);
 
@@ -131,7 +156,40 @@ class Socket : public FsNode {
     virtual int PendingConnections() { return pending.get_length(); }
 };
 
+class LocalSocket;
+
+// File descriptors passed with SCM_RIGHTS, received along with the byte at position
+struct LocalSocketRights {
+    size_t position;
+    unsigned count = 0;
+    FancyRefPtr<KernelObject> objects[LOCAL_SOCKET_MAX_RIGHTS];
+};
+
+// One direction of a connected local stream socket.
+// Data is copied straight from the sender into the ring and from the ring to the receiver.
+struct LocalSocketStream {
+    LocalSocketStream() : ring(LOCAL_SOCKET_BUFFER_SIZE) {}
+    ~LocalSocketStream();
+
+    // Wake the receiving or sending socket, takes ring.endLock
+    void WakeReader();
+    void WakeWriter();
+
+    PipeBuffer ring;
+
+    // Protected by ring.endLock
+    LocalSocket* reader = nullptr;
+    LocalSocket* writer = nullptr;
+    bool readerClosed = false;
+    bool writerClosed = false;
+
+    lock_t rightsLock = 0;
+    List<LocalSocketRights*> rights; // Ordered by position
+};
+
 class LocalSocket final : public Socket {
+    friend struct LocalSocketStream;
+
   protected:
     lock_t m_slock = 0;
 
@@ -144,16 +202,20 @@ class LocalSocket final : public Socket {
   public:
     LocalSocket* peer = nullptr;
 
+    // Datagram sockets
     Stream* inbound = nullptr;
     Stream* outbound = nullptr;
 
+    // Stream sockets
+    FancyRefPtr<LocalSocketStream> m_receive;
+    FancyRefPtr<LocalSocketStream> m_send;
+
     LocalSocket(int type, int protocol);
     ~LocalSocket();
 
     static LocalSocket* CreatePairedSocket(LocalSocket* client);
 
     int ConnectTo(LocalSocket* client);
-    void DisconnectPeer();
 
     void OnDisconnect();
 
@@ -168,19 +230,20 @@ class LocalSocket final : public Socket {
     void Close();
 
     int64_t ReceiveFrom(void* buffer, size_t len, int flags, sockaddr* src, socklen_t* addrlen,
-                        const void* ancillary = nullptr, size_t ancillaryLen = 0);
+                        void* ancillary = nullptr, size_t* ancillaryLen = nullptr);
     int64_t SendTo(void* buffer, size_t len, int flags, const sockaddr* src, socklen_t addrlen,
                    const void* ancillary = nullptr, size_t ancillaryLen = 0);
 
     void Watch(FilesystemWatcher& watcher, int events);
     void Unwatch(FilesystemWatcher& watcher);
+    void SignalWatchers();
 
-    bool CanRead() {
-        if (inbound)
-            return !inbound->Empty();
-        else
-            return false;
-    }
+    bool CanRead();
+    bool CanWrite();
+
+  private:
+    int64_t StreamReceive(uint8_t* buffer, size_t len, int flags, void* ancillary, size_t* ancillaryLen);
+    int64_t StreamSend(uint8_t* buffer, size_t len, int flags, const void* ancillary, size_t ancillaryLen);
 };
 
 class IPSocket : public Socket {
@@ -206,7 +269,7 @@ class IPSocket : public Socket {
     void Close();
 
     virtual int64_t ReceiveFrom(void* buffer, size_t len, int flags, sockaddr* src, socklen_t* addrlen,
-                                const void* ancillary = nullptr, size_t ancillaryLen = 0);
+                                void* ancillary = nullptr, size_t* ancillaryLen = nullptr);
     virtual int64_t SendTo(void* buffer, size_t len, int flags, const sockaddr* src, socklen_t addrlen,
                            const void* ancillary = nullptr, size_t ancillaryLen = 0);
 
@@ -219,7 +282,7 @@ class IPSocket : public Socket {
 
     bool pktInfo = false; // Check for packet info field?
 
-    List<NetworkPacket> pQueue;
+    List<NetworkPacket*> pQueue;
 
     virtual unsigned short AllocatePort() = 0;
     virtual int AcquirePort(uint16_t port) = 0;
@@ -241,32 +304,57 @@ class UDPSocket final : public IPSocket {
     int Listen(int backlog);
 
     int64_t ReceiveFrom(void* buffer, size_t len, int flags, sockaddr* src, socklen_t* addrlen,
-                        const void* ancillary = nullptr, size_t ancillaryLen = 0);
+                        void* ancillary = nullptr, size_t* ancillaryLen = nullptr);
     int64_t SendTo(void* buffer, size_t len, int flags, const sockaddr* src, socklen_t addrlen,
                    const void* ancillary = nullptr, size_t ancillaryLen = 0);
 
+    int SetSocketOptions(int level, int opt, const void* optValue, socklen_t optLength);
+    int GetSocketOptions(int level, int opt, void* optValue, socklen_t* optLength);
+
   protected:
-    friend void OnReceiveUDP(IPv4Header& ipHeader, void* data, size_t length);
+    friend void OnReceiveUDP(IPv4Header& ipHeader, NetworkPacket* pkt);
 
     struct UDPPacket {
         IPv4Address sourceIP;
         BigEndian<uint16_t> sourcePort;
-        size_t length;
-        uint8_t* data;
+        NetworkPacket* packet; // Referenced packet holding the payload
     };
 
     lock_t packetsLock = 0;
     List<UDPPacket> packets;
+    size_t receiveBufferSize = UDP_RECEIVE_BUFFER; // Set with SO_RCVBUF
+    size_t receiveBufferUsed = 0; // Payload bytes in packets
 
     unsigned short AllocatePort();
     int AcquirePort(uint16_t port);
     int ReleasePort();
 
-    int64_t OnReceive(IPv4Address& sourceIP, BigEndian<uint16_t> sourcePort, void* buffer, size_t len);
+    int64_t OnReceive(IPv4Address& sourceIP, BigEndian<uint16_t> sourcePort, NetworkPacket* packet);
 };
 } // namespace Network::UDP
 
 namespace Network::TCP {
+struct TCPOptions;
+
+// Create an identifier for a connection with the source IP, dest IP, source port and destination port.
+// This allows for one connection per port per remote address per local adddress
+struct TCPConnectionIdentifier {
+    IPv4Address localIP;  // Local TCP Endpoint IP
+    IPv4Address remoteIP; // Remote TCP Endpoint IP
+    uint16_t localPort;   // Local Port
+    uint16_t remotePort;  // Remote Port
+
+    TCPConnectionIdentifier() = default;
+
+    TCPConnectionIdentifier(const IPv4Address& local, const IPv4Address& remote, uint16_t lPort, uint16_t rPort)
+        : localIP(local), remoteIP(remote), localPort(lPort), remotePort(rPort) {}
+
+    inline bool operator==(const TCPConnectionIdentifier& other) const {
+        return remoteIP.value == other.remoteIP.value && localIP.value == other.localIP.value &&
+               remotePort == other.remotePort && localPort == other.localPort;
+    }
+};
+
 class TCPSocket final : public IPSocket {
   public:
     TCPSocket(int type, int protocol);
@@ -278,7 +366,7 @@ class TCPSocket final : public IPSocket {
     int Listen(int backlog);
 
     int64_t ReceiveFrom(void* buffer, size_t len, int flags, sockaddr* src, socklen_t* addrlen,
-                        const void* ancillary = nullptr, size_t ancillaryLen = 0);
+                        void* ancillary = nullptr, size_t* ancillaryLen = nullptr);
     int64_t SendTo(void* buffer, size_t len, int flags, const sockaddr* src, socklen_t addrlen,
                    const void* ancillary = nullptr, size_t ancillaryLen = 0);
 
@@ -290,35 +378,85 @@ class TCPSocket final : public IPSocket {
 
     void Close();
 
+    IntrusiveListNode timerNode;  // In the sockets checked by the TCP timer thread
+    IntrusiveListNode closedNode; // In the sockets closed by their file but still shutting down
+
   protected:
     bool m_fileClosed = false;
-    bool m_noDelay = false;   // Disable 'Nagle's algorithm', we don't actualy implement this yet
+    bool m_noDelay = false;   // Disable 'Nagle's algorithm'
+    bool m_cork = false;      // Hold back partial segments, up to TCP_CORK_TIMEOUT
     bool m_keepAlive = false; // We haven't implmented this yet
 
     friend void OnReceiveTCP(IPv4Header& ipHeader, void* data, size_t length);
+    friend void TimerThread();
+    friend int AcquirePort(TCPSocket* sock, const IPv4Address& localAddress, const IPv4Address& remoteAddress,
+                           uint16_t port, uint16_t remotePort);
+    friend int ReleasePort(TCPSocket* sock);
 
-    void OnReceive(const IPv4Address& source, const IPv4Address& dest, uint8_t* data, size_t length);
+    // Where the socket is in the connection or listen table
+    TCPConnectionIdentifier m_tableId;
+    bool m_inTable = false;
 
-    int Synchronize(uint32_t seqNumber); // TCP SYN (Establish a connection to the server)
-    int Acknowledge(uint32_t ackNumber); // TCP ACK (Acknowledge connection)
-    int SynchronizeAcknowledge(
-        uint32_t seqNumber,
-        uint32_t ackNumber); // TCP SYN-ACK (Establish connection to client and acknowledge the connection)
-    int Finish();            // TCP FIN (Last packet from sender)
-    int FinishAcknowledge(uint32_t ackNumber); // TCP FIN-ACK (Last packet from sender, acknowledge)
-    int Reset();                               // TCP RST (Abort connection)
+    void OnReceive(const IPv4Address& source, const IPv4Address& dest, uint8_t* data, size_t length);
+    // Handle a segment, m_lock must be held
+    void ProcessSegment(const IPv4Address& source, uint8_t* data, size_t length);
+
+    int Synchronize(uint32_t seqNumber);            // TCP SYN (Establish a connection to the server)
+    int Acknowledge();                              // TCP ACK (Acknowledge everything received so far)
+    int SynchronizeAcknowledge(uint32_t seqNumber); // TCP SYN-ACK (Establish connection to client and acknowledge the connection)
+    int FinishAcknowledge();                        // TCP FIN-ACK (Last packet from sender, acknowledge)
+    int Reset();                                    // TCP RST (Abort connection)
+
+    /////////////////////////////
+    /// \brief Send a segment
+    ///
+    /// Options are added to SYN segments, and SACK blocks to ACKs whilst segments are held out of order.
+    ///
+    /// \param sequence Sequence number of the segment
+    /// \param flags TCPHeader flags
+    /// \param length Amount of data, taken from the send buffer at sequence
+    ///
+    /// \return 0 on success, negative error code on failure
+    /////////////////////////////
+    int SendSegment(uint32_t sequence, uint16_t flags, size_t length);
+
+    /////////////////////////////
+    /// \brief Send as much of the send buffer as the windows allow, then the FIN if pending
+    ///
+    /// Partial segments are held back whilst data is outstanding (Nagle) or whilst corked. m_lock must be held
+    ///
+    /// \param push Send partial segments regardless
+    /////////////////////////////
+    void Output(bool push = false);
+    // Acknowledge received data now or within TCP_DELAYED_ACK, m_lock must be held
+    void DelayAcknowledge(size_t length);
+    // Send the first segment at or after sequence that the peer has not SACKed, m_lock must be held
+    bool Retransmit(uint32_t sequence);
+    // Handle the acknowledgement number, window and SACK blocks of a segment. m_lock must be held
+    void ProcessAcknowledgement(TCPHeader* header, const TCPOptions& options, bool hasData);
+    // Merge the SACK blocks of a segment into m_sacked, m_lock must be held
+    void UpdateScoreboard(const TCPOptions& options);
+    void WakeSenders();
+    // Called by the timer thread, m_lock must be held
+    void OnTimer(uint64_t now);
+
+    // Congestion control, m_lock must be held
+    void OnCongestion(bool timeout);
+    void OnAcknowledged(uint32_t bytes);
+    void UpdateRoundTripTime(uint64_t sample);
+
+    // Store segments that arrived ahead of m_remoteSequenceNumber, m_lock must be held
+    void QueueOutOfOrder(uint32_t sequence, const uint8_t* data, size_t length);
+    // Move queued segments that have become contiguous into m_inboundData, m_lock must be held
+    void DrainOutOfOrder();
+
+    uint32_t ReceiveWindow();
+    inline uint32_t FlightSize() const { return m_sequenceNumber - m_lastAcknowledged; }
 
     unsigned short AllocatePort();
     int AcquirePort(uint16_t port);
     int ReleasePort();
 
-    struct TCPPacket {
-        TCPHeader header;
-        uint32_t sequenceNumber;
-        uint32_t length;
-        uint8_t* data;
-    };
-
     // As per RFC 793
     enum State {
         TCPStateUnknown,
@@ -329,18 +467,90 @@ class TCPSocket final : public IPSocket {
         TCPStateFinWait1,    // Waiting for an ACK or FIN-ACK after our FIN
         TCPStateFinWait2,    // Waiting for the peer to send FIN
         TCPStateCloseWait,   // Waiting for the last process to close the socket
+        TCPStateClosing,     // Both ends have sent FIN, waiting for the ACK of ours
         TCPStateLastAck,     // Waiting for a final ACK after our FIN
         TCPStateTimeWait,    // Waiting to ensure that the peer recieved its ACK
     };
 
+    enum CongestionControl {
+        CongestionNewReno,
+        CongestionCubic,
+    };
+
+    struct SequenceRange {
+        uint32_t start;
+        uint32_t end;
+    };
+
+    struct TCPSegment {
+        uint32_t sequence;
+        uint32_t length;
+        uint8_t* data;
+    };
+
     State state = TCPStateUnknown;
-    uint32_t m_sequenceNumber;
-    uint32_t m_lastAcknowledged; // Last acknowledged sequence number
 
-    uint32_t m_remoteSequenceNumber; // Sequence number of the remote endpoint
+    lock_t m_lock = 0; // Held whilst using the sequence space, buffers and congestion state
+
+    // Send sequence space
+    uint32_t m_sequenceNumber;   // Next sequence number to send (SND.NXT)
+    uint32_t m_lastAcknowledged; // Oldest unacknowledged sequence number (SND.UNA)
+    uint32_t m_sendWindow = 0;   // Receive window of the peer in bytes
+
+    // Data from m_lastAcknowledged on, unacknowledged then unsent
+    uint8_t* m_sendBuffer = nullptr;
+    size_t m_sendBufferStart = 0;
+    size_t m_sendBufferUsed = 0;
+    IntrusiveList<ThreadBlocker, &ThreadBlocker::queueNode> m_sendWaiters; // Threads waiting for room in the send buffer
+    Mutex m_sendMutex;                  // Held by SendTo whilst copying into the send buffer without m_lock
+
+    bool m_finPending = false; // Send a FIN once the send buffer has been sent
+    bool m_finSent = false;    // The FIN is the sequence number before m_sequenceNumber
+
+    // Negotiated in the handshake
+    uint16_t m_mss = TCP_DEFAULT_MSS;
+    uint8_t m_sendScale = 0;    // Shift of the windows the peer advertises
+    uint8_t m_receiveScale = 0; // Shift of the windows we advertise
+    bool m_sackPermitted = false;
+
+    // Congestion control
+    CongestionControl m_congestionControl = CongestionCubic;
+    uint32_t m_congestionWindow = 0;
+    uint32_t m_slowStartThreshold = UINT32_MAX;
+    unsigned m_duplicateAcks = 0;
+    bool m_inRecovery = false;
+    uint32_t m_recoveryPoint = 0;   // SND.NXT when loss recovery started
+    uint32_t m_retransmitNext = 0;  // Where to look for the next hole to retransmit in recovery
+
+    uint32_t m_cubicMaxWindow = 0;   // Window before the last reduction (W_max)
+    uint32_t m_cubicOrigin = 0;      // Window the cubic function plateaus at
+    uint32_t m_cubicRenoWindow = 0;  // Window Reno would have, CUBIC never grows slower
+    uint64_t m_cubicEpochStart = 0;  // Start of the current congestion avoidance epoch, 0 if none
+    uint64_t m_cubicK = 0;           // Time from the start of the epoch to reach m_cubicOrigin in ms
+
+    // Ranges above m_lastAcknowledged the peer has SACKed, sorted
+    SequenceRange m_sacked[TCP_SACK_SCOREBOARD];
+    unsigned m_sackedCount = 0;
+
+    // Retransmission timer (RFC 6298), times are in microseconds
+    uint64_t m_retransmitTimeout = TCP_RETRY_INITIAL;
+    uint64_t m_smoothedRtt = 0;
+    uint64_t m_rttVariance = 0;
+    uint32_t m_rttSequence = 0; // Segment being timed
+    uint64_t m_rttStart = 0;    // 0 if no segment is being timed
+    uint64_t m_retransmitDeadline = 0; // 0 if the timer is stopped
+    unsigned m_retransmits = 0;
+
+    // Receive sequence space
+    uint32_t m_remoteSequenceNumber; // Next sequence number expected from the peer (RCV.NXT)
+    List<TCPSegment> m_outOfOrder;   // Segments past m_remoteSequenceNumber, sorted
+    size_t m_outOfOrderBytes = 0;
+    uint32_t m_lastOutOfOrder = 0;   // Sequence number of the newest out of order segment, reported first in SACK
+    uint32_t m_advertisedWindow = 0;
+    size_t m_delayedAckBytes = 0;      // Received but not yet acknowledged
+    uint64_t m_delayedAckDeadline = 0; // 0 if no ACK is being held back
+    uint64_t m_corkDeadline = 0;       // When held back partial segments are sent, 0 if none
 
-    lock_t m_unacknowledgedPacketsLock = 0;
-    List<TCPPacket> m_unacknowledgedPackets; // Unacknowledged outbound packets
     DataStream m_inboundData = DataStream(512);
 };
 } // namespace Network::TCP
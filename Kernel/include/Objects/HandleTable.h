@@ -0,0 +1,96 @@
+#pragma once
+
+#include <Compiler.h>
+#include <Objects/Handle.h>
+#include <Spinlock.h>
+
+#include <stdint.h>
+
+#define HANDLE_TABLE_CHUNK_SIZE 64  // Handles in a chunk, one word of the free bitmap
+#define HANDLE_TABLE_MAX_CHUNKS 256
+#define HANDLE_TABLE_MAX (HANDLE_TABLE_CHUNK_SIZE * HANDLE_TABLE_MAX_CHUNKS)
+
+// Handle table of a process
+//
+// Handles are kept in chunks which never move once allocated, so looking up a handle
+// does not lock the table, only the slot of the handle for as long as it takes to copy it.
+// Threads using different handles never contend. Changes to the table are serialized by m_lock,
+// which also protects the bitmap used to find the lowest free handle ID.
+class HandleTable final {
+public:
+    HandleTable() = default;
+    ~HandleTable();
+
+    HandleTable(const HandleTable&) = delete;
+    HandleTable& operator=(const HandleTable&) = delete;
+
+    /////////////////////////////
+    /// \brief Get the handle with ID \a id
+    ///
+    /// \return The handle, null handle when \a id is invalid
+    /////////////////////////////
+    ALWAYS_INLINE Handle Get(handle_id_t id) {
+        if (id < 0 || id >= HANDLE_TABLE_MAX) {
+            return HANDLE_NULL;
+        }
+
+        Chunk* chunk = __atomic_load_n(&m_chunks[id / HANDLE_TABLE_CHUNK_SIZE], __ATOMIC_ACQUIRE);
+        if (!chunk) {
+            return HANDLE_NULL;
+        }
+
+        Slot& slot = chunk->slots[id % HANDLE_TABLE_CHUNK_SIZE];
+        ScopedSpinLock lockSlot(slot.lock);
+        return slot.handle;
+    }
+
+    /////////////////////////////
+    /// \brief Place a KernelObject in the lowest free slot
+    ///
+    /// \return ID of the new handle, -EMFILE when the table is full
+    /////////////////////////////
+    handle_id_t Allocate(FancyRefPtr<KernelObject> ko, bool closeOnExec);
+
+    /////////////////////////////
+    /// \brief Set the handle with ID \a id, destroying any handle already there
+    ///
+    /// \return 0 on success, -EBADF when \a id is out of range
+    /////////////////////////////
+    int Replace(handle_id_t id, Handle handle);
+
+    /////////////////////////////
+    /// \brief Destroy the handle with ID \a id
+    ///
+    /// \return 0 on success, EBADF when \a id is out of range
+    /////////////////////////////
+    int Destroy(handle_id_t id);
+
+    // Copy every handle of other, skipping those with closeOnExec set if skipCloseOnExec is true
+    void CopyFrom(HandleTable& other, bool skipCloseOnExec);
+    // Destroy every handle with closeOnExec set
+    void CloseOnExec();
+    // Destroy every handle
+    void Clear();
+
+    // One past the highest handle ID ever used
+    ALWAYS_INLINE unsigned Count() const { return __atomic_load_n(&m_count, __ATOMIC_RELAXED); }
+
+private:
+    struct Slot {
+        lock_t lock = 0;
+        Handle handle;
+    };
+
+    struct Chunk {
+        Slot slots[HANDLE_TABLE_CHUNK_SIZE];
+        uint64_t used = 0; // Bitmap of the slots holding a handle, only accessed with m_lock held
+    };
+
+    // Get the chunk at index, allocating it if it does not exist. m_lock must be held
+    Chunk* GetChunk(unsigned index);
+
+    Chunk* m_chunks[HANDLE_TABLE_MAX_CHUNKS] = {nullptr};
+    unsigned m_count = 0;
+
+    lock_t m_lock = 0; // Held when changing the table
+};
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <Error.h>
+#include <Lock.h>
+#include <RefPtr.h>
+#include <Vector.h>
+
+#include <Objects/KObject.h>
+#include <Objects/Message.h>
+
+#include <ABI/IORing.h>
+
+class Process;
+class UNIXOpenFile;
+
+// Submission and completion rings of a process (see ABI/IORing.h)
+//
+// Operations are run by the thread calling Enter. Those which would block are kept
+// and tried again whenever Enter is called, or when a file they are waiting on is ready
+// whilst Enter waits for completions.
+class IORing final : public KernelObject {
+    DECLARE_KOBJECT(IORing);
+
+public:
+    /////////////////////////////
+    /// \brief Create rings and map them into a process
+    ///
+    /// \param entries Submission ring entries, rounded up to a power of two
+    ///
+    /// \return Negative error code on failure
+    /////////////////////////////
+    static ErrorOr<FancyRefPtr<IORing>> Create(Process* process, uint32_t entries, IORingInfo& info);
+
+    ~IORing();
+
+    /////////////////////////////
+    /// \brief Run submitted operations and wait for completions
+    ///
+    /// \param minComplete Wait until at least this many completions are in the completion ring
+    /// \param timeout Most time to wait in microseconds, negative to wait forever
+    ///
+    /// \return Amount of submissions consumed, negative error code on failure
+    /////////////////////////////
+    long Enter(uint32_t minComplete, long timeout);
+
+private:
+    struct PendingOperation {
+        IORingSubmission submission;
+        FancyRefPtr<UNIXOpenFile> file;
+    };
+
+    IORing(Process* process, FancyRefPtr<MessageRingVMObject> vmo, uint32_t sqEntries);
+
+    // Returns true and sets result if the operation completed, false if it would block
+    bool Run(const IORingSubmission& sub, const FancyRefPtr<UNIXOpenFile>& file, int64_t& result);
+    // Poll events the operation waits on
+    static int WaitEvents(const IORingSubmission& sub);
+
+    void Complete(uint64_t userData, int64_t result);
+    uint32_t CompletionsAvailable() const;
+
+    // Consume submissions whilst there is room to complete them
+    long Submit();
+    // Try the pending operations again, returns the amount that completed
+    unsigned RunPending();
+
+    Process* m_process;
+    FancyRefPtr<MessageRingVMObject> m_vmo;
+
+    IORingHeader* m_header;
+    IORingSubmission* m_submissions;
+    IORingCompletion* m_completions;
+
+    // Kept apart from the header so the process cannot change them
+    uint32_t m_sqEntries;
+    uint32_t m_cqEntries;
+
+    Mutex m_enterLock; // Held by the thread running operations
+    Vector<PendingOperation> m_pending;
+};
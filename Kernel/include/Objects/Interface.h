@@ -52,6 +52,8 @@ public:
     }
 
     virtual void Unwatch(KernelObjectWatcher& watcher) override {
+        acquireLock(&waitingLock);
         waiting.remove(&watcher);
+        releaseLock(&waitingLock);
     }
 };
@@ -19,6 +19,8 @@ enum class KOTypeID : int {
     Service,
     UNIXOpenFile,
     Process,
+    IORing,
+    WaitSet,
 };
 
 #define DECLARE_KOBJECT(type)                                                                                          \
@@ -48,6 +50,9 @@ class KernelObjectWatcher : public Semaphore {
 public:
     KernelObjectWatcher() : Semaphore(0) {}
 
+    // Called by watched objects when they may be ready
+    virtual void Signal() { Semaphore::Signal(); }
+
     inline void WatchObject(FancyRefPtr<KernelObject> node, int events) {
         node->Watch(*this, events);
 
@@ -8,17 +8,52 @@
 #include <Lock.h>
 #include <RingBuffer.h>
 
+#include <MM/VMObject.h>
 #include <Objects/KObject.h>
 
+#include <ABI/IPC.h>
+#include <ABI/MessageRing.h>
+
+class Process;
+
+#define MESSAGE_ENDPOINT_RESPONSE_BUCKETS 16
+
 struct MessageEndpointInfo{
     uint16_t msgSize;
 };
 
+// Physical memory holding the message rings of an endpoint pair, also mapped into kernel space
+class MessageRingVMObject final : public PhysicalVMObject {
+public:
+    MessageRingVMObject(size_t size);
+    ~MessageRingVMObject();
+
+    ALWAYS_INLINE uint8_t* KernelMapping() { return m_kernelMapping; }
+    ALWAYS_INLINE bool CanMunmap() const override { return true; }
+
+private:
+    uint8_t* m_kernelMapping;
+};
+
+#define MESSAGE_ENDPOINT_QUEUE_MEMORY_DEFAULT 0x300000 // Default limit of memory queued on an endpoint (3MB)
+#define MESSAGE_ENDPOINT_INITIAL_QUEUE 16 // Messages that may be queued before the queue limit is first grown
+#define MESSAGE_ENDPOINT_CACHE_MAX 8 // Free messages kept for reuse by an endpoint, the rest are freed
+
 class MessageEndpoint final : public KernelObject{
     DECLARE_KOBJECT(MessageEndpoint);
 
 public:
     static const uint16_t maxMessageSizeLimit = UINT16_MAX;
+
+    struct Message{
+        uint64_t id;
+        FancyRefPtr<VMObject>* memory; // Attached memory, null if none
+        uint16_t size;
+        uint8_t data[];
+    };
+
+    // Most memory that messages queued on an endpoint may use, set with ipcqueue= (in KB) on the kernel command line
+    static size_t queueMemoryLimit;
     
     static Pair<FancyRefPtr<MessageEndpoint>,FancyRefPtr<MessageEndpoint>> CreatePair(uint16_t msgSize){
         FancyRefPtr<MessageEndpoint> endpoint1 = FancyRefPtr<MessageEndpoint>(new MessageEndpoint(msgSize));
@@ -35,6 +70,22 @@ public:
     
     void Destroy();
 
+    /////////////////////////////
+    /// \brief Get the message counters of the endpoint
+    ///
+    /// Fills everything but the handle ID
+    /////////////////////////////
+    void GetStatistics(EndpointStatistics& stats);
+
+    /////////////////////////////
+    /// \brief Get the kernel memory used by messages queued on (or cached by) the endpoint
+    ///
+    /// \return Size in bytes
+    /////////////////////////////
+    ALWAYS_INLINE size_t UsedMemory() const {
+        return static_cast<size_t>(__atomic_load_n(&m_messageCount, __ATOMIC_RELAXED)) * (sizeof(Message) + maxMessageSize);
+    }
+
     /////////////////////////////
     /// \brief Read a message from the queue
     ///
@@ -43,10 +94,23 @@ public:
     /// \param id Pointer to the ID to be populated
     /// \param size Pointer to the message size to be populated
     /// \param data Pointer to data
+    /// \param memory If not null, populated with the memory attached to the message (if any),
+    /// otherwise attached memory is dropped
+    /// \param taken If not null, the message is only taken off the queue and must be passed to FinishRead()
     ///
     /// \return 0 on success, 1 on empty, negative error code on failure
     /////////////////////////////
-    int64_t Read(uint64_t* id, uint16_t* size, uint8_t* data);
+    int64_t Read(uint64_t* id, uint16_t* size, uint8_t* data, FancyRefPtr<VMObject>* memory = nullptr,
+                 Message** taken = nullptr);
+
+    /////////////////////////////
+    /// \brief Finish reading a message taken off the queue by Read()
+    ///
+    /// \param message Message given by Read()
+    /// \param delivered Whether the reader got the message, otherwise it is put back at the head of the queue
+    /// \param memory Memory attached to the message, given back if it was not delivered
+    /////////////////////////////
+    void FinishRead(Message* message, bool delivered, FancyRefPtr<VMObject> memory = nullptr);
     
     /////////////////////////////
     /// \brief Send a message and return the response
@@ -59,12 +123,12 @@ public:
     /// \param data Pointer to data
     ///
     /// \param rID ID of the expected message
-    /// \param size Pointer to the message size to be populated
+    /// \param rSize Size of the rData buffer, populated with the size of the response
     /// \param data Pointer to an unsigned integer representing either 8 bytes of data (size <= 8) or a pointer to a buffer of size length containing message data
     ///
     /// \param timeout Amount of time (in us) until timeout, -1 for no timeout
     ///
-    /// \return 0 on success, 1 on timeout, negative error code on failure
+    /// \return 0 on success, -ETIMEDOUT on timeout, negative error code on failure
     /////////////////////////////
     int64_t Call(uint64_t id, uint16_t size, uint64_t data, uint64_t rID, uint16_t* rSize, uint8_t* rData, int64_t timeout);
     
@@ -76,14 +140,41 @@ public:
     /// \param id ID of the message to be sent
     /// \param size Size of the message to be sent
     /// \param data Pointer to data
+    /// \param memory Memory to attach to the message, handed to the receiver without copying.
+    /// Messages with memory never complete a Call.
+    ///
+    /// \return 0 on success, negative error code on failure
+    /////////////////////////////
+    int64_t Write(uint64_t id, uint16_t size, uint64_t data, FancyRefPtr<VMObject> memory = nullptr);
+
+    /////////////////////////////
+    /// \brief Map the message rings of the endpoint pair into a process
+    ///
+    /// The rings are created the first time either endpoint is mapped.
+    /// The peer only writes to the ring read by this endpoint once it has been mapped.
+    ///
+    /// \param process Process to map the rings into
+    /// \param info Populated with the address of the mapping and offsets of the rings
+    ///
+    /// \return 0 on success, negative error code on failure
+    /////////////////////////////
+    int64_t MapRing(Process* process, MessageRingInfo& info);
+
+    /////////////////////////////
+    /// \brief Wake the peer after writing to its ring
     ///
     /// \return 0 on success, negative error code on failure
     /////////////////////////////
-    int64_t Write(uint64_t id, uint16_t size, uint64_t data);
+    int64_t NotifyPeer();
 
     void Watch(KernelObjectWatcher& watcher, int events) override {
         acquireLock(&waitingLock);
-        if(queue.Empty()){
+        if(m_rxRing){
+            // Tell the writer to notify us, then check the ring again so a message written in between is not missed
+            __atomic_store_n(&m_rxRing->readerWaiting, 1, __ATOMIC_SEQ_CST);
+        }
+
+        if(queue.Empty() && !RingPending()){
             waiting.add_back(&watcher);
         } else {
             watcher.Signal();
@@ -92,35 +183,62 @@ public:
     }
 
     virtual void Unwatch(KernelObjectWatcher& watcher) override {
+        acquireLock(&waitingLock);
         waiting.remove(&watcher);
+        releaseLock(&waitingLock);
     }
 
     inline uint16_t GetMaxMessageSize() const { return maxMessageSize; }
 
 private:
-    struct Response{
-        uint64_t id;
-        uint16_t* size;
-        uint8_t** buffer;
-    };
+    // Call waiting on a response, lives on the stack of the caller
+    struct PendingResponse{
+        PendingResponse* next = nullptr;
+        PendingResponse* prev = nullptr;
 
-    struct Message{
         uint64_t id;
-        uint16_t size;
-        uint8_t data[];
+        bool queued = false; // Still waiting in a bucket, protected by waitingResponseLock
+
+        uint16_t size = 0;
+        uint8_t* buffer = nullptr; // Response data, allocated by Write
+
+        Semaphore semaphore = Semaphore(0);
+
+        PendingResponse(uint64_t id) : id(id) {}
     };
 
+    ALWAYS_INLINE FastList<PendingResponse*>& ResponseBucket(uint64_t id){
+        return waitingResponse[id % MESSAGE_ENDPOINT_RESPONSE_BUCKETS];
+    }
+
+    ALWAYS_INLINE bool RingPending() const {
+        return m_rxRing && __atomic_load_n(&m_rxRing->tail, __ATOMIC_SEQ_CST) != __atomic_load_n(&m_rxRing->head, __ATOMIC_RELAXED);
+    }
+
+    // Signal everything watching the endpoint, waitingLock must not be held
+    void SignalWatchers();
+
+    // Account for a message that has been read and recycle it, queueLock must be held
+    void Consume(Message* m);
+
     inline Message* AllocateMessage(){
         void* m = kmalloc(sizeof(Message) + maxMessageSize);
 
         return reinterpret_cast<Message*>(m);
     }
 
+    // Raise the limit of messages we may queue on the peer (up to m_queueLimitMax) once it has been reached
+    void GrowQueueLimit();
+
     friend Pair<FancyRefPtr<MessageEndpoint>,FancyRefPtr<MessageEndpoint>> CreatePair();
     uint16_t maxMessageSize = 8;
-    uint16_t messageQueueLimit = 128;
+    // Messages we may queue on the peer, starts small and grows whilst the peer falls behind
+    unsigned messageQueueLimit = MESSAGE_ENDPOINT_INITIAL_QUEUE;
+    unsigned m_queueLimitMax = MESSAGE_ENDPOINT_INITIAL_QUEUE; // Limited by queueMemoryLimit
     lock_t queueLock = 0;
+    lock_t m_queueLimitLock = 0;
 
+    // Free slots in the queue of the peer, signalled by the peer as it reads messages
     Semaphore queueAvailablilitySemaphore = Semaphore(messageQueueLimit);
 
     RingBuffer<Message*> queue;
@@ -128,8 +246,29 @@ private:
 
     MessageEndpoint* peer;
 
+    FancyRefPtr<MessageRingVMObject> m_ring; // Shared with the peer
+    MessageRingHeader* m_rxRing = nullptr; // Kernel mapping of the ring read by this endpoint
+    MessageRingHeader* m_txRing = nullptr; // Kernel mapping of the ring written by this endpoint
+    uint32_t m_rxOffset = 0;
+    uint32_t m_txOffset = 0;
+
+    unsigned m_queueCount = 0; // Messages in queue, protected by queueLock
+    unsigned m_cacheCount = 0; // Messages in cache, protected by queueLock
+    unsigned m_messageCount = 0; // Messages allocated for queue and cache, protected by queueLock
+
+    // Statistics, updated without a lock
+    uint64_t m_messagesSent = 0;
+    uint64_t m_bytesSent = 0;
+    uint64_t m_messagesReceived = 0;
+    uint64_t m_bytesReceived = 0;
+    unsigned m_queueHighWater = 0; // Protected by queueLock
+    uint64_t m_calls = 0;
+    uint64_t m_callTimeouts = 0;
+    uint64_t m_callLatency[ENDPOINT_LATENCY_BUCKETS] = {};
+
     List<KernelObjectWatcher*> waiting;
-    List<Pair<Semaphore*, Response>> waitingResponse;
+    FastList<PendingResponse*> waitingResponse[MESSAGE_ENDPOINT_RESPONSE_BUCKETS]; // Hashed on response ID
+    unsigned m_waitingResponseCount = 0; // Lets Write skip the lookup when no calls are waiting
 
     lock_t waitingLock = 0;
     lock_t waitingResponseLock = 0;
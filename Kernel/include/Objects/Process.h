@@ -11,6 +11,7 @@
 #include <List.h>
 #include <MM/AddressSpace.h>
 #include <Objects/Handle.h>
+#include <Objects/HandleTable.h>
 #include <Objects/KObject.h>
 #include <RefPtr.h>
 #include <Thread.h>
@@ -22,9 +23,8 @@ class Process : public KernelObject {
 
     friend struct Thread;
     friend void KernelProcess();
+    friend void Reaper();
     friend long SysExecve(RegisterContext* r);
-    friend long SysFutexWait(RegisterContext* r);
-    friend long SysFutexWake(RegisterContext* r);
 
 public:
     enum {
@@ -37,6 +37,9 @@ public:
     static FancyRefPtr<Process> CreateKernelProcess(void* entry, const char* name, Process* parent);
     static FancyRefPtr<Process> CreateELFProcess(void* elf, const Vector<String>& argv, const Vector<String>& envp,
                                                  const char* execPath, Process* parent);
+    // Segments of the ELF file are mapped from the page cache rather than copied
+    static FancyRefPtr<Process> CreateELFProcess(const FancyRefPtr<UNIXOpenFile>& elf, const Vector<String>& argv,
+                                                 const Vector<String>& envp, const char* execPath, Process* parent);
     ALWAYS_INLINE static Process* Current() {
         return Thread::Current()->parent;
     }
@@ -147,39 +150,57 @@ public:
 
     ALWAYS_INLINE PageMap* GetPageMap() { return addressSpace->GetPageMap(); }
 
+    /////////////////////////////
+    /// \brief Swap out memory of the process that has not been accessed recently
+    ///
+    /// Does not wait, nothing is swapped out if the process is busy (e.g. in execve) or dying.
+    ///
+    /// \return Amount of pages swapped out
+    /////////////////////////////
+    unsigned SwapOut(unsigned maxPages);
+
     /////////////////////////////
     /// \brief Get size of handle vector
     ///
     /// Includes invalid/closed handles
     /////////////////////////////
-    ALWAYS_INLINE unsigned HandleCount() const { return m_handles.size(); }
+    ALWAYS_INLINE unsigned HandleCount() const { return m_handles.Count(); }
+
+    /////////////////////////////
+    /// \brief Get the kernel memory used by messages queued on the endpoints of the process
+    ///
+    /// \return Size in bytes
+    /////////////////////////////
+    size_t IPCMemory();
+
+    /////////////////////////////
+    /// \brief Count the bytes moved by a read or write system call
+    ///
+    /// \param ret Return value of the read or write, errors are not counted
+    /// \return ret
+    /////////////////////////////
+    ALWAYS_INLINE long AccountRead(long ret) {
+        if (ret > 0) {
+            __atomic_add_fetch(&ioReadBytes, ret, __ATOMIC_RELAXED);
+        }
+        return ret;
+    }
+
+    ALWAYS_INLINE long AccountWrite(long ret) {
+        if (ret > 0) {
+            __atomic_add_fetch(&ioWriteBytes, ret, __ATOMIC_RELAXED);
+        }
+        return ret;
+    }
 
     /////////////////////////////
     /// \brief Allocate Handle
     ///
     /// \param fd Reference pointer to valid KernelObject
-    /// \return ID of new file descriptor
+    /// \return ID of new file descriptor, -EMFILE when there are too many handles
     /////////////////////////////
     ALWAYS_INLINE handle_id_t AllocateHandle(FancyRefPtr<KernelObject> ko, bool closeOnExec = false) {
-        ScopedSpinLock lockHandles(m_handleLock);
-
-        Handle h;
-        h.ko = std::move(ko);
-        h.closeOnExec = closeOnExec;
-
-        int i = 0;
-        for(; i < static_cast<int>(m_handles.get_length()); i++){
-            if(!m_handles[i].IsValid()){
-                h.id = i;
-                m_handles[i] = std::move(h);
-                return i;
-            }
-        }
-        
-        h.id = i;
-        m_handles.add_back(h);
-
-        return i;
+        return m_handles.Allocate(std::move(ko), closeOnExec);
     }
 
     template<KernelObjectDerived T> 
@@ -193,14 +214,7 @@ public:
     /// \return Handle object on success
     /// \return null handle when \a id is invalid
     /////////////////////////////
-    ALWAYS_INLINE Handle GetHandle(handle_id_t id) {
-        ScopedSpinLock lockHandles(m_handleLock);
-        if (id < 0 || id >= m_handles.size()) {
-            return HANDLE_NULL; // No such handle
-        }
-
-        return m_handles[id];
-    }
+    ALWAYS_INLINE Handle GetHandle(handle_id_t id) { return m_handles.Get(id); }
 
     template<typename T>
     ALWAYS_INLINE ErrorOr<FancyRefPtr<T>> GetHandleAs(handle_id_t id) {
@@ -220,17 +234,7 @@ public:
     /// \brief Replace handle
     /////////////////////////////
     ALWAYS_INLINE int ReplaceHandle(handle_id_t id, Handle newHandle) {
-        if(id < 0) {
-            return -EBADF;
-        }
-        
-        ScopedSpinLock lockHandles(m_handleLock);
-        assert(id < m_handles.size());
-
-        newHandle.id = id;
-        m_handles.at(id) = std::move(newHandle);
-
-        return 0;
+        return m_handles.Replace(id, std::move(newHandle));
     }
 
     /////////////////////////////
@@ -241,20 +245,11 @@ public:
     /// \param id Handle to destroy
     /// \return 0 on success, EBADF when fd is out of range
     /////////////////////////////
-    ALWAYS_INLINE int DestroyHandle(handle_id_t id) {
-        ScopedSpinLock lockHandles(m_handleLock);
-        if (id >= m_handles.size()) {
-            return EBADF; // No such handle
-        }
-
-        // Deferences the KernelObject
-        m_handles[id] = {-1, nullptr};
-        return 0;
-    }
+    ALWAYS_INLINE int DestroyHandle(handle_id_t id) { return m_handles.Destroy(id); }
 
-    ALWAYS_INLINE Handle stdin() { return m_handles[0]; };
-    ALWAYS_INLINE Handle stdout() { return m_handles[1]; };
-    ALWAYS_INLINE Handle stderr() { return m_handles[2]; };
+    ALWAYS_INLINE Handle stdin() { return m_handles.Get(0); };
+    ALWAYS_INLINE Handle stdout() { return m_handles.Get(1); };
+    ALWAYS_INLINE Handle stderr() { return m_handles.Get(2); };
 
     ALWAYS_INLINE void RegisterChildProcess(const FancyRefPtr<Process>& child) {
         ScopedSpinLock lock(m_processLock);
@@ -393,27 +388,42 @@ public:
     uint64_t usedMemoryBlocks = 0;
     timeval creationTime;     // When the process was created
     uint64_t activeTicks = 0; // How many ticks this process has been active
+    uint64_t migrations = 0;  // How many times threads of this process have moved between CPUs
 
-    AddressSpace* addressSpace = nullptr;
+    // Scheduler statistics, totals of all threads
+    uint64_t contextSwitches = 0;
+    uint64_t voluntarySwitches = 0;
+    uint64_t involuntarySwitches = 0;
+    uint64_t runQueueWaitUs = 0;
+    uint64_t maxRunQueueWaitUs = 0;
 
-    HashMap<uintptr_t, List<FutexThreadBlocker*>*> futexWaitQueue = HashMap<uintptr_t, List<FutexThreadBlocker*>*>(8);
+    // I/O statistics, updated without a lock
+    uint64_t ipcMessagesSent = 0;
+    uint64_t ipcMessagesReceived = 0;
+    uint64_t ioReadBytes = 0;
+    uint64_t ioWriteBytes = 0;
+
+    AddressSpace* addressSpace = nullptr;
 
     int exitCode = 0;
 
     // Handle table
-    Vector<Handle> m_handles;
+    HandleTable m_handles;
 
 private:
     Process(pid_t pid, const char* name, const char* workingDir, Process* parent);
 
+    // Creates a process from either an ELF in memory or an ELF file
+    static FancyRefPtr<Process> CreateELFProcess(void* elf, const FancyRefPtr<UNIXOpenFile>& elfFile,
+                                                 const Vector<String>& argv, const Vector<String>& envp,
+                                                 const char* execPath, Process* parent);
+
     FancyRefPtr<Thread> GetThreadFromTID_Unlocked(pid_t tid);
     void MapSignalTrampoline();
 
     lock_t m_processLock = 0;        // Should be acquired when modifying the data structure
     lock_t m_watchingLock = 0;       // Should be acquired when modifying watching processes
     lock_t m_fileDescriptorLock = 0; // Should be acquired when modifying file descriptors
-    lock_t m_handleLock = 0;         // Should be acquired when modifying handles
-    lock_t m_futexLock = 0;          // Should be acquired when modifying futex block queue
     pid_t m_pid;                     // Process ID (PID)
 
     bool m_started = false; // Has the process been started?
@@ -5,8 +5,14 @@
 #include <Objects/KObject.h>
 #include <Objects/Interface.h>
 
+#include <Hash.h>
+#include <StringView.h>
 #include <Vector.h>
 
+#define SERVICE_TABLE_BUCKETS 64 // Buckets in the ServiceFS name table
+#define SERVICE_INTERFACE_BUCKETS 8 // Buckets in the interface table of each service
+#define SERVICE_ACTIVATION_TIMEOUT 10000000 // Microseconds to wait for a registered service to create an interface
+
 class Service;
 
 class ServiceFS : public fs::FsVolume {
@@ -14,8 +20,12 @@ protected:
     friend class Service;
     static ServiceFS* instance;
 
+    // Services hashed on their name. Entries do not count as a reference (see CreateService),
+    // a service removes itself once it is destroyed.
+    HashMap<StringView, FancyRefPtr<Service>*> m_services{SERVICE_TABLE_BUCKETS};
+    lock_t m_servicesLock = 0;
+
 public:
-    List<FancyRefPtr<Service>> services;
     FancyRefPtr<Service> kernelService;
 
     static void Initialize(){
@@ -30,8 +40,33 @@ public:
         return instance;
     }
 
+    /////////////////////////////
+    /// \brief Find a service by name
+    ///
+    /// \param name Name of the service, anything following a '/' is ignored
+    ///
+    /// \return 0 on success, 1 if there is no such service
+    /////////////////////////////
     long ResolveServiceName(FancyRefPtr<Service>& ref, const char* name);
+
+    /////////////////////////////
+    /// \brief Create a service
+    ///
+    /// If the service has been registered and not yet created, the registered service is returned.
+    ///
+    /// \return The new service, nullptr if a service with the name already exists
+    /////////////////////////////
     FancyRefPtr<Service> CreateService(const char* name);
+
+    /////////////////////////////
+    /// \brief Register a service ahead of the process which creates it
+    ///
+    /// Connections to the service wait for its interfaces to be created instead of failing.
+    /// The first connection signals the registered service so that its process can be started.
+    ///
+    /// \return The registered service, nullptr if a service with the name already exists
+    /////////////////////////////
+    FancyRefPtr<Service> RegisterService(const char* name);
 };
 
 class Service final : public KernelObject{
@@ -40,7 +75,19 @@ class Service final : public KernelObject{
 protected:
     char* name;
     List<FancyRefPtr<MessageInterface>> interfaces;
+    HashMap<StringView, FancyRefPtr<MessageInterface>> m_interfaceTable{SERVICE_INTERFACE_BUCKETS}; // Hashed on name
 
+    // Services registered with ServiceFS::RegisterService are activated by the first connection
+    bool m_registered = false; // Registered ahead of time
+    bool m_created = true; // Created by the process providing it
+    bool m_activated = false; // A connection has been made, m_waitLock must be held
+
+    lock_t m_waitLock = 0;
+    List<KernelObjectWatcher*> m_watchers; // Waiting for the service to be activated
+    Semaphore m_interfaceWaiters{0}; // Connections waiting for an interface to be created
+    unsigned m_interfaceWaiting = 0;
+
+    friend class ServiceFS;
 public:
     Service(const char* _name);
     ~Service();
@@ -50,5 +97,18 @@ public:
     long CreateInterface(FancyRefPtr<MessageInterface>& rInterface, const char* name, uint16_t msgSize);
     long ResolveInterface(FancyRefPtr<MessageInterface>& interface, const char* name);
 
+    /////////////////////////////
+    /// \brief Find an interface to connect to
+    ///
+    /// Activates a registered service and waits for it to create the interface.
+    ///
+    /// \return 0 on success, -ENOENT if there is no such interface, -EINTR if interrupted
+    /////////////////////////////
+    long ConnectInterface(FancyRefPtr<MessageInterface>& interface, const char* name);
+
+    // Signalled once a registered service has been activated
+    void Watch(KernelObjectWatcher& watcher, int events) override;
+    void Unwatch(KernelObjectWatcher& watcher) override;
+
     const char* GetName() { return name; };
 };
\ No newline at end of file
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <List.h>
+#include <Lock.h>
+#include <RefPtr.h>
+#include <UserPointer.h>
+#include <Vector.h>
+
+#include <Objects/Handle.h>
+#include <Objects/KObject.h>
+
+class WaitSet;
+
+// A kernel object in a wait set, signalled by the object whenever it may be ready
+class WaitSetItem final : public KernelObjectWatcher {
+    friend class WaitSet;
+    friend FastList<WaitSetItem*>;
+
+public:
+    WaitSetItem(WaitSet* set, handle_id_t id, const FancyRefPtr<KernelObject>& object)
+        : set(set), id(id), object(object) {}
+
+    void Signal() override;
+
+private:
+    WaitSet* set;
+    handle_id_t id; // Handle ID reported to the waiter
+    FancyRefPtr<KernelObject> object;
+
+    bool ready = false; // On the ready list
+    bool rearm = false; // Reported, watch the object again when taken off the ready list
+
+    // Ready list of the wait set
+    WaitSetItem* next = nullptr;
+    WaitSetItem* prev = nullptr;
+};
+
+// Kernel objects are added once and stay watched between waits, unlike SysKernelObjectWait which
+// watches every object on each call. Items are put on the ready list by their watcher callback and
+// only those are looked at, so waiting costs O(ready objects) rather than O(objects in the set).
+// Objects only signal a watcher once, so a reported item is watched again the next time the set is
+// waited on and reported again if it is still ready.
+class WaitSet final : public KernelObject {
+    DECLARE_KOBJECT(WaitSet);
+
+public:
+    WaitSet() = default;
+    ~WaitSet();
+
+    /////////////////////////////
+    /// \brief Add an object to the set
+    ///
+    /// The set keeps a reference to the object until it is removed,
+    /// closing the handle does not remove it.
+    ///
+    /// \param id Handle ID of the object, reported by Wait when it is ready
+    ///
+    /// \return 0 on success, -EEXIST if id is already in the set
+    /////////////////////////////
+    long Add(handle_id_t id, const FancyRefPtr<KernelObject>& object);
+
+    /////////////////////////////
+    /// \brief Remove an object from the set
+    ///
+    /// \return 0 on success, -ENOENT if id is not in the set
+    /////////////////////////////
+    long Remove(handle_id_t id);
+
+    /////////////////////////////
+    /// \brief Wait for objects in the set to be signalled
+    ///
+    /// \param ready Filled with the handle IDs of signalled objects
+    /// \param maxReady Most handle IDs to store in \a ready
+    /// \param timeout Timeout in microseconds, 0 to return immediately and negative to wait indefinitely
+    ///
+    /// \return Amount of handle IDs stored in \a ready, -EINTR when interrupted, -EFAULT on a bad buffer
+    /////////////////////////////
+    long Wait(UserBuffer<handle_id_t> ready, int maxReady, long timeout);
+
+    void Watch(KernelObjectWatcher& watcher, int events) override;
+    void Unwatch(KernelObjectWatcher& watcher) override;
+
+private:
+    friend class WaitSetItem;
+
+    // Put an item on the ready list, waking threads waiting on the set if wake is set
+    void Queue(WaitSetItem* item, bool wake);
+    // Watch the object of the item, queueing it if it is already ready
+    void Arm(WaitSetItem* item);
+    // Report items on the ready list, m_lock must be held
+    int Collect(UserBuffer<handle_id_t>& ready, int maxReady);
+
+    Vector<WaitSetItem*> m_items; // Indexed by handle ID, nullptr when the ID is not in the set
+    Mutex m_lock;                 // Held when changing items or reporting them
+
+    FastList<WaitSetItem*> m_ready;
+    lock_t m_readyLock = 0;
+
+    Semaphore m_waiters{0};
+    unsigned m_waiting = 0; // Threads waiting on m_waiters, m_readyLock must be held
+
+    // Other waits on the set itself (e.g. SysKernelObjectWait), signalled when an item is queued
+    lock_t m_watchersLock = 0;
+    List<KernelObjectWatcher*> m_watchers;
+};
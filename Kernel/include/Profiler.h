@@ -0,0 +1,43 @@
+#pragma once
+
+#include <Compiler.h>
+#include <stdint.h>
+
+#define PROFILER_MAX_CPUS 64
+#define PROFILER_SAMPLES_PER_CPU 4096 // Must be a power of two, samples are dropped when full
+#define PROFILER_MAX_FRAMES 16
+#define PROFILER_NAME_LENGTH 16 // Characters of the process name kept with each sample
+
+struct RegisterContext;
+
+/////////////////////////////
+/// \brief Sampling profiler driven by the scheduler tick
+///
+/// Whilst running, the interrupted RIP of every CPU is sampled on each scheduler tick
+/// into a ring buffer for that CPU, along with the kernel stack if the CPU was in the kernel.
+/// Controlled and read through /dev/profile:
+///     Writing "start" or "start stack" clears the samples and starts sampling, "stop" stops it.
+///     Reading removes samples and gives a line for each:
+///         <cpu> <pid> <tid> <process> <k|u> <frame>...
+///     and a line for each CPU that ran out of space since the last read:
+///         # <cpu> dropped <count>
+///     where frames go from the interrupted address to its callers,
+///     kernel addresses are resolved as symbol+0xoffset and user addresses are left as 0x<address>.
+/////////////////////////////
+namespace Profiler {
+
+extern bool running;
+
+// Called by the scheduler on each tick, with interrupts disabled
+void Sample(RegisterContext* r);
+
+ALWAYS_INLINE static void Tick(RegisterContext* r) {
+    if (__builtin_expect(running, 0)) {
+        Sample(r);
+    }
+}
+
+// Creates /dev/profile
+void Initialize();
+
+} // namespace Profiler
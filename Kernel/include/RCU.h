@@ -0,0 +1,81 @@
+#pragma once
+
+#include <Compiler.h>
+#include <Thread.h>
+
+struct CPU;
+
+// Read-copy-update for tables which are read far more often than they are written.
+//
+// Readers take no locks, they mark a read section and follow pointers published with Assign.
+// Writers (still serialised by a lock of their own) publish a new copy and free the old one
+// through Retire or Call once every reader which may have seen it has finished.
+//
+// The scheduler does not preempt a thread inside a read section, so once every CPU has been through
+// the scheduler whilst not in a read section (a quiescent state) or has been idle,
+// every read section which started before the grace period has ended.
+// Read sections must not block or sleep.
+namespace RCU {
+
+ALWAYS_INLINE void ReadLock() {
+    // There are no other threads before the scheduler has started
+    if (Thread* thread = Thread::Current(); thread) {
+        thread->rcuReadDepth++;
+    }
+
+    asm volatile("" ::: "memory");
+}
+
+ALWAYS_INLINE void ReadUnlock() {
+    asm volatile("" ::: "memory");
+
+    if (Thread* thread = Thread::Current(); thread) {
+        thread->rcuReadDepth--;
+    }
+}
+
+class ReadGuard final {
+public:
+    ALWAYS_INLINE ReadGuard() { ReadLock(); }
+    ALWAYS_INLINE ~ReadGuard() { ReadUnlock(); }
+
+    ReadGuard(const ReadGuard&) = delete;
+    ReadGuard& operator=(const ReadGuard&) = delete;
+};
+
+// Load a pointer published with Assign, only to be used within a read section
+template <typename T> ALWAYS_INLINE T* Dereference(T* const& pointer) {
+    return __atomic_load_n(&pointer, __ATOMIC_ACQUIRE);
+}
+
+// Publish value, everything written to it beforehand is visible to readers which load it
+template <typename T> ALWAYS_INLINE void Assign(T*& pointer, T* value) {
+    __atomic_store_n(&pointer, value, __ATOMIC_RELEASE);
+}
+
+/////////////////////////////
+/// \brief Wait for every read section in progress to end
+///
+/// Sleeps, so must not be called within a read section or with a lock held.
+/////////////////////////////
+void Synchronize();
+
+/////////////////////////////
+/// \brief Call func(arg) from the RCU thread after a grace period
+///
+/// Callbacks are batched so many share one grace period.
+/////////////////////////////
+void Call(void (*func)(void*), void* arg);
+
+// Delete obj once no reader can be using it
+template <typename T> void Retire(T* obj) {
+    Call([](void* p) { delete static_cast<T*>(p); }, obj);
+}
+
+// Called by the scheduler with interrupts disabled when the current thread is not in a read section
+void QuiescentState(CPU* cpu);
+
+// Start the thread which runs callbacks
+void Initialize();
+
+} // namespace RCU
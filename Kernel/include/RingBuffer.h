@@ -2,6 +2,7 @@
 
 #include <stddef.h>
 
+#include <Compiler.h>
 #include <Memory.h>
 #include <Pair.h>
 #include <Spinlock.h>
@@ -51,6 +52,25 @@ public:
         releaseLock(&dequeueLock);
     }
 
+    // Put data back at the head of the queue, it is the next to be dequeued
+    void EnqueueFront(const T& data){
+        acquireLock(&enqueueLock);
+        acquireLock(&dequeueLock);
+
+        T* front = (dequeuePointer == buffer) ? bufferEnd - 1 : dequeuePointer - 1;
+        if(front == enqueuePointer){
+            // Grow first, the queue would look empty once full
+            Resize((bufferSize + 2) << 1);
+            front = (dequeuePointer == buffer) ? bufferEnd - 1 : dequeuePointer - 1;
+        }
+
+        *front = data;
+        dequeuePointer = front;
+
+        releaseLock(&enqueueLock);
+        releaseLock(&dequeueLock);
+    }
+
     void EnqueueUnlocked(const T* data, size_t count){
         size_t contiguousCount = count;
         size_t wrappedCount = 0;
@@ -240,4 +260,217 @@ private:
     inline constexpr void EnqueueUnlocked(const T& data){
         RingBuffer::EnqueueUnlocked(reinterpret_cast<uint8_t const*>(&data), sizeof(T));
     }
-};
\ No newline at end of file
+};
+
+/////////////////////////////
+/// \brief Lock-free ring for one producer and one consumer
+///
+/// Holds up to N elements (a power of two) inline and never grows, Push fails once it is full.
+/// The producer and consumer indices sit on cache lines of their own alongside a copy of the other side's index,
+/// so each side only touches the other's line when its copy says the ring is full (or empty).
+/// Only one context may push and one may pop at a time, e.g. an interrupt handler and a reader holding its own lock.
+/////////////////////////////
+template<typename T, unsigned N>
+class SPSCRingBuffer{
+    static_assert(N && !(N & (N - 1)), "SPSCRingBuffer size must be a power of two");
+
+public:
+    // Returns the amount pushed, less than count if the ring filled up
+    unsigned PushBatch(const T* data, unsigned count){
+        unsigned tail = m_tail;
+
+        unsigned space = N - (tail - m_cachedHead);
+        if(space < count){
+            m_cachedHead = __atomic_load_n(&m_head, __ATOMIC_ACQUIRE);
+            space = N - (tail - m_cachedHead);
+        }
+
+        if(count > space){
+            count = space;
+        }
+
+        for(unsigned i = 0; i < count; i++){
+            m_buffer[(tail + i) & (N - 1)] = data[i];
+        }
+
+        __atomic_store_n(&m_tail, tail + count, __ATOMIC_RELEASE);
+        return count;
+    }
+
+    // Returns the amount popped, 0 if the ring is empty
+    unsigned PopBatch(T* data, unsigned count){
+        unsigned head = m_head;
+
+        unsigned available = m_cachedTail - head;
+        if(available < count){
+            m_cachedTail = __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE);
+            available = m_cachedTail - head;
+        }
+
+        if(count > available){
+            count = available;
+        }
+
+        for(unsigned i = 0; i < count; i++){
+            data[i] = m_buffer[(head + i) & (N - 1)];
+        }
+
+        __atomic_store_n(&m_head, head + count, __ATOMIC_RELEASE);
+        return count;
+    }
+
+    ALWAYS_INLINE bool Push(const T& data) { return PushBatch(&data, 1); }
+    ALWAYS_INLINE bool Pop(T& data) { return PopBatch(&data, 1); }
+
+    // Only a snapshot unless called by the consumer
+    ALWAYS_INLINE unsigned Count() const {
+        return __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&m_head, __ATOMIC_RELAXED);
+    }
+
+    ALWAYS_INLINE bool Empty() const { return !Count(); }
+
+private:
+    uint8_t m_padding0[CACHE_LINE_SIZE];
+
+    // Consumer
+    unsigned m_head = 0;
+    unsigned m_cachedTail = 0;
+    uint8_t m_padding1[CACHE_LINE_SIZE - sizeof(unsigned) * 2];
+
+    // Producer
+    unsigned m_tail = 0;
+    unsigned m_cachedHead = 0;
+    uint8_t m_padding2[CACHE_LINE_SIZE - sizeof(unsigned) * 2];
+
+    T m_buffer[N];
+};
+
+/////////////////////////////
+/// \brief Lock-free ring for any number of producers and one consumer
+///
+/// Holds up to N elements (a power of two) inline and never grows, Push fails once it is full.
+/// Producers reserve slots by moving the tail with a compare and swap, then publish each slot through its sequence number,
+/// so the consumer never sees a slot that is still being written.
+/// A producer stopped between reserving and publishing holds up the consumer (but not other producers) until it resumes.
+/// Only one context may pop at a time.
+/////////////////////////////
+template<typename T, unsigned N>
+class MPSCRingBuffer{
+    static_assert(N && !(N & (N - 1)), "MPSCRingBuffer size must be a power of two");
+
+    struct Slot{
+        unsigned sequence; // Position the slot is free for, plus one once it has been published
+        T value;
+    };
+
+public:
+    MPSCRingBuffer(){
+        for(unsigned i = 0; i < N; i++){
+            m_slots[i].sequence = i;
+        }
+    }
+
+    MPSCRingBuffer(const MPSCRingBuffer&) = delete;
+    MPSCRingBuffer& operator=(const MPSCRingBuffer&) = delete;
+
+    bool Push(const T& data){
+        unsigned tail = __atomic_load_n(&m_tail, __ATOMIC_RELAXED);
+
+        Slot* slot;
+        for(;;){
+            slot = &m_slots[tail & (N - 1)];
+
+            int diff = static_cast<int>(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - tail);
+            if(diff < 0){
+                return false; // Full, the consumer has yet to take what was last in the slot
+            } else if(diff > 0){
+                tail = __atomic_load_n(&m_tail, __ATOMIC_RELAXED); // Another producer took it
+            } else if(__atomic_compare_exchange_n(&m_tail, &tail, tail + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+                break;
+            }
+        }
+
+        slot->value = data;
+        __atomic_store_n(&slot->sequence, tail + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // Reserves every slot with a single compare and swap,
+    // returns the amount pushed, less than count if the ring filled up
+    unsigned PushBatch(const T* data, unsigned count){
+        unsigned tail;
+        unsigned reserved;
+        do {
+            // The consumer frees slots in order before moving the head,
+            // so everything below head + N is free. Reading the head first means the tail is never behind it.
+            // Push goes by the slots themselves and may already be past head + N if the consumer is yet to move the head
+            unsigned head = __atomic_load_n(&m_head, __ATOMIC_ACQUIRE);
+            tail = __atomic_load_n(&m_tail, __ATOMIC_RELAXED);
+
+            unsigned used = tail - head;
+            unsigned space = (used < N) ? N - used : 0;
+            reserved = (count > space) ? space : count;
+
+            if(!reserved){
+                return 0;
+            }
+        } while(!__atomic_compare_exchange_n(&m_tail, &tail, tail + reserved, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+        for(unsigned i = 0; i < reserved; i++){
+            Slot& slot = m_slots[(tail + i) & (N - 1)];
+
+            slot.value = data[i];
+            __atomic_store_n(&slot.sequence, tail + i + 1, __ATOMIC_RELEASE);
+        }
+
+        return reserved;
+    }
+
+    // Returns the amount popped, stopping at the first slot which has not been published
+    unsigned PopBatch(T* data, unsigned count){
+        unsigned head = m_head;
+
+        unsigned i = 0;
+        for(; i < count; i++){
+            Slot& slot = m_slots[(head + i) & (N - 1)];
+            if(__atomic_load_n(&slot.sequence, __ATOMIC_ACQUIRE) != head + i + 1){
+                break;
+            }
+
+            data[i] = slot.value;
+            __atomic_store_n(&slot.sequence, head + i + N, __ATOMIC_RELEASE); // Free for the next time around
+        }
+
+        if(i){
+            __atomic_store_n(&m_head, head + i, __ATOMIC_RELEASE);
+        }
+
+        return i;
+    }
+
+    ALWAYS_INLINE bool Pop(T& data) { return PopBatch(&data, 1); }
+
+    // Whether the next slot for the consumer has yet to be published
+    ALWAYS_INLINE bool Empty() const {
+        unsigned head = __atomic_load_n(&m_head, __ATOMIC_RELAXED);
+        return __atomic_load_n(&m_slots[head & (N - 1)].sequence, __ATOMIC_ACQUIRE) != head + 1;
+    }
+
+    // Includes slots which have been reserved but not yet published
+    ALWAYS_INLINE unsigned Count() const {
+        return __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&m_head, __ATOMIC_RELAXED);
+    }
+
+private:
+    uint8_t m_padding0[CACHE_LINE_SIZE];
+
+    // Consumer
+    unsigned m_head = 0;
+    uint8_t m_padding1[CACHE_LINE_SIZE - sizeof(unsigned)];
+
+    // Producers
+    unsigned m_tail = 0;
+    uint8_t m_padding2[CACHE_LINE_SIZE - sizeof(unsigned)];
+
+    Slot m_slots[N];
+};
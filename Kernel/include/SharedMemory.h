@@ -6,10 +6,27 @@
 #include <Scheduler.h>
 
 #define SMEM_FLAGS_PRIVATE 1
+#define SMEM_FLAGS_RESERVE 2 // Reserve address space for the object to grow into
 
+// Shared memory is mapped at its reserved size but only the committed part is backed,
+// the rest faults until the object is grown over it.
 class SharedVMObject : public PhysicalVMObject {
 public:
-    SharedVMObject(size_t size, int64_t key, pid_t owner, pid_t recipient, bool isPrivate);
+    SharedVMObject(size_t size, size_t reserved, int64_t key, pid_t owner, pid_t recipient, bool isPrivate);
+
+    /////////////////////////////
+    /// \brief Commit more of the reserved size
+    ///
+    /// New blocks are zeroed and show up in every existing mapping the next time they are touched.
+    ///
+    /// \param newSize New committed size, page aligned
+    ///
+    /// \return 0 on success, -EINVAL if newSize exceeds the reserved size, -ENOMEM if out of memory
+    /////////////////////////////
+    long Grow(size_t newSize);
+
+    ALWAYS_INLINE size_t Committed() const { return committed; }
+    size_t UsedPhysicalMemory() const override { return committed; }
 
     ALWAYS_INLINE int64_t Key() const { return key; }
     ALWAYS_INLINE pid_t Owner() const { return owner; }
@@ -19,6 +36,7 @@ public:
     ALWAYS_INLINE bool CanMunmap() const override { return true; }
 private:
     int64_t key; // Key
+    size_t committed; // Backed part of the object, the object size is what is reserved
 
     pid_t owner; // Owner Process
     pid_t recipient; // Recipient Process (if private)
@@ -30,7 +48,9 @@ namespace Memory{
     int CanModifySharedMemory(pid_t pid, int64_t key);
     FancyRefPtr<SharedVMObject> GetSharedMemory(int64_t key);
     
-    int64_t CreateSharedMemory(uint64_t size, uint64_t flags, pid_t owner, pid_t recipient);
+    // reserve is only used with SMEM_FLAGS_RESERVE, otherwise the object cannot grow
+    int64_t CreateSharedMemory(uint64_t size, uint64_t flags, pid_t owner, pid_t recipient, uint64_t reserve = 0);
+    long GrowSharedMemory(int64_t key, uint64_t size, pid_t pid);
     void* MapSharedMemory(int64_t key, Process* proc, uint64_t hint);
     void DestroySharedMemory(int64_t key);
 }
\ No newline at end of file
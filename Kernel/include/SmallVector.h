@@ -0,0 +1,29 @@
+#pragma once
+
+#include <Vector.h>
+
+#include <stdint.h>
+
+/////////////////////////////
+/// \brief Vector with room for N elements inside the object itself
+///
+/// Nothing is allocated until there are more than N elements, so short lived vectors
+/// (e.g. syscall arguments) can live on the stack. Can be passed anywhere a Vector<T>& is taken.
+/////////////////////////////
+template <typename T, size_t N> class SmallVector final : public Vector<T> {
+public:
+    // Vector grows as soon as it is full, the extra slot keeps N elements inline
+    SmallVector() : Vector<T>(reinterpret_cast<T*>(m_buffer), N + 1) {}
+
+    template <typename... D> SmallVector(D... data) : SmallVector() { (this->add_back(data), ...); }
+
+    SmallVector(const SmallVector&) = delete;
+    SmallVector& operator=(const SmallVector&) = delete;
+
+    ~SmallVector() {
+        this->clear(); // Before the buffer goes away
+    }
+
+private:
+    alignas(T) uint8_t m_buffer[sizeof(T) * (N + 1)];
+};
@@ -6,7 +6,40 @@ typedef volatile int lock_t;
 #include <Compiler.h>
 
 //#define CHECK_DEADLOCK
-#ifdef CHECK_DEADLOCK
+
+#include <LockStatistics.h>
+#include <TicketLock.h>
+
+#ifdef LOCK_STATISTICS
+
+#define acquireLock(lock)                                                                                              \
+    ({                                                                                                                 \
+        lock_t* _lockStat = (lock);                                                                                    \
+        uint64_t _spinCycles = 0;                                                                                      \
+        if (__atomic_exchange_n(_lockStat, 1, __ATOMIC_ACQUIRE)) {                                                     \
+            uint64_t _spinStart = ReadTimestampCounter();                                                              \
+            while (__atomic_exchange_n(_lockStat, 1, __ATOMIC_ACQUIRE))                                                \
+                asm("pause");                                                                                          \
+            _spinCycles = ReadTimestampCounter() - _spinStart + 1;                                                     \
+        }                                                                                                              \
+        LockStatisticsAcquired(_lockStat, _spinCycles);                                                                \
+    })
+
+#define acquireLockIntDisable(lock)                                                                                    \
+    ({                                                                                                                 \
+        lock_t* _lockStat = (lock);                                                                                    \
+        uint64_t _spinCycles = 0;                                                                                      \
+        asm volatile("cli");                                                                                           \
+        if (__atomic_exchange_n(_lockStat, 1, __ATOMIC_ACQUIRE)) {                                                     \
+            uint64_t _spinStart = ReadTimestampCounter();                                                              \
+            while (__atomic_exchange_n(_lockStat, 1, __ATOMIC_ACQUIRE))                                                \
+                asm volatile("sti; pause; cli");                                                                       \
+            _spinCycles = ReadTimestampCounter() - _spinStart + 1;                                                     \
+        }                                                                                                              \
+        LockStatisticsAcquired(_lockStat, _spinCycles);                                                                \
+    })
+
+#elif defined CHECK_DEADLOCK
 #include <Assert.h>
 
 #define acquireLock(lock)                                                                                              \
@@ -47,6 +80,27 @@ typedef volatile int lock_t;
 
 #endif
 
+#ifdef LOCK_STATISTICS
+
+#define releaseLock(lock)                                                                                              \
+    ({                                                                                                                 \
+        lock_t* _lockStat = (lock);                                                                                    \
+        LockStatisticsReleased(_lockStat);                                                                             \
+        __atomic_store_n(_lockStat, 0, __ATOMIC_RELEASE);                                                              \
+    });
+
+#define acquireTestLock(lock)                                                                                          \
+    ({                                                                                                                 \
+        lock_t* _lockStat = (lock);                                                                                    \
+        int status;                                                                                                    \
+        status = __atomic_exchange_n(_lockStat, 1, __ATOMIC_ACQUIRE);                                                  \
+        if (!status)                                                                                                   \
+            LockStatisticsAcquired(_lockStat, 0);                                                                      \
+        status;                                                                                                        \
+    })
+
+#else
+
 #define releaseLock(lock) ({ __atomic_store_n(lock, 0, __ATOMIC_RELEASE); });
 
 #define acquireTestLock(lock)                                                                                          \
@@ -56,6 +110,8 @@ typedef volatile int lock_t;
         status;                                                                                                        \
     })
 
+#endif
+
 template <bool disableInterrupts = false> class ScopedSpinLock final {
 public:
     ALWAYS_INLINE ScopedSpinLock(lock_t& lock) : m_lock(lock) {
@@ -83,4 +139,33 @@ public:
 private:
     lock_t& m_lock;
     bool m_irq;
-};
\ No newline at end of file
+};
+
+template <bool disableInterrupts = false> class ScopedTicketLock final {
+public:
+    ALWAYS_INLINE ScopedTicketLock(TicketLock& lock) : m_lock(lock) {
+        if constexpr (disableInterrupts) {
+            m_irq = CheckInterrupts();
+            if (m_irq) {
+                m_lock.AcquireIntDisable();
+            } else {
+                m_lock.Acquire();
+            }
+        } else {
+            m_lock.Acquire();
+        }
+    }
+    ALWAYS_INLINE ~ScopedTicketLock() {
+        m_lock.Release();
+
+        if constexpr (disableInterrupts) {
+            if (m_irq) {
+                asm volatile("sti");
+            }
+        }
+    }
+
+private:
+    TicketLock& m_lock;
+    bool m_irq;
+};
@@ -310,6 +310,15 @@ typedef struct tagHBA_CMD_TBL
 #define AHCI_CAP_SSC (1 << 14) // Slumber state capable?
 #define AHCI_CAP_PSC (1 << 13) // Partial state capable
 #define AHCI_CAP_SALP (1 << 26) // Supports aggressive link power management
+#define AHCI_CAP_CCCS (1 << 7) // Command completion coalescing supported
+
+#define AHCI_CCC_CTL_EN (1 << 0) // Command completion coalescing enable
+#define AHCI_CCC_CTL_INT(x) (((x) >> 3) & 0x1f) // Bit in IS set when coalesced completions are reported
+#define AHCI_CCC_CTL_CC(x) (((x) & 0xff) << 8) // Completions before an interrupt
+#define AHCI_CCC_CTL_TV(x) (((x) & 0xffff) << 16) // Timeout in ms before an interrupt
+
+#define AHCI_CCC_COMPLETIONS 0 // Default completions reported by one interrupt, 0 disables coalescing
+#define AHCI_CCC_TIMEOUT 1 // Longest a completion waits for its interrupt in ms
 
 #define AHCI_CAP2_NVMHCI (1 << 1) // NVMHCI Present
 #define AHCI_CAP2_BOHC (1 << 0) // BIOS/OS Handoff
@@ -332,8 +341,24 @@ typedef struct tagHBA_CMD_TBL
 #define HBA_PxCMD_ICC 	(0xf << 28)
 #define HBA_PxCMD_ICC_ACTIVE (1 << 28)
 
+#define HBA_PxIS_DHRS (1 << 0) // Device to host register FIS
+#define HBA_PxIS_SDBS (1 << 3) // Set device bits FIS, sent when NCQ commands complete
+#define HBA_PxIS_IFS (1 << 27) // Interface fatal error
+#define HBA_PxIS_HBDS (1 << 28) // Host bus data error
+#define HBA_PxIS_HBFS (1 << 29) // Host bus fatal error
+#define HBA_PxIS_TFES (1 << 30) // Task file error
+#define HBA_PxIS_ERROR (HBA_PxIS_IFS | HBA_PxIS_HBDS | HBA_PxIS_HBFS | HBA_PxIS_TFES)
+
 #define HBA_PORT_IPM_ACTIVE 1
 
+#define AHCI_MAX_SLOTS 32
+#define AHCI_CAP_NCS(cap) ((((cap) >> 8) & 0x1f) + 1) // Number of command slots
+#define AHCI_PRDT_MAX_ENTRIES ((PAGE_SIZE_4K - 0x80) / sizeof(hba_prdt_entry_t)) // Each command table is a page
+#define AHCI_MAX_TRANSFER 524288 // Bytes per command, fits in the PRDT even when the buffer is not page aligned
+#define AHCI_BUFFER_COUNT 8
+#define AHCI_COMMAND_TIMEOUT 1000000 // 1s
+#define AHCI_IO_THREADS 4 // DiskDevice threads per port when NCQ is in use
+
 #define HBA_PxSSTS_DET 0xfULL
 #define HBA_PxSSTS_DET_INIT 1
 #define HBA_PxSSTS_DET_PRESENT 3
@@ -345,6 +370,12 @@ namespace AHCI{
 		Active = 2,
 	};
 
+	struct CommandSlot{
+		ThreadBlocker* blocker = nullptr; // Unblocked when the command completes
+		int status = 0;
+		bool complete = false;
+	};
+
 	class Port : public DiskDevice{
 	public:
 		Port(int num, hba_port_t* portStructure, hba_mem_t* hbaMem);
@@ -352,14 +383,34 @@ namespace AHCI{
 		int ReadDiskBlock(uint64_t lba, uint32_t count, void* buffer);
 		int WriteDiskBlock(uint64_t lba, uint32_t count, void* buffer);
 
+		// Complete any commands the port has finished, called from the controller interrupt handler
+		void ProcessCompletions();
+		// Wait for the controller interrupt instead of polling
+		void EnableInterrupts();
+
         int blocksize = 512;
 		AHCIStatus status = AHCIStatus::Uninitialized;
 	private:
 		int AcquireBuffer();
 		void ReleaseBuffer(int index);
 
-		int FindCmdSlot();
-		int Access(uint64_t lba, uint32_t count, uintptr_t physBuffer, int write);
+		// Returns a free command slot or -1 if all are in use
+		int TryAcquireSlot();
+
+		/////////////////////////////
+		/// \brief Fill in the command table for slot and issue it
+		///
+		/// \param buffer Kernel heap memory to transfer to or from, must be 2 byte aligned
+		/// \param size Size of the transfer, must be even and at most AHCI_MAX_TRANSFER
+		/////////////////////////////
+		void Issue(int slot, const fis_reg_h2d_t& cmdfis, uint8_t* buffer, uint32_t size, bool write);
+		// Wait for the command in slot to complete and free the slot, returns 0 or an error
+		int Wait(int slot);
+
+		// Stop and restart the command engine, failing every outstanding command. slotLock must be held
+		void ResetCommandEngine();
+
+		int Access(uint64_t lba, uint32_t count, uint8_t* buffer, int write);
 		void Identify();
 
 		hba_port_t* registers;
@@ -367,16 +418,31 @@ namespace AHCI{
 		hba_cmd_header_t* commandList; // Address Mapping of the Command List
 		hba_fis_t* fis; // Address Mapping of the FIS
 
-		hba_cmd_tbl_t* commandTables[8];
+		hba_cmd_tbl_t* commandTables[AHCI_MAX_SLOTS];
+		unsigned slotCount = 0; // Command slots supported by the HBA
 
-		uint64_t physBuffers[8];
-		void* buffers[8];
-		lock_t bufferLocks[8];
+		// Slots are used by one command at a time until it has been waited on
+		CommandSlot slots[AHCI_MAX_SLOTS];
+		uint32_t freeSlots = 0;
+		uint32_t activeSlots = 0; // Issued to the HBA and not completed
+		lock_t slotLock = 0;
 
-		Semaphore bufferSemaphore = Semaphore(8);
-		Semaphore portLock = Semaphore(1); // Binary semaphore for the AHCI port
+		unsigned queueDepth = 1; // Reported by the drive, more than 1 if it supports NCQ
+		bool ncq = false; // Use READ/WRITE FPDMA QUEUED with up to slotCount commands outstanding
+		bool interruptsEnabled = false;
+
+		// For transfers which cannot go straight to the caller's buffer
+		uint64_t physBuffers[AHCI_BUFFER_COUNT];
+		void* buffers[AHCI_BUFFER_COUNT];
+		lock_t bufferLocks[AHCI_BUFFER_COUNT];
+
+		Semaphore bufferSemaphore = Semaphore(AHCI_BUFFER_COUNT);
 	};
 
+	// Completions reported by one coalesced interrupt, 0 disables coalescing.
+	// Most I/O waits on a single command, which would wait for the timeout, so it is off unless set with ahcicoalesce=
+	extern unsigned cccCompletions;
+
 	int Init();
 
 	void StartCMD(hba_port_t *port);
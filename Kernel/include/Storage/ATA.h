@@ -36,6 +36,12 @@
 #define ATA_CMD_READ_DMA_EX     0x25
 #define ATA_CMD_WRITE_DMA_EX    0x35
 #define ATA_CMD_IDENTIFY        0xec
+#define ATA_CMD_READ_FPDMA_QUEUED   0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED  0x61
+
+#define ATA_IDENTIFY_QUEUE_DEPTH 75 // Word containing the maximum queue depth - 1
+#define ATA_IDENTIFY_SATA_CAPABILITIES 76
+#define ATA_SATA_CAP_NCQ (1 << 8)
 
 #define ATA_PRD_BUFFER(x) (x & 0xFFFFFFFF)
 #define ATA_PRD_TRANSFER_SIZE(x) ((x & 0xFFFFULL) << 32)
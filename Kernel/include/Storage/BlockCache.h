@@ -0,0 +1,112 @@
+#pragma once
+
+#include <Compiler.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+class DiskDevice;
+
+#define BLOCK_CACHE_MEMORY_DIVISOR 4 // Cache at most 1/4 of physical memory, reclaim frees it earlier if needed
+#define BLOCK_CACHE_BUCKETS 4096
+#define BLOCK_CACHE_SHARDS 16 // Each with its own lock and a share of the buckets and pages
+#define BLOCK_CACHE_MAX_READ_PAGES 32 // Most uncached pages read from the disk with one request
+
+// Percentages of the cache that can be dirty
+#define BLOCK_CACHE_DIRTY_BACKGROUND_RATIO 10 // Past this the flusher writes back pages regardless of age
+#define BLOCK_CACHE_DIRTY_RATIO 20            // Past this writers write back pages themselves
+
+#define BLOCK_CACHE_DIRTY_EXPIRE 5000000    // Microseconds a page can be dirty before the flusher writes it back
+#define BLOCK_CACHE_FLUSH_INTERVAL 1000000 // Microseconds between flusher passes
+
+// Kernel wide cache of disk contents, kept in 4KB pages keyed by disk and byte offset
+//
+// All disk and partition I/O goes through the cache (see DiskDevice and PartitionDevice)
+// so memory goes to whichever disk or filesystem is being used rather than a fixed budget for each driver.
+// Writes only dirty the cached pages, which are written back by the flusher thread once they have been
+// dirty for a while or too much of the cache is dirty, or by Sync.
+// Clean pages are freed once the cache is full or when memory is reclaimed, picked by the CLOCK algorithm
+// so cache hits never reorder the lists.
+namespace BlockCache {
+
+// Size the cache from physical memory and start the flusher thread, disks are not cached before this
+void Initialize();
+
+/////////////////////////////
+/// \brief Read from a disk through the cache
+///
+/// May block whilst pages are read from the disk.
+///
+/// \param offset Offset on the disk in bytes, must be a multiple of the disk's block size
+///
+/// \return 0 on success, the driver's error otherwise (see DiskDevice::ReadDiskBlock)
+/////////////////////////////
+int Read(DiskDevice* disk, uint64_t offset, size_t size, void* buffer);
+
+/////////////////////////////
+/// \brief Write to a disk through the cache
+///
+/// Pages written to are dirtied and written back later.
+/// Partially written pages that are not cached are read first.
+/// May block writing back pages if too much of the cache is dirty.
+///
+/// \param offset Offset on the disk in bytes, must be a multiple of the disk's block size
+///
+/// \return 0 on success, the driver's error otherwise (see DiskDevice::WriteDiskBlock)
+/////////////////////////////
+int Write(DiskDevice* disk, uint64_t offset, size_t size, void* buffer);
+
+/////////////////////////////
+/// \brief Write back the dirty pages of part of a disk
+///
+/// \param offset Offset on the disk in bytes
+/// \param size Size of the range, UINT64_MAX for the rest of the disk
+///
+/// \return 0 on success, the driver's error if any page failed to be written
+/////////////////////////////
+int Sync(DiskDevice* disk, uint64_t offset = 0, uint64_t size = UINT64_MAX);
+
+// Drop every cached page of a disk, including dirty pages
+void Purge(DiskDevice* disk);
+
+struct CachedPage;
+
+// A page held in the cache by Pin, unpinned when released or destroyed
+class PinnedPage final {
+    friend int Pin(DiskDevice* disk, uint64_t offset, PinnedPage& pinned);
+
+public:
+    PinnedPage() = default;
+    ~PinnedPage() { Release(); }
+
+    PinnedPage(const PinnedPage&) = delete;
+    PinnedPage& operator=(const PinnedPage&) = delete;
+
+    // The whole 4KB page
+    ALWAYS_INLINE uint8_t* Data() const { return m_data; }
+    ALWAYS_INLINE bool IsPinned() const { return m_page; }
+
+    // Mark the page dirty after changing its data, it is written back like any other write
+    void MarkDirty();
+    void Release();
+
+private:
+    CachedPage* m_page = nullptr;
+    uint8_t* m_data = nullptr; // Kernel mapping of the page whilst it is pinned
+};
+
+/////////////////////////////
+/// \brief Pin the cached page holding offset, reading it from the disk if it is not cached
+///
+/// The data of a pinned page can be used in place rather than copied out with Read.
+/// Pinned pages are never evicted, so pins should not be held for long.
+/// May block whilst the page is read.
+///
+/// \param offset Offset on the disk in bytes, the page holding it is pinned
+/// \param pinned Set to the pinned page, any page it had pinned is released
+///
+/// \return 0 on success, 1 if the disk is not cached, the driver's error otherwise
+/////////////////////////////
+int Pin(DiskDevice* disk, uint64_t offset, PinnedPage& pinned);
+
+} // namespace BlockCache
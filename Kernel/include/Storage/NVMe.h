@@ -42,6 +42,13 @@
 
 #define NVME_NSSR_RESET_VALUE 0x4E564D65 // "NVME", initiates a reset
 
+#define NVME_QUEUE_MAX_COMMANDS 64 // Outstanding commands per queue, limited by the size of NVMeQueue::freeCommands
+#define NVME_COMMAND_TIMEOUT 500000 // Command timeout in microseconds
+#define NVME_STATUS_TIMEOUT 32767 // Completion status given to commands which time out
+#define NVME_NAMESPACE_BUFFER_COUNT 32 // Transfers which can be in progress at once on a namespace
+#define NVME_NAMESPACE_IO_THREADS 4 // I/O threads for each namespace, each keeps one request outstanding
+#define NVME_MAX_TRANSFER 2097152 // Bytes per command, as many pages as fit in a one page PRP list
+
 namespace NVMe{
 	struct NVMeIdentifyCommand{
 		enum{
@@ -172,6 +179,13 @@ namespace NVMe{
 	};
 	static_assert(sizeof(NVMeCompletion) == 16);
 
+	struct NVMeRequest{
+		NVMeCompletion completion;
+		ThreadBlocker* blocker = nullptr; // Unblocked when the command completes
+		bool complete = false;
+		bool abandoned = false; // Timed out, the command ID is freed if the command ever completes
+	};
+
 	class NVMeQueue{
 		uint16_t queueID = 0;
 
@@ -190,9 +204,15 @@ namespace NVMe{
 		uint16_t cqCount = 0; // Amount of elements in CQ
 		uint16_t sqCount = 0; // Amount of elements in SQ
 
+		// Taken by the interrupt handler so must be acquired with interrupts disabled
 		lock_t queueLock = 0;
 
-		uint16_t nextCommandID = 0;
+		// The command ID is the index into requests, a command ID is in use until its completion is read.
+		// At most sqCount - 1 commands are outstanding so the submission queue can never overflow.
+		NVMeRequest requests[NVME_QUEUE_MAX_COMMANDS];
+		uint64_t freeCommands = 0; // Bitmap of unused command IDs
+
+		bool interruptsEnabled = false;
 	public:
 		bool completionCycleState = true;
 		uint16_t cqHead = 0;
@@ -214,9 +234,31 @@ namespace NVMe{
 
 		long Consume(NVMeCommand& cmd);
 
-		void Submit(NVMeCommand& cmd);
+		///////////////////////////////
+		/// \brief Submit a command without waiting for it
+		///
+		/// Yields whilst every command ID is in use.
+		///
+		/// \return Command ID to pass to Wait
+		///////////////////////////////
+		uint16_t Submit(NVMeCommand& cmd);
+
+		///////////////////////////////
+		/// \brief Wait for a command returned by Submit to complete
+		///
+		/// Blocks until the completion interrupt if interrupts are enabled, otherwise polls.
+		/// The command ID is free to be reused afterwards.
+		/// Completion status is set to NVME_STATUS_TIMEOUT on timeout.
+		///////////////////////////////
+		void Wait(uint16_t commandID, NVMeCompletion& complet);
 		void SubmitWait(NVMeCommand& cmd, NVMeCompletion& complet);
 
+		// Read new completion queue entries and wake the threads waiting for them
+		void ProcessCompletions();
+
+		__attribute__((always_inline)) inline void EnableInterrupts() { interruptsEnabled = true; }
+
+		__attribute__((always_inline)) uint16_t ID() { return queueID; }
 		__attribute__((always_inline)) uint16_t CQSize() { return cqCount; }
 		__attribute__((always_inline)) uint16_t SQSize() { return sqCount; }
 		__attribute__((always_inline)) uintptr_t CQBase() { return completionBase; }
@@ -262,8 +304,12 @@ namespace NVMe{
 		long IdentifyController();
 		long GetNamespaceList();
 
-		NVMeQueue* AcquireIOQueue();
-		void ReleaseIOQueue(NVMeQueue* queue);
+		// I/O queue belonging to the current CPU.
+		// The thread may move to another CPU afterwards, which is harmless as queues can be used from any CPU.
+		NVMeQueue* GetIOQueue();
+
+		// Most bytes a single read or write command can transfer
+		__attribute__((always_inline)) inline uint32_t MaxTransferSize() const { return maxTransferSize; }
 
 		__attribute__((always_inline)) inline DriverStatus Status(){ return dStatus; }
 	private:
@@ -364,16 +410,29 @@ namespace NVMe{
 		Vector<uint32_t> namespaceIDs;
 		List<Namespace*> namespaces;
 
-		List<NVMeQueue*> ioQueues;
+		// One I/O queue per CPU, CPUs share queues if the controller does not give us enough
+		NVMeQueue** ioQueues = nullptr;
+		unsigned ioQueueCount = 0;
 		uint16_t nextQueueID = 1;
 		NVMeQueue adminQueue;
 
 		DriverStatus dStatus;
 
+		uint32_t maxTransferSize = NVME_MAX_TRANSFER;
+
 		uint16_t completionQueuesAllocated = 1;
 		uint16_t submissionQueuesAllocated = 1;
 
-		Semaphore queueAvailability = Semaphore(0);
+		enum InterruptMode{
+			InterruptsNone, // Completion is polled
+			InterruptsShared, // One vector for every I/O queue
+			InterruptsPerQueue, // An MSI-X vector for each I/O queue, sent to the CPU using the queue
+		};
+		InterruptMode intMode = InterruptsNone;
+		uint8_t sharedIRQ = 0xFF;
+
+		static void QueueIRQHandler(NVMeQueue* queue, RegisterContext* r);
+		static void SharedIRQHandler(Controller* c, RegisterContext* r);
 
 		#pragma region Controller Registers
 		// Capabilities
@@ -446,6 +505,7 @@ namespace NVMe{
 
 		uint16_t AllocateQueueID() { return nextQueueID++; }
 
+		void SetupInterrupts(unsigned queueCount);
 		long CreateIOQueue(NVMeQueue* qPtr);
 		long SetNumberOfQueues(uint16_t num);
 	};
@@ -455,14 +515,19 @@ namespace NVMe{
 		size_t diskSize;
 		uint32_t nsID;
 
-		uintptr_t physBuffers[8];
-		void* buffers[8];
-		lock_t bufferLocks[8];
-		Semaphore bufferAvailability = Semaphore(8);
+		// Page sized buffers, one is used by each transfer in progress.
+		// Transfers which can be done with DMA straight to the caller's pages use it as their PRP list,
+		// others bounce through it.
+		uintptr_t physBuffers[NVME_NAMESPACE_BUFFER_COUNT];
+		void* buffers[NVME_NAMESPACE_BUFFER_COUNT];
+		lock_t bufferLocks[NVME_NAMESPACE_BUFFER_COUNT];
+		Semaphore bufferAvailability = Semaphore(NVME_NAMESPACE_BUFFER_COUNT);
 
 		int AcquireBuffer();
 		void ReleaseBuffer(int buffer);
 
+		int Access(uint64_t lba, uint32_t count, uint8_t* buffer, bool write);
+
 	public:
 		enum NamespaceStatus{
 			Uninitialized = 0,
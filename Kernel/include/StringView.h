@@ -1,6 +1,8 @@
 #pragma once
 
 #include <Assert.h>
+#include <Compiler.h>
+#include <Hash.h>
 #include <String.h>
 
 class StringView {
@@ -27,4 +29,12 @@ inline bool operator==(const StringView& l, const StringView& r){
 
 inline bool operator!=(const StringView& l, const StringView& r){
     return strcmp(l.Data(), r.Data());
-}
\ No newline at end of file
+}
+template<>
+struct HashKeyCompatible<StringView, const char*> {
+    ALWAYS_INLINE static unsigned Hash(const char* key) { return HashString(key); }
+    ALWAYS_INLINE static bool Equals(const StringView& l, const char* r) { return !strcmp(l.Data(), r); }
+};
+
+template<>
+struct HashKeyCompatible<StringView, char*> : HashKeyCompatible<StringView, const char*> {};
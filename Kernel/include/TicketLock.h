@@ -0,0 +1,85 @@
+#pragma once
+
+#include <Compiler.h>
+#include <LockStatistics.h>
+#include <stdint.h>
+
+// Included by CPU.h for the run queue lock, so this cannot depend on CPU.h (see ScopedTicketLock in Spinlock.h)
+
+#define TICKET_LOCK_BACKOFF 32 // Pauses per waiter ahead in the queue
+
+/////////////////////////////
+/// \brief Fair spinlock for heavily contended locks
+///
+/// Threads take a ticket and get the lock in the order they arrived, so no CPU is starved.
+/// Waiters back off for longer the further back in the queue they are to keep
+/// traffic on the lock's cache line down whilst it is handed over.
+///
+/// Unlike acquireLockIntDisable, interrupts stay disabled whilst waiting
+/// as the ticket is held for the CPU the whole time.
+/////////////////////////////
+class TicketLock final {
+public:
+    ALWAYS_INLINE void Acquire() {
+        uint32_t ticket = __atomic_fetch_add(&m_next, 1, __ATOMIC_RELAXED);
+        Wait(ticket);
+    }
+
+    ALWAYS_INLINE void AcquireIntDisable() {
+        asm volatile("cli");
+        Acquire();
+    }
+
+    // Returns true if the lock was acquired
+    ALWAYS_INLINE bool TryAcquire() {
+        uint32_t owner = __atomic_load_n(&m_owner, __ATOMIC_RELAXED);
+        if (!__atomic_compare_exchange_n(&m_next, &owner, owner + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return false; // Held or another CPU got the ticket first
+        }
+
+#ifdef LOCK_STATISTICS
+        LockStatisticsAcquired(this, 0);
+#endif
+        return true;
+    }
+
+    ALWAYS_INLINE void Release() {
+#ifdef LOCK_STATISTICS
+        LockStatisticsReleased(this);
+#endif
+        // Only the holder changes the owner
+        __atomic_store_n(&m_owner, m_owner + 1, __ATOMIC_RELEASE);
+    }
+
+    ALWAYS_INLINE bool IsLocked() const {
+        return __atomic_load_n(&m_owner, __ATOMIC_RELAXED) != __atomic_load_n(&m_next, __ATOMIC_RELAXED);
+    }
+
+private:
+    ALWAYS_INLINE void Wait(uint32_t ticket) {
+        uint32_t owner = __atomic_load_n(&m_owner, __ATOMIC_ACQUIRE);
+        if (__builtin_expect(owner == ticket, 1)) {
+#ifdef LOCK_STATISTICS
+            LockStatisticsAcquired(this, 0);
+#endif
+            return;
+        }
+
+#ifdef LOCK_STATISTICS
+        uint64_t spinStart = __builtin_ia32_rdtsc();
+#endif
+        do {
+            for (uint32_t i = (ticket - owner) * TICKET_LOCK_BACKOFF; i; i--) {
+                asm volatile("pause");
+            }
+            owner = __atomic_load_n(&m_owner, __ATOMIC_ACQUIRE);
+        } while (owner != ticket);
+
+#ifdef LOCK_STATISTICS
+        LockStatisticsAcquired(this, __builtin_ia32_rdtsc() - spinStart + 1);
+#endif
+    }
+
+    uint32_t m_owner = 0; // Ticket being served
+    uint32_t m_next = 0;  // Next ticket to hand out
+};
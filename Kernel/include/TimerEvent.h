@@ -9,13 +9,23 @@ namespace Timer{
     using TimerCallback = void(*)(void*);
     void Handler(void*, RegisterContext* r);
 
+    class TimerEvent;
+    void QueueEvent(TimerEvent* ev, uint64_t expires);
+    void CascadeSlot(FastList<TimerEvent*>* slot);
+    void AdvanceWheel();
+
     class TimerEvent final {
         friend void Timer::Handler(void*, RegisterContext* r);
+        friend void Timer::QueueEvent(TimerEvent* ev, uint64_t expires);
+        friend void Timer::CascadeSlot(FastList<TimerEvent*>* slot);
+        friend void Timer::AdvanceWheel();
         friend class ::FastList<TimerEvent*>;
     protected:
-        long ticks = 0;
+        uint64_t expires; // Tick the event is dispatched on
         bool dispatched = false;
 
+        FastList<TimerEvent*>* slot = nullptr; // Timer wheel slot the event is queued in
+
         lock_t lock = 0;
 
         TimerEvent* next = nullptr;
@@ -29,7 +39,8 @@ namespace Timer{
         TimerEvent(long _us, TimerCallback _callback, void* data);
         ~TimerEvent();
 
-        inline long GetTicks() const { return ticks; }
+        // Ticks left until the event is dispatched
+        long GetTicks() const;
 
         __attribute__((always_inline)) inline void Lock() { acquireLock(&lock); }
         __attribute__((always_inline)) inline void Unlock() { releaseLock(&lock); }
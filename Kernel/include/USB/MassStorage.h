@@ -0,0 +1,97 @@
+#pragma once
+
+#include <Device.h>
+#include <Lock.h>
+#include <USB/XHCI.h>
+
+#define USB_MSC_MAX_TRANSFER 131072 // Most bytes moved by one SCSI command
+#define USB_MSC_READY_RETRIES 20    // TEST UNIT READY attempts whilst the medium spins up, 100ms apart
+
+#define USB_MSC_CBW_SIGNATURE 0x43425355 // 'USBC'
+#define USB_MSC_CSW_SIGNATURE 0x53425355 // 'USBS'
+#define USB_MSC_CBW_DATA_IN (1 << 7)
+
+#define USB_MSC_REQUEST_RESET 0xFF // Bulk-Only Mass Storage Reset
+
+namespace USB {
+// USB Mass Storage Bulk-Only Transport device with the SCSI command set
+class MassStorage final : public DiskDevice {
+public:
+    enum DriverStatus {
+        Uninitialized,
+        Error,
+        Active,
+    };
+    DriverStatus status = Uninitialized;
+
+    MassStorage(XHCIController* hcd, XHCIController::TransferRing* control, XHCIController::TransferRing* bulkIn,
+                XHCIController::TransferRing* bulkOut, uint8_t interface);
+    ~MassStorage();
+
+    int ReadDiskBlock(uint64_t lba, uint32_t count, void* buffer);
+    int WriteDiskBlock(uint64_t lba, uint32_t count, void* buffer);
+
+private:
+    struct CommandBlockWrapper {
+        uint32_t signature;
+        uint32_t tag; // Echoed back in the status
+        uint32_t dataTransferLength;
+        uint8_t flags;
+        uint8_t lun;
+        uint8_t commandLength;
+        uint8_t command[16];
+    } __attribute__((packed));
+
+    struct CommandStatusWrapper {
+        uint32_t signature;
+        uint32_t tag;
+        uint32_t dataResidue;
+        uint8_t status; // 0 passed, 1 failed, 2 phase error
+    } __attribute__((packed));
+
+    static_assert(sizeof(CommandBlockWrapper) == 31);
+    static_assert(sizeof(CommandStatusWrapper) == 13);
+
+    enum SCSICommands {
+        SCSICmdTestUnitReady = 0x00,
+        SCSICmdRequestSense = 0x03,
+        SCSICmdReadCapacity10 = 0x25,
+        SCSICmdRead10 = 0x28,
+        SCSICmdWrite10 = 0x2A,
+        SCSICmdRead16 = 0x88,
+        SCSICmdWrite16 = 0x8A,
+        SCSICmdServiceActionIn16 = 0x9E, // READ CAPACITY (16) with service action 0x10
+    };
+
+    XHCIController* hcd;
+    XHCIController::TransferRing* control;
+    XHCIController::TransferRing* bulkIn;
+    XHCIController::TransferRing* bulkOut;
+    uint8_t interface;
+
+    uint64_t blockCount = 0;
+    uint32_t nextTag = 1;
+
+    // Commands are carried out one at a time, the CBW, data and CSW of each are queued together
+    Mutex commandLock;
+    CommandBlockWrapper* cbw;
+    CommandStatusWrapper* csw;
+    uint8_t* bounceBuffer; // For buffers which cannot be used for DMA
+
+    /////////////////////////////
+    /// \brief Carry out a SCSI command
+    ///
+    /// \param data Kernel heap buffer for the data stage
+    /// \param in Whether data is read from the device
+    ///
+    /// \return 0 on success, -EIO on failure
+    /////////////////////////////
+    int Command(const uint8_t* command, uint8_t length, void* data, uint32_t dataLength, bool in);
+
+    // Bulk-only reset recovery, after which the device takes commands again
+    void ResetRecovery();
+
+    int ReadCapacity();
+    int Access(uint64_t lba, uint32_t count, uint8_t* buffer, bool write);
+};
+} // namespace USB
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stdint.h>
+
+#define USB_REQUEST_TYPE_IN (1 << 7)        // Device to host
+#define USB_REQUEST_TYPE_CLASS (1 << 5)
+#define USB_REQUEST_RECIPIENT_INTERFACE 0x1
+#define USB_REQUEST_RECIPIENT_ENDPOINT 0x2
+
+#define USB_ENDPOINT_IN (1 << 7)                    // Direction bit of the endpoint address
+#define USB_ENDPOINT_NUMBER(x) ((x) & 0xF)
+#define USB_ENDPOINT_TRANSFER_TYPE(x) ((x) & 0x3)   // From bmAttributes
+
+#define USB_FEATURE_ENDPOINT_HALT 0
+
+#define USB_CLASS_MASS_STORAGE 0x08
+#define USB_SUBCLASS_SCSI 0x06
+#define USB_PROTOCOL_BULK_ONLY 0x50
+
+namespace USB {
+enum DescriptorType {
+    DescriptorTypeDevice = 1,
+    DescriptorTypeConfiguration = 2,
+    DescriptorTypeString = 3,
+    DescriptorTypeInterface = 4,
+    DescriptorTypeEndpoint = 5,
+};
+
+enum StandardRequest {
+    RequestGetStatus = 0,
+    RequestClearFeature = 1,
+    RequestSetFeature = 3,
+    RequestSetAddress = 5,
+    RequestGetDescriptor = 6,
+    RequestGetConfiguration = 8,
+    RequestSetConfiguration = 9,
+};
+
+enum EndpointTransferType {
+    TransferTypeControl = 0,
+    TransferTypeIsochronous = 1,
+    TransferTypeBulk = 2,
+    TransferTypeInterrupt = 3,
+};
+
+struct DeviceDescriptor {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint16_t bcdUSB;
+    uint8_t bDeviceClass;
+    uint8_t bDeviceSubClass;
+    uint8_t bDeviceProtocol;
+    uint8_t bMaxPacketSize0; // Max packet size of the default control endpoint, a power of 2 exponent for USB 3
+    uint16_t idVendor;
+    uint16_t idProduct;
+    uint16_t bcdDevice;
+    uint8_t iManufacturer;
+    uint8_t iProduct;
+    uint8_t iSerialNumber;
+    uint8_t bNumConfigurations;
+} __attribute__((packed));
+
+struct ConfigurationDescriptor {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint16_t wTotalLength; // Length of the configuration and every descriptor following it
+    uint8_t bNumInterfaces;
+    uint8_t bConfigurationValue;
+    uint8_t iConfiguration;
+    uint8_t bmAttributes;
+    uint8_t bMaxPower;
+} __attribute__((packed));
+
+struct InterfaceDescriptor {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bInterfaceNumber;
+    uint8_t bAlternateSetting;
+    uint8_t bNumEndpoints;
+    uint8_t bInterfaceClass;
+    uint8_t bInterfaceSubClass;
+    uint8_t bInterfaceProtocol;
+    uint8_t iInterface;
+} __attribute__((packed));
+
+struct EndpointDescriptor {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bEndpointAddress;
+    uint8_t bmAttributes;
+    uint16_t wMaxPacketSize;
+    uint8_t bInterval;
+} __attribute__((packed));
+
+static_assert(sizeof(DeviceDescriptor) == 18);
+static_assert(sizeof(ConfigurationDescriptor) == 9);
+static_assert(sizeof(InterfaceDescriptor) == 9);
+static_assert(sizeof(EndpointDescriptor) == 7);
+} // namespace USB
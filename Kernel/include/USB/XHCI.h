@@ -2,6 +2,7 @@
 
 #include <Lock.h>
 #include <PCI.h>
+#include <USB/USB.h>
 #include <stdint.h>
 
 #define XHCI_PORT_OFFSET 0x400
@@ -44,12 +45,26 @@
 #define XHCI_PORTSC_PEC (1 << 18) // Port Enabled/Disabled Change
 #define XHCI_PORTSC_PRC (1 << 21) // Port Reset Change
 #define XHCI_PORTSC_WPR (1 << 31) // On USB3 ports warm reset
+#define XHCI_PORTSC_SPEED(x) (((x) >> 10) & 0xF) // Port speed ID
+// Written as 1 to clear or disable, must be masked off when writing anything else back
+#define XHCI_PORTSC_RW1C (XHCI_PORTSC_PED | (0x7FU << 17))
 
 #define XHCI_INT_ERDP_BUSY (1 << 3)
 
 #define XHCI_TRB_SIZE 16
 #define XHCI_EVENT_RING_SEGMENT_TABLE_ENTRY_SIZE 16
 
+#define XHCI_INT_MODERATION_INTERVAL 1000 // Default minimum time between interrupts in 250ns units (250us)
+
+#define XHCI_MAX_SLOTS 40 // Device slots we enable
+#define XHCI_MAX_ENDPOINTS 32 // Device context indices, 1 is the default control endpoint
+
+#define XHCI_TRB_MAX_TRANSFER 65536 // A TRB buffer may not cross a 64KB boundary
+#define XHCI_TD_MAX_TRBS 64 // Most TRBs in a TD built from a kernel buffer
+
+#define XHCI_COMPLETION_SUCCESS 1 // Completion codes passed to transfer callbacks
+#define XHCI_COMPLETION_SHORT_PACKET 13
+
 namespace USB {
 class XHCIController : private PCIDevice {
 public:
@@ -66,6 +81,102 @@ public:
 
     static int Initialize();
 
+    // Minimum time between interrupts in 250ns units, 0 for none. Set (in us) with xhciimod= on the kernel command line
+    static uint16_t interruptModeration;
+
+    struct TransferRing;
+
+    /////////////////////////////
+    /// \brief Called from the interrupt handler when a transfer descriptor completes
+    ///
+    /// \param context Pointer given when the transfer was queued
+    /// \param completionCode xHCI completion code of the last TRB
+    /// \param residual Bytes which were not transferred
+    /////////////////////////////
+    using TransferCallback = void (*)(void* context, int completionCode, size_t residual);
+
+    /////////////////////////////
+    /// \brief Create the transfer ring for an endpoint
+    ///
+    /// \param slotID Device slot
+    /// \param endpointID Device context index of the endpoint
+    ///
+    /// \return The ring, nullptr on failure
+    /////////////////////////////
+    TransferRing* CreateTransferRing(uint8_t slotID, uint8_t endpointID);
+
+    /////////////////////////////
+    /// \brief Queue a transfer on a bulk or interrupt endpoint
+    ///
+    /// The transfer is not started until TransferRing::Ring is called, so several can be queued with one doorbell.
+    ///
+    /// \param ring Transfer ring of the endpoint
+    /// \param buffer Physical address of the data
+    /// \param length Length of the data
+    /// \param callback Called once the transfer completes
+    /// \param context Passed to callback
+    ///
+    /// \return false if the ring is full
+    /////////////////////////////
+    bool QueueNormalTransfer(TransferRing* ring, uintptr_t buffer, size_t length, TransferCallback callback,
+                             void* context);
+
+    /////////////////////////////
+    /// \brief Queue a request on a control endpoint
+    ///
+    /// The direction of the data stage comes from bit 7 of requestType.
+    /// The transfer is not started until TransferRing::Ring is called.
+    ///
+    /// \param buffer Physical address of the data stage, ignored when length is 0
+    ///
+    /// \return false if the ring is full
+    /////////////////////////////
+    bool QueueControlTransfer(TransferRing* ring, uint8_t requestType, uint8_t request, uint16_t value, uint16_t index,
+                              uintptr_t buffer, uint16_t length, TransferCallback callback, void* context);
+
+    /////////////////////////////
+    /// \brief Queue a transfer to or from kernel heap memory on a bulk or interrupt endpoint
+    ///
+    /// The buffer does not need to be physically contiguous, the TD gets a TRB for every contiguous piece.
+    /// The transfer is not started until TransferRing::Ring is called.
+    ///
+    /// \return false if the ring is full or the buffer needs more than XHCI_TD_MAX_TRBS TRBs
+    /////////////////////////////
+    bool QueueBufferTransfer(TransferRing* ring, void* buffer, size_t length, TransferCallback callback,
+                             void* context);
+
+    // Lets a thread wait on a transfer, pass TransferWaiter::Complete as the callback and the waiter as the context
+    struct TransferWaiter {
+        Semaphore completion = Semaphore(0);
+        int completionCode = 0;
+        size_t residual = 0;
+
+        static void Complete(void* waiter, int completionCode, size_t residual);
+
+        // Wait for the transfer, returns true if it succeeded (a short packet counts as success)
+        bool Wait();
+    };
+
+    /////////////////////////////
+    /// \brief Carry out a request on a control endpoint and wait for it
+    ///
+    /// \param buffer Physical address of the data stage, ignored when length is 0
+    ///
+    /// \return 0 on success, -EIO on failure
+    /////////////////////////////
+    int ControlTransfer(TransferRing* ring, uint8_t requestType, uint8_t request, uint16_t value, uint16_t index,
+                        uintptr_t buffer, uint16_t length);
+
+    /////////////////////////////
+    /// \brief Recover a halted endpoint, or stop a running one
+    ///
+    /// Every TD still on the ring is thrown away without its callback being run,
+    /// the endpoint carries on from the next TD queued.
+    ///
+    /// \return 0 on success, -EIO on failure
+    /////////////////////////////
+    int ResetEndpoint(TransferRing* ring);
+
 protected:
     friend void XHCIIRQHandler(XHCIController* xHC, RegisterContext* r);
 
@@ -168,7 +279,7 @@ protected:
             uint32_t temp = configure;
 
             temp &= ~((uint32_t)USB_CFG_MAXSLOTSEN);
-            temp |= temp & USB_CFG_MAXSLOTSEN;
+            temp |= value & USB_CFG_MAXSLOTSEN;
 
             configure = temp;
         }
@@ -184,11 +295,13 @@ protected:
 
         inline bool Powered() { return portSC & XHCI_PORTSC_PP; }
 
-        inline void PowerOn() { portSC |= XHCI_PORTSC_PP; }
+        inline void PowerOn() { portSC = (portSC & ~XHCI_PORTSC_RW1C) | XHCI_PORTSC_PP; }
 
-        inline void Reset() { portSC |= XHCI_PORTSC_PR; }
+        inline void Reset() { portSC = (portSC & ~XHCI_PORTSC_RW1C) | XHCI_PORTSC_PR; }
 
-        inline void WarmReset() { portSC |= XHCI_PORTSC_WPR; }
+        inline void WarmReset() { portSC = (portSC & ~XHCI_PORTSC_RW1C) | XHCI_PORTSC_WPR; }
+
+        inline void ClearChanges() { portSC = (portSC & ~XHCI_PORTSC_RW1C) | (portSC & (0x7FU << 17)); }
 
         inline bool Enabled() { return portSC & XHCI_PORTSC_PED; }
 
@@ -632,7 +745,8 @@ protected:
         uint32_t rsvdZ2 : 8;
         uint32_t deconfigure : 1; // When 1 the command will "deconfigure" the Device Slot.
         uint32_t trbType : 6;
-        uint32_t rsvdZ3 : 16;
+        uint32_t rsvdZ3 : 8;
+        uint32_t slotID : 8; // The slot to configure
     } __attribute__((packed)) xhci_configure_endpoint_command_trb_t;
 
     static_assert(XHCI_TRB_SIZE == sizeof(xhci_trb_t));
@@ -682,6 +796,13 @@ protected:
 
         void SendCommandRaw(void* cmd);
         xhci_command_completion_event_trb_t SendCommand(void* cmd);
+
+        // Wakes the thread waiting on the command, called from the interrupt handler
+        void OnCompletion(const xhci_command_completion_event_trb_t& ev);
+
+    private:
+        // Copy a command into the ring, returns its index. lock must be held
+        unsigned Enqueue(xhci_trb_t* command);
     } commandRing = CommandRing(this);
 
     struct EventRingSegment {
@@ -733,6 +854,9 @@ protected:
 
     uint8_t maxSlots;
 
+    lock_t transferRingsLock = 0;
+    TransferRing* transferRings[XHCI_MAX_SLOTS + 1][XHCI_MAX_ENDPOINTS] = {}; // Indexed by slot ID and endpoint ID
+
     uint8_t controllerIRQ = 0xFF;
     Vector<xhci_ext_cap_supported_protocol_t*> protocols;
 
@@ -745,10 +869,87 @@ protected:
 
     void IRQHandler(RegisterContext* r);
 
-    void EnableSlot();
+    // Returns the ID of the slot, 0 on failure
+    uint8_t EnableSlot();
+
+    inline size_t ContextSize() const { return capRegs->contextSize ? 64 : 32; }
+
+    /////////////////////////////
+    /// \brief Address the device on a root hub port and hand it to a class driver
+    ///
+    /// \param port Root hub port number, starting at 1
+    /// \param speed Port speed ID
+    /////////////////////////////
+    void InitializeDevice(unsigned port, uint8_t speed);
+
+    /////////////////////////////
+    /// \brief Enable the bulk endpoints of an interface with a Configure Endpoint command
+    ///
+    /// \param inputPhys Physical address of a page for the input context
+    /// \param endpoints Endpoint descriptors
+    /// \param rings Filled with the transfer ring of each endpoint
+    ///
+    /// \return 0 on success, -EIO on failure
+    /////////////////////////////
+    int ConfigureEndpoints(uint8_t slotID, uintptr_t inputPhys, const EndpointDescriptor** endpoints,
+                           unsigned count, TransferRing** rings);
 
     void OnInterrupt();
+    void HandleEvent(const xhci_event_trb_t& ev);
 
     Status controllerStatus = ControllerNotInitialized;
 };
+
+// Ring for one endpoint, any amount of transfer descriptors can be outstanding at once
+struct XHCIController::TransferRing {
+    XHCIController* hcd;
+    uint8_t slotID;
+    uint8_t endpointID; // Device context index, also the doorbell target
+
+    uintptr_t physicalAddr;
+    xhci_trb_t* ring = nullptr;
+    unsigned enqueueIndex = 0;
+    unsigned dequeueIndex = 0; // Oldest TRB the controller has not finished with
+    unsigned maxIndex = 0;     // Index of the link TRB
+    bool cycleState = 1;
+
+    lock_t lock = 0;
+
+    struct PendingTransfer {
+        TransferCallback callback = nullptr;
+        void* context = nullptr;
+    };
+    PendingTransfer* pending = nullptr; // Indexed by the last TRB of each TD
+
+    TransferRing(XHCIController* c, uint8_t slot, uint8_t endpoint);
+
+    // Where the controller should carry on from, with the dequeue cycle state in bit 0
+    inline uintptr_t DequeuePointer() const {
+        return (physicalAddr + enqueueIndex * XHCI_TRB_SIZE) | (cycleState ? 1 : 0);
+    }
+
+    // Address of the endpoint, as used by USB requests
+    inline uint8_t EndpointAddress() const { return (endpointID / 2) | ((endpointID & 1) ? USB_ENDPOINT_IN : 0); }
+
+    /////////////////////////////
+    /// \brief Copy a TD into the ring
+    ///
+    /// The cycle bit of the first TRB is written last so the controller never sees part of a TD.
+    ///
+    /// \param trbs TRBs of the TD, chain bits already set. The last has interrupt on completion set
+    /// \param count Amount of TRBs
+    ///
+    /// \return false if the ring does not have room
+    /////////////////////////////
+    bool Queue(xhci_trb_t* trbs, unsigned count, TransferCallback callback, void* context);
+
+    // Let the controller know about everything queued so far
+    void Ring();
+
+    // Drop every TD on the ring without running callbacks, returns the new dequeue pointer
+    uintptr_t Flush();
+
+    // Retire the TD the event belongs to and run its callback, called from the interrupt handler
+    void OnTransferEvent(const xhci_transfer_event_trb_t& ev);
+};
 } // namespace USB
\ No newline at end of file
@@ -3,26 +3,99 @@
 #include <Compiler.h>
 #include <Paging.h>
 
+#include <bits/posix/iovec.h>
+
+class Process;
+
+// How UserMemcpy copies, picked from CPUID by InitializeUserCopy
+enum UserCopyMode : uint8_t {
+    UserCopyQwords = 0, // rep movsq, then rep movsb for the rest
+    UserCopyERMS = 1,   // Enhanced rep movsb, used for larger copies
+    UserCopyFSRM = 2,   // Fast short rep movsb, used for every copy
+};
+
 extern "C" {
+extern uint8_t userCopyMode;
+
+// Copy memory where a fault which cannot be handled returns 1 rather than panicking, 0 on success.
+// Nothing is checked, use CopyFromUser and CopyToUser
 int UserMemcpy(void* dest, const void* src, size_t count);
 void UserMemcpyTrap();
+void UserMemcpyTrapQ();
 void UserMemcpyTrapHandler();
+
+// Length of str, max if there is no null terminator within max bytes or -1 if reading faulted
+long UserStrnlen(const char* str, size_t max);
+void UserStrnlenTrap();
+void UserStrnlenTrapHandler();
+}
+
+/////////////////////////////
+/// \brief Pick how to copy user memory and register the page fault traps of the copy routines
+/////////////////////////////
+void InitializeUserCopy();
+
+// Whether the range lies in the user half of the address space, what is mapped there is not looked at.
+// The copy routines leave that to the page fault handler
+ALWAYS_INLINE static bool IsUserRange(const void* ptr, size_t size) {
+    uintptr_t base = reinterpret_cast<uintptr_t>(ptr);
+    return base + size >= base && base + size <= USER_ADDRESS_LIMIT;
+}
+
+/////////////////////////////
+/// \brief Copy from user memory
+///
+/// Unlike checking with CheckUsermodePointer beforehand, no regions are looked up.
+/// Faults are handled as they would be for the process, anything it could not access fails the copy.
+///
+/// \return 0 on success, 1 if src is not user memory or is not accessible
+/////////////////////////////
+[[nodiscard]] ALWAYS_INLINE int CopyFromUser(void* dest, const void* src, size_t count) {
+    if (!IsUserRange(src, count)) {
+        return 1;
+    }
+
+    return UserMemcpy(dest, src, count);
 }
 
-template <typename T, typename P> inline static constexpr int IsUsermodePointer(P* ptr) {
-    if (reinterpret_cast<uintptr_t>(ptr + sizeof(T)) >= KERNEL_VIRTUAL_BASE) {
-        return 0;
+/////////////////////////////
+/// \brief Copy from user memory without handling page faults
+///
+/// For use with spinlocks held, anything not already mapped fails the copy.
+/// The caller can drop its locks, fault the memory in with CopyFromUser and try again.
+///
+/// \return 0 on success, 1 if src is not user memory or is not mapped
+/////////////////////////////
+[[nodiscard]] int CopyFromUserAtomic(void* dest, const void* src, size_t count);
+
+/////////////////////////////
+/// \brief Copy to user memory
+///
+/// \return 0 on success, 1 if dest is not user memory or is not accessible
+/////////////////////////////
+[[nodiscard]] ALWAYS_INLINE int CopyToUser(void* dest, const void* src, size_t count) {
+    if (!IsUserRange(dest, count)) {
+        return 1;
     }
 
-    return 1;
+    return UserMemcpy(dest, src, count);
 }
 
-template <typename P> inline static constexpr int IsUsermodePointer(P* ptr, size_t offset, size_t count) {
-    if (reinterpret_cast<uintptr_t>(ptr + offset + count) >= KERNEL_VIRTUAL_BASE) {
-        return 0;
+// Copy count objects in one go, 0 on success
+template <typename T> [[nodiscard]] ALWAYS_INLINE int CopyArrayFromUser(T* dest, const T* src, size_t count) {
+    if (count > SIZE_MAX / sizeof(T)) {
+        return 1;
     }
 
-    return 1;
+    return CopyFromUser(dest, src, sizeof(T) * count);
+}
+
+template <typename T> [[nodiscard]] ALWAYS_INLINE int CopyArrayToUser(T* dest, const T* src, size_t count) {
+    if (count > SIZE_MAX / sizeof(T)) {
+        return 1;
+    }
+
+    return CopyToUser(dest, src, sizeof(T) * count);
 }
 
 // Class for handling usermode pointers
@@ -32,10 +105,10 @@ public:
     UserPointer(uintptr_t ptr) : m_ptr(reinterpret_cast<T*>(ptr)) {}
 
     [[nodiscard]] ALWAYS_INLINE int GetValue(T& kernelValue) const {
-        return UserMemcpy(&kernelValue, m_ptr, sizeof(T));
+        return CopyFromUser(&kernelValue, m_ptr, sizeof(T));
     }
     [[nodiscard]] ALWAYS_INLINE int StoreValue(const T& kernelValue) {
-        return UserMemcpy(m_ptr, &kernelValue, sizeof(T));
+        return CopyToUser(m_ptr, &kernelValue, sizeof(T));
     }
 
     ALWAYS_INLINE T* Pointer() { return m_ptr; }
@@ -51,26 +124,18 @@ public:
     UserBuffer(uintptr_t ptr) : m_ptr(reinterpret_cast<T*>(ptr)) {}
 
     [[nodiscard]] ALWAYS_INLINE int GetValue(unsigned index, T& kernelValue) const {
-        return UserMemcpy(&kernelValue, &m_ptr[index], sizeof(T));
+        return CopyFromUser(&kernelValue, &m_ptr[index], sizeof(T));
     }
     [[nodiscard]] ALWAYS_INLINE int StoreValue(unsigned index, const T& kernelValue) {
-        return UserMemcpy(&m_ptr[index], &kernelValue, sizeof(T));
+        return CopyToUser(&m_ptr[index], &kernelValue, sizeof(T));
     }
 
     [[nodiscard]] ALWAYS_INLINE int Read(T* data, size_t offset, size_t count) const {
-        if (!IsUsermodePointer(m_ptr, offset, count)) { // Don't allow kernel memory access
-            return 1;
-        }
-
-        return UserMemcpy(data, &m_ptr[offset], sizeof(T) * count);
+        return CopyArrayFromUser(data, m_ptr + offset, count);
     }
 
     [[nodiscard]] ALWAYS_INLINE int Write(T* data, size_t offset, size_t count) {
-        if (!IsUsermodePointer(m_ptr, offset, count)) { // Don't allow kernel memory access
-            return 1;
-        }
-
-        return UserMemcpy(&m_ptr[offset], data, sizeof(T) * count);
+        return CopyArrayToUser(m_ptr + offset, data, count);
     }
 
     ALWAYS_INLINE T* Pointer() { return m_ptr; }
@@ -79,6 +144,39 @@ private:
     T* m_ptr;
 };
 
+// Kernel copy of a user iovec array, small arrays are kept on the stack
+class UserIOVec {
+public:
+    UserIOVec() = default;
+    UserIOVec(const UserIOVec&) = delete;
+    UserIOVec& operator=(const UserIOVec&) = delete;
+
+    ~UserIOVec() {
+        if (m_iov != m_inlineIov) {
+            delete[] m_iov;
+        }
+    }
+
+    /////////////////////////////
+    /// \brief Copy and check the iovec array of the current process
+    ///
+    /// The array is copied in one go and every buffer is checked with the address space locked once.
+    ///
+    /// \return 0 on success, -EINVAL if the count or total length is invalid, -EFAULT if a buffer is invalid
+    /////////////////////////////
+    long Copy(Process* process, uintptr_t ptr, long count);
+
+    ALWAYS_INLINE const iovec* Get() const { return m_iov; }
+    ALWAYS_INLINE int Count() const { return m_count; }
+    ALWAYS_INLINE size_t TotalLength() const { return m_total; }
+
+private:
+    iovec m_inlineIov[8];
+    iovec* m_iov = m_inlineIov;
+    int m_count = 0;
+    size_t m_total = 0;
+};
+
 #define TRY_STORE_UMODE_VALUE(ptrObject, value)                                                                        \
     if (ptrObject.StoreValue(value)) {                                                                                 \
         return -EFAULT;                                                                                                \
@@ -58,6 +58,13 @@ private:
     size_t capacity = 0;
     lock_t lock = 0;
 
+    T* inlineData = nullptr; // Storage given by SmallVector, never freed
+    size_t inlineCapacity = 0;
+
+protected:
+    Vector(T* buffer, size_t bufferCapacity)
+        : data(buffer), capacity(bufferCapacity), inlineData(buffer), inlineCapacity(bufferCapacity) {}
+
 public:
     Vector() = default;
 
@@ -72,6 +79,19 @@ public:
     Vector(Vector<T>&& x) {
         ScopedSpinLock lock{x.lock};
 
+        if (x.data && x.data == x.inlineData) {
+            // The storage belongs to x, so the elements have to be moved out of it
+            EnsureCapacity(x.count);
+            for (unsigned i = 0; i < x.count; i++) {
+                new (&data[i]) T(std::move(x.data[i]));
+                x.data[i].~T();
+            }
+
+            count = x.count;
+            x.count = 0;
+            return;
+        }
+
         data = x.data;
         count = x.count;
         capacity = x.capacity;
@@ -183,7 +203,7 @@ public:
         for (unsigned i = 0; i < count; i++) {
             if (data[i] == val) {
                 EraseUnlocked(i);
-                return;
+                break;
             }
         }
 
@@ -191,7 +211,13 @@ public:
     }
 
     ~Vector() {
-        if (data) {
+        if constexpr (!TTraits<T>::is_trivial()) {
+            for (unsigned i = 0; i < count; i++) {
+                data[i].~T();
+            }
+        }
+
+        if (data && data != inlineData) {
             kfree(data);
         }
         data = nullptr;
@@ -222,11 +248,15 @@ public:
                     data[i].~T();
                 }
             }
-            kfree(data);
+
+            if (data != inlineData) {
+                kfree(data);
+            }
         }
 
-        count = capacity = 0;
-        data = nullptr;
+        count = 0;
+        data = inlineData;
+        capacity = inlineCapacity;
         releaseLock(&lock);
     }
 
@@ -253,7 +283,9 @@ private:
                     }
                 }
 
-                kfree(oldData);
+                if (oldData != inlineData) {
+                    kfree(oldData);
+                }
             } else {
                 data = reinterpret_cast<T*>(kmalloc(newCapacity * sizeof(T)));
             }
@@ -9,6 +9,26 @@ namespace Video{
     video_mode_t GetVideoMode();
     FancyRefPtr<VMObject> GetFramebufferVMO();
 
+    /////////////////////////////
+    /// \brief Give the framebuffer a second page to flip to, where the display adapter can pan
+    ///
+    /// Must be called once PCI devices are known and before the framebuffer is mapped by user space.
+    /// Also creates /dev/fb0, through which the displayed page is chosen.
+    /////////////////////////////
+    void InitializePageFlipping();
+
+    // Pages in the framebuffer VMO, each is the pitch multiplied by the height of the video mode
+    unsigned FramebufferPageCount();
+
+    /////////////////////////////
+    /// \brief Scan out of a page of the framebuffer
+    ///
+    /// \param waitForVBlank Wait for the vertical blank so the switch does not tear
+    ///
+    /// \return 0 on success, -EINVAL if the page does not exist
+    /////////////////////////////
+    int FlipFramebuffer(unsigned page, bool waitForVBlank);
+
     void DrawRect(unsigned int x, unsigned int y, unsigned int width, unsigned int height, uint8_t r, uint8_t g, uint8_t b);
     void DrawChar(char c, unsigned int x, unsigned int y, uint8_t r, uint8_t g, uint8_t b, int vscale = 1, int hscale = 1);
     void DrawString(const char* str, unsigned int x, unsigned int y, uint8_t r, uint8_t g, uint8_t b, int vscale = 1, int hscale = 1);
@@ -1,6 +1,7 @@
 #include <ACPI.h>
 
 #include <APIC.h>
+#include <Assert.h>
 #include <CString.h>
 #include <IOPorts.h>
 #include <List.h>
@@ -27,6 +28,14 @@ acpi_xsdt_t* xsdtHeader;
 acpi_fadt_t* fadt;
 pci_mcfg_table_t* mcfg = nullptr;
 
+unsigned numaNodeCount = 1;
+unsigned numaMemoryRangeCount = 0;
+numa_memory_range_t numaMemoryRanges[NUMA_MAX_MEMORY_RANGES];
+
+static uint32_t numaDomains[NUMA_MAX_NODES]; // Proximity domain of each node
+static uint8_t processorNodes[256]; // Indexed by APIC ID
+static uint8_t numaDistances[NUMA_MAX_NODES][NUMA_MAX_NODES];
+
 char oem[7];
 
 void* FindSDT(const char* signature, int index) {
@@ -125,6 +134,132 @@ int ReadMADT() {
     return 0;
 }
 
+// Gets the node index of a proximity domain, giving it a node if it does not have one
+static unsigned NodeOfDomain(uint32_t domain) {
+    for (unsigned i = 0; i < numaNodeCount; i++) {
+        if (numaDomains[i] == domain) {
+            return i;
+        }
+    }
+
+    if (numaNodeCount >= NUMA_MAX_NODES) {
+        Log::Warning("[ACPI] Too many NUMA nodes, treating proximity domain %u as node 0", domain);
+        return 0;
+    }
+
+    numaDomains[numaNodeCount] = domain;
+    return numaNodeCount++;
+}
+
+int ReadSRAT() {
+    acpi_srat_t* srat = reinterpret_cast<acpi_srat_t*>(FindSDT("SRAT", 0));
+    if (!srat) {
+        return 1; // Not a NUMA system
+    }
+
+    // Node 0 gets assigned to the first proximity domain found
+    numaNodeCount = 0;
+
+    uintptr_t sratEnd = reinterpret_cast<uintptr_t>(srat) + srat->header.length;
+    uintptr_t sratEntry = reinterpret_cast<uintptr_t>(srat) + sizeof(acpi_srat_t);
+    while (sratEntry + sizeof(acpi_srat_entry_t) <= sratEnd) {
+        acpi_srat_entry_t* entry = reinterpret_cast<acpi_srat_entry_t*>(sratEntry);
+        if (!entry->length) {
+            break; // Malformed table
+        }
+
+        switch (entry->type) {
+        case 0: {
+            srat_processor_affinity_t* affinity = reinterpret_cast<srat_processor_affinity_t*>(entry);
+            if (!(affinity->flags & 1)) {
+                break;
+            }
+
+            uint32_t domain = affinity->domainLow | (affinity->domainHigh[0] << 8) |
+                              (affinity->domainHigh[1] << 16) | (affinity->domainHigh[2] << 24);
+            processorNodes[affinity->apicID] = NodeOfDomain(domain);
+        } break;
+        case 1: {
+            srat_memory_affinity_t* affinity = reinterpret_cast<srat_memory_affinity_t*>(entry);
+            if (!(affinity->flags & 1) || !affinity->length) {
+                break;
+            }
+
+            if (numaMemoryRangeCount >= NUMA_MAX_MEMORY_RANGES) {
+                Log::Warning("[ACPI] Too many SRAT memory ranges");
+                break;
+            }
+
+            numaMemoryRanges[numaMemoryRangeCount++] = {
+                .base = affinity->base, .length = affinity->length, .node = NodeOfDomain(affinity->domain)};
+        } break;
+        case 2: {
+            srat_x2apic_affinity_t* affinity = reinterpret_cast<srat_x2apic_affinity_t*>(entry);
+            if (!(affinity->flags & 1) || affinity->x2apicID > 0xFF) {
+                break; // CPUs are only addressed by 8-bit APIC IDs
+            }
+
+            processorNodes[affinity->x2apicID] = NodeOfDomain(affinity->domain);
+        } break;
+        default:
+            break;
+        }
+
+        sratEntry += entry->length;
+    }
+
+    if (!numaNodeCount) {
+        numaNodeCount = 1;
+    }
+
+    if (debugLevelACPI >= DebugLevelNormal) {
+        Log::Info("[ACPI] %u NUMA nodes, %u memory ranges", numaNodeCount, numaMemoryRangeCount);
+    }
+
+    return 0;
+}
+
+// Read the distances between nodes, must be called after ReadSRAT
+void ReadSLIT() {
+    for (unsigned i = 0; i < NUMA_MAX_NODES; i++) {
+        for (unsigned j = 0; j < NUMA_MAX_NODES; j++) {
+            numaDistances[i][j] = (i == j) ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+        }
+    }
+
+    acpi_slit_t* slit = reinterpret_cast<acpi_slit_t*>(FindSDT("SLIT", 0));
+    if (!slit || numaNodeCount <= 1) {
+        return;
+    }
+
+    uint64_t count = slit->localityCount;
+    if (sizeof(acpi_slit_t) + count * count > slit->header.length) {
+        Log::Warning("[ACPI] SLIT is too small for %u localities", static_cast<unsigned>(count));
+        return;
+    }
+
+    for (unsigned i = 0; i < numaNodeCount; i++) {
+        for (unsigned j = 0; j < numaNodeCount; j++) {
+            if (numaDomains[i] < count && numaDomains[j] < count) {
+                numaDistances[i][j] = slit->distances[numaDomains[i] * count + numaDomains[j]];
+            }
+        }
+    }
+}
+
+unsigned NUMANodeOfProcessor(uint32_t apicID) {
+    if (apicID > 0xFF) {
+        return 0;
+    }
+
+    return processorNodes[apicID];
+}
+
+unsigned NUMADistance(unsigned a, unsigned b) {
+    assert(a < NUMA_MAX_NODES && b < NUMA_MAX_NODES);
+    return numaDistances[a][b];
+}
+
 void Init() {
     if (desc) {
         goto success; // Already found
@@ -183,6 +318,8 @@ success:
     asm("cli");
 
     ReadMADT();
+    ReadSRAT();
+    ReadSLIT();
     mcfg = reinterpret_cast<pci_mcfg_table_t*>(FindSDT("MCFG", 0)); // Attempt to find MCFG table for PCI
 
     asm("sti");
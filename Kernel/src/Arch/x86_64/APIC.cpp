@@ -6,6 +6,7 @@
 #include <Logging.h>
 #include <Paging.h>
 #include <SMP.h>
+#include <Timer.h>
 
 #include <Debug.h>
 
@@ -62,6 +63,43 @@ void SendIPI(uint8_t destination, uint32_t dsh /* Destination Shorthand*/, uint3
     APIC_WRITE(LOCAL_APIC_ICR_HIGH, high);
     APIC_WRITE(LOCAL_APIC_ICR_LOW, low);
 }
+
+uint64_t timerFrequency = 0; // Local APIC timer frequency (after dividing) in Hz
+
+void CalibrateTimer() {
+    assert(CheckInterrupts());
+
+    APIC_WRITE(LOCAL_APIC_TIMER_DIVIDE, LOCAL_APIC_TIMER_DIVIDE_16);
+    APIC_WRITE(LOCAL_APIC_LVT_TIMER, LOCAL_APIC_LVT_MASKED); // One shot, masked
+
+    // Count down from the maximum value for 10ms
+    APIC_WRITE(LOCAL_APIC_TIMER_INITIAL_COUNT, 0xFFFFFFFF);
+    Timer::Wait(10);
+    uint32_t elapsed = 0xFFFFFFFF - APIC_READ(LOCAL_APIC_TIMER_CURRENT_COUNT);
+
+    APIC_WRITE(LOCAL_APIC_TIMER_INITIAL_COUNT, 0);
+
+    timerFrequency = static_cast<uint64_t>(elapsed) * 100;
+
+    if (debugLevelInterrupts >= DebugLevelNormal) {
+        Log::Info("[APIC] Local APIC timer frequency: %u Hz", timerFrequency);
+    }
+}
+
+bool TimerAvailable() { return timerFrequency > 0; }
+
+void StartTimer(uint32_t frequency, uint8_t vector) {
+    assert(TimerAvailable());
+
+    APIC_WRITE(LOCAL_APIC_TIMER_DIVIDE, LOCAL_APIC_TIMER_DIVIDE_16);
+    APIC_WRITE(LOCAL_APIC_LVT_TIMER, LOCAL_APIC_LVT_TIMER_PERIODIC | vector);
+    APIC_WRITE(LOCAL_APIC_TIMER_INITIAL_COUNT, timerFrequency / frequency);
+}
+
+void StopTimer() {
+    APIC_WRITE(LOCAL_APIC_LVT_TIMER, LOCAL_APIC_LVT_MASKED);
+    APIC_WRITE(LOCAL_APIC_TIMER_INITIAL_COUNT, 0);
+}
 } // namespace Local
 
 namespace IO {
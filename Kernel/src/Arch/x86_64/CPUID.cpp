@@ -18,4 +18,127 @@ cpuid_info_t CPUID() {
     info.features_ecx = ecx;
     info.features_edx = edx;
     return info;
-}
\ No newline at end of file
+}
+
+ALWAYS_INLINE static void CPUIDLeaf(uint32_t leaf, uint32_t subleaf, uint32_t& eax, uint32_t& ebx, uint32_t& ecx,
+                                    uint32_t& edx) {
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(leaf), "c"(subleaf));
+}
+
+uint32_t CPUIDLastLevelCacheID() {
+    uint32_t eax, ebx, ecx, edx;
+
+    CPUIDLeaf(0, 0, eax, ebx, ecx, edx);
+    uint32_t maxLeaf = eax;
+    bool isAMD = (ebx == 0x68747541); // "Auth" of AuthenticAMD
+
+    CPUIDLeaf(1, 0, eax, ebx, ecx, edx);
+    uint32_t apicID = ebx >> 24; // Initial APIC ID of the executing CPU
+
+    // Intel uses leaf 4 for the deterministic cache parameters,
+    // AMD uses 0x8000001D when topology extensions are supported
+    uint32_t cacheLeaf = 0;
+    if (isAMD) {
+        CPUIDLeaf(0x80000000, 0, eax, ebx, ecx, edx);
+        if (eax >= 0x8000001D) {
+            CPUIDLeaf(0x80000001, 0, eax, ebx, ecx, edx);
+            if (ecx & (1 << 22)) {
+                cacheLeaf = 0x8000001D;
+            }
+        }
+    } else if (maxLeaf >= 4) {
+        cacheLeaf = 4;
+    }
+
+    if (!cacheLeaf) {
+        return 0; // Assume all CPUs share a cache
+    }
+
+    uint32_t highestLevel = 0;
+    uint32_t sharingCPUs = 1;
+    for (uint32_t i = 0; i < 16; i++) {
+        CPUIDLeaf(cacheLeaf, i, eax, ebx, ecx, edx);
+        if (!(eax & 0x1F)) {
+            break; // No more caches
+        }
+
+        uint32_t level = (eax >> 5) & 0x7;
+        if (level >= highestLevel) {
+            highestLevel = level;
+            sharingCPUs = ((eax >> 14) & 0xFFF) + 1;
+        }
+    }
+
+    // CPUs sharing a cache have the same APIC ID once the low bits are removed
+    unsigned shift = 0;
+    while ((1U << shift) < sharingCPUs) {
+        shift++;
+    }
+
+    return apicID >> shift;
+}
+
+cpuid_pmu_info_t CPUIDPerformanceMonitoring() {
+    cpuid_pmu_info_t info = {};
+    uint32_t eax, ebx, ecx, edx;
+
+    CPUIDLeaf(0, 0, eax, ebx, ecx, edx);
+    uint32_t maxLeaf = eax;
+    info.isAMD = (ebx == 0x68747541); // "Auth" of AuthenticAMD
+
+    if (info.isAMD) {
+        // Every 64-bit AMD CPU has at least the 4 legacy counters,
+        // with the core performance extension there are 6 at different MSRs
+        info.counters = 4;
+        info.counterWidth = 48;
+
+        CPUIDLeaf(0x80000000, 0, eax, ebx, ecx, edx);
+        if (eax >= 0x80000001) {
+            CPUIDLeaf(0x80000001, 0, eax, ebx, ecx, edx);
+            if (ecx & (1 << 23)) {
+                info.amdCoreExtension = true;
+                info.counters = 6;
+            }
+        }
+    } else if (maxLeaf >= 0xA) {
+        CPUIDLeaf(0xA, 0, eax, ebx, ecx, edx);
+        info.version = eax & 0xFF;
+        info.counters = (eax >> 8) & 0xFF;
+        info.counterWidth = (eax >> 16) & 0xFF;
+
+        // Events past the length of the bit vector are not available either
+        uint32_t length = (eax >> 24) & 0xFF;
+        info.unavailableEvents = ebx | ((length < 32) ? (~0U << length) : 0);
+
+        if (!info.version) {
+            info.counters = 0;
+        }
+    }
+
+    return info;
+}
+
+bool CPUIDInvariantTSC() {
+    uint32_t eax, ebx, ecx, edx;
+    CPUIDLeaf(0x80000000, 0, eax, ebx, ecx, edx);
+    if (eax < 0x80000007) {
+        return false;
+    }
+
+    CPUIDLeaf(0x80000007, 0, eax, ebx, ecx, edx);
+    return edx & (1 << 8);
+}
+
+bool CPUIDFastStrings(bool& fastShort) {
+    uint32_t eax, ebx, ecx, edx;
+    fastShort = false;
+
+    CPUIDLeaf(0, 0, eax, ebx, ecx, edx);
+    if (eax < 7) {
+        return false;
+    }
+
+    CPUIDLeaf(7, 0, eax, ebx, ecx, edx);
+    fastShort = edx & (1 << 4);
+    return ebx & (1 << 9);
+}
@@ -1,6 +1,7 @@
 #include <ELF.h>
 
 #include <CString.h>
+#include <Fs/Filesystem.h>
 #include <Logging.h>
 #include <Math.h>
 #include <Paging.h>
@@ -19,6 +20,16 @@ int VerifyELF(void* elf) {
         return 1;
 }
 
+int VerifyELF(const FancyRefPtr<UNIXOpenFile>& file) {
+    elf64_header_t elfHdr;
+    if (fs::Read(file->node, 0, sizeof(elf64_header_t), reinterpret_cast<uint8_t*>(&elfHdr)) !=
+        sizeof(elf64_header_t)) {
+        return 0;
+    }
+
+    return VerifyELF(&elfHdr);
+}
+
 elf_info_t LoadELFSegments(Process* proc, void* _elf, uintptr_t base) {
     uint8_t* elf = reinterpret_cast<uint8_t*>(_elf);
     elf_info_t elfInfo;
@@ -54,17 +65,19 @@ elf_info_t LoadELFSegments(Process* proc, void* _elf, uintptr_t base) {
     }
 
     char* linkPath = nullptr;
-    uintptr_t pml4Phys = Scheduler::GetCurrentProcess()->GetPageMap()->pml4Phys;
+    PageMap* currentPageMap = Scheduler::GetCurrentProcess()->GetPageMap();
     for (int i = 0; i < elfHdr.phNum; i++) {
         elf64_program_header_t elfPHdr = *((elf64_program_header_t*)(elf + elfHdr.phOff + i * elfHdr.phEntrySize));
 
         assert(elfPHdr.fileSize <= elfPHdr.memSize);
 
         if (elfPHdr.type == PT_LOAD && elfPHdr.memSize > 0) {
-            asm volatile("cli; mov %%rax, %%cr3" ::"a"(proc->GetPageMap()->pml4Phys) : "memory");
+            asm volatile("cli");
+            Memory::SwitchPageMap(proc->GetPageMap());
             memset((void*)(base + elfPHdr.vaddr + elfPHdr.fileSize), 0, (elfPHdr.memSize - elfPHdr.fileSize));
             memcpy((void*)(base + elfPHdr.vaddr), (void*)(elf + elfPHdr.offset), elfPHdr.fileSize);
-            asm volatile("mov %%rax, %%cr3; sti" ::"a"(pml4Phys) : "memory");
+            Memory::SwitchPageMap(currentPageMap);
+            asm volatile("sti");
         } else if (elfPHdr.type == PT_PHDR) {
             elfInfo.pHdrSegment = base + elfPHdr.vaddr;
         } else if (elfPHdr.type == PT_INTERP) {
@@ -77,4 +90,126 @@ elf_info_t LoadELFSegments(Process* proc, void* _elf, uintptr_t base) {
     }
 
     return elfInfo;
-}
\ No newline at end of file
+}
+
+elf_info_t LoadELFSegments(Process* proc, const FancyRefPtr<UNIXOpenFile>& file, uintptr_t base) {
+    elf_info_t elfInfo;
+    memset(&elfInfo, 0, sizeof(elfInfo));
+
+    elf64_header_t elfHdr;
+    if (fs::Read(file->node, 0, sizeof(elf64_header_t), reinterpret_cast<uint8_t*>(&elfHdr)) !=
+            sizeof(elf64_header_t) ||
+        !VerifyELF(&elfHdr)) {
+        return elfInfo; // Invalid ELF Header
+    }
+
+    size_t pHdrsSize = elfHdr.phNum * elfHdr.phEntrySize;
+    uint8_t* pHdrs = reinterpret_cast<uint8_t*>(kmalloc(pHdrsSize));
+    if (fs::Read(file->node, elfHdr.phOff, pHdrsSize, pHdrs) != pHdrsSize) {
+        kfree(pHdrs);
+        return elfInfo;
+    }
+
+    // Pages are only mapped from the page cache when each segment
+    // is at the same offset within a page in memory as in the file
+    bool mappable = true;
+    for (uint16_t i = 0; i < elfHdr.phNum; i++) {
+        elf64_program_header_t* elfPHdr = (elf64_program_header_t*)(pHdrs + i * elfHdr.phEntrySize);
+        if (elfPHdr->type == PT_LOAD && (elfPHdr->vaddr & 0xFFF) != (elfPHdr->offset & 0xFFF)) {
+            mappable = false;
+        }
+    }
+
+    if (!mappable) {
+        kfree(pHdrs);
+
+        // Fall back to reading the whole file and copying the segments
+        uint8_t* elf = reinterpret_cast<uint8_t*>(kmalloc(file->node->size));
+        if (fs::Read(file->node, 0, file->node->size, elf) == file->node->size) {
+            elfInfo = LoadELFSegments(proc, elf, base);
+        }
+
+        kfree(elf);
+        return elfInfo;
+    }
+
+    elfInfo.entry = base + elfHdr.entry;
+    elfInfo.phEntrySize = elfHdr.phEntrySize;
+    elfInfo.phNum = elfHdr.phNum;
+
+    PageMap* currentPageMap = Scheduler::GetCurrentProcess()->GetPageMap();
+    uint8_t* partialPage = reinterpret_cast<uint8_t*>(kmalloc(PAGE_SIZE_4K));
+    for (uint16_t i = 0; i < elfHdr.phNum; i++) {
+        elf64_program_header_t elfPHdr = *((elf64_program_header_t*)(pHdrs + i * elfHdr.phEntrySize));
+
+        if (elfPHdr.type == PT_PHDR) {
+            elfInfo.pHdrSegment = base + elfPHdr.vaddr;
+            continue;
+        } else if (elfPHdr.type == PT_INTERP) {
+            char* linkPath = (char*)kmalloc(elfPHdr.fileSize + 1);
+            fs::Read(file->node, elfPHdr.offset, elfPHdr.fileSize, reinterpret_cast<uint8_t*>(linkPath));
+            linkPath[elfPHdr.fileSize] = 0; // Null terminate the path
+
+            elfInfo.linkerPath = linkPath;
+            continue;
+        } else if (elfPHdr.memSize == 0 || elfPHdr.type != PT_LOAD) {
+            continue;
+        }
+
+        assert(base + elfPHdr.vaddr);
+        assert(elfPHdr.fileSize <= elfPHdr.memSize);
+
+        uintptr_t segmentBase = base + elfPHdr.vaddr;
+        uintptr_t pageBase = segmentBase & ~0xFFFUL;
+        uintptr_t fileEnd = segmentBase + elfPHdr.fileSize;
+        uintptr_t memEnd = (segmentBase + elfPHdr.memSize + 0xFFF) & ~0xFFFUL;
+
+        // Whole pages of file data are mapped from the page cache and copied when written,
+        // the page the file data ends in is zeroed past the end so it goes with the BSS
+        uintptr_t fileMappingEnd = (elfPHdr.memSize > elfPHdr.fileSize) ? (fileEnd & ~0xFFFUL)
+                                                                          : ((fileEnd + 0xFFF) & ~0xFFFUL);
+        if (fileMappingEnd > pageBase) {
+            FancyRefPtr<VMObject> vmo =
+                new FileVMObject(file, elfPHdr.offset & ~0xFFFUL, fileMappingEnd - pageBase, false);
+            if (!proc->addressSpace->MapVMO(vmo, pageBase, true)) {
+                Log::Error("Failed to map process image memory");
+                memset(&elfInfo, 0, sizeof(elfInfo));
+                break;
+            }
+        }
+
+        if (memEnd <= fileMappingEnd) {
+            continue;
+        }
+
+        proc->usedMemoryBlocks += (memEnd - fileMappingEnd) >> 12;
+        if (!proc->addressSpace->MapVMO(new ProcessImageVMObject(fileMappingEnd, memEnd - fileMappingEnd, true),
+                                       fileMappingEnd, true)) {
+            Log::Error("Failed to map process image memory");
+            memset(&elfInfo, 0, sizeof(elfInfo));
+            break;
+        }
+
+        // The blocks are zeroed when allocated, so only the file data in the partial page is copied
+        uintptr_t copyStart = (fileMappingEnd > segmentBase) ? fileMappingEnd : segmentBase;
+        if (fileEnd > copyStart) {
+            size_t copySize = fileEnd - copyStart;
+            if (fs::Read(file->node, elfPHdr.offset + (copyStart - segmentBase), copySize, partialPage) !=
+                copySize) {
+                Log::Error("Failed to read process image");
+                memset(&elfInfo, 0, sizeof(elfInfo));
+                break;
+            }
+
+            asm volatile("cli");
+            Memory::SwitchPageMap(proc->GetPageMap());
+            memcpy((void*)copyStart, partialPage, copySize);
+            Memory::SwitchPageMap(currentPageMap);
+            asm volatile("sti");
+        }
+    }
+
+    kfree(partialPage);
+    kfree(pHdrs);
+    return elfInfo;
+}
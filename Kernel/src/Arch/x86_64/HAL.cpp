@@ -3,19 +3,27 @@
 #include <ACPI.h>
 #include <APIC.h>
 #include <BootProtocols.h>
+#include <BootTrace.h>
 #include <CString.h>
 #include <Device.h>
 #include <IDT.h>
 #include <Logging.h>
 #include <MM/KMalloc.h>
+#include <MM/Swap.h>
+#include <MM/VMObject.h>
+#include <Net/Adapter.h>
+#include <Objects/Message.h>
 #include <PCI.h>
 #include <Paging.h>
 #include <Panic.h>
+#include <PerfCounters.h>
 #include <PhysicalAllocator.h>
 #include <SMP.h>
 #include <Serial.h>
+#include <Storage/AHCI.h>
 #include <TSS.h>
 #include <Timer.h>
+#include <USB/XHCI.h>
 #include <Video/Video.h>
 #include <Video/VideoConsole.h>
 
@@ -34,8 +42,83 @@ bool debugMode = false;
 bool disableSMP = false;
 bool useKCon = false;
 bool runTests = false;
+uint64_t isolatedCPUs = 0;
 VideoConsole* con;
 
+// Parse a decimal number, advancing str past it
+static unsigned ParseUnsigned(const char*& str) {
+    unsigned value = 0;
+    while (*str >= '0' && *str <= '9') {
+        value = value * 10 + (*str++ - '0');
+    }
+
+    return value;
+}
+
+// Parse a CPU list (e.g. 1,3-5) into a mask,
+// CPUs past 63 cannot be isolated
+static uint64_t ParseCPUList(const char* list) {
+    uint64_t mask = 0;
+    while (*list) {
+        unsigned first = ParseUnsigned(list);
+
+        unsigned last = first;
+        if (*list == '-') {
+            list++;
+            last = ParseUnsigned(list);
+        }
+
+        for (unsigned i = first; i <= last && i < 64; i++) {
+            mask |= (1ULL << i);
+        }
+
+        if (*list != ',') {
+            break;
+        }
+        list++;
+    }
+
+    return mask;
+}
+
+// Parse the fault-around window size, rounded down to a power of two
+static void ParseFaultAround(const char* value) {
+    unsigned pages = ParseUnsigned(value);
+    if (pages > VMOBJECT_FAULT_AROUND_MAX) {
+        pages = VMOBJECT_FAULT_AROUND_MAX;
+    }
+
+    unsigned window = 1;
+    while (window * 2 <= pages) {
+        window *= 2;
+    }
+
+    PhysicalVMObject::faultAroundPages = window;
+}
+
+// Memory (in KB) that messages queued on a single endpoint may use
+static void ParseIPCQueue(const char* value) {
+    unsigned kb = ParseUnsigned(value);
+    if (kb) {
+        MessageEndpoint::queueMemoryLimit = static_cast<size_t>(kb) << 10;
+    }
+}
+
+// Interrupts per second network adapters may raise, 0 for no limit
+static void ParseNetIRQRate(const char* value) { Network::NetworkAdapter::interruptRate = ParseUnsigned(value); }
+
+// Completions the AHCI controller reports per interrupt, limited to the 8-bit CCC_CTL.CC field
+static void ParseAHCICoalesce(const char* value) {
+    unsigned completions = ParseUnsigned(value);
+    AHCI::cccCompletions = completions > 0xFF ? 0xFF : completions;
+}
+
+// Minimum time (in us) between xHCI interrupts, stored in 250ns units
+static void ParseXHCIModeration(const char* value) {
+    unsigned interval = ParseUnsigned(value) * 4;
+    USB::XHCIController::interruptModeration = interval > 0xFFFF ? 0xFFFF : interval;
+}
+
 void InitMultiboot2(multiboot2_info_header_t* mbInfo);
 void InitStivale2(stivale2_info_header_t* st2Info);
 
@@ -43,18 +126,21 @@ void InitCore() { // ALWAYS call this first
     asm volatile("cli");
 
     SMP::InitializeCPU0Context();
+    BootTrace::Mark("Kernel entry");
     
     Serial::Initialize();
     Serial::Write("Initializing Lemon...\r\n");
 
     // Initialize Paging/Virtual Memory Manager
     Memory::InitializeVirtualMemory();
+    BootTrace::Mark("Paging initialized");
 
     // Initialize IDT
     IDT::Initialize();
 
     // Initialize Physical Memory Allocator
     Memory::InitializePhysicalAllocator(&mem_info);
+    BootTrace::Mark("Physical allocator initialized");
 }
 
 void InitVideo() {
@@ -86,24 +172,33 @@ void InitExtra() {
     }
     Log::Write("OK");
 
+    PerfCounters::InitializeCPU();
+
     Log::Info("Initializing ACPI...");
     ACPI::Init();
+    BootTrace::Mark("ACPI initialized");
     Log::Write("OK");
 
+    Memory::InitializeNUMA();
+
     Log::Info("Initializing PCI...");
     PCI::Init();
+    BootTrace::Mark("PCI scanned");
     Log::Write("OK");
 
     Log::Info("Initializing System Timer...");
     Timer::Initialize(1600);
+    BootTrace::Mark("Timer initialized");
     Log::Write("OK");
 
     Log::Info("Initializing Local and I/O APIC...");
     APIC::Initialize();
+    BootTrace::Mark("APIC initialized");
     Log::Write("OK");
 
     Log::Info("Initializing SMP...");
     SMP::Initialize();
+    BootTrace::Mark("SMP initialized");
     Log::Write("OK");
 
     Memory::LateInitializeVirtualMemory();
@@ -181,7 +276,7 @@ void InitMultiboot2(uintptr_t _mbInfo) {
             Memory::KernelMapVirtualMemory4K(
                 mbFbInfo->framebufferAddr, (uintptr_t)videoMode.address,
                 ((mbFbInfo->framebufferPitch * mbFbInfo->framebufferHeight + (PAGE_SIZE_4K - 1)) / PAGE_SIZE_4K),
-                PAGE_PAT_WRITE_COMBINING | PAGE_WRITABLE | PAGE_PRESENT);
+                PAGE_MEMORY_WC | PAGE_WRITABLE | PAGE_PRESENT);
 
             videoMode.width = mbFbInfo->framebufferWidth;
             videoMode.height = mbFbInfo->framebufferHeight;
@@ -233,6 +328,20 @@ void InitMultiboot2(uintptr_t _mbInfo) {
                 disableSMP = true;
             else if (strcmp(cmdLine, "kcon") == 0)
                 useKCon = true;
+            else if (strcmp(cmdLine, "swap") == 0)
+                Memory::swapPartitionsEnabled = true;
+            else if (strncmp(cmdLine, "isolcpus=", 9) == 0)
+                isolatedCPUs = ParseCPUList(cmdLine + 9);
+            else if (strncmp(cmdLine, "faultaround=", 12) == 0)
+                ParseFaultAround(cmdLine + 12);
+            else if (strncmp(cmdLine, "ipcqueue=", 9) == 0)
+                ParseIPCQueue(cmdLine + 9);
+            else if (strncmp(cmdLine, "netirqrate=", 11) == 0)
+                ParseNetIRQRate(cmdLine + 11);
+            else if (strncmp(cmdLine, "ahcicoalesce=", 13) == 0)
+                ParseAHCICoalesce(cmdLine + 13);
+            else if (strncmp(cmdLine, "xhciimod=", 9) == 0)
+                ParseXHCIModeration(cmdLine + 9);
             cmdLine = strtok_r(NULL, " ", &savePtr);
         }
     }
@@ -321,7 +430,7 @@ void InitStivale2(uintptr_t st2Info) {
                 Memory::KernelAllocate4KPages((fbTag->fbPitch * fbTag->fbHeight + (PAGE_SIZE_4K - 1)) / PAGE_SIZE_4K));
             Memory::KernelMapVirtualMemory4K(fbTag->fbAddress, (uintptr_t)videoMode.address,
                                              ((fbTag->fbPitch * fbTag->fbHeight + (PAGE_SIZE_4K - 1)) / PAGE_SIZE_4K),
-                                             PAGE_PAT_WRITE_COMBINING | PAGE_WRITABLE | PAGE_PRESENT);
+                                             PAGE_MEMORY_WC | PAGE_WRITABLE | PAGE_PRESENT);
 
             videoMode.width = fbTag->fbWidth;
             videoMode.height = fbTag->fbHeight;
@@ -375,8 +484,22 @@ void InitStivale2(uintptr_t st2Info) {
                 disableSMP = true;
             else if (strcmp(cmdLine, "kcon") == 0)
                 useKCon = true;
+            else if (strcmp(cmdLine, "swap") == 0)
+                Memory::swapPartitionsEnabled = true;
             else if (strcmp(cmdLine, "runtests") == 0)
                 runTests = true;
+            else if (strncmp(cmdLine, "isolcpus=", 9) == 0)
+                isolatedCPUs = ParseCPUList(cmdLine + 9);
+            else if (strncmp(cmdLine, "faultaround=", 12) == 0)
+                ParseFaultAround(cmdLine + 12);
+            else if (strncmp(cmdLine, "ipcqueue=", 9) == 0)
+                ParseIPCQueue(cmdLine + 9);
+            else if (strncmp(cmdLine, "netirqrate=", 11) == 0)
+                ParseNetIRQRate(cmdLine + 11);
+            else if (strncmp(cmdLine, "ahcicoalesce=", 13) == 0)
+                ParseAHCICoalesce(cmdLine + 13);
+            else if (strncmp(cmdLine, "xhciimod=", 9) == 0)
+                ParseXHCIModeration(cmdLine + 9);
             cmdLine = strtok_r(NULL, " ", &savePtr);
         }
     }
@@ -45,16 +45,61 @@ section .text
     pop rax
 %endmacro
 
+; The kernel GS base is loaded whilst in the kernel (see GetCPULocal),
+; when coming from or returning to usermode swap it with the user GS base.
+; Expects the error code to be on the top of the stack
+%macro SWAPGS_IF_USER 0
+    test qword [rsp + 16], 3 ; Saved CS
+    jz %%kernel
+    swapgs
+%%kernel:
+%endmacro
+
 %macro ISR_COMMON_EXIT 0
     popaq
+    cli ; Syscalls reenable interrupts, none can arrive between the swapgs and iretq
+    SWAPGS_IF_USER
     add rsp, 8; Remove the error code
     iretq
 %endmacro
 
+; NMIs and machine checks can arrive between syscall and its swapgs or between the swapgs
+; and sysret, so the saved CS says nothing about which GS base is loaded.
+; Kernel addresses are in the upper half, so check the sign of the GS base instead.
+%macro ISR_PARANOID 1
+	global isr%1
+	isr%1:
+        cli
+%if %1 != 8 ; Double faults push an error code
+        push 0
+%endif
+        pushaq
+        mov ecx, 0xC0000101 ; GS base
+        rdmsr
+        xor ebx, ebx ; rbx is preserved by isr_handler
+        test edx, edx
+        js %%kernelGS
+        swapgs
+        mov ebx, 1
+%%kernelGS:
+        mov rdi, %1
+        mov rsi, rsp
+        xor rbp, rbp
+        call isr_handler
+        test ebx, ebx
+        jz %%restored
+        swapgs
+%%restored:
+        popaq
+        add rsp, 8; Remove the error code
+        iretq
+%endmacro
+
 %macro ISR_ERROR_CODE 1
 	global isr%1
 	isr%1:
         cli
+        SWAPGS_IF_USER
         pushaq
         mov rdi, %1
         mov rsi, rsp
@@ -68,6 +113,7 @@ section .text
 	isr%1:
 		cli
         push 0
+        SWAPGS_IF_USER
         pushaq
         mov rdi, %1
         mov rsi, rsp
@@ -81,6 +127,7 @@ section .text
 	ipi%1:
 		cli
         push 0
+        SWAPGS_IF_USER
         pushaq
         mov rdi, %1
         mov rsi, rsp
@@ -94,6 +141,7 @@ section .text
   irq%1:
     cli
     push 0
+    SWAPGS_IF_USER
     pushaq
     mov rdi, %2
     mov rsi, rsp
@@ -105,13 +153,13 @@ section .text
 
 ISR_NO_ERROR_CODE  0
 ISR_NO_ERROR_CODE  1
-ISR_NO_ERROR_CODE  2
+ISR_PARANOID 2
 ISR_NO_ERROR_CODE  3
 ISR_NO_ERROR_CODE  4
 ISR_NO_ERROR_CODE  5
 ISR_NO_ERROR_CODE  6
 ISR_NO_ERROR_CODE  7
-ISR_ERROR_CODE 8
+ISR_PARANOID 8
 ISR_NO_ERROR_CODE  9
 ISR_ERROR_CODE 10
 ISR_ERROR_CODE 11
@@ -121,7 +169,7 @@ ISR_ERROR_CODE 14
 ISR_NO_ERROR_CODE  15
 ISR_NO_ERROR_CODE  16
 ISR_ERROR_CODE  17
-ISR_NO_ERROR_CODE  18
+ISR_PARANOID 18
 ISR_NO_ERROR_CODE 19
 ISR_NO_ERROR_CODE 20
 ISR_NO_ERROR_CODE 21
@@ -142,6 +190,7 @@ global isr0x69
 isr0x69:
     cli
     push 0
+    SWAPGS_IF_USER
     pushaq
     mov rdi, rsp
     xor rbp, rbp
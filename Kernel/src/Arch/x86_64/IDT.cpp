@@ -187,8 +187,10 @@ uint8_t ReserveUnusedInterrupt() {
     uint8_t interrupt = 0xFF;
     for (unsigned i = IRQ0 + 16 /* Ignore all legacy IRQs and exceptions */;
          i < 100 /* Ignore >100 */ && interrupt == 0xFF; i++) {
-        if (!interruptHandlers[i].handler) {
-            interruptHandlers[i].handler = InvalidInterruptHandler;
+        isr_t expected = nullptr; // Drivers are probed in parallel at boot
+        isr_t reserved = InvalidInterruptHandler;
+        if (__atomic_compare_exchange_n(&interruptHandlers[i].handler, &expected, reserved, false, __ATOMIC_SEQ_CST,
+                                        __ATOMIC_RELAXED)) {
             interrupt = i;
         }
     }
@@ -2,17 +2,80 @@ BITS 64
 
 global UserMemcpy
 global UserMemcpyTrap
+global UserMemcpyTrapQ
 global UserMemcpyTrapHandler
+global UserStrnlen
+global UserStrnlenTrap
+global UserStrnlenTrapHandler
+global userCopyMode
 
-; UserMemcpy (dst, src, cnt)
+; Values of userCopyMode, set from CPUID at boot
+%define USER_COPY_QWORDS 0 ; rep movsq then rep movsb for the rest
+%define USER_COPY_ERMS 1 ; rep movsb is fast once a copy is large enough
+%define USER_COPY_FSRM 2 ; rep movsb is fast for any size
+
+; Copies smaller than this go by qword without FSRM, as rep movsb has a high startup cost
+%define USER_COPY_ERMS_THRESHOLD 128
+
+section .data
+userCopyMode: db USER_COPY_QWORDS
+
+section .text
+
+; Every instruction touching user memory is registered as a page fault trap,
+; faults which cannot be handled continue at the trap handler which returns the error
+
+; UserMemcpy (dst, src, cnt), returns 0 on success, 1 if the copy faulted
 UserMemcpy:
     mov rcx, rdx
 
+    cmp byte [rel userCopyMode], USER_COPY_FSRM
+    je UserMemcpyBytes
+
+    cmp byte [rel userCopyMode], USER_COPY_ERMS
+    jne UserMemcpyQwords
+
+    cmp rdx, USER_COPY_ERMS_THRESHOLD
+    jae UserMemcpyBytes
+
+UserMemcpyQwords:
+    shr rcx, 3
+
+UserMemcpyTrapQ:
+    rep movsq
+
+    mov rcx, rdx
+    and rcx, 7
+
+UserMemcpyBytes:
 UserMemcpyTrap:
     rep movsb
 
-    mov rax, 0
+    xor eax, eax
     ret
 UserMemcpyTrapHandler:
     mov rax, 1
     ret
+
+; UserStrnlen (str, max), returns the length of str, max if there is no null terminator
+; in the first max bytes or -1 if reading faulted
+UserStrnlen:
+    mov rcx, rsi
+    mov rdx, rdi
+    test rcx, rcx
+    jz UserStrnlenNotFound
+
+    xor eax, eax
+UserStrnlenTrap:
+    repne scasb
+    jne UserStrnlenNotFound
+
+    lea rax, [rdi - 1]
+    sub rax, rdx
+    ret
+UserStrnlenNotFound:
+    mov rax, rsi
+    ret
+UserStrnlenTrapHandler:
+    mov rax, -1
+    ret
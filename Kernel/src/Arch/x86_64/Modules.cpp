@@ -6,8 +6,10 @@
 #include <Memory.h>
 #include <StringView.h>
 
+#include <BootTrace.h>
 #include <ELF.h>
 #include <Fs/Filesystem.h>
+#include <Lock.h>
 #include <Panic.h>
 #include <Symbols.h>
 
@@ -27,21 +29,42 @@ Module::~Module() {
 
 namespace ModuleManager {
 HashMap<StringView, Module*> modules;
+// Modules are loaded in parallel at boot, relocation and the symbol table are serialized but init is not
+Mutex modulesLock;
+
+// Whether [offset, offset + size) is within the module image
+static inline bool InImage(size_t imageSize, uint64_t offset, uint64_t size) {
+    return offset <= imageSize && size <= imageSize - offset;
+}
+
+int LoadModuleSegments(Module* module, const uint8_t* image, size_t imageSize) {
+    const elf64_header_t& header = *reinterpret_cast<const elf64_header_t*>(image);
 
-int LoadModuleSegments(Module* module, FsNode* file, elf64_header_t& header) {
     unsigned shOff = header.shOff;           // Section header table offset
     uint16_t shEntSize = header.shEntrySize; // Section header table
     uint16_t shNum = header.shNum;
     uint16_t shStrIndex = header.shStrIndex;
 
+    if (shEntSize < sizeof(ELF64Section) || !InImage(imageSize, shOff, static_cast<uint64_t>(shNum) * shEntSize)) {
+        Log::Error("Error loading module: Section header table is outside of the file");
+        return ModuleFailureCode::ErrorInvalidELFSection;
+    }
+
+    // The section headers are copied as the address of each section is filled in
     ELF64Section* sections = new ELF64Section[shNum];
     ELF64Section* shStrTab = nullptr;  // Section String Table
     ELF64Section* symStrTab = nullptr; // Symbol String Table
     ELF64Section* symTab = nullptr;    // Symbol table
 
     for (unsigned i = 0; i < shNum; i++) {
-        ssize_t r = fs::Read(file, shOff + i * shEntSize, sizeof(ELF64Section), &sections[i]);
-        assert(r == sizeof(ELF64Section));
+        memcpy(&sections[i], image + shOff + i * shEntSize, sizeof(ELF64Section));
+
+        if (sections[i].type != SHT_NOBITS && !InImage(imageSize, sections[i].off, sections[i].size)) {
+            Log::Error("Error loading module: Section %u is outside of the file", i);
+
+            delete[] sections;
+            return ModuleFailureCode::ErrorInvalidELFSection;
+        }
 
         if (sections[i].type == SHT_STRTAB) {
             if (i == shStrIndex) {
@@ -52,7 +75,10 @@ int LoadModuleSegments(Module* module, FsNode* file, elf64_header_t& header) {
         }
     }
 
-    if (!shStrIndex) {
+    // Don't trust that the string tables are NULL terminated
+    auto isTerminated = [image](ELF64Section* table) { return table->size && !image[table->off + table->size - 1]; };
+
+    if (!shStrTab || !isTerminated(shStrTab)) {
         Log::Error("Error loading module: Could not find section string table");
 
         delete[] sections;
@@ -64,17 +90,13 @@ int LoadModuleSegments(Module* module, FsNode* file, elf64_header_t& header) {
         return ModuleFailureCode::ErrorInvalidELFSection;
     }
 
-    char* sectionStringTable = new char[shStrTab->size + 1];
-    {
-        long len = fs::Read(file, shStrTab->off, shStrTab->size, sectionStringTable);
-        assert(len == shStrTab->size);
-        sectionStringTable[len] = 0;
-    }
-
+    const char* sectionStringTable = reinterpret_cast<const char*>(image + shStrTab->off);
     for (unsigned i = 0; i < shNum; i++) {
-        if (sections[i].type == SHT_STRTAB &&
-            strncmp(sectionStringTable + sections[i].name, ".strtab", shStrTab->size - sections[i].name) ==
-                0) { // Don't trust that it is NULL terminated
+        if (sections[i].name >= shStrTab->size) {
+            continue;
+        }
+
+        if (sections[i].type == SHT_STRTAB && !strcmp(sectionStringTable + sections[i].name, ".strtab")) {
             symStrTab = &sections[i];
         }
 
@@ -83,113 +105,76 @@ int LoadModuleSegments(Module* module, FsNode* file, elf64_header_t& header) {
                    sections[i].off);
     }
 
-    if (!symStrTab) {
+    if (!symStrTab || !isTerminated(symStrTab)) {
         Log::Error("Error loading module: Could not find symbol string table");
 
-        delete[] sectionStringTable;
         delete[] sections;
         return ModuleFailureCode::ErrorInvalidELFSection;
     }
 
-    char* symStringTable = new char[symStrTab->size + 1];
-    {
-        long len = fs::Read(file, symStrTab->off, symStrTab->size, symStringTable);
-        assert(len == symStrTab->size);
-        symStringTable[len] = 0;
-    }
+    const char* symStringTable = reinterpret_cast<const char*>(image + symStrTab->off);
 
     unsigned symCount = symTab->size / sizeof(ELF64Symbol);
+    const ELF64Symbol* symbols = reinterpret_cast<const ELF64Symbol*>(image + symTab->off);
+
+    // Kernel symbols are looked up once here rather than for every relocation against them
+    uintptr_t* kernelSymbolAddresses = new uintptr_t[symCount];
+    memset(kernelSymbolAddresses, 0, sizeof(uintptr_t) * symCount);
+
+    auto cleanup = [&](int code) -> int {
+        delete[] kernelSymbolAddresses;
+        delete[] sections;
+        return code;
+    };
 
     long moduleInfoIndex = -1;
-    ELF64Symbol* symbols = new ELF64Symbol[symCount + 1];
-    assert(fs::Read(file, symTab->off, symTab->size, symbols) == symTab->size);
-    {
-        for (unsigned i = 0; i < symCount; i++) {
-            ELF64Symbol& symbol = symbols[i];
-            if (symbol.name > symStrTab->size || !symbol.name) {
-                continue; // Symbol is without a name
-            }
+    for (unsigned i = 0; i < symCount; i++) {
+        const ELF64Symbol& symbol = symbols[i];
+        if (symbol.name >= symStrTab->size || !symbol.name) {
+            continue; // Symbol is without a name
+        }
 
-            uint8_t symbolType = ELF64_SYM_TYPE(symbol.info);
-            uint8_t symbolBinding = ELF64_SYM_BIND(symbol.info);
-            if (symbolType == STT_FILE || symbolType == STT_SECTION) {
-                continue; // We don't care about FILE or SECTION symbols
-            } else if (symbolType != STT_OBJECT && symbolType != STT_FUNC && symbolType != STT_NOTYPE) {
-                Log::Error("[Module] Unknown symbol type: %d. Failed to resolve %s.", symbolType,
-                           symStringTable + symbol.name);
-
-                delete[] sectionStringTable;
-                delete[] symStringTable;
-                delete[] sections;
-                delete[] symbols;
-                return ModuleFailureCode::ErrorUnresolvedSymbol; // Fail as we failed to resolve the symbol
-            }
+        uint8_t symbolType = ELF64_SYM_TYPE(symbol.info);
+        uint8_t symbolBinding = ELF64_SYM_BIND(symbol.info);
+        if (symbolType == STT_FILE || symbolType == STT_SECTION) {
+            continue; // We don't care about FILE or SECTION symbols
+        } else if (symbolType != STT_OBJECT && symbolType != STT_FUNC && symbolType != STT_NOTYPE) {
+            Log::Error("[Module] Unknown symbol type: %d. Failed to resolve %s.", symbolType,
+                       symStringTable + symbol.name);
+            return cleanup(ModuleFailureCode::ErrorUnresolvedSymbol); // Fail as we failed to resolve the symbol
+        }
 
-            if (!strcmp(symStringTable + symbol.name, "_moduleInfo")) {
-                moduleInfoIndex = i;
-            }
+        if (!strcmp(symStringTable + symbol.name, "_moduleInfo")) {
+            moduleInfoIndex = i;
+        }
 
-            if (symbolBinding == STB_GLOBAL) {
-                if (symbol.shIndex == 0) {
-                    KernelSymbol* sym = nullptr;
-                    if (!ResolveKernelSymbol(symStringTable + symbol.name, sym)) {
-                        Log::Error("[Module] Failed to resolve '%s'!", symStringTable + symbol.name);
-
-                        delete[] sectionStringTable;
-                        delete[] symStringTable;
-                        delete[] sections;
-                        delete[] symbols;
-                        return ModuleFailureCode::ErrorUnresolvedSymbol; // Fail as we failed to resolve the symbol
-                    } else {
-                        Log::Debug(debugLevelModules, DebugLevelVerbose, "Resolved kernel symbol: %s : %x",
-                                   sym->mangledName, sym->address);
-                    }
-                } else {
-                    Log::Debug(debugLevelModules, DebugLevelVerbose, "Found symbol (%x): %s : %x (shidx %hd)",
-                               symbol.info, symStringTable + symbol.name, symbol.value, symbol.shIndex);
-                }
-            } else if (symbolBinding == STB_WEAK) {
-                if (symbol.shIndex == 0) {
-                    KernelSymbol* sym = nullptr;
-                    if (!ResolveKernelSymbol(symStringTable + symbol.name, sym)) {
-                        Log::Error("[Module] Failed to resolve '%s'!", symStringTable + symbol.name);
-
-                        delete[] sectionStringTable;
-                        delete[] symStringTable;
-                        delete[] sections;
-                        delete[] symbols;
-                        return ModuleFailureCode::ErrorUnresolvedSymbol; // Fail as we failed to resolve the symbol
-                    } else {
-                        Log::Debug(debugLevelModules, DebugLevelVerbose, "Resolved kernel symbol: %s : %x",
-                                   sym->mangledName, sym->address);
-                    }
-                } else {
-                    Log::Debug(debugLevelModules, DebugLevelVerbose, "Found symbol (%x): %s : %x (shidx %hd)",
-                               symbol.info, symStringTable + symbol.name, symbol.value, symbol.shIndex);
+        if (symbolBinding == STB_GLOBAL || symbolBinding == STB_WEAK) {
+            if (symbol.shIndex == 0) {
+                KernelSymbol* sym = nullptr;
+                if (!ResolveKernelSymbol(symStringTable + symbol.name, sym)) {
+                    Log::Error("[Module] Failed to resolve '%s'!", symStringTable + symbol.name);
+                    return cleanup(ModuleFailureCode::ErrorUnresolvedSymbol); // Fail as we failed to resolve the symbol
                 }
-            } else if (symbolBinding == STB_LOCAL) {
-                Log::Debug(debugLevelModules, DebugLevelVerbose, "Found symbol (%x): %s : %x (shidx %hd)", symbol.info,
-                           symStringTable + symbol.name, symbol.value, symbol.shIndex);
-            } else {
-                Log::Error("[Module] Unknown symbol binding: %d", symbolBinding);
 
-                delete[] sectionStringTable;
-                delete[] symStringTable;
-                delete[] sections;
-                delete[] symbols;
-                return ModuleFailureCode::ErrorUnresolvedSymbol; // Fail as we failed to resolve the symbol
+                Log::Debug(debugLevelModules, DebugLevelVerbose, "Resolved kernel symbol: %s : %x", sym->mangledName,
+                           sym->address);
+                kernelSymbolAddresses[i] = sym->address;
+            } else {
+                Log::Debug(debugLevelModules, DebugLevelVerbose, "Found symbol (%x): %s : %x (shidx %hd)",
+                           symbol.info, symStringTable + symbol.name, symbol.value, symbol.shIndex);
             }
+        } else if (symbolBinding == STB_LOCAL) {
+            Log::Debug(debugLevelModules, DebugLevelVerbose, "Found symbol (%x): %s : %x (shidx %hd)", symbol.info,
+                       symStringTable + symbol.name, symbol.value, symbol.shIndex);
+        } else {
+            Log::Error("[Module] Unknown symbol binding: %d", symbolBinding);
+            return cleanup(ModuleFailureCode::ErrorUnresolvedSymbol); // Fail as we failed to resolve the symbol
         }
     }
 
     if (moduleInfoIndex < 0) { // Module info structure not found
         Log::Error("[Module] No module information.");
-
-        delete[] sectionStringTable;
-        delete[] symStringTable;
-        delete[] sections;
-        delete[] symbols;
-        return ModuleFailureCode::ErrorNoModuleInfo;
+        return cleanup(ModuleFailureCode::ErrorNoModuleInfo);
     }
 
     assert(moduleInfoIndex < symCount && symbols[moduleInfoIndex].size == sizeof(LemonModuleInfo));
@@ -218,16 +203,15 @@ int LoadModuleSegments(Module* module, FsNode* file, elf64_header_t& header) {
             moduleSegment.size = section.size;
             section.addr = segmentBase; // Update the segment address for later on
 
-            memset(reinterpret_cast<void*>(segmentBase), 0, section.size);
-
             if (section.type == SHT_PROGBITS) {
-                ssize_t read = fs::Read(file, section.off, section.size, reinterpret_cast<void*>(segmentBase));
-                assert(read == section.size);
+                memcpy(reinterpret_cast<void*>(segmentBase), image + section.off, section.size);
 
                 Log::Debug(debugLevelModules, DebugLevelVerbose,
                            "[Module] ELF section '%s' loaded! Index: %d Write? %Y", sectionStringTable + section.name,
                            i, moduleSegment.write);
             } else {
+                memset(reinterpret_cast<void*>(segmentBase), 0, section.size);
+
                 Log::Debug(debugLevelModules, DebugLevelVerbose,
                            "[Module] ELF section '%s' loaded and zeroed! Index: %d Write? %Y",
                            sectionStringTable + section.name, i, moduleSegment.write);
@@ -243,7 +227,6 @@ int LoadModuleSegments(Module* module, FsNode* file, elf64_header_t& header) {
         if (section.type == SHT_RELA) {
             assert(section.info < shNum);
 
-            ELF64RelocationA relocation;
             ELF64Section& relSection = sections[section.info]; // The section index of the section the relocation is
                                                                // applied to is in section header info
 
@@ -254,32 +237,30 @@ int LoadModuleSegments(Module* module, FsNode* file, elf64_header_t& header) {
                 continue; // debug_info and other sections may have relocations but are not present in memory
             }
 
-            size_t offset = 0;
-            while (offset < section.size) {
-                ssize_t read = fs::Read(file, section.off + offset, sizeof(ELF64RelocationA), &relocation);
-                assert(read == sizeof(ELF64RelocationA));
-
-                offset += read;
+            // The whole section is applied straight from the file image
+            const ELF64RelocationA* relocations = reinterpret_cast<const ELF64RelocationA*>(image + section.off);
+            size_t relocationCount = section.size / sizeof(ELF64RelocationA);
+            for (size_t r = 0; r < relocationCount; r++) {
+                const ELF64RelocationA& relocation = relocations[r];
 
                 unsigned symIndex = ELF64_R_SYM(relocation.info);
                 assert(symIndex < symCount);
 
-                ELF64Symbol& symbol = symbols[symIndex];
+                const ELF64Symbol& symbol = symbols[symIndex];
 
                 Log::Debug(debugLevelModules, DebugLevelVerbose,
                            "[Module] Found 'rela' relocation. Offset: %x, Addend: %x, Info: %x, Symbol: '%s'",
                            relocation.offset, relocation.addend, relocation.info, symStringTable + symbol.name);
 
+                assert(relocation.offset + sizeof(uintptr_t) <= relSection.size);
                 uintptr_t* relocationPointer = reinterpret_cast<uintptr_t*>(relSection.addr + relocation.offset);
 
                 switch (ELF64_R_TYPE(relocation.info)) {
                 case ELF64_R_X86_64_64:
                     if (symbol.shIndex == 0) {
-                        KernelSymbol* ksym;
-                        int r = ResolveKernelSymbol(symStringTable + symbol.name, ksym);
-                        assert(r); // Make sure the symbol is resolved
+                        assert(kernelSymbolAddresses[symIndex]); // Make sure the symbol is resolved
 
-                        *relocationPointer = ksym->address;
+                        *relocationPointer = kernelSymbolAddresses[symIndex];
                     } else {
                         assert(symbol.shIndex < shNum);
                         ELF64Section& symSection = sections[symbol.shIndex];
@@ -301,8 +282,8 @@ int LoadModuleSegments(Module* module, FsNode* file, elf64_header_t& header) {
     }
 
     for (unsigned i = 0; i < symCount; i++) {
-        ELF64Symbol& symbol = symbols[i];
-        if (symbol.name > symStrTab->size || !symbol.name) {
+        const ELF64Symbol& symbol = symbols[i];
+        if (symbol.name >= symStrTab->size || !symbol.name) {
             continue; // Symbol is without a name
         }
 
@@ -315,7 +296,7 @@ int LoadModuleSegments(Module* module, FsNode* file, elf64_header_t& header) {
         assert(symbol.shIndex < shNum);
         ELF64Section& section = sections[symbol.shIndex]; // Get symbol section
 
-        char* symbolName = symStringTable + symbol.name;
+        const char* symbolName = symStringTable + symbol.name;
         if (symbol.shIndex != 0) {
             if (symbolBinding == STB_GLOBAL) {
                 KernelSymbol* sym;
@@ -354,11 +335,7 @@ int LoadModuleSegments(Module* module, FsNode* file, elf64_header_t& header) {
     Log::Info("[Module] Module '%s' loaded! Initializtion function at %x, Exit function at %x.", module->Name(),
               module->init, module->exit);
 
-    delete[] sectionStringTable;
-    delete[] symStringTable;
-    delete[] sections;
-    delete[] symbols;
-    return 0;
+    return cleanup(0);
 }
 
 ModuleLoadStatus LoadModule(const char* path) {
@@ -374,22 +351,33 @@ ModuleLoadStatus LoadModule(const char* path) {
         return {.status = ModuleLoadStatus::ModuleNotFound, .code = 0};
     }
 
-    elf64_header_t header;
-    long len = fs::Read(node, 0, sizeof(elf64_header_t), &header); // Attempt to read ELF header
+    // Read the whole module at once, it is relocated from this image
+    size_t imageSize = node->size;
+    uint8_t* image = reinterpret_cast<uint8_t*>(kmalloc(imageSize ? imageSize : 1));
+    long len = fs::Read(node, 0, imageSize, image);
+    delete handle.Value();
 
-    if (len < sizeof(elf64_header_t) || !VerifyELF(&header)) { // Verify ELF header
+    if (len < static_cast<long>(sizeof(elf64_header_t)) || static_cast<size_t>(len) != imageSize ||
+        !VerifyELF(image)) { // Verify ELF header
         Log::Info("Module '%s' is not in ELF format!", path);
+
+        kfree(image);
         return {.status = ModuleLoadStatus::ModuleInvalid, .code = 0};
     }
 
     Module* module = new Module();
 
-    if (int err = LoadModuleSegments(module, node, header); err) {
+    modulesLock.Lock();
+    int err = LoadModuleSegments(module, image, imageSize);
+    kfree(image);
+    if (err) {
+        modulesLock.Unlock();
         return {.status = ModuleLoadStatus::ModuleFailure, .code = err};
     }
 
     modules.insert(module->Name(), module);
-    delete handle.Value();
+    modulesLock.Unlock();
+    BootTrace::Mark("Module relocated", module->Name());
 
     int status = module->init();
     if (status) {
@@ -402,7 +390,9 @@ ModuleLoadStatus LoadModule(const char* path) {
 
 int UnloadModule(const char* name) {
     Module* module;
+    modulesLock.Lock();
     int found = modules.get(name, module);
+    modulesLock.Unlock();
 
     if (!found) {
         return -ENOENT;
@@ -414,7 +404,9 @@ int UnloadModule(const char* name) {
 }
 
 void UnloadModule(Module* module) {
+    modulesLock.Lock();
     modules.remove(module->name);
+    modulesLock.Unlock();
 
     int status = module->exit();
     if (status) {
@@ -422,11 +414,13 @@ void UnloadModule(Module* module) {
         KernelPanic((const char*[]){"Failed to unload kernel module:", module->Name()}, 2);
     }
 
+    modulesLock.Lock();
     for (auto& sym : module->globalSymbols) {
         RemoveKernelSymbol(sym->mangledName);
         delete sym;
     }
     module->globalSymbols.clear();
+    modulesLock.Unlock();
 
     for (auto& seg : module->segments) {
         for (size_t i = 0; i < PAGE_COUNT_4K(seg.size); i++) {
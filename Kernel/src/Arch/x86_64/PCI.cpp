@@ -6,6 +6,8 @@
 #include <IDT.h>
 #include <IOPorts.h>
 #include <Logging.h>
+#include <Paging.h>
+#include <SMP.h>
 #include <Vector.h>
 
 namespace PCI {
@@ -15,10 +17,13 @@ PCIInfo* unknownDevice = nullptr;
 PCIMCFG* mcfgTable = nullptr;
 PCIConfigurationAccessMode configMode = PCIConfigurationAccessMode::Legacy;
 Vector<PCIMCFGBaseAddress>* enhancedBaseAddresses = nullptr; // Base addresses for enhanced (PCI Express) configuration mechanism
+unsigned nextInterruptCPU = 0;
+lock_t configLock = 0; // Legacy configuration access is an address then a data port, drivers are probed in parallel
 
 uint32_t ConfigReadDword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
     uint32_t address = (uint32_t)((bus << 16) | (slot << 11) | (func << 8) | (offset & 0xfc) | 0x80000000);
 
+    ScopedSpinLock<true> lock(configLock);
     outportl(0xCF8, address);
 
     uint32_t data = inportl(0xCFC);
@@ -29,6 +34,7 @@ uint32_t ConfigReadDword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset
 uint16_t ConfigReadWord(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
     uint32_t address = (uint32_t)((bus << 16) | (slot << 11) | (func << 8) | (offset & 0xfc) | 0x80000000);
 
+    ScopedSpinLock<true> lock(configLock);
     outportl(0xCF8, address);
 
     uint16_t data = (uint16_t)((inportl(0xCFC) >> ((offset & 2) * 8)) & 0xffff);
@@ -39,6 +45,7 @@ uint16_t ConfigReadWord(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset)
 uint8_t ConfigReadByte(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
     uint32_t address = (uint32_t)((bus << 16) | (slot << 11) | (func << 8) | (offset & 0xfc) | 0x80000000);
 
+    ScopedSpinLock<true> lock(configLock);
     outportl(0xCF8, address);
 
     uint8_t data;
@@ -47,9 +54,10 @@ uint8_t ConfigReadByte(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset)
     return data;
 }
 
-void ConfigWriteDword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint16_t data) {
+void ConfigWriteDword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t data) {
     uint32_t address = (uint32_t)((bus << 16) | (slot << 11) | (func << 8) | (offset & 0xfc) | 0x80000000);
 
+    ScopedSpinLock<true> lock(configLock);
     outportl(0xCF8, address);
     outportl(0xCFC, data);
 }
@@ -57,6 +65,7 @@ void ConfigWriteDword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, u
 void ConfigWriteWord(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint16_t data) {
     uint32_t address = (uint32_t)((bus << 16) | (slot << 11) | (func << 8) | (offset & 0xfc) | 0x80000000);
 
+    ScopedSpinLock<true> lock(configLock);
     outportl(0xCF8, address);
     outportl(0xCFC, (inportl(0xCFC) & (~(0xFFFF << ((offset & 2) * 8)))) |
                         (static_cast<uint32_t>(data) << ((offset & 2) * 8)));
@@ -65,6 +74,7 @@ void ConfigWriteWord(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, ui
 void ConfigWriteByte(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint8_t data) {
     uint32_t address = (uint32_t)((bus << 16) | (slot << 11) | (func << 8) | (offset & 0xfc) | 0x80000000);
 
+    ScopedSpinLock<true> lock(configLock);
     outportl(0xCF8, address);
     outportb(0xCFC,
              (inportl(0xCFC) & (~(0xFF << ((offset & 3) * 8)))) | (static_cast<uint32_t>(data) << ((offset & 3) * 8)));
@@ -232,6 +242,15 @@ void Init() {
         }
     }
 }
+
+unsigned NextInterruptCPU() {
+    if (SMP::processorCount <= 1) {
+        return 0;
+    }
+
+    unsigned index = __atomic_fetch_add(&nextInterruptCPU, 1, __ATOMIC_RELAXED) % SMP::processorCount;
+    return SMP::cpus[index] ? SMP::cpus[index]->id : 0;
+}
 } // namespace PCI
 
 PCIDevice::PCIDevice(uint8_t _bus, uint8_t _slot, uint8_t _func) : bus(_bus), slot(_slot), func(_func) {
@@ -245,12 +264,12 @@ PCIDevice::PCIDevice(uint8_t _bus, uint8_t _slot, uint8_t _func) : bus(_bus), sl
     capabilities = new Vector<uint16_t>();
     if (Status() & PCI_STATUS_CAPABILITIES) {
         uint8_t ptr = PCI::ConfigReadWord(bus, slot, func, PCICapabilitiesPointer) & 0xFC;
-        uint16_t cap = PCI::ConfigReadDword(bus, slot, func, ptr);
-        do {
+        while (ptr) {
+            uint32_t cap = PCI::ConfigReadDword(bus, slot, func, ptr);
             if ((cap & 0xFF) == PCICapabilityIDs::PCICapMSI) {
                 msiPtr = ptr;
                 msiCapable = true;
-                msiCap.register0 = PCI::ConfigReadDword(bus, slot, func, ptr);
+                msiCap.register0 = cap;
                 msiCap.register1 = PCI::ConfigReadDword(bus, slot, func, ptr + sizeof(uint32_t));
                 msiCap.register2 = PCI::ConfigReadDword(bus, slot, func, ptr + sizeof(uint32_t) * 2);
 
@@ -259,17 +278,25 @@ PCIDevice::PCIDevice(uint8_t _bus, uint8_t _slot, uint8_t _func) : bus(_bus), sl
                 }
 
                 msiCap.register4 = PCI::ConfigReadDword(bus, slot, func, ptr + sizeof(uint32_t) * 3);
+            } else if ((cap & 0xFF) == PCICapabilityIDs::PCICapMSIX) {
+                msixPtr = ptr;
+                msixCapable = true;
+                msixCap.register0 = cap;
+                msixCap.register1 = PCI::ConfigReadDword(bus, slot, func, ptr + sizeof(uint32_t));
+                msixCap.register2 = PCI::ConfigReadDword(bus, slot, func, ptr + sizeof(uint32_t) * 2);
             }
 
-            ptr = (cap >> 8);
-            cap = PCI::ConfigReadDword(bus, slot, func, ptr);
-
             capabilities->add_back(cap & 0xFF);
-        } while ((cap >> 8));
+            ptr = (cap >> 8) & 0xFC;
+        }
     }
 }
 
 uint8_t PCIDevice::AllocateVector(PCIVectors type) {
+    if ((type & PCIVectorMSIX) && msixCapable) {
+        return AllocateMSIXVector(0, PCI::NextInterruptCPU());
+    }
+
     if (type & PCIVectorMSI) {
         if (!msiCapable) {
             Log::Error("[PCIDevice] AllocateVector: Device not MSI capable!");
@@ -291,7 +318,7 @@ uint8_t PCIDevice::AllocateVector(PCIVectors type) {
 
             Log::Info("(64: %Y) Ctrl %x, Data %x", msiCap.msiControl & PCI_CAP_MSI_CONTROL_64, msiCap.register0, msiCap.GetData());
 
-            msiCap.SetAddress(0); // Send it to CPU 0
+            msiCap.SetAddress(PCI::NextInterruptCPU());
 
             PCI::ConfigWriteDword(bus, slot, func, msiPtr, msiCap.register0);
             PCI::ConfigWriteDword(bus, slot, func, msiPtr + sizeof(uint32_t), msiCap.register1);
@@ -319,4 +346,49 @@ uint8_t PCIDevice::AllocateVector(PCIVectors type) {
 
     Log::Error("[PCIDevice] AllocateVector: Could not allocate interrupt (type %i)!", static_cast<int>(type));
     return 0xFF;
-}
\ No newline at end of file
+}
+
+uint8_t PCIDevice::AllocateMSIXVector(unsigned entry, unsigned cpu) {
+    if (!msixCapable) {
+        Log::Error("[PCIDevice] AllocateMSIXVector: Device not MSI-X capable!");
+        return 0xFF;
+    } else if (entry >= MSIXVectorCount()) {
+        Log::Error("[PCIDevice] AllocateMSIXVector: Entry %u out of range (table size %u)!", entry, MSIXVectorCount());
+        return 0xFF;
+    }
+
+    if (!msixTable) {
+        uintptr_t tableBase = GetBaseAddressRegister(PCI_CAP_MSIX_BIR(msixCap.tableOffset)) +
+                              PCI_CAP_MSIX_OFFSET(msixCap.tableOffset);
+        size_t tableSize = MSIXVectorCount() * sizeof(PCIMSIXTableEntry);
+        unsigned pages = ((tableBase & (PAGE_SIZE_4K - 1)) + tableSize + PAGE_SIZE_4K - 1) >> PAGE_SHIFT_4K;
+
+        uintptr_t mapping = reinterpret_cast<uintptr_t>(Memory::KernelAllocate4KPages(pages));
+        Memory::KernelMapVirtualMemory4K(tableBase & ~static_cast<uintptr_t>(PAGE_SIZE_4K - 1), mapping, pages,
+                                         PAGE_PRESENT | PAGE_WRITABLE | PAGE_MEMORY_UC);
+        msixTable = reinterpret_cast<PCIMSIXTableEntry*>(mapping + (tableBase & (PAGE_SIZE_4K - 1)));
+
+        // Mask everything until it is allocated
+        for (unsigned i = 0; i < MSIXVectorCount(); i++) {
+            msixTable[i].vectorControl = msixTable[i].vectorControl | PCI_MSIX_VECTOR_MASKED;
+        }
+
+        msixCap.msixControl = (msixCap.msixControl & ~PCI_CAP_MSIX_CONTROL_FUNCTION_MASK) | PCI_CAP_MSIX_CONTROL_ENABLE;
+        PCI::ConfigWriteWord(bus, slot, func, msixPtr + 2, msixCap.msixControl);
+
+        SetCommand(GetCommand() | PCI_CMD_INTERRUPT_DISABLE); // MSI-X replaces the legacy interrupt pin
+    }
+
+    uint8_t interrupt = IDT::ReserveUnusedInterrupt();
+    if (interrupt == 0xFF) {
+        Log::Error("[PCIDevice] AllocateMSIXVector: Could not reserve unused interrupt (no free interrupts?)!");
+        return interrupt;
+    }
+
+    msixTable[entry].addressLow = PCI_CAP_MSI_ADDRESS_BASE | (static_cast<uint32_t>(cpu) << 12);
+    msixTable[entry].addressHigh = 0;
+    msixTable[entry].data = ICR_VECTOR(interrupt) | ICR_MESSAGE_TYPE_FIXED;
+    msixTable[entry].vectorControl = msixTable[entry].vectorControl & ~PCI_MSIX_VECTOR_MASKED;
+
+    return interrupt;
+}
@@ -9,6 +9,8 @@
 #include <IDT.h>
 #include <IOPorts.h>
 #include <Logging.h>
+#include <RingBuffer.h>
+#include <Spinlock.h>
 #include <stddef.h>
 
 #include "PS2.h"
@@ -36,7 +38,9 @@
 
 #define KEY_QUEUE_SIZE 256
 
-uint8_t keyQueue[KEY_QUEUE_SIZE];
+// Pushed by the interrupt handler, popped by readers holding keyReadLock
+SPSCRingBuffer<uint8_t, KEY_QUEUE_SIZE> keyQueue;
+lock_t keyReadLock = 0;
 
 extern const uint8_t scancode2Keymap[];
 extern const uint8_t scancode2KeymapExtended[];
@@ -44,9 +48,6 @@ extern const uint8_t scancode2KeymapExtended[];
 // Set true when a 0xe0 byte is received (indicating extended scancode)
 bool keyIsExtended = false;
 bool keyWasReleased = false;
-unsigned short keyQueueEnd = 0;
-unsigned short keyQueueStart = 0;
-unsigned short keyCount = 0;
 
 template <bool isMouse> inline void WaitData() {
     int timeout = 250;
@@ -94,23 +95,6 @@ template <bool isMouse> int SendCommand(uint8_t cmd) {
     return r;
 }
 
-bool ReadKey(uint8_t* key) {
-    if (keyCount <= 0)
-        return false;
-
-    *key = keyQueue[keyQueueStart];
-
-    keyQueueStart++;
-
-    if (keyQueueStart >= KEY_QUEUE_SIZE) {
-        keyQueueStart = 0;
-    }
-
-    keyCount--;
-
-    return true;
-}
-
 // Interrupt handler
 void KBHandler(void*, RegisterContext* r) {
     if (!(inportb(PS2_CMD) & 1))
@@ -147,19 +131,7 @@ void KBHandler(void*, RegisterContext* r) {
     keyIsExtended = false;
     keyWasReleased = false;
 
-    if (keyCount >= KEY_QUEUE_SIZE)
-        return; // Drop key
-
-    // Add key to queue
-    keyQueue[keyQueueEnd] = keyCode;
-
-    keyQueueEnd++;
-
-    if (keyQueueEnd >= KEY_QUEUE_SIZE) {
-        keyQueueEnd = 0;
-    }
-
-    keyCount++;
+    keyQueue.Push(keyCode); // Dropped if the queue is full
 }
 
 uint8_t mouseData[4];
@@ -171,11 +143,9 @@ struct MousePacket {
     int8_t verticalScroll;
 };
 
-MousePacket packetQueue[PACKET_QUEUE_SIZE]; // Use a statically allocated array to avoid allocations
-
-short packetQueueEnd = 0;
-short packetQueueStart = 0;
-short packetCount = 0;
+// Pushed by the interrupt handler, popped by readers holding packetReadLock
+SPSCRingBuffer<MousePacket, PACKET_QUEUE_SIZE> packetQueue;
+lock_t packetReadLock = 0;
 
 uint8_t mouseCycle = 0;
 bool hasScrollWheel = false;
@@ -206,9 +176,6 @@ void MouseHandler(void*, RegisterContext* regs) {
         }
         mouseCycle = 0;
 
-        if (packetCount >= PACKET_QUEUE_SIZE)
-            break; // Drop packet
-
         MousePacket pkt;
         pkt.buttons = mouseData[0] & (MOUSE_BUTTON_LEFT | MOUSE_BUTTON_MIDDLE | MOUSE_BUTTON_RIGHT);
 
@@ -226,16 +193,7 @@ void MouseHandler(void*, RegisterContext* regs) {
         pkt.yMovement = -y;
         pkt.verticalScroll = mouseData[3];
 
-        // Add packet to queue
-        packetQueue[packetQueueEnd] = pkt;
-
-        packetQueueEnd++;
-
-        if (packetQueueEnd >= PACKET_QUEUE_SIZE) {
-            packetQueueEnd = 0;
-        }
-
-        packetCount++;
+        packetQueue.Push(pkt); // Dropped if the queue is full
         break;
     }
 
@@ -260,19 +218,19 @@ public:
     }
 
     ssize_t Read(size_t offset, size_t size, uint8_t* buffer) {
-        if (size > keyCount)
-            size = keyCount;
-
-        if (!size)
-            return 0;
-
-        unsigned short i = 0;
-        for (; i < size; i++) {
-            if (!ReadKey(buffer++)) // Insert key and increment
-                break;
+        if (size > KEY_QUEUE_SIZE)
+            size = KEY_QUEUE_SIZE;
+
+        // Don't touch the caller's buffer with the lock held
+        uint8_t keys[KEY_QUEUE_SIZE];
+        unsigned count;
+        {
+            ScopedSpinLock lockRead(keyReadLock);
+            count = keyQueue.PopBatch(keys, size);
         }
 
-        return i;
+        memcpy(buffer, keys, count);
+        return count;
     }
 };
 
@@ -293,20 +251,14 @@ public:
         if (size < sizeof(MousePacket))
             return 0;
 
-        if (packetCount <= 0)
-            return 0; // No packets
-
-        MousePacket* pkt = (MousePacket*)buffer;
-        *pkt = packetQueue[packetQueueStart];
-
-        packetQueueStart++;
-
-        if (packetQueueStart >= PACKET_QUEUE_SIZE) {
-            packetQueueStart = 0;
+        MousePacket pkt;
+        {
+            ScopedSpinLock lockRead(packetReadLock);
+            if (!packetQueue.Pop(pkt))
+                return 0; // No packets
         }
 
-        packetCount--;
-
+        memcpy(buffer, &pkt, sizeof(MousePacket));
         return sizeof(MousePacket);
     }
 };
@@ -7,6 +7,7 @@
 #include <Paging.h>
 #include <Panic.h>
 #include <PhysicalAllocator.h>
+#include <SMP.h>
 #include <Scheduler.h>
 #include <StackTrace.h>
 #include <Syscalls.h>
@@ -14,6 +15,10 @@
 
 // extern uint32_t kernel_end;
 
+#define MSR_PAT 0x277
+// Power on defaults (WB, WT, UC-, UC) for entries 0-3 and 4-6, write combining for entry 7
+#define PAT_VALUE 0x0107040600070406ULL
+
 #define KERNEL_HEAP_PDPT_INDEX 511
 #define KERNEL_HEAP_PML4_INDEX 511
 
@@ -30,6 +35,65 @@ page_dir_t ioDirs[4] __attribute__((aligned(4096)));
 
 lock_t kernelHeapDirLock = 0;
 
+static bool pcidSupported = false;
+static bool patSupported = false;
+static uint64_t nextPageMapID = 1;
+// Incremented whenever a present kernel mapping is changed,
+// TLB entries tagged with PCIDs other than the one loaded may be stale after this
+static uint64_t kernelMappingGeneration = 0;
+
+// Only one shootdown is in flight at a time,
+// CPUs waiting to send one service the current request so they cannot deadlock
+static lock_t shootdownLock = 0;
+static struct {
+    PageMap* pageMap;
+    uintptr_t base;
+    uint64_t pages;
+    volatile uint64_t pendingCPUs; // CPUs yet to invalidate their entries
+} shootdownRequest;
+
+void TLBShootdownHandler(void*, RegisterContext*);
+
+// Change in the page counts of a page map, applied once all the entries have been updated
+struct PageCountDelta {
+    int64_t resident = 0;
+    int64_t shared = 0;
+    int64_t cow = 0;
+
+    // Count (or with a negative amount, uncount) pages mapped by entry
+    ALWAYS_INLINE void Count(uint64_t entry, int64_t pages) {
+        if ((entry & (PAGE_PRESENT | PAGE_USER)) != (PAGE_PRESENT | PAGE_USER)) {
+            return;
+        }
+
+        resident += pages;
+        if (entry & PAGE_SHARED) {
+            shared += pages;
+        }
+        if (entry & PAGE_COPY_ON_WRITE) {
+            cow += pages;
+        }
+    }
+
+    void CountTable(const page_t* table, int64_t sign) {
+        for (int i = 0; i < PAGES_PER_TABLE; i++) {
+            Count(table[i], sign);
+        }
+    }
+
+    void Apply(PageMap* pageMap) {
+        if (resident) {
+            __atomic_add_fetch(&pageMap->residentPages, resident, __ATOMIC_RELAXED);
+        }
+        if (shared) {
+            __atomic_add_fetch(&pageMap->sharedPages, shared, __ATOMIC_RELAXED);
+        }
+        if (cow) {
+            __atomic_add_fetch(&pageMap->cowPages, cow, __ATOMIC_RELAXED);
+        }
+    }
+};
+
 HashMap<uintptr_t, PageFaultTrap>* pageFaultTraps;
 
 uint64_t VirtualToPhysicalAddress(uint64_t addr) {
@@ -60,8 +124,11 @@ uint64_t VirtualToPhysicalAddress(uint64_t addr, page_map_t* addressSpace) {
     uint32_t pageTableIndex = PAGE_TABLE_GET_INDEX(addr);
 
     if (pml4Index == 0) { // From Process Address Space
-        if ((addressSpace->pageDirs[pdptIndex][pageDirIndex] & 0x1) &&
-            addressSpace->pageTables[pdptIndex][pageDirIndex])
+        pd_entry_t dirEnt = addressSpace->pageDirs[pdptIndex][pageDirIndex];
+        if ((dirEnt & 0x1) && (dirEnt & PDE_2M))
+            return (dirEnt & PDE_FRAME & ~static_cast<uint64_t>(PAGE_SIZE_2M - 1)) +
+                   (static_cast<uint64_t>(pageTableIndex) << PAGE_SHIFT_4K);
+        else if ((dirEnt & 0x1) && addressSpace->pageTables[pdptIndex][pageDirIndex])
             return addressSpace->pageTables[pdptIndex][pageDirIndex][pageTableIndex] & PAGE_FRAME;
         else
             return 0;
@@ -75,6 +142,35 @@ uint64_t VirtualToPhysicalAddress(uint64_t addr, page_map_t* addressSpace) {
     return address;
 }
 
+int TestAndClearAccessed(uintptr_t virt, PageMap* pageMap, bool& large) {
+    uint32_t pdptIndex = PDPT_GET_INDEX(virt);
+    uint32_t pageDirIndex = PAGE_DIR_GET_INDEX(virt);
+    assert(!PML4_GET_INDEX(virt) && pdptIndex <= MAX_PDPT_INDEX);
+
+    large = false;
+    if (!pageMap->pageDirs[pdptIndex]) {
+        return -1;
+    }
+
+    pd_entry_t& dirEnt = pageMap->pageDirs[pdptIndex][pageDirIndex];
+    uint64_t* entry;
+    if ((dirEnt & PDE_PRESENT) && (dirEnt & PDE_2M)) {
+        large = true;
+        entry = &dirEnt;
+    } else if ((dirEnt & PDE_PRESENT) && pageMap->pageTables[pdptIndex][pageDirIndex]) {
+        entry = &pageMap->pageTables[pdptIndex][pageDirIndex][PAGE_TABLE_GET_INDEX(virt)];
+    } else {
+        return -1;
+    }
+
+    if (!(*entry & PAGE_PRESENT)) {
+        return -1;
+    }
+
+    // The CPU sets the bit atomically, clear it the same way so nothing else is lost
+    return (__atomic_fetch_and(entry, ~static_cast<uint64_t>(PAGE_ACCESSED), __ATOMIC_RELAXED) & PAGE_ACCESSED) ? 1 : 0;
+}
+
 page_table_t AllocatePageTable() {
     void* virt = KernelAllocate4KPages(1);
     uint64_t phys = Memory::AllocatePhysicalMemoryBlock();
@@ -103,8 +199,34 @@ page_table_t CreatePageTable(uint16_t pdptIndex, uint16_t pageDirIndex, PageMap*
     return pTable;
 }
 
+// Replace a 2MB page with a page table mapping the same memory,
+// used when only part of the 2MB page is being remapped
+void SplitLargePage(uint16_t pdptIndex, uint16_t pageDirIndex, PageMap* pageMap) {
+    pd_entry_t dirEnt = pageMap->pageDirs[pdptIndex][pageDirIndex];
+    assert(dirEnt & PDE_2M);
+
+    uint64_t phys = dirEnt & PDE_FRAME & ~static_cast<uint64_t>(PAGE_SIZE_2M - 1);
+    uint64_t flags = dirEnt & (PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER | PAGE_WRITETHROUGH | PAGE_CACHE_DISABLED |
+                               PAGE_SHARED | PAGE_COPY_ON_WRITE);
+    if (dirEnt & PDE_PAT) {
+        flags |= PAGE_PAT; // The PAT bit is bit 12 in a 2MB PDE but bit 7 in a PTE
+    }
+
+    // Fill the page table before it is installed so the memory stays mapped throughout
+    page_table_t pTable = AllocatePageTable();
+    for (int i = 0; i < PAGES_PER_TABLE; i++) {
+        pTable.virt[i] = (phys + static_cast<uint64_t>(i) * PAGE_SIZE_4K) | flags;
+    }
+
+    pageMap->pageTables[pdptIndex][pageDirIndex] = pTable.virt;
+    pageMap->pageDirs[pdptIndex][pageDirIndex] = pTable.phys | PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER;
+
+    invlpg((static_cast<uintptr_t>(pdptIndex) << 30) | (static_cast<uintptr_t>(pageDirIndex) << 21));
+}
+
 void InitializeVirtualMemory() {
     IDT::RegisterInterruptHandler(14, PageFaultHandler);
+    IDT::RegisterInterruptHandler(IPI_TLB_SHOOTDOWN, TLBShootdownHandler);
     memset(kernelPML4, 0, sizeof(pml4_t));
     memset(kernelPDPT, 0, sizeof(pdpt_t));
     memset(kernelHeapDir, 0, sizeof(page_dir_t));
@@ -139,13 +261,233 @@ void InitializeVirtualMemory() {
 
     kernelPML4Phys = (uint64_t)kernelPML4 - KERNEL_VIRTUAL_BASE;
     asm("mov %%rax, %%cr3" ::"a"((uint64_t)kernelPML4 - KERNEL_VIRTUAL_BASE));
+
+    pcidSupported = CPUID().features_ecx & CPUID_ECX_PCIDE;
+    if (pcidSupported) {
+        Log::Info("Using PCIDs");
+    }
+    InitializeTLB();
+
+    patSupported = CPUID().features_edx & CPUID_EDX_PAT;
+    if (!patSupported) {
+        Log::Warning("PAT not supported, write combining mappings will be uncached");
+    }
+    InitializePAT();
+}
+
+void InitializePAT() {
+    if (!patSupported) {
+        return; // PAGE_PAT is ignored, PAGE_MEMORY_WC falls back to UC
+    }
+
+    // Flush caches and the TLB around the change so nothing is left cached with the old types
+    asm volatile("wbinvd" ::: "memory");
+    WriteMSR(MSR_PAT, PAT_VALUE);
+    asm volatile("mov %%cr3, %%rax; mov %%rax, %%cr3" ::: "rax", "memory");
+    asm volatile("wbinvd" ::: "memory");
+}
+
+void InitializeTLB() {
+    if (!pcidSupported) {
+        return;
+    }
+
+    // CR3 must have a PCID of 0 when this is set
+    assert(!(GetCR3() & CR3_PCID_MASK));
+
+    uintptr_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    asm volatile("mov %0, %%cr4" ::"r"(cr4 | CR4_PCIDE));
+}
+
+uint64_t ActivatePageMap(PageMap* pageMap) {
+    CPU* cpu = GetCPULocal();
+    uint64_t cpuBit = (cpu->id < 64) ? (1ULL << cpu->id) : 0;
+
+    // Publish the page map before checking if it is stale,
+    // a shootdown marks it stale before checking if we are running it
+    __atomic_store_n(&cpu->currentPageMap, pageMap, __ATOMIC_SEQ_CST);
+    __atomic_fetch_or(&pageMap->activeCPUs, cpuBit, __ATOMIC_SEQ_CST);
+    bool stale = __atomic_fetch_and(&pageMap->staleCPUs, ~cpuBit, __ATOMIC_SEQ_CST) & cpuBit;
+
+    // CPUs past 63 cannot be tracked, always flush
+    if (!pcidSupported || !cpuBit) {
+        return pageMap->pml4Phys;
+    }
+
+    uint64_t generation = __atomic_load_n(&kernelMappingGeneration, __ATOMIC_ACQUIRE);
+    if (cpu->kernelMappingGeneration != generation) {
+        // Kernel mappings have changed, forget every PCID so each is flushed before it is used again
+        memset(cpu->pcidPageMaps, 0, sizeof(cpu->pcidPageMaps));
+        cpu->kernelMappingGeneration = generation;
+    }
+
+    for (unsigned i = 0; i < CPU_PCID_COUNT; i++) {
+        if (cpu->pcidPageMaps[i] == pageMap->id) {
+            uint64_t cr3 = pageMap->pml4Phys | (i + 1);
+            return stale ? cr3 : (cr3 | CR3_NO_FLUSH);
+        }
+    }
+
+    // Take the oldest PCID, loading it without CR3_NO_FLUSH drops its entries
+    unsigned pcid = cpu->nextPCID++ % CPU_PCID_COUNT;
+    cpu->pcidPageMaps[pcid] = pageMap->id;
+    return pageMap->pml4Phys | (pcid + 1);
+}
+
+// Invalidate entries of the address space loaded on this CPU
+static void LocalInvalidatePages(uintptr_t base, uint64_t pages) {
+    if (pages > TLB_FLUSH_ALL_PAGES) {
+        // Reloading CR3 without CR3_NO_FLUSH flushes the loaded PCID
+        asm volatile("mov %0, %%cr3" ::"r"(GetCR3()) : "memory");
+        return;
+    }
+
+    while (pages--) {
+        invlpg(base);
+        base += PAGE_SIZE_4K;
+    }
+}
+
+static void ProcessShootdownRequest(CPU* cpu) {
+    uint64_t cpuBit = 1ULL << cpu->id;
+    if (!(__atomic_load_n(&shootdownRequest.pendingCPUs, __ATOMIC_ACQUIRE) & cpuBit)) {
+        return;
+    }
+
+    if (cpu->currentPageMap == shootdownRequest.pageMap) {
+        LocalInvalidatePages(shootdownRequest.base, shootdownRequest.pages);
+    } else {
+        // We switched away since the request was sent
+        __atomic_fetch_or(&shootdownRequest.pageMap->staleCPUs, cpuBit, __ATOMIC_SEQ_CST);
+    }
+
+    __atomic_fetch_and(&shootdownRequest.pendingCPUs, ~cpuBit, __ATOMIC_RELEASE);
+}
+
+void TLBShootdownHandler(void*, RegisterContext*) { ProcessShootdownRequest(GetCPULocal()); }
+
+static void ShootdownTLB(PageMap* pageMap, uintptr_t base, uint64_t pages) {
+    InterruptDisabler disableInterrupts;
+    CPU* self = GetCPULocal();
+
+    if (self->currentPageMap == pageMap) {
+        LocalInvalidatePages(base, pages);
+    }
+
+    uint64_t active = __atomic_load_n(&pageMap->activeCPUs, __ATOMIC_SEQ_CST);
+    uint64_t targets = 0;
+    // CPUs past 63 are not represented, as with SMP::OnlineCPUMask
+    for (unsigned i = 0; i < SMP::processorCount && i < 64; i++) {
+        CPU* cpu = SMP::cpus[i];
+        uint64_t cpuBit = 1ULL << i;
+        if (!cpu || !(active & cpuBit)) {
+            continue;
+        }
+
+        if (cpu == self) {
+            if (self->currentPageMap != pageMap) {
+                __atomic_fetch_or(&pageMap->staleCPUs, cpuBit, __ATOMIC_SEQ_CST);
+            }
+            continue;
+        }
+
+        if (__atomic_load_n(&cpu->currentPageMap, __ATOMIC_SEQ_CST) == pageMap) {
+            targets |= cpuBit;
+            continue;
+        }
+
+        // Not running the page map, mark it stale so the CPU flushes its entries when it switches back.
+        // If the CPU loaded the page map before seeing the stale bit it needs an IPI after all.
+        __atomic_fetch_or(&pageMap->staleCPUs, cpuBit, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&cpu->currentPageMap, __ATOMIC_SEQ_CST) == pageMap) {
+            targets |= cpuBit;
+        }
+    }
+
+    if (!targets) {
+        return;
+    }
+
+    while (acquireTestLock(&shootdownLock)) {
+        ProcessShootdownRequest(self);
+        asm volatile("pause");
+    }
+
+    shootdownRequest.pageMap = pageMap;
+    shootdownRequest.base = base;
+    shootdownRequest.pages = pages;
+    __atomic_store_n(&shootdownRequest.pendingCPUs, targets, __ATOMIC_RELEASE);
+
+    for (unsigned i = 0; i < SMP::processorCount && i < 64; i++) {
+        if (targets & (1ULL << i)) {
+            APIC::Local::SendIPI(SMP::cpus[i]->id, ICR_DSH_DEST, ICR_MESSAGE_TYPE_FIXED, IPI_TLB_SHOOTDOWN);
+        }
+    }
+
+    while (__atomic_load_n(&shootdownRequest.pendingCPUs, __ATOMIC_ACQUIRE)) {
+        asm volatile("pause");
+    }
+
+    releaseLock(&shootdownLock);
+}
+
+void InvalidatePages(PageMap* pageMap, uintptr_t base, uint64_t pages) {
+    Thread* thread = GetCurrentThread();
+    if (thread && thread->tlbShootdownBatch && thread->tlbShootdownBatch->GetPageMap() == pageMap) {
+        thread->tlbShootdownBatch->Add(base, pages);
+        return;
+    }
+
+    ShootdownTLB(pageMap, base, pages);
+}
+
+TLBShootdownBatch::TLBShootdownBatch(PageMap* pageMap) : m_pageMap(pageMap), m_thread(GetCurrentThread()) {
+    if (m_thread) {
+        assert(!m_thread->tlbShootdownBatch);
+        m_thread->tlbShootdownBatch = this;
+    }
+}
+
+TLBShootdownBatch::~TLBShootdownBatch() {
+    Flush();
+
+    if (m_thread) {
+        m_thread->tlbShootdownBatch = nullptr;
+    }
+}
+
+void TLBShootdownBatch::Add(uintptr_t base, uint64_t pages) {
+    uintptr_t end = base + pages * PAGE_SIZE_4K;
+    if (m_start == m_end) {
+        m_start = base;
+        m_end = end;
+        return;
+    }
+
+    // Merge into one range, anything large is flushed at once anyway
+    if (base < m_start) {
+        m_start = base;
+    }
+
+    if (end > m_end) {
+        m_end = end;
+    }
+}
+
+void TLBShootdownBatch::Flush() {
+    if (m_start == m_end) {
+        return;
+    }
+
+    ShootdownTLB(m_pageMap, m_start, (m_end - m_start) >> PAGE_SHIFT_4K);
+    m_start = m_end = 0;
 }
 
 void LateInitializeVirtualMemory() {
     pageFaultTraps = new HashMap<uintptr_t, PageFaultTrap>();
 
-    RegisterPageFaultTrap(PageFaultTrap{.instructionPointer = reinterpret_cast<uintptr_t>(UserMemcpyTrap),
-                                        .handler = UserMemcpyTrapHandler});
+    InitializeUserCopy();
 }
 
 PageMap* CreatePageMap() {
@@ -190,6 +532,14 @@ PageMap* CreatePageMap() {
     addressSpace->pml4Phys = pml4Phys;
     addressSpace->pdpt = pdpt;
 
+    addressSpace->id = __atomic_fetch_add(&nextPageMapID, 1, __ATOMIC_RELAXED);
+    addressSpace->activeCPUs = 0;
+    addressSpace->staleCPUs = 0;
+
+    addressSpace->residentPages = 0;
+    addressSpace->sharedPages = 0;
+    addressSpace->cowPages = 0;
+
     pml4[0] = pdptPhys | PML4_PRESENT | PML4_WRITABLE | PAGE_USER;
 
     return addressSpace;
@@ -224,6 +574,12 @@ PageMap* ClonePageMap(PageMap* pageMap) {
     clone->pdptPhys = pdptPhys;
     clone->pml4Phys = pml4Phys;
     clone->pdpt = pdpt;
+    clone->id = __atomic_fetch_add(&nextPageMapID, 1, __ATOMIC_RELAXED);
+
+    // Every entry is copied so the counts are the same
+    clone->residentPages = pageMap->residentPages;
+    clone->sharedPages = pageMap->sharedPages;
+    clone->cowPages = pageMap->cowPages;
 
     for (unsigned int i = 0; i < DIRS_PER_PDPT; i++) {
         pageDirs[i] = (pd_entry_t*)KernelAllocate4KPages(1);
@@ -243,6 +599,9 @@ PageMap* ClonePageMap(PageMap* pageMap) {
 
                 memcpy(pgTable.virt, originalPageTable,
                        sizeof(uintptr_t) * PAGES_PER_TABLE); // Copy the pages in the page table
+            } else if (pageMap->pageDirs[i][j] & PDE_2M) {
+                pageDirs[i][j] = pageMap->pageDirs[i][j]; // 2MB pages have no page table to copy
+                pageTables[i][j] = nullptr;
             } else {
                 pageDirs[i][j] = 0;
                 pageTables[i][j] = nullptr;
@@ -265,8 +624,8 @@ void DestroyPageMap(PageMap* pageMap) {
 
         for (int j = 0; j < TABLES_PER_DIR; j++) {
             pd_entry_t dirEnt = pageMap->pageDirs[i][j];
-            if (dirEnt & PAGE_PRESENT) {
-                uint64_t phys = GetPageFrame(dirEnt);
+            if ((dirEnt & PAGE_PRESENT) && !(dirEnt & PDE_2M)) { // 2MB pages are owned by their VMObject
+                uint64_t phys = dirEnt & PDE_FRAME;
                 if (phys < PHYSALLOC_BLOCK_SIZE) {
                     continue;
                 }
@@ -522,13 +881,22 @@ void KernelFree4KPages(void* addr, uint64_t amount) {
 
     ScopedSpinLock<true> lockKDir(kernelHeapDirLock);
 
+    bool changed = false;
     while (amount--) {
         pageDirIndex = PAGE_DIR_GET_INDEX(virt);
         pageIndex = PAGE_TABLE_GET_INDEX(virt);
+        if (kernelHeapDirTables[pageDirIndex][pageIndex] & PAGE_PRESENT) {
+            changed = true;
+            invlpg(virt);
+        }
         kernelHeapDirTables[pageDirIndex][pageIndex] = 0;
-        invlpg(virt);
         virt += PAGE_SIZE_4K;
     }
+
+    // Only translations of present pages can be cached under other PCIDs
+    if (changed) {
+        __atomic_fetch_add(&kernelMappingGeneration, 1, __ATOMIC_RELEASE);
+    }
 }
 
 void Free4KPages(void* addr, uint64_t amount, page_map_t* addressSpace) {
@@ -536,7 +904,10 @@ void Free4KPages(void* addr, uint64_t amount, page_map_t* addressSpace) {
 
     uint64_t virt = (uint64_t)addr;
 
-    while (amount--) {
+    uint64_t pages = amount;
+    bool changed = false;
+    PageCountDelta delta;
+    while (amount) {
         pml4Index = PML4_GET_INDEX(virt);
         pdptIndex = PDPT_GET_INDEX(virt);
         pageDirIndex = PAGE_DIR_GET_INDEX(virt);
@@ -546,14 +917,47 @@ void Free4KPages(void* addr, uint64_t amount, page_map_t* addressSpace) {
         if (pdptIndex > MAX_PDPT_INDEX || pml4Index)
             KernelPanic(panic, 1);
 
-        if (!(addressSpace->pageDirs[pdptIndex][pageDirIndex] & 0x1))
+        // Pages of the range covered by this page directory entry
+        uint64_t count = PAGES_PER_TABLE - pageIndex;
+        if (count > amount) {
+            count = amount;
+        }
+
+        amount -= count;
+        virt += count * PAGE_SIZE_4K;
+
+        pd_entry_t& dirEnt = addressSpace->pageDirs[pdptIndex][pageDirIndex];
+        if (!(dirEnt & PDE_PRESENT)) {
             continue;
+        }
 
-        addressSpace->pageTables[pdptIndex][pageDirIndex][pageIndex] = 0;
+        if (dirEnt & PDE_2M) {
+            if (count == PAGES_PER_TABLE) {
+                // Freeing the whole 2MB page
+                delta.Count(dirEnt, -PAGES_PER_TABLE);
+                dirEnt = 0;
+                changed = true;
+                continue;
+            }
 
-        invlpg(virt);
+            // The range starts or ends inside the 2MB page,
+            // keep the rest of it mapped with 4KB pages
+            SplitLargePage(pdptIndex, pageDirIndex, addressSpace);
+        }
 
-        virt += PAGE_SIZE_4K; /* Go to next page */
+        page_t* table = addressSpace->pageTables[pdptIndex][pageDirIndex];
+        for (uint64_t i = pageIndex; i < pageIndex + count; i++) {
+            changed |= (table[i] & PAGE_PRESENT);
+            delta.Count(table[i], -1);
+            table[i] = 0;
+        }
+    }
+
+    delta.Apply(addressSpace);
+
+    // Translations are only cached for present pages
+    if (changed) {
+        InvalidatePages(addressSpace, reinterpret_cast<uintptr_t>(addr), pages);
     }
 }
 
@@ -562,13 +966,20 @@ void KernelMapVirtualMemory2M(uint64_t phys, uint64_t virt, uint64_t amount) {
 
     ScopedSpinLock<true> lockKDir(kernelHeapDirLock);
 
+    bool changed = false;
     while (amount--) {
+        uint64_t old = kernelHeapDir[pageDirIndex];
         kernelHeapDir[pageDirIndex] = 0x83;
         SetPageFrame(&(kernelHeapDir[pageDirIndex]), phys);
         kernelHeapDir[pageDirIndex] |= 0x83;
+        changed |= (old & PDE_PRESENT) && old != kernelHeapDir[pageDirIndex];
         pageDirIndex++;
         phys += PAGE_SIZE_2M;
     }
+
+    if (changed) {
+        __atomic_fetch_add(&kernelMappingGeneration, 1, __ATOMIC_RELEASE);
+    }
 }
 
 void KernelMapVirtualMemory4K(uint64_t phys, uint64_t virt, uint64_t amount, uint64_t flags) {
@@ -576,15 +987,27 @@ void KernelMapVirtualMemory4K(uint64_t phys, uint64_t virt, uint64_t amount, uin
 
     ScopedSpinLock<true> lockKDir(kernelHeapDirLock);
 
+    bool changed = false;
     while (amount--) {
         pageDirIndex = PAGE_DIR_GET_INDEX(virt);
         pageIndex = PAGE_TABLE_GET_INDEX(virt);
-        kernelHeapDirTables[pageDirIndex][pageIndex] = flags;
-        SetPageFrame(&(kernelHeapDirTables[pageDirIndex][pageIndex]), phys);
-        invlpg(virt);
+        page_t& page = kernelHeapDirTables[pageDirIndex][pageIndex];
+        page_t old = page;
+        page = flags;
+        SetPageFrame(&page, phys);
+
+        // Mapping a page that was not present, or remapping it as it was, leaves nothing stale
+        if ((old & PAGE_PRESENT) && old != page) {
+            changed = true;
+            invlpg(virt);
+        }
         phys += PAGE_SIZE_4K;
         virt += PAGE_SIZE_4K;
     }
+
+    if (changed) {
+        __atomic_fetch_add(&kernelMappingGeneration, 1, __ATOMIC_RELEASE);
+    }
 }
 
 void KernelMapVirtualMemory4K(uint64_t phys, uint64_t virt, uint64_t amount) {
@@ -594,6 +1017,10 @@ void KernelMapVirtualMemory4K(uint64_t phys, uint64_t virt, uint64_t amount) {
 void MapVirtualMemory4K(uint64_t phys, uint64_t virt, uint64_t amount, uint64_t flags, PageMap* pageMap) {
     uint64_t pml4Index, pdptIndex, pageDirIndex, pageIndex;
 
+    uint64_t base = virt;
+    uint64_t pages = amount;
+    bool changed = false;
+    PageCountDelta delta;
     while (amount--) {
         pml4Index = PML4_GET_INDEX(virt);
         pdptIndex = PDPT_GET_INDEX(virt);
@@ -605,25 +1032,82 @@ void MapVirtualMemory4K(uint64_t phys, uint64_t virt, uint64_t amount, uint64_t
             KernelPanic(panic, 1);
 
         assert(pageMap->pageDirs[pdptIndex]);
-        if (!(pageMap->pageDirs[pdptIndex][pageDirIndex] & 0x1))
+        if (pageMap->pageDirs[pdptIndex][pageDirIndex] & PDE_2M)
+            SplitLargePage(pdptIndex, pageDirIndex, pageMap); // Only part of the 2MB page is being remapped
+        else if (!(pageMap->pageDirs[pdptIndex][pageDirIndex] & 0x1))
             CreatePageTable(pdptIndex, pageDirIndex,
                             pageMap); // If we don't have a page table at this address, create one.
 
         assert(pageMap->pageTables[pdptIndex][pageDirIndex]);
-        pageMap->pageTables[pdptIndex][pageDirIndex][pageIndex] = flags;
-        SetPageFrame(&(pageMap->pageTables[pdptIndex][pageDirIndex][pageIndex]), phys);
-
-        invlpg(virt);
+        page_t& page = pageMap->pageTables[pdptIndex][pageDirIndex][pageIndex];
+        changed |= (page & PAGE_PRESENT);
+        delta.Count(page, -1);
+        page = flags;
+        SetPageFrame(&page, phys);
+        delta.Count(flags, 1);
 
         phys += PAGE_SIZE_4K;
         virt += PAGE_SIZE_4K; /* Go to next page */
     }
+
+    delta.Apply(pageMap);
+
+    // Translations are only cached for present pages
+    if (changed) {
+        InvalidatePages(pageMap, base, pages);
+    }
 }
 
 void MapVirtualMemory4K(uint64_t phys, uint64_t virt, uint64_t amount, PageMap* pageMap) {
     MapVirtualMemory4K(phys, virt, amount, PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER, pageMap);
 }
 
+void MapVirtualMemory2M(uint64_t phys, uint64_t virt, uint64_t amount, uint64_t flags, PageMap* pageMap) {
+    uint64_t pml4Index, pdptIndex, pageDirIndex;
+
+    assert(!(phys & (PAGE_SIZE_2M - 1)) && !(virt & (PAGE_SIZE_2M - 1)));
+    PageCountDelta delta;
+    while (amount--) {
+        pml4Index = PML4_GET_INDEX(virt);
+        pdptIndex = PDPT_GET_INDEX(virt);
+        pageDirIndex = PAGE_DIR_GET_INDEX(virt);
+
+        const char* panic[1] = {"Process address space cannot be >512GB"};
+        if (pdptIndex > MAX_PDPT_INDEX || pml4Index)
+            KernelPanic(panic, 1);
+
+        assert(pageMap->pageDirs[pdptIndex]);
+        pd_entry_t oldDirEnt = pageMap->pageDirs[pdptIndex][pageDirIndex];
+        page_t* oldTable = pageMap->pageTables[pdptIndex][pageDirIndex];
+
+        pageMap->pageDirs[pdptIndex][pageDirIndex] = (phys & PDE_FRAME) | PageFlagsToPDE(flags) | PDE_2M;
+        pageMap->pageTables[pdptIndex][pageDirIndex] = nullptr;
+        delta.Count(flags, PAGES_PER_TABLE);
+
+        if ((oldDirEnt & PDE_PRESENT) && !(oldDirEnt & PDE_2M) && oldTable) {
+            delta.CountTable(oldTable, -1);
+
+            // Any of the old 4KB pages may still be in the TLB,
+            // they must be gone from every CPU before the old table is freed
+            InvalidatePages(pageMap, virt, PAGES_PER_TABLE);
+            if (Thread* thread = GetCurrentThread(); thread && thread->tlbShootdownBatch) {
+                thread->tlbShootdownBatch->Flush();
+            }
+
+            FreePhysicalMemoryBlock(oldDirEnt & PDE_FRAME);
+            KernelFree4KPages(oldTable, 1);
+        } else if (oldDirEnt & PDE_PRESENT) {
+            delta.Count(oldDirEnt, -PAGES_PER_TABLE);
+            InvalidatePages(pageMap, virt, PAGES_PER_TABLE);
+        }
+
+        phys += PAGE_SIZE_2M;
+        virt += PAGE_SIZE_2M;
+    }
+
+    delta.Apply(pageMap);
+}
+
 uintptr_t GetIOMapping(uintptr_t addr) {
     if (addr > 0xffffffff) { // Typically most MMIO will not reside > 4GB, but check just in case
         Log::Error("MMIO >4GB current unsupported");
@@ -704,7 +1188,10 @@ void PageFaultHandler(void*, RegisterContext* regs) {
         }
     }
 
-    if (process) {
+    // The kernel is copying user memory with a spinlock held, fail the copy rather than handle the fault
+    bool faultsDisabled = !(regs->cs & 0x3) && thread && thread->pageFaultsDisabled;
+
+    if (process && !faultsDisabled) {
         AddressSpace* addressSpace = process->addressSpace;
         asm("sti");
         MappedRegion* faultRegion =
@@ -714,22 +1201,19 @@ void PageFaultHandler(void*, RegisterContext* regs) {
             faultRegion->vmObject.get()) { // If there is a corresponding VMO for the fault then this is not an error
             FancyRefPtr<VMObject> vmo = faultRegion->vmObject;
             if (vmo->IsCopyOnWrite() && rw /* Attempted to write to read-only page */) {
-                if (vmo->refCount <= 1) { // Last reference, no need to clone
-                    vmo->copyOnWrite = false;
-                    vmo->MapAllocatedBlocks(
-                        faultRegion->Base(),
-                        addressSpace->GetPageMap()); // This should remap all allocated blocks as writable
-
+                if (vmo->refCount <= 1) { // Only we reference the object, copy just the block being written
                     asm("sti");
-                    vmo->Hit(faultRegion->Base(), faultAddress - faultRegion->Base(),
-                             addressSpace->GetPageMap()); // In case the block was never allocated in the first place
+                    int status = vmo->CopyOnWriteHit(faultRegion->Base(), faultAddress - faultRegion->Base(),
+                                                     addressSpace->GetPageMap());
                     asm("cli");
 
                     faultRegion->lock.ReleaseRead();
-                    if ((regs->cs & 0x3)) {
-                        releaseLock(&Thread::Current()->kernelLock);
+                    if (!status) {
+                        if ((regs->cs & 0x3)) {
+                            releaseLock(&Thread::Current()->kernelLock);
+                        }
+                        return;
                     }
-                    return;
                 } else {
                     asm("sti");
                     VMObject* clone = vmo->Clone();
@@ -765,9 +1249,13 @@ void PageFaultHandler(void*, RegisterContext* regs) {
             asm("cli");
         } else if (faultRegion) {
             faultRegion->lock.ReleaseRead();
-        } else if (PageFaultTrap trap; pageFaultTraps->get(regs->rip, trap)) {
-            // If we have found a handler, set the IP to the handler
-            // and run
+        }
+    }
+
+    // The kernel faulted accessing memory the process could not have,
+    // if it was copying user memory set the IP to the handler and run
+    if (!(regs->cs & 0x3)) {
+        if (PageFaultTrap trap; pageFaultTraps->get(regs->rip, trap)) {
             regs->rip = reinterpret_cast<uintptr_t>(trap.handler);
             return;
         }
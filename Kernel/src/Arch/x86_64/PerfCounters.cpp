@@ -0,0 +1,243 @@
+#include <PerfCounters.h>
+
+#include <CPU.h>
+#include <Logging.h>
+
+#define MSR_INTEL_PERFEVTSEL0 0x186
+#define MSR_INTEL_PMC0 0xC1
+#define MSR_INTEL_A_PMC0 0x4C1 // Full width alias of PMC0
+#define MSR_INTEL_PERF_CAPABILITIES 0x345
+#define MSR_INTEL_PERF_GLOBAL_CTRL 0x38F
+
+#define MSR_AMD_PERF_CTL0 0xC0010000
+#define MSR_AMD_PERF_CTR0 0xC0010004
+#define MSR_AMD_CORE_PERF_CTL0 0xC0010200 // Interleaved with the counters
+#define MSR_AMD_CORE_PERF_CTR0 0xC0010201
+
+#define PERF_CAPABILITIES_FULL_WIDTH_WRITE (1 << 13)
+
+#define EVENT_SELECT_USR (1 << 16)
+#define EVENT_SELECT_OS (1 << 17)
+#define EVENT_SELECT_ENABLE (1 << 22)
+
+namespace PerfCounters {
+
+struct EventEncoding {
+    uint8_t event;
+    uint8_t umask;
+};
+
+// Architectural events
+static const EventEncoding intelEvents[PerfEventCount] = {
+    {0x3C, 0x00}, // Unhalted core cycles
+    {0xC0, 0x00}, // Instructions retired
+    {0x2E, 0x41}, // LLC misses
+    {0xC5, 0x00}, // Branch mispredicts retired
+};
+
+// Bits of CPUID leaf 0xA EBX for each event
+static const uint32_t intelEventBits[PerfEventCount] = {1 << 0, 1 << 1, 1 << 4, 1 << 6};
+
+// Family 17h onwards, the L3 is counted by separate counters so L2 misses are used for cache misses
+static const EventEncoding amdEvents[PerfEventCount] = {
+    {0x76, 0x00}, // Cycles not in halt
+    {0xC0, 0x00}, // Retired instructions
+    {0x64, 0x09}, // L2 cache misses
+    {0xC3, 0x00}, // Retired branches mispredicted
+};
+
+static cpuid_pmu_info_t pmu;
+static bool detected = false;
+static uint32_t supportedEvents = 0;
+static uint64_t counterMask = 0;
+// Whether the full counter value can be written back,
+// Intel CPUs without full width writes only take 32 bits sign extended
+static bool restoreCounts = false;
+
+static inline uint32_t EventSelectMSR(int index) {
+    if (pmu.isAMD) {
+        return pmu.amdCoreExtension ? MSR_AMD_CORE_PERF_CTL0 + 2 * index : MSR_AMD_PERF_CTL0 + index;
+    }
+
+    return MSR_INTEL_PERFEVTSEL0 + index;
+}
+
+static inline uint32_t CounterMSR(int index) {
+    if (pmu.isAMD) {
+        return pmu.amdCoreExtension ? MSR_AMD_CORE_PERF_CTR0 + 2 * index : MSR_AMD_PERF_CTR0 + index;
+    }
+
+    return (restoreCounts ? MSR_INTEL_A_PMC0 : MSR_INTEL_PMC0) + index;
+}
+
+static inline uint64_t EventSelect(int event) {
+    const EventEncoding& encoding = pmu.isAMD ? amdEvents[event] : intelEvents[event];
+    return encoding.event | (encoding.umask << 8) | EVENT_SELECT_USR | EVENT_SELECT_OS | EVENT_SELECT_ENABLE;
+}
+
+static void Detect() {
+    pmu = CPUIDPerformanceMonitoring();
+
+    for (int i = 0; i < PerfEventCount && i < pmu.counters; i++) {
+        if (pmu.isAMD || !(pmu.unavailableEvents & intelEventBits[i])) {
+            supportedEvents |= PERF_EVENT_BIT(i);
+        }
+    }
+
+    counterMask = (pmu.counterWidth >= 64) ? ~0ULL : ((1ULL << pmu.counterWidth) - 1);
+    if (pmu.isAMD) {
+        restoreCounts = true;
+    } else if (pmu.version && (CPUID().features_ecx & CPUID_ECX_PDCM)) {
+        restoreCounts = ReadMSR(MSR_INTEL_PERF_CAPABILITIES) & PERF_CAPABILITIES_FULL_WIDTH_WRITE;
+    }
+
+    if (supportedEvents) {
+        Log::Info("Performance counters: %s, %d counters, %d bits, events %x", pmu.isAMD ? "AMD" : "Intel",
+                  pmu.counters, pmu.counterWidth, supportedEvents);
+    } else {
+        Log::Info("Performance counters not supported");
+    }
+}
+
+void InitializeCPU() {
+    if (!detected) {
+        Detect();
+        detected = true;
+    }
+
+    if (!supportedEvents) {
+        return;
+    }
+
+    // Counters are only enabled whilst a thread is counting, so rdpmc can always be allowed
+    SetCR4PCE();
+
+    for (int i = 0; i < PerfEventCount; i++) {
+        if (supportedEvents & PERF_EVENT_BIT(i)) {
+            WriteMSR(EventSelectMSR(i), 0);
+            WriteMSR(CounterMSR(i), 0);
+        }
+    }
+
+    // Version 2 onwards have to enable the counters globally as well
+    if (!pmu.isAMD && pmu.version >= 2) {
+        WriteMSR(MSR_INTEL_PERF_GLOBAL_CTRL, ReadMSR(MSR_INTEL_PERF_GLOBAL_CTRL) | ((1ULL << pmu.counters) - 1));
+    }
+}
+
+// Program the counters of the executing CPU for state
+static void Load(CPU* cpu, PerfCounterState* state) {
+    for (int i = 0; i < PerfEventCount; i++) {
+        if (state->events & PERF_EVENT_BIT(i)) {
+            WriteMSR(CounterMSR(i), restoreCounts ? state->counts[i] : 0);
+            WriteMSR(EventSelectMSR(i), EventSelect(i));
+        }
+    }
+
+    cpu->perfEvents = state->events;
+}
+
+// Stop the counters of the executing CPU, adding their counts to state if it is not null.
+// The counters are cleared so they cannot be read by the next thread
+static void Unload(CPU* cpu, PerfCounterState* state) {
+    for (int i = 0; i < PerfEventCount; i++) {
+        if (cpu->perfEvents & PERF_EVENT_BIT(i)) {
+            WriteMSR(EventSelectMSR(i), 0);
+
+            uint64_t count = ReadMSR(CounterMSR(i)) & counterMask;
+            if (state) {
+                state->counts[i] = restoreCounts ? count : state->counts[i] + count;
+            }
+
+            WriteMSR(CounterMSR(i), 0);
+        }
+    }
+
+    cpu->perfEvents = 0;
+}
+
+void SwitchThreads(CPU* cpu, Thread* previous, Thread* next) {
+    if (cpu->perfEvents) {
+        Unload(cpu, (previous && previous->state != ThreadStateDying) ? previous->perfCounters : nullptr);
+    }
+
+    if (next->perfCounters && next->perfCounters->running) {
+        Load(cpu, next->perfCounters);
+    }
+}
+
+uint32_t Start(uint32_t events, lemon_perf_counters_t& info) {
+    Thread* thread = Thread::Current();
+
+    events &= supportedEvents;
+    if (!thread->perfCounters) {
+        thread->perfCounters = new PerfCounterState();
+    }
+
+    {
+        InterruptDisabler disableInterrupts;
+        CPU* cpu = GetCPULocal();
+
+        PerfCounterState* state = thread->perfCounters;
+        if (cpu->perfEvents) {
+            Unload(cpu, nullptr);
+        }
+
+        state->events = events;
+        for (uint64_t& count : state->counts) {
+            count = 0;
+        }
+
+        state->running = true;
+        Load(cpu, state);
+    }
+
+    info.events = events;
+    info.counterWidth = pmu.counterWidth;
+    for (int i = 0; i < PerfEventCount; i++) {
+        // Without restoring, rdpmc only gives the count since the thread was last switched in
+        info.rdpmcIndex[i] = (restoreCounts && (events & PERF_EVENT_BIT(i))) ? i : -1;
+    }
+
+    return events;
+}
+
+void Stop() {
+    Thread* thread = Thread::Current();
+    if (!thread->perfCounters) {
+        return;
+    }
+
+    InterruptDisabler disableInterrupts;
+    Unload(GetCPULocal(), thread->perfCounters);
+    thread->perfCounters->running = false;
+}
+
+void Read(uint64_t counts[PerfEventCount]) {
+    Thread* thread = Thread::Current();
+    PerfCounterState* state = thread->perfCounters;
+
+    for (int i = 0; i < PerfEventCount; i++) {
+        counts[i] = 0;
+    }
+
+    if (!state) {
+        return;
+    }
+
+    InterruptDisabler disableInterrupts;
+    CPU* cpu = GetCPULocal();
+    for (int i = 0; i < PerfEventCount; i++) {
+        if (!(state->events & PERF_EVENT_BIT(i))) {
+            continue;
+        }
+
+        counts[i] = state->counts[i];
+        if (state->running && (cpu->perfEvents & PERF_EVENT_BIT(i))) {
+            uint64_t live = ReadMSR(CounterMSR(i)) & counterMask;
+            counts[i] = restoreCounts ? live : counts[i] + live;
+        }
+    }
+}
+
+} // namespace PerfCounters
@@ -1,84 +1,416 @@
 #include <PhysicalAllocator.h>
 
+#include <ACPI.h>
 #include <CPU.h>
 #include <CString.h>
+#include <Compiler.h>
 #include <Lock.h>
 #include <Logging.h>
+#include <Math.h>
+#include <MM/Reclaim.h>
 #include <Paging.h>
 #include <Panic.h>
+#include <SMP.h>
 #include <Serial.h>
 
-namespace Memory {
-uint32_t physicalMemoryBitmap[PHYSALLOC_BITMAP_SIZE_DWORDS];
+// Physical memory is managed by a binary buddy allocator.
+//
+// Each order has a bitmap of free blocks, a set bit marks a free block that could not be merged with its buddy
+// so every free page belongs to exactly one free block. Free lists cannot be kept in the free pages themselves
+// as memory above 4GB is not mapped, so each order also has a summary bitmap with one bit for every
+// non-empty word of its free block bitmap to keep searches short.
+//
+// The first 32 blocks are never handed out (low memory is used by the SMP trampoline).
+//
+// Single pages are handed out from per-CPU caches which are refilled and drained
+// in batches, so allocatorLock is only taken once every PHYSALLOC_CPU_CACHE_BATCH pages.
+//
+// On NUMA systems the memory ranges of each node (from the SRAT) are searched separately so pages come from
+// the node of the allocating CPU, falling back to the nearest node with free memory. Pages freed on another
+// node go straight back to the global pool rather than into the per-CPU cache.
+//
+// Idle threads zero free pages into a pool (zeroedPool) so page faults and the kernel heap
+// can skip zeroing. Pages in the pool count as used and the pool gives them back under memory pressure.
+
+#define PHYSALLOC_MAX_BLOCKS (static_cast<uint64_t>(PHYSALLOC_BITMAP_SIZE_DWORDS) * 32)
+#define PHYSALLOC_RESERVED_BLOCKS 32
+
+#define PHYSALLOC_CPU_CACHE_BATCH_ORDER 5
+#define PHYSALLOC_CPU_CACHE_BATCH (1U << PHYSALLOC_CPU_CACHE_BATCH_ORDER)
+static_assert(PHYSALLOC_CPU_CACHE_BATCH <= CPU_PAGE_CACHE_SIZE / 2);
 
-uint64_t usedPhysicalBlocks = PHYSALLOC_BITMAP_SIZE_DWORDS * 32;
+namespace Memory {
+uint64_t usedPhysicalBlocks = PHYSALLOC_MAX_BLOCKS;
+int64_t memoryUsage[MemoryUsageCount];
 uint64_t maxPhysicalBlocks = 0;
 
-uint64_t nextChunk = 1;
+TicketLock allocatorLock;
 
-lock_t allocatorLock = 0;
+static constexpr uint64_t OrderBlockCount(unsigned order) {
+    return (PHYSALLOC_MAX_BLOCKS + (1ULL << order) - 1) >> order;
+}
 
-// Initialize the physical page allocator
-void InitializePhysicalAllocator(memory_info_t* mem_info) {
-    memset(physicalMemoryBitmap, 0xFFFFFFFF, PHYSALLOC_BITMAP_SIZE_DWORDS * sizeof(uint32_t));
+static constexpr uint64_t WordCount(uint64_t bits) { return (bits + 63) / 64; }
 
-    maxPhysicalBlocks = PHYSALLOC_BITMAP_SIZE_DWORDS * 32;
-    usedPhysicalBlocks = maxPhysicalBlocks;
+// Offsets of each order within freeBlockBitmap and freeBlockSummary
+struct OrderOffsets {
+    uint64_t bitmap[PHYSALLOC_MAX_ORDER + 2];
+    uint64_t summary[PHYSALLOC_MAX_ORDER + 2];
+
+    constexpr OrderOffsets() : bitmap(), summary() {
+        for (unsigned i = 0; i <= PHYSALLOC_MAX_ORDER; i++) {
+            bitmap[i + 1] = bitmap[i] + WordCount(OrderBlockCount(i));
+            summary[i + 1] = summary[i] + WordCount(WordCount(OrderBlockCount(i)));
+        }
+    }
+};
+
+static constexpr OrderOffsets offsets;
+
+uint64_t freeBlockBitmap[offsets.bitmap[PHYSALLOC_MAX_ORDER + 1]];
+uint64_t freeBlockSummary[offsets.summary[PHYSALLOC_MAX_ORDER + 1]];
+uint64_t freeBlockCount[PHYSALLOC_MAX_ORDER + 1];
+uint64_t summaryHint[PHYSALLOC_MAX_ORDER + 1]; // There are no free blocks before this summary word
+
+// Blocks of physical memory belonging to a NUMA node
+struct NodeRange {
+    uint64_t first; // First block index
+    uint64_t end;   // Block index after the last block
+    unsigned node;
+    uint64_t summaryHint[PHYSALLOC_MAX_ORDER + 1]; // There are no free blocks in the range before this summary word
+};
+
+// Only set up when there is more than one node
+static unsigned nodeCount = 1;
+static unsigned nodeRangeCount = 0;
+static NodeRange nodeRanges[NUMA_MAX_MEMORY_RANGES];
+static unsigned nodeFallback[NUMA_MAX_NODES][NUMA_MAX_NODES]; // Every node ordered by distance from each node
+
+// Gets the node containing block index, defaulting to node
+static unsigned NodeOfBlock(uint64_t index, unsigned node) {
+    for (unsigned i = 0; i < nodeRangeCount; i++) {
+        if (index >= nodeRanges[i].first && index < nodeRanges[i].end) {
+            return nodeRanges[i].node;
+        }
+    }
+
+    return node;
+}
+
+static ALWAYS_INLINE bool IsFreeBlock(unsigned order, uint64_t block) {
+    return freeBlockBitmap[offsets.bitmap[order] + (block >> 6)] & (1ULL << (block & 63));
 }
 
-// Sets a bit in the physical memory bitmap
-__attribute__((always_inline)) inline void SetBit(uint64_t bit) { physicalMemoryBitmap[bit >> 5] |= (1 << (bit & 31)); }
+static void AddFreeBlock(unsigned order, uint64_t block) {
+    uint64_t word = block >> 6;
+
+    freeBlockBitmap[offsets.bitmap[order] + word] |= (1ULL << (block & 63));
+    freeBlockSummary[offsets.summary[order] + (word >> 6)] |= (1ULL << (word & 63));
+    freeBlockCount[order]++;
+
+    if ((word >> 6) < summaryHint[order]) {
+        summaryHint[order] = (word >> 6);
+    }
 
-// Clears a bit in the physical memory bitmap
-__attribute__((always_inline)) inline void ClearBit(uint64_t bit) {
-    physicalMemoryBitmap[bit >> 5] &= (~(1 << (bit & 31)));
+    for (unsigned i = 0; i < nodeRangeCount; i++) {
+        if ((word >> 6) < nodeRanges[i].summaryHint[order]) {
+            nodeRanges[i].summaryHint[order] = (word >> 6);
+        }
+    }
 }
 
-// Tests a bit in the physical memory bitmap
-__attribute__((always_inline)) inline bool TestBit(uint64_t bit) {
-    return physicalMemoryBitmap[bit >> 5] & (1 << (bit & 31));
+static void RemoveFreeBlock(unsigned order, uint64_t block) {
+    uint64_t word = block >> 6;
+
+    uint64_t& bits = freeBlockBitmap[offsets.bitmap[order] + word];
+    bits &= ~(1ULL << (block & 63));
+    if (!bits) {
+        freeBlockSummary[offsets.summary[order] + (word >> 6)] &= ~(1ULL << (word & 63));
+    }
+
+    freeBlockCount[order]--;
 }
 
-// Finds the first free block in physical memory
-uint64_t GetFirstFreeMemoryBlock() {
-    if (nextChunk == 0) {
-        nextChunk = 1;
+// Returns the index of the lowest free block of order, -1 if there are none
+static int64_t FindFreeBlock(unsigned order) {
+    if (!freeBlockCount[order]) {
+        return -1;
+    }
+
+    uint64_t summaryWords = offsets.summary[order + 1] - offsets.summary[order];
+    for (uint64_t i = summaryHint[order]; i < summaryWords; i++) {
+        uint64_t summary = freeBlockSummary[offsets.summary[order] + i];
+        if (!summary) {
+            continue;
+        }
+
+        summaryHint[order] = i;
+
+        uint64_t word = (i << 6) + __builtin_ctzll(summary);
+        uint64_t bits = freeBlockBitmap[offsets.bitmap[order] + word];
+        assert(bits);
+
+        return static_cast<int64_t>((word << 6) + __builtin_ctzll(bits));
     }
 
-    for (uint32_t i = nextChunk; i < (maxPhysicalBlocks >> 5); i++) {
-        if (physicalMemoryBitmap[i] != 0xffffffff) // If all 32 bits at the index are used then ignore them
-            for (uint32_t j = 0; j < 32; j++) {    // Test each bit in the dword
-                if (!(physicalMemoryBitmap[i] & (1 << j))) {
-                    nextChunk = i;
+    assert(!"Physical allocator free block count is wrong!");
+    return -1;
+}
 
-#ifdef KERNEL_DEBUG
-                    uint64_t value = (i << 5) + j;
-                    assert(value > 0);
+// Returns the index of the lowest free block of order starting within range, -1 if there are none
+static int64_t FindFreeBlockInRange(unsigned order, NodeRange& range) {
+    uint64_t firstBlock = (range.first + (1ULL << order) - 1) >> order;
+    uint64_t endBlock = (range.end + (1ULL << order) - 1) >> order;
+    if (!freeBlockCount[order] || firstBlock >= endBlock) {
+        return -1;
+    }
 
-                    return value; // Make sure we don't return zero
-#else
-                    return (i << 5) + j;
-#endif
-                }
+    uint64_t firstWord = firstBlock >> 6;
+    uint64_t lastWord = (endBlock - 1) >> 6;
+    for (uint64_t i = MAX(range.summaryHint[order], firstWord >> 6); i <= (lastWord >> 6); i++) {
+        uint64_t summary = freeBlockSummary[offsets.summary[order] + i];
+        while (summary) {
+            uint64_t word = (i << 6) + __builtin_ctzll(summary);
+            summary &= summary - 1;
+
+            if (word < firstWord || word > lastWord) {
+                continue;
+            }
+
+            uint64_t bits = freeBlockBitmap[offsets.bitmap[order] + word];
+            if (word == firstWord) {
+                bits &= ~0ULL << (firstBlock & 63);
+            }
+            if (word == lastWord) {
+                bits &= ~0ULL >> (63 - ((endBlock - 1) & 63));
             }
+
+            if (bits) {
+                range.summaryHint[order] = i;
+                return static_cast<int64_t>((word << 6) + __builtin_ctzll(bits));
+            }
+        }
     }
 
-    for (uint32_t i = 1; i < (maxPhysicalBlocks >> 5); i++) { // Retry searching every chunk
-        if (physicalMemoryBitmap[i] != 0xffffffff)            // If all 32 bits at the index are used then ignore them
-            for (uint32_t j = 0; j < 32; j++) {               // Test each bit in the dword
-                if (!(physicalMemoryBitmap[i] & (1 << j))) {
-                    nextChunk = i;
+    range.summaryHint[order] = (lastWord >> 6) + 1;
+    return -1;
+}
 
-#ifdef KERNEL_DEBUG
-                    uint64_t value = (i << 5) + j;
-                    assert(value > 0);
+// Gets the order of the free block containing page, returns false if the page is in use
+static bool FindContainingBlock(uint64_t page, unsigned& order) {
+    for (unsigned i = 0; i <= PHYSALLOC_MAX_ORDER; i++) {
+        if (IsFreeBlock(i, page >> i)) {
+            order = i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Frees a block, merging it with its buddy for as long as the buddy is free
+static void InsertBlock(unsigned order, uint64_t block) {
+    while (order < PHYSALLOC_MAX_ORDER && IsFreeBlock(order, block ^ 1)) {
+        RemoveFreeBlock(order, block ^ 1);
+
+        block >>= 1;
+        order++;
+    }
+
+    AddFreeBlock(order, block);
+}
+
+// Takes a single free page out of the free block containing it, returns false if the page is already in use
+static bool ReservePage(uint64_t page) {
+    unsigned order;
+    if (!FindContainingBlock(page, order)) {
+        return false;
+    }
+
+    // Split the block, giving back the halves that do not contain the page
+    RemoveFreeBlock(order, page >> order);
+    while (order > 0) {
+        order--;
+        AddFreeBlock(order, (page >> order) ^ 1);
+    }
+
+    return true;
+}
+
+// Takes free block of blockOrder, returning the index of the first block of the 2^order blocks wanted
+static uint64_t TakeBlock(unsigned blockOrder, uint64_t block, unsigned order) {
+    RemoveFreeBlock(blockOrder, block);
+
+    // Split the block down to the size we want
+    while (blockOrder > order) {
+        blockOrder--;
+        block <<= 1;
+        AddFreeBlock(blockOrder, block + 1);
+    }
+
+    return block << order;
+}
+
+// Returns the index of the first block of a run of 2^order free blocks, 0 on failure
+static uint64_t AllocateBlocks(unsigned order) {
+    for (unsigned i = order; i <= PHYSALLOC_MAX_ORDER; i++) {
+        int64_t block = FindFreeBlock(i);
+        if (block >= 0) {
+            return TakeBlock(i, block, order);
+        }
+    }
+
+    return 0;
+}
+
+// AllocateBlocks limited to the memory of node
+static uint64_t AllocateBlocksOnNode(unsigned order, unsigned node) {
+    for (unsigned i = order; i <= PHYSALLOC_MAX_ORDER; i++) {
+        for (unsigned r = 0; r < nodeRangeCount; r++) {
+            if (nodeRanges[r].node != node) {
+                continue;
+            }
+
+            int64_t block = FindFreeBlockInRange(i, nodeRanges[r]);
+            if (block >= 0) {
+                return TakeBlock(i, block, order);
+            }
+        }
+    }
+
+    return 0;
+}
+
+// AllocateBlocks preferring the memory of node, then the nearest nodes
+static uint64_t AllocateBlocksNear(unsigned order, unsigned node) {
+    if (nodeCount <= 1) {
+        return AllocateBlocks(order);
+    }
+
+    for (unsigned i = 0; i < nodeCount; i++) {
+        if (uint64_t index = AllocateBlocksOnNode(order, nodeFallback[node][i])) {
+            return index;
+        }
+    }
+
+    // Memory not described by the SRAT
+    return AllocateBlocks(order);
+}
+
+static ALWAYS_INLINE bool IsManagedBlock(uint64_t index) {
+    return index >= PHYSALLOC_RESERVED_BLOCKS && index < maxPhysicalBlocks;
+}
+
+// Accessed without allocatorLock by the per-CPU caches
+static ALWAYS_INLINE void AddUsedBlocks(int64_t count) {
+    __atomic_add_fetch(&usedPhysicalBlocks, count, __ATOMIC_RELAXED);
+}
+
+// Fill the (empty) page cache of cpu from the global pool, pageCacheLock of cpu must be held
+static void RefillPageCache(CPU* cpu) {
+    ScopedTicketLock lock(allocatorLock);
 
-                    return value; // Make sure we don't return zero
-#else
-                    return (i << 5) + j;
+    // Try to take a whole block at once,
+    // pages are stored in reverse so they get used in ascending order
+    if (uint64_t index = AllocateBlocksNear(PHYSALLOC_CPU_CACHE_BATCH_ORDER, cpu->numaNode)) {
+        for (unsigned i = PHYSALLOC_CPU_CACHE_BATCH; i > 0; i--) {
+            cpu->pageCache[cpu->pageCacheCount++] = index + i - 1;
+        }
+        return;
+    }
+
+    // Memory is fragmented or almost full
+    while (cpu->pageCacheCount < PHYSALLOC_CPU_CACHE_BATCH) {
+        uint64_t index = AllocateBlocksNear(0, cpu->numaNode);
+        if (!index) {
+            break;
+        }
+
+        cpu->pageCache[cpu->pageCacheCount++] = index;
+    }
+}
+
+// Give a batch of pages in the (full) page cache of cpu back to the global pool, pageCacheLock of cpu must be held
+static void DrainPageCache(CPU* cpu) {
+    ScopedTicketLock lock(allocatorLock);
+
+    for (unsigned i = 0; i < PHYSALLOC_CPU_CACHE_BATCH; i++) {
+        uint64_t index = cpu->pageCache[--cpu->pageCacheCount];
+
+#ifdef KERNEL_DEBUG
+        unsigned order;
+        assert(!FindContainingBlock(index, order)); // Double free
 #endif
-                }
+
+        InsertBlock(0, index);
+    }
+}
+
+// Initialize the physical page allocator
+void InitializePhysicalAllocator(memory_info_t* mem_info) {
+    memset(freeBlockBitmap, 0, sizeof(freeBlockBitmap));
+    memset(freeBlockSummary, 0, sizeof(freeBlockSummary));
+    memset(freeBlockCount, 0, sizeof(freeBlockCount));
+    memset(summaryHint, 0, sizeof(summaryHint));
+
+    // Everything is in use until the memory map marks it as free
+    maxPhysicalBlocks = PHYSALLOC_MAX_BLOCKS;
+    usedPhysicalBlocks = maxPhysicalBlocks;
+
+    RegisterLockStatistics(&allocatorLock, "allocatorLock");
+}
+
+// Split physical memory into NUMA nodes, ACPI must be initialized
+void InitializeNUMA() {
+    if (ACPI::numaNodeCount <= 1) {
+        return;
+    }
+
+    ScopedTicketLock<true> lock(allocatorLock);
+
+    for (unsigned i = 0; i < ACPI::numaMemoryRangeCount; i++) {
+        const numa_memory_range_t& range = ACPI::numaMemoryRanges[i];
+
+        uint64_t first = range.base >> PHYSALLOC_BLOCK_SHIFT;
+        uint64_t end = MIN((range.base + range.length) >> PHYSALLOC_BLOCK_SHIFT, PHYSALLOC_MAX_BLOCKS);
+        if (first >= end) {
+            continue;
+        }
+
+        NodeRange& nodeRange = nodeRanges[nodeRangeCount++];
+        nodeRange.first = first;
+        nodeRange.end = end;
+        nodeRange.node = range.node;
+        for (unsigned order = 0; order <= PHYSALLOC_MAX_ORDER; order++) {
+            nodeRange.summaryHint[order] = (first >> order) >> 12;
+        }
+    }
+
+    // Sort the other nodes of each node by distance
+    for (unsigned node = 0; node < ACPI::numaNodeCount; node++) {
+        unsigned* fallback = nodeFallback[node];
+        for (unsigned i = 0; i < ACPI::numaNodeCount; i++) {
+            unsigned j = i;
+            while (j > 0 && ACPI::NUMADistance(node, fallback[j - 1]) > ACPI::NUMADistance(node, i)) {
+                fallback[j] = fallback[j - 1];
+                j--;
             }
+            fallback[j] = i;
+        }
+    }
+
+    nodeCount = ACPI::numaNodeCount;
+}
+
+// Finds the first free block in physical memory
+uint64_t GetFirstFreeMemoryBlock() {
+    ScopedTicketLock<true> lock(allocatorLock);
+
+    for (unsigned i = 0; i <= PHYSALLOC_MAX_ORDER; i++) {
+        int64_t block = FindFreeBlock(i);
+        if (block >= 0) {
+            return static_cast<uint64_t>(block) << i;
+        }
     }
 
     // The first block is always reserved
@@ -87,88 +419,258 @@ uint64_t GetFirstFreeMemoryBlock() {
 
 // Marks a region in physical memory as being used
 void MarkMemoryRegionUsed(uint64_t base, size_t size) {
-    for (uint32_t blocks = (size + (PHYSALLOC_BLOCK_SIZE - 1)) / PHYSALLOC_BLOCK_SIZE,
-                  align = base / PHYSALLOC_BLOCK_SIZE;
-         blocks > 0; blocks--, usedPhysicalBlocks++)
-        SetBit(align++);
+    ScopedTicketLock<true> lock(allocatorLock);
+
+    uint64_t index = base / PHYSALLOC_BLOCK_SIZE;
+    for (uint64_t blocks = (size + (PHYSALLOC_BLOCK_SIZE - 1)) / PHYSALLOC_BLOCK_SIZE; blocks > 0; blocks--, index++) {
+        if (IsManagedBlock(index) && ReservePage(index)) {
+            AddUsedBlocks(1);
+        }
+    }
 }
 
 // Marks a region in physical memory as being free
 void MarkMemoryRegionFree(uint64_t base, size_t size) {
-    for (uint32_t blocks = (size + (PHYSALLOC_BLOCK_SIZE - 1)) / PHYSALLOC_BLOCK_SIZE,
-                  align = base / PHYSALLOC_BLOCK_SIZE;
-         blocks > 0; blocks--, usedPhysicalBlocks--)
-        ClearBit(align++);
+    ScopedTicketLock<true> lock(allocatorLock);
+
+    uint64_t index = base / PHYSALLOC_BLOCK_SIZE;
+    for (uint64_t blocks = (size + (PHYSALLOC_BLOCK_SIZE - 1)) / PHYSALLOC_BLOCK_SIZE; blocks > 0; blocks--, index++) {
+        unsigned order;
+        if (IsManagedBlock(index) && !FindContainingBlock(index, order)) {
+            InsertBlock(0, index);
+            AddUsedBlocks(-1);
+        }
+    }
+}
+
+// Give every page cached by CPUs other than self back to the global pool, interrupts must be disabled
+static void StealPageCaches(CPU* self) {
+    for (unsigned i = 0; i < SMP::processorCount; i++) {
+        CPU* other = SMP::cpus[i];
+        if (other == self) {
+            continue;
+        }
+
+        ScopedTicketLock cacheLock(other->pageCacheLock);
+        if (!other->pageCacheCount) {
+            continue;
+        }
+
+        ScopedTicketLock lock(allocatorLock);
+        while (other->pageCacheCount) {
+            InsertBlock(0, other->pageCache[--other->pageCacheCount]);
+        }
+    }
+}
+
+// Refill the page cache of cpu if it is empty, returns true if it holds any pages.
+// Interrupts must be disabled
+static bool TryRefillPageCache(CPU* cpu) {
+    ScopedTicketLock cacheLock(cpu->pageCacheLock);
+    if (!cpu->pageCacheCount) {
+        RefillPageCache(cpu);
+    }
+
+    return cpu->pageCacheCount;
 }
 
 // Allocates a block of physical memory
 uint64_t AllocatePhysicalMemoryBlock() {
-    ScopedSpinLock<true> lock(allocatorLock);
+    InterruptDisabler disableInterrupts;
+
+    CPU* cpu = GetCPULocal();
+    cpu->pageCacheLock.Acquire();
+    if (__builtin_expect(!cpu->pageCacheCount, 0)) {
+        RefillPageCache(cpu);
+        bool refilled = cpu->pageCacheCount;
+        cpu->pageCacheLock.Release(); // Reclaiming frees pages into the cache
+
+        CheckMemoryPressure();
+
+        // If the caller had interrupts enabled it cannot be holding the kernel heap
+        // or any other interrupt disabling lock, so have caches give memory back ourselves
+        if (!refilled && disableInterrupts.InterruptsWereEnabled()) {
+            if (ReclaimMemory(RECLAIM_BATCH_SIZE, true)) {
+                refilled = TryRefillPageCache(cpu);
+            }
+
+            // Anything left has to be swapped out by the reclaim thread
+            for (unsigned i = 0; !refilled && i < RECLAIM_WAIT_ATTEMPTS && WaitForReclaim(); i++) {
+                cpu = GetCPULocal(); // May have moved whilst waiting
+                refilled = TryRefillPageCache(cpu);
+            }
+        }
+
+        // Other CPUs may still have pages cached
+        if (!refilled) {
+            StealPageCaches(cpu);
+        }
+
+        cpu->pageCacheLock.Acquire();
+        if (!cpu->pageCacheCount) {
+            RefillPageCache(cpu);
+        }
 
-    uint64_t index = GetFirstFreeMemoryBlock();
-    if (!index) {
-        asm("cli");
-        Log::Error("Out of memory!");
-        KernelPanic("Out of memory!");
-        for (;;)
-            ;
+        if (!cpu->pageCacheCount) {
+            Log::Error("Out of memory!");
+            KernelPanic("Out of memory!");
+            for (;;)
+                ;
+        }
     }
 
-    SetBit(index);
-    usedPhysicalBlocks++;
+    uint64_t index = cpu->pageCache[--cpu->pageCacheCount];
+    cpu->pageCacheLock.Release();
+    AddUsedBlocks(1);
 
     return index << PHYSALLOC_BLOCK_SHIFT;
 }
 
+// Allocates 2^order physically contiguous blocks
+uint64_t AllocatePhysicalMemoryBlocks(unsigned order) {
+    assert(order <= PHYSALLOC_MAX_ORDER);
+
+    uint64_t index;
+    {
+        ScopedTicketLock<true> lock(allocatorLock);
+
+        index = AllocateBlocksNear(order, GetCPULocal()->numaNode);
+        if (index) {
+            AddUsedBlocks(1LL << order);
+        }
+    }
+
+    CheckMemoryPressure();
+    return index << PHYSALLOC_BLOCK_SHIFT;
+}
+
 // Allocates a block of 2MB physical memory
-/*uint64_t AllocateLargePhysicalMemoryBlock() {
-    uint64_t index = GetFirstFreeMemoryBlock();
-    uint64_t blockCount = 0x200000
-    uint64_t counter = 0;
-    while(counter < blockCount){
-        if(bit_test(index)){
-            index++;
-            counter = 0;
-            continue;
+uint64_t AllocateLargePhysicalMemoryBlock() { return AllocatePhysicalMemoryBlocks(PHYSALLOC_LARGE_BLOCK_ORDER); }
+
+// Frees a block of physical memory
+void FreePhysicalMemoryBlock(uint64_t addr) {
+    uint64_t index = addr >> PHYSALLOC_BLOCK_SHIFT;
+    assert(index); // If memory < 4096 is getting freed we have a serious problem
+    assert(IsManagedBlock(index));
+
+    InterruptDisabler disableInterrupts;
+
+    CPU* cpu = GetCPULocal();
+    if (__builtin_expect(nodeCount > 1, 0) && NodeOfBlock(index, cpu->numaNode) != cpu->numaNode) {
+        // Keep memory of other nodes out of our cache
+        ScopedTicketLock lock(allocatorLock);
+        InsertBlock(0, index);
+        AddUsedBlocks(-1);
+        return;
+    }
+
+    ScopedTicketLock cacheLock(cpu->pageCacheLock);
+    if (__builtin_expect(cpu->pageCacheCount >= CPU_PAGE_CACHE_SIZE, 0)) {
+        DrainPageCache(cpu);
+    }
+
+    cpu->pageCache[cpu->pageCacheCount++] = index;
+    AddUsedBlocks(-1);
+}
+
+// Zeroed blocks, filled by idle threads
+static struct {
+    lock_t lock = 0;
+    bool enabled = false;
+
+    unsigned count = 0;
+    uint64_t blocks[PHYSALLOC_ZEROED_POOL_SIZE]; // Indexes of zeroed blocks
+} zeroedPool;
+
+class ZeroedPoolReclaimer final : public Reclaimer {
+public:
+    size_t Reclaim(size_t bytes) override {
+        InterruptDisabler disableInterrupts;
+        // Called from an allocation, the pool may be locked by this CPU
+        if (acquireTestLock(&zeroedPool.lock)) {
+            return 0;
         }
 
-        index++;
-        counter++;
+        size_t freed = 0;
+        while (freed < bytes && zeroedPool.count) {
+            FreePhysicalMemoryBlock(zeroedPool.blocks[--zeroedPool.count] << PHYSALLOC_BLOCK_SHIFT);
+            freed += PHYSALLOC_BLOCK_SIZE;
+        }
+
+        releaseLock(&zeroedPool.lock);
+        return freed;
     }
+};
 
-    if (index == 0)
+uint64_t AllocateZeroedPhysicalMemoryBlock() {
+    if (!__atomic_load_n(&zeroedPool.count, __ATOMIC_RELAXED)) {
         return 0;
+    }
 
-    uint64_t addr = index * PHYSALLOC_BLOCK_SIZE;
+    ScopedSpinLock<true> lockPool(zeroedPool.lock);
+    if (!zeroedPool.count) {
+        return 0;
+    }
 
-    while(blockCount--)
-        bit_set(index++);
-    usedPhysicalBlocks += counter;
+    return zeroedPool.blocks[--zeroedPool.count] << PHYSALLOC_BLOCK_SHIFT;
+}
 
-    return addr;
-}*/
+void InitializeZeroedPool() {
+    RegisterReclaimer(new ZeroedPoolReclaimer());
+    __atomic_store_n(&zeroedPool.enabled, true, __ATOMIC_RELEASE);
+}
 
-// Frees a block of physical memory
-void FreePhysicalMemoryBlock(uint64_t addr) {
-    uint64_t index = addr >> PHYSALLOC_BLOCK_SHIFT;
-    assert(index); // If memory < 4096 is getting freed we have a serious problem
+bool ZeroFreeBlocks(void* window) {
+    if (!__atomic_load_n(&zeroedPool.enabled, __ATOMIC_ACQUIRE) || IsMemoryLow()) {
+        return false; // Leave free memory for allocations that need it
+    }
+
+    unsigned count = PHYSALLOC_ZEROED_POOL_SIZE - __atomic_load_n(&zeroedPool.count, __ATOMIC_RELAXED);
+    if (!count) {
+        return false;
+    } else if (count > PHYSALLOC_ZERO_BATCH) {
+        count = PHYSALLOC_ZERO_BATCH;
+    }
 
-    uint64_t chunk = index >> 5;
+    uint64_t blocks[PHYSALLOC_ZERO_BATCH];
+    for (unsigned i = 0; i < count; i++) {
+        blocks[i] = AllocatePhysicalMemoryBlock();
+        KernelMapVirtualMemory4K(blocks[i], reinterpret_cast<uintptr_t>(window) + i * PHYSALLOC_BLOCK_SIZE, 1);
+    }
 
-    physicalMemoryBitmap[chunk] = physicalMemoryBitmap[chunk] & (~(1U << (index & 31)));
-    usedPhysicalBlocks--;
+    // Interrupts are enabled so a thread that wakes up can preempt us
+    memset(window, 0, count * PHYSALLOC_BLOCK_SIZE);
 
-    if (chunk < nextChunk) {
-        nextChunk = chunk;
+    ScopedSpinLock<true> lockPool(zeroedPool.lock);
+    for (unsigned i = 0; i < count; i++) {
+        if (zeroedPool.count < PHYSALLOC_ZEROED_POOL_SIZE) {
+            zeroedPool.blocks[zeroedPool.count++] = blocks[i] >> PHYSALLOC_BLOCK_SHIFT;
+        } else {
+            FreePhysicalMemoryBlock(blocks[i]); // Another CPU filled the pool first
+        }
     }
+
+    return true;
 }
 
-// Frees a block of physical memory
-void FreeLargePhysicalMemoryBlock(uint64_t addr) {
-    uint64_t index = addr / PHYSALLOC_BLOCK_SIZE;
-    uint64_t blockCount = 0x200000 /* 2MB */ / PHYSALLOC_BLOCK_SIZE;
-    usedPhysicalBlocks -= blockCount;
-    while (blockCount--)
-        ClearBit(index++);
-}
-} // namespace Memory
\ No newline at end of file
+// Frees 2^order physically contiguous blocks
+void FreePhysicalMemoryBlocks(uint64_t addr, unsigned order) {
+    uint64_t index = addr >> PHYSALLOC_BLOCK_SHIFT;
+    assert(order <= PHYSALLOC_MAX_ORDER);
+    assert(!(index & ((1ULL << order) - 1))); // Blocks are aligned to their size
+    assert(IsManagedBlock(index));
+
+    ScopedTicketLock<true> lock(allocatorLock);
+
+#ifdef KERNEL_DEBUG
+    unsigned containing;
+    assert(!FindContainingBlock(index, containing)); // Double free
+#endif
+
+    InsertBlock(order, index >> order);
+    AddUsedBlocks(-(1LL << order));
+}
+
+// Frees a block of 2MB physical memory
+void FreeLargePhysicalMemoryBlock(uint64_t addr) { FreePhysicalMemoryBlocks(addr, PHYSALLOC_LARGE_BLOCK_ORDER); }
+} // namespace Memory
@@ -2,12 +2,14 @@
 
 #include <ACPI.h>
 #include <APIC.h>
+#include <BootTrace.h>
 #include <CPU.h>
 #include <Device.h>
 #include <HAL.h>
 #include <IDT.h>
 #include <Logging.h>
 #include <Memory.h>
+#include <PerfCounters.h>
 #include <TSS.h>
 #include <Timer.h>
 
@@ -42,7 +44,6 @@ tss_t tss1 __attribute__((aligned(16)));
 void SMPEntry(uint16_t id) {
     CPU* cpu = cpus[id];
     cpu->currentThread = nullptr;
-    cpu->runQueueLock = 0;
     SetCPULocal(cpu);
 
     cpu->gdt = Memory::KernelAllocate4KPages(
@@ -57,23 +58,34 @@ void SMPEntry(uint16_t id) {
 
     TSS::InitializeTSS(&cpu->tss, cpu->gdt);
     APIC::Local::Enable();
+    Memory::InitializeTLB();
+    Memory::InitializePAT();
 
-    cpu->runQueue = new FastList<Thread*>();
+    for (int i = 0; i < SchedulingClassCount; i++) {
+        cpu->runQueues[i] = new FastList<Thread*>();
+    }
+
+    cpu->cacheID = CPUIDLastLevelCacheID();
+    cpu->numaNode = ACPI::NUMANodeOfProcessor(cpu->id);
+    PerfCounters::InitializeCPU();
 
+    SetCR0TS(); // FPU state is loaded lazily, see Scheduler::DeviceNotAvailableHandler
+
+    BootTrace::Mark("SMP", "processor started");
     doneInit = true;
 
     syscall_init();
 
     asm("sti");
-    
+
+    // Wait to be given work by the scheduler
     for (;;)
-        asm volatile("pause");
+        asm volatile("hlt");
 }
 
 void InitializeCPU(uint16_t id) {
     CPU* cpu = new CPU;
     cpu->id = id;
-    cpu->runQueueLock = 0;
     cpus[id] = cpu;
 
     *smpMagic = 0;                                          // Set magic to 0
@@ -120,14 +132,18 @@ void InitializeCPU0Context() {
     cpus[0]->gdt = (void*)GDT64Pointer64.base;
     cpus[0]->gdtPtr = GDT64Pointer64;
     cpus[0]->currentThread = nullptr;
-    cpus[0]->runQueueLock = 0;
     SetCPULocal(cpus[0]);
 }
 
 void Initialize() {
     assert(didInitializeCPU0);
     // Initialize rest of CPU 0
-    cpus[0]->runQueue = new FastList<Thread*>();
+    for (int i = 0; i < SchedulingClassCount; i++) {
+        cpus[0]->runQueues[i] = new FastList<Thread*>();
+    }
+
+    cpus[0]->cacheID = CPUIDLastLevelCacheID();
+    cpus[0]->numaNode = ACPI::NUMANodeOfProcessor(cpus[0]->id);
 
     if (HAL::disableSMP) {
         TSS::InitializeTSS(&cpus[0]->tss, cpus[0]->gdt);
@@ -138,6 +154,10 @@ void Initialize() {
 
     processorCount = ACPI::processorCount;
 
+    // APs use their Local APIC timer for scheduling ticks
+    APIC::Local::CalibrateTimer();
+    BootTrace::Mark("SMP", "local APIC timer calibrated");
+
     memcpy((void*)SMP_TRAMPOLINE_ENTRY, &_smp_trampoline_entry16, ((uint64_t)&_smp_trampoline_end) - (uint64_t)(&_smp_trampoline_entry16));
 
     for (int i = 0; i < processorCount; i++) {
@@ -8,6 +8,7 @@
 #include <Debug.h>
 #include <ELF.h>
 #include <Fs/Initrd.h>
+#include <HAL.h>
 #include <IDT.h>
 #include <List.h>
 #include <Lock.h>
@@ -15,7 +16,10 @@
 #include <MM/KMalloc.h>
 #include <Paging.h>
 #include <Panic.h>
+#include <PerfCounters.h>
 #include <PhysicalAllocator.h>
+#include <RCU.h>
+#include <Profiler.h>
 #include <SMP.h>
 #include <Serial.h>
 #include <String.h>
@@ -25,50 +29,321 @@
 extern "C" void IdleProcess();
 
 void KernelProcess();
+void Reaper();
 
 namespace Scheduler {
 int schedulerLock = 0;
 bool schedulerReady = false;
 
-lock_t processesLock = 0;
+// Protects processes and processTable,
+// they are read far more often than processes are created or destroyed
+ReadWriteLock processesLock;
 List<FancyRefPtr<Process>>* processes;
+HashMap<pid_t, FancyRefPtr<Process>>* processTable; // Indexed by PID
 
 lock_t destroyedProcessesLock = 0;
 List<FancyRefPtr<Process>>* destroyedProcesses;
+Semaphore reaperSemaphore = Semaphore(0); // Signalled when a process is queued for destruction
+ReaperStatistics reaperStatistics;
 
 unsigned processTableSize = 512;
 std::atomic<pid_t> nextPID = 1;
 
-// When the run queue was last balanced
-uint64_t nextBalanceDue = 0;
+// Lower class threads are given a timeslice after being passed over this many times
+// so that they cannot be starved by interactive threads
+#define SCHEDULER_STARVATION_LIMIT 16
+
+// Threads are kept on the CPU they last ran on (or one sharing its last level cache)
+// unless it has this many more threads queued than the least busy CPU
+#define SCHEDULER_AFFINITY_SLACK 2
+
+// How often (in ticks) idle CPUs are woken to look for work to steal
+#define SCHEDULER_IDLE_BALANCE_TICKS 16
+
+// PIDs are allocated sequentially so the next process is usually found within a few PIDs,
+// GetNextProcessPID() probes the process table this many times before scanning the process list
+#define SCHEDULER_NEXT_PID_PROBES 8
 
 void Schedule(void*, RegisterContext* r);
 
+uint32_t TimeSliceForClass(int schedClass) {
+    switch (schedClass) {
+    case SchedulingClassRealtime:
+        return THREAD_TIMESLICE_REALTIME;
+    case SchedulingClassBatch:
+        return THREAD_TIMESLICE_BATCH;
+    default:
+        return THREAD_TIMESLICE_DEFAULT;
+    }
+}
+
+// Must be called with the run queue lock of the destination CPU held
+static inline void RecordMigration(Thread* thread, CPU* from, CPU* to) {
+    thread->migrations++;
+    __atomic_add_fetch(&thread->parent->migrations, 1, __ATOMIC_RELAXED);
+
+    to->migrations++;
+    if (from->cacheID != to->cacheID) {
+        to->cacheMigrations++;
+    }
+
+    if (from->numaNode != to->numaNode) {
+        to->nodeMigrations++;
+    }
+}
+
+uint64_t AllowedCPUs(Thread* thread) {
+    uint64_t mask = thread->affinity ? thread->affinity : ~HAL::isolatedCPUs;
+    if (!(mask & SMP::OnlineCPUMask())) {
+        return ~0ULL; // Never leave a thread with nowhere to run
+    }
+
+    return mask;
+}
+
+// Find the allowed CPU with the shortest run queue
+static CPU* ShortestAllowedQueue(Thread* thread) {
+    CPU* shortest = nullptr;
+    unsigned shortestLength = 0;
+    for (unsigned i = 0; i < SMP::processorCount; i++) {
+        CPU* other = SMP::cpus[i];
+        if (!CPUAllowed(thread, other)) {
+            continue;
+        }
+
+        unsigned length = RunQueueLength(other);
+        if (!shortest || length < shortestLength) {
+            shortest = other;
+            shortestLength = length;
+        }
+    }
+
+    assert(shortest);
+    return shortest;
+}
+
+// Move a thread queued on (but not running on) \a cpu to a CPU it is allowed on.
+// \a cpu's run queue lock must be held, gives up if the destination is busy.
+static bool MigrateDisallowedThread(CPU* cpu, Thread* thread) {
+    CPU* destination = ShortestAllowedQueue(thread);
+    if (destination == cpu || !destination->runQueueLock.TryAcquire()) {
+        return false;
+    }
+
+    // The thread may still have its FPU state loaded on this CPU,
+    // write it back before the destination can run the thread
+    if (__atomic_load_n(&cpu->fpuOwner, __ATOMIC_RELAXED) == thread) {
+        asm volatile("fxsave64 (%0)" ::"r"((uintptr_t)thread->fxState) : "memory");
+        __atomic_store_n(&cpu->fpuOwner, nullptr, __ATOMIC_RELAXED);
+        SetCR0TS();
+    }
+
+    cpu->runQueues[thread->schedulingClass]->remove(thread);
+
+    destination->runQueues[thread->schedulingClass]->add_back(thread);
+    thread->cpu = destination->id;
+    RecordMigration(thread, cpu, destination);
+
+    destination->runQueueLock.Release();
+
+    WakeIdleCPU(destination);
+    return true;
+}
+
 void InsertNewThreadIntoQueue(Thread* thread) {
-    CPU* cpu = SMP::cpus[0];
-    for (unsigned i = 1; i < SMP::processorCount; i++) {
-        // Pick the CPU with the most idle time since run queue balance
-        if (SMP::cpus[i]->idleProcess->GetMainThread()->ticksSinceBalance >
-            cpu->idleProcess->GetMainThread()->ticksSinceBalance) {
-            cpu = SMP::cpus[i];
+    // Prefer the CPU the thread last ran on. New threads start near their creator
+    // as they will most likely be working on the same data.
+    CPU* preferred = (thread->cpu >= 0) ? SMP::cpus[thread->cpu] : GetCPULocal();
+    if (!CPUAllowed(thread, preferred)) {
+        preferred = ShortestAllowedQueue(thread);
+    }
+    unsigned preferredLength = RunQueueLength(preferred);
+
+    CPU* shortest = preferred;
+    unsigned shortestLength = preferredLength;
+
+    CPU* shortestShared = preferred; // Shortest run queue sharing a cache with the preferred CPU
+    unsigned shortestSharedLength = preferredLength;
+
+    CPU* shortestNode = preferred; // Shortest run queue on the NUMA node of the preferred CPU
+    unsigned shortestNodeLength = preferredLength;
+    for (unsigned i = 0; i < SMP::processorCount; i++) {
+        CPU* other = SMP::cpus[i];
+        if (!CPUAllowed(thread, other)) {
+            continue;
         }
 
-        // Pick a CPU with an empty run queue no matter what
-        if (!cpu->runQueue->get_length()) {
-            break;
+        unsigned length = RunQueueLength(other);
+        if (length < shortestLength) {
+            shortest = other;
+            shortestLength = length;
         }
+
+        if (other->cacheID == preferred->cacheID && length < shortestSharedLength) {
+            shortestShared = other;
+            shortestSharedLength = length;
+        }
+
+        if (other->numaNode == preferred->numaNode && length < shortestNodeLength) {
+            shortestNode = other;
+            shortestNodeLength = length;
+        }
+    }
+
+    // Only give up the warm cache if the preferred CPU is clearly overloaded,
+    // idle CPUs will steal work from busy CPUs if this turns out to be a bad choice.
+    // Leaving the NUMA node also leaves the memory the thread has been given behind.
+    CPU* cpu;
+    if (preferredLength <= shortestLength + SCHEDULER_AFFINITY_SLACK) {
+        cpu = preferred;
+    } else if (shortestSharedLength <= shortestLength + SCHEDULER_AFFINITY_SLACK) {
+        cpu = shortestShared;
+    } else if (shortestNodeLength <= shortestLength + SCHEDULER_AFFINITY_SLACK) {
+        cpu = shortestNode;
+    } else {
+        cpu = shortest;
     }
 
     asm("sti");
-    acquireLockIntDisable(&cpu->runQueueLock);
-    cpu->runQueue->add_back(thread);
+    cpu->runQueueLock.AcquireIntDisable();
+    cpu->runQueues[thread->schedulingClass]->add_back(thread);
+    if (thread->cpu >= 0 && thread->cpu != static_cast<int>(cpu->id)) {
+        RecordMigration(thread, SMP::cpus[thread->cpu], cpu);
+    }
     thread->cpu = cpu->id;
-    releaseLock(&cpu->runQueueLock);
+    thread->runnableSince = Timer::UsecondsSinceBoot();
+    cpu->runQueueLock.Release();
     asm("sti");
+
+    WakeIdleCPU(cpu);
+}
+
+void WakeIdleCPU(CPU* cpu) {
+    if (!schedulerReady) {
+        return;
+    }
+
+    // Pairs with the store in EnterIdle,
+    // either we see the CPU is idle or it sees our runnable thread before halting
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&cpu->idle, __ATOMIC_RELAXED) && cpu != GetCPULocal()) {
+        APIC::Local::SendIPI(cpu->id, ICR_DSH_DEST, ICR_MESSAGE_TYPE_FIXED, IPI_SCHEDULE);
+    }
+}
+
+void SetSchedulingClass(Thread* thread, int schedClass) {
+    assert(schedClass >= 0 && schedClass < SchedulingClassCount);
+
+    InterruptDisabler disableInterrupts;
+
+    // The thread may get stolen by another CPU whilst we are acquiring the lock,
+    // so make sure it is still on the same CPU once we hold it
+    for (;;) {
+        int cpuID = __atomic_load_n(&thread->cpu, __ATOMIC_ACQUIRE);
+        if (cpuID < 0) {
+            // Not in a run queue
+            thread->schedulingClass = schedClass;
+            thread->timeSliceDefault = TimeSliceForClass(schedClass);
+            return;
+        }
+
+        CPU* cpu = SMP::cpus[cpuID];
+        cpu->runQueueLock.Acquire();
+        if (thread->cpu != cpuID) {
+            cpu->runQueueLock.Release();
+            continue;
+        }
+
+        if (thread->schedulingClass != schedClass) {
+            cpu->runQueues[thread->schedulingClass]->remove(thread);
+            cpu->runQueues[schedClass]->add_back(thread);
+        }
+
+        thread->schedulingClass = schedClass;
+        thread->timeSliceDefault = TimeSliceForClass(schedClass);
+        if (thread->timeSlice > thread->timeSliceDefault) {
+            thread->timeSlice = thread->timeSliceDefault;
+        }
+
+        cpu->runQueueLock.Release();
+        return;
+    }
+}
+
+void SetAffinity(Thread* thread, uint64_t mask) {
+    InterruptDisabler disableInterrupts;
+
+    // The thread may get stolen by another CPU whilst we are acquiring the lock,
+    // so make sure it is still on the same CPU once we hold it
+    for (;;) {
+        int cpuID = __atomic_load_n(&thread->cpu, __ATOMIC_ACQUIRE);
+        if (cpuID < 0) {
+            // Not in a run queue
+            thread->affinity = mask;
+            return;
+        }
+
+        CPU* cpu = SMP::cpus[cpuID];
+        cpu->runQueueLock.Acquire();
+        if (thread->cpu != cpuID) {
+            cpu->runQueueLock.Release();
+            continue;
+        }
+
+        thread->affinity = mask;
+
+        // A running thread is moved by the first Schedule() after it is switched out
+        if (!CPUAllowed(thread, cpu) && thread != cpu->currentThread) {
+            MigrateDisallowedThread(cpu, thread);
+        }
+
+        cpu->runQueueLock.Release();
+        return;
+    }
+}
+
+// #NM, raised when a thread uses the FPU/SSE whilst CR0.TS is set
+void DeviceNotAvailableHandler(void*, RegisterContext*) {
+    CPU* cpu = GetCPULocal();
+    Thread* thread = cpu->currentThread;
+
+    // A process exiting on another CPU changes the owner under the run queue lock before freeing it
+    ScopedTicketLock<true> lock(cpu->runQueueLock);
+    ClearCR0TS();
+
+    Thread* owner = __atomic_load_n(&cpu->fpuOwner, __ATOMIC_RELAXED);
+    if (owner == thread) {
+        return;
+    }
+
+    if (owner) {
+        asm volatile("fxsave64 (%0)" ::"r"((uintptr_t)owner->fxState) : "memory");
+    }
+
+    asm volatile("fxrstor64 (%0)" ::"r"((uintptr_t)thread->fxState) : "memory");
+    __atomic_store_n(&cpu->fpuOwner, thread, __ATOMIC_RELAXED);
+    cpu->fpuRestores++;
+}
+
+// Write back the FPU state if the owner is not the current thread.
+// Must be called with the run queue lock held as once the owner is back in the queue
+// another CPU may steal and run it, or its process may exit and free it.
+void ReleaseFPU(CPU* cpu) {
+    Thread* owner = __atomic_load_n(&cpu->fpuOwner, __ATOMIC_RELAXED);
+    if (owner && owner != cpu->currentThread) {
+        // No point saving state that will never be used again
+        if (owner->state != ThreadStateDying) {
+            asm volatile("fxsave64 (%0)" ::"r"((uintptr_t)owner->fxState) : "memory");
+        }
+
+        __atomic_store_n(&cpu->fpuOwner, nullptr, __ATOMIC_RELAXED);
+        SetCR0TS();
+    }
 }
 
 void Initialize() {
     processes = new List<FancyRefPtr<Process>>();
+    processTable = new HashMap<pid_t, FancyRefPtr<Process>>(processTableSize);
     destroyedProcesses = new List<FancyRefPtr<Process>>();
 
     CPU* cpu = GetCPULocal();
@@ -80,15 +355,25 @@ void Initialize() {
     }
 
     for (unsigned i = 0; i < SMP::processorCount; i++) {
-        SMP::cpus[i]->runQueue->clear();
-        releaseLock(&SMP::cpus[i]->runQueueLock);
+        for (int j = 0; j < SchedulingClassCount; j++) {
+            SMP::cpus[i]->runQueues[j]->clear();
+        }
+        RegisterLockStatistics(&SMP::cpus[i]->runQueueLock, "runQueueLock");
     }
+    processesLock.RegisterStatistics("processesLock");
 
     IDT::RegisterInterruptHandler(IPI_SCHEDULE, Schedule);
+    IDT::RegisterInterruptHandler(7 /* #NM */, DeviceNotAvailableHandler);
+    SetCR0TS(); // No thread owns the FPU yet, APs set TS on startup
 
     auto kproc = Process::CreateKernelProcess((void*)KernelProcess, "Kernel", nullptr);
     kproc->Start();
 
+    auto reaper = Process::CreateKernelProcess((void*)Reaper, "Reaper", nullptr);
+    reaper->Start();
+
+    RCU::Initialize();
+
     cpu->currentThread = nullptr;
     schedulerReady = true;
     asm("sti; int $0xfd;"); // IPI_SCHEDULE
@@ -96,46 +381,99 @@ void Initialize() {
 }
 
 void RegisterProcess(FancyRefPtr<Process> proc) {
-    ScopedSpinLock acq(processesLock);
+    processesLock.AcquireWrite();
+
+    processTable->insert(proc->PID(), proc);
     processes->add_back(std::move(proc));
+
+    processesLock.ReleaseWrite();
 }
 
 void MarkProcessForDestruction(Process* proc) {
-    ScopedSpinLock lockProcesses(processesLock);
-    ScopedSpinLock lockDestroyedProcesses(destroyedProcessesLock);
+    FancyRefPtr<Process> destroyed = nullptr;
 
+    processesLock.AcquireWrite();
     for (auto it = processes->begin(); it != processes->end(); it++) {
         if (it->get() == proc) {
-            destroyedProcesses->add_back(*it);
+            processTable->remove(proc->PID());
+
+            destroyed = *it;
             processes->remove(it);
-            return;
+            break;
+        }
+    }
+    processesLock.ReleaseWrite();
+
+    assert(destroyed.get() && "Failed to mark process for destruction!");
+
+    {
+        ScopedSpinLock lockDestroyedProcesses(destroyedProcessesLock);
+        destroyedProcesses->add_back(std::move(destroyed));
+
+        reaperStatistics.queued++;
+        reaperStatistics.backlog = destroyedProcesses->get_length();
+        if (reaperStatistics.backlog > reaperStatistics.maxBacklog) {
+            reaperStatistics.maxBacklog = reaperStatistics.backlog;
         }
     }
 
-    assert(!"Failed to mark process for destruction!");
+    reaperSemaphore.Signal();
 }
 
+const ReaperStatistics& GetReaperStatistics() { return reaperStatistics; }
+
 pid_t GetNextPID() { return nextPID++; }
 
 FancyRefPtr<Process> FindProcessByPID(pid_t pid) {
-    ScopedSpinLock lockProcesses(processesLock);
-    for (auto& proc : *processes) {
-        if (proc->PID() == pid)
-            return proc;
-    }
+    FancyRefPtr<Process> proc = nullptr;
+
+    processesLock.AcquireRead();
+    processTable->get_unlocked(pid, proc);
+    processesLock.ReleaseRead();
 
-    return nullptr;
+    return proc;
 }
 
 pid_t GetNextProcessPID(pid_t pid) {
-    ScopedSpinLock lockProcesses(processesLock);
+    processesLock.AcquireRead();
+
+    FancyRefPtr<Process> proc;
+    for (pid_t next = pid + 1; next <= pid + SCHEDULER_NEXT_PID_PROBES && next < nextPID; next++) {
+        if (processTable->get_unlocked(next, proc)) {
+            processesLock.ReleaseRead();
+            return next;
+        }
+    }
+
+    // Processes are not necessarily registered in PID order,
+    // look for the lowest PID greater than pid
+    pid_t next = 0;
     for (auto it = processes->begin(); it != processes->end(); it++) {
-        if (it->get()->PID() > pid) { // Found process with PID greater than pid
-            return it->get()->PID();
+        pid_t other = it->get()->PID();
+        if (other > pid && (!next || other < next)) {
+            next = other;
         }
     }
 
-    return 0; // Could not find process, return as if end of list
+    processesLock.ReleaseRead();
+    return next; // 0 if we could not find a process, return as if end of list
+}
+
+FancyRefPtr<Process> TryFindNextProcess(pid_t pid) {
+    if (processesLock.TryAcquireRead()) {
+        return nullptr;
+    }
+
+    FancyRefPtr<Process> next = nullptr;
+    for (auto it = processes->begin(); it != processes->end(); it++) {
+        pid_t other = it->get()->PID();
+        if (other > pid && (!next.get() || other < next->PID())) {
+            next = *it;
+        }
+    }
+
+    processesLock.ReleaseRead();
+    return next;
 }
 
 void Yield() {
@@ -144,6 +482,7 @@ void Yield() {
 
     if (cpu->currentThread) {
         cpu->currentThread->timeSlice = 0;
+        cpu->currentThread->yielded = true;
     }
     asm("sti; int $0xFD"); // Send schedule IPI to self
 }
@@ -152,120 +491,305 @@ void Tick(RegisterContext* r) {
     if (!schedulerReady)
         return;
 
-    APIC::Local::SendIPI(0, ICR_DSH_OTHER, ICR_MESSAGE_TYPE_FIXED, IPI_SCHEDULE);
+    CPU* cpu = GetCPULocal();
 
-    Schedule(nullptr, r);
-}
+    // Check if any CPU has threads that could be stolen
+    bool balance = false;
+    if (!(Timer::GetTicks() % SCHEDULER_IDLE_BALANCE_TICKS)) {
+        for (unsigned i = 0; i < SMP::processorCount && !balance; i++) {
+            balance = RunQueueLength(SMP::cpus[i]) > 1;
+        }
+    }
 
-void BalanceRunQueues() {
-    assert(processesLock);
-    assert(!CheckInterrupts());
+    for (unsigned i = 0; i < SMP::processorCount; i++) {
+        CPU* other = SMP::cpus[i];
+        if (other == cpu) {
+            continue;
+        }
 
-    if(Timer::UsecondsSinceBoot() - nextBalanceDue > 1000000) {
-        Log::Warning("Exceeded run balance due time by %d", Timer::UsecondsSinceBoot() - nextBalanceDue);
+        if (__atomic_load_n(&other->idle, __ATOMIC_RELAXED)) {
+            // Idle CPUs are left halted, occasionally wake them
+            // to steal work if another CPU has threads queued up
+            if (balance) {
+                WakeIdleCPU(other);
+            }
+        } else if (!APIC::Local::TimerAvailable()) {
+            // Busy CPUs tick using their own Local APIC timer when available
+            APIC::Local::SendIPI(other->id, ICR_DSH_DEST, ICR_MESSAGE_TYPE_FIXED, IPI_SCHEDULE);
+        }
     }
 
-    long avgUtilization[SMP::processorCount];
-    long leastActive = 0;
+    Schedule(nullptr, r);
+}
 
-    FastList<Thread*> threadsToDistribute;
+Thread* StealThread(CPU* cpu) {
+    assert(!CheckInterrupts());
 
-    // Lock ALL run queues
+    // Look for the CPU with the most work queued,
+    // the length is read without the lock as it is only a hint.
+    // CPUs sharing our last level cache are preferred as the stolen thread keeps its cache,
+    // then CPUs on our NUMA node as the thread's memory stays local.
+    CPU* victim = nullptr;
+    unsigned victimLength = 1; // Leave CPUs with only one thread alone
+    CPU* remoteVictim = nullptr;
+    unsigned remoteVictimLength = 1 + SCHEDULER_AFFINITY_SLACK; // Losing the cache needs more imbalance
+    CPU* nodeVictim = nullptr;
+    unsigned nodeVictimLength = 1 + 2 * SCHEDULER_AFFINITY_SLACK; // Leaving the node needs even more
     for (unsigned i = 0; i < SMP::processorCount; i++) {
-        CPU* cpu = SMP::cpus[i];
-        if(cpu != GetCPULocal()) {
-            acquireLock(&cpu->runQueueLock);
+        CPU* other = SMP::cpus[i];
+        if (other == cpu) {
+            continue;
         }
 
-        if (!cpu->currentThread || cpu->currentThread == cpu->idleThread) {
-            avgUtilization[i] = 0;
-        } else {
-            // TODO: Move the thread even if the CPU was using it
-            // TODO: Consider leaving high utilization processes on the CPU
-            // as they have likely populated the CPU cache
-            if (cpu->currentThread->ticksGivenSinceBalance) {
-                avgUtilization[i] =
-                    cpu->currentThread->ticksSinceBalance * 100 / cpu->currentThread->ticksGivenSinceBalance;
-            } else {
-                avgUtilization[i] = 0;
+        unsigned length = RunQueueLength(other);
+        if (other->cacheID == cpu->cacheID) {
+            if (length > victimLength) {
+                victim = other;
+                victimLength = length;
+            }
+        } else if (other->numaNode == cpu->numaNode) {
+            if (length > remoteVictimLength) {
+                remoteVictim = other;
+                remoteVictimLength = length;
             }
+        } else if (length > nodeVictimLength) {
+            nodeVictim = other;
+            nodeVictimLength = length;
         }
+    }
 
-        if (cpu->runQueue->get_length()) {
-        retry:
-            Thread* it = cpu->runQueue->get_front();
-            do {
-                if (!it) {
-                    break;
-                }
+    if (!victim) {
+        victim = remoteVictim ? remoteVictim : nodeVictim;
+    }
 
-                if (it != cpu->currentThread) {
-                    // Save next thread as it will be overwritten by
-                    // intrusive list
-                    cpu->runQueue->remove(it);
-                    it->cpu = -1;
+    if (!victim) {
+        return nullptr;
+    }
 
-                    if(it->state != ThreadStateDying) {
-                        threadsToDistribute.add_back(it);
-                    }
+    // Never spin on another CPU's run queue,
+    // if the victim is busy scheduling we will try again next tick
+    if (!victim->runQueueLock.TryAcquire()) {
+        return nullptr;
+    }
 
-                    goto retry; // The front may have changed
-                } else {
-                    it = it->next;
-                }
-            } while (it != cpu->runQueue->get_front());
+    // Take the highest class thread we can find
+    Thread* stolen = nullptr;
+    for (int i = 0; i < SchedulingClassCount && !stolen; i++) {
+        Thread* it = victim->runQueues[i]->get_front();
+        while (it) {
+            // Only take threads that are runnable, allowed on this CPU
+            // and not currently executing on the victim
+            if (it != victim->currentThread && it->state == ThreadStateRunning && CPUAllowed(it, cpu)) {
+                stolen = it;
+                break;
+            }
+
+            it = victim->runQueues[i]->next(it);
         }
     }
 
-    Thread* nextThread;
-    while ((nextThread = threadsToDistribute.get_front())) {
-        CPU* cpu = SMP::cpus[leastActive];
+    if (stolen) {
+        victim->runQueues[stolen->schedulingClass]->remove(stolen);
 
-        threadsToDistribute.remove(nextThread);
-        cpu->runQueue->add_back(nextThread);
-        nextThread->cpu = cpu->id;
+        cpu->runQueues[stolen->schedulingClass]->add_back(stolen);
+        stolen->cpu = cpu->id;
+        RecordMigration(stolen, victim, cpu);
 
-        Log::Debug(debugLevelScheduler, DebugLevelVerbose, "Gave %s to CPU %d", nextThread->parent->name, leastActive);
+        Log::Debug(debugLevelScheduler, DebugLevelVerbose, "CPU %d stole %s (tid %d) from CPU %d", cpu->id,
+                   stolen->parent->name, stolen->tid, victim->id);
+    }
 
-        if (nextThread->ticksGivenSinceBalance > 0) {
-            avgUtilization[leastActive] += nextThread->ticksSinceBalance * 100 / nextThread->ticksGivenSinceBalance;
+    victim->runQueueLock.Release();
+    return stolen;
+}
+
+// \a running is the thread being switched out, we are still on its kernel stack
+Thread* PickNextThread(CPU* cpu, Thread* running) {
+    Thread* next = nullptr;
+
+    cpu->migrationPending = false;
+    for (int i = 0; i < SchedulingClassCount; i++) {
+        Thread* it = cpu->runQueues[i]->get_front();
+        while (it) {
+            Thread* following = cpu->runQueues[i]->next(it);
+            if (__builtin_expect(!CPUAllowed(it, cpu), 0)) {
+                // The affinity of the thread has changed, try to hand it to a CPU it may run on.
+                // Another CPU must not resume the thread we are switching out of whilst we are on its stack,
+                // it gets moved by the next Schedule() on this CPU.
+                if (it == running) {
+                    cpu->migrationPending = true;
+                } else {
+                    MigrateDisallowedThread(cpu, it);
+                }
+            } else if (!(it->state & ThreadStateBlocked)) {
+                break;
+            }
+
+            it = following;
         }
 
-        if (!threadsToDistribute.get_front()) {
-            break; // Done distributing threads
+        if (!it) {
+            continue;
         }
 
-        for (unsigned i = 0; i < SMP::processorCount; i++) {
-            Log::Debug(debugLevelScheduler, DebugLevelVerbose, "util: %d, %d", i, avgUtilization[i]);
+        if (!next) {
+            next = it;
 
-            if (avgUtilization[i] < avgUtilization[leastActive]) {
-                leastActive = i;
+            if (i == SchedulingClassRealtime) {
+                break; // Realtime threads are never passed over
             }
+            continue;
+        }
+
+        // There is a runnable thread in a lower class than the one we picked,
+        // give it a timeslice if it has been waiting for too long
+        if (++cpu->starvedPasses >= SCHEDULER_STARVATION_LIMIT) {
+            cpu->starvedPasses = 0;
+            next = it;
         }
+        break;
     }
 
-    // Unlock ALL run queues
-    for (unsigned i = 0; i < SMP::processorCount; i++) {
-        Thread* thread = SMP::cpus[i]->runQueue->get_front();
-        if (thread) {
-            do {
-                thread->ticksSinceBalance = 0;
-                thread->ticksGivenSinceBalance = 0;
+    return next;
+}
 
-                Log::Debug(debugLevelScheduler, DebugLevelVerbose, "%d: resetting %s (pid %d tid %d)", i,
-                           thread->parent->name, thread->parent->PID(), thread->tid);
-                thread = thread->next;
-            } while (thread != SMP::cpus[i]->runQueue->get_front());
+// Take the thread previous handed off to (see Thread::handoff) if it can run on this CPU right now,
+// moving it here if it is queued on another CPU. The run queue lock of cpu must be held.
+static Thread* TakeHandoff(CPU* cpu, Thread* previous) {
+    Thread* target = previous->handoff;
+    int hint = previous->handoffCPU;
+    previous->handoff = nullptr;
+
+    // The target may have exited and been freed since it was woken, so it is only compared against
+    // until it is found in the run queue of the CPU it was on, threads are removed from it before being freed
+    if (target == previous || hint < 0 || hint >= static_cast<int>(SMP::processorCount)) {
+        return nullptr;
+    }
+
+    CPU* other = SMP::cpus[hint];
+    if (other != cpu && !other->runQueueLock.TryAcquire()) {
+        return nullptr; // Never spin on another CPU's run queue
+    }
+
+    Thread* found = nullptr;
+    for (int i = 0; i < SchedulingClassCount && !found; i++) {
+        for (Thread* it = other->runQueues[i]->get_front(); it; it = other->runQueues[i]->next(it)) {
+            if (it == target) {
+                found = it;
+                break;
+            }
         }
+    }
+
+    // Must be runnable, and if it is on another CPU not running there and allowed on this one
+    if (found && (found->state != ThreadStateRunning ||
+                  (other != cpu && (other->currentThread == found || !CPUAllowed(found, cpu))))) {
+        found = nullptr;
+    }
 
-        SMP::cpus[i]->idleThread->ticksSinceBalance = 0;
+    if (found && other != cpu) {
+        // Its FPU state was written back when it was last switched out on the other CPU
+        other->runQueues[found->schedulingClass]->remove(found);
 
-        if(SMP::cpus[i] != GetCPULocal()) {
-            releaseLock(&SMP::cpus[i]->runQueueLock);
+        cpu->runQueues[found->schedulingClass]->add_back(found);
+        found->cpu = cpu->id;
+        RecordMigration(found, other, cpu);
+    }
+
+    if (other != cpu) {
+        other->runQueueLock.Release();
+    }
+
+    if (found) {
+        cpu->handoffs++;
+    }
+    return found;
+}
+
+// Called with the run queue lock held when there is nothing to run on this CPU
+static Thread* EnterIdle(CPU* cpu, Thread* running) {
+    // Mark ourselves idle before checking the run queue one last time,
+    // WakeIdleCPU checks the flag after a thread is made runnable
+    // so either we will find the thread or we will get woken up.
+    __atomic_store_n(&cpu->idle, true, __ATOMIC_SEQ_CST);
+    if (Thread* thread = PickNextThread(cpu, running)) {
+        __atomic_store_n(&cpu->idle, false, __ATOMIC_RELAXED);
+        return thread;
+    }
+
+    return cpu->idleThread;
+}
+
+// Only tick whilst this CPU has work,
+// CPU 0 always gets ticks from the system timer
+static void UpdateTimer(CPU* cpu) {
+    if (cpu->currentThread != cpu->idleThread) {
+        __atomic_store_n(&cpu->idle, false, __ATOMIC_RELAXED);
+    }
+
+    if (cpu == SMP::cpus[0] || !APIC::Local::TimerAvailable()) {
+        return;
+    }
+
+    // Keep ticking whilst a thread is waiting to be migrated (see PickNextThread)
+    if (cpu->idle && !cpu->migrationPending && cpu->timerRunning) {
+        APIC::Local::StopTimer();
+        cpu->timerRunning = false;
+    } else if ((!cpu->idle || cpu->migrationPending) && !cpu->timerRunning) {
+        APIC::Local::StartTimer(Timer::GetFrequency(), IPI_SCHEDULE);
+        cpu->timerRunning = true;
+    }
+}
+
+// Update scheduler statistics when switching from previous to next,
+// called with the run queue lock held
+static void AccountSwitch(CPU* cpu, Thread* previous, Thread* next) {
+    uint64_t now = Timer::UsecondsSinceBoot();
+
+    cpu->contextSwitches++;
+
+    if (previous == cpu->idleThread) {
+        cpu->idleUs += now - cpu->idleSince;
+    } else if (previous && previous->state != ThreadStateDying) {
+        Process* process = previous->parent;
+
+        previous->contextSwitches++;
+        __atomic_add_fetch(&process->contextSwitches, 1, __ATOMIC_RELAXED);
+
+        if ((previous->state & ThreadStateBlocked) || previous->yielded) {
+            previous->voluntarySwitches++;
+            __atomic_add_fetch(&process->voluntarySwitches, 1, __ATOMIC_RELAXED);
+        } else {
+            previous->involuntarySwitches++;
+            __atomic_add_fetch(&process->involuntarySwitches, 1, __ATOMIC_RELAXED);
+        }
+
+        // Still runnable, start counting how long it waits
+        if (!(previous->state & ThreadStateBlocked)) {
+            previous->runnableSince = now;
         }
+        previous->yielded = false;
     }
 
-    nextBalanceDue = Timer::UsecondsSinceBoot() + 1000000;
+    if (next == cpu->idleThread) {
+        cpu->idleSince = now;
+    } else if (next->runnableSince) {
+        uint64_t wait = now - next->runnableSince;
+        Process* process = next->parent;
+
+        next->runQueueWaitUs += wait;
+        __atomic_add_fetch(&process->runQueueWaitUs, wait, __ATOMIC_RELAXED);
+        if (wait > next->maxRunQueueWaitUs) {
+            next->maxRunQueueWaitUs = wait;
+        }
+
+        // Races with other CPUs only lose a maximum, which is fine for statistics
+        if (wait > process->maxRunQueueWaitUs) {
+            process->maxRunQueueWaitUs = wait;
+        }
+
+        next->runnableSince = 0;
+    }
 }
 
 void Schedule(__attribute__((unused)) void* data, RegisterContext* r) {
@@ -273,106 +797,95 @@ void Schedule(__attribute__((unused)) void* data, RegisterContext* r) {
 
     CPU* cpu = GetCPULocal();
 
+    // Yields (including blocking) also come through here, only ticks are sampled
+    if (!cpu->currentThread || !cpu->currentThread->yielded) {
+        Profiler::Tick(r);
+    }
+
+    if (!cpu->currentThread || !cpu->currentThread->rcuReadDepth) {
+        RCU::QuiescentState(cpu);
+    }
+
     if (cpu->currentThread && !(cpu->currentThread->state & ThreadStateBlocked)) {
         cpu->currentThread->parent->activeTicks++;
+        cpu->currentThread->activeTicks++;
         if (cpu->currentThread->timeSlice > 0) {
-            cpu->currentThread->ticksSinceBalance++;
             cpu->currentThread->timeSlice--;
             return;
         }
+
+        if (cpu->currentThread->rcuReadDepth) {
+            return; // Never preempt an RCU reader, it gets switched out at the first tick after it finishes
+        }
     }
 
-    if(__builtin_expect(acquireTestLock(&cpu->runQueueLock), 0)) {
+    assert(!cpu->currentThread || !cpu->currentThread->rcuReadDepth); // Blocked in an RCU read section
+
+    if(__builtin_expect(!cpu->runQueueLock.TryAcquire(), 0)) {
         // If the process should block wait, otherwise return
         if(cpu->currentThread->state & ThreadStateBlocked) {
-            acquireLock(&cpu->runQueueLock);
+            cpu->runQueueLock.Acquire();
         } else return;
     }
 
-    if (SMP::processorCount > 1 && Timer::UsecondsSinceBoot() > nextBalanceDue) {
-        if(!__builtin_expect(acquireTestLock(&processesLock), 0)) {
-            if (Timer::UsecondsSinceBoot() > nextBalanceDue) {
-                BalanceRunQueues();
-            }
-            releaseLock(&processesLock);
+    Thread* previous = cpu->currentThread;
+
+    if (__builtin_expect(RunQueueLength(cpu) <= 0 || !cpu->currentThread, 0)) {
+        cpu->currentThread = nullptr;
+        if (RunQueueLength(cpu) <= 0) {
+            // Nothing queued on this CPU, see if any other CPU has work for us
+            cpu->currentThread = StealThread(cpu);
         }
-    }
 
-    if (__builtin_expect(cpu->runQueue->get_length() <= 0 || !cpu->currentThread, 0)) {
-        cpu->currentThread = cpu->idleThread;
+        if (!cpu->currentThread) {
+            cpu->currentThread = EnterIdle(cpu, previous);
+        }
     } else if (__builtin_expect(cpu->currentThread->state == ThreadStateDying, 0)) {
-        cpu->runQueue->remove(cpu->currentThread);
+        cpu->runQueues[cpu->currentThread->schedulingClass]->remove(cpu->currentThread);
         cpu->currentThread->cpu = -1;
-        cpu->currentThread = cpu->idleThread;
+        cpu->currentThread = EnterIdle(cpu, previous);
     } else {
-        asm volatile("fxsave64 (%0)" ::"r"((uintptr_t)cpu->currentThread->fxState) : "memory");
+        cpu->currentThread->registers = *r;
 
         if (__builtin_expect(cpu->currentThread->parent != cpu->idleProcess, 1)) {
-            cpu->currentThread->ticksGivenSinceBalance += cpu->currentThread->timeSliceDefault;
-
-            cpu->currentThread->registers = *r;
-
-            cpu->currentThread = cpu->currentThread->next;
-        } else {
-            cpu->currentThread->ticksGivenSinceBalance += cpu->currentThread->timeSliceDefault;
-            cpu->currentThread->registers = *r;
-            cpu->currentThread = cpu->runQueue->front;
-        }
-
-        // Get the next thread that isnt blocked
-        if (cpu->currentThread->state & ThreadStateBlocked) {
-            Thread* first = cpu->currentThread;
-
-            do {
-                cpu->currentThread = cpu->currentThread->next;
-            } while ((cpu->currentThread->state & ThreadStateBlocked) && cpu->currentThread != first);
-        }
-
-        // Check if we could find an unblocked thread
-        if (cpu->currentThread->state & ThreadStateBlocked) {
-                cpu->currentThread = cpu->idleThread;
-        } /*else if(SMP::processorCount > 1) {
-            // See if we can find a better thread
-            // where better is the thread w/ least CPU time
-            Thread* first = cpu->currentThread;
-            Thread* leastHungry = cpu->currentThread->next;
-
-            cpu->currentThread = leastHungry;
-            do {
-                if (leastHungry->state & ThreadStateBlocked) {
-                    Thread* first = leastHungry;
-
-                    do {
-                        leastHungry = leastHungry->next;
-                    } while ((leastHungry->state & ThreadStateBlocked) && leastHungry != first);
-
-                    if (leastHungry->state & ThreadStateBlocked) {
-                        cpu->currentThread = cpu->idleThread;
-                        break;
-                    }
-                }
+            // Move the thread to the back of its queue
+            // so the other threads in its class get a turn
+            FastList<Thread*>* queue = cpu->runQueues[cpu->currentThread->schedulingClass];
+            queue->remove(cpu->currentThread);
+            queue->add_back(cpu->currentThread);
+        }
 
-                if(leastHungry == first) {
-                    break;
-                }
+        // A thread blocking on (or replying to) an IPC call switches straight to the thread it woke,
+        // otherwise get the highest class thread that isnt blocked or try to steal one before going idle
+        cpu->currentThread = previous->handoff ? TakeHandoff(cpu, previous) : nullptr;
+        if (!cpu->currentThread) {
+            cpu->currentThread = PickNextThread(cpu, previous);
+        }
 
-                if(leastHungry->ticksSinceBalance < cpu->currentThread->ticksSinceBalance) {
-                    cpu->currentThread = leastHungry;
-                }
+        if (!cpu->currentThread) {
+            cpu->currentThread = StealThread(cpu);
+            if (!cpu->currentThread) {
+                cpu->currentThread = EnterIdle(cpu, previous);
+            }
+        }
+    }
 
-                leastHungry = leastHungry->next;
-            } while(leastHungry != first);
-        }*/
+    if (cpu->currentThread != previous) {
+        AccountSwitch(cpu, previous, cpu->currentThread);
+        PerfCounters::Switch(cpu, previous, cpu->currentThread);
     }
 
-    releaseLock(&cpu->runQueueLock);
+    UpdateTimer(cpu);
+    ReleaseFPU(cpu);
+    cpu->runQueueLock.Release();
 
     DoSwitch(cpu);
 }
 
 void DoSwitch(CPU* cpu) {
-    asm volatile("fxrstor64 (%0)" ::"r"((uintptr_t)cpu->currentThread->fxState) : "memory");
-
+    // FPU state is restored lazily by the #NM handler the first time the thread uses it,
+    // if the thread still owns the FPU the state is already loaded.
+    // The previous owner has been released by the caller with the run queue lock held
     asm volatile("wrmsr" ::"a"(cpu->currentThread->fsBase & 0xFFFFFFFF) /*Value low*/,
                  "d"((cpu->currentThread->fsBase >> 32) & 0xFFFFFFFF) /*Value high*/, "c"(0xC0000100) /*Set FS Base*/);
 
@@ -416,8 +929,78 @@ void DoSwitch(CPU* cpu) {
         mov %%rax, %%cr3
         pop %%rax
         addq $8, %%rsp
+
+        testq $3, 8(%%rsp) # Returning to usermode, load the user GS base (see GetCPULocal)
+        jz 1f
+        swapgs
+    1:
         iretq)" ::"r"(&cpu->currentThread->registers),
-        "r"(cpu->currentThread->parent->GetPageMap()->pml4Phys));
+        "r"(Memory::ActivatePageMap(cpu->currentThread->parent->GetPageMap())));
 }
 
 } // namespace Scheduler
+
+// Tear down destroyed processes off the hot path,
+// the whole queue is taken at once so Process::Die() never waits on teardown
+void Reaper() {
+    using namespace Scheduler;
+
+    List<FancyRefPtr<Process>> batch;
+    bool deferred = false;
+    for (;;) {
+        if (deferred) {
+            // Processes still in use were put back, try again shortly
+            Thread::Current()->Sleep(10000);
+        } else if (reaperSemaphore.Wait()) {
+            continue; // Interrupted
+        }
+
+        acquireLock(&destroyedProcessesLock);
+        batch = std::move(*destroyedProcesses);
+        reaperStatistics.backlog = 0;
+        releaseLock(&destroyedProcessesLock);
+
+        if (!batch.get_length()) {
+            deferred = false;
+            continue;
+        }
+
+        uint64_t batchStart = Timer::UsecondsSinceBoot();
+        unsigned reaped = 0;
+        unsigned requeued = 0;
+
+        while (batch.get_length()) {
+            FancyRefPtr<Process> proc = batch.remove_at(0);
+            if (acquireTestLock(&proc->m_processLock)) {
+                // Still locked by someone, put it back for the next pass
+                ScopedSpinLock lockDestroyedProcesses(destroyedProcessesLock);
+                destroyedProcesses->add_back(std::move(proc));
+                reaperStatistics.backlog = destroyedProcesses->get_length();
+
+                requeued++;
+                continue;
+            }
+
+            if (proc->addressSpace) { // Destroy the address space regardless
+                delete proc->addressSpace;
+                proc->addressSpace = nullptr;
+            }
+
+            releaseLock(&proc->m_processLock);
+            reaped++;
+
+            // If this was the last reference the process (along with its threads and handles)
+            // is freed as proc goes out of scope
+        }
+
+        deferred = requeued > 0;
+
+        reaperStatistics.reaped += reaped;
+        reaperStatistics.deferred += requeued;
+        reaperStatistics.batches++;
+        reaperStatistics.lastBatchUs = Timer::UsecondsSinceBoot() - batchStart;
+
+        Log::Debug(debugLevelScheduler, DebugLevelNormal, "[Reaper] Reaped %u processes (%u deferred) in %luus",
+                   reaped, requeued, reaperStatistics.lastBatchUs);
+    }
+}
@@ -1,37 +1,86 @@
 #include <CString.h>
 
+#include <CPU.h>
+#include <Errno.h>
+#include <Fs/Filesystem.h>
+#include <Logging.h>
+#include <Objects/Process.h>
 #include <Paging.h>
+#include <UserPointer.h>
 
+void InitializeUserCopy() {
+    bool fastShort;
+    if (CPUIDFastStrings(fastShort)) {
+        userCopyMode = fastShort ? UserCopyFSRM : UserCopyERMS;
+    }
+
+    Memory::RegisterPageFaultTrap(PageFaultTrap{.instructionPointer = reinterpret_cast<uintptr_t>(UserMemcpyTrap),
+                                                .handler = UserMemcpyTrapHandler});
+    Memory::RegisterPageFaultTrap(PageFaultTrap{.instructionPointer = reinterpret_cast<uintptr_t>(UserMemcpyTrapQ),
+                                                .handler = UserMemcpyTrapHandler});
+    Memory::RegisterPageFaultTrap(PageFaultTrap{.instructionPointer = reinterpret_cast<uintptr_t>(UserStrnlenTrap),
+                                                .handler = UserStrnlenTrapHandler});
+
+    Log::Info("[User Copy] Using %s", (userCopyMode == UserCopyFSRM)   ? "FSRM"
+                                      : (userCopyMode == UserCopyERMS) ? "ERMS"
+                                                                       : "rep movsq");
+}
+
+int CopyFromUserAtomic(void* dest, const void* src, size_t count) {
+    if (!IsUserRange(src, count)) {
+        return 1;
+    }
+
+    Thread* thread = Thread::Current();
+    thread->pageFaultsDisabled = true;
+    int e = UserMemcpy(dest, src, count);
+    thread->pageFaultsDisabled = false;
+    return e;
+}
+
+// The string is read by the current process, aSpace is expected to be its address space
 long strlenSafe(const char* str, size_t& size, AddressSpace* aSpace) {
-    size_t pageBoundary =
-        PAGE_SIZE_4K - (reinterpret_cast<uintptr_t>(str) & (PAGE_SIZE_4K - 1)); // Get amount of bytes to page boundary
-    if (!Memory::CheckUsermodePointer(reinterpret_cast<uintptr_t>(str), pageBoundary, aSpace)) {
+    if (!IsUserRange(str, 1)) {
         return 1;
     }
 
-    size_t& i = size;
-    i = 0;
+    // Pages are faulted in as the string is read, anything the process could not access stops the search
+    size_t max = USER_ADDRESS_LIMIT - reinterpret_cast<uintptr_t>(str);
+    long length = UserStrnlen(str, max);
+    if (length < 0 || static_cast<size_t>(length) == max) {
+        return 1;
+    }
 
-    while (i < pageBoundary) {
-        if (str[i] == '\0') {
-            return 0;
-        }
+    size = length;
+    return 0;
+}
 
-        i++;
+long UserIOVec::Copy(Process* process, uintptr_t ptr, long count) {
+    if (count < 0 || count > IOV_MAX) {
+        return -EINVAL;
     }
 
-    for (;;) {
-        if (!Memory::CheckUsermodePointer(reinterpret_cast<uintptr_t>(str) + i, PAGE_SIZE_4K, aSpace)) {
-            return 1;
-        }
+    if (count > static_cast<long>(sizeof(m_inlineIov) / sizeof(iovec))) {
+        m_iov = new iovec[count];
+    }
+    m_count = count;
 
-        size_t pageBoundary = i + PAGE_SIZE_4K;
-        while (i < pageBoundary) {
-            if (str[i] == '\0') {
-                return 0;
-            }
+    if (CopyArrayFromUser(m_iov, reinterpret_cast<const iovec*>(ptr), count)) {
+        return -EFAULT;
+    }
 
-            i++;
+    m_total = 0;
+    for (int i = 0; i < m_count; i++) {
+        if (m_iov[i].iov_len > static_cast<size_t>(INT64_MAX) - m_total) {
+            return -EINVAL; // Total length does not fit in ssize_t
         }
+        m_total += m_iov[i].iov_len;
     }
+
+    // The buffers are used directly rather than copied, so they have to be mapped
+    if (!process->addressSpace->RangesInRegion(m_iov, m_count)) {
+        return -EFAULT;
+    }
+
+    return 0;
 }
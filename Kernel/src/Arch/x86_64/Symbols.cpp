@@ -8,6 +8,9 @@
 #include <Vector.h>
 
 HashMap<StringView, KernelSymbol*> symbolHashMap;
+// Every symbol, searched when resolving an address
+Vector<KernelSymbol*> symbolList;
+lock_t symbolListLock = 0;
 
 void LoadSymbolsFromFile(FsNode* node) {
     unsigned bufferSize = node->size;
@@ -54,6 +57,10 @@ void LoadSymbolsFromFile(FsNode* node) {
                        sym->mangledName);
 
             symbolHashMap.insert(sym->mangledName, sym);
+            {
+                ScopedSpinLock lockSymbols(symbolListLock);
+                symbolList.add_back(sym);
+            }
 
             bufferPos += (lineEnd - line) + 1;
         }
@@ -67,10 +74,42 @@ int ResolveKernelSymbol(const char* mangledName, KernelSymbol*& symbolPtr) {
     return symbolHashMap.get(mangledName, symbolPtr);
 }
 
+int ResolveKernelSymbol(uintptr_t address, KernelSymbol*& symbolPtr) {
+    ScopedSpinLock lockSymbols(symbolListLock);
+
+    // Closest symbol at or below the address
+    KernelSymbol* closest = nullptr;
+    for (KernelSymbol* sym : symbolList) {
+        if (sym->address <= address && (!closest || sym->address > closest->address)) {
+            closest = sym;
+        }
+    }
+
+    if (!closest) {
+        return 0;
+    }
+
+    symbolPtr = closest;
+    return 1;
+}
+
 void AddKernelSymbol(KernelSymbol* sym) {
     assert(!symbolHashMap.find(sym->mangledName));
 
     symbolHashMap.insert(sym->mangledName, sym);
+
+    ScopedSpinLock lockSymbols(symbolListLock);
+    symbolList.add_back(sym);
 }
 
-void RemoveKernelSymbol(const char* mangledName) { symbolHashMap.remove(mangledName); }
\ No newline at end of file
+void RemoveKernelSymbol(const char* mangledName) {
+    KernelSymbol* sym = symbolHashMap.remove(mangledName);
+
+    ScopedSpinLock lockSymbols(symbolListLock);
+    for (unsigned i = 0; i < symbolList.get_length(); i++) {
+        if (symbolList[i] == sym) {
+            symbolList.erase(i);
+            break;
+        }
+    }
+}
\ No newline at end of file
@@ -1,12 +1,17 @@
 global syscall_entry
 
 extern SyscallHandler
+extern SyscallFastHandler
+extern fastSyscalls
 
 section .text
 
 USER_SS equ 0x1B
 USER_CS equ 0x23
 
+NUM_SYSCALLS equ 145 ; Keep in sync with Syscalls.h
+SYSCALL_FAST_FALLBACK equ -4096
+
 CPU_LOCAL_SELF equ 0x0
 CPU_LOCAL_ID equ 0x8
 CPU_LOCAL_THREAD equ 0x10
@@ -14,18 +19,63 @@ CPU_LOCAL_SCRATCH equ 0x18
 CPU_LOCAL_TSS equ 0x20
 CPU_LOCAL_TSS_RSP0 equ (CPU_LOCAL_TSS + 0x4)
 
+; Both paths build the start of a RegisterContext (see CPU.h), the kernel GS base stays loaded
+; until the swapgs just before sysret. Syscalls with an entry in fastSyscalls only save the registers
+; the C ABI does not preserve, anything else saves every register and goes through SyscallHandler.
 syscall_entry:
     swapgs
     mov qword [gs:CPU_LOCAL_SCRATCH], rsp
     mov rsp, qword [gs:CPU_LOCAL_TSS_RSP0]
     push USER_SS
     push qword [gs:CPU_LOCAL_SCRATCH]
-    swapgs
     push r11
     push USER_CS
     push rcx
     push 0
 
+    ; rcx and r11 are clobbered by syscall so are free to use
+    cmp rax, NUM_SYSCALLS
+    jae .slow
+    lea rcx, [rel fastSyscalls]
+    cmp qword [rcx + rax * 8], 0
+    je .slow
+
+    ; Layout of SyscallFastFrame, keeps the stack 16 byte aligned
+    push rdi
+    push rsi
+    push rdx
+    push r8
+    push r9
+    push r10
+    push rax
+
+    mov rdi, rsp ; rbp is left alone, it is not saved
+    call SyscallFastHandler
+
+    cmp rax, SYSCALL_FAST_FALLBACK
+    je .fallback
+
+    add rsp, 8 ; Syscall number
+    pop r10
+    pop r9
+    pop r8
+    pop rdx
+    pop rsi
+    pop rdi
+    jmp .exit
+
+.fallback:
+    ; The fast handler could not handle it, restore the arguments and go the slow way
+    pop rax
+    pop r10
+    pop r9
+    pop r8
+    pop rdx
+    pop rsi
+    pop rdi
+
+.slow:
+    mov rcx, qword [rsp + 8] ; User RIP
     push rax
     push rbx
     push rcx
@@ -62,6 +112,10 @@ syscall_entry:
     pop rbx
     pop rax
 
+.exit:
+    ; Interrupts must stay disabled from here, an IRQ after the swapgs
+    ; or once on the user stack would run with the wrong GS base and stack
+    cli
     add rsp, 8
     ; Get user RIP
     pop rcx
@@ -69,5 +123,6 @@ syscall_entry:
     ; User RFLAGS
     pop r11
     ; Get user RSP
+    swapgs
     pop rsp
     o64 sysret
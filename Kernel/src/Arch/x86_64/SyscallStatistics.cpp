@@ -0,0 +1,105 @@
+#include <Syscalls.h>
+
+#include <CString.h>
+#include <Device.h>
+#include <Math.h>
+#include <MM/KMalloc.h>
+#include <SMP.h>
+#include <Spinlock.h>
+
+// Write label followed by num, returns the end of the text
+static char* AppendNumber(char* text, const char* label, uint64_t num) {
+    strcpy(text, label);
+    text += strlen(label);
+
+    itoa(num, text, 10);
+    return text + strlen(text);
+}
+
+// One line per syscall which has been called, summed over every CPU.
+// Read from the start to get new figures and write anything to reset the counters
+class SyscallStatisticsDevice final : public Device {
+public:
+    SyscallStatisticsDevice() : Device("syscallstat", DeviceTypeUNIXPseudo) {
+        flags = FS_NODE_FILE;
+
+        SetDeviceName("Syscall Statistics");
+    }
+
+    ssize_t Read(size_t offset, size_t size, uint8_t* buffer) override {
+        ScopedSpinLock lockText(m_textLock);
+        if (!offset || !m_text) {
+            Update();
+        }
+
+        if (offset >= m_textLength) {
+            return 0;
+        }
+
+        size = MIN(size, m_textLength - offset);
+        memcpy(buffer, m_text + offset, size);
+        return size;
+    }
+
+    ssize_t Write(size_t, size_t size, uint8_t*) override {
+        for (unsigned i = 0; i < SMP::processorCount; i++) {
+            memset(SMP::cpus[i]->syscallCounters, 0, sizeof(SyscallCounter) * NUM_SYSCALLS);
+        }
+
+        return size;
+    }
+
+private:
+    void Update() {
+        // Number and five numbers
+        constexpr size_t lineSize = 160;
+
+        if (!m_text) {
+            m_text = reinterpret_cast<char*>(kmalloc(NUM_SYSCALLS * lineSize + 1));
+        }
+
+        char* text = m_text;
+        for (unsigned num = 0; num < NUM_SYSCALLS; num++) {
+            SyscallCounter total = {};
+            for (unsigned i = 0; i < SMP::processorCount; i++) {
+                const SyscallCounter& counter = SMP::cpus[i]->syscallCounters[num];
+
+                total.calls += counter.calls;
+                total.fastCalls += counter.fastCalls;
+                total.cycles += counter.cycles;
+                total.maxCycles = MAX(total.maxCycles, counter.maxCycles);
+            }
+
+            if (!total.calls) {
+                continue;
+            }
+
+            text = AppendNumber(text, "", num);
+            text = AppendNumber(text, ": calls ", total.calls);
+            text = AppendNumber(text, " fast ", total.fastCalls);
+            text = AppendNumber(text, " total ", total.cycles);
+            text = AppendNumber(text, " max ", total.maxCycles);
+            text = AppendNumber(text, " avg ", total.cycles / total.calls);
+            strcpy(text, " cycles\n");
+            text += strlen(text);
+        }
+
+        m_textLength = text - m_text;
+    }
+
+    lock_t m_textLock = 0;
+    char* m_text = nullptr;
+    size_t m_textLength = 0;
+};
+
+void InitializeSyscallStatistics() {
+    for (unsigned i = 0; i < SMP::processorCount; i++) {
+        SyscallCounter* counters = new SyscallCounter[NUM_SYSCALLS];
+        memset(counters, 0, sizeof(SyscallCounter) * NUM_SYSCALLS);
+
+        // Published last, the counters are only touched once this is set
+        __atomic_store_n(&SMP::cpus[i]->syscallCounters, counters, __ATOMIC_RELEASE);
+    }
+
+    new SyscallStatisticsDevice();
+}
@@ -5,21 +5,28 @@
 #include <Device.h>
 #include <Errno.h>
 #include <Framebuffer.h>
+#include <Futex.h>
 #include <HAL.h>
 #include <IDT.h>
 #include <Lemon.h>
 #include <Lock.h>
 #include <Logging.h>
+#include <MM/Swap.h>
 #include <Math.h>
+#include <Metrics.h>
 #include <Modules.h>
 #include <Net/Socket.h>
+#include <Objects/IORing.h>
 #include <Objects/Service.h>
+#include <Objects/WaitSet.h>
 #include <OnCleanup.h>
 #include <Pair.h>
+#include <PerfCounters.h>
 #include <PhysicalAllocator.h>
 #include <SMP.h>
 #include <Scheduler.h>
 #include <SharedMemory.h>
+#include <SmallVector.h>
 #include <Signal.h>
 #include <StackTrace.h>
 #include <TTY/PTY.h>
@@ -27,6 +34,8 @@
 #include <UserPointer.h>
 #include <Video/Video.h>
 
+#include <ABI/Futex.h>
+#include <ABI/IPC.h>
 #include <ABI/Process.h>
 
 #include <abi-bits/vm-flags.h>
@@ -34,6 +43,10 @@
 
 #define EXEC_CHILD 1
 
+// Arguments and environment variables copied by exec/spawn without allocating the list
+#define EXEC_INLINE_ARGS 8
+#define EXEC_INLINE_ENV 32
+
 long SysRead(RegisterContext* r);
 long SysWrite(RegisterContext* r);
 long SysOpen(RegisterContext* r);
@@ -67,6 +80,13 @@ long SysEPollCtl(RegisterContext* r);
 long SysEpollWait(RegisterContext* r);
 long SysPipe(RegisterContext* r);
 long SysFChdir(RegisterContext* r);
+long SysFSync(RegisterContext* r);
+long SysReadV(RegisterContext* r);
+long SysWriteV(RegisterContext* r);
+long SysPReadV(RegisterContext* r);
+long SysPWriteV(RegisterContext* r);
+long SysReadDirBatch(RegisterContext* r);
+long SysSendFile(RegisterContext* r);
 
 long SysExit(RegisterContext* r) {
     int code = SC_ARG0(r);
@@ -108,7 +128,7 @@ long SysExec(RegisterContext* r) {
         return -ENOENT;
     }
 
-    Vector<String> kernelEnvp;
+    SmallVector<String, EXEC_INLINE_ENV> kernelEnvp;
     if (envp) {
         int i = 0;
         while (envp[i]) {
@@ -125,7 +145,7 @@ long SysExec(RegisterContext* r) {
 
     Log::Info("Loading: %s", (char*)SC_ARG0(r));
 
-    Vector<String> kernelArgv;
+    SmallVector<String, EXEC_INLINE_ARGS> kernelArgv;
     for (int i = 0; i < argc; i++) {
         if (!argv[i]) { // Some programs may attempt to terminate argv with a null pointer
             argc = i;
@@ -145,18 +165,16 @@ long SysExec(RegisterContext* r) {
         kernelArgv.add_back(filepath); // Ensure at least argv[0] is set
     }
 
-    timeval tv = Timer::GetSystemUptimeStruct();
-    uint8_t* buffer = (uint8_t*)kmalloc(node->size);
-    size_t read = fs::Read(node, 0, node->size, buffer);
-    if (read != node->size) {
-        Log::Warning("Could not read file: %s", filepath);
-        return 0;
+    auto elfFile = fs::Open(node);
+    if (elfFile.HasError()) {
+        Log::Warning("Could not open file: %s", filepath);
+        return -elfFile.Err().code;
     }
-    timeval tvnew = Timer::GetSystemUptimeStruct();
-    Log::Info("Done (took %d us)", Timer::TimeDifference(tvnew, tv));
-    FancyRefPtr<Process> proc = Process::CreateELFProcess((void*)buffer, kernelArgv, kernelEnvp, filepath,
+
+    // Segments are faulted in from the page cache as they are used
+    FancyRefPtr<Process> proc = Process::CreateELFProcess(FancyRefPtr<UNIXOpenFile>(elfFile.Value()), kernelArgv,
+                                                          kernelEnvp, filepath,
                                                           ((flags & EXEC_CHILD) ? currentProcess : nullptr));
-    kfree(buffer);
 
     if (!proc) {
         Log::Warning("SysExec: Proc is null!");
@@ -170,14 +188,7 @@ long SysExec(RegisterContext* r) {
         currentProcess->RegisterChildProcess(proc);
 
         // Copy handles
-        proc->m_handles.resize(currentProcess->HandleCount());
-        for (unsigned i = 0; i < proc->m_handles.size(); i++) {
-            if (!currentProcess->m_handles[i].closeOnExec) {
-                proc->m_handles[i] = currentProcess->m_handles[i];
-            } else {
-                proc->m_handles[i] = HANDLE_NULL;
-            }
-        }
+        proc->m_handles.CopyFrom(currentProcess->m_handles, true);
     }
 
     proc->Start();
@@ -223,7 +234,7 @@ long SysExecve(RegisterContext* r) {
         return -ENOENT;
     }
 
-    Vector<String> kernelEnvp;
+    SmallVector<String, EXEC_INLINE_ENV> kernelEnvp;
     if (envp) {
         int i = 0;
         while (envp[i]) {
@@ -240,7 +251,7 @@ long SysExecve(RegisterContext* r) {
 
     Log::Info("Loading: %s", (char*)SC_ARG0(r));
 
-    Vector<String> kernelArgv;
+    SmallVector<String, EXEC_INLINE_ARGS> kernelArgv;
     if (argv) {
         int i = 0;
         while (argv[i]) {
@@ -259,15 +270,16 @@ long SysExecve(RegisterContext* r) {
         kernelArgv.add_back(filepath); // Ensure at least argv[0] is set
     }
 
-    timeval tv = Timer::GetSystemUptimeStruct();
-    uint8_t* buffer = (uint8_t*)kmalloc(node->size);
-    size_t read = fs::Read(node, 0, node->size, buffer);
-    if (read != node->size) {
-        Log::Warning("Could not read file: %s", filepath);
-        return -EIO;
+    auto openFile = fs::Open(node);
+    if (openFile.HasError()) {
+        Log::Warning("Could not open file: %s", filepath);
+        return -openFile.Err().code;
+    }
+
+    FancyRefPtr<UNIXOpenFile> elfFile = openFile.Value();
+    if (!VerifyELF(elfFile)) {
+        return -ENOEXEC; // Checked before the old address space is gone
     }
-    timeval tvnew = Timer::GetSystemUptimeStruct();
-    Log::Info("Done (took %d us)", Timer::TimeDifference(tvnew, tv));
 
     Thread* currentThread = Thread::Current();
     ScopedSpinLock lockProcess(currentProcess->m_processLock);
@@ -289,7 +301,8 @@ long SysExecve(RegisterContext* r) {
 
     asm volatile("cli");
     currentProcess->addressSpace = newSpace;
-    asm volatile("mov %%rax, %%cr3; sti" ::"a"(newSpace->GetPageMap()->pml4Phys));
+    Memory::SwitchPageMap(newSpace->GetPageMap());
+    asm volatile("sti");
 
     delete oldSpace;
 
@@ -298,9 +311,8 @@ long SysExecve(RegisterContext* r) {
     // Force the first 8KB to be allocated
     // TODO: PageMap race cond
 
-    elf_info_t elfInfo = LoadELFSegments(currentProcess, buffer, 0);
+    elf_info_t elfInfo = LoadELFSegments(currentProcess, elfFile, 0);
     r->rip = currentProcess->LoadELF(&r->rsp, elfInfo, kernelArgv, kernelEnvp, filepath);
-    kfree(buffer);
 
     if (!r->rip) {
         // Its really important that we kill the process afterwards,
@@ -328,12 +340,7 @@ long SysExecve(RegisterContext* r) {
     // Restore default FPU state
     asm volatile("fxrstor64 (%0)" ::"r"((uintptr_t)currentThread->fxState) : "memory");
 
-    ScopedSpinLock lockProcessFds(currentProcess->m_handleLock);
-    for (Handle& fd : currentProcess->m_handles) {
-        if (fd.closeOnExec) {
-            fd = HANDLE_NULL;
-        }
-    }
+    currentProcess->m_handles.CloseOnExec();
 
     return 0;
 }
@@ -358,6 +365,7 @@ long SysMapFB(RegisterContext* r) {
     fbInfo.height = vMode.height;
     fbInfo.bpp = vMode.bpp;
     fbInfo.pitch = vMode.pitch;
+    fbInfo.pageCount = Video::FramebufferPageCount();
 
     if (HAL::debugMode)
         fbInfo.height = vMode.height / 3 * 2;
@@ -470,10 +478,10 @@ long SysMmap(RegisterContext* r) {
 
     bool fixed = flags & MAP_FIXED;
     bool anon = flags & MAP_ANON;
-    // bool privateMapping = flags & MAP_PRIVATE;
+    bool sharedMapping = flags & MAP_SHARED;
 
-    uint64_t unknownFlags = flags & ~static_cast<uint64_t>(MAP_ANON | MAP_FIXED | MAP_PRIVATE);
-    if (unknownFlags || !anon) {
+    uint64_t unknownFlags = flags & ~static_cast<uint64_t>(MAP_ANON | MAP_FIXED | MAP_PRIVATE | MAP_SHARED);
+    if (unknownFlags || (anon && sharedMapping)) {
         Log::Warning("SysMmap: Unsupported mmap flags %x", flags);
         return -EINVAL;
     }
@@ -485,7 +493,25 @@ long SysMmap(RegisterContext* r) {
         return -EINVAL;
     }
 
-    MappedRegion* region = proc->addressSpace->AllocateAnonymousVMObject(size, hint, fixed);
+    MappedRegion* region;
+    if (anon) {
+        region = proc->addressSpace->AllocateAnonymousVMObject(size, hint, fixed);
+    } else {
+        FancyRefPtr<UNIXOpenFile> handle = SC_TRY_OR_ERROR(proc->GetHandleAs<UNIXOpenFile>(SC_ARG4(r)));
+        size_t offset = SC_ARG5(r);
+        if (!handle->node->IsFile()) {
+            return -ENODEV;
+        }
+
+        if ((offset & (PAGE_SIZE_4K - 1)) || (hint & (PAGE_SIZE_4K - 1))) {
+            return -EINVAL;
+        }
+
+        size = (size + PAGE_SIZE_4K - 1) & ~static_cast<size_t>(PAGE_SIZE_4K - 1);
+        FancyRefPtr<VMObject> vmo = new FileVMObject(std::move(handle), offset, size, sharedMapping);
+        region = proc->addressSpace->MapVMO(vmo, hint, fixed);
+    }
+
     if (!region || !region->base) {
         IF_DEBUG((debugLevelSyscalls >= DebugLevelNormal), {
             Log::Error("SysMmap: Failed to map region (hint %x)!", hint);
@@ -613,11 +639,12 @@ long SysMunmap(RegisterContext* r) {
 }
 
 /*
- * SysCreateSharedMemory (key, size, flags, recipient) - Create Shared Memory
+ * SysCreateSharedMemory (key, size, flags, recipient, reserve) - Create Shared Memory
  * key - Pointer to memory key
  * size - memory size
  * flags - flags
  * recipient - (if private flag) PID of the process that can access memory
+ * reserve - (if reserve flag) size the memory can be grown to with SysGrowSharedMemory
  *
  * On Success - Return 0, key greater than 1
  * On Failure - Return -1, key null
@@ -627,8 +654,9 @@ long SysCreateSharedMemory(RegisterContext* r) {
     uint64_t size = SC_ARG1(r);
     uint64_t flags = SC_ARG2(r);
     uint64_t recipient = SC_ARG3(r);
+    uint64_t reserve = (flags & SMEM_FLAGS_RESERVE) ? SC_ARG4(r) : 0;
 
-    *key = Memory::CreateSharedMemory(size, flags, Scheduler::GetCurrentProcess()->PID(), recipient);
+    *key = Memory::CreateSharedMemory(size, flags, Scheduler::GetCurrentProcess()->PID(), recipient, reserve);
     assert(*key);
 
     return 0;
@@ -704,6 +732,24 @@ long SysDestroySharedMemory(RegisterContext* r) {
     return 0;
 }
 
+/*
+ * SysGrowSharedMemory (key, size) - Grow Shared Memory
+ * key - Memory key
+ * size - New size, at most the size reserved when the memory was created
+ *
+ * Existing mappings cover the reserved size so they see the new memory without being remapped.
+ * Only the owner can grow shared memory, it is never shrunk.
+ *
+ * On Success - return 0
+ * On Failure - return -EINVAL (bad key or size), -EPERM (not the owner), -ENOMEM
+ */
+long SysGrowSharedMemory(RegisterContext* r) {
+    int64_t key = SC_ARG0(r);
+    uint64_t size = SC_ARG1(r);
+
+    return Memory::GrowSharedMemory(key, size, Scheduler::GetCurrentProcess()->PID());
+}
+
 /*
  * SysSocket (domain, type, protocol) - Create socket
  * domain - socket domain
@@ -902,6 +948,91 @@ long SysSetUID(RegisterContext* r) {
     return 0;
 }
 
+// Send the data of one message, msg itself must already have been checked
+static long SendMessage(Process* proc, Socket* sock, msghdr* msg, uint64_t flags) {
+    UserIOVec iov;
+    if (long e = iov.Copy(proc, reinterpret_cast<uintptr_t>(msg->msg_iov), msg->msg_iovlen); e) {
+        IF_DEBUG(debugLevelSyscalls >= DebugLevelNormal, { Log::Warning("SysSendMsg: msg: Invalid iovec"); });
+        return e;
+    }
+
+    if (msg->msg_name && msg->msg_namelen &&
+        !Memory::CheckUsermodePointer((uintptr_t)msg->msg_name, msg->msg_namelen, proc->addressSpace)) {
+        IF_DEBUG(debugLevelSyscalls >= DebugLevelNormal,
+                 { Log::Warning("SysSendMsg: msg: Invalid name ptr and name not null"); });
+        return -EFAULT;
+    }
+
+    if (msg->msg_control && msg->msg_controllen &&
+        !Memory::CheckUsermodePointer((uintptr_t)msg->msg_control, msg->msg_controllen, proc->addressSpace)) {
+        IF_DEBUG(debugLevelSyscalls >= DebugLevelNormal,
+                 { Log::Warning("SysSendMsg: msg: Invalid control ptr and control null"); });
+        return -EFAULT;
+    }
+
+    long sent = 0;
+
+    for (int i = 0; i < iov.Count(); i++) {
+        // Control messages go with the first part of the data
+        long ret = sock->SendTo(iov.Get()[i].iov_base, iov.Get()[i].iov_len, flags, (sockaddr*)msg->msg_name,
+                                msg->msg_namelen, i ? nullptr : msg->msg_control, i ? 0 : msg->msg_controllen);
+
+        if (ret < 0)
+            return sent ? sent : ret;
+
+        sent += ret;
+        if (static_cast<size_t>(ret) < iov.Get()[i].iov_len) {
+            break;
+        }
+    }
+
+    return sent;
+}
+
+// Receive the data of one message, msg itself must already have been checked
+static long ReceiveMessage(Process* proc, Socket* sock, msghdr* msg, uint64_t flags) {
+    UserIOVec iov;
+    if (long e = iov.Copy(proc, reinterpret_cast<uintptr_t>(msg->msg_iov), msg->msg_iovlen); e) {
+        IF_DEBUG(debugLevelSyscalls >= DebugLevelNormal, { Log::Warning("SysRecvMsg: msg: Invalid iovec"); });
+        return e;
+    }
+
+    if (msg->msg_control && msg->msg_controllen &&
+        !Memory::CheckUsermodePointer((uintptr_t)msg->msg_control, msg->msg_controllen, proc->addressSpace)) {
+        IF_DEBUG(debugLevelSyscalls >= DebugLevelNormal,
+                 { Log::Warning("SysRecvMsg: msg: Invalid control ptr and control null"); });
+        return -EFAULT;
+    }
+
+    long read = 0;
+    size_t controlLength = msg->msg_control ? msg->msg_controllen : 0;
+
+    for (int i = 0; i < iov.Count(); i++) {
+        // Control messages come with the first part of the data, only wait for that part
+        socklen_t len = msg->msg_namelen;
+        long ret = sock->ReceiveFrom(iov.Get()[i].iov_base, iov.Get()[i].iov_len, i ? (flags | MSG_DONTWAIT) : flags,
+                                     reinterpret_cast<sockaddr*>(msg->msg_name), &len, i ? nullptr : msg->msg_control,
+                                     i ? nullptr : &controlLength);
+        msg->msg_namelen = len;
+
+        if (ret < 0) {
+            if (i) {
+                break; // Return what we have
+            }
+            return ret;
+        }
+
+        read += ret;
+        if (static_cast<size_t>(ret) < iov.Get()[i].iov_len) {
+            break;
+        }
+    }
+
+    msg->msg_controllen = controlLength;
+
+    return read;
+}
+
 /*
  * SysSend (sockfd, msg, flags) - Send data through a socket
  * sockfd - Socket file descriptor
@@ -937,46 +1068,7 @@ long SysSendMsg(RegisterContext* r) {
         return -EFAULT;
     }
 
-    if (!Memory::CheckUsermodePointer((uintptr_t)msg->msg_iov, sizeof(iovec) * msg->msg_iovlen, proc->addressSpace)) {
-
-        IF_DEBUG(debugLevelSyscalls >= DebugLevelNormal, { Log::Warning("SysSendMsg: msg: Invalid iovec ptr"); });
-        return -EFAULT;
-    }
-
-    if (msg->msg_name && msg->msg_namelen &&
-        !Memory::CheckUsermodePointer((uintptr_t)msg->msg_name, msg->msg_namelen, proc->addressSpace)) {
-        IF_DEBUG(debugLevelSyscalls >= DebugLevelNormal,
-                 { Log::Warning("SysSendMsg: msg: Invalid name ptr and name not null"); });
-        return -EFAULT;
-    }
-
-    if (msg->msg_control && msg->msg_controllen &&
-        !Memory::CheckUsermodePointer((uintptr_t)msg->msg_control, msg->msg_controllen, proc->addressSpace)) {
-        IF_DEBUG(debugLevelSyscalls >= DebugLevelNormal,
-                 { Log::Warning("SysSendMsg: msg: Invalid control ptr and control null"); });
-        return -EFAULT;
-    }
-
-    long sent = 0;
-    Socket* sock = (Socket*)handle->node;
-
-    for (unsigned i = 0; i < msg->msg_iovlen; i++) {
-        if (!Memory::CheckUsermodePointer((uintptr_t)msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len,
-                                          proc->addressSpace)) {
-            Log::Warning("SysSendMsg: msg: Invalid iovec entry base");
-            return -EFAULT;
-        }
-
-        long ret = sock->SendTo(msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len, flags, (sockaddr*)msg->msg_name,
-                                msg->msg_namelen, msg->msg_control, msg->msg_controllen);
-
-        if (ret < 0)
-            return ret;
-
-        sent += ret;
-    }
-
-    return sent;
+    return SendMessage(proc, (Socket*)handle->node, msg, flags);
 }
 
 /*
@@ -1016,42 +1108,123 @@ long SysRecvMsg(RegisterContext* r) {
         return -EFAULT;
     }
 
-    if (!Memory::CheckUsermodePointer((uintptr_t)msg->msg_iov, sizeof(iovec) * msg->msg_iovlen, proc->addressSpace)) {
-        IF_DEBUG(debugLevelSyscalls >= DebugLevelNormal, { Log::Warning("SysRecvMsg: msg: Invalid iovec ptr"); });
-        return -EFAULT;
+    return ReceiveMessage(proc, (Socket*)handle->node, msg, flags);
+}
+
+/*
+ * SysSendMMsg (sockfd, msgvec, vlen, flags) - Send several messages through a socket
+ * sockfd - Socket file descriptor
+ * msgvec - Array of message headers, msg_len of each is set to the amount of data sent
+ * vlen - Amount of message headers
+ * flags - flags
+ *
+ * On Success - return amount of messages sent
+ * On Failure - return -1
+ */
+long SysSendMMsg(RegisterContext* r) {
+    Process* proc = Scheduler::GetCurrentProcess();
+
+    FancyRefPtr<UNIXOpenFile> handle = SC_TRY_OR_ERROR(proc->GetHandleAs<UNIXOpenFile>(SC_ARG0(r)));
+    if (!handle) {
+        IF_DEBUG(debugLevelSyscalls >= DebugLevelNormal,
+                 { Log::Warning("SysSendMMsg: Invalid File Descriptor: %d", SC_ARG0(r)); });
+        return -EBADF;
     }
 
-    if (msg->msg_control && msg->msg_controllen &&
-        !Memory::CheckUsermodePointer((uintptr_t)msg->msg_control, msg->msg_controllen, proc->addressSpace)) {
+    mmsghdr* msgvec = (mmsghdr*)SC_ARG1(r);
+    unsigned vlen = MIN(SC_ARG2(r), static_cast<uint64_t>(MMSG_MAX));
+    uint64_t flags = SC_ARG3(r);
+
+    if ((handle->node->flags & FS_NODE_TYPE) != FS_NODE_SOCKET) {
         IF_DEBUG(debugLevelSyscalls >= DebugLevelNormal,
-                 { Log::Warning("SysRecvMsg: msg: Invalid control ptr and control null"); });
+                 { Log::Warning("SysSendMMsg: File (Descriptor: %d) is not a socket", SC_ARG0(r)); });
+        return -ENOTSOCK;
+    }
+
+    if (!Memory::CheckUsermodePointer(SC_ARG1(r), sizeof(mmsghdr) * vlen, proc->addressSpace)) {
+        IF_DEBUG(debugLevelSyscalls >= DebugLevelNormal, { Log::Warning("SysSendMMsg: Invalid msgvec ptr"); });
         return -EFAULT;
     }
 
-    long read = 0;
     Socket* sock = (Socket*)handle->node;
 
-    for (unsigned i = 0; i < msg->msg_iovlen; i++) {
-        if (!Memory::CheckUsermodePointer((uintptr_t)msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len,
-                                          proc->addressSpace)) {
-            Log::Warning("SysRecvMsg: msg: Invalid iovec entry base");
-            return -EFAULT;
+    unsigned sent = 0;
+    for (; sent < vlen; sent++) {
+        long ret = SendMessage(proc, sock, &msgvec[sent].msg_hdr, flags);
+        if (ret < 0) {
+            if (sent) {
+                break; // Report what was sent, the error comes back on the next call
+            }
+
+            return ret;
         }
 
-        socklen_t len = msg->msg_namelen;
-        long ret =
-            sock->ReceiveFrom(msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len, flags,
-                              reinterpret_cast<sockaddr*>(msg->msg_name), &len, msg->msg_control, msg->msg_controllen);
-        msg->msg_namelen = len;
+        msgvec[sent].msg_len = ret;
+    }
+
+    return sent;
+}
+
+/*
+ * SysRecvMMsg (sockfd, msgvec, vlen, flags) - Receive several messages through a socket
+ * sockfd - Socket file descriptor
+ * msgvec - Array of message headers, msg_len of each is set to the amount of data received
+ * vlen - Amount of message headers
+ * flags - flags, MSG_WAITFORONE only waits for the first message
+ *
+ * On Success - return amount of messages received
+ * On Failure - return -1
+ */
+long SysRecvMMsg(RegisterContext* r) {
+    Process* proc = Scheduler::GetCurrentProcess();
+
+    FancyRefPtr<UNIXOpenFile> handle = SC_TRY_OR_ERROR(proc->GetHandleAs<UNIXOpenFile>(SC_ARG0(r)));
+    if (!handle) {
+        IF_DEBUG(debugLevelSyscalls >= DebugLevelNormal,
+                 { Log::Warning("SysRecvMMsg: Invalid File Descriptor: %d", SC_ARG0(r)); });
+        return -EBADF;
+    }
+
+    mmsghdr* msgvec = (mmsghdr*)SC_ARG1(r);
+    unsigned vlen = MIN(SC_ARG2(r), static_cast<uint64_t>(MMSG_MAX));
+    uint64_t flags = SC_ARG3(r);
+
+    if (handle->mode & O_NONBLOCK) {
+        flags |= MSG_DONTWAIT; // Don't wait if socket marked as nonblock
+    }
 
+    if ((handle->node->flags & FS_NODE_TYPE) != FS_NODE_SOCKET) {
+        IF_DEBUG(debugLevelSyscalls >= DebugLevelNormal,
+                 { Log::Warning("SysRecvMMsg: File (Descriptor: %d) is not a socket", SC_ARG0(r)); });
+        return -ENOTSOCK;
+    }
+
+    if (!Memory::CheckUsermodePointer(SC_ARG1(r), sizeof(mmsghdr) * vlen, proc->addressSpace)) {
+        IF_DEBUG(debugLevelSyscalls >= DebugLevelNormal, { Log::Warning("SysRecvMMsg: Invalid msgvec ptr"); });
+        return -EFAULT;
+    }
+
+    Socket* sock = (Socket*)handle->node;
+
+    unsigned received = 0;
+    for (; received < vlen; received++) {
+        long ret = ReceiveMessage(proc, sock, &msgvec[received].msg_hdr, flags & ~MSG_WAITFORONE);
         if (ret < 0) {
+            if (received) {
+                break; // Report what was received, the error comes back on the next call
+            }
+
             return ret;
         }
 
-        read += ret;
+        msgvec[received].msg_len = ret;
+
+        if (flags & MSG_WAITFORONE) {
+            flags |= MSG_DONTWAIT; // Take whatever else is already queued
+        }
     }
 
-    return read;
+    return received;
 }
 
 /////////////////////////////
@@ -1122,7 +1295,17 @@ long SysGetProcessInfo(RegisterContext* r) {
     pInfo->activeUs = reqProcess->activeTicks * 1000000 / Timer::GetFrequency();
 
     pInfo->usedMem = reqProcess->addressSpace->UsedPhysicalMemory();
+    pInfo->sharedMem = reqProcess->addressSpace->SharedPhysicalMemory();
+    pInfo->cowMem = reqProcess->addressSpace->CopyOnWritePhysicalMemory();
+    pInfo->ipcMem = reqProcess->IPCMemory();
     pInfo->isCPUIdle = reqProcess->IsCPUIdleProcess();
+    pInfo->migrations = reqProcess->migrations;
+
+    pInfo->contextSwitches = reqProcess->contextSwitches;
+    pInfo->voluntarySwitches = reqProcess->voluntarySwitches;
+    pInfo->involuntarySwitches = reqProcess->involuntarySwitches;
+    pInfo->runQueueWaitUs = reqProcess->runQueueWaitUs;
+    pInfo->maxRunQueueWaitUs = reqProcess->maxRunQueueWaitUs;
 
     return 0;
 }
@@ -1176,7 +1359,17 @@ long SysGetNextProcessInfo(RegisterContext* r) {
     pInfo->activeUs = reqProcess->activeTicks * 1000000 / Timer::GetFrequency();
 
     pInfo->usedMem = reqProcess->addressSpace->UsedPhysicalMemory();
+    pInfo->sharedMem = reqProcess->addressSpace->SharedPhysicalMemory();
+    pInfo->cowMem = reqProcess->addressSpace->CopyOnWritePhysicalMemory();
+    pInfo->ipcMem = reqProcess->IPCMemory();
     pInfo->isCPUIdle = reqProcess->IsCPUIdleProcess();
+    pInfo->migrations = reqProcess->migrations;
+
+    pInfo->contextSwitches = reqProcess->contextSwitches;
+    pInfo->voluntarySwitches = reqProcess->voluntarySwitches;
+    pInfo->involuntarySwitches = reqProcess->involuntarySwitches;
+    pInfo->runQueueWaitUs = reqProcess->runQueueWaitUs;
+    pInfo->maxRunQueueWaitUs = reqProcess->maxRunQueueWaitUs;
 
     return 0;
 }
@@ -1221,33 +1414,25 @@ long SysExitThread(RegisterContext* r) {
 }
 
 /////////////////////////////
-/// \brief SysFutexWake(futex) Wake a thread waiting on a futex
+/// \brief SysFutexWake(futex) Wake a thread waiting on a private futex
 ///
 /// \param futex - (int*) Futex pointer
 ///
 /// \return 0 on success, error code on failure
 /////////////////////////////
 long SysFutexWake(RegisterContext* r) {
-    int* futex = reinterpret_cast<int*>(SC_ARG0(r));
-
-    if (!Memory::CheckUsermodePointer(SC_ARG0(r), sizeof(int), Scheduler::GetCurrentProcess()->addressSpace)) {
-        return EFAULT;
+    if (long ret = Futex::Wake(SC_ARG0(r), false, 1, FUTEX_BITSET_MATCH_ANY); ret < 0) {
+        return ret;
     }
 
-    Process* currentProcess = Scheduler::GetCurrentProcess();
+    return 0;
+}
 
-    acquireLock(&currentProcess->m_futexLock);
-    List<FutexThreadBlocker*>* blocked = nullptr;
-    if (!currentProcess->futexWaitQueue.get(reinterpret_cast<uintptr_t>(futex), blocked) || !blocked->get_length()) {
-        releaseLock(&currentProcess->m_futexLock);
-        return 0;
+long SysFutexWakeFast(SyscallFastFrame* r) {
+    if (long ret = Futex::Wake(SC_ARG0(r), false, 1, FUTEX_BITSET_MATCH_ANY); ret < 0) {
+        return ret;
     }
 
-    auto front = blocked->remove_at(0);
-    if (front && front->ShouldBlock())
-        front->Unblock();
-
-    releaseLock(&currentProcess->m_futexLock);
     return 0;
 }
 
@@ -1262,86 +1447,212 @@ long SysFutexWake(RegisterContext* r) {
 /// \return 0 on success, error code on failure
 /////////////////////////////
 long SysFutexWait(RegisterContext* r) {
-    int* futex = reinterpret_cast<int*>(SC_ARG0(r));
-
-    Process* currentProcess = Scheduler::GetCurrentProcess();
-    Thread* currentThread = Thread::Current();
-
-    if (!Memory::CheckUsermodePointer(SC_ARG0(r), sizeof(int), currentProcess->addressSpace)) {
-        return EFAULT;
+    long ret = Futex::Wait(SC_ARG0(r), false, static_cast<int>(SC_ARG1(r)), FUTEX_BITSET_MATCH_ANY, 0);
+    if (ret == -EAGAIN) {
+        return 0; // The value had already changed
     }
 
-    int expected = static_cast<int>(SC_ARG1(r));
-
-    List<FutexThreadBlocker*>* blocked;
+    return ret;
+}
 
-    acquireLock(&currentProcess->m_futexLock);
-    if (!currentProcess->futexWaitQueue.get(reinterpret_cast<uintptr_t>(futex), blocked)) {
-        blocked = new List<FutexThreadBlocker*>();
+/////////////////////////////
+/// \brief SysFutex(futex, op, val, val2, futex2, val3) Futex operation
+///
+/// Futexes are shared with other processes mapping the same shared memory unless FUTEX_PRIVATE_FLAG is set in op.
+///
+/// FUTEX_WAIT - Wait whilst *futex is val, val2 is the timeout in microseconds (0 for none)
+/// FUTEX_WAIT_BITSET - FUTEX_WAIT, only woken by wakes sharing a bit with val3
+/// FUTEX_WAKE - Wake up to val threads
+/// FUTEX_WAKE_BITSET - FUTEX_WAKE, only waking threads sharing a bit with val3
+/// FUTEX_REQUEUE - Wake up to val threads and move up to val2 other waiters to futex2
+/// FUTEX_CMP_REQUEUE - FUTEX_REQUEUE only if *futex is val3
+///
+/// \param futex (int*) Futex pointer
+/// \param op (int) Operation (see ABI/Futex.h)
+///
+/// \return Threads woken (and requeued) for wake and requeue, 0 for wait, negative error code on failure
+/////////////////////////////
+long SysFutex(RegisterContext* r) {
+    uintptr_t futex = SC_ARG0(r);
+    int op = static_cast<int>(SC_ARG1(r));
+    int val = static_cast<int>(SC_ARG2(r));
 
-        currentProcess->futexWaitQueue.insert(reinterpret_cast<uintptr_t>(futex), blocked);
+    bool shared = !(op & FUTEX_PRIVATE_FLAG);
+    switch (op & FUTEX_CMD_MASK) {
+    case FUTEX_WAIT:
+        return Futex::Wait(futex, shared, val, FUTEX_BITSET_MATCH_ANY, static_cast<long>(SC_ARG3(r)));
+    case FUTEX_WAIT_BITSET:
+        return Futex::Wait(futex, shared, val, static_cast<uint32_t>(SC_ARG5(r)), static_cast<long>(SC_ARG3(r)));
+    case FUTEX_WAKE:
+        return Futex::Wake(futex, shared, val, FUTEX_BITSET_MATCH_ANY);
+    case FUTEX_WAKE_BITSET:
+        return Futex::Wake(futex, shared, val, static_cast<uint32_t>(SC_ARG5(r)));
+    case FUTEX_REQUEUE:
+        return Futex::Requeue(futex, SC_ARG4(r), shared, val, static_cast<int>(SC_ARG3(r)), nullptr);
+    case FUTEX_CMP_REQUEUE: {
+        int expected = static_cast<int>(SC_ARG5(r));
+        return Futex::Requeue(futex, SC_ARG4(r), shared, val, static_cast<int>(SC_ARG3(r)), &expected);
     }
+    default:
+        return -ENOSYS;
+    }
+}
 
-    FutexThreadBlocker blocker;
-    blocked->add_back(&blocker);
-
-    releaseLock(&currentProcess->m_futexLock);
-
-    while (*futex == expected) {
-        if (currentThread->Block(&blocker)) {
-            acquireLock(&currentProcess->m_futexLock);
-            blocked->remove(&blocker);
-            releaseLock(&currentProcess->m_futexLock);
+// Wakes are the common case, anything else takes the slow path
+long SysFutexFast(SyscallFastFrame* r) {
+    uintptr_t futex = SC_ARG0(r);
+    int op = static_cast<int>(SC_ARG1(r));
+    int val = static_cast<int>(SC_ARG2(r));
 
-            return -EINTR; // We were interrupted
-        }
+    // Shared futexes take the address space region lock to find the physical address
+    if (!(op & FUTEX_PRIVATE_FLAG)) {
+        return SYSCALL_FAST_FALLBACK;
     }
 
-    blocked->remove(&blocker);
-
-    return 0;
+    switch (op & FUTEX_CMD_MASK) {
+    case FUTEX_WAKE:
+        return Futex::Wake(futex, false, val, FUTEX_BITSET_MATCH_ANY);
+    case FUTEX_WAKE_BITSET:
+        return Futex::Wake(futex, false, val, static_cast<uint32_t>(SC_ARG5(r)));
+    default:
+        return SYSCALL_FAST_FALLBACK;
+    }
 }
 
 /////////////////////////////
-/// \brief SysCreateService (name) - Create a service
+/// \brief SysEndpointMapRing (endpoint, info) Map the shared message rings of an endpoint
 ///
-/// Create a new service. Services are essentially named containers for interfaces, allowing one program to implement
-/// multiple interfaces under a service.
+/// Messages can then be written to and read from the rings without entering the kernel (see ABI/MessageRing.h)
 ///
-/// \param name (const char*) Service name to be used, must be unique
+/// \param endpoint (handle_t) Endpoint handle
+/// \param info (MessageRingInfo*) Populated with the address and layout of the rings
 ///
-/// \return Handle ID on success, error code on failure
+/// \return 0 on success, negative error code on failure
 /////////////////////////////
-long SysCreateService(RegisterContext* r) {
+long SysEndpointMapRing(RegisterContext* r) {
     Process* currentProcess = Scheduler::GetCurrentProcess();
 
-    size_t nameLength;
-    if (strlenSafe(reinterpret_cast<const char*>(SC_ARG0(r)), nameLength, currentProcess->addressSpace)) {
-        return -EFAULT;
+    UserPointer<MessageRingInfo> info = SC_ARG1(r);
+
+    Handle endpHandle;
+    if (!(endpHandle = currentProcess->GetHandle(SC_ARG0(r)))) {
+        Log::Warning("(%s): SysEndpointMapRing: Invalid handle ID %d", currentProcess->name, SC_ARG0(r));
+        return -EINVAL;
     }
 
-    char name[nameLength + 1];
-    strncpy(name, reinterpret_cast<const char*>(SC_ARG0(r)), nameLength);
-    name[nameLength] = 0;
+    if (!endpHandle.ko->IsType(MessageEndpoint::TypeID())) {
+        Log::Warning("SysEndpointMapRing: Invalid handle type (ID %d)", SC_ARG0(r));
+        return -EINVAL;
+    }
 
-    for (auto& svc : ServiceFS::Instance()->services) {
-        if (strncmp(svc->GetName(), name, nameLength) == 0) {
-            Log::Warning("SysCreateService: Service '%s' already exists!", svc->GetName());
-            return -EEXIST;
-        }
+    MessageEndpoint* endpoint = reinterpret_cast<MessageEndpoint*>(endpHandle.ko.get());
+
+    MessageRingInfo ringInfo;
+    if (long ret = endpoint->MapRing(currentProcess, ringInfo); ret) {
+        return ret;
     }
 
-    FancyRefPtr<Service> svc = ServiceFS::Instance()->CreateService(name);
-    return currentProcess->AllocateHandle(static_pointer_cast<KernelObject, Service>(svc));
+    TRY_STORE_UMODE_VALUE(info, ringInfo);
+    return 0;
 }
 
 /////////////////////////////
-/// \brief SysCreateInterface (service, name, msgSize) - Create a new interface
+/// \brief SysEndpointNotify (endpoint) Wake the peer of an endpoint
 ///
-/// Create a new interface. Interfaces allow clients to open connections to a service
+/// Called after writing to the ring of the peer when readerWaiting is set.
 ///
-/// \param service (handle_id_t) Handle ID of the service hosting the interface
-/// \param name (const char*) Name of the interface,
+/// \param endpoint (handle_t) Endpoint handle
+///
+/// \return 0 on success, negative error code on failure
+/////////////////////////////
+long SysEndpointNotify(RegisterContext* r) {
+    Process* currentProcess = Scheduler::GetCurrentProcess();
+
+    Handle endpHandle;
+    if (!(endpHandle = currentProcess->GetHandle(SC_ARG0(r)))) {
+        Log::Warning("(%s): SysEndpointNotify: Invalid handle ID %d", currentProcess->name, SC_ARG0(r));
+        return -EINVAL;
+    }
+
+    if (!endpHandle.ko->IsType(MessageEndpoint::TypeID())) {
+        Log::Warning("SysEndpointNotify: Invalid handle type (ID %d)", SC_ARG0(r));
+        return -EINVAL;
+    }
+
+    MessageEndpoint* endpoint = reinterpret_cast<MessageEndpoint*>(endpHandle.ko.get());
+    return endpoint->NotifyPeer();
+}
+
+/////////////////////////////
+/// \brief SysCreateService (name) - Create a service
+///
+/// Create a new service. Services are essentially named containers for interfaces, allowing one program to implement
+/// multiple interfaces under a service.
+///
+/// \param name (const char*) Service name to be used, must be unique
+///
+/// \return Handle ID on success, error code on failure
+/////////////////////////////
+long SysCreateService(RegisterContext* r) {
+    Process* currentProcess = Scheduler::GetCurrentProcess();
+
+    size_t nameLength;
+    if (strlenSafe(reinterpret_cast<const char*>(SC_ARG0(r)), nameLength, currentProcess->addressSpace)) {
+        return -EFAULT;
+    }
+
+    char name[nameLength + 1];
+    strncpy(name, reinterpret_cast<const char*>(SC_ARG0(r)), nameLength);
+    name[nameLength] = 0;
+
+    FancyRefPtr<Service> svc = ServiceFS::Instance()->CreateService(name);
+    if (!svc.get()) {
+        Log::Warning("SysCreateService: Service '%s' already exists!", name);
+        return -EEXIST;
+    }
+
+    return currentProcess->AllocateHandle(static_pointer_cast<KernelObject, Service>(svc));
+}
+
+/////////////////////////////
+/// \brief SysRegisterService (name) - Register a service ahead of time
+///
+/// Register a service so that it can be started when it is first used.
+/// Connections to the service wait for the process creating it to create the interface.
+/// The returned handle is signalled by the first connection, the service is kept
+/// registered until the handle is closed.
+///
+/// \param name (const char*) Name of the service
+///
+/// \return Handle ID of service on success, negative error code on failure
+/////////////////////////////
+long SysRegisterService(RegisterContext* r) {
+    Process* currentProcess = Scheduler::GetCurrentProcess();
+
+    size_t nameLength;
+    if (strlenSafe(reinterpret_cast<const char*>(SC_ARG0(r)), nameLength, currentProcess->addressSpace)) {
+        return -EFAULT;
+    }
+
+    char name[nameLength + 1];
+    strncpy(name, reinterpret_cast<const char*>(SC_ARG0(r)), nameLength);
+    name[nameLength] = 0;
+
+    FancyRefPtr<Service> svc = ServiceFS::Instance()->RegisterService(name);
+    if (!svc.get()) {
+        return -EEXIST;
+    }
+
+    return currentProcess->AllocateHandle(static_pointer_cast<KernelObject, Service>(svc));
+}
+
+/////////////////////////////
+/// \brief SysCreateInterface (service, name, msgSize) - Create a new interface
+///
+/// Create a new interface. Interfaces allow clients to open connections to a service
+///
+/// \param service (handle_id_t) Handle ID of the service hosting the interface
+/// \param name (const char*) Name of the interface,
 /// \param msgSize (uint16_t) Maximum message size for all connections
 ///
 /// \return Handle ID of service on success, negative error code on failure
@@ -1439,16 +1750,15 @@ long SysInterfaceConnect(RegisterContext* r) {
         return -EINVAL;
     }
 
-    FancyRefPtr<MessageInterface> interface;
-    {
-        FancyRefPtr<Service> svc;
-        if (ServiceFS::Instance()->ResolveServiceName(svc, path)) {
-            return -ENOENT; // No such service
-        }
+    FancyRefPtr<Service> svc;
+    if (ServiceFS::Instance()->ResolveServiceName(svc, path)) {
+        return -ENOENT; // No such service
+    }
 
-        if (svc->ResolveInterface(interface, strchr(path, '/') + 1)) {
-            return -ENOENT; // No such interface
-        }
+    // Registered services are started on the first connection, which waits for the interface to be created
+    FancyRefPtr<MessageInterface> interface;
+    if (long ret = svc->ConnectInterface(interface, strchr(path, '/') + 1); ret) {
+        return ret;
     }
 
     FancyRefPtr<MessageEndpoint> endp = interface->Connect();
@@ -1564,6 +1874,187 @@ long SysEndpointDequeue(RegisterContext* r) {
                           reinterpret_cast<uint8_t*>(SC_ARG3(r)));
 }
 
+// Take the memory attached to a message, which must be a whole region of the process.
+// Shared objects are shared with the receiver, private anonymous memory is unmapped from the process.
+static long TakeMessageMemory(Process* process, uintptr_t base, size_t size, FancyRefPtr<VMObject>& memory) {
+    MappedRegion* region = process->addressSpace->AddressToRegionWriteLock(base);
+    if (!region) {
+        return -EFAULT;
+    }
+
+    if (region->Base() != base || region->Size() != size || !region->vmObject.get()) {
+        region->lock.ReleaseWrite();
+        return -EINVAL;
+    }
+
+    memory = region->vmObject;
+    if (memory->IsShared()) {
+        region->lock.ReleaseWrite();
+        return 0;
+    }
+
+    // Moving the memory is only safe if nothing else maps it (e.g. after a fork)
+    if (!memory->IsAnonymous() || !memory->CanMunmap() || memory->ReferenceCount() != 1) {
+        memory = nullptr;
+        region->lock.ReleaseWrite();
+        return -EINVAL;
+    }
+
+    long ret = process->addressSpace->UnmapRegion(region);
+    assert(!ret);
+    return 0;
+}
+
+// Give memory taken by TakeMessageMemory back to the process when the message could not be queued
+static void ReturnMessageMemory(Process* process, uintptr_t base, const FancyRefPtr<VMObject>& memory) {
+    if (memory->IsShared()) {
+        return; // Never unmapped
+    }
+
+    if (!process->addressSpace->MapVMO(memory, base, true)) {
+        // Another thread has mapped something in its place
+        Log::Warning("(%s): Failed to map back message memory at %x", process->name, base);
+    }
+}
+
+/////////////////////////////
+/// \brief SysEndpointQueueBatch (endpoint, messages, count) - Queue several messages on an endpoint
+///
+/// Messages are queued in order, stopping at the first one that fails.
+/// Memory attached to a message (see EndpointMessageDescriptor) is handed to the receiver without copying,
+/// private anonymous memory is unmapped from the sender and mapped back if the message could not be queued.
+///
+/// \param endpoint (handle_id_t) Handle ID of specified endpoint
+/// \param messages (EndpointMessageDescriptor*) Messages to queue
+/// \param count (unsigned) Amount of messages, at most ENDPOINT_BATCH_MAX
+///
+/// \return Amount of messages queued, negative error code if the first message could not be queued
+/////////////////////////////
+long SysEndpointQueueBatch(RegisterContext* r) {
+    Process* currentProcess = Scheduler::GetCurrentProcess();
+
+    Handle endpHandle;
+    if (!(endpHandle = currentProcess->GetHandle(SC_ARG0(r)))) {
+        Log::Warning("(%s): SysEndpointQueueBatch: Invalid handle ID %d", currentProcess->name, SC_ARG0(r));
+        return -EBADF;
+    }
+
+    if (!endpHandle.ko->IsType(MessageEndpoint::TypeID())) {
+        Log::Warning("SysEndpointQueueBatch: Invalid handle type (ID %d)", SC_ARG0(r));
+        return -EINVAL;
+    }
+
+    unsigned count = SC_ARG2(r);
+    if (count > ENDPOINT_BATCH_MAX) {
+        return -EINVAL;
+    }
+
+    MessageEndpoint* endpoint = reinterpret_cast<MessageEndpoint*>(endpHandle.ko.get());
+
+    uintptr_t messages = SC_ARG1(r);
+    for (unsigned i = 0; i < count; i++) {
+        EndpointMessageDescriptor msg;
+        long ret;
+        if (UserPointer<EndpointMessageDescriptor>(messages + i * sizeof(msg)).GetValue(msg)) {
+            ret = -EFAULT;
+        } else if (msg.size && !Memory::CheckUsermodePointer(msg.data, msg.size, currentProcess->addressSpace)) {
+            ret = -EFAULT;
+        } else if (msg.memory) {
+            FancyRefPtr<VMObject> memory;
+            if (!(ret = TakeMessageMemory(currentProcess, msg.memory, msg.memorySize, memory))) {
+                if ((ret = endpoint->Write(msg.id, msg.size, msg.data, memory)) < 0) {
+                    ReturnMessageMemory(currentProcess, msg.memory, memory);
+                }
+            }
+        } else {
+            ret = endpoint->Write(msg.id, msg.size, msg.data);
+        }
+
+        if (ret < 0) {
+            return i ? i : ret;
+        }
+    }
+
+    return count;
+}
+
+/////////////////////////////
+/// \brief SysEndpointDequeueBatch (endpoint, messages, count) - Dequeue several messages from an endpoint
+///
+/// \param endpoint (handle_id_t) Handle ID of specified endpoint
+/// \param messages (EndpointMessageDescriptor*) Buffers for the messages, the ID and size of each are filled in
+/// along with the address and size of any memory attached to the message, which is now mapped into the process
+/// \param count (unsigned) Amount of buffers, at most ENDPOINT_BATCH_MAX
+///
+/// \return Amount of messages dequeued (0 on empty), negative error code on failure
+/////////////////////////////
+long SysEndpointDequeueBatch(RegisterContext* r) {
+    Process* currentProcess = Scheduler::GetCurrentProcess();
+
+    Handle endpHandle;
+    if (!(endpHandle = currentProcess->GetHandle(SC_ARG0(r)))) {
+        Log::Warning("(%s): SysEndpointDequeueBatch: Invalid handle ID %d", currentProcess->name, SC_ARG0(r));
+        return -EINVAL;
+    }
+
+    if (!endpHandle.ko->IsType(MessageEndpoint::TypeID())) {
+        Log::Warning("SysEndpointDequeueBatch: Invalid handle type (ID %d)", SC_ARG0(r));
+        return -EINVAL;
+    }
+
+    unsigned count = SC_ARG2(r);
+    if (count > ENDPOINT_BATCH_MAX) {
+        return -EINVAL;
+    }
+
+    MessageEndpoint* endpoint = reinterpret_cast<MessageEndpoint*>(endpHandle.ko.get());
+
+    uintptr_t messages = SC_ARG1(r);
+    for (unsigned i = 0; i < count; i++) {
+        UserPointer<EndpointMessageDescriptor> desc = messages + i * sizeof(EndpointMessageDescriptor);
+
+        EndpointMessageDescriptor msg;
+        FancyRefPtr<VMObject> memory;
+        MessageEndpoint::Message* taken;
+        long ret;
+        if (desc.GetValue(msg) ||
+            !Memory::CheckUsermodePointer(msg.data, endpoint->GetMaxMessageSize(), currentProcess->addressSpace)) {
+            ret = -EFAULT;
+        } else if ((ret = endpoint->Read(&msg.id, &msg.size, reinterpret_cast<uint8_t*>(msg.data), &memory,
+                                         &taken)) > 0) {
+            msg.memory = 0;
+            msg.memorySize = 0;
+
+            if (memory.get()) {
+                MappedRegion* region = currentProcess->addressSpace->MapVMO(memory, 0, false);
+                if (region) {
+                    msg.memory = region->Base();
+                    msg.memorySize = region->Size();
+                } else {
+                    Log::Warning("(%s): SysEndpointDequeueBatch: Failed to map message memory", currentProcess->name);
+                }
+            }
+
+            if (desc.StoreValue(msg)) {
+                // Leave the message for the next read rather than dropping it
+                if (msg.memory) {
+                    currentProcess->addressSpace->UnmapMemory(msg.memory, msg.memorySize);
+                }
+                endpoint->FinishRead(taken, false, std::move(memory));
+                ret = -EFAULT;
+            } else {
+                endpoint->FinishRead(taken, true);
+            }
+        }
+
+        if (ret <= 0) {
+            return (i || !ret) ? i : ret; // Empty, or hand back what we have before reporting an error
+        }
+    }
+
+    return count;
+}
+
 /////////////////////////////
 /// \brief SysEndpointCall (endpoint, id, data, rID, rData, size, timeout)
 ///
@@ -1600,7 +2091,67 @@ long SysEndpointCall(RegisterContext* r) {
 
     MessageEndpoint* endpoint = reinterpret_cast<MessageEndpoint*>(endpHandle.ko.get());
 
-    return endpoint->Call(SC_ARG1(r), *size, SC_ARG2(r), SC_ARG3(r), size, reinterpret_cast<uint8_t*>(SC_ARG4(r)), -1);
+    uint16_t returnSize = endpoint->GetMaxMessageSize();
+    long ret = endpoint->Call(SC_ARG1(r), *size, SC_ARG2(r), SC_ARG3(r), &returnSize,
+                              reinterpret_cast<uint8_t*>(SC_ARG4(r)), -1);
+    if (!ret) {
+        *size = returnSize;
+    }
+    return ret;
+}
+
+/////////////////////////////
+/// \brief SysEndpointCallTimeout (endpoint, call, response, timeout)
+///
+/// Send a message and wait for the response, giving up after the timeout
+///
+/// \param endpoint (handle_id_t) Handle ID of specified endpoint
+/// \param call (EndpointMessageDescriptor*) Message to send
+/// \param response (EndpointMessageDescriptor*) ID of the expected response, buffer for its data and size of the
+/// buffer, the size is replaced with the size of the response
+/// \param timeout (int64_t) Timeout in us, -1 for no timeout
+///
+/// \return 0 on success, -ETIMEDOUT on timeout, -EMSGSIZE if the response does not fit, negative error code on failure
+/////////////////////////////
+long SysEndpointCallTimeout(RegisterContext* r) {
+    Process* currentProcess = Scheduler::GetCurrentProcess();
+
+    Handle endpHandle;
+    if (!(endpHandle = currentProcess->GetHandle(SC_ARG0(r)))) {
+        Log::Warning("(%s): SysEndpointCallTimeout: Invalid handle ID %d", currentProcess->name, SC_ARG0(r));
+        return -EINVAL;
+    }
+
+    if (!endpHandle.ko->IsType(MessageEndpoint::TypeID())) {
+        Log::Warning("SysEndpointCallTimeout: Invalid handle type (ID %d)", SC_ARG0(r));
+        return -EINVAL;
+    }
+
+    MessageEndpoint* endpoint = reinterpret_cast<MessageEndpoint*>(endpHandle.ko.get());
+
+    UserPointer<EndpointMessageDescriptor> callPtr = SC_ARG1(r);
+    UserPointer<EndpointMessageDescriptor> responsePtr = SC_ARG2(r);
+
+    EndpointMessageDescriptor call, response;
+    TRY_GET_UMODE_VALUE(callPtr, call);
+    TRY_GET_UMODE_VALUE(responsePtr, response);
+
+    if (call.size && !Memory::CheckUsermodePointer(call.data, call.size, currentProcess->addressSpace)) {
+        return -EFAULT;
+    }
+
+    if (response.size && !Memory::CheckUsermodePointer(response.data, response.size, currentProcess->addressSpace)) {
+        return -EFAULT;
+    }
+
+    long ret = endpoint->Call(call.id, call.size, call.data, response.id, &response.size,
+                              reinterpret_cast<uint8_t*>(response.data), static_cast<int64_t>(SC_ARG3(r)));
+    if (ret) {
+        return ret;
+    }
+
+    TRY_STORE_UMODE_VALUE(responsePtr, response);
+    return 0;
 }
 
 /////////////////////////////
@@ -1639,6 +2190,110 @@ long SysEndpointInfo(RegisterContext* r) {
     return 0;
 }
 
+/////////////////////////////
+/// \brief SysEndpointStatistics (pid, handle, stats)
+///
+/// Get the message counters of the first endpoint of a process with a handle ID of at least \a handle,
+/// all of the endpoints of a process can be listed by passing the returned ID + 1.
+///
+/// \param pid (pid_t) PID of the process, 0 for the calling process
+/// \param handle (handle_id_t) Handle ID to start looking from
+/// \param stats (EndpointStatistics*) Filled with the counters of the endpoint
+///
+/// \return Handle ID of the endpoint on success, -ENOENT if there are no more endpoints, negative error code on failure
+/////////////////////////////
+long SysEndpointStatistics(RegisterContext* r) {
+    Process* currentProcess = Scheduler::GetCurrentProcess();
+    UserPointer<EndpointStatistics> stats = SC_ARG2(r);
+
+    FancyRefPtr<Process> process;
+    if (SC_ARG0(r)) {
+        if (!(process = Scheduler::FindProcessByPID(SC_ARG0(r))).get()) {
+            return -ESRCH;
+        }
+
+        // Only root may look at the endpoints of another user's processes
+        if (currentProcess->euid != 0 && currentProcess->euid != process->uid) {
+            return -EPERM;
+        }
+    }
+    Process* target = process.get() ? process.get() : currentProcess;
+
+    long handleCount = target->HandleCount();
+    for (long id = SC_ARG1(r); id >= 0 && id < handleCount; id++) {
+        Handle h = target->GetHandle(id);
+        if (!h.IsValid() || !h.ko->IsType(MessageEndpoint::TypeID())) {
+            continue;
+        }
+
+        EndpointStatistics endpStats;
+        reinterpret_cast<MessageEndpoint*>(h.ko.get())->GetStatistics(endpStats);
+        endpStats.handle = id;
+
+        if (stats.StoreValue(endpStats)) {
+            return -EFAULT;
+        }
+        return id;
+    }
+
+    return -ENOENT;
+}
+
+/////////////////////////////
+/// \brief SysIORingCreate (entries, info) Create submission and completion rings
+///
+/// The rings are mapped into the process (see ABI/IORing.h), submitted operations are run with SysIORingEnter.
+///
+/// \param entries (uint32_t) Submission ring entries, rounded up to a power of two
+/// \param info (IORingInfo*) Populated with the address and layout of the rings
+///
+/// \return Handle ID of the rings on success, negative error code on failure
+/////////////////////////////
+long SysIORingCreate(RegisterContext* r) {
+    Process* currentProcess = Scheduler::GetCurrentProcess();
+
+    UserPointer<IORingInfo> info = SC_ARG1(r);
+
+    IORingInfo ringInfo;
+    auto ring = IORing::Create(currentProcess, static_cast<uint32_t>(SC_ARG0(r)), ringInfo);
+    if (ring.HasError()) {
+        return -ring.err.code;
+    }
+
+    TRY_STORE_UMODE_VALUE(info, ringInfo);
+    return currentProcess->AllocateHandle(static_pointer_cast<KernelObject>(ring.Value()));
+}
+
+/////////////////////////////
+/// \brief SysIORingEnter (ring, minComplete, timeout) Run submitted operations
+///
+/// Every submission in the submission ring is consumed whilst there is room in the completion ring.
+/// Operations that would block are completed on a later call.
+///
+/// \param ring (handle_t) Handle ID of the rings
+/// \param minComplete (uint32_t) Wait until at least this many completions are in the completion ring
+/// \param timeout (long) Most time to wait in microseconds, negative to wait forever
+///
+/// \return Amount of submissions consumed on success, negative error code on failure
+/////////////////////////////
+long SysIORingEnter(RegisterContext* r) {
+    Process* currentProcess = Scheduler::GetCurrentProcess();
+
+    Handle ringHandle;
+    if (!(ringHandle = currentProcess->GetHandle(SC_ARG0(r)))) {
+        Log::Warning("(%s): SysIORingEnter: Invalid handle ID %d", currentProcess->name, SC_ARG0(r));
+        return -EINVAL;
+    }
+
+    if (!ringHandle.ko->IsType(IORing::TypeID())) {
+        Log::Warning("SysIORingEnter: Invalid handle type (ID %d)", SC_ARG0(r));
+        return -EINVAL;
+    }
+
+    IORing* ring = reinterpret_cast<IORing*>(ringHandle.ko.get());
+    return ring->Enter(static_cast<uint32_t>(SC_ARG1(r)), static_cast<long>(SC_ARG2(r)));
+}
+
 /////////////////////////////
 /// \brief SysKernelObjectWaitOne (object)
 ///
@@ -1680,7 +2335,8 @@ long SysKernelObjectWaitOne(RegisterContext* r) {
 /////////////////////////////
 /// \brief SysKernelObjectWait (objects, count)
 ///
-/// Wait on one KernelObject
+/// Wait on several KernelObjects, returning when any of them is signalled.
+/// File descriptors are signalled when readable.
 ///
 /// \param objects (handle_t*) Pointer to array of handles to wait on
 /// \param count (size_t) Amount of objects to wait on
@@ -1729,6 +2385,84 @@ long SysKernelObjectWait(RegisterContext* r) {
     return 0;
 }
 
+/////////////////////////////
+/// \brief SysWaitSetCreate () Create a wait set
+///
+/// Kernel objects stay in a wait set between waits, so waiting only costs as much as the objects which are ready.
+///
+/// \return Handle ID of the wait set on success, negative error code on failure
+/////////////////////////////
+long SysWaitSetCreate(RegisterContext* r) {
+    Process* currentProcess = Scheduler::GetCurrentProcess();
+
+    return currentProcess->AllocateHandle(FancyRefPtr<KernelObject>(new WaitSet()));
+}
+
+/////////////////////////////
+/// \brief SysWaitSetAdd (set, object) Add a kernel object to a wait set
+///
+/// The wait set keeps the object until it is removed, even once its handle is closed.
+///
+/// \param set (handle_id_t) Handle ID of the wait set
+/// \param object (handle_id_t) Handle ID of the object, reported by SysWaitSetWait when the object is ready
+///
+/// \return 0 on success, negative error code on failure
+/////////////////////////////
+long SysWaitSetAdd(RegisterContext* r) {
+    Process* currentProcess = Scheduler::GetCurrentProcess();
+
+    FancyRefPtr<WaitSet> set = SC_TRY_OR_ERROR(currentProcess->GetHandleAs<WaitSet>(SC_ARG0(r)));
+
+    Handle handle = currentProcess->GetHandle(SC_ARG1(r));
+    if (!handle) {
+        return -EBADF;
+    } else if (handle.ko->IsType(WaitSet::TypeID())) {
+        return -EINVAL; // Wait sets cannot be nested
+    }
+
+    return set->Add(handle.id, handle.ko);
+}
+
+/////////////////////////////
+/// \brief SysWaitSetRemove (set, object) Remove a kernel object from a wait set
+///
+/// \param set (handle_id_t) Handle ID of the wait set
+/// \param object (handle_id_t) Handle ID the object was added with
+///
+/// \return 0 on success, negative error code on failure
+/////////////////////////////
+long SysWaitSetRemove(RegisterContext* r) {
+    Process* currentProcess = Scheduler::GetCurrentProcess();
+
+    FancyRefPtr<WaitSet> set = SC_TRY_OR_ERROR(currentProcess->GetHandleAs<WaitSet>(SC_ARG0(r)));
+    return set->Remove(static_cast<handle_id_t>(SC_ARG1(r)));
+}
+
+/////////////////////////////
+/// \brief SysWaitSetWait (set, ready, count, timeout) Wait on a wait set
+///
+/// Objects may be reported when they are not ready, and are reported again by later waits whilst they stay ready.
+///
+/// \param set (handle_id_t) Handle ID of the wait set
+/// \param ready (handle_id_t*) Filled with the handle IDs of ready objects
+/// \param count (int) Most handle IDs to store in ready
+/// \param timeout (long) Timeout in microseconds, 0 to return immediately and negative to wait indefinitely
+///
+/// \return Amount of handle IDs stored in ready on success, negative error code on failure
+/////////////////////////////
+long SysWaitSetWait(RegisterContext* r) {
+    Process* currentProcess = Scheduler::GetCurrentProcess();
+
+    FancyRefPtr<WaitSet> set = SC_TRY_OR_ERROR(currentProcess->GetHandleAs<WaitSet>(SC_ARG0(r)));
+
+    int count = static_cast<int>(SC_ARG2(r));
+    if (count <= 0) {
+        return -EINVAL;
+    }
+
+    return set->Wait(UserBuffer<handle_id_t>(SC_ARG1(r)), count, static_cast<long>(SC_ARG3(r)));
+}
+
 /////////////////////////////
 /// \brief SysKernelObjectDestroy (object)
 ///
@@ -1930,10 +2664,31 @@ long SysDeviceManagement(RegisterContext* r) {
 
         return dev->Type();
     }
-    case DeviceManager::RequestDeviceGetChildCount:
-        return -ENOSYS;
-    case DeviceManager::RequestDeviceEnumerateChildren:
-        return -ENOSYS;
+    case DeviceManager::RequestDeviceGetChildCount:
+        return -ENOSYS;
+    case DeviceManager::RequestDeviceEnumerateChildren:
+        return -ENOSYS;
+    case DeviceManager::RequestDeviceGetDiskStatistics: {
+        int64_t deviceID = SC_ARG1(r);
+        UserPointer<DiskStatistics> stats = SC_ARG2(r);
+
+        Device* dev = DeviceManager::DeviceFromID(deviceID);
+        if (!dev) {
+            return -ENOENT;
+        }
+
+        if (dev->Type() != DeviceTypeStorageDevice) {
+            return -ENODEV; // Only disks keep I/O statistics
+        }
+
+        DiskStatistics diskStats;
+        static_cast<DiskDevice*>(dev)->GetStatistics(diskStats);
+
+        if (stats.StoreValue(diskStats)) {
+            return -EFAULT;
+        }
+        return 0;
+    }
     default:
         return -EINVAL;
     }
@@ -2376,6 +3131,440 @@ long SysGetResourceLimit(RegisterContext* r) {
     return -ENOSYS;
 }
 
+/////////////////////////////
+/// \brief SysSetSchedulingClass(tid, schedClass)
+///
+/// Set the scheduling class of a thread in the current process
+///
+/// \param tid Thread ID, 0 for the calling thread
+/// \param schedClass Scheduling class (see ABI/Process.h)
+///
+/// \return 0 on success, negative error code on failure
+/// \return -EINVAL if schedClass is invalid
+/// \return -ESRCH if the thread does not exist
+/// \return -EPERM if attempting to set the realtime class without being root
+/////////////////////////////
+long SysSetSchedulingClass(RegisterContext* r) {
+    Process* process = Scheduler::GetCurrentProcess();
+
+    long tid = SC_ARG0(r);
+    int schedClass = SC_ARG1(r);
+
+    if (schedClass < 0 || schedClass >= SchedulingClassCount) {
+        return -EINVAL;
+    }
+
+    if (schedClass == SchedulingClassRealtime && process->euid != 0) {
+        return -EPERM; // Only root may starve the rest of the system
+    }
+
+    FancyRefPtr<Thread> th;
+    if (tid) {
+        th = process->GetThreadFromTID(tid);
+    } else {
+        th = process->GetThreadFromTID(Thread::Current()->tid);
+    }
+
+    if (!th.get()) {
+        return -ESRCH;
+    }
+
+    Scheduler::SetSchedulingClass(th.get(), schedClass);
+    return 0;
+}
+
+/////////////////////////////
+/// \brief SysGetSchedulingClass(tid)
+///
+/// Get the scheduling class of a thread in the current process
+///
+/// \param tid Thread ID, 0 for the calling thread
+///
+/// \return Scheduling class on success, negative error code on failure
+/// \return -ESRCH if the thread does not exist
+/////////////////////////////
+long SysGetSchedulingClass(RegisterContext* r) {
+    Process* process = Scheduler::GetCurrentProcess();
+
+    long tid = SC_ARG0(r);
+    if (!tid) {
+        return Thread::Current()->schedulingClass;
+    }
+
+    auto th = process->GetThreadFromTID(tid);
+    if (!th.get()) {
+        return -ESRCH;
+    }
+
+    return th->schedulingClass;
+}
+
+/////////////////////////////
+/// \brief SysGetCPUInfo(cpu, info)
+///
+/// Get scheduler statistics for a CPU
+///
+/// \param cpu Index of the CPU (0 to cpuCount - 1)
+/// \param info Pointer to lemon_cpu_info_t structure
+///
+/// \return 0 on success, negative error code on failure
+/// \return -EINVAL if cpu is out of range
+/// \return -EFAULT if info is invalid
+/////////////////////////////
+long SysGetCPUInfo(RegisterContext* r) {
+    unsigned index = SC_ARG0(r);
+    UserPointer<lemon_cpu_info_t> info = SC_ARG1(r);
+
+    if (index >= SMP::processorCount) {
+        return -EINVAL;
+    }
+
+    CPU* cpu = SMP::cpus[index];
+    uint64_t now = Timer::UsecondsSinceBoot();
+
+    // Include the current idle period
+    uint64_t idleUs = cpu->idleUs;
+    if (cpu->currentThread == cpu->idleThread) {
+        uint64_t idleSince = cpu->idleSince;
+        if (now > idleSince) {
+            idleUs += now - idleSince;
+        }
+    }
+
+    lemon_cpu_info_t cpuInfo = {
+        .id = static_cast<uint16_t>(cpu->id),
+        .busyUs = (now > idleUs) ? (now - idleUs) : 0,
+        .idleUs = idleUs,
+        .contextSwitches = cpu->contextSwitches,
+        .migrations = cpu->migrations,
+        .cacheMigrations = cpu->cacheMigrations,
+        .runQueueLength = Scheduler::RunQueueLength(cpu),
+        .numaNode = cpu->numaNode,
+        .nodeMigrations = cpu->nodeMigrations,
+    };
+
+    TRY_STORE_UMODE_VALUE(info, cpuInfo);
+    return 0;
+}
+
+/////////////////////////////
+/// \brief SysSetAffinity(tid, mask)
+///
+/// Set the mask of CPUs a thread in the current process may run on
+///
+/// \param tid Thread ID, 0 for the calling thread
+/// \param mask Mask of CPUs (bit n for CPU n), 0 for any CPU that has not been isolated
+///
+/// \return 0 on success, negative error code on failure
+/// \return -EINVAL if mask contains no online CPUs
+/// \return -ESRCH if the thread does not exist
+/////////////////////////////
+long SysSetAffinity(RegisterContext* r) {
+    Process* process = Scheduler::GetCurrentProcess();
+
+    long tid = SC_ARG0(r);
+    uint64_t mask = SC_ARG1(r);
+
+    if (mask && !(mask & SMP::OnlineCPUMask())) {
+        return -EINVAL;
+    }
+
+    FancyRefPtr<Thread> th;
+    if (tid) {
+        th = process->GetThreadFromTID(tid);
+    } else {
+        th = process->GetThreadFromTID(Thread::Current()->tid);
+    }
+
+    if (!th.get()) {
+        return -ESRCH;
+    }
+
+    Scheduler::SetAffinity(th.get(), mask);
+
+    // Get off a CPU we are no longer allowed on
+    if (th.get() == Thread::Current() && !Scheduler::CPUAllowed(th.get(), GetCPULocal())) {
+        Scheduler::Yield();
+    }
+    return 0;
+}
+
+/////////////////////////////
+/// \brief SysGetAffinity(tid, mask)
+///
+/// Get the mask of CPUs a thread in the current process may run on
+///
+/// \param tid Thread ID, 0 for the calling thread
+/// \param mask Pointer to uint64_t, set to the mask of CPUs the thread may run on
+///
+/// \return 0 on success, negative error code on failure
+/// \return -ESRCH if the thread does not exist
+/// \return -EFAULT if mask is invalid
+/////////////////////////////
+long SysGetAffinity(RegisterContext* r) {
+    Process* process = Scheduler::GetCurrentProcess();
+
+    long tid = SC_ARG0(r);
+    UserPointer<uint64_t> mask = SC_ARG1(r);
+
+    FancyRefPtr<Thread> th;
+    if (tid) {
+        th = process->GetThreadFromTID(tid);
+    } else {
+        th = process->GetThreadFromTID(Thread::Current()->tid);
+    }
+
+    if (!th.get()) {
+        return -ESRCH;
+    }
+
+    TRY_STORE_UMODE_VALUE(mask, Scheduler::AllowedCPUs(th.get()) & SMP::OnlineCPUMask());
+    return 0;
+}
+
+/////////////////////////////
+/// \brief SysGetMemoryInfo(info)
+///
+/// Get a breakdown of what physical memory is being used for.
+/// The counters are kept up to date as memory is allocated so this is cheap to poll.
+///
+/// \param info Pointer to lemon_memory_info_t structure
+///
+/// \return 0 on success, negative error code on failure
+/// \return -EFAULT if info is invalid
+/////////////////////////////
+long SysGetMemoryInfo(RegisterContext* r) {
+    UserPointer<lemon_memory_info_t> info = SC_ARG0(r);
+
+    auto usageKB = [](Memory::MemoryUsage usage) -> uint64_t {
+        int64_t bytes = __atomic_load_n(&Memory::memoryUsage[usage], __ATOMIC_RELAXED);
+        return (bytes > 0) ? (bytes / 1024) : 0;
+    };
+
+    lemon_memory_info_t memInfo = {
+        .totalMem = HAL::mem_info.totalMemory / 1024,
+        .usedMem = Memory::usedPhysicalBlocks * 4,
+        .kernelHeap = usageKB(Memory::MemoryUsageKernelHeap),
+        .pageCache = usageKB(Memory::MemoryUsagePageCache),
+        .blockCache = usageKB(Memory::MemoryUsageBlockCache),
+        .anonymous = usageKB(Memory::MemoryUsageAnonymous),
+        .swapPool = usageKB(Memory::MemoryUsageSwapPool),
+        .swapped = Memory::GetSwapStatistics().swappedPages * 4,
+        .swapDisk = Memory::GetSwapStatistics().diskPages * 4,
+    };
+
+    TRY_STORE_UMODE_VALUE(info, memInfo);
+    return 0;
+}
+
+// Copy a null terminated array of usermode strings
+static long CopyUserStrings(char** strings, Vector<String>& out, AddressSpace* addressSpace) {
+    for (int i = 0;; i++) {
+        char* string;
+        if (CopyFromUser(&string, &strings[i], sizeof(char*))) {
+            return -EFAULT;
+        }
+
+        if (!string) {
+            return 0;
+        }
+
+        size_t len;
+        if (strlenSafe(string, len, addressSpace)) {
+            return -EFAULT;
+        }
+
+        out.add_back(String(string));
+    }
+}
+
+/////////////////////////////
+/// \brief SysSpawn(path, argv, envp, actions, actionCount)
+///
+/// Create a child process running an executable, without forking the address space of the caller.
+/// The child inherits the handles and working directory of the caller,
+/// then the file actions are applied in order and handles with close on exec set are closed.
+///
+/// \param path (const char*) Path of the executable
+/// \param argv (char**) Null terminated argument list, may be null
+/// \param envp (char**) Null terminated environment, may be null
+/// \param actions (const lemon_spawn_action_t*) File actions
+/// \param actionCount (size_t) Amount of file actions, at most SPAWN_ACTIONS_MAX
+///
+/// \return PID of the child on success, negative error code on failure
+/// \return -EBADF if an action duplicates a handle that is not open
+/// \return -ENOEXEC if path is not a valid ELF executable
+/////////////////////////////
+long SysSpawn(RegisterContext* r) {
+    Process* currentProcess = Scheduler::GetCurrentProcess();
+
+    size_t filePathLength;
+    if (strlenSafe(reinterpret_cast<char*>(SC_ARG0(r)), filePathLength, currentProcess->addressSpace)) {
+        return -EFAULT;
+    }
+
+    char filepath[filePathLength + 1];
+    strncpy(filepath, (char*)SC_ARG0(r), filePathLength);
+    filepath[filePathLength] = 0;
+
+    char** argv = (char**)SC_ARG1(r);
+    char** envp = (char**)SC_ARG2(r);
+    UserBuffer<lemon_spawn_action_t> actions = SC_ARG3(r);
+    size_t actionCount = SC_ARG4(r);
+
+    if (actionCount > SPAWN_ACTIONS_MAX) {
+        return -EINVAL;
+    }
+
+    SmallVector<String, EXEC_INLINE_ARGS> kernelArgv;
+    if (argv && CopyUserStrings(argv, kernelArgv, currentProcess->addressSpace)) {
+        return -EFAULT;
+    }
+
+    SmallVector<String, EXEC_INLINE_ENV> kernelEnvp;
+    if (envp && CopyUserStrings(envp, kernelEnvp, currentProcess->addressSpace)) {
+        return -EFAULT;
+    }
+
+    if (!kernelArgv.size()) {
+        kernelArgv.add_back(filepath); // Ensure at least argv[0] is set
+    }
+
+    // Apply the file actions to a copy of our handles first,
+    // so nothing has to be undone if one fails
+    HandleTable handles;
+    handles.CopyFrom(currentProcess->m_handles, false);
+    for (size_t i = 0; i < actionCount; i++) {
+        lemon_spawn_action_t action;
+        if (actions.GetValue(i, action)) {
+            return -EFAULT;
+        }
+
+        if (action.type == SpawnActionDup2) {
+            Handle handle = handles.Get(action.fd);
+            if (!handle) {
+                return -EBADF;
+            }
+
+            handle.closeOnExec = false;
+            if (handles.Replace(action.newFd, std::move(handle))) {
+                return -EBADF;
+            }
+        } else if (action.type == SpawnActionClose) {
+            handles.Destroy(action.fd);
+        } else {
+            return -EINVAL;
+        }
+    }
+
+    FsNode* node = fs::ResolvePath(filepath, currentProcess->workingDir->node, true /* Follow Symlinks */);
+    if (!node) {
+        return -ENOENT;
+    } else if (node->IsDirectory()) {
+        return -EISDIR;
+    }
+
+    auto openFile = fs::Open(node);
+    if (openFile.HasError()) {
+        return -openFile.Err().code;
+    }
+
+    FancyRefPtr<UNIXOpenFile> elfFile = openFile.Value();
+    if (!VerifyELF(elfFile)) {
+        return -ENOEXEC;
+    }
+
+    FancyRefPtr<Process> proc = Process::CreateELFProcess(elfFile, kernelArgv, kernelEnvp, filepath, currentProcess);
+    if (!proc) {
+        return -EIO; // Failed to create process
+    }
+
+    proc->workingDir = currentProcess->workingDir;
+    strncpy(proc->workingDirPath, currentProcess->workingDirPath, PATH_MAX);
+
+    currentProcess->RegisterChildProcess(proc);
+
+    // Replace the default standard handles, anything closed by the actions stays closed
+    proc->m_handles.Clear();
+    proc->m_handles.CopyFrom(handles, true);
+
+    proc->Start();
+    return proc->PID();
+}
+
+/////////////////////////////
+/// \brief SysPerfCounters(op, arg0, arg1)
+///
+/// Use the hardware performance counters for the calling thread.
+/// The counts only include time the calling thread was running.
+///
+/// \param op (int) PERF_COUNTERS_START, PERF_COUNTERS_STOP or PERF_COUNTERS_READ
+/// \param arg0 PERF_COUNTERS_START: (uint32_t) mask of events (PERF_EVENT_BIT) to count,
+/// PERF_COUNTERS_READ: (uint64_t*) buffer of PerfEventCount counts
+/// \param arg1 PERF_COUNTERS_START: (lemon_perf_counters_t*) filled with the events counted, may be null
+///
+/// \return 0 on success, negative error code on failure
+/// \return -EOPNOTSUPP if none of the events can be counted
+/////////////////////////////
+long SysPerfCounters(RegisterContext* r) {
+    int op = SC_ARG0(r);
+
+    if (op == PERF_COUNTERS_START) {
+        UserPointer<lemon_perf_counters_t> infoPtr = SC_ARG2(r);
+
+        lemon_perf_counters_t info;
+        if (!PerfCounters::Start(SC_ARG1(r), info)) {
+            PerfCounters::Stop();
+            return -EOPNOTSUPP;
+        }
+
+        if (SC_ARG2(r) && infoPtr.StoreValue(info)) {
+            return -EFAULT;
+        }
+
+        return 0;
+    } else if (op == PERF_COUNTERS_STOP) {
+        PerfCounters::Stop();
+        return 0;
+    } else if (op == PERF_COUNTERS_READ) {
+        UserBuffer<uint64_t> countsPtr = SC_ARG1(r);
+
+        uint64_t counts[PerfEventCount];
+        PerfCounters::Read(counts);
+
+        if (countsPtr.Write(counts, 0, PerfEventCount)) {
+            return -EFAULT;
+        }
+
+        return 0;
+    }
+
+    return -EINVAL;
+}
+
+/////////////////////////////
+/// \brief SysMapMetrics(address)
+///
+/// Map the system metrics (lemon_metrics_t) read only into the calling process.
+/// The kernel keeps them up to date whilst they are mapped, see Metrics.h.
+///
+/// \param address (uintptr_t*) Set to the address the metrics were mapped at
+///
+/// \return 0 on success, negative error code on failure
+/// \return -EFAULT if address is invalid
+/////////////////////////////
+long SysMapMetrics(RegisterContext* r) {
+    UserPointer<uintptr_t> addressPtr = SC_ARG0(r);
+
+    uintptr_t address;
+    if (long e = Metrics::MapIntoProcess(Process::Current(), address); e) {
+        return e;
+    }
+
+    TRY_STORE_UMODE_VALUE(addressPtr, address);
+    return 0;
+}
+
 // clang-format off
 syscall_t syscalls[NUM_SYSCALLS]{
     SysDebug,
@@ -2489,10 +3678,69 @@ syscall_t syscalls[NUM_SYSCALLS]{
     SysEpollCreate,
     SysEPollCtl,
     SysEpollWait, // 110
-    SysFChdir
+    SysFChdir,
+    SysSetSchedulingClass,
+    SysGetSchedulingClass,
+    SysGetCPUInfo,
+    SysSetAffinity, // 115
+    SysGetAffinity,
+    SysGetMemoryInfo,
+    SysFutex,
+    SysEndpointMapRing,
+    SysEndpointNotify,
+    SysEndpointQueueBatch,
+    SysEndpointDequeueBatch,
+    SysEndpointCallTimeout,
+    SysEndpointStatistics,
+    SysFSync, // 125
+    SysReadV,
+    SysWriteV,
+    SysPReadV,
+    SysPWriteV,
+    SysIORingCreate, // 130
+    SysIORingEnter,
+    SysReadDirBatch,
+    SysSendFile,
+    SysSendMMsg,
+    SysRecvMMsg, // 135
+    SysSpawn,
+    SysPerfCounters,
+    SysMapMetrics, // 138
+    SysWaitSetCreate,
+    SysWaitSetAdd, // 140
+    SysWaitSetRemove,
+    SysWaitSetWait,
+    SysGrowSharedMemory,
+    SysRegisterService,
 };
 // clang-format on
 
+long SysGetTIDFast(SyscallFastFrame*) { return Thread::Current()->tid; }
+long SysGetUIDFast(SyscallFastFrame*) { return Scheduler::GetCurrentProcess()->uid; }
+long SysGetEUIDFast(SyscallFastFrame*) { return Scheduler::GetCurrentProcess()->euid; }
+long SysGetGIDFast(SyscallFastFrame*) { return Scheduler::GetCurrentProcess()->gid; }
+long SysGetEGIDFast(SyscallFastFrame*) { return Scheduler::GetCurrentProcess()->egid; }
+
+struct FastSyscallTable {
+    fast_syscall_t entries[NUM_SYSCALLS];
+};
+
+static constexpr FastSyscallTable BuildFastSyscalls() {
+    FastSyscallTable table{};
+    table.entries[SYS_GETTID] = SysGetTIDFast;
+    table.entries[SYS_GETUID] = SysGetUIDFast;
+    table.entries[SYS_GETEUID] = SysGetEUIDFast;
+    table.entries[SYS_FUTEX_WAKE] = SysFutexWakeFast;
+    table.entries[SYS_GETGID] = SysGetGIDFast;
+    table.entries[SYS_GETEGID] = SysGetEGIDFast;
+    table.entries[SYS_FUTEX] = SysFutexFast;
+    return table;
+}
+
+// Taken by syscall_entry instead of syscalls when set, read directly by Syscall.asm.
+// Syscalls made through int 0x69 always use syscalls.
+extern "C" const FastSyscallTable fastSyscalls = BuildFastSyscalls();
+
 void DumpLastSyscall(Thread* t) {
     RegisterContext& lastSyscall = t->lastSyscall.regs;
     Log::Info("Last syscall:\nCall: %d, arg0: %i (%x), arg1: %i (%x), arg2: %i (%x), arg3: %i (%x), arg4: %i (%x), "
@@ -2538,6 +3786,9 @@ extern "C" void SyscallHandler(RegisterContext* regs) {
         return;
     }
 
+    uint64_t num = regs->rax;
+    uint64_t start = ReadTimestampCounter();
+
     Thread* thread = Thread::Current();
     if (__builtin_expect(acquireTestLock(&thread->kernelLock), 0)) {
         for (;;)
@@ -2581,4 +3832,40 @@ extern "C" void SyscallHandler(RegisterContext* regs) {
     while (thread->state == ThreadStateDying) {
         Scheduler::Yield();
     }
+
+    // Interrupts stay disabled until we are back in usermode
+    asm volatile("cli");
+    AccountSyscall(num, ReadTimestampCounter() - start, false);
+}
+
+// Called by syscall_entry for syscalls in fastSyscalls, only the registers not preserved by the C ABI are saved
+extern "C" long SyscallFastHandler(SyscallFastFrame* frame) {
+    uint64_t start = ReadTimestampCounter();
+
+    // Let the slow path deal with threads being killed
+    Thread* thread = Thread::Current();
+    if (__builtin_expect(acquireTestLock(&thread->kernelLock), 0)) {
+        return SYSCALL_FAST_FALLBACK;
+    } else if (__builtin_expect(thread->state == ThreadStateZombie, 0)) {
+        releaseLock(&thread->kernelLock);
+        return SYSCALL_FAST_FALLBACK;
+    }
+
+    asm("sti");
+
+    long ret = fastSyscalls.entries[frame->rax](frame);
+
+    releaseLock(&thread->kernelLock);
+    if (ret == SYSCALL_FAST_FALLBACK) {
+        asm volatile("cli");
+        return ret;
+    }
+
+    while (thread->state == ThreadStateDying) {
+        Scheduler::Yield();
+    }
+
+    asm volatile("cli");
+    AccountSyscall(frame->rax, ReadTimestampCounter() - start, true);
+    return ret;
 }
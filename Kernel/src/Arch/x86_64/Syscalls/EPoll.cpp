@@ -2,7 +2,6 @@
 #include <Syscalls.h>
 
 #include <Fs/EPoll.h>
-#include <Net/Socket.h>
 
 #include <UserPointer.h>
 #include <OnCleanup.h>
@@ -56,59 +55,18 @@ long SysEPollCtl(RegisterContext* r) {
 
     fs::EPoll* epoll = (fs::EPoll*)epHandle->node;
 
-    ScopedSpinLock<true> lockEp(epoll->epLock);
-
     if (op == EPOLL_CTL_ADD) {
         struct epoll_event e;
         TRY_GET_UMODE_VALUE(event, e);
 
-        if (e.events & EPOLLEXCLUSIVE) {
-            // Unsupported
-            Log::Warning("SysEPollCtl: EPOLLEXCLUSIVE unsupported!");
-        }
-
-        if (e.events & EPOLLET) {
-            Log::Warning("SysEPollCtl: EPOLLET unsupported!");
-        }
-
-        for (const auto& pair : epoll->fds) {
-            if (pair.item1 == fd) {
-                return -EEXIST; // Already watching the fd
-            }
-        }
-
-        epoll->fds.add_back({fd, {e.events, e.data}});
+        return epoll->Add(fd, handle.get(), e);
     } else if (op == EPOLL_CTL_DEL) {
-        for (auto it = epoll->fds.begin(); it != epoll->fds.end(); it++) {
-            if (it->item1 == fd) {
-                epoll->fds.remove(it);
-                return 0;
-            }
-        }
-
-        return -ENOENT;
+        return epoll->Remove(fd);
     } else if (op == EPOLL_CTL_MOD) {
-        struct epoll_event* current = nullptr;
         struct epoll_event e;
         TRY_GET_UMODE_VALUE(event, e);
 
-        if (e.events & EPOLLEXCLUSIVE) {
-            // Not that we support this flag yet,
-            // however for future it can only be
-            // enabled on EPOLL_CTL_ADD.
-            return -EINVAL;
-        }
-
-        for (auto& pair : epoll->fds) {
-            if (pair.item1 == fd) {
-                current = &pair.item2;
-                break;
-            }
-        }
-
-        if (!current) {
-            return -ENOENT; // fd not found
-        }
+        return epoll->Modify(fd, e);
     }
 
     return -EINVAL;
@@ -151,161 +109,5 @@ long SysEpollWait(RegisterContext* r) {
         }
     });
 
-    ScopedSpinLock lockEp(epoll->epLock);
-
-    Vector<int> removeFds; // Fds to unwatch
-    auto getEvents = [removeFds](FancyRefPtr<UNIXOpenFile>& handle, uint32_t requested, int& evCount) -> uint32_t {
-        uint32_t ev = 0;
-        if (requested & EPOLLIN) {
-            if (handle->node->CanRead()) {
-                ev |= EPOLLIN;
-            }
-        }
-
-        if (requested & EPOLLOUT) {
-            if (handle->node->CanWrite()) {
-                ev |= EPOLLOUT;
-            }
-        }
-
-        if (handle->node->IsSocket()) {
-            if (!((Socket*)handle->node)->IsConnected() && !((Socket*)handle->node)->IsListening()) {
-                ev |= EPOLLHUP;
-            }
-
-            if (((Socket*)handle->node)->PendingConnections() && (requested & EPOLLIN)) {
-                ev |= EPOLLIN;
-            }
-        }
-
-        if (ev) {
-            evCount++;
-        }
-
-        return ev;
-    };
-
-    auto epollToPollEvents = [](uint32_t ep) -> int {
-        int evs = 0;
-        if (ep & EPOLLIN) {
-            evs |= POLLIN;
-        }
-
-        if (ep & EPOLLOUT) {
-            evs |= POLLOUT;
-        }
-
-        if (ep & EPOLLHUP) {
-            evs |= POLLHUP;
-        }
-
-        if (ep & EPOLLRDHUP) {
-            evs |= POLLRDHUP;
-        }
-
-        if (ep & EPOLLERR) {
-            evs |= POLLERR;
-        }
-
-        if (ep & EPOLLPRI) {
-            evs |= POLLPRI;
-        }
-
-        return evs;
-    };
-
-    struct EPollFD {
-        FancyRefPtr<UNIXOpenFile> handle;
-        int fd;
-        struct epoll_event ev;
-    };
-
-    Vector<EPollFD> files;
-    int evCount = 0; // Amount of fds with events
-    for (const auto& pair : epoll->fds) {
-        auto result = proc->GetHandleAs<UNIXOpenFile>(pair.item1);
-        if (result.HasError()) {
-            continue; // Ignore closed fds
-        }
-
-        auto handle = std::move(result.Value());
-
-        if (uint32_t ev = getEvents(handle, pair.item2.events, evCount); ev) {
-            if (events.StoreValue(evCount - 1, {
-                                                   .events = ev,
-                                                   .data = pair.item2.data,
-                                               })) {
-                return -EFAULT;
-            }
-        }
-
-        if (evCount > 0) {
-            if (pair.item2.events & EPOLLONESHOT) {
-                removeFds.add_back(pair.item1);
-            }
-        } else {
-            files.add_back(
-                {handle, pair.item1, pair.item2}); // We only need the handle for later if events were not found
-        }
-
-        if (evCount >= maxevents) {
-            goto done; // Reached max events/fds
-        }
-    }
-
-    if (evCount > 0) {
-        goto done;
-    }
-
-    if (!evCount && timeout) {
-        FilesystemWatcher fsWatcher;
-        for (auto& file : files) {
-            fsWatcher.WatchNode(file.handle->node, epollToPollEvents(file.ev.events));
-        }
-
-        while (!evCount) {
-            if (timeout > 0) {
-                if (fsWatcher.WaitTimeout(timeout)) {
-                    return -EINTR; // Interrupted
-                } else if (timeout <= 0) {
-                    return 0; // Timed out
-                }
-            } else if (fsWatcher.Wait()) {
-                return -EINTR; // Interrupted
-            }
-
-            for (auto& handle : files) {
-                if (uint32_t ev = getEvents(handle.handle, handle.ev.events, evCount); ev) {
-                    if (events.StoreValue(evCount - 1, {
-                                                           .events = ev,
-                                                           .data = handle.ev.data,
-                                                       })) {
-                        return -EFAULT;
-                    }
-                }
-
-                if (evCount > 0) {
-                    if (handle.ev.events & EPOLLONESHOT) {
-                        removeFds.add_back(handle.fd);
-                    }
-                }
-
-                if (evCount >= maxevents) {
-                    goto done; // Reached max events/fds
-                }
-            }
-        }
-    }
-
-done:
-    for (int fd : removeFds) {
-        for (auto it = epoll->fds.begin(); it != epoll->fds.end(); it++) {
-            if (it->item1 == fd) {
-                epoll->fds.remove(it);
-                break;
-            }
-        }
-    }
-
-    return evCount;
+    return epoll->Wait(events, maxevents, timeout);
 }
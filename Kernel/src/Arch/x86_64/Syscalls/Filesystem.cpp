@@ -1,6 +1,8 @@
+#include <Math.h>
 #include <Scheduler.h>
 #include <Syscalls.h>
 
+#include <Fs/PageCache.h>
 #include <Fs/Pipe.h>
 #include <Net/Socket.h>
 
@@ -29,7 +31,7 @@ long SysRead(RegisterContext* r) {
     }
 
     ssize_t ret = fs::Read(handle, count, buffer);
-    return ret;
+    return proc->AccountRead(ret);
 }
 
 long SysWrite(RegisterContext* r) {
@@ -50,7 +52,7 @@ long SysWrite(RegisterContext* r) {
     }
 
     ssize_t ret = fs::Write(handle, SC_ARG2(r), buffer);
-    return ret;
+    return proc->AccountWrite(ret);
 }
 
 /*
@@ -95,7 +97,7 @@ open:
 
             IF_DEBUG(debugLevelSyscalls >= DebugLevelNormal, { Log::Info("SysOpen: Creating %s", filepath); });
 
-            parent->Create(&ent, flags);
+            fs::Create(parent, &ent, flags);
 
             flags &= ~O_CREAT;
             goto open;
@@ -167,7 +169,7 @@ long SysLink(RegisterContext* r) {
 
     DirectoryEntry entry;
     strcpy(entry.name, linkName.c_str());
-    return parentDirectory->Link(file, &entry);
+    return fs::Link(parentDirectory, file, &entry);
 }
 
 long SysUnlink(RegisterContext* r) {
@@ -212,7 +214,7 @@ long SysUnlink(RegisterContext* r) {
 
     DirectoryEntry entry;
     strcpy(entry.name, linkName.c_str());
-    return workingDir->Unlink(&entry);
+    return fs::Unlink(workingDir, &entry);
 }
 
 long SysChdir(RegisterContext* r) {
@@ -409,7 +411,7 @@ long SysMkdir(RegisterContext* r) {
 
     DirectoryEntry dir;
     strcpy(dir.name, dirPath.c_str());
-    int ret = parentDirectory->CreateDirectory(&dir, mode);
+    int ret = fs::CreateDirectory(parentDirectory, &dir, mode);
 
     return ret;
 }
@@ -542,6 +544,69 @@ long SysReadDir(RegisterContext* r) {
     return ret;
 }
 
+/////////////////////////////
+/// \brief SysReadDirBatch(fd, entries, count) Read several directory entries
+///
+/// Reads from the file position of fd, which is advanced past the entries read.
+/// The file position is an opaque cursor which need not be an entry index,
+/// so it should not be mixed with SysReadDirNext on the same file descriptor.
+///
+/// \param fd File descriptor of directory
+/// \param entries (fs_dirent_t*) Filled with the entries read
+/// \param count Size of entries in fs_dirent_t
+///
+/// \return Amount of entries read, 0 at the end of the directory, negative error code on failure
+/////////////////////////////
+long SysReadDirBatch(RegisterContext* r) {
+    Process* process = Scheduler::GetCurrentProcess();
+
+    FancyRefPtr<UNIXOpenFile> handle = SC_TRY_OR_ERROR(process->GetHandleAs<UNIXOpenFile>(SC_ARG0(r)));
+    if (!handle) {
+        return -EBADF;
+    }
+
+    fs_dirent_t* direntPointer = (fs_dirent_t*)SC_ARG1(r);
+    size_t count = SC_ARG2(r);
+    if (count > UINT64_MAX / sizeof(fs_dirent_t) ||
+        !Memory::CheckUsermodePointer(SC_ARG1(r), count * sizeof(fs_dirent_t), process->addressSpace)) {
+        return -EFAULT;
+    }
+
+    if ((handle->node->flags & FS_NODE_TYPE) != FS_NODE_DIRECTORY) {
+        return -ENOTDIR;
+    }
+
+    // Entries are read in chunks to keep the kernel buffer small
+    const int chunkSize = 32;
+    DirectoryEntry* entries = new DirectoryEntry[chunkSize];
+
+    long total = 0;
+    while (static_cast<size_t>(total) < count) {
+        int ret = fs::ReadDirBatch(handle, entries, static_cast<int>(MIN(count - total, (size_t)chunkSize)));
+        if (ret < 0) {
+            if (!total) {
+                total = ret;
+            }
+            break;
+        }
+
+        for (int i = 0; i < ret; i++) {
+            fs_dirent_t& dirent = direntPointer[total + i];
+            strcpy(dirent.name, entries[i].name);
+            dirent.type = entries[i].flags;
+            dirent.inode = entries[i].inode;
+        }
+
+        total += ret;
+        if (ret < chunkSize) {
+            break; // End of directory
+        }
+    }
+
+    delete[] entries;
+    return total;
+}
+
 long SysGetCWD(RegisterContext* r) {
     char* buf = (char*)SC_ARG0(r);
     size_t sz = SC_ARG1(r);
@@ -573,7 +638,7 @@ long SysPRead(RegisterContext* r) {
     uint8_t* buffer = (uint8_t*)SC_ARG1(r);
     uint64_t count = SC_ARG2(r);
     uint64_t off = SC_ARG4(r);
-    return fs::Read(handle->node, off, count, buffer);
+    return currentProcess->AccountRead(fs::Read(handle->node, off, count, buffer));
 }
 
 long SysPWrite(RegisterContext* r) {
@@ -592,7 +657,162 @@ long SysPWrite(RegisterContext* r) {
     uint8_t* buffer = (uint8_t*)SC_ARG1(r);
     uint64_t count = SC_ARG2(r);
     uint64_t off = SC_ARG4(r);
-    return fs::Write(handle->node, off, count, buffer);
+    return currentProcess->AccountWrite(fs::Write(handle->node, off, count, buffer));
+}
+
+/////////////////////////////
+/// \brief SysReadV(fd, iov, iovcnt) Read from a file into several buffers
+///
+/// \param fd File descriptor to read from
+/// \param iov (const iovec*) Buffers to read into
+/// \param iovcnt Amount of buffers, at most IOV_MAX
+///
+/// \return Bytes read on success, negative error code on failure
+/////////////////////////////
+long SysReadV(RegisterContext* r) {
+    Process* process = Scheduler::GetCurrentProcess();
+
+    FancyRefPtr<UNIXOpenFile> handle = SC_TRY_OR_ERROR(process->GetHandleAs<UNIXOpenFile>(SC_ARG0(r)));
+    if (!handle) {
+        return -EBADF;
+    }
+
+    UserIOVec iov;
+    if (long e = iov.Copy(process, SC_ARG1(r), SC_ARG2(r)); e) {
+        return e;
+    }
+
+    return process->AccountRead(fs::ReadV(handle, iov.Get(), iov.Count()));
+}
+
+/////////////////////////////
+/// \brief SysWriteV(fd, iov, iovcnt) Write to a file from several buffers
+///
+/// \param fd File descriptor to write to
+/// \param iov (const iovec*) Buffers to write
+/// \param iovcnt Amount of buffers, at most IOV_MAX
+///
+/// \return Bytes written on success, negative error code on failure
+/////////////////////////////
+long SysWriteV(RegisterContext* r) {
+    Process* process = Scheduler::GetCurrentProcess();
+
+    FancyRefPtr<UNIXOpenFile> handle = SC_TRY_OR_ERROR(process->GetHandleAs<UNIXOpenFile>(SC_ARG0(r)));
+    if (!handle) {
+        return -EBADF;
+    }
+
+    UserIOVec iov;
+    if (long e = iov.Copy(process, SC_ARG1(r), SC_ARG2(r)); e) {
+        return e;
+    }
+
+    return process->AccountWrite(fs::WriteV(handle, iov.Get(), iov.Count()));
+}
+
+/////////////////////////////
+/// \brief SysPReadV(fd, iov, iovcnt, offset) Read from an offset of a file into several buffers
+///
+/// The file position is not used or changed.
+///
+/// \param fd File descriptor to read from
+/// \param iov (const iovec*) Buffers to read into
+/// \param iovcnt Amount of buffers, at most IOV_MAX
+/// \param offset (off_t) Offset in the file to read from
+///
+/// \return Bytes read on success, negative error code on failure
+/////////////////////////////
+long SysPReadV(RegisterContext* r) {
+    Process* process = Scheduler::GetCurrentProcess();
+
+    FancyRefPtr<UNIXOpenFile> handle = SC_TRY_OR_ERROR(process->GetHandleAs<UNIXOpenFile>(SC_ARG0(r)));
+    if (!handle) {
+        return -EBADF;
+    }
+
+    off_t offset = SC_ARG3(r);
+    if (offset < 0) {
+        return -EINVAL;
+    }
+
+    UserIOVec iov;
+    if (long e = iov.Copy(process, SC_ARG1(r), SC_ARG2(r)); e) {
+        return e;
+    }
+
+    return process->AccountRead(fs::ReadV(handle->node, offset, iov.Get(), iov.Count()));
+}
+
+/////////////////////////////
+/// \brief SysPWriteV(fd, iov, iovcnt, offset) Write to an offset of a file from several buffers
+///
+/// The file position is not used or changed.
+///
+/// \param fd File descriptor to write to
+/// \param iov (const iovec*) Buffers to write
+/// \param iovcnt Amount of buffers, at most IOV_MAX
+/// \param offset (off_t) Offset in the file to write to
+///
+/// \return Bytes written on success, negative error code on failure
+/////////////////////////////
+long SysPWriteV(RegisterContext* r) {
+    Process* process = Scheduler::GetCurrentProcess();
+
+    FancyRefPtr<UNIXOpenFile> handle = SC_TRY_OR_ERROR(process->GetHandleAs<UNIXOpenFile>(SC_ARG0(r)));
+    if (!handle) {
+        return -EBADF;
+    }
+
+    off_t offset = SC_ARG3(r);
+    if (offset < 0) {
+        return -EINVAL;
+    }
+
+    UserIOVec iov;
+    if (long e = iov.Copy(process, SC_ARG1(r), SC_ARG2(r)); e) {
+        return e;
+    }
+
+    return process->AccountWrite(fs::WriteV(handle->node, offset, iov.Get(), iov.Count()));
+}
+
+/////////////////////////////
+/// \brief SysSendFile(outFd, inFd, offset, count) Copy data between files in the kernel
+///
+/// Works between any files, pipes and sockets, serving as both sendfile and splice.
+///
+/// \param outFd File descriptor to write to at its file position
+/// \param inFd File descriptor to read from
+/// \param offset (off_t*) Offset to read from, advanced past the data copied. If null the file position of inFd is used
+/// \param count Most bytes to copy
+///
+/// \return Bytes copied on success, negative error code on failure
+/////////////////////////////
+long SysSendFile(RegisterContext* r) {
+    Process* process = Scheduler::GetCurrentProcess();
+
+    FancyRefPtr<UNIXOpenFile> out = SC_TRY_OR_ERROR(process->GetHandleAs<UNIXOpenFile>(SC_ARG0(r)));
+    FancyRefPtr<UNIXOpenFile> in = SC_TRY_OR_ERROR(process->GetHandleAs<UNIXOpenFile>(SC_ARG1(r)));
+    if (!out || !in) {
+        return -EBADF;
+    }
+
+    UserPointer<off_t> offsetPointer = SC_ARG2(r);
+    size_t count = SC_ARG3(r);
+
+    if (!SC_ARG2(r)) {
+        return fs::Splice(out, in, nullptr, count);
+    }
+
+    off_t offset;
+    TRY_GET_UMODE_VALUE(offsetPointer, offset);
+
+    ssize_t ret = fs::Splice(out, in, &offset, count);
+    if (ret >= 0) {
+        TRY_STORE_UMODE_VALUE(offsetPointer, offset);
+    }
+
+    return ret;
 }
 
 long SysIoctl(RegisterContext* r) {
@@ -867,14 +1087,7 @@ long SysDup(RegisterContext* r) {
     }
 
     if (requestedFd >= 0) {
-        if (static_cast<unsigned>(requestedFd) >= currentProcess->HandleCount()) {
-            Log::Error("SysDup: We do not support (yet) requesting unallocated fds."); // TODO: Requested file
-                                                                                       // descriptors out of range
-            return -ENOSYS;
-        }
-
-        currentProcess->DestroyHandle(requestedFd); // If it exists destroy existing fd
-
+        // Any existing handle is destroyed
         if (currentProcess->ReplaceHandle(requestedFd, std::move(handle))) {
             return -EBADF;
         }
@@ -1100,7 +1313,9 @@ long SysPipe(RegisterContext* r) {
     UNIXPipe* read;
     UNIXPipe* write;
 
-    UNIXPipe::CreatePipe(read, write);
+    if (int ret = UNIXPipe::CreatePipe(read, write); ret) {
+        return ret;
+    }
 
     UNIXOpenFile* readHandle = SC_TRY_OR_ERROR(fs::Open(read));
     UNIXOpenFile* writeHandle = SC_TRY_OR_ERROR(fs::Open(write));
@@ -1113,3 +1328,35 @@ long SysPipe(RegisterContext* r) {
 
     return 0;
 }
+
+/////////////////////////////
+/// \brief SysFSync(fd) Write back the cached data of a file
+///
+/// Blocks until everything written to the file before the call is on its device.
+///
+/// \param fd File descriptor to sync
+///
+/// \return Negative error code on error, otherwise 0
+/////////////////////////////
+long SysFSync(RegisterContext* r) {
+    Process* process = Scheduler::GetCurrentProcess();
+
+    FancyRefPtr<UNIXOpenFile> handle = SC_TRY_OR_ERROR(process->GetHandleAs<UNIXOpenFile>(SC_ARG0(r)));
+    if (!handle) {
+        return -EBADF;
+    }
+
+    // Writes through shared mappings first
+    if (handle->node->pageCache) {
+        if (PageCache* cache = PageCache::AcquireIfCached(handle->node); cache) {
+            int e = cache->WriteBack();
+            cache->Release();
+
+            if (e) {
+                return -e;
+            }
+        }
+    }
+
+    return handle->node->Sync();
+}
@@ -2,6 +2,8 @@
 
 #include <CPU.h>
 #include <Debug.h>
+#include <PerfCounters.h>
+#include <SMP.h>
 #include <Scheduler.h>
 #include <Timer.h>
 #include <TimerEvent.h>
@@ -49,12 +51,12 @@ Thread::Thread(Process* _parent, pid_t _tid)
     ((fx_state_t*)fxState)->mxcsrMask = 0xffbf;
     ((fx_state_t*)fxState)->fcw = 0x33f; // Default FPU Control Word State
 
-    kernelStackBase = kmalloc(524288);
+    kernelStackBase = kmalloc(THREAD_KERNEL_STACK_SIZE);
     kernelStack = (uint8_t*)kernelStackBase + 524488;
 }
 
 Thread::~Thread() {
-    
+    delete perfCounters;
 }
 
 void Thread::Signal(int signal) {
@@ -370,10 +372,27 @@ void Thread::Unblock() {
         acquireLock(&stateLock);
     timeSlice = timeSliceDefault;
 
-    if (state != ThreadStateZombie)
+    if (state != ThreadStateZombie) {
+        if (state & ThreadStateBlocked) {
+            runnableSince = Timer::UsecondsSinceBoot();
+
+            // Let the waking thread switch straight to us (e.g. a caller waiting on our response)
+            if (Thread* waker = GetCPULocal()->currentThread; waker && waker != this && waker->handoffArmed) {
+                waker->handoffArmed = false;
+                waker->handoff = this;
+                waker->handoffCPU = cpu;
+            }
+        }
         state = ThreadStateRunning;
+    }
 
     releaseLock(&stateLock);
+
+    // Our CPU may have gone idle whilst we were blocked
+    if (int threadCPU = cpu; threadCPU >= 0) {
+        Scheduler::WakeIdleCPU(SMP::cpus[threadCPU]);
+    }
+
     if(intsWereEnabled)
         asm volatile("sti");
 }
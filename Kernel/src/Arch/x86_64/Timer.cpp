@@ -6,6 +6,7 @@
 #include <APIC.h>
 #include <CPU.h>
 #include <IDT.h>
+#include <KernelData.h>
 #include <List.h>
 #include <Logging.h>
 #include <Scheduler.h>
@@ -15,43 +16,93 @@ namespace Timer {
 int frequency = 1000;         // Timer frequency
 uint64_t ticks = 0; // System uptime in ticks since the timer was initialized
 uint64_t uptimeUs = 0; // System uptime in microseconds
-long pendingTicks = 0; // If the sleep queue is locked add ticks here
 
 lock_t sleepQueueLock = 0;
 
-// In the sleep queue, all waiting threads have a counter as an offset from the previous waiting thread.
-// For example there are 2 threads, thread 1 is waiting for 10 ticks and thread 2 is waiting for 15 ticks.
-// Thread 1's ticks value will be 10, and as 15 - 10 is 5, thread 2's value will be 5 so it waits 5 ticks after thread 1
-FastList<TimerEvent*> sleeping;
+// Timer events are kept in a hierarchical timer wheel, so queueing and removing events does not depend on the
+// amount of events pending. Level 0 has a slot for each of the next TIMER_WHEEL_SLOTS ticks,
+// each slot of level n covers TIMER_WHEEL_SLOTS slots of level n - 1.
+// When a level wraps around, the events in the next slot of the level above are queued again ('cascaded')
+// into the lower levels. Events further away than the wheel covers sit in the last level and get requeued until due.
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 4
+
+FastList<TimerEvent*> wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+uint64_t wheelTicks = 0; // Last tick processed by the timer wheel, sleepQueueLock must be held
+
+// sleepQueueLock must be held
+void QueueEvent(TimerEvent* ev, uint64_t expires) {
+    if (expires < wheelTicks) {
+        expires = wheelTicks;
+    }
 
-TimerEvent::TimerEvent(long _us, void (*_callback)(void*), void* _data)
-    : ticks(_us * frequency / 1000000), callback(_callback), data(_data) {
-    if (ticks <= 0) {
-        callback(data);
-        return;
+    // Cascading can requeue an event due on the current tick (delta of 0),
+    // which lands in the current level 0 slot and is dispatched by AdvanceWheel straight after cascading
+    uint64_t delta = expires - wheelTicks;
+
+    unsigned level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ULL << ((level + 1) * TIMER_WHEEL_BITS))) {
+        level++;
     }
 
-    acquireLock(&sleepQueueLock);
+    if (delta >= (1ULL << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS))) {
+        // Past the end of the wheel, put it in the furthest slot
+        expires = wheelTicks + (1ULL << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS)) - 1;
+    }
 
-    TimerEvent* ev = sleeping.get_front();
-    while (ev) {
-        if (ev->ticks >= ticks) { // See if we need to insert in middle of queue
-            ev->ticks -= ticks;
-            sleeping.insert(this, ev); // Insert before
+    FastList<TimerEvent*>* slot = &wheel[level][(expires >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK];
+    slot->add_back(ev);
+    ev->slot = slot;
+}
 
-            releaseLock(&sleepQueueLock);
-            return;
-        }
+// Queue the events of a slot again now that they are closer, sleepQueueLock must be held
+void CascadeSlot(FastList<TimerEvent*>* slot) {
+    while (TimerEvent* ev = slot->get_front()) {
+        slot->remove(ev);
+        QueueEvent(ev, ev->expires);
+    }
+}
 
-        ticks -= ev->ticks;
-        ev = ev->next;
+// Move the wheel forward a tick and dispatch due events, sleepQueueLock must be held
+void AdvanceWheel() {
+    wheelTicks++;
 
-        if (ev == sleeping.get_front()) {
+    // Cascade down from the levels that wrapped around
+    for (unsigned level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        if (wheelTicks & ((1ULL << (level * TIMER_WHEEL_BITS)) - 1)) {
             break;
         }
+
+        CascadeSlot(&wheel[level][(wheelTicks >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK]);
+    }
+
+    FastList<TimerEvent*>* slot = &wheel[0][wheelTicks & TIMER_WHEEL_MASK];
+    while (TimerEvent* ev = slot->get_front()) {
+        assert(ev->expires <= wheelTicks);
+        ev->Dispatch();
+    }
+}
+
+TimerEvent::TimerEvent(long _us, void (*_callback)(void*), void* _data) : callback(_callback), data(_data) {
+    // Round up so the event is never dispatched early
+    long delta = (_us * frequency + 999999) / 1000000;
+    if (_us <= 0 || delta <= 0) {
+        dispatched = true;
+        callback(data);
+        return;
     }
 
-    sleeping.add_back(this); // Add to back
+    acquireLock(&sleepQueueLock);
+
+    // The wheel may be behind if it was locked on the last ticks
+    expires = __atomic_load_n(&ticks, __ATOMIC_RELAXED) + delta;
+    if (expires <= wheelTicks) {
+        expires = wheelTicks + 1;
+    }
+    QueueEvent(this, expires);
+
     releaseLock(&sleepQueueLock);
 }
 
@@ -62,24 +113,28 @@ TimerEvent::~TimerEvent() {
     if (!dispatched) {
         dispatched = true;
 
-        if (next) {
-            if (next && ticks >= 0 && next != sleeping.get_front()) { // Make sure not at end of list
-                next->ticks += ticks;
-            }
-
-            sleeping.remove(this); // Remove from queue
-        }
+        slot->remove(this);
+        slot = nullptr;
     }
 
     releaseLock(&sleepQueueLock);
     releaseLock(&lock);
 }
 
+long TimerEvent::GetTicks() const {
+    if (dispatched) {
+        return 0;
+    }
+
+    return static_cast<long>(expires - Timer::GetTicks());
+}
+
 void TimerEvent::Dispatch() {
     acquireLock(&lock);
     if (!dispatched) {
         dispatched = true;
-        sleeping.remove(this);
+        slot->remove(this);
+        slot = nullptr;
 
         callback(data);
     }
@@ -122,26 +177,13 @@ void Wait(long ms) {
 void Handler(void*, RegisterContext* r) {
     ticks++;
     __atomic_store_n(&uptimeUs, ticks * 1000000 / frequency, __ATOMIC_RELAXED);
+    KernelData::UpdateClock();
 
-    pendingTicks++;
     if (!(acquireTestLock(&sleepQueueLock))) {
-        while (sleeping.get_length() &&
-               pendingTicks-- >
-                   0) { // Make sure the queue has not changed inbetween checking the length and acquiring the lock
-            TimerEvent* cnt = sleeping.get_front();
-
-            assert(cnt);
-            cnt->ticks--;
-
-            if (cnt->ticks <= 0) {
-                sleeping.get_front()->Dispatch();
-
-                while (sleeping.get_length() && sleeping.get_front()->ticks <= 0) {
-                    sleeping.get_front()->Dispatch();
-                }
-            }
+        // Catch up on any ticks missed whilst the wheel was locked
+        while (wheelTicks < ticks) {
+            AdvanceWheel();
         }
-        pendingTicks = 0;
 
         releaseLock(&sleepQueueLock);
     }
@@ -153,7 +195,11 @@ void Handler(void*, RegisterContext* r) {
 void Initialize(uint32_t freq) {
     IDT::RegisterInterruptHandler(IRQ0, Handler);
 
-    new (&sleeping) FastList<TimerEvent*>();
+    for (auto& level : wheel) {
+        for (auto& slot : level) {
+            new (&slot) FastList<TimerEvent*>();
+        }
+    }
 
     frequency = freq;
     uint32_t divisor = 1193182 / freq;
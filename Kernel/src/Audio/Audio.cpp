@@ -1,4 +1,7 @@
 #include <Audio/Audio.h>
+#include <Audio/Mixer.h>
+
+#include <Objects/Process.h>
 
 namespace Audio {
 
@@ -15,6 +18,10 @@ public:
 
     int Ioctl(uint64_t cmd, uint64_t arg) override {
         switch(cmd) {
+        case IoCtlMixerSetMasterVolume:
+            return MixerSetMasterVolume((int)arg);
+        case IoCtlMixerGetMasterVolume:
+            return MixerGetMasterVolume();
         default:
             return -EINVAL;
         }
@@ -23,6 +30,7 @@ public:
     }
 };
 
+// Each open gets its own stream, which the mixer adds to every other stream
 class PCMOutputDevice
     : public FsNode {
 public:
@@ -30,49 +38,12 @@ public:
         flags = FS_NODE_CHARDEVICE;
     }
 
-    int Ioctl(uint64_t cmd, uint64_t arg) override {
-        ScopedSpinLock lockOutputs(pcmOutputsLock);
-        if(!currentOutput) {
-            Log::Warning("no audio output!", size);
-            return 0;
-        }
-
-        AudioController* c = currentOutput->c;
-        void* out = currentOutput->output;
-        switch (cmd)
-        {
-        case IoCtlOutputSetVolume:
-            return c->OutputSetVolume(out, (int)arg);
-        case IoCtlOutputGetVolume:
-            return c->OutputGetVolume(out);
-        case IoCtlOutputGetEncoding:
-            return c->OutputGetEncoding(out);
-        case IoCtlOutputGetSampleRate:
-            return c->OutputSampleRate(out);
-        case IoCtlOutputGetNumberOfChannels:
-            return c->OutputNumberOfChannels(out);
-        case IoCtlOutputSetAsync:
-            m_async = (bool)arg;
-            return 0;
-        case IoCtlOutputSetNumberOfChannels:
-        default:
-            return -EINVAL;
-        }
-    }
-
-    ssize_t Write(size_t off, size_t size, uint8_t* buffer) override {
-        ScopedSpinLock lockOutputs(pcmOutputsLock);
-        if(!currentOutput) {
-            // If no output treat as dummy device
-            Log::Warning("no audio output!", size);
-            return size;
-        }
+    ErrorOr<UNIXOpenFile*> Open(size_t flags) override {
+        MixerStream* stream = new MixerStream();
+        MixerAddStream(stream);
 
-        AudioController* c = currentOutput->c;
-        return c->WriteSamples(currentOutput->output, buffer, size, m_async);
+        return stream->Open(flags);
     }
-private:
-    bool m_async = false;
 };
 
 class SoundFS
@@ -129,9 +100,42 @@ AudioController::~AudioController() {
 
 }
 
+FancyRefPtr<SampleRingVMObject> AudioController::OutputMapRing(void*, size_t&) {
+    return nullptr;
+}
+
+int AudioController::OutputRingPosition(void*) {
+    return -ENOSYS;
+}
+
+int AudioController::OutputRingCommit(void*, size_t) {
+    return -ENOSYS;
+}
+
+SampleRingVMObject::SampleRingVMObject(size_t size) : PhysicalVMObject(size, false, true) {
+    // Blocks are allocated (and zeroed) by PhysicalVMObject as we are not anonymous
+    unsigned blockCount = size >> PAGE_SHIFT_4K;
+    m_kernelMapping = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(blockCount));
+    for(unsigned i = 0; i < blockCount; i++) {
+        Memory::KernelMapVirtualMemory4K(static_cast<uintptr_t>(physicalBlocks[i]) << PAGE_SHIFT_4K,
+                                         reinterpret_cast<uintptr_t>(m_kernelMapping) + (i << PAGE_SHIFT_4K), 1);
+    }
+}
+
+SampleRingVMObject::~SampleRingVMObject() {
+    Memory::KernelFree4KPages(m_kernelMapping, size >> PAGE_SHIFT_4K);
+}
+
 SoundFS* sfs;
 void InitializeSystem() {
     sfs = new SoundFS();
+
+    InitializeMixer();
+}
+
+PCMOutput* CurrentPCMOut() {
+    ScopedSpinLock lockOutputs(pcmOutputsLock);
+    return currentOutput;
 }
 
 void RegisterPCMOut(PCMOutput* out) {
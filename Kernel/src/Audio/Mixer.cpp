@@ -0,0 +1,409 @@
+#include <Audio/Mixer.h>
+
+#include <Errno.h>
+#include <List.h>
+#include <Logging.h>
+#include <Math.h>
+#include <Objects/Process.h>
+#include <Scheduler.h>
+
+namespace Audio {
+
+lock_t streamsLock = 0;
+List<MixerStream*> streams;
+
+// Signalled when a stream has samples queued
+Semaphore mixerWake = Semaphore(0);
+
+int masterVolume = 100; // Percentage
+
+MixerStream::MixerStream() {
+    flags = FS_NODE_CHARDEVICE;
+
+    m_ring = new SampleRingVMObject(AUDIO_STREAM_RING_SIZE);
+    m_samples = m_ring->KernelMapping();
+
+    // Start out in the format of the output, so clients which convert for themselves keep working
+    if (PCMOutput* out = CurrentPCMOut()) {
+        SoundEncoding encoding = out->c->OutputGetEncoding(out->output);
+        int channels = out->c->OutputNumberOfChannels(out->output);
+        int rate = out->c->OutputSampleRate(out->output);
+
+        if (encoding == PCMS16LE || encoding == PCMS32LE) {
+            m_encoding = encoding;
+        }
+
+        if (channels >= 1 && channels <= AUDIO_MIXER_MAX_CHANNELS) {
+            m_channels = channels;
+        }
+
+        if (rate >= AUDIO_STREAM_MIN_RATE && rate <= AUDIO_STREAM_MAX_RATE) {
+            m_rate = rate;
+        }
+    }
+
+    Reset();
+}
+
+MixerStream::~MixerStream() {}
+
+void MixerStream::Close() {
+    handleCount--;
+
+    if (handleCount == 0) {
+        MixerRemoveStream(this);
+        delete this;
+    }
+}
+
+ssize_t MixerStream::Write(size_t, size_t size, uint8_t* buffer) {
+    ScopedMutexLock lockWrite(m_writeLock);
+    if (size % FrameSize()) {
+        return -EINVAL; // Must be writing exact frames
+    }
+
+    size_t written = 0;
+    while (written < size) {
+        // Only writers move m_written, so the space can only grow whilst we copy
+        uint64_t queued;
+        {
+            ScopedSpinLock lockStream(m_lock);
+            queued = m_written - m_read;
+        }
+
+        size_t space = AUDIO_STREAM_RING_SIZE - queued;
+        if (!space) {
+            if (m_async) {
+                return written ? static_cast<ssize_t>(written) : -EAGAIN;
+            }
+
+            if (m_space.Wait()) {
+                return written ? static_cast<ssize_t>(written) : -EINTR;
+            }
+            continue;
+        }
+
+        size_t offset = m_written % AUDIO_STREAM_RING_SIZE;
+        size_t count = MIN(MIN(size - written, space), AUDIO_STREAM_RING_SIZE - offset);
+        memcpy(m_samples + offset, buffer + written, count);
+
+        {
+            ScopedSpinLock lockStream(m_lock);
+            m_written += count;
+        }
+        written += count;
+
+        MixerWake();
+    }
+
+    return written;
+}
+
+int MixerStream::Ioctl(uint64_t cmd, uint64_t arg) {
+    switch (cmd) {
+    case IoCtlOutputSetVolume:
+        m_volume = MIN(MAX(static_cast<int>(arg), 0), 100);
+        return 0;
+    case IoCtlOutputGetVolume:
+        return m_volume;
+    case IoCtlOutputGetEncoding:
+        return m_encoding;
+    case IoCtlOutputGetSampleRate:
+        return m_rate;
+    case IoCtlOutputGetNumberOfChannels:
+        return m_channels;
+    case IoCtlOutputSetAsync:
+        m_async = (bool)arg;
+        return 0;
+    case IoCtlOutputSetNumberOfChannels:
+        if (arg < 1 || arg > AUDIO_MIXER_MAX_CHANNELS) {
+            return -EINVAL;
+        }
+        return SetFormat(m_encoding, arg, m_rate);
+    case IoCtlOutputSetSampleRate:
+        if (arg < AUDIO_STREAM_MIN_RATE || arg > AUDIO_STREAM_MAX_RATE) {
+            return -EINVAL;
+        }
+        return SetFormat(m_encoding, m_channels, arg);
+    case IoCtlOutputSetEncoding:
+        if (arg != PCMS16LE && arg != PCMS32LE) {
+            return -EINVAL;
+        }
+        return SetFormat(static_cast<SoundEncoding>(arg), m_channels, m_rate);
+    case IoCtlOutputMapRing: {
+        Process* process = Process::Current();
+        if (!Memory::CheckUsermodePointer(arg, sizeof(AudioRingInfo), process->addressSpace)) {
+            return -EFAULT;
+        }
+
+        MappedRegion* region = process->addressSpace->MapVMO(static_pointer_cast<VMObject>(m_ring), 0, false);
+        if (!region) {
+            return -ENOMEM;
+        }
+
+        *reinterpret_cast<AudioRingInfo*>(arg) = {
+            .base = region->Base(),
+            .size = AUDIO_STREAM_RING_SIZE,
+            .periodSize = AUDIO_MIXER_PERIOD_FRAMES * FrameSize(),
+        };
+        return 0;
+    }
+    case IoCtlOutputGetPosition: {
+        ScopedSpinLock lockStream(m_lock);
+        return m_read % AUDIO_STREAM_RING_SIZE;
+    }
+    case IoCtlOutputCommit: {
+        ScopedMutexLock lockWrite(m_writeLock);
+        if (arg % FrameSize()) {
+            return -EINVAL;
+        }
+
+        {
+            ScopedSpinLock lockStream(m_lock);
+            if (m_written + arg - m_read > AUDIO_STREAM_RING_SIZE) {
+                return -EINVAL; // More than the ring holds
+            }
+
+            m_written += arg;
+        }
+
+        MixerWake();
+        return 0;
+    }
+    default:
+        return -EINVAL;
+    }
+}
+
+int MixerStream::SetFormat(SoundEncoding encoding, int channels, int rate) {
+    ScopedMutexLock lockWrite(m_writeLock);
+    ScopedSpinLock lockStream(m_lock);
+
+    m_encoding = encoding;
+    m_channels = channels;
+    m_rate = rate;
+
+    Reset();
+    return 0;
+}
+
+void MixerStream::Reset() {
+    m_written = 0;
+    m_read = 0;
+
+    // The first output frame reads in the first input frame
+    m_phase = 1ULL << 32;
+    memset(m_previous, 0, sizeof(m_previous));
+    memset(m_next, 0, sizeof(m_next));
+}
+
+void MixerStream::ReadFrame(int32_t* frame) {
+    // The ring holds a whole number of frames, so they never wrap
+    uint8_t* p = m_samples + m_read % AUDIO_STREAM_RING_SIZE;
+    for (int c = 0; c < m_channels; c++) {
+        if (m_encoding == PCMS32LE) {
+            int32_t sample;
+            memcpy(&sample, p, sizeof(int32_t));
+            frame[c] = sample >> 16;
+            p += sizeof(int32_t);
+        } else {
+            int16_t sample;
+            memcpy(&sample, p, sizeof(int16_t));
+            frame[c] = sample;
+            p += sizeof(int16_t);
+        }
+    }
+
+    m_read += FrameSize();
+}
+
+void MixerStream::Mix(int32_t* mix, unsigned frames, int outputRate, int outputChannels, int32_t volume) {
+    bool consumed = false;
+    {
+        ScopedSpinLock lockStream(m_lock);
+
+        int64_t gain = static_cast<int64_t>(volume) * m_volume / 100;
+        uint64_t step = (static_cast<uint64_t>(m_rate) << 32) / outputRate;
+        unsigned frameSize = FrameSize();
+
+        for (unsigned i = 0; i < frames; i++) {
+            bool dry = false;
+            while (m_phase >= (1ULL << 32)) {
+                if (m_written - m_read < frameSize) {
+                    dry = true;
+                    break;
+                }
+
+                memcpy(m_previous, m_next, sizeof(m_next));
+                ReadFrame(m_next);
+                consumed = true;
+
+                m_phase -= 1ULL << 32;
+            }
+
+            if (dry) {
+                break; // Whatever is left of the period stays silent
+            }
+
+            // Interpolate between the last two input frames
+            int32_t fraction = m_phase >> 16;
+            int32_t frame[AUDIO_MIXER_MAX_CHANNELS];
+            for (int c = 0; c < m_channels; c++) {
+                frame[c] = m_previous[c] + ((static_cast<int64_t>(m_next[c] - m_previous[c]) * fraction) >> 16);
+            }
+
+            int32_t* out = mix + i * outputChannels;
+            if (m_channels == 2 && outputChannels == 1) {
+                out[0] += ((frame[0] + frame[1]) / 2 * gain) >> 16;
+            } else {
+                // Mono goes to every output channel
+                for (int c = 0; c < outputChannels; c++) {
+                    out[c] += (frame[MIN(c, m_channels - 1)] * gain) >> 16;
+                }
+            }
+
+            m_phase += step;
+        }
+    }
+
+    if (consumed) {
+        m_space.Signal();
+    }
+}
+
+void MixerAddStream(MixerStream* stream) {
+    ScopedSpinLock lockStreams(streamsLock);
+    streams.add_back(stream);
+}
+
+void MixerRemoveStream(MixerStream* stream) {
+    ScopedSpinLock lockStreams(streamsLock);
+    streams.remove(stream);
+}
+
+void MixerWake() { mixerWake.Signal(); }
+
+int MixerSetMasterVolume(int percentage) {
+    masterVolume = MIN(MAX(percentage, 0), 100);
+    return 0;
+}
+
+int MixerGetMasterVolume() { return masterVolume; }
+
+static bool MixerHasSamples() {
+    ScopedSpinLock lockStreams(streamsLock);
+    for (auto it = streams.begin(); it != streams.end(); it++) {
+        if ((*it)->HasSamples()) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Mix a period of every stream into 16-bit samples
+static void MixPeriod(int32_t* mix, unsigned frames, int rate, int channels, int16_t* output) {
+    memset(mix, 0, frames * channels * sizeof(int32_t));
+
+    {
+        ScopedSpinLock lockStreams(streamsLock);
+
+        int32_t volume = masterVolume * 0x10000 / 100;
+        for (auto it = streams.begin(); it != streams.end(); it++) {
+            (*it)->Mix(mix, frames, rate, channels, volume);
+        }
+    }
+
+    for (unsigned i = 0; i < frames * channels; i++) {
+        output[i] = MIN(MAX(mix[i], INT16_MIN), INT16_MAX);
+    }
+}
+
+[[noreturn]] static void MixerThread() {
+    // Running late means a gap in the audio
+    Scheduler::SetSchedulingClass(Thread::Current(), SchedulingClassRealtime);
+
+    PCMOutput* mapped = nullptr; // Output the ring belongs to
+    FancyRefPtr<SampleRingVMObject> ring;
+    size_t periodSize = 0;
+    uint64_t committed = 0; // Bytes committed to the ring since it was mapped
+
+    unsigned capacity = 0; // Samples which fit in the buffers
+    int32_t* mix = nullptr;
+    int16_t* period = nullptr;
+
+    for (;;) {
+        PCMOutput* out = CurrentPCMOut();
+        if (!out || !MixerHasSamples()) {
+            // Whatever is queued in the hardware plays out and it stops
+            bool wasInterrupted = mixerWake.Wait();
+            (void)wasInterrupted;
+            continue;
+        }
+
+        AudioController* c = out->c;
+        int rate = c->OutputSampleRate(out->output);
+        int channels = c->OutputNumberOfChannels(out->output);
+        if (c->OutputGetEncoding(out->output) != PCMS16LE || rate <= 0 || channels < 1 ||
+            channels > AUDIO_MIXER_MAX_CHANNELS) {
+            Log::Warning("[Audio] Mixer does not support the format of the output");
+            Thread::Current()->Sleep(1000000);
+            continue;
+        }
+
+        if (out != mapped) {
+            mapped = out;
+            committed = 0;
+
+            ring = c->OutputMapRing(out->output, periodSize);
+            if (!ring.get()) {
+                periodSize = AUDIO_MIXER_PERIOD_FRAMES * channels * sizeof(int16_t);
+            }
+        }
+
+        unsigned frames = periodSize / (channels * sizeof(int16_t));
+        if (frames * channels > capacity) {
+            delete[] mix;
+            delete[] period;
+
+            capacity = frames * channels;
+            mix = new int32_t[capacity];
+            period = new int16_t[capacity];
+        }
+
+        if (!ring.get()) {
+            // Blocks whilst the hardware has no room
+            MixPeriod(mix, frames, rate, channels, period);
+            if (c->WriteSamples(out->output, reinterpret_cast<uint8_t*>(period), periodSize, false) < 0) {
+                // Still keep time so clients are not drained as fast as they can write
+                Thread::Current()->Sleep(static_cast<long>(frames) * 1000000 / rate);
+            }
+            continue;
+        }
+
+        int position = c->OutputRingPosition(out->output);
+        if (position < 0) {
+            mapped = nullptr; // Someone else took the output, get the ring back
+            continue;
+        }
+
+        size_t queued = (committed % ring->Size() + ring->Size() - position) % ring->Size();
+        if (queued >= AUDIO_MIXER_LATENCY_PERIODS * periodSize) {
+            Thread::Current()->Sleep(static_cast<long>(frames) * 1000000 / rate);
+            continue;
+        }
+
+        // The ring holds a whole number of periods
+        MixPeriod(mix, frames, rate, channels,
+                  reinterpret_cast<int16_t*>(ring->KernelMapping() + committed % ring->Size()));
+        c->OutputRingCommit(out->output, periodSize);
+        committed += periodSize;
+    }
+}
+
+void InitializeMixer() {
+    auto proc = Process::CreateKernelProcess((void*)MixerThread, "AudioMixer", nullptr);
+    proc->Start();
+}
+
+} // namespace Audio
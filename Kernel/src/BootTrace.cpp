@@ -0,0 +1,182 @@
+#include <BootTrace.h>
+
+#include <CPU.h>
+#include <CString.h>
+#include <Device.h>
+#include <MM/KMalloc.h>
+#include <Math.h>
+#include <Spinlock.h>
+#include <Timer.h>
+
+namespace BootTrace {
+
+struct Event {
+    uint64_t tsc;
+    unsigned cpu;
+    bool ready; // Set last, the event may still be being written
+    char name[BOOT_TRACE_NAME_LENGTH];
+};
+
+// In .bss so points can be marked before the heap exists
+static Event events[BOOT_TRACE_MAX_EVENTS];
+static unsigned eventCount = 0; // Includes dropped events
+
+// Used to find the TSC frequency when the timeline is read
+static uint64_t calibrationTSC = 0;
+static uint64_t calibrationUs = 0;
+
+void Mark(const char* name, const char* detail) {
+    uint64_t tsc = ReadTimestampCounter();
+
+    unsigned index = __atomic_fetch_add(&eventCount, 1, __ATOMIC_RELAXED);
+    if (index >= BOOT_TRACE_MAX_EVENTS) {
+        return;
+    }
+
+    Event& event = events[index];
+    event.tsc = tsc;
+    event.cpu = static_cast<unsigned>(GetCPULocal()->id);
+
+    strncpy(event.name, name, BOOT_TRACE_NAME_LENGTH - 1);
+    event.name[BOOT_TRACE_NAME_LENGTH - 1] = 0;
+    if (detail) {
+        size_t len = strlen(event.name);
+        if (len + 2 < BOOT_TRACE_NAME_LENGTH - 1) {
+            strcpy(event.name + len, ": ");
+            strncpy(event.name + len + 2, detail, BOOT_TRACE_NAME_LENGTH - 1 - len - 2);
+            event.name[BOOT_TRACE_NAME_LENGTH - 1] = 0;
+        }
+    }
+
+    __atomic_store_n(&event.ready, true, __ATOMIC_RELEASE);
+}
+
+// Write label followed by num, returns the end of the text
+static char* AppendNumber(char* text, const char* label, uint64_t num) {
+    strcpy(text, label);
+    text += strlen(label);
+
+    itoa(num, text, 10);
+    return text + strlen(text);
+}
+
+// One line per point in the order they were marked:
+//     <ms since the first point> ms cpu <cpu> <name>
+// Writing adds a point for each line written
+class BootTraceDevice final : public Device {
+public:
+    BootTraceDevice() : Device("boottrace", DeviceTypeUNIXPseudo) {
+        flags = FS_NODE_FILE;
+
+        SetDeviceName("Boot Timeline");
+    }
+
+    ssize_t Read(size_t offset, size_t size, uint8_t* buffer) override {
+        ScopedSpinLock lockText(m_textLock);
+        if (!offset || !m_text) {
+            Update();
+        }
+
+        if (offset >= m_textLength) {
+            return 0;
+        }
+
+        size = MIN(size, m_textLength - offset);
+        memcpy(buffer, m_text + offset, size);
+        return size;
+    }
+
+    ssize_t Write(size_t, size_t size, uint8_t* buffer) override {
+        char name[BOOT_TRACE_NAME_LENGTH];
+
+        size_t i = 0;
+        while (i < size) {
+            size_t len = 0;
+            while (i < size && buffer[i] != '\n') {
+                if (len < BOOT_TRACE_NAME_LENGTH - 1) {
+                    name[len++] = buffer[i];
+                }
+                i++;
+            }
+            i++; // Skip the newline
+
+            if (len) {
+                name[len] = 0;
+                Mark(name);
+            }
+        }
+
+        return size;
+    }
+
+private:
+    void Update() {
+        // Time, CPU and name
+        constexpr size_t lineSize = BOOT_TRACE_NAME_LENGTH + 64;
+        constexpr size_t headerSize = 128;
+
+        if (!m_text) {
+            m_text = reinterpret_cast<char*>(kmalloc(headerSize + BOOT_TRACE_MAX_EVENTS * lineSize + 1));
+        }
+
+        unsigned count = MIN(__atomic_load_n(&eventCount, __ATOMIC_RELAXED), BOOT_TRACE_MAX_EVENTS);
+
+        // The TSC is not calibrated anywhere else, so find its rate against the timer
+        uint64_t elapsedUs = Timer::UsecondsSinceBoot() - calibrationUs;
+        uint64_t cyclesPerUs = elapsedUs ? (ReadTimestampCounter() - calibrationTSC) / elapsedUs : 0;
+        if (!cyclesPerUs) {
+            cyclesPerUs = 1;
+        }
+
+        uint64_t first = 0;
+        for (unsigned i = 0; i < count; i++) {
+            if (__atomic_load_n(&events[i].ready, __ATOMIC_ACQUIRE) && (!first || events[i].tsc < first)) {
+                first = events[i].tsc;
+            }
+        }
+
+        char* text = AppendNumber(m_text, "# ", count);
+        text = AppendNumber(text, " points, ", eventCount - count);
+        text = AppendNumber(text, " dropped, TSC ", cyclesPerUs);
+        strcpy(text, " cycles/us\n");
+        text += strlen(text);
+
+        for (unsigned i = 0; i < count; i++) {
+            Event& event = events[i];
+            if (!__atomic_load_n(&event.ready, __ATOMIC_ACQUIRE)) {
+                continue;
+            }
+
+            uint64_t us = (event.tsc - first) / cyclesPerUs;
+            text = AppendNumber(text, "", us / 1000);
+
+            // Three digits of microseconds
+            *(text++) = '.';
+            *(text++) = '0' + (us / 100) % 10;
+            *(text++) = '0' + (us / 10) % 10;
+            *(text++) = '0' + us % 10;
+
+            text = AppendNumber(text, " ms cpu ", event.cpu);
+            *(text++) = ' ';
+
+            strcpy(text, event.name);
+            text += strlen(text);
+            *(text++) = '\n';
+        }
+
+        m_textLength = text - m_text;
+    }
+
+    lock_t m_textLock = 0;
+    char* m_text = nullptr;
+    size_t m_textLength = 0;
+};
+
+void Initialize() {
+    calibrationTSC = ReadTimestampCounter();
+    calibrationUs = Timer::UsecondsSinceBoot();
+
+    new BootTraceDevice();
+}
+
+} // namespace BootTrace
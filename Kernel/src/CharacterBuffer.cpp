@@ -3,10 +3,18 @@
 #include <CString.h>
 #include <Lock.h>
 #include <Logging.h>
+#include <Math.h>
 #include <MM/KMalloc.h>
 
+typedef uint64_t __attribute__((may_alias, aligned(1))) unaligned_uint64_t;
+
+// Sets the high bit of the lowest zero byte of x, bytes above it may be set without being zero
+ALWAYS_INLINE static uint64_t ZeroBytes(uint64_t x) {
+    return (x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL;
+}
+
 CharacterBuffer::CharacterBuffer() {
-    buffer = new char[bufferSize];
+    buffer = (char*)kmalloc(bufferSize);
     bufferPos = 0;
     lock = 0;
     lines = 0;
@@ -14,7 +22,7 @@ CharacterBuffer::CharacterBuffer() {
 
 CharacterBuffer::~CharacterBuffer() {
     if(buffer){
-        delete buffer;
+        kfree(buffer);
     }
 }
 
@@ -29,36 +37,38 @@ ssize_t CharacterBuffer::Write(char* _buffer, size_t size) {
 
     ScopedSpinLock lock{this->lock};
 
-    if ((bufferPos + size) > bufferSize) {
-        char* oldBuf = buffer;
-        buffer = (char*)kmalloc(bufferPos + size + 128);
-        memcpy(buffer, oldBuf, bufferSize);
-        bufferSize = bufferPos + size + 128;
+    Reserve(size);
+    char* data = buffer + start;
 
-        if(oldBuf) {
-            kfree(oldBuf);
-        }
+    if (raw) {
+        memcpy(data + bufferPos, _buffer, size);
+        bufferPos += size;
+
+        return size;
     }
 
-    ssize_t written = 0;
+    size_t i = 0;
+    while (i < size) {
+        // Copy everything up to the next erase or end of line at once
+        size_t run = Scan(_buffer + i, size - i, erase, '\n', '\0');
+        memcpy(data + bufferPos, _buffer + i, run);
+        bufferPos += run;
+        i += run;
 
-    for (unsigned i = 0; i < size; i++) {
-        if (_buffer[i] == '\b' /*Backspace*/ && !ignoreBackspace) {
-            if (bufferPos > 0) {
-                bufferPos--;
-                written++;
-            }
-            continue;
-        } else {
-            buffer[bufferPos++] = _buffer[i];
-            written++;
+        if (i >= size) {
+            break;
         }
 
-        if (_buffer[i] == '\n' || _buffer[i] == '\0')
+        char c = _buffer[i++];
+        if (c == '\n' || c == '\0') {
+            data[bufferPos++] = c;
             lines++;
+        } else if (bufferPos > 0 && data[bufferPos - 1] != '\n' && data[bufferPos - 1] != '\0') {
+            bufferPos--; // Erase, which stops at the start of the line
+        }
     }
 
-    return written;
+    return size;
 }
 
 ssize_t CharacterBuffer::Read(char* _buffer, size_t count) {
@@ -67,33 +77,132 @@ ssize_t CharacterBuffer::Read(char* _buffer, size_t count) {
         return 0;
     }
 
-    int i = 0;
-    int readPos = 0;
-    for (; readPos < bufferPos && i < count; readPos++) {
-        if (buffer[readPos] == '\0') {
-            lines--;
-            continue;
+    char* data = buffer + start;
+
+    if (raw) {
+        if (count > bufferPos) {
+            count = bufferPos;
         }
 
-        _buffer[i] = buffer[readPos];
-        i++;
+        memcpy(_buffer, data, count);
+        start += count;
+        bufferPos -= count;
+
+        if (!bufferPos) {
+            start = 0;
+        }
 
-        if (buffer[readPos] == '\n')
-            lines--;
+        return count;
     }
 
-    for (unsigned j = 0; j < bufferSize - readPos; j++) {
-        buffer[j] = buffer[readPos + j];
+    size_t i = 0;
+    size_t readPos = 0;
+    while (readPos < bufferPos && i < count) {
+        size_t run = Scan(data + readPos, MIN(bufferPos - readPos, count - i), '\n', '\0', '\0');
+        memcpy(_buffer + i, data + readPos, run);
+        i += run;
+        readPos += run;
+
+        if (readPos >= bufferPos || i >= count) {
+            break;
+        }
+
+        // End of line, NUL ends a line without being read
+        char c = data[readPos++];
+        lines--;
+
+        if (c == '\n') {
+            _buffer[i++] = c;
+        }
     }
 
+    // Leave the rest where it is rather than moving it to the start of the buffer
+    start += readPos;
     bufferPos -= readPos;
 
+    if (!bufferPos) {
+        start = 0;
+    }
+
     return i;
 }
 
+void CharacterBuffer::SetRaw(bool r) {
+    ScopedSpinLock lock{this->lock};
+    if (raw == r) {
+        return;
+    }
+
+    raw = r;
+    if (!raw) {
+        char* data = buffer + start;
+
+        lines = 0;
+        for (size_t i = Scan(data, bufferPos, '\n', '\0', '\0'); i < bufferPos;
+             i += Scan(data + i, bufferPos - i, '\n', '\0', '\0')) {
+            lines++;
+            i++;
+        }
+    }
+}
+
 void CharacterBuffer::Flush() {
     ScopedSpinLock lock{this->lock};
 
+    start = 0;
     bufferPos = 0;
     lines = 0;
-}
\ No newline at end of file
+}
+
+void CharacterBuffer::Reserve(size_t size) {
+    if (start + bufferPos + size <= bufferSize) {
+        return;
+    }
+
+    if (bufferPos + size <= bufferSize && start >= bufferPos) {
+        // Move the data back to the start of the buffer, the old and new locations do not overlap
+        memcpy(buffer, buffer + start, bufferPos);
+        start = 0;
+        return;
+    }
+
+    size_t newSize = bufferSize;
+    while (newSize < bufferPos + size) {
+        newSize <<= 1; // Grow geometrically so a stream of small writes is not copied each time
+    }
+
+    char* oldBuf = buffer;
+    buffer = (char*)kmalloc(newSize);
+    memcpy(buffer, oldBuf + start, bufferPos);
+    bufferSize = newSize;
+    start = 0;
+
+    if(oldBuf) {
+        kfree(oldBuf);
+    }
+}
+
+size_t CharacterBuffer::Scan(const char* data, size_t len, char a, char b, char c) {
+    uint64_t pa = 0x0101010101010101ULL * static_cast<uint8_t>(a);
+    uint64_t pb = 0x0101010101010101ULL * static_cast<uint8_t>(b);
+    uint64_t pc = 0x0101010101010101ULL * static_cast<uint8_t>(c);
+
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        uint64_t word = *reinterpret_cast<const unaligned_uint64_t*>(data + i);
+
+        // The lowest byte set in any of the masks is an exact match
+        uint64_t match = ZeroBytes(word ^ pa) | ZeroBytes(word ^ pb) | ZeroBytes(word ^ pc);
+        if (match) {
+            return i + (__builtin_ctzll(match) >> 3);
+        }
+    }
+
+    for (; i < len; i++) {
+        if (data[i] == a || data[i] == b || data[i] == c) {
+            return i;
+        }
+    }
+
+    return len;
+}
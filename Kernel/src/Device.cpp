@@ -7,6 +7,7 @@
 #include <Fs/VolumeManager.h>
 #include <Scheduler.h>
 #include <List.h>
+#include <Spinlock.h>
 #include <Math.h>
 #include <String.h>
 #include <Timer.h>
@@ -145,6 +146,7 @@ namespace DeviceManager {
 int64_t nextDeviceID = 1;
 List<Device*>* rootDevices;
 Vector<Device*>* devices;
+lock_t devicesLock = 0; // Drivers are probed in parallel at boot
 
 class DevFS : public Device {
 public:
@@ -210,6 +212,7 @@ void RegisterFSVolume(){
 }
 
 void RegisterDevice(Device* dev) {
+    ScopedSpinLock lock(devicesLock);
     dev->SetID(nextDeviceID++);
 
     devices->add_back(dev);
@@ -220,6 +223,7 @@ void RegisterDevice(Device* dev) {
 }
 
 void UnregisterDevice(Device* dev) {
+    ScopedSpinLock lock(devicesLock);
     if (dev->IsRootDevice()) {
         rootDevices->remove(dev);
     }
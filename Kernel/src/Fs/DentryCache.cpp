@@ -0,0 +1,185 @@
+#include <Fs/DentryCache.h>
+
+#include <Fs/Filesystem.h>
+
+#include <Assert.h>
+#include <CString.h>
+#include <Hash.h>
+#include <List.h>
+#include <RCU.h>
+#include <Spinlock.h>
+
+#define DENTRY_CACHE_BUCKETS 1024
+
+namespace fs::DentryCache {
+
+struct Dentry {
+    FsNode* parent;
+    FsNode* node; // nullptr if the name does not exist
+    unsigned hash;
+    unsigned nameLength;
+    char name[DENTRY_NAME_MAX + 1];
+
+    Dentry* hashNext; // Next entry in the bucket, published with RCU::Assign
+    bool referenced;  // Set by lookups, cleared as the entry is passed over for eviction
+
+    // Least recently used list
+    Dentry* next;
+    Dentry* prev;
+};
+
+// Lookups only hold an RCU read section, everything else holds cacheLock.
+// Entries are never changed once published, they are unlinked and retired instead.
+static lock_t cacheLock = 0;
+static Dentry* buckets[DENTRY_CACHE_BUCKETS] = {};
+static FastList<Dentry*> lru; // Oldest entry at the front, approximately least recently used
+static uint64_t generation = 0;
+
+static inline unsigned HashName(FsNode* dir, const char* name, unsigned length) {
+    // FNV-1a over the name, mixed with the directory
+    unsigned hash = 2166136261U ^ HashU(static_cast<unsigned>(reinterpret_cast<uintptr_t>(dir) >> 4));
+    for (unsigned i = 0; i < length; i++) {
+        hash = (hash ^ static_cast<uint8_t>(name[i])) * 16777619U;
+    }
+
+    return hash;
+}
+
+// cacheLock or an RCU read section must be held
+static Dentry** FindEntry(FsNode* dir, const char* name, unsigned length, unsigned hash) {
+    Dentry** entry = &buckets[hash % DENTRY_CACHE_BUCKETS];
+    while (Dentry* d = RCU::Dereference(*entry)) {
+        if (d->hash == hash && d->parent == dir && d->nameLength == length && !memcmp(d->name, name, length)) {
+            return entry;
+        }
+
+        entry = &d->hashNext;
+    }
+
+    return nullptr;
+}
+
+// cacheLock must be held, the entry is unlinked and freed once no lookup can be using it
+static void RemoveEntry(Dentry** entry) {
+    Dentry* d = *entry;
+    RCU::Assign(*entry, d->hashNext); // Lookups already on the entry can carry on past it
+
+    lru.remove(d);
+
+    d->parent->dentryCount--;
+    if (d->node) {
+        d->node->dentryCount--;
+    }
+
+    RCU::Retire(d);
+}
+
+bool Lookup(FsNode* dir, const char* name, FsNode*& node) {
+    unsigned length = strlen(name);
+    if (length > DENTRY_NAME_MAX) {
+        return false;
+    }
+
+    unsigned hash = HashName(dir, name, length);
+
+    RCU::ReadGuard guard;
+    Dentry** entry = FindEntry(dir, name, length, hash);
+    if (!entry) {
+        return false;
+    }
+
+    Dentry* d = RCU::Dereference(*entry);
+    if (!d->referenced) {
+        __atomic_store_n(&d->referenced, true, __ATOMIC_RELAXED);
+    }
+
+    node = d->node;
+    return true;
+}
+
+uint64_t Generation() { return __atomic_load_n(&generation, __ATOMIC_ACQUIRE); }
+
+void Insert(FsNode* dir, const char* name, FsNode* node, uint64_t gen) {
+    unsigned length = strlen(name);
+    if (length > DENTRY_NAME_MAX) {
+        return;
+    }
+
+    unsigned hash = HashName(dir, name, length);
+
+    ScopedSpinLock lockCache(cacheLock);
+    if (generation != gen || FindEntry(dir, name, length, hash)) {
+        return; // Stale or another thread cached it first
+    }
+
+    if (lru.get_length() >= DENTRY_CACHE_MAX) {
+        // Second chance, entries looked up since they were last passed over go to the back
+        Dentry* victim = lru.get_front();
+        for (unsigned i = 0; i < DENTRY_CACHE_MAX && __atomic_load_n(&victim->referenced, __ATOMIC_RELAXED); i++) {
+            __atomic_store_n(&victim->referenced, false, __ATOMIC_RELAXED);
+
+            lru.rotate();
+            victim = lru.get_front();
+        }
+
+        Dentry** entry = FindEntry(victim->parent, victim->name, victim->nameLength, victim->hash);
+        assert(entry);
+        RemoveEntry(entry);
+    }
+
+    // A lookup may still be reading an evicted entry, so it is never reused in place
+    Dentry* d = new Dentry;
+    d->parent = dir;
+    d->node = node;
+    d->hash = hash;
+    d->nameLength = length;
+    memcpy(d->name, name, length);
+    d->name[length] = 0;
+    d->referenced = false;
+
+    dir->dentryCount++;
+    if (node) {
+        node->dentryCount++;
+    }
+
+    Dentry*& bucket = buckets[hash % DENTRY_CACHE_BUCKETS];
+    d->hashNext = bucket;
+    RCU::Assign(bucket, d);
+
+    lru.add_back(d);
+}
+
+void Invalidate(FsNode* dir, const char* name) {
+    unsigned length = strlen(name);
+
+    ScopedSpinLock lockCache(cacheLock);
+    generation++;
+
+    if (length > DENTRY_NAME_MAX) {
+        return;
+    }
+
+    if (Dentry** entry = FindEntry(dir, name, length, HashName(dir, name, length)); entry) {
+        RemoveEntry(entry);
+    }
+}
+
+void Purge(FsNode* node) {
+    ScopedSpinLock lockCache(cacheLock);
+    generation++;
+
+    Dentry* d = lru.get_front();
+    while (d && node->dentryCount) {
+        Dentry* next = lru.next(d);
+
+        if (d->parent == node || d->node == node) {
+            Dentry** entry = FindEntry(d->parent, d->name, d->nameLength, d->hash);
+            assert(entry);
+            RemoveEntry(entry);
+        }
+
+        d = next;
+    }
+}
+
+} // namespace fs::DentryCache
@@ -0,0 +1,361 @@
+#include <Fs/EPoll.h>
+
+#include <Errno.h>
+#include <Math.h>
+#include <Net/Socket.h>
+
+namespace fs {
+
+// Held when changing the epoll items of any file and when the last handle to an EPoll is closed
+static lock_t fileItemsLock = 0;
+
+static int EPollToPollEvents(uint32_t ep) {
+    int evs = 0;
+    if (ep & EPOLLIN) {
+        evs |= POLLIN;
+    }
+
+    if (ep & EPOLLOUT) {
+        evs |= POLLOUT;
+    }
+
+    if (ep & EPOLLHUP) {
+        evs |= POLLHUP;
+    }
+
+    if (ep & EPOLLRDHUP) {
+        evs |= POLLRDHUP;
+    }
+
+    if (ep & EPOLLERR) {
+        evs |= POLLERR;
+    }
+
+    if (ep & EPOLLPRI) {
+        evs |= POLLPRI;
+    }
+
+    return evs;
+}
+
+// Events the node has out of those requested, sockets always report EPOLLHUP
+static uint32_t GetEvents(FsNode* node, uint32_t requested) {
+    uint32_t ev = 0;
+    if (requested & EPOLLIN) {
+        if (node->CanRead()) {
+            ev |= EPOLLIN;
+        }
+    }
+
+    if (requested & EPOLLOUT) {
+        if (node->CanWrite()) {
+            ev |= EPOLLOUT;
+        }
+    }
+
+    if (node->IsSocket()) {
+        Socket* sock = (Socket*)node;
+        if (!sock->IsConnected() && !sock->IsListening()) {
+            ev |= EPOLLHUP;
+        }
+
+        if (sock->PendingConnections() && (requested & EPOLLIN)) {
+            ev |= EPOLLIN;
+        }
+    }
+
+    return ev;
+}
+
+void EPollItem::Signal() { epoll->Queue(this, true); }
+
+EPoll::~EPoll() {
+    // Close already stopped watching the files
+    for (EPollItem* item : items) {
+        if (item) {
+            delete item;
+        }
+    }
+}
+
+void EPoll::Close() {
+    {
+        ScopedSpinLock lockItems(fileItemsLock);
+        handleCount--;
+
+        if (handleCount > 0) {
+            return;
+        }
+
+        // Files cannot be closed whilst the lock is held, so their nodes are still around.
+        // Once unlinked FileClosed can no longer find the items.
+        for (EPollItem* item : items) {
+            if (item) {
+                item->node->Unwatch(*item);
+                UnlinkFile(item);
+            }
+        }
+    }
+
+    delete this;
+}
+
+int EPoll::Add(int fd, UNIXOpenFile* file, const epoll_event& event) {
+    ScopedMutexLock lockEp(epLock);
+    if (static_cast<unsigned>(fd) < items.get_length() && items[fd]) {
+        return -EEXIST; // Already watching the fd
+    }
+
+    if (static_cast<unsigned>(fd) >= items.get_length()) {
+        items.resize(fd + 1);
+    }
+
+    EPollItem* item = new EPollItem(this, fd, file, event);
+    {
+        ScopedSpinLock lockItems(fileItemsLock);
+        item->fileNext = file->epollItems;
+        if (file->epollItems) {
+            file->epollItems->filePrev = item;
+        }
+        file->epollItems = item;
+    }
+
+    items[fd] = item;
+    Arm(item);
+    return 0;
+}
+
+int EPoll::Modify(int fd, const epoll_event& event) {
+    ScopedMutexLock lockEp(epLock);
+    if (static_cast<unsigned>(fd) >= items.get_length() || !items[fd]) {
+        return -ENOENT; // fd not found
+    }
+
+    EPollItem* item = items[fd];
+    if ((event.events & EPOLLEXCLUSIVE) || (item->event.events & EPOLLEXCLUSIVE)) {
+        return -EINVAL; // EPOLLEXCLUSIVE can only be set by EPOLL_CTL_ADD
+    }
+
+    item->event = event;
+    item->disabled = false;
+
+    Arm(item);
+    return 0;
+}
+
+int EPoll::Remove(int fd) {
+    ScopedMutexLock lockEp(epLock);
+    if (static_cast<unsigned>(fd) >= items.get_length() || !items[fd]) {
+        return -ENOENT;
+    }
+
+    EPollItem* item = items[fd];
+    {
+        ScopedSpinLock lockItems(fileItemsLock);
+        if (!item->file) {
+            return -ENOENT; // The file is being closed and will detach the item
+        }
+
+        UnlinkFile(item);
+    }
+
+    Detach(item);
+    return 0;
+}
+
+long EPoll::Wait(UserBuffer<epoll_event> events, int maxEvents, long timeout) {
+    while (true) {
+        {
+            ScopedMutexLock lockEp(epLock);
+            if (int count = Collect(events, maxEvents); count) {
+                return count;
+            }
+        }
+
+        if (!timeout) {
+            return 0;
+        }
+
+        {
+            ScopedSpinLock<true> lockReady(readyLock);
+            if (ready.get_length()) {
+                continue; // Queued since collecting
+            }
+
+            waiting++;
+        }
+
+        bool interrupted;
+        if (timeout > 0) {
+            interrupted = waiters.WaitTimeout(timeout);
+            if (timeout <= 0) {
+                timeout = 0; // Timed out, collect one last time
+            }
+        } else {
+            interrupted = waiters.Wait();
+        }
+
+        {
+            ScopedSpinLock<true> lockReady(readyLock);
+            waiting--;
+        }
+
+        if (interrupted) {
+            return -EINTR;
+        }
+    }
+}
+
+void EPoll::FileClosed(UNIXOpenFile* file) {
+    while (true) {
+        EPollItem* item;
+        EPoll* epoll;
+        {
+            ScopedSpinLock lockItems(fileItemsLock);
+            item = file->epollItems;
+            if (!item) {
+                return;
+            }
+
+            epoll = item->epoll;
+            UnlinkFile(item);
+
+            epoll->handleCount++; // Keep the EPoll around until the item is detached
+        }
+
+        {
+            ScopedMutexLock lockEp(epoll->epLock);
+            epoll->Detach(item);
+        }
+
+        epoll->Close();
+    }
+}
+
+void EPoll::Queue(EPollItem* item, bool wake) {
+    unsigned wakeCount;
+    {
+        ScopedSpinLock<true> lockReady(readyLock);
+        if (!item->ready) {
+            item->ready = true;
+            ready.add_back(item);
+        }
+
+        // Exclusive items only wake a single waiting thread
+        wakeCount = (item->event.events & EPOLLEXCLUSIVE) ? MIN(waiting, 1U) : waiting;
+    }
+
+    if (!wake) {
+        return;
+    }
+
+    while (wakeCount--) {
+        waiters.Signal();
+    }
+}
+
+void EPoll::Arm(EPollItem* item) {
+    item->rearm = false;
+    if (item->disabled) {
+        return;
+    }
+
+    // Nodes only signal a watcher once, make sure it is not watching twice
+    item->node->Unwatch(*item);
+    item->node->Watch(*item, EPollToPollEvents(item->event.events));
+
+    // Not every node signals when it already has events
+    if (GetEvents(item->node, item->event.events)) {
+        Queue(item, false);
+    }
+}
+
+void EPoll::Detach(EPollItem* item) {
+    items[item->fd] = nullptr;
+
+    item->node->Unwatch(*item);
+    {
+        ScopedSpinLock<true> lockReady(readyLock);
+        if (item->ready) {
+            ready.remove(item);
+        }
+    }
+
+    delete item;
+}
+
+void EPoll::UnlinkFile(EPollItem* item) {
+    if (item->filePrev) {
+        item->filePrev->fileNext = item->fileNext;
+    } else {
+        item->file->epollItems = item->fileNext;
+    }
+
+    if (item->fileNext) {
+        item->fileNext->filePrev = item->filePrev;
+    }
+
+    item->file = nullptr;
+    item->fileNext = nullptr;
+    item->filePrev = nullptr;
+}
+
+int EPoll::Collect(UserBuffer<epoll_event>& events, int maxEvents) {
+    unsigned pending;
+    {
+        ScopedSpinLock<true> lockReady(readyLock);
+        pending = ready.get_length(); // Items put back on the list are left for the next call
+    }
+
+    int count = 0;
+    while (pending-- && count < maxEvents) {
+        EPollItem* item;
+        {
+            ScopedSpinLock<true> lockReady(readyLock);
+            item = ready.get_front();
+            if (!item) {
+                break;
+            }
+
+            ready.remove(item);
+            item->ready = false;
+        }
+
+        if (item->rearm || item->disabled) {
+            Arm(item);
+            continue;
+        }
+
+        uint32_t ev = GetEvents(item->node, item->event.events);
+        if (!ev) {
+            Arm(item); // Signalled but nothing to report
+            continue;
+        }
+
+        if (events.StoreValue(count, {
+                                         .events = ev,
+                                         .data = item->event.data,
+                                     })) {
+            Queue(item, false);
+            return -EFAULT;
+        }
+        count++;
+
+        if (item->event.events & EPOLLONESHOT) {
+            // Not reported again until EPOLL_CTL_MOD
+            item->disabled = true;
+            item->node->Unwatch(*item);
+        } else if (item->event.events & EPOLLET) {
+            // Watched again the next time the list is collected, once the events have been handled.
+            // Events still there then are reported again.
+            item->rearm = true;
+            Queue(item, false);
+        } else {
+            Queue(item, false); // Level triggered, reported until there are no events
+        }
+    }
+
+    return count;
+}
+
+} // namespace fs
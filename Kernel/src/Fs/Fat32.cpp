@@ -4,6 +4,7 @@
 #include <Device.h>
 #include <Errno.h>
 #include <Logging.h>
+#include <Math.h>
 #include <Memory.h>
 
 namespace fs::FAT32 {
@@ -54,6 +55,11 @@ Fat32Volume::Fat32Volume(PartitionDevice* _part, char* name) {
 
     clusterSizeBytes = bootRecord->bpb.sectorsPerCluster * part->parentDisk->blocksize;
 
+    fatBlockCount = (static_cast<uint64_t>(bootRecord->ebr.sectorsPerFAT) * part->parentDisk->blocksize +
+                     FAT32_FAT_BLOCK_SIZE - 1) / FAT32_FAT_BLOCK_SIZE;
+    fatBlocks = new uint32_t*[fatBlockCount];
+    memset(fatBlocks, 0, sizeof(uint32_t*) * fatBlockCount);
+
     fat32MountPoint.flags = FS_NODE_MOUNTPOINT | FS_NODE_DIRECTORY;
     fat32MountPoint.inode = bootRecord->ebr.rootClusterNum;
 
@@ -67,82 +73,82 @@ Fat32Volume::Fat32Volume(PartitionDevice* _part, char* name) {
     strcpy(mountPointDirent.name, name);
 }
 
-List<uint32_t>* Fat32Volume::GetClusterChain(uint32_t cluster) {
-    List<uint32_t>* list = new List<uint32_t>();
-
-    uint32_t* buf = (uint32_t*)kmalloc(4096);
-
-    uint32_t lastBlock = 0xFFFFFFFF;
-
-    do {
-        list->add_back(cluster);
-
-        uint32_t block = ((cluster * 4) / 4096);
-        uint32_t offset = cluster % (4096 / 4);
-
-        if (block != lastBlock) {
-            if (part->ReadBlock(bootRecord->bpb.reservedSectors +
-                                    block * (4096 / part->parentDisk->blocksize) /* Get Sector of Block */,
-                                4096, buf)) {
-                delete list;
-                return nullptr;
-            }
+uint32_t Fat32Volume::NextCluster(uint32_t cluster) {
+    uint32_t block = cluster / (FAT32_FAT_BLOCK_SIZE / 4);
+    if (block >= fatBlockCount) {
+        return 0;
+    }
 
-            lastBlock = block;
+    uint32_t* entries = __atomic_load_n(&fatBlocks[block], __ATOMIC_ACQUIRE);
+    if (!entries) {
+        // Read without the lock, another thread may read the same block
+        entries = (uint32_t*)kmalloc(FAT32_FAT_BLOCK_SIZE);
+        if (part->ReadBlock(bootRecord->bpb.reservedSectors +
+                                block * (FAT32_FAT_BLOCK_SIZE / part->parentDisk->blocksize) /* Get Sector of Block */,
+                            FAT32_FAT_BLOCK_SIZE, entries)) {
+            kfree(entries);
+            return 0;
         }
 
-        cluster = buf[offset] & 0x0FFFFFFF;
+        ScopedSpinLock lockFat(fatLock);
+        if (fatBlocks[block]) {
+            kfree(entries);
+            entries = fatBlocks[block];
+        } else {
+            __atomic_store_n(&fatBlocks[block], entries, __ATOMIC_RELEASE);
+        }
+    }
 
-    } while (cluster && (cluster & 0x0FFFFFFF) < 0x0FFFFFF8);
+    uint32_t next = entries[cluster % (FAT32_FAT_BLOCK_SIZE / 4)] & 0x0FFFFFFF;
+    if (next < 2 || next >= FAT32_CLUSTER_END) {
+        return 0; // End of the chain
+    }
 
-    return list;
+    return next;
 }
 
-void* Fat32Volume::ReadClusterChain(uint32_t cluster, int* clusterCount, size_t max) {
-    uint32_t maxCluster = (max / (bootRecord->bpb.sectorsPerCluster * part->parentDisk->blocksize)) + 1;
-    List<uint32_t>* clusterChain = GetClusterChain(cluster);
-
-    if (!clusterChain)
-        return nullptr;
-
-    uint8_t* buf = reinterpret_cast<uint8_t*>(kmalloc(clusterChain->get_length() * clusterSizeBytes));
-    void* _buf = buf;
-
-    for (unsigned i = 0; i < clusterChain->get_length() && maxCluster; i++) {
-        part->ReadBlock(ClusterToLBA(clusterChain->get_at(i)), clusterSizeBytes, buf);
-
-        buf += clusterSizeBytes;
+uint32_t Fat32Volume::GetCluster(Fat32Node* node, uint32_t index) {
+    ScopedMutexLock lockClusters(node->clusterLock);
+    if (!node->clusters.get_length()) {
+        node->clusters.add_back(node->inode);
     }
 
-    if (clusterCount)
-        *clusterCount = clusterChain->get_length();
+    // Follow the chain only as far as needed
+    while (node->clusters.get_length() <= index) {
+        uint32_t next = NextCluster(node->clusters[node->clusters.get_length() - 1]);
+        if (!next) {
+            return 0;
+        }
 
-    delete clusterChain;
+        node->clusters.add_back(next);
+    }
 
-    return _buf;
+    return node->clusters[index];
 }
 
 void* Fat32Volume::ReadClusterChain(uint32_t cluster, int* clusterCount) {
     if (cluster == 0)
         cluster = bootRecord->ebr.rootClusterNum;
-    List<uint32_t>* clusterChain = GetClusterChain(cluster);
 
-    if (!clusterChain)
-        return nullptr;
+    Vector<uint32_t> clusterChain;
+    for (; cluster; cluster = NextCluster(cluster)) {
+        clusterChain.add_back(cluster);
+    }
 
-    uint8_t* buf = reinterpret_cast<uint8_t*>(kmalloc(clusterChain->get_length() * clusterSizeBytes));
+    uint8_t* buf = reinterpret_cast<uint8_t*>(kmalloc(clusterChain.get_length() * clusterSizeBytes));
     void* _buf = buf;
 
-    for (unsigned i = 0; i < clusterChain->get_length(); i++) {
-        part->ReadBlock(ClusterToLBA(clusterChain->get_at(i)), clusterSizeBytes, buf);
+    for (unsigned i = 0; i < clusterChain.get_length(); i++) {
+        if (part->ReadBlock(ClusterToLBA(clusterChain[i]), clusterSizeBytes, buf)) {
+            kfree(_buf);
+            return nullptr;
+        }
 
         buf += clusterSizeBytes;
     }
 
     if (clusterCount)
-        *clusterCount = clusterChain->get_length();
-
-    delete clusterChain;
+        *clusterCount = clusterChain.get_length();
 
     return _buf;
 }
@@ -151,26 +157,66 @@ ssize_t Fat32Volume::Read(Fat32Node* node, size_t offset, size_t size, uint8_t*
     if (!node->inode || node->flags & FS_NODE_DIRECTORY)
         return -1;
 
-    int count;
-    void* _buf = ReadClusterChain(node->inode, &count, size);
-
-    if (static_cast<unsigned>(count) * bootRecord->bpb.sectorsPerCluster * part->parentDisk->blocksize < size)
+    if (offset >= node->size)
         return 0;
+    else if (offset + size > node->size)
+        size = node->size - offset;
+
+    // Only read the clusters covering the requested range
+    size_t clusterSize = clusterSizeBytes;
+    uint8_t* clusterBuffer = nullptr; // Clusters only partly read go here first
+
+    size_t done = 0;
+    while (done < size) {
+        size_t pos = offset + done;
+        uint32_t index = pos / clusterSize;
+        size_t clusterOffset = pos % clusterSize;
+
+        uint32_t cluster = GetCluster(node, index);
+        if (!cluster) {
+            break; // Chain is shorter than the file
+        }
 
-    memcpy(buffer, _buf, size);
-    return size;
-}
+        if (clusterOffset || size - done < clusterSize) {
+            if (!clusterBuffer) {
+                clusterBuffer = reinterpret_cast<uint8_t*>(kmalloc(clusterSize));
+            }
+
+            if (part->ReadBlock(ClusterToLBA(cluster), clusterSize, clusterBuffer)) {
+                break;
+            }
+
+            size_t count = MIN(clusterSize - clusterOffset, size - done);
+            memcpy(buffer + done, clusterBuffer + clusterOffset, count);
+            done += count;
+            continue;
+        }
+
+        // Read clusters contiguous on disk straight into the buffer with one request
+        uint32_t limit = MIN((size - done) / clusterSize, MAX(FAT32_MAX_READ / clusterSize, 1UL));
+        uint32_t count = 1;
+        while (count < limit && GetCluster(node, index + count) == cluster + count) {
+            count++;
+        }
 
-ssize_t Fat32Volume::Write(Fat32Node* node, size_t offset, size_t size, uint8_t* buffer) {
-    return -EROFS;
+        if (part->ReadBlock(ClusterToLBA(cluster), count * clusterSize, buffer + done)) {
+            break;
+        }
+        done += count * clusterSize;
+    }
 
-    List<uint32_t>* clusters = GetClusterChain(node->inode);
-    if (offset + size > clusters->get_length() * bootRecord->bpb.sectorsPerCluster * part->parentDisk->blocksize) {
-        // TODO: Allocate clusters
-        Log::Info("[FAT32] Allocating Clusters");
+    if (clusterBuffer) {
+        kfree(clusterBuffer);
     }
+
+    if (!done) {
+        return -EIO;
+    }
+    return done;
 }
 
+ssize_t Fat32Volume::Write(Fat32Node* node, size_t offset, size_t size, uint8_t* buffer) { return -EROFS; }
+
 void Fat32Volume::Open(Fat32Node* node, uint32_t flags) {}
 
 void Fat32Volume::Close(Fat32Node* node) {}
@@ -183,6 +229,9 @@ int Fat32Volume::ReadDir(Fat32Node* node, DirectoryEntry* dirent, uint32_t index
     int clusterCount = 0;
 
     fat_entry_t* dirEntries = (fat_entry_t*)ReadClusterChain(cluster, &clusterCount);
+    if (!dirEntries) {
+        return -EIO;
+    }
 
     fat_entry_t* dirEntry;
     int dirEntryIndex = -1;
@@ -213,6 +262,7 @@ int Fat32Volume::ReadDir(Fat32Node* node, DirectoryEntry* dirent, uint32_t index
     }
 
     if (dirEntryIndex == -1) {
+        kfree(dirEntries);
         return 0;
     }
 
@@ -241,6 +291,8 @@ int Fat32Volume::ReadDir(Fat32Node* node, DirectoryEntry* dirent, uint32_t index
     else
         dirent->flags = DT_REG;
 
+    kfree(lfnEntries);
+    kfree(dirEntries);
     return 1;
 }
 
@@ -251,16 +303,16 @@ FsNode* Fat32Volume::FindDir(Fat32Node* node, const char* name) {
     int clusterCount = 0;
 
     fat_entry_t* dirEntries = (fat_entry_t*)ReadClusterChain(cluster, &clusterCount);
-
-    List<int> foundEntries;
-    List<int> foundEntriesLfnCount;
+    if (!dirEntries) {
+        return nullptr;
+    }
 
     fat_lfn_entry_t** lfnEntries;
     Fat32Node* _node = nullptr;
 
-    for (unsigned i = 0; i < static_cast<unsigned>(clusterCount) * clusterSizeBytes; i++) {
+    for (unsigned i = 0; i < static_cast<unsigned>(clusterCount) * clusterSizeBytes / sizeof(fat_entry_t); i++) {
         if (dirEntries[i].filename[0] == 0)
-            return nullptr; // No Directory Entry at index
+            break; // No Directory Entry at index
         else if (dirEntries[i].filename[0] == 0xE5) {
             lfnCount = 0;
             continue; // Unused Entry
@@ -293,10 +345,15 @@ FsNode* Fat32Volume::FindDir(Fat32Node* node, const char* name) {
                 }
             }
 
-            if (strcmp(_name, name) == 0) {
+            bool match = strcmp(_name, name) == 0;
+            kfree(_name);
+
+            if (match) {
                 uint64_t clusterNum = (((uint32_t)dirEntries[i].highClusterNum) << 16) | dirEntries[i].lowClusterNum;
-                if (clusterNum == bootRecord->ebr.rootClusterNum || clusterNum == 0)
+                if (clusterNum == bootRecord->ebr.rootClusterNum || clusterNum == 0) {
+                    kfree(dirEntries);
                     return mountPoint; // Root Directory
+                }
                 _node = new Fat32Node();
                 _node->size = dirEntries[i].fileSize;
                 _node->inode = clusterNum;
@@ -314,6 +371,7 @@ FsNode* Fat32Volume::FindDir(Fat32Node* node, const char* name) {
         _node->vol = this;
     }
 
+    kfree(dirEntries);
     return _node;
 }
 
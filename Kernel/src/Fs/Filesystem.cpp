@@ -1,10 +1,16 @@
 #include <Fs/Filesystem.h>
 
 #include <Errno.h>
+#include <Fs/DentryCache.h>
+#include <Fs/EPoll.h>
 #include <Fs/FsVolume.h>
+#include <Fs/PageCache.h>
+#include <Fs/Readahead.h>
 #include <Fs/VolumeManager.h>
 #include <Logging.h>
+#include <Math.h>
 #include <Panic.h>
+#include <Paging.h>
 #include <Scheduler.h>
 
 #include <Debug.h>
@@ -47,6 +53,38 @@ retry:
     }
 }
 
+void UNIXOpenFile::Watch(KernelObjectWatcher& watcher, int events) {
+    FileObjectWatcher* fileWatcher = new FileObjectWatcher(watcher);
+    {
+        ScopedSpinLock acq(objectWatchersLock);
+        objectWatchers.add_back(fileWatcher);
+    }
+
+    // Kernel object waits have no events of their own, the watcher keeps the file open until Unwatch
+    node->Watch(*fileWatcher, events ? events : POLLIN);
+}
+
+void UNIXOpenFile::Unwatch(KernelObjectWatcher& watcher) {
+    FileObjectWatcher* fileWatcher = nullptr;
+    {
+        ScopedSpinLock acq(objectWatchersLock);
+        for (FileObjectWatcher* w : objectWatchers) {
+            if (&w->watcher == &watcher) {
+                fileWatcher = w;
+                break;
+            }
+        }
+
+        if (!fileWatcher) {
+            return;
+        }
+        objectWatchers.remove(fileWatcher);
+    }
+
+    node->Unwatch(*fileWatcher);
+    delete fileWatcher;
+}
+
 DirectoryEntry::DirectoryEntry(FsNode* node, const char* name) : node(node) {
     strncpy(this->name, name, NAME_MAX);
 
@@ -414,32 +452,102 @@ FsNode* Root::FindDir(const char* name) {
     return nullptr;
 }
 
+// Make sure writes through shared mappings are seen before reading
+static void WriteBackMappings(FsNode* node) {
+    if (node->pageCache) {
+        if (PageCache* cache = PageCache::AcquireIfCached(node); cache) {
+            if (cache->HasDirtyPages()) {
+                cache->WriteBack();
+            }
+            cache->Release();
+        }
+    }
+}
+
+// Keep any mappings of the file coherent after writing
+static void UpdateMappings(FsNode* node, size_t offset, ssize_t written) {
+    if (node->pageCache && written > 0) {
+        if (PageCache* cache = PageCache::AcquireIfCached(node); cache) {
+            cache->Update(offset, written);
+            cache->Release();
+        }
+    }
+}
+
 ssize_t Read(FsNode* node, size_t offset, size_t size, void* buffer) {
     assert(node);
 
+    WriteBackMappings(node);
     return node->Read(offset, size, reinterpret_cast<uint8_t*>(buffer));
 }
 
 ssize_t Write(FsNode* node, size_t offset, size_t size, void* buffer) {
     assert(node);
 
-    return node->Write(offset, size, reinterpret_cast<uint8_t*>(buffer));
+    ssize_t ret = node->Write(offset, size, reinterpret_cast<uint8_t*>(buffer));
+    UpdateMappings(node, offset, ret);
+    return ret;
+}
+
+ssize_t ReadV(FsNode* node, size_t offset, const iovec* iov, int iovcnt) {
+    assert(node);
+
+    WriteBackMappings(node);
+    return node->ReadV(offset, iov, iovcnt);
+}
+
+ssize_t WriteV(FsNode* node, size_t offset, const iovec* iov, int iovcnt) {
+    assert(node);
+
+    ssize_t ret = node->WriteV(offset, iov, iovcnt);
+    UpdateMappings(node, offset, ret);
+    return ret;
 }
 
 ErrorOr<UNIXOpenFile*> Open(FsNode* node, uint32_t flags) { return node->Open(flags); }
 
+int Create(FsNode* dir, DirectoryEntry* ent, uint32_t mode) {
+    assert(dir);
+    assert(ent);
+
+    int e = dir->Create(ent, mode);
+    if (dir->cacheDirectoryEntries) {
+        DentryCache::Invalidate(dir, ent->name); // Remove any negative entry
+    }
+    return e;
+}
+
+int CreateDirectory(FsNode* dir, DirectoryEntry* ent, uint32_t mode) {
+    assert(dir);
+    assert(ent);
+
+    int e = dir->CreateDirectory(ent, mode);
+    if (dir->cacheDirectoryEntries) {
+        DentryCache::Invalidate(dir, ent->name);
+    }
+    return e;
+}
+
 int Link(FsNode* dir, FsNode* link, DirectoryEntry* ent) {
     assert(dir);
     assert(link);
 
-    return dir->Link(link, ent);
+    int e = dir->Link(link, ent);
+    if (dir->cacheDirectoryEntries) {
+        DentryCache::Invalidate(dir, ent->name);
+    }
+    return e;
 }
 
 int Unlink(FsNode* dir, DirectoryEntry* ent, bool unlinkDirectories) {
     assert(dir);
     assert(ent);
 
-    return dir->Unlink(ent, unlinkDirectories);
+    int e = dir->Unlink(ent, unlinkDirectories);
+    if (dir->cacheDirectoryEntries) {
+        DentryCache::Invalidate(dir, ent->name);
+    }
+    return e;
 }
 
 void Close(FsNode* node) { return node->Close(); }
@@ -448,6 +556,11 @@ void Close(UNIXOpenFile* fd) {
     if (!fd)
         return;
 
+    // Nothing else references the file so nothing can add an epoll item to it
+    if (fd->epollItems) {
+        EPoll::FileClosed(fd);
+    }
+
     ScopedSpinLock lockOpenFileData(fd->dataLock);
 
     assert(fd->node);
@@ -462,10 +575,30 @@ int ReadDir(FsNode* node, DirectoryEntry* dirent, uint32_t index) {
     return node->ReadDir(dirent, index);
 }
 
+int ReadDirBatch(FsNode* node, DirectoryEntry* entries, int count, off_t& cursor) {
+    assert(node);
+
+    return node->ReadDirBatch(entries, count, cursor);
+}
+
 FsNode* FindDir(FsNode* node, const char* name) {
     assert(node);
 
-    return node->FindDir(name);
+    // . and .. are cheap to find and .. may leave the volume
+    if (!node->cacheDirectoryEntries || !strcmp(name, ".") || !strcmp(name, "..")) {
+        return node->FindDir(name);
+    }
+
+    FsNode* result;
+    if (DentryCache::Lookup(node, name, result)) {
+        return result;
+    }
+
+    uint64_t generation = DentryCache::Generation();
+    result = node->FindDir(name);
+    DentryCache::Insert(node, name, result, generation);
+
+    return result;
 }
 
 ssize_t Read(const FancyRefPtr<UNIXOpenFile>& handle, size_t size, uint8_t* buffer) {
@@ -475,6 +608,7 @@ ssize_t Read(const FancyRefPtr<UNIXOpenFile>& handle, size_t size, uint8_t* buff
     ssize_t ret = Read(handle->node, handle->pos, size, buffer);
 
     if (ret > 0) {
+        Readahead::Update(handle, handle->pos, ret);
         handle->pos += ret;
     }
 
@@ -493,18 +627,182 @@ ssize_t Write(const FancyRefPtr<UNIXOpenFile>& handle, size_t size, uint8_t* buf
     return ret;
 }
 
+ssize_t ReadV(const FancyRefPtr<UNIXOpenFile>& handle, const iovec* iov, int iovcnt) {
+    assert(handle->node);
+
+    ScopedSpinLock lockOpenFile(handle->dataLock);
+    ssize_t ret = ReadV(handle->node, handle->pos, iov, iovcnt);
+
+    if (ret > 0) {
+        Readahead::Update(handle, handle->pos, ret);
+        handle->pos += ret;
+    }
+
+    return ret;
+}
+
+ssize_t WriteV(const FancyRefPtr<UNIXOpenFile>& handle, const iovec* iov, int iovcnt) {
+    assert(handle->node);
+
+    ScopedSpinLock lockOpenFile(handle->dataLock);
+    ssize_t ret = WriteV(handle->node, handle->pos, iov, iovcnt);
+
+    if (ret >= 0) {
+        handle->pos += ret;
+    }
+
+    return ret;
+}
+
 int ReadDir(const FancyRefPtr<UNIXOpenFile>& handle, DirectoryEntry* dirent, uint32_t index) {
     assert(handle->node);
 
     return ReadDir(handle->node, dirent, index);
 }
 
+int ReadDirBatch(const FancyRefPtr<UNIXOpenFile>& handle, DirectoryEntry* entries, int count) {
+    assert(handle->node);
+
+    ScopedSpinLock lockOpenFile(handle->dataLock);
+    return ReadDirBatch(handle->node, entries, count, handle->pos);
+}
+
 FsNode* FindDir(const FancyRefPtr<UNIXOpenFile>& handle, const char* name) {
     assert(handle->node);
 
     return FindDir(handle->node, name);
 }
 
+// Size of the kernel buffer used by Splice when data is not in the page cache
+#define SPLICE_BUFFER_SIZE (PAGE_SIZE_4K * 16)
+
+ssize_t Splice(const FancyRefPtr<UNIXOpenFile>& out, const FancyRefPtr<UNIXOpenFile>& in, off_t* inOffset,
+               size_t count) {
+    assert(out->node && in->node);
+
+    if (in->node->IsDirectory() || out->node->IsDirectory()) {
+        return -EISDIR;
+    }
+
+    // Streams (pipes, sockets) have no offset to read from
+    bool isStream = !(in->node->IsFile() || in->node->IsBlockDevice());
+    if (isStream && inOffset) {
+        return -ESPIPE;
+    }
+
+    off_t pos = inOffset ? *inOffset : in->pos;
+    if (pos < 0) {
+        return -EINVAL;
+    }
+
+    uint8_t* buffer = nullptr;
+    uint8_t* pageWindow = nullptr; // Cached pages of in are mapped here to be written
+
+    PageCache* cache = nullptr;
+    if (!isStream && in->node->pageCache) {
+        cache = PageCache::AcquireIfCached(in->node);
+    }
+
+    ssize_t total = 0;
+    while (static_cast<size_t>(total) < count) {
+        if (total && isStream && !in->node->CanRead()) {
+            break; // Do not block once something has been copied
+        }
+
+        size_t size = MIN(count - total, static_cast<size_t>(SPLICE_BUFFER_SIZE));
+        uint8_t* data;
+
+        ssize_t read;
+        uintptr_t phys = 0;
+        size_t streamPosition;
+        bool peeked = false; // Read from a stream without taking the data, taken once it has been written
+        if (cache && static_cast<size_t>(pos) < in->node->size && (phys = cache->FindPage(pos >> PAGE_SHIFT_4K))) {
+            // Write straight from the page cache, which is what any mappings of the file see
+            if (!pageWindow) {
+                pageWindow = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(1));
+            }
+            Memory::KernelMapVirtualMemory4K(phys, reinterpret_cast<uintptr_t>(pageWindow), 1);
+
+            size_t pageOffset = pos & (PAGE_SIZE_4K - 1);
+            read = MIN(size, MIN(PAGE_SIZE_4K - pageOffset, static_cast<size_t>(in->node->size - pos)));
+            data = pageWindow + pageOffset;
+        } else {
+            if (!buffer) {
+                buffer = new uint8_t[SPLICE_BUFFER_SIZE];
+            }
+
+            if (isStream) {
+                read = in->node->Peek(size, buffer, streamPosition);
+                peeked = (read != -ENOSYS);
+            }
+
+            if (!peeked) {
+                read = Read(in->node, pos, size, buffer);
+            }
+
+            if (read < 0) {
+                if (!total) {
+                    total = read;
+                }
+                break;
+            } else if (!read) {
+                break; // End of file
+            }
+
+            if (!inOffset) {
+                Readahead::Update(in, pos, read);
+            }
+            data = buffer;
+        }
+
+        // Data read from a stream cannot be read again, so keep writing it after a short write
+        ssize_t written = 0;
+        while (written < read) {
+            ssize_t ret = Write(out, read - written, data + written);
+            if (ret <= 0) {
+                if (ret < 0 && !total && !written) {
+                    total = ret;
+                }
+                break;
+            }
+
+            written += ret;
+            if (!isStream) {
+                break;
+            }
+        }
+
+        // Whatever could not be written is left in the stream
+        if (peeked) {
+            in->node->Consume(streamPosition, written);
+        }
+
+        pos += written;
+        total += written;
+        if (written < read) {
+            break;
+        }
+    }
+
+    if (inOffset) {
+        *inOffset = pos;
+    } else if (!isStream) {
+        ScopedSpinLock lockOpenFile(in->dataLock);
+        in->pos = pos;
+    }
+
+    if (cache) {
+        cache->Release();
+    }
+
+    if (pageWindow) {
+        Memory::KernelFree4KPages(pageWindow, 1);
+    }
+
+    delete[] buffer;
+    return total;
+}
+
 int Ioctl(const FancyRefPtr<UNIXOpenFile>& handle, uint64_t cmd, uint64_t arg) {
     assert(handle->node);
 
@@ -561,23 +859,23 @@ int Rename(FsNode* olddir, const char* oldpath, FsNode* newdir, const char* newp
         assert(oldpathParent); // If this is null something went horribly wrong
 
         if (newnode) {
-            if (auto e = newpathParent->Unlink(&newpathDirent)) {
+            if (auto e = fs::Unlink(newpathParent, &newpathDirent)) {
                 return e; // Unlink error
             }
         }
 
-        if (auto e = newpathParent->Link(oldnode, &newpathDirent)) {
+        if (auto e = fs::Link(newpathParent, oldnode, &newpathDirent)) {
             return e; // Link error
         }
 
-        if (auto e = oldpathParent->Unlink(&oldpathDirent)) {
+        if (auto e = fs::Unlink(oldpathParent, &oldpathDirent)) {
             return e; // Unlink error
         }
     } else if ((oldnode->flags & FS_NODE_TYPE) != FS_NODE_SYMLINK) { // Aight we have to copy it
         FsNode* oldpathParent = fs::ResolveParent(oldpath, olddir);
         assert(oldpathParent); // If this is null something went horribly wrong
 
-        if (auto e = newpathParent->Create(&newpathDirent, 0)) {
+        if (auto e = fs::Create(newpathParent, &newpathDirent, 0)) {
             return e; // Create error
         }
 
@@ -608,7 +906,7 @@ int Rename(FsNode* olddir, const char* oldpath, FsNode* newdir, const char* newp
 
         kfree(buffer);
 
-        if (auto e = oldpathParent->Unlink(&oldpathDirent)) {
+        if (auto e = fs::Unlink(oldpathParent, &oldpathDirent)) {
             return e; // Unlink error
         }
     } else {
@@ -1,10 +1,15 @@
 #include <Fs/Filesystem.h>
+#include <Fs/DentryCache.h>
 
 #include <Errno.h>
 #include <Logging.h>
 
+#include <abi-bits/socket.h>
+
 FsNode::~FsNode(){
-    
+    if(dentryCount){
+        fs::DentryCache::Purge(this);
+    }
 }
 
 ssize_t FsNode::Read(size_t, size_t, uint8_t *){
@@ -17,6 +22,52 @@ ssize_t FsNode::Write(size_t, size_t, uint8_t *){
     return -ENOSYS;
 }
 
+ssize_t FsNode::ReadV(size_t off, const iovec* iov, int iovcnt){
+    ssize_t total = 0;
+    for(int i = 0; i < iovcnt; i++){
+        if(!iov[i].iov_len){
+            continue;
+        }
+
+        if(total && !CanRead()){
+            break; // Do not block once something has been read
+        }
+
+        ssize_t ret = Read(off + total, iov[i].iov_len, reinterpret_cast<uint8_t*>(iov[i].iov_base));
+        if(ret < 0){
+            return total ? total : ret;
+        }
+
+        total += ret;
+        if(static_cast<size_t>(ret) < iov[i].iov_len){
+            break;
+        }
+    }
+
+    return total;
+}
+
+ssize_t FsNode::WriteV(size_t off, const iovec* iov, int iovcnt){
+    ssize_t total = 0;
+    for(int i = 0; i < iovcnt; i++){
+        if(!iov[i].iov_len){
+            continue;
+        }
+
+        ssize_t ret = Write(off + total, iov[i].iov_len, reinterpret_cast<uint8_t*>(iov[i].iov_base));
+        if(ret < 0){
+            return total ? total : ret;
+        }
+
+        total += ret;
+        if(static_cast<size_t>(ret) < iov[i].iov_len){
+            break;
+        }
+    }
+
+    return total;
+}
+
 ErrorOr<UNIXOpenFile*> FsNode::Open(size_t flags){
     UNIXOpenFile* fDesc = new UNIXOpenFile;
 
@@ -42,6 +93,23 @@ int FsNode::ReadDir(DirectoryEntry*, uint32_t){
     return -ENOSYS;
 }
 
+int FsNode::ReadDirBatch(DirectoryEntry* entries, int count, off_t& cursor){
+    int read = 0;
+    while(read < count){
+        int ret = ReadDir(&entries[read], cursor);
+        if(ret < 0){
+            return read ? read : ret;
+        } else if(!ret){
+            break; // End of directory
+        }
+
+        cursor++;
+        read++;
+    }
+
+    return read;
+}
+
 FsNode* FsNode::FindDir(const char*){
     assert(IsDirectory());
 
@@ -106,8 +174,8 @@ void FsNode::Unwatch(FilesystemWatcher& watcher){
     Log::Warning("FsNode::Unwatch base called");
 }
 
-void FsNode::Sync(){
-    
+int FsNode::Sync(){
+    return 0;
 }
 
 void FsNode::UnblockAll(){
@@ -116,4 +184,16 @@ void FsNode::UnblockAll(){
         blocked.get_front()->Unblock();
     }
     releaseLock(&blockedLock);
+}
+
+bool FsNode::UnblockWaiters(unsigned count){
+    acquireLock(&blockedLock);
+    while(count-- && blocked.get_length()){
+        blocked.get_front()->Unblock(); // Removes the blocker from the list
+    }
+
+    bool waiting = blocked.get_length();
+    releaseLock(&blockedLock);
+
+    return waiting;
 }
\ No newline at end of file
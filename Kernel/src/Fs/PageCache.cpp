@@ -0,0 +1,269 @@
+#include <Fs/PageCache.h>
+
+#include <Fs/Filesystem.h>
+
+#include <Assert.h>
+#include <CString.h>
+#include <Errno.h>
+#include <Logging.h>
+#include <Math.h>
+#include <Paging.h>
+#include <PhysicalAllocator.h>
+
+// Held whilst a node's page cache is created or destroyed
+static lock_t nodeCacheLock = 0;
+
+PageCache* PageCache::Acquire(FsNode* node) {
+    ScopedSpinLock lockCaches(nodeCacheLock);
+
+    if (node->pageCache) {
+        node->pageCache->m_refCount++;
+        return node->pageCache;
+    }
+
+    node->pageCache = new PageCache(node);
+    return node->pageCache;
+}
+
+PageCache* PageCache::AcquireIfCached(FsNode* node) {
+    ScopedSpinLock lockCaches(nodeCacheLock);
+
+    if (node->pageCache) {
+        node->pageCache->m_refCount++;
+    }
+    return node->pageCache;
+}
+
+void PageCache::Release() {
+    {
+        ScopedSpinLock lockCaches(nodeCacheLock);
+        if (--m_refCount) {
+            return;
+        }
+
+        m_node->pageCache = nullptr;
+    }
+
+    // Nothing maps the cache anymore
+    if (m_dirtyCount) {
+        WriteBack();
+    }
+
+    delete this;
+}
+
+PageCache::PageCache(FsNode* node) : m_node(node), m_inMemory(node->InMemory()) {
+    if (!m_inMemory) {
+        Reserve(PAGE_COUNT_4K(node->size));
+    }
+}
+
+PageCache::~PageCache() {
+    for (uint64_t i = 0; i < m_capacity; i++) {
+        if (m_blocks[i]) {
+            Memory::FreePhysicalMemoryBlock(static_cast<uintptr_t>(m_blocks[i]) << PAGE_SHIFT_4K);
+        }
+    }
+    Memory::AccountMemory(Memory::MemoryUsagePageCache, -(static_cast<int64_t>(m_cachedCount) << PAGE_SHIFT_4K));
+
+    delete[] m_blocks;
+    delete[] m_dirty;
+}
+
+void PageCache::Reserve(uint64_t count) {
+    if (count <= m_capacity) {
+        return;
+    }
+
+    // Round up to a whole dirty bitmap word
+    count = (count + 31) & ~31ULL;
+
+    uint32_t* blocks = new uint32_t[count];
+    uint32_t* dirty = new uint32_t[count >> 5];
+    memset(blocks, 0, count * sizeof(uint32_t));
+    memset(dirty, 0, (count >> 5) * sizeof(uint32_t));
+
+    if (m_blocks) {
+        memcpy(blocks, m_blocks, m_capacity * sizeof(uint32_t));
+        memcpy(dirty, m_dirty, (m_capacity >> 5) * sizeof(uint32_t));
+
+        delete[] m_blocks;
+        delete[] m_dirty;
+    }
+
+    m_blocks = blocks;
+    m_dirty = dirty;
+    m_capacity = count;
+}
+
+int PageCache::ReadPage(uint64_t index, uintptr_t phys, size_t start, size_t end) {
+    uint8_t* buffer = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(1));
+    Memory::KernelMapVirtualMemory4K(phys, reinterpret_cast<uintptr_t>(buffer), 1);
+
+    size_t offset = (index << PAGE_SHIFT_4K) + start;
+    size_t size = 0;
+    if (offset < m_node->size) {
+        size = MIN(m_node->size - offset, end - start);
+    }
+
+    int status = 0;
+    if (size) {
+        ssize_t ret = m_node->Read(offset, size, buffer + start);
+        if (ret < 0) {
+            status = -ret;
+        } else {
+            size = ret; // Short reads leave the rest of the range zeroed
+        }
+    }
+
+    if (!status && start + size < end) {
+        memset(buffer + start + size, 0, end - start - size);
+    }
+
+    Memory::KernelFree4KPages(buffer, 1);
+    return status;
+}
+
+uintptr_t PageCache::FindPage(uint64_t index) {
+    if (m_inMemory) {
+        return m_node->MemoryPage(index, false);
+    }
+
+    ScopedSpinLock lockCache(m_lock);
+    if (index >= m_capacity || !m_blocks[index]) {
+        return 0;
+    }
+
+    return static_cast<uintptr_t>(m_blocks[index]) << PAGE_SHIFT_4K;
+}
+
+uintptr_t PageCache::GetPage(uint64_t index) {
+    if (m_inMemory) {
+        return m_node->MemoryPage(index, true);
+    }
+
+    if (uintptr_t phys = FindPage(index); phys) {
+        return phys;
+    }
+
+    // Read the page without holding the lock, another thread may read it at the same time
+    uintptr_t phys = Memory::AllocatePhysicalMemoryBlock();
+    if (!phys) {
+        return 0;
+    }
+    assert(phys < (0xffffffffULL << PAGE_SHIFT_4K));
+
+    if (int e = ReadPage(index, phys); e) {
+        Log::Warning("[PageCache] Failed to read page %u of inode %u: %d", index, m_node->inode, e);
+
+        Memory::FreePhysicalMemoryBlock(phys);
+        return 0;
+    }
+
+    ScopedSpinLock lockCache(m_lock);
+    Reserve(index + 1);
+    if (m_blocks[index]) {
+        // Beaten to it, use the cached page
+        Memory::FreePhysicalMemoryBlock(phys);
+        return static_cast<uintptr_t>(m_blocks[index]) << PAGE_SHIFT_4K;
+    }
+
+    m_blocks[index] = phys >> PAGE_SHIFT_4K;
+    m_cachedCount++;
+    Memory::AccountMemory(Memory::MemoryUsagePageCache, PAGE_SIZE_4K);
+    return phys;
+}
+
+void PageCache::MarkDirty(uint64_t index) {
+    if (m_inMemory) {
+        return; // Writes through the mapping go straight to the file
+    }
+
+    ScopedSpinLock lockCache(m_lock);
+    assert(index < m_capacity && m_blocks[index]);
+
+    if (!IsDirty(index)) {
+        m_dirty[index >> 5] |= 1U << (index & 31);
+        m_dirtyCount++;
+    }
+}
+
+void PageCache::AddSharedMapping() {
+    ScopedSpinLock lockCache(m_lock);
+    m_sharedMappings++;
+    m_sharedMappingsAdded++;
+}
+
+void PageCache::RemoveSharedMapping() {
+    ScopedSpinLock lockCache(m_lock);
+    assert(m_sharedMappings);
+    m_sharedMappings--;
+}
+
+int PageCache::WriteBack() {
+    uint8_t* buffer = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(1));
+
+    int status = 0;
+    for (uint64_t i = 0;; i++) {
+        uintptr_t phys;
+        unsigned mappingsAdded;
+        {
+            ScopedSpinLock lockCache(m_lock);
+            if (i >= m_capacity) {
+                break;
+            }
+
+            if (!IsDirty(i)) {
+                continue;
+            }
+            phys = static_cast<uintptr_t>(m_blocks[i]) << PAGE_SHIFT_4K;
+            mappingsAdded = m_sharedMappingsAdded;
+        }
+
+        // Mappings do not change the size of the file
+        size_t offset = i << PAGE_SHIFT_4K;
+        if (offset < m_node->size) {
+            size_t size = MIN(m_node->size - offset, static_cast<size_t>(PAGE_SIZE_4K));
+
+            Memory::KernelMapVirtualMemory4K(phys, reinterpret_cast<uintptr_t>(buffer), 1);
+            if (ssize_t ret = m_node->Write(offset, size, buffer); ret < 0) {
+                Log::Warning("[PageCache] Failed to write back page %u of inode %u: %d", i, m_node->inode, -ret);
+                status = -ret;
+                continue;
+            }
+        }
+
+        // Only clean once nothing can write to the page without marking it dirty again,
+        // a mapping that existed at any point since the page was written may have changed it
+        ScopedSpinLock lockCache(m_lock);
+        if (!m_sharedMappings && m_sharedMappingsAdded == mappingsAdded && IsDirty(i)) {
+            m_dirty[i >> 5] &= ~(1U << (i & 31));
+            m_dirtyCount--;
+        }
+    }
+
+    Memory::KernelFree4KPages(buffer, 1);
+    return status;
+}
+
+void PageCache::Update(size_t offset, size_t size) {
+    if (m_inMemory) {
+        return; // Mappings share the pages of the file
+    }
+
+    uint64_t first = offset >> PAGE_SHIFT_4K;
+    uint64_t end = PAGE_COUNT_4K(offset + size);
+
+    for (uint64_t i = first; i < end; i++) {
+        uintptr_t phys = FindPage(i);
+        if (!phys) {
+            continue;
+        }
+
+        // Only the first and last pages can be partly written
+        size_t pageOffset = i << PAGE_SHIFT_4K;
+        size_t start = MAX(offset, pageOffset) - pageOffset;
+        size_t pageEnd = MIN(offset + size - pageOffset, static_cast<size_t>(PAGE_SIZE_4K));
+        ReadPage(i, phys, start, pageEnd);
+    }
+}
@@ -1,71 +1,327 @@
 #include <Fs/Pipe.h>
 
-#include <Move.h>
 #include <Errno.h>
+#include <Math.h>
+#include <Move.h>
+#include <Paging.h>
+#include <PhysicalAllocator.h>
+
+PipeBuffer::PipeBuffer(size_t capacity) : m_ring(AllocateRing(capacity)), m_capacity(m_ring ? capacity : 0) {
+    assert(capacity >= PAGE_SIZE_4K && !(capacity & (capacity - 1)));
+}
+
+PipeBuffer::~PipeBuffer() {
+    if (m_ring) {
+        FreeRing(m_ring, m_capacity);
+    }
+}
+
+size_t PipeBuffer::Read(uint8_t* buffer, size_t size) {
+    size_t tail = m_tail;
+    size_t count = MIN(size, __atomic_load_n(&m_head, __ATOMIC_ACQUIRE) - tail);
+
+    size_t offset = tail & (m_capacity - 1);
+    size_t contiguous = MIN(count, m_capacity - offset);
+
+    memcpy(buffer, m_ring + offset, contiguous);
+    memcpy(buffer + contiguous, m_ring, count - contiguous); // Wrapped around
+
+    __atomic_store_n(&m_tail, tail + count, __ATOMIC_SEQ_CST);
+    return count;
+}
+
+size_t PipeBuffer::Peek(uint8_t* buffer, size_t size) const {
+    size_t tail = m_tail;
+    size_t count = MIN(size, __atomic_load_n(&m_head, __ATOMIC_ACQUIRE) - tail);
+
+    size_t offset = tail & (m_capacity - 1);
+    size_t contiguous = MIN(count, m_capacity - offset);
+
+    memcpy(buffer, m_ring + offset, contiguous);
+    memcpy(buffer + contiguous, m_ring, count - contiguous); // Wrapped around
+
+    return count;
+}
+
+bool PipeBuffer::Consume(size_t position, size_t size) {
+    if (m_tail != position) {
+        return false;
+    }
+
+    assert(size <= __atomic_load_n(&m_head, __ATOMIC_ACQUIRE) - position);
+    __atomic_store_n(&m_tail, position + size, __ATOMIC_SEQ_CST);
+    return true;
+}
+
+size_t PipeBuffer::Write(const uint8_t* buffer, size_t size) {
+    size_t head = m_head;
+    size_t count = MIN(size, m_capacity - (head - __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE)));
+
+    size_t offset = head & (m_capacity - 1);
+    size_t contiguous = MIN(count, m_capacity - offset);
+
+    memcpy(m_ring + offset, buffer, contiguous);
+    memcpy(m_ring, buffer + contiguous, count - contiguous); // Wrapped around
+
+    __atomic_store_n(&m_head, head + count, __ATOMIC_SEQ_CST);
+    return count;
+}
+
+long PipeBuffer::Resize(size_t capacity) {
+    if (capacity > PIPE_MAX_SIZE) {
+        return -EINVAL;
+    }
+
+    size_t newCapacity = PAGE_SIZE_4K;
+    while (newCapacity < capacity) {
+        newCapacity <<= 1;
+    }
 
-UNIXPipe::UNIXPipe(int _end, FancyRefPtr<DataStream> stream)
-    : end(static_cast<decltype(end)>(_end)), stream(std::move(stream)){
+    ScopedMutexLock lockWrite(writeLock);
+    ScopedMutexLock lockRead(readLock);
+
+    if (newCapacity == m_capacity) {
+        return m_capacity;
+    }
+
+    size_t used = m_head - m_tail;
+    if (used > newCapacity) {
+        return -EBUSY;
+    }
+
+    uint8_t* ring = AllocateRing(newCapacity);
+    if (!ring) {
+        return -ENOMEM;
+    }
+
+    size_t offset = m_tail & (m_capacity - 1);
+    size_t contiguous = MIN(used, m_capacity - offset);
+    memcpy(ring, m_ring + offset, contiguous);
+    memcpy(ring + contiguous, m_ring, used - contiguous);
+
+    FreeRing(m_ring, m_capacity);
+
+    m_ring = ring;
+    m_capacity = newCapacity;
+    m_tail = 0;
+    m_head = used;
+
+    return m_capacity;
+}
+
+uint8_t* PipeBuffer::AllocateRing(size_t capacity) {
+    unsigned pages = capacity >> PAGE_SHIFT_4K;
+
+    uint8_t* ring = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(pages));
+    for (unsigned i = 0; i < pages; i++) {
+        uintptr_t phys = Memory::AllocatePhysicalMemoryBlock();
+        if (!phys) {
+            FreeRing(ring, static_cast<size_t>(i) << PAGE_SHIFT_4K);
+            Memory::KernelFree4KPages(ring + (static_cast<size_t>(i) << PAGE_SHIFT_4K), pages - i);
+            return nullptr;
+        }
+
+        Memory::KernelMapVirtualMemory4K(phys, reinterpret_cast<uintptr_t>(ring) + (i << PAGE_SHIFT_4K), 1);
+    }
+
+    return ring;
+}
+
+void PipeBuffer::FreeRing(uint8_t* ring, size_t capacity) {
+    unsigned pages = capacity >> PAGE_SHIFT_4K;
+
+    for (unsigned i = 0; i < pages; i++) {
+        Memory::FreePhysicalMemoryBlock(
+            Memory::VirtualToPhysicalAddress(reinterpret_cast<uintptr_t>(ring) + (i << PAGE_SHIFT_4K)));
+    }
+
+    Memory::KernelFree4KPages(ring, pages);
 }
 
-ssize_t UNIXPipe::Read(size_t off, size_t size, uint8_t* buffer){
+UNIXPipe::UNIXPipe(int _end, FancyRefPtr<PipeBuffer> pipe)
+    : end(static_cast<decltype(end)>(_end)), pipe(std::move(pipe)){
+}
+
+ssize_t UNIXPipe::Read(size_t, size_t size, uint8_t* buffer){
+    return ReadData(size, buffer, nullptr);
+}
+
+ssize_t UNIXPipe::Peek(size_t size, uint8_t* buffer, size_t& position){
+    return ReadData(size, buffer, &position);
+}
+
+void UNIXPipe::Consume(size_t position, size_t size){
+    {
+        ScopedMutexLock lockRead(pipe->readLock);
+        if(!pipe->Consume(position, size)){
+            return; // Another reader got there first
+        }
+    }
+
+    FinishRead();
+}
+
+ssize_t UNIXPipe::ReadData(size_t size, uint8_t* buffer, size_t* position){
     if(end != ReadEnd){
         return -ESPIPE;
+    } else if(!size){
+        return 0;
     }
 
-    if(!widowed && size > stream->Pos()){
-        FilesystemBlocker bl(this, size);
+    size_t read;
+    for(;;){
+        {
+            ScopedMutexLock lockRead(pipe->readLock);
+            if(position){
+                *position = pipe->ReadPosition();
+                read = pipe->Peek(buffer, size);
+            } else {
+                read = pipe->Read(buffer, size);
+            }
+        }
 
-        if(Thread::Current()->Block(&bl)){
-            return -EINTR;
+        if(read){
+            break;
+        } else if(__atomic_load_n(&widowed, __ATOMIC_ACQUIRE)){
+            return 0; // No writers left
+        }
+
+        FilesystemBlocker bl(this);
+
+        // Ask the writer to wake us, then check again so a write in between is not missed
+        __atomic_store_n(&pipe->readerWaiting, true, __ATOMIC_SEQ_CST);
+        if(!pipe->Used() && !__atomic_load_n(&widowed, __ATOMIC_ACQUIRE)){
+            if(Thread::Current()->Block(&bl)){
+                if(pipe->Used()){
+                    UnblockNext(); // We may have been woken for the data, pass it on
+                }
+                return -EINTR;
+            }
         }
     }
 
-    if(size > stream->Pos()){
-        size = stream->Pos();
+    if(!position){
+        FinishRead(); // Otherwise done by Consume
     }
 
-    return stream->Read(buffer, size);
+    return read;
+}
+
+void UNIXPipe::FinishRead(){
+    // Only wake writers which found the pipe full
+    if(__atomic_exchange_n(&pipe->writerWaiting, false, __ATOMIC_SEQ_CST)){
+        WakeOtherEnd();
+    }
+
+    // Only one reader is woken for new data, let the next one take what we left
+    if(pipe->Used() && blocked.get_length()){
+        UnblockNext();
+    }
 }
 
 ssize_t UNIXPipe::Write(size_t off, size_t size, uint8_t* buffer){
     if(end != WriteEnd){
         return -ESPIPE;
-    } else if(widowed || !otherEnd){
-        Thread::Current()->Signal(SIGPIPE); // Send SIGPIPE on broken pipe
-        return -EPIPE;
     }
 
-    ssize_t ret = stream->Write(buffer, size);
+    // Writes of up to PIPE_BUF bytes are not interleaved with other writes
+    size_t wanted = (size <= PIPE_BUF) ? size : 1;
 
-    {
-        ScopedSpinLock acq(otherEnd->watchingLock);
+    size_t written = 0;
+    while(written < size){
+        if(__atomic_load_n(&widowed, __ATOMIC_ACQUIRE)){
+            if(written){
+                return written;
+            }
+
+            Thread::Current()->Signal(SIGPIPE); // Send SIGPIPE on broken pipe
+            return -EPIPE;
+        }
 
-        for(auto& w : otherEnd->watching){
-            w->Signal();
+        size_t count = 0;
+        {
+            ScopedMutexLock lockWrite(pipe->writeLock);
+            if(pipe->Free() >= wanted){
+                count = pipe->Write(buffer + written, size - written);
+            }
         }
 
-        acquireLock(&otherEnd->blockedLock);
-        FilesystemBlocker* bl = otherEnd->blocked.get_front();
-        while(bl){
-            FilesystemBlocker* next = otherEnd->blocked.next(bl);
+        if(count){
+            written += count;
 
-            if(bl->RequestedLength() <= stream->Pos()){
-                bl->Unblock();
+            // Only wake readers which found the pipe empty
+            if(__atomic_exchange_n(&pipe->readerWaiting, false, __ATOMIC_SEQ_CST)){
+                WakeOtherEnd();
             }
+            continue;
+        }
+
+        FilesystemBlocker bl(this, wanted);
+
+        // Ask the reader to wake us, then check again so a read in between is not missed
+        __atomic_store_n(&pipe->writerWaiting, true, __ATOMIC_SEQ_CST);
+        if(pipe->Free() < wanted && !__atomic_load_n(&widowed, __ATOMIC_ACQUIRE)){
+            if(Thread::Current()->Block(&bl)){
+                if(pipe->Free() >= PIPE_BUF){
+                    UnblockNext(); // We may have been woken for the space, pass it on
+                }
+                return written ? static_cast<ssize_t>(written) : -EINTR;
+            }
+        }
+    }
+
+    // Only one writer is woken for new space, let the next one use what we left
+    if(pipe->Free() && blocked.get_length()){
+        UnblockNext();
+    }
+
+    return written;
+}
 
-            bl = next;
+int UNIXPipe::Ioctl(uint64_t cmd, uint64_t arg){
+    if(cmd == F_GETPIPE_SZ){
+        return pipe->Capacity();
+    } else if(cmd == F_SETPIPE_SZ){
+        long ret = pipe->Resize(arg);
+        if(ret >= 0 && end == ReadEnd){
+            WakeOtherEnd(); // There may be space for blocked writers
+        } else if(ret >= 0){
+            Wake();
         }
-        releaseLock(&otherEnd->blockedLock);
 
-        otherEnd->watching.clear();
+        return ret;
     }
 
-    return ret;
+    return -ENOTTY;
+}
+
+bool UNIXPipe::CanRead(){
+    return end == ReadEnd && (pipe->Used() || __atomic_load_n(&widowed, __ATOMIC_ACQUIRE));
+}
+
+bool UNIXPipe::CanWrite(){
+    return end == WriteEnd && (pipe->Free() >= PIPE_BUF || __atomic_load_n(&widowed, __ATOMIC_ACQUIRE));
 }
 
 void UNIXPipe::Watch(FilesystemWatcher& watcher, int events){
-    ScopedSpinLock acq(watchingLock);
-    watching.add_back(&watcher);
+    {
+        ScopedSpinLock acq(watchingLock);
+        watching.add_back(&watcher);
+    }
+
+    // Watchers stay registered until Unwatch but are only signalled once the other end
+    // sees the waiting flag, which is set again by EPoll rearming the watcher
+    if(end == ReadEnd){
+        __atomic_store_n(&pipe->readerWaiting, true, __ATOMIC_SEQ_CST);
+        if(CanRead()){
+            Wake();
+        }
+    } else {
+        __atomic_store_n(&pipe->writerWaiting, true, __ATOMIC_SEQ_CST);
+        if(CanWrite()){
+            Wake();
+        }
+    }
 }
 
 void UNIXPipe::Unwatch(FilesystemWatcher& watcher){
@@ -77,20 +333,59 @@ void UNIXPipe::Close(){
     handleCount--;
 
     if(handleCount <= 0){
-        if(otherEnd){
-            otherEnd->widowed = true;
+        {
+            ScopedSpinLock lockEnds(pipe->endLock);
+            if(otherEnd){
+                __atomic_store_n(&otherEnd->widowed, true, __ATOMIC_RELEASE);
+                otherEnd->otherEnd = nullptr;
+
+                // Every reader sees EOF and every writer gets EPIPE
+                otherEnd->SignalWatchers();
+                otherEnd->UnblockAll();
+            }
         }
 
         delete this;
     }
 }
 
-void UNIXPipe::CreatePipe(UNIXPipe*& read, UNIXPipe*& write){
-    FancyRefPtr<DataStream> stream = new DataStream(1024);
-    
-    read = new UNIXPipe(UNIXPipe::ReadEnd, stream);
-    write = new UNIXPipe(UNIXPipe::WriteEnd, stream);
+int UNIXPipe::CreatePipe(UNIXPipe*& read, UNIXPipe*& write){
+    FancyRefPtr<PipeBuffer> pipe = new PipeBuffer(PIPE_DEFAULT_SIZE);
+    if(!pipe->Capacity()){
+        return -ENOMEM;
+    }
+
+    read = new UNIXPipe(UNIXPipe::ReadEnd, pipe);
+    write = new UNIXPipe(UNIXPipe::WriteEnd, pipe);
 
     read->otherEnd = write;
     write->otherEnd = read;
-}
\ No newline at end of file
+    return 0;
+}
+
+void UNIXPipe::Wake(){
+    SignalWatchers();
+    UnblockNext();
+}
+
+void UNIXPipe::SignalWatchers(){
+    ScopedSpinLock acq(watchingLock);
+
+    for(auto& w : watching){
+        w->Signal();
+    }
+}
+
+void UNIXPipe::UnblockNext(){
+    if(UnblockWaiters(1)){
+        // The threads left blocked have to be woken by the other end
+        __atomic_store_n((end == ReadEnd) ? &pipe->readerWaiting : &pipe->writerWaiting, true, __ATOMIC_SEQ_CST);
+    }
+}
+
+void UNIXPipe::WakeOtherEnd(){
+    ScopedSpinLock lockEnds(pipe->endLock);
+    if(otherEnd){
+        otherEnd->Wake();
+    }
+}
@@ -0,0 +1,129 @@
+#include <Fs/Readahead.h>
+
+#include <Fs/Filesystem.h>
+
+#include <Debug.h>
+#include <Lock.h>
+#include <Logging.h>
+#include <MM/Reclaim.h>
+#include <Scheduler.h>
+
+namespace fs::Readahead {
+
+struct ReadaheadRequest {
+    FancyRefPtr<UNIXOpenFile> file; // Keeps the node around until it has been read
+    size_t offset;
+    size_t size;
+};
+
+static lock_t queueLock = 0;
+static ReadaheadRequest queue[READAHEAD_QUEUE_SIZE];
+static unsigned queueHead = 0;
+static unsigned queueCount = 0;
+
+static Semaphore queueSemaphore = Semaphore(0);
+static bool threadRunning = false;
+
+static bool Queue(const FancyRefPtr<UNIXOpenFile>& handle, size_t offset, size_t size) {
+    ScopedSpinLock lockQueue(queueLock);
+    if (queueCount >= READAHEAD_QUEUE_SIZE) {
+        return false;
+    }
+
+    ReadaheadRequest& req = queue[(queueHead + queueCount) % READAHEAD_QUEUE_SIZE];
+    req.file = handle;
+    req.offset = offset;
+    req.size = size;
+
+    queueCount++;
+    queueSemaphore.Signal();
+    return true;
+}
+
+static void ReadaheadThread() {
+    // Only read to fill the BlockCache, the data is thrown away
+    uint8_t* buffer = new uint8_t[READAHEAD_MAX_WINDOW];
+
+    for (;;) {
+        if (queueSemaphore.Wait()) {
+            continue; // Interrupted
+        }
+
+        ReadaheadRequest req;
+        {
+            ScopedSpinLock lockQueue(queueLock);
+            if (!queueCount) {
+                continue;
+            }
+
+            req.file = std::move(queue[queueHead].file);
+            req.offset = queue[queueHead].offset;
+            req.size = queue[queueHead].size;
+
+            queueHead = (queueHead + 1) % READAHEAD_QUEUE_SIZE;
+            queueCount--;
+        }
+
+        // Reading ahead would only push out pages that are in use
+        if (Memory::IsMemoryLow()) {
+            continue;
+        }
+
+        if (ssize_t ret = req.file->node->Read(req.offset, req.size, buffer); ret < 0) {
+            Log::Debug(debugLevelFilesystem, DebugLevelVerbose, "[Readahead] Failed to read ahead inode %u: %d",
+                       req.file->node->inode, -ret);
+        }
+    }
+}
+
+void Initialize() {
+    auto proc = Process::CreateKernelProcess((void*)ReadaheadThread, "Readahead", nullptr);
+    proc->Start();
+
+    threadRunning = true;
+}
+
+void Update(const FancyRefPtr<UNIXOpenFile>& handle, size_t offset, size_t size) {
+    FsNode* node = handle->node;
+    if (!node->readahead || !size || !threadRunning) {
+        return;
+    }
+
+    size_t end = offset + size;
+    if (offset != handle->readaheadNext) {
+        // Not sequential, start again from here
+        handle->readaheadNext = end;
+        handle->readaheadEnd = end;
+        handle->readaheadWindow = 0;
+        return;
+    }
+    handle->readaheadNext = end;
+
+    // Read the next window once the reader is half way into the last one
+    if (handle->readaheadWindow && handle->readaheadEnd > end + handle->readaheadWindow / 2) {
+        return;
+    }
+
+    size_t start = (handle->readaheadEnd > end) ? handle->readaheadEnd : end;
+    if (start >= node->size) {
+        return;
+    }
+
+    size_t window = handle->readaheadWindow ? handle->readaheadWindow * 2 : READAHEAD_MIN_WINDOW;
+    if (window > READAHEAD_MAX_WINDOW) {
+        window = READAHEAD_MAX_WINDOW;
+    }
+
+    size_t count = window;
+    if (count > node->size - start) {
+        count = node->size - start;
+    }
+
+    // If the queue is full try again on the next read
+    if (Queue(handle, start, count)) {
+        handle->readaheadEnd = start + count;
+        handle->readaheadWindow = window;
+    }
+}
+
+} // namespace fs::Readahead
@@ -23,6 +23,31 @@ inline static long GetBlockCount(char* size){ // Get size of file in blocks
     return (sz + 511) / 512;
 }
 
+// Path of the entry without any leading "./" or trailing '/'
+static char* GetPath(tar_header_t* header, char path[TAR_PATH_MAX]){
+    size_t length = 0;
+    if(!strncmp(header->ustar.sig, "ustar", 5) && header->ustar.filenamePrefix[0]){
+        for(size_t i = 0; i < sizeof(header->ustar.filenamePrefix) && header->ustar.filenamePrefix[i]; i++){
+            path[length++] = header->ustar.filenamePrefix[i];
+        }
+        path[length++] = '/';
+    }
+
+    for(size_t i = 0; i < sizeof(header->ustar.name) && header->ustar.name[i]; i++){
+        path[length++] = header->ustar.name[i];
+    }
+
+    while(length && path[length - 1] == '/'){
+        length--;
+    }
+    path[length] = 0;
+
+    if(path[0] == '.' && (path[1] == '/' || !path[1])){
+        return path + (path[1] ? 2 : 1);
+    }
+    return path;
+}
+
 inline static uint32_t TarTypeToFilesystemFlags(char type){
     switch(type){
         case TAR_TYPE_DIRECTORY:
@@ -61,9 +86,11 @@ namespace fs::tar{
         } else return nullptr;
     }
 
-    void TarVolume::MakeNode(tar_header_t* header, TarNode* n, ino_t inode, ino_t parent, tar_header_t* dirHeader){
+    void TarVolume::MakeNode(tar_header_t* header, TarNode* n, ino_t inode, ino_t parent, const char* name){
         n->parentInode = parent;
         n->header = header;
+        n->entryCount = 0;
+        n->children = nullptr;
 
         n->inode = inode;
         n->uid = OctToDec(header->ustar.uid, 8);
@@ -71,104 +98,84 @@ namespace fs::tar{
         n->vol = this;
         n->volumeID = volumeID;
 
-        char* strtokSavePtr;
-        char* name = header->ustar.name;
-        char* _name = strtok_r(header->ustar.name, "/", &strtokSavePtr);
-        while(_name){
-            name = _name;
-            _name = strtok_r(NULL, "/", &strtokSavePtr);
-        }
         strcpy(n->name, name);
         n->size = GetSize(header->ustar.size);
     }
 
-    int TarVolume::ReadDirectory(int blockIndex, ino_t parent){
-        ino_t dirInode = nextNode++;
-        tar_header_t* dirHeader = &blocks[blockIndex];
-        TarNode* dirNode = &nodes[dirInode];
-        MakeNode(dirHeader, dirNode, dirInode, parent);
-        dirNode->entryCount = 0;
-
-        unsigned i = blockIndex + GetBlockCount(dirHeader->ustar.size) + 1; // Next block
-        while(i < blockCount){
-            if(strncmp(blocks[i].ustar.name, dirHeader->ustar.name, strlen(dirHeader->ustar.name)) || !strlen(blocks[i].ustar.name)){
-                break; // End of directory - header is not in directory
-            } else if(blocks[i].ustar.name[strlen(dirHeader->ustar.name)] != '/'){ // Check for the path separator
-                break; // Wwe encountered a file with a name starting with the name of the directory
-            }
-
-            dirNode->entryCount++;
-            i += GetBlockCount(blocks[i].ustar.size) + 1;
-        }
-        
-        dirNode->children = (ino_t*)kmalloc(sizeof(ino_t) * dirNode->entryCount);
-
-        i = blockIndex + GetBlockCount(dirHeader->ustar.size) + 1;
-        for(int e = 0; i < blockCount && e < dirNode->entryCount; e++){ // Iterate through directory
-            ino_t inode = nextNode++;
-            TarNode* n = &nodes[inode];
-            MakeNode(&blocks[i], n, inode, dirInode, dirHeader);
-            dirNode->children[e] = inode;
-
-            //Log::Info("[TAR] Found File: %s, ", blocks[i].ustar.name);
-
-            i += GetBlockCount(blocks[i].ustar.size) + 1;
-        }
-
-        return i;
-    }
-
     TarVolume::TarVolume(uintptr_t base, size_t size, char* name){
         blocks = (tar_header_t*)base;
         blockCount = size / 512;
 
-        int entryCount = 0;
-        for(uint64_t i = 0; i < blockCount; i++, nodeCount++){ // Get file count
-            tar_header_t header = blocks[i];
-
-            if(!strchr(header.ustar.name, '/') || (header.ustar.type == TAR_TYPE_DIRECTORY && strchr(header.ustar.name, '/') == header.ustar.name + strlen(header.ustar.name) - 1)) entryCount++;
-
-            i += GetBlockCount(header.ustar.size);
+        for(uint64_t i = 0; i < blockCount && blocks[i].ustar.name[0]; i += GetBlockCount(blocks[i].ustar.size) + 1){
+            nodeCount++; // Get file count
         }
 
         nodes = new TarNode[nodeCount];
 
         TarNode* volumeNode = &nodes[0];
         volumeNode->header = nullptr;
+        volumeNode->path = nullptr;
         volumeNode->flags = FS_NODE_DIRECTORY | FS_NODE_MOUNTPOINT;
         volumeNode->inode = 0;
         volumeNode->size = size;
         volumeNode->vol = this;
         volumeNode->parent = 0;
+        volumeNode->entryCount = 0;
 
         mountPoint = volumeNode;
         strcpy(mountPointDirent.name, name);
         mountPointDirent.flags = DT_DIR;
         mountPointDirent.node = volumeNode;
 
-        volumeNode->children = (ino_t*)kmalloc(sizeof(ino_t) * entryCount);
-        volumeNode->entryCount = entryCount;
-        int e = 0;
-        for(unsigned i = 0; i < blockCount; e++){
-            tar_header_t header = blocks[i];
-            
-            if(!strlen(header.ustar.name)) break;
-
-            if(header.ustar.type == TAR_TYPE_DIRECTORY){
-                volumeNode->children[e] = nextNode; // Directory will take next available node so add it to children
-                i = ReadDirectory(i, 0);
-                continue;
-            } else if(header.ustar.type == TAR_TYPE_FILE) {
-                ino_t inode = nextNode++;
-                TarNode* node = &nodes[inode];
-                MakeNode(&blocks[i], node, inode, 0);
-                volumeNode->children[e] = inode;
+        // Index every entry by path, directories come before their contents in the archive
+        char path[TAR_PATH_MAX];
+        for(uint64_t i = 0; i < blockCount && blocks[i].ustar.name[0]; i += GetBlockCount(blocks[i].ustar.size) + 1){
+            tar_header_t* header = &blocks[i];
+            char type = header->ustar.type;
+            if(type != TAR_TYPE_FILE && type != '\0' && type != TAR_TYPE_FILE_CONTIGUOUS && type != TAR_TYPE_DIRECTORY){
+                continue; // Links, devices and extended headers are not supported
             }
 
-            i += GetBlockCount(header.ustar.size);
-            i++;
+            char* entryPath = GetPath(header, path);
+            TarNode* node;
+            if(!entryPath[0] || paths.get_unlocked(entryPath, node)){
+                continue; // The archive itself or a duplicate
+            }
+
+            ino_t parent = 0;
+            char* entryName = entryPath;
+            if(char* separator = strrchr(entryPath, '/'); separator){
+                *separator = 0;
+                if(!paths.get_unlocked(entryPath, node) || !node->IsDirectory()){
+                    Log::Warning("[TAR] No directory for %s/%s", entryPath, separator + 1);
+                    continue;
+                }
+                *separator = '/';
+
+                parent = node->inode;
+                entryName = separator + 1;
+            }
+
+            ino_t inode = nextNode++;
+            node = &nodes[inode];
+            MakeNode(header, node, inode, parent, entryName);
+
+            node->path = strdup(entryPath);
+            paths.insert(node->path, node);
+            nodes[parent].entryCount++;
+        }
+
+        for(ino_t i = 0; i < nextNode; i++){
+            if(nodes[i].IsDirectory()){
+                nodes[i].children = (ino_t*)kmalloc(sizeof(ino_t) * nodes[i].entryCount);
+                nodes[i].entryCount = 0;
+            }
+        }
+
+        for(ino_t i = 1; i < nextNode; i++){
+            TarNode& dir = nodes[nodes[i].parentInode];
+            dir.children[dir.entryCount++] = i;
         }
-        volumeNode->entryCount = e;
     }
 
     ssize_t TarVolume::Read(TarNode* node, size_t offset, size_t size, uint8_t *buffer){
@@ -261,10 +268,25 @@ namespace fs::tar{
             else return &nodes[tarNode->parentInode];
         }
 
-        for(int i = 0; i < tarNode->entryCount; i++){
-            if(strcmp(nodes[tarNode->children[i]].name, name) == 0) return &nodes[tarNode->children[i]];
+        // Look the entry up by its path in the archive
+        char path[TAR_PATH_MAX];
+        size_t nameLength = strlen(name);
+        if(tarNode->path){
+            size_t pathLength = strlen(tarNode->path);
+            if(pathLength + nameLength + 2 > TAR_PATH_MAX) return nullptr;
+
+            memcpy(path, tarNode->path, pathLength);
+            path[pathLength] = '/';
+            memcpy(path + pathLength + 1, name, nameLength + 1);
+        } else {
+            if(nameLength + 1 > TAR_PATH_MAX) return nullptr;
+
+            memcpy(path, name, nameLength + 1);
         }
 
-        return nullptr;
+        TarNode* found;
+        if(!paths.get_unlocked(path, found)) return nullptr;
+
+        return found;
     }
 }
@@ -2,6 +2,8 @@
 
 #include <Errno.h>
 #include <Debug.h>
+#include <Math.h>
+#include <PhysicalAllocator.h>
 
 namespace fs::Temp{
     TempVolume::TempVolume(const char* name){
@@ -17,53 +19,6 @@ namespace fs::Temp{
         mountPoint->volumeID = volumeID;
     }
 
-    void TempVolume::ReallocateNode(TempNode* node, size_t oldSize){
-        unsigned newBufferSize = (node->size + (TEMP_BUFFER_CHUNK_SIZE - 1)) & (~(TEMP_BUFFER_CHUNK_SIZE - 1)); // Round up to multiple of the chunk size
-
-        if(newBufferSize <= 0){
-            if(node->buffer){
-                delete node->buffer;
-
-                node->buffer = nullptr;
-            }
-
-            memoryUsage -= node->bufferSize;
-            node->bufferSize = 0;
-        } else if(newBufferSize > node->bufferSize){
-            if(!node->buffer){
-                node->buffer = new uint8_t[newBufferSize];
-
-                memoryUsage += newBufferSize;
-            } else {
-                uint8_t* newBuffer = new uint8_t[newBufferSize];
-                memcpy(newBuffer, node->buffer, oldSize);
-
-                delete node->buffer;
-                node->buffer = newBuffer;
-
-                memoryUsage += newBufferSize - node->bufferSize;
-            }
-
-            node->bufferSize = newBufferSize;
-        } else if(newBufferSize < node->bufferSize){
-            if(!node->buffer){
-                node->buffer = new uint8_t[newBufferSize];
-
-                memoryUsage += newBufferSize;
-            } else {
-                uint8_t* newBuffer = new uint8_t[newBufferSize];
-                memcpy(newBuffer, node->buffer, node->size);
-
-                delete node->buffer;
-                node->buffer = newBuffer;
-
-                memoryUsage -= (node->bufferSize - newBufferSize);
-            }
-
-            node->bufferSize = newBufferSize;
-        }
-    }
-
     TempNode::TempNode(TempVolume* v, int createFlags){
         vol = v;
         volumeID = v->volumeID;
@@ -77,10 +32,12 @@ namespace fs::Temp{
 
         if((flags & FS_NODE_TYPE) == FS_NODE_FILE){
             bufferLock = ReadWriteLock();
-            buffer = nullptr;
-            bufferSize = 0;
+            chunks = nullptr;
+            chunkLevels = 0;
+            mapped = false;
         } else if((flags & FS_NODE_TYPE) == FS_NODE_DIRECTORY){
             children = List<DirectoryEntry>();
+            cacheDirectoryEntries = true;
         } else {
             assert(!"TempNode not regular file or directory!");
         }
@@ -91,9 +48,128 @@ namespace fs::Temp{
             for(auto& ent : children){
                 Unlink(&ent, true); // Unlink all files
             }
-        } else if(buffer){
-            delete buffer;
+        } else if(chunks){
+            TrimChunks(chunks, chunkLevels, 0, nullptr);
+            delete chunks;
+        }
+    }
+
+    uint64_t* TempNode::ChunkEntry(uint64_t index, bool allocate){
+        while(!chunks || (index >> (chunkLevels * TEMP_TABLE_SHIFT))){
+            if(!allocate){
+                return nullptr;
+            }
+
+            // Add a level above the root, the old root covering the start of the file
+            TempChunkTable* table = new TempChunkTable{};
+            table->entries[0] = reinterpret_cast<uintptr_t>(chunks);
+
+            chunks = table;
+            chunkLevels++;
+        }
+
+        TempChunkTable* table = chunks;
+        for(unsigned level = chunkLevels; level > 1; level--){
+            uint64_t& entry = table->entries[(index >> ((level - 1) * TEMP_TABLE_SHIFT)) & (TEMP_TABLE_SIZE - 1)];
+            if(!entry){
+                if(!allocate){
+                    return nullptr;
+                }
+
+                entry = reinterpret_cast<uintptr_t>(new TempChunkTable{});
+            }
+
+            table = reinterpret_cast<TempChunkTable*>(entry);
         }
+
+        return &table->entries[index & (TEMP_TABLE_SIZE - 1)];
+    }
+
+    uintptr_t TempNode::FindChunk(uint64_t index){
+        uint64_t* entry = ChunkEntry(index, false);
+        return entry ? *entry : 0;
+    }
+
+    uintptr_t TempNode::AllocateChunk(uint64_t index){
+        uint64_t* entry = ChunkEntry(index, true);
+        if(!*entry){
+            uintptr_t phys = Memory::AllocateZeroedPhysicalMemoryBlock();
+            if(!phys){
+                return 0;
+            }
+
+            *entry = phys;
+            __atomic_add_fetch(&vol->memoryUsage, PAGE_SIZE_4K, __ATOMIC_RELAXED);
+            Memory::AccountMemory(Memory::MemoryUsagePageCache, PAGE_SIZE_4K);
+        }
+
+        return *entry;
+    }
+
+    void TempNode::TrimChunks(TempChunkTable* table, unsigned level, uint64_t first, uint8_t* window){
+        uint64_t span = 1ULL << ((level - 1) * TEMP_TABLE_SHIFT); // Pages under each entry
+        for(uint64_t i = first / span; i < TEMP_TABLE_SIZE; i++){
+            if(!table->entries[i]){
+                continue; // Hole
+            }
+
+            uint64_t start = (i == first / span) ? (first % span) : 0;
+            if(level > 1){
+                TempChunkTable* child = reinterpret_cast<TempChunkTable*>(table->entries[i]);
+                TrimChunks(child, level - 1, start, window);
+
+                if(!window && !start){
+                    delete child;
+                    table->entries[i] = 0;
+                }
+            } else if(window){
+                Memory::KernelMapVirtualMemory4K(table->entries[i], reinterpret_cast<uintptr_t>(window), 1);
+                memset(window, 0, PAGE_SIZE_4K);
+            } else {
+                Memory::FreePhysicalMemoryBlock(table->entries[i]);
+                table->entries[i] = 0;
+
+                __atomic_sub_fetch(&vol->memoryUsage, PAGE_SIZE_4K, __ATOMIC_RELAXED);
+                Memory::AccountMemory(Memory::MemoryUsagePageCache, -static_cast<int64_t>(PAGE_SIZE_4K));
+            }
+        }
+    }
+
+    void TempNode::Resize(size_t oldSize){
+        // Only pages written through a mapping or left by a shrinking file have data past the end
+        if(size > oldSize && !mapped){
+            return;
+        }
+
+        size_t end = MIN(size, oldSize);
+        uint8_t* window = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(1));
+
+        if(end % PAGE_SIZE_4K){
+            if(uintptr_t phys = FindChunk(end >> PAGE_SHIFT_4K); phys){
+                Memory::KernelMapVirtualMemory4K(phys, reinterpret_cast<uintptr_t>(window), 1);
+                memset(window + end % PAGE_SIZE_4K, 0, PAGE_SIZE_4K - end % PAGE_SIZE_4K);
+            }
+        }
+
+        if(__atomic_load_n(&pageCache, __ATOMIC_ACQUIRE)){
+            // Pages may still be mapped, zero them instead
+            if(chunks){
+                TrimChunks(chunks, chunkLevels, PAGE_COUNT_4K(end), window);
+            }
+        } else {
+            if(chunks){
+                TrimChunks(chunks, chunkLevels, PAGE_COUNT_4K(end), nullptr);
+            }
+
+            if(!end && chunks){
+                delete chunks;
+                chunks = nullptr;
+                chunkLevels = 0;
+            }
+            mapped = false;
+        }
+
+        Memory::KernelFree4KPages(window, 1);
     }
 
     TempNode* TempNode::Find(const char* name){
@@ -113,7 +189,9 @@ namespace fs::Temp{
             return -EISDIR;
         }
 
-        if(off > size){
+        bufferLock.AcquireRead();
+        if(off >= size){
+            bufferLock.ReleaseRead();
             return 0;
         }
 
@@ -121,10 +199,23 @@ namespace fs::Temp{
             readSize = size - off;
         }
 
-        bufferLock.AcquireRead();
-        memcpy(readBuffer, buffer + off, readSize);
-        bufferLock.ReleaseRead();
+        uint8_t* window = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(1));
+        for(size_t done = 0; done < readSize;){
+            size_t pos = off + done;
+            size_t count = MIN(PAGE_SIZE_4K - pos % PAGE_SIZE_4K, readSize - done);
 
+            if(uintptr_t phys = FindChunk(pos >> PAGE_SHIFT_4K); phys){
+                Memory::KernelMapVirtualMemory4K(phys, reinterpret_cast<uintptr_t>(window), 1);
+                memcpy(readBuffer + done, window + pos % PAGE_SIZE_4K, count);
+            } else {
+                memset(readBuffer + done, 0, count); // Hole
+            }
+
+            done += count;
+        }
+        Memory::KernelFree4KPages(window, 1);
+
+        bufferLock.ReleaseRead();
         return readSize;
     }
 
@@ -138,21 +229,39 @@ namespace fs::Temp{
         }
 
         bufferLock.AcquireWrite();
-        if(!buffer || off + writeSize > size){
-            size_t old = size;
+        size_t old = size;
+        if(off + writeSize > size){
             size = off + writeSize;
+            Resize(old);
+        }
+
+        Log::Debug(debugLevelTmpFS, DebugLevelVerbose, "Writing (offset: %u, size: %u, nsize: %u)", off, writeSize, size);
+
+        // Only the pages being written are touched, appending never copies the file
+        uint8_t* window = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(1));
+        size_t done = 0;
+        while(done < writeSize){
+            size_t pos = off + done;
+            size_t count = MIN(PAGE_SIZE_4K - pos % PAGE_SIZE_4K, writeSize - done);
 
-            if(size >= bufferSize){
-                vol->ReallocateNode(this, old);
+            uintptr_t phys = AllocateChunk(pos >> PAGE_SHIFT_4K);
+            if(!phys){
+                break; // Out of memory
             }
-        }
 
-        Log::Debug(debugLevelTmpFS, DebugLevelVerbose, "Writing (offset: %u, size: %u, nsize: %u, bsize: %u)", off, writeSize, size, bufferSize);
+            Memory::KernelMapVirtualMemory4K(phys, reinterpret_cast<uintptr_t>(window), 1);
+            memcpy(window + pos % PAGE_SIZE_4K, writeBuffer + done, count);
+
+            done += count;
+        }
+        Memory::KernelFree4KPages(window, 1);
 
-        memcpy(buffer + off, writeBuffer, writeSize);
+        if(done < writeSize){
+            size = MAX(old, off + done);
+        }
         bufferLock.ReleaseWrite();
 
-        return writeSize;
+        return done ? static_cast<ssize_t>(done) : -ENOSPC;
     }
 
     int TempNode::Truncate(off_t length){
@@ -168,13 +277,33 @@ namespace fs::Temp{
 
         size_t old = size;
         size = length;
-        vol->ReallocateNode(this, old);
+        if(size != old){
+            Resize(old);
+        }
 
         bufferLock.ReleaseWrite();
 
         return 0;
     }
 
+    uintptr_t TempNode::MemoryPage(uint64_t index, bool allocate){
+        __atomic_store_n(&mapped, true, __ATOMIC_RELAXED);
+
+        bufferLock.AcquireRead();
+        uintptr_t phys = FindChunk(index);
+        bufferLock.ReleaseRead();
+
+        if(phys || !allocate){
+            return phys;
+        }
+
+        bufferLock.AcquireWrite();
+        phys = AllocateChunk(index);
+        bufferLock.ReleaseWrite();
+
+        return phys;
+    }
+
     int TempNode::ReadDir(DirectoryEntry* dirent, uint32_t index){
         if(index >= children.get_length() + 2){
             return 0; // Out of range
@@ -2,6 +2,7 @@
 
 #include <Fs/FsVolume.h>
 #include <Panic.h>
+#include <Spinlock.h>
 
 /*
 
@@ -169,6 +170,7 @@ int Unmount(const char* name) {
 }
 
 void RegisterVolume(FsVolume* volume) {
+    ScopedSpinLock lock(volumeManagerLock);
     volume->SetVolumeID(nextVolumeID++);
     if(volume->mountPoint){
         volume->mountPoint->parent = fs::GetRoot();
@@ -177,6 +179,7 @@ void RegisterVolume(FsVolume* volume) {
 }
 
 int UnregisterVolume(FsVolume* volume) {
+    ScopedSpinLock lock(volumeManagerLock);
     for (auto it = volumes->begin(); it != volumes->end(); it++) {
         if (*it == volume) {
             volumes->remove(it);
@@ -0,0 +1,281 @@
+#include <Futex.h>
+
+#include <ABI/Futex.h>
+#include <Errno.h>
+#include <List.h>
+#include <MM/AddressSpace.h>
+#include <Objects/Process.h>
+#include <Paging.h>
+#include <Scheduler.h>
+#include <Spinlock.h>
+#include <Thread.h>
+#include <UserPointer.h>
+
+#define FUTEX_HASH_BUCKETS 256 // Must be a power of two
+
+namespace Futex {
+
+struct Key {
+    uintptr_t addressSpace; // 0 for shared futexes
+    uintptr_t address;      // Virtual address, or physical address for shared futexes
+
+    ALWAYS_INLINE bool operator==(const Key& other) const {
+        return addressSpace == other.addressSpace && address == other.address;
+    }
+};
+
+struct Bucket;
+
+class FutexBlocker final : public ThreadBlocker {
+public:
+    FutexBlocker(const Key& key, uint32_t bitset) : key(key), bitset(bitset) {}
+
+    FutexBlocker* next = nullptr;
+    FutexBlocker* prev = nullptr;
+
+    // The key and bucket change when the waiter is requeued, only changed with the bucket lock held
+    Key key;
+    Bucket* bucket = nullptr;
+    uint32_t bitset;
+    bool queued = false;
+};
+
+struct Bucket {
+    lock_t lock = 0;
+    FastList<FutexBlocker*> waiters;
+};
+
+static Bucket buckets[FUTEX_HASH_BUCKETS];
+
+static ALWAYS_INLINE Bucket* GetBucket(const Key& key) {
+    uint64_t hash = (key.address >> 2) ^ (key.addressSpace >> 4);
+    hash *= 0x9e3779b97f4a7c15ULL;
+    return &buckets[(hash >> 32) & (FUTEX_HASH_BUCKETS - 1)];
+}
+
+// Get the key of the futex at address in the current process, the futex must already be mapped
+static long GetKey(uintptr_t address, bool shared, Key& key) {
+    if (address & (sizeof(int) - 1)) {
+        return -EINVAL;
+    }
+
+    AddressSpace* addressSpace = Scheduler::GetCurrentProcess()->addressSpace;
+    if (shared) {
+        MappedRegion* region = addressSpace->AddressToRegionReadLock(address);
+        if (!region) {
+            return -EFAULT;
+        }
+
+        if (region->vmObject.get() && region->vmObject->IsShared()) {
+            uintptr_t phys =
+                Memory::VirtualToPhysicalAddress(address & ~(PAGE_SIZE_4K - 1), addressSpace->GetPageMap());
+            region->lock.ReleaseRead();
+
+            if (!phys) {
+                return -EFAULT;
+            }
+
+            key = {.addressSpace = 0, .address = phys + (address & (PAGE_SIZE_4K - 1))};
+            return 0;
+        }
+
+        // Private mappings are not shared between processes even when forked
+        region->lock.ReleaseRead();
+    }
+
+    key = {.addressSpace = reinterpret_cast<uintptr_t>(addressSpace), .address = address};
+    return 0;
+}
+
+// Take a blocker out of its bucket, returns false if a wake already removed it
+static bool Dequeue(FutexBlocker& blocker) {
+    while (true) {
+        Bucket* bucket = __atomic_load_n(&blocker.bucket, __ATOMIC_ACQUIRE);
+        ScopedSpinLock lockBucket(bucket->lock);
+
+        if (blocker.bucket != bucket) {
+            continue; // Requeued whilst we were taking the lock
+        }
+
+        if (!blocker.queued) {
+            return false;
+        }
+
+        bucket->waiters.remove(&blocker);
+        blocker.queued = false;
+        return true;
+    }
+}
+
+// Wake up to count waiters on key, the bucket lock must be held
+static int WakeWaiters(Bucket* bucket, const Key& key, int count, uint32_t bitset) {
+    int woken = 0;
+
+    unsigned remaining = bucket->waiters.get_length();
+    FutexBlocker* blocker = bucket->waiters.get_front();
+    while (remaining-- && woken < count) {
+        FutexBlocker* next = blocker->next;
+
+        if (blocker->key == key && (blocker->bitset & bitset)) {
+            bucket->waiters.remove(blocker);
+            blocker->queued = false;
+            blocker->Unblock();
+            woken++;
+        }
+
+        blocker = next;
+    }
+
+    return woken;
+}
+
+long Wait(uintptr_t futex, bool shared, int expected, uint32_t bitset, long timeout) {
+    if (!bitset) {
+        return -EINVAL;
+    }
+
+    // Also faults the page in so that it can be found in the page map
+    UserPointer<int> value(futex);
+    int current;
+    TRY_GET_UMODE_VALUE(value, current);
+    if (current != expected) {
+        return -EAGAIN;
+    }
+
+    Key key;
+    if (long e = GetKey(futex, shared, key); e) {
+        return e;
+    }
+
+    FutexBlocker blocker(key, bitset);
+    {
+        Bucket* bucket = GetBucket(key);
+        ScopedSpinLock lockBucket(bucket->lock);
+
+        blocker.bucket = bucket;
+        blocker.queued = true;
+        bucket->waiters.add_back(&blocker);
+    }
+
+    // Check again now that we are queued, any thread changing the value from here will find us when it wakes the futex
+    if (value.GetValue(current) || current != expected) {
+        if (Dequeue(blocker)) {
+            return -EAGAIN;
+        }
+
+        return 0; // Woken anyway
+    }
+
+    bool interrupted;
+    long remaining = timeout;
+    if (timeout > 0) {
+        interrupted = Thread::Current()->Block(&blocker, remaining);
+    } else {
+        interrupted = Thread::Current()->Block(&blocker);
+    }
+
+    if (!Dequeue(blocker)) {
+        return 0; // Woken
+    }
+
+    if (interrupted) {
+        return -EINTR;
+    } else if (timeout > 0 && remaining <= 0) {
+        return -ETIMEDOUT;
+    }
+
+    return 0; // Spurious wakeup, it is up to the caller to check the value
+}
+
+long Wake(uintptr_t futex, bool shared, int count, uint32_t bitset) {
+    if (!bitset) {
+        return -EINVAL;
+    }
+
+    Key key;
+    if (long e = GetKey(futex, shared, key); e) {
+        return e;
+    }
+
+    Bucket* bucket = GetBucket(key);
+    ScopedSpinLock lockBucket(bucket->lock);
+
+    return WakeWaiters(bucket, key, count, bitset);
+}
+
+long Requeue(uintptr_t futex, uintptr_t target, bool shared, int wakeCount, int requeueCount, const int* expected) {
+    UserPointer<int> value(futex);
+    int current;
+    if (expected) {
+        // Fault the page in before taking any locks
+        TRY_GET_UMODE_VALUE(value, current);
+    }
+
+    Key key, targetKey;
+    if (long e = GetKey(futex, shared, key); e) {
+        return e;
+    } else if (long e = GetKey(target, shared, targetKey); e) {
+        return e;
+    }
+
+    Bucket* bucket = GetBucket(key);
+    Bucket* targetBucket = GetBucket(targetKey);
+
+    // Always lock the buckets in the same order
+    Bucket* first = bucket < targetBucket ? bucket : targetBucket;
+    Bucket* second = bucket < targetBucket ? targetBucket : bucket;
+
+retry:
+    acquireLock(&first->lock);
+    if (second != first) {
+        acquireLock(&second->lock);
+    }
+
+    // Compared whilst holding the locks, so no waiter can queue itself between the compare and the requeue.
+    // The page may have been swapped out since it was faulted in, which cannot be handled with the locks held
+    long ret;
+    if (expected && CopyFromUserAtomic(&current, reinterpret_cast<const int*>(futex), sizeof(int))) {
+        if (second != first) {
+            releaseLock(&second->lock);
+        }
+        releaseLock(&first->lock);
+
+        TRY_GET_UMODE_VALUE(value, current);
+        goto retry;
+    }
+
+    if (expected && current != *expected) {
+        ret = -EAGAIN;
+    } else {
+        ret = WakeWaiters(bucket, key, wakeCount, FUTEX_BITSET_MATCH_ANY);
+
+        int requeued = 0;
+        unsigned remaining = bucket->waiters.get_length();
+        FutexBlocker* blocker = bucket->waiters.get_front();
+        while (remaining-- && requeued < requeueCount) {
+            FutexBlocker* next = blocker->next;
+
+            if (blocker->key == key) {
+                bucket->waiters.remove(blocker);
+
+                blocker->key = targetKey;
+                targetBucket->waiters.add_back(blocker);
+                __atomic_store_n(&blocker->bucket, targetBucket, __ATOMIC_RELEASE);
+                requeued++;
+            }
+
+            blocker = next;
+        }
+
+        ret += requeued;
+    }
+
+    if (second != first) {
+        releaseLock(&second->lock);
+    }
+    releaseLock(&first->lock);
+
+    return ret;
+}
+
+} // namespace Futex
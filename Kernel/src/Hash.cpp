@@ -3,9 +3,19 @@
 #include <StringView.h>
 #include <String.h>
 
+unsigned HashString(const char* str){
+    // FNV-1a, unlike XORing the hash of each character the order matters
+    unsigned value = 2166136261;
+    while(char c = *str++){
+        value = (value ^ static_cast<unsigned char>(c)) * 16777619;
+    }
+
+    return HashU(value);
+}
+
 template<>
 unsigned Hash<unsigned long>(const unsigned long& value){
-	return HashU(value);
+	return HashU(value ^ (value >> 32)); // Fold in the upper half rather than truncating it
 }
 
 template<>
@@ -13,6 +23,11 @@ unsigned Hash<unsigned int>(const unsigned int& value){
 	return HashU(value);
 }
 
+template<>
+unsigned Hash<int>(const int& value){
+	return HashU(value);
+}
+
 template<>
 unsigned Hash<unsigned short>(const unsigned short& value){
 	return HashU(value);
@@ -25,24 +40,10 @@ unsigned Hash<unsigned char>(const unsigned char& value){
 
 template<>
 unsigned Hash<StringView>(const StringView& sv){
-    const char* str = sv.Data();
-    unsigned value = (*str << 1);
-
-    while(char c = *str++){
-        value ^= HashU(c);
-    }
-
-    return value;
+    return HashString(sv.Data());
 }
 
 template<>
 unsigned Hash<String>(const String& s) {
-    const char* str = s.c_str();
-    unsigned value = (*str << 1);
-
-    while(char c = *str++){
-        value ^= HashU(c);
-    }
-
-    return value;
+    return HashString(s.c_str());
 }
@@ -1,22 +1,33 @@
 #include <Audio/Audio.h>
+#include <BootTrace.h>
 #include <CPU.h>
+#include <Fs/Readahead.h>
 #include <Fs/TAR.h>
 #include <Fs/Tmp.h>
 #include <Fs/VolumeManager.h>
 #include <HAL.h>
+#include <KernelData.h>
 #include <Lemon.h>
 #include <Logging.h>
 #include <MM/KMalloc.h>
+#include <MM/Reclaim.h>
+#include <MM/Swap.h>
 #include <Math.h>
+#include <Metrics.h>
 #include <Modules.h>
 #include <Net/Net.h>
 #include <Objects/Service.h>
 #include <PCI.h>
 #include <PS2.h>
 #include <Panic.h>
+#include <PhysicalAllocator.h>
+#include <Profiler.h>
+#include <Lock.h>
+#include <SMP.h>
 #include <Scheduler.h>
 #include <SharedMemory.h>
 #include <Storage/AHCI.h>
+#include <Storage/BlockCache.h>
 #include <Storage/ATA.h>
 #include <Storage/NVMe.h>
 #include <String.h>
@@ -34,47 +45,135 @@ video_mode_t videoMode;
 
 void IdleProcess() {
     Thread* th = Thread::Current();
+    void* zeroWindow = Memory::KernelAllocate4KPages(PHYSALLOC_ZERO_BATCH);
     for (;;) {
         th->timeSlice = 0;
-        asm volatile("pause");
+
+        // Zero pages ahead of time so page faults and the kernel heap do not have to
+        if (Memory::ZeroFreeBlocks(zeroWindow)) {
+            continue;
+        }
+
+        asm volatile("sti; hlt"); // Wait for an interrupt
     }
 }
 
 void syscall_init();
 
-void KernelProcess() {
-    NVMe::Initialize();
-    USB::XHCIController::Initialize();
-    ATA::Init();
-    AHCI::Init();
+// Driver probes and module loads that do not depend on each other, run by the boot workers
+struct BootTask {
+    const char* name;
+    void (*initialize)() = nullptr;
+    char* modulePath = nullptr; // Loaded as a module if initialize is not set
+
+    uint64_t start = 0; // Microseconds since boot
+    uint64_t duration = 0;
+    unsigned processor = 0;
+};
+
+static Vector<BootTask> bootTasks;
+static unsigned nextBootTask = 0;
+static Semaphore bootWorkersDone(0);
+
+void BootWorker() {
+    for (;;) {
+        unsigned index = __atomic_fetch_add(&nextBootTask, 1, __ATOMIC_RELAXED);
+        if (index >= bootTasks.size()) {
+            break;
+        }
 
+        BootTask& task = bootTasks[index];
+        task.processor = static_cast<unsigned>(GetCPULocal()->id);
+        task.start = Timer::UsecondsSinceBoot();
+        BootTrace::Mark("Boot task started", task.name);
+        if (task.initialize) {
+            task.initialize();
+        } else {
+            ModuleManager::LoadModule(task.modulePath);
+        }
+        task.duration = Timer::UsecondsSinceBoot() - task.start;
+        BootTrace::Mark("Boot task finished", task.name);
+    }
+
+    bootWorkersDone.Signal();
+    Process::Current()->Die();
+}
+
+// Run the boot tasks on a worker for each processor and wait for all of them to finish
+static void RunBootTasks() {
+    unsigned workerCount = SMP::processorCount;
+    if (workerCount > bootTasks.size()) {
+        workerCount = bootTasks.size();
+    }
+
+    uint64_t start = Timer::UsecondsSinceBoot();
+    for (unsigned i = 0; i < workerCount; i++) {
+        auto proc = Process::CreateKernelProcess((void*)BootWorker, "BootWorker", nullptr);
+        proc->Start();
+    }
+
+    // Nothing signals the kernel process, so the waits are not interrupted
+    for (unsigned i = 0; i < workerCount; i++) {
+        [[maybe_unused]] bool interrupted = bootWorkersDone.Wait();
+    }
+
+    Log::Info("Boot timeline (%u tasks on %u workers, %lu ms):", static_cast<unsigned>(bootTasks.size()), workerCount,
+              (Timer::UsecondsSinceBoot() - start) / 1000);
+    for (BootTask& task : bootTasks) {
+        Log::Info("    %s: CPU %u, started at %lu ms, took %lu us", task.name, task.processor, task.start / 1000,
+                  task.duration);
+    }
+}
+
+void KernelProcess() {
+    BootTrace::Mark("Kernel process started");
+    Log::StartDrainThread();
+    Memory::InitializeReclaimer();
+    Memory::InitializeSwap();
+    Memory::InitializeZeroedPool();
+    fs::Readahead::Initialize();
+    BlockCache::Initialize();
+    Metrics::Initialize();
+
+    // Subsystems the drivers and modules register with
     ServiceFS::Initialize();
 
     Network::InitializeConnections();
     Audio::InitializeSystem();
+    Video::InitializePageFlipping();
 
+    bootTasks.add_back({.name = "NVMe", .initialize = NVMe::Initialize});
+    bootTasks.add_back({.name = "XHCI", .initialize = [] { USB::XHCIController::Initialize(); }});
+    bootTasks.add_back({.name = "ATA", .initialize = [] { ATA::Init(); }});
+    bootTasks.add_back({.name = "AHCI", .initialize = [] { AHCI::Init(); }});
+
+    char* modulesCfg = nullptr;
     if (FsNode* node = fs::ResolvePath("/initrd/modules.cfg")) {
-        char* buffer = new char[node->size + 1];
+        modulesCfg = new char[node->size + 1];
 
-        ssize_t read = fs::Read(node, 0, node->size, buffer);
+        ssize_t read = fs::Read(node, 0, node->size, modulesCfg);
         if (read > 0) {
-            buffer[read] = 0; // Null-terminate the buffer
+            modulesCfg[read] = 0; // Null-terminate the buffer
 
             char* save;
-            char* path = strtok_r(buffer, "\n", &save);
+            char* path = strtok_r(modulesCfg, "\n", &save);
             while (path) {
                 if (strlen(path) > 0) {
-                    ModuleManager::LoadModule(path); // modules.cfg should contain a list of paths to modules
+                    // modules.cfg should contain a list of paths to modules
+                    bootTasks.add_back({.name = path, .modulePath = path});
                 }
 
                 path = strtok_r(nullptr, "\n", &save);
             }
         }
-
-        delete[] buffer;
     }
 
+    RunBootTasks();
+    bootTasks.clear();
+    delete[] modulesCfg;
+
     fs::VolumeManager::MountSystemVolume();
+    BootTrace::Mark("System volume mounted");
 
     // TODO: Move this to userspace
     fs::VolumeManager::RegisterVolume(new fs::LinkVolume("/system/etc", "etc"));
@@ -119,28 +218,12 @@ void KernelProcess() {
     auto initProc = Process::CreateELFProcess(initElf, Vector<String>("init"), Vector<String>("PATH=/initrd"),
                                               "/system/lemon/init.lef", nullptr);
     initProc->Start();
+    BootTrace::Mark("Init started");
 
+    // Nothing left to do, destroyed processes are cleaned up by the reaper
     for (;;) {
-        acquireLock(&Scheduler::destroyedProcessesLock);
-        for (auto it = Scheduler::destroyedProcesses->begin(); it != Scheduler::destroyedProcesses->end(); it++) {
-            if (!(acquireTestLock(&(*it)->m_processLock))) {
-                FancyRefPtr<Process> proc = *it;
-                if (proc->addressSpace) { // Destroy the address space regardless
-                    delete (proc)->addressSpace;
-                    proc->addressSpace = nullptr;
-                }
-
-                Scheduler::destroyedProcesses->remove(it);
-                releaseLock(&proc->m_processLock);
-            }
-
-            if (it == Scheduler::destroyedProcesses->end()) {
-                break;
-            }
-        }
-        releaseLock(&Scheduler::destroyedProcessesLock);
-
-        Thread::Current()->Sleep(100000);
+        GenericThreadBlocker blocker;
+        [[maybe_unused]] bool interrupted = Thread::Current()->Block(&blocker);
     }
 }
 
@@ -161,6 +244,12 @@ extern "C" [[noreturn]] void kmain() {
     fs::VolumeManager::Initialize();
     DeviceManager::Initialize();
     Log::LateInitialize();
+    InitializeHeapProfiler();
+    InitializeLockStatistics();
+    InitializeSyscallStatistics();
+    BootTrace::Initialize();
+    Profiler::Initialize();
+    KernelData::Initialize();
 
     InitializeConstructors(); // Call global constructors
 
@@ -188,6 +277,7 @@ extern "C" [[noreturn]] void kmain() {
 
     fs::tar::TarVolume* tar = new fs::tar::TarVolume(HAL::bootModules[0].base, HAL::bootModules[0].size, "initrd");
     fs::VolumeManager::RegisterVolume(tar);
+    BootTrace::Mark("Initrd mounted");
 
     Log::Write("OK");
 
@@ -230,6 +320,7 @@ extern "C" [[noreturn]] void kmain() {
     syscall_init();
 
     Log::Info("Initializing Task Scheduler...");
+    BootTrace::Mark("Starting scheduler");
     Scheduler::Initialize();
     for (;;)
         ;
@@ -0,0 +1,113 @@
+#include <KernelData.h>
+
+#include <Assert.h>
+#include <CPU.h>
+#include <CString.h>
+#include <Logging.h>
+#include <MM/AddressSpace.h>
+#include <MM/VMObject.h>
+#include <Memory.h>
+#include <Objects/Process.h>
+#include <Timer.h>
+
+namespace KernelData {
+
+static lemon_clock_data_t* clock = nullptr;
+static uintptr_t clockPhys = 0;
+
+// The TSC rate is measured against the timer over about a second, then measured again every second
+static bool useTSC = false;
+static uint64_t calibrationTSC = 0;
+static uint64_t calibrationTicks = 0;
+
+// Clock page shared by all, process page for each process.
+// Shared so that it is never copy on write, forks are given their own by MapIntoProcess.
+class KernelDataVMObject final : public VMObject {
+public:
+    KernelDataVMObject() : VMObject(KERNEL_DATA_SIZE, false, true) {
+        KernelAllocateMappedBlock(&m_processPhys, &m_process);
+        memset(m_process, 0, PAGE_SIZE_4K);
+    }
+
+    ~KernelDataVMObject() {
+        Memory::KernelFree4KPages(m_process, 1);
+        Memory::FreePhysicalMemoryBlock(m_processPhys);
+    }
+
+    void MapAllocatedBlocks(uintptr_t base, PageMap* pMap) override {
+        Memory::MapVirtualMemory4K(clockPhys, base, 1, PAGE_USER | PAGE_PRESENT, pMap);
+        Memory::MapVirtualMemory4K(m_processPhys, base + KERNEL_DATA_PROCESS_OFFSET, 1, PAGE_USER | PAGE_PRESENT,
+                                   pMap);
+    }
+
+    [[noreturn]] VMObject* Clone() override { assert(!"Kernel data VMO cannot be cloned!"); }
+
+    ALWAYS_INLINE void SetPID(pid_t pid) { m_process->pid = pid; }
+
+private:
+    uintptr_t m_processPhys;
+    lemon_process_data_t* m_process;
+};
+
+void Initialize() {
+    KernelAllocateMappedBlock(&clockPhys, &clock);
+    memset(clock, 0, PAGE_SIZE_4K);
+
+    // Without an invariant TSC the clock only has the resolution of the timer
+    useTSC = CPUIDInvariantTSC();
+    clock->tscShift = 32;
+
+    calibrationTSC = ReadTimestampCounter();
+    calibrationTicks = Timer::GetTicks();
+
+    Log::Info("Kernel data page at %x, TSC %s", KERNEL_DATA_ADDRESS, useTSC ? "invariant" : "not used");
+}
+
+void UpdateClock() {
+    if (!clock) {
+        return;
+    }
+
+    uint64_t tsc = ReadTimestampCounter();
+    uint64_t ticks = Timer::GetTicks();
+    uint64_t frequency = Timer::GetFrequency();
+
+    // Readers retry whilst the sequence is odd
+    __atomic_store_n(&clock->sequence, clock->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    clock->uptimeNs = (ticks / frequency) * 1000000000 + (ticks % frequency) * 1000000000 / frequency;
+    clock->tsc = tsc;
+
+    // The window is kept to about a second so the shifted nanoseconds cannot overflow
+    if (useTSC && ticks - calibrationTicks >= frequency) {
+        uint64_t elapsedTicks = ticks - calibrationTicks;
+        uint64_t elapsedNs = elapsedTicks * 1000000000 / frequency;
+        uint64_t elapsedTSC = tsc - calibrationTSC;
+
+        if (elapsedTSC) {
+            clock->tscMult = (elapsedNs << clock->tscShift) / elapsedTSC;
+            clock->maxTSCDelta = elapsedTSC / elapsedTicks;
+        }
+
+        calibrationTSC = tsc;
+        calibrationTicks = ticks;
+    }
+
+    __atomic_store_n(&clock->sequence, clock->sequence + 1, __ATOMIC_RELEASE);
+}
+
+void MapIntoProcess(Process* process) {
+    // A fork shares the pages of its parent until now
+    process->addressSpace->UnmapMemory(KERNEL_DATA_ADDRESS, KERNEL_DATA_SIZE);
+
+    KernelDataVMObject* data = new KernelDataVMObject();
+    data->SetPID(process->PID());
+
+    FancyRefPtr<VMObject> vmo = data;
+    if (!process->addressSpace->MapVMO(vmo, KERNEL_DATA_ADDRESS, true)) {
+        Log::Warning("Failed to map kernel data pages into process %d", process->PID());
+    }
+}
+
+} // namespace KernelData
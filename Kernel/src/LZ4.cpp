@@ -0,0 +1,199 @@
+#include <LZ4.h>
+
+#include <CString.h>
+
+// A sequence is a token (literal length in the high nibble, match length - 4 in the low nibble),
+// any extra literal length bytes, the literals, a 16-bit little endian match offset and any extra match length bytes.
+// A nibble of 15 is followed by bytes added to the length until one is below 255.
+// The last sequence only has literals, the last LZ4_LAST_LITERALS bytes are always literals
+// and no match starts in the last LZ4_MATCH_LIMIT bytes.
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MATCH_LIMIT 12
+#define LZ4_MAX_OFFSET 65535
+
+namespace LZ4 {
+
+static inline uint32_t Read32(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t HashSequence(uint32_t sequence) { return (sequence * 2654435761U) >> (32 - LZ4_HASH_BITS); }
+
+// Write the extra bytes of a length that did not fit in its nibble
+static inline bool WriteLength(uint8_t*& out, uint8_t* outEnd, size_t length) {
+    for (; length >= 255; length -= 255) {
+        if (out >= outEnd) {
+            return false;
+        }
+        *out++ = 255;
+    }
+
+    if (out >= outEnd) {
+        return false;
+    }
+    *out++ = static_cast<uint8_t>(length);
+    return true;
+}
+
+// Write a sequence, matchLength is 0 for the last sequence which only has literals
+static bool WriteSequence(uint8_t*& out, uint8_t* outEnd, const uint8_t* literals, size_t literalLength,
+                          uint16_t offset, size_t matchLength) {
+    if (out >= outEnd) {
+        return false;
+    }
+
+    uint8_t* token = out++;
+    *token = static_cast<uint8_t>((literalLength >= 15 ? 15 : literalLength) << 4);
+    if (literalLength >= 15 && !WriteLength(out, outEnd, literalLength - 15)) {
+        return false;
+    }
+
+    if (static_cast<size_t>(outEnd - out) < literalLength) {
+        return false;
+    }
+    memcpy(out, literals, literalLength);
+    out += literalLength;
+
+    if (!matchLength) {
+        return true;
+    }
+
+    if (outEnd - out < 2) {
+        return false;
+    }
+    *out++ = offset & 0xFF;
+    *out++ = offset >> 8;
+
+    matchLength -= LZ4_MIN_MATCH;
+    *token |= (matchLength >= 15 ? 15 : matchLength);
+    return matchLength < 15 || WriteLength(out, outEnd, matchLength - 15);
+}
+
+size_t Compress(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity, Workspace& workspace) {
+    if (size > LZ4_MAX_INPUT_SIZE) {
+        return 0;
+    }
+
+    uint8_t* out = dst;
+    uint8_t* outEnd = dst + capacity;
+
+    const uint8_t* ip = src;
+    const uint8_t* anchor = src; // Start of the literals not yet written
+    const uint8_t* end = src + size;
+
+    if (size > LZ4_MATCH_LIMIT) {
+        const uint8_t* matchLimit = end - LZ4_LAST_LITERALS;
+        const uint8_t* startLimit = end - LZ4_MATCH_LIMIT;
+
+        memset(workspace.table, 0, sizeof(workspace.table));
+        while (ip < startLimit) {
+            uint32_t sequence = Read32(ip);
+            uint16_t& entry = workspace.table[HashSequence(sequence)];
+            const uint8_t* candidate = src + entry;
+            entry = static_cast<uint16_t>(ip - src);
+
+            if (candidate >= ip || Read32(candidate) != sequence) {
+                ip++;
+                continue;
+            }
+
+            // Extend the match backwards into the literals
+            while (ip > anchor && candidate > src && ip[-1] == candidate[-1]) {
+                ip--;
+                candidate--;
+            }
+
+            const uint8_t* matchEnd = ip + LZ4_MIN_MATCH;
+            const uint8_t* ref = candidate + LZ4_MIN_MATCH;
+            while (matchEnd < matchLimit && *matchEnd == *ref) {
+                matchEnd++;
+                ref++;
+            }
+
+            if (!WriteSequence(out, outEnd, anchor, ip - anchor, static_cast<uint16_t>(ip - candidate),
+                               matchEnd - ip)) {
+                return 0;
+            }
+
+            ip = anchor = matchEnd;
+        }
+    }
+
+    if (!WriteSequence(out, outEnd, anchor, end - anchor, 0, 0)) {
+        return 0;
+    }
+
+    return out - dst;
+}
+
+// Read the extra bytes of a length, returns false if the input ends first
+static inline bool ReadLength(const uint8_t*& ip, const uint8_t* end, size_t& length) {
+    uint8_t byte;
+    do {
+        if (ip >= end) {
+            return false;
+        }
+
+        byte = *ip++;
+        length += byte;
+    } while (byte == 255);
+
+    return true;
+}
+
+ssize_t Decompress(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity) {
+    const uint8_t* ip = src;
+    const uint8_t* end = src + size;
+    uint8_t* op = dst;
+    uint8_t* outEnd = dst + capacity;
+
+    while (ip < end) {
+        uint8_t token = *ip++;
+
+        size_t literalLength = token >> 4;
+        if (literalLength == 15 && !ReadLength(ip, end, literalLength)) {
+            return -1;
+        }
+
+        if (static_cast<size_t>(end - ip) < literalLength || static_cast<size_t>(outEnd - op) < literalLength) {
+            return -1;
+        }
+        memcpy(op, ip, literalLength);
+        ip += literalLength;
+        op += literalLength;
+
+        if (ip == end) {
+            break; // Last sequence
+        }
+
+        if (end - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        size_t matchLength = token & 15;
+        if (matchLength == 15 && !ReadLength(ip, end, matchLength)) {
+            return -1;
+        }
+        matchLength += LZ4_MIN_MATCH;
+
+        if (!offset || offset > static_cast<size_t>(op - dst) || static_cast<size_t>(outEnd - op) < matchLength) {
+            return -1;
+        }
+
+        // Matches may overlap the output they produce, so copy a byte at a time
+        const uint8_t* ref = op - offset;
+        while (matchLength--) {
+            *op++ = *ref++;
+        }
+    }
+
+    return op - dst;
+}
+
+} // namespace LZ4
@@ -50,4 +50,71 @@ void Semaphore::Signal() {
     }
 
     releaseLock(&lock);
-}
\ No newline at end of file
+}
+void Mutex::LockSlow() {
+    assert(CheckInterrupts());
+    assert(!IsHeldByCurrentThread());
+
+    // The owner is likely to be running on another CPU and about to release it
+    for (unsigned i = 0; i < MUTEX_SPIN_COUNT; i++) {
+        if (!IsLocked() && TryLock()) {
+            return;
+        }
+        asm volatile("pause");
+    }
+
+    Thread* self = Thread::Current();
+    assert(self); // Nothing should contend the mutex before the scheduler starts
+
+    while (true) {
+        MutexBlocker blocker;
+
+        acquireLock(&m_waitersLock);
+        // Unlock() clears the owner before checking the waiter count,
+        // so either we get the mutex here or Unlock() sees us waiting
+        __atomic_add_fetch(&m_waiterCount, 1, __ATOMIC_SEQ_CST);
+        if (TryLock()) {
+            __atomic_sub_fetch(&m_waiterCount, 1, __ATOMIC_RELAXED);
+            releaseLock(&m_waitersLock);
+            return;
+        }
+
+        m_waiters.add_back(&blocker);
+        releaseLock(&m_waitersLock);
+
+        // The mutex cannot be given up on, so ignore signals.
+        // Block returns straight away whilst a signal is pending, give the owner a chance to run.
+        if (self->Block(&blocker)) {
+            Scheduler::Yield();
+        }
+
+        acquireLock(&m_waitersLock);
+        if (!blocker.WasRemoved()) {
+            m_waiters.remove(&blocker);
+        }
+        __atomic_sub_fetch(&m_waiterCount, 1, __ATOMIC_RELAXED);
+        releaseLock(&m_waitersLock);
+
+        if (TryLock()) {
+            return;
+        }
+    }
+}
+
+void Mutex::Unlock() {
+    assert(IsHeldByCurrentThread());
+
+    __atomic_store_n(&m_owner, nullptr, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&m_waiterCount, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+
+    // Wake the first waiter, it will try to get the mutex again as another thread may take it first
+    acquireLock(&m_waitersLock);
+    if (m_waiters.get_length()) {
+        MutexBlocker* blocker = m_waiters.get_front();
+        m_waiters.remove(blocker);
+        blocker->Unblock(); // Marks it as removed
+    }
+    releaseLock(&m_waitersLock);
+}
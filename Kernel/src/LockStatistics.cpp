@@ -0,0 +1,174 @@
+#include <Spinlock.h>
+
+#ifdef LOCK_STATISTICS
+
+#include <CString.h>
+#include <Device.h>
+#include <Math.h>
+#include <MM/KMalloc.h>
+
+// Open addressed by lock address, entries are never removed
+static LockStatistics lockStatistics[LOCK_STATISTICS_MAX_LOCKS];
+static lock_t lockStatisticsLock = 0;
+
+static ALWAYS_INLINE unsigned LockHash(const volatile void* lock) {
+    return (reinterpret_cast<uintptr_t>(lock) >> 2) * 0x9e3779b1U;
+}
+
+void RegisterLockStatistics(const volatile void* lock, const char* name) {
+    ScopedSpinLock lockStats(lockStatisticsLock);
+
+    unsigned hash = LockHash(lock);
+    for (unsigned i = 0; i < LOCK_STATISTICS_MAX_LOCKS; i++) {
+        LockStatistics& stats = lockStatistics[(hash + i) & (LOCK_STATISTICS_MAX_LOCKS - 1)];
+        if (stats.lock == lock) {
+            stats.name = name;
+            return;
+        }
+
+        if (!stats.lock) {
+            stats.name = name;
+            stats.acquiredAt = 0;
+            // Published last, FindLockStatistics does not take lockStatisticsLock
+            __atomic_store_n(&stats.lock, lock, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+}
+
+LockStatistics* FindLockStatistics(const volatile void* lock) {
+    unsigned hash = LockHash(lock);
+    for (unsigned i = 0; i < LOCK_STATISTICS_MAX_LOCKS; i++) {
+        LockStatistics& stats = lockStatistics[(hash + i) & (LOCK_STATISTICS_MAX_LOCKS - 1)];
+
+        const volatile void* entry = __atomic_load_n(&stats.lock, __ATOMIC_ACQUIRE);
+        if (entry == lock) {
+            return &stats;
+        } else if (!entry) {
+            return nullptr;
+        }
+    }
+
+    return nullptr;
+}
+
+void LockStatisticsAcquired(const volatile void* lock, uint64_t spinCycles) {
+    LockStatistics* stats = FindLockStatistics(lock);
+    if (!stats) {
+        return;
+    }
+
+    stats->acquisitions++;
+    if (spinCycles) {
+        stats->contended++;
+        stats->spinCycles += spinCycles;
+    }
+    stats->acquiredAt = ReadTimestampCounter();
+}
+
+void LockStatisticsReleased(const volatile void* lock) {
+    LockStatistics* stats = FindLockStatistics(lock);
+    if (!stats || !stats->acquiredAt) {
+        return; // Not registered or registered whilst held
+    }
+
+    uint64_t held = ReadTimestampCounter() - stats->acquiredAt;
+    stats->holdCycles += held;
+    stats->maxHoldCycles = MAX(stats->maxHoldCycles, held);
+    stats->acquiredAt = 0;
+}
+
+// Write label followed by num, returns the end of the text
+static char* AppendNumber(char* text, const char* label, uint64_t num) {
+    strcpy(text, label);
+    text += strlen(label);
+
+    itoa(num, text, 10);
+    return text + strlen(text);
+}
+
+// One line per lock, read from the start to get new figures and write anything to reset the counters
+class LockStatisticsDevice final : public Device {
+public:
+    LockStatisticsDevice() : Device("lockstat", DeviceTypeUNIXPseudo) {
+        flags = FS_NODE_FILE;
+
+        SetDeviceName("Lock Statistics");
+    }
+
+    ssize_t Read(size_t offset, size_t size, uint8_t* buffer) override {
+        ScopedSpinLock lockText(m_textLock);
+        if (!offset || !m_text) {
+            Update();
+        }
+
+        if (offset >= m_textLength) {
+            return 0;
+        }
+
+        size = MIN(size, m_textLength - offset);
+        memcpy(buffer, m_text + offset, size);
+        return size;
+    }
+
+    ssize_t Write(size_t, size_t size, uint8_t*) override {
+        for (LockStatistics& stats : lockStatistics) {
+            if (stats.lock) {
+                stats.acquisitions = stats.contended = 0;
+                stats.spinCycles = stats.holdCycles = stats.maxHoldCycles = 0;
+            }
+        }
+
+        return size;
+    }
+
+private:
+    void Update() {
+        // Name, address and six numbers
+        constexpr size_t lineSize = 256;
+
+        if (!m_text) {
+            m_text = reinterpret_cast<char*>(kmalloc(LOCK_STATISTICS_MAX_LOCKS * lineSize + 1));
+        }
+
+        char* text = m_text;
+        for (LockStatistics& stats : lockStatistics) {
+            const volatile void* lock = __atomic_load_n(&stats.lock, __ATOMIC_ACQUIRE);
+            if (!lock) {
+                continue;
+            }
+
+            strncpy(text, stats.name, 64);
+            text[64] = 0;
+            text += strlen(text);
+
+            strcpy(text, " (0x");
+            text += strlen(text);
+            itoa(reinterpret_cast<uintptr_t>(lock), text, 16);
+            text += strlen(text);
+
+            text = AppendNumber(text, "): acquisitions ", stats.acquisitions);
+            text = AppendNumber(text, " contended ", stats.contended);
+            text = AppendNumber(text, " spin ", stats.spinCycles);
+            text = AppendNumber(text, " hold ", stats.holdCycles);
+            text = AppendNumber(text, " max hold ", stats.maxHoldCycles);
+            text = AppendNumber(text, " avg hold ", stats.acquisitions ? stats.holdCycles / stats.acquisitions : 0);
+            strcpy(text, " cycles\n");
+            text += strlen(text);
+        }
+
+        m_textLength = text - m_text;
+    }
+
+    lock_t m_textLock = 0;
+    char* m_text = nullptr;
+    size_t m_textLength = 0;
+};
+
+void InitializeLockStatistics() { new LockStatisticsDevice(); }
+
+#else
+
+void InitializeLockStatistics() {}
+
+#endif
@@ -1,8 +1,12 @@
 #include <Logging.h>
 
+#include <CPU.h>
 #include <Device.h>
 #include <Fs/Filesystem.h>
 #include <MM/KMalloc.h>
+#include <Math.h>
+#include <SMP.h>
+#include <Scheduler.h>
 #include <TTY/PTY.h>
 #include <Serial.h>
 #include <String.h>
@@ -108,8 +112,144 @@ size_t logBufferMaxSize = 0x100000; // 1MB
 
 lock_t logLock = 0;
 
+// Messages are written into a ring of the CPU they were logged on and drained by a thread,
+// so logging does not wait on the serial port or the console.
+// Each message is a header followed by the text, published once the whole message has been written
+// and drained in order of their sequence numbers.
+struct CPULogBuffer {
+    struct MessageHeader {
+        uint32_t length;
+        uint32_t reserved;
+        uint64_t sequence;
+    };
+
+    char data[LOG_CPU_BUFFER_SIZE];
+
+    uint64_t head = 0; // Only written by the CPU
+    uint64_t tail = 0; // Only written by the drain thread
+
+    // State of the message being written, messages nest (e.g. Log::Write within Log::Info)
+    int depth = 0;
+    bool interrupts = false; // Interrupts were enabled before the outermost message
+    bool overflowed = false; // Did not fit, is dropped
+    uint64_t messageStart = 0;
+    uint64_t writePos = 0;
+
+    uint64_t dropped = 0;
+
+    ALWAYS_INLINE void CopyIn(uint64_t pos, const void* src, size_t n) {
+        size_t offset = pos & (LOG_CPU_BUFFER_SIZE - 1);
+        size_t first = MIN(n, LOG_CPU_BUFFER_SIZE - offset);
+        memcpy(data + offset, src, first);
+        memcpy(data, reinterpret_cast<const uint8_t*>(src) + first, n - first);
+    }
+
+    ALWAYS_INLINE void CopyOut(uint64_t pos, void* dest, size_t n) const {
+        size_t offset = pos & (LOG_CPU_BUFFER_SIZE - 1);
+        size_t first = MIN(n, LOG_CPU_BUFFER_SIZE - offset);
+        memcpy(dest, data + offset, first);
+        memcpy(reinterpret_cast<uint8_t*>(dest) + first, data, n - first);
+    }
+};
+
+static CPULogBuffer* cpuLogBuffers[LOG_MAX_CPUS];
+static bool asyncLogging = false; // Set once the drain thread is running, cleared on panic
+static uint64_t nextMessageSequence = 0;
+static char* drainBuffer = nullptr; // Message being written out by the drain thread
+
 void WriteN(const char* str, size_t n);
 
+// Returns nullptr if the message should be written directly
+static CPULogBuffer* BeginMessage() {
+    if (!__atomic_load_n(&asyncLogging, __ATOMIC_ACQUIRE)) {
+        return nullptr;
+    }
+
+    // The CPU writing the message has to stay the only writer of its ring until it is published
+    bool interrupts = CheckInterrupts();
+    asm volatile("cli");
+
+    uint64_t id = GetCPULocal()->id;
+    CPULogBuffer* buffer = (id < LOG_MAX_CPUS) ? cpuLogBuffers[id] : nullptr;
+    if (!buffer) {
+        if (interrupts) {
+            asm volatile("sti");
+        }
+        return nullptr;
+    }
+
+    if (buffer->depth++ == 0) {
+        buffer->interrupts = interrupts;
+        buffer->overflowed = false;
+        buffer->messageStart = buffer->head;
+        buffer->writePos = buffer->head + sizeof(CPULogBuffer::MessageHeader);
+    }
+
+    return buffer;
+}
+
+static void AppendMessage(CPULogBuffer* buffer, const char* str, size_t n) {
+    if (buffer->overflowed) {
+        return;
+    }
+
+    uint64_t tail = __atomic_load_n(&buffer->tail, __ATOMIC_ACQUIRE);
+    if (buffer->writePos + n - tail > LOG_CPU_BUFFER_SIZE) {
+        buffer->overflowed = true; // Full, the drain thread has fallen behind
+        return;
+    }
+
+    buffer->CopyIn(buffer->writePos, str, n);
+    buffer->writePos += n;
+}
+
+static void EndMessage(CPULogBuffer* buffer) {
+    if (--buffer->depth) {
+        return;
+    }
+
+    if (buffer->overflowed) {
+        buffer->dropped++;
+    } else if (buffer->writePos > buffer->messageStart + sizeof(CPULogBuffer::MessageHeader)) {
+        CPULogBuffer::MessageHeader header = {
+            .length = static_cast<uint32_t>(buffer->writePos - buffer->messageStart - sizeof(header)),
+            .reserved = 0,
+            .sequence = __atomic_fetch_add(&nextMessageSequence, 1, __ATOMIC_RELAXED),
+        };
+        buffer->CopyIn(buffer->messageStart, &header, sizeof(header));
+
+        __atomic_store_n(&buffer->head, buffer->writePos, __ATOMIC_RELEASE);
+    }
+
+    if (buffer->interrupts) {
+        asm volatile("sti");
+    }
+}
+
+// Holds a message together, whether it is written to the CPU's ring or directly
+class LogMessage final {
+public:
+    ALWAYS_INLINE LogMessage() {
+        m_buffer = BeginMessage();
+        if (!m_buffer && CheckInterrupts()) {
+            acquireLock(&logLock);
+            m_locked = true;
+        }
+    }
+
+    ALWAYS_INLINE ~LogMessage() {
+        if (m_buffer) {
+            EndMessage(m_buffer);
+        } else if (m_locked) {
+            releaseLock(&logLock);
+        }
+    }
+
+private:
+    CPULogBuffer* m_buffer;
+    bool m_locked = false;
+};
+
 class LogDevice : public Device {
 public:
     LogDevice(char* name) : Device(name, DeviceTypeKernelLog) { flags = FS_NODE_FILE; }
@@ -159,7 +299,8 @@ void EnableBuffer() {
 
 void DisableBuffer() { logBufferEnabled = false; }
 
-void WriteN(const char* str, size_t n) {
+// Write to the serial port, console and log buffer, waits on the serial port
+static void WriteDirect(const char* str, size_t n) {
     Serial::Write(str, n);
 
     if (console) {
@@ -197,6 +338,104 @@ void WriteN(const char* str, size_t n) {
     }
 }
 
+void WriteN(const char* str, size_t n) {
+    if (CPULogBuffer* buffer = BeginMessage()) {
+        AppendMessage(buffer, str, n);
+        EndMessage(buffer);
+        return;
+    }
+
+    WriteDirect(str, n);
+}
+
+// Write out the published message with the lowest sequence number, returns false if there are none
+static bool DrainMessage(bool lock) {
+    CPULogBuffer* oldest = nullptr;
+    CPULogBuffer::MessageHeader oldestHeader;
+
+    for (CPULogBuffer* buffer : cpuLogBuffers) {
+        if (!buffer || buffer->tail == __atomic_load_n(&buffer->head, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+
+        CPULogBuffer::MessageHeader header;
+        buffer->CopyOut(buffer->tail, &header, sizeof(header));
+        if (!oldest || header.sequence < oldestHeader.sequence) {
+            oldest = buffer;
+            oldestHeader = header;
+        }
+    }
+
+    if (!oldest) {
+        return false;
+    }
+
+    oldest->CopyOut(oldest->tail + sizeof(oldestHeader), drainBuffer, oldestHeader.length);
+    __atomic_store_n(&oldest->tail, oldest->tail + sizeof(oldestHeader) + oldestHeader.length, __ATOMIC_RELEASE);
+
+    if (lock) {
+        acquireLock(&logLock);
+    }
+    WriteDirect(drainBuffer, oldestHeader.length);
+    if (lock) {
+        releaseLock(&logLock);
+    }
+    return true;
+}
+
+void DrainThread() {
+    uint64_t dropped = 0;
+    for (;;) {
+        if (DrainMessage(true)) {
+            continue;
+        }
+
+        uint64_t droppedNow = 0;
+        for (CPULogBuffer* buffer : cpuLogBuffers) {
+            droppedNow += buffer ? buffer->dropped : 0;
+        }
+
+        if (droppedNow != dropped) {
+            Warning("Log: Dropped %lu messages, the log was full", droppedNow - dropped);
+            dropped = droppedNow;
+            continue;
+        }
+
+        if (console) {
+            console->Update();
+        }
+
+        // Polled rather than woken so logging never has to touch the scheduler
+        Thread::Current()->Sleep(LOG_DRAIN_INTERVAL);
+    }
+}
+
+void StartDrainThread() {
+    drainBuffer = reinterpret_cast<char*>(kmalloc(LOG_CPU_BUFFER_SIZE));
+
+    for (unsigned i = 0; i < LOG_MAX_CPUS; i++) {
+        if (SMP::cpus[i]) {
+            cpuLogBuffers[i] = new CPULogBuffer();
+        }
+    }
+
+    auto proc = Process::CreateKernelProcess((void*)DrainThread, "LogDrain", nullptr);
+    proc->Start();
+
+    __atomic_store_n(&asyncLogging, true, __ATOMIC_RELEASE);
+}
+
+void FlushForPanic() {
+    __atomic_store_n(&asyncLogging, false, __ATOMIC_RELEASE);
+    if (!drainBuffer) {
+        return;
+    }
+
+    // The other CPUs are halted, possibly in the middle of draining so logLock is not taken
+    while (DrainMessage(false))
+        ;
+}
+
 void Write(const char* str, uint8_t r, uint8_t g, uint8_t b) { WriteN(str, strlen(str)); }
 
 void Write(unsigned long long num, bool hex, uint8_t r, uint8_t g, uint8_t b) {
@@ -303,7 +542,7 @@ void WriteF(const char* __restrict format, va_list args) {
         }
     }
 
-    if (console)
+    if (console && !__atomic_load_n(&asyncLogging, __ATOMIC_RELAXED))
         console->Update();
 }
 
@@ -315,39 +554,36 @@ void Print(const char* __restrict fmt, ...) {
 }
 
 void Warning(const char* __restrict fmt, ...) {
-    if (CheckInterrupts())
-        acquireLock(&logLock);
+    LogMessage message;
     Write("\r\n[WARN]    ", 255, 255, 0);
     va_list args;
     va_start(args, fmt);
     WriteF(fmt, args);
     va_end(args);
-    if (CheckInterrupts())
-        releaseLock(&logLock);
 }
 
 void Error(const char* __restrict fmt, ...) {
-    if (CheckInterrupts())
-        acquireLock(&logLock);
+    LogMessage message;
     Write("\r\n[ERROR]   ", 255, 0, 0);
     va_list args;
     va_start(args, fmt);
     WriteF(fmt, args);
     va_end(args);
-    if (CheckInterrupts())
-        releaseLock(&logLock);
 }
 
 void Info(const char* __restrict fmt, ...) {
-    if (CheckInterrupts())
-        acquireLock(&logLock);
+    LogMessage message;
     Write("\r\n[INFO]    ");
     va_list args;
     va_start(args, fmt);
     WriteF(fmt, args);
     va_end(args);
-    if (CheckInterrupts())
-        releaseLock(&logLock);
+}
+
+void InfoF(const char* __restrict fmt, va_list args) {
+    LogMessage message;
+    Write("\r\n[INFO]    ");
+    WriteF(fmt, args);
 }
 
 void Warning(const char* str) {
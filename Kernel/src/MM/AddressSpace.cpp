@@ -1,6 +1,7 @@
 #include <MM/AddressSpace.h>
 
 #include <CPU.h>
+#include <MM/Swap.h>
 #include <StackTrace.h>
 
 AddressSpace::AddressSpace(PageMap* pm) : m_pageMap(pm) {}
@@ -22,62 +23,65 @@ AddressSpace::~AddressSpace() {
 MappedRegion* AddressSpace::AddressToRegionReadLock(uintptr_t address) {
     ScopedSpinLock acquired(m_lock);
 
-    for (MappedRegion& region : m_regions) {
-        if (!region.vmObject.get()) {
-            continue;
-        }
-
-        if (address >= region.Base() && address < region.End()) {
-            region.lock.AcquireRead();
-            return &region;
-        }
+    MappedRegion* region = m_regions.find(address);
+    if (!region || !region->vmObject.get()) {
+        return nullptr;
     }
 
-    return nullptr;
+    region->lock.AcquireRead();
+    return region;
 }
 
 MappedRegion* AddressSpace::AddressToRegionWriteLock(uintptr_t address) {
     ScopedSpinLock acquired(m_lock);
 
-    for (MappedRegion& region : m_regions) {
-        if (!region.vmObject.get()) {
-            continue;
-        }
-
-        if (address >= region.Base() && address < region.End()) {
-            region.lock.AcquireWrite();
-            return &region;
-        }
+    MappedRegion* region = m_regions.find(address);
+    if (!region || !region->vmObject.get()) {
+        return nullptr;
     }
 
-    return nullptr;
+    region->lock.AcquireWrite();
+    return region;
 }
 
-bool AddressSpace::RangeInRegion(uintptr_t base, size_t size) {
+// m_lock must be held
+bool AddressSpace::RangeInRegionUnlocked(uintptr_t base, size_t size) {
     uintptr_t end = base + size;
+    if (end < base) {
+        return false;
+    }
 
-    auto it = m_regions.begin();
-    for (; it != m_regions.end(); it++) {
-        if (base < it->Base()) {
+    while (base < end) {
+        // The range may span several adjacent regions
+        MappedRegion* region = m_regions.find(base);
+        if (!region) {
             IF_DEBUG((debugLevelUsermodeMM >= DebugLevelNormal), {
-                Log::Warning("range (%x-%x) not in region (%x-%x)!", base, base + size, it->Base(), it->End());
+                Log::Warning("range (%x-%x) not in region!", base, end);
                 PrintStackTrace(GetRBP());
             });
-            return false;                                    // Outside of the region, regions are ordered
-        } else if (base >= it->Base() && base < it->End()) { // We intersect with this region
-            base = it->End();
+            return false;
         }
 
-        if (base >= end) {
-            return true; // Range lies completely within the region
-        }
+        base = region->End();
     }
 
-    if (base >= end) {
-        return true; // Range lies completely within the region
+    return true; // Range lies completely within the regions
+}
+
+bool AddressSpace::RangeInRegion(uintptr_t base, size_t size) {
+    ScopedSpinLock acquired(m_lock);
+    return RangeInRegionUnlocked(base, size);
+}
+
+bool AddressSpace::RangesInRegion(const iovec* iov, size_t count) {
+    ScopedSpinLock acquired(m_lock);
+    for (size_t i = 0; i < count; i++) {
+        if (!RangeInRegionUnlocked(reinterpret_cast<uintptr_t>(iov[i].iov_base), iov[i].iov_len)) {
+            return false;
+        }
     }
 
-    return false;
+    return true;
 }
 
 long AddressSpace::UnmapRegion(MappedRegion* region) {
@@ -86,26 +90,25 @@ long AddressSpace::UnmapRegion(MappedRegion* region) {
 
     assert(region->lock.IsWriteLocked());
 
-    for (auto it = m_regions.begin(); it != m_regions.end(); it++) {
-        if (it->Base() == region->Base()) {
-            if(IsKernel()){
-                assert(it->Base() >= KERNEL_VIRTUAL_BASE);
-                Memory::KernelMapVirtualMemory4K(0, region->Base(), PAGE_COUNT_4K(region->Size()), 0);
-            } else {
-                Memory::MapVirtualMemory4K(0, region->Base(), PAGE_COUNT_4K(region->Size()), 0, m_pageMap);
-            }
+    MappedRegion* it = m_regions.find(region->Base());
+    if (!it || it->Base() != region->Base()) {
+        Log::Warning("Failed to unmap region object!");
+        return 1;
+    }
 
-            if (it->vmObject) {
-                it->vmObject->refCount--;
-            }
+    if(IsKernel()){
+        assert(it->Base() >= KERNEL_VIRTUAL_BASE);
+        Memory::KernelMapVirtualMemory4K(0, region->Base(), PAGE_COUNT_4K(region->Size()), 0);
+    } else {
+        Memory::MapVirtualMemory4K(0, region->Base(), PAGE_COUNT_4K(region->Size()), 0, m_pageMap);
+    }
 
-            m_regions.remove(it);
-            return 0;
-        }
+    if (it->vmObject) {
+        it->vmObject->refCount--;
     }
 
-    Log::Warning("Failed to unmap region object!");
-    return 1;
+    m_regions.remove(it);
+    return 0;
 }
 
 MappedRegion* AddressSpace::MapVMO(FancyRefPtr<VMObject> obj, uintptr_t base, bool fixed) {
@@ -177,9 +180,22 @@ AddressSpace* AddressSpace::Fork() {
     ScopedSpinLock acquired(m_lock);
 
     AddressSpace* fork = new AddressSpace(Memory::ClonePageMap(m_pageMap));
+
+    // Our pages are being made read only, send one shootdown for all of them
+    Memory::TLBShootdownBatch shootdown(m_pageMap);
     for (auto it = m_regions.begin(); it != m_regions.end(); it++) {
         MappedRegion& r = *it;
 
+        VMObject* copy = r.vmObject->IsShared() ? nullptr : r.vmObject->Fork();
+        if (copy) {
+            // Both objects now map the same blocks read only, the first write to a block copies it
+            r.vmObject->MapAllocatedBlocks(r.Base(), m_pageMap);
+
+            MappedRegion& forkRegion = *fork->m_regions.insert(MappedRegion(r.Base(), r.Size(), copy));
+            forkRegion.vmObject->MapAllocatedBlocks(forkRegion.Base(), fork->m_pageMap);
+            continue;
+        }
+
         r.vmObject->refCount++;
         if (!r.vmObject->IsShared()) { // Shared VM Objects are shared, we do not want COW
             r.vmObject->copyOnWrite = true;
@@ -188,7 +204,7 @@ AddressSpace* AddressSpace::Fork() {
             r.vmObject->MapAllocatedBlocks(r.Base(), m_pageMap);
         }
 
-        fork->m_regions.add_back(const_cast<const MappedRegion&>(r));
+        fork->m_regions.insert(MappedRegion(const_cast<const MappedRegion&>(r)));
 
         r.vmObject->MapAllocatedBlocks(r.Base(), fork->m_pageMap);
     }
@@ -211,7 +227,7 @@ retry:
             Memory::MapVirtualMemory4K(0, base, PAGE_COUNT_4K(size), 0, m_pageMap);
 
             // Assume vmobject has been removed
-            m_regions.remove(it);
+            m_regions.remove(&region);
             goto retry;
         }
 
@@ -223,7 +239,7 @@ retry:
 
                 Memory::MapVirtualMemory4K(0, base, PAGE_COUNT_4K(size), 0, m_pageMap);
 
-                m_regions.remove(it);
+                m_regions.remove(&region);
                 goto retry;
             }
         }
@@ -234,18 +250,6 @@ retry:
     return 0;
 }
 
-size_t AddressSpace::UsedPhysicalMemory() const {
-    size_t mem = 0;
-
-    for (MappedRegion& region : m_regions) {
-        if (region.vmObject.get()) {
-            mem += region.vmObject->UsedPhysicalMemory();
-        }
-    }
-
-    return mem;
-}
-
 void AddressSpace::DumpRegions() {
     for (MappedRegion& region : m_regions) {
         if (!region.vmObject.get())
@@ -255,62 +259,62 @@ void AddressSpace::DumpRegions() {
     }
 }
 
-MappedRegion* AddressSpace::FindAvailableRegion(size_t size) {
-    uintptr_t base = PAGE_SIZE_4K; // We do not want zero addresses
-    uintptr_t end = base + size;
-
-    auto it = m_regions.begin();
-    for (; it != m_regions.end(); it++) {
-        if (it->Base() >= end) {
-            return &m_regions.insert(MappedRegion(base, size), it);
-        }
+unsigned AddressSpace::SwapOut(unsigned maxPages) {
+    if (IsKernel() || acquireTestLock(&m_lock)) {
+        return 0;
+    }
 
-        if (base >= it->Base() && base < it->End()) { // We intersect with this region
-            base = it->End();
-            end = base + size;
+    unsigned swapped = 0;
+    unsigned scanBudget = SWAP_SCAN_BATCH;
+    for (unsigned visited = 0; visited < m_regions.get_length() && swapped < maxPages && scanBudget; visited++) {
+        MappedRegion* region = m_regions.lower_bound(m_swapHand);
+        if (!region) {
+            m_swapHand = 0; // Wrap around
+            region = m_regions.lower_bound(0);
+            if (!region) {
+                break;
+            }
         }
 
-        if (end > it->Base() && end <= it->End()) { // We intersect with this region
-            base = it->End();
-            end = base + size;
+        // Regions being faulted on or changed are left until next time
+        if (region->vmObject.get() && !region->lock.TryAcquireWriteOnce()) {
+            swapped += region->vmObject->SwapOut(region->Base(), m_pageMap, maxPages - swapped, scanBudget);
+            region->lock.ReleaseWrite();
         }
 
-        if (base < it->Base() && end > it->End()) { // We encapsulate this region
-            base = it->End();
-            end = base + size;
+        // Keep going with the same region next time if we stopped part way through
+        if (scanBudget && swapped < maxPages) {
+            m_swapHand = region->End();
         }
     }
 
-    if (end < m_endRegion) {
-        return &m_regions.add_back(MappedRegion(base, size));
+    releaseLock(&m_lock);
+    return swapped;
+}
+
+MappedRegion* AddressSpace::FindAvailableRegion(size_t size) {
+    // Align large regions to 2MB so they can be mapped with 2MB pages
+    uintptr_t alignment = (size >= PAGE_SIZE_2M) ? PAGE_SIZE_2M : PAGE_SIZE_4K;
+
+    // We do not want zero addresses
+    uintptr_t base = m_regions.find_gap(size, alignment, PAGE_SIZE_4K, m_endRegion);
+    if (!base) {
+        return nullptr; // Failed to allocate
     }
 
-    return nullptr; // Failed to allocate
+    return m_regions.insert(MappedRegion(base, size));
 }
 
 MappedRegion* AddressSpace::AllocateRegionAt(uintptr_t base, size_t size) {
     uintptr_t end = base + size;
 
-    auto it = m_regions.begin();
-    auto lastIt = m_regions.end();
-    for (; it != m_regions.end(); it++) {
-        if (it->End() <= base) {
-            lastIt = it;
-            continue;
-        }
-
-        if (it->Base() >= end) {
-            return &m_regions.insert(MappedRegion(base, size), it);
-        }
-
+    // Make sure the first region ending after base starts after our end
+    MappedRegion* next = m_regions.lower_bound(base);
+    if (next && next->Base() < end) {
         IF_DEBUG((debugLevelUsermodeMM >= DebugLevelNormal),
-                 { Log::Error("AllocateRegionAt: Failed at %x - %x", it->Base(), it->End()); });
+                 { Log::Error("AllocateRegionAt: Failed at %x - %x", next->Base(), next->End()); });
         return nullptr;
     }
 
-    if (!m_regions.get_length() || m_regions.get_back().End() <= base) {
-        return &m_regions.add_back(MappedRegion(base, size)); // Region is at end
-    }
-
-    return nullptr;
-}
\ No newline at end of file
+    return m_regions.insert(MappedRegion(base, size));
+}
@@ -0,0 +1,208 @@
+#include <MM/VMObject.h>
+
+#include <Fs/Filesystem.h>
+#include <Fs/PageCache.h>
+
+#include <Assert.h>
+#include <CString.h>
+#include <Paging.h>
+#include <PhysicalAllocator.h>
+#include <Spinlock.h>
+
+FileVMObject::FileVMObject(FancyRefPtr<UNIXOpenFile> file, size_t offset, size_t size, bool shared)
+    : VMObject(size, false, shared), m_file(std::move(file)), m_firstPage(offset >> PAGE_SHIFT_4K) {
+    assert(!(offset & (PAGE_SIZE_4K - 1)));
+
+    m_cache = PageCache::Acquire(m_file->node);
+
+    if (shared) {
+        m_cache->AddSharedMapping();
+    } else {
+        // Writes always go to a private copy of the page
+        copyOnWrite = true;
+
+        m_privateBlocks = new uint32_t[size >> PAGE_SHIFT_4K];
+        memset(m_privateBlocks, 0, sizeof(uint32_t) * (size >> PAGE_SHIFT_4K));
+    }
+}
+
+FileVMObject::FileVMObject(const FileVMObject& other)
+    : VMObject(other.size, false, other.shared), m_file(other.m_file), m_firstPage(other.m_firstPage) {
+    m_cache = PageCache::Acquire(m_file->node);
+    copyOnWrite = other.copyOnWrite;
+    if (shared) {
+        m_cache->AddSharedMapping();
+    }
+
+    if (!other.m_privateBlocks) {
+        return;
+    }
+
+    unsigned blockCount = size >> PAGE_SHIFT_4K;
+    m_privateBlocks = new uint32_t[blockCount];
+    memset(m_privateBlocks, 0, sizeof(uint32_t) * blockCount);
+
+    // Temporary mappings so we can copy the data over
+    uint8_t* virtBuffer = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(2));
+    uint8_t* virtDestBuffer = virtBuffer + PAGE_SIZE_4K;
+
+    for (unsigned i = 0; i < blockCount; i++) {
+        if (!other.m_privateBlocks[i]) {
+            continue; // Still the file's page
+        }
+
+        uintptr_t block = Memory::AllocatePhysicalMemoryBlock();
+        assert(block < PHYS_BLOCK_MAX);
+
+        Memory::KernelMapVirtualMemory4K(static_cast<uintptr_t>(other.m_privateBlocks[i]) << PAGE_SHIFT_4K,
+                                         (uintptr_t)virtBuffer, 1);
+        Memory::KernelMapVirtualMemory4K(block, (uintptr_t)virtDestBuffer, 1);
+        memcpy(virtDestBuffer, virtBuffer, PAGE_SIZE_4K);
+
+        m_privateBlocks[i] = block >> PAGE_SHIFT_4K;
+        Memory::AccountMemory(Memory::MemoryUsageAnonymous, PAGE_SIZE_4K);
+    }
+
+    Memory::KernelFree4KPages(virtBuffer, 2);
+}
+
+FileVMObject::~FileVMObject() {
+    if (m_privateBlocks) {
+        for (unsigned i = 0; i < (size >> PAGE_SHIFT_4K); i++) {
+            if (m_privateBlocks[i]) {
+                Memory::FreePhysicalMemoryBlock(static_cast<uintptr_t>(m_privateBlocks[i]) << PAGE_SHIFT_4K);
+                Memory::AccountMemory(Memory::MemoryUsageAnonymous, -static_cast<int64_t>(PAGE_SIZE_4K));
+            }
+        }
+
+        delete[] m_privateBlocks;
+    }
+
+    if (shared) {
+        m_cache->RemoveSharedMapping();
+    }
+
+    // Writes back any dirty pages if we were the last mapping
+    m_cache->Release();
+}
+
+int FileVMObject::Hit(uintptr_t base, uintptr_t offset, PageMap* pMap) {
+    unsigned blockIndex = offset >> PAGE_SHIFT_4K;
+    assert(blockIndex < (size >> PAGE_SHIFT_4K));
+
+    uintptr_t virt = base + (static_cast<uintptr_t>(blockIndex) << PAGE_SHIFT_4K);
+
+    if (m_privateBlocks) {
+        if (uint32_t block = __atomic_load_n(&m_privateBlocks[blockIndex], __ATOMIC_ACQUIRE); block) {
+            // Only writable once we are the only reference to the object
+            uint64_t flags = (refCount <= 1) ? (PAGE_USER | PAGE_WRITABLE | PAGE_PRESENT)
+                                             : (PAGE_USER | PAGE_PRESENT | PAGE_COPY_ON_WRITE);
+            Memory::MapVirtualMemory4K(static_cast<uintptr_t>(block) << PAGE_SHIFT_4K, virt, 1, flags, pMap);
+            return 0;
+        }
+    }
+
+    uintptr_t phys = m_cache->GetPage(m_firstPage + blockIndex);
+    if (!phys) {
+        return 1; // Failed to read the file
+    }
+
+    if (shared) {
+        m_cache->MarkDirty(m_firstPage + blockIndex);
+        Memory::MapVirtualMemory4K(phys, virt, 1, PAGE_USER | PAGE_WRITABLE | PAGE_PRESENT | PAGE_SHARED, pMap);
+    } else {
+        Memory::MapVirtualMemory4K(phys, virt, 1, PAGE_USER | PAGE_PRESENT | PAGE_COPY_ON_WRITE, pMap);
+    }
+
+    return 0;
+}
+
+int FileVMObject::CopyOnWriteHit(uintptr_t base, uintptr_t offset, PageMap* pMap) {
+    if (!m_privateBlocks) {
+        return Hit(base, offset, pMap);
+    }
+
+    unsigned blockIndex = offset >> PAGE_SHIFT_4K;
+    assert(blockIndex < (size >> PAGE_SHIFT_4K));
+
+    if (__atomic_load_n(&m_privateBlocks[blockIndex], __ATOMIC_ACQUIRE)) {
+        return Hit(base, offset, pMap); // Already copied, map it writable
+    }
+
+    // Reading the page may block so do it before taking the lock
+    uintptr_t phys = m_cache->GetPage(m_firstPage + blockIndex);
+    if (!phys) {
+        return 1;
+    }
+
+    uintptr_t newBlock = Memory::AllocatePhysicalMemoryBlock();
+    if (!newBlock) {
+        return 1; // Failed to allocate
+    }
+    assert(newBlock < PHYS_BLOCK_MAX);
+
+    // Temporary mappings so we can copy the data over
+    uint8_t* virtBuffer = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(2));
+    uint8_t* virtDestBuffer = virtBuffer + PAGE_SIZE_4K;
+
+    Memory::KernelMapVirtualMemory4K(phys, (uintptr_t)virtBuffer, 1);
+    Memory::KernelMapVirtualMemory4K(newBlock, (uintptr_t)virtDestBuffer, 1);
+    memcpy(virtDestBuffer, virtBuffer, PAGE_SIZE_4K);
+
+    Memory::KernelFree4KPages(virtBuffer, 2);
+
+    {
+        ScopedSpinLock lockBlocks(m_blockLock);
+        if (m_privateBlocks[blockIndex]) {
+            // Another thread copied the page first
+            Memory::FreePhysicalMemoryBlock(newBlock);
+        } else {
+            __atomic_store_n(&m_privateBlocks[blockIndex], newBlock >> PAGE_SHIFT_4K, __ATOMIC_RELEASE);
+            Memory::AccountMemory(Memory::MemoryUsageAnonymous, PAGE_SIZE_4K);
+        }
+    }
+
+    return Hit(base, offset, pMap);
+}
+
+void FileVMObject::MapAllocatedBlocks(uintptr_t base, PageMap* pMap) {
+    unsigned blockCount = size >> PAGE_SHIFT_4K;
+    for (unsigned i = 0; i < blockCount; i++) {
+        uintptr_t virt = base + (static_cast<uintptr_t>(i) << PAGE_SHIFT_4K);
+
+        if (m_privateBlocks && m_privateBlocks[i]) {
+            uint64_t flags = (refCount <= 1) ? (PAGE_USER | PAGE_WRITABLE | PAGE_PRESENT)
+                                             : (PAGE_USER | PAGE_PRESENT | PAGE_COPY_ON_WRITE);
+            Memory::MapVirtualMemory4K(static_cast<uintptr_t>(m_privateBlocks[i]) << PAGE_SHIFT_4K, virt, 1, flags,
+                                       pMap);
+            continue;
+        }
+
+        // Only map what has been read already, the rest is read on demand
+        if (uintptr_t phys = m_cache->FindPage(m_firstPage + i); phys) {
+            if (shared) {
+                m_cache->MarkDirty(m_firstPage + i);
+                Memory::MapVirtualMemory4K(phys, virt, 1, PAGE_USER | PAGE_WRITABLE | PAGE_PRESENT | PAGE_SHARED, pMap);
+            } else {
+                Memory::MapVirtualMemory4K(phys, virt, 1, PAGE_USER | PAGE_PRESENT | PAGE_COPY_ON_WRITE, pMap);
+            }
+        }
+    }
+}
+
+VMObject* FileVMObject::Clone() { return new FileVMObject(*this); }
+
+size_t FileVMObject::UsedPhysicalMemory() const {
+    size_t used = 0;
+    if (m_privateBlocks) {
+        for (unsigned i = 0; i < (size >> PAGE_SHIFT_4K); i++) {
+            if (m_privateBlocks[i]) {
+                used += PAGE_SIZE_4K;
+            }
+        }
+    }
+
+    return used;
+}
+
+int FileVMObject::Sync() { return m_cache->WriteBack(); }
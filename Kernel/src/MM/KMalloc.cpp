@@ -1,7 +1,9 @@
 #include <frg/slab.hpp>
 
 #include <Assert.h>
+#include <CPU.h>
 #include <CString.h>
+#include <Debug.h>
 #include <Lock.h>
 #include <Logging.h>
 #include <Paging.h>
@@ -9,6 +11,28 @@
 
 #include <StackTrace.h>
 
+#ifdef KERNEL_HEAP_PROFILE
+#include <Device.h>
+#include <Errno.h>
+#include <Math.h>
+#include <Symbols.h>
+#include <Timer.h>
+#endif
+
+// Allocations of up to 1024 bytes are rounded up to a power of two size class and served from
+// per-CPU caches of free objects (CPU::slabCaches), so most allocations and frees take no lock.
+// Each class has a shared pool of free objects carved from slabs of kernel heap pages,
+// objects move between the pool and the per-CPU caches in batches of half a cache.
+// Larger allocations go to the frg slab allocator.
+
+#define KMALLOC_HEAP_BASE 0xFFFFFFFFC0000000ULL // Kernel heap PDPT (see Memory::KernelAllocate4KPages)
+#define KMALLOC_HEAP_PAGES (TABLES_PER_DIR * PAGES_PER_TABLE)
+
+#define KMALLOC_MIN_CLASS_SHIFT 4 // 16 bytes
+#define KMALLOC_MAX_CLASS_SIZE (1U << (KMALLOC_MIN_CLASS_SHIFT + CPU_SLAB_CLASS_COUNT - 1))
+#define KMALLOC_SLAB_PAGES 4
+#define KMALLOC_CPU_BATCH (CPU_SLAB_CACHE_SIZE / 2)
+
 class Lock {
 public:
     void lock() {
@@ -39,39 +63,51 @@ private:
 
 lock_t allocatorInstanceLock = 0;
 
+static uintptr_t MapHeapPages(size_t len);
+static void UnmapHeapPages(uintptr_t addr, size_t len);
+
 struct KernelAllocator {
-    uintptr_t map(size_t len) {
-        size_t pageCount = (len + PAGE_SIZE_4K - 1) / PAGE_SIZE_4K;
-        void* ptr = Memory::KernelAllocate4KPages(pageCount);
-        uintptr_t base = reinterpret_cast<uintptr_t>(ptr);
+    uintptr_t map(size_t len) { return MapHeapPages(len); }
+    void unmap(uintptr_t addr, size_t len) { UnmapHeapPages(addr, len); }
 
-        while (pageCount--) {
-            Memory::KernelMapVirtualMemory4K(Memory::AllocatePhysicalMemoryBlock(), base, 1);
-            base += PAGE_SIZE_4K;
-        }
+    frg::slab_pool<KernelAllocator, Lock> slabPool{*this};
+    frg::slab_allocator<KernelAllocator, Lock> slabAllocator{&slabPool};
+};
 
-        memset(ptr, 0, len);
+static uintptr_t MapHeapPages(size_t len) {
+    size_t pageCount = (len + PAGE_SIZE_4K - 1) / PAGE_SIZE_4K;
+    void* ptr = Memory::KernelAllocate4KPages(pageCount);
+    uintptr_t base = reinterpret_cast<uintptr_t>(ptr);
 
-        return reinterpret_cast<uintptr_t>(ptr);
+    while (pageCount--) {
+        if (uint64_t phys = Memory::AllocateZeroedPhysicalMemoryBlock()) {
+            Memory::KernelMapVirtualMemory4K(phys, base, 1);
+        } else {
+            Memory::KernelMapVirtualMemory4K(Memory::AllocatePhysicalMemoryBlock(), base, 1);
+            memset(reinterpret_cast<void*>(base), 0, PAGE_SIZE_4K);
+        }
+        base += PAGE_SIZE_4K;
     }
 
-    void unmap(uintptr_t addr, size_t len) {
-        assert(!(addr & (PAGE_SIZE_4K - 1)));
+    Memory::AccountMemory(Memory::MemoryUsageKernelHeap, PAGE_COUNT_4K(len) << PAGE_SHIFT_4K);
 
-        size_t pageCount = (len + PAGE_SIZE_4K - 1) / PAGE_SIZE_4K;
-        uintptr_t base = addr;
+    return reinterpret_cast<uintptr_t>(ptr);
+}
 
-        for (unsigned i = 0; i < pageCount; i++) {
-            Memory::FreePhysicalMemoryBlock(Memory::VirtualToPhysicalAddress(base));
-            base += PAGE_SIZE_4K;
-        }
+static void UnmapHeapPages(uintptr_t addr, size_t len) {
+    assert(!(addr & (PAGE_SIZE_4K - 1)));
 
-        Memory::KernelFree4KPages(reinterpret_cast<void*>(addr), pageCount);
+    size_t pageCount = (len + PAGE_SIZE_4K - 1) / PAGE_SIZE_4K;
+    uintptr_t base = addr;
+
+    for (unsigned i = 0; i < pageCount; i++) {
+        Memory::FreePhysicalMemoryBlock(Memory::VirtualToPhysicalAddress(base));
+        base += PAGE_SIZE_4K;
     }
 
-    frg::slab_pool<KernelAllocator, Lock> slabPool{*this};
-    frg::slab_allocator<KernelAllocator, Lock> slabAllocator{&slabPool};
-};
+    Memory::KernelFree4KPages(reinterpret_cast<void*>(addr), pageCount);
+    Memory::AccountMemory(Memory::MemoryUsageKernelHeap, -(static_cast<int64_t>(pageCount) << PAGE_SHIFT_4K));
+}
 
 KernelAllocator* allocator = nullptr;
 
@@ -97,10 +133,471 @@ frg::slab_allocator<KernelAllocator, Lock>& Allocator() {
     return allocator->slabAllocator;
 }
 
-void* kmalloc(size_t size) { return Allocator().allocate(size); }
+// Free objects of a size class shared between CPUs
+static struct SlabClass {
+    lock_t lock = 0;
+    void* freeList = nullptr; // Linked through the first word of each object
+    size_t freeCount = 0;
+} slabClasses[CPU_SLAB_CLASS_COUNT];
+
+// Size class (plus one) of the slab each kernel heap page belongs to, 0 if it is not part of a slab
+static uint8_t heapPageClasses[KMALLOC_HEAP_PAGES];
+
+static ALWAYS_INLINE size_t ClassSize(unsigned sizeClass) { return 1UL << (sizeClass + KMALLOC_MIN_CLASS_SHIFT); }
+
+// Size class for an allocation of size bytes, -1 if too large
+static ALWAYS_INLINE int SizeClass(size_t size) {
+    if (size > KMALLOC_MAX_CLASS_SIZE) {
+        return -1;
+    } else if (size <= ClassSize(0)) {
+        return 0;
+    }
+
+    return (64 - __builtin_clzll(size - 1)) - KMALLOC_MIN_CLASS_SHIFT;
+}
+
+// Size class of an allocated object, -1 if it came from the frg allocator
+static ALWAYS_INLINE int ObjectClass(void* p) {
+    uintptr_t addr = reinterpret_cast<uintptr_t>(p);
+    if (addr < KMALLOC_HEAP_BASE) {
+        return -1;
+    }
+
+    return static_cast<int>(heapPageClasses[(addr - KMALLOC_HEAP_BASE) >> PAGE_SHIFT_4K]) - 1;
+}
+
+// Carve a new slab into free objects, the class lock must be held
+static void GrowSlabClass(unsigned sizeClass) {
+    SlabClass& slabClass = slabClasses[sizeClass];
+    size_t objectSize = ClassSize(sizeClass);
+
+    uintptr_t base = MapHeapPages(KMALLOC_SLAB_PAGES * PAGE_SIZE_4K);
+    for (unsigned i = 0; i < KMALLOC_SLAB_PAGES; i++) {
+        heapPageClasses[((base - KMALLOC_HEAP_BASE) >> PAGE_SHIFT_4K) + i] = sizeClass + 1;
+    }
+
+    for (uintptr_t obj = base + KMALLOC_SLAB_PAGES * PAGE_SIZE_4K - objectSize; obj >= base; obj -= objectSize) {
+        *reinterpret_cast<void**>(obj) = slabClass.freeList;
+        slabClass.freeList = reinterpret_cast<void*>(obj);
+    }
+    slabClass.freeCount += (KMALLOC_SLAB_PAGES * PAGE_SIZE_4K) / objectSize;
+}
+
+// Move a batch of objects from the shared pool to the (empty) cache of cpu, interrupts must be disabled
+static void RefillSlabCache(CPU* cpu, unsigned sizeClass) {
+    SlabClass& slabClass = slabClasses[sizeClass];
+    ScopedSpinLock lockClass(slabClass.lock);
+
+    if (slabClass.freeCount < KMALLOC_CPU_BATCH) {
+        GrowSlabClass(sizeClass);
+    }
+
+    for (unsigned i = 0; i < KMALLOC_CPU_BATCH; i++) {
+        void* obj = slabClass.freeList;
+        slabClass.freeList = *reinterpret_cast<void**>(obj);
+
+        *reinterpret_cast<void**>(obj) = cpu->slabCaches[sizeClass];
+        cpu->slabCaches[sizeClass] = obj;
+    }
+
+    slabClass.freeCount -= KMALLOC_CPU_BATCH;
+    cpu->slabCacheCounts[sizeClass] += KMALLOC_CPU_BATCH;
+}
+
+// Give a batch of objects in the (full) cache of cpu back to the shared pool, interrupts must be disabled
+static void DrainSlabCache(CPU* cpu, unsigned sizeClass) {
+    void* first = cpu->slabCaches[sizeClass];
+    void* last = first;
+    for (unsigned i = 1; i < KMALLOC_CPU_BATCH; i++) {
+        last = *reinterpret_cast<void**>(last);
+    }
+
+    cpu->slabCaches[sizeClass] = *reinterpret_cast<void**>(last);
+    cpu->slabCacheCounts[sizeClass] -= KMALLOC_CPU_BATCH;
+
+    SlabClass& slabClass = slabClasses[sizeClass];
+    ScopedSpinLock lockClass(slabClass.lock);
+
+    *reinterpret_cast<void**>(last) = slabClass.freeList;
+    slabClass.freeList = first;
+    slabClass.freeCount += KMALLOC_CPU_BATCH;
+}
+
+static void* SlabAllocate(unsigned sizeClass) {
+    InterruptDisabler disableInterrupts;
+
+    CPU* cpu = GetCPULocal();
+    if (__builtin_expect(!cpu->slabCacheCounts[sizeClass], 0)) {
+        RefillSlabCache(cpu, sizeClass);
+    }
+
+    void* obj = cpu->slabCaches[sizeClass];
+    cpu->slabCaches[sizeClass] = *reinterpret_cast<void**>(obj);
+    cpu->slabCacheCounts[sizeClass]--;
+
+    return obj;
+}
+
+static void SlabFree(void* obj, unsigned sizeClass) {
+    InterruptDisabler disableInterrupts;
+
+    CPU* cpu = GetCPULocal();
+    if (__builtin_expect(cpu->slabCacheCounts[sizeClass] >= CPU_SLAB_CACHE_SIZE, 0)) {
+        DrainSlabCache(cpu, sizeClass);
+    }
+
+    *reinterpret_cast<void**>(obj) = cpu->slabCaches[sizeClass];
+    cpu->slabCaches[sizeClass] = obj;
+    cpu->slabCacheCounts[sizeClass]++;
+}
+
+static void* HeapAllocate(size_t size) {
+    if (int sizeClass = SizeClass(size); sizeClass >= 0) {
+        return SlabAllocate(sizeClass);
+    }
+
+    return Allocator().allocate(size);
+}
+
+static void HeapFree(void* p) {
+    if (int sizeClass = ObjectClass(p); sizeClass >= 0) {
+        SlabFree(p, sizeClass);
+        return;
+    }
+
+    Allocator().free(p);
+}
+
+#ifdef KERNEL_HEAP_PROFILE
+
+// Every allocation is preceded by a header recording its size and the site (call stack) it was allocated from.
+// Sites are kept in a fixed size open addressed table so recording an allocation never allocates.
+// The sites can be read as text from /dev/kheapprof, sorted by the amount of bytes still allocated.
+
+#define KMALLOC_PROFILE_MAGIC 0x6b686561U
+#define KMALLOC_PROFILE_SITES 1024 // Must be a power of two
+#define KMALLOC_PROFILE_DEPTH 8
+
+struct AllocationHeader {
+    uint32_t magic;
+    uint32_t site;
+    uint64_t size;
+};
+static_assert(sizeof(AllocationHeader) == 16); // Keep 16 byte alignment
+
+struct AllocationSite {
+    uintptr_t trace[KMALLOC_PROFILE_DEPTH];
+    unsigned depth;
+
+    uint64_t allocations;
+    uint64_t frees;
+    uint64_t totalBytes;
+    uint64_t liveBytes;
+
+    uint64_t lastAllocations; // Allocations when the profile was last read, for the allocation rate
+};
+
+// Interrupts must be disabled whilst held as allocations are made from IRQs
+static lock_t profileLock = 0;
+static AllocationSite profileSites[KMALLOC_PROFILE_SITES];
+static unsigned profileSiteCount = 0;
+// Allocations made once the table is full
+static AllocationSite profileOverflow;
+static uint64_t profileLastRead = 0; // Microseconds since boot
+
+// Find or create the site for trace, profileLock must be held
+static uint32_t FindAllocationSite(const uintptr_t* trace, unsigned depth) {
+    uint64_t hash = depth;
+    for (unsigned i = 0; i < depth; i++) {
+        hash = (hash ^ trace[i]) * 0x100000001b3ULL;
+    }
+
+    for (unsigned i = 0; i < KMALLOC_PROFILE_SITES; i++) {
+        uint32_t index = (hash + i) & (KMALLOC_PROFILE_SITES - 1);
+        AllocationSite& site = profileSites[index];
+
+        if (!site.depth) {
+            // Free entry, the site is not in the table
+            if (profileSiteCount >= KMALLOC_PROFILE_SITES / 2) {
+                break; // Keep probes short
+            }
+
+            memcpy(site.trace, trace, depth * sizeof(uintptr_t));
+            site.depth = depth;
+            profileSiteCount++;
+            return index;
+        }
+
+        if (site.depth == depth && !memcmp(site.trace, trace, depth * sizeof(uintptr_t))) {
+            return index;
+        }
+    }
+
+    return KMALLOC_PROFILE_SITES;
+}
+
+static ALWAYS_INLINE AllocationSite& GetAllocationSite(uint32_t index) {
+    return index < KMALLOC_PROFILE_SITES ? profileSites[index] : profileOverflow;
+}
+
+void* kmalloc(size_t size) {
+    uintptr_t trace[KMALLOC_PROFILE_DEPTH];
+    unsigned depth = GetStackTrace(reinterpret_cast<uint64_t>(__builtin_frame_address(0)), trace, KMALLOC_PROFILE_DEPTH);
+    if (!depth) {
+        trace[0] = reinterpret_cast<uintptr_t>(__builtin_return_address(0));
+        depth = 1;
+    }
+
+    AllocationHeader* header = reinterpret_cast<AllocationHeader*>(HeapAllocate(size + sizeof(AllocationHeader)));
+    if (!header) {
+        return nullptr;
+    }
+
+    uint32_t index;
+    {
+        InterruptDisabler disableInterrupts;
+        ScopedSpinLock lockProfile(profileLock);
+
+        index = FindAllocationSite(trace, depth);
+
+        AllocationSite& site = GetAllocationSite(index);
+        site.allocations++;
+        site.totalBytes += size;
+        site.liveBytes += size;
+    }
+
+    header->magic = KMALLOC_PROFILE_MAGIC;
+    header->site = index;
+    header->size = size;
+    return header + 1;
+}
+
+void kfree(void* p) {
+    if (!p) {
+        return;
+    }
+
+    AllocationHeader* header = reinterpret_cast<AllocationHeader*>(p) - 1;
+    assert(header->magic == KMALLOC_PROFILE_MAGIC);
+
+    {
+        InterruptDisabler disableInterrupts;
+        ScopedSpinLock lockProfile(profileLock);
+
+        AllocationSite& site = GetAllocationSite(header->site);
+        site.frees++;
+        site.liveBytes -= header->size;
+    }
+
+    header->magic = 0;
+    HeapFree(header);
+}
+
+void* krealloc(void* p, size_t sz) {
+    if (!p) {
+        return kmalloc(sz);
+    }
+
+    size_t oldSize = (reinterpret_cast<AllocationHeader*>(p) - 1)->size;
+    if (sz <= oldSize) {
+        return p; // Still fits
+    }
+
+    // Attribute the new allocation to the caller of krealloc
+    void* newObject = kmalloc(sz);
+    memcpy(newObject, p, oldSize);
+    kfree(p);
+
+    return newObject;
+}
+
+// Text buffer for the profile, allocated with kmalloc so it must not be used with profileLock held
+class ProfileText {
+public:
+    ~ProfileText() { kfree(m_buffer); }
+
+    void Append(const char* str) {
+        size_t len = strlen(str);
+        if (m_length + len > m_capacity) {
+            m_capacity = (m_length + len) * 2 + 4096;
+            m_buffer = reinterpret_cast<char*>(krealloc(m_buffer, m_capacity));
+        }
+
+        memcpy(m_buffer + m_length, str, len);
+        m_length += len;
+    }
+
+    void Append(uint64_t num, int base = 10) {
+        char str[24];
+        Append(itoa(num, str, base));
+    }
+
+    ALWAYS_INLINE const char* Data() const { return m_buffer; }
+    ALWAYS_INLINE size_t Length() const { return m_length; }
+
+private:
+    char* m_buffer = nullptr;
+    size_t m_length = 0;
+    size_t m_capacity = 0;
+};
+
+static void WriteAllocationSite(ProfileText& text, const AllocationSite& site, uint64_t elapsed) {
+    text.Append("live ");
+    text.Append(site.liveBytes);
+    text.Append(" bytes (");
+    text.Append(site.allocations - site.frees);
+    text.Append(" objects), total ");
+    text.Append(site.totalBytes);
+    text.Append(" bytes, ");
+    text.Append(site.allocations);
+    text.Append(" allocations, ");
+    text.Append(site.frees);
+    text.Append(" frees, ");
+    text.Append(elapsed ? (site.allocations - site.lastAllocations) * 1000000 / elapsed : 0);
+    text.Append(" allocations/s\n");
+
+    for (unsigned i = 0; i < site.depth; i++) {
+        text.Append("    0x");
+        text.Append(site.trace[i], 16);
+
+        KernelSymbol* sym;
+        if (ResolveKernelSymbol(site.trace[i], sym)) {
+            text.Append(" ");
+            text.Append(sym->mangledName);
+            text.Append("+0x");
+            text.Append(site.trace[i] - sym->address, 16);
+        }
+        text.Append("\n");
+    }
+}
+
+// Reads give a snapshot of the allocation sites taken when the device is read from the start.
+// Allocation rates are averaged over the time since the last snapshot.
+class HeapProfileDevice final : public Device {
+public:
+    HeapProfileDevice() : Device("kheapprof", DeviceTypeUNIXPseudo) {
+        flags = FS_NODE_FILE;
+
+        SetDeviceName("Kernel Heap Profile");
+    }
+
+    ssize_t Read(size_t offset, size_t size, uint8_t* buffer) override {
+        ScopedSpinLock lockSnapshot(m_snapshotLock);
+        if (!offset || !m_snapshot) {
+            TakeSnapshot();
+        }
+
+        if (offset >= m_snapshot->Length()) {
+            return 0;
+        }
+
+        size = MIN(size, m_snapshot->Length() - offset);
+        memcpy(buffer, m_snapshot->Data() + offset, size);
+        return size;
+    }
+
+    ssize_t Write(size_t, size_t, uint8_t*) override { return -EROFS; }
+
+private:
+    void TakeSnapshot() {
+        AllocationSite* sites = new AllocationSite[KMALLOC_PROFILE_SITES + 1];
+        unsigned count = 0;
+        uint64_t elapsed;
+
+        {
+            InterruptDisabler disableInterrupts;
+            ScopedSpinLock lockProfile(profileLock);
+
+            for (AllocationSite& site : profileSites) {
+                if (site.depth) {
+                    sites[count++] = site;
+                    site.lastAllocations = site.allocations;
+                }
+            }
+
+            if (profileOverflow.allocations) {
+                sites[count++] = profileOverflow;
+                profileOverflow.lastAllocations = profileOverflow.allocations;
+            }
+
+            uint64_t now = Timer::UsecondsSinceBoot();
+            elapsed = now - profileLastRead;
+            profileLastRead = now;
+        }
+
+        // Largest live bytes first
+        for (unsigned i = 1; i < count; i++) {
+            AllocationSite site = sites[i];
+
+            unsigned j = i;
+            for (; j > 0 && sites[j - 1].liveBytes < site.liveBytes; j--) {
+                sites[j] = sites[j - 1];
+            }
+            sites[j] = site;
+        }
+
+        uint64_t liveBytes = 0;
+        for (unsigned i = 0; i < count; i++) {
+            liveBytes += sites[i].liveBytes;
+        }
+
+        delete m_snapshot;
+        m_snapshot = new ProfileText();
+
+        m_snapshot->Append(count);
+        m_snapshot->Append(" allocation sites, ");
+        m_snapshot->Append(liveBytes);
+        m_snapshot->Append(" live bytes\n\n");
+
+        for (unsigned i = 0; i < count; i++) {
+            WriteAllocationSite(*m_snapshot, sites[i], elapsed);
+        }
+
+        delete[] sites;
+    }
+
+    lock_t m_snapshotLock = 0;
+    ProfileText* m_snapshot = nullptr;
+};
+
+void InitializeHeapProfiler() {
+    profileLastRead = Timer::UsecondsSinceBoot();
+
+    new HeapProfileDevice();
+}
+
+#else
+
+void* kmalloc(size_t size) { return HeapAllocate(size); }
+
+void kfree(void* p) {
+    if (!p) {
+        return;
+    }
+
+    HeapFree(p);
+}
+
+void* krealloc(void* p, size_t sz) {
+    int sizeClass = p ? ObjectClass(p) : -1;
+    if (sizeClass < 0) {
+        return Allocator().reallocate(p, sz);
+    }
+
+    size_t oldSize = ClassSize(sizeClass);
+    if (sz <= oldSize) {
+        return p; // Still fits
+    }
+
+    void* newObject = kmalloc(sz);
+    memcpy(newObject, p, oldSize);
+    SlabFree(p, sizeClass);
+
+    return newObject;
+}
 
-void kfree(void* p) { return Allocator().free(p); }
+void InitializeHeapProfiler() {}
 
-void* krealloc(void* p, size_t sz) { return Allocator().reallocate(p, sz); }
+#endif
 
 void frg_panic(const char* s) { Log::Error(s); }
@@ -0,0 +1,182 @@
+#include <MM/Reclaim.h>
+
+#include <Debug.h>
+#include <HAL.h>
+#include <Lock.h>
+#include <Logging.h>
+#include <MM/Swap.h>
+#include <PhysicalAllocator.h>
+#include <Scheduler.h>
+#include <Vector.h>
+
+namespace Memory {
+
+lock_t reclaimersLock = 0;
+Vector<Reclaimer*> reclaimers;
+unsigned reclaimHand = 0; // Reclaimer to start with next, so one cache is not always emptied before the others
+
+Semaphore reclaimSemaphore = Semaphore(0); // Signalled when free memory drops below the low watermark
+bool reclaimThreadRunning = false;
+bool reclaimPending = false;
+Thread* reclaimThread = nullptr;
+
+lock_t reclaimWaitLock = 0;
+Semaphore reclaimWaiters = Semaphore(0); // Allocations waiting for the current pass to finish
+unsigned reclaimWaiting = 0;             // reclaimWaitLock must be held
+bool reclaimPassFreed = false;           // Whether the last pass freed anything, reclaimWaitLock must be held
+
+uint64_t usableBlocks = 0; // Blocks of usable memory reported by the bootloader
+uint64_t lowWatermark = 0;
+uint64_t highWatermark = 0;
+
+ReclaimStatistics reclaimStatistics;
+
+// maxPhysicalBlocks is only the limit of the allocator, usedPhysicalBlocks counts from the usable memory
+static ALWAYS_INLINE uint64_t FreeBlocks() {
+    uint64_t used = __atomic_load_n(&usedPhysicalBlocks, __ATOMIC_RELAXED);
+    return (used < usableBlocks) ? (usableBlocks - used) : 0;
+}
+
+void RegisterReclaimer(Reclaimer* reclaimer) {
+    ScopedSpinLock lockReclaimers(reclaimersLock);
+
+    reclaimers.add_back(reclaimer);
+}
+
+void UnregisterReclaimer(Reclaimer* reclaimer) {
+    ScopedSpinLock lockReclaimers(reclaimersLock);
+
+    reclaimers.remove(reclaimer);
+}
+
+size_t ReclaimMemory(size_t bytes, bool direct) {
+    // The caller may be registering a reclaimer
+    if (acquireTestLock(&reclaimersLock)) {
+        return 0;
+    }
+
+    size_t freed = 0;
+    size_t count = reclaimers.size();
+    for (unsigned i = 0; i < count && freed < bytes; i++) {
+        freed += reclaimers[(reclaimHand + i) % count]->Reclaim(bytes - freed);
+    }
+    reclaimHand++;
+
+    releaseLock(&reclaimersLock);
+
+    if (direct) {
+        __atomic_add_fetch(&reclaimStatistics.directReclaims, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&reclaimStatistics.bytesReclaimed, freed, __ATOMIC_RELAXED);
+    return freed;
+}
+
+void CheckMemoryPressure() {
+    if (__builtin_expect(FreeBlocks() >= lowWatermark, 1) || !reclaimThreadRunning) {
+        return;
+    }
+
+    // Only wake the reclaim thread once per pass
+    if (!__atomic_exchange_n(&reclaimPending, true, __ATOMIC_ACQ_REL)) {
+        __atomic_add_fetch(&reclaimStatistics.wakeups, 1, __ATOMIC_RELAXED);
+        reclaimSemaphore.Signal();
+    }
+}
+
+bool IsMemoryLow() { return FreeBlocks() < lowWatermark; }
+
+bool WaitForReclaim() {
+    // The reclaim thread would be waiting on itself
+    if (!reclaimThreadRunning || Thread::Current() == reclaimThread) {
+        return false;
+    }
+
+    {
+        ScopedSpinLock<true> lockWait(reclaimWaitLock);
+        reclaimWaiting++;
+    }
+
+    if (!__atomic_exchange_n(&reclaimPending, true, __ATOMIC_ACQ_REL)) {
+        reclaimSemaphore.Signal();
+    }
+
+    asm volatile("sti");
+    bool interrupted = reclaimWaiters.Wait();
+    asm volatile("cli");
+
+    ScopedSpinLock<true> lockWait(reclaimWaitLock);
+    if (interrupted) {
+        if (reclaimWaiting) {
+            reclaimWaiting--; // Not woken by the pass
+        }
+        return false;
+    }
+
+    // Another pass is unlikely to do better when this one freed nothing
+    return reclaimPassFreed;
+}
+
+void ReclaimThread() {
+    reclaimThread = Thread::Current();
+
+    for (;;) {
+        if (reclaimSemaphore.Wait()) {
+            continue; // Interrupted
+        }
+
+        size_t freed = 0;
+        while (FreeBlocks() < highWatermark) {
+            size_t reclaimed = ReclaimMemory(RECLAIM_BATCH_SIZE);
+            if (!reclaimed) {
+                // The caches have nothing left, swap out memory that has not been used recently
+                reclaimed = SwapOut(RECLAIM_BATCH_SIZE);
+            }
+
+            if (!reclaimed) {
+                break; // Nothing left to reclaim
+            }
+
+            freed += reclaimed;
+        }
+
+        Log::Debug(debugLevelUsermodeMM, DebugLevelNormal, "[Reclaim] Reclaimed %lu KB, %lu KB free", freed / 1024,
+                   (FreeBlocks() * PHYSALLOC_BLOCK_SIZE) / 1024);
+
+        __atomic_store_n(&reclaimPending, false, __ATOMIC_RELEASE);
+
+        // Let allocations waiting on the pass try again
+        unsigned waiting;
+        {
+            ScopedSpinLock<true> lockWait(reclaimWaitLock);
+            reclaimPassFreed = freed > 0;
+            waiting = reclaimWaiting;
+            reclaimWaiting = 0;
+        }
+
+        while (waiting--) {
+            reclaimWaiters.Signal();
+        }
+    }
+}
+
+void InitializeReclaimer() {
+    usableBlocks = HAL::mem_info.totalMemory / PHYSALLOC_BLOCK_SIZE;
+    if (usableBlocks > maxPhysicalBlocks) {
+        usableBlocks = maxPhysicalBlocks;
+    }
+
+    lowWatermark = usableBlocks / RECLAIM_LOW_WATERMARK_DIVISOR;
+    if (lowWatermark < RECLAIM_LOW_WATERMARK_MIN) {
+        lowWatermark = RECLAIM_LOW_WATERMARK_MIN;
+    }
+    highWatermark = lowWatermark * 2;
+
+    auto proc = Process::CreateKernelProcess((void*)ReclaimThread, "Reclaim", nullptr);
+    proc->Start();
+
+    reclaimThreadRunning = true;
+}
+
+const ReclaimStatistics& GetReclaimStatistics() { return reclaimStatistics; }
+
+} // namespace Memory
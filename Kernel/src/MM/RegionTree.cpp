@@ -0,0 +1,304 @@
+#include <MM/RegionTree.h>
+
+#include <Assert.h>
+
+MappedRegion* RegionTree::find(uintptr_t address) {
+    Node* node = m_root;
+    Node* candidate = nullptr; // Last region starting at or below address
+    while (node) {
+        if (address < node->region.Base()) {
+            node = node->left;
+        } else {
+            candidate = node;
+            node = node->right;
+        }
+    }
+
+    if (candidate && address < candidate->region.End()) {
+        return &candidate->region;
+    }
+
+    return nullptr;
+}
+
+MappedRegion* RegionTree::lower_bound(uintptr_t address) {
+    // Regions do not overlap so they are ordered by end as well as base
+    Node* node = m_root;
+    Node* result = nullptr;
+    while (node) {
+        if (node->region.End() > address) {
+            result = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+
+    return result ? &result->region : nullptr;
+}
+
+MappedRegion* RegionTree::insert(MappedRegion&& region) {
+    Node* parent = nullptr;
+    Node** link = &m_root;
+    while (*link) {
+        parent = *link;
+        if (region.Base() < parent->region.Base()) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+        }
+    }
+
+    Node* node = new Node(std::move(region));
+    node->parent = parent;
+    *link = node;
+    m_count++;
+
+    Node* prev = PrevNode(node);
+    Node* next = NextNode(node);
+    assert(!prev || prev->region.End() <= node->region.Base());
+    assert(!next || node->region.End() <= next->region.Base());
+
+    node->gap = node->region.Base() - (prev ? prev->region.End() : 0);
+    Retrace(node);
+
+    if (next) {
+        next->gap = next->region.Base() - node->region.End();
+        Retrace(next);
+    }
+
+    return &node->region;
+}
+
+void RegionTree::remove(MappedRegion* region) {
+    Node* node = NodeOf(region);
+    Node* prev = PrevNode(node);
+    Node* next = NextNode(node);
+
+    Node* retraceFrom;
+    if (!node->left || !node->right) {
+        retraceFrom = node->parent;
+        Replace(node->parent, node, node->left ? node->left : node->right);
+    } else {
+        // Move the successor (the leftmost node of our right subtree) into our place,
+        // nodes are moved rather than their regions so pointers to other regions stay valid
+        Node* successor = next;
+        if (successor->parent != node) {
+            retraceFrom = successor->parent;
+            Replace(successor->parent, successor, successor->right);
+
+            successor->right = node->right;
+            successor->right->parent = successor;
+        } else {
+            retraceFrom = successor;
+        }
+
+        Replace(node->parent, node, successor);
+        successor->left = node->left;
+        successor->left->parent = successor;
+    }
+
+    Retrace(retraceFrom);
+
+    if (next) {
+        next->gap = next->region.Base() - (prev ? prev->region.End() : 0);
+        Retrace(next);
+    }
+
+    m_count--;
+    delete node;
+}
+
+uintptr_t RegionTree::find_gap(size_t size, uintptr_t alignment, uintptr_t start, uintptr_t end) const {
+    if (uintptr_t base = SearchGap(m_root, size, alignment, start)) {
+        return base;
+    }
+
+    // Try the space after the last region
+    Node* last = LastNode(m_root);
+    uintptr_t base = last ? last->region.End() : 0;
+    if (base < start) {
+        base = start;
+    }
+    base = (base + alignment - 1) & ~(alignment - 1);
+
+    if (base + size <= end && base + size > base) {
+        return base;
+    }
+
+    return 0;
+}
+
+void RegionTree::clear() {
+    Node* node = m_root;
+    while (node) {
+        // Destroy children before their parents
+        if (node->left) {
+            node = node->left;
+        } else if (node->right) {
+            node = node->right;
+        } else {
+            Node* parent = node->parent;
+            if (parent) {
+                if (parent->left == node) {
+                    parent->left = nullptr;
+                } else {
+                    parent->right = nullptr;
+                }
+            }
+
+            delete node;
+            node = parent;
+        }
+    }
+
+    m_root = nullptr;
+    m_count = 0;
+}
+
+RegionTree::Node* RegionTree::FirstNode(Node* node) {
+    while (node && node->left) {
+        node = node->left;
+    }
+
+    return node;
+}
+
+RegionTree::Node* RegionTree::LastNode(Node* node) {
+    while (node && node->right) {
+        node = node->right;
+    }
+
+    return node;
+}
+
+RegionTree::Node* RegionTree::NextNode(Node* node) {
+    if (node->right) {
+        return FirstNode(node->right);
+    }
+
+    while (node->parent && node->parent->right == node) {
+        node = node->parent;
+    }
+
+    return node->parent;
+}
+
+RegionTree::Node* RegionTree::PrevNode(Node* node) {
+    if (node->left) {
+        return LastNode(node->left);
+    }
+
+    while (node->parent && node->parent->left == node) {
+        node = node->parent;
+    }
+
+    return node->parent;
+}
+
+uintptr_t RegionTree::SearchGap(const Node* node, size_t size, uintptr_t alignment, uintptr_t start) {
+    if (!node || node->maxGap < size) {
+        return 0; // No gap in this subtree is large enough
+    }
+
+    // Take the lowest gap that fits
+    if (uintptr_t base = SearchGap(node->left, size, alignment, start)) {
+        return base;
+    }
+
+    uintptr_t base = node->region.Base() - node->gap;
+    if (base < start) {
+        base = start;
+    }
+    base = (base + alignment - 1) & ~(alignment - 1);
+
+    if (base + size <= node->region.Base()) {
+        return base;
+    }
+
+    return SearchGap(node->right, size, alignment, start);
+}
+
+void RegionTree::Update(Node* node) {
+    int leftHeight = Height(node->left);
+    int rightHeight = Height(node->right);
+    node->height = 1 + ((leftHeight > rightHeight) ? leftHeight : rightHeight);
+
+    node->maxGap = node->gap;
+    if (MaxGap(node->left) > node->maxGap) {
+        node->maxGap = MaxGap(node->left);
+    }
+    if (MaxGap(node->right) > node->maxGap) {
+        node->maxGap = MaxGap(node->right);
+    }
+}
+
+void RegionTree::Replace(Node* parent, Node* old, Node* node) {
+    if (!parent) {
+        m_root = node;
+    } else if (parent->left == old) {
+        parent->left = node;
+    } else {
+        parent->right = node;
+    }
+
+    if (node) {
+        node->parent = parent;
+    }
+}
+
+RegionTree::Node* RegionTree::RotateLeft(Node* node) {
+    Node* pivot = node->right;
+
+    node->right = pivot->left;
+    if (pivot->left) {
+        pivot->left->parent = node;
+    }
+
+    Replace(node->parent, node, pivot);
+    pivot->left = node;
+    node->parent = pivot;
+
+    Update(node);
+    Update(pivot);
+    return pivot;
+}
+
+RegionTree::Node* RegionTree::RotateRight(Node* node) {
+    Node* pivot = node->left;
+
+    node->left = pivot->right;
+    if (pivot->right) {
+        pivot->right->parent = node;
+    }
+
+    Replace(node->parent, node, pivot);
+    pivot->right = node;
+    node->parent = pivot;
+
+    Update(node);
+    Update(pivot);
+    return pivot;
+}
+
+// Rebalance and update the gaps of node and all of its ancestors
+void RegionTree::Retrace(Node* node) {
+    while (node) {
+        Update(node);
+
+        int balance = Height(node->left) - Height(node->right);
+        if (balance > 1) {
+            if (Height(node->left->left) < Height(node->left->right)) {
+                RotateLeft(node->left);
+            }
+            node = RotateRight(node);
+        } else if (balance < -1) {
+            if (Height(node->right->right) < Height(node->right->left)) {
+                RotateRight(node->right);
+            }
+            node = RotateLeft(node);
+        }
+
+        node = node->parent;
+    }
+}
@@ -0,0 +1,620 @@
+#include <MM/Swap.h>
+
+#include <Assert.h>
+#include <CString.h>
+#include <Device.h>
+#include <Errno.h>
+#include <HAL.h>
+#include <LZ4.h>
+#include <Lock.h>
+#include <Logging.h>
+#include <Math.h>
+#include <Objects/Process.h>
+#include <Paging.h>
+#include <PhysicalAllocator.h>
+#include <SMP.h>
+#include <Scheduler.h>
+#include <Spinlock.h>
+
+// Swapped out pages are kept in slots, referenced by the blocks of PhysicalVMObjects (see SWAP_ENTRY_BIT).
+// A slot is shared when an object is forked, each object reads the page back into a block of its own.
+//
+// Pages are compressed into the pool, physical pages filled one after the other and freed once nothing
+// in them is used. Zero filled pages take no space at all. When the pool fills up the swap thread writes
+// the oldest pages out to the swap partition, as the pool is filled in order this frees the oldest pool pages.
+
+#define SWAP_SLOT_CHUNK_SHIFT 12
+#define SWAP_SLOT_CHUNK_SIZE (1U << SWAP_SLOT_CHUNK_SHIFT)
+#define SWAP_NO_SLOT 0 // Slot 0 is never used and ends the lists
+
+#define SWAP_NO_POOL_PAGE 0xFFFFFFFFU
+
+// Written by mkswap at the end of page 0 of a swap partition
+#define SWAP_SIGNATURE "SWAPSPACE2"
+#define SWAP_SIGNATURE_LENGTH 10
+
+namespace Memory {
+
+enum SwapSlotState : uint8_t {
+    SwapSlotFree,
+    SwapSlotZero, // Zero filled, nothing is stored
+    SwapSlotPool, // Compressed in the pool
+    SwapSlotDisk, // Written to the swap partition
+};
+
+struct SwapSlot {
+    uint32_t refCount;
+    SwapSlotState state;
+    bool writingBack; // Being written out by the swap thread, the pool copy stays until it is done
+    uint16_t size;    // Compressed size
+    uint16_t offset;  // Offset into the pool page
+    uint32_t location; // Pool page, page of the swap partition or the next free slot
+    uint32_t older;    // Pool FIFO, pages written to the pool before and after this one
+    uint32_t newer;
+};
+
+struct SwapPoolPage {
+    uint32_t block; // Physical block, 0 if unused
+    uint16_t used;  // Data is only appended to the page
+    uint16_t live;  // Data still used by slots, the page is freed when there is none
+};
+
+static lock_t swapLock = 0; // Protects everything below, taken with interrupts disabled
+
+static SwapSlot* slotChunks[SWAP_MAX_SLOTS / SWAP_SLOT_CHUNK_SIZE];
+static uint32_t nextUnusedSlot = 1;
+static uint32_t freeSlots = SWAP_NO_SLOT;
+static uint32_t oldestPoolSlot = SWAP_NO_SLOT; // Slots in the pool, not including those being written out
+static uint32_t newestPoolSlot = SWAP_NO_SLOT;
+
+static SwapPoolPage* poolPages = nullptr;
+static uint32_t poolCapacity = 0; // Most pages the pool can use
+static uint32_t poolCurrent = SWAP_NO_POOL_PAGE; // Page being filled
+static uint32_t poolFreeHint = 0;
+
+bool swapPartitionsEnabled = false;
+
+static PartitionDevice* swapPartition = nullptr;
+static uint64_t* diskBitmap = nullptr;
+static uint32_t diskPageCount = 0;
+static uint32_t diskHint = 1;
+
+// Kernel mappings of a pool page and of the page being read back
+static uint8_t* poolWindow = nullptr;
+static uint8_t* pageWindow = nullptr;
+
+// Space for SwapStore to compress a page in without holding swapLock,
+// one per CPU as it is used with interrupts disabled
+struct SwapScratch {
+    uint8_t* window; // Kernel mapping of the page being stored, then of the pool page it is copied to
+    uint8_t compressed[LZ4::CompressBound(PAGE_SIZE_4K)];
+    LZ4::Workspace workspace;
+};
+static SwapScratch* scratch = nullptr;
+
+static Semaphore writebackSemaphore = Semaphore(0);
+static bool writebackPending = false;
+
+static pid_t swapHand = 0; // Process to swap out from next
+
+static SwapStatistics swapStatistics;
+
+static ALWAYS_INLINE SwapSlot& Slot(uint32_t index) {
+    return slotChunks[index >> SWAP_SLOT_CHUNK_SHIFT][index & (SWAP_SLOT_CHUNK_SIZE - 1)];
+}
+
+// Allocate the chunk for the next unused slot if it is needed,
+// only SwapStore takes unused slots so this is done without the lock
+static bool ReserveSlot() {
+    if (__atomic_load_n(&freeSlots, __ATOMIC_ACQUIRE) != SWAP_NO_SLOT) {
+        return true;
+    }
+
+    if (nextUnusedSlot >= SWAP_MAX_SLOTS) {
+        return false;
+    }
+
+    SwapSlot*& chunk = slotChunks[nextUnusedSlot >> SWAP_SLOT_CHUNK_SHIFT];
+    if (!chunk) {
+        SwapSlot* newChunk = new SwapSlot[SWAP_SLOT_CHUNK_SIZE];
+        memset(newChunk, 0, sizeof(SwapSlot) * SWAP_SLOT_CHUNK_SIZE);
+
+        __atomic_store_n(&chunk, newChunk, __ATOMIC_RELEASE);
+    }
+
+    return true;
+}
+
+// swapLock must be held, ReserveSlot must have succeeded
+static uint32_t AllocateSlot() {
+    uint32_t index = freeSlots;
+    if (index != SWAP_NO_SLOT) {
+        freeSlots = Slot(index).location;
+    } else {
+        index = nextUnusedSlot++;
+    }
+
+    SwapSlot& slot = Slot(index);
+    slot = {};
+    slot.refCount = 1;
+    return index;
+}
+
+// swapLock must be held
+static void FreeSlot(uint32_t index) {
+    SwapSlot& slot = Slot(index);
+    slot.state = SwapSlotFree;
+    slot.location = freeSlots;
+
+    freeSlots = index;
+}
+
+// Add to the newest end of the pool FIFO, swapLock must be held
+static void LinkPoolSlot(uint32_t index) {
+    SwapSlot& slot = Slot(index);
+    slot.older = newestPoolSlot;
+    slot.newer = SWAP_NO_SLOT;
+
+    if (newestPoolSlot != SWAP_NO_SLOT) {
+        Slot(newestPoolSlot).newer = index;
+    } else {
+        oldestPoolSlot = index;
+    }
+    newestPoolSlot = index;
+}
+
+// swapLock must be held
+static void UnlinkPoolSlot(uint32_t index) {
+    SwapSlot& slot = Slot(index);
+    if (slot.older != SWAP_NO_SLOT) {
+        Slot(slot.older).newer = slot.newer;
+    } else {
+        oldestPoolSlot = slot.newer;
+    }
+
+    if (slot.newer != SWAP_NO_SLOT) {
+        Slot(slot.newer).older = slot.older;
+    } else {
+        newestPoolSlot = slot.older;
+    }
+}
+
+// Map a pool page into poolWindow, swapLock must be held
+static ALWAYS_INLINE uint8_t* MapPoolPage(uint32_t page) {
+    KernelMapVirtualMemory4K(static_cast<uintptr_t>(poolPages[page].block) << PAGE_SHIFT_4K,
+                             reinterpret_cast<uintptr_t>(poolWindow), 1);
+    return poolWindow;
+}
+
+// Find room for size bytes in the pool, if no page can be allocated victim is used as a pool page.
+// swapLock must be held.
+static bool PoolAllocate(uint16_t size, uintptr_t victim, uint32_t& page, uint16_t& offset, bool& usedVictim) {
+    usedVictim = false;
+    if (poolCurrent != SWAP_NO_POOL_PAGE && poolPages[poolCurrent].used + size <= PAGE_SIZE_4K) {
+        page = poolCurrent;
+    } else {
+        // The current page is full, it is freed once everything in it has gone
+        if (poolCurrent != SWAP_NO_POOL_PAGE && !poolPages[poolCurrent].live) {
+            FreePhysicalMemoryBlock(static_cast<uintptr_t>(poolPages[poolCurrent].block) << PAGE_SHIFT_4K);
+            AccountMemory(MemoryUsageSwapPool, -static_cast<int64_t>(PAGE_SIZE_4K));
+            poolPages[poolCurrent].block = 0;
+            poolFreeHint = MIN(poolFreeHint, poolCurrent);
+            swapStatistics.poolPages--;
+        }
+        poolCurrent = SWAP_NO_POOL_PAGE;
+
+        if (swapStatistics.poolPages >= poolCapacity) {
+            return false;
+        }
+
+        while (poolPages[poolFreeHint].block) {
+            poolFreeHint++;
+        }
+        page = poolFreeHint;
+
+        uintptr_t phys = AllocatePhysicalMemoryBlocks(0);
+        if (!phys) {
+            phys = victim; // Out of memory, the page has already been compressed so keep it for the pool
+            usedVictim = true;
+        }
+
+        poolPages[page] = {static_cast<uint32_t>(phys >> PAGE_SHIFT_4K), 0, 0};
+        poolCurrent = page;
+        AccountMemory(MemoryUsageSwapPool, PAGE_SIZE_4K);
+        swapStatistics.poolPages++;
+    }
+
+    SwapPoolPage& poolPage = poolPages[page];
+    offset = poolPage.used;
+    poolPage.used += size;
+    poolPage.live += size;
+    return true;
+}
+
+// swapLock must be held
+static void PoolFree(uint32_t page, uint16_t size) {
+    SwapPoolPage& poolPage = poolPages[page];
+    assert(poolPage.live >= size);
+
+    poolPage.live -= size;
+    swapStatistics.compressedBytes -= size;
+    if (poolPage.live || page == poolCurrent) {
+        return;
+    }
+
+    FreePhysicalMemoryBlock(static_cast<uintptr_t>(poolPage.block) << PAGE_SHIFT_4K);
+    AccountMemory(MemoryUsageSwapPool, -static_cast<int64_t>(PAGE_SIZE_4K));
+    poolPage.block = 0;
+    poolFreeHint = MIN(poolFreeHint, page);
+    swapStatistics.poolPages--;
+}
+
+// swapLock must be held, returns 0 if the partition is full
+static uint32_t AllocateDiskPage() {
+    for (uint32_t i = 0; i < diskPageCount; i++) {
+        uint32_t page = diskHint + i;
+        if (page >= diskPageCount) {
+            page -= diskPageCount - 1; // Page 0 is never used
+        }
+
+        if (!(diskBitmap[page >> 6] & (1ULL << (page & 63)))) {
+            diskBitmap[page >> 6] |= (1ULL << (page & 63));
+            diskHint = page + 1;
+            return page;
+        }
+    }
+
+    return 0;
+}
+
+// swapLock must be held
+static void FreeDiskPage(uint32_t page) {
+    diskBitmap[page >> 6] &= ~(1ULL << (page & 63));
+    diskHint = MIN(diskHint, page);
+}
+
+static bool IsZeroPage(const uint8_t* page) {
+    const uint64_t* words = reinterpret_cast<const uint64_t*>(page);
+    for (unsigned i = 0; i < PAGE_SIZE_4K / sizeof(uint64_t); i++) {
+        if (words[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Whether the pool is full enough to start writing it out, swapLock must be held
+static ALWAYS_INLINE bool ShouldWriteBack() {
+    return swapPartition && oldestPoolSlot != SWAP_NO_SLOT && swapStatistics.poolPages >= poolCapacity / 2;
+}
+
+uint32_t SwapStore(uintptr_t phys) {
+    if (!poolCapacity || !ReserveSlot()) {
+        return 0;
+    }
+
+    InterruptDisabler disableInterrupts;
+    SwapScratch& cpuScratch = scratch[GetCPULocal()->id];
+
+    // Compress before taking the lock, only finding room in the pool and the slot are done with it held
+    KernelMapVirtualMemory4K(phys, reinterpret_cast<uintptr_t>(cpuScratch.window), 1);
+    size_t size = 0;
+    if (!IsZeroPage(cpuScratch.window)) {
+        size = LZ4::Compress(cpuScratch.window, PAGE_SIZE_4K, cpuScratch.compressed, SWAP_MAX_COMPRESSED_SIZE,
+                             cpuScratch.workspace);
+        if (!size) {
+            __atomic_add_fetch(&swapStatistics.incompressible, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+    }
+
+    uint32_t page = SWAP_NO_POOL_PAGE;
+    uint16_t offset = 0;
+    if (size) {
+        uintptr_t poolPhys;
+        bool usedVictim;
+        {
+            ScopedSpinLock lockSwap(swapLock);
+            if (!PoolAllocate(size, phys, page, offset, usedVictim)) {
+                return 0; // Pool is full
+            }
+            poolPhys = static_cast<uintptr_t>(poolPages[page].block) << PAGE_SHIFT_4K;
+        }
+
+        // The space is ours, nothing can read it until the slot is created.
+        // When the page itself became the pool page it is still mapped in the window.
+        if (!usedVictim) {
+            KernelMapVirtualMemory4K(poolPhys, reinterpret_cast<uintptr_t>(cpuScratch.window), 1);
+        }
+        memcpy(cpuScratch.window + offset, cpuScratch.compressed, size);
+
+        if (!usedVictim) {
+            FreePhysicalMemoryBlock(phys);
+        }
+    } else {
+        FreePhysicalMemoryBlock(phys);
+    }
+
+    uint32_t index;
+    bool wakeWriteback = false;
+    {
+        ScopedSpinLock lockSwap(swapLock);
+
+        index = AllocateSlot();
+        SwapSlot& slot = Slot(index);
+        if (size) {
+            slot.state = SwapSlotPool;
+            slot.size = size;
+            slot.offset = offset;
+            slot.location = page;
+            LinkPoolSlot(index);
+
+            swapStatistics.compressedBytes += size;
+            if (ShouldWriteBack() && !writebackPending) {
+                writebackPending = wakeWriteback = true;
+            }
+        } else {
+            slot.state = SwapSlotZero;
+            swapStatistics.zeroPages++;
+        }
+
+        swapStatistics.swappedPages++;
+        swapStatistics.swapOuts++;
+    }
+
+    if (wakeWriteback) {
+        writebackSemaphore.Signal();
+    }
+
+    return SWAP_ENTRY_BIT | index;
+}
+
+int SwapIn(uint32_t entry, uintptr_t phys) {
+    uint32_t index = entry & ~SWAP_ENTRY_BIT;
+    uint32_t diskPage;
+    {
+        ScopedSpinLock<true> lockSwap(swapLock);
+        SwapSlot& slot = Slot(index);
+        assert(slot.refCount);
+
+        swapStatistics.swapIns++;
+        if (slot.state != SwapSlotDisk) {
+            KernelMapVirtualMemory4K(phys, reinterpret_cast<uintptr_t>(pageWindow), 1);
+            if (slot.state == SwapSlotZero) {
+                memset(pageWindow, 0, PAGE_SIZE_4K);
+                return 0;
+            }
+
+            assert(slot.state == SwapSlotPool);
+            if (LZ4::Decompress(MapPoolPage(slot.location) + slot.offset, slot.size, pageWindow, PAGE_SIZE_4K) !=
+                PAGE_SIZE_4K) {
+                Log::Error("[Swap] Slot %u is corrupted", index);
+                return -EIO;
+            }
+            return 0;
+        }
+
+        // Disk slots do not move whilst the caller holds its reference
+        diskPage = slot.location;
+    }
+
+    uint8_t* buffer = reinterpret_cast<uint8_t*>(KernelAllocate4KPages(1));
+    KernelMapVirtualMemory4K(phys, reinterpret_cast<uintptr_t>(buffer), 1);
+
+    int e = swapPartition->TransferUncached(DiskRequest::Read, static_cast<uint64_t>(diskPage) << PAGE_SHIFT_4K,
+                                            PAGE_SIZE_4K, buffer);
+    KernelFree4KPages(buffer, 1);
+
+    if (e) {
+        Log::Error("[Swap] Error %d reading page %u of the swap partition", e, diskPage);
+        return -EIO;
+    }
+    return 0;
+}
+
+void SwapDuplicate(uint32_t entry) {
+    ScopedSpinLock<true> lockSwap(swapLock);
+
+    SwapSlot& slot = Slot(entry & ~SWAP_ENTRY_BIT);
+    assert(slot.refCount);
+    slot.refCount++;
+}
+
+void SwapFree(uint32_t entry) {
+    uint32_t index = entry & ~SWAP_ENTRY_BIT;
+
+    ScopedSpinLock<true> lockSwap(swapLock);
+    SwapSlot& slot = Slot(index);
+    assert(slot.refCount);
+
+    if (--slot.refCount || slot.writingBack) {
+        return; // Still used, or the swap thread frees it once written out
+    }
+
+    switch (slot.state) {
+    case SwapSlotZero:
+        swapStatistics.zeroPages--;
+        break;
+    case SwapSlotPool:
+        UnlinkPoolSlot(index);
+        PoolFree(slot.location, slot.size);
+        break;
+    case SwapSlotDisk:
+        FreeDiskPage(slot.location);
+        swapStatistics.diskPages--;
+        break;
+    default:
+        assert(!"Freeing unused swap slot");
+    }
+
+    swapStatistics.swappedPages--;
+    FreeSlot(index);
+}
+
+bool SwapPoolFull() {
+    return __atomic_load_n(&swapStatistics.poolPages, __ATOMIC_RELAXED) >= poolCapacity &&
+           __atomic_load_n(&poolCurrent, __ATOMIC_RELAXED) == SWAP_NO_POOL_PAGE;
+}
+
+const SwapStatistics& GetSwapStatistics() { return swapStatistics; }
+
+// Write the oldest pages in the pool out to the swap partition
+static void SwapThread() {
+    uintptr_t bufferPhys = AllocatePhysicalMemoryBlock();
+    uint8_t* buffer = reinterpret_cast<uint8_t*>(KernelAllocate4KPages(1));
+    KernelMapVirtualMemory4K(bufferPhys, reinterpret_cast<uintptr_t>(buffer), 1);
+
+    for (;;) {
+        if (writebackSemaphore.Wait()) {
+            continue; // Interrupted
+        }
+
+        for (;;) {
+            uint32_t index;
+            uint32_t diskPage;
+            {
+                ScopedSpinLock<true> lockSwap(swapLock);
+                if (!ShouldWriteBack() || !(diskPage = AllocateDiskPage())) {
+                    writebackPending = false;
+                    break;
+                }
+
+                index = oldestPoolSlot;
+                SwapSlot& slot = Slot(index);
+                UnlinkPoolSlot(index);
+                slot.writingBack = true;
+
+                LZ4::Decompress(MapPoolPage(slot.location) + slot.offset, slot.size, buffer, PAGE_SIZE_4K);
+            }
+
+            int e = swapPartition->TransferUncached(DiskRequest::Write, static_cast<uint64_t>(diskPage) << PAGE_SHIFT_4K,
+                                                    PAGE_SIZE_4K, buffer);
+
+            ScopedSpinLock<true> lockSwap(swapLock);
+            SwapSlot& slot = Slot(index);
+            slot.writingBack = false;
+
+            if (e) {
+                Log::Error("[Swap] Error %d writing page %u of the swap partition", e, diskPage);
+                FreeDiskPage(diskPage);
+
+                if (slot.refCount) {
+                    LinkPoolSlot(index);
+                } else {
+                    PoolFree(slot.location, slot.size);
+                    swapStatistics.swappedPages--;
+                    FreeSlot(index);
+                }
+
+                // Leave the pool as it is until the next swap out
+                writebackPending = false;
+                break;
+            }
+
+            PoolFree(slot.location, slot.size);
+            if (!slot.refCount) {
+                // Freed whilst being written out
+                FreeDiskPage(diskPage);
+                swapStatistics.swappedPages--;
+                FreeSlot(index);
+                continue;
+            }
+
+            slot.state = SwapSlotDisk;
+            slot.location = diskPage;
+            swapStatistics.diskPages++;
+        }
+    }
+}
+
+void InitializeSwap() {
+    poolCapacity = HAL::mem_info.totalMemory / PAGE_SIZE_4K / SWAP_POOL_DIVISOR;
+    poolPages = new SwapPoolPage[poolCapacity + 1]; // The last page stops the search for a free page
+    memset(poolPages, 0, sizeof(SwapPoolPage) * (poolCapacity + 1));
+    poolPages[poolCapacity].block = 1;
+
+    poolWindow = reinterpret_cast<uint8_t*>(KernelAllocate4KPages(2));
+    pageWindow = poolWindow + PAGE_SIZE_4K;
+
+    scratch = new SwapScratch[SMP::processorCount];
+    for (unsigned i = 0; i < SMP::processorCount; i++) {
+        scratch[i].window = reinterpret_cast<uint8_t*>(KernelAllocate4KPages(1));
+    }
+
+    auto proc = Process::CreateKernelProcess((void*)SwapThread, "Swap", nullptr);
+    proc->Start();
+
+    Log::Info("[Swap] Compressed pool of up to %u KB", poolCapacity * (PAGE_SIZE_4K / 1024));
+}
+
+// Whether page 0 of part is a swap header made by mkswap.
+// Anything else, including a hibernation image (S1SUSPEND), may hold data we must not overwrite
+static bool HasSwapSignature(PartitionDevice* part) {
+    uintptr_t phys = AllocatePhysicalMemoryBlock();
+    uint8_t* header = reinterpret_cast<uint8_t*>(KernelAllocate4KPages(1));
+    KernelMapVirtualMemory4K(phys, reinterpret_cast<uintptr_t>(header), 1);
+
+    bool valid = !part->TransferUncached(DiskRequest::Read, 0, PAGE_SIZE_4K, header) &&
+                 !memcmp(header + PAGE_SIZE_4K - SWAP_SIGNATURE_LENGTH, SWAP_SIGNATURE, SWAP_SIGNATURE_LENGTH);
+
+    KernelFree4KPages(header, 1);
+    FreePhysicalMemoryBlock(phys);
+    return valid;
+}
+
+void AddSwapPartition(PartitionDevice* part) {
+    if (!swapPartitionsEnabled) {
+        Log::Info("[Swap] Found swap partition %s, pass swap on the command line to use it",
+                  part->InstanceName().c_str());
+        return;
+    }
+
+    if (swapPartition) {
+        Log::Warning("[Swap] Already using a swap partition, ignoring %s", part->InstanceName().c_str());
+        return;
+    }
+
+    uint64_t pages = MIN(part->PartitionSize() >> PAGE_SHIFT_4K, static_cast<uint64_t>(SWAP_MAX_SLOTS));
+    if (pages < 2) {
+        return; // Page 0 is kept for the swap header
+    }
+
+    if (!HasSwapSignature(part)) {
+        Log::Warning("[Swap] %s has no mkswap signature (or holds a hibernation image), ignoring",
+                     part->InstanceName().c_str());
+        return;
+    }
+
+    diskBitmap = new uint64_t[(pages + 63) / 64];
+    memset(diskBitmap, 0, sizeof(uint64_t) * ((pages + 63) / 64));
+    diskBitmap[0] = 1;
+    diskPageCount = pages;
+
+    swapStatistics.diskTotal = pages - 1;
+    __atomic_store_n(&swapPartition, part, __ATOMIC_RELEASE);
+
+    Log::Info("[Swap] Using %s, %u KB", part->InstanceName().c_str(), (pages - 1) * (PAGE_SIZE_4K / 1024));
+}
+
+size_t SwapOut(size_t bytes) {
+    unsigned target = PAGE_COUNT_4K(bytes);
+    unsigned swapped = 0;
+
+    // Pages get a second chance, so go around every process twice before giving up
+    for (unsigned wraps = 0; swapped < target && wraps < 2 && !SwapPoolFull();) {
+        FancyRefPtr<Process> process = Scheduler::TryFindNextProcess(swapHand);
+        if (!process.get()) {
+            swapHand = 0;
+            wraps++;
+            continue;
+        }
+        swapHand = process->PID();
+
+        swapped += process->SwapOut(target - swapped);
+    }
+
+    return static_cast<size_t>(swapped) << PAGE_SHIFT_4K;
+}
+
+} // namespace Memory
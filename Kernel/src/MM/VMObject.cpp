@@ -1,11 +1,73 @@
 #include <MM/VMObject.h>
 
+#include <MM/Swap.h>
 #include <Paging.h>
 #include <PhysicalAllocator.h>
 #include <Scheduler.h>
 #include <CPU.h>
+#include <Math.h>
 
 #include <Assert.h>
+#include <Spinlock.h>
+
+// Blocks looked at before the ones chosen are swapped out, at most PAGES_PER_TABLE
+#define VMOBJECT_SWAP_OUT_BATCH 64
+
+// Physical blocks shared copy on write between objects are given a count of the extra objects
+// referencing them. Counts are kept in chunks of 512 (one 2MB run), allocated the first time
+// a block in the chunk is shared, so memory is only used for ranges that have been forked.
+#define COW_CHUNK_SHIFT 9
+#define COW_CHUNK_COUNT ((static_cast<uint64_t>(PHYSALLOC_BITMAP_SIZE_DWORDS) * 32) >> COW_CHUNK_SHIFT)
+
+static uint32_t* cowShareCounts[COW_CHUNK_COUNT];
+
+static uint32_t* BlockShareCount(uint32_t block, bool allocate){
+    uint32_t chunkIndex = block >> COW_CHUNK_SHIFT;
+    assert(chunkIndex < COW_CHUNK_COUNT);
+
+    uint32_t* chunk = __atomic_load_n(&cowShareCounts[chunkIndex], __ATOMIC_ACQUIRE);
+    if(!chunk){
+        if(!allocate){
+            return nullptr;
+        }
+
+        uint32_t* newChunk = new uint32_t[1U << COW_CHUNK_SHIFT];
+        memset(newChunk, 0, sizeof(uint32_t) << COW_CHUNK_SHIFT);
+
+        if(__atomic_compare_exchange_n(&cowShareCounts[chunkIndex], &chunk, newChunk, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+            chunk = newChunk;
+        } else {
+            delete[] newChunk; // Someone else got there first
+        }
+    }
+
+    return &chunk[block & ((1U << COW_CHUNK_SHIFT) - 1)];
+}
+
+static void ShareBlock(uint32_t block){
+    __atomic_fetch_add(BlockShareCount(block, true), 1, __ATOMIC_ACQ_REL);
+}
+
+static bool IsBlockShared(uint32_t block){
+    uint32_t* count = BlockShareCount(block, false);
+    return count && __atomic_load_n(count, __ATOMIC_ACQUIRE);
+}
+
+// Drop a reference to block, freeing it if we were the last object using it
+static void ReleaseBlock(uint32_t block){
+    uint32_t* count = BlockShareCount(block, false);
+    if(count){
+        uint32_t refs = __atomic_load_n(count, __ATOMIC_ACQUIRE);
+        while(refs){
+            if(__atomic_compare_exchange_n(count, &refs, refs - 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+                return; // Still used by another object
+            }
+        }
+    }
+
+    Memory::FreePhysicalMemoryBlock(static_cast<uintptr_t>(block) << PAGE_SHIFT_4K);
+    Memory::AccountMemory(Memory::MemoryUsageAnonymous, -static_cast<int64_t>(PAGE_SIZE_4K));
+}
 
 VMObject::VMObject(size_t size, bool anonymous, bool shared) : size(size), anonymous(anonymous), shared(shared) {
     assert(!(size & (PAGE_SIZE_4K - 1)));
@@ -15,95 +77,344 @@ int VMObject::Hit(uintptr_t, uintptr_t, PageMap*){
     return 1; // Fatal page fault, kill process
 }
 
+int VMObject::CopyOnWriteHit(uintptr_t base, uintptr_t offset, PageMap* pMap){
+    // We hold the last reference to the object so there is nothing left to copy
+    copyOnWrite = false;
+    MapAllocatedBlocks(base, pMap); // This should remap all allocated blocks as writable
+
+    return Hit(base, offset, pMap); // In case the block was never allocated in the first place
+}
+
 VMObject* VMObject::Split(uintptr_t offset){
     assert(!"Cannot split VMObject!");
 
     return nullptr;
 }
 
+unsigned PhysicalVMObject::faultAroundPages = VMOBJECT_FAULT_AROUND_DEFAULT;
+
 PhysicalVMObject::PhysicalVMObject(uintptr_t size, bool anonymous, bool shared) : VMObject(size, anonymous, shared) {
     assert(!(size & (PAGE_SIZE_4K - 1)));
 
     size_t blockCount = PAGE_COUNT_4K(size);
 
     physicalBlocks = new uint32_t[blockCount];
+    memset(physicalBlocks, 0, sizeof(uint32_t) * blockCount);
+
+    if(!anonymous){
+        // Allocate all of our blocks
+        ForceAllocate();
+    }
+}
+
+int PhysicalVMObject::AllocateLargeBlock(unsigned first, uintptr_t base, PageMap* pMap){
+    assert(first + PAGES_PER_TABLE <= (size >> PAGE_SHIFT_4K));
+
+    uintptr_t phys = Memory::AllocateLargePhysicalMemoryBlock();
+    if(!phys){
+        return 1; // Physical memory is too fragmented
+    }
+    assert(phys < PHYS_BLOCK_MAX);
+    Memory::AccountMemory(Memory::MemoryUsageAnonymous, PAGE_SIZE_2M);
+
+    for(unsigned i = 0; i < PAGES_PER_TABLE; i++){
+        assert(!physicalBlocks[first + i]);
+        physicalBlocks[first + i] = (phys >> PAGE_SHIFT_4K) + i;
+    }
+
+    uintptr_t virt = base + (static_cast<uintptr_t>(first) << PAGE_SHIFT_4K);
+    if(pMap){
+        Memory::MapVirtualMemory2M(phys, virt, 1, PAGE_USER | PAGE_WRITABLE | PAGE_PRESENT | SharingPageFlags(), pMap);
+    }
+
+    if(pMap && (GetCR3() & PAGE_FRAME) == pMap->pml4Phys){
+        memset(reinterpret_cast<void*>(virt), 0, PAGE_SIZE_2M);
+    } else {
+        // Zero through a temporary kernel mapping, a window at a time
+        uint8_t* window = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(VMOBJECT_FAULT_AROUND_MAX));
+        for(unsigned i = 0; i < PAGES_PER_TABLE; i += VMOBJECT_FAULT_AROUND_MAX){
+            Memory::KernelMapVirtualMemory4K(phys + (static_cast<uintptr_t>(i) << PAGE_SHIFT_4K), reinterpret_cast<uintptr_t>(window), VMOBJECT_FAULT_AROUND_MAX);
+            memset(window, 0, VMOBJECT_FAULT_AROUND_MAX * PAGE_SIZE_4K);
+        }
+        Memory::KernelFree4KPages(window, VMOBJECT_FAULT_AROUND_MAX);
+    }
+
+    return 0;
+}
+
+PhysicalVMObject::PhysicalVMObject(PhysicalVMObject* parent) : VMObject(parent->size, parent->anonymous, parent->shared) {
+    assert(!parent->shared);
+
+    size_t blockCount = PAGE_COUNT_4K(size);
+    physicalBlocks = new uint32_t[blockCount];
+
+    ScopedSpinLock lockBlocks(parent->blockLock);
+    for(unsigned i = 0; i < blockCount; i++){
+        physicalBlocks[i] = parent->physicalBlocks[i];
+        if(Memory::IsSwapEntry(physicalBlocks[i])){
+            Memory::SwapDuplicate(physicalBlocks[i]);
+        } else if(physicalBlocks[i]){
+            ShareBlock(physicalBlocks[i]);
+        }
+    }
+
+    parent->copyOnWrite = true;
+    parent->cowScan = 0;
+    copyOnWrite = true;
+    refCount = 1;
+}
+
+bool PhysicalVMObject::IsLargeBlock(unsigned first) const {
+    if(first + PAGES_PER_TABLE > (size >> PAGE_SHIFT_4K)){
+        return false;
+    }
+
+    uint32_t block = physicalBlocks[first];
+    if(!block || Memory::IsSwapEntry(block) || (block & (PAGES_PER_TABLE - 1))){
+        return false; // Not allocated, swapped out or not 2MB aligned
+    }
+
+    for(unsigned i = 1; i < PAGES_PER_TABLE; i++){
+        if(physicalBlocks[first + i] != block + i){
+            return false;
+        }
+    }
+
+    return true;
+}
 
-    if(anonymous){
-        memset(physicalBlocks, 0, sizeof(uint32_t) * blockCount);
+int PhysicalVMObject::AllocateBlocks(unsigned first, unsigned count, uintptr_t base, PageMap* pMap){
+    assert(count <= VMOBJECT_FAULT_AROUND_MAX);
+
+    // If the page map is active we can zero the blocks through their new mappings,
+    // otherwise map them into the kernel temporarily
+    bool zeroInPlace = pMap && ((GetCR3() & PAGE_FRAME) == pMap->pml4Phys);
+    uint8_t* zeroBase;
+    if(zeroInPlace){
+        zeroBase = reinterpret_cast<uint8_t*>(base + (static_cast<uintptr_t>(first) << PAGE_SHIFT_4K));
     } else {
-        void* mapping = Memory::KernelAllocate4KPages(1);
-        for(unsigned i = 0; i < blockCount; i++){
-            uintptr_t phys = Memory::AllocatePhysicalMemoryBlock();
-            physicalBlocks[i] = phys >> PAGE_SHIFT_4K; // Allocate all of our blocks
+        zeroBase = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(count));
+    }
+
+    uint64_t allocated = 0; // Blocks allocated by us, relative to first
+    uint64_t unzeroed = 0; // Allocated blocks that did not come from the zeroed pool
+    for(unsigned i = 0; i < count; i++){
+        if(physicalBlocks[first + i]){
+            continue; // Already allocated
+        }
 
-            Memory::KernelMapVirtualMemory4K(phys, (uintptr_t)mapping, 1);
-            memset(mapping, 0, PAGE_SIZE_4K);
+        uintptr_t phys = Memory::AllocateZeroedPhysicalMemoryBlock();
+        if(!phys){
+            phys = Memory::AllocatePhysicalMemoryBlock();
+            unzeroed |= (1ULL << i);
+        }
+        assert(phys < PHYS_BLOCK_MAX);
+        if(!phys){
+            break; // Failed to allocate
         }
-        Memory::KernelFree4KPages(mapping, 1);
+
+        physicalBlocks[first + i] = phys >> PAGE_SHIFT_4K;
+        allocated |= (1ULL << i);
+        Memory::AccountMemory(Memory::MemoryUsageAnonymous, PAGE_SIZE_4K);
+
+        if(pMap){
+            // New blocks belong to this object alone so they are never copy on write
+            Memory::MapVirtualMemory4K(phys, base + (static_cast<uintptr_t>(first + i) << PAGE_SHIFT_4K), 1, PAGE_USER | PAGE_WRITABLE | PAGE_PRESENT | (shared ? PAGE_SHARED : 0), pMap);
+        }
+
+        if(!zeroInPlace && (unzeroed & (1ULL << i))){
+            Memory::KernelMapVirtualMemory4K(phys, reinterpret_cast<uintptr_t>(zeroBase) + (static_cast<uintptr_t>(i) << PAGE_SHIFT_4K), 1);
+        }
+    }
+
+    // Zero each run of newly allocated blocks at once
+    unzeroed &= allocated;
+    for(unsigned i = 0; i < count;){
+        if(!(unzeroed & (1ULL << i))){
+            i++;
+            continue;
+        }
+
+        unsigned run = i;
+        while(run < count && (unzeroed & (1ULL << run))){
+            run++;
+        }
+
+        memset(zeroBase + (static_cast<uintptr_t>(i) << PAGE_SHIFT_4K), 0, static_cast<size_t>(run - i) << PAGE_SHIFT_4K);
+        i = run;
     }
+
+    if(!zeroInPlace){
+        Memory::KernelFree4KPages(zeroBase, count);
+    }
+
+    return allocated ? 0 : 1;
 }
 
 int PhysicalVMObject::Hit(uintptr_t base, uintptr_t offset, PageMap* pMap){
     unsigned blockIndex = offset >> PAGE_SHIFT_4K;
-    assert(blockIndex < (size >> PAGE_SHIFT_4K));
+    unsigned blockCount = size >> PAGE_SHIFT_4K;
+    assert(blockIndex < blockCount);
 
     uint32_t& block = physicalBlocks[blockIndex];
+    if(Memory::IsSwapEntry(block)){
+        return SwapInBlock(blockIndex, base, pMap);
+    }
+
     if(block){ // Another reference to the VMObject probably mapped this block
-        Memory::MapVirtualMemory4K(static_cast<uintptr_t>(block) << PAGE_SHIFT_4K, base + offset, 1, pMap);
-    } else { // We need to allocate block
-        assert(anonymous);
+        Memory::MapVirtualMemory4K(static_cast<uintptr_t>(block) << PAGE_SHIFT_4K, base + offset, 1, PAGE_USER | (PAGE_WRITABLE * (!copyOnWrite)) | PAGE_PRESENT | SharingPageFlags(), pMap);
+        return 0;
+    }
 
-        uintptr_t phys = Memory::AllocatePhysicalMemoryBlock();
-        assert(phys < PHYS_BLOCK_MAX);
-        if(!phys){
-            return 1; // Failed to allocate
+    // We need to allocate block
+    if(!anonymous){
+        return 1; // Only the committed part of a shared memory object is backed
+    }
+
+    // Objects that are not copy on write get a 2MB page if the 2MB aligned window around
+    // the fault is within the object and nothing in it has been allocated yet
+    uintptr_t largeVirt = (base + offset) & ~static_cast<uintptr_t>(PAGE_SIZE_2M - 1);
+    if(!copyOnWrite && largeVirt >= base){
+        unsigned largeFirst = (largeVirt - base) >> PAGE_SHIFT_4K;
+        bool available = largeFirst + PAGES_PER_TABLE <= blockCount;
+        for(unsigned i = 0; available && i < PAGES_PER_TABLE; i++){
+            available = !physicalBlocks[largeFirst + i];
         }
 
-        block = phys >> PAGE_SHIFT_4K;
+        if(available && !AllocateLargeBlock(largeFirst, base, pMap)){
+            return 0; // Success
+        }
+    }
 
-        Memory::MapVirtualMemory4K(phys, base + offset, 1, PAGE_USER | PAGE_WRITABLE | PAGE_PRESENT, pMap);
-        
-        if(GetCR3() == pMap->pml4Phys){
-            memset(reinterpret_cast<void*>((base + offset) & ~static_cast<uintptr_t>(PAGE_SIZE_4K - 1)), 0, PAGE_SIZE_4K); // Zero the block
-        } else {
-            void* mapping = Memory::KernelAllocate4KPages(1);
-            Memory::KernelMapVirtualMemory4K(phys, (uintptr_t)mapping, 1);
+    // Fault-around, the neighbouring blocks are likely to be used soon (e.g. heap or stack growth)
+    // so allocate an aligned window of blocks to save on page faults.
+    // Objects shared copy on write as a whole are mapped by another address space so only take the block we need.
+    unsigned first = blockIndex;
+    unsigned count = 1;
+    if((!copyOnWrite || refCount <= 1) && faultAroundPages > 1){
+        first = blockIndex & ~(faultAroundPages - 1);
+        count = MIN(faultAroundPages, blockCount - first);
+    }
+
+    if(AllocateBlocks(first, count, base, pMap) || !block){
+        return 1; // Failed to allocate
+    }
+
+    return 0; // Success
+}
+
+int PhysicalVMObject::CopyOnWriteHit(uintptr_t base, uintptr_t offset, PageMap* pMap){
+    unsigned blockIndex = offset >> PAGE_SHIFT_4K;
+    assert(blockIndex < (size >> PAGE_SHIFT_4K));
 
-            memset(mapping, 0, PAGE_SIZE_4K);
+    uintptr_t virt = base + (static_cast<uintptr_t>(blockIndex) << PAGE_SHIFT_4K);
 
-            Memory::KernelFree4KPages(mapping, 1);
+    if(!physicalBlocks[blockIndex]){
+        return Hit(base, offset, pMap); // Never allocated, we will get a block of our own
+    } else if(Memory::IsSwapEntry(physicalBlocks[blockIndex])){
+        return Hit(base, offset, pMap); // Swapped out, the block read back in is our own
+    }
+
+    // Blocks are never unallocated whilst the object is mapped,
+    // but another thread may have replaced it by the time we hold the lock
+    ScopedSpinLock lockBlocks(blockLock);
+    uint32_t block = physicalBlocks[blockIndex];
+    if(!IsBlockShared(block)){
+        // Any other objects have already copied or freed the block
+        Memory::MapVirtualMemory4K(static_cast<uintptr_t>(block) << PAGE_SHIFT_4K, virt, 1, PAGE_USER | PAGE_WRITABLE | PAGE_PRESENT, pMap);
+        UpdateCopyOnWrite();
+        return 0;
+    }
+
+    uintptr_t newBlock = Memory::AllocatePhysicalMemoryBlock();
+    if(!newBlock){
+        return 1; // Failed to allocate
+    }
+    assert(newBlock < PHYS_BLOCK_MAX);
+    Memory::AccountMemory(Memory::MemoryUsageAnonymous, PAGE_SIZE_4K);
+
+    // Temporary mappings so we can copy the data over
+    uint8_t* virtBuffer = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(2));
+    uint8_t* virtDestBuffer = virtBuffer + PAGE_SIZE_4K;
+
+    Memory::KernelMapVirtualMemory4K(static_cast<uintptr_t>(block) << PAGE_SHIFT_4K, (uintptr_t)virtBuffer, 1);
+    Memory::KernelMapVirtualMemory4K(newBlock, (uintptr_t)virtDestBuffer, 1);
+    memcpy(virtDestBuffer, virtBuffer, PAGE_SIZE_4K);
+
+    Memory::KernelFree4KPages(virtBuffer, 2);
+
+    physicalBlocks[blockIndex] = newBlock >> PAGE_SHIFT_4K;
+    Memory::MapVirtualMemory4K(newBlock, virt, 1, PAGE_USER | PAGE_WRITABLE | PAGE_PRESENT, pMap);
+
+    ReleaseBlock(block);
+    UpdateCopyOnWrite();
+    return 0;
+}
+
+void PhysicalVMObject::UpdateCopyOnWrite(){
+    // Blocks only stop being shared until the next fork, which starts the scan again
+    unsigned blockCount = size >> PAGE_SHIFT_4K;
+    while(cowScan < blockCount){
+        uint32_t block = physicalBlocks[cowScan];
+        if(block && !Memory::IsSwapEntry(block) && IsBlockShared(block)){
+            return; // Still shared, writes to it have to be copied
         }
+
+        cowScan++;
     }
 
-    return 0; // Success
+    // Any blocks still mapped read only get mapped writable by Hit on the next write
+    if(refCount <= 1){
+        copyOnWrite = false;
+    }
 }
 
 void PhysicalVMObject::ForceAllocate(){
-    void* mapping = Memory::KernelAllocate4KPages(1);
-    for(unsigned i = 0; i < (size >> PAGE_SHIFT_4K); i++){
-        if(physicalBlocks[i]){
-            continue; // Already allocated
-        }
-        assert(anonymous);
+    AllocateRange(0, size >> PAGE_SHIFT_4K);
+}
 
-        uintptr_t phys = Memory::AllocatePhysicalMemoryBlock();
-        assert(phys < PHYS_BLOCK_MAX);
-        
-        physicalBlocks[i] = phys >> PAGE_SHIFT_4K;
+int PhysicalVMObject::AllocateRange(unsigned first, unsigned end){
+    int failed = 0;
+    for(unsigned i = first; i < end;){
+        // Use 2MB runs where we can so the object can be mapped with 2MB pages
+        if(!(i & (PAGES_PER_TABLE - 1)) && i + PAGES_PER_TABLE <= end){
+            bool available = true;
+            for(unsigned j = 0; available && j < PAGES_PER_TABLE; j++){
+                available = !physicalBlocks[i + j];
+            }
+
+            if(available && !AllocateLargeBlock(i, 0, nullptr)){
+                i += PAGES_PER_TABLE;
+                continue;
+            }
+        }
 
-        Memory::KernelMapVirtualMemory4K(phys, (uintptr_t)mapping, 1);
-        memset(mapping, 0, PAGE_SIZE_4K);
+        unsigned count = MIN(end - i, VMOBJECT_FAULT_AROUND_MAX);
+        AllocateBlocks(i, count, 0, nullptr);
+        for(unsigned j = i; j < i + count; j++){
+            failed |= !physicalBlocks[j];
+        }
+        i += count;
     }
-    Memory::KernelFree4KPages(mapping, 1);
+
+    return failed;
 }
 
 void PhysicalVMObject::MapAllocatedBlocks(uintptr_t base, PageMap* pMap){
     uintptr_t virt = base;
 
-    long pgFlags = PAGE_USER | (PAGE_WRITABLE * (!copyOnWrite)) | PAGE_PRESENT;
+    long pgFlags = PAGE_USER | (PAGE_WRITABLE * (!copyOnWrite)) | PAGE_PRESENT | SharingPageFlags();
     for(unsigned i = 0; i < (size >> PAGE_SHIFT_4K); i++){
+        if(!(virt & (PAGE_SIZE_2M - 1)) && IsLargeBlock(i)){
+            Memory::MapVirtualMemory2M(static_cast<uintptr_t>(physicalBlocks[i]) << PAGE_SHIFT_4K, virt, 1, pgFlags, pMap);
+
+            i += PAGES_PER_TABLE - 1;
+            virt += PAGE_SIZE_2M;
+            continue;
+        }
+
         uint64_t block = physicalBlocks[i];
-        if(block){ // Is it allocated?
+        if(block && !Memory::IsSwapEntry(block)){ // Is it allocated and in memory?
             // Only set write flag if copyOnWrite is false
             Memory::MapVirtualMemory4K(block << PAGE_SHIFT_4K, virt, 1, pgFlags, pMap);
         } else {
@@ -124,9 +435,20 @@ VMObject* PhysicalVMObject::Clone(){
 
     for(unsigned i = 0; i < (size >> PAGE_SHIFT_4K); i++){
         uintptr_t block = physicalBlocks[i];
-        if(block){
+        if(Memory::IsSwapEntry(block)){
+            // Read straight into the new block, on failure it is left zeroed
+            uintptr_t newBlock = Memory::AllocatePhysicalMemoryBlock();
+            newVMO->physicalBlocks[i] = newBlock >> PAGE_SHIFT_4K;
+            Memory::AccountMemory(Memory::MemoryUsageAnonymous, PAGE_SIZE_4K);
+
+            if(Memory::SwapIn(block, newBlock)){
+                Memory::KernelMapVirtualMemory4K(newBlock, (uintptr_t)virtDestBuffer, 1);
+                memset(virtDestBuffer, 0, PAGE_SIZE_4K);
+            }
+        } else if(block){
             uintptr_t newBlock = Memory::AllocatePhysicalMemoryBlock();
             newVMO->physicalBlocks[i] = newBlock >> PAGE_SHIFT_4K;
+            Memory::AccountMemory(Memory::MemoryUsageAnonymous, PAGE_SIZE_4K);
 
             Memory::KernelMapVirtualMemory4K(block << PAGE_SHIFT_4K, (uintptr_t)virtBuffer, 1); // Map temporary mappings to our blocks
             Memory::KernelMapVirtualMemory4K(newBlock, (uintptr_t)virtDestBuffer, 1);
@@ -143,6 +465,145 @@ VMObject* PhysicalVMObject::Clone(){
     return newVMO;
 }
 
+VMObject* PhysicalVMObject::Fork(){
+    return new PhysicalVMObject(this);
+}
+
+int PhysicalVMObject::SwapInBlock(unsigned index, uintptr_t base, PageMap* pMap){
+    uint32_t entry = physicalBlocks[index];
+
+    uintptr_t phys = Memory::AllocatePhysicalMemoryBlock();
+    if(!phys){
+        return 1; // Failed to allocate
+    }
+    assert(phys < PHYS_BLOCK_MAX);
+
+    if(Memory::SwapIn(entry, phys)){
+        Memory::FreePhysicalMemoryBlock(phys);
+        return 1; // Could not read the page back
+    }
+
+    // Another thread may have faulted on the same block whilst it was read
+    bool swappedIn;
+    {
+        ScopedSpinLock lockBlocks(blockLock);
+        swappedIn = physicalBlocks[index] == entry;
+        if(swappedIn){
+            physicalBlocks[index] = phys >> PAGE_SHIFT_4K;
+        }
+    }
+
+    if(swappedIn){
+        Memory::SwapFree(entry);
+        Memory::AccountMemory(Memory::MemoryUsageAnonymous, PAGE_SIZE_4K);
+    } else {
+        Memory::FreePhysicalMemoryBlock(phys);
+    }
+
+    uintptr_t virt = base + (static_cast<uintptr_t>(index) << PAGE_SHIFT_4K);
+    Memory::MapVirtualMemory4K(static_cast<uintptr_t>(physicalBlocks[index]) << PAGE_SHIFT_4K, virt, 1, PAGE_USER | (PAGE_WRITABLE * (!copyOnWrite)) | PAGE_PRESENT | SharingPageFlags(), pMap);
+    return 0;
+}
+
+unsigned PhysicalVMObject::SwapOutBlocks(const unsigned* victims, unsigned count, uintptr_t base, PageMap* pMap){
+    unsigned swapped = 0;
+    for(unsigned i = 0; i < count; i++){
+        unsigned index = victims[i];
+        uintptr_t phys = static_cast<uintptr_t>(physicalBlocks[index]) << PAGE_SHIFT_4K;
+
+        if(uint32_t entry = Memory::SwapStore(phys); entry){
+            physicalBlocks[index] = entry;
+            Memory::AccountMemory(Memory::MemoryUsageAnonymous, -static_cast<int64_t>(PAGE_SIZE_4K));
+            swapped++;
+        } else {
+            // Did not compress or the pool is full, keep it in memory
+            Memory::MapVirtualMemory4K(phys, base + (static_cast<uintptr_t>(index) << PAGE_SHIFT_4K), 1, PAGE_USER | (PAGE_WRITABLE * (!copyOnWrite)) | PAGE_PRESENT | SharingPageFlags(), pMap);
+        }
+    }
+
+    return swapped;
+}
+
+unsigned PhysicalVMObject::SwapOut(uintptr_t base, PageMap* pMap, unsigned maxPages, unsigned& scanBudget){
+    // Blocks of objects that are shared or mapped more than once may be mapped somewhere else
+    if(!anonymous || shared || refCount > 1){
+        return 0;
+    }
+
+    // The holder could be waiting on the reclaim thread for memory
+    if(acquireTestLock(&blockLock)){
+        return 0;
+    }
+
+    unsigned blockCount = size >> PAGE_SHIFT_4K;
+    if(swapHand >= blockCount){
+        swapHand = 0;
+    }
+
+    Memory::TLBShootdownBatch shootdown(pMap);
+
+    unsigned victims[PAGES_PER_TABLE];
+    unsigned victimCount = 0;
+    unsigned swapped = 0;
+
+    // Victims are unmapped, then stored once no CPU can be writing to them
+    auto swapOutVictims = [&](){
+        shootdown.Flush();
+        swapped += SwapOutBlocks(victims, victimCount, base, pMap);
+        victimCount = 0;
+    };
+
+    for(unsigned scanned = 0; scanned < blockCount && scanBudget && swapped + victimCount < maxPages && !Memory::SwapPoolFull();){
+        unsigned i = swapHand;
+        uint32_t block = physicalBlocks[i];
+        uintptr_t virt = base + (static_cast<uintptr_t>(i) << PAGE_SHIFT_4K);
+        unsigned advance = 1;
+
+        // Blocks shared copy on write are still used by another object
+        if(block && !Memory::IsSwapEntry(block) && !IsBlockShared(block)){
+            bool large;
+            int accessed = Memory::TestAndClearAccessed(virt, pMap, large);
+            if(large){
+                // The accessed bit covers the whole 2MB page so all of it goes or none of it
+                unsigned first = i - ((virt & (PAGE_SIZE_2M - 1)) >> PAGE_SHIFT_4K);
+                advance = first + PAGES_PER_TABLE - i;
+
+                bool evict = !accessed;
+                for(unsigned j = 0; evict && j < PAGES_PER_TABLE; j++){
+                    evict = !IsBlockShared(physicalBlocks[first + j]);
+                }
+
+                if(evict){
+                    swapOutVictims();
+
+                    // Splits the 2MB page
+                    Memory::MapVirtualMemory4K(0, base + (static_cast<uintptr_t>(first) << PAGE_SHIFT_4K), PAGES_PER_TABLE, PAGE_USER, pMap);
+                    for(unsigned j = 0; j < PAGES_PER_TABLE; j++){
+                        victims[victimCount++] = first + j;
+                    }
+                    swapOutVictims();
+                }
+            } else if(!accessed){
+                Memory::MapVirtualMemory4K(0, virt, 1, PAGE_USER, pMap);
+                victims[victimCount++] = i;
+            }
+        }
+
+        scanned += advance;
+        scanBudget -= MIN(advance, scanBudget);
+        swapHand = (i + advance < blockCount) ? (i + advance) : 0;
+
+        if(victimCount >= VMOBJECT_SWAP_OUT_BATCH){
+            swapOutVictims();
+        }
+    }
+
+    swapOutVictims();
+
+    releaseLock(&blockLock);
+    return swapped;
+}
+
 size_t PhysicalVMObject::UsedPhysicalMemory() const {
     if(!anonymous){
         return size;
@@ -150,7 +611,7 @@ size_t PhysicalVMObject::UsedPhysicalMemory() const {
 
     unsigned blockCount = 0;
     for(unsigned i = 0; i < (size >> PAGE_SHIFT_4K); i++){
-        if(physicalBlocks[i]){
+        if(physicalBlocks[i] && !Memory::IsSwapEntry(physicalBlocks[i])){
             blockCount++;
         }
     }
@@ -163,8 +624,19 @@ PhysicalVMObject::~PhysicalVMObject(){
 
     if(physicalBlocks){
         for(unsigned i = 0; i < size >> PAGE_SHIFT_4K; i++){ // Free our allocated physical blocks
-            if(physicalBlocks[i]){
-                Memory::FreePhysicalMemoryBlock(static_cast<uintptr_t>(physicalBlocks[i]) << PAGE_SHIFT_4K);
+            bool largeBlock = IsLargeBlock(i);
+            for(unsigned j = 0; largeBlock && j < PAGES_PER_TABLE; j++){
+                largeBlock = !IsBlockShared(physicalBlocks[i + j]);
+            }
+
+            if(largeBlock){
+                Memory::FreeLargePhysicalMemoryBlock(static_cast<uintptr_t>(physicalBlocks[i]) << PAGE_SHIFT_4K);
+                Memory::AccountMemory(Memory::MemoryUsageAnonymous, -static_cast<int64_t>(PAGE_SIZE_2M));
+                i += PAGES_PER_TABLE - 1;
+            } else if(Memory::IsSwapEntry(physicalBlocks[i])){
+                Memory::SwapFree(physicalBlocks[i]);
+            } else if(physicalBlocks[i]){
+                ReleaseBlock(physicalBlocks[i]);
             }
             
         }
@@ -178,6 +650,15 @@ ProcessImageVMObject::ProcessImageVMObject(uintptr_t base, size_t size, bool wri
 
 }
 
+ProcessImageVMObject::ProcessImageVMObject(ProcessImageVMObject* parent) :
+    PhysicalVMObject(parent), write(parent->write), base(parent->base) {
+
+}
+
+VMObject* ProcessImageVMObject::Fork(){
+    return new ProcessImageVMObject(this);
+}
+
 void ProcessImageVMObject::MapAllocatedBlocks(uintptr_t requestedBase, PageMap* pMap){
     assert(requestedBase == base);
 
@@ -186,7 +667,7 @@ void ProcessImageVMObject::MapAllocatedBlocks(uintptr_t requestedBase, PageMap*
         uint64_t block = physicalBlocks[i];
         assert(block);
 
-        Memory::MapVirtualMemory4K(block << PAGE_SHIFT_4K, virt, 1, PAGE_USER | (PAGE_WRITABLE * (write && !copyOnWrite)) | PAGE_PRESENT, pMap);
+        Memory::MapVirtualMemory4K(block << PAGE_SHIFT_4K, virt, 1, PAGE_USER | (PAGE_WRITABLE * (write && !copyOnWrite)) | PAGE_PRESENT | SharingPageFlags(), pMap);
         virt += PAGE_SIZE_4K;
     }
 }
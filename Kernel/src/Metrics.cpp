@@ -0,0 +1,207 @@
+#include <Metrics.h>
+
+#include <Assert.h>
+#include <CPU.h>
+#include <CString.h>
+#include <Errno.h>
+#include <HAL.h>
+#include <Lock.h>
+#include <Logging.h>
+#include <Math.h>
+#include <MM/AddressSpace.h>
+#include <MM/Swap.h>
+#include <MM/VMObject.h>
+#include <Memory.h>
+#include <Objects/Process.h>
+#include <PhysicalAllocator.h>
+#include <SMP.h>
+#include <Scheduler.h>
+#include <Thread.h>
+#include <Timer.h>
+
+#define METRICS_PAGE_COUNT (METRICS_SIZE / PAGE_SIZE_4K)
+
+namespace Metrics {
+
+// The same pages are mapped into every process that asks for them,
+// shared so they are never copy on write and forks keep them
+class MetricsVMObject final : public VMObject {
+public:
+    MetricsVMObject() : VMObject(METRICS_SIZE, false, true) {
+        m_virt = reinterpret_cast<lemon_metrics_t*>(Memory::KernelAllocate4KPages(METRICS_PAGE_COUNT));
+        for (unsigned i = 0; i < METRICS_PAGE_COUNT; i++) {
+            m_phys[i] = Memory::AllocatePhysicalMemoryBlock();
+            Memory::KernelMapVirtualMemory4K(m_phys[i], reinterpret_cast<uintptr_t>(m_virt) + i * PAGE_SIZE_4K, 1);
+        }
+
+        memset(m_virt, 0, METRICS_SIZE);
+    }
+
+    void MapAllocatedBlocks(uintptr_t base, PageMap* pMap) override {
+        for (unsigned i = 0; i < METRICS_PAGE_COUNT; i++) {
+            Memory::MapVirtualMemory4K(m_phys[i], base + i * PAGE_SIZE_4K, 1, PAGE_USER | PAGE_PRESENT, pMap);
+        }
+    }
+
+    [[noreturn]] VMObject* Clone() override { assert(!"Metrics VMO cannot be cloned!"); }
+
+    ALWAYS_INLINE lemon_metrics_t* Metrics() { return m_virt; }
+
+private:
+    uintptr_t m_phys[METRICS_PAGE_COUNT];
+    lemon_metrics_t* m_virt;
+};
+
+static MetricsVMObject* metricsVMO = nullptr;
+static FancyRefPtr<VMObject> metricsVMORef;
+
+// Snapshot being built, held by updateLock
+static lemon_metrics_t* staging = nullptr;
+static Mutex updateLock;
+
+static void UpdateCPUs(lemon_metrics_t* m, uint64_t now) {
+    m->cpuCount = MIN(SMP::processorCount, METRICS_MAX_CPUS);
+    for (unsigned i = 0; i < m->cpuCount; i++) {
+        CPU* cpu = SMP::cpus[i];
+
+        // Include the current idle period
+        uint64_t idleUs = cpu->idleUs;
+        if (cpu->currentThread == cpu->idleThread) {
+            uint64_t idleSince = cpu->idleSince;
+            if (now > idleSince) {
+                idleUs += now - idleSince;
+            }
+        }
+
+        m->cpus[i] = {
+            .busyUs = (now > idleUs) ? (now - idleUs) : 0,
+            .idleUs = idleUs,
+            .contextSwitches = cpu->contextSwitches,
+            .migrations = cpu->migrations,
+            .runQueueLength = Scheduler::RunQueueLength(cpu),
+            .id = static_cast<uint16_t>(cpu->id),
+        };
+    }
+}
+
+static void UpdateMemory(lemon_metrics_t* m) {
+    auto usageKB = [](Memory::MemoryUsage usage) -> uint64_t {
+        int64_t bytes = __atomic_load_n(&Memory::memoryUsage[usage], __ATOMIC_RELAXED);
+        return (bytes > 0) ? (bytes / 1024) : 0;
+    };
+
+    m->memory = {
+        .totalMem = HAL::mem_info.totalMemory / 1024,
+        .usedMem = Memory::usedPhysicalBlocks * 4,
+        .kernelHeap = usageKB(Memory::MemoryUsageKernelHeap),
+        .pageCache = usageKB(Memory::MemoryUsagePageCache),
+        .blockCache = usageKB(Memory::MemoryUsageBlockCache),
+        .anonymous = usageKB(Memory::MemoryUsageAnonymous),
+        .swapPool = usageKB(Memory::MemoryUsageSwapPool),
+        .swapped = Memory::GetSwapStatistics().swappedPages * 4,
+        .swapDisk = Memory::GetSwapStatistics().diskPages * 4,
+    };
+}
+
+static void UpdateProcesses(lemon_metrics_t* m) {
+    uint64_t uptime = Timer::GetSystemUptime();
+    uint64_t frequency = Timer::GetFrequency();
+
+    unsigned count = 0;
+    pid_t pid = 0;
+    while (count < METRICS_MAX_PROCESSES && (pid = Scheduler::GetNextProcessPID(pid))) {
+        FancyRefPtr<Process> process = Scheduler::FindProcessByPID(pid);
+        if (!process.get() || process->IsDead()) {
+            continue;
+        }
+
+        lemon_metrics_process_t& p = m->processes[count++];
+        p.pid = pid;
+        p.threadCount = process->Threads().get_length();
+        p.state = process->GetMainThread()->state;
+        p.isCPUIdle = process->IsCPUIdleProcess();
+
+        strncpy(p.name, process->name, METRICS_NAME_LENGTH - 1);
+        p.name[METRICS_NAME_LENGTH - 1] = 0;
+
+        p.runningTime = uptime - process->creationTime.tv_sec;
+        p.activeUs = process->activeTicks * 1000000 / frequency;
+
+        p.usedMem = process->addressSpace->UsedPhysicalMemory();
+        p.ipcMem = process->IPCMemory();
+
+        p.contextSwitches = process->contextSwitches;
+        p.migrations = process->migrations;
+
+        p.ipcMessagesSent = __atomic_load_n(&process->ipcMessagesSent, __ATOMIC_RELAXED);
+        p.ipcMessagesReceived = __atomic_load_n(&process->ipcMessagesReceived, __ATOMIC_RELAXED);
+        p.ioReadBytes = __atomic_load_n(&process->ioReadBytes, __ATOMIC_RELAXED);
+        p.ioWriteBytes = __atomic_load_n(&process->ioWriteBytes, __ATOMIC_RELAXED);
+    }
+
+    m->processCount = count;
+}
+
+static void Update() {
+    ScopedMutexLock lock(updateLock);
+    uint64_t now = Timer::UsecondsSinceBoot();
+
+    staging->uptimeUs = now;
+    UpdateCPUs(staging, now);
+    UpdateMemory(staging);
+    UpdateProcesses(staging);
+
+    // Only copy what is in use so readers retry for as little time as possible
+    lemon_metrics_t* metrics = metricsVMO->Metrics();
+    size_t size = reinterpret_cast<uintptr_t>(&staging->processes[staging->processCount]) -
+                  reinterpret_cast<uintptr_t>(&staging->cpuCount);
+
+    // Readers retry whilst the sequence is odd
+    __atomic_store_n(&metrics->sequence, metrics->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    memcpy(&metrics->cpuCount, &staging->cpuCount, size);
+
+    __atomic_store_n(&metrics->sequence, metrics->sequence + 1, __ATOMIC_RELEASE);
+}
+
+static void Updater() {
+    for (;;) {
+        Thread::Current()->Sleep(METRICS_UPDATE_INTERVAL_US);
+
+        // Nobody has the metrics mapped, do not bother
+        if (!metricsVMO->ReferenceCount()) {
+            continue;
+        }
+
+        Update();
+    }
+}
+
+void Initialize() {
+    metricsVMO = new MetricsVMObject();
+    metricsVMORef = metricsVMO;
+
+    staging = reinterpret_cast<lemon_metrics_t*>(kmalloc(sizeof(lemon_metrics_t)));
+    memset(staging, 0, sizeof(lemon_metrics_t));
+
+    auto updater = Process::CreateKernelProcess((void*)Updater, "Metrics", nullptr);
+    updater->Start();
+}
+
+long MapIntoProcess(Process* process, uintptr_t& address) {
+    MappedRegion* region = process->addressSpace->MapVMO(metricsVMORef, 0, false);
+    if (!region) {
+        return -ENOMEM;
+    }
+
+    // Give the first reader something to read straight away
+    if (metricsVMO->ReferenceCount() == 1) {
+        Update();
+    }
+
+    address = region->Base();
+    return 0;
+}
+
+} // namespace Metrics
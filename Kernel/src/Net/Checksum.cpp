@@ -0,0 +1,63 @@
+#include <Net/Net.h>
+
+typedef uint64_t __attribute__((may_alias, aligned(1))) unaligned_uint64_t;
+typedef uint32_t __attribute__((may_alias, aligned(1))) unaligned_uint32_t;
+typedef uint16_t __attribute__((may_alias, aligned(1))) unaligned_uint16_t;
+
+namespace Network {
+    // Add with the carry wrapped around to bit 0, 2^64 is 1 in one's complement arithmetic
+    ALWAYS_INLINE static uint64_t AddCarry(uint64_t sum, uint64_t value){
+        sum += value;
+        return sum + (sum < value);
+    }
+
+    uint64_t ChecksumAdd(const void* data, size_t size, uint64_t sum){
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+
+        // The kernel is built without SSE, so sum 64 bits at a time in two chains that do not wait on each other's carry
+        uint64_t sum2 = 0;
+        while(size >= 32){
+            sum = AddCarry(sum, *reinterpret_cast<const unaligned_uint64_t*>(p));
+            sum2 = AddCarry(sum2, *reinterpret_cast<const unaligned_uint64_t*>(p + 8));
+            sum = AddCarry(sum, *reinterpret_cast<const unaligned_uint64_t*>(p + 16));
+            sum2 = AddCarry(sum2, *reinterpret_cast<const unaligned_uint64_t*>(p + 24));
+
+            p += 32;
+            size -= 32;
+        }
+        sum = AddCarry(sum, sum2);
+
+        while(size >= 8){
+            sum = AddCarry(sum, *reinterpret_cast<const unaligned_uint64_t*>(p));
+            p += 8;
+            size -= 8;
+        }
+
+        if(size >= 4){
+            sum = AddCarry(sum, *reinterpret_cast<const unaligned_uint32_t*>(p));
+            p += 4;
+            size -= 4;
+        }
+
+        if(size >= 2){
+            sum = AddCarry(sum, *reinterpret_cast<const unaligned_uint16_t*>(p));
+            p += 2;
+            size -= 2;
+        }
+
+        if(size){
+            sum = AddCarry(sum, *p); // Uneven amount of data, padded with a zero byte
+        }
+
+        return sum;
+    }
+
+    uint64_t PseudoHeaderSum(const IPv4Address& source, const IPv4Address& destination, uint8_t protocol, uint16_t length){
+        BigEndian<uint16_t> bigProtocol;
+        bigProtocol = protocol; // Preceded by a zero byte
+        BigEndian<uint16_t> bigLength;
+        bigLength = length;
+
+        return static_cast<uint64_t>(source.value) + destination.value + bigProtocol.value + bigLength.value;
+    }
+}
@@ -74,7 +74,11 @@ int IPSocket::Listen(int backlog){
 	return -ENOSYS;
 }
     
-int64_t IPSocket::ReceiveFrom(void* buffer, size_t len, int flags, sockaddr* src, socklen_t* addrlen, const void* ancillary, size_t ancillaryLen){
+int64_t IPSocket::ReceiveFrom(void* buffer, size_t len, int flags, sockaddr* src, socklen_t* addrlen, void* ancillary, size_t* ancillaryLen){
+	if(ancillaryLen){
+		*ancillaryLen = 0; // No ancillary data
+	}
+
 	if(flags & SOCK_NONBLOCK && !pQueue.get_length()){
 		return -EAGAIN;
 	}
@@ -6,6 +6,7 @@
 #include <Math.h>
 #include <Timer.h>
 #include <Errno.h>
+#include <RCU.h>
 
 #include <Objects/Service.h>
 #include <Objects/Interface.h>
@@ -13,13 +14,43 @@
 #define NET_INTERFACE_STACKSIZE 32768
 
 namespace Network{
-	extern HashMap<uint32_t, MACAddress> addressCache;
-	extern Vector<NetworkAdapter*> adapters;
 
-	Semaphore packetQueueSemaphore(0);
-	FancyRefPtr<Process> netProcess;
+	// Hands everything sent straight back to the receive path, so the stack can be measured without a NIC
+	class LoopbackAdapter final : public NetworkAdapter {
+	public:
+		LoopbackAdapter() : NetworkAdapter(NetworkAdapterLoopback) {
+			SetInstanceName("lo");
+			SetDeviceName("Loopback Adapter");
 
-	void OnReceiveARP(void* data, size_t length){
+			// Nothing goes over a wire, checksums are never needed and segments are passed up whole
+			offloads = OffloadTxChecksum | OffloadRxChecksum | OffloadTcpSegmentation;
+
+			mac = {0, 0, 0, 0, 0, 0};
+			adapterIP = IPv4Address(127, 0, 0, 1);
+			subnetMask = IPv4Address(255, 0, 0, 0);
+
+			linkState = LinkUp;
+			dState = OK;
+		}
+
+		void SendPacket(void* data, size_t len){
+			NetworkPacket* pkt = AllocatePacket();
+			memcpy(pkt->Put(len), data, len);
+
+			SendPacket(pkt);
+		}
+
+		void SendPacket(NetworkPacket* pkt){
+			pkt->checksumVerified = true;
+			Receive(pkt);
+		}
+	};
+
+	void InitializeLoopback(){
+		NetFS::GetInstance()->RegisterAdapter(new LoopbackAdapter());
+	}
+
+	void OnReceiveARP(NetworkAdapter* receiver, void* data, size_t length){
 		if(length < sizeof(ARPHeader)){
 			IF_DEBUG(debugLevelNetwork >= DebugLevelVerbose, {
 				Log::Warning("[Network] [ARP] Discarding packet (too short)");
@@ -44,7 +75,7 @@ namespace Network{
 				uint8_t buffer[sizeof(EthernetFrame) + sizeof(ARPHeader)];
 				
 				EthernetFrame* ethFrame = reinterpret_cast<EthernetFrame*>(buffer);
-				ethFrame->etherType = EtherTypeIPv4;
+				ethFrame->etherType = EtherTypeARP;
 				ethFrame->src = adapter->mac;
 				ethFrame->dest = arp->srcHwAddr;
 
@@ -65,8 +96,10 @@ namespace Network{
 			}
 		}
 
-		// Insert into cache regardless of whether it was a reply or request
-		addressCache.insert(arp->srcPrAddr.value, arp->srcHwAddr);
+		// Insert into cache regardless of whether it was a reply or request, probes have no sender address
+		if(arp->srcPrAddr.value){
+			NeighbourUpdate(receiver, arp->srcPrAddr.value, arp->srcHwAddr);
+		}
 	}
 
 	void OnReceiveICMP(void* data, size_t length){
@@ -79,36 +112,61 @@ namespace Network{
 		Log::Info("[Network] [ICMP] Received packet, Type: %d, Code: %d", header->type, header->code);
 	}
 
-    void OnReceiveIPv4(void* data, size_t length){
-		if(length < sizeof(IPv4Header)){
+	// pkt starts at the TCP or UDP header, the checksum covers it and the pseudo header
+	static bool TransportChecksumValid(IPv4Header* header, NetworkPacket* pkt){
+		if(pkt->checksumVerified){
+			return true; // Already checked by the adapter
+		}
+
+		if(header->protocol == IPv4ProtocolUDP && pkt->length >= sizeof(UDPHeader) && !reinterpret_cast<UDPHeader*>(pkt->Data())->checksum.value){
+			return true; // No checksum was sent
+		}
+
+		uint64_t sum = ChecksumAdd(pkt->Data(), pkt->length, PseudoHeaderSum(header->sourceIP, header->destIP, header->protocol, pkt->length));
+		return ChecksumFold(sum) == 0xFFFF;
+	}
+
+    void OnReceiveIPv4(NetworkPacket* pkt){
+		if(pkt->length < sizeof(IPv4Header)){
 			Log::Warning("[Network] [IPv4] Discarding packet (too short)");
 			return;
 		}
 
-		IPv4Header* header = (IPv4Header*)data;
+		IPv4Header* header = (IPv4Header*)pkt->Data();
 
 		if(header->version != 4){
 			Log::Warning("[Network] [IPv4] Discarding packet (invalid version)");
 			return;
 		}
 
-		BigEndian<uint16_t> checksum = header->headerChecksum;
+		if(ChecksumFold(ChecksumAdd(header, sizeof(IPv4Header))) != 0xFFFF){ // Verify checksum
+			Log::Warning("[Network] [IPv4] Discarding packet (invalid checksum)");
+			return;
+		}
+
+		if((uint16_t)header->length < sizeof(IPv4Header) || (uint16_t)header->length > pkt->length){
+			Log::Warning("[Network] [IPv4] Discarding packet (invalid length)");
+			return;
+		}
 
-		header->headerChecksum = 0;
-		if(checksum.value != CaclulateChecksum(data, sizeof(IPv4Header)).value){ // Verify checksum
+		// The header stays where it is in the buffer, only the start of the packet moves
+		pkt->Trim(header->length);
+		pkt->Pull(sizeof(IPv4Header));
+
+		if((header->protocol == IPv4ProtocolUDP || header->protocol == IPv4ProtocolTCP) && !TransportChecksumValid(header, pkt)){
 			Log::Warning("[Network] [IPv4] Discarding packet (invalid checksum)");
 			return;
 		}
 
 		switch(header->protocol){
 			case IPv4ProtocolICMP:
-				OnReceiveICMP(header->data, length - sizeof(IPv4Header));
+				OnReceiveICMP(pkt->Data(), pkt->length);
 				break;
 			case IPv4ProtocolUDP:
-				UDP::OnReceiveUDP(*header, header->data, ((uint16_t)header->length) - sizeof(IPv4Header));
+				UDP::OnReceiveUDP(*header, pkt);
 				break;
 			case IPv4ProtocolTCP:
-				TCP::OnReceiveTCP(*header, header->data, ((uint16_t)header->length) - sizeof(IPv4Header));
+				TCP::OnReceiveTCP(*header, pkt->Data(), pkt->length);
 				break;
 			default:
 				Log::Warning("[Network] [IPv4] Discarding packet (invalid protocol %x)", header->protocol);
@@ -116,87 +174,104 @@ namespace Network{
 		}
 	}
 
-	[[noreturn]] void InterfaceThread(){
-		Log::Info("[Network] Initializing network interface layer...");
+	void OnReceive(NetworkAdapter* adapter, NetworkPacket* p){
+		if(p->length < sizeof(EthernetFrame)){
+			Log::Warning("[Network] Discarding packet (too short)");
 
-		for(;;){
-			NetworkPacket* p;
-			if(packetQueueSemaphore.Wait()){
-				continue; // We got interrupted
-			}
-			
-			for(NetworkAdapter* adapter : adapters){
-				if((p = adapter->Dequeue())){
-					if(p->length < sizeof(EthernetFrame)){
-						Log::Warning("[Network] Discarding packet (too short)");
+			p->Release();
+			return;
+		}
 
-						adapter->CachePacket(p);
-						break;
-					}
+		// Handled in place, anything that keeps the packet takes its own reference
+		EthernetFrame* etherFrame = reinterpret_cast<EthernetFrame*>(p->Data());
+		if(etherFrame->dest != adapter->mac && etherFrame->dest != MACAddress{0xff, 0xff, 0xff, 0xff, 0xff, 0xff}){
+			Log::Warning("[Network] Discarding packet (invalid MAC address %x:%x:%x:%x:%x:%x)", etherFrame->dest[0], etherFrame->dest[1], etherFrame->dest[2], etherFrame->dest[3], etherFrame->dest[4], etherFrame->dest[5]);
+			p->Release();
+			return;
+		}
 
-					size_t len = p->length;
-					uint8_t buffer[ETHERNET_MAX_PACKET_SIZE];
-					memcpy(buffer, p->data, p->length);
+		p->Pull(sizeof(EthernetFrame));
+		
+		switch ((uint16_t)etherFrame->etherType)
+		{
+		case EtherTypeIPv4:
+			OnReceiveIPv4(p);
+			break;
+		case EtherTypeARP:
+			OnReceiveARP(adapter, p->Data(), p->length);
+			break;
+		default:
+			Log::Warning("[Network] Discarding packet (invalid EtherType %x)", etherFrame->etherType);
+			break;
+		}
 
-					adapter->CachePacket(p); // Get the packet back to the NIC driver's cache as soon as possible
+		p->Release();
+	}
 
-					EthernetFrame* etherFrame = reinterpret_cast<EthernetFrame*>(buffer);
-					if(etherFrame->dest != adapter->mac && etherFrame->dest != MACAddress{0xff, 0xff, 0xff, 0xff, 0xff, 0xff}){
-						Log::Warning("[Network] Discarding packet (invalid MAC address %x:%x:%x:%x:%x:%x)", etherFrame->dest[0], etherFrame->dest[1], etherFrame->dest[2], etherFrame->dest[3], etherFrame->dest[4], etherFrame->dest[5]);
-						continue;
-					}
-					
-					switch ((uint16_t)etherFrame->etherType)
-					{
-					case EtherTypeIPv4:
-						OnReceiveIPv4(etherFrame->data, len - sizeof(EthernetFrame));
-						break;
-					case EtherTypeARP:
-						OnReceiveARP(etherFrame->data, len - sizeof(EthernetFrame));
-						break;
-					default:
-						Log::Warning("[Network] Discarding packet (invalid EtherType %x)", etherFrame->etherType);
+	void Send(void* data, size_t length, NetworkAdapter* adapter){
+		if(adapter){
+			adapter->SendPacket(data, length);
+		} else {
+			NetworkAdapter* first = nullptr;
+			{
+				RCU::ReadGuard guard;
+				for(NetworkAdapter* a : *RCU::Dereference(adapterTable)){
+					if(!a->IsLoopback()){
+						first = a;
 						break;
 					}
 				}
 			}
+
+			if(first){
+				first->SendPacket(data, length); // May block, so not within the read section
+			}
 		}
 	}
 
-	void InitializeNetworkThread(){
-		netProcess = Process::CreateKernelProcess((void*)InterfaceThread, "NetworkStack", nullptr);
-		netProcess->Start();
-	}
+	void Send(NetworkPacket* pkt, NetworkAdapter* adapter){
+		assert(adapter);
 
-	void Send(void* data, size_t length, NetworkAdapter* adapter){
-		if(adapter){
-			adapter->SendPacket(data, length);
-		} else for(auto& adapter : adapters){
-			adapter->SendPacket(data, length);
-			break;
-		}
+		adapter->SendPacket(pkt);
 	}
 
     int SendIPv4(void* data, size_t length, IPv4Address& source, IPv4Address& destination, uint8_t protocol, NetworkAdapter* adapter){
-		if(length > 1518 - sizeof(EthernetFrame) - sizeof(IPv4Header)){
+		if(length > ETHERNET_MAX_PACKET_SIZE - sizeof(EthernetFrame) - sizeof(IPv4Header)){
 			return -EMSGSIZE;
 		}
 
 		assert(adapter);
 
-		uint8_t buffer[1600]; // The maxmium Ethernet frame size is 1518 so this will do
+		NetworkPacket* pkt = adapter->AllocatePacket();
+		memcpy(pkt->Put(length), data, length);
+
+		return SendIPv4(pkt, source, destination, protocol, adapter);
+	}
+
+    int SendIPv4(NetworkPacket* pkt, IPv4Address& source, IPv4Address& destination, uint8_t protocol, NetworkAdapter* adapter){
+		assert(adapter);
+		assert(pkt->adapter == adapter);
+
+		if(!pkt->segmentSize && pkt->length > ETHERNET_MAX_PACKET_SIZE - sizeof(EthernetFrame) - sizeof(IPv4Header)){
+			pkt->Release();
+			return -EMSGSIZE;
+		}
+
+		size_t length = pkt->length;
+
+		IPv4Address nextHop = destination;
+		if(destination.value != INADDR_BROADCAST){
+			if(int status = Route(source, destination, nextHop, adapter); status < 0){
+				pkt->Release();
+				return status;
+			}
+		}
 
-		EthernetFrame* ethFrame = (EthernetFrame*)buffer;
+		IPv4Header* ipHeader = (IPv4Header*)pkt->Push(sizeof(IPv4Header));
+		EthernetFrame* ethFrame = (EthernetFrame*)pkt->Push(sizeof(EthernetFrame));
 		ethFrame->etherType = EtherTypeIPv4;
 		ethFrame->src = adapter->mac;
-		
-		if(destination.value == INADDR_BROADCAST){
-			ethFrame->dest = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff}; // Broadcast MAC Address
-		} else if(int status = Route(source, destination, ethFrame->dest, adapter); status < 0){
-			return status;
-		}
 
-		IPv4Header* ipHeader = (IPv4Header*)ethFrame->data;
 		memset(ipHeader, 0, sizeof(IPv4Header));
 
 		ipHeader->ihl = 5; // 5 dwords (20 bytes)
@@ -209,12 +284,18 @@ namespace Network{
 		ipHeader->destIP = destination;
 		ipHeader->sourceIP = adapter->adapterIP;
 
-		ipHeader->headerChecksum = CaclulateChecksum(ipHeader, sizeof(IPv4Header));
+		ipHeader->headerChecksum = Checksum(ipHeader, sizeof(IPv4Header));
 
-		memcpy(ipHeader->data, data, length);
-
-		Send(ethFrame, sizeof(EthernetFrame) + sizeof(IPv4Header) + length, adapter);
+		if(destination.value == INADDR_BROADCAST){
+			ethFrame->dest = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff}; // Broadcast MAC Address
+			Send(pkt, adapter);
+		} else if(adapter->IsLoopback()){
+			ethFrame->dest = adapter->mac; // No neighbours to resolve
+			Send(pkt, adapter);
+		} else {
+			NeighbourOutput(adapter, nextHop, pkt); // Held until ARP resolves the next hop if needed
+		}
 
 		return 0;
 	}
-}
\ No newline at end of file
+}
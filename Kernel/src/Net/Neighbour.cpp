@@ -0,0 +1,361 @@
+#include <Net/Net.h>
+
+#include <Net/Adapter.h>
+
+#include <Objects/Process.h>
+#include <List.h>
+#include <Lock.h>
+#include <Logging.h>
+#include <Timer.h>
+
+namespace Network {
+    enum NeighbourState {
+        NeighbourFree,
+        NeighbourIncomplete, // ARP request sent, waiting on the reply
+        NeighbourReachable,
+    };
+
+    // Entries are never freed once they are in a bucket so lookups can walk the buckets without a lock.
+    // A free entry is reused by the next neighbour hashed to the same bucket,
+    // readers check sequence to find out whether the entry changed whilst they were reading it.
+    struct Neighbour {
+        Neighbour* next = nullptr;
+        uint32_t sequence = 0; // Odd whilst being written
+
+        NetworkAdapter* adapter = nullptr;
+        IPv4Address ip = 0U;
+        MACAddress mac;
+        int state = NeighbourFree;
+        uint64_t confirmed = 0; // When the MAC address was last received
+
+        // Only used with tableLock held
+        uint64_t lastRequest = 0;
+        unsigned probes = 0; // ARP requests sent since the last reply
+        NetworkPacket* pending[NEIGHBOUR_QUEUE_MAX]; // Waiting on the MAC address
+        unsigned pendingCount = 0;
+    };
+
+    struct NeighbourRequest {
+        NetworkAdapter* adapter;
+        IPv4Address ip;
+    };
+
+    static lock_t tableLock = 0; // Held by writers
+    static Neighbour* table[NEIGHBOUR_TABLE_SIZE] = {};
+    static bool timerThreadStarted = false;
+
+    ALWAYS_INLINE static Neighbour*& Bucket(const IPv4Address& ip){
+        return table[((ip.value * 0x9E3779B1U) >> 16) % NEIGHBOUR_TABLE_SIZE];
+    }
+
+    ALWAYS_INLINE static void BeginWrite(Neighbour* n){
+        __atomic_store_n(&n->sequence, n->sequence + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+
+    ALWAYS_INLINE static void EndWrite(Neighbour* n){
+        __atomic_store_n(&n->sequence, n->sequence + 1, __ATOMIC_RELEASE);
+    }
+
+    // Lock free, an entry is read again if a writer changed it in the meantime
+    static bool FindReachable(NetworkAdapter* adapter, const IPv4Address& ip, MACAddress& mac, uint64_t& confirmed){
+        Neighbour* n = __atomic_load_n(&Bucket(ip), __ATOMIC_ACQUIRE);
+        for(; n; n = __atomic_load_n(&n->next, __ATOMIC_ACQUIRE)){
+            for(;;){
+                uint32_t sequence = __atomic_load_n(&n->sequence, __ATOMIC_ACQUIRE);
+                if(sequence & 1){
+                    asm volatile("pause");
+                    continue;
+                }
+
+                bool match = n->state == NeighbourReachable && n->adapter == adapter && n->ip.value == ip.value;
+                MACAddress entryMAC = n->mac;
+                uint64_t entryConfirmed = n->confirmed;
+
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if(__atomic_load_n(&n->sequence, __ATOMIC_RELAXED) != sequence){
+                    continue;
+                }
+
+                if(match){
+                    mac = entryMAC;
+                    confirmed = entryConfirmed;
+                    return true;
+                }
+                break;
+            }
+        }
+
+        return false;
+    }
+
+    // tableLock must be held
+    static Neighbour* Find(NetworkAdapter* adapter, const IPv4Address& ip){
+        for(Neighbour* n = Bucket(ip); n; n = n->next){
+            if(n->state != NeighbourFree && n->adapter == adapter && n->ip.value == ip.value){
+                return n;
+            }
+        }
+
+        return nullptr;
+    }
+
+    // Get a free entry in the bucket of ip, or add one. tableLock must be held
+    static Neighbour* Allocate(NetworkAdapter* adapter, const IPv4Address& ip){
+        Neighbour*& bucket = Bucket(ip);
+
+        Neighbour* n = bucket;
+        while(n && n->state != NeighbourFree){
+            n = n->next;
+        }
+
+        if(!n){
+            n = new Neighbour;
+            n->next = bucket;
+            __atomic_store_n(&bucket, n, __ATOMIC_RELEASE);
+        }
+
+        BeginWrite(n);
+        n->adapter = adapter;
+        n->ip = ip;
+        n->state = NeighbourIncomplete;
+        n->confirmed = 0;
+        EndWrite(n);
+
+        n->lastRequest = 0;
+        n->probes = 0;
+        n->pendingCount = 0;
+        return n;
+    }
+
+    // tableLock must be held
+    static void Free(Neighbour* n){
+        BeginWrite(n);
+        n->state = NeighbourFree;
+        n->adapter = nullptr;
+        EndWrite(n);
+    }
+
+    static void SendRequest(NetworkAdapter* adapter, const IPv4Address& ip){
+        uint8_t buffer[sizeof(EthernetFrame) + sizeof(ARPHeader)];
+
+        EthernetFrame* ethFrame = reinterpret_cast<EthernetFrame*>(buffer);
+        ethFrame->etherType = EtherTypeARP;
+        ethFrame->src = adapter->mac;
+        ethFrame->dest = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+        ARPHeader* arp = reinterpret_cast<ARPHeader*>(buffer + sizeof(EthernetFrame));
+        arp->destHwAddr = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+        arp->srcHwAddr = adapter->mac;
+        arp->hLength = 6;
+        arp->hwType = 1; // Ethernet
+
+        arp->destPrAddr = ip.value;
+        arp->srcPrAddr = adapter->adapterIP.value;
+        arp->pLength = 4;
+        arp->prType = EtherTypeIPv4;
+
+        arp->opcode = ARPHeader::ARPRequest;
+
+        Network::Send(buffer, sizeof(EthernetFrame) + sizeof(ARPHeader), adapter);
+    }
+
+    static void SendPending(NetworkAdapter* adapter, const MACAddress& mac, NetworkPacket** pending, unsigned count){
+        for(unsigned i = 0; i < count; i++){
+            reinterpret_cast<EthernetFrame*>(pending[i]->Data())->dest = mac;
+            Send(pending[i], adapter);
+        }
+    }
+
+    // Resends ARP requests, gives up on neighbours that do not reply and frees entries that have not been confirmed in a while
+    static void TimerThread(){
+        for(;;){
+            Thread::Current()->Sleep(NEIGHBOUR_TIMER_INTERVAL);
+
+            uint64_t now = Timer::UsecondsSinceBoot();
+            List<NeighbourRequest> requests;
+            List<NetworkPacket*> dropped;
+
+            acquireLock(&tableLock);
+            for(Neighbour* bucket : table){
+                for(Neighbour* n = bucket; n; n = n->next){
+                    if(n->state == NeighbourReachable){
+                        if(now - n->confirmed >= NEIGHBOUR_STALE_TIME){
+                            Free(n); // Resolved again the next time it is sent to
+                        }
+                        continue;
+                    } else if(n->state != NeighbourIncomplete || now - n->lastRequest < NEIGHBOUR_RETRANSMIT_TIME){
+                        continue;
+                    }
+
+                    if(n->probes < NEIGHBOUR_MAX_PROBES){
+                        n->probes++;
+                        n->lastRequest = now;
+                        requests.add_back({n->adapter, n->ip});
+                        continue;
+                    }
+
+                    Log::Debug(debugLevelNetwork, DebugLevelNormal, "[Network] [ARP] No reply from %d.%d.%d.%d", n->ip.data[0], n->ip.data[1], n->ip.data[2], n->ip.data[3]);
+
+                    for(unsigned i = 0; i < n->pendingCount; i++){
+                        dropped.add_back(n->pending[i]);
+                    }
+                    Free(n);
+                }
+            }
+            releaseLock(&tableLock);
+
+            for(NeighbourRequest& request : requests){
+                SendRequest(request.adapter, request.ip);
+            }
+
+            for(NetworkPacket* pkt : dropped){
+                pkt->Release();
+            }
+        }
+    }
+
+    static void StartTimerThread(){
+        if(!__atomic_exchange_n(&timerThreadStarted, true, __ATOMIC_ACQ_REL)){
+            auto proc = Process::CreateKernelProcess((void*)TimerThread, "NeighbourTimer", nullptr);
+            proc->Start();
+        }
+    }
+
+    bool NeighbourLookup(NetworkAdapter* adapter, const IPv4Address& ip, MACAddress& mac){
+        uint64_t confirmed;
+        return FindReachable(adapter, ip, mac, confirmed);
+    }
+
+    void NeighbourOutput(NetworkAdapter* adapter, const IPv4Address& ip, NetworkPacket* pkt){
+        MACAddress mac;
+        uint64_t confirmed;
+        uint64_t now = Timer::UsecondsSinceBoot();
+
+        if(FindReachable(adapter, ip, mac, confirmed)){
+            bool refresh = false;
+            if(now - confirmed >= NEIGHBOUR_REACHABLE_TIME){
+                // Still in use, check the neighbour is still there before the entry goes stale
+                acquireLock(&tableLock);
+                Neighbour* n = Find(adapter, ip);
+                if(n && n->state == NeighbourReachable && now - n->lastRequest >= NEIGHBOUR_RETRANSMIT_TIME){
+                    n->lastRequest = now;
+                    refresh = true;
+                }
+                releaseLock(&tableLock);
+            }
+
+            if(refresh){
+                SendRequest(adapter, ip);
+            }
+
+            if(pkt){
+                SendPending(adapter, mac, &pkt, 1);
+            }
+            return;
+        }
+
+        bool request = false;
+        bool resolved = false;
+        NetworkPacket* dropped = nullptr;
+
+        acquireLock(&tableLock);
+        Neighbour* n = Find(adapter, ip);
+        if(n && n->state == NeighbourReachable){
+            mac = n->mac; // Resolved since we looked
+            resolved = true;
+        } else {
+            if(!n){
+                n = Allocate(adapter, ip);
+                n->probes = 1;
+                n->lastRequest = now;
+                request = true;
+            }
+
+            if(pkt){
+                if(n->pendingCount == NEIGHBOUR_QUEUE_MAX){
+                    // Keep the newest packets
+                    dropped = n->pending[0];
+                    for(unsigned i = 1; i < NEIGHBOUR_QUEUE_MAX; i++){
+                        n->pending[i - 1] = n->pending[i];
+                    }
+                    n->pendingCount--;
+                }
+
+                n->pending[n->pendingCount++] = pkt;
+            }
+        }
+        releaseLock(&tableLock);
+
+        if(resolved){
+            if(pkt){
+                SendPending(adapter, mac, &pkt, 1);
+            }
+            return;
+        }
+
+        if(dropped){
+            dropped->Release();
+        }
+
+        if(request){
+            StartTimerThread();
+            SendRequest(adapter, ip);
+        }
+    }
+
+    void NeighbourUpdate(NetworkAdapter* adapter, const IPv4Address& ip, const MACAddress& mac){
+        NetworkPacket* pending[NEIGHBOUR_QUEUE_MAX];
+        unsigned pendingCount = 0;
+        bool created = false;
+
+        acquireLock(&tableLock);
+        Neighbour* n = Find(adapter, ip);
+        if(!n){
+            n = Allocate(adapter, ip);
+            created = true;
+        }
+
+        BeginWrite(n);
+        n->mac = mac;
+        n->state = NeighbourReachable;
+        n->confirmed = Timer::UsecondsSinceBoot();
+        EndWrite(n);
+
+        n->probes = 0;
+
+        pendingCount = n->pendingCount;
+        memcpy(pending, n->pending, pendingCount * sizeof(NetworkPacket*));
+        n->pendingCount = 0;
+        releaseLock(&tableLock);
+
+        if(created){
+            StartTimerThread();
+        }
+
+        SendPending(adapter, mac, pending, pendingCount);
+    }
+
+    void NeighbourFlush(NetworkAdapter* adapter){
+        List<NetworkPacket*> dropped;
+
+        acquireLock(&tableLock);
+        for(Neighbour* bucket : table){
+            for(Neighbour* n = bucket; n; n = n->next){
+                if(n->state == NeighbourFree || n->adapter != adapter){
+                    continue;
+                }
+
+                for(unsigned i = 0; i < n->pendingCount; i++){
+                    dropped.add_back(n->pending[i]);
+                }
+                Free(n);
+            }
+        }
+        releaseLock(&tableLock);
+
+        for(NetworkPacket* pkt : dropped){
+            pkt->Release();
+        }
+    }
+}
@@ -6,69 +6,21 @@
 #include <Endian.h>
 #include <Logging.h>
 #include <Errno.h>
-#include <Hash.h>
+#include <RCU.h>
 
 namespace Network {
     NetFS netFS;
 
     lock_t adaptersLock = 0;
-    Vector<NetworkAdapter*> adapters;
-
-    HashMap<uint32_t, MACAddress> addressCache;
+    AdapterTable* adapterTable = new AdapterTable;
 
     void InitializeConnections(){
-        InitializeNetworkThread();
-    }
-
-    int IPLookup(NetworkAdapter* adapter, const IPv4Address& ip, MACAddress& mac){
-        if(addressCache.get(ip.value, mac)){
-            return 0;
-        }
-
-        uint8_t buffer[sizeof(EthernetFrame) + sizeof(ARPHeader)];
-        
-		EthernetFrame* ethFrame = reinterpret_cast<EthernetFrame*>(buffer);
-		ethFrame->etherType = EtherTypeARP;
-		ethFrame->src = adapter->mac;
-		ethFrame->dest = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
-
-        ARPHeader* arp = reinterpret_cast<ARPHeader*>(buffer + sizeof(EthernetFrame));
-        arp->destHwAddr = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
-        arp->srcHwAddr = adapter->mac;
-        arp->hLength = 6;
-        arp->hwType = 1; // Ethernet
-
-        arp->destPrAddr = ip.value;
-        arp->srcPrAddr = adapter->adapterIP.value;
-        arp->pLength = 4;
-        arp->prType = EtherTypeARP;
-
-        arp->opcode = ARPHeader::ARPRequest;
-
-        Network::Send(buffer, sizeof(EthernetFrame) + sizeof(ARPHeader), adapter);
-
-        assert(CheckInterrupts());
-
-        auto t1 = Timer::GetSystemUptimeStruct();
-        int status = 0;
-        while(!(status = addressCache.find(ip.value)) && Timer::TimeDifference(Timer::GetSystemUptimeStruct(), t1) < 2000000){
-            Scheduler::Yield();
-        }
-
-        if(status <= 0){
-            IF_DEBUG((debugLevelNetwork >= DebugLevelNormal), {
-                Log::Warning("[Network] [ARP] Timed out waiting for ARP reply.");
-            });
-            return -EADDRNOTAVAIL;
-        }
+        Log::Info("[Network] Initializing network interface layer..."); // Each adapter starts its own processing threads
 
-        status = addressCache.get(ip.value, mac);
-        assert(status > 0);
-
-        return 0;
+        InitializeLoopback();
     }
 
-    int Route(const IPv4Address& local, const IPv4Address& dest, MACAddress& mac, NetworkAdapter*& adapter){
+    int Route(const IPv4Address& local, const IPv4Address& dest, IPv4Address& nextHop, NetworkAdapter*& adapter){
         bool isLocalDestination = false;
         IPv4Address localDestination;
 
@@ -87,7 +39,8 @@ namespace Network {
                 localDestination = adapter->gatewayIP; // Destination is to WAN, 
             }
         } else {
-            for(NetworkAdapter* a : adapters){
+            RCU::ReadGuard guard;
+            for(NetworkAdapter* a : *RCU::Dereference(adapterTable)){
                 if(local.value != INADDR_ANY && a->adapterIP.value != local.value){
                     continue; // Local address does not correspond to the adapter IP address
                 }
@@ -109,18 +62,8 @@ namespace Network {
             return -ENETUNREACH;
         }
 
-        if(isLocalDestination){
-            int status = IPLookup(adapter, dest, mac);
-            if(status < 0){
-                return status; // Error obtaining MAC address for IP
-            }
-        } else {
-            int status = IPLookup(adapter, adapter->gatewayIP, mac);
-            if(status < 0){
-                return status; // Error obtaining MAC address for IP
-            }
-        }
-        
+        // The MAC address is resolved when sending, so routing never waits on ARP
+        nextHop = isLocalDestination ? dest : adapter->gatewayIP;
         return 0;
     }
 
@@ -147,11 +90,13 @@ namespace Network {
             return 1;
         }
 
-        if(index >= adapters.get_length() + 2){
+        RCU::ReadGuard guard;
+        AdapterTable* table = RCU::Dereference(adapterTable);
+        if(index >= table->count + 2){
             return 0; // Out of range
         }
 
-        NetworkAdapter* adapter = adapters[index - 2];
+        NetworkAdapter* adapter = table->adapters[index - 2];
         strcpy(dirent->name, adapter->InstanceName().c_str());
 
         dirent->flags = FS_NODE_CHARDEVICE;
@@ -166,7 +111,8 @@ namespace Network {
             return DeviceManager::GetDevFS();
         }
 
-        for(NetworkAdapter* adapter : adapters){
+        RCU::ReadGuard guard;
+        for(NetworkAdapter* adapter : *RCU::Dereference(adapterTable)){
             if(strcmp(name, adapter->InstanceName().c_str()) == 0){
                 return adapter;
             }
@@ -178,32 +124,58 @@ namespace Network {
     void NetFS::RegisterAdapter(NetworkAdapter* adapter){
         acquireLock(&adaptersLock);
 
-        adapter->adapterIndex = adapters.get_length();
-        adapters.add_back(adapter);
+        AdapterTable* old = adapterTable;
+        AdapterTable* table = new AdapterTable;
+        table->count = old->count + 1;
+        table->adapters = new NetworkAdapter*[table->count];
+        memcpy(table->adapters, old->adapters, old->count * sizeof(NetworkAdapter*));
+
+        adapter->adapterIndex = old->count;
+        table->adapters[old->count] = adapter;
 
+        RCU::Assign(adapterTable, table);
         releaseLock(&adaptersLock);
+
+        RCU::Retire(old);
+
+        adapter->StartProcessing();
     }
 
     void NetFS::RemoveAdapter(NetworkAdapter* adapter){
         acquireLock(&adaptersLock);
 
-        for(unsigned i = 0; i < adapters.get_length(); i++){
-            if(adapters[i] == adapter){
+        AdapterTable* old = adapterTable;
+        AdapterTable* table = nullptr;
+        for(unsigned i = 0; i < old->count; i++){
+            if(old->adapters[i] == adapter){
                 for(IPSocket* sock : adapter->boundSockets){
                     sock->adapter = nullptr;
                 }
                 adapter->boundSockets.clear();
 
-                adapters.erase(i);
+                table = new AdapterTable;
+                table->count = old->count - 1;
+                table->adapters = new NetworkAdapter*[old->count];
+                memcpy(table->adapters, old->adapters, i * sizeof(NetworkAdapter*));
+                memcpy(table->adapters + i, old->adapters + i + 1, (old->count - i - 1) * sizeof(NetworkAdapter*));
+
+                RCU::Assign(adapterTable, table);
                 break;
             }
         }
 
         releaseLock(&adaptersLock);
+
+        if(table){
+            RCU::Retire(old);
+        }
+
+        NeighbourFlush(adapter);
     }
 
     NetworkAdapter* NetFS::FindAdapter(const char* name, size_t len){
-        for(NetworkAdapter* adapter : adapters){
+        RCU::ReadGuard guard;
+        for(NetworkAdapter* adapter : *RCU::Dereference(adapterTable)){
             if(strncmp(name, adapter->InstanceName().c_str(), len) == 0){
                 return adapter;
             }
@@ -213,7 +185,8 @@ namespace Network {
     }
 
     NetworkAdapter* NetFS::FindAdapter(uint32_t ip){
-        for(NetworkAdapter* adapter : adapters){
+        RCU::ReadGuard guard;
+        for(NetworkAdapter* adapter : *RCU::Dereference(adapterTable)){
             if(adapter->adapterIP.value == ip){
                 return adapter; // Found adapter with IP address
             }
@@ -1,13 +1,45 @@
 #include <Net/Adapter.h>
 
+#include <ABI/Network.h>
 #include <List.h>
 #include <Logging.h>
 #include <Assert.h>
 #include <Errno.h>
 #include <Net/Socket.h>
+#include <Hash.h>
+#include <Math.h>
+#include <Objects/Process.h>
+#include <Paging.h>
+#include <PhysicalAllocator.h>
+#include <RCU.h>
+#include <SMP.h>
+#include <UserPointer.h>
+
+NetworkPacket::NetworkPacket() {
+    physicalAddress = Memory::AllocatePhysicalMemoryBlock();
+    buffer = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(1));
+    Memory::KernelMapVirtualMemory4K(physicalAddress, reinterpret_cast<uintptr_t>(buffer), 1);
+}
+
+NetworkPacket::~NetworkPacket() {
+    Memory::KernelFree4KPages(buffer, 1);
+    Memory::FreePhysicalMemoryBlock(physicalAddress);
+}
+
+void NetworkPacket::Release() {
+    if (__atomic_sub_fetch(&refCount, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+
+    if (adapter) {
+        adapter->CachePacket(this);
+    } else {
+        delete this;
+    }
+}
 
 namespace Network {
-    extern Vector<NetworkAdapter*> adapters;
+    unsigned NetworkAdapter::interruptRate = NETWORK_INTERRUPT_RATE_DEFAULT;
 
     NetworkAdapter::NetworkAdapter(AdapterType aType) : Device(DeviceTypeNetworkAdapter, NetFS::GetInstance()), type(aType) {
         flags = FS_NODE_CHARDEVICE;
@@ -17,49 +49,122 @@ namespace Network {
         assert(!"NetworkAdapter: Base class SendPacket has been called");
     }
 
+    void NetworkAdapter::SendPacket(NetworkPacket* pkt){
+        SendPacket(pkt->Data(), pkt->length);
+        pkt->Release();
+    }
+
     int NetworkAdapter::GetLink() const {
         return linkState;
     }
 
     int NetworkAdapter::QueueSize() const {
-        return queue.get_length();
+        return __atomic_load_n(&queuedPackets, __ATOMIC_RELAXED);
     }
 
-    NetworkPacket* NetworkAdapter::Dequeue() { 
-        ScopedSpinLock lock{queueLock};
-        if(queue.get_length()) {
-            packetSemaphore.SetValue(queue.get_length() - 1);
-            return queue.remove_at(0); 
-        } else {
-            return nullptr;
+    // Hash of the IPv4 addresses, protocol and ports of a frame, 0 for anything else
+    static unsigned FlowHash(NetworkPacket* pkt){
+        if(pkt->length < sizeof(EthernetFrame) + sizeof(IPv4Header)){
+            return 0;
+        }
+
+        EthernetFrame* etherFrame = reinterpret_cast<EthernetFrame*>(pkt->Data());
+        if((uint16_t)etherFrame->etherType != EtherTypeIPv4){
+            return 0; // ARP and the like all go to the first thread
+        }
+
+        IPv4Header* header = reinterpret_cast<IPv4Header*>(etherFrame->data);
+        unsigned hash = HashU(header->sourceIP.value ^ HashU(header->destIP.value ^ header->protocol));
+
+        // Fragments after the first have no ports, leave them out for all fragments so they stay together
+        const uint8_t* raw = reinterpret_cast<const uint8_t*>(header);
+        bool fragment = (raw[6] & 0x3F) || raw[7]; // More fragments flag or a fragment offset
+
+        size_t headerLength = header->ihl * 4;
+        if((header->protocol == IPv4ProtocolTCP || header->protocol == IPv4ProtocolUDP) && !fragment
+            && pkt->length >= sizeof(EthernetFrame) + headerLength + sizeof(uint32_t)){
+            uint32_t ports;
+            memcpy(&ports, etherFrame->data + headerLength, sizeof(uint32_t)); // Source and destination port
+            hash = HashU(hash ^ ports);
+        }
+
+        return hash;
+    }
+
+    void NetworkAdapter::Receive(NetworkPacket* pkt){
+        ReceiveQueue& q = rxQueues[FlowHash(pkt) % rxQueueCount];
+
+        __atomic_add_fetch(&queuedPackets, 1, __ATOMIC_RELAXED);
+        if(!q.packets.Push(pkt)){
+            __atomic_sub_fetch(&queuedPackets, 1, __ATOMIC_RELAXED);
+
+            IF_DEBUG(debugLevelNetwork >= DebugLevelVerbose, {
+                Log::Warning("[Network] Receive queue full, dropping packet");
+            });
+
+            pkt->Release();
+            return;
+        }
+
+        if(__atomic_exchange_n(&q.sleeping, false, __ATOMIC_SEQ_CST)){
+            q.semaphore.Signal();
         }
     }
 
-    NetworkPacket* NetworkAdapter::DequeueBlocking() {
-        if(packetSemaphore.Wait()){
-            return nullptr; // We were interrupted
+    void NetworkAdapter::StartProcessing(){
+        rxQueueCount = MIN(SMP::processorCount, NETWORK_RX_QUEUES);
+        if(!rxQueueCount){
+            rxQueueCount = 1;
         }
-        
-        ScopedSpinLock lock{queueLock};
-        if(queue.get_length()){
-            return queue.remove_at(0); 
-        } else {
-            return nullptr;
+
+        for(unsigned i = 0; i < rxQueueCount; i++){
+            rxQueues[i].adapter = this;
+
+            auto proc = Process::CreateKernelProcess((void*)ProcessingThread, "NetworkStack", nullptr);
+            proc->GetMainThread()->registers.rdi = reinterpret_cast<uintptr_t>(&rxQueues[i]);
+            proc->Start();
         }
     }
-    
-    void NetworkAdapter::CachePacket(NetworkPacket* pkt){
-        if(cache.get_length() < maxCache){
-            acquireLock(&cacheLock);
 
-            cache.add_back(pkt);
+    void NetworkAdapter::ProcessingThread(ReceiveQueue* q){
+        NetworkPacket* batch[NETWORK_RX_BATCH];
+        for(;;){
+            while(unsigned count = q->packets.PopBatch(batch, NETWORK_RX_BATCH)){
+                __atomic_sub_fetch(&q->adapter->queuedPackets, count, __ATOMIC_RELAXED);
 
-            releaseLock(&cacheLock);
-        } else {
-            delete pkt;
+                for(unsigned i = 0; i < count; i++){
+                    OnReceive(q->adapter, batch[i]);
+                }
+            }
+
+            // Ask to be woken, then check again for a packet pushed in between
+            __atomic_store_n(&q->sleeping, true, __ATOMIC_SEQ_CST);
+            if(!q->packets.Empty() && __atomic_exchange_n(&q->sleeping, false, __ATOMIC_SEQ_CST)){
+                continue; // Nobody else will signal
+            }
+
+            (void)q->semaphore.Wait(); // Spurious and interrupted wakeups just go around again
         }
+    }
+    
+    void NetworkAdapter::CachePacket(NetworkPacket* pkt){
+        packetCache.Free(pkt);
     };
 
+    NetworkPacket* NetworkAdapter::AllocatePacket(){
+        NetworkPacket* pkt = packetCache.Allocate();
+        pkt->adapter = this;
+        pkt->refCount = 1;
+        pkt->offset = NETWORK_PACKET_HEADROOM;
+        pkt->length = 0;
+        pkt->checksumVerified = false;
+        pkt->checksumStart = 0;
+        pkt->checksumOffset = 0;
+        pkt->segmentSize = 0;
+
+        return pkt;
+    }
+
     int NetworkAdapter::Ioctl(uint64_t cmd, uint64_t arg){
         Process* currentProcess = Scheduler::GetCurrentProcess();
 
@@ -100,8 +205,40 @@ namespace Network {
             namedAdapter->gatewayIP.value = addr->sin_addr.s_addr;
 
             // Add the gateway to the ARP cache
-            MACAddress mac;
-            IPLookup(namedAdapter, namedAdapter->gatewayIP, mac);
+            NeighbourOutput(namedAdapter, namedAdapter->gatewayIP, nullptr);
+            return 0;
+        } else if(cmd == SIOCSIFCONFIG){
+            InterfaceConfiguration* config = reinterpret_cast<InterfaceConfiguration*>(arg);
+            if(!Memory::CheckUsermodePointer(arg, sizeof(InterfaceConfiguration), currentProcess->addressSpace)){
+                return -EFAULT;
+            }
+
+            if(currentProcess->euid != 0){
+                IF_DEBUG(debugLevelNetwork >= DebugLevelVerbose, {
+                    Log::Warning("[Network] NetworkAdapter::Ioctl: Attempted SIOCSIFCONFIG as EUID %d!", currentProcess->euid);
+                });
+                return -EPERM; // We are not root
+            }
+
+            NetworkAdapter* namedAdapter = NetFS::GetInstance()->FindAdapter(config->name, IF_NAMESIZE);
+            if(!namedAdapter){
+                return -ENODEV;
+            }
+
+            // Neighbours found with the old address may no longer be on the subnet
+            bool moved = namedAdapter->adapterIP.value != config->address || namedAdapter->subnetMask.value != config->subnetMask;
+
+            namedAdapter->adapterIP.value = config->address;
+            namedAdapter->subnetMask.value = config->subnetMask;
+            namedAdapter->gatewayIP.value = config->gateway;
+
+            if(moved){
+                NeighbourFlush(namedAdapter);
+            }
+
+            if(namedAdapter->gatewayIP.value){
+                NeighbourOutput(namedAdapter, namedAdapter->gatewayIP, nullptr);
+            }
             return 0;
         } else if(cmd >= SIOCGIFNAME && cmd <= SIOCGIFCOUNT){
             ifreq* req = reinterpret_cast<ifreq*>(arg);
@@ -116,13 +253,27 @@ namespace Network {
             }
 
             switch(cmd){
-            case SIOCGIFNAME:
-                if(req->ifr_ifindex >= adapters.get_length()){
-                    return -ENOENT;
+            case SIOCGIFNAME: {
+                int index = req->ifr_ifindex;
+
+                // Touching user memory can block on a page fault, which is not allowed in a read section
+                char name[IF_NAMESIZE];
+                {
+                    RCU::ReadGuard guard;
+                    AdapterTable* table = RCU::Dereference(adapterTable);
+                    if(index < 0 || static_cast<unsigned>(index) >= table->count){
+                        return -ENOENT;
+                    }
+
+                    strncpy(name, table->adapters[index]->instanceName.c_str(), IF_NAMESIZE - 1);
+                    name[IF_NAMESIZE - 1] = 0;
+                }
+
+                if(CopyToUser(req->ifr_name, name, strlen(name) + 1)){
+                    return -EFAULT;
                 }
-                
-                strcpy(req->ifr_name, adapters[req->ifr_ifindex]->instanceName.c_str());
                 break;
+            }
             case SIOCGIFADDR: {
                 sockaddr_in* addr = reinterpret_cast<sockaddr_in*>(&req->ifr_addr);
                 addr->sin_family = SocketProtocol::InternetProtocol;
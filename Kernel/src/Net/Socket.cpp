@@ -3,6 +3,8 @@
 #include <Assert.h>
 #include <Errno.h>
 #include <Logging.h>
+#include <Math.h>
+#include <Objects/Process.h>
 #include <Scheduler.h>
 
 int Socket::CreateSocket(int domain, int type, int protocol, Socket** sock) {
@@ -76,7 +78,7 @@ int64_t Socket::Receive(void* buffer, size_t len, int flags) {
 }
 
 int64_t Socket::ReceiveFrom(void* buffer, size_t len, int flags, sockaddr* src, socklen_t* addrlen,
-                            const void* ancillary, size_t ancillaryLen) {
+                            void* ancillary, size_t* ancillaryLen) {
     assert(!"ReceiveFrom has been called from socket base");
 
     return -1; // We should not return but get the compiler to shut up
@@ -139,18 +141,110 @@ void Socket::Watch(FilesystemWatcher& watcher, int events) { assert(!"Socket::Wa
 
 void Socket::Unwatch(FilesystemWatcher& watcher) { assert(!"Socket::Unwatch called from socket base"); }
 
+static lock_t peerLock = 0; // Held whilst disconnecting LocalSocket::peer
+
+// Control message headers are padded like CMSG_ALIGN
+ALWAYS_INLINE static constexpr size_t ControlAlign(size_t len) { return (len + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1); }
+
+// Take a reference to each file descriptor in an SCM_RIGHTS message
+static int CopyRights(const void* control, size_t controlLength, LocalSocketRights*& rights) {
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(control);
+    Process* process = Process::Current();
+
+    size_t offset = 0;
+    while (offset + sizeof(cmsghdr) <= controlLength) {
+        const cmsghdr* cmsg = reinterpret_cast<const cmsghdr*>(data + offset);
+        if (cmsg->cmsg_len < ControlAlign(sizeof(cmsghdr)) || cmsg->cmsg_len > controlLength - offset) {
+            delete rights;
+            rights = nullptr;
+            return -EINVAL;
+        }
+
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            size_t count = (cmsg->cmsg_len - ControlAlign(sizeof(cmsghdr))) / sizeof(int);
+            if (rights || !count || count > LOCAL_SOCKET_MAX_RIGHTS) {
+                delete rights;
+                rights = nullptr;
+                return -EINVAL;
+            }
+
+            rights = new LocalSocketRights;
+
+            const int* fds = reinterpret_cast<const int*>(data + offset + ControlAlign(sizeof(cmsghdr)));
+            for (unsigned i = 0; i < count; i++) {
+                Handle h = process->GetHandle(fds[i]);
+                if (!h.IsValid()) {
+                    delete rights;
+                    rights = nullptr;
+                    return -EBADF;
+                }
+
+                rights->objects[rights->count++] = std::move(h.ko);
+            }
+        }
+
+        offset += ControlAlign(cmsg->cmsg_len);
+    }
+
+    return 0;
+}
+
+// Give the receiving process a handle to each object, as many as fit in the control buffer.
+// Returns the length of the control message written.
+static size_t InstallRights(LocalSocketRights* rights, void* control, size_t capacity, bool closeOnExec) {
+    const size_t header = ControlAlign(sizeof(cmsghdr));
+    if (!control || capacity < header + sizeof(int)) {
+        return 0; // Nowhere to put them, the objects are dropped
+    }
+
+    Process* process = Process::Current();
+    unsigned count = MIN(rights->count, (capacity - header) / sizeof(int));
+
+    int* fds = reinterpret_cast<int*>(reinterpret_cast<uint8_t*>(control) + header);
+    for (unsigned i = 0; i < count; i++) {
+        fds[i] = process->AllocateHandle(rights->objects[i], closeOnExec);
+    }
+
+    cmsghdr* cmsg = reinterpret_cast<cmsghdr*>(control);
+    cmsg->cmsg_len = header + count * sizeof(int);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+
+    return cmsg->cmsg_len;
+}
+
+LocalSocketStream::~LocalSocketStream() {
+    for (LocalSocketRights* r : rights) {
+        delete r;
+    }
+}
+
+void LocalSocketStream::WakeReader() {
+    ScopedSpinLock lockEnds(ring.endLock);
+    if (reader) {
+        reader->SignalWatchers();
+        reader->UnblockAll();
+    }
+}
+
+void LocalSocketStream::WakeWriter() {
+    ScopedSpinLock lockEnds(ring.endLock);
+    if (writer) {
+        writer->SignalWatchers();
+        writer->UnblockAll();
+    }
+}
+
 LocalSocket::LocalSocket(int type, int protocol) : Socket(type, protocol) {
     domain = UnixDomain;
     flags = FS_NODE_SOCKET;
 
     assert(type == StreamSocket || type == DatagramSocket);
 
+    // Stream sockets get their rings when they are connected
     if (type == DatagramSocket) {
         inbound = new PacketStream();
         outbound = new PacketStream();
-    } else {
-        inbound = new DataStream(1024);
-        outbound = new DataStream(1024);
     }
 }
 
@@ -171,16 +265,26 @@ LocalSocket::~LocalSocket() {
 LocalSocket* LocalSocket::CreatePairedSocket(LocalSocket* client) {
     LocalSocket* sock = new LocalSocket(client->type, 0);
 
-    if (sock->outbound) {
-        delete sock->outbound;
-    }
+    if (sock->type == StreamSocket) {
+        // One ring for each direction
+        sock->m_send = new LocalSocketStream();
+        sock->m_send->writer = sock;
+        sock->m_send->reader = client;
 
-    if (sock->inbound) {
+        sock->m_receive = new LocalSocketStream();
+        sock->m_receive->writer = client;
+        sock->m_receive->reader = sock;
+
+        client->m_send = sock->m_receive;
+        client->m_receive = sock->m_send;
+    } else {
+        delete sock->outbound;
         delete sock->inbound;
+
+        sock->outbound = client->inbound; // Outbound to client
+        sock->inbound = client->outbound; // Inbound to server
     }
 
-    sock->outbound = client->inbound; // Outbound to client
-    sock->inbound = client->outbound; // Inbound to server
     sock->peer = client;
     client->peer = sock;
 
@@ -198,11 +302,7 @@ int LocalSocket::ConnectTo(LocalSocket* client) {
 
     pending.add_back(client);
 
-    acquireLock(&m_watcherLock);
-    while (m_watching.get_length()) {
-        m_watching.remove_at(0)->Signal();
-    }
-    releaseLock(&m_watcherLock);
+    SignalWatchers();
 
     while (!client->m_connected) {
         // TODO: Actually block the task
@@ -214,22 +314,10 @@ int LocalSocket::ConnectTo(LocalSocket* client) {
     return 0;
 }
 
-void LocalSocket::DisconnectPeer() {
-    assert(peer);
-
-    peer->OnDisconnect();
-
-    peer = nullptr;
-}
-
 void LocalSocket::OnDisconnect() {
     m_connected = false;
 
-    acquireLock(&m_watcherLock);
-    while (m_watching.get_length()) {
-        m_watching.remove_at(0)->Signal(); // Signal all watching on disconnect
-    }
-    releaseLock(&m_watcherLock);
+    SignalWatchers(); // Signal all watching on disconnect
 
     peer = nullptr;
 }
@@ -356,17 +444,28 @@ int LocalSocket::Listen(int backlog) {
 }
 
 int64_t LocalSocket::ReceiveFrom(void* buffer, size_t len, int flags, sockaddr* src, socklen_t* addrlen,
-                                 const void* ancillary, size_t ancillaryLen) {
+                                 void* ancillary, size_t* ancillaryLen) {
     if (type == StreamSocket) {
-        if (src || addrlen) {
-            return -EISCONN;
+        if (addrlen) {
+            *addrlen = 0; // Connected, there is no source address
+        }
+
+        if (!m_receive) {
+            Log::Warning("LocalSocket::ReceiveFrom: LocalSocket not connected");
+            return -ENOTCONN;
         }
+
+        return StreamReceive(reinterpret_cast<uint8_t*>(buffer), len, flags, ancillary, ancillaryLen);
     } else if (type == DatagramSocket) {
         if (src || addrlen) {
             return -EOPNOTSUPP;
         }
     }
 
+    if (ancillaryLen) {
+        *ancillaryLen = 0; // No ancillary data
+    }
+
     if (!inbound) {
         Log::Warning("LocalSocket::ReceiveFrom: LocalSocket not connected");
         return -ENOTCONN;
@@ -392,6 +491,13 @@ int64_t LocalSocket::SendTo(void* buffer, size_t len, int flags, const sockaddr*
         if (src || addrlen) {
             return -EISCONN;
         }
+
+        if (!m_send) {
+            Log::Warning("LocalSocket::SendTo: LocalSocket not connected");
+            return -ENOTCONN;
+        }
+
+        return StreamSend(reinterpret_cast<uint8_t*>(buffer), len, flags, ancillary, ancillaryLen);
     } else if (type == DatagramSocket) {
         if (src || addrlen) {
             return -EOPNOTSUPP;
@@ -403,21 +509,166 @@ int64_t LocalSocket::SendTo(void* buffer, size_t len, int flags, const sockaddr*
         return -ENOTCONN;
     }
 
-    if (type == StreamSocket && (flags & MSG_DONTWAIT) && outbound->Pos() + len >= STREAM_MAX_BUFSIZE) {
-        return -EAGAIN;
-    } else
-        while (type == StreamSocket && outbound->Pos() + len >= STREAM_MAX_BUFSIZE) {
-            Scheduler::Yield();
-        }
-
     int64_t written = outbound->Write(buffer, len);
 
+    ScopedSpinLock lockPeer(peerLock);
     if (peer && peer->CanRead()) {
-        acquireLock(&peer->m_watcherLock);
-        while (peer->m_watching.get_length()) {
-            peer->m_watching.remove_at(0)->Signal();
+        peer->SignalWatchers();
+    }
+
+    return written;
+}
+
+int64_t LocalSocket::StreamReceive(uint8_t* buffer, size_t len, int flags, void* ancillary, size_t* ancillaryLen) {
+    size_t controlCapacity = 0;
+    if (ancillaryLen) {
+        controlCapacity = *ancillaryLen;
+        *ancillaryLen = 0;
+    }
+
+    if (!len) {
+        return 0;
+    }
+
+    LocalSocketStream& stream = *m_receive;
+    LocalSocketRights* rights = nullptr;
+
+    size_t read;
+    for (;;) {
+        {
+            ScopedMutexLock lockRead(stream.ring.readLock);
+
+            // Anything written after this is past what we read, along with any rights sent with it
+            size_t tail = stream.ring.ReadPosition();
+            size_t count = MIN(len, stream.ring.Used());
+
+            {
+                // Stop before the next message with rights so they arrive with its first byte
+                ScopedSpinLock lockRights(stream.rightsLock);
+                for (LocalSocketRights* r : stream.rights) {
+                    if (r->position > tail) {
+                        count = MIN(count, r->position - tail);
+                        break;
+                    }
+                }
+
+                if (count && !(flags & MSG_PEEK) && stream.rights.get_length() &&
+                    stream.rights.get_front()->position == tail) {
+                    rights = stream.rights.remove_at(0);
+                }
+            }
+
+            if (flags & MSG_PEEK) {
+                read = stream.ring.Peek(buffer, count);
+            } else {
+                read = stream.ring.Read(buffer, count);
+            }
+        }
+
+        if (read) {
+            break;
+        } else if (__atomic_load_n(&stream.writerClosed, __ATOMIC_ACQUIRE) && !stream.ring.Used()) {
+            return 0; // Peer has closed
+        } else if (flags & MSG_DONTWAIT) {
+            return -EAGAIN;
+        }
+
+        FilesystemBlocker bl(this);
+
+        // Ask the writer to wake us, then check again so a write in between is not missed
+        __atomic_store_n(&stream.ring.readerWaiting, true, __ATOMIC_SEQ_CST);
+        if (!stream.ring.Used() && !__atomic_load_n(&stream.writerClosed, __ATOMIC_ACQUIRE)) {
+            if (Thread::Current()->Block(&bl)) {
+                return -EINTR;
+            }
+        }
+    }
+
+    // Only wake writers which found the ring full
+    if (!(flags & MSG_PEEK) && __atomic_exchange_n(&stream.ring.writerWaiting, false, __ATOMIC_SEQ_CST)) {
+        stream.WakeWriter();
+    }
+
+    if (rights) {
+        size_t controlLength = InstallRights(rights, ancillary, controlCapacity, flags & MSG_CMSG_CLOEXEC);
+        if (ancillaryLen) {
+            *ancillaryLen = controlLength;
+        }
+
+        delete rights;
+    }
+
+    return read;
+}
+
+int64_t LocalSocket::StreamSend(uint8_t* buffer, size_t len, int flags, const void* ancillary, size_t ancillaryLen) {
+    LocalSocketRights* rights = nullptr;
+    if (ancillary && ancillaryLen) {
+        if (int e = CopyRights(ancillary, ancillaryLen, rights); e) {
+            return e;
+        }
+    }
+
+    if (!len) {
+        delete rights; // Nothing to send them with
+        return 0;
+    }
+
+    LocalSocketStream& stream = *m_send;
+
+    size_t written = 0;
+    while (written < len) {
+        if (__atomic_load_n(&stream.readerClosed, __ATOMIC_ACQUIRE)) {
+            delete rights;
+            if (written) {
+                return written;
+            }
+
+            if (!(flags & MSG_NOSIGNAL)) {
+                Thread::Current()->Signal(SIGPIPE);
+            }
+            return -EPIPE;
+        }
+
+        size_t count;
+        {
+            ScopedMutexLock lockWrite(stream.ring.writeLock);
+
+            // Rights are only attached once their first byte is going in
+            if (rights && stream.ring.Free()) {
+                rights->position = stream.ring.WritePosition();
+
+                ScopedSpinLock lockRights(stream.rightsLock);
+                stream.rights.add_back(rights);
+                rights = nullptr;
+            }
+
+            count = stream.ring.Write(buffer + written, len - written);
+        }
+
+        if (count) {
+            written += count;
+
+            // Only wake readers which found the ring empty
+            if (__atomic_exchange_n(&stream.ring.readerWaiting, false, __ATOMIC_SEQ_CST)) {
+                stream.WakeReader();
+            }
+            continue;
+        } else if (flags & MSG_DONTWAIT) {
+            delete rights;
+            return written ? static_cast<int64_t>(written) : -EAGAIN;
+        }
+
+        FilesystemBlocker bl(this);
+
+        // Ask the reader to wake us, then check again so a read in between is not missed
+        __atomic_store_n(&stream.ring.writerWaiting, true, __ATOMIC_SEQ_CST);
+        if (!stream.ring.Free() && !__atomic_load_n(&stream.readerClosed, __ATOMIC_ACQUIRE)) {
+            if (Thread::Current()->Block(&bl)) {
+                delete rights;
+                return written ? static_cast<int64_t>(written) : -EINTR;
+            }
         }
-        releaseLock(&peer->m_watcherLock);
     }
 
     return written;
@@ -436,13 +687,44 @@ ErrorOr<UNIXOpenFile*> LocalSocket::Open(size_t flags) {
 }
 
 void LocalSocket::Close() {
-    if (handleCount == 0) {
-        if (peer) {
-            DisconnectPeer();
+    handleCount--;
+
+    if (handleCount <= 0) {
+        {
+            ScopedSpinLock lockPeer(peerLock);
+            if (peer) {
+                peer->OnDisconnect();
+                peer = nullptr;
+
+                // Datagram streams are shared with the peer, it frees them when it closes
+                inbound = nullptr;
+                outbound = nullptr;
+            }
         }
 
         m_connected = false;
 
+        // The peer reads EOF and gets EPIPE on write
+        if (m_send) {
+            {
+                ScopedSpinLock lockEnds(m_send->ring.endLock);
+                __atomic_store_n(&m_send->writerClosed, true, __ATOMIC_RELEASE);
+                m_send->writer = nullptr;
+            }
+            m_send->WakeReader();
+            m_send = nullptr;
+        }
+
+        if (m_receive) {
+            {
+                ScopedSpinLock lockEnds(m_receive->ring.endLock);
+                __atomic_store_n(&m_receive->readerClosed, true, __ATOMIC_RELEASE);
+                m_receive->reader = nullptr;
+            }
+            m_receive->WakeWriter();
+            m_receive = nullptr;
+        }
+
         if (bound) {
             DirectoryEntry ent(this, m_binding.sun_path);
             if(int e = fs::Unlink(this, &ent); e){
@@ -457,7 +739,49 @@ void LocalSocket::Close() {
     }
 }
 
+bool LocalSocket::CanRead() {
+    if (m_receive) {
+        return m_receive->ring.Used() || __atomic_load_n(&m_receive->writerClosed, __ATOMIC_ACQUIRE);
+    } else if (inbound) {
+        return !inbound->Empty();
+    }
+
+    return false;
+}
+
+bool LocalSocket::CanWrite() {
+    if (m_send) {
+        return m_send->ring.Free() || __atomic_load_n(&m_send->readerClosed, __ATOMIC_ACQUIRE);
+    }
+
+    return true;
+}
+
 void LocalSocket::Watch(FilesystemWatcher& watcher, int events) {
+    if (m_receive) {
+        acquireLock(&m_watcherLock);
+        m_watching.add_back(&watcher);
+        releaseLock(&m_watcherLock);
+
+        // Watchers stay registered until Unwatch but are only signalled once the other end
+        // sees the waiting flag, which is set again by EPoll rearming the watcher
+        bool ready = !IsConnected();
+        if (events & (POLLIN | POLLPRI)) {
+            __atomic_store_n(&m_receive->ring.readerWaiting, true, __ATOMIC_SEQ_CST);
+            ready |= CanRead();
+        }
+
+        if (events & POLLOUT) {
+            __atomic_store_n(&m_send->ring.writerWaiting, true, __ATOMIC_SEQ_CST);
+            ready |= CanWrite();
+        }
+
+        if (ready) {
+            SignalWatchers();
+        }
+        return;
+    }
+
     if (!(events & (POLLIN | POLLPRI))) {
         return;
     }
@@ -476,3 +800,12 @@ void LocalSocket::Unwatch(FilesystemWatcher& watcher) {
     m_watching.remove(&watcher);
     releaseLock(&m_watcherLock);
 }
+
+void LocalSocket::SignalWatchers() {
+    // Watchers stay registered until they are unwatched
+    acquireLock(&m_watcherLock);
+    for (auto* watcher : m_watching) {
+        watcher->Signal();
+    }
+    releaseLock(&m_watcherLock);
+}
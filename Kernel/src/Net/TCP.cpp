@@ -2,62 +2,116 @@
 #include <Net/Socket.h>
 #include <Net/Adapter.h>
 
+#include <Objects/Process.h>
+#include <CString.h>
 #include <Timer.h>
 #include <Math.h>
+#include <SmallVector.h>
 
 #include <Errno.h>
 
-// Create an identifier for a connection with the source IP, dest IP, source port and destination port.
-// This allows for one connection per port per remote address per local adddress
-struct TCPConnectionIdentifier{
-    IPv4Address localIP; // Local TCP Endpoint IP
-    IPv4Address remoteIP; // Remote TCP Endpoint IP
-    uint16_t localPort; // Local Port
-    uint16_t remotePort; // Remote Port
+#define TCP_TABLE_SHARDS 32
+#define TCP_TABLE_BUCKETS 8 // Buckets in each shard
 
-    TCPConnectionIdentifier() = default;
+namespace Network {
+    namespace TCP {
+        // Mixes all 96 bits so connections that only differ in a few bits of the ports or addresses spread out,
+        // rather than cancelling out as they would when XORing the fields
+        static uint64_t HashConnection(const TCPConnectionIdentifier& id){
+            uint64_t hash = (static_cast<uint64_t>(id.remoteIP.value) << 32) | id.localIP.value;
+            hash ^= ((static_cast<uint64_t>(id.remotePort) << 16) | id.localPort) * 0x9E3779B97F4A7C15ULL;
+
+            // splitmix64 finalizer
+            hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+            return hash ^ (hash >> 31);
+        }
 
-    TCPConnectionIdentifier(const IPv4Address& local, const IPv4Address& remote, uint16_t lPort, uint16_t rPort) : localIP(local), remoteIP(remote), localPort(lPort), remotePort(rPort){
+        // Sockets by TCPConnectionIdentifier, split into shards with their own lock
+        // so setting up and tearing down connections does not stall demultiplexing other connections
+        class TCPSocketTable final {
+        public:
+            // Returns false if the identifier is in use
+            bool Insert(const TCPConnectionIdentifier& id, TCPSocket* sock){
+                uint64_t hash = HashConnection(id);
+                Shard& shard = m_shards[hash % TCP_TABLE_SHARDS];
+                List<Entry>& bucket = shard.buckets[(hash / TCP_TABLE_SHARDS) % TCP_TABLE_BUCKETS];
+
+                ScopedSpinLock lock(shard.lock);
+                for(Entry& entry : bucket){
+                    if(entry.id == id){
+                        return false;
+                    }
+                }
 
-    }
+                bucket.add_back({id, sock});
+                return true;
+            }
 
-    inline bool operator==(const TCPConnectionIdentifier& other) const{
-        return remoteIP.value == other.remoteIP.value && localIP.value == other.localIP.value && remotePort == other.remotePort && localPort == other.localPort;
-    }
-};
+            void Remove(const TCPConnectionIdentifier& id, TCPSocket* sock){
+                uint64_t hash = HashConnection(id);
+                Shard& shard = m_shards[hash % TCP_TABLE_SHARDS];
+                List<Entry>& bucket = shard.buckets[(hash / TCP_TABLE_SHARDS) % TCP_TABLE_BUCKETS];
 
-template<>
-inline unsigned Hash<TCPConnectionIdentifier>(const TCPConnectionIdentifier& id){
-    return ::Hash(id.remoteIP.value) ^ ::Hash(id.localIP.value) ^ ::Hash(id.remotePort) ^ ::Hash(id.localPort);
-}
+                ScopedSpinLock lock(shard.lock);
+                for(auto it = bucket.begin(); it != bucket.end(); it++){
+                    if(it->id == id && it->sock == sock){
+                        bucket.remove(it);
+                        return;
+                    }
+                }
+            }
 
-namespace Network {
-    namespace TCP {
-        List<TCPSocket*> closedSockets;
-        HashMap<TCPConnectionIdentifier, TCPSocket*> sockets;
+            TCPSocket* Find(const TCPConnectionIdentifier& id){
+                uint64_t hash = HashConnection(id);
+                Shard& shard = m_shards[hash % TCP_TABLE_SHARDS];
+                List<Entry>& bucket = shard.buckets[(hash / TCP_TABLE_SHARDS) % TCP_TABLE_BUCKETS];
+
+                ScopedSpinLock lock(shard.lock);
+                for(Entry& entry : bucket){
+                    if(entry.id == id){
+                        return entry.sock;
+                    }
+                }
+
+                return nullptr;
+            }
+
+        private:
+            struct Entry {
+                TCPConnectionIdentifier id;
+                TCPSocket* sock;
+            };
+
+            struct Shard {
+                lock_t lock = 0;
+                List<Entry> buckets[TCP_TABLE_BUCKETS];
+            };
+
+            Shard m_shards[TCP_TABLE_SHARDS];
+        };
+
+        lock_t closedSocketsLock = 0;
+        IntrusiveList<TCPSocket, &TCPSocket::closedNode> closedSockets;
+        TCPSocketTable connections; // Sockets with a peer, looked up for every segment
+        TCPSocketTable listening;   // Sockets bound without a peer, remote address and port are 0
         uint16_t nextEphemeralPort = EPHEMERAL_PORT_RANGE_START;
 
         TCPSocket* FindSocket(TCPConnectionIdentifier id){
-            TCPSocket* sock = nullptr;
-            
-            if(sockets.get(id, sock)){
+            if(TCPSocket* sock = connections.Find(id)){
                 return sock;
             }
 
             id.remoteIP = INADDR_ANY;
             id.remotePort = INADDR_ANY;
-            
-            if(sockets.get(id, sock)){
+
+            if(TCPSocket* sock = listening.Find(id)){
                 return sock; // We may want to initiate a connection to a listen socket
             }
 
             id.localIP.value = INADDR_ANY;
-            
-            if(sockets.get(id, sock)){
-                return sock;
-            }
 
-            return nullptr;
+            return listening.Find(id);
         }
 
         int AcquirePort(TCPSocket* sock, const IPv4Address& localAddress, const IPv4Address& remoteAddress, uint16_t port, uint16_t remotePort){
@@ -67,22 +121,24 @@ namespace Network {
             }
 
             TCPConnectionIdentifier id = TCPConnectionIdentifier(localAddress, remoteAddress, port, remotePort);
+            TCPSocketTable& table = (remoteAddress.value == INADDR_ANY && !remotePort) ? listening : connections;
 
-            if(sockets.find(id)){
-                Log::Warning("[Network] AcquirePort: Port %d in use on %d.%d.%d.%d!", port, localAddress.data[0], localAddress.data[0], localAddress.data[1], localAddress.data[2], localAddress.data[3]);
+            if(!table.Insert(id, sock)){
+                Log::Warning("[Network] AcquirePort: Port %d in use on %d.%d.%d.%d!", port, localAddress.data[0], localAddress.data[1], localAddress.data[2], localAddress.data[3]);
                 return -EADDRINUSE;
             }
 
-            sockets.insert(id, sock);
-            
+            sock->m_tableId = id;
+            sock->m_inTable = true;
+
             return 0;
         }
 
         unsigned short AllocatePort(TCPSocket* sock){
             unsigned short port = EPHEMERAL_PORT_RANGE_START;
 
-            if(nextEphemeralPort < PORT_MAX){
-                port = nextEphemeralPort++;
+            if(__atomic_load_n(&nextEphemeralPort, __ATOMIC_RELAXED) < PORT_MAX){
+                port = __atomic_fetch_add(&nextEphemeralPort, 1, __ATOMIC_RELAXED);
                 
                 if(AcquirePort(sock, sock->LocalIPAddress(), sock->PeerIPAddress(), port, sock->PeerPort())){
                     port = 0;
@@ -100,89 +156,162 @@ namespace Network {
         }
 
         int ReleasePort(TCPSocket* sock){
-            sockets.removeValue(sock);
+            if(!sock->m_inTable){
+                return 0;
+            }
 
+            const TCPConnectionIdentifier& id = sock->m_tableId;
+            if(id.remoteIP.value == INADDR_ANY && !id.remotePort){
+                listening.Remove(id, sock);
+            } else {
+                connections.Remove(id, sock);
+            }
+
+            sock->m_inTable = false;
             return 0;
         }
 
         BigEndian<uint16_t> CalculateTCPChecksum(const IPv4Address& src, const IPv4Address& dest, void* data, uint16_t size){
-            struct PseudoIPv4Header{
-                uint32_t source;
-                uint32_t destination;
-                uint8_t zero = 0;
-                uint8_t protocol = IPv4ProtocolTCP;
-                BigEndian<uint16_t> length = 0;
-            } __attribute__((packed));
-            uint32_t checksum = 0;
+            return ChecksumFinish(ChecksumAdd(data, size, PseudoHeaderSum(src, dest, IPv4ProtocolTCP, size)));
+        }
 
-            PseudoIPv4Header pseudoHeader;
-            pseudoHeader.source = src.value;
-            pseudoHeader.destination = dest.value;
-            pseudoHeader.zero = 0;
-            pseudoHeader.protocol = IPv4ProtocolTCP;
-            pseudoHeader.length = size;
+        // Comparisons of sequence numbers, which wrap around
+        ALWAYS_INLINE static bool SequenceBefore(uint32_t a, uint32_t b){
+            return static_cast<int32_t>(a - b) < 0;
+        }
 
-            uint16_t* ptr = (uint16_t*)&pseudoHeader;
-            uint16_t count = sizeof(PseudoIPv4Header);
-            while(count >= 2){
-                checksum += *ptr++;
-                count -= 2;
-            }
+        ALWAYS_INLINE static bool SequenceAfter(uint32_t a, uint32_t b){
+            return static_cast<int32_t>(a - b) > 0;
+        }
 
-            ptr = (uint16_t*)data;
-            count = size;
-            while(count >= 2){
-                checksum += *ptr++;
-                count -= 2;
-            }
+        ALWAYS_INLINE static uint32_t ReadBigEndian32(const uint8_t* p){
+            return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) | (static_cast<uint32_t>(p[2]) << 8) | p[3];
+        }
 
-            if(count){ // Uneven amount of data
-                checksum += ((uint16_t)(*reinterpret_cast<uint8_t*>(ptr)));
-            }
+        ALWAYS_INLINE static void WriteBigEndian32(uint8_t* p, uint32_t value){
+            p[0] = value >> 24;
+            p[1] = value >> 16;
+            p[2] = value >> 8;
+            p[3] = value;
+        }
 
-            checksum = (checksum & 0xFFFF) + (checksum >> 16);
+        // Integer cube root (Hacker's Delight), the kernel is built without floating point
+        static uint64_t CubeRoot(uint64_t x){
+            uint64_t y = 0;
+            for(int s = 63; s >= 0; s -= 3){
+                y <<= 1;
 
-            BigEndian<uint16_t> ret;
-            ret.value = ~checksum;
-            return ret;
+                uint64_t b = 3 * y * (y + 1) + 1;
+                if((x >> s) >= b){
+                    x -= b << s;
+                    y++;
+                }
+            }
+
+            return y;
         }
 
-        int SendTCP(void* data, size_t length, IPv4Address& source, IPv4Address& destination, TCPHeader& header, NetworkAdapter* adapter = nullptr){
-            uint8_t buffer[1600];
+        struct TCPOptions {
+            uint16_t mss = 0; // 0 if not present
+            int windowScale = -1; // -1 if not present
+            bool sackPermitted = false;
+
+            struct {
+                uint32_t start;
+                uint32_t end;
+            } sack[4];
+            unsigned sackCount = 0;
+        };
+
+        static void ParseOptions(TCPHeader* header, size_t headerLength, TCPOptions& options){
+            uint8_t* option = reinterpret_cast<uint8_t*>(header) + sizeof(TCPHeader);
+            uint8_t* end = reinterpret_cast<uint8_t*>(header) + headerLength;
+
+            while(option < end){
+                uint8_t kind = option[0];
+                if(kind == TCPOptionEnd){
+                    break;
+                } else if(kind == TCPOptionNOP){
+                    option++;
+                    continue;
+                }
+
+                if(option + 1 >= end || option[1] < 2 || option + option[1] > end){
+                    break; // Malformed option
+                }
 
-            if(length + sizeof(TCPHeader) > 1600){
-                length = 1600 - sizeof(TCPHeader);
+                uint8_t length = option[1];
+                switch(kind){
+                    case TCPOptionMSS:
+                        if(length == 4){
+                            options.mss = (option[2] << 8) | option[3];
+                        }
+                        break;
+                    case TCPOptionWindowScale:
+                        if(length == 3){
+                            options.windowScale = MIN(option[2], 14); // RFC 7323 limits the shift to 14
+                        }
+                        break;
+                    case TCPOptionSACKPermitted:
+                        options.sackPermitted = true;
+                        break;
+                    case TCPOptionSACK:
+                        for(unsigned i = 2; i + 8 <= length && options.sackCount < 4; i += 8){
+                            options.sack[options.sackCount].start = ReadBigEndian32(option + i);
+                            options.sack[options.sackCount].end = ReadBigEndian32(option + i + 4);
+                            options.sackCount++;
+                        }
+                        break;
+                }
+
+                option += length;
             }
+        }
 
-            TCPHeader* tcpHeader = reinterpret_cast<TCPHeader*>(buffer);
+        lock_t timerSocketsLock = 0;
+        IntrusiveList<TCPSocket, &TCPSocket::timerNode> timerSockets; // Connected sockets the timer thread checks
+        bool timerThreadStarted = false;
 
-            memcpy(buffer + sizeof(TCPHeader), data, length);
+        // Runs the retransmission timers of every socket
+        void TimerThread(){
+            for(;;){
+                Thread::Current()->Sleep(TCP_TIMER_INTERVAL);
 
-            *tcpHeader = header;
+                uint64_t now = Timer::UsecondsSinceBoot();
+                SmallVector<TCPSocket*, 8> closed;
 
-            tcpHeader->checksum = 0;
-            tcpHeader->checksum = CalculateTCPChecksum(source, destination, buffer, length + sizeof(TCPHeader));
+                acquireLock(&timerSocketsLock);
+                for(TCPSocket* sock : timerSockets){
+                    ScopedSpinLock lock(sock->m_lock);
 
-            if(int e = SendIPv4(buffer, length + sizeof(TCPHeader), source, destination, IPv4ProtocolTCP, adapter); e){
-                return e;
-            }
+                    bool open = sock->state != TCPSocket::TCPStateUnknown;
+                    sock->OnTimer(now);
+
+                    if(open && sock->m_fileClosed && sock->state == TCPSocket::TCPStateUnknown){
+                        closed.add_back(sock); // Gave up on the connection, the destructor needs timerSocketsLock
+                    }
+                }
+                releaseLock(&timerSocketsLock);
+
+                for(TCPSocket* sock : closed){
+                    acquireLock(&closedSocketsLock);
+                    closedSockets.remove(sock);
+                    releaseLock(&closedSocketsLock);
+                    if(sock->port){
+                        sock->ReleasePort();
+                    }
 
-            return length;
+                    delete sock;
+                }
+            }
         }
 
         void OnReceiveTCP(IPv4Header& ipHeader, void* data, size_t length){
-            TCPHeader* tcpHeader = reinterpret_cast<TCPHeader*>(data);
-            BigEndian<uint16_t> checksum = tcpHeader->checksum;
+            TCPHeader* tcpHeader = reinterpret_cast<TCPHeader*>(data); // Checksum has already been verified
 
             Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] Recieving Packet from %hd.%hd.%hd.%hd:%hu (dest: %hd.%hd.%hd.%hd:%hu)!", ipHeader.sourceIP.data[0], ipHeader.sourceIP.data[1], ipHeader.sourceIP.data[2], ipHeader.sourceIP.data[3], (uint16_t)tcpHeader->srcPort, ipHeader.destIP.data[0], ipHeader.destIP.data[1], ipHeader.destIP.data[2], ipHeader.destIP.data[3], (uint16_t)tcpHeader->destPort);
 
-            /*tcpHeader->checksum = 0;
-            if(uint16_t chk = CalculateTCPChecksum(ipHeader.sourceIP, ipHeader.destIP, data, ipHeader.length).value; chk != checksum.value){
-                Log::Warning("[Network] [TCP] Dropping Packet (invalid checksum %hx, should be: %hx)", (uint16_t)checksum, EndianBigToLittle16(chk));
-            }*/
-            tcpHeader->checksum = checksum;
-
-            if(tcpHeader->dataOffset * 4 < sizeof(TCPHeader)){
+            if(tcpHeader->dataOffset * 4 < sizeof(TCPHeader) || tcpHeader->dataOffset * 4 > length){
                 return; // Invalid data offset (must be at least 5)
             }
 
@@ -200,7 +329,32 @@ namespace Network {
         }
 
         void TCPSocket::OnReceive(const IPv4Address& source, const IPv4Address& dest, uint8_t* data, size_t length){
+            bool closed;
+
+            {
+                ScopedSpinLock lock(m_lock);
+
+                bool open = state != TCPStateUnknown;
+                ProcessSegment(source, data, length);
+
+                closed = open && m_fileClosed && state == TCPStateUnknown;
+            }
+
+            if(closed){
+                acquireLock(&closedSocketsLock);
+                closedSockets.remove(this);
+                releaseLock(&closedSocketsLock);
+                if(port) {
+                    ReleasePort();
+                }
+
+                delete this;
+            }
+        }
+
+        void TCPSocket::ProcessSegment(const IPv4Address& source, uint8_t* data, size_t length){
             TCPHeader* tcpHeader = reinterpret_cast<TCPHeader*>(data); // Checksum has already been verified
+            size_t dataOffset = tcpHeader->dataOffset * 4;
 
             if(state == TCPStateUnknown){
                 return; // We should not be receiving packets as we have not opened a connection and we are not listening
@@ -223,10 +377,15 @@ namespace Network {
                 return;
             }
 
+            TCPOptions options;
+            ParseOptions(tcpHeader, dataOffset, options);
+
             if(tcpHeader->rst){
                 state = TCPStateUnknown; // Abort connection
 
                 UnblockAll();
+                WakeSenders();
+                return;
             } else if(state == TCPStateSyn){
                 bool ack = tcpHeader->ack;
                 bool syn = tcpHeader->syn;
@@ -240,13 +399,24 @@ namespace Network {
                 }
 
                 if(ack && syn){ // It is important that we recieve a SYN and ACK
-                    Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] (State: SYN-SENT) Recieved SYN-ACK (Sequence number: %u) from %d.%d.%d.%d:%d", tcpHeader->sequence, source.data[0], source.data[1], source.data[2], source.data[3], (uint16_t)tcpHeader->srcPort);
+                    Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] (State: SYN-SENT) Recieved SYN-ACK (Sequence number: %u) from %d.%d.%d.%d:%d", (uint32_t)tcpHeader->sequence, source.data[0], source.data[1], source.data[2], source.data[3], (uint16_t)tcpHeader->srcPort);
 
-                    m_remoteSequenceNumber = tcpHeader->sequence;
-                    m_lastAcknowledged = tcpHeader->acknowledgementNumber;
+                    if(tcpHeader->acknowledgementNumber == m_sequenceNumber){ // The ACK number must be equal to the sequence number.
+                        m_remoteSequenceNumber = tcpHeader->sequence + 1;
+                        m_lastAcknowledged = m_sequenceNumber;
+                        m_sendWindow = tcpHeader->windowSize; // Never scaled in a SYN
+
+                        m_mss = options.mss ? MIN(options.mss, TCP_MSS) : TCP_DEFAULT_MSS;
+                        if(options.windowScale >= 0){ // Only scale if both ends sent the option
+                            m_sendScale = options.windowScale;
+                            m_receiveScale = TCP_WINDOW_SCALE;
+                        }
+                        m_sackPermitted = options.sackPermitted;
+
+                        m_congestionWindow = MIN(10U * m_mss, MAX(2U * m_mss, 14600U)); // Initial window (RFC 6928)
 
-                    if(m_lastAcknowledged == m_sequenceNumber){ // The ACK number must be equal to the sequence number.
                         state = TCPStateEstablished; // Our SYN has been acknowledged with a SYN-ACK
+                        Acknowledge();
 
                         UnblockAll(); // Unblock waiting threads
                     }
@@ -265,54 +435,85 @@ namespace Network {
 
                     UnblockAll(); // Unblock waiting threads
                 }
-            } else if(state == TCPStateEstablished){
-                bool ack = tcpHeader->ack;
-                bool psh = tcpHeader->psh;
-                bool fin = tcpHeader->fin;
-                
-                bool doUnblock = false;
-                uint16_t other = (tcpHeader->flags & (TCPHeader::FlagsMask ^ (TCPHeader::ACK | TCPHeader::PSH | TCPHeader::FIN | TCPHeader::ECE))); // Get all other flags
+                return;
+            } else if(state == TCPStateTimeWait){
+                state = TCPStateUnknown;
 
-                if(other){
-                    return; // Unsupported flags
-                }
+                Reset(); // It did not receive our ACK, just reset
+                return;
+            }
 
-                if(tcpHeader->sequence != m_remoteSequenceNumber){
-                    Log::Debug(debugLevelNetwork, DebugLevelNormal, "[Network] [TCP] (State: ESTABLISHED) Received packet with sequence number of %d, Expected %d", tcpHeader->sequence, m_remoteSequenceNumber);
-                    return; // Either a previous packet has been dropped, or it is retransmitting a previous packet
-                }
+            if(tcpHeader->syn){
+                Acknowledge(); // The peer is retransmitting its SYN-ACK, our ACK was lost
+                return;
+            }
 
-                uint16_t dataOffset = tcpHeader->dataOffset * 4;
-                uint16_t dataLength = length - dataOffset;
+            uint16_t other = (tcpHeader->flags & (TCPHeader::FlagsMask ^ (TCPHeader::ACK | TCPHeader::PSH | TCPHeader::FIN | TCPHeader::ECE))); // Get all other flags
+            if(other){
+                Log::Debug(debugLevelNetwork, DebugLevelNormal, "[Network] [TCP] Unexpected flags: %hx", other);
+                return; // Unsupported flags
+            }
 
-                if(ack){
-                    if(tcpHeader->acknowledgementNumber > m_sequenceNumber){
-                        Log::Debug(debugLevelNetwork, DebugLevelNormal, "[Network] [TCP] (State: ESTABLIHSED) recieved ACK wth ack number > sequence number");
-                        Acknowledge(m_remoteSequenceNumber);
-                        return;
-                    }
+            uint8_t* payload = data + dataOffset;
+            size_t payloadLength = length - dataOffset;
+            uint32_t sequence = tcpHeader->sequence;
+            bool fin = tcpHeader->fin;
+
+            // The peer may only send data until its FIN
+            bool receiving = state == TCPStateEstablished || state == TCPStateFinWait1 || state == TCPStateFinWait2;
+            if(!receiving && (payloadLength || fin)){
+                Acknowledge(); // Our ACK of its FIN may have been lost
+            }
 
-                    acquireLock(&m_unacknowledgedPacketsLock);
+            if(tcpHeader->ack){
+                ProcessAcknowledgement(tcpHeader, options, payloadLength || fin);
+            }
 
-                    m_lastAcknowledged = tcpHeader->acknowledgementNumber;
+            bool finReceived = false;
+            if(receiving && (payloadLength || fin)){
+                Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] Recieving %d bytes of data (Flags: %hx, sequence: %u)", payloadLength, tcpHeader->flags & TCPHeader::FlagsMask, sequence);
 
-                    for(auto it = m_unacknowledgedPackets.begin(); it != m_unacknowledgedPackets.end(); it++){
-                        if(it->sequenceNumber <= m_lastAcknowledged){
-                            m_unacknowledgedPackets.remove(it);
-                        }
+                uint32_t finSequence = sequence + payloadLength;
+                uint32_t duplicate = m_remoteSequenceNumber - sequence;
 
-                        if(it == m_unacknowledgedPackets.end()){
-                            break;
-                        }
+                if(SequenceAfter(sequence, m_remoteSequenceNumber)){
+                    // A segment before this one was lost, keep this one and send a duplicate ACK with SACK blocks
+                    if(payloadLength){
+                        QueueOutOfOrder(sequence, payload, payloadLength);
                     }
 
-                    releaseLock(&m_unacknowledgedPacketsLock);
-                }
+                    Acknowledge();
+                } else if(duplicate > payloadLength || (duplicate == payloadLength && !fin)){
+                    Acknowledge(); // Everything has been received before, our ACK may have been lost
+                } else {
+                    payload += duplicate;
+                    payloadLength -= duplicate;
+
+                    uint32_t window = ReceiveWindow();
+                    if(payloadLength > window){
+                        payloadLength = window; // Drop what does not fit, along with the FIN
+                        fin = false;
+                    }
+
+                    bool holeFilled = false;
+                    if(payloadLength){
+                        m_inboundData.Write(payload, payloadLength);
+                        m_remoteSequenceNumber += payloadLength;
+
+                        holeFilled = m_outOfOrder.get_length();
+                        DrainOutOfOrder();
+                    }
 
-                Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] Recieving %d bytes of data (Flags: %hx, total len: %d)", dataLength, tcpHeader->flags & TCPHeader::FlagsMask);
+                    if(fin && m_remoteSequenceNumber == finSequence){
+                        m_remoteSequenceNumber++;
+                        finReceived = true;
+                    }
 
-                if(dataLength){
-                    m_inboundData.Write(data + dataOffset, dataLength);
+                    if(finReceived || holeFilled){
+                        Acknowledge(); // The peer is waiting on these to close or to leave recovery
+                    } else {
+                        DelayAcknowledge(payloadLength);
+                    }
 
                     acquireLock(&blockedLock);
                     FilesystemBlocker* bl = blocked.get_front();
@@ -326,247 +527,703 @@ namespace Network {
                         bl = next;
                     }
                     releaseLock(&blockedLock);
+                }
+            }
+
+            bool finAcknowledged = m_finSent && m_lastAcknowledged == m_sequenceNumber;
+            switch(state){
+                case TCPStateEstablished:
+                    if(finReceived){
+                        Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] (State: ESTABLISHED) Peer closed connection with FIN, entering CLOSE-WAIT");
+                        state = TCPStateCloseWait; // Connection ended, wait for process(es) to close file descriptors
+                    }
+                    break;
+                case TCPStateFinWait1:
+                    if(finReceived){
+                        state = finAcknowledged ? TCPStateTimeWait : TCPStateClosing;
+                    } else if(finAcknowledged){
+                        state = TCPStateFinWait2;
+                    }
+                    break;
+                case TCPStateFinWait2:
+                    if(finReceived){
+                        state = TCPStateTimeWait;
+                    }
+                    break;
+                case TCPStateClosing:
+                    if(finAcknowledged){
+                        state = TCPStateTimeWait;
+                    }
+                    break;
+                case TCPStateLastAck:
+                    if(finAcknowledged){
+                        state = TCPStateUnknown; // We have closed successfully
+                    }
+                    break;
+                default:
+                    break;
+            }
+
+            if(tcpHeader->psh || finReceived){
+                UnblockAll();
+            }
+        }
 
-                    m_remoteSequenceNumber = tcpHeader->sequence + dataLength;
+        void TCPSocket::ProcessAcknowledgement(TCPHeader* header, const TCPOptions& options, bool hasData){
+            uint32_t ack = header->acknowledgementNumber;
+            uint32_t window = static_cast<uint32_t>(static_cast<uint16_t>(header->windowSize)) << m_sendScale;
+            uint64_t now = Timer::UsecondsSinceBoot();
 
-                    Acknowledge(m_remoteSequenceNumber);
-                }
+            if(SequenceAfter(ack, m_sequenceNumber)){
+                Log::Debug(debugLevelNetwork, DebugLevelNormal, "[Network] [TCP] Recieved ACK wth ack number > sequence number");
+                Acknowledge();
+                return;
+            } else if(SequenceBefore(ack, m_lastAcknowledged)){
+                return; // Old duplicate
+            }
+
+            if(m_sackPermitted){
+                UpdateScoreboard(options);
+            }
 
-                if(psh){
-                    Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] PSH!");
+            if(ack == m_lastAcknowledged){
+                // Only an ACK that carries nothing and changes nothing counts as a duplicate (RFC 5681)
+                bool duplicate = FlightSize() && !hasData && window == m_sendWindow;
+                m_sendWindow = window;
 
-                    doUnblock = true;
+                if(!duplicate){
+                    Output();
+                    return;
                 }
 
-                if(fin){
-                    Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] (State: ESTABLISHED) Peer closed connection with FIN, entering CLOSE-WAIT");
-                    state = TCPStateCloseWait; // Connection ended, wait for process(es) to close file descriptors
+                m_duplicateAcks++;
+                if(m_inRecovery){
+                    m_congestionWindow += m_mss; // A segment has left the network
+
+                    // Fill the next hole below the highest SACKed sequence number
+                    if(m_sackedCount && SequenceBefore(m_retransmitNext, m_sacked[m_sackedCount - 1].start)){
+                        Retransmit(m_retransmitNext);
+                    }
+
+                    Output();
+                } else if(m_duplicateAcks == TCP_DUPACK_THRESHOLD){
+                    // Fast retransmit, then NewReno fast recovery (RFC 6582)
+                    OnCongestion(false);
+
+                    m_inRecovery = true;
+                    m_recoveryPoint = m_sequenceNumber;
+                    m_rttStart = 0;
 
-                    Acknowledge(m_remoteSequenceNumber);
-                    doUnblock = true;
+                    Retransmit(m_lastAcknowledged);
+                    m_congestionWindow = m_slowStartThreshold + TCP_DUPACK_THRESHOLD * m_mss;
+                    m_retransmitDeadline = now + m_retransmitTimeout;
                 }
+                return;
+            }
 
-                if(doUnblock){
-                    UnblockAll();
+            uint32_t acknowledged = ack - m_lastAcknowledged;
+            size_t dataAcknowledged = MIN(static_cast<size_t>(acknowledged), m_sendBufferUsed); // The FIN is not in the buffer
+
+            m_sendBufferStart = (m_sendBufferStart + dataAcknowledged) & (TCP_SEND_BUFFER - 1);
+            m_sendBufferUsed -= dataAcknowledged;
+            m_lastAcknowledged = ack;
+            m_sendWindow = window;
+            m_duplicateAcks = 0;
+            m_retransmits = 0;
+
+            // Forget SACKed ranges that are now cumulatively acknowledged
+            unsigned count = 0;
+            for(unsigned i = 0; i < m_sackedCount; i++){
+                if(!SequenceAfter(m_sacked[i].end, ack)){
+                    continue;
                 }
-            } else if(state == TCPStateFinWait1){
-                bool ack = tcpHeader->ack;
-                bool fin = tcpHeader->fin;
-                uint16_t other = (tcpHeader->flags & (TCPHeader::FlagsMask ^ (TCPHeader::ACK | TCPHeader::FIN))); // Get all other flags
 
-                if(other){
-                    Log::Debug(debugLevelNetwork, DebugLevelNormal, "[Network] [TCP] (State: FIN-WAIT-1) Unexpected flags: %hx", other);
-                    return; // Unexpected flags
+                m_sacked[count] = m_sacked[i];
+                if(SequenceBefore(m_sacked[count].start, ack)){
+                    m_sacked[count].start = ack;
                 }
+                count++;
+            }
+            m_sackedCount = count;
+
+            if(m_rttStart && SequenceAfter(ack, m_rttSequence)){
+                UpdateRoundTripTime(now - m_rttStart);
+                m_rttStart = 0;
+            }
 
-                if(fin && ack){
-                    state = TCPStateTimeWait;
+            if(m_inRecovery){
+                if(SequenceBefore(ack, m_recoveryPoint)){
+                    // Partial ACK, the segment after this one was lost too
+                    m_congestionWindow -= MIN(m_congestionWindow, acknowledged);
+                    if(acknowledged >= m_mss){
+                        m_congestionWindow += m_mss;
+                    }
 
-                    Acknowledge(m_remoteSequenceNumber);
-                } else if(ack){
-                    m_remoteSequenceNumber = tcpHeader->sequence;
+                    Retransmit(m_lastAcknowledged);
+                } else {
+                    m_inRecovery = false;
+                    m_congestionWindow = MIN(m_slowStartThreshold, MAX(FlightSize(), static_cast<uint32_t>(m_mss)) + m_mss);
+                }
+            } else {
+                OnAcknowledged(acknowledged);
+            }
+
+            // Restart the timer for what is still outstanding
+            m_retransmitDeadline = FlightSize() ? now + m_retransmitTimeout : 0;
 
-                    state = TCPStateFinWait2;
-                } else if(fin){
-                    m_remoteSequenceNumber = tcpHeader->sequence + 1;
+            WakeSenders();
+            Output();
+        }
 
-                    FinishAcknowledge(m_remoteSequenceNumber);
+        void TCPSocket::UpdateScoreboard(const TCPOptions& options){
+            for(unsigned i = 0; i < options.sackCount; i++){
+                SequenceRange block = {options.sack[i].start, options.sack[i].end};
 
-                    state = TCPStateLastAck;
+                if(!SequenceBefore(block.start, block.end) || !SequenceAfter(block.end, m_lastAcknowledged) || SequenceAfter(block.end, m_sequenceNumber)){
+                    continue; // Invalid or already acknowledged
                 }
 
-                return;
-            } else if(state == TCPStateFinWait2){
-                bool fin = tcpHeader->fin;
+                if(SequenceBefore(block.start, m_lastAcknowledged)){
+                    block.start = m_lastAcknowledged;
+                }
 
-                // Allow the remote endpoint to resend ACK
-                uint16_t other = (tcpHeader->flags & (TCPHeader::FlagsMask ^ (TCPHeader::FIN | TCPHeader::ACK))); // Get all other flags
+                // Merge the block with every range it touches, keeping the scoreboard sorted
+                SequenceRange merged[TCP_SACK_SCOREBOARD + 1];
+                unsigned count = 0;
+                bool placed = false;
+                for(unsigned j = 0; j < m_sackedCount; j++){
+                    SequenceRange& range = m_sacked[j];
+
+                    if(SequenceBefore(range.end, block.start)){
+                        merged[count++] = range;
+                    } else if(SequenceAfter(range.start, block.end)){
+                        if(!placed){
+                            merged[count++] = block;
+                            placed = true;
+                        }
+                        merged[count++] = range;
+                    } else {
+                        if(SequenceBefore(range.start, block.start)){
+                            block.start = range.start;
+                        }
+                        if(SequenceAfter(range.end, block.end)){
+                            block.end = range.end;
+                        }
+                    }
+                }
 
-                if(other){
-                    Log::Debug(debugLevelNetwork, DebugLevelNormal, "[Network] [TCP] (State: FIN-WAIT-2) Unexpected flags: %hx", other);
-                    return; // Unexpected flags
+                if(!placed){
+                    merged[count++] = block;
                 }
 
-                if(fin){
-                    m_remoteSequenceNumber = tcpHeader->sequence + 1;
+                m_sackedCount = MIN(count, static_cast<unsigned>(TCP_SACK_SCOREBOARD)); // Drop the highest ranges if full
+                memcpy(m_sacked, merged, m_sackedCount * sizeof(SequenceRange));
+            }
+        }
 
-                    state = TCPStateTimeWait;
+        void TCPSocket::WakeSenders(){
+            while(ThreadBlocker* bl = m_sendWaiters.pop_front()){
+                bl->Unblock();
+            }
+        }
 
-                    Acknowledge(m_remoteSequenceNumber);
+        void TCPSocket::OnCongestion(bool timeout){
+            if(m_congestionControl == CongestionCubic){
+                // Fast convergence, release some bandwidth if the window is still shrinking (RFC 8312)
+                if(m_congestionWindow < m_cubicMaxWindow){
+                    m_cubicMaxWindow = static_cast<uint64_t>(m_congestionWindow) * (10 + TCP_CUBIC_BETA) / 20;
+                } else {
+                    m_cubicMaxWindow = m_congestionWindow;
                 }
-            } else if(state == TCPStateCloseWait || state == TCPStateTimeWait){
-                state = TCPStateUnknown;
 
-                Reset(); // (CLOSE-WAIT) We should not be receiving packets on a close-wait / (TIME-WAIT) It did not receive our ACK, just reset
-            } else if(state == TCPStateLastAck){
-                bool ack = tcpHeader->ack;
+                m_slowStartThreshold = MAX(static_cast<uint32_t>(static_cast<uint64_t>(m_congestionWindow) * TCP_CUBIC_BETA / 10), 2U * m_mss);
+                m_cubicEpochStart = 0;
+            } else {
+                m_slowStartThreshold = MAX(FlightSize() / 2, 2U * m_mss);
+            }
 
-                if(ack){
-                    state = TCPStateUnknown; // We have closed successfully
+            m_congestionWindow = timeout ? m_mss : m_slowStartThreshold;
+        }
+
+        void TCPSocket::OnAcknowledged(uint32_t bytes){
+            if(m_congestionWindow < m_slowStartThreshold){
+                // Slow start, at most two segments per ACK (RFC 3465)
+                m_congestionWindow += MIN(bytes, 2U * m_mss);
+                return;
+            }
+
+            if(m_congestionControl == CongestionNewReno){
+                // Congestion avoidance, about a segment per round trip
+                m_congestionWindow += MAX(1U, static_cast<uint32_t>(static_cast<uint64_t>(bytes) * m_mss / m_congestionWindow));
+                return;
+            }
+
+            uint64_t now = Timer::UsecondsSinceBoot();
+            if(!m_cubicEpochStart){
+                m_cubicEpochStart = now;
+                m_cubicRenoWindow = m_congestionWindow;
+
+                if(m_congestionWindow < m_cubicMaxWindow){
+                    // K = cbrt((W_max - cwnd) / C) with the window in segments and K in ms
+                    uint64_t difference = (m_cubicMaxWindow - m_congestionWindow) / m_mss;
+                    m_cubicK = CubeRoot(difference * 10 / TCP_CUBIC_C * 1000000000ULL);
+                    m_cubicOrigin = m_cubicMaxWindow;
                 } else {
-                    Log::Debug(debugLevelNetwork, DebugLevelNormal, "[Network] [TCP] (State: LAST_ACK) Unexpected flags: %hx. Expected ACK", tcpHeader->flags & TCPHeader::FlagsMask);
+                    m_cubicK = 0;
+                    m_cubicOrigin = m_congestionWindow;
+                }
+            }
+
+            // W_cubic(t + RTT) = C(t + RTT - K)^3 + W_max, with t in ms
+            uint64_t t = (now - m_cubicEpochStart + m_smoothedRtt) / 1000;
+            uint64_t offset = MIN(t > m_cubicK ? t - m_cubicK : m_cubicK - t, 1000000ULL);
+            uint64_t delta = offset * offset * offset * TCP_CUBIC_C / 10 / 1000000 * m_mss / 1000; // C * offset^3 segments in bytes
+
+            uint64_t target;
+            if(t > m_cubicK){
+                target = m_cubicOrigin + delta;
+            } else {
+                target = m_cubicOrigin > delta ? m_cubicOrigin - delta : 0;
+            }
+
+            // Never grow slower than Reno would, which grows by 3(1 - beta)/(1 + beta) segments a round trip
+            m_cubicRenoWindow += static_cast<uint64_t>(bytes) * m_mss * 3 * (10 - TCP_CUBIC_BETA) / ((10 + TCP_CUBIC_BETA) * static_cast<uint64_t>(m_congestionWindow));
+            if(target < m_cubicRenoWindow){
+                target = m_cubicRenoWindow;
+            }
+
+            if(target > m_congestionWindow){
+                // (target - cwnd) / cwnd for each segment acknowledged, at most 1.5 times the window a round trip
+                uint64_t increase = (target - m_congestionWindow) * bytes / m_congestionWindow;
+                m_congestionWindow += MIN(increase, static_cast<uint64_t>(bytes / 2));
+            }
+        }
 
-                    state = TCPStateUnknown;
-                    Reset();
+        void TCPSocket::UpdateRoundTripTime(uint64_t sample){
+            if(!m_smoothedRtt){
+                m_smoothedRtt = sample;
+                m_rttVariance = sample / 2;
+            } else {
+                uint64_t difference = m_smoothedRtt > sample ? m_smoothedRtt - sample : sample - m_smoothedRtt;
+
+                m_rttVariance = (3 * m_rttVariance + difference) / 4;
+                m_smoothedRtt = (7 * m_smoothedRtt + sample) / 8;
+            }
+
+            // RFC 6298
+            m_retransmitTimeout = m_smoothedRtt + MAX(static_cast<uint64_t>(TCP_TIMER_INTERVAL), 4 * m_rttVariance);
+            m_retransmitTimeout = MIN(MAX(m_retransmitTimeout, static_cast<uint64_t>(TCP_RETRY_MIN)), static_cast<uint64_t>(TCP_RETRY_MAX));
+        }
+
+        uint32_t TCPSocket::ReceiveWindow(){
+            size_t used = m_inboundData.Pos() + m_outOfOrderBytes;
+            return used >= TCP_RECEIVE_BUFFER ? 0 : TCP_RECEIVE_BUFFER - used;
+        }
+
+        void TCPSocket::QueueOutOfOrder(uint32_t sequence, const uint8_t* data, size_t length){
+            // Only keep what fits in the window
+            uint32_t windowEnd = m_remoteSequenceNumber + ReceiveWindow();
+            if(!SequenceBefore(sequence, windowEnd)){
+                return;
+            } else if(SequenceAfter(sequence + length, windowEnd)){
+                length = windowEnd - sequence;
+            }
+
+            m_lastOutOfOrder = sequence;
+
+            size_t index = 0;
+            for(TCPSegment& segment : m_outOfOrder){
+                if(segment.sequence == sequence && segment.length >= length){
+                    return; // Already have it
+                } else if(SequenceAfter(segment.sequence, sequence)){
+                    break;
                 }
+
+                index++;
             }
 
-            if(m_fileClosed && state == TCPStateUnknown){
-                closedSockets.remove(this);
-                if(port) {
-                    ReleasePort();
+            TCPSegment segment = {.sequence = sequence, .length = static_cast<uint32_t>(length), .data = new uint8_t[length]};
+            memcpy(segment.data, data, length);
+
+            m_outOfOrder.insert(segment, index);
+            m_outOfOrderBytes += length;
+        }
+
+        void TCPSocket::DrainOutOfOrder(){
+            while(m_outOfOrder.get_length()){
+                TCPSegment segment = m_outOfOrder.get_at(0);
+                if(SequenceAfter(segment.sequence, m_remoteSequenceNumber)){
+                    break; // Still missing data before it
                 }
 
-                delete this;
+                m_outOfOrder.remove_at(0);
+                m_outOfOrderBytes -= segment.length;
+
+                // Segments may overlap what has been received already
+                uint32_t end = segment.sequence + segment.length;
+                if(SequenceAfter(end, m_remoteSequenceNumber)){
+                    uint32_t skip = m_remoteSequenceNumber - segment.sequence;
+
+                    m_inboundData.Write(segment.data + skip, segment.length - skip);
+                    m_remoteSequenceNumber = end;
+                }
+
+                delete[] segment.data;
             }
         }
 
-        int TCPSocket::Synchronize(uint32_t seqNumber){ // TCP SYN (Establish a connection to the server)
-            TCPHeader tcpHeader;
-            memset(&tcpHeader, 0, sizeof(TCPHeader));
-            
-            Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] [SYN] Sequence Number: %u", seqNumber);
+        int TCPSocket::SendSegment(uint32_t sequence, uint16_t flags, size_t length){
+            if(!adapter){
+                return -ENETUNREACH;
+            }
 
-            tcpHeader.srcPort = port;
-            tcpHeader.destPort = destinationPort;
-            tcpHeader.sequence = seqNumber;
-            tcpHeader.acknowledgementNumber = 0;
+            uint8_t options[40];
+            size_t optionsLength = 0;
+
+            if(flags & TCPHeader::SYN){
+                // MSS, window scale and SACK permitted, aligned to 4 bytes with NOPs
+                options[0] = TCPOptionMSS;
+                options[1] = 4;
+                options[2] = TCP_MSS >> 8;
+                options[3] = TCP_MSS & 0xFF;
+                options[4] = TCPOptionNOP;
+                options[5] = TCPOptionWindowScale;
+                options[6] = 3;
+                options[7] = TCP_WINDOW_SCALE;
+                options[8] = TCPOptionNOP;
+                options[9] = TCPOptionNOP;
+                options[10] = TCPOptionSACKPermitted;
+                options[11] = 2;
+                optionsLength = 12;
+            } else if(m_sackPermitted && m_outOfOrder.get_length()){
+                // Coalesce the out of order segments into blocks
+                SequenceRange blocks[TCP_SACK_SCOREBOARD];
+                unsigned count = 0;
+                for(TCPSegment& segment : m_outOfOrder){
+                    uint32_t end = segment.sequence + segment.length;
+
+                    if(count && !SequenceBefore(blocks[count - 1].end, segment.sequence)){
+                        if(SequenceAfter(end, blocks[count - 1].end)){
+                            blocks[count - 1].end = end;
+                        }
+                        continue;
+                    } else if(count == TCP_SACK_SCOREBOARD){
+                        break;
+                    }
 
-            tcpHeader.dataOffset = sizeof(TCPHeader) / 4; // Size of the TCP Header in DWORDs
-            tcpHeader.syn = 1; // SYN/Synchronize
+                    blocks[count++] = {segment.sequence, end};
+                }
 
-            tcpHeader.windowSize = 65535;
+                // The block with the most recent segment goes first (RFC 2018)
+                for(unsigned i = 1; i < count; i++){
+                    if(!SequenceBefore(m_lastOutOfOrder, blocks[i].start) && SequenceBefore(m_lastOutOfOrder, blocks[i].end)){
+                        SequenceRange newest = blocks[i];
+                        blocks[i] = blocks[0];
+                        blocks[0] = newest;
+                        break;
+                    }
+                }
 
-            tcpHeader.checksum = CalculateTCPChecksum(adapter->adapterIP, peerAddress, &tcpHeader, sizeof(TCPHeader));
+                // Options are taken out of the MSS
+                count = MIN(count, static_cast<unsigned>(TCP_MAX_SACK_BLOCKS));
+                while(count && 4 + 8 * count + MIN(length, static_cast<size_t>(m_mss)) > TCP_MSS){
+                    count--;
+                }
 
-            if(int e = SendIPv4(&tcpHeader, sizeof(TCPHeader), address, peerAddress, IPv4ProtocolTCP, adapter); e){
-                return e;
+                if(count){
+                    options[0] = TCPOptionNOP;
+                    options[1] = TCPOptionNOP;
+                    options[2] = TCPOptionSACK;
+                    options[3] = 2 + 8 * count;
+                    for(unsigned i = 0; i < count; i++){
+                        WriteBigEndian32(options + 4 + i * 8, blocks[i].start);
+                        WriteBigEndian32(options + 8 + i * 8, blocks[i].end);
+                    }
+                    optionsLength = 4 + 8 * count;
+                }
             }
 
-            return 0;
-        }
-        
-        int TCPSocket::Acknowledge(uint32_t ackNumber){ // TCP ACK (Acknowledge connection)
-            TCPHeader tcpHeader;
-            memset(&tcpHeader, 0, sizeof(TCPHeader));
+            size_t headerLength = sizeof(TCPHeader) + optionsLength;
 
-            Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] [ACK] Acknowledgement Number: %u", ackNumber);
-            
-            tcpHeader.srcPort = port;
-            tcpHeader.destPort = destinationPort;
-            tcpHeader.sequence = m_sequenceNumber;
-            tcpHeader.acknowledgementNumber = ackNumber;
+            NetworkPacket* pkt = adapter->AllocatePacket();
+            TCPHeader* tcpHeader = reinterpret_cast<TCPHeader*>(pkt->Put(headerLength));
+            memset(tcpHeader, 0, sizeof(TCPHeader));
 
-            tcpHeader.dataOffset = sizeof(TCPHeader) / 4; // Size of the TCP Header in DWORDs
-            tcpHeader.ack = 1; // ACK/Acknowledge
+            tcpHeader->srcPort = port;
+            tcpHeader->destPort = destinationPort;
+            tcpHeader->sequence = sequence;
+            tcpHeader->acknowledgementNumber = (flags & TCPHeader::ACK) ? m_remoteSequenceNumber : 0;
+            tcpHeader->flags = static_cast<uint16_t>(((headerLength / 4) << 12) | flags); // Data offset in DWORDs
 
-            tcpHeader.windowSize = 65535;
+            uint32_t window = ReceiveWindow();
+            if(flags & TCPHeader::SYN){
+                tcpHeader->windowSize = MIN(window, 65535U); // Never scaled in a SYN
+                m_advertisedWindow = MIN(window, 65535U);
+            } else {
+                tcpHeader->windowSize = MIN(window >> m_receiveScale, 65535U);
+                m_advertisedWindow = MIN(window >> m_receiveScale, 65535U) << m_receiveScale;
+            }
 
-            tcpHeader.checksum = CalculateTCPChecksum(adapter->adapterIP, peerAddress, &tcpHeader, sizeof(TCPHeader));
+            memcpy(tcpHeader + 1, options, optionsLength);
 
-            if(int e = SendIPv4(&tcpHeader, sizeof(TCPHeader), address, peerAddress, IPv4ProtocolTCP, adapter); e){
-                return e;
+            if(flags & TCPHeader::ACK){
+                // Anything received has now been acknowledged
+                m_delayedAckBytes = 0;
+                m_delayedAckDeadline = 0;
             }
 
-            return 0;
-        }
-        
-        int TCPSocket::SynchronizeAcknowledge(uint32_t seqNumber, uint32_t ackNumber){ // TCP SYN-ACK (Establish connection to client and acknowledge the connection
-            TCPHeader tcpHeader;
-            memset(&tcpHeader, 0, sizeof(TCPHeader));
+            if(length){
+                // The send buffer starts at m_lastAcknowledged
+                uint8_t* data = pkt->Put(length);
+                size_t index = (m_sendBufferStart + (sequence - m_lastAcknowledged)) & (TCP_SEND_BUFFER - 1);
+                size_t first = MIN(length, TCP_SEND_BUFFER - index);
 
-            Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] [SYN-ACK] Sequence Number: %u, Acknowledgement Number: %u", seqNumber, ackNumber);
-            
-            tcpHeader.srcPort = port;
-            tcpHeader.destPort = destinationPort;
-            tcpHeader.sequence = seqNumber;
-            tcpHeader.acknowledgementNumber = ackNumber;
+                memcpy(data, m_sendBuffer + index, first);
+                memcpy(data + first, m_sendBuffer, length - first);
+            }
 
-            tcpHeader.dataOffset = sizeof(TCPHeader) / 4; // Size of the TCP Header in DWORDs
-            tcpHeader.syn = 1; // SYN/Synchronize
-            tcpHeader.ack = 1; // ACK/Acknowledge
+            tcpHeader->checksum = 0;
+            if(length > m_mss){
+                // Cut into segments by the adapter, which adds each segment's length to the pseudo header sum
+                pkt->segmentSize = MIN(static_cast<size_t>(m_mss), TCP_MSS - optionsLength);
 
-            tcpHeader.windowSize = 65535;
+                tcpHeader->checksum.value = ChecksumFold(PseudoHeaderSum(adapter->adapterIP, peerAddress, IPv4ProtocolTCP, 0));
 
-            tcpHeader.checksum = CalculateTCPChecksum(adapter->adapterIP, peerAddress, &tcpHeader, sizeof(TCPHeader));
+                pkt->checksumStart = reinterpret_cast<uint8_t*>(tcpHeader) - pkt->buffer;
+                pkt->checksumOffset = pkt->checksumStart + offsetof(TCPHeader, checksum);
+            } else if(adapter->offloads & NetworkAdapter::OffloadTxChecksum){
+                // The adapter adds the header and data
+                tcpHeader->checksum.value = ChecksumFold(PseudoHeaderSum(adapter->adapterIP, peerAddress, IPv4ProtocolTCP, headerLength + length));
 
-            if(int e = SendIPv4(&tcpHeader, sizeof(TCPHeader), address, peerAddress, IPv4ProtocolTCP, adapter); e){
-                return e;
+                pkt->checksumStart = reinterpret_cast<uint8_t*>(tcpHeader) - pkt->buffer;
+                pkt->checksumOffset = pkt->checksumStart + offsetof(TCPHeader, checksum);
+            } else {
+                tcpHeader->checksum = CalculateTCPChecksum(adapter->adapterIP, peerAddress, tcpHeader, headerLength + length);
             }
 
-            return 0;
+            return SendIPv4(pkt, address, peerAddress, IPv4ProtocolTCP, adapter);
         }
 
-        int TCPSocket::Finish(){ // TCP FIN (Last packet from sender)
-            TCPHeader tcpHeader;
-            memset(&tcpHeader, 0, sizeof(TCPHeader));
+        void TCPSocket::Output(bool push){
+            // Adapters that can segment are given as many full segments as fit in a packet
+            size_t maxSegment = m_mss;
+            if(adapter && (adapter->offloads & NetworkAdapter::OffloadTcpSegmentation)){
+                maxSegment = MAX(static_cast<size_t>(TCP_SEGMENTATION_MAX / m_mss), 1UL) * m_mss;
+            }
 
-            Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] [FIN]");
-            
-            tcpHeader.srcPort = port;
-            tcpHeader.destPort = destinationPort;
-            tcpHeader.sequence = m_sequenceNumber;
+            for(;;){
+                uint32_t unsentOffset = m_sequenceNumber - m_lastAcknowledged;
+                if(m_finSent || unsentOffset >= m_sendBufferUsed){
+                    m_corkDeadline = 0;
 
-            tcpHeader.dataOffset = sizeof(TCPHeader) / 4; // Size of the TCP Header in DWORDs
-            tcpHeader.fin = 1; // FIN/Finish
+                    if(m_finPending && !m_finSent){
+                        FinishAcknowledge();
 
-            tcpHeader.windowSize = 65535;
+                        m_sequenceNumber++;
+                        m_finSent = true;
 
-            tcpHeader.checksum = CalculateTCPChecksum(adapter->adapterIP, peerAddress, &tcpHeader, sizeof(TCPHeader));
+                        if(!m_retransmitDeadline){
+                            m_retransmitDeadline = Timer::UsecondsSinceBoot() + m_retransmitTimeout;
+                        }
+                    }
+                    return;
+                }
 
-            if(int e = SendIPv4(&tcpHeader, sizeof(TCPHeader), address, peerAddress, IPv4ProtocolTCP, adapter); e){
-                return e;
+                uint32_t window = MIN(m_congestionWindow, m_sendWindow);
+                uint32_t flight = FlightSize();
+                if(flight >= window){
+                    if(!m_retransmitDeadline){
+                        m_retransmitDeadline = Timer::UsecondsSinceBoot() + m_retransmitTimeout; // The peer's window is closed, probe it
+                    }
+                    return;
+                }
+
+                size_t unsent = m_sendBufferUsed - unsentOffset;
+                size_t length = MIN(MIN(unsent, maxSegment), static_cast<size_t>(window - flight));
+
+                // Avoid sending small segments whilst data is outstanding (Nagle and silly window syndrome avoidance),
+                // or whilst corked until the cork is removed or times out
+                if(length < m_mss && !push && !m_finPending){
+                    if(m_cork){
+                        if(!m_corkDeadline){
+                            m_corkDeadline = Timer::UsecondsSinceBoot() + TCP_CORK_TIMEOUT;
+                        }
+                        return;
+                    } else if(flight && (length < unsent || !m_noDelay)){
+                        return;
+                    }
+                }
+
+                uint16_t flags = TCPHeader::ACK;
+                if(length == unsent){
+                    flags |= TCPHeader::PSH;
+                }
+
+                if(SendSegment(m_sequenceNumber, flags, length)){
+                    if(!m_retransmitDeadline){
+                        m_retransmitDeadline = Timer::UsecondsSinceBoot() + m_retransmitTimeout; // Try again later
+                    }
+                    return;
+                }
+
+                if(!m_rttStart){
+                    m_rttStart = Timer::UsecondsSinceBoot();
+                    m_rttSequence = m_sequenceNumber;
+                }
+
+                m_sequenceNumber += length;
+
+                if(!m_retransmitDeadline){
+                    m_retransmitDeadline = Timer::UsecondsSinceBoot() + m_retransmitTimeout;
+                }
+            }
+        }
+
+        bool TCPSocket::Retransmit(uint32_t sequence){
+            if(SequenceBefore(sequence, m_lastAcknowledged)){
+                sequence = m_lastAcknowledged;
             }
 
-            return 0;
+            // Skip what the peer already has, the scoreboard is sorted
+            uint32_t end = m_sequenceNumber;
+            for(unsigned i = 0; i < m_sackedCount; i++){
+                if(!SequenceBefore(sequence, m_sacked[i].start) && SequenceBefore(sequence, m_sacked[i].end)){
+                    sequence = m_sacked[i].end;
+                } else if(SequenceAfter(m_sacked[i].start, sequence)){
+                    end = m_sacked[i].start;
+                    break;
+                }
+            }
+
+            if(!SequenceBefore(sequence, m_sequenceNumber)){
+                return false; // Nothing left to retransmit
+            }
+
+            uint32_t dataEnd = m_lastAcknowledged + m_sendBufferUsed;
+            if(!SequenceBefore(sequence, dataEnd)){
+                FinishAcknowledge(); // Only the FIN is left
+
+                m_retransmitNext = sequence + 1;
+                return true;
+            } else if(SequenceAfter(end, dataEnd)){
+                end = dataEnd;
+            }
+
+            size_t length = MIN(static_cast<size_t>(end - sequence), static_cast<size_t>(m_mss));
+            SendSegment(sequence, TCPHeader::ACK | ((sequence + length == dataEnd) ? TCPHeader::PSH : 0), length);
+
+            m_retransmitNext = sequence + length;
+            m_rttStart = 0; // Retransmitted segments are not timed (Karn's algorithm)
+            return true;
         }
 
-        int TCPSocket::FinishAcknowledge(uint32_t ackNumber){ // TCP FIN-ACK (Last packet from sender, acknowledge)
-            TCPHeader tcpHeader;
-            memset(&tcpHeader, 0, sizeof(TCPHeader));
+        void TCPSocket::DelayAcknowledge(size_t length){
+            // ACK at least every second full segment, otherwise wait for data to send the ACK with (RFC 1122)
+            m_delayedAckBytes += length;
+            if(m_delayedAckBytes >= 2U * m_mss){
+                Acknowledge();
+            } else if(!m_delayedAckDeadline){
+                m_delayedAckDeadline = Timer::UsecondsSinceBoot() + TCP_DELAYED_ACK;
+            }
+        }
 
-            Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] [FIN-ACK] Acknowledgement Number: %u", ackNumber);
-            
-            tcpHeader.srcPort = port;
-            tcpHeader.destPort = destinationPort;
-            tcpHeader.sequence = m_sequenceNumber;
-            tcpHeader.acknowledgementNumber = ackNumber;
+        void TCPSocket::OnTimer(uint64_t now){
+            bool open = state == TCPStateEstablished || state == TCPStateCloseWait || state == TCPStateFinWait1 || state == TCPStateFinWait2;
+            if(m_delayedAckDeadline && now >= m_delayedAckDeadline){
+                m_delayedAckDeadline = 0;
 
-            tcpHeader.dataOffset = sizeof(TCPHeader) / 4; // Size of the TCP Header in DWORDs
-            tcpHeader.ack = 1; // ACK/Acknowledge
-            tcpHeader.fin = 1;
+                if(open){
+                    Acknowledge();
+                }
+            }
 
-            tcpHeader.windowSize = 65535;
+            if(m_corkDeadline && now >= m_corkDeadline){
+                m_corkDeadline = 0;
 
-            tcpHeader.checksum = CalculateTCPChecksum(adapter->adapterIP, peerAddress, &tcpHeader, sizeof(TCPHeader));
+                if(open){
+                    Output(true);
+                }
+            }
 
-            if(int e = SendIPv4(&tcpHeader, sizeof(TCPHeader), address, peerAddress, IPv4ProtocolTCP, adapter); e){
-                return e;
+            if(!m_retransmitDeadline || now < m_retransmitDeadline){
+                return;
             }
 
-            return 0;
-        }
+            m_retransmitDeadline = 0;
 
-        int TCPSocket::Reset(){ // TCP RST (Abort connection)
-            TCPHeader tcpHeader;
-            memset(&tcpHeader, 0, sizeof(TCPHeader));
+            if(state == TCPStateUnknown || state == TCPStateSyn || state == TCPStateTimeWait){
+                return;
+            }
 
-            Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] [RST]");
-            
-            tcpHeader.srcPort = port;
-            tcpHeader.destPort = destinationPort;
-            tcpHeader.sequence = m_sequenceNumber;
+            if(!FlightSize()){
+                if(!m_sendWindow && m_sendBufferUsed){
+                    // The peer's window is closed, send a byte to find out when it opens
+                    SendSegment(m_sequenceNumber, TCPHeader::ACK, 1);
+                    m_sequenceNumber++;
+
+                    m_retransmitTimeout = MIN(m_retransmitTimeout * 2, static_cast<uint64_t>(TCP_RETRY_MAX));
+                    m_retransmitDeadline = now + m_retransmitTimeout;
+                } else {
+                    Output();
+                }
+                return;
+            }
 
-            tcpHeader.dataOffset = sizeof(TCPHeader) / 4; // Size of the TCP Header in DWORDs
-            tcpHeader.rst = 1; // RST, Abort the connections
+            if(++m_retransmits > TCP_MAX_RETRANSMITS){
+                Log::Debug(debugLevelNetwork, DebugLevelNormal, "[Network] [TCP] Connection timed out");
 
-            tcpHeader.checksum = CalculateTCPChecksum(adapter->adapterIP, peerAddress, &tcpHeader, sizeof(TCPHeader));
+                Reset();
+                state = TCPStateUnknown;
 
-            if(int e = SendIPv4(&tcpHeader, sizeof(TCPHeader), address, peerAddress, IPv4ProtocolTCP, adapter); e){
-                return e;
+                UnblockAll();
+                WakeSenders();
+                return;
             }
 
-            return 0;
+            // Retransmission timeout, start again from the oldest unacknowledged segment with a window of one segment
+            OnCongestion(true);
+
+            m_inRecovery = false;
+            m_duplicateAcks = 0;
+            m_sackedCount = 0; // The peer may have discarded data it SACKed (RFC 2018)
+            m_rttStart = 0;
+            m_retransmitTimeout = MIN(m_retransmitTimeout * 2, static_cast<uint64_t>(TCP_RETRY_MAX));
+
+            m_sequenceNumber = m_lastAcknowledged;
+            m_finSent = false;
+
+            Output();
+        }
+
+        int TCPSocket::Synchronize(uint32_t seqNumber){ // TCP SYN (Establish a connection to the server)
+            Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] [SYN] Sequence Number: %u", seqNumber);
+
+            return SendSegment(seqNumber, TCPHeader::SYN, 0);
+        }
+
+        int TCPSocket::Acknowledge(){ // TCP ACK (Acknowledge connection)
+            Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] [ACK] Acknowledgement Number: %u", m_remoteSequenceNumber);
+
+            return SendSegment(m_sequenceNumber, TCPHeader::ACK, 0);
+        }
+
+        int TCPSocket::SynchronizeAcknowledge(uint32_t seqNumber){ // TCP SYN-ACK (Establish connection to client and acknowledge the connection
+            Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] [SYN-ACK] Sequence Number: %u, Acknowledgement Number: %u", seqNumber, m_remoteSequenceNumber);
+
+            return SendSegment(seqNumber, TCPHeader::SYN | TCPHeader::ACK, 0);
+        }
+
+        int TCPSocket::FinishAcknowledge(){ // TCP FIN-ACK (Last packet from sender, acknowledge)
+            Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] [FIN-ACK] Acknowledgement Number: %u", m_remoteSequenceNumber);
+
+            // The FIN follows the data in the send buffer
+            return SendSegment(m_lastAcknowledged + m_sendBufferUsed, TCPHeader::FIN | TCPHeader::ACK, 0);
+        }
+
+        int TCPSocket::Reset(){ // TCP RST (Abort connection)
+            Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] [RST]");
+
+            return SendSegment(m_sequenceNumber, TCPHeader::RST, 0);
         }
 
         unsigned short TCPSocket::AllocatePort(){
@@ -586,7 +1243,17 @@ namespace Network {
         }
 
         TCPSocket::~TCPSocket(){
+            acquireLock(&timerSocketsLock);
+            timerSockets.remove(this);
+            releaseLock(&timerSocketsLock);
+
+            for(TCPSegment& segment : m_outOfOrder){
+                delete[] segment.data;
+            }
 
+            if(m_sendBuffer){
+                delete[] m_sendBuffer;
+            }
         }
 
         Socket* TCPSocket::Accept(sockaddr* addr, socklen_t* addrlen, int mode){
@@ -631,8 +1298,8 @@ namespace Network {
                 return -ECONNREFUSED;
             }
 
-            MACAddress mac;
-            if(int e = Route(address, peerAddress, mac, adapter)){
+            IPv4Address nextHop;
+            if(int e = Route(address, peerAddress, nextHop, adapter)){
                 return e;
             }
 
@@ -657,8 +1324,24 @@ namespace Network {
 
             Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] Connecting to %hd.%hd.%hd.%hd:%hd", peerAddress.data[0], peerAddress.data[1], peerAddress.data[2], peerAddress.data[3], (uint16_t)destinationPort);
 
-            m_sequenceNumber = (Timer::GetSystemUptime() % 512) * (rand() % 255) + (Timer::UsecondsSinceBoot() % 255) + 1;
-            Synchronize(m_sequenceNumber - 1); // The peer should acknowledge the sent sequence number + 1, so just send (sequenceNumber - 1)
+            if(!__atomic_exchange_n(&timerThreadStarted, true, __ATOMIC_ACQ_REL)){
+                auto proc = Process::CreateKernelProcess((void*)TimerThread, "TCPTimer", nullptr);
+                proc->Start();
+            }
+
+            acquireLock(&timerSocketsLock);
+            if(!timerNode.IsLinked()){
+                timerSockets.add_back(this);
+            }
+            releaseLock(&timerSocketsLock);
+
+            {
+                ScopedSpinLock lock(m_lock);
+
+                m_sequenceNumber = (Timer::GetSystemUptime() % 512) * (rand() % 255) + (Timer::UsecondsSinceBoot() % 255) + 1;
+                m_lastAcknowledged = m_sequenceNumber;
+                Synchronize(m_sequenceNumber - 1); // The peer should acknowledge the sent sequence number + 1, so just send (sequenceNumber - 1)
+            }
 
             long retryPeriod = TCP_RETRY_MIN;
             while(state == TCPStateSyn){
@@ -669,8 +1352,16 @@ namespace Network {
                     return -EINTR;
                 }
 
-                if(timeout <= 0){
+                if(timeout <= 0 && state == TCPStateSyn){
+                    if(retryPeriod >= TCP_RETRY_MAX){
+                        state = TCPStateUnknown;
+                        return -ETIMEDOUT;
+                    }
+
                     retryPeriod *= 4;
+
+                    ScopedSpinLock lock(m_lock);
+                    Synchronize(m_sequenceNumber - 1); // The SYN or SYN-ACK was lost
                 }
             }
 
@@ -678,8 +1369,6 @@ namespace Network {
                 return -ECONNREFUSED;
             }
 
-            m_remoteSequenceNumber += 1;
-            Acknowledge(m_remoteSequenceNumber);
             return 0;
         }
 
@@ -701,8 +1390,15 @@ namespace Network {
             return 0;
         }
 
-        int64_t TCPSocket::ReceiveFrom(void* buffer, size_t len, int flags, sockaddr* src, socklen_t* addrlen, const void* ancillary, size_t ancillaryLen){
-            if(state != TCPStateEstablished && !m_inboundData.Pos()){
+        int64_t TCPSocket::ReceiveFrom(void* buffer, size_t len, int flags, sockaddr* src, socklen_t* addrlen, void* ancillary, size_t* ancillaryLen){
+            if(ancillaryLen){
+                *ancillaryLen = 0; // No ancillary data
+            }
+
+            // The peer can still send data after we have sent our FIN
+            bool receiving = state == TCPStateEstablished || state == TCPStateFinWait1 || state == TCPStateFinWait2;
+
+            if(!receiving && !m_inboundData.Pos()){
                 Log::Debug(debugLevelNetwork, DebugLevelNormal, "TCPSocket::ReceiveFrom: Not connected!");
                 return -ENOTCONN;
             }
@@ -713,7 +1409,7 @@ namespace Network {
                 *addrlen = sizeof(sockaddr_in);
             }
 
-            if(state == TCPStateEstablished && m_inboundData.Pos() < len){ // We do not want to block when in CLOSE-WAIT
+            if(receiving && m_inboundData.Pos() < len){ // We do not want to block when in CLOSE-WAIT
                 FilesystemBlocker bl(this, len);
 
                 if(Thread::Current()->Block(&bl)){
@@ -733,11 +1429,21 @@ namespace Network {
                 }
             }
 
-            return m_inboundData.Read(buffer, len);
+            int64_t ret = m_inboundData.Read(buffer, len);
+
+            ScopedSpinLock lock(m_lock);
+
+            // Let the peer know once the window has opened by a segment or half the buffer (RFC 1122)
+            bool open = state == TCPStateEstablished || state == TCPStateFinWait1 || state == TCPStateFinWait2;
+            if(open && ReceiveWindow() >= m_advertisedWindow + MIN(static_cast<uint32_t>(m_mss), TCP_RECEIVE_BUFFER / 2U)){
+                Acknowledge();
+            }
+
+            return ret;
         }
 
         int64_t TCPSocket::SendTo(void* buffer, size_t len, int flags, const sockaddr* dest, socklen_t addrlen, const void* ancillary, size_t ancillaryLen){
-            if(state != TCPStateEstablished){
+            if(state != TCPStateEstablished && state != TCPStateCloseWait){
                 Log::Debug(debugLevelNetwork, DebugLevelNormal, "TCPSocket::SendTo: Not connected!");
                 return -ENOTCONN;
             }
@@ -747,35 +1453,67 @@ namespace Network {
                 return -EISCONN; // dest is invalid
             }
 
-            uint16_t shortLength = static_cast<uint16_t>(len);
+            const uint8_t* data = reinterpret_cast<const uint8_t*>(buffer);
+            size_t written = 0;
+            int64_t error = 0;
+
+            m_sendMutex.Lock();
+            while(written < len){
+                GenericThreadBlocker bl;
+
+                acquireLock(&m_lock);
+                if(state != TCPStateEstablished && state != TCPStateCloseWait){
+                    releaseLock(&m_lock);
 
-            TCPHeader header;
-            memset(&header, 0, sizeof(TCPHeader));
+                    error = -EPIPE;
+                    break;
+                }
+
+                if(!m_sendBuffer){
+                    m_sendBuffer = new uint8_t[TCP_SEND_BUFFER];
+                }
 
-            header.srcPort = port;
-            header.destPort = destinationPort;
-            header.sequence = m_sequenceNumber;
-            header.acknowledgementNumber = m_remoteSequenceNumber;
+                size_t tail = (m_sendBufferStart + m_sendBufferUsed) & (TCP_SEND_BUFFER - 1);
+                size_t count = MIN(len - written, TCP_SEND_BUFFER - m_sendBufferUsed);
+                if(!count && !(flags & MSG_DONTWAIT)){
+                    m_sendWaiters.add_back(&bl);
+                }
+                releaseLock(&m_lock);
+
+                if(count){
+                    // Only SendTo writes past m_sendBufferUsed, so copy without m_lock in case the buffer faults
+                    size_t first = MIN(count, TCP_SEND_BUFFER - tail);
+                    memcpy(m_sendBuffer + tail, data + written, first);
+                    memcpy(m_sendBuffer, data + written + first, count - first);
+                    written += count;
 
-            header.dataOffset = sizeof(TCPHeader) / 4;
+                    ScopedSpinLock lock(m_lock);
+                    m_sendBufferUsed += count;
 
-            header.windowSize = 65535;
+                    Output();
+                    continue;
+                }
 
-            header.ack = 1;
-            header.psh = 1;
+                if(flags & MSG_DONTWAIT){
+                    error = -EAGAIN;
+                    break;
+                }
 
-            TCPPacket pack = { .header = header, .sequenceNumber = m_sequenceNumber, .length = shortLength, .data = new uint8_t[len]};
-            memcpy(pack.data, buffer, shortLength);
+                // Wait for ACKs to make room
+                bool interrupted = Thread::Current()->Block(&bl);
 
-            m_sequenceNumber += shortLength;
+                acquireLock(&m_lock);
+                m_sendWaiters.remove(&bl);
+                releaseLock(&m_lock);
 
-            int64_t ret = SendTCP(buffer, shortLength, address, peerAddress, header, adapter);
-            if(ret >= 0){
-                ScopedSpinLock acquired(m_unacknowledgedPacketsLock);
-                m_unacknowledgedPackets.add_back(pack);
+                if(interrupted){
+                    error = -EINTR;
+                    break;
+                }
             }
+            m_sendMutex.Unlock();
 
-            return ret;
+            return written ? static_cast<int64_t>(written) : error;
         }
 
         int TCPSocket::SetSocketOptions(int level, int opt, const void* optValue, socklen_t optLength){
@@ -786,9 +1524,42 @@ namespace Network {
                             return -EFAULT; // need to be at least int size
                         }
 
-                        m_noDelay = *reinterpret_cast<const int*>(optValue); // Disable 'Nagle's algorithm', we don't actualy implement this yet 
+                        m_noDelay = *reinterpret_cast<const int*>(optValue); // Disable 'Nagle's algorithm'
                         // Nagle's algorithm involves buffering output until we fill a packet
+                        if(m_noDelay){
+                            ScopedSpinLock lock(m_lock);
+                            Output(true); // Send whatever was held back
+                        }
+                        return 0;
+                    case TCP_CORK:
+                        if(optLength < sizeof(int)){
+                            return -EFAULT; // need to be at least int size
+                        }
+
+                        {
+                            ScopedSpinLock lock(m_lock);
+
+                            m_cork = *reinterpret_cast<const int*>(optValue);
+                            if(!m_cork){
+                                Output(true); // Removing the cork sends partial segments straight away
+                            }
+                        }
+                        return 0;
+                    case TCP_CONGESTION: {
+                        char name[16] = {};
+                        memcpy(name, optValue, MIN(static_cast<size_t>(optLength), sizeof(name) - 1));
+
+                        ScopedSpinLock lock(m_lock);
+                        if(!strcmp(name, "reno")){
+                            m_congestionControl = CongestionNewReno;
+                        } else if(!strcmp(name, "cubic")){
+                            m_congestionControl = CongestionCubic;
+                            m_cubicEpochStart = 0;
+                        } else {
+                            return -ENOENT;
+                        }
                         return 0;
+                    }
                     default:
                         Log::Warning("TCPSocket::SetSocketOptions: Unknown option: %d", opt);
                         return -ENOPROTOOPT;
@@ -818,6 +1589,25 @@ namespace Network {
                         *optLength = sizeof(int);
                         *reinterpret_cast<int*>(optValue) = m_noDelay;
                         return 0;
+                    case TCP_CORK:
+                        if(*optLength < sizeof(int)){
+                            return -EFAULT; // Not big enough, callers job to check the memory space
+                        }
+
+                        *optLength = sizeof(int);
+                        *reinterpret_cast<int*>(optValue) = m_cork;
+                        return 0;
+                    case TCP_CONGESTION: {
+                        const char* name = (m_congestionControl == CongestionCubic) ? "cubic" : "reno";
+                        size_t length = strlen(name) + 1;
+                        if(*optLength < length){
+                            return -EINVAL;
+                        }
+
+                        *optLength = length;
+                        memcpy(optValue, name, length);
+                        return 0;
+                    }
                     default:
                         Log::Warning("TCPSocket::GetSocketOptions: Unknown option: %d", opt);
                         return -ENOPROTOOPT;
@@ -846,25 +1636,32 @@ namespace Network {
                 if(state == TCPStateListen || state == TCPStateUnknown){
                     return; // No active connection
                 }
-                
+
                 if(state == TCPStateSyn || state == TCPStateSynAck){
                     Reset(); // Connection has not been estabilished
 
                     return;
                 }
 
-                if(state == TCPStateEstablished){
-                    state = TCPStateFinWait1;
-
-                    FinishAcknowledge(m_remoteSequenceNumber);
-                } else if(state == TCPStateCloseWait){
-                    state = TCPStateLastAck;
+                {
+                    ScopedSpinLock lock(m_lock);
+                    if(state == TCPStateEstablished){
+                        state = TCPStateFinWait1;
+                    } else if(state == TCPStateCloseWait){
+                        state = TCPStateLastAck;
+                    }
 
-                    Finish();
+                    // The FIN is sent after whatever is left in the send buffer
+                    m_finPending = true;
+                    Output();
                 }
 
-                closedSockets.add_back(this);
+                acquireLock(&closedSocketsLock);
+                if(!closedNode.IsLinked()){
+                    closedSockets.add_back(this);
+                }
+                releaseLock(&closedSocketsLock);
             }
         }
     }
-}
\ No newline at end of file
+}
@@ -1,5 +1,6 @@
 #include <Net/Socket.h>
 #include <Net/Net.h>
+#include <Net/Adapter.h>
 
 #include <Hash.h>
 #include <Errno.h>
@@ -75,33 +76,46 @@ namespace Network::UDP{
     }
 
     int SendUDP(void* data, size_t length, IPv4Address& source, IPv4Address& destination, BigEndian<uint16_t> sourcePort, BigEndian<uint16_t> destinationPort, NetworkAdapter* adapter){
-		if(length > 1518){
+		if(length > ETHERNET_MAX_PACKET_SIZE - sizeof(EthernetFrame) - sizeof(IPv4Header) - sizeof(UDPHeader)){
 			return -EMSGSIZE;
 		}
 
-		uint8_t buffer[1600];
+		assert(adapter);
 
-		UDPHeader* header = (UDPHeader*)buffer;
+		// The only copy of the data, the headers are pushed in front of it
+		NetworkPacket* pkt = adapter->AllocatePacket();
+		memcpy(pkt->Put(length), data, length);
+
+		UDPHeader* header = (UDPHeader*)pkt->Push(sizeof(UDPHeader));
 		header->destPort = destinationPort;
 		header->srcPort = sourcePort;
 		header->length = sizeof(UDPHeader) + length;
 		header->checksum = 0;
 
-		memcpy(header->data, data, length);
-
-		//header->checksum = CaclulateChecksum(header, sizeof(UDPHeader));
+		uint64_t pseudoHeader = PseudoHeaderSum(adapter->adapterIP, destination, IPv4ProtocolUDP, sizeof(UDPHeader) + length);
+		if(adapter->offloads & NetworkAdapter::OffloadTxChecksum){
+			header->checksum.value = ChecksumFold(pseudoHeader); // The adapter adds the header and data
+
+			pkt->checksumStart = reinterpret_cast<uint8_t*>(header) - pkt->buffer;
+			pkt->checksumOffset = pkt->checksumStart + offsetof(UDPHeader, checksum);
+		} else {
+			header->checksum = ChecksumFinish(ChecksumAdd(header, sizeof(UDPHeader) + length, pseudoHeader));
+			if(!header->checksum.value){
+				header->checksum.value = 0xFFFF; // Zero means there is no checksum
+			}
+		}
 
-		return SendIPv4(header, header->length, source, destination, IPv4ProtocolUDP, adapter);
+		return SendIPv4(pkt, source, destination, IPv4ProtocolUDP, adapter);
 	}
 
-    void OnReceiveUDP(IPv4Header& ipHeader, void* data, size_t length){
-		if(length < sizeof(UDPHeader)){
+    void OnReceiveUDP(IPv4Header& ipHeader, NetworkPacket* pkt){
+		if(pkt->length < sizeof(UDPHeader)){
 			Log::Warning("[Network] [UDP] Discarding packet (too short)");
 			return;
 		}
 
-		UDPHeader* header = (UDPHeader*)data;
-        if(header->length > length){
+		UDPHeader* header = (UDPHeader*)pkt->Data();
+        if(header->length > pkt->length || header->length < sizeof(UDPHeader)){
 			Log::Warning("[Network] [UDP] Discarding packet (too long)");
             return;
         }
@@ -112,7 +126,11 @@ namespace Network::UDP{
 
         UDPSocket* sock = nullptr;
         if(sockets.get((uint16_t)header->destPort, sock) && sock){
-            sock->OnReceive(ipHeader.sourceIP, header->srcPort, header->data, header->length);
+            BigEndian<uint16_t> sourcePort = header->srcPort;
+
+            pkt->Trim(header->length);
+            pkt->Pull(sizeof(UDPHeader));
+            sock->OnReceive(ipHeader.sourceIP, sourcePort, pkt);
         }
     }
 
@@ -124,6 +142,10 @@ namespace Network::UDP{
         if(bound){
             ReleasePort();
         }
+
+        while(packets.get_length()){
+            packets.remove_at(0).packet->Release();
+        }
     }
 
     unsigned short UDPSocket::AllocatePort(){
@@ -138,22 +160,24 @@ namespace Network::UDP{
         return Network::UDP::ReleasePort(port);
     }
 
-    int64_t UDPSocket::OnReceive(IPv4Address& sourceIP, BigEndian<uint16_t> sourcePort, void* buffer, size_t len){
+    int64_t UDPSocket::OnReceive(IPv4Address& sourceIP, BigEndian<uint16_t> sourcePort, NetworkPacket* packet){
         UDPPacket pkt;
         pkt.sourceIP = sourceIP;
         pkt.sourcePort = sourcePort;
-        pkt.length = len;
+        pkt.packet = packet;
 
-        pkt.data = new uint8_t[len];
-        memcpy(pkt.data, buffer, len);
+        acquireLock(&packetsLock);
+        if(receiveBufferUsed + packet->length > receiveBufferSize){
+            releaseLock(&packetsLock);
+            return -ENOBUFS; // The receive queue is full, drop the datagram
+        }
 
+        packet->Reference(); // Keep the packet rather than copying the data out of it
         packets.add_back(pkt);
+        receiveBufferUsed += packet->length;
+        releaseLock(&packetsLock);
 
-        acquireLock(&blockedLock);
-        while(blocked.get_length()){
-            blocked.get_front()->Unblock();
-        }
-        releaseLock(&blockedLock);
+        UnblockWaiters(1); // Each packet is only received by one thread
 
         return 0;
     }
@@ -188,20 +212,35 @@ namespace Network::UDP{
         return -EOPNOTSUPP;
     }
 
-    int64_t UDPSocket::ReceiveFrom(void* buffer, size_t len, int flags, sockaddr* src, socklen_t* addrlen, const void* ancillary, size_t ancillaryLen){
+    int64_t UDPSocket::ReceiveFrom(void* buffer, size_t len, int flags, sockaddr* src, socklen_t* addrlen, void* ancillary, size_t* ancillaryLen){
+        if(ancillaryLen){
+            *ancillaryLen = 0; // No ancillary data
+        }
+
         acquireLock(&packetsLock);
-        if(packets.get_length() <= 0){
+        while(packets.get_length() <= 0){
             releaseLock(&packetsLock);
             if(flags & MSG_DONTWAIT){
                 return -EAGAIN; // Don't wait
-            } else if(FilesystemBlocker bl(this); Thread::Current()->Block(&bl)){
+            }
+
+            FilesystemBlocker bl(this);
+            if(packets.get_length() <= 0 && Thread::Current()->Block(&bl)){
                 return -EINTR; // We were interrupted
             }
+
+            acquireLock(&packetsLock);
         }
 
         UDPPacket pkt = packets.remove_at(0);
+        receiveBufferUsed -= pkt.packet->length;
+        bool more = packets.get_length() > 0;
         releaseLock(&packetsLock);
 
+        if(more){
+            UnblockWaiters(1); // Another thread may have missed out on a packet
+        }
+
         if(src && addrlen){
             sockaddr_in addr;
             addr.sin_family = InternetProtocol;
@@ -213,10 +252,10 @@ namespace Network::UDP{
             *addrlen = sizeof(sockaddr_in); // addrlen is updated to contain the actual size of the source address
         }
 
-        size_t finalLength = MIN(len, pkt.length);
-        memcpy(buffer, pkt.data, finalLength);
+        size_t finalLength = MIN(len, pkt.packet->length);
+        memcpy(buffer, pkt.packet->Data(), finalLength);
 
-        delete[] pkt.data; // Free buffer
+        pkt.packet->Release();
 
         return finalLength;
     }
@@ -255,10 +294,10 @@ namespace Network::UDP{
         }
 
         if(!adapter){
-            MACAddress mac;
+            IPv4Address nextHop;
             NetworkAdapter* adapter = nullptr;
             
-            if(int e = Route(INADDR_ANY, sendIPAddress, mac, adapter)){
+            if(int e = Route(INADDR_ANY, sendIPAddress, nextHop, adapter)){
                 return e;
             }
         
@@ -273,4 +312,38 @@ namespace Network::UDP{
 
         return len;
     }
+
+    int UDPSocket::SetSocketOptions(int level, int opt, const void* optValue, socklen_t optLength){
+        if(level == SOL_SOCKET && opt == SO_RCVBUF){
+            if(optLength < sizeof(int)){
+                return -EFAULT; // need to be at least int size
+            }
+
+            int size = *reinterpret_cast<const int*>(optValue);
+            size = MAX(size, UDP_RECEIVE_BUFFER_MIN);
+            size = MIN(size, UDP_RECEIVE_BUFFER_MAX);
+
+            // Datagrams already queued are kept even if the buffer shrinks
+            acquireLock(&packetsLock);
+            receiveBufferSize = size;
+            releaseLock(&packetsLock);
+            return 0;
+        }
+
+        return IPSocket::SetSocketOptions(level, opt, optValue, optLength);
+    }
+
+    int UDPSocket::GetSocketOptions(int level, int opt, void* optValue, socklen_t* optLength){
+        if(level == SOL_SOCKET && opt == SO_RCVBUF){
+            if(*optLength < sizeof(int)){
+                return -EINVAL; // Not big enough, callers job to check the memory space
+            }
+
+            *optLength = sizeof(int);
+            *reinterpret_cast<int*>(optValue) = receiveBufferSize;
+            return 0;
+        }
+
+        return IPSocket::GetSocketOptions(level, opt, optValue, optLength);
+    }
 }
\ No newline at end of file
@@ -0,0 +1,134 @@
+#include <Objects/HandleTable.h>
+
+#include <Errno.h>
+#include <Move.h>
+
+HandleTable::~HandleTable() {
+    for (Chunk* chunk : m_chunks) {
+        delete chunk;
+    }
+}
+
+HandleTable::Chunk* HandleTable::GetChunk(unsigned index) {
+    Chunk* chunk = m_chunks[index];
+    if (!chunk) {
+        chunk = new Chunk();
+        // Lookups may find the chunk as soon as it is stored
+        __atomic_store_n(&m_chunks[index], chunk, __ATOMIC_RELEASE);
+    }
+
+    return chunk;
+}
+
+handle_id_t HandleTable::Allocate(FancyRefPtr<KernelObject> ko, bool closeOnExec) {
+    ScopedSpinLock lockTable(m_lock);
+
+    for (unsigned i = 0; i < HANDLE_TABLE_MAX_CHUNKS; i++) {
+        Chunk* chunk = GetChunk(i);
+        if (chunk->used == ~0ULL) {
+            continue; // Full
+        }
+
+        unsigned index = __builtin_ctzll(~chunk->used);
+        chunk->used |= 1ULL << index;
+
+        handle_id_t id = i * HANDLE_TABLE_CHUNK_SIZE + index;
+        {
+            Slot& slot = chunk->slots[index];
+            ScopedSpinLock lockSlot(slot.lock);
+            slot.handle = Handle{id, std::move(ko), closeOnExec};
+        }
+
+        if (static_cast<unsigned>(id) >= m_count) {
+            __atomic_store_n(&m_count, id + 1, __ATOMIC_RELAXED);
+        }
+        return id;
+    }
+
+    return -EMFILE;
+}
+
+int HandleTable::Replace(handle_id_t id, Handle handle) {
+    if (id < 0 || id >= HANDLE_TABLE_MAX) {
+        return -EBADF;
+    }
+
+    // Dereference the old KernelObject once the locks are released, closing it may block
+    Handle old;
+    {
+        ScopedSpinLock lockTable(m_lock);
+        Chunk* chunk = GetChunk(id / HANDLE_TABLE_CHUNK_SIZE);
+
+        unsigned index = id % HANDLE_TABLE_CHUNK_SIZE;
+        if (handle.IsValid()) {
+            chunk->used |= 1ULL << index;
+        } else {
+            chunk->used &= ~(1ULL << index);
+        }
+
+        handle.id = id;
+        {
+            Slot& slot = chunk->slots[index];
+            ScopedSpinLock lockSlot(slot.lock);
+            old = std::move(slot.handle);
+            slot.handle = std::move(handle);
+        }
+
+        if (static_cast<unsigned>(id) >= m_count) {
+            __atomic_store_n(&m_count, id + 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    return 0;
+}
+
+int HandleTable::Destroy(handle_id_t id) {
+    if (id < 0 || static_cast<unsigned>(id) >= Count()) {
+        return EBADF; // No such handle
+    }
+
+    Handle old;
+    {
+        ScopedSpinLock lockTable(m_lock);
+        Chunk* chunk = m_chunks[id / HANDLE_TABLE_CHUNK_SIZE];
+        if (!chunk) {
+            return 0;
+        }
+
+        unsigned index = id % HANDLE_TABLE_CHUNK_SIZE;
+        chunk->used &= ~(1ULL << index);
+
+        Slot& slot = chunk->slots[index];
+        ScopedSpinLock lockSlot(slot.lock);
+        old = std::move(slot.handle);
+        slot.handle = HANDLE_NULL;
+    }
+
+    return 0;
+}
+
+void HandleTable::CopyFrom(HandleTable& other, bool skipCloseOnExec) {
+    unsigned count = other.Count();
+    for (unsigned i = 0; i < count; i++) {
+        Handle h = other.Get(i);
+        if (h.IsValid() && !(skipCloseOnExec && h.closeOnExec)) {
+            Replace(i, std::move(h));
+        }
+    }
+}
+
+void HandleTable::CloseOnExec() {
+    unsigned count = Count();
+    for (unsigned i = 0; i < count; i++) {
+        if (Get(i).closeOnExec) {
+            Destroy(i);
+        }
+    }
+}
+
+void HandleTable::Clear() {
+    unsigned count = Count();
+    for (unsigned i = 0; i < count; i++) {
+        Destroy(i);
+    }
+}
@@ -0,0 +1,331 @@
+#include <Objects/IORing.h>
+
+#include <Errno.h>
+#include <Fs/Filesystem.h>
+#include <Logging.h>
+#include <Math.h>
+#include <Net/Socket.h>
+#include <Objects/Process.h>
+#include <Paging.h>
+#include <Scheduler.h>
+#include <Timer.h>
+
+ErrorOr<FancyRefPtr<IORing>> IORing::Create(Process* process, uint32_t entries, IORingInfo& info) {
+    if (!entries || entries > IORING_MAX_ENTRIES) {
+        return Error{EINVAL};
+    }
+
+    uint32_t sqEntries = 1;
+    while (sqEntries < entries) {
+        sqEntries <<= 1;
+    }
+
+    size_t size = PAGE_COUNT_4K(sizeof(IORingHeader) + sqEntries * sizeof(IORingSubmission) +
+                                sqEntries * 2 * sizeof(IORingCompletion))
+                  << PAGE_SHIFT_4K;
+
+    FancyRefPtr<MessageRingVMObject> vmo = new MessageRingVMObject(size);
+    FancyRefPtr<IORing> ring = new IORing(process, vmo, sqEntries);
+
+    MappedRegion* region = process->addressSpace->MapVMO(static_pointer_cast<VMObject>(vmo), 0, false);
+    if (!region) {
+        return Error{ENOMEM};
+    }
+
+    info = {
+        .base = region->Base(),
+        .size = size,
+        .sqOffset = static_cast<uint32_t>(reinterpret_cast<uint8_t*>(ring->m_submissions) - vmo->KernelMapping()),
+        .cqOffset = static_cast<uint32_t>(reinterpret_cast<uint8_t*>(ring->m_completions) - vmo->KernelMapping()),
+    };
+    return ring;
+}
+
+IORing::IORing(Process* process, FancyRefPtr<MessageRingVMObject> vmo, uint32_t sqEntries)
+    : m_process(process), m_vmo(std::move(vmo)), m_sqEntries(sqEntries), m_cqEntries(sqEntries * 2) {
+    uint8_t* base = m_vmo->KernelMapping();
+
+    m_header = reinterpret_cast<IORingHeader*>(base);
+    m_submissions = reinterpret_cast<IORingSubmission*>(base + sizeof(IORingHeader));
+    m_completions = reinterpret_cast<IORingCompletion*>(base + sizeof(IORingHeader) +
+                                                        m_sqEntries * sizeof(IORingSubmission));
+
+    m_header->sqMask = m_sqEntries - 1;
+    m_header->sqEntries = m_sqEntries;
+    m_header->cqMask = m_cqEntries - 1;
+    m_header->cqEntries = m_cqEntries;
+}
+
+IORing::~IORing() {
+    // Operations that never completed are dropped along with their file references
+    m_pending.clear();
+}
+
+int IORing::WaitEvents(const IORingSubmission& sub) {
+    switch (sub.opcode) {
+    case IORING_OP_READ:
+    case IORING_OP_ACCEPT:
+    case IORING_OP_RECV:
+        return POLLIN;
+    case IORING_OP_WRITE:
+    case IORING_OP_SEND:
+        return POLLOUT;
+    case IORING_OP_POLL:
+        return sub.opFlags;
+    default:
+        return 0;
+    }
+}
+
+bool IORing::Run(const IORingSubmission& sub, const FancyRefPtr<UNIXOpenFile>& file, int64_t& result) {
+    if (sub.opcode == IORING_OP_NOP) {
+        result = 0;
+        return true;
+    }
+
+    if (!file.get()) {
+        result = -EBADF;
+        return true;
+    }
+
+    FsNode* node = file->node;
+    bool isSocket = (node->flags & FS_NODE_TYPE) == FS_NODE_SOCKET;
+    // Files and block devices never have to wait on another process
+    bool isStream = !(node->IsFile() || node->IsDirectory() || node->IsBlockDevice());
+
+    if (sub.opcode == IORING_OP_READ || sub.opcode == IORING_OP_WRITE || sub.opcode == IORING_OP_RECV ||
+        sub.opcode == IORING_OP_SEND) {
+        if (!Memory::CheckUsermodePointer(sub.addr, sub.len, m_process->addressSpace)) {
+            result = -EFAULT;
+            return true;
+        }
+    }
+
+    uint8_t* buffer = reinterpret_cast<uint8_t*>(sub.addr);
+    switch (sub.opcode) {
+    case IORING_OP_READ:
+        if (isStream && !node->CanRead()) {
+            return false;
+        }
+
+        if (sub.flags & IORING_SUBMIT_OFFSET) {
+            result = fs::Read(node, sub.offset, sub.len, buffer);
+        } else {
+            result = fs::Read(file, sub.len, buffer);
+        }
+        return true;
+    case IORING_OP_WRITE:
+        if (isStream && !node->CanWrite()) {
+            return false;
+        }
+
+        if (sub.flags & IORING_SUBMIT_OFFSET) {
+            result = fs::Write(node, sub.offset, sub.len, buffer);
+        } else {
+            result = fs::Write(file, sub.len, buffer);
+        }
+        return true;
+    case IORING_OP_ACCEPT: {
+        if (!isSocket) {
+            result = -ENOTSOCK;
+            return true;
+        }
+
+        Socket* sock = reinterpret_cast<Socket*>(node);
+        if (!sock->PendingConnections()) {
+            return false;
+        }
+
+        Socket* newSock = sock->Accept(nullptr, nullptr, sub.opFlags | O_NONBLOCK);
+        if (!newSock) {
+            return false; // Taken by another thread
+        }
+
+        ErrorOr<UNIXOpenFile*> handle = fs::Open(newSock);
+        if (handle.HasError()) {
+            result = -handle.err.code;
+            return true;
+        }
+
+        handle.Value()->mode = sub.opFlags;
+        result = m_process->AllocateHandle(handle.Value());
+        return true;
+    }
+    case IORING_OP_RECV: {
+        if (!isSocket) {
+            result = -ENOTSOCK;
+            return true;
+        }
+
+        Socket* sock = reinterpret_cast<Socket*>(node);
+        if (!sock->CanRead() && sock->IsConnected()) {
+            return false;
+        }
+
+        result = sock->ReceiveFrom(buffer, sub.len, sub.opFlags | MSG_DONTWAIT, nullptr, nullptr);
+        return result != -EAGAIN;
+    }
+    case IORING_OP_SEND: {
+        if (!isSocket) {
+            result = -ENOTSOCK;
+            return true;
+        }
+
+        Socket* sock = reinterpret_cast<Socket*>(node);
+        if (!sock->CanWrite() && sock->IsConnected()) {
+            return false;
+        }
+
+        result = sock->SendTo(buffer, sub.len, sub.opFlags, nullptr, 0);
+        return result != -EAGAIN;
+    }
+    case IORING_OP_POLL: {
+        int events = 0;
+        if ((sub.opFlags & POLLIN) &&
+            (node->CanRead() || (isSocket && reinterpret_cast<Socket*>(node)->PendingConnections()))) {
+            events |= POLLIN;
+        }
+
+        if ((sub.opFlags & POLLOUT) && node->CanWrite()) {
+            events |= POLLOUT;
+        }
+
+        if (isSocket && !reinterpret_cast<Socket*>(node)->IsConnected() &&
+            !reinterpret_cast<Socket*>(node)->IsListening()) {
+            events |= POLLHUP;
+        }
+
+        if (!events) {
+            return false;
+        }
+
+        result = events;
+        return true;
+    }
+    default:
+        result = -EINVAL;
+        return true;
+    }
+}
+
+uint32_t IORing::CompletionsAvailable() const {
+    return __atomic_load_n(&m_header->cqTail, __ATOMIC_RELAXED) - __atomic_load_n(&m_header->cqHead, __ATOMIC_ACQUIRE);
+}
+
+void IORing::Complete(uint64_t userData, int64_t result) {
+    uint32_t tail = m_header->cqTail;
+
+    IORingCompletion& comp = m_completions[tail & (m_cqEntries - 1)];
+    comp.userData = userData;
+    comp.result = result;
+
+    __atomic_store_n(&m_header->cqTail, tail + 1, __ATOMIC_RELEASE);
+}
+
+long IORing::Submit() {
+    long consumed = 0;
+
+    uint32_t head = m_header->sqHead;
+    uint32_t tail = __atomic_load_n(&m_header->sqTail, __ATOMIC_ACQUIRE);
+    if (tail - head > m_sqEntries) {
+        return -EINVAL; // The process has corrupted the ring
+    }
+
+    while (head != tail) {
+        // Every operation in flight must have room in the completion ring
+        if (CompletionsAvailable() + m_pending.size() >= m_cqEntries) {
+            break;
+        }
+
+        // Copy it so the process cannot change it whilst we use it
+        IORingSubmission sub = m_submissions[head & (m_sqEntries - 1)];
+        head++;
+        consumed++;
+
+        FancyRefPtr<UNIXOpenFile> file;
+        if (sub.opcode != IORING_OP_NOP) {
+            auto result = m_process->GetHandleAs<UNIXOpenFile>(sub.fd);
+            if (!result.HasError()) {
+                file = std::move(result.Value());
+            }
+        }
+
+        int64_t result;
+        if (Run(sub, file, result)) {
+            Complete(sub.userData, result);
+        } else {
+            m_pending.add_back({.submission = sub, .file = std::move(file)});
+        }
+    }
+
+    __atomic_store_n(&m_header->sqHead, head, __ATOMIC_RELEASE);
+    return consumed;
+}
+
+unsigned IORing::RunPending() {
+    unsigned completed = 0;
+    for (unsigned i = 0; i < m_pending.size();) {
+        int64_t result;
+        if (Run(m_pending[i].submission, m_pending[i].file, result)) {
+            Complete(m_pending[i].submission.userData, result);
+            m_pending.erase(i);
+            completed++;
+        } else {
+            i++;
+        }
+    }
+
+    return completed;
+}
+
+long IORing::Enter(uint32_t minComplete, long timeout) {
+    if (Process::Current() != m_process) {
+        return -EPERM; // Buffers are in the address space of the process that created the ring
+    }
+
+    ScopedMutexLock lockEnter(m_enterLock);
+
+    RunPending();
+
+    long consumed = Submit();
+    if (consumed < 0) {
+        return consumed;
+    }
+
+    if (minComplete > m_cqEntries) {
+        minComplete = m_cqEntries;
+    }
+
+    timeval start = Timer::GetSystemUptimeStruct();
+    while (CompletionsAvailable() < minComplete && m_pending.size() && timeout) {
+        FilesystemWatcher watcher;
+        for (const PendingOperation& op : m_pending) {
+            if (op.file.get()) {
+                watcher.WatchNode(op.file->node, WaitEvents(op.submission));
+            }
+        }
+
+        // Something may have become ready before we started watching
+        if (RunPending()) {
+            continue;
+        }
+
+        if (timeout > 0) {
+            long remaining = timeout - Timer::TimeDifference(Timer::GetSystemUptimeStruct(), start);
+            if (remaining <= 0) {
+                break;
+            }
+
+            if (watcher.WaitTimeout(remaining)) {
+                break; // Interrupted
+            }
+        } else if (watcher.Wait()) {
+            break; // Interrupted
+        }
+
+        RunPending();
+    }
+
+    __atomic_store_n(&m_header->pending, static_cast<uint32_t>(m_pending.size()), __ATOMIC_RELEASE);
+    return consumed;
+}
@@ -2,6 +2,30 @@
 
 #include <Errno.h>
 #include <Logging.h>
+#include <Math.h>
+#include <Objects/Process.h>
+#include <Paging.h>
+#include <Scheduler.h>
+#include <Timer.h>
+
+// Held whilst the rings of an endpoint pair are created
+static lock_t ringCreateLock = 0;
+
+size_t MessageEndpoint::queueMemoryLimit = MESSAGE_ENDPOINT_QUEUE_MEMORY_DEFAULT;
+
+MessageRingVMObject::MessageRingVMObject(size_t size) : PhysicalVMObject(size, false, true) {
+    // Blocks are allocated (and zeroed) by PhysicalVMObject as we are not anonymous
+    unsigned blockCount = size >> PAGE_SHIFT_4K;
+    m_kernelMapping = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(blockCount));
+    for(unsigned i = 0; i < blockCount; i++){
+        Memory::KernelMapVirtualMemory4K(static_cast<uintptr_t>(physicalBlocks[i]) << PAGE_SHIFT_4K,
+                                         reinterpret_cast<uintptr_t>(m_kernelMapping) + (i << PAGE_SHIFT_4K), 1);
+    }
+}
+
+MessageRingVMObject::~MessageRingVMObject(){
+    Memory::KernelFree4KPages(m_kernelMapping, size >> PAGE_SHIFT_4K);
+}
 
 MessageEndpoint::MessageEndpoint(uint16_t maxSize){
     maxMessageSize = maxSize;
@@ -10,27 +34,48 @@ MessageEndpoint::MessageEndpoint(uint16_t maxSize){
         maxMessageSize = maxMessageSizeLimit;
     }
 
-    messageQueueLimit = 0x300000 / maxMessageSize; // No more than 3MB
+    m_queueLimitMax = MAX(queueMemoryLimit / (sizeof(Message) + maxMessageSize), 1UL);
+    messageQueueLimit = MIN(m_queueLimitMax, static_cast<unsigned>(MESSAGE_ENDPOINT_INITIAL_QUEUE));
 
     queueAvailablilitySemaphore.SetValue(messageQueueLimit);
 
     if(debugLevelMessageEndpoint >= DebugLevelNormal){
-        Log::Info("[MessageEndpoint] new endpoint with message size of %u (Queue limit: %u)", maxMessageSize, messageQueueLimit);
+        Log::Info("[MessageEndpoint] new endpoint with message size of %u (Queue limit: %u, max %u)", maxMessageSize, messageQueueLimit, m_queueLimitMax);
     }
 }
 
 MessageEndpoint::~MessageEndpoint(){
     Destroy();
+
+    // Drop any memory attached to unread messages
+    Message* m;
+    while(queue.Dequeue(m) > 0){
+        delete m->memory;
+        kfree(m);
+    }
+
+    while(cache.Dequeue(m) > 0){
+        kfree(m);
+    }
 }
 
 void MessageEndpoint::Destroy(){
     // TODO: peer race condition
     if(peer){
+        if(m_txRing){
+            __atomic_or_fetch(&m_txRing->flags, MESSAGE_RING_WRITER_CLOSED, __ATOMIC_SEQ_CST);
+        }
+
+        if(m_rxRing){
+            // The peer has to go through the kernel to find out we are gone
+            __atomic_and_fetch(&m_rxRing->flags, ~MESSAGE_RING_READER_MAPPED, __ATOMIC_SEQ_CST);
+        }
+
         peer->peer = nullptr;
     }
 }
 
-int64_t MessageEndpoint::Read(uint64_t* id, uint16_t* size, uint8_t* data){
+int64_t MessageEndpoint::Read(uint64_t* id, uint16_t* size, uint8_t* data, FancyRefPtr<VMObject>* memory, Message** taken){
     assert(id);
     assert(size);
     assert(data);
@@ -47,6 +92,7 @@ int64_t MessageEndpoint::Read(uint64_t* id, uint16_t* size, uint8_t* data){
 
     Message* m;
     if(queue.Dequeue(m) <= 0){
+        releaseLock(&queueLock);
         return 0;
     }
 
@@ -54,11 +100,26 @@ int64_t MessageEndpoint::Read(uint64_t* id, uint16_t* size, uint8_t* data){
     *size = m->size;
     *id = m->id;
 
-    cache.Enqueue(m);
+    if(m->memory){
+        if(memory){
+            *memory = std::move(*m->memory);
+        }
 
-    releaseLock(&queueLock);
+        delete m->memory;
+        m->memory = nullptr;
+    } else if(memory){
+        *memory = nullptr;
+    }
 
-    queueAvailablilitySemaphore.Signal();
+    if(taken){
+        // Still counted as queued and holding the writer's slot until FinishRead
+        *taken = m;
+        releaseLock(&queueLock);
+        return 1;
+    }
+
+    Consume(m);
+    releaseLock(&queueLock);
 
     if(debugLevelMessageEndpoint >= DebugLevelVerbose){
         Log::Info("[MessageEndpoint] Receiving message (ID: %u, Size: %u)", *id, *size);
@@ -67,6 +128,51 @@ int64_t MessageEndpoint::Read(uint64_t* id, uint16_t* size, uint8_t* data){
     return 1;
 }
 
+void MessageEndpoint::FinishRead(Message* message, bool delivered, FancyRefPtr<VMObject> memory){
+    if(delivered){
+        acquireLock(&queueLock);
+        Consume(message);
+        releaseLock(&queueLock);
+        return;
+    }
+
+    if(memory.get()){
+        message->memory = new FancyRefPtr<VMObject>(std::move(memory));
+    }
+
+    acquireLock(&queueLock);
+    queue.EnqueueFront(message);
+    releaseLock(&queueLock);
+
+    // Anything that found the queue empty in the meantime has to look again
+    SignalWatchers();
+}
+
+void MessageEndpoint::Consume(Message* m){
+    __atomic_add_fetch(&m_messagesReceived, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&m_bytesReceived, m->size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&Process::Current()->ipcMessagesReceived, 1, __ATOMIC_RELAXED);
+
+    // Only keep a few messages around, a burst should not pin memory once it has been read
+    if(m_cacheCount < MESSAGE_ENDPOINT_CACHE_MAX){
+        cache.Enqueue(m);
+        m_cacheCount++;
+    } else {
+        kfree(m);
+        __atomic_sub_fetch(&m_messageCount, 1, __ATOMIC_RELAXED);
+    }
+
+    m_queueCount--;
+    if(m_rxRing){
+        __atomic_store_n(&m_rxRing->queued, m_queueCount, __ATOMIC_RELEASE);
+    }
+
+    // The slot belongs to the writer
+    if(MessageEndpoint* p = peer; p){
+        p->queueAvailablilitySemaphore.Signal();
+    }
+}
+
 int64_t MessageEndpoint::Call(uint64_t id, uint16_t size, uint64_t data, uint64_t rID, uint16_t* rSize, uint8_t* rData, int64_t timeout){
     if(!peer){
         return -ENOTCONN;
@@ -79,36 +185,96 @@ int64_t MessageEndpoint::Call(uint64_t id, uint16_t size, uint64_t data, uint64_
     assert(rSize);
     assert(rData);
     
-    Semaphore s = Semaphore(0);
-    acquireLock(&waitingResponseLock);
-    
-    uint8_t* buffer = nullptr;
-    uint16_t returnSize; // We cannot use rSize as it lies within the process' address space, not the kernel's
-    waitingResponse.add_back({&s, {.id = rID, .size = &returnSize, .buffer = &buffer}});
+    uint16_t capacity = *rSize;
+
+    PendingResponse response(rID);
+    FastList<PendingResponse*>& bucket = ResponseBucket(rID);
 
+    acquireLock(&waitingResponseLock);
+    bucket.add_back(&response);
+    response.queued = true;
+    __atomic_add_fetch(&m_waitingResponseCount, 1, __ATOMIC_SEQ_CST);
     releaseLock(&waitingResponseLock);
 
-    Write(id, size, data); // Send message
+    if(m_rxRing){
+        // The response has to come through the kernel
+        __atomic_add_fetch(&m_rxRing->callPending, 1, __ATOMIC_SEQ_CST);
+    }
 
-    // TODO: timeout
-    if(s.Wait()){ // Await response
-        if(buffer){
-            delete buffer;
+    uint64_t callStart = Timer::UsecondsSinceBoot();
+
+    // Once we block on the response switch straight to the thread woken by the message (usually the server)
+    Thread* currentThread = Thread::Current();
+    currentThread->handoffArmed = true;
+    int64_t status = Write(id, size, data); // Send message
+    currentThread->handoffArmed = false;
+
+    bool timedOut = false;
+    if(status >= 0){
+        // Await response
+        if(timeout > 0){
+            long remaining = timeout;
+            if(!response.semaphore.WaitTimeout(remaining)){
+                timedOut = !remaining;
+            }
+        } else if(timeout == 0){
+            timedOut = true;
+        } else {
+            (void)response.semaphore.Wait();
         }
+    }
 
-        return -EINTR; // Interrupted
+    currentThread->handoff = nullptr; // Not used if the response arrived before we blocked
+
+    if(m_rxRing){
+        __atomic_sub_fetch(&m_rxRing->callPending, 1, __ATOMIC_RELEASE);
     }
-    
-    if(buffer){
-        memcpy(rData, buffer, returnSize);
-        *rSize = returnSize;
 
-        delete buffer;
+    acquireLock(&waitingResponseLock);
+    if(response.queued){
+        // No response, timed out or interrupted
+        bucket.remove(&response);
+        response.queued = false;
+        __atomic_sub_fetch(&m_waitingResponseCount, 1, __ATOMIC_RELAXED);
+        releaseLock(&waitingResponseLock);
+
+        if(status < 0){
+            return status; // Failed to send
+        }
+
+        if(!timedOut){
+            return -EINTR;
+        }
+
+        __atomic_add_fetch(&m_callTimeouts, 1, __ATOMIC_RELAXED);
+        return -ETIMEDOUT;
+    }
+    releaseLock(&waitingResponseLock);
+
+    // Bucket n holds calls taking less than 2^n us
+    uint64_t latency = Timer::UsecondsSinceBoot() - callStart;
+    unsigned latencyBucket = latency ? (64 - __builtin_clzll(latency)) : 0;
+    __atomic_add_fetch(&m_callLatency[MIN(latencyBucket, ENDPOINT_LATENCY_BUCKETS - 1U)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&m_calls, 1, __ATOMIC_RELAXED);
+
+    __atomic_add_fetch(&m_messagesReceived, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&m_bytesReceived, response.size, __ATOMIC_RELAXED);
+
+    // The response may have arrived just as we timed out, use it anyway
+    if(response.size > capacity){
+        delete[] response.buffer;
+        return -EMSGSIZE;
     }
+
+    if(response.buffer){
+        memcpy(rData, response.buffer, response.size);
+        delete[] response.buffer;
+    }
+    *rSize = response.size;
     return 0;
 }
 
-int64_t MessageEndpoint::Write(uint64_t id, uint16_t size, uint64_t data){
+int64_t MessageEndpoint::Write(uint64_t id, uint16_t size, uint64_t data, FancyRefPtr<VMObject> memory){
     if(!peer){
         return -ENOTCONN;
     }
@@ -117,31 +283,55 @@ int64_t MessageEndpoint::Write(uint64_t id, uint16_t size, uint64_t data){
         return -EINVAL;
     }
 
-    acquireLock(&peer->waitingResponseLock);
-    for(auto it = peer->waitingResponse.begin(); it != peer->waitingResponse.end(); it++){
-        if(it->item2.id == id){
-            Response& response = it->item2;
+    // Only look for a waiting call if there is one,
+    // responses are copied so messages with memory always go on the queue
+    if(!memory.get() && __atomic_load_n(&peer->m_waitingResponseCount, __ATOMIC_SEQ_CST)){
+        FastList<PendingResponse*>& bucket = peer->ResponseBucket(id);
 
-            if(size){
-                *it->item2.buffer = new uint8_t[size];
+        acquireLock(&peer->waitingResponseLock);
+        for(PendingResponse* response = bucket.get_front(); response; response = (response->next == bucket.get_front()) ? nullptr : response->next){
+            if(response->id != id){
+                continue;
+            }
 
-                memcpy(*it->item2.buffer, reinterpret_cast<uint8_t*>(data), size);
+            if(size){
+                response->buffer = new uint8_t[size];
+                memcpy(response->buffer, reinterpret_cast<uint8_t*>(data), size);
             }
+            response->size = size;
 
-            *response.size = size;
+            bucket.remove(response);
+            response->queued = false;
+            __atomic_sub_fetch(&peer->m_waitingResponseCount, 1, __ATOMIC_RELAXED);
 
-            it->item1->Signal();
+            // Switch straight back to the caller
+            Thread* currentThread = Thread::Current();
+            currentThread->handoffArmed = true;
+            response->semaphore.Signal();
+            currentThread->handoffArmed = false;
 
             if(debugLevelMessageEndpoint >= DebugLevelVerbose){
                 Log::Info("[MessageEndpoint] Sending response (ID: %u, Size: %u) to peer", id, size);
             }
 
-            peer->waitingResponse.remove(it);
             releaseLock(&peer->waitingResponseLock);
+
+            __atomic_add_fetch(&m_messagesSent, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&m_bytesSent, size, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&Process::Current()->ipcMessagesSent, 1, __ATOMIC_RELAXED);
+
+            if(currentThread->handoff && CheckInterrupts()){
+                Scheduler::Yield();
+            }
+            currentThread->handoff = nullptr;
             return 0; // Skip queue entirely
         }
+        releaseLock(&peer->waitingResponseLock);
+    }
+
+    if(queueAvailablilitySemaphore.GetValue() <= 0){
+        GrowQueueLimit();
     }
-    releaseLock(&peer->waitingResponseLock);
 
     if(queueAvailablilitySemaphore.Wait()){
         return -EINTR;
@@ -151,24 +341,38 @@ int64_t MessageEndpoint::Write(uint64_t id, uint16_t size, uint64_t data){
 
     Message* m;
     if(peer->cache.Dequeue(m)){ // Check for a cached message allocaiton
+        peer->m_cacheCount--;
+
         m->size = size;
         m->id = id;
         memcpy(m->data, (uint8_t*)data, size);
     } else {
         m = AllocateMessage(); // Nothing left in cache, allocate a new message
+        __atomic_add_fetch(&peer->m_messageCount, 1, __ATOMIC_RELAXED);
 
         m->size = size;
         m->id = id;
         memcpy(m->data, (uint8_t*)data, size);
     }
 
+    m->memory = memory.get() ? new FancyRefPtr<VMObject>(std::move(memory)) : nullptr;
+
     peer->queue.Enqueue(m);
 
-    acquireLock(&peer->waitingLock);
-    while(peer->waiting.get_length() > 0){
-        peer->waiting.remove_at(0)->Signal();
+    peer->m_queueCount++;
+    if(peer->m_queueCount > peer->m_queueHighWater){
+        peer->m_queueHighWater = peer->m_queueCount;
+    }
+
+    if(peer->m_rxRing){
+        __atomic_store_n(&peer->m_rxRing->queued, peer->m_queueCount, __ATOMIC_RELEASE);
     }
-    releaseLock(&peer->waitingLock);
+
+    peer->SignalWatchers();
+
+    __atomic_add_fetch(&m_messagesSent, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&m_bytesSent, size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&Process::Current()->ipcMessagesSent, 1, __ATOMIC_RELAXED);
 
     if(debugLevelMessageEndpoint >= DebugLevelVerbose){
         Log::Info("[MessageEndpoint] Sending message (ID: %u, Size: %u) to peer", id, size);
@@ -176,4 +380,134 @@ int64_t MessageEndpoint::Write(uint64_t id, uint16_t size, uint64_t data){
 
     releaseLock(&peer->queueLock);
     return 0;
-}
\ No newline at end of file
+}
+
+int64_t MessageEndpoint::MapRing(Process* process, MessageRingInfo& info){
+    {
+        ScopedSpinLock lockRing(ringCreateLock);
+        if(!peer){
+            return -ENOTCONN;
+        }
+
+        if(!m_ring.get()){
+            uint32_t slotSize = (sizeof(MessageRingSlot) + maxMessageSize + 7) & ~7U;
+            uint32_t slotCount = MIN(MAX(MESSAGE_RING_SIZE / slotSize, MESSAGE_RING_MIN_SLOTS), MESSAGE_RING_MAX_SLOTS);
+            size_t ringSize = PAGE_COUNT_4K(sizeof(MessageRingHeader) + static_cast<size_t>(slotCount) * slotSize) << PAGE_SHIFT_4K;
+
+            FancyRefPtr<MessageRingVMObject> ring = new MessageRingVMObject(ringSize * 2);
+            for(unsigned i = 0; i < 2; i++){
+                MessageRingHeader* header = reinterpret_cast<MessageRingHeader*>(ring->KernelMapping() + ringSize * i);
+                header->slotCount = slotCount;
+                header->slotSize = slotSize;
+            }
+
+            // The first ring is read by this endpoint, the second by the peer
+            m_ring = ring;
+            m_rxOffset = 0;
+            m_txOffset = ringSize;
+
+            peer->m_ring = ring;
+            peer->m_rxOffset = ringSize;
+            peer->m_txOffset = 0;
+
+            MessageEndpoint* endpoints[] = {this, peer};
+            for(MessageEndpoint* endp : endpoints){
+                endp->m_rxRing = reinterpret_cast<MessageRingHeader*>(ring->KernelMapping() + endp->m_rxOffset);
+                endp->m_txRing = reinterpret_cast<MessageRingHeader*>(ring->KernelMapping() + endp->m_txOffset);
+            }
+        }
+    }
+
+    {
+        // Messages may have been queued before there was a ring
+        ScopedSpinLock lockQueue(queueLock);
+        __atomic_store_n(&m_rxRing->queued, m_queueCount, __ATOMIC_RELEASE);
+    }
+
+    MappedRegion* region = process->addressSpace->MapVMO(static_pointer_cast<VMObject>(m_ring), 0, false);
+    if(!region){
+        return -ENOMEM;
+    }
+
+    info = {.base = region->Base(), .size = m_ring->Size(), .rxOffset = m_rxOffset, .txOffset = m_txOffset};
+
+    // Now the peer can write to us
+    __atomic_or_fetch(&m_rxRing->flags, MESSAGE_RING_READER_MAPPED, __ATOMIC_SEQ_CST);
+
+    if(debugLevelMessageEndpoint >= DebugLevelNormal){
+        Log::Info("[MessageEndpoint] Mapped rings at %x (%u slots of %u bytes)", info.base, m_rxRing->slotCount, m_rxRing->slotSize);
+    }
+    return 0;
+}
+
+int64_t MessageEndpoint::NotifyPeer(){
+    MessageEndpoint* p = peer;
+    if(!p){
+        return -ENOTCONN;
+    }
+
+    p->SignalWatchers();
+    return 0;
+}
+
+void MessageEndpoint::GetStatistics(EndpointStatistics& stats){
+    stats = {};
+
+    stats.msgSize = maxMessageSize;
+    stats.messagesSent = m_messagesSent;
+    stats.bytesSent = m_bytesSent;
+    stats.messagesReceived = m_messagesReceived;
+    stats.bytesReceived = m_bytesReceived;
+
+    // The rings are shared with the peer, both ends count what has gone through them
+    if(m_txRing){
+        stats.ringSent = __atomic_load_n(&m_txRing->tail, __ATOMIC_RELAXED);
+    }
+    if(m_rxRing){
+        stats.ringReceived = __atomic_load_n(&m_rxRing->head, __ATOMIC_RELAXED);
+    }
+
+    {
+        ScopedSpinLock lockQueue(queueLock);
+        stats.queued = m_queueCount;
+        stats.queueHighWater = m_queueHighWater;
+    }
+    stats.queueLimit = messageQueueLimit;
+    stats.queueLimitMax = m_queueLimitMax;
+
+    stats.calls = m_calls;
+    stats.callTimeouts = m_callTimeouts;
+    for(unsigned i = 0; i < ENDPOINT_LATENCY_BUCKETS; i++){
+        stats.callLatency[i] = m_callLatency[i];
+    }
+}
+
+void MessageEndpoint::GrowQueueLimit(){
+    ScopedSpinLock lockLimit(m_queueLimitLock);
+    if(queueAvailablilitySemaphore.GetValue() > 0 || messageQueueLimit >= m_queueLimitMax){
+        return; // Another writer grew it, or we are at the limit and have to wait for the peer
+    }
+
+    // Double the limit so a peer that keeps falling behind only takes a few steps to reach the maximum
+    unsigned grow = MIN(messageQueueLimit, m_queueLimitMax - messageQueueLimit);
+    messageQueueLimit += grow;
+    while(grow--){
+        queueAvailablilitySemaphore.Signal();
+    }
+
+    if(debugLevelMessageEndpoint >= DebugLevelVerbose){
+        Log::Info("[MessageEndpoint] Queue limit raised to %u", messageQueueLimit);
+    }
+}
+
+void MessageEndpoint::SignalWatchers(){
+    acquireLock(&waitingLock);
+    if(m_rxRing){
+        __atomic_store_n(&m_rxRing->readerWaiting, 0, __ATOMIC_RELAXED);
+    }
+
+    while(waiting.get_length() > 0){
+        waiting.remove_at(0)->Signal();
+    }
+    releaseLock(&waitingLock);
+}
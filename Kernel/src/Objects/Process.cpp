@@ -5,6 +5,8 @@
 #include <Assert.h>
 #include <CPU.h>
 #include <ELF.h>
+#include <KernelData.h>
+#include <Objects/Message.h>
 #include <IDT.h>
 #include <SMP.h>
 #include <Scheduler.h>
@@ -48,6 +50,19 @@ FancyRefPtr<Process> Process::CreateELFProcess(void* elf, const Vector<String>&
         return nullptr;
     }
 
+    return CreateELFProcess(elf, nullptr, argv, envp, execPath, parent);
+}
+
+FancyRefPtr<Process> Process::CreateELFProcess(const FancyRefPtr<UNIXOpenFile>& elf, const Vector<String>& argv, const Vector<String>& envp, const char* execPath, Process* parent){
+    if (!VerifyELF(elf)) {
+        return nullptr;
+    }
+
+    return CreateELFProcess(nullptr, elf, argv, envp, execPath, parent);
+}
+
+FancyRefPtr<Process> Process::CreateELFProcess(void* elf, const FancyRefPtr<UNIXOpenFile>& elfFile, const Vector<String>& argv, const Vector<String>& envp, const char* execPath, Process* parent){
+
     const char* name = "unknown";
     if(argv.size() >= 1){
         name = argv[0].c_str();
@@ -61,7 +76,7 @@ FancyRefPtr<Process> Process::CreateELFProcess(void* elf, const Vector<String>&
     thread->timeSlice = thread->timeSliceDefault;
     thread->priority = 4;
 
-    elf_info_t elfInfo = LoadELFSegments(proc.get(), elf, 0);
+    elf_info_t elfInfo = elf ? LoadELFSegments(proc.get(), elf, 0) : LoadELFSegments(proc.get(), elfFile, 0);
 
     MappedRegion* stackRegion = proc->addressSpace->AllocateAnonymousVMObject(0x400000, 0, false); // 4MB max stacksize
 
@@ -90,14 +105,14 @@ FancyRefPtr<Process> Process::CreateELFProcess(void* elf, const Vector<String>&
     FsNode* logDev = fs::ResolvePath("/dev/kernellog");
 
     if (nullDev) {
-        proc->m_handles[0] = MakeHandle(0, fs::Open(nullDev).Value()); // stdin
+        proc->m_handles.Replace(0, MakeHandle(0, fs::Open(nullDev).Value())); // stdin
     } else {
         Log::Warning("Failed to find /dev/null");
     }
 
     if (logDev) {
-        proc->m_handles[1] = MakeHandle(1, fs::Open(logDev).Value()); // stdout
-        proc->m_handles[2] = MakeHandle(2, fs::Open(logDev).Value()); // stderr
+        proc->m_handles.Replace(1, MakeHandle(1, fs::Open(logDev).Value())); // stdout
+        proc->m_handles.Replace(2, MakeHandle(2, fs::Open(logDev).Value())); // stderr
     } else {
         Log::Warning("Failed to find /dev/kernellog");
     }
@@ -146,13 +161,11 @@ Process::Process(pid_t pid, const char* _name, const char* _workingDir, Process*
     m_threads.add_back(m_mainThread);
 
     assert(m_mainThread->parent == this);
-
-    m_handles.add_back(HANDLE_NULL); // stdin
-    m_handles.add_back(HANDLE_NULL); // stdout
-    m_handles.add_back(HANDLE_NULL); // stderr
 }
 
 uintptr_t Process::LoadELF(uintptr_t* stackPointer, elf_info_t elfInfo, const Vector<String>& argv, const Vector<String>& envp, const char* execPath) {
+    KernelData::MapIntoProcess(this);
+
     uintptr_t rip = elfInfo.entry;
     if (elfInfo.linkerPath) {
         // char* linkPath = elfInfo.linkerPath;
@@ -163,25 +176,28 @@ uintptr_t Process::LoadELF(uintptr_t* stackPointer, elf_info_t elfInfo, const Ve
             KernelPanic("Failed to load dynamic linker!");
         }
 
-        void* linkerElf = kmalloc(node->size);
-        fs::Read(node, 0, node->size, (uint8_t*)linkerElf); // Load Dynamic Linker
+        auto linkerFile = fs::Open(node);
+        if (linkerFile.HasError()) {
+            Log::Warning("Failed to open dynamic linker");
+            return 0;
+        }
 
+        FancyRefPtr<UNIXOpenFile> linkerElf = linkerFile.Value();
         if (!VerifyELF(linkerElf)) {
             Log::Warning("Invalid Dynamic Linker ELF");
             return 0;
         }
 
+        // ld.so is mapped from the page cache, so its text is shared by every dynamically linked process
         elf_info_t linkerELFInfo = LoadELFSegments(this, linkerElf, linkerBaseAddress);
         rip = linkerELFInfo.entry;
-
-        kfree(linkerElf);
     }
 
     char* tempArgv[argv.size()];
     char* tempEnvp[envp.size()];
 
     asm("cli");
-    asm volatile("mov %%rax, %%cr3" ::"a"(this->GetPageMap()->pml4Phys));
+    Memory::SwitchPageMap(this->GetPageMap());
 
     // ABI Stuff
     uint64_t* stack = (uint64_t*)(*stackPointer);
@@ -252,7 +268,7 @@ uintptr_t Process::LoadELF(uintptr_t* stackPointer, elf_info_t elfInfo, const Ve
     stack--;
     *stack = argv.size(); // argc
 
-    asm volatile("mov %%rax, %%cr3" ::"a"(Scheduler::GetCurrentProcess()->GetPageMap()->pml4Phys));
+    Memory::SwitchPageMap(Scheduler::GetCurrentProcess()->GetPageMap());
     asm("sti");
 
     *stackPointer = (uintptr_t)stack;
@@ -296,6 +312,21 @@ void Process::Destroy() {
     }
 }
 
+unsigned Process::SwapOut(unsigned maxPages) {
+    // The address space is replaced by execve whilst holding the lock
+    if (acquireTestLock(&m_processLock)) {
+        return 0;
+    }
+
+    unsigned swapped = 0;
+    if (m_state == Process_Running && addressSpace) {
+        swapped = addressSpace->SwapOut(maxPages);
+    }
+
+    releaseLock(&m_processLock);
+    return swapped;
+}
+
 void Process::Die() {
     asm volatile("sti");
 
@@ -422,8 +453,8 @@ void Process::Die() {
 
     assert(!runningThreads.get_length());
 
-    // Prevent run queue balancing
-    acquireLock(&Scheduler::processesLock);
+    // All other threads are now dying so idle CPUs will not steal them
+    // whilst we remove them from the run queues
     acquireLockIntDisable(&m_processLock);
 
     CPU* cpu = GetCPULocal();
@@ -437,16 +468,24 @@ void Process::Die() {
         }
     }
 
-    acquireLock(&cpu->runQueueLock);
+    cpu->runQueueLock.Acquire();
+
+    // As on the other CPUs below, hand the FPU of a thread that will be freed to the idle thread
+    if (Thread* owner = __atomic_load_n(&cpu->fpuOwner, __ATOMIC_RELAXED); owner && owner->parent == this) {
+        __atomic_store_n(&cpu->fpuOwner, cpu->idleThread, __ATOMIC_RELAXED);
+    }
 
-    for (unsigned j = 0; j < cpu->runQueue->get_length(); j++) {
-        if (Thread* thread = cpu->runQueue->get_at(j); thread != cpu->currentThread && thread->parent == this) {
-            cpu->runQueue->remove_at(j);
-            j = 0;
+    for (int i = 0; i < SchedulingClassCount; i++) {
+        FastList<Thread*>* queue = cpu->runQueues[i];
+        for (unsigned j = 0; j < queue->get_length(); j++) {
+            if (Thread* thread = queue->get_at(j); thread != cpu->currentThread && thread->parent == this) {
+                queue->remove_at(j);
+                j = 0;
+            }
         }
     }
 
-    releaseLock(&cpu->runQueueLock);
+    cpu->runQueueLock.Release();
 
     for (unsigned i = 0; i < SMP::processorCount; i++) {
         if (i == cpu->id)
@@ -454,7 +493,7 @@ void Process::Die() {
 
         CPU* other = SMP::cpus[i];
         asm("sti");
-        acquireLockIntDisable(&other->runQueueLock);
+        other->runQueueLock.AcquireIntDisable();
 
         if(other->currentThread && other->currentThread->parent == this) {
             assert(other->currentThread->state == ThreadStateDying); // The thread state should be blocked
@@ -462,14 +501,24 @@ void Process::Die() {
             other->currentThread = nullptr;
         }
 
-        for (unsigned j = 0; j < other->runQueue->get_length(); j++) {
-            Thread* thread = other->runQueue->get_at(j);
+        // The thread will be freed, hand the FPU to the idle thread
+        // so the CPU will write the state back somewhere safe.
+        // The owner only changes with the run queue lock held
+        if (Thread* owner = __atomic_load_n(&other->fpuOwner, __ATOMIC_RELAXED); owner && owner->parent == this) {
+            __atomic_store_n(&other->fpuOwner, other->idleThread, __ATOMIC_RELAXED);
+        }
 
-            assert(thread);
+        for (int k = 0; k < SchedulingClassCount; k++) {
+            FastList<Thread*>* queue = other->runQueues[k];
+            for (unsigned j = 0; j < queue->get_length(); j++) {
+                Thread* thread = queue->get_at(j);
 
-            if (thread->parent == this) {
-                other->runQueue->remove(thread);
-                j = 0;
+                assert(thread);
+
+                if (thread->parent == this) {
+                    queue->remove(thread);
+                    j = 0;
+                }
             }
         }
 
@@ -477,7 +526,7 @@ void Process::Die() {
             APIC::Local::SendIPI(i, ICR_DSH_SELF, ICR_MESSAGE_TYPE_FIXED, IPI_SCHEDULE);
         }
 
-        releaseLock(&other->runQueueLock);
+        other->runQueueLock.Release();
         asm("sti");
 
         if (other->currentThread == nullptr) {
@@ -486,10 +535,9 @@ void Process::Die() {
     }
 
     asm("sti");
-    releaseLock(&Scheduler::processesLock);
 
     Log::Debug(debugLevelScheduler, DebugLevelNormal, "[%d] Closing handles...", m_pid);
-    m_handles.clear();
+    m_handles.Clear();
 
     Log::Debug(debugLevelScheduler, DebugLevelNormal, "[%d] Signaling watchers...", m_pid);
     {
@@ -516,10 +564,11 @@ void Process::Die() {
 
     bool isDyingProcess = (thisThread->parent == this);
     if(isDyingProcess){
-        acquireLockIntDisable(&cpu->runQueueLock);
+        cpu->runQueueLock.AcquireIntDisable();
         Log::Debug(debugLevelScheduler, DebugLevelNormal, "[%d] Rescheduling...", m_pid);
 
         asm volatile("mov %%rax, %%cr3" ::"a"(((uint64_t)Memory::kernelPML4) - KERNEL_VIRTUAL_BASE));
+        cpu->currentPageMap = nullptr;
 
         thisThread->state = ThreadStateDying;
         thisThread->timeSlice = 0;
@@ -529,10 +578,11 @@ void Process::Die() {
         // cpu may have changes since we released the processes lock
         // as the run queue
         cpu = GetCPULocal();
-        cpu->runQueue->remove(thisThread);
+        cpu->runQueues[thisThread->schedulingClass]->remove(thisThread);
         cpu->currentThread = cpu->idleThread;
 
-        releaseLock(&cpu->runQueueLock);
+        Scheduler::ReleaseFPU(cpu);
+        cpu->runQueueLock.Release();
 
         Scheduler::DoSwitch(cpu);
         KernelPanic("Dead process attempting to continue execution");
@@ -541,6 +591,19 @@ void Process::Die() {
     }
 }
 
+size_t Process::IPCMemory() {
+    size_t used = 0;
+    unsigned handleCount = m_handles.Count();
+    for (unsigned i = 0; i < handleCount; i++) {
+        Handle h = m_handles.Get(i);
+        if (h.IsValid() && h.ko->IsType(MessageEndpoint::TypeID())) {
+            used += static_cast<MessageEndpoint*>(h.ko.get())->UsedMemory();
+        }
+    }
+
+    return used;
+}
+
 void Process::Start(){
     ScopedSpinLock acq(m_processLock);
     assert(!m_started);
@@ -576,16 +639,20 @@ FancyRefPtr<Process> Process::Fork() {
     FancyRefPtr<Process> newProcess = new Process(Scheduler::GetNextPID(), name, workingDirPath, this);
     delete newProcess->addressSpace; // TODO: Do not create address space in first place
     newProcess->addressSpace = addressSpace->Fork();
+    KernelData::MapIntoProcess(newProcess.get());
+
+    Thread* forkingThread = Thread::Current();
+    newProcess->m_mainThread->schedulingClass = forkingThread->schedulingClass;
+    newProcess->m_mainThread->timeSliceDefault = Scheduler::TimeSliceForClass(forkingThread->schedulingClass);
+    newProcess->m_mainThread->timeSlice = newProcess->m_mainThread->timeSliceDefault;
+    newProcess->m_mainThread->affinity = forkingThread->affinity;
 
     newProcess->euid = euid;
     newProcess->uid = uid;
     newProcess->euid = egid;
     newProcess->gid = gid;
 
-    newProcess->m_handles.resize(m_handles.size());
-    for(unsigned i = 0; i < m_handles.size(); i++){
-        newProcess->m_handles[i] = m_handles[i];
-    }
+    newProcess->m_handles.CopyFrom(m_handles, false);
 
     m_children.add_back(newProcess);
     Scheduler::RegisterProcess(newProcess);
@@ -606,10 +673,14 @@ pid_t Process::CreateChildThread(uintptr_t entry, uintptr_t stack, uint64_t cs,
     registers->rflags = 0x202; // IF - Interrupt Flag, bit 1 should be 1
     thread.registers.cs = cs;
     thread.registers.ss = ss;
-    thread.timeSliceDefault = THREAD_TIMESLICE_DEFAULT;
-    thread.timeSlice = thread.timeSliceDefault;
     thread.priority = 4;
 
+    // New threads inherit the scheduling class and affinity of their creator
+    thread.schedulingClass = Thread::Current()->schedulingClass;
+    thread.timeSliceDefault = Scheduler::TimeSliceForClass(thread.schedulingClass);
+    thread.timeSlice = thread.timeSliceDefault;
+    thread.affinity = Thread::Current()->affinity;
+
     Scheduler::InsertNewThreadIntoQueue(&thread);
     return threadID;
 }
@@ -635,8 +706,10 @@ void Process::MapSignalTrampoline(){
     m_signalTrampoline->vmObject->MapAllocatedBlocks(m_signalTrampoline->Base(), GetPageMap());
 
     // Copy signal trampoline code into process
-    asm volatile("cli; mov %%rax, %%cr3" ::"a"(GetPageMap()->pml4Phys));
+    asm volatile("cli");
+    Memory::SwitchPageMap(GetPageMap());
     memcpy(reinterpret_cast<void*>(m_signalTrampoline->Base()), signalTrampolineStart,
            signalTrampolineEnd - signalTrampolineStart);
-    asm volatile("mov %%rax, %%cr3; sti" ::"a"(Scheduler::GetCurrentProcess()->GetPageMap()->pml4Phys));
+    Memory::SwitchPageMap(Scheduler::GetCurrentProcess()->GetPageMap());
+    asm volatile("sti");
 }
\ No newline at end of file
@@ -16,20 +16,17 @@ ServiceFS::ServiceFS(){
 long ServiceFS::ResolveServiceName(FancyRefPtr<Service>& ref, const char* name){
     const char* separator = strchr(name, '/');
 
-    if(separator){
-        for(auto& svc : services){
-            if(strncmp(svc->GetName(), name, separator - name) == 0){
-                ref = svc;
-                return 0;
-            }
-        }
-    } else {
-        for(auto& svc : services){
-            if(strcmp(svc->GetName(), name) == 0){
-                ref = svc;
-                return 0;
-            }
-        }
+    size_t length = separator ? static_cast<size_t>(separator - name) : strlen(name);
+    char serviceName[length + 1];
+    strncpy(serviceName, name, length);
+    serviceName[length] = 0;
+
+    ScopedSpinLock lockServices(m_servicesLock);
+
+    FancyRefPtr<Service>* entry;
+    if(m_services.get(StringView(serviceName), entry)){
+        ref = *entry;
+        return 0;
     }
 
     //Log::Warning("Service %s not found!", name);
@@ -37,10 +34,40 @@ long ServiceFS::ResolveServiceName(FancyRefPtr<Service>& ref, const char* name){
 }
 
 FancyRefPtr<Service> ServiceFS::CreateService(const char* name){
+    ScopedSpinLock lockServices(m_servicesLock);
+
+    FancyRefPtr<Service>* entry;
+    if(m_services.get(StringView(name), entry)){
+        Service* registered = entry->get();
+        if(registered->m_registered && !registered->m_created){
+            registered->m_created = true; // Take over the registered service
+            return *entry;
+        }
+
+        return nullptr;
+    }
+
     auto svc = FancyRefPtr<Service>(new Service(name));
 
-    services.add_back(svc);
-    (*svc.GetRefCount())--; // Really hacky but means that the service list entry does not count as a reference
+    // The key points to the name of the service, which lives as long as the entry
+    m_services.insert(StringView(svc->GetName()), new FancyRefPtr<Service>(svc));
+    (*svc.GetRefCount())--; // Really hacky but means that the service table entry does not count as a reference
+
+    return svc;
+}
+
+FancyRefPtr<Service> ServiceFS::RegisterService(const char* name){
+    ScopedSpinLock lockServices(m_servicesLock);
+    if(m_services.find(StringView(name))){
+        return nullptr;
+    }
+
+    auto svc = FancyRefPtr<Service>(new Service(name));
+    svc->m_registered = true;
+    svc->m_created = false;
+
+    m_services.insert(StringView(svc->GetName()), new FancyRefPtr<Service>(svc));
+    (*svc.GetRefCount())--; // As with CreateService, the entry does not count as a reference
 
     return svc;
 }
@@ -54,17 +81,24 @@ Service::~Service(){
 }
 
 void Service::Destroy(){
+    for(auto& i : interfaces){
+        m_interfaceTable.remove(StringView(i->name));
+    }
     interfaces.clear();
 
-    auto& services = ServiceFS::Instance()->services;
-    auto it = services.begin();
-    while(it != services.end()){
-        if(*it == this){
-            services.remove(it);
-            break;
+    ServiceFS* fs = ServiceFS::Instance();
+
+    FancyRefPtr<Service>* entry = nullptr;
+    {
+        ScopedSpinLock lockServices(fs->m_servicesLock);
+        if(fs->m_services.get(StringView(name), entry) && entry->get() == this){
+            fs->m_services.remove(StringView(name));
+        } else {
+            entry = nullptr;
         }
-        it++;
     }
+
+    delete entry; // Does not free us as the entry is not counted as a reference
 }
 
 long Service::CreateInterface(FancyRefPtr<MessageInterface>& rInterface, const char* name, uint16_t msgSize){
@@ -73,27 +107,91 @@ long Service::CreateInterface(FancyRefPtr<MessageInterface>& rInterface, const c
         return -EINVAL;
     }
 
-    for(auto& i : interfaces){
-        if(strcmp(name, i->name) == 0){
-            return -EEXIST;
-        }
+    if(m_interfaceTable.find(StringView(name))){
+        return -EEXIST;
     }
 
     rInterface = FancyRefPtr<MessageInterface>(new MessageInterface(name, msgSize));
 
     interfaces.add_back(rInterface);
 
+    unsigned waiting;
+    {
+        ScopedSpinLock lockWait(m_waitLock);
+        m_interfaceTable.insert(StringView(rInterface->name), rInterface);
+
+        waiting = m_interfaceWaiting;
+    }
+
+    // Connections waiting on the service look for their interface again
+    while(waiting--){
+        m_interfaceWaiters.Signal();
+    }
+
     return 0;
 }
 
 long Service::ResolveInterface(FancyRefPtr<MessageInterface>& interface, const char* name){
-    for(auto& _if : interfaces){
-        if(strcmp(_if->name, name) == 0){
-            interface = _if;
-            return 0;
-        }
+    if(m_interfaceTable.get(StringView(name), interface)){
+        return 0;
     }
 
     Log::Warning("Interface %s not found!", name);
     return 1;
-}
\ No newline at end of file
+}
+
+long Service::ConnectInterface(FancyRefPtr<MessageInterface>& interface, const char* name){
+    if(!m_registered){
+        return ResolveInterface(interface, name) ? -ENOENT : 0;
+    }
+
+    long timeout = SERVICE_ACTIVATION_TIMEOUT;
+    while(true){
+        {
+            ScopedSpinLock lockWait(m_waitLock);
+            if(m_interfaceTable.get(StringView(name), interface)){
+                return 0;
+            }
+
+            if(!m_activated){
+                m_activated = true;
+                while(m_watchers.get_length()){
+                    m_watchers.remove_at(0)->Signal();
+                }
+            }
+
+            if(timeout <= 0){
+                Log::Warning("Service %s did not create interface %s!", this->name, name);
+                return -ENOENT;
+            }
+
+            m_interfaceWaiting++;
+        }
+
+        bool interrupted = m_interfaceWaiters.WaitTimeout(timeout);
+
+        {
+            ScopedSpinLock lockWait(m_waitLock);
+            m_interfaceWaiting--;
+        }
+
+        if(interrupted){
+            return -EINTR;
+        }
+    }
+}
+
+void Service::Watch(KernelObjectWatcher& watcher, int){
+    ScopedSpinLock lockWait(m_waitLock);
+    if(m_activated){
+        watcher.Signal();
+        return;
+    }
+
+    m_watchers.add_back(&watcher);
+}
+
+void Service::Unwatch(KernelObjectWatcher& watcher){
+    ScopedSpinLock lockWait(m_waitLock);
+    m_watchers.remove(&watcher);
+}
@@ -0,0 +1,206 @@
+#include <Objects/WaitSet.h>
+
+#include <Errno.h>
+#include <Fs/Filesystem.h>
+
+void WaitSetItem::Signal() { set->Queue(this, true); }
+
+WaitSet::~WaitSet() {
+    for (WaitSetItem* item : m_items) {
+        if (item) {
+            item->object->Unwatch(*item);
+            delete item;
+        }
+    }
+}
+
+long WaitSet::Add(handle_id_t id, const FancyRefPtr<KernelObject>& object) {
+    if (id < 0) {
+        return -EBADF;
+    }
+
+    ScopedMutexLock lock(m_lock);
+    if (static_cast<unsigned>(id) < m_items.get_length() && m_items[id]) {
+        return -EEXIST;
+    }
+
+    if (static_cast<unsigned>(id) >= m_items.get_length()) {
+        m_items.resize(id + 1);
+    }
+
+    WaitSetItem* item = new WaitSetItem(this, id, object);
+    m_items[id] = item;
+
+    Arm(item);
+    return 0;
+}
+
+long WaitSet::Remove(handle_id_t id) {
+    ScopedMutexLock lock(m_lock);
+    if (id < 0 || static_cast<unsigned>(id) >= m_items.get_length() || !m_items[id]) {
+        return -ENOENT;
+    }
+
+    WaitSetItem* item = m_items[id];
+    m_items[id] = nullptr;
+
+    item->object->Unwatch(*item);
+    {
+        ScopedSpinLock<true> lockReady(m_readyLock);
+        if (item->ready) {
+            m_ready.remove(item);
+        }
+    }
+
+    delete item;
+    return 0;
+}
+
+long WaitSet::Wait(UserBuffer<handle_id_t> ready, int maxReady, long timeout) {
+    while (true) {
+        {
+            ScopedMutexLock lock(m_lock);
+            if (int count = Collect(ready, maxReady); count) {
+                return count;
+            }
+        }
+
+        if (!timeout) {
+            return 0;
+        }
+
+        {
+            ScopedSpinLock<true> lockReady(m_readyLock);
+            if (m_ready.get_length()) {
+                continue; // Queued since collecting
+            }
+
+            m_waiting++;
+        }
+
+        bool interrupted;
+        if (timeout > 0) {
+            interrupted = m_waiters.WaitTimeout(timeout);
+            if (timeout <= 0) {
+                timeout = 0; // Timed out, collect one last time
+            }
+        } else {
+            interrupted = m_waiters.Wait();
+        }
+
+        {
+            ScopedSpinLock<true> lockReady(m_readyLock);
+            m_waiting--;
+        }
+
+        if (interrupted) {
+            return -EINTR;
+        }
+    }
+}
+
+void WaitSet::Watch(KernelObjectWatcher& watcher, int) {
+    ScopedSpinLock<true> lockReady(m_readyLock);
+    if (m_ready.get_length()) {
+        watcher.Signal();
+        return;
+    }
+
+    ScopedSpinLock lockWatchers(m_watchersLock);
+    m_watchers.add_back(&watcher);
+}
+
+void WaitSet::Unwatch(KernelObjectWatcher& watcher) {
+    ScopedSpinLock lockWatchers(m_watchersLock);
+    m_watchers.remove(&watcher);
+}
+
+void WaitSet::Queue(WaitSetItem* item, bool wake) {
+    unsigned wakeCount;
+    {
+        ScopedSpinLock<true> lockReady(m_readyLock);
+        if (!item->ready) {
+            item->ready = true;
+            m_ready.add_back(item);
+        }
+
+        wakeCount = m_waiting;
+
+        if (wake) {
+            ScopedSpinLock lockWatchers(m_watchersLock);
+            while (m_watchers.get_length()) {
+                m_watchers.remove_at(0)->Signal();
+            }
+        }
+    }
+
+    if (!wake) {
+        return;
+    }
+
+    while (wakeCount--) {
+        m_waiters.Signal();
+    }
+}
+
+void WaitSet::Arm(WaitSetItem* item) {
+    item->rearm = false;
+
+    // Objects only signal a watcher once, make sure it is not watching twice
+    item->object->Unwatch(*item);
+    item->object->Watch(*item, 0);
+
+    // Files do not signal when they are already readable
+    if (item->object->IsType(KOTypeID::UNIXOpenFile) &&
+        static_cast<UNIXOpenFile*>(item->object.get())->node->CanRead()) {
+        Queue(item, false);
+    }
+}
+
+int WaitSet::Collect(UserBuffer<handle_id_t>& ready, int maxReady) {
+    unsigned pending;
+    {
+        ScopedSpinLock<true> lockReady(m_readyLock);
+        pending = m_ready.get_length(); // Items put back on the list are left for the next call
+    }
+
+    int count = 0;
+    while (pending-- && count < maxReady) {
+        WaitSetItem* item;
+        {
+            ScopedSpinLock<true> lockReady(m_readyLock);
+            item = m_ready.get_front();
+            if (!item) {
+                break;
+            }
+
+            m_ready.remove(item);
+            item->ready = false;
+        }
+
+        if (item->rearm) {
+            // Objects still ready signal as soon as they are watched
+            Arm(item);
+
+            ScopedSpinLock<true> lockReady(m_readyLock);
+            if (!item->ready) {
+                continue; // No longer ready
+            }
+
+            m_ready.remove(item);
+            item->ready = false;
+        }
+
+        if (ready.StoreValue(count, item->id)) {
+            Queue(item, false);
+            return -EFAULT;
+        }
+        count++;
+
+        // Watched again the next time the set is waited on, once the object has been handled
+        item->rearm = true;
+        Queue(item, false);
+    }
+
+    return count;
+}
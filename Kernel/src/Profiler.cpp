@@ -0,0 +1,257 @@
+#include <Profiler.h>
+
+#include <CPU.h>
+#include <CString.h>
+#include <Device.h>
+#include <Errno.h>
+#include <Lock.h>
+#include <Math.h>
+#include <Objects/Process.h>
+#include <SMP.h>
+#include <StackTrace.h>
+#include <Symbols.h>
+#include <Thread.h>
+
+namespace Profiler {
+
+struct ProfileSample {
+    uintptr_t frames[PROFILER_MAX_FRAMES]; // The interrupted address then its callers
+    pid_t pid;
+    pid_t tid;
+    uint8_t depth;
+    bool user;
+    char process[PROFILER_NAME_LENGTH];
+};
+
+// Written by the CPU on its tick, read by /dev/profile
+struct CPUSamples {
+    ProfileSample samples[PROFILER_SAMPLES_PER_CPU];
+
+    uint64_t head = 0; // Only written by the CPU
+    uint64_t tail = 0; // Only written by readers
+    uint64_t dropped = 0;
+};
+
+bool running = false;
+static bool sampleStacks = false;
+static CPUSamples* cpuSamples[PROFILER_MAX_CPUS];
+
+void Sample(RegisterContext* r) {
+    CPU* cpu = GetCPULocal();
+    CPUSamples* samples = (cpu->id < PROFILER_MAX_CPUS) ? cpuSamples[cpu->id] : nullptr;
+    if (!samples) {
+        return;
+    }
+
+    uint64_t head = samples->head;
+    if (head - __atomic_load_n(&samples->tail, __ATOMIC_ACQUIRE) >= PROFILER_SAMPLES_PER_CPU) {
+        samples->dropped++;
+        return;
+    }
+
+    ProfileSample& sample = samples->samples[head & (PROFILER_SAMPLES_PER_CPU - 1)];
+    Thread* thread = cpu->currentThread;
+    if (thread) {
+        sample.pid = thread->parent->PID();
+        sample.tid = thread->tid;
+        strncpy(sample.process, thread->parent->name, PROFILER_NAME_LENGTH - 1);
+        sample.process[PROFILER_NAME_LENGTH - 1] = 0;
+    } else {
+        sample.pid = sample.tid = 0;
+        strcpy(sample.process, "none");
+    }
+
+    sample.user = r->cs & 3;
+    sample.frames[0] = r->rip;
+    sample.depth = 1;
+
+    // User stacks could be paged out, only kernel stacks are followed
+    if (sampleStacks && !sample.user && thread) {
+        uintptr_t stack = reinterpret_cast<uintptr_t>(thread->kernelStackBase);
+        sample.depth += GetStackTraceWithin(r->rbp, stack, stack + THREAD_KERNEL_STACK_SIZE, sample.frames + 1,
+                                            PROFILER_MAX_FRAMES - 1);
+    }
+
+    __atomic_store_n(&samples->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Kernel symbol lookups go through every symbol, so recent ones are kept
+class SymbolCache final {
+public:
+    KernelSymbol* Resolve(uintptr_t address) {
+        Entry& entry = m_entries[(address >> 2) & (cacheSize - 1)];
+        if (entry.address != address) {
+            entry.address = address;
+            if (!ResolveKernelSymbol(address, entry.symbol)) {
+                entry.symbol = nullptr;
+            }
+        }
+
+        return entry.symbol;
+    }
+
+    void Clear() {
+        for (Entry& entry : m_entries) {
+            entry.address = 0;
+        }
+    }
+
+private:
+    static constexpr unsigned cacheSize = 1024;
+
+    struct Entry {
+        uintptr_t address = 0;
+        KernelSymbol* symbol = nullptr;
+    };
+    Entry m_entries[cacheSize];
+};
+
+class ProfileDevice final : public Device {
+public:
+    ProfileDevice() : Device("profile", DeviceTypeUNIXPseudo) {
+        flags = FS_NODE_FILE;
+
+        SetDeviceName("Sampling Profiler");
+    }
+
+    ssize_t Read(size_t, size_t size, uint8_t* buffer) override {
+        ScopedMutexLock lock(m_lock);
+
+        char line[lineSize];
+        size_t written = 0;
+        for (CPUSamples*& samples : cpuSamples) {
+            if (!samples) {
+                continue;
+            }
+
+            unsigned cpu = &samples - cpuSamples;
+            if (uint64_t dropped = __atomic_exchange_n(&samples->dropped, 0, __ATOMIC_RELAXED)) {
+                char* text = Append(line, "# ");
+                text = AppendNumber(text, cpu, 10);
+                text = Append(text, " dropped ");
+                text = AppendNumber(text, dropped, 10);
+                *(text++) = '\n';
+
+                if (written + (text - line) > size) {
+                    samples->dropped += dropped; // Reported next time
+                    return written;
+                }
+                memcpy(buffer + written, line, text - line);
+                written += text - line;
+            }
+
+            uint64_t head = __atomic_load_n(&samples->head, __ATOMIC_ACQUIRE);
+            while (samples->tail != head) {
+                size_t len = FormatSample(line, cpu, samples->samples[samples->tail & (PROFILER_SAMPLES_PER_CPU - 1)]);
+                if (written + len > size) {
+                    return written; // The rest are read next time
+                }
+
+                memcpy(buffer + written, line, len);
+                written += len;
+                __atomic_store_n(&samples->tail, samples->tail + 1, __ATOMIC_RELEASE);
+            }
+        }
+
+        return written;
+    }
+
+    ssize_t Write(size_t, size_t size, uint8_t* buffer) override {
+        ScopedMutexLock lock(m_lock);
+
+        if (size >= 5 && !strncmp(reinterpret_cast<char*>(buffer), "start", 5)) {
+            Start(size >= 11 && !strncmp(reinterpret_cast<char*>(buffer) + 5, " stack", 6));
+        } else if (size >= 4 && !strncmp(reinterpret_cast<char*>(buffer), "stop", 4)) {
+            __atomic_store_n(&running, false, __ATOMIC_RELEASE);
+        } else {
+            return -EINVAL;
+        }
+
+        return size;
+    }
+
+private:
+    // Frames are at most a symbol name and an offset
+    static constexpr size_t frameSize = 128;
+    static constexpr size_t lineSize = 64 + PROFILER_NAME_LENGTH + PROFILER_MAX_FRAMES * frameSize;
+
+    void Start(bool stacks) {
+        for (unsigned i = 0; i < PROFILER_MAX_CPUS; i++) {
+            if (SMP::cpus[i] && !cpuSamples[i]) {
+                cpuSamples[i] = new CPUSamples();
+            }
+        }
+
+        // Discard any samples left from last time
+        for (CPUSamples* samples : cpuSamples) {
+            if (samples) {
+                __atomic_store_n(&samples->tail, __atomic_load_n(&samples->head, __ATOMIC_ACQUIRE),
+                                 __ATOMIC_RELEASE);
+                samples->dropped = 0;
+            }
+        }
+
+        // Modules may have been loaded or unloaded
+        m_symbols.Clear();
+
+        sampleStacks = stacks;
+        __atomic_store_n(&running, true, __ATOMIC_RELEASE);
+    }
+
+    static char* Append(char* text, const char* str) {
+        size_t len = strlen(str);
+        memcpy(text, str, len);
+        return text + len;
+    }
+
+    static char* AppendNumber(char* text, uint64_t num, int base) {
+        itoa(num, text, base);
+        return text + strlen(text);
+    }
+
+    size_t FormatSample(char* line, unsigned cpu, const ProfileSample& sample) {
+        char* text = AppendNumber(line, cpu, 10);
+        *(text++) = ' ';
+        text = AppendNumber(text, sample.pid, 10);
+        *(text++) = ' ';
+        text = AppendNumber(text, sample.tid, 10);
+        *(text++) = ' ';
+
+        // Names are separated by spaces so leave them out of the process name
+        for (const char* c = sample.process; *c; c++) {
+            *(text++) = (*c == ' ') ? '_' : *c;
+        }
+        if (!sample.process[0]) {
+            *(text++) = '?';
+        }
+
+        text = Append(text, sample.user ? " u" : " k");
+        for (unsigned i = 0; i < sample.depth; i++) {
+            *(text++) = ' ';
+
+            uintptr_t address = sample.frames[i];
+            KernelSymbol* symbol = (address >= KERNEL_VIRTUAL_BASE) ? m_symbols.Resolve(address) : nullptr;
+            if (symbol) {
+                size_t len = MIN(strlen(symbol->mangledName), frameSize - 24);
+                memcpy(text, symbol->mangledName, len);
+                text += len;
+
+                text = Append(text, "+0x");
+                text = AppendNumber(text, address - symbol->address, 16);
+            } else {
+                text = Append(text, "0x");
+                text = AppendNumber(text, address, 16);
+            }
+        }
+        *(text++) = '\n';
+
+        return text - line;
+    }
+
+    Mutex m_lock;
+    SymbolCache m_symbols;
+};
+
+void Initialize() { new ProfileDevice(); }
+
+} // namespace Profiler
@@ -0,0 +1,105 @@
+#include <RCU.h>
+
+#include <Assert.h>
+#include <CPU.h>
+#include <Lock.h>
+#include <Objects/Process.h>
+#include <SMP.h>
+#include <Spinlock.h>
+
+#define RCU_POLL_INTERVAL 1000 // Microseconds between checking whether CPUs have been through a quiescent state
+
+namespace RCU {
+
+struct Callback {
+    Callback* next;
+    void (*func)(void*);
+    void* arg;
+};
+
+// Incremented at the start of every grace period
+static uint64_t sequence = 0;
+
+static lock_t callbacksLock = 0;
+static Callback* callbacks = nullptr; // Waiting for the RCU thread, newest first
+static Semaphore callbacksSemaphore = Semaphore(0);
+
+void QuiescentState(CPU* cpu) {
+    __atomic_store_n(&cpu->rcuSequence, __atomic_load_n(&sequence, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
+
+// Whether cpu has been through a quiescent state since grace period target started
+static bool PassedQuiescentState(CPU* cpu, uint64_t target) {
+    if (__atomic_load_n(&cpu->rcuSequence, __ATOMIC_SEQ_CST) >= target) {
+        return true;
+    }
+
+    // Idle CPUs stop ticking, but they have to have gone through the scheduler to become idle
+    return __atomic_load_n(&cpu->idle, __ATOMIC_SEQ_CST) &&
+           __atomic_load_n(&cpu->currentThread, __ATOMIC_SEQ_CST) == cpu->idleThread;
+}
+
+void Synchronize() {
+    assert(!Thread::Current()->rcuReadDepth);
+
+    uint64_t target = __atomic_add_fetch(&sequence, 1, __ATOMIC_SEQ_CST);
+
+    // We are not in a read section and readers are never preempted,
+    // so nothing can be reading on this CPU
+    asm volatile("cli");
+    QuiescentState(GetCPULocal());
+    asm volatile("sti");
+
+    for (unsigned i = 0; i < SMP::processorCount; i++) {
+        while (!PassedQuiescentState(SMP::cpus[i], target)) {
+            Thread::Current()->Sleep(RCU_POLL_INTERVAL);
+        }
+    }
+}
+
+void Call(void (*func)(void*), void* arg) {
+    Callback* cb = new Callback{nullptr, func, arg};
+
+    acquireLock(&callbacksLock);
+    cb->next = callbacks;
+    callbacks = cb;
+    releaseLock(&callbacksLock);
+
+    callbacksSemaphore.Signal();
+}
+
+// Takes every queued callback at once so they all share a grace period
+static void RCUThread() {
+    for (;;) {
+        if (callbacksSemaphore.Wait()) {
+            continue; // Interrupted
+        }
+
+        acquireLock(&callbacksLock);
+        Callback* batch = callbacks;
+        callbacks = nullptr;
+        releaseLock(&callbacksLock);
+
+        if (!batch) {
+            continue; // Taken with an earlier batch
+        }
+
+        Synchronize();
+
+        while (batch) {
+            Callback* next = batch->next;
+
+            batch->func(batch->arg);
+            delete batch;
+
+            batch = next;
+        }
+    }
+}
+
+void Initialize() {
+    auto proc = Process::CreateKernelProcess((void*)RCUThread, "RCU", nullptr);
+    proc->Start();
+}
+
+} // namespace RCU
@@ -1,13 +1,39 @@
 #include <Memory.h>
 
+#include <Errno.h>
 #include <Lock.h>
 #include <Logging.h>
 #include <RefPtr.h>
 #include <Scheduler.h>
 #include <SharedMemory.h>
 
-SharedVMObject::SharedVMObject(size_t size, int64_t key, pid_t owner, pid_t recipient, bool isPrivate)
-    : PhysicalVMObject(size, false, true), key(key), owner(owner), recipient(recipient), isPrivate(isPrivate) {}
+SharedVMObject::SharedVMObject(size_t size, size_t reserved, int64_t key, pid_t owner, pid_t recipient, bool isPrivate)
+    : PhysicalVMObject(reserved, true, true), key(key), committed(0), owner(owner), recipient(recipient),
+      isPrivate(isPrivate) {
+    assert(size <= reserved);
+
+    // Blocks are allocated up front rather than on fault
+    anonymous = false;
+    Grow(size);
+}
+
+long SharedVMObject::Grow(size_t newSize) {
+    assert(!(newSize & (PAGE_SIZE_4K - 1)));
+
+    ScopedSpinLock lockBlocks(blockLock);
+    if (newSize > size) {
+        return -EINVAL;
+    } else if (newSize <= committed) {
+        return 0;
+    }
+
+    if (AllocateRange(committed >> PAGE_SHIFT_4K, newSize >> PAGE_SHIFT_4K)) {
+        return -ENOMEM; // Blocks which were allocated are kept for the next attempt
+    }
+
+    committed = newSize;
+    return 0;
+}
 
 namespace Memory {
 lock_t sMemLock = 0;
@@ -45,7 +71,7 @@ int CanModifySharedMemory(pid_t pid, int64_t key) {
     return 0;
 }
 
-int64_t CreateSharedMemory(uint64_t size, uint64_t flags, pid_t owner, pid_t recipient) {
+int64_t CreateSharedMemory(uint64_t size, uint64_t flags, pid_t owner, pid_t recipient, uint64_t reserve) {
     ScopedSpinLock acquired(sMemLock);
 
     int64_t key = NextKey();
@@ -53,8 +79,13 @@ int64_t CreateSharedMemory(uint64_t size, uint64_t flags, pid_t owner, pid_t rec
         return 0;
 
     uint64_t vmoSize = (size + PAGE_SIZE_4K - 1) & ~static_cast<size_t>(PAGE_SIZE_4K - 1);
+    uint64_t reservedSize = vmoSize;
+    if ((flags & SMEM_FLAGS_RESERVE) && reserve > vmoSize) {
+        reservedSize = (reserve + PAGE_SIZE_4K - 1) & ~static_cast<size_t>(PAGE_SIZE_4K - 1);
+    }
 
-    SharedVMObject* sMem = new SharedVMObject(vmoSize, key, owner, recipient, flags & SMEM_FLAGS_PRIVATE);
+    SharedVMObject* sMem =
+        new SharedVMObject(vmoSize, reservedSize, key, owner, recipient, flags & SMEM_FLAGS_PRIVATE);
     table[key - 1] = sMem;
 
     return key;
@@ -83,6 +114,22 @@ void* MapSharedMemory(int64_t key, Process* proc, uint64_t hint) {
     return reinterpret_cast<void*>(region->Base());
 }
 
+long GrowSharedMemory(int64_t key, uint64_t size, pid_t pid) {
+    FancyRefPtr<SharedVMObject> sMem;
+    {
+        ScopedSpinLock acquired(sMemLock);
+        sMem = GetSharedMemory(key);
+    }
+
+    if (!sMem.get()) {
+        return -EINVAL;
+    } else if (sMem->Owner() != pid) {
+        return -EPERM;
+    }
+
+    return sMem->Grow((size + PAGE_SIZE_4K - 1) & ~static_cast<size_t>(PAGE_SIZE_4K - 1));
+}
+
 void DestroySharedMemory(int64_t key) {
     ScopedSpinLock acquired(sMemLock);
 
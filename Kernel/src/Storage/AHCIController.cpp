@@ -19,8 +19,32 @@ Port* ports[32];
 PCIDevice* controllerPCIDevice;
 uint8_t ahciClassCode = PCI_CLASS_STORAGE;
 uint8_t ahciSubclass = PCI_SUBCLASS_SATA;
+uint8_t ahciIRQ = 0xFF;
+uint32_t cccInterrupt = 0; // IS bit for coalesced completions, 0 when not coalescing
+unsigned cccCompletions = AHCI_CCC_COMPLETIONS;
+
+void InterruptHandler(void*, RegisterContext* r) {
+    uint32_t is = ahciHBA->is;
+
+    if (is & cccInterrupt) {
+        uint32_t coalesced = ahciHBA->ccc_pts;
+        for (int i = 0; i < 32; i++) {
+            if (((coalesced >> i) & 1) && ports[i]) {
+                ports[i]->ProcessCompletions();
+            }
+        }
+        is &= ~cccInterrupt;
+        ahciHBA->is = cccInterrupt;
+    }
+
+    for (int i = 0; i < 32; i++) {
+        if (((is >> i) & 1) && ports[i]) {
+            ports[i]->ProcessCompletions(); // Clears the port interrupt status
+        }
+    }
 
-void InterruptHandler(void*, RegisterContext* r) {}
+    ahciHBA->is = is;
+}
 
 int Init() {
     if (!PCI::FindGenericDevice(ahciClassCode, ahciSubclass)) {
@@ -42,11 +66,12 @@ int Init() {
 
     ahciHBA = (hba_mem_t*)ahciVirtualAddress;
 
-    /*uint8_t irq = controllerPCIDevice->AllocateVector(PCIVectors::PCIVectorAny);
-    if (irq == 0xFF) {
-        Log::Warning("[AHCI] Failed to allocate vector!");
+    ahciIRQ = controllerPCIDevice->AllocateVector(PCIVectors::PCIVectorAny);
+    if (ahciIRQ == 0xFF) {
+        Log::Warning("[AHCI] Failed to allocate vector, polling for completion");
+    } else {
+        IDT::RegisterInterruptHandler(ahciIRQ, reinterpret_cast<isr_t>(&InterruptHandler));
     }
-    //IDT::RegisterInterruptHandler(irq, InterruptHandler);*/
 
     uint32_t pi = ahciHBA->pi;
 
@@ -57,7 +82,7 @@ int Init() {
     ahciHBA->ghc &= ~AHCI_GHC_IE;
 
     if (debugLevelAHCI >= DebugLevelNormal) {
-        Log::Info("[AHCI] Interrupt Vector: %x, Base Address: %x, Virtual Base Address: %x", -1, ahciBaseAddress,
+        Log::Info("[AHCI] Interrupt Vector: %x, Base Address: %x, Virtual Base Address: %x", ahciIRQ, ahciBaseAddress,
                   ahciVirtualAddress);
         Log::Info("[AHCI] (Cap: %x, Cap2: %x) Enabled? %Y, BOHC? %Y, 64-bit addressing? %Y, Staggered Spin-up? %Y, "
                   "Slumber State Capable? %Y, Partial State Capable? %Y, FIS-based switching? %Y",
@@ -95,6 +120,29 @@ int Init() {
         }
     }
 
+    if (ahciIRQ != 0xFF) {
+        // Ports poll whilst they are set up, only enable interrupts once every port has been created
+        ahciHBA->is = 0xffffffff;
+        uint32_t activePorts = 0;
+        for (int i = 0; i < 32; i++) {
+            if (ports[i]) {
+                ports[i]->EnableInterrupts();
+                activePorts |= 1U << i;
+            }
+        }
+
+        if ((ahciHBA->cap & AHCI_CAP_CCCS) && cccCompletions && activePorts) {
+            // Report completions in batches, the controller interrupts once enough have built up or the timeout passes
+            ahciHBA->ccc_ctl = 0;
+            ahciHBA->ccc_ctl = AHCI_CCC_CTL_TV(AHCI_CCC_TIMEOUT) | AHCI_CCC_CTL_CC(cccCompletions);
+            ahciHBA->ccc_pts = activePorts;
+            ahciHBA->ccc_ctl = ahciHBA->ccc_ctl | AHCI_CCC_CTL_EN;
+
+            cccInterrupt = 1U << AHCI_CCC_CTL_INT(ahciHBA->ccc_ctl);
+        }
+        ahciHBA->ghc |= AHCI_GHC_IE;
+    }
+
     return 0;
 }
 } // namespace AHCI
\ No newline at end of file
@@ -2,6 +2,7 @@
 
 #include <Errno.h>
 #include <Logging.h>
+#include <Math.h>
 #include <Paging.h>
 #include <PhysicalAllocator.h>
 #include <Scheduler.h>
@@ -11,8 +12,6 @@
 
 #include <Debug.h>
 
-#define HBA_PxIS_TFES (1 << 30)
-
 namespace AHCI {
 Port::Port(int num, hba_port_t* portStructure, hba_mem_t* hbaMem) {
     registers = portStructure;
@@ -51,7 +50,8 @@ Port::Port(int num, hba_port_t* portStructure, hba_mem_t* hbaMem) {
     fis->rfis.fis_type = FIS_TYPE_REG_D2H;
     fis->sdbfis[0] = FIS_TYPE_DEV_BITS;
 
-    for (int i = 0; i < 8 /*Support for 8 command slots*/; i++) {
+    slotCount = AHCI_CAP_NCS(hbaMem->cap);
+    for (unsigned i = 0; i < slotCount; i++) {
         commandList[i].prdtl = 1;
 
         phys = Memory::AllocatePhysicalMemoryBlock();
@@ -68,8 +68,8 @@ Port::Port(int num, hba_port_t* portStructure, hba_mem_t* hbaMem) {
         registers->cmd &= ~HBA_PxCMD_ASP; // Disable aggressive slumber and partial
     }
 
-    registers->is = 0; // Clear interrupts
-    registers->ie = 1;
+    registers->is = 0xffffffff; // Clear interrupts
+    registers->ie = 0; // Enabled once the controller has an interrupt handler
     registers->fbs &= ~(0xFFFFF000U);
 
     registers->cmd |= HBA_PxCMD_POD;
@@ -141,16 +141,35 @@ Port::Port(int num, hba_port_t* portStructure, hba_mem_t* hbaMem) {
         return;
     }
 
-    for (unsigned i = 0; i < 8; i++) {
+    for (unsigned i = 0; i < AHCI_BUFFER_COUNT; i++) {
         physBuffers[i] = Memory::AllocatePhysicalMemoryBlock();
         buffers[i] = Memory::KernelAllocate4KPages(1);
         Memory::KernelMapVirtualMemory4K(physBuffers[i], (uintptr_t)buffers[i], 1);
     }
 
+    // The command engine is left running, commands are issued by setting their bit in CI
+    registers->serr = registers->serr;
+    registers->is = 0xffffffff;
+    StartCMD(registers);
+
+    freeSlots = 1; // One command at a time until we know whether the drive supports NCQ
+
     status = AHCIStatus::Active;
 
     Identify();
 
+    if ((hbaMem->cap & AHCI_CAP_NCQ) && queueDepth > 1) {
+        ncq = true;
+        slotCount = MIN(slotCount, queueDepth);
+        freeSlots = (slotCount >= 32) ? 0xffffffff : ((1U << slotCount) - 1);
+
+        ioThreads = AHCI_IO_THREADS; // Keep several requests outstanding
+    }
+
+    if (debugLevelAHCI >= DebugLevelNormal) {
+        Log::Info("[AHCI] NCQ: %Y, Queue depth: %d", ncq, ncq ? slotCount : 1);
+    }
+
     if (debugLevelAHCI >= DebugLevelNormal) {
         Log::Info("[AHCI] Port - SSTS: %x, SCTL: %x, SERR: %x, SACT: %x, Cmd/Status: %x, FBS: %x, IE: %x",
                   registers->ssts, registers->sctl, registers->serr, registers->sact, registers->cmd, registers->fbs,
@@ -169,8 +188,7 @@ Port::Port(int num, hba_port_t* portStructure, hba_mem_t* hbaMem) {
 
     InitializePartitions();
 
-    portLock.SetValue(1);
-    bufferSemaphore.SetValue(8);
+    bufferSemaphore.SetValue(AHCI_BUFFER_COUNT);
 }
 
 int Port::AcquireBuffer() {
@@ -179,7 +197,7 @@ int Port::AcquireBuffer() {
     }
 
     int i = 0;
-    for (; i < 8; i++) {
+    for (; i < AHCI_BUFFER_COUNT; i++) {
         if (!acquireTestLock(&bufferLocks[i])) {
             return i;
         }
@@ -190,55 +208,33 @@ int Port::AcquireBuffer() {
 }
 
 void Port::ReleaseBuffer(int index) {
-    assert(index < 8);
+    assert(index < AHCI_BUFFER_COUNT);
 
     releaseLock(&bufferLocks[index]);
     bufferSemaphore.Signal();
 }
 
 int Port::ReadDiskBlock(uint64_t lba, uint32_t count, void* _buffer) {
-    uint64_t blockCount = ((count + (blocksize - 1)) / blocksize);
     uint8_t* buffer = reinterpret_cast<uint8_t*>(_buffer);
 
-    // Log::Info("LBA: %x, count: %u, blcount: %u", lba, count, blockCount);
+    // PRDT entries point straight at the pages of the buffer
+    if (CanDMA(buffer, count, 2)) {
+        return Access(lba, count, buffer, 0);
+    }
 
     int buf = AcquireBuffer();
     if (buf == -EINTR) {
         return EINTR;
     }
-    if (buf >= 8 || buf < 0) {
+    if (buf >= AHCI_BUFFER_COUNT || buf < 0) {
         return 4; // Should not happen
     }
 
-    while (blockCount >= 8 && count) {
-        int size = 512 * 8;
-        if (size > count)
-            size = count;
-
-        if (!size)
-            break;
-
-        if (int e = Access(lba, 8, physBuffers[buf], 0); e) { // LBA, 8 blocks, read
-            return e;                                         // Error Reading Sectors
-        }
-
-        memcpy(buffer, buffers[buf], size);
-
-        buffer += size;
-        lba += 8;
-        blockCount -= 8;
-        count -= size;
-    }
-
-    while (blockCount >= 2 && count) {
-        int size = 512 << 1;
-        if (size > count)
-            size = count;
+    while (count) {
+        uint32_t size = MIN(count, PAGE_SIZE_4K);
+        uint32_t blocks = (size + (blocksize - 1)) / blocksize;
 
-        if (!size)
-            break;
-
-        if (int e = Access(lba, 2, physBuffers[buf], 0); e) { // LBA, 2 blocks, read
+        if (int e = Access(lba, blocks * blocksize, reinterpret_cast<uint8_t*>(buffers[buf]), 0); e) {
             ReleaseBuffer(buf);
             return e; // Error Reading Sectors
         }
@@ -246,217 +242,189 @@ int Port::ReadDiskBlock(uint64_t lba, uint32_t count, void* _buffer) {
         memcpy(buffer, buffers[buf], size);
 
         buffer += size;
-        lba += 2;
-        blockCount -= 2;
+        lba += blocks;
         count -= size;
     }
 
-    while (blockCount && count) {
-        int size = 512;
-        if (size > count)
-            size = count;
-
-        if (!size)
-            break;
-
-        if (int e = Access(lba, 1, physBuffers[buf], 0); e) { // LBA, 1 block, read
-            ReleaseBuffer(buf);
-            return e; // Error Reading Sectors
-        }
-
-        memcpy(buffer, buffers[buf], size);
-
-        buffer += size;
-        lba++;
-        blockCount--;
-        count -= size;
-    }
     ReleaseBuffer(buf);
     return 0;
 }
 
 int Port::WriteDiskBlock(uint64_t lba, uint32_t count, void* _buffer) {
-    uint64_t blockCount = ((count + (blocksize - 1)) / blocksize);
     uint8_t* buffer = reinterpret_cast<uint8_t*>(_buffer);
 
-    unsigned buf = AcquireBuffer();
-    if (buf >= 8) {
-        return 4; // Should not happen
+    if (CanDMA(buffer, count, 2)) {
+        return Access(lba, count, buffer, 1);
     }
 
-    while (blockCount-- && count) {
-        uint64_t size;
-        if (count < 512)
-            size = count;
-        else
-            size = 512;
+    int buf = AcquireBuffer();
+    if (buf == -EINTR) {
+        return EINTR;
+    }
+    if (buf >= AHCI_BUFFER_COUNT || buf < 0) {
+        return 4; // Should not happen
+    }
 
-        if (!size)
-            break;
+    while (count) {
+        uint32_t size = MIN(count, PAGE_SIZE_4K);
+        uint32_t blocks = (size + (blocksize - 1)) / blocksize;
 
         memcpy(buffers[buf], buffer, size);
 
-        if (int e = Access(lba, 1, physBuffers[buf], 1); e) { // LBA, 1 block, write
+        if (int e = Access(lba, blocks * blocksize, reinterpret_cast<uint8_t*>(buffers[buf]), 1); e) {
             ReleaseBuffer(buf);
-            return e; // Error Reading Sectors
+            return e; // Error Writing Sectors
         }
 
         buffer += size;
-        lba++;
+        lba += blocks;
+        count -= size;
     }
-    ReleaseBuffer(buf);
 
+    ReleaseBuffer(buf);
     return 0;
 }
 
-int Port::Access(uint64_t lba, uint32_t count, uintptr_t physBuffer, int write) {
-    assert(CheckInterrupts());
-
-    if (portLock.Wait()) {
-        return -EINTR;
-    }
-
-    registers->ie = 0xffffffff;
-    registers->is = 0;
-    int spin = 0;
-
-    int slot = FindCmdSlot();
-    if (slot == -1) {
-        Log::Warning("[SATA] Could not find command slot!");
-
-        portLock.Signal();
-        return -EIO;
-    }
-
-    registers->serr = registers->tfd = 0;
-
-    hba_cmd_header_t* commandHeader = &commandList[slot];
-
-    commandHeader->cfl = sizeof(fis_reg_h2d_t) / sizeof(uint32_t);
-
-    commandHeader->a = 0;
-    commandHeader->w = write;
-    commandHeader->c = 0;
-    commandHeader->p = 0;
-
-    commandHeader->prdbc = 0;
-    commandHeader->pmp = 0;
-
-    hba_cmd_tbl_t* commandTable = commandTables[slot];
-    memset(commandTable, 0, sizeof(hba_cmd_tbl_t));
-
-    commandTable->prdt_entry[0].dba = physBuffer & 0xFFFFFFFF;
-    commandTable->prdt_entry[0].dbau = (physBuffer >> 32) & 0xFFFFFFFF;
-    commandTable->prdt_entry[0].dbc = 512 * count - 1; // 512 bytes per sector
-    commandTable->prdt_entry[0].i = 1;
+int Port::Access(uint64_t lba, uint32_t count, uint8_t* buffer, int write) {
+    // Slots issued by this call, waited on in the order they were issued
+    int pending[AHCI_MAX_SLOTS];
+    unsigned pendingHead = 0;
+    unsigned pendingTail = 0;
+
+    int error = 0;
+    while (count && !error) {
+        int slot = TryAcquireSlot();
+        if (slot < 0) {
+            if (pendingHead != pendingTail) {
+                // Free up one of our own slots rather than waiting on other threads
+                error = Wait(pending[pendingHead++ % AHCI_MAX_SLOTS]);
+            } else {
+                ProcessCompletions();
+                Scheduler::Yield();
+            }
+            continue;
+        }
 
-    fis_reg_h2d_t* cmdfis = (fis_reg_h2d_t*)(commandTable->cfis);
-    memset(commandTable->cfis, 0, sizeof(fis_reg_h2d_t));
+        uint32_t size = MIN(count, AHCI_MAX_TRANSFER);
+        uint32_t blocks = size / blocksize;
+
+        fis_reg_h2d_t cmdfis;
+        memset(&cmdfis, 0, sizeof(fis_reg_h2d_t));
+
+        cmdfis.fis_type = FIS_TYPE_REG_H2D;
+        cmdfis.c = 1; // Command
+
+        cmdfis.lba0 = lba & 0xFF;
+        cmdfis.lba1 = (lba >> 8) & 0xFF;
+        cmdfis.lba2 = (lba >> 16) & 0xFF;
+        cmdfis.device = 1 << 6; // LBA mode
+
+        cmdfis.lba3 = (lba >> 24) & 0xFF;
+        cmdfis.lba4 = (lba >> 32) & 0xFF;
+        cmdfis.lba5 = (lba >> 40) & 0xFF;
+
+        if (ncq) {
+            // Queued commands take the sector count in the features register and the tag in the count register
+            cmdfis.command = write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED;
+            cmdfis.featurel = blocks & 0xff;
+            cmdfis.featureh = blocks >> 8;
+            cmdfis.countl = slot << 3;
+        } else {
+            cmdfis.command = write ? ATA_CMD_WRITE_DMA_EX : ATA_CMD_READ_DMA_EX;
+            cmdfis.countl = blocks & 0xff;
+            cmdfis.counth = blocks >> 8;
+        }
 
-    cmdfis->fis_type = FIS_TYPE_REG_H2D;
-    cmdfis->c = 1;      // Command
-    cmdfis->pmport = 0; // Port multiplier
+        Issue(slot, cmdfis, buffer, size, write);
+        pending[pendingTail++ % AHCI_MAX_SLOTS] = slot;
 
-    if (write) {
-        cmdfis->command = ATA_CMD_WRITE_DMA_EX;
-    } else {
-        cmdfis->command = ATA_CMD_READ_DMA_EX;
+        buffer += size;
+        lba += blocks;
+        count -= size;
     }
 
-    cmdfis->lba0 = lba & 0xFF;
-    cmdfis->lba1 = (lba >> 8) & 0xFF;
-    cmdfis->lba2 = (lba >> 16) & 0xFF;
-    cmdfis->device = 1 << 6;
-
-    cmdfis->lba3 = (lba >> 24) & 0xFF;
-    cmdfis->lba4 = (lba >> 32) & 0xFF;
-    cmdfis->lba5 = (lba >> 40) & 0xFF;
-
-    cmdfis->countl = count & 0xff;
-    cmdfis->counth = count >> 8;
-
-    cmdfis->control = 0x8;
-
-    spin = Timer::UsecondsSinceBoot() + 100000;
-    while ((registers->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && spin) {
-        if (Timer::UsecondsSinceBoot() >= spin) {
-            spin = 0;
+    while (pendingHead != pendingTail) {
+        if (int e = Wait(pending[pendingHead++ % AHCI_MAX_SLOTS]); e && !error) {
+            error = e;
         }
-
-        Scheduler::Yield();
     }
 
-    if (spin <= 0) {
-        Log::Warning("[SATA] Port Hung");
+    return error;
+}
 
-        portLock.Signal();
-        return -EIO;
+void Port::Identify() {
+    int slot;
+    while ((slot = TryAcquireSlot()) < 0) {
+        ProcessCompletions();
     }
 
-    registers->ie = registers->is = 0xffffffff;
+    fis_reg_h2d_t cmdfis;
+    memset(&cmdfis, 0, sizeof(fis_reg_h2d_t));
 
-    StartCMD(registers);
-    registers->ci |= 1 << slot;
+    cmdfis.fis_type = FIS_TYPE_REG_H2D;
+    cmdfis.c = 1; // Command
+    cmdfis.command = ATA_CMD_IDENTIFY;
 
-    // Log::Info("SERR: %x, Slot: %x, PxCMD: %x, Int status: %x, Ci: %x, TFD: %x", registers->serr, slot,
-    // registers->cmd, registers->is, registers->ci, registers->tfd);
-
-    spin = Timer::UsecondsSinceBoot() + 200000;
-    while ((registers->ci & (1 << slot)) && Timer::UsecondsSinceBoot() < spin) {
-        if (registers->is & HBA_PxIS_TFES) // Task file error
-        {
-            Log::Warning("[SATA] Disk Error (SERR: %x)", registers->serr);
+    uint8_t* buffer = reinterpret_cast<uint8_t*>(buffers[0]);
+    Issue(slot, cmdfis, buffer, 512, false);
 
-            StopCMD(registers);
-            portLock.Signal();
-            return -EIO;
-        }
+    if (Wait(slot)) {
+        Log::Warning("[SATA] Failed to identify device");
+        return;
     }
 
-    spin = Timer::UsecondsSinceBoot() + 100000;
-    while ((registers->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && spin) {
-        if (Timer::UsecondsSinceBoot() >= spin) {
-            spin = 0;
-        }
-
-        Scheduler::Yield();
+    uint16_t* identity = reinterpret_cast<uint16_t*>(buffer);
+    if (identity[ATA_IDENTIFY_SATA_CAPABILITIES] & ATA_SATA_CAP_NCQ) {
+        queueDepth = (identity[ATA_IDENTIFY_QUEUE_DEPTH] & 0x1f) + 1;
     }
+}
 
-    StopCMD(registers);
-
-    if (spin <= 0) {
-        Log::Warning("[SATA] Port Hung");
-
-        portLock.Signal();
-        return -EIO;
+int Port::TryAcquireSlot() {
+    ScopedSpinLock<true> lockSlots(slotLock);
+    if (!freeSlots) {
+        return -1;
     }
 
-    // Log::Info("SERR: %x, Slot: %x, PxCMD: %x, Int status: %x, Ci: %x, TFD: %x", registers->serr, slot,
-    // registers->cmd, registers->is, registers->ci, registers->tfd);
-
-    if (registers->is & HBA_PxIS_TFES) {
-        Log::Warning("[SATA] Disk Error (SERR: %x)", registers->serr);
-
-        portLock.Signal();
-        return -EIO;
-    }
+    int slot = __builtin_ctz(freeSlots);
+    freeSlots &= ~(1U << slot);
 
-    portLock.Signal();
-    return 0;
+    slots[slot].complete = false;
+    slots[slot].blocker = nullptr;
+    slots[slot].status = 0;
+    return slot;
 }
 
-void Port::Identify() {
+void Port::Issue(int slot, const fis_reg_h2d_t& cmdfis, uint8_t* buffer, uint32_t size, bool write) {
+    assert(size <= AHCI_MAX_TRANSFER && !(size & 1));
 
-    registers->ie = 0xffffffff;
-    registers->is = 0;
-    int spin = 0;
-
-    registers->tfd = 0;
+    hba_cmd_tbl_t* commandTable = commandTables[slot];
+    memcpy(commandTable->cfis, &cmdfis, sizeof(fis_reg_h2d_t));
+
+    // Build a scatter-gather list over the pages of the buffer, merging physically contiguous pages
+    unsigned entries = 0;
+    uintptr_t addr = reinterpret_cast<uintptr_t>(buffer);
+    while (size) {
+        uint32_t offset = addr & (PAGE_SIZE_4K - 1);
+        uint32_t len = MIN(size, PAGE_SIZE_4K - offset);
+        uintptr_t phys = Memory::VirtualToPhysicalAddress(addr) + offset;
+
+        hba_prdt_entry_t* last = entries ? &commandTable->prdt_entry[entries - 1] : nullptr;
+        if (last && ((static_cast<uintptr_t>(last->dbau) << 32) | last->dba) + last->dbc + 1 == phys) {
+            last->dbc += len;
+        } else {
+            assert(entries < AHCI_PRDT_MAX_ENTRIES);
+
+            hba_prdt_entry_t* entry = &commandTable->prdt_entry[entries++];
+            entry->dba = phys & 0xFFFFFFFF;
+            entry->dbau = phys >> 32;
+            entry->rsv0 = 0;
+            entry->dbc = len - 1;
+            entry->rsv1 = 0;
+            entry->i = 0;
+        }
 
-    int slot = FindCmdSlot();
-    if (slot == -1) {
-        Log::Warning("[SATA] Could not find command slot!");
-        return;
+        addr += len;
+        size -= len;
     }
 
     hba_cmd_header_t* commandHeader = &commandList[slot];
@@ -464,99 +432,128 @@ void Port::Identify() {
     commandHeader->cfl = sizeof(fis_reg_h2d_t) / sizeof(uint32_t);
 
     commandHeader->a = 0;
-    commandHeader->w = 0;
+    commandHeader->w = write;
     commandHeader->c = 0;
     commandHeader->p = 0;
 
     commandHeader->prdbc = 0;
     commandHeader->pmp = 0;
+    commandHeader->prdtl = entries;
 
-    hba_cmd_tbl_t* commandTable = commandTables[slot];
-    memset(commandTable, 0, sizeof(hba_cmd_tbl_t));
+    __atomic_thread_fence(__ATOMIC_RELEASE); // The HBA reads the command table once the slot is issued
 
-    commandTable->prdt_entry[0].dba = physBuffers[0] & 0xFFFFFFFF;
-    commandTable->prdt_entry[0].dbau = (physBuffers[0] >> 32) & 0xFFFFFFFF;
-    commandTable->prdt_entry[0].dbc = 512 - 1; // 512 bytes per sector
-    commandTable->prdt_entry[0].i = 1;
+    ScopedSpinLock<true> lockSlots(slotLock);
+    if (ncq) {
+        registers->sact = 1U << slot; // Writing zeroes has no effect, so only our slot is set
+    }
+    registers->ci = 1U << slot;
 
-    fis_reg_h2d_t* cmdfis = (fis_reg_h2d_t*)(commandTable->cfis);
-    memset(commandTable->cfis, 0, sizeof(fis_reg_h2d_t));
+    activeSlots |= 1U << slot;
+}
 
-    cmdfis->fis_type = FIS_TYPE_REG_H2D;
-    cmdfis->c = 1;      // Command
-    cmdfis->pmport = 0; // Port multiplier
-    cmdfis->command = ATA_CMD_IDENTIFY;
+int Port::Wait(int slot) {
+    assert(slot >= 0 && slot < AHCI_MAX_SLOTS);
+    CommandSlot& cmd = slots[slot];
 
-    cmdfis->lba0 = 0;
-    cmdfis->lba1 = 0;
-    cmdfis->lba2 = 0;
-    cmdfis->device = 0;
+    timeval tv = Timer::GetSystemUptimeStruct();
+    for (;;) {
+        ProcessCompletions(); // Picks up the completion if the interrupt was missed or interrupts are disabled
 
-    cmdfis->lba3 = 0;
-    cmdfis->lba4 = 0;
-    cmdfis->lba5 = 0;
+        long elapsed = Timer::TimeDifference(Timer::GetSystemUptimeStruct(), tv);
+        GenericThreadBlocker blocker;
+        bool block = interruptsEnabled && Thread::Current();
+        {
+            ScopedSpinLock<true> lockSlots(slotLock);
+            if (!cmd.complete && elapsed >= AHCI_COMMAND_TIMEOUT) {
+                Log::Warning("[SATA] Command timed out (TFD: %x, SERR: %x)", registers->tfd, registers->serr);
 
-    cmdfis->countl = 0;
-    cmdfis->counth = 0;
+                // Stopping the command engine makes sure the HBA is done with the buffer
+                ResetCommandEngine();
+            }
 
-    cmdfis->control = 0;
+            if (cmd.complete) {
+                int status = cmd.status;
+                freeSlots |= 1U << slot;
+                return status;
+            }
 
-    spin = 100;
-    while ((registers->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && spin--) {
-        Timer::Wait(1);
-    }
+            if (block) {
+                cmd.blocker = &blocker;
+            }
+        }
 
-    if (spin >= 100) {
-        Log::Warning("[SATA] Port Hung");
-        return;
+        if (!block) {
+            Scheduler::Yield();
+            continue;
+        }
+
+        long timeout = AHCI_COMMAND_TIMEOUT - elapsed;
+        if (Thread::Current()->Block(&blocker, timeout)) {
+            Scheduler::Yield(); // A command cannot be cancelled, so keep waiting even with a signal pending
+        }
+
+        ScopedSpinLock<true> lockSlots(slotLock);
+        cmd.blocker = nullptr;
     }
+}
 
-    registers->ie = registers->is = 0xffffffff;
+void Port::ProcessCompletions() {
+    ScopedSpinLock<true> lockSlots(slotLock);
 
-    StartCMD(registers);
-    registers->sact |= 1 << slot;
-    registers->ci |= 1 << slot;
+    uint32_t is = registers->is;
+    registers->is = is;
 
-    // Log::Info("SERR: %x, Slot: %x, PxCMD: %x, Int status: %x, Ci: %x, TFD: %x", registers->serr, slot,
-    // registers->cmd, registers->is, registers->ci, registers->tfd);
+    if (is & HBA_PxIS_ERROR) {
+        Log::Warning("[SATA] Disk Error (IS: %x, TFD: %x, SERR: %x)", is, registers->tfd, registers->serr);
 
-    while (registers->ci & (1 << slot)) {
-        if (registers->is & HBA_PxIS_TFES) // Task file error
-        {
-            Log::Warning("[SATA] Disk Error (SERR: %x)", registers->serr);
-            StopCMD(registers);
-            return;
-        }
+        // Every outstanding command is aborted on error, not just the one that failed
+        ResetCommandEngine();
+        return;
     }
 
-    StopCMD(registers);
+    // Queued commands are done once their SACT bit is cleared, others once their CI bit is cleared
+    uint32_t done = activeSlots & ~(registers->sact | registers->ci);
+    activeSlots &= ~done;
+
+    while (done) {
+        int slot = __builtin_ctz(done);
+        done &= ~(1U << slot);
 
-    spin = 100;
-    while ((registers->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && spin--) {
-        Timer::Wait(1);
+        slots[slot].complete = true;
+        if (slots[slot].blocker) {
+            slots[slot].blocker->Unblock();
+        }
     }
+}
 
-    // Log::Info("SERR: %x, Slot: %x, PxCMD: %x, Int status: %x, Ci: %x, TFD: %x", registers->serr, slot,
-    // registers->cmd, registers->is, registers->ci, registers->tfd);
+void Port::EnableInterrupts() {
+    registers->is = 0xffffffff;
+    registers->ie = HBA_PxIS_DHRS | HBA_PxIS_SDBS | HBA_PxIS_ERROR;
 
-    if (registers->is & HBA_PxIS_TFES) {
-        Log::Warning("[SATA] Disk Error (SERR: %x)", registers->serr);
-        StopCMD(registers);
-        return;
-    }
-    return;
+    interruptsEnabled = true;
 }
 
-int Port::FindCmdSlot() {
-    // If not set in SACT and CI, the slot is free
-    uint32_t slots = (registers->sact | registers->ci);
-    for (int i = 0; i < 8; i++) {
-        if ((slots & 1) == 0)
-            return i;
-        slots >>= 1;
-    }
+void Port::ResetCommandEngine() {
+    StopCMD(registers); // Clears CI and SACT
 
-    return -1;
+    registers->serr = registers->serr;
+    registers->is = 0xffffffff;
+
+    StartCMD(registers);
+
+    uint32_t failed = activeSlots;
+    activeSlots = 0;
+
+    while (failed) {
+        int slot = __builtin_ctz(failed);
+        failed &= ~(1U << slot);
+
+        slots[slot].status = -EIO;
+        slots[slot].complete = true;
+        if (slots[slot].blocker) {
+            slots[slot].blocker->Unblock();
+        }
+    }
 }
 
 void StopCMD(hba_port_t* port) {
@@ -0,0 +1,758 @@
+#include <Storage/BlockCache.h>
+
+#include <Device.h>
+#include <HAL.h>
+#include <MM/Reclaim.h>
+
+#include <Assert.h>
+#include <CString.h>
+#include <Hash.h>
+#include <List.h>
+#include <Logging.h>
+#include <Math.h>
+#include <Paging.h>
+#include <PhysicalAllocator.h>
+#include <Scheduler.h>
+#include <Spinlock.h>
+#include <Thread.h>
+#include <Timer.h>
+
+namespace BlockCache {
+
+struct CachedPage {
+    DiskDevice* disk;
+    uint64_t index; // Offset on the disk in 4KB pages
+    uint32_t block; // Physical block holding the page
+
+    bool dirty;         // Not yet written back to the disk
+    bool flushing;      // Being written back
+    uint32_t writes;    // Changed by every write so the flusher knows if the page changed whilst it was written
+    uint64_t dirtiedAt; // When the page was dirtied in microseconds since boot
+    // Pinned pages are kept off the clock so they cannot be evicted,
+    // pages removed from the cache whilst pinned have disk set to nullptr and are freed once unpinned
+    uint32_t pins;
+    bool referenced; // Used since the clock hand last passed the page
+
+    unsigned shard;       // Shard the entry belongs to, entries never move between shards
+    CachedPage* hashNext; // Next page in the bucket
+
+    // Clock for clean pages, dirty list for dirty pages
+    CachedPage* next;
+    CachedPage* prev;
+};
+
+#define SHARD_BUCKETS (BLOCK_CACHE_BUCKETS / BLOCK_CACHE_SHARDS)
+
+// Pages are spread over the shards by their hash, so threads using different pages rarely share a lock
+struct Shard {
+    lock_t lock = 0;
+    CachedPage* buckets[SHARD_BUCKETS] = {};
+    // Clean pages, the clock hand is at the front. Hits only set the referenced bit of a page,
+    // the clock is only turned by eviction
+    FastList<CachedPage*> clock;
+    // Least recently dirtied page at the front, dirty pages cannot be evicted until they are written back
+    FastList<CachedPage*> dirtyList;
+    // Entries are never freed as pages may be removed by reclaim from within kmalloc
+    CachedPage* freeEntries = nullptr;
+} __attribute__((aligned(64)));
+
+static Shard shards[BLOCK_CACHE_SHARDS];
+static uint64_t generation = 0; // Changed by every uncached write so reads racing with it do not cache stale data
+static unsigned reclaimShard = 0; // Shard reclaim starts from, so no one shard is emptied first every time
+
+static uint64_t maxShardPages = 0;
+static uint64_t dirtyBackgroundPages = 0; // Past this the flusher writes back pages regardless of age
+static uint64_t dirtyLimitPages = 0;      // Past this writers write back pages themselves
+
+static ALWAYS_INLINE unsigned HashPage(DiskDevice* disk, uint64_t index) {
+    return HashU(static_cast<unsigned>(index) ^ static_cast<unsigned>(index >> 32) ^
+                 static_cast<unsigned>(reinterpret_cast<uintptr_t>(disk) >> 4));
+}
+
+static ALWAYS_INLINE Shard& ShardOf(DiskDevice* disk, uint64_t index) {
+    return shards[HashPage(disk, index) % BLOCK_CACHE_SHARDS];
+}
+
+static ALWAYS_INLINE CachedPage** BucketOf(Shard& shard, DiskDevice* disk, uint64_t index) {
+    return &shard.buckets[(HashPage(disk, index) / BLOCK_CACHE_SHARDS) % SHARD_BUCKETS];
+}
+
+// Read without any lock, only used to decide when to write back pages
+static uint64_t DirtyPages() {
+    uint64_t count = 0;
+    for (Shard& shard : shards) {
+        count += shard.dirtyList.get_length();
+    }
+
+    return count;
+}
+
+// shard.lock must be held
+static CachedPage** FindPage(Shard& shard, DiskDevice* disk, uint64_t index) {
+    CachedPage** page = BucketOf(shard, disk, index);
+    while (*page) {
+        if ((*page)->disk == disk && (*page)->index == index) {
+            return page;
+        }
+
+        page = &(*page)->hashNext;
+    }
+
+    return nullptr;
+}
+
+// The lock of the shard of the entry must be held
+static ALWAYS_INLINE void FreeEntry(CachedPage* page) {
+    Shard& shard = shards[page->shard];
+    page->hashNext = shard.freeEntries;
+    shard.freeEntries = page;
+}
+
+// The lock of the shard of the page must be held
+static void FreePage(CachedPage* page) {
+    Memory::FreePhysicalMemoryBlock(static_cast<uintptr_t>(page->block) << PAGE_SHIFT_4K);
+    Memory::AccountMemory(Memory::MemoryUsageBlockCache, -static_cast<int64_t>(PAGE_SIZE_4K));
+
+    FreeEntry(page);
+}
+
+// shard.lock must be held
+static void RemovePage(Shard& shard, CachedPage** entry) {
+    CachedPage* page = *entry;
+    *entry = page->hashNext;
+
+    if (page->dirty) {
+        shard.dirtyList.remove(page);
+    } else if (!page->pins) {
+        shard.clock.remove(page);
+    }
+
+    if (page->pins) {
+        // Freed once unpinned
+        page->disk = nullptr;
+        page->dirty = false;
+        return;
+    }
+
+    FreePage(page);
+}
+
+// Evict a clean page of the shard, shard.lock must be held
+static void Evict(Shard& shard) {
+    // Pages referenced since the hand last passed them get a second chance.
+    // Every page passed is cleared, so this stops within one turn of the clock
+    CachedPage* page;
+    while ((page = shard.clock.get_front()) && page->referenced) {
+        page->referenced = false;
+        shard.clock.rotate();
+    }
+
+    if (!page) {
+        return; // Everything is dirty, writers will be throttled until pages are written back
+    }
+
+    CachedPage** entry = FindPage(shard, page->disk, page->index);
+    assert(entry);
+    RemovePage(shard, entry);
+}
+
+class BlockCacheReclaimer final : public Memory::Reclaimer {
+public:
+    size_t Reclaim(size_t bytes) override {
+        InterruptDisabler disableInterrupts;
+
+        // Only clean pages can be dropped
+        size_t freed = 0;
+        unsigned first = reclaimShard++;
+        for (unsigned i = 0; i < BLOCK_CACHE_SHARDS && freed < bytes; i++) {
+            Shard& shard = shards[(first + i) % BLOCK_CACHE_SHARDS];
+            // We may have been called from an allocation made by the cache
+            if (acquireTestLock(&shard.lock)) {
+                continue;
+            }
+
+            while (freed < bytes && shard.clock.get_length()) {
+                Evict(shard);
+                freed += PAGE_SIZE_4K;
+            }
+
+            releaseLock(&shard.lock);
+        }
+
+        return freed;
+    }
+};
+
+// Copy from a cached page through window, returns false if the page is not cached
+static bool CopyFromCache(DiskDevice* disk, uint64_t index, size_t pageOffset, size_t size, uint8_t* buffer,
+                          uint8_t* window) {
+    Shard& shard = ShardOf(disk, index);
+    ScopedSpinLock lockShard(shard.lock);
+
+    CachedPage** entry = FindPage(shard, disk, index);
+    if (!entry) {
+        return false;
+    }
+
+    CachedPage* page = *entry;
+    page->referenced = true;
+
+    Memory::KernelMapVirtualMemory4K(static_cast<uintptr_t>(page->block) << PAGE_SHIFT_4K,
+                                     reinterpret_cast<uintptr_t>(window), 1);
+    memcpy(buffer, window + pageOffset, size);
+    return true;
+}
+
+// Take a free entry of the shard or allocate one
+static CachedPage* AllocateEntry(Shard& shard) {
+    CachedPage* page;
+    {
+        ScopedSpinLock lockShard(shard.lock);
+        page = shard.freeEntries;
+        if (page) {
+            shard.freeEntries = page->hashNext;
+        }
+    }
+
+    if (!page) {
+        page = new CachedPage;
+        page->shard = &shard - shards;
+    }
+
+    return page;
+}
+
+// shard.lock must be held, page is an entry of the shard
+static void InsertPage(Shard& shard, CachedPage* page, DiskDevice* disk, uint64_t index, uintptr_t phys) {
+    if (shard.clock.get_length() + shard.dirtyList.get_length() >= maxShardPages) {
+        Evict(shard);
+    }
+
+    page->disk = disk;
+    page->index = index;
+    page->block = phys >> PAGE_SHIFT_4K;
+    page->dirty = false;
+    page->flushing = false;
+    page->writes = 0;
+    page->pins = 0;
+    page->referenced = false; // Pages read ahead are evicted first unless used
+
+    CachedPage** bucket = BucketOf(shard, disk, index);
+    page->hashNext = *bucket;
+    *bucket = page;
+    // Just behind the hand, the last page it reaches
+    shard.clock.add_back(page);
+
+    Memory::AccountMemory(Memory::MemoryUsageBlockCache, PAGE_SIZE_4K);
+}
+
+// shard.lock must be held
+static void MarkDirty(Shard& shard, CachedPage* page) {
+    page->writes++;
+    if (page->dirty) {
+        return;
+    }
+
+    if (!page->pins) {
+        shard.clock.remove(page);
+    }
+    shard.dirtyList.add_back(page);
+
+    page->dirty = true;
+    page->dirtiedAt = Timer::UsecondsSinceBoot();
+}
+
+/////////////////////////////
+/// \brief Read pages from the disk with one request and cache them
+///
+/// \param window Virtual memory of at least count pages the pages are mapped to
+/// \param phys Set to the physical block of each page not taken by the cache
+/// (written to whilst we were reading or read first by another thread), or 0. The caller frees them
+/////////////////////////////
+static int ReadPages(DiskDevice* disk, uint64_t index, unsigned count, uint8_t* window, uintptr_t* phys) {
+    uint64_t gen = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+
+    for (unsigned i = 0; i < count; i++) {
+        phys[i] = Memory::AllocatePhysicalMemoryBlock();
+        if (!phys[i]) {
+            while (i--) {
+                Memory::FreePhysicalMemoryBlock(phys[i]);
+                phys[i] = 0;
+            }
+            return 1;
+        }
+        assert(phys[i] < (0xffffffffULL << PAGE_SHIFT_4K));
+
+        Memory::KernelMapVirtualMemory4K(phys[i], reinterpret_cast<uintptr_t>(window + (i << PAGE_SHIFT_4K)), 1);
+    }
+
+    if (int e = disk->SubmitWait(DiskRequest::Read, (index << PAGE_SHIFT_4K) / disk->blocksize,
+                                 count << PAGE_SHIFT_4K, window);
+        e) {
+        for (unsigned i = 0; i < count; i++) {
+            Memory::FreePhysicalMemoryBlock(phys[i]);
+            phys[i] = 0;
+        }
+        return e;
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        Shard& shard = ShardOf(disk, index + i);
+        CachedPage* page = AllocateEntry(shard);
+
+        ScopedSpinLock lockShard(shard.lock);
+        if (gen != __atomic_load_n(&generation, __ATOMIC_ACQUIRE) || FindPage(shard, disk, index + i)) {
+            FreeEntry(page);
+            continue;
+        }
+
+        InsertPage(shard, page, disk, index + i, phys[i]);
+        phys[i] = 0; // Owned by the cache
+    }
+
+    return 0;
+}
+
+static bool IsCached(DiskDevice* disk, uint64_t index) {
+    Shard& shard = ShardOf(disk, index);
+    ScopedSpinLock lockShard(shard.lock);
+    return FindPage(shard, disk, index);
+}
+
+// Read a page from the disk into window and cache it, the caller frees phys if it is not 0
+static ALWAYS_INLINE int ReadPage(DiskDevice* disk, uint64_t index, uint8_t* window, uintptr_t& phys) {
+    return ReadPages(disk, index, 1, window, &phys);
+}
+
+/////////////////////////////
+/// \brief Write back the least recently dirtied page of a shard matching
+///
+/// Only pages of disk (any disk if nullptr) in [start, end) dirtied at or before dirtiedBefore are written back.
+///
+/// \param bounce Buffer the page is copied to whilst it is written
+/// \param status Set to the driver's error if the write failed
+///
+/// \return false if there were no matching pages
+/////////////////////////////
+static bool FlushNext(Shard& shard, DiskDevice* disk, uint64_t start, uint64_t end, uint64_t dirtiedBefore,
+                      uint8_t* window, uint8_t* bounce, int& status) {
+    DiskDevice* pageDisk;
+    uint64_t index;
+    uint32_t writes;
+    {
+        ScopedSpinLock lockShard(shard.lock);
+
+        // The list is in the order pages were dirtied
+        CachedPage* page = shard.dirtyList.get_front();
+        while (page && page->dirtiedAt <= dirtiedBefore) {
+            if (!page->flushing && (!disk || page->disk == disk) && page->index >= start && page->index < end) {
+                break;
+            }
+
+            page = shard.dirtyList.next(page);
+        }
+
+        if (!page || page->dirtiedAt > dirtiedBefore) {
+            return false;
+        }
+
+        page->flushing = true;
+        pageDisk = page->disk;
+        index = page->index;
+        writes = page->writes;
+
+        Memory::KernelMapVirtualMemory4K(static_cast<uintptr_t>(page->block) << PAGE_SHIFT_4K,
+                                         reinterpret_cast<uintptr_t>(window), 1);
+        memcpy(bounce, window, PAGE_SIZE_4K);
+    }
+
+    int e = pageDisk->SubmitWait(DiskRequest::Write, (index << PAGE_SHIFT_4K) / pageDisk->blocksize, PAGE_SIZE_4K,
+                                 bounce);
+    if (e) {
+        Log::Warning("[BlockCache] Failed to write back page %u of %s: %d", index, pageDisk->InstanceName().c_str(),
+                     e);
+        status = e;
+    }
+
+    ScopedSpinLock lockShard(shard.lock);
+
+    CachedPage** entry = FindPage(shard, pageDisk, index);
+    if (!entry) {
+        return true; // Purged
+    }
+
+    CachedPage* page = *entry;
+    page->flushing = false;
+    if (page->writes != writes) {
+        // Written to again, it stays dirty
+        shard.dirtyList.remove(page);
+        shard.dirtyList.add_back(page);
+        page->dirtiedAt = Timer::UsecondsSinceBoot();
+        return true;
+    }
+
+    // Pages that failed to be written are not kept dirty either, they would never leave the cache
+    shard.dirtyList.remove(page);
+    if (!page->pins) {
+        shard.clock.add_back(page);
+    }
+    page->dirty = false;
+    return true;
+}
+
+// Write back the least recently dirtied page of each shard in turn until at most limit are dirty
+static void FlushDown(uint64_t limit, uint8_t* window, uint8_t* bounce, int& status) {
+    bool flushed = true;
+    while (flushed && DirtyPages() > limit) {
+        flushed = false;
+        for (Shard& shard : shards) {
+            flushed |= FlushNext(shard, nullptr, 0, UINT64_MAX, UINT64_MAX, window, bounce, status);
+        }
+    }
+}
+
+// Write back pages until at most limit are dirty
+static int FlushOver(uint64_t limit) {
+    uint8_t* window = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(1));
+    uint8_t* bounce = new uint8_t[PAGE_SIZE_4K];
+
+    int status = 0;
+    FlushDown(limit, window, bounce, status);
+
+    delete[] bounce;
+    Memory::KernelFree4KPages(window, 1);
+    return status;
+}
+
+static void FlusherThread() {
+    uint8_t* window = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(1));
+    uint8_t* bounce = new uint8_t[PAGE_SIZE_4K];
+
+    for (;;) {
+        Thread::Current()->Sleep(BLOCK_CACHE_FLUSH_INTERVAL);
+
+        int status = 0;
+        uint64_t now = Timer::UsecondsSinceBoot();
+        uint64_t expired = (now > BLOCK_CACHE_DIRTY_EXPIRE) ? (now - BLOCK_CACHE_DIRTY_EXPIRE) : 0;
+
+        // Write back everything that has been dirty for too long
+        for (Shard& shard : shards) {
+            while (FlushNext(shard, nullptr, 0, UINT64_MAX, expired, window, bounce, status))
+                ;
+        }
+
+        // Then the least recently dirtied pages whilst too many are dirty
+        FlushDown(dirtyBackgroundPages, window, bounce, status);
+    }
+}
+
+void Initialize() {
+    // Memory::maxPhysicalBlocks is the limit of the allocator, not the amount of memory
+    uint64_t maxPages = HAL::mem_info.totalMemory / PAGE_SIZE_4K / BLOCK_CACHE_MEMORY_DIVISOR;
+    maxShardPages = MAX(maxPages / BLOCK_CACHE_SHARDS, 1ULL);
+    dirtyBackgroundPages = maxPages * BLOCK_CACHE_DIRTY_BACKGROUND_RATIO / 100;
+    dirtyLimitPages = maxPages * BLOCK_CACHE_DIRTY_RATIO / 100;
+
+    Memory::RegisterReclaimer(new BlockCacheReclaimer());
+
+    auto proc = Process::CreateKernelProcess((void*)FlusherThread, "BlockFlusher", nullptr);
+    proc->Start();
+}
+
+int Read(DiskDevice* disk, uint64_t offset, size_t size, void* buffer) {
+    if (disk->blocksize > static_cast<int>(PAGE_SIZE_4K) || !maxShardPages) {
+        return disk->Transfer(DiskRequest::Read, offset / disk->blocksize, size, buffer);
+    }
+
+    uint8_t* out = reinterpret_cast<uint8_t*>(buffer);
+    uint8_t* window = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(BLOCK_CACHE_MAX_READ_PAGES));
+
+    int status = 0;
+    while (size) {
+        uint64_t index = offset >> PAGE_SHIFT_4K;
+        size_t pageOffset = offset & (PAGE_SIZE_4K - 1);
+        size_t count = MIN(size, PAGE_SIZE_4K - pageOffset);
+
+        if (!CopyFromCache(disk, index, pageOffset, count, out, window)) {
+            // Read the pages of the request following this one that are not cached with the same request
+            unsigned pages = 1;
+            {
+                uint64_t last = (offset + size - 1) >> PAGE_SHIFT_4K;
+                while (pages < BLOCK_CACHE_MAX_READ_PAGES && index + pages <= last && !IsCached(disk, index + pages)) {
+                    pages++;
+                }
+            }
+
+            uintptr_t phys[BLOCK_CACHE_MAX_READ_PAGES];
+            if (ReadPages(disk, index, pages, window, phys)) {
+                // Could not read the whole page (e.g. it goes past the end of the disk),
+                // read the rest without the cache
+                status = disk->Transfer(DiskRequest::Read, offset / disk->blocksize, size, out);
+                break;
+            }
+
+            count = MIN(size, (pages << PAGE_SHIFT_4K) - pageOffset);
+            memcpy(out, window + pageOffset, count); // window still maps the pages
+            for (unsigned i = 0; i < pages; i++) {
+                if (phys[i]) {
+                    Memory::FreePhysicalMemoryBlock(phys[i]);
+                }
+            }
+        }
+
+        offset += count;
+        out += count;
+        size -= count;
+    }
+
+    Memory::KernelFree4KPages(window, BLOCK_CACHE_MAX_READ_PAGES);
+    return status;
+}
+
+// Write to the disk without the cache, dropping any clean pages written to
+static int WriteUncached(DiskDevice* disk, uint64_t offset, size_t size, const uint8_t* buffer) {
+    int status = disk->Transfer(DiskRequest::Write, offset / disk->blocksize, size, const_cast<uint8_t*>(buffer));
+
+    // Reads that started before this are not cached, pages they cached before this are removed below
+    __atomic_add_fetch(&generation, 1, __ATOMIC_ACQ_REL);
+
+    // Even if the write failed part of it may have reached the disk
+    uint64_t end = (offset + size + PAGE_SIZE_4K - 1) >> PAGE_SHIFT_4K;
+    for (uint64_t index = offset >> PAGE_SHIFT_4K; index < end; index++) {
+        Shard& shard = ShardOf(disk, index);
+        ScopedSpinLock lockShard(shard.lock);
+
+        // Pinned pages are left to whoever pinned them but no longer found
+        if (CachedPage** entry = FindPage(shard, disk, index); entry && !(*entry)->dirty) {
+            RemovePage(shard, entry);
+        }
+    }
+
+    return status;
+}
+
+// Copy to a cached page through window and mark it dirty, returns false if the page is not cached
+static bool CopyToCache(DiskDevice* disk, uint64_t index, size_t pageOffset, size_t size, const uint8_t* buffer,
+                        uint8_t* window) {
+    Shard& shard = ShardOf(disk, index);
+    ScopedSpinLock lockShard(shard.lock);
+
+    CachedPage** entry = FindPage(shard, disk, index);
+    if (!entry) {
+        return false;
+    }
+
+    CachedPage* page = *entry;
+    Memory::KernelMapVirtualMemory4K(static_cast<uintptr_t>(page->block) << PAGE_SHIFT_4K,
+                                     reinterpret_cast<uintptr_t>(window), 1);
+    memcpy(window + pageOffset, buffer, size);
+
+    MarkDirty(shard, page);
+    return true;
+}
+
+// Cache a whole page that is being written without reading it from the disk
+static bool InsertDirtyPage(DiskDevice* disk, uint64_t index, const uint8_t* buffer, uint8_t* window) {
+    uintptr_t phys = Memory::AllocatePhysicalMemoryBlock();
+    if (!phys) {
+        return false;
+    }
+    assert(phys < (0xffffffffULL << PAGE_SHIFT_4K));
+
+    Memory::KernelMapVirtualMemory4K(phys, reinterpret_cast<uintptr_t>(window), 1);
+    memcpy(window, buffer, PAGE_SIZE_4K);
+
+    Shard& shard = ShardOf(disk, index);
+    CachedPage* page = AllocateEntry(shard);
+
+    ScopedSpinLock lockShard(shard.lock);
+    if (FindPage(shard, disk, index)) {
+        // Cached by another thread, the caller copies to that page instead
+        FreeEntry(page);
+
+        Memory::FreePhysicalMemoryBlock(phys);
+        return false;
+    }
+
+    InsertPage(shard, page, disk, index, phys);
+    MarkDirty(shard, page);
+    return true;
+}
+
+int Write(DiskDevice* disk, uint64_t offset, size_t size, void* buffer) {
+    if (disk->blocksize > static_cast<int>(PAGE_SIZE_4K) || !maxShardPages) {
+        return WriteUncached(disk, offset, size, reinterpret_cast<uint8_t*>(buffer));
+    }
+
+    const uint8_t* in = reinterpret_cast<uint8_t*>(buffer);
+    uint8_t* window = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(1));
+
+    int status = 0;
+    while (size) {
+        uint64_t index = offset >> PAGE_SHIFT_4K;
+        size_t pageOffset = offset & (PAGE_SIZE_4K - 1);
+        size_t count = MIN(size, PAGE_SIZE_4K - pageOffset);
+
+        if (!CopyToCache(disk, index, pageOffset, count, in, window)) {
+            if (count == PAGE_SIZE_4K && InsertDirtyPage(disk, index, in, window)) {
+                // The whole page is written so there is no need to read it first
+            } else {
+                // Read the rest of the page and try again
+                uintptr_t phys;
+                if (ReadPage(disk, index, window, phys)) {
+                    // Could not read the whole page (e.g. it goes past the end of the disk),
+                    // write the rest without the cache
+                    status = WriteUncached(disk, offset, size, in);
+                    break;
+                }
+
+                if (phys) {
+                    Memory::FreePhysicalMemoryBlock(phys);
+                }
+                continue;
+            }
+        }
+
+        offset += count;
+        in += count;
+        size -= count;
+    }
+
+    Memory::KernelFree4KPages(window, 1);
+
+    // Make writers wait on the disk once too much is dirty
+    if (__builtin_expect(DirtyPages() > dirtyLimitPages, 0)) {
+        if (int e = FlushOver(dirtyBackgroundPages); e && !status) {
+            status = e;
+        }
+    }
+
+    return status;
+}
+
+int Sync(DiskDevice* disk, uint64_t offset, uint64_t size) {
+    if (!maxShardPages) {
+        return 0;
+    }
+
+    uint8_t* window = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(1));
+    uint8_t* bounce = new uint8_t[PAGE_SIZE_4K];
+
+    uint64_t start = offset >> PAGE_SHIFT_4K;
+    uint64_t end = (size == UINT64_MAX) ? UINT64_MAX : ((offset + size + PAGE_SIZE_4K - 1) >> PAGE_SHIFT_4K);
+
+    // Pages dirtied after we start are left to the flusher, so constant writers cannot keep us here
+    uint64_t now = Timer::UsecondsSinceBoot();
+
+    int status = 0;
+    for (Shard& shard : shards) {
+        while (FlushNext(shard, disk, start, end, now, window, bounce, status))
+            ;
+    }
+
+    delete[] bounce;
+    Memory::KernelFree4KPages(window, 1);
+    return status;
+}
+
+void Purge(DiskDevice* disk) {
+    __atomic_add_fetch(&generation, 1, __ATOMIC_ACQ_REL);
+
+    // Pinned pages are on neither list, so go through every bucket
+    for (Shard& shard : shards) {
+        ScopedSpinLock lockShard(shard.lock);
+        for (unsigned i = 0; i < SHARD_BUCKETS; i++) {
+            CachedPage** entry = &shard.buckets[i];
+            while (*entry) {
+                if ((*entry)->disk == disk) {
+                    RemovePage(shard, entry);
+                } else {
+                    entry = &(*entry)->hashNext;
+                }
+            }
+        }
+    }
+}
+
+int Pin(DiskDevice* disk, uint64_t offset, PinnedPage& pinned) {
+    pinned.Release();
+    if (disk->blocksize > static_cast<int>(PAGE_SIZE_4K) || !maxShardPages) {
+        return 1;
+    }
+
+    uint64_t index = offset >> PAGE_SHIFT_4K;
+    uint8_t* window = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(1));
+
+    for (;;) {
+        {
+            Shard& shard = ShardOf(disk, index);
+            ScopedSpinLock lockShard(shard.lock);
+            if (CachedPage** entry = FindPage(shard, disk, index); entry) {
+                CachedPage* page = *entry;
+                page->referenced = true;
+                if (!page->pins++ && !page->dirty) {
+                    shard.clock.remove(page);
+                }
+
+                Memory::KernelMapVirtualMemory4K(static_cast<uintptr_t>(page->block) << PAGE_SHIFT_4K,
+                                                 reinterpret_cast<uintptr_t>(window), 1);
+                pinned.m_page = page;
+                pinned.m_data = window;
+                return 0;
+            }
+        }
+
+        uintptr_t phys;
+        if (int e = ReadPage(disk, index, window, phys); e) {
+            Memory::KernelFree4KPages(window, 1);
+            return e;
+        }
+
+        // Not cached if the disk was written to whilst we read it, read it again
+        if (phys) {
+            Memory::FreePhysicalMemoryBlock(phys);
+        }
+    }
+}
+
+void PinnedPage::MarkDirty() {
+    assert(m_page);
+
+    {
+        Shard& shard = shards[m_page->shard];
+        ScopedSpinLock lockShard(shard.lock);
+        if (!m_page->disk) {
+            return; // Removed from the cache
+        }
+
+        BlockCache::MarkDirty(shard, m_page);
+    }
+
+    if (__builtin_expect(DirtyPages() > dirtyLimitPages, 0)) {
+        FlushOver(dirtyBackgroundPages);
+    }
+}
+
+void PinnedPage::Release() {
+    if (!m_page) {
+        return;
+    }
+
+    {
+        Shard& shard = shards[m_page->shard];
+        ScopedSpinLock lockShard(shard.lock);
+        if (!--m_page->pins) {
+            if (!m_page->disk) {
+                FreePage(m_page);
+            } else if (!m_page->dirty) {
+                shard.clock.add_back(m_page);
+            }
+        }
+    }
+
+    Memory::KernelFree4KPages(m_data, 1);
+    m_page = nullptr;
+    m_data = nullptr;
+}
+
+} // namespace BlockCache
@@ -4,6 +4,13 @@
 #include <Fs/Fat32.h>
 #include <Fs/VolumeManager.h>
 #include <Logging.h>
+#include <Math.h>
+#include <Objects/Process.h>
+#include <Paging.h>
+#include <Scheduler.h>
+#include <Storage/BlockCache.h>
+#include <Thread.h>
+#include <Timer.h>
 
 static int nextDeviceNumber = 0;
 
@@ -25,12 +32,287 @@ int DiskDevice::ReadDiskBlock(uint64_t lba, uint32_t count, void* buffer) { retu
 
 int DiskDevice::WriteDiskBlock(uint64_t lba, uint32_t count, void* buffer) { return -1; }
 
+int DiskDevice::Transfer(DiskRequest::Operation op, uint64_t lba, uint32_t count, void* buffer) {
+    uint64_t start = Timer::UsecondsSinceBoot();
+    {
+        ScopedSpinLock lockStats(statsLock);
+        if (!ioStats.inFlight++) {
+            busySince = start;
+        }
+        ioStats.inFlightHighWater = MAX(ioStats.inFlightHighWater, ioStats.inFlight);
+    }
+
+    int e = (op == DiskRequest::Read) ? ReadDiskBlock(lba, count, buffer) : WriteDiskBlock(lba, count, buffer);
+
+    uint64_t end = Timer::UsecondsSinceBoot();
+    uint64_t latency = end - start;
+
+    // Bucket n holds transfers taking less than 2^n us
+    unsigned latencyBucket = MIN(latency ? (64 - __builtin_clzll(latency)) : 0, DISK_LATENCY_BUCKETS - 1U);
+
+    ScopedSpinLock lockStats(statsLock);
+    if (!--ioStats.inFlight) {
+        ioStats.busyUs += end - busySince;
+    }
+    ioStats.inFlightUs += latency;
+
+    if (e) {
+        ioStats.errors++;
+    } else if (op == DiskRequest::Read) {
+        ioStats.reads++;
+        ioStats.bytesRead += count;
+        ioStats.readLatency[latencyBucket]++;
+    } else {
+        ioStats.writes++;
+        ioStats.bytesWritten += count;
+        ioStats.writeLatency[latencyBucket]++;
+    }
+
+    return e;
+}
+
+void DiskDevice::GetStatistics(DiskStatistics& stats) {
+    ScopedSpinLock lockStats(statsLock);
+    stats = ioStats;
+
+    if (stats.inFlight) {
+        stats.busyUs += Timer::UsecondsSinceBoot() - busySince; // Count the current busy period
+    }
+}
+
+void DiskDevice::Submit(DiskRequest* req) {
+    if (!__atomic_exchange_n(&ioThreadsStarted, true, __ATOMIC_ACQ_REL)) {
+        for (unsigned i = 0; i < ioThreads; i++) {
+            auto proc = Process::CreateKernelProcess((void*)IOThread, "DiskIO", nullptr);
+            proc->GetMainThread()->registers.rdi = reinterpret_cast<uintptr_t>(this);
+            proc->Start();
+        }
+    }
+
+    req->submitted = Timer::UsecondsSinceBoot();
+    req->deadline = req->submitted + ((req->op == DiskRequest::Read) ? DISK_READ_EXPIRE : DISK_WRITE_EXPIRE);
+    req->fifo.request = req;
+
+    {
+        ScopedSpinLock lockStats(statsLock);
+        ioStats.requests++;
+        ioStats.queued++;
+    }
+
+    {
+        ScopedSpinLock lockRequests(requestLock);
+
+        // Requests for the same block stay in the order they were submitted
+        DiskRequest* it = requests.get_front();
+        while (it && it->lba <= req->lba) {
+            it = requests.next(it);
+        }
+
+        if (it) {
+            requests.insert(req, it);
+        } else {
+            requests.add_back(req);
+        }
+
+        if (req->op == DiskRequest::Read) {
+            readFifo.add_back(&req->fifo);
+        } else {
+            writeFifo.add_back(&req->fifo);
+        }
+    }
+
+    requestSemaphore.Signal();
+}
+
+namespace {
+struct RequestWaiter {
+    lock_t lock = 0;
+    ThreadBlocker* blocker = nullptr;
+    bool complete = false;
+};
+} // namespace
+
+static void WakeRequestWaiter(DiskRequest*, void* data) {
+    RequestWaiter* waiter = reinterpret_cast<RequestWaiter*>(data);
+
+    ScopedSpinLock lockWaiter(waiter->lock);
+    waiter->complete = true;
+    if (waiter->blocker) {
+        waiter->blocker->Unblock();
+    }
+}
+
+int DiskDevice::SubmitWait(DiskRequest::Operation op, uint64_t lba, uint32_t count, void* buffer) {
+    if (!Thread::Current()) {
+        // Nothing can wait before the scheduler is running
+        return Transfer(op, lba, count, buffer);
+    }
+
+    RequestWaiter waiter;
+    DiskRequest req(op, lba, count, buffer, WakeRequestWaiter, &waiter);
+    Submit(&req);
+
+    for (;;) {
+        GenericThreadBlocker blocker;
+        {
+            ScopedSpinLock lockWaiter(waiter.lock);
+            if (waiter.complete) {
+                break;
+            }
+            waiter.blocker = &blocker;
+        }
+
+        if (Thread::Current()->Block(&blocker)) {
+            Scheduler::Yield(); // The transfer cannot be cancelled, so keep waiting even with a signal pending
+        }
+
+        ScopedSpinLock lockWaiter(waiter.lock);
+        waiter.blocker = nullptr;
+    }
+
+    return req.status;
+}
+
+unsigned DiskDevice::NextBatch(DiskRequest** batch) {
+    DiskRequest* first = nullptr;
+    uint64_t now = Timer::UsecondsSinceBoot();
+
+    // Requests which have waited too long go first, reads before writes as a thread is usually waiting on them
+    if (readFifo.get_front() && readFifo.get_front()->request->deadline <= now) {
+        first = readFifo.get_front()->request;
+    } else if (writeFifo.get_front() && writeFifo.get_front()->request->deadline <= now) {
+        first = writeFifo.get_front()->request;
+    } else {
+        // Carry on from where the last batch ended, going back to the lowest LBA past the last request
+        first = requests.get_front();
+        for (DiskRequest* it = first; it; it = requests.next(it)) {
+            if (it->lba >= headLBA) {
+                first = it;
+                break;
+            }
+        }
+    }
+
+    if (!first) {
+        return 0; // Taken as part of an earlier batch
+    }
+
+    unsigned count = 0;
+    uint64_t size = first->count;
+    DiskRequest* last = first;
+
+    batch[count++] = first;
+    for (DiskRequest* it = requests.next(first); it && count < DISK_REQUEST_BATCH_MAX; it = requests.next(it)) {
+        if (it->op != first->op || (last->count % blocksize) || it->lba != last->lba + last->count / blocksize ||
+            size + it->count > DISK_REQUEST_MERGE_MAX) {
+            break;
+        }
+
+        batch[count++] = it;
+        size += it->count;
+        last = it;
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        requests.remove(batch[i]);
+
+        if (batch[i]->op == DiskRequest::Read) {
+            readFifo.remove(&batch[i]->fifo);
+        } else {
+            writeFifo.remove(&batch[i]->fifo);
+        }
+    }
+
+    headLBA = last->lba + (last->count + blocksize - 1) / blocksize;
+    return count;
+}
+
+int DiskDevice::Dispatch(DiskRequest** batch, unsigned count, uint8_t* mergeBuffer) {
+    DiskRequest* first = batch[0];
+
+    uint32_t size = 0;
+    bool contiguous = true; // Buffers which follow on from each other need no copying
+    for (unsigned i = 0; i < count; i++) {
+        if (i && batch[i]->buffer != batch[i - 1]->buffer + batch[i - 1]->count) {
+            contiguous = false;
+        }
+        size += batch[i]->count;
+    }
+
+    uint8_t* buffer = contiguous ? first->buffer : mergeBuffer;
+    if (first->op == DiskRequest::Write) {
+        if (!contiguous) {
+            for (unsigned i = 0, offset = 0; i < count; offset += batch[i]->count, i++) {
+                memcpy(mergeBuffer + offset, batch[i]->buffer, batch[i]->count);
+            }
+        }
+
+        return Transfer(DiskRequest::Write, first->lba, size, buffer);
+    }
+
+    int e = Transfer(DiskRequest::Read, first->lba, size, buffer);
+    if (!e && !contiguous) {
+        for (unsigned i = 0, offset = 0; i < count; offset += batch[i]->count, i++) {
+            memcpy(batch[i]->buffer, mergeBuffer + offset, batch[i]->count);
+        }
+    }
+
+    return e;
+}
+
+bool DiskDevice::CanDMA(const void* buffer, uint32_t count, uintptr_t alignment) const {
+    uintptr_t addr = reinterpret_cast<uintptr_t>(buffer);
+    return addr >= KERNEL_HEAP_VIRTUAL_BASE && !(addr & (alignment - 1)) && !(count % blocksize);
+}
+
+void DiskDevice::IOThread(DiskDevice* disk) {
+    uint8_t* mergeBuffer = new uint8_t[DISK_REQUEST_MERGE_MAX];
+    DiskRequest* batch[DISK_REQUEST_BATCH_MAX];
+
+    for (;;) {
+        if (disk->requestSemaphore.Wait()) {
+            continue; // Interrupted
+        }
+
+        unsigned count;
+        {
+            ScopedSpinLock lockRequests(disk->requestLock);
+            count = disk->NextBatch(batch);
+        }
+
+        if (!count) {
+            continue;
+        }
+
+        {
+            uint64_t now = Timer::UsecondsSinceBoot();
+
+            ScopedSpinLock lockStats(disk->statsLock);
+            disk->ioStats.queued -= count;
+            disk->ioStats.mergedRequests += count - 1;
+            for (unsigned i = 0; i < count; i++) {
+                disk->ioStats.queueTimeUs += now - batch[i]->submitted;
+            }
+        }
+
+        int status = disk->Dispatch(batch, count, mergeBuffer);
+        for (unsigned i = 0; i < count; i++) {
+            DiskRequest* req = batch[i];
+            req->status = status;
+
+            if (req->callback) {
+                req->callback(req, req->callbackData); // May free req
+            }
+        }
+    }
+}
+
 ssize_t DiskDevice::Read(size_t off, size_t size, uint8_t* buffer) {
     if (off & (blocksize - 1)) {
         return -EINVAL; // Block aligned reads only
     }
 
-    int e = ReadDiskBlock(off / blocksize, size, buffer);
+    int e = BlockCache::Read(this, off, size, buffer);
 
     if (e) {
         return -EIO;
@@ -41,4 +323,6 @@ ssize_t DiskDevice::Read(size_t off, size_t size, uint8_t* buffer) {
 
 ssize_t DiskDevice::Write(size_t off, size_t size, uint8_t* buffer) { return -ENOSYS; }
 
-DiskDevice::~DiskDevice() {}
\ No newline at end of file
+int DiskDevice::Sync() { return BlockCache::Sync(this) ? -EIO : 0; }
+
+DiskDevice::~DiskDevice() { BlockCache::Purge(this); }
\ No newline at end of file
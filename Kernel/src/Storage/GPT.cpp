@@ -3,14 +3,19 @@
 #include <Device.h>
 #include <Logging.h>
 #include <Memory.h>
+#include <MM/Swap.h>
 
 #include <Debug.h>
 
 namespace GPT {
+// Linux swap (0657FD6D-A4AB-43C4-84E5-0933C84B4F4F) as stored on disk
+static const uint8_t linuxSwapGUID[16] = {0x6D, 0xFD, 0x57, 0x06, 0xAB, 0xA4, 0xC4, 0x43,
+                                          0x84, 0xE5, 0x09, 0x33, 0xC8, 0x4B, 0x4F, 0x4F};
+
 int Parse(DiskDevice* disk) {
     gpt_header_t* header = (gpt_header_t*)kmalloc(disk->blocksize);
 
-    if (int e = disk->ReadDiskBlock(1, disk->blocksize, (uint8_t*)header); e) {
+    if (int e = disk->Transfer(DiskRequest::Read, 1, disk->blocksize, (uint8_t*)header); e) {
         Log::Info("[GPT] Disk error %d", e);
         return -1; // Disk Error
     }
@@ -32,7 +37,7 @@ int Parse(DiskDevice* disk) {
     int partNum = 4; // header->partNum;
 
     gpt_entry_t* partitionTable = (gpt_entry_t*)kmalloc(partNum * header->partEntrySize);
-    if (disk->ReadDiskBlock(tableLBA, partNum * header->partEntrySize, (uint8_t*)partitionTable)) {
+    if (disk->Transfer(DiskRequest::Read, tableLBA, partNum * header->partEntrySize, (uint8_t*)partitionTable)) {
         return -1; // Disk Error
     }
 
@@ -46,6 +51,10 @@ int Parse(DiskDevice* disk) {
         if ((entry.endLBA - entry.startLBA)) {
             PartitionDevice* part = new PartitionDevice(entry.startLBA, entry.endLBA, disk);
             disk->partitions.add_back(part);
+
+            if (!memcmp(entry.typeGUID, linuxSwapGUID, sizeof(linuxSwapGUID))) {
+                Memory::AddSwapPartition(part);
+            }
         }
     }
 
@@ -1,10 +1,14 @@
 #include <Storage/NVMe.h>
 
+#include <CPU.h>
 #include <Debug.h>
+#include <IDT.h>
 #include <Logging.h>
 #include <Math.h>
 #include <PCI.h>
+#include <SMP.h>
 #include <Scheduler.h>
+#include <Thread.h>
 
 namespace NVMe {
 char* deviceName = "Generic NVMe Controller";
@@ -35,67 +39,132 @@ NVMeQueue::NVMeQueue(uint16_t qid, uintptr_t cqBase, uintptr_t sqBase, void* cq,
     cqCount = csz / sizeof(NVMeCompletion);
     sQueueSize = ssz;
     sqCount = ssz / sizeof(NVMeCommand);
+
+    // Keep a submission queue entry free so a full queue is not mistaken for an empty one
+    unsigned commandCount = MIN(NVME_QUEUE_MAX_COMMANDS, sqCount - 1);
+    freeCommands = (commandCount >= 64) ? ~0ULL : ((1ULL << commandCount) - 1);
 }
 
 long NVMeQueue::Consume(NVMeCommand& cmd) { return 0; }
 
-void NVMeQueue::Submit(NVMeCommand& cmd) {
-    acquireLock(&queueLock);
-    cmd.commandID = nextCommandID++;
-    if (nextCommandID == 0xffff) {
-        nextCommandID = 0;
-    }
+uint16_t NVMeQueue::Submit(NVMeCommand& cmd) {
+    for (;;) {
+        {
+            ScopedSpinLock<true> lockQueue(queueLock);
+            if (freeCommands) {
+                uint16_t id = __builtin_ctzll(freeCommands);
+                freeCommands &= ~(1ULL << id);
 
-    submissionQueue[sqTail] = cmd;
+                requests[id].complete = false;
+                requests[id].blocker = nullptr;
 
-    sqTail++;
-    if (sqTail >= sqCount) {
-        sqTail = 0;
-    }
+                cmd.commandID = id;
+                submissionQueue[sqTail] = cmd;
 
-    *submissionDB = sqTail;
-    releaseLock(&queueLock);
-}
+                sqTail++;
+                if (sqTail >= sqCount) {
+                    sqTail = 0;
+                }
 
-void NVMeQueue::SubmitWait(NVMeCommand& cmd, NVMeCompletion& complet) {
-    ScopedSpinLock lockQueue(queueLock);
-    cmd.commandID = nextCommandID++;
-    if (nextCommandID == 0xffff) {
-        nextCommandID = 0;
-    }
-
-    submissionQueue[sqTail] = cmd;
+                *submissionDB = sqTail;
+                return id;
+            }
+        }
 
-    sqTail++;
-    if (sqTail >= sqCount) {
-        sqTail = 0;
+        // Every command ID is in use, wait for a command to finish
+        ProcessCompletions();
+        Scheduler::Yield();
     }
+}
 
-    *submissionDB = sqTail;
+void NVMeQueue::Wait(uint16_t commandID, NVMeCompletion& complet) {
+    assert(commandID < NVME_QUEUE_MAX_COMMANDS);
+    NVMeRequest& req = requests[commandID];
 
     timeval tv = Timer::GetSystemUptimeStruct();
-    while (completionCycleState == !completionQueue[cqHead].phaseTag) {
-        if (Timer::TimeDifference(Timer::GetSystemUptimeStruct(), tv) >= 500000) {
-            complet.status = 32767;
-            return; // Timeout
+    for (;;) {
+        ProcessCompletions(); // Picks up the completion if the interrupt was missed or interrupts are disabled
+
+        long elapsed = Timer::TimeDifference(Timer::GetSystemUptimeStruct(), tv);
+        GenericThreadBlocker blocker;
+        {
+            ScopedSpinLock<true> lockQueue(queueLock);
+            if (req.complete) {
+                complet = req.completion;
+                freeCommands |= 1ULL << commandID;
+                return;
+            } else if (elapsed >= NVME_COMMAND_TIMEOUT) {
+                // The controller may still use the command, the ID is freed if it ever completes
+                req.abandoned = true;
+                complet.status = NVME_STATUS_TIMEOUT;
+                return;
+            }
+
+            if (interruptsEnabled) {
+                req.blocker = &blocker;
+            }
         }
-        Scheduler::Yield();
+
+        if (!interruptsEnabled) {
+            Scheduler::Yield();
+            continue;
+        }
+
+        long timeout = NVME_COMMAND_TIMEOUT - elapsed;
+        if (Thread::Current()->Block(&blocker, timeout)) {
+            Scheduler::Yield(); // A command cannot be cancelled, so keep waiting even with a signal pending
+        }
+
+        ScopedSpinLock<true> lockQueue(queueLock);
+        req.blocker = nullptr;
     }
-    complet = completionQueue[cqHead];
+}
+
+void NVMeQueue::SubmitWait(NVMeCommand& cmd, NVMeCompletion& complet) { Wait(Submit(cmd), complet); }
+
+void NVMeQueue::ProcessCompletions() {
+    ScopedSpinLock<true> lockQueue(queueLock);
+
+    bool consumed = false;
+    for (;;) {
+        __atomic_thread_fence(__ATOMIC_ACQUIRE); // The controller writes to the completion queue
+        NVMeCompletion& entry = completionQueue[cqHead];
+        if (entry.phaseTag != completionCycleState) {
+            break; // No new entries
+        }
 
-    if (++cqHead >= cqCount) {
-        cqHead = 0;
-        completionCycleState = !completionCycleState;
+        if (entry.commandID < NVME_QUEUE_MAX_COMMANDS) {
+            NVMeRequest& req = requests[entry.commandID];
+            if (req.abandoned) {
+                req.abandoned = false;
+                freeCommands |= 1ULL << entry.commandID;
+            } else {
+                req.completion = entry;
+                req.complete = true;
+
+                if (req.blocker) {
+                    req.blocker->Unblock();
+                }
+            }
+        }
+
+        if (++cqHead >= cqCount) {
+            cqHead = 0;
+            completionCycleState = !completionCycleState;
+        }
+        consumed = true;
     }
 
-    *completionDB = cqHead;
+    if (consumed) {
+        *completionDB = cqHead;
+    }
 }
 
 Controller::Controller(const PCIInfo& dev) : PCIDevice(dev) {
 
     cRegs = reinterpret_cast<Registers*>(Memory::KernelAllocate4KPages(4));
     Memory::KernelMapVirtualMemory4K(GetBaseAddressRegister(0), (uintptr_t)cRegs, 4,
-                                     PAGE_PRESENT | PAGE_WRITABLE | PAGE_CACHE_DISABLED | PAGE_WRITETHROUGH);
+                                     PAGE_PRESENT | PAGE_WRITABLE | PAGE_MEMORY_UC);
 
     EnableBusMastering();
     EnableMemorySpace();
@@ -193,16 +262,26 @@ Controller::Controller(const PCIInfo& dev) : PCIDevice(dev) {
         return;
     }
 
+    // MDTS is in units of the minimum memory page size, 0 means there is no limit
+    if (controllerIdentity->maximumDataTransferSize &&
+        controllerIdentity->maximumDataTransferSize < 32 - NVME_CAP_MPSMIN(cRegs->cap) - 12) {
+        maxTransferSize = MIN(maxTransferSize, GetMinMemoryPageSize() << controllerIdentity->maximumDataTransferSize);
+    }
+
     // GetNamespaceList();
 
-    // Attempt to allocate 12 I/O queues
-    if (SetNumberOfQueues(12)) {
+    // Attempt to allocate an I/O queue for each CPU
+    unsigned queueCount = SMP::processorCount;
+    if (SetNumberOfQueues(queueCount)) {
         dStatus = ControllerError; // Failed to create at least one I/O queue
         return;
     }
 
-    // Create 32 I/O Queues
-    for (unsigned i = 0; i < MIN(completionQueuesAllocated, submissionQueuesAllocated); i++) {
+    queueCount = MIN(queueCount, MIN(completionQueuesAllocated, submissionQueuesAllocated));
+    SetupInterrupts(queueCount);
+
+    ioQueues = new NVMeQueue*[queueCount];
+    for (unsigned i = 0; i < queueCount; i++) {
         NVMeQueue* qPtr = new NVMeQueue();
 
         if (CreateIOQueue(qPtr)) { // Error creating I/O queue?
@@ -210,17 +289,16 @@ Controller::Controller(const PCIInfo& dev) : PCIDevice(dev) {
             break;
         }
 
-        ioQueues.add_back(qPtr);
+        ioQueues[ioQueueCount] = qPtr;
+        __atomic_store_n(&ioQueueCount, ioQueueCount + 1, __ATOMIC_RELEASE); // Read by the shared interrupt handler
     }
 
-    if (ioQueues.get_length() < 1) {
+    if (ioQueueCount < 1) {
         Log::Warning("[NVMe] Failed to create any I/O queues!");
         dStatus = ControllerError; // Failed to create at least one I/O queue
         return;
     }
 
-    queueAvailability = Semaphore(ioQueues.get_length());
-
     IF_DEBUG(debugLevelNVMe >= DebugLevelNormal, {
         char serialNumber[21];
         memcpy(serialNumber, controllerIdentity->serialNumber, 20);
@@ -231,7 +309,7 @@ Controller::Controller(const PCIInfo& dev) : PCIDevice(dev) {
         name[40] = 0;
 
         Log::Info("[NVMe] Serial number: '%s', Name: '%s', %d namespaces (%d reported), %d I/O queues", serialNumber,
-                  name, namespaceIDs.get_length(), controllerIdentity->numNamespaces, ioQueues.get_length());
+                  name, namespaceIDs.get_length(), controllerIdentity->numNamespaces, ioQueueCount);
     });
 
     dStatus = ControllerReady;
@@ -281,6 +359,27 @@ Controller::Controller(const PCIInfo& dev) : PCIDevice(dev) {
     }
 }
 
+void Controller::SetupInterrupts(unsigned queueCount) {
+    if (MSIXVectorCount() > queueCount) {
+        intMode = InterruptsPerQueue; // Each I/O queue uses the MSI-X entry matching its ID, entry 0 is the admin queue
+        return;
+    }
+
+    if (MSIXCapable()) {
+        sharedIRQ = AllocateMSIXVector(0, 0);
+    } else if (MSICapable()) {
+        sharedIRQ = AllocateVector(PCIVectorMSI);
+    }
+
+    if (sharedIRQ == 0xFF) {
+        Log::Warning("[NVMe] No MSI or MSI-X support, polling for completion");
+        return;
+    }
+
+    IDT::RegisterInterruptHandler(sharedIRQ, reinterpret_cast<isr_t>(&SharedIRQHandler), this);
+    intMode = InterruptsShared;
+}
+
 long Controller::CreateIOQueue(NVMeQueue* qPtr) {
     uintptr_t sqBase = Memory::AllocatePhysicalMemoryBlock();
     uintptr_t cqBase = Memory::AllocatePhysicalMemoryBlock();
@@ -295,7 +394,19 @@ long Controller::CreateIOQueue(NVMeQueue* qPtr) {
     NVMeCompletion completion;
 
     *qPtr = NVMeQueue(queueID, cqBase, sqBase, cq, sq, GetCompletionDoorbell(queueID), GetSubmissionDoorbell(queueID),
-                      PAGE_SIZE_4K, PAGE_SIZE_4K);
+                      MIN(PAGE_SIZE_4K, GetMaxQueueEntries() * sizeof(NVMeCompletion)),
+                      MIN(PAGE_SIZE_4K, GetMaxQueueEntries() * sizeof(NVMeCommand)));
+
+    uint8_t irq = 0xFF;
+    if (intMode == InterruptsPerQueue) {
+        // Queue n is used by CPU n (see GetIOQueue), so send its interrupt there
+        unsigned cpu = (queueID - 1 < 256 && SMP::cpus[queueID - 1]) ? queueID - 1 : 0;
+
+        irq = AllocateMSIXVector(queueID, cpu);
+        if (irq == 0xFF) {
+            Log::Warning("[NVMe] Failed to allocate interrupt for I/O queue %u, polling for completion", queueID);
+        }
+    }
 
     NVMeCommand createCq;
     memset(&createCq, 0, sizeof(NVMeCommand));
@@ -306,6 +417,14 @@ long Controller::CreateIOQueue(NVMeQueue* qPtr) {
     createCq.createIOCQ.queueSize = qPtr->CQSize() - 1;
     createCq.prp1 = cqBase;
 
+    if (irq != 0xFF) {
+        createCq.createIOCQ.intEnable = 1;
+        createCq.createIOCQ.intVector = queueID;
+    } else if (intMode == InterruptsShared) {
+        createCq.createIOCQ.intEnable = 1;
+        createCq.createIOCQ.intVector = 0;
+    }
+
     adminQueue.SubmitWait(createCq, completion);
 
     if (completion.status > 0) {
@@ -330,18 +449,29 @@ long Controller::CreateIOQueue(NVMeQueue* qPtr) {
         return completion.status;
     }
 
+    if (irq != 0xFF) {
+        IDT::RegisterInterruptHandler(irq, reinterpret_cast<isr_t>(&QueueIRQHandler), qPtr);
+    }
+
+    if (createCq.createIOCQ.intEnable) {
+        qPtr->EnableInterrupts();
+    }
+
     return 0;
 }
 
 long Controller::SetNumberOfQueues(uint16_t num) {
+    assert(num > 0);
+
     NVMeCommand cmd;
     memset(&cmd, 0, sizeof(NVMeCommand));
 
     cmd.opcode = AdminCmdSetFeatures;
 
     cmd.setFeatures.featureID = NVMeSetFeaturesCommand::FeatureIDNumberOfQueues;
-    cmd.setFeatures.dw11 = (static_cast<uint32_t>(num) << 16) |
-                           num; // Number of completion queues in high word, Number of submission queues in low word
+    cmd.setFeatures.dw11 = (static_cast<uint32_t>(num - 1) << 16) |
+                           (num - 1); // Number of completion queues in high word, Number of submission queues in low
+                                      // word, both 0's based
 
     NVMeCompletion completion;
     adminQueue.SubmitWait(cmd, completion);
@@ -351,8 +481,8 @@ long Controller::SetNumberOfQueues(uint16_t num) {
         return completion.status;
     }
 
-    completionQueuesAllocated = (completion.dw0 >> 16) & 0xffff; // High word
-    submissionQueuesAllocated = completion.dw0 & 0xffff;         // Low Word
+    completionQueuesAllocated = ((completion.dw0 >> 16) & 0xffff) + 1; // High word, 0's based
+    submissionQueuesAllocated = (completion.dw0 & 0xffff) + 1;         // Low Word, 0's based
 
     return 0;
 }
@@ -419,18 +549,17 @@ long Controller::GetNamespaceList() {
     return 0;
 }
 
-NVMeQueue* Controller::AcquireIOQueue() {
-    if (queueAvailability.Wait()) {
-        return nullptr;
-    }
-
-    assert(ioQueues.get_length() > 0);
-    return ioQueues.remove_at(0);
+NVMeQueue* Controller::GetIOQueue() {
+    assert(ioQueueCount > 0);
+    return ioQueues[GetCPULocal()->id % ioQueueCount];
 }
 
-void Controller::ReleaseIOQueue(NVMeQueue* queue) {
-    ioQueues.add_back(queue);
+void Controller::QueueIRQHandler(NVMeQueue* queue, RegisterContext* r) { queue->ProcessCompletions(); }
 
-    queueAvailability.Signal();
+void Controller::SharedIRQHandler(Controller* c, RegisterContext* r) {
+    unsigned count = __atomic_load_n(&c->ioQueueCount, __ATOMIC_ACQUIRE);
+    for (unsigned i = 0; i < count; i++) {
+        c->ioQueues[i]->ProcessCompletions();
+    }
 }
 } // namespace NVMe
\ No newline at end of file
@@ -2,6 +2,7 @@
 
 #include <Debug.h>
 #include <Errno.h>
+#include <Math.h>
 #include <Storage/GPT.h>
 
 namespace NVMe {
@@ -13,14 +14,15 @@ Namespace::Namespace(Controller* controller, uint32_t nsID, const NamespaceIdent
 
     uint8_t lbaFormat = id.fmtLBASize & 0xf; // Low 4 bits are LBA format
     uint8_t lbaSize = id.lbaFormats[lbaFormat].lbaDataSize;
-    if (lbaSize < 9) {
+    if (lbaSize < 9 || lbaSize > PAGE_SHIFT_4K) {
         nsStatus = NamespaceStatus::Error;
-        return; // LBA Size must be at least 9 (512 bytes)
+        return; // LBA Size must be at least 9 (512 bytes) and a block must fit in a buffer
     }
 
     blocksize = 1 << lbaSize;
+    ioThreads = NVME_NAMESPACE_IO_THREADS; // Commands on different queues are carried out at once
 
-    for (unsigned i = 0; i < 8; i++) {
+    for (unsigned i = 0; i < NVME_NAMESPACE_BUFFER_COUNT; i++) {
         physBuffers[i] = Memory::AllocatePhysicalMemoryBlock();
         buffers[i] = Memory::KernelAllocate4KPages(1);
         Memory::KernelMapVirtualMemory4K(physBuffers[i], (uintptr_t)buffers[i], 1);
@@ -48,7 +50,7 @@ int Namespace::AcquireBuffer() {
         return -EINTR;
     }
 
-    for (uint8_t i = 0; i < 8; i++) {
+    for (uint8_t i = 0; i < NVME_NAMESPACE_BUFFER_COUNT; i++) {
         if (!acquireTestLock(&bufferLocks[i])) {
             return i;
         }
@@ -58,117 +60,91 @@ int Namespace::AcquireBuffer() {
 }
 
 void Namespace::ReleaseBuffer(int buffer) {
-    assert(buffer >= 0 && buffer < 8);
+    assert(buffer >= 0 && buffer < NVME_NAMESPACE_BUFFER_COUNT);
     releaseLock(&bufferLocks[buffer]);
 
     bufferAvailability.Signal();
 }
 
-int Namespace::ReadDiskBlock(uint64_t lba, uint32_t count, void* _buffer) {
-    if (lba + count > diskSize) {
-        return 2;
-    }
-
-    uint32_t blockCount = (count + (blocksize - 1)) / blocksize;
-    uint8_t* buffer = reinterpret_cast<uint8_t*>(_buffer);
-    int blockBufferIndex = AcquireBuffer();
-    if (blockBufferIndex == -EINTR) {
-        return -EINTR;
-    }
-    assert(blockBufferIndex >= 0);
-
-    NVMeQueue* queue = controller->AcquireIOQueue();
-    if (!queue) {
-        return -EINTR; // The only time it should be null is if we got interrupted
-    }
-
-    NVMeCompletion completion;
-
-    NVMeCommand cmd;
-    memset(&cmd, 0, sizeof(NVMeCommand));
-    cmd.opcode = NVMCommands::NVMCmdRead;
-
-    cmd.read.blockNum = 1;
-    cmd.read.startLBA = lba;
-    cmd.prp1 = physBuffers[blockBufferIndex];
-    cmd.nsID = nsID;
-
-    while (blockCount && count > 0) {
-        int size = blocksize;
-        if (size > count)
-            size = count;
-
-        if (!size)
-            break;
-
-        queue->SubmitWait(cmd, completion);
-
-        if (completion.status > 0) {
-            controller->ReleaseIOQueue(queue);
-            ReleaseBuffer(blockBufferIndex);
-
-            IF_DEBUG(debugLevelNVMe >= DebugLevelNormal,
-                     { Log::Error("[NVMe] (NSID: %d, LBA: %x) Disk Error %d", nsID, lba, completion.status); });
-            return -completion.status;
-        }
-
-        memcpy(buffer, buffers[blockBufferIndex], size);
-
-        count -= size;
-        buffer += size;
-        cmd.read.startLBA++;
-        blockCount--;
-    }
+int Namespace::ReadDiskBlock(uint64_t lba, uint32_t count, void* buffer) {
+    return Access(lba, count, reinterpret_cast<uint8_t*>(buffer), false);
+}
 
-    ReleaseBuffer(blockBufferIndex);
-    controller->ReleaseIOQueue(queue);
-    return 0;
+int Namespace::WriteDiskBlock(uint64_t lba, uint32_t count, void* buffer) {
+    return Access(lba, count, reinterpret_cast<uint8_t*>(buffer), true);
 }
 
-int Namespace::WriteDiskBlock(uint64_t lba, uint32_t count, void* _buffer) {
-    if (lba + count > diskSize) {
+int Namespace::Access(uint64_t lba, uint32_t count, uint8_t* buffer, bool write) {
+    if (lba + (count + (blocksize - 1)) / blocksize > diskSize) {
         return 2;
     }
 
-    uint32_t blockCount = (count + (blocksize - 1)) / blocksize;
-    uint8_t* buffer = reinterpret_cast<uint8_t*>(_buffer);
     int blockBufferIndex = AcquireBuffer();
     if (blockBufferIndex == -EINTR) {
         return -EINTR;
     }
-
     assert(blockBufferIndex >= 0);
 
-    NVMeQueue* queue = controller->AcquireIOQueue();
-    if (!queue) {
-        return -EINTR; // The only time it should be null is if we got interrupted
-    }
+    // PRP entries must be dword aligned
+    bool direct = CanDMA(buffer, count, 4);
+
+    NVMeQueue* queue = controller->GetIOQueue();
 
     NVMeCompletion completion;
 
     NVMeCommand cmd;
     memset(&cmd, 0, sizeof(NVMeCommand));
-    cmd.opcode = NVMCommands::NVMCmdWrite;
-
-    cmd.write.blockNum = 1;
-    cmd.write.startLBA = lba;
-    cmd.prp1 = physBuffers[blockBufferIndex];
+    cmd.opcode = write ? NVMCommands::NVMCmdWrite : NVMCommands::NVMCmdRead;
     cmd.nsID = nsID;
 
-    while (blockCount && count > 0) {
-        int size = blocksize;
-        if (size > count)
-            size = count;
+    // Reads and writes share the layout of the LBA and block count
+    cmd.read.startLBA = lba;
 
-        if (!size)
-            break;
+    while (count > 0) {
+        uint32_t size;
+        if (direct) {
+            size = MIN(count, controller->MaxTransferSize());
+
+            // The first entry may start part way into a page, every following page is whole.
+            // Past two pages PRP2 points to a list of the rest, which is kept in our buffer.
+            uintptr_t addr = reinterpret_cast<uintptr_t>(buffer);
+            uint32_t offset = addr & (PAGE_SIZE_4K - 1);
+            uint32_t first = PAGE_SIZE_4K - offset;
+
+            cmd.prp1 = Memory::VirtualToPhysicalAddress(addr) + offset;
+            if (size <= first) {
+                cmd.prp2 = 0;
+            } else if (size <= first + PAGE_SIZE_4K) {
+                cmd.prp2 = Memory::VirtualToPhysicalAddress(addr + first);
+            } else {
+                uint64_t* prpList = reinterpret_cast<uint64_t*>(buffers[blockBufferIndex]);
+
+                unsigned entries = 0;
+                for (uint32_t pos = first; pos < size; pos += PAGE_SIZE_4K) {
+                    assert(entries < PAGE_SIZE_4K / sizeof(uint64_t));
+                    prpList[entries++] = Memory::VirtualToPhysicalAddress(addr + pos);
+                }
+
+                cmd.prp2 = physBuffers[blockBufferIndex];
+            }
+        } else {
+            // Transfer as much as fits in the buffer with each command
+            size = MIN(count, PAGE_SIZE_4K);
+
+            cmd.prp1 = physBuffers[blockBufferIndex];
+            cmd.prp2 = 0;
+
+            if (write) {
+                memcpy(buffers[blockBufferIndex], buffer, size);
+            }
+        }
 
-        memcpy(buffers[blockBufferIndex], buffer, size);
+        uint32_t blocks = (size + (blocksize - 1)) / blocksize;
 
+        cmd.read.blockNum = blocks - 1; // 0's based
         queue->SubmitWait(cmd, completion);
 
         if (completion.status > 0) {
-            controller->ReleaseIOQueue(queue);
             ReleaseBuffer(blockBufferIndex);
 
             IF_DEBUG(debugLevelNVMe >= DebugLevelNormal,
@@ -176,14 +152,16 @@ int Namespace::WriteDiskBlock(uint64_t lba, uint32_t count, void* _buffer) {
             return -completion.status;
         }
 
+        if (!direct && !write) {
+            memcpy(buffer, buffers[blockBufferIndex], size);
+        }
+
         count -= size;
         buffer += size;
-        cmd.read.startLBA++;
-        blockCount--;
+        cmd.read.startLBA += blocks;
     }
 
     ReleaseBuffer(blockBufferIndex);
-    controller->ReleaseIOQueue(queue);
     return 0;
 }
-} // namespace NVMe
\ No newline at end of file
+} // namespace NVMe
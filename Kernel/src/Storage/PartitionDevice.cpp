@@ -2,6 +2,7 @@
 
 #include <CString.h>
 #include <Errno.h>
+#include <Storage/BlockCache.h>
 
 PartitionDevice::PartitionDevice(uint64_t startLBA, uint64_t endLBA, DiskDevice* disk)
     : Device(DeviceTypeStoragePartition) {
@@ -43,14 +44,22 @@ int PartitionDevice::ReadBlock(uint64_t lba, uint32_t count, void* buffer) {
         return 2;
     }
 
-    return parentDisk->ReadDiskBlock(lba + m_startLBA, count, buffer);
+    return BlockCache::Read(parentDisk, (lba + m_startLBA) * parentDisk->blocksize, count, buffer);
 }
 
 int PartitionDevice::WriteBlock(uint64_t lba, uint32_t count, void* buffer) {
     if (lba * parentDisk->blocksize + count > (m_endLBA - m_startLBA) * parentDisk->blocksize)
         return 2;
 
-    return parentDisk->WriteDiskBlock(lba + m_startLBA, count, buffer);
+    return BlockCache::Write(parentDisk, (lba + m_startLBA) * parentDisk->blocksize, count, buffer);
+}
+
+int PartitionDevice::TransferUncached(DiskRequest::Operation op, uint64_t offset, uint32_t count, void* buffer) {
+    if ((offset | count) & (parentDisk->blocksize - 1) || offset + count > PartitionSize()) {
+        return 2;
+    }
+
+    return parentDisk->Transfer(op, offset / parentDisk->blocksize + m_startLBA, count, buffer);
 }
 
 ssize_t PartitionDevice::Read(size_t off, size_t size, uint8_t* buffer) {
@@ -59,7 +68,7 @@ ssize_t PartitionDevice::Read(size_t off, size_t size, uint8_t* buffer) {
         return -EINVAL; // Block aligned reads only
     }
 
-    int e = parentDisk->ReadDiskBlock(m_startLBA + off / parentDisk->blocksize, size, buffer);
+    int e = BlockCache::Read(parentDisk, m_startLBA * parentDisk->blocksize + off, size, buffer);
 
     if (e) {
         return -EIO;
@@ -74,7 +83,7 @@ ssize_t PartitionDevice::Write(size_t off, size_t size, uint8_t* buffer) {
         return -EINVAL; // Block aligned writes only
     }
 
-    int e = parentDisk->WriteDiskBlock(m_startLBA + off / parentDisk->blocksize, size, buffer);
+    int e = BlockCache::Write(parentDisk, m_startLBA * parentDisk->blocksize + off, size, buffer);
 
     if (e) {
         return -EIO;
@@ -83,4 +92,13 @@ ssize_t PartitionDevice::Write(size_t off, size_t size, uint8_t* buffer) {
     return size;
 }
 
+int PartitionDevice::Sync() {
+    uint64_t blocksize = parentDisk->blocksize;
+    if (BlockCache::Sync(parentDisk, m_startLBA * blocksize, (m_endLBA - m_startLBA) * blocksize)) {
+        return -EIO;
+    }
+
+    return 0;
+}
+
 PartitionDevice::~PartitionDevice() {}
\ No newline at end of file
@@ -76,9 +76,11 @@ ssize_t PTYDevice::Write(size_t offset, size_t size, uint8_t* buffer) {
 
         buffer += written;
         while (written < size) {
-            size_t ret = pty->SlaveWrite((char*)buffer, size - written);
+            ssize_t ret = pty->SlaveWrite((char*)buffer, size - written);
             if (ret < 0) {
                 return ret;
+            } else if (!ret) {
+                Scheduler::Yield(); // Buffer is full, let the other side read
             }
             written += ret;
             buffer += ret;
@@ -93,9 +95,11 @@ ssize_t PTYDevice::Write(size_t offset, size_t size, uint8_t* buffer) {
 
         buffer += written;
         while (written < size) {
-            size_t ret = pty->MasterWrite((char*)buffer, size - written);
+            ssize_t ret = pty->MasterWrite((char*)buffer, size - written);
             if (ret < 0) {
                 return ret;
+            } else if (!ret) {
+                Scheduler::Yield(); // Buffer is full, let the other side read
             }
             written += ret;
             buffer += ret;
@@ -118,7 +122,7 @@ int PTYDevice::Ioctl(uint64_t cmd, uint64_t arg) {
         break;
     case TCSETS:
         pty->tios = *((termios*)arg);
-        pty->slave.ignoreBackspace = !pty->IsCanonical();
+        pty->UpdateLineCount();
         break;
     case TIOCGWINSZ:
         *((winsz*)arg) = pty->wSz;
@@ -181,8 +185,8 @@ PTY::PTY(int id) : m_id(id) {
     slaveFile.flags = FS_NODE_CHARDEVICE;
     masterFile.flags = FS_NODE_CHARDEVICE;
 
-    master.ignoreBackspace = true;
-    slave.ignoreBackspace = false;
+    master.SetRaw(true); // Output is passed to the master as is
+    slave.SetRaw(false);
     master.Flush();
     slave.Flush();
     tios.c_lflag = ECHO | ICANON;
@@ -221,6 +225,12 @@ void PTY::Close() {
     }
 }
 
+void PTY::UpdateLineCount() {
+    // Input is only processed by line in canonical mode
+    slave.erase = tios.c_cc[VERASE];
+    slave.SetRaw(!IsCanonical());
+}
+
 ssize_t PTY::MasterRead(char* buffer, size_t count) { return master.Read(buffer, count); }
 
 ssize_t PTY::SlaveRead(char* buffer, size_t count) {
@@ -248,34 +258,21 @@ ssize_t PTY::SlaveRead(char* buffer, size_t count) {
 ssize_t PTY::MasterWrite(char* buffer, size_t count) {
     ssize_t ret = slave.Write(buffer, count);
 
-    if (slaveFile.blocked.get_length()) {
-        if (IsCanonical()) {
-            while (slave.lines && slaveFile.blocked.get_length()) {
-                acquireLock(&slaveFile.blockedLock);
-                if (slaveFile.blocked.get_length()) {
-                    slaveFile.blocked.get_front()->Unblock();
-                }
-                releaseLock(&slaveFile.blockedLock);
-            }
-        } else {
-            while (slave.bufferPos && slaveFile.blocked.get_length()) {
-                acquireLock(&slaveFile.blockedLock);
-                if (slaveFile.blocked.get_length()) {
-                    slaveFile.blocked.get_front()->Unblock();
-                }
-                releaseLock(&slaveFile.blockedLock);
-            }
-        }
+    if (slaveFile.blocked.get_length() && (IsCanonical() ? slave.lines : slave.bufferPos)) {
+        slaveFile.UnblockWaiters(1); // One reader can take everything there is
     }
 
     if (Echo() && ret) {
-        for (unsigned i = 0; i < count; i++) {
-            if (buffer[i] == '\e') { // Escape
-                master.Write("^[", 2);
-            } else {
-                master.Write(&buffer[i], 1);
-            }
+        // Echo runs of characters at once, only escapes are replaced
+        size_t run = 0;
+        for (size_t i = CharacterBuffer::Scan(buffer, count, '\e', '\e', '\e'); i < count;
+             i = run + CharacterBuffer::Scan(buffer + run, count - run, '\e', '\e', '\e')) {
+            master.Write(buffer + run, i - run);
+            master.Write("^[", 2); // Escape
+
+            run = i + 1;
         }
+        master.Write(buffer + run, count - run);
     }
 
     if (IsCanonical()) {
@@ -298,12 +295,8 @@ ssize_t PTY::MasterWrite(char* buffer, size_t count) {
 ssize_t PTY::SlaveWrite(char* buffer, size_t count) {
     ssize_t written = master.Write(buffer, count);
 
-    while (master.bufferPos && masterFile.blocked.get_length()) {
-        acquireLock(&masterFile.blockedLock);
-        if (masterFile.blocked.get_length()) {
-            masterFile.blocked.get_front()->Unblock();
-        }
-        releaseLock(&masterFile.blockedLock);
+    if (master.bufferPos && masterFile.blocked.get_length()) {
+        masterFile.UnblockWaiters(1);
     }
 
     if (master.bufferPos && m_watchingMaster.get_length()) {
@@ -0,0 +1,249 @@
+#include <USB/MassStorage.h>
+
+#include <Debug.h>
+#include <Errno.h>
+#include <Math.h>
+#include <Storage/GPT.h>
+#include <Timer.h>
+
+namespace USB {
+// SCSI fields are big endian
+static inline void PutBE32(uint8_t* p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+static inline void PutBE64(uint8_t* p, uint64_t value) {
+    PutBE32(p, value >> 32);
+    PutBE32(p + 4, value & 0xFFFFFFFF);
+}
+
+static inline uint32_t GetBE32(const uint8_t* p) {
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+}
+
+static inline uint64_t GetBE64(const uint8_t* p) { return (uint64_t(GetBE32(p)) << 32) | GetBE32(p + 4); }
+
+MassStorage::MassStorage(XHCIController* hcd, XHCIController::TransferRing* control,
+                         XHCIController::TransferRing* bulkIn, XHCIController::TransferRing* bulkOut,
+                         uint8_t interface)
+    : hcd(hcd), control(control), bulkIn(bulkIn), bulkOut(bulkOut), interface(interface) {
+    cbw = new CommandBlockWrapper;
+    csw = new CommandStatusWrapper;
+    bounceBuffer = new uint8_t[USB_MSC_MAX_TRANSFER];
+
+    // The medium may take a moment to become ready after the device is configured
+    uint8_t testUnitReady[6] = {SCSICmdTestUnitReady, 0, 0, 0, 0, 0};
+    unsigned retries = 0;
+    while (Command(testUnitReady, sizeof(testUnitReady), nullptr, 0, false)) {
+        if (++retries >= USB_MSC_READY_RETRIES) {
+            Log::Warning("[USB MSC] Device not ready");
+            status = Error;
+            return;
+        }
+
+        // Fetch the sense data to clear the unit attention condition
+        uint8_t requestSense[6] = {SCSICmdRequestSense, 0, 0, 0, 18, 0};
+        Command(requestSense, sizeof(requestSense), bounceBuffer, 18, true);
+
+        Timer::Wait(100);
+    }
+
+    if (ReadCapacity()) {
+        Log::Warning("[USB MSC] Failed to read capacity");
+        status = Error;
+        return;
+    }
+
+    SetDeviceName("USB Mass Storage Device");
+    status = Active;
+
+    switch (GPT::Parse(this)) {
+    case 0:
+        Log::Error("[USB MSC] Disk has a corrupted or non-existant GPT. MBR disks are NOT supported.");
+        break;
+    case -1:
+        Log::Error("[USB MSC] Disk Error while Parsing GPT");
+        break;
+    }
+    Log::Info("[USB MSC] Blocksize is %d, %u blocks and found %d partitions!", blocksize, blockCount,
+              partitions.get_length());
+
+    InitializePartitions();
+}
+
+MassStorage::~MassStorage() {
+    delete cbw;
+    delete csw;
+    delete[] bounceBuffer;
+}
+
+int MassStorage::ReadDiskBlock(uint64_t lba, uint32_t count, void* buffer) {
+    return Access(lba, count, reinterpret_cast<uint8_t*>(buffer), false);
+}
+
+int MassStorage::WriteDiskBlock(uint64_t lba, uint32_t count, void* buffer) {
+    return Access(lba, count, reinterpret_cast<uint8_t*>(buffer), true);
+}
+
+int MassStorage::Command(const uint8_t* command, uint8_t length, void* data, uint32_t dataLength, bool in) {
+    assert(length <= sizeof(cbw->command));
+
+    ScopedMutexLock lockCommand(commandLock);
+
+    memset(cbw, 0, sizeof(CommandBlockWrapper));
+    cbw->signature = USB_MSC_CBW_SIGNATURE;
+    cbw->tag = nextTag++;
+    cbw->dataTransferLength = dataLength;
+    cbw->flags = in ? USB_MSC_CBW_DATA_IN : 0;
+    cbw->lun = 0;
+    cbw->commandLength = length;
+    memcpy(cbw->command, command, length);
+
+    memset(csw, 0, sizeof(CommandStatusWrapper));
+
+    // Queue all three stages before ringing, so the device is never left waiting on the host between them
+    XHCIController::TransferWaiter cbwWaiter, dataWaiter, cswWaiter;
+    bool queued =
+        hcd->QueueBufferTransfer(bulkOut, cbw, sizeof(CommandBlockWrapper), XHCIController::TransferWaiter::Complete,
+                                 &cbwWaiter);
+    if (queued && dataLength) {
+        queued = hcd->QueueBufferTransfer(in ? bulkIn : bulkOut, data, dataLength,
+                                          XHCIController::TransferWaiter::Complete, &dataWaiter);
+    }
+    if (queued) {
+        queued = hcd->QueueBufferTransfer(bulkIn, csw, sizeof(CommandStatusWrapper),
+                                          XHCIController::TransferWaiter::Complete, &cswWaiter);
+    }
+
+    if (!queued) {
+        // Throw away whatever made it onto the rings
+        hcd->ResetEndpoint(bulkOut);
+        hcd->ResetEndpoint(bulkIn);
+        return -EIO;
+    }
+
+    bulkOut->Ring();
+    bulkIn->Ring();
+
+    // A stall leaves the TDs after it on the ring, which are thrown away by the reset recovery
+    if (!cbwWaiter.Wait() || (dataLength && !dataWaiter.Wait()) || !cswWaiter.Wait()) {
+        IF_DEBUG(debugLevelXHCI >= DebugLevelNormal,
+                 { Log::Warning("[USB MSC] Command %x failed, resetting device", command[0]); });
+
+        ResetRecovery();
+        return -EIO;
+    }
+
+    if (csw->signature != USB_MSC_CSW_SIGNATURE || csw->tag != cbw->tag || csw->status == 2) {
+        // Phase error or a CSW we do not understand
+        ResetRecovery();
+        return -EIO;
+    }
+
+    if (csw->status) {
+        return -EIO; // Command failed
+    }
+
+    return 0;
+}
+
+void MassStorage::ResetRecovery() {
+    hcd->ControlTransfer(control, USB_REQUEST_TYPE_CLASS | USB_REQUEST_RECIPIENT_INTERFACE, USB_MSC_REQUEST_RESET, 0,
+                         interface, 0, 0);
+
+    XHCIController::TransferRing* rings[] = {bulkIn, bulkOut};
+    for (XHCIController::TransferRing* ring : rings) {
+        hcd->ResetEndpoint(ring);
+
+        // The device keeps its side of the endpoint halted until told otherwise
+        hcd->ControlTransfer(control, USB_REQUEST_RECIPIENT_ENDPOINT, RequestClearFeature, USB_FEATURE_ENDPOINT_HALT,
+                             ring->EndpointAddress(), 0, 0);
+    }
+}
+
+int MassStorage::ReadCapacity() {
+    uint8_t readCapacity[10] = {SCSICmdReadCapacity10, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    if (Command(readCapacity, sizeof(readCapacity), bounceBuffer, 8, true)) {
+        return -EIO;
+    }
+
+    uint64_t lastLBA = GetBE32(bounceBuffer);
+    blocksize = GetBE32(bounceBuffer + 4);
+
+    if (lastLBA == 0xFFFFFFFF) {
+        // Too large for READ CAPACITY (10)
+        uint8_t readCapacity16[16] = {SCSICmdServiceActionIn16, 0x10};
+        readCapacity16[13] = 32; // Allocation length
+
+        if (Command(readCapacity16, sizeof(readCapacity16), bounceBuffer, 32, true)) {
+            return -EIO;
+        }
+
+        lastLBA = GetBE64(bounceBuffer);
+        blocksize = GetBE32(bounceBuffer + 8);
+    }
+
+    if (blocksize < 512 || blocksize > PAGE_SIZE_4K) {
+        Log::Warning("[USB MSC] Unsupported block size %u", blocksize);
+        return -EIO;
+    }
+
+    blockCount = lastLBA + 1;
+    return 0;
+}
+
+int MassStorage::Access(uint64_t lba, uint32_t count, uint8_t* buffer, bool write) {
+    if (lba + (count + (blocksize - 1)) / blocksize > blockCount) {
+        return 2;
+    }
+
+    // The device moves whole blocks, anything else goes through the bounce buffer
+    bool direct = CanDMA(buffer, count, 1) && !(count % blocksize);
+
+    while (count > 0) {
+        uint32_t size = MIN(count, USB_MSC_MAX_TRANSFER);
+        uint32_t blocks = (size + (blocksize - 1)) / blocksize;
+
+        uint8_t* data = direct ? buffer : bounceBuffer;
+        if (write && !direct) {
+            memcpy(bounceBuffer, buffer, size);
+        }
+
+        uint8_t command[16];
+        memset(command, 0, sizeof(command));
+
+        uint8_t length;
+        if (lba + blocks > 0xFFFFFFFF) {
+            command[0] = write ? SCSICmdWrite16 : SCSICmdRead16;
+            PutBE64(command + 2, lba);
+            PutBE32(command + 10, blocks);
+            length = 16;
+        } else {
+            command[0] = write ? SCSICmdWrite10 : SCSICmdRead10;
+            PutBE32(command + 2, lba);
+            command[7] = blocks >> 8;
+            command[8] = blocks & 0xFF;
+            length = 10;
+        }
+
+        if (Command(command, length, data, blocks * blocksize, !write)) {
+            IF_DEBUG(debugLevelXHCI >= DebugLevelNormal,
+                     { Log::Error("[USB MSC] (LBA: %x) Disk Error", lba); });
+            return -EIO;
+        }
+
+        if (!direct && !write) {
+            memcpy(buffer, bounceBuffer, size);
+        }
+
+        count -= size;
+        buffer += size;
+        lba += blocks;
+    }
+
+    return 0;
+}
+} // namespace USB
@@ -3,12 +3,15 @@
 #include <Assert.h>
 #include <IDT.h>
 #include <Logging.h>
+#include <Math.h>
 #include <Memory.h>
 #include <PCI.h>
 #include <Paging.h>
 #include <Timer.h>
+#include <USB/MassStorage.h>
 
 #include <Debug.h>
+#include <Errno.h>
 
 namespace USB {
 Vector<XHCIController*> xhciControllers;
@@ -16,6 +19,8 @@ uint8_t xhciClassCode = PCI_CLASS_SERIAL_BUS;
 uint8_t xhciSubclass = PCI_SUBCLASS_USB;
 uint8_t xhciProgIF = PCI_PROGIF_XHCI;
 
+uint16_t XHCIController::interruptModeration = XHCI_INT_MODERATION_INTERVAL;
+
 void XHCIIRQHandler(XHCIController* xHC, RegisterContext* r) { xHC->OnInterrupt(); }
 
 int XHCIController::Initialize() {
@@ -24,14 +29,12 @@ int XHCIController::Initialize() {
         return 1;
     }
 
-    return 0;
-
-    /*PCI::EnumerateGenericPCIDevices(xhciClassCode, xhciSubclass, [](const PCIInfo& dev) -> void {
+    PCI::EnumerateGenericPCIDevices(xhciClassCode, xhciSubclass, [](const PCIInfo& dev) -> void {
         if (dev.progIf == xhciProgIF) {
             xhciControllers.add_back(new XHCIController(dev));
         }
     });
-    return 0;*/
+    return 0;
 }
 
 XHCIController::XHCIController(const PCIInfo& dev) : PCIDevice(dev) {
@@ -100,7 +103,7 @@ XHCIController::XHCIController(const PCIInfo& dev) : PCIDevice(dev) {
     // Buffer Array
     if (capRegs->MaxScratchpadBuffers() > 0) {
         scratchpadBuffersPhys = Memory::AllocatePhysicalMemoryBlock();
-        scratchpadBuffers = reinterpret_cast<uint64_t*>(Memory::GetIOMapping(devContextBaseAddressArrayPhys));
+        scratchpadBuffers = reinterpret_cast<uint64_t*>(Memory::GetIOMapping(scratchpadBuffersPhys));
 
         memset(scratchpadBuffers, 0, PAGE_SIZE_4K);
 
@@ -116,7 +119,7 @@ XHCIController::XHCIController(const PCIInfo& dev) : PCIDevice(dev) {
 
     //opRegs->deviceNotificationControl = 2; // FUNCTION_WAKE notification, all others should be handled automatically
 
-    maxSlots = 40;
+    maxSlots = XHCI_MAX_SLOTS;
     if (maxSlots > capRegs->MaxSlots()) {
         maxSlots = capRegs->MaxSlots();
     }
@@ -126,7 +129,7 @@ XHCIController::XHCIController(const PCIInfo& dev) : PCIDevice(dev) {
     InitializeProtocols();
 
     interrupter = &runtimeRegs->interrupters[0];
-    // interrupter->intModerationInterval = 4000; // (~1ms)
+    interrupter->intModerationInterval = interruptModeration; // Events in between share an interrupt
 
     /*eventRingSegmentTablePhys = Memory::AllocatePhysicalMemoryBlock();
     eventRingSegmentTable = reinterpret_cast<xhci_event_ring_segment_table_entry_t*>(Memory::KernelAllocate4KPages(1));
@@ -243,40 +246,39 @@ XHCIController::CommandRing::CommandRing(XHCIController* c) : hcd(c) {
     events = new CommandCompletionEvent[maxIndex];
 }
 
-void XHCIController::CommandRing::SendCommandRaw(void* data) {
-    xhci_trb_t* command = reinterpret_cast<xhci_trb_t*>(data);
-
-    ScopedSpinLock<true> lockRing(lock);
+unsigned XHCIController::CommandRing::Enqueue(xhci_trb_t* command) {
+    command->cycleBit = cycleState;
 
-    if (cycleState)
-        command->cycleBit = 1;
-    else
-        command->cycleBit = 0;
+    unsigned index = enqueueIndex;
+    ring[enqueueIndex++] = *command;
 
-    memcpy(&ring[enqueueIndex++], command, sizeof(xhci_trb_t));
+    if (enqueueIndex >= maxIndex) {
+        // Hand the link TRB to the controller and go back to the start
+        reinterpret_cast<xhci_link_trb_t*>(&ring[maxIndex])->cycleBit = cycleState;
 
-    if (enqueueIndex >= maxIndex - 1) {
+        enqueueIndex = 0;
         cycleState = !cycleState;
     }
+
+    return index;
+}
+
+void XHCIController::CommandRing::SendCommandRaw(void* data) {
+    ScopedSpinLock<true> lockRing(lock);
+
+    Enqueue(reinterpret_cast<xhci_trb_t*>(data));
 }
 
 XHCIController::xhci_command_completion_event_trb_t XHCIController::CommandRing::SendCommand(void* data) {
     CommandCompletionEvent* ev;
 
     {
-        xhci_trb_t* command = reinterpret_cast<xhci_trb_t*>(data);
-
         ScopedSpinLock<true> lockRing(lock);
 
         ev = &events[enqueueIndex];
         ev->completion.SetValue(0);
 
-        if (cycleState)
-            command->cycleBit = 1;
-        else
-            command->cycleBit = 0;
-
-        ring[enqueueIndex++] = *command;
+        Enqueue(reinterpret_cast<xhci_trb_t*>(data));
     }
 
     hcd->doorbellRegs[0].doorbell = 0;
@@ -287,6 +289,110 @@ XHCIController::xhci_command_completion_event_trb_t XHCIController::CommandRing:
     return ev->event;
 }
 
+void XHCIController::CommandRing::OnCompletion(const xhci_command_completion_event_trb_t& ev) {
+    uintptr_t index = (ev.commandTRBPointer - physicalAddr) / XHCI_TRB_SIZE;
+    if (ev.commandTRBPointer < physicalAddr || index >= maxIndex) {
+        Log::Warning("[XHCI] Completion event for unknown command %x", ev.commandTRBPointer);
+        return;
+    }
+
+    events[index].event = ev;
+    events[index].completion.Signal();
+}
+
+XHCIController::TransferRing::TransferRing(XHCIController* c, uint8_t slot, uint8_t endpoint)
+    : hcd(c), slotID(slot), endpointID(endpoint) {
+    physicalAddr = Memory::AllocatePhysicalMemoryBlock();
+    ring = (xhci_trb_t*)Memory::KernelAllocate4KPages(1);
+
+    Memory::KernelMapVirtualMemory4K(physicalAddr, reinterpret_cast<uintptr_t>(ring), 1,
+                                     PAGE_PRESENT | PAGE_WRITABLE | PAGE_CACHE_DISABLED);
+
+    memset(ring, 0, PAGE_SIZE_4K);
+
+    maxIndex = PAGE_SIZE_4K / XHCI_TRB_SIZE - 1;
+
+    auto* trb = (xhci_link_trb_t*)(&ring[maxIndex]);
+    trb->trbType = TRBTypeLink;
+    trb->cycleBit = 0; // Given to the controller once the ring wraps
+    trb->segmentPtr = physicalAddr;
+    trb->toggleCycle = 1;
+
+    pending = new PendingTransfer[maxIndex];
+}
+
+bool XHCIController::TransferRing::Queue(xhci_trb_t* trbs, unsigned count, TransferCallback callback,
+                                         void* context) {
+    ScopedSpinLock<true> lockRing(lock);
+
+    // Keep one TRB free so a full ring can be told apart from an empty one
+    unsigned used = (enqueueIndex + maxIndex - dequeueIndex) % maxIndex;
+    if (used + count >= maxIndex) {
+        return false;
+    }
+
+    xhci_trb_t* first = &ring[enqueueIndex];
+    bool firstCycle = cycleState;
+
+    for (unsigned i = 0; i < count; i++) {
+        xhci_trb_t trb = trbs[i];
+        trb.cycleBit = (i == 0) ? !cycleState : cycleState;
+
+        if (i == count - 1) {
+            pending[enqueueIndex] = {callback, context};
+        }
+        ring[enqueueIndex++] = trb;
+
+        if (enqueueIndex >= maxIndex) {
+            xhci_link_trb_t* link = reinterpret_cast<xhci_link_trb_t*>(&ring[maxIndex]);
+            link->chainBit = (i != count - 1); // The TD carries on at the start of the ring
+            link->cycleBit = cycleState;
+
+            enqueueIndex = 0;
+            cycleState = !cycleState;
+        }
+    }
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    first->cycleBit = firstCycle; // The controller can now see the TD
+    return true;
+}
+
+void XHCIController::TransferRing::Ring() { hcd->doorbellRegs[slotID].doorbell = endpointID; }
+
+uintptr_t XHCIController::TransferRing::Flush() {
+    ScopedSpinLock<true> lockRing(lock);
+
+    for (unsigned i = 0; i < maxIndex; i++) {
+        pending[i] = {};
+    }
+    dequeueIndex = enqueueIndex;
+
+    return DequeuePointer();
+}
+
+void XHCIController::TransferRing::OnTransferEvent(const xhci_transfer_event_trb_t& ev) {
+    uintptr_t index = (ev.pointer - physicalAddr) / XHCI_TRB_SIZE;
+    if (ev.eventData || ev.pointer < physicalAddr || index >= maxIndex) {
+        return;
+    }
+
+    PendingTransfer transfer;
+    {
+        ScopedSpinLock<true> lockRing(lock);
+
+        transfer = pending[index];
+        if (!transfer.callback) {
+            return; // Short packet in the middle of a TD, the event for the last TRB follows
+        }
+
+        pending[index] = {};
+        dequeueIndex = (index + 1) % maxIndex;
+    }
+
+    transfer.callback(transfer.context, ev.completionCode, ev.transferLength);
+}
+
 XHCIController::EventRing::EventRing(XHCIController* c) : hcd(c) {
     segmentCount = 1;
 
@@ -330,45 +436,467 @@ bool XHCIController::EventRing::Dequeue(xhci_event_trb_t* trb) {
     return false;
 }
 
-void XHCIController::EnableSlot() {
+uint8_t XHCIController::EnableSlot() {
     xhci_enable_slot_command_trb_t trb;
     memset(&trb, 0, XHCI_TRB_SIZE);
 
     trb.trbType = TRBTypes::TRBTypeEnableSlotCommand;
 
-    commandRing.SendCommand(&trb);
+    xhci_command_completion_event_trb_t ev = commandRing.SendCommand(&trb);
+    if (ev.completionCode != XHCI_COMPLETION_SUCCESS) {
+        return 0;
+    }
+
+    return ev.slotID;
 }
 
-void XHCIController::OnInterrupt() {
-    Log::Info("[XHCI] Interrupt!");
+void XHCIController::InitializeDevice(unsigned port, uint8_t speed) {
+    uint8_t slotID = EnableSlot();
+    if (!slotID || slotID > maxSlots) {
+        Log::Warning("[XHCI] Failed to enable a slot for port %u", port);
+        return;
+    }
 
-    interrupter->interruptPending = 1;
-    
-    if (!(opRegs->usbStatus | USB_STS_EINT)) {
+    uintptr_t outputPhys = Memory::AllocatePhysicalMemoryBlock();
+    memset(reinterpret_cast<void*>(Memory::GetIOMapping(outputPhys)), 0, PAGE_SIZE_4K);
+    devContextBaseAddressArray[slotID] = outputPhys;
+
+    uintptr_t inputPhys = Memory::AllocatePhysicalMemoryBlock();
+    uint8_t* input = reinterpret_cast<uint8_t*>(Memory::GetIOMapping(inputPhys));
+    memset(input, 0, PAGE_SIZE_4K);
+
+    // Descriptors are read into this page
+    uintptr_t bufferPhys = Memory::AllocatePhysicalMemoryBlock();
+    uint8_t* buffer = reinterpret_cast<uint8_t*>(Memory::GetIOMapping(bufferPhys));
+
+    TransferRing* control = CreateTransferRing(slotID, 1);
+
+    // Input context: input control context, slot context then endpoint contexts
+    uint32_t* inputControl = reinterpret_cast<uint32_t*>(input);
+    inputControl[1] = (1 << 0) | (1 << 1); // Add the slot and the default control endpoint
+
+    xhci_slot_context_t* slot = reinterpret_cast<xhci_slot_context_t*>(input + ContextSize());
+    slot->rootHubPortNumber = port;
+    slot->speed = speed;
+    slot->ctxEntries = 1;
+
+    // Low and full speed devices may use less than 64, which is corrected once the device descriptor is read
+    uint16_t maxPacketSize = (speed == 2) ? 8 : ((speed >= 4) ? 512 : 64);
+
+    xhci_endpoint_context_t* ep0 = reinterpret_cast<xhci_endpoint_context_t*>(input + ContextSize() * 2);
+    ep0->endpointType = EndpointTypeControl;
+    ep0->maxPacketSize = maxPacketSize;
+    ep0->errorCount = 3;
+    ep0->trDequeuePointer = control->DequeuePointer() >> 4;
+    ep0->dequeueCycleState = control->DequeuePointer() & 1;
+    ep0->averageTRBLength = 8;
+
+    xhci_address_device_command_trb_t address;
+    memset(&address, 0, XHCI_TRB_SIZE);
+    address.trbType = TRBTypeAddressDeviceCommand;
+    address.inputContextPointer = inputPhys;
+    address.slotID = slotID;
+
+    if (commandRing.SendCommand(&address).completionCode != XHCI_COMPLETION_SUCCESS) {
+        Log::Warning("[XHCI] Failed to address device on port %u", port);
         return;
     }
 
-    opRegs->usbStatus |= USB_STS_EINT;
+    // Only the first 8 bytes are safe to read until the max packet size of the control endpoint is known
+    if (ControlTransfer(control, USB_REQUEST_TYPE_IN, RequestGetDescriptor, DescriptorTypeDevice << 8, 0, bufferPhys,
+                        8)) {
+        Log::Warning("[XHCI] Failed to get device descriptor on port %u", port);
+        return;
+    }
 
-    xhci_event_trb_t ev;
-    if(eventRing.Dequeue(&ev)){
-        Log::Info("recv event!");
+    DeviceDescriptor* device = reinterpret_cast<DeviceDescriptor*>(buffer);
+    if (speed < 4 && device->bMaxPacketSize0 && device->bMaxPacketSize0 != maxPacketSize) {
+        inputControl[1] = (1 << 1); // Evaluate the control endpoint
+        ep0->maxPacketSize = device->bMaxPacketSize0;
+
+        xhci_trb_t evaluate;
+        memset(&evaluate, 0, XHCI_TRB_SIZE);
+        evaluate.parameter[0] = inputPhys & 0xFFFFFFFF;
+        evaluate.parameter[1] = inputPhys >> 32;
+        evaluate.trbType = TRBTypeEvaluateContextCommand;
+        evaluate.control = slotID << 8;
+
+        commandRing.SendCommand(&evaluate);
+    }
+
+    if (ControlTransfer(control, USB_REQUEST_TYPE_IN, RequestGetDescriptor, DescriptorTypeDevice << 8, 0, bufferPhys,
+                        sizeof(DeviceDescriptor)) ||
+        ControlTransfer(control, USB_REQUEST_TYPE_IN, RequestGetDescriptor, DescriptorTypeConfiguration << 8, 0,
+                        bufferPhys + sizeof(DeviceDescriptor), sizeof(ConfigurationDescriptor))) {
+        Log::Warning("[XHCI] Failed to get descriptors on port %u", port);
+        return;
+    }
+
+    if (debugLevelXHCI >= DebugLevelNormal) {
+        Log::Info("[XHCI] Port %u: Device %x:%x (class %x), slot %u", port, device->idVendor, device->idProduct,
+                  device->bDeviceClass, slotID);
+    }
+
+    // Read the whole configuration, which is followed by its interface and endpoint descriptors
+    ConfigurationDescriptor* config = reinterpret_cast<ConfigurationDescriptor*>(buffer + sizeof(DeviceDescriptor));
+    uint16_t configLength = MIN(config->wTotalLength, PAGE_SIZE_4K - sizeof(DeviceDescriptor));
+    if (ControlTransfer(control, USB_REQUEST_TYPE_IN, RequestGetDescriptor, DescriptorTypeConfiguration << 8, 0,
+                        bufferPhys + sizeof(DeviceDescriptor), configLength)) {
+        Log::Warning("[XHCI] Failed to get configuration on port %u", port);
+        return;
+    }
+
+    // Look for a bulk only mass storage interface and its two bulk endpoints
+    const InterfaceDescriptor* storage = nullptr;
+    const EndpointDescriptor* endpoints[2] = {nullptr, nullptr}; // IN then OUT
+
+    const uint8_t* configEnd = reinterpret_cast<uint8_t*>(config) + configLength;
+    const uint8_t* p = reinterpret_cast<uint8_t*>(config) + config->bLength;
+    const InterfaceDescriptor* interface = nullptr;
+    while (p + 2 <= configEnd && p[0] >= 2 && p + p[0] <= configEnd) {
+        if (p[1] == DescriptorTypeInterface) {
+            interface = reinterpret_cast<const InterfaceDescriptor*>(p);
+        } else if (p[1] == DescriptorTypeEndpoint && interface && !storage &&
+                   interface->bInterfaceClass == USB_CLASS_MASS_STORAGE &&
+                   interface->bInterfaceSubClass == USB_SUBCLASS_SCSI &&
+                   interface->bInterfaceProtocol == USB_PROTOCOL_BULK_ONLY) {
+            const EndpointDescriptor* ep = reinterpret_cast<const EndpointDescriptor*>(p);
+            if (USB_ENDPOINT_TRANSFER_TYPE(ep->bmAttributes) == TransferTypeBulk) {
+                endpoints[(ep->bEndpointAddress & USB_ENDPOINT_IN) ? 0 : 1] = ep;
+            }
+
+            if (endpoints[0] && endpoints[1]) {
+                storage = interface;
+            }
+        }
+
+        p += p[0];
+    }
+
+    if (!storage) {
+        Log::Info("[XHCI] No driver for device %x:%x on port %u", device->idVendor, device->idProduct, port);
+        return;
+    }
+
+    if (ControlTransfer(control, 0, RequestSetConfiguration, config->bConfigurationValue, 0, 0, 0)) {
+        Log::Warning("[XHCI] Failed to set configuration on port %u", port);
+        return;
+    }
+
+    TransferRing* rings[2];
+    if (ConfigureEndpoints(slotID, inputPhys, endpoints, 2, rings)) {
+        Log::Warning("[XHCI] Failed to configure endpoints on port %u", port);
+        return;
+    }
+
+    MassStorage* disk = new MassStorage(this, control, rings[0], rings[1], storage->bInterfaceNumber);
+    if (disk->status != MassStorage::Active) {
+        Log::Warning("[XHCI] Failed to initialize mass storage device on port %u", port);
+        delete disk;
+    }
+}
+
+int XHCIController::ConfigureEndpoints(uint8_t slotID, uintptr_t inputPhys, const EndpointDescriptor** endpoints,
+                                       unsigned count, TransferRing** rings) {
+    uint8_t* input = reinterpret_cast<uint8_t*>(Memory::GetIOMapping(inputPhys));
+    uint8_t* output = reinterpret_cast<uint8_t*>(Memory::GetIOMapping(devContextBaseAddressArray[slotID]));
+
+    memset(input, 0, ContextSize() * 2);
+
+    // The slot context is updated with the last valid endpoint context
+    uint32_t* inputControl = reinterpret_cast<uint32_t*>(input);
+    inputControl[1] = 1 << 0;
+
+    xhci_slot_context_t* slot = reinterpret_cast<xhci_slot_context_t*>(input + ContextSize());
+    memcpy(slot, output, sizeof(xhci_slot_context_t));
+    slot->slotState = 0;
+
+    for (unsigned i = 0; i < count; i++) {
+        const EndpointDescriptor* desc = endpoints[i];
+        bool in = desc->bEndpointAddress & USB_ENDPOINT_IN;
+
+        // Device context index, OUT endpoints are even and IN endpoints odd
+        uint8_t dci = USB_ENDPOINT_NUMBER(desc->bEndpointAddress) * 2 + (in ? 1 : 0);
+
+        rings[i] = CreateTransferRing(slotID, dci);
+        if (!rings[i]) {
+            return -EIO;
+        }
+
+        inputControl[1] |= 1U << dci;
+        if (dci > slot->ctxEntries) {
+            slot->ctxEntries = dci;
+        }
+
+        xhci_endpoint_context_t* ep = reinterpret_cast<xhci_endpoint_context_t*>(input + ContextSize() * (dci + 1));
+        memset(ep, 0, ContextSize());
+        ep->endpointType = in ? EndpointTypeBulkIn : EndpointTypeBulkOut;
+        ep->maxPacketSize = desc->wMaxPacketSize & 0x7FF;
+        ep->errorCount = 3;
+        ep->trDequeuePointer = rings[i]->DequeuePointer() >> 4;
+        ep->dequeueCycleState = rings[i]->DequeuePointer() & 1;
+        ep->averageTRBLength = 3072;
+    }
+
+    xhci_configure_endpoint_command_trb_t configure;
+    memset(&configure, 0, XHCI_TRB_SIZE);
+    configure.trbType = TRBTypeConfigureEndpointCommand;
+    configure.inputContextPointer = inputPhys;
+    configure.slotID = slotID;
+
+    if (commandRing.SendCommand(&configure).completionCode != XHCI_COMPLETION_SUCCESS) {
+        return -EIO;
+    }
+
+    return 0;
+}
+
+XHCIController::TransferRing* XHCIController::CreateTransferRing(uint8_t slotID, uint8_t endpointID) {
+    if (!slotID || slotID > maxSlots || !endpointID || endpointID >= XHCI_MAX_ENDPOINTS) {
+        return nullptr;
     }
 
-    for(int i = 0; i < eventRing.segments[0].size; i++){
-        auto& trb = eventRing.segments[0].segment[i];
-        if(trb.trbType == 0){
-            continue;
+    TransferRing* ring = new TransferRing(this, slotID, endpointID);
+
+    ScopedSpinLock<true> lockRings(transferRingsLock);
+    assert(!transferRings[slotID][endpointID]);
+    transferRings[slotID][endpointID] = ring;
+
+    return ring;
+}
+
+bool XHCIController::QueueNormalTransfer(TransferRing* ring, uintptr_t buffer, size_t length,
+                                         TransferCallback callback, void* context) {
+    xhci_trb_t trbs[16];
+    unsigned count = 0;
+
+    // Split the buffer so no TRB crosses a 64KB boundary
+    do {
+        if (count == 16) {
+            return false; // Too big for one TD
         }
 
-        Log::Info("cycle: %Y event cycle: %Y TRB type: %x", trb.cycleBit, eventRing.cycleState, trb.trbType);
+        size_t trbLength = MIN(length, XHCI_TRB_MAX_TRANSFER - (buffer & (XHCI_TRB_MAX_TRANSFER - 1)));
+
+        xhci_normal_trb_t* trb = reinterpret_cast<xhci_normal_trb_t*>(&trbs[count++]);
+        memset(trb, 0, sizeof(xhci_normal_trb_t));
+        trb->trbType = TRBTypeNormal;
+        trb->dataBuffer = buffer;
+        trb->transferLength = trbLength;
+        trb->interruptOnShortPacket = 1;
+        trb->chainBit = 1;
+
+        buffer += trbLength;
+        length -= trbLength;
+    } while (length);
+
+    xhci_normal_trb_t* last = reinterpret_cast<xhci_normal_trb_t*>(&trbs[count - 1]);
+    last->chainBit = 0;
+    last->interruptOnCompletion = 1;
+
+    return ring->Queue(trbs, count, callback, context);
+}
+
+bool XHCIController::QueueControlTransfer(TransferRing* ring, uint8_t requestType, uint8_t request, uint16_t value,
+                                          uint16_t index, uintptr_t buffer, uint16_t length,
+                                          TransferCallback callback, void* context) {
+    xhci_trb_t trbs[3];
+    memset(trbs, 0, sizeof(trbs));
+
+    bool in = requestType & 0x80;
+    unsigned count = 0;
+
+    xhci_setup_trb_t* setup = reinterpret_cast<xhci_setup_trb_t*>(&trbs[count++]);
+    setup->bmRequestType = requestType;
+    setup->bRequest = request;
+    setup->wValue = value;
+    setup->wIndex = index;
+    setup->wLength = length;
+    setup->trbTransferLength = 8;
+    setup->immediateData = 1;
+    setup->trbType = TRBTypeSetup;
+    setup->transferType = length ? (in ? INDataStage : OUTDataStage) : NoDataStage;
+
+    if (length) {
+        xhci_data_trb_t* data = reinterpret_cast<xhci_data_trb_t*>(&trbs[count++]);
+        data->dataBuffer = buffer;
+        data->transferLength = length;
+        data->interruptOnShortPacket = 1;
+        data->trbType = TRBTypeData;
+        data->direction = in;
     }
 
-    interrupter->eventRingDequeuePointer =
-        (reinterpret_cast<uintptr_t>(eventRing.segments[0].physicalAddr) + eventRing.dequeueIndex * XHCI_TRB_SIZE) |
-        XHCI_INT_ERDP_BUSY;
-    interrupter->interruptPending = 0;
-    opRegs->usbStatus &= ~USB_STS_EINT;
+    // The status stage goes the opposite way to the data stage, IN when there is no data stage
+    xhci_status_trb_t* status = reinterpret_cast<xhci_status_trb_t*>(&trbs[count++]);
+    status->interruptOnCompletion = 1;
+    status->trbType = TRBTypeStatus;
+    status->direction = !(length && in);
+
+    return ring->Queue(trbs, count, callback, context);
+}
+
+bool XHCIController::QueueBufferTransfer(TransferRing* ring, void* buffer, size_t length, TransferCallback callback,
+                                         void* context) {
+    xhci_trb_t trbs[XHCI_TD_MAX_TRBS];
+    unsigned count = 0;
+
+    uintptr_t addr = reinterpret_cast<uintptr_t>(buffer);
+    do {
+        // Go up to the end of the page, carrying on into the next page whilst it is physically contiguous
+        uintptr_t phys = Memory::VirtualToPhysicalAddress(addr) + (addr & (PAGE_SIZE_4K - 1));
+        size_t trbLength = MIN(length, PAGE_SIZE_4K - (addr & (PAGE_SIZE_4K - 1)));
+        while (trbLength < length && Memory::VirtualToPhysicalAddress(addr + trbLength) == phys + trbLength &&
+               ((phys + trbLength) & (XHCI_TRB_MAX_TRANSFER - 1))) {
+            trbLength += MIN(length - trbLength, PAGE_SIZE_4K);
+        }
+
+        if (count == XHCI_TD_MAX_TRBS) {
+            return false;
+        }
+
+        xhci_normal_trb_t* trb = reinterpret_cast<xhci_normal_trb_t*>(&trbs[count++]);
+        memset(trb, 0, sizeof(xhci_normal_trb_t));
+        trb->trbType = TRBTypeNormal;
+        trb->dataBuffer = phys;
+        trb->transferLength = trbLength;
+        trb->interruptOnShortPacket = 1;
+        trb->chainBit = 1;
+
+        addr += trbLength;
+        length -= trbLength;
+    } while (length);
+
+    xhci_normal_trb_t* last = reinterpret_cast<xhci_normal_trb_t*>(&trbs[count - 1]);
+    last->chainBit = 0;
+    last->interruptOnCompletion = 1;
+
+    return ring->Queue(trbs, count, callback, context);
+}
+
+void XHCIController::TransferWaiter::Complete(void* waiter, int completionCode, size_t residual) {
+    TransferWaiter* w = reinterpret_cast<TransferWaiter*>(waiter);
+
+    w->completionCode = completionCode;
+    w->residual = residual;
+    w->completion.Signal();
+}
+
+bool XHCIController::TransferWaiter::Wait() {
+    bool wasInterrupted = completion.Wait();
+    assert(!wasInterrupted);
+
+    return completionCode == XHCI_COMPLETION_SUCCESS || completionCode == XHCI_COMPLETION_SHORT_PACKET;
+}
+
+int XHCIController::ControlTransfer(TransferRing* ring, uint8_t requestType, uint8_t request, uint16_t value,
+                                    uint16_t index, uintptr_t buffer, uint16_t length) {
+    TransferWaiter waiter;
+    if (!QueueControlTransfer(ring, requestType, request, value, index, buffer, length, TransferWaiter::Complete,
+                              &waiter)) {
+        return -EIO;
+    }
+    ring->Ring();
+
+    if (!waiter.Wait()) {
+        if (debugLevelXHCI >= DebugLevelNormal) {
+            Log::Warning("[XHCI] Control transfer (request %x) failed with code %d", request, waiter.completionCode);
+        }
+        return -EIO;
+    }
+
+    return 0;
+}
+
+int XHCIController::ResetEndpoint(TransferRing* ring) {
+    xhci_trb_t reset;
+    memset(&reset, 0, XHCI_TRB_SIZE);
+    reset.trbType = TRBTypeResetEndpointCommand;
+    reset.control = ring->endpointID | (ring->slotID << 8);
+
+    commandRing.SendCommand(&reset); // Fails with a context state error if the endpoint was not halted
+
+    // An endpoint which is still running has to be stopped before its dequeue pointer can be moved
+    xhci_trb_t stop;
+    memset(&stop, 0, XHCI_TRB_SIZE);
+    stop.trbType = TRBTypeStopEndpointCommand;
+    stop.control = ring->endpointID | (ring->slotID << 8);
+
+    commandRing.SendCommand(&stop); // Likewise fails if the reset above stopped it
+
+    uintptr_t dequeue = ring->Flush();
+
+    xhci_trb_t setDequeue;
+    memset(&setDequeue, 0, XHCI_TRB_SIZE);
+    setDequeue.parameter[0] = dequeue & 0xFFFFFFFF;
+    setDequeue.parameter[1] = dequeue >> 32;
+    setDequeue.trbType = TRBTypeSetTRDequeuePointerCommand;
+    setDequeue.control = ring->endpointID | (ring->slotID << 8);
+
+    if (commandRing.SendCommand(&setDequeue).completionCode != XHCI_COMPLETION_SUCCESS) {
+        return -EIO;
+    }
+
+    return 0;
+}
+
+void XHCIController::OnInterrupt() {
+    if (!(opRegs->usbStatus & USB_STS_EINT)) {
+        return;
+    }
+
+    // Both are write 1 to clear
+    opRegs->usbStatus = USB_STS_EINT;
+    interrupter->interruptPending = 1;
+
+    // Take everything on the event ring, the dequeue pointer is only written once for the whole batch
+    xhci_event_trb_t ev;
+    unsigned count = 0;
+    while (eventRing.Dequeue(&ev)) {
+        HandleEvent(ev);
+        count++;
+    }
+
+    // Writing the busy bit clears it and lets the controller interrupt again
+    uintptr_t dequeue = eventRing.segments[0].physicalAddr + eventRing.dequeueIndex * XHCI_TRB_SIZE;
+    interrupter->eventRingDequeuePointer = dequeue | XHCI_INT_ERDP_BUSY;
+
+    if (debugLevelXHCI >= DebugLevelVerbose) {
+        Log::Info("[XHCI] Handled %u events", count);
+    }
+}
+
+void XHCIController::HandleEvent(const xhci_event_trb_t& ev) {
+    switch (ev.trbType) {
+    case TRBTypeCommandCompletionEvent:
+        commandRing.OnCompletion(reinterpret_cast<const xhci_command_completion_event_trb_t&>(ev));
+        break;
+    case TRBTypeTransferEvent: {
+        auto& transfer = reinterpret_cast<const xhci_transfer_event_trb_t&>(ev);
+
+        TransferRing* ring = nullptr;
+        if (transfer.slotID <= XHCI_MAX_SLOTS && transfer.endpointID < XHCI_MAX_ENDPOINTS) {
+            ring = transferRings[transfer.slotID][transfer.endpointID];
+        }
+
+        if (ring) {
+            ring->OnTransferEvent(transfer);
+        } else if (debugLevelXHCI >= DebugLevelNormal) {
+            Log::Warning("[XHCI] Transfer event for slot %u endpoint %u without a ring", transfer.slotID,
+                         transfer.endpointID);
+        }
+        break;
+    }
+    case TRBTypePortStatusChangeEvent:
+        if (debugLevelXHCI >= DebugLevelVerbose) {
+            Log::Info("[XHCI] Port %u status changed", static_cast<unsigned>(ev.ptr >> 24) & 0xFF);
+        }
+        break;
+    default:
+        if (debugLevelXHCI >= DebugLevelVerbose) {
+            Log::Info("[XHCI] Unhandled event (type %u)", ev.trbType);
+        }
+        break;
+    }
 }
 
 bool XHCIController::TakeOwnership() {
@@ -466,6 +994,11 @@ void XHCIController::InitializePorts() {
                 if (debugLevelXHCI >= DebugLevelVerbose) {
                     Log::Info("Port %i is enabled!", i);
                 }
+
+                port.ClearChanges();
+                if (port.Connected()) {
+                    InitializeDevice(i, XHCI_PORTSC_SPEED(port.portSC));
+                }
             }
         }
     }
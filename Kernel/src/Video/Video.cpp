@@ -1,8 +1,33 @@
 #include <Video/Video.h>
 
 #include <Assert.h>
+#include <Device.h>
+#include <Errno.h>
+#include <Framebuffer.h>
+#include <HAL.h>
+#include <IOPorts.h>
+#include <Lock.h>
+#include <Logging.h>
 #include <MM/VMObject.h>
 #include <Math.h>
+#include <PCI.h>
+#include <Timer.h>
+
+// QEMU standard VGA and the Bochs display adapter
+#define BOCHS_VGA_VENDOR_ID 0x1234
+#define BOCHS_VGA_DEVICE_ID 0x1111
+
+#define BOCHS_DISPI_IOPORT_INDEX 0x1CE
+#define BOCHS_DISPI_IOPORT_DATA 0x1CF
+
+#define BOCHS_DISPI_ID_VIRTUAL 0xB0C1 // Earliest interface with a virtual framebuffer to pan around
+#define BOCHS_DISPI_ID_VIDEO_MEMORY 0xB0C5 // Earliest interface reporting the amount of video memory
+#define BOCHS_DISPI_ENABLED 0x1
+
+#define VGA_INPUT_STATUS_1 0x3DA
+#define VGA_STATUS_VRETRACE (1 << 3)
+
+#define VIDEO_VBLANK_TIMEOUT 20000 // Microseconds to wait for the vertical blank, longer than a frame at 60Hz
 
 uint8_t defaultFont[128][8] = {
     {0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // U+0000 (nul)
@@ -153,13 +178,29 @@ uint16_t screenDepth;
 
 uint32_t screenPitch;
 
+unsigned framebufferPages = 1;
+unsigned currentPage = 0; // Page being scanned out of
+lock_t flipLock = 0;
+
+enum BochsDispiIndex {
+    DispiIndexID = 0x0,
+    DispiIndexEnable = 0x4,
+    DispiIndexVirtWidth = 0x6,
+    DispiIndexVirtHeight = 0x7,
+    DispiIndexXOffset = 0x8,
+    DispiIndexYOffset = 0x9,
+    DispiIndexVideoMemory64K = 0xA,
+};
+
 class FramebufferVMO : public VMObject {
   public:
     FramebufferVMO()
-        : VMObject(PAGE_COUNT_4K(screenPitch * screenHeight * (screenDepth / 8)) << PAGE_SHIFT_4K, false, true) {}
+        : VMObject(PAGE_COUNT_4K(screenPitch * screenHeight * framebufferPages) << PAGE_SHIFT_4K, false, true) {}
 
     void MapAllocatedBlocks(uintptr_t base, PageMap* pMap) {
-        Memory::MapVirtualMemory4K(videoMode.physicalAddress, base, size >> PAGE_SHIFT_4K, pMap);
+        // Same memory type as the kernel mapping, presenting a frame is a long run of writes
+        Memory::MapVirtualMemory4K(videoMode.physicalAddress, base, size >> PAGE_SHIFT_4K,
+                                   PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER | PAGE_MEMORY_WC, pMap);
     }
 
     [[noreturn]] VMObject* Clone() { assert(!"Framebuffer VMO cannot be cloned!"); }
@@ -187,6 +228,117 @@ video_mode_t GetVideoMode() { return videoMode; }
 
 FancyRefPtr<VMObject> GetFramebufferVMO() { return *framebufferVMOPtr; }
 
+static inline uint16_t BochsRead(uint16_t index) {
+    outportw(BOCHS_DISPI_IOPORT_INDEX, index);
+    return inportw(BOCHS_DISPI_IOPORT_DATA);
+}
+
+static inline void BochsWrite(uint16_t index, uint16_t value) {
+    outportw(BOCHS_DISPI_IOPORT_INDEX, index);
+    outportw(BOCHS_DISPI_IOPORT_DATA, value);
+}
+
+// Wait for the start of the vertical retrace, giving up after a frame
+static void WaitForVBlank() {
+    uint64_t timeout = Timer::UsecondsSinceBoot() + VIDEO_VBLANK_TIMEOUT;
+
+    // Let any retrace in progress finish, we may be too late to flip in it
+    while ((inportb(VGA_INPUT_STATUS_1) & VGA_STATUS_VRETRACE) && Timer::UsecondsSinceBoot() < timeout)
+        ;
+    while (!(inportb(VGA_INPUT_STATUS_1) & VGA_STATUS_VRETRACE) && Timer::UsecondsSinceBoot() < timeout)
+        ;
+}
+
+class FramebufferDevice final : public Device {
+  public:
+    FramebufferDevice() : Device("fb0", DeviceTypeDisplayAdapter) {
+        flags = FS_NODE_CHARDEVICE;
+        SetDeviceName("Framebuffer");
+    }
+
+    int Ioctl(uint64_t cmd, uint64_t arg) override {
+        switch (cmd) {
+        case IoCtlFramebufferFlip:
+            return FlipFramebuffer(arg, true);
+        case IoCtlFramebufferGetPage:
+            return currentPage;
+        default:
+            return -EINVAL;
+        }
+    }
+};
+FramebufferDevice* framebufferDevice = nullptr;
+
+// Pan the Bochs virtual framebuffer between two pages, each the height of the screen
+static bool InitializeBochsPages() {
+    if (!PCI::FindDevice(BOCHS_VGA_DEVICE_ID, BOCHS_VGA_VENDOR_ID)) {
+        return false;
+    }
+
+    uint16_t id = BochsRead(DispiIndexID);
+    if (id < BOCHS_DISPI_ID_VIRTUAL || !(BochsRead(DispiIndexEnable) & BOCHS_DISPI_ENABLED)) {
+        return false;
+    }
+
+    // The bootloader framebuffer has to be the one scanned out of by the adapter
+    PCIDevice device(PCI::GetPCIDevice(BOCHS_VGA_DEVICE_ID, BOCHS_VGA_VENDOR_ID));
+    if (device.GetBaseAddressRegister(0) != videoMode.physicalAddress || screenDepth != 32 ||
+        BochsRead(DispiIndexVirtWidth) * 4U != screenPitch) {
+        return false;
+    }
+
+    if (id >= BOCHS_DISPI_ID_VIDEO_MEMORY &&
+        BochsRead(DispiIndexVideoMemory64K) * 65536UL < static_cast<uint64_t>(screenPitch) * screenHeight * 2) {
+        return false;
+    }
+
+    // The adapter will not take a height it cannot fit in video memory
+    BochsWrite(DispiIndexVirtHeight, screenHeight * 2);
+    if (BochsRead(DispiIndexVirtHeight) < screenHeight * 2) {
+        BochsWrite(DispiIndexVirtHeight, screenHeight);
+        return false;
+    }
+
+    BochsWrite(DispiIndexXOffset, 0);
+    BochsWrite(DispiIndexYOffset, 0);
+    return true;
+}
+
+void InitializePageFlipping() {
+    // The kernel console draws to the first page, which would be hidden half the time
+    if (!HAL::debugMode && InitializeBochsPages()) {
+        framebufferPages = 2;
+
+        // Nothing has mapped the framebuffer yet, so swap in one covering both pages
+        framebufferVMO = new FramebufferVMO();
+        *framebufferVMOPtr = FancyRefPtr<VMObject>(framebufferVMO);
+
+        Log::Info("[Video] Framebuffer has %u pages", framebufferPages);
+    }
+
+    framebufferDevice = new FramebufferDevice();
+}
+
+unsigned FramebufferPageCount() { return framebufferPages; }
+
+int FlipFramebuffer(unsigned page, bool waitForVBlank) {
+    if (page >= framebufferPages) {
+        return -EINVAL;
+    }
+
+    if (waitForVBlank) {
+        WaitForVBlank();
+    }
+
+    ScopedSpinLock lockFlip(flipLock);
+    if (framebufferPages > 1) {
+        BochsWrite(DispiIndexYOffset, page * screenHeight);
+    }
+    currentPage = page;
+
+    return 0;
+}
+
 void DrawPixel(unsigned int x, unsigned int y, uint8_t r, uint8_t g, uint8_t b) {
     uint32_t colour = r << 16 | g << 8 | b;
     ((uint32_t*)videoMemory)[(y * screenWidth) + x] = colour;
@@ -39,6 +39,16 @@ struct LemonEvent {
         uint64_t bufferKey;
         uint64_t data;
     };
+    uint64_t timestamp = 0; // When the window server sent the event, in microseconds since boot
+};
+
+#define WINDOW_MAX_BATCHED_EVENTS 16
+
+// Event sent to a window in a batch, packed in a string
+struct WindowEvent {
+    int32_t event;
+    uint64_t data;
+    uint64_t timestamp;
 };
 
 template<typename... Args>
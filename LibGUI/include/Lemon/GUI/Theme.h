@@ -4,6 +4,7 @@
 #include <Lemon/Graphics/Colour.h>
 
 #include <mutex>
+#include <string_view>
 #include <vector>
 
 namespace Lemon::GUI {
@@ -34,6 +35,18 @@ public:
 
     void Update(const std::string& path);
 
+    /////////////////////////////
+    /// \brief Load a theme parsed by another process
+    ///
+    /// LemonWM parses the system theme once and sends it to clients, so they do not have to read the JSON.
+    ///
+    /// \param data Theme from Serialize
+    /// \return false if the data is not a theme with the same colours
+    /////////////////////////////
+    bool Load(std::string_view data);
+    // Pack the parsed theme for Load
+    std::string Serialize();
+
     const Colour& ColourActiveWindow() const { return m_colours[Colour_ActiveWindow]; }
     const Colour& ColourActiveWindowText() const { return m_colours[Colour_ActiveWindowText]; }
     const Colour& ColourInactiveWindow() const { return m_colours[Colour_InactiveWindow]; }
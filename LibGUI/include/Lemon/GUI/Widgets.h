@@ -1,12 +1,21 @@
 #pragma once
 
+#include <Lemon/Core/Thumbnails.h>
 #include <Lemon/GUI/ContextMenu.h>
 #include <Lemon/GUI/Event.h>
 #include <Lemon/GUI/Theme.h>
 #include <Lemon/Graphics/Graphics.h>
 #include <Lemon/Graphics/Surface.h>
 
+#include <sys/types.h>
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_set>
 #include <vector>
 
 namespace Lemon::GUI {
@@ -81,6 +90,16 @@ public:
         UpdateFixedBounds();
     };
 
+    /////////////////////////////
+    /// \brief Mark the widget to be repainted
+    ///
+    /// Only matters when the window tracks damage. Widgets are invalidated by their container when sent input,
+    /// anything else changing how a widget looks, such as setting its fields directly, should call this.
+    /////////////////////////////
+    void Invalidate();
+    // Mark rect, relative to the window, to be repainted. Passed up through the parents to the window
+    void Invalidate(const Rect& rect);
+
     Widget* active = nullptr; // Only applies to containers, etc. is so widgets know whether they are active or not
 protected:
     Widget* parent = nullptr;
@@ -111,6 +130,17 @@ public:
 
     virtual void Paint(surface_t* surface);
 
+    /////////////////////////////
+    /// \brief Add the bounds of the children repainted whole which touch damage
+    ///
+    /// Only plain Containers and LayoutContainers repaint just what is damaged, other widgets
+    /// (including subclasses of Container, which may draw over their children) are repainted whole.
+    /// Their bounds have to be damaged before anything is painted so they are drawn over a fresh background.
+    /////////////////////////////
+    void AddDamage(std::vector<Rect>& damage);
+    // Paint what is within damage, which already includes the bounds added by AddDamage
+    void PaintDamage(surface_t* surface, const std::vector<Rect>& damage);
+
     virtual void OnMouseEnter(vector2i_t mousePos);
     virtual void OnMouseExit(vector2i_t mousePos);
     virtual void OnMouseDown(vector2i_t mousePos);
@@ -357,13 +387,15 @@ public:
 protected:
     struct RowCache {
         std::vector<Graphics::TextObject> text;
+        std::vector<const Surface*> icons; // nullptr for text columns
     };
 
     DataModel* model = nullptr;
     std::vector<int> columnDisplayWidths;
 
-    bool cacheDirty = false;
-    std::vector<RowCache> cachedRows;
+    bool cacheDirty = false; // Set when the data changes
+    int cacheFirstRow = -1; // Row at the top of cachedRows
+    std::vector<RowCache> cachedRows; // Only the rows in view
     int rowsToDisplay;
 
     int selectedCol = 0;
@@ -408,21 +440,32 @@ public:
     void OnKeyPress(int key);
 
     int AddItem(GridItem& item);
+    // Add several items, leaves newItems empty
+    void AddItems(std::vector<GridItem>& newItems);
+    // Stable sort of the items, the selected item stays selected
+    void SortItems(bool (*compare)(const GridItem&, const GridItem&));
 
     void ClearItems() {
         items.clear();
+        labels.clear();
         ResetScrollBar();
     }
 
+    // Change the icon of the item called name, returns false if there is no such item
+    bool SetItemIcon(const std::string& name, const Surface* icon);
+
     void UpdateFixedBounds();
 
     void (*OnSubmit)(GridItem&, GridView*) = nullptr;
     void (*OnSelect)(GridItem&, GridView*) = nullptr;
+    // Called when an item first comes into view and again after sorting, e.g. to load a preview of it
+    void (*OnItemShown)(GridItem&, GridView*) = nullptr;
 
     int selected = -1;
 
 protected:
     std::vector<GridItem> items;
+    std::vector<std::string> labels; // Names shortened to fit, empty until the item is first drawn
 
     const vector2i_t itemSize = {96, 80};
     int itemsPerRow = 1;
@@ -469,11 +512,22 @@ public:
 
     std::string currentPath;
     FileView(rect_t bounds, const char* path);
+    ~FileView();
+
+    void Paint(surface_t* surface);
 
+    /////////////////////////////
+    /// \brief Load the contents of currentPath
+    ///
+    /// The directory is read on another thread. Entries are added as they arrive when the view is painted,
+    /// the UI thread is interrupted to wake it from waiting on the window server. They are sorted once
+    /// the whole directory has been read.
+    /////////////////////////////
     void Refresh();
 
     void OnSubmit(std::string& path);
     static void OnListSubmit(GridItem& item, GridView* list);
+    static void OnListItemShown(GridItem& item, GridView* list);
     static void OnTextBoxSubmit(TextBox* textBox);
 
     inline int SidepanelWidth() { return sidepanelWidth; }
@@ -494,6 +548,29 @@ protected:
     Widget* active;
 
     ListColumn nameCol, sizeCol;
+
+    std::thread scanThread;
+    std::mutex scanLock; // Protects scanned, scanFinished and scanPending
+    std::vector<GridItem> scanned; // Read but not yet added to fileList
+    bool scanFinished = false;
+    bool scanPending = false; // Set until the UI thread has taken the end of the scan
+    std::atomic<bool> cancelScan = false;
+    pid_t uiThread = 0; // Interrupted when there are new entries
+
+    // Runs on scanThread
+    void Scan(std::string path);
+    // Add what has been read to fileList
+    void PollScan();
+    void StopScan();
+
+    // Images in the current directory are shown as thumbnails once they have been generated
+    std::unique_ptr<ThumbnailGenerator> thumbnailGenerator;
+    std::unordered_set<std::string> thumbnailsRequested; // Names of the files in the current directory
+    std::deque<Surface> thumbnails; // Icons of items in fileList, a deque so they are never moved
+
+    // Give the items of fileList the thumbnails that have been generated
+    void PollThumbnails();
+    void ClearThumbnails();
 };
 
 class ScrollView : public Container {
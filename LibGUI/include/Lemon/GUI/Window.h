@@ -6,6 +6,7 @@
 #include <Lemon/GUI/WindowServer.h>
 #include <Lemon/Graphics/Graphics.h>
 #include <Lemon/Graphics/Surface.h>
+#include <Lemon/Graphics/Video.h>
 
 #include <queue>
 #include <utility>
@@ -47,6 +48,29 @@ struct WindowBuffer {
     uint32_t dirty;   // Does it need to be drawn?
 };
 
+#define VIDEO_BUFFER_FRAMES 2
+
+// Shared between a client and LemonWM for a video surface, followed by the frames
+struct VideoBuffer {
+    uint32_t format; // Graphics::VideoFormat
+    int32_t width;
+    int32_t height;
+    uint32_t currentFrame; // Frame shown by LemonWM, the client writes to the other
+    uint64_t frameOffsets[VIDEO_BUFFER_FRAMES];
+    uint32_t drawing; // Is the current frame being drawn?
+};
+
+#define WINDOW_MAX_DAMAGE_RECTS 16
+#define WINDOW_MAX_OPAQUE_RECTS 16
+
+// Rect relative to the window content, sent packed in a string
+struct WindowRect {
+    int32_t x;
+    int32_t y;
+    int32_t width;
+    int32_t height;
+};
+
 enum WindowType {
     Basic,
     GUI,
@@ -127,16 +151,73 @@ public:
     /// \brief Paint window
     ///
     /// Call OnPaint(), if relevant draw GUI Widgets, then swap the window buffers.
+    ///
+    /// When trackDamage is set and there is no OnPaint or OnPaintEnd, only the widgets within what has been
+    /// invalidated since the last frame are repainted and sent to be composited. Nothing is drawn if nothing
+    /// was invalidated.
     /////////////////////////////
     virtual void Paint();
 
+    /////////////////////////////
+    /// \brief Mark part of the window to be repainted
+    ///
+    /// \param rect Rect relative to the window
+    /////////////////////////////
+    void Invalidate(const Rect& rect);
+
+    /////////////////////////////
+    /// \brief Repaint the whole window on the next Paint()
+    /////////////////////////////
+    inline void InvalidateAll() { m_damageAll = true; }
+
     /////////////////////////////
     /// \brief Swap the window buffers
     ///
     /// Swap the window buffers, equivalent to Paint() on a Basic Window without OnPaint()
+    ///
+    /// The new frame is compared with the last, which is still in the other buffer,
+    /// and only what changed is sent to be composited. Nothing is sent if nothing changed.
     /////////////////////////////
     void SwapBuffers();
 
+    /////////////////////////////
+    /// \brief Tell the window server which parts of a transparent window are always opaque
+    ///
+    /// Opaque parts are copied rather than blended, and whatever is beneath them is not drawn.
+    /// Only the first WINDOW_MAX_OPAQUE_RECTS rects are used.
+    ///
+    /// \param rects Opaque rects relative to the window, none for the whole window to be blended
+    /////////////////////////////
+    void SetOpaqueRegion(const std::vector<Rect>& rects);
+
+    /////////////////////////////
+    /// \brief Create a video surface, which LemonWM composites straight from shared frames
+    ///
+    /// LemonWM scales the frames and converts them to RGB as it draws the window,
+    /// rather than them being converted into the window buffer and copied again.
+    /// Replaces any existing video surface.
+    ///
+    /// \param format Graphics::VideoFormat of the frames
+    /// \param size Size of the frames in pixels
+    ///
+    /// \return 0 on success, otherwise an error code
+    /////////////////////////////
+    int CreateVideoSurface(int format, vector2i_t size);
+    void DestroyVideoSurface();
+    inline bool HasVideoSurface() const { return m_videoBuffer; }
+
+    // Get the frame to write the next video frame to, which is not on screen
+    Graphics::VideoFrame VideoBackFrame();
+
+    /////////////////////////////
+    /// \brief Show the back frame, drawn over the window content
+    ///
+    /// Like SwapBuffers, waits for LemonWM to finish drawing the frame on screen before swapping.
+    ///
+    /// \param rect Where to scale the frame to, relative to the window content
+    /////////////////////////////
+    void PresentVideoFrame(const Rect& rect);
+
     /////////////////////////////
     /// \brief Check the event queue for events.
     ///
@@ -286,6 +367,8 @@ public:
     Container rootContainer;
     surface_t surface = {0, 0, 32, nullptr};
     bool closed = false; // Set to true when close button pressed
+    // Only repaint invalidated widgets, anything changing a widget other than input must call Widget::Invalidate()
+    bool trackDamage = false;
 
 private:
     class TooltipWindow : protected LemonWMServerEndpoint {
@@ -323,6 +406,13 @@ private:
     /////////////////////////////
     void GUIHandleEvent(LemonEvent& ev);
 
+    // Body of Paint, which also times the first paint when startup is being profiled
+    void PaintWindow();
+    // Repaint what has been invalidated since the last frame
+    void PaintDamage();
+    // Swap the window buffers, sending damage to be composited
+    void SwapBuffers(const std::vector<Rect>& damage);
+
     bool m_shouldResize = false;
     vector2i_t m_resizeBounds;
 
@@ -332,6 +422,15 @@ private:
     uint8_t* m_buffer1;
     uint8_t* m_buffer2;
     uint64_t m_windowBufferKey;
+    bool m_hasCommitted = false; // Whether the buffer not being drawn to has the last frame
+
+    VideoBuffer* m_videoBuffer = nullptr;
+    int64_t m_videoBufferKey = 0;
+
+    std::vector<Rect> m_damage; // Invalidated since the last frame
+    bool m_damageAll = true;
+    // What changed in the last frame, which the buffer being drawn to is missing
+    std::vector<Rect> m_lastDamage;
 
     uint32_t m_flags;
 
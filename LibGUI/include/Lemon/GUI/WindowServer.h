@@ -59,14 +59,17 @@ public:
 private:
     WindowServer();
 
+    // Load the system theme from LemonWM
+    void UpdateTheme();
+
     void OnPeerDisconnect(const Lemon::Handle& client) override;
-    void OnSendEvent(const Lemon::Handle& client, int64_t windowID, int32_t id, uint64_t data) override;
+    void OnSendEvents(const Lemon::Handle& client, int64_t windowID, std::string_view events) override;
     void OnThemeUpdated(const Lemon::Handle& client) override;
     void OnPing(const Lemon::Handle& client, int64_t windowID) override;
 
-    void OnWindowCreated(const Lemon::Handle& client, int64_t windowID, uint32_t flags, const std::string& name) override;
+    void OnWindowCreated(const Lemon::Handle& client, int64_t windowID, uint32_t flags, std::string_view name) override;
     void OnWindowStateChanged(const Lemon::Handle& client, int64_t windowID, uint32_t flags, int32_t state) override;
-    void OnWindowTitleChanged(const Lemon::Handle& client, int64_t windowID, const std::string& name) override;
+    void OnWindowTitleChanged(const Lemon::Handle& client, int64_t windowID, std::string_view name) override;
     void OnWindowDestroyed(const Lemon::Handle& client, int64_t windowID) override;
 
     std::map<long, GUI::Window*> m_windows;
@@ -5,6 +5,7 @@
 #include <Lemon/GUI/Messagebox.h>
 #include <Lemon/GUI/Theme.h>
 #include <Lemon/GUI/Window.h>
+#include <Lemon/System/Util.h>
 
 #include <assert.h>
 #include <dirent.h>
@@ -16,6 +17,11 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <lemon/syscall.h>
+
+#define FILEVIEW_SCAN_BATCH 64 // Entries read by each syscall
+#define FILEVIEW_WAKE_INTERVAL 10000 // us between interrupting the UI thread at the end of a scan
+
 namespace Lemon::GUI {
 const Surface* FileView::diskIcon = nullptr;
 const Surface* FileView::folderIcon = nullptr;
@@ -27,6 +33,31 @@ const Surface* FileView::ramIcon = nullptr;
 const Surface* FileView::diskIconSml = nullptr;
 const Surface* FileView::folderIconSml = nullptr;
 
+static const Surface* FileIcon(const char* name, bool isDirectory) {
+    if (isDirectory) {
+        return FileView::folderIcon;
+    } else if (const char* ext = strchr(name, '.'); ext) {
+        if (!strcmp(ext, ".txt") || !strcmp(ext, ".cfg") || !strcmp(ext, ".py") || !strcmp(ext, ".asm")) {
+            return FileView::textFileIcon;
+        } else if (!strcmp(ext, ".json")) {
+            return FileView::jsonFileIcon;
+        }
+    }
+
+    return FileView::fileIcon;
+}
+
+// Directories first, then by name
+static bool CompareFiles(const GridItem& a, const GridItem& b) {
+    bool aIsDirectory = a.icon == FileView::folderIcon;
+    bool bIsDirectory = b.icon == FileView::folderIcon;
+    if (aIsDirectory != bIsDirectory) {
+        return aIsDirectory;
+    }
+
+    return strcmp(a.name.c_str(), b.name.c_str()) < 0;
+}
+
 void FileViewOnListSelect(GridItem& item, GridView* lv) {
     FileView* fv = (FileView*)lv->GetParent();
 
@@ -93,6 +124,9 @@ FileView::FileView(rect_t bounds, const char* path) : Container(bounds) {
 
     fileList->OnSubmit = OnListSubmit;
     fileList->OnSelect = FileViewOnListSelect;
+    fileList->OnItemShown = OnListItemShown;
+
+    thumbnailGenerator = std::make_unique<ThumbnailGenerator>([this]() { Lemon::InterruptThread(uiThread); });
 
     pathBox = new TextBox({pathBoxPadding.x, pathBoxPadding.y, pathBoxPadding.x, pathBoxHeight}, false);
     AddWidget(pathBox);
@@ -140,7 +174,23 @@ FileView::FileView(rect_t bounds, const char* path) : Container(bounds) {
     Refresh();
 }
 
+FileView::~FileView() {
+    StopScan();
+
+    thumbnailGenerator.reset(); // Stop the workers before freeing the thumbnails
+    ClearThumbnails();
+}
+
+void FileView::Paint(surface_t* surface) {
+    PollScan();
+    PollThumbnails();
+
+    Container::Paint(surface);
+}
+
 void FileView::Refresh() {
+    StopScan();
+
     char* rPath = realpath(currentPath.c_str(), nullptr);
     assert(rPath);
 
@@ -158,64 +208,136 @@ void FileView::Refresh() {
 
     fileList->ClearItems();
 
-    std::string absPath;
-    struct dirent** entries;
-    int entryCount =
-        scandir(currentPath.c_str(), &entries, static_cast<int (*)(const dirent*)>([](const dirent* d) -> int {
-                    (void)d;
-                    return 1;
-                }),
-                static_cast<int (*)(const dirent**, const dirent**)>([](const dirent** a, const dirent** b) {
-                    if ((*a)->d_type == DT_DIR && (*b)->d_type != DT_DIR) {
-                        return -1;
-                    } else if ((*b)->d_type == DT_DIR && (*a)->d_type != DT_DIR) {
-                        return 1;
-                    }
-                    return strcmp((*a)->d_name, (*b)->d_name);
-                }));
+    thumbnailGenerator->Cancel();
+    ClearThumbnails();
+
+    scanPending = true;
+    cancelScan = false;
+    uiThread = syscall(SYS_GETTID);
+    scanThread = std::thread(&FileView::Scan, this, currentPath);
+}
 
-    if (entryCount < 0) {
+void FileView::Scan(std::string path) {
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
         perror("GUI: FileView: open:");
-        return;
-    }
+    } else {
+        std::vector<lemon_dirent_t> entries(FILEVIEW_SCAN_BATCH);
+        std::vector<GridItem> batch;
+
+        long count;
+        while (!cancelScan && (count = Lemon::ReadDirBatch(fd, entries.data(), entries.size())) > 0) {
+            for (long i = 0; i < count; i++) {
+                lemon_dirent_t& dirent = entries[i];
+
+                // Only stat when the filesystem does not give the type, as it is slow for large directories
+                bool isDirectory = dirent.type == DT_DIR;
+                if (dirent.type == DT_UNKNOWN) {
+                    struct stat statResult;
+                    if (lstat((path + dirent.name).c_str(), &statResult)) {
+                        perror("GUI: FileView: File: Stat");
+                        continue;
+                    }
 
-    for (int i = 0; i < entryCount; i++) {
-        struct dirent& dirent = *entries[i];
+                    isDirectory = S_ISDIR(statResult.st_mode);
+                }
 
-        GridItem item;
-        item.name = dirent.d_name;
+                GridItem item;
+                item.name = dirent.name;
+                item.icon = FileIcon(dirent.name, isDirectory);
+                batch.push_back(std::move(item));
+            }
 
-        absPath = currentPath + "/" + dirent.d_name;
+            {
+                std::lock_guard lock(scanLock);
+                scanned.insert(scanned.end(), std::make_move_iterator(batch.begin()),
+                               std::make_move_iterator(batch.end()));
+            }
+            batch.clear();
 
-        struct stat statResult;
-        int ret = lstat(absPath.c_str(), &statResult);
-        if (ret) {
-            perror("GUI: FileView: File: Stat");
-            // assert(!ret);
-            continue;
+            Lemon::InterruptThread(uiThread);
+        }
+
+        if (count < 0) {
+            perror("GUI: FileView: ReadDirBatch:");
         }
+        close(fd);
+    }
+
+    {
+        std::lock_guard lock(scanLock);
+        scanFinished = true;
+    }
 
-        if (S_ISDIR(statResult.st_mode)) {
-            item.icon = folderIcon;
-        } else if (char* ext = strchr(dirent.d_name, '.'); ext) {
-            if (!strcmp(ext, ".txt") || !strcmp(ext, ".cfg") || !strcmp(ext, ".py") || !strcmp(ext, ".asm")) {
-                item.icon = textFileIcon;
-            } else if (!strcmp(ext, ".json")) {
-                item.icon = jsonFileIcon;
-            } else {
-                item.icon = fileIcon;
+    // The UI thread may not have been waiting when it was interrupted,
+    // so keep waking it until it has taken the end of the scan
+    while (!cancelScan) {
+        {
+            std::lock_guard lock(scanLock);
+            if (!scanPending) {
+                break;
             }
-        } else {
-            item.icon = fileIcon;
         }
 
-        fileList->AddItem(item);
+        Lemon::InterruptThread(uiThread);
+        usleep(FILEVIEW_WAKE_INTERVAL);
+    }
+}
+
+void FileView::PollScan() {
+    std::vector<GridItem> entries;
+    bool finished;
+    {
+        std::lock_guard lock(scanLock);
+        if (!scanPending) {
+            return;
+        }
+
+        entries.swap(scanned);
+        finished = scanFinished;
+        if (finished) {
+            scanPending = false;
+        }
+    }
+
+    fileList->AddItems(entries);
+
+    if (finished) {
+        fileList->SortItems(CompareFiles); // The scan thread is joined by the next StopScan
     }
+}
 
-    while (--entryCount >= 0) {
-        free(entries[entryCount]);
+void FileView::StopScan() {
+    if (scanThread.joinable()) {
+        cancelScan = true;
+        scanThread.join();
     }
-    free(entries);
+
+    scanned.clear();
+    scanFinished = false;
+    scanPending = false;
+}
+
+void FileView::PollThumbnails() {
+    std::vector<ThumbnailGenerator::Thumbnail> completed;
+    thumbnailGenerator->TakeCompleted(completed);
+
+    for (auto& thumbnail : completed) {
+        // Anything from another directory was thrown away by Cancel
+        std::string name = thumbnail.path.substr(currentPath.length());
+
+        thumbnails.push_back(thumbnail.surface);
+        fileList->SetItemIcon(name, &thumbnails.back());
+    }
+}
+
+void FileView::ClearThumbnails() {
+    for (Surface& surface : thumbnails) {
+        delete[] surface.buffer;
+    }
+
+    thumbnails.clear();
+    thumbnailsRequested.clear();
 }
 
 void FileView::OnSubmit(std::string& path) {
@@ -253,6 +375,18 @@ void FileView::OnListSubmit(GridItem& item, GridView* list) {
     fv->OnSubmit(item.name);
 }
 
+void FileView::OnListItemShown(GridItem& item, GridView* list) {
+    FileView* fv = (FileView*)list->GetParent();
+
+    // Only files which still have their generic icon, so each image is only asked for once
+    if (item.icon != fileIcon || !ThumbnailGenerator::IsImage(item.name.c_str()) ||
+        !fv->thumbnailsRequested.insert(item.name).second) {
+        return;
+    }
+
+    fv->thumbnailGenerator->Request(fv->currentPath + item.name);
+}
+
 void FileView::OnTextBoxSubmit(TextBox* textBox) {
     FileView* fv = (FileView*)textBox->GetParent();
 
@@ -8,7 +8,10 @@ namespace Lemon::GUI {
 //////////////////////////
 Image::Image(rect_t _bounds) : Widget(_bounds), texture(fixedBounds.size) {}
 
-void Image::Load(surface_t* image) { texture.LoadSourcePixels(image); }
+void Image::Load(surface_t* image) {
+    texture.LoadSourcePixels(image);
+    Invalidate();
+}
 
 int Image::Load(const char* path) {
     surface_t surface;
@@ -19,6 +22,7 @@ int Image::Load(const char* path) {
     }
 
     texture.AdoptSourcePixels(&surface); // We don't need the buffer so give it to the Texture object
+    Invalidate();
 
     return 0;
 }
@@ -2,10 +2,18 @@
 
 #include <Lemon/GUI/WindowServer.h>
 
+#include <string.h>
+
 #define SET_COLOUR(c, val) 
 
 namespace Lemon::GUI{
 
+struct SerializedTheme {
+    uint32_t colourCount;
+    int32_t windowCornerRadius;
+    RGBAColour colours[Colour_Count];
+};
+
 Theme::Theme() noexcept {
     m_config.AddSerializedConfigProperty<RGBAColour>("colours.activeWindow", RGBAColour{0x22, 0x20, 0x22, 0xFF});
     m_config.AddSerializedConfigProperty<RGBAColour>("colours.activeWindowText", RGBAColour{0xEE, 0xEE, 0xEE, 0xFF});
@@ -50,4 +58,31 @@ void Theme::Update(const std::string& path){
     m_windowCornerRadius = m_config.GetConfigProperty<long>("wm.windowCornerRadius");
 }
 
-}
\ No newline at end of file
+bool Theme::Load(std::string_view data){
+    SerializedTheme theme;
+    if(data.length() != sizeof(SerializedTheme)){
+        return false;
+    }
+
+    memcpy(&theme, data.data(), sizeof(SerializedTheme));
+    if(theme.colourCount != Colour_Count){
+        return false;
+    }
+
+    std::unique_lock<std::mutex> preventWrite(m_writeLock);
+
+    m_colours.assign(theme.colours, theme.colours + Colour_Count);
+    m_windowCornerRadius = theme.windowCornerRadius;
+    return true;
+}
+
+std::string Theme::Serialize(){
+    std::unique_lock<std::mutex> preventWrite(m_writeLock);
+
+    SerializedTheme theme = {.colourCount = Colour_Count, .windowCornerRadius = m_windowCornerRadius, .colours = {}};
+    std::copy(m_colours.begin(), m_colours.end(), theme.colours);
+
+    return std::string(reinterpret_cast<const char*>(&theme), sizeof(SerializedTheme));
+}
+
+}
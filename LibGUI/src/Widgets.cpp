@@ -12,8 +12,61 @@
 #include <ctype.h>
 #include <math.h>
 #include <string>
+#include <typeinfo>
 
 namespace Lemon::GUI {
+// Plain containers repaint only what is damaged, anything else is repainted whole
+static inline bool PaintsByDamage(const Widget* w) {
+    return typeid(*w) == typeid(Container) || typeid(*w) == typeid(LayoutContainer);
+}
+
+// A widget sent input may change how it looks. Plain containers only pass the input on,
+// so the child it reaches is invalidated by them instead
+static inline void InvalidateInput(Widget* w) {
+    if (w && !PaintsByDamage(w)) {
+        w->Invalidate();
+    }
+}
+
+static inline bool Overlaps(const Rect& a, const Rect& b) {
+    return a.x < b.x + b.width && b.x < a.x + a.width && a.y < b.y + b.height && b.y < a.y + a.height;
+}
+
+// Shorten str with an ellipsis to fit within width, measuring each codepoint once
+static std::string FitText(const std::string& str, int width) {
+    if (Graphics::GetTextLength(str.c_str()) <= width) {
+        return str;
+    }
+
+    int available = width - Graphics::GetTextLength("...");
+    int len = 0;
+    size_t end = 0;
+    while (end < str.length()) {
+        size_t next = end + 1;
+        while (next < str.length() && (str[next] & 0xc0) == 0x80) {
+            next++; // Continuation byte
+        }
+
+        len += Graphics::GetTextLength(str.substr(end, next - end).c_str());
+        if (len > available) {
+            break;
+        }
+        end = next;
+    }
+
+    return str.substr(0, end) + "...";
+}
+
+static bool TouchesDamage(const Rect& rect, const std::vector<Rect>& damage) {
+    for (const Rect& d : damage) {
+        if (Overlaps(rect, d)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 Widget::Widget() {}
 
 Widget::Widget(rect_t bounds, LayoutSize newSizeX, LayoutSize newSizeY) {
@@ -62,6 +115,16 @@ void Widget::OnActive() {}
 
 void Widget::OnInactive() {}
 
+void Widget::Invalidate() { Invalidate(fixedBounds); }
+
+void Widget::Invalidate(const Rect& rect) {
+    if (parent) {
+        parent->Invalidate(rect);
+    } else if (window) {
+        window->Invalidate(rect);
+    }
+}
+
 void Widget::UpdateFixedBounds() {
     fixedBounds.pos = bounds.pos;
 
@@ -134,9 +197,12 @@ void Container::AddWidget(Widget* w) {
     }
 
     UpdateFixedBounds();
+    Invalidate();
 }
 
 void Container::RemoveWidget(Widget* w) {
+    Invalidate(w->GetFixedBounds());
+
     w->SetParent(nullptr);
     w->SetWindow(nullptr);
 
@@ -158,10 +224,65 @@ void Container::Paint(surface_t* surface) {
     }
 }
 
+void Container::AddDamage(std::vector<Rect>& damage) {
+    for (Widget* w : children) {
+        if (PaintsByDamage(w)) {
+            static_cast<Container*>(w)->AddDamage(damage);
+            continue;
+        }
+
+        const Rect& bounds = w->GetFixedBounds();
+        if (!TouchesDamage(bounds, damage)) {
+            continue;
+        }
+
+        bool covered = false;
+        for (const Rect& d : damage) {
+            if (bounds.x >= d.x && bounds.y >= d.y && bounds.x + bounds.width <= d.x + d.width &&
+                bounds.y + bounds.height <= d.y + d.height) {
+                covered = true;
+                break;
+            }
+        }
+
+        if (!covered) {
+            damage.push_back(bounds);
+        }
+    }
+}
+
+void Container::PaintDamage(surface_t* surface, const std::vector<Rect>& damage) {
+    if (background.a == 255) {
+        for (const Rect& d : damage) {
+            int left = std::max(d.x, fixedBounds.x);
+            int top = std::max(d.y, fixedBounds.y);
+            int right = std::min(d.x + d.width, fixedBounds.x + fixedBounds.width);
+            int bottom = std::min(d.y + d.height, fixedBounds.y + fixedBounds.height);
+
+            if (right > left && bottom > top) {
+                Graphics::DrawRect(left, top, right - left, bottom - top, background, surface);
+            }
+        }
+    }
+
+    for (Widget* w : children) {
+        if (!TouchesDamage(w->GetFixedBounds(), damage)) {
+            continue;
+        }
+
+        if (PaintsByDamage(w)) {
+            static_cast<Container*>(w)->PaintDamage(surface, damage);
+        } else {
+            w->Paint(surface);
+        }
+    }
+}
+
 void Container::OnMouseEnter(vector2i_t mousePos) {
     for (Widget* w : children) {
         if (Graphics::PointInRect(w->GetFixedBounds(), mousePos)) {
             w->OnMouseEnter(mousePos);
+            InvalidateInput(w);
 
             lastMousedOver = w;
             break;
@@ -172,6 +293,7 @@ void Container::OnMouseEnter(vector2i_t mousePos) {
 void Container::OnMouseExit(vector2i_t mousePos) {
     if (lastMousedOver) {
         lastMousedOver->OnMouseExit(mousePos);
+        InvalidateInput(lastMousedOver);
     }
 
     lastMousedOver = nullptr;
@@ -183,12 +305,14 @@ void Container::OnMouseDown(vector2i_t mousePos) {
             if (active != w) {
                 if (active) {
                     active->OnInactive();
+                    InvalidateInput(active);
                 }
 
                 w->OnActive();
             }
             active = w;
             w->OnMouseDown(mousePos);
+            InvalidateInput(w);
             break;
         }
     }
@@ -197,6 +321,7 @@ void Container::OnMouseDown(vector2i_t mousePos) {
 void Container::OnMouseUp(vector2i_t mousePos) {
     if (active) {
         active->OnMouseUp(mousePos);
+        InvalidateInput(active);
     }
 }
 
@@ -205,6 +330,7 @@ void Container::OnRightMouseDown(vector2i_t mousePos) {
         if (Graphics::PointInRect(w->GetFixedBounds(), mousePos)) {
             active = w;
             w->OnRightMouseDown(mousePos);
+            InvalidateInput(w);
             break;
         }
     }
@@ -213,6 +339,7 @@ void Container::OnRightMouseDown(vector2i_t mousePos) {
 void Container::OnRightMouseUp(vector2i_t mousePos) {
     if (active) {
         active->OnRightMouseUp(mousePos);
+        InvalidateInput(active);
     }
 }
 
@@ -224,19 +351,23 @@ void Container::OnMouseMove(vector2i_t mousePos) {
             } else {
                 if (lastMousedOver) {
                     lastMousedOver->OnMouseExit(mousePos);
+                    InvalidateInput(lastMousedOver);
                 }
 
                 w->OnMouseEnter(mousePos);
+                InvalidateInput(w);
 
                 lastMousedOver = w;
             }
         } else if (w == lastMousedOver) {
+            InvalidateInput(w);
             lastMousedOver = nullptr;
         }
     }
 
     if (active) {
         active->OnMouseMove(mousePos);
+        InvalidateInput(active);
     }
 }
 
@@ -245,6 +376,7 @@ void Container::OnDoubleClick(vector2i_t mousePos) {
         Graphics::PointInRect(active->GetFixedBounds(),
                               mousePos)) { // If user hasnt clicked on same widget then this aint a double click
         active->OnDoubleClick(mousePos);
+        InvalidateInput(active);
     } else {
         OnMouseDown(mousePos);
     }
@@ -253,6 +385,7 @@ void Container::OnDoubleClick(vector2i_t mousePos) {
 void Container::OnKeyPress(int key) {
     if (active) {
         active->OnKeyPress(key);
+        InvalidateInput(active);
     }
 }
 
@@ -326,6 +459,8 @@ void LayoutContainer::UpdateFixedBounds() {
 Button::Button(const char* _label, rect_t _bounds) : Widget(_bounds) {
     label = _label;
     labelLength = Graphics::GetTextLength(label.c_str());
+
+    Invalidate();
 }
 
 void Button::SetLabel(const char* _label) {
@@ -625,38 +760,30 @@ void TextBox::Paint(surface_t* surface) {
 }
 
 void TextBox::LoadText(const char* text) {
-    const char* text2 = text;
-    int lineCount = 1;
+    Invalidate();
 
     contents.clear();
 
     if (multiline) {
-        while (*text2) {
-            if (*text2 == '\n')
-                lineCount++;
-            text2++;
+        // Count lines first so the line vector is allocated once
+        size_t lines = 1;
+        for (const char* c = text; (c = strchr(c, '\n')); c++) {
+            lines++;
         }
+        contents.reserve(lines);
 
-        text2 = text;
-        for (int i = 0; i < lineCount; i++) {
-            const char* end = strchr(text2, '\n');
-            if (end) {
-                size_t len = (uintptr_t)(end - text2);
-                if (len > strlen(text2))
-                    break;
-
-                contents.push_back(std::string(text2, len));
-
-                text2 = end + 1;
-            } else {
-                contents.push_back(std::string(text2));
-            }
+        // One pass over the text, each line is copied once
+        const char* line = text;
+        while (const char* end = strchr(line, '\n')) {
+            contents.emplace_back(line, end - line);
+            line = end + 1;
         }
+        contents.emplace_back(line);
 
         this->lineCount = contents.size();
         ResetScrollBar();
     } else {
-        contents.push_back(std::string(text2));
+        contents.push_back(std::string(text));
     }
 }
 
@@ -807,6 +934,8 @@ void TextBox::MaskText(bool state) {
     } else {
         masked = false;
     }
+
+    Invalidate();
 }
 
 //////////////////////////
@@ -829,10 +958,14 @@ void ListView::SetModel(DataModel* model) {
 
     model->Refresh();
     cacheDirty = true;
+    ResetScrollBar();
+    Invalidate();
 }
 
 void ListView::UpdateData() {
     cacheDirty = true;
+    ResetScrollBar();
+    Invalidate();
 }
 
 void ListView::Paint(surface_t* surface) {
@@ -848,7 +981,12 @@ void ListView::Paint(surface_t* surface) {
         return; // If there is no model there is no data to display
     }
 
-    if(cacheDirty) {
+    // Only the rows in view are fetched from the model, again when scrolled to another row
+    int index = 0;
+    if (showScrollBar)
+        index = sBar.scrollPos / itemHeight;
+
+    if (cacheDirty || index != cacheFirstRow) {
         RepopulateCache();
         cacheDirty = false;
     }
@@ -878,10 +1016,6 @@ void ListView::Paint(surface_t* surface) {
     int yPos = fixedBounds.y + (columnDisplayHeight *
                                 displayColumnNames); // Offset by column display height only if we display the columns
 
-    int index = 0;
-
-    if (showScrollBar)
-        index = sBar.scrollPos / itemHeight;
     int maxItem = std::min(index + rowsToDisplay, model->RowCount());
 
     for (int row = 0; index < maxItem; index++, row++) {
@@ -895,15 +1029,12 @@ void ListView::Paint(surface_t* surface) {
                                Theme::Current().ColourForegroundInactive(), surface, fixedBounds);
         }
 
+        RowCache& cached = cachedRows.at(row);
         for (int i = 0; i < model->ColumnCount(); i++) {
-            std::string str = "";
-
-            Variant value = model->GetData(index, i);
-            if (std::holds_alternative<const Surface*>(value)) {
-                const Surface* src = std::get<const Surface*>(value);
+            if (const Surface* src = cached.icons.at(i); src) {
                 Graphics::surfacecpyTransparent(surface, src, {xPos + 2, yPos + itemHeight / 2 - src->height / 2});
-            } else if (i < (int)cachedRows.at(i).text.size()) {
-                cachedRows.at(row).text[i].BlitTo(surface);
+            } else {
+                cached.text.at(i).BlitTo(surface);
             }
 
             xPos += columnDisplayWidths[i] + 2;
@@ -938,8 +1069,6 @@ void ListView::OnMouseDown(vector2i_t mousePos) {
     if (showScrollBar && mousePos.x > fixedBounds.pos.x + fixedBounds.size.x - 12) {
         sBar.OnMouseDownRelative({mousePos.x - fixedBounds.pos.x + fixedBounds.size.x - 12,
                                   mousePos.y - columnDisplayHeight - fixedBounds.pos.y});
-
-        cacheDirty = true;
         return;
     }
 
@@ -1064,15 +1193,20 @@ void ListView::ResetScrollBar() {
 }
 
 void ListView::RepopulateCache() {
-    columnDisplayWidths.clear();
+    // Column widths only change with the data, not when scrolling
+    if (cacheDirty || static_cast<int>(columnDisplayWidths.size()) != model->ColumnCount()) {
+        columnDisplayWidths.clear();
 
-    for (int i = 0; i < model->ColumnCount(); i++) {
-        columnDisplayWidths.push_back(model->SizeHint(i));
+        for (int i = 0; i < model->ColumnCount(); i++) {
+            columnDisplayWidths.push_back(model->SizeHint(i));
+        }
     }
 
     int index = 0;
     if (showScrollBar)
         index = sBar.scrollPos / itemHeight;
+    cacheFirstRow = index;
+
     int xPos = 0;
     int yPos = fixedBounds.y + (columnDisplayHeight *
                                 displayColumnNames); // Offset by column display height only if we display the columns
@@ -1083,6 +1217,7 @@ void ListView::RepopulateCache() {
     for (int row = 0; row < rowsToDisplay && row + index < model->RowCount(); row++) {
         xPos = fixedBounds.x;
         cachedRows[row].text.resize(model->ColumnCount());
+        cachedRows[row].icons.assign(model->ColumnCount(), nullptr);
 
         for (int i = 0; i < model->ColumnCount(); i++) {
             std::string str = "";
@@ -1093,31 +1228,14 @@ void ListView::RepopulateCache() {
             } else if (std::holds_alternative<int>(value)) {
                 str = std::to_string(std::get<int>(value));
             } else if (std::holds_alternative<const Surface*>(value)) {
+                cachedRows[row].icons[i] = std::get<const Surface*>(value);
                 xPos += columnDisplayWidths[i] + 2;
                 continue;
             } else {
                 assert(!"GUI::ListView: Unsupported type!");
             }
 
-            int textLen = Graphics::GetTextLength(str.c_str());
-            if (textLen > columnDisplayWidths[i] - 2) {
-                int l = str.length() - 1;
-                while (l) {
-                    str = str.substr(0, l);
-
-                    textLen = Graphics::GetTextLength(str.c_str());
-                    if (textLen < columnDisplayWidths[i] + 2) {
-                        if (l > 2) {
-                            str.erase(str.end() - 1); // Omit last character
-                            str.append(
-                                "..."); // We have a variable width font should we should only have to omit 1 character
-                        }
-                        break;
-                    }
-
-                    l = str.length() - 1;
-                }
-            }
+            str = FitText(str, columnDisplayWidths[i] - 2);
 
             vector2i_t textPos = {xPos + 2, yPos + itemHeight / 2 - font->height / 2};
             cachedRows[row].text[i].SetPos(textPos);
@@ -1151,8 +1269,10 @@ void ListView::OnEditboxSubmit() {
 }
 
 void GridView::ResetScrollBar() {
-    if (!items.size())
+    if (!items.size()) {
+        showScrollBar = false;
         return; // Lets not divide by zero
+    }
 
     assert(items.size() < INT32_MAX);
 
@@ -1202,27 +1322,18 @@ void GridView::Paint(surface_t* surface) {
             Graphics::surfacecpyTransparent(surface, item.icon, iconPos, srcRegion);
         }
 
-        std::string str = item.name;
-        int len = Graphics::GetTextLength(str.c_str());
-        if (static_cast<int>(idx) != selected && len > itemSize.x - 2) {
-            int l = UTF8Strlen(str) - 1;
-            while (l) {
-                str = str.substr(0, UTF8SkipCodepoints(str, l));
-                len = Graphics::GetTextLength(str.c_str());
-
-                if (len < itemSize.x + 2) {
-                    if (l > 2) {
-                        str.erase(str.begin() + UTF8SkipCodepoints(str, -1)); // Omit last character
-                        str.append(
-                            "..."); // We have a variable width font should we should only have to omit 1 character
-                    }
-                    break;
-                }
+        // Labels are shortened the first time they come into view, the selected item shows its whole name
+        if (labels[idx].empty()) {
+            labels[idx] = FitText(item.name, itemSize.x - 2);
 
-                l = UTF8Strlen(str) - 1;
+            if (OnItemShown) {
+                OnItemShown(item, this);
             }
         }
 
+        const std::string& str = (static_cast<int>(idx) == selected) ? item.name : labels[idx];
+        int len = Graphics::GetTextLength(str.c_str());
+
         int fontHeight = Graphics::DefaultFont()->height;
         int textY = fixedBounds.y + yPos + itemSize.y - fontHeight - 4;
         int textX = fixedBounds.x + xPos + (itemSize.x / 2) - (len / 2);
@@ -1367,12 +1478,60 @@ void GridView::OnKeyPress(int key) {
 
 int GridView::AddItem(GridItem& item) {
     items.push_back(item);
+    labels.emplace_back();
 
     ResetScrollBar();
 
     return items.size() - 1;
 }
 
+void GridView::AddItems(std::vector<GridItem>& newItems) {
+    if (newItems.empty()) {
+        return;
+    }
+
+    items.insert(items.end(), std::make_move_iterator(newItems.begin()), std::make_move_iterator(newItems.end()));
+    labels.resize(items.size());
+    newItems.clear();
+
+    ResetScrollBar();
+}
+
+void GridView::SortItems(bool (*compare)(const GridItem&, const GridItem&)) {
+    std::vector<int> order(items.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return compare(items[a], items[b]); });
+
+    std::vector<GridItem> sorted;
+    sorted.reserve(items.size());
+
+    int newSelected = -1;
+    for (size_t i = 0; i < order.size(); i++) {
+        if (order[i] == selected) {
+            newSelected = i;
+        }
+        sorted.push_back(std::move(items[order[i]]));
+    }
+
+    items = std::move(sorted);
+    labels.assign(items.size(), std::string());
+    selected = newSelected;
+}
+
+bool GridView::SetItemIcon(const std::string& name, const Surface* icon) {
+    for (GridItem& item : items) {
+        if (item.name == name) {
+            item.icon = icon;
+            return true;
+        }
+    }
+
+    return false;
+}
+
 void GridView::UpdateFixedBounds() {
     Widget::UpdateFixedBounds();
 
@@ -1,18 +1,77 @@
 #include <Lemon/Core/JSON.h>
 #include <Lemon/Core/SharedMemory.h>
 #include <Lemon/Core/Logger.h>
+#include <Lemon/Core/StartupProfile.h>
 #include <Lemon/GUI/Window.h>
 
 #include <Lemon/GUI/WindowServer.h>
 
+#include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <sstream>
 
 namespace Lemon::GUI {
+// Find the rows that differ from the last frame, grouped into runs narrowed to the columns that differ
+static int FindDamage(const Surface& surface, const uint8_t* lastFrame, WindowRect* rects) {
+    const uint32_t* frame = reinterpret_cast<const uint32_t*>(surface.buffer);
+    const uint32_t* last = reinterpret_cast<const uint32_t*>(lastFrame);
+    int width = surface.width;
+
+    auto rowDiffers = [&](int y) -> bool { return memcmp(frame + y * width, last + y * width, width * 4); };
+
+    int count = 0;
+    int y = 0;
+    while (y < surface.height) {
+        if (!rowDiffers(y)) {
+            y++;
+            continue;
+        }
+
+        int top = y;
+        int left = width;
+        int right = 0;
+        for (; y < surface.height && rowDiffers(y); y++) {
+            const uint32_t* a = frame + y * width;
+            const uint32_t* b = last + y * width;
+
+            int l = 0;
+            while (a[l] == b[l]) {
+                l++;
+            }
+
+            int r = width - 1;
+            while (a[r] == b[r]) {
+                r--;
+            }
+
+            left = std::min(left, l);
+            right = std::max(right, r);
+        }
+
+        WindowRect rect = {left, top, right - left + 1, y - top};
+        if (count < WINDOW_MAX_DAMAGE_RECTS) {
+            rects[count++] = rect;
+        } else {
+            // Out of rects, grow the last to cover this one too
+            WindowRect& lastRect = rects[count - 1];
+            int lastRight = lastRect.x + lastRect.width;
+            lastRect.x = std::min(lastRect.x, rect.x);
+            lastRect.width = std::max(lastRight, rect.x + rect.width) - lastRect.x;
+            lastRect.height = rect.y + rect.height - lastRect.y;
+        }
+    }
+
+    return count;
+}
+
 Window::Window(const char* title, vector2i_t size, uint32_t flags, int type, vector2i_t pos)
     : rootContainer({{0, 0}, size}), m_flags(flags), m_windowType(type) {
+    StartupProfile::Scope profile("CreateWindow");
+
     WindowServer* server = WindowServer::Instance();
     if(!server) {
         Logger::Error("Failed to connect to lemonwm!");
@@ -51,6 +110,10 @@ Window::Window(const char* title, vector2i_t size, uint32_t flags, int type, vec
 Window::~Window() {
     WindowServer* server = WindowServer::Instance();
 
+    if (m_videoBuffer) {
+        Lemon::UnmapSharedMemory(m_videoBuffer, m_videoBufferKey);
+    }
+
     server->DestroyWindow(m_windowID);
     server->UnregisterWindow(m_windowID);
 
@@ -62,8 +125,6 @@ void Window::SetTitle(const std::string& title) { WindowServer::Instance()->SetT
 void Window::Relocate(vector2i_t pos) { WindowServer::Instance()->Relocate(m_windowID, pos.x, pos.y); }
 
 void Window::Resize(vector2i_t size) {
-    Lemon::UnmapSharedMemory(m_windowBufferInfo, m_windowBufferKey);
-
     if(m_windowType == WindowType::GUI) {
         if (menuBar) {
             rootContainer.SetBounds({{0, WINDOW_MENUBAR_HEIGHT}, {size.x, size.y - WINDOW_MENUBAR_HEIGHT}});
@@ -74,15 +135,27 @@ void Window::Resize(vector2i_t size) {
         rootContainer.UpdateFixedBounds();
     }
 
-    m_windowBufferKey = WindowServer::Instance()->Resize(m_windowID, size.x, size.y).bufferKey;
-    if (m_windowBufferKey <= 0) {
-        printf("[LibLemon] Warning: Window::Resize: Failed to obtain window buffer!\n");
+    // LemonWM keeps the same buffer whilst the window fits in it, only the offsets change
+    int64_t bufferKey = WindowServer::Instance()->Resize(m_windowID, size.x, size.y).bufferKey;
+    if (bufferKey != m_windowBufferKey) {
+        if (m_windowBufferInfo) {
+            Lemon::UnmapSharedMemory(m_windowBufferInfo, m_windowBufferKey);
+            m_windowBufferInfo = nullptr;
+        }
 
-        surface.buffer = nullptr;
-        return;
+        m_windowBufferKey = bufferKey;
+        if (m_windowBufferKey <= 0) {
+            printf("[LibLemon] Warning: Window::Resize: Failed to obtain window buffer!\n");
+
+            surface.buffer = nullptr;
+            return;
+        }
+
+        m_windowBufferInfo = (WindowBuffer*)Lemon::MapSharedMemory(m_windowBufferKey);
     }
 
-    m_windowBufferInfo = (WindowBuffer*)Lemon::MapSharedMemory(m_windowBufferKey);
+    m_hasCommitted = false;
+    InvalidateAll();
 
     m_windowBufferInfo->currentBuffer = 0;
     m_buffer1 = ((uint8_t*)m_windowBufferInfo) + m_windowBufferInfo->buffer1Offset;
@@ -106,6 +179,19 @@ void Window::SwapBuffers() {
     while (m_windowBufferInfo->drawing)
         ; // WM is currently drawing the other buffer
 
+    WindowRect damage[WINDOW_MAX_DAMAGE_RECTS];
+    int damageCount = 0;
+    if (m_hasCommitted) {
+        damageCount = FindDamage(surface, (surface.buffer == m_buffer1) ? m_buffer2 : m_buffer1, damage);
+
+        m_lastDamage.clear();
+        for (int i = 0; i < damageCount; i++) {
+            m_lastDamage.push_back({damage[i].x, damage[i].y, damage[i].width, damage[i].height});
+        }
+    } else {
+        m_lastDamage = {GetRect()};
+    }
+
     if (surface.buffer == m_buffer1) {
         m_windowBufferInfo->currentBuffer = 0;
         surface.buffer = m_buffer2;
@@ -114,10 +200,204 @@ void Window::SwapBuffers() {
         surface.buffer = m_buffer1;
     }
 
-    m_windowBufferInfo->dirty = 1;
+    if (!m_hasCommitted) {
+        m_windowBufferInfo->dirty = 1; // Nothing to compare with, draw the whole window
+        m_hasCommitted = true;
+    } else if (damageCount > 0) {
+        WindowServer::Instance()->Commit(
+            m_windowID, std::string_view(reinterpret_cast<const char*>(damage), damageCount * sizeof(WindowRect)));
+    }
+}
+
+void Window::SetOpaqueRegion(const std::vector<Rect>& rects) {
+    WindowRect region[WINDOW_MAX_OPAQUE_RECTS];
+    size_t count = std::min<size_t>(rects.size(), WINDOW_MAX_OPAQUE_RECTS);
+    for (size_t i = 0; i < count; i++) {
+        region[i] = {rects[i].x, rects[i].y, rects[i].width, rects[i].height};
+    }
+
+    WindowServer::Instance()->SetOpaqueRegion(
+        m_windowID, std::string_view(reinterpret_cast<const char*>(region), count * sizeof(WindowRect)));
+}
+
+int Window::CreateVideoSurface(int format, vector2i_t size) {
+    DestroyVideoSurface();
+
+    auto response = WindowServer::Instance()->CreateVideoSurface(m_windowID, format, size.x, size.y);
+    if (response.status) {
+        return response.status;
+    }
+
+    m_videoBufferKey = response.bufferKey;
+    m_videoBuffer = reinterpret_cast<VideoBuffer*>(Lemon::MapSharedMemory(m_videoBufferKey));
+    if (!m_videoBuffer) {
+        m_videoBufferKey = 0;
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+void Window::DestroyVideoSurface() {
+    if (!m_videoBuffer) {
+        return;
+    }
+
+    Lemon::UnmapSharedMemory(m_videoBuffer, m_videoBufferKey);
+    WindowServer::Instance()->DestroyVideoSurface(m_windowID);
+
+    m_videoBuffer = nullptr;
+    m_videoBufferKey = 0;
+}
+
+Graphics::VideoFrame Window::VideoBackFrame() {
+    assert(m_videoBuffer);
+
+    uint32_t back = (m_videoBuffer->currentFrame + 1) % VIDEO_BUFFER_FRAMES;
+    return Graphics::VideoFrameLayout(m_videoBuffer->format, m_videoBuffer->width, m_videoBuffer->height,
+                                      reinterpret_cast<uint8_t*>(m_videoBuffer) + m_videoBuffer->frameOffsets[back]);
+}
+
+void Window::PresentVideoFrame(const Rect& rect) {
+    assert(m_videoBuffer);
+
+    while (m_videoBuffer->drawing)
+        ; // WM is currently drawing the frame on screen
+
+    m_videoBuffer->currentFrame = (m_videoBuffer->currentFrame + 1) % VIDEO_BUFFER_FRAMES;
+    WindowServer::Instance()->PresentVideoFrame(m_windowID, rect.x, rect.y, rect.width, rect.height);
+}
+
+void Window::SwapBuffers(const std::vector<Rect>& damage) {
+    while (m_windowBufferInfo->drawing)
+        ; // WM is currently drawing the other buffer
+
+    // Past the limit the rest are covered by the last rect
+    WindowRect rects[WINDOW_MAX_DAMAGE_RECTS];
+    int count = 0;
+    for (const Rect& rect : damage) {
+        if (count < WINDOW_MAX_DAMAGE_RECTS) {
+            rects[count++] = {rect.x, rect.y, rect.width, rect.height};
+            continue;
+        }
+
+        WindowRect& last = rects[count - 1];
+        int right = std::max(last.x + last.width, rect.x + rect.width);
+        int bottom = std::max(last.y + last.height, rect.y + rect.height);
+        last.x = std::min(last.x, rect.x);
+        last.y = std::min(last.y, rect.y);
+        last.width = right - last.x;
+        last.height = bottom - last.y;
+    }
+
+    if (surface.buffer == m_buffer1) {
+        m_windowBufferInfo->currentBuffer = 0;
+        surface.buffer = m_buffer2;
+    } else {
+        m_windowBufferInfo->currentBuffer = 1;
+        surface.buffer = m_buffer1;
+    }
+
+    WindowServer::Instance()->Commit(
+        m_windowID, std::string_view(reinterpret_cast<const char*>(rects), count * sizeof(WindowRect)));
+    m_lastDamage = damage;
+}
+
+void Window::Invalidate(const Rect& rect) {
+    int left = std::max(rect.x, 0);
+    int top = std::max(rect.y, 0);
+    int right = std::min(rect.x + rect.width, surface.width);
+    int bottom = std::min(rect.y + rect.height, surface.height);
+    if (right <= left || bottom <= top) {
+        return;
+    }
+
+    Rect clipped = {left, top, right - left, bottom - top};
+    for (const Rect& d : m_damage) {
+        if (clipped.x >= d.x && clipped.y >= d.y && right <= d.x + d.width && bottom <= d.y + d.height) {
+            return; // Already damaged
+        }
+    }
+
+    // Repainting a lot of small rects is no better than repainting everything
+    if (m_damage.size() >= WINDOW_MAX_DAMAGE_RECTS * 4) {
+        m_damageAll = true;
+        return;
+    }
+
+    m_damage.push_back(clipped);
+}
+
+void Window::PaintDamage() {
+    if (m_damage.empty()) {
+        return; // Nothing has changed
+    }
+
+    std::vector<Rect> damage = std::move(m_damage);
+    m_damage.clear();
+
+    // The menubar is drawn whole whenever any of it is damaged
+    bool paintMenuBar = false;
+    if (menuBar) {
+        for (const Rect& d : damage) {
+            paintMenuBar |= d.y < WINDOW_MENUBAR_HEIGHT;
+        }
+
+        if (paintMenuBar) {
+            damage.push_back({0, 0, surface.width, WINDOW_MENUBAR_HEIGHT});
+        }
+    }
+
+    // Widgets other than plain containers are repainted whole,
+    // which may overlap more widgets, so this carries on until nothing more is added
+    size_t count;
+    do {
+        count = damage.size();
+        rootContainer.AddDamage(damage);
+    } while (damage.size() != count);
+
+    // The buffer being drawn to has the frame before last, bring across what changed in the last frame first
+    const uint8_t* lastFrame = (surface.buffer == m_buffer1) ? m_buffer2 : m_buffer1;
+    for (const Rect& rect : m_lastDamage) {
+        for (int y = rect.y; y < rect.y + rect.height; y++) {
+            size_t offset = (static_cast<size_t>(y) * surface.width + rect.x) * 4;
+            memcpy(surface.buffer + offset, lastFrame + offset, rect.width * 4);
+        }
+    }
+
+    if (paintMenuBar) {
+        menuBar->Paint(&surface);
+    }
+
+    rootContainer.PaintDamage(&surface, damage);
+
+    SwapBuffers(damage);
 }
 
 void Window::Paint() {
+    if (StartupProfile::Enabled()) {
+        {
+            StartupProfile::Scope profile("Paint");
+            PaintWindow();
+        }
+
+        StartupProfile::Finish(); // The first frame is the end of startup
+        return;
+    }
+
+    PaintWindow();
+}
+
+void Window::PaintWindow() {
+    if (m_windowType == WindowType::GUI && trackDamage && !OnPaint && !OnPaintEnd && m_hasCommitted &&
+        !m_damageAll) {
+        PaintDamage();
+        return;
+    }
+
+    m_damage.clear();
+    m_damageAll = false;
+
     if (OnPaint)
         OnPaint(&surface);
 
@@ -171,6 +451,7 @@ void Window::GUIHandleEvent(LemonEvent& ev) {
         if (menuBar && ev.mousePos.y < menuBar->GetFixedBounds().height) {
             rootContainer.active = nullptr;
             menuBar->OnMouseDown(ev.mousePos);
+            Invalidate(menuBar->GetFixedBounds());
         } else if (menuBar) {
             // ev.mousePos.y -= menuBar->GetFixedBounds().height;
         }
@@ -197,6 +478,7 @@ void Window::GUIHandleEvent(LemonEvent& ev) {
         if (menuBar && ev.mousePos.y < menuBar->GetFixedBounds().height) {
             rootContainer.active = nullptr;
             menuBar->OnMouseDown(ev.mousePos);
+            Invalidate(menuBar->GetFixedBounds());
         } else if (menuBar) {
             // ev.mousePos.y -= menuBar->GetFixedBounds().height;
         }
@@ -209,6 +491,7 @@ void Window::GUIHandleEvent(LemonEvent& ev) {
         if (menuBar && ev.mousePos.y < menuBar->GetFixedBounds().height) {
             rootContainer.active = nullptr;
             menuBar->OnMouseDown(ev.mousePos);
+            Invalidate(menuBar->GetFixedBounds());
         } else if (menuBar) {
             // ev.mousePos.y -= menuBar->GetFixedBounds().height;
         }
@@ -221,6 +504,7 @@ void Window::GUIHandleEvent(LemonEvent& ev) {
         if (menuBar && ev.mousePos.y < menuBar->GetFixedBounds().height) {
             rootContainer.active = nullptr;
             menuBar->OnMouseDown(ev.mousePos);
+            Invalidate(menuBar->GetFixedBounds());
         } else if (menuBar) {
             // ev.mousePos.y -= menuBar->GetFixedBounds().height;
         }
@@ -238,6 +522,7 @@ void Window::GUIHandleEvent(LemonEvent& ev) {
 
         if (menuBar && ev.mousePos.y >= 0 && ev.mousePos.y < menuBar->GetFixedBounds().height) {
             menuBar->OnMouseMove(ev.mousePos);
+            Invalidate(menuBar->GetFixedBounds());
         } else if (menuBar) {
             // ev.mousePos.y -= menuBar->GetFixedBounds().height;
         }
@@ -1,9 +1,11 @@
 #include <Lemon/GUI/WindowServer.h>
 
+#include <Lemon/Core/StartupProfile.h>
 #include <Lemon/GUI/Theme.h>
 #include <Lemon/GUI/Window.h>
 
 #include <assert.h>
+#include <string.h>
 
 namespace Lemon {
 WindowServer* WindowServer::m_instance = nullptr;
@@ -16,6 +18,7 @@ WindowServer* WindowServer::Instance() {
 
     std::scoped_lock acquire(m_instanceLock);
     if (!m_instance) {
+        StartupProfile::Scope profile("WindowServer");
         m_instance = new WindowServer();
     }
 
@@ -37,27 +40,49 @@ void WindowServer::Poll() {
 
 WindowServer::WindowServer() : LemonWMServerEndpoint("lemon.lemonwm/Instance") {
     assert(!m_instance);
-    GUI::Theme::Current().Update(GetSystemTheme());
+
+    // Window updates are frequent, write them straight into memory shared with LemonWM
+    if (long ret = EnableRing(); ret) {
+        Lemon::Logger::Warning("Failed to map message rings: {}", ret);
+    }
+
+    UpdateTheme();
+}
+
+void WindowServer::UpdateTheme() {
+    StartupProfile::Scope profile("Theme");
+
+    // LemonWM has already parsed the theme, only read the JSON if it sent something we cannot use
+    if (!GUI::Theme::Current().Load(LemonWMServerEndpoint::GetSystemThemeData().theme)) {
+        GUI::Theme::Current().Update(GetSystemTheme());
+    }
 }
 
 void WindowServer::OnPeerDisconnect(const Lemon::Handle&) {
     throw std::runtime_error("WindowServer has disconnected!");
 }
 
-void WindowServer::OnSendEvent(const Lemon::Handle&, int64_t windowID, int32_t id, uint64_t data) {
-    if (auto window = m_windows.find(windowID);
-        window != m_windows.end()) { // Event may have been sent before server acknowledged destroyed window
-        window->second->m_eventQueue.push(Lemon::LemonEvent{.event = id, .data = data});
+void WindowServer::OnSendEvents(const Lemon::Handle&, int64_t windowID, std::string_view events) {
+    auto window = m_windows.find(windowID);
+    if (window == m_windows.end()) {
+        return; // Event may have been sent before server acknowledged destroyed window
+    }
+
+    for (size_t i = 0; i + sizeof(WindowEvent) <= events.length(); i += sizeof(WindowEvent)) {
+        WindowEvent ev;
+        memcpy(&ev, events.data() + i, sizeof(WindowEvent));
+
+        window->second->m_eventQueue.push(Lemon::LemonEvent{.event = ev.event, .data = ev.data, .timestamp = ev.timestamp});
     }
 }
 
-void WindowServer::OnThemeUpdated(const Lemon::Handle&) { GUI::Theme::Current().Update(GetSystemTheme()); }
+void WindowServer::OnThemeUpdated(const Lemon::Handle&) { UpdateTheme(); }
 
 void WindowServer::OnPing(const Lemon::Handle&, int64_t windowID) { Pong(windowID); }
 
-void WindowServer::OnWindowCreated(const Lemon::Handle&, int64_t windowID, uint32_t flags, const std::string& name) {
+void WindowServer::OnWindowCreated(const Lemon::Handle&, int64_t windowID, uint32_t flags, std::string_view name) {
     if (OnWindowCreatedHandler)
-        OnWindowCreatedHandler(windowID, flags, name);
+        OnWindowCreatedHandler(windowID, flags, std::string(name));
 }
 
 void WindowServer::OnWindowStateChanged(const Lemon::Handle&, int64_t windowID, uint32_t flags, int32_t state) {
@@ -65,9 +90,9 @@ void WindowServer::OnWindowStateChanged(const Lemon::Handle&, int64_t windowID,
         OnWindowStateChangedHandler(windowID, flags, state);
 }
 
-void WindowServer::OnWindowTitleChanged(const Lemon::Handle&, int64_t windowID, const std::string& name) {
+void WindowServer::OnWindowTitleChanged(const Lemon::Handle&, int64_t windowID, std::string_view name) {
     if (OnWindowTitleChangedHandler)
-        OnWindowTitleChangedHandler(windowID, name);
+        OnWindowTitleChangedHandler(windowID, std::string(name));
 }
 
 void WindowServer::OnWindowDestroyed(const Lemon::Handle&, int64_t windowID) {
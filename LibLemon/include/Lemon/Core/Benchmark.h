@@ -0,0 +1,104 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+namespace Lemon {
+
+/////////////////////////////
+/// \brief Timing and reporting shared by the benchmarks
+///
+/// Sampled benchmarks (tests.lef bench, ipctest.lef) print each result with Report on one line as
+///     bench <name> samples=<n> iterations=<n> best=<value> median=<value> avg=<value> unit=<unit>
+/// so runs can be compared (e.g. with diff or awk) before and after a change.
+/// Benchmark utilities timing one run of each test (fsbench, netbench) report through a Totals.
+/////////////////////////////
+namespace Benchmark {
+
+inline uint64_t NowNs() {
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+inline uint64_t NowUs() { return NowNs() / 1000; }
+
+/////////////////////////////
+/// \brief Print the line for a result, sorts samples
+///
+/// \param higherIsBetter Whether the best sample is the highest (e.g. throughput) rather than the lowest (latency)
+/////////////////////////////
+inline void Report(const char* name, unsigned iterations, double* samples, int sampleCount, const char* unit,
+                   bool higherIsBetter) {
+    std::sort(samples, samples + sampleCount);
+
+    double sum = 0;
+    for (int i = 0; i < sampleCount; i++) {
+        sum += samples[i];
+    }
+
+    printf("bench %s samples=%d iterations=%u best=%.1f median=%.1f avg=%.1f unit=%s\n", name, sampleCount,
+           iterations, higherIsBetter ? samples[sampleCount - 1] : samples[0], samples[sampleCount / 2],
+           sum / sampleCount, unit);
+}
+
+/////////////////////////////
+/// \brief Results of tests each timed over a single run
+///
+/// Each result is printed as a row of ops, time, ops/s, MB/s (when bytes were moved) and us/op.
+/// In machine readable mode nothing is printed until Finish, which prints one line of test,ops,bytes,us for each.
+/////////////////////////////
+class Totals final {
+public:
+    // nameWidth is the width of the test name column
+    Totals(int nameWidth) : m_nameWidth(nameWidth) {}
+
+    // Record a test which did ops operations moving bytes in us microseconds
+    void Report(const char* name, uint64_t ops, uint64_t bytes, uint64_t us) {
+        if (!us) {
+            us = 1;
+        }
+        m_results.push_back({name, ops, bytes, us});
+
+        if (machineReadable) {
+            return;
+        }
+
+        printf("%-*s %8lu ops  %10.3f s  %10.0f ops/s", m_nameWidth, name, ops, us / 1000000.0,
+               ops * 1000000.0 / us);
+        if (bytes) {
+            printf("  %9.2f MB/s", (bytes / (1024.0 * 1024.0)) / (us / 1000000.0));
+        }
+        printf("  %8.1f us/op\n", static_cast<double>(us) / ops);
+    }
+
+    void Finish() {
+        if (!machineReadable) {
+            return;
+        }
+
+        for (const Result& r : m_results) {
+            printf("%s,%lu,%lu,%lu\n", r.name, r.ops, r.bytes, r.us);
+        }
+    }
+
+    bool machineReadable = false;
+
+private:
+    struct Result {
+        const char* name;
+        uint64_t ops;
+        uint64_t bytes;
+        uint64_t us;
+    };
+
+    int m_nameWidth;
+    std::vector<Result> m_results;
+};
+
+} // namespace Benchmark
+} // namespace Lemon
@@ -13,13 +13,15 @@ class CFGParser {
 
   private:
     std::vector<std::pair<std::string, std::vector<CFGItem>>> items;
-    FILE* cfgFile = nullptr;
+    std::string cfgPath;
     std::vector<char> cfgData;
 
+    void ParseData();
+
   public:
     CFGParser(const char* path);
-    ~CFGParser();
 
+    // Parses the file, or loads it from the config cache if it has not changed since it was last parsed
     void Parse();
     auto& GetItems() { return items; };
 };
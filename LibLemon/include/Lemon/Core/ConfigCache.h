@@ -0,0 +1,150 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Parsed configs are shared through here by every process
+#define CONFIG_CACHE_DIR "/tmp/configcache"
+
+namespace Lemon {
+
+/////////////////////////////
+/// \brief A parsed config file in a compact binary form
+///
+/// The first process to parse a config saves the result to CONFIG_CACHE_DIR,
+/// every other process maps the cache and reads entries straight out of it
+/// rather than lexing and parsing the source again.
+///
+/// The kernel does not keep modification times, so a cache is only used
+/// when the inode, size and a hash of the contents of the source match those it was built from.
+/////////////////////////////
+class ConfigCache {
+public:
+    enum ValueType : uint32_t {
+        TypeString,
+        TypeSigned,
+        TypeUnsigned,
+        TypeFloat,
+        TypeBool,
+    };
+
+    // Identifies the contents of a config file
+    struct Source {
+        bool valid = false;
+        uint64_t inode;
+        uint64_t size;
+        uint64_t hash;
+    };
+
+    struct Entry {
+        uint32_t section; // Entries in the same section (e.g. under the same CFG heading) have the same index
+        ValueType type;
+
+        std::string_view sectionName;
+        std::string_view key;
+        std::string_view str; // Only for TypeString
+
+        union {
+            long sLong;
+            unsigned long uLong;
+            double dbl;
+            bool boolean;
+        } value;
+    };
+
+    // On disk format, a header followed by the records then the strings they point to
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+
+        uint64_t sourceInode;
+        uint64_t sourceSize;
+        uint64_t sourceHash;
+
+        uint32_t recordCount;
+        uint32_t pathLength; // The path of the source is the first string
+        uint32_t stringsSize;
+        uint32_t reserved;
+    };
+
+    struct Record {
+        uint32_t section;
+        uint32_t type;
+
+        uint32_t sectionName;
+        uint32_t sectionNameLength;
+        uint32_t key;
+        uint32_t keyLength;
+        uint32_t str;
+        uint32_t strLength;
+
+        uint64_t value; // Bits of the number or bool
+    };
+
+    // Collects the entries of a config as it is parsed
+    class Builder {
+    public:
+        void BeginSection(std::string_view name);
+
+        void AddString(std::string_view key, std::string_view value);
+        void AddSigned(std::string_view key, long value);
+        void AddUnsigned(std::string_view key, unsigned long value);
+        void AddFloat(std::string_view key, double value);
+        void AddBool(std::string_view key, bool value);
+
+    private:
+        friend class ConfigCache;
+
+        void Add(std::string_view key, ValueType type, uint64_t value, std::string_view str = {});
+        uint32_t Intern(std::string_view str);
+
+        std::vector<Record> m_records;
+        std::string m_strings;
+
+        uint32_t m_section = 0;
+        uint32_t m_sectionName = 0;
+        uint32_t m_sectionNameLength = 0;
+    };
+
+    ConfigCache() = default;
+    ~ConfigCache();
+
+    ConfigCache(const ConfigCache&) = delete;
+    ConfigCache& operator=(const ConfigCache&) = delete;
+
+    /////////////////////////////
+    /// \brief Map the cache of the config at path
+    ///
+    /// \param source Filled with the identity of the config, to be passed to Save on failure
+    /// \return 0 if there is an up to date cache, 1 if the config has to be parsed
+    /////////////////////////////
+    int Open(const char* path, Source& source);
+
+    /////////////////////////////
+    /// \brief Use the entries of builder, saving them as the cache of the config at path
+    ///
+    /// Failing to save is ignored as the cache is only an optimisation.
+    /////////////////////////////
+    void Save(const char* path, const Source& source, const Builder& builder);
+
+    inline size_t size() const { return m_header ? m_header->recordCount : 0; }
+    Entry operator[](size_t index) const;
+
+private:
+    void Close();
+    int Validate(const char* path, const Source& source) const;
+
+    const Header* m_header = nullptr;
+    const Record* m_records = nullptr;
+    const char* m_strings = nullptr;
+
+    void* m_mapping = nullptr;
+    size_t m_mappingSize = 0;
+    std::vector<uint8_t> m_data; // Used instead of a mapping when built by this process
+};
+
+} // namespace Lemon
@@ -10,6 +10,10 @@
 namespace Lemon{
     Surface* CreateFramebufferSurface();
     void CreateFramebufferSurface(Surface& surface);
+
+    // Create a surface for each page of the framebuffer, up to maxPages.
+    // Returns the amount of pages, only the first is displayed until flipped with FlipFramebuffer
+    int CreateFramebufferPages(Surface* pages, int maxPages);
 }
 
 #endif
@@ -7,6 +7,8 @@
 #include <mutex>
 #include <string>
 
+class LemonWMServerEndpoint;
+
 namespace Lemon {
 // Thread safe class for retrieve and caching icons
 class IconManager final {
@@ -31,14 +33,37 @@ class IconManager final {
     /////////////////////////////
     const Surface* GetIcon(const std::string& name, IconSize preferredSize = IconSize32x32);
 
+    /////////////////////////////
+    /// \brief Get image surface
+    ///
+    /// Loads the image at path scaled to width by height. Images under /system/lemon/resources
+    /// are decoded once by LemonWM and shared by every process.
+    ///
+    /// \param path Path of image
+    /// \param width Width to scale to
+    /// \param height Height to scale to
+    ///
+    /// \return Immutable surface pointer, nullptr if the image could not be loaded
+    /////////////////////////////
+    const Surface* GetImage(const std::string& path, int width, int height);
+
   private:
     IconManager();
 
+    // Map the image from LemonWM, or decode it if LemonWM cannot share it
+    bool LoadImage(const std::string& path, int width, int height, Surface* surface);
+    bool LoadSharedImage(const std::string& path, int width, int height, Surface* surface);
+
     static IconManager* m_instance;
     static std::mutex m_mutex;
 
     Icon m_missingIcon; // Filler icon for when no sucessful icon could be found
 
     std::map<std::string, Icon> m_icons; // Icon cache
+    std::map<std::string, Surface> m_images; // Keyed by path and size
+
+    std::mutex m_imageCacheMutex;
+    LemonWMServerEndpoint* m_imageCache = nullptr;
+    bool m_imageCacheUnavailable = false; // LemonWM could not be reached, so images are decoded by the process
 };
 } // namespace Lemon
@@ -1,15 +1,55 @@
 #pragma once
 
 #include <cassert>
-#include <map>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include <Lemon/Core/Lexer.h>
 
 namespace Lemon {
-using JSONKey = std::string;
+using JSONKey = std::string_view;
 
+struct JSONValue;
+struct JSONMember;
+
+// Values of an array, allocated in the arena of the parser
+struct JSONArray {
+    JSONValue* values;
+    size_t count;
+
+    inline size_t size() const { return count; }
+    inline JSONValue* begin() const { return values; }
+    inline JSONValue* end() const;
+
+    inline JSONValue& operator[](size_t index) const;
+};
+
+// Members of an object sorted by key, allocated in the arena of the parser
+struct JSONObject {
+    JSONMember* members;
+    size_t count;
+
+    inline size_t size() const { return count; }
+    inline JSONMember* begin() const { return members; }
+    inline JSONMember* end() const;
+
+    // Binary search for the member with key, returns end() if there is none
+    JSONMember* find(std::string_view key) const;
+
+    inline JSONValue& at(std::string_view key) const;
+};
+
+/////////////////////////////
+/// \brief A JSON value
+///
+/// Values do not own anything and are trivial to copy. Strings, arrays and objects
+/// point into the source or the arena of the JSONParser they came from,
+/// so they are only valid for as long as the parser is.
+/////////////////////////////
 struct JSONValue {
     enum {
         TypeString,
@@ -28,9 +68,12 @@ struct JSONValue {
     } traits;
 
     union {
-        std::string* str = nullptr;
-        std::vector<JSONValue>* array;
-        std::map<JSONKey, JSONValue>* object;
+        struct {
+            const char* data;
+            size_t length;
+        } str;
+        JSONArray array;
+        JSONObject object;
         unsigned long uLong;
         long sLong;
         float fl;
@@ -38,49 +81,29 @@ struct JSONValue {
         bool boolean;
     } data;
 
-    JSONValue() { type = TypeNull; }
-
-    JSONValue(const JSONValue& v) = delete;
-    JSONValue(JSONValue&& v) {
-        type = v.type;
-        traits = v.traits;
-        
-        data = v.data;
-
-        v.type = TypeNull;
-        v.data.uLong = 0;
+    JSONValue() {
+        type = TypeNull;
+        data.array = {nullptr, 0};
     }
 
-    JSONValue(const std::string& s) {
+    JSONValue(std::string_view s) {
         type = TypeString;
 
-        data.str = new std::string(s);
+        data.str = {s.data(), s.length()};
     }
 
-    JSONValue(std::string&& s) {
-        type = TypeString;
-
-        data.str = new std::string(s);
-    }
+    JSONValue(const char* s) : JSONValue(std::string_view(s)) {}
 
-    JSONValue(std::vector<JSONValue>&& v) {
+    JSONValue(JSONArray a) {
         type = TypeArray;
 
-        data.array = new std::vector<JSONValue>(std::move(v));
+        data.array = a;
     }
 
-    JSONValue(std::map<JSONKey, JSONValue>&& o) {
+    JSONValue(JSONObject o) {
         type = TypeObject;
 
-        data.object = new std::map<JSONKey, JSONValue>(std::move(o));
-    }
-
-    static JSONValue NewObject() {
-        JSONValue v;
-        v.type = TypeObject;
-        v.data.object = new std::map<JSONKey, JSONValue>();
-
-        return v;
+        data.object = o;
     }
 
     JSONValue(unsigned long ul) {
@@ -112,88 +135,188 @@ struct JSONValue {
         data.boolean = b;
     }
 
-    ~JSONValue() {
-        ReleaseData();
-    }
-
-    JSONValue& operator=(JSONValue&& other) {
-        ReleaseData();
-
-        type = other.type;
-        traits = other.traits;
-        data = other.data;
+    inline JSONValue& operator[](std::string_view key) const {
+        assert(type == TypeObject);
 
-        other.type = TypeNull;
-        other.data.uLong = 0;
-
-        return *this;
+        return data.object.at(key);
     }
 
-    void ReleaseData() {
-        if(type == TypeString) {
-            delete data.str;
-        } else if(type == TypeArray) {
-            delete data.array;
-        } else if(type == TypeObject) {
-            delete data.object;
-        }
-    }
+    inline bool IsString() const { return type == TypeString; }
 
-    inline JSONValue& operator[](const std::string& s) {
-        assert(type == TypeObject && data.object);
+    inline bool IsNumber() const { return type == TypeNumber; }
+    inline bool IsFloat() const { return traits.isFloatingPoint; }
+    inline bool IsSigned() const { return traits.isSigned; }
 
-        return data.object->at(s);
-    }
+    inline bool IsBool() const { return type == TypeBoolean; }
 
-    inline bool IsString() { return type == TypeString; }
+    inline bool IsArray() const { return type == TypeArray; }
 
-    inline bool IsNumber() { return type == TypeNumber; }
-    inline bool IsFloat() { return traits.isFloatingPoint; }
-    inline bool IsSigned() { return traits.isSigned; }
+    inline bool IsObject() const { return type == TypeObject; }
 
-    inline bool IsBool() { return type == TypeBoolean; }
+    inline bool IsNull() const { return type == TypeNull; }
 
-    inline bool IsArray() { return type == TypeArray; }
+    inline std::string_view AsStringView() const {
+        assert(IsString());
+        return std::string_view(data.str.data, data.str.length);
+    }
 
-    inline bool IsObject() { return type == TypeObject; }
+    // Copies the string, use AsStringView to avoid the allocation
+    inline std::string AsString() const { return std::string(AsStringView()); }
 
-    inline bool IsNull() { return type == TypeNull; }
+    inline JSONArray AsArray() const {
+        assert(IsArray());
+        return data.array;
+    }
 
-    std::string AsString() { return *data.str; }
+    inline JSONObject AsObject() const {
+        assert(IsObject());
+        return data.object;
+    }
 
-    template <typename I = long> inline I AsSignedNumber() { 
+    template <typename I = long> inline I AsSignedNumber() const {
         assert(!IsFloat());
-        return static_cast<I>(data.sLong); }
+        return static_cast<I>(data.sLong);
+    }
 
-    template <typename I = unsigned long> inline I AsUnsignedNumber() { return static_cast<I>(data.uLong); }
+    template <typename I = unsigned long> inline I AsUnsignedNumber() const { return static_cast<I>(data.uLong); }
 
-    template <typename I = double> inline I AsFloat() {
-        if(traits.isFloatingPoint) {
+    template <typename I = double> inline I AsFloat() const {
+        if (traits.isFloatingPoint) {
             return static_cast<I>(data.dbl);
         } else {
             return static_cast<I>(data.sLong);
         }
     }
 
-    inline bool AsBool() { return data.boolean; }
+    inline bool AsBool() const { return data.boolean; }
 };
 
+struct JSONMember {
+    JSONKey key;
+    JSONValue value;
+};
+
+inline JSONValue* JSONArray::end() const { return values + count; }
+
+inline JSONMember* JSONObject::end() const { return members + count; }
+
+inline JSONValue& JSONArray::operator[](size_t index) const {
+    assert(index < count);
+    return values[index];
+}
+
+inline JSONValue& JSONObject::at(std::string_view key) const {
+    JSONMember* member = find(key);
+    assert(member != end());
+
+    return member->value;
+}
+
+/////////////////////////////
+/// \brief Receives the contents of a JSON document as it is parsed
+///
+/// Strings and keys passed to the handler are only valid for the duration of the call.
+/// Returning false from any of the callbacks stops parsing.
+/////////////////////////////
+class JSONHandler {
+public:
+    virtual ~JSONHandler() = default;
+
+    virtual bool OnNull() { return true; }
+    virtual bool OnBool(bool) { return true; }
+    virtual bool OnSigned(long) { return true; }
+    virtual bool OnUnsigned(unsigned long) { return true; }
+    virtual bool OnFloat(double) { return true; }
+    virtual bool OnString(std::string_view) { return true; }
+
+    virtual bool OnObjectStart() { return true; }
+    virtual bool OnKey(std::string_view) { return true; }
+    virtual bool OnObjectEnd(size_t /* memberCount */) { return true; }
+
+    virtual bool OnArrayStart() { return true; }
+    virtual bool OnArrayEnd(size_t /* count */) { return true; }
+};
+
+// Allocates the nodes of a document in large blocks, which are all freed at once
+class JSONArena {
+public:
+    void* Allocate(size_t size, size_t alignment = alignof(std::max_align_t));
+
+    template <typename T> inline T* Allocate(size_t count) {
+        return reinterpret_cast<T*>(Allocate(sizeof(T) * count, alignof(T)));
+    }
+
+private:
+    std::vector<std::unique_ptr<uint8_t[]>> m_blocks;
+    uint8_t* m_pos = nullptr;
+    uint8_t* m_end = nullptr;
+    size_t m_nextBlockSize = 4096;
+};
+
+/////////////////////////////
+/// \brief JSON parser
+///
+/// Files are mapped rather than read, strings without escape sequences
+/// are kept as views into the source and everything else is allocated in an arena,
+/// so a document costs a handful of allocations however large it is.
+/// Parse(JSONHandler&) walks the document without building it at all.
+///
+/// The document is first scanned with SIMD for its structural characters,
+/// the parser then jumps between them rather than lexing every byte.
+/////////////////////////////
 class JSONParser : protected BasicLexer {
-  protected:
-    std::vector<char> buffer;
+protected:
+    const void* m_mapping = nullptr;
+    size_t m_mappingSize = 0;
+
+    JSONArena m_arena;
+    std::string m_scratch; // Holds strings with escape sequences whilst being passed to the handler
+
+    std::vector<uint32_t> m_structurals; // Offsets of the structural characters of the document
+    size_t m_nextStructural = 0;
+
+    // Move to the next structural character, returns false at the end of the document
+    bool NextStructural();
+    // Numbers and literals have to be followed by whitespace or a structural character
+    bool AtScalarEnd() const;
 
-    std::string ParseString();
+    int ParseString(std::string_view& str);
+    int ParseNumber(JSONHandler& handler);
 
-    int ParseValue(JSONValue& val);
+    int ParseValue(JSONHandler& handler, int depth);
 
-    JSONValue ParseObject();
-    JSONValue ParseArray();
+    int ParseObject(JSONHandler& handler, int depth);
+    int ParseArray(JSONHandler& handler, int depth);
 
-  public:
-    JSONParser(std::string_view& v);
+    bool EatLiteral(std::string_view word);
+
+public:
+    JSONParser(const std::string_view& v);
     JSONParser(const char* path);
+    ~JSONParser();
+
+    JSONParser(const JSONParser&) = delete;
+    JSONParser& operator=(const JSONParser&) = delete;
 
+    /////////////////////////////
+    /// \brief Parse the document
+    ///
+    /// \return The root value, null if the document is invalid.
+    /// It is valid for as long as the parser is.
+    /////////////////////////////
     JSONValue Parse();
+
+    /////////////////////////////
+    /// \brief Parse the document, passing its contents to handler without building it
+    ///
+    /// \return 0 on success, 1 if the document is invalid or the handler stopped parsing
+    /////////////////////////////
+    int Parse(JSONHandler& handler);
+
+    // Whether value points into the source document rather than the arena
+    inline bool IsInSource(const char* value) const { return value >= sv.data() && value < sv.data() + sv.size(); }
+
+    inline JSONArena& Arena() { return m_arena; }
 };
 
 int WriteJSON(const char* file, JSONValue& object);
@@ -11,23 +11,19 @@
 #define SHA2_CHOOSE(e, f, g) ((e & f) ^ ((~e) & g))
 #define SHA2_MAJOR(a, b, c) ((a & b) ^ (a & c) ^ (b & c))
 
+/////////////////////////////
+/// \brief Streaming SHA-256
+///
+/// Data can be passed to Update in pieces of any size. Blocks are hashed with the SHA extensions
+/// when the CPU has them, otherwise in C++.
+/////////////////////////////
 class SHA256 {
   private:
-    const uint32_t initialHash[8]{
-        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
-    };
-
-    const uint32_t constants[64]{
-        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
-        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
-        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
-        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
-        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
-        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
-        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
-        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
-
-    void Transform(const uint8_t* data);
+    // Hash blocks chunks of data into state, with the best implementation for the CPU
+    static void Transform(uint32_t state[8], const uint8_t* data, size_t blocks);
+
+    uint64_t length;                   // Total bytes passed to Update
+    uint8_t buffer[SHA256_CHUNK_SIZE]; // Data that has yet to make up a whole chunk
 
   protected:
     uint32_t hash[8];
@@ -35,6 +31,35 @@ class SHA256 {
   public:
     SHA256();
 
+    // Start again, as if newly constructed
+    void Reset();
+
     void Update(const void* data, size_t count);
-    std::string GetHash();
+
+    // The digest of everything passed to Update so far. More data can still be added afterwards.
+    void GetDigest(uint8_t digest[SHA256_HASH_SIZE]) const;
+    // The digest as a hex string
+    std::string GetHash() const;
+
+    /////////////////////////////
+    /// \brief Hash the file at path
+    ///
+    /// The file is mapped rather than read, so it is hashed straight from the page cache.
+    ///
+    /// \return 0 on success, otherwise -1 and errno is set
+    /////////////////////////////
+    static int HashFile(const char* path, uint8_t digest[SHA256_HASH_SIZE]);
+
+    /////////////////////////////
+    /// \brief Hash count independent buffers
+    ///
+    /// Without the SHA extensions, up to 8 buffers are hashed at once using AVX2. Buffers of similar length
+    /// are hashed together, as each group takes as long as its longest buffer.
+    ///
+    /// \param data Start of each buffer
+    /// \param lengths Length of each buffer in bytes
+    /// \param digests Digest of each buffer is written here
+    /////////////////////////////
+    static void HashMany(const void* const* data, const size_t* lengths, uint8_t (*digests)[SHA256_HASH_SIZE],
+                         size_t count);
 };
@@ -5,9 +5,15 @@
 
 #define SMEM_FLAGS_PRIVATE 1
 #define SMEM_FLAGS_SHARED 0
+#define SMEM_FLAGS_RESERVE 2
 
 namespace Lemon {
 int64_t CreateSharedMemory(uint64_t size, uint64_t flags);
+// Create shared memory which can be grown up to reserve bytes by GrowSharedMemory,
+// mappings cover the whole reservation so growing never moves the memory
+int64_t ReserveSharedMemory(uint64_t size, uint64_t reserve, uint64_t flags);
+// Grow shared memory created by this process, returns 0 on success
+long GrowSharedMemory(int64_t key, uint64_t size);
 void* MapSharedMemory(int64_t key);
 long UnmapSharedMemory(void* address, int64_t key);
 long DestroySharedMemory(int64_t key);
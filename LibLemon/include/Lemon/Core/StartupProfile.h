@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+
+// File descriptor the startup breakdown is written to, profiling is off unless set
+#define STARTUP_PROFILE_FD_ENV "LEMON_STARTUP_PROFILE"
+// Exit once the breakdown has been written
+#define STARTUP_PROFILE_EXIT_ENV "LEMON_STARTUP_PROFILE_EXIT"
+
+#define STARTUP_PROFILE_MAX_PHASES 32
+
+namespace Lemon {
+
+/////////////////////////////
+/// \brief Where a program spends its time before the first paint of a window
+///
+/// Used by the startupbench utility, which sets LEMON_STARTUP_PROFILE to the write end of a pipe.
+/// Phases are timed exclusive of any phases nested within them, so they add up to the time spent in them.
+/// When the first window has painted, one line is written for each phase:
+///     loaded <us>                     Time LibLemon was initialized
+///     phase <name> <count> <us>       Total time and number of times in a phase
+///     painted <us>                    Time of the end of the first paint
+/// Times are microseconds on CLOCK_BOOTTIME.
+/////////////////////////////
+namespace StartupProfile {
+
+// Whether the program is being profiled and has not painted yet
+bool Enabled();
+
+uint64_t Now();
+
+/////////////////////////////
+/// \brief Time a phase of startup until the end of the scope
+///
+/// \param name Name of the phase, must outlive the program (e.g. a string literal)
+/////////////////////////////
+class Scope final {
+public:
+    Scope(const char* name);
+    ~Scope();
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+private:
+    const char* m_name;
+    uint64_t m_start = 0;
+    uint64_t m_nested = 0; // Time spent in scopes within this one
+    Scope* m_parent = nullptr;
+};
+
+/////////////////////////////
+/// \brief Write the breakdown and stop profiling
+///
+/// Called by LibGUI after the first paint of a window.
+/// Exits the program if LEMON_STARTUP_PROFILE_EXIT is set.
+/////////////////////////////
+void Finish();
+
+} // namespace StartupProfile
+} // namespace Lemon
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <Lemon/Graphics/Surface.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Thumbnails are kept here between runs
+#define THUMBNAIL_CACHE_DIR "/system/lemon/thumbnails"
+#define THUMBNAIL_SIZE 64
+#define THUMBNAIL_WORKERS 2
+
+namespace Lemon {
+
+/////////////////////////////
+/// \brief Generates thumbnails of images on worker threads
+///
+/// Images are decoded straight to THUMBNAIL_SIZE (see Graphics::LoadImage) and saved
+/// to THUMBNAIL_CACHE_DIR, so each image is only decoded once.
+///
+/// The kernel does not keep modification times, so a saved thumbnail is only used
+/// when the inode and size of the image match those it was made from.
+/////////////////////////////
+class ThumbnailGenerator {
+public:
+    struct Thumbnail {
+        std::string path;
+        Surface surface; // The buffer is owned by whoever takes the thumbnail
+    };
+
+    /////////////////////////////
+    /// \param onReady Called on a worker thread when there are thumbnails to take with TakeCompleted.
+    /// It is called again every so often until they have been taken.
+    /////////////////////////////
+    ThumbnailGenerator(std::function<void()> onReady);
+    ~ThumbnailGenerator();
+
+    ThumbnailGenerator(const ThumbnailGenerator&) = delete;
+    ThumbnailGenerator& operator=(const ThumbnailGenerator&) = delete;
+
+    // Whether the file looks like an image a thumbnail can be made of, going by its extension
+    static bool IsImage(const char* name);
+
+    /////////////////////////////
+    /// \brief Ask for a thumbnail of the image at path
+    ///
+    /// The last images asked for are done first, as they are the ones most likely to be in view.
+    /////////////////////////////
+    void Request(const std::string& path);
+
+    // Forget any requests and thumbnails that have not been taken, e.g. when leaving a directory
+    void Cancel();
+
+    // Move the thumbnails made since the last call into thumbnails
+    void TakeCompleted(std::vector<Thumbnail>& thumbnails);
+
+private:
+    void Worker();
+    // Wake whoever is waiting on the thumbnails until they have been taken
+    void Notify();
+
+    bool Generate(const std::string& path, Surface& surface);
+
+    std::function<void()> m_onReady;
+
+    std::mutex m_lock; // Protects everything below
+    std::condition_variable m_requestAdded;
+    std::deque<std::string> m_requests;
+    std::vector<Thumbnail> m_completed;
+    uint64_t m_generation = 0; // Incremented by Cancel, so anything in progress is thrown away
+    bool m_notifying = false;
+    bool m_stop = false;
+
+    std::vector<std::thread> m_workers; // Started on the first request
+};
+
+} // namespace Lemon
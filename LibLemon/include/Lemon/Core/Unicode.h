@@ -3,15 +3,39 @@
 #include <string>
 #include <vector>
 
+#include <stddef.h>
 #include <stdint.h>
 
+// Codepoint given for bytes that are not valid UTF-8
+#define UNICODE_REPLACEMENT_CHARACTER 0xFFFD
+
 namespace Lemon {
-    
+
 std::vector<int32_t> UTF8ToUTF32(const std::string& utf8String);
+
+/////////////////////////////
+/// \brief Decode length bytes of UTF-8 at str into codepoints
+///
+/// codepoints is resized to fit, so a vector kept between calls is only allocated once.
+/// Runs of ASCII are converted 16 bytes at a time.
+/// Invalid or incomplete sequences each give UNICODE_REPLACEMENT_CHARACTER.
+/////////////////////////////
+void UTF8ToUTF32(const char* str, size_t length, std::vector<int32_t>& codepoints);
+
 unsigned UTF8Strlen(const std::string& utf8String);
+// Count of codepoints in length bytes at str, the same as UTF8ToUTF32 gives (one per invalid byte)
+size_t UTF8Strlen(const char* str, size_t length);
 
 // Get the position of bytes n codepoints in
 // if n < 0, go backwards
 unsigned UTF8SkipCodepoints(const std::string& utf8String, long n);
 
-};
\ No newline at end of file
+// Whether length bytes at str are valid UTF-8 (no overlong encodings, surrogates or codepoints past U+10FFFF)
+bool UTF8Validate(const char* str, size_t length);
+
+// Number of ASCII bytes at the start of str
+size_t ASCIIPrefix(const char* str, size_t length);
+// Number of printable ASCII bytes (' ' to '~') at the start of str
+size_t ASCIIPrintablePrefix(const char* str, size_t length);
+
+};
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <Lemon/Graphics/Colour.h>
+#include <Lemon/Graphics/Font.h>
+#include <Lemon/Graphics/Rect.h>
+#include <Lemon/Graphics/Surface.h>
+
+#include <climits>
+#include <string>
+#include <vector>
+
+#define DISPLAY_LIST_BAND_HEIGHT 64  // Rows of the surface drawn together
+#define DISPLAY_LIST_MAX_OCCLUDERS 32 // Later opaque draws checked when culling
+
+namespace Lemon::Graphics {
+
+/////////////////////////////
+/// \brief Records draw commands to be drawn at once
+///
+/// Commands hidden by later opaque ones are dropped, then the surface is drawn in bands of rows,
+/// each band only going through the commands touching it. Bands are independent so can be drawn
+/// by several threads. The result is the same as calling the immediate functions in the order recorded.
+/////////////////////////////
+class DisplayList {
+public:
+    inline bool IsEmpty() const { return m_commands.empty(); }
+    inline size_t Size() const { return m_commands.size(); }
+
+    void Clear();
+
+    // Same as Graphics::DrawRect, which writes the colour without blending
+    void DrawRect(const Rect& rect, const RGBAColour& colour, const Rect& clip = {0, 0, INT_MAX, INT_MAX});
+    void DrawRoundedRect(const Rect& rect, const RGBAColour& colour, int topLeftRadius, int topRightRadius,
+                         int bottomRightRadius, int bottomLeftRadius, const Rect& clip = {0, 0, INT_MAX, INT_MAX});
+    // Glyphs are rasterised as the string is recorded, so bands can be drawn by several threads
+    void DrawString(const std::string& str, const Vector2i& pos, const RGBAColour& colour,
+                    const Rect& clip = {0, 0, INT_MAX, INT_MAX}, Font* font = DefaultFont());
+    // The surfaces must stay valid until the list has been drawn
+    void Blit(const Surface* src, const Vector2i& offset, const Rect& region,
+              const Rect& clip = {0, 0, INT_MAX, INT_MAX});
+    void AlphaBlit(const Surface* src, const Vector2i& offset, const Rect& region,
+                   const Rect& clip = {0, 0, INT_MAX, INT_MAX});
+
+    /////////////////////////////
+    /// \brief Draw the recorded commands to surface
+    ///
+    /// The list is kept, so can be drawn again.
+    ///
+    /// \param threads Threads to draw with, including the caller
+    /////////////////////////////
+    void Execute(Surface* surface, int threads = 1);
+
+private:
+    enum CommandType {
+        CommandRect,
+        CommandRoundedRect,
+        CommandString,
+        CommandBlit,
+        CommandAlphaBlit,
+    };
+
+    struct Command {
+        CommandType type;
+        Rect bounds; // Pixels which may be touched, within the clip
+        Rect clip;
+        RGBAColour colour;
+
+        Vector2i pos;
+        Rect region; // Of the source surface for blits
+
+        union {
+            const Surface* src;
+            Font* font;
+            int radii[4];
+        };
+        size_t text; // Offset of the string in m_text
+    };
+
+    // Add the command if any of rect is within its clip
+    void Record(Command& command, const Rect& rect);
+    // Record a blit, clamping region to the source surface
+    void RecordBlit(CommandType type, const Surface* src, const Vector2i& offset, const Rect& region, const Rect& clip);
+    // Mark commands entirely covered by later opaque ones
+    void Cull();
+    // Draw the commands touching a band with their clips limited to the rows top to bottom
+    void DrawBand(Surface* surface, size_t band, int top, int bottom);
+
+    std::vector<Command> m_commands;
+    std::string m_text; // Strings of the commands, each null terminated
+
+    std::vector<bool> m_culled;
+    std::vector<std::vector<uint32_t>> m_bands; // Commands touching each band, in order
+};
+} // namespace Lemon::Graphics
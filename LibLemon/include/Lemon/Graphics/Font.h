@@ -1,8 +1,60 @@
 #pragma once
 
+#include <cstdint>
 #include <exception>
+#include <unordered_map>
+#include <vector>
+
+#define GLYPH_ATLAS_MIN_WIDTH 256
 
 namespace Lemon::Graphics {
+struct Font;
+
+// A glyph rasterised into the atlas of its font
+struct Glyph {
+    unsigned index; // FreeType glyph index, used for kerning
+    int top;        // Offset of the top of the bitmap above the baseline
+    int width;
+    int height;
+    int advance;
+    int atlasX; // Position of the bitmap in the atlas
+    int atlasY;
+};
+
+/////////////////////////////
+/// \brief Glyphs of a font rasterised so far
+///
+/// Fonts are loaded at a single size, so glyphs are keyed by codepoint.
+/// Bitmaps are 8-bit coverage packed into shelves of an atlas which only ever grows downwards,
+/// so a glyph keeps its place once rasterised.
+/////////////////////////////
+class GlyphCache {
+public:
+    GlyphCache(int atlasWidth) : m_atlasWidth(atlasWidth) {}
+
+    /////////////////////////////
+    /// \brief Get a glyph, rasterising it on first use
+    ///
+    /// \return The glyph, or nullptr if it could not be rasterised
+    /////////////////////////////
+    const Glyph* Get(Font* font, uint32_t codepoint);
+
+    inline const uint8_t* Atlas() const { return m_atlas.data(); }
+    inline int AtlasWidth() const { return m_atlasWidth; }
+
+private:
+    bool Rasterise(Font* font, uint32_t codepoint, Glyph& glyph);
+
+    const Glyph* m_ascii[128] = {}; // Looked up without hashing
+    std::unordered_map<uint32_t, Glyph> m_glyphs;
+
+    std::vector<uint8_t> m_atlas;
+    int m_atlasWidth;
+    int m_shelfX = 0;
+    int m_shelfY = 0;
+    int m_shelfHeight = 0;
+};
+
 struct Font {
     bool monospace = false;
     void* face;
@@ -12,6 +64,7 @@ struct Font {
     int width;
     int tabWidth = 4;
     char* id;
+    GlyphCache* glyphs = nullptr;
 };
 
 class FontException : public std::exception {
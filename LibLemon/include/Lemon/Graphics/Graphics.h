@@ -188,6 +188,23 @@ static inline uint32_t AlphaBlendF(uint32_t oldColour, uint8_t r, uint8_t g, uin
     return AlphaBlendInt(oldColour, RGBAColour::ToARGB({r, g, b, static_cast<uint8_t>(opacity * 255)}));
 }
 
+// Implementations of the copies, fills, blends and video conversion used for drawing
+enum GraphicsKernelSet {
+    KernelsAuto, // Picked by the features of the CPU at startup
+    KernelsScalar,
+    KernelsSSE2,
+    KernelsAVX2,
+};
+
+/////////////////////////////
+/// \brief Pick the implementation of the copies, fills, blends and video conversion used for drawing
+///
+/// For benchmarks comparing them, everything the process draws afterwards uses the set.
+///
+/// \return false if the CPU or OS cannot run the set
+/////////////////////////////
+bool UseGraphicsKernels(GraphicsKernelSet set);
+
 // PointInRect (rect, point) - Check if a point lies inside a rectangle
 bool PointInRect(rect_t rect, vector2i_t point);
 
@@ -224,6 +241,17 @@ inline void DrawRectOutline(rect_t rect, rgba_colour_t colour, surface_t* surfac
     DrawRectOutline(rect.pos.x, rect.pos.y, rect.size.x, rect.size.y, colour, surface, mask);
 }
 
+/////////////////////////////
+/// \brief Fill the set bits of a 1-bit bitmap 8 pixels wide, the most significant bit being leftmost
+///
+/// The bitmap is clipped once and each row is filled as runs of set bits.
+///
+/// \param rows First row of the bitmap
+/// \param stride Bytes from one row to the next
+/////////////////////////////
+void DrawMask8(int x, int y, const uint8_t* rows, int stride, int height, const RGBAColour& colour, surface_t* surface,
+               const Rect& mask = {0, 0, INT_MAX, INT_MAX});
+
 int DrawChar(int c, int x, int y, uint8_t r, uint8_t g, uint8_t b, surface_t* surface, rect_t limits,
              Font* font = DefaultFont());
 int DrawChar(int c, int x, int y, uint8_t r, uint8_t g, uint8_t b, surface_t* surface, Font* font = DefaultFont());
@@ -247,6 +275,8 @@ uint32_t Interpolate(double q11, double q21, double q12, double q22, double x, d
 // LoadImage (const char*, int, int, int, int, surface_t*, bool) - Load image, scale to dimensions (w, h) and copy to
 // surface at offset (x, y)
 int LoadImage(const char* path, int x, int y, int w, int h, surface_t* surface, bool preserveAspectRatio);
+// GetImageSize (const char*, int&, int&) - Read the dimensions of the image at path without decoding it
+int GetImageSize(const char* path, int& width, int& height);
 // LoadImage (FILE* f, surface_t* surface) - Load image from open file and create a new surface
 int LoadImage(FILE* f, surface_t* surface);
 // LoadImage (const char* path, surface_t* surface) - Attempt to load image at path and create a new surface
@@ -14,4 +14,4 @@ inline void operator-=(vector2i_t& l, const vector2i_t& r) { l = l - r; }
 
 inline bool operator==(const vector2i_t& l, const vector2i_t& r) { return l.x == r.x && l.y == r.y; }
 
-inline bool operator!=(const vector2i_t& l, const vector2i_t& r) { return l.x != r.x && l.y != r.y; }
+inline bool operator!=(const vector2i_t& l, const vector2i_t& r) { return l.x != r.x || l.y != r.y; }
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <Lemon/Graphics/Rect.h>
+#include <Lemon/Graphics/Surface.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace Lemon::Graphics {
+
+// Pixel formats of video frames
+enum VideoFormat {
+    VideoFormatRGB32,  // One plane of 32-bit pixels, the same as a surface
+    VideoFormatYUV420, // BT.601 limited range, a Y plane then U and V planes at half the width and height
+    VideoFormatCount,
+};
+
+struct VideoFrame {
+    int format;
+    int width;
+    int height;
+    uint8_t* planes[3]; // Only the first is used by RGB32
+    int strides[3];     // Bytes from one row of each plane to the next
+};
+
+// Bytes taken by a frame laid out by VideoFrameLayout, 0 if the format or size is invalid
+size_t VideoFrameSize(int format, int width, int height);
+// Get the planes of a frame in buffer, one plane after another with their rows packed
+VideoFrame VideoFrameLayout(int format, int width, int height, uint8_t* buffer);
+
+/////////////////////////////
+/// \brief Scale a video frame to dest on surface, converting it to RGB
+///
+/// Scaling is nearest neighbour. Only the part of dest within clip is drawn,
+/// so a frame can be drawn in pieces by several threads at once.
+/////////////////////////////
+void DrawVideoFrame(const VideoFrame& frame, const Rect& dest, Surface* surface, const Rect& clip);
+
+} // namespace Lemon::Graphics
@@ -9,10 +9,15 @@
 #include <Lemon/Core/Logger.h>
 
 #include <Lemon/IPC/Message.h>
+#include <Lemon/IPC/MessageRing.h>
 
 #include <assert.h>
 #include <stdint.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <deque>
 
 namespace Lemon {
 class EndpointException : public std::exception {
@@ -40,10 +45,15 @@ public:
 
     Endpoint(const Lemon::Endpoint& other) = delete;
 
-    Endpoint(Lemon::Endpoint&& other) : m_handle(std::move(other.m_handle)), m_msgSize(other.m_msgSize) {
+    Endpoint(Lemon::Endpoint&& other)
+        : m_handle(std::move(other.m_handle)), m_msgSize(other.m_msgSize), m_ringInfo(other.m_ringInfo),
+          m_rxRing(other.m_rxRing), m_txRing(other.m_txRing), m_received(std::move(other.m_received)),
+          m_batchSize(other.m_batchSize), m_callTimeout(other.m_callTimeout) {
         assert(m_handle.get() > 0);
 
         other.m_handle = Handle();
+        other.m_ringInfo = {};
+        other.m_rxRing = other.m_txRing = MessageRing();
     }
 
     Endpoint(Handle h, uint16_t msgSize) {
@@ -100,17 +110,54 @@ public:
     }
 
     Lemon::Endpoint& operator=(Lemon::Endpoint&& other) {
+        UnmapRing();
+
         m_handle = std::move(other.m_handle);
         m_msgSize = other.m_msgSize;
+        m_ringInfo = other.m_ringInfo;
+        m_rxRing = other.m_rxRing;
+        m_txRing = other.m_txRing;
+        FreeReceived();
+        m_received = std::move(other.m_received);
+        m_batchSize = other.m_batchSize;
+        m_callTimeout = other.m_callTimeout;
 
         assert(m_handle.get());
 
         other.m_handle = Handle();
+        other.m_ringInfo = {};
+        other.m_rxRing = other.m_txRing = MessageRing();
 
         return *this;
     }
 
-    ~Endpoint() = default;
+    ~Endpoint() {
+        UnmapRing();
+        FreeReceived();
+    }
+
+    /////////////////////////////
+    /// \brief Send and receive messages through shared rings
+    ///
+    /// Messages are written straight into memory shared with the peer,
+    /// the kernel is only entered to wake the peer. Messages still go through the kernel
+    /// until the peer also maps the rings, and for calls.
+    ///
+    /// \return 0 on success, negative error code on failure
+    /////////////////////////////
+    inline long EnableRing() {
+        if (m_rxRing.IsValid()) {
+            return 0;
+        }
+
+        if (long ret = EndpointMapRing(m_handle.get(), m_ringInfo); ret) {
+            return ret;
+        }
+
+        m_rxRing = MessageRing(m_ringInfo.base, m_ringInfo.rxOffset);
+        m_txRing = MessageRing(m_ringInfo.base, m_ringInfo.txOffset);
+        return 0;
+    }
 
     /////////////////////////////
     /// \brief Close Endpoint
@@ -119,6 +166,7 @@ public:
     /// the actual endpoint will be destroyed when any peers destroy their handles
     /////////////////////////////
     inline void Close() {
+        UnmapRing();
         DestroyKObject(m_handle.get());
 
         m_handle = Handle();
@@ -143,37 +191,121 @@ public:
     inline uint16_t GetMessageSize() const { return m_msgSize; }
 
     inline long Queue(uint64_t id, const uint8_t* data, uint16_t size) {
+        if (QueueRing(id, data, size)) {
+            return 0;
+        }
+
         return EndpointQueue(m_handle.get(), id, size, reinterpret_cast<uintptr_t>(data));
     }
 
     inline long Queue(uint64_t id, uint64_t data, uint16_t size) {
-        return EndpointQueue(m_handle.get(), id, size, data);
+        return Queue(id, reinterpret_cast<const uint8_t*>(data), size);
     }
 
     inline long Queue(const Message& m) {
-        return EndpointQueue(m_handle.get(), m.id(), m.length(), reinterpret_cast<uintptr_t>(m.data()));
+        if (m.memory()) {
+            return Queue(&m, 1); // Memory can only be attached through the kernel
+        }
+
+        return Queue(m.id(), m.data(), m.length());
+    }
+
+    /////////////////////////////
+    /// \brief Queue several messages
+    ///
+    /// Messages that do not fit in the ring of the peer are sent through the kernel
+    /// ENDPOINT_BATCH_MAX at a time.
+    ///
+    /// \return 0 on success, negative error code on failure
+    /////////////////////////////
+    inline long Queue(const Message* messages, size_t count) {
+        EndpointMessageDescriptor batch[ENDPOINT_BATCH_MAX];
+
+        size_t i = 0;
+        while (i < count) {
+            unsigned batchCount = 0;
+            for (; i < count && batchCount < ENDPOINT_BATCH_MAX; i++) {
+                const Message& m = messages[i];
+                if (!batchCount && !m.memory() && QueueRing(m.id(), m.data(), m.length())) {
+                    continue; // Keep messages in order, only use the ring when nothing is waiting for the kernel
+                }
+
+                batch[batchCount++] = {.id = m.id(),
+                                       .data = reinterpret_cast<uintptr_t>(m.data()),
+                                       .memory = reinterpret_cast<uintptr_t>(m.memory()),
+                                       .memorySize = m.memorySize(),
+                                       .size = m.length(),
+                                       .reserved = {}};
+            }
+
+            for (unsigned queued = 0; queued < batchCount;) {
+                long ret = EndpointQueueBatch(m_handle.get(), batch + queued, batchCount - queued);
+                if (ret < 0) {
+                    return ret;
+                }
+                queued += ret;
+            }
+        }
+
+        return 0;
     }
 
     inline long Poll(Message& m) {
+        if (!m_received.empty()) {
+            EndpointMessageDescriptor& front = m_received.front();
+            m.Set(reinterpret_cast<uint8_t*>(front.data), front.size, front.id);
+            m.AttachMemory(reinterpret_cast<void*>(front.memory), front.memorySize);
+
+            m_received.pop_front();
+            return 1;
+        }
+
         uint64_t id;
         uint16_t size;
         uint8_t* data = new uint8_t[m_msgSize];
-        long ret = EndpointDequeue(m_handle.get(), &id, &size, data);
+
+        if (m_rxRing.IsValid()) {
+            if (m_rxRing.Read(id, data, size)) {
+                m.Set(data, size, id);
+                return 1;
+            } else if (!m_rxRing.KernelPending()) {
+                delete[] data;
+                return 0; // Nothing in the kernel queue either, skip the syscall
+            }
+        }
+
+        if (m_batchSize > 1) {
+            delete[] data;
+            return PollBatch(m);
+        }
+
+        // Dequeue through the batch syscall so memory attached to the message is mapped
+        EndpointMessageDescriptor msg = {
+            .id = 0, .data = reinterpret_cast<uintptr_t>(data), .memory = 0, .memorySize = 0, .size = 0, .reserved = {}};
+        long ret = EndpointDequeueBatch(m_handle.get(), &msg, 1);
 
         if (ret > 0) {
-            m.Set(data, size, id);
+            m.Set(data, msg.size, msg.id);
+            m.AttachMemory(reinterpret_cast<void*>(msg.memory), msg.memorySize);
+            m_batchSize = 4; // There may be more, try taking a few at once next time
         } else {
             delete[] data;
         }
         return ret;
     }
 
+    /////////////////////////////
+    /// \brief Set how long calls wait for a response
+    ///
+    /// \param us Timeout in microseconds, -1 to wait forever
+    /////////////////////////////
+    inline void SetCallTimeout(int64_t us) { m_callTimeout = us; }
+
     inline long Call(const Message& call, Message& rmsg, uint64_t id) {
-        uint16_t size = call.length();
+        uint16_t size = m_msgSize;
         uint8_t* data = new uint8_t[m_msgSize];
 
-        long ret = EndpointCall(m_handle.get(), call.id(), reinterpret_cast<uintptr_t>(call.data()), id,
-                                reinterpret_cast<uintptr_t>(data), &size);
+        long ret = CallRaw(call, id, data, size);
 
         if (!ret) {
             rmsg.Set(data, size, id);
@@ -187,8 +319,7 @@ public:
         uint16_t size = call.length();
         uint8_t* data = const_cast<uint8_t*>(call.data());
 
-        long ret = EndpointCall(m_handle.get(), call.id(), reinterpret_cast<uintptr_t>(call.data()), id,
-                                reinterpret_cast<uintptr_t>(call.data()), &size);
+        long ret = CallRaw(call, id, data, size);
 
         if (!ret) {
             call.Set(data, size, id);
@@ -197,7 +328,118 @@ public:
     }
 
 protected:
+    // size is the size of the response buffer, replaced by the size of the response
+    inline long CallRaw(const Message& call, uint64_t id, uint8_t* response, uint16_t& size) {
+        if (m_callTimeout < 0) {
+            uint16_t callSize = call.length();
+            long ret = EndpointCall(m_handle.get(), call.id(), reinterpret_cast<uintptr_t>(call.data()), id,
+                                    reinterpret_cast<uintptr_t>(response), &callSize);
+            size = callSize;
+            return ret;
+        }
+
+        EndpointMessageDescriptor callDesc = {.id = call.id(),
+                                              .data = reinterpret_cast<uintptr_t>(call.data()),
+                                              .memory = 0,
+                                              .memorySize = 0,
+                                              .size = call.length(),
+                                              .reserved = {}};
+        EndpointMessageDescriptor responseDesc = {.id = id,
+                                                  .data = reinterpret_cast<uintptr_t>(response),
+                                                  .memory = 0,
+                                                  .memorySize = 0,
+                                                  .size = size,
+                                                  .reserved = {}};
+
+        long ret = EndpointCallTimeout(m_handle.get(), callDesc, responseDesc, m_callTimeout);
+        size = responseDesc.size;
+        return ret;
+    }
+
+    // Write a message to the ring of the peer, returns false if it has to go through the kernel
+    inline bool QueueRing(uint64_t id, const uint8_t* data, uint16_t size) {
+        if (!m_txRing.IsValid() || !m_txRing.CanWrite()) {
+            return false;
+        }
+
+        int ret = m_txRing.Write(id, data, size);
+        if (ret < 0) {
+            return false; // Full
+        } else if (ret) {
+            EndpointNotify(m_handle.get());
+        }
+        return true;
+    }
+
+    // Take as many messages as we think are queued in one syscall
+    inline long PollBatch(Message& m) {
+        unsigned count = m_batchSize;
+        if (m_rxRing.IsValid()) {
+            // The ring tells us how many are queued
+            count = std::clamp<unsigned>(m_rxRing.KernelQueued(), 1, ENDPOINT_BATCH_MAX);
+        }
+
+        EndpointMessageDescriptor batch[ENDPOINT_BATCH_MAX];
+        for (unsigned i = 0; i < count; i++) {
+            batch[i] = {.id = 0,
+                        .data = reinterpret_cast<uintptr_t>(new uint8_t[m_msgSize]),
+                        .memory = 0,
+                        .memorySize = 0,
+                        .size = 0,
+                        .reserved = {}};
+        }
+
+        long ret = EndpointDequeueBatch(m_handle.get(), batch, count);
+
+        unsigned received = std::max(ret, 0L);
+        for (unsigned i = received; i < count; i++) {
+            delete[] reinterpret_cast<uint8_t*>(batch[i].data);
+        }
+
+        if (ret <= 0) {
+            m_batchSize = 1;
+            return ret;
+        }
+
+        // Grow the batch whilst the queue stays deep, go back to single messages once it is drained
+        if (received == count) {
+            m_batchSize = std::min<unsigned>(count * 2, ENDPOINT_BATCH_MAX);
+        } else {
+            m_batchSize = received;
+        }
+
+        m.Set(reinterpret_cast<uint8_t*>(batch[0].data), batch[0].size, batch[0].id);
+        m.AttachMemory(reinterpret_cast<void*>(batch[0].memory), batch[0].memorySize);
+        m_received.insert(m_received.end(), batch + 1, batch + received);
+        return 1;
+    }
+
+    inline void FreeReceived() {
+        for (auto& msg : m_received) {
+            delete[] reinterpret_cast<uint8_t*>(msg.data);
+        }
+        m_received.clear();
+    }
+
+    inline void UnmapRing() {
+        if (m_ringInfo.base) {
+            munmap(reinterpret_cast<void*>(m_ringInfo.base), m_ringInfo.size);
+        }
+
+        m_ringInfo = {};
+        m_rxRing = m_txRing = MessageRing();
+    }
+
     Handle m_handle;
     uint16_t m_msgSize = 512;
+
+    MessageRingInfo m_ringInfo = {};
+    MessageRing m_rxRing;
+    MessageRing m_txRing;
+
+    std::deque<EndpointMessageDescriptor> m_received; // Messages dequeued by a batch and not yet polled
+    unsigned m_batchSize = 1; // Messages to dequeue at once, grows whilst the queue is deep
+
+    int64_t m_callTimeout = -1;
 };
 }; // namespace Lemon
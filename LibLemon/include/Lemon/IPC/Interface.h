@@ -1,6 +1,7 @@
 #pragma once
 
 #include <Lemon/IPC/Message.h>
+#include <Lemon/IPC/MessageRing.h>
 #include <string.h>
 
 #include <list>
@@ -64,6 +65,8 @@ private:
 
     // Repopulate the std::vector of raw handles
     void RepopulateRawHandles();
+    // Dequeue up to count messages from a client in one syscall onto m_queue
+    long DequeueBatch(const Handle& client, unsigned count);
 
 protected:
     struct InterfaceMessageInfo {
@@ -71,13 +74,19 @@ protected:
         uint64_t id;
         uint8_t* data = nullptr;
         uint16_t length = 0;
+
+        void* memory = nullptr; // Memory attached to the message
+        size_t memorySize = 0;
     };
 
     std::map<std::string, int> m_objects;
     std::vector<handle_t> m_rawEndpoints;
     std::list<Handle> m_endpoints;
+    // Rings of clients read without entering the kernel
+    std::map<handle_t, std::pair<MessageRingInfo, MessageRing>> m_rings;
     uint16_t m_msgSize;
     uint8_t* m_dataBuffer = nullptr;
+    uint8_t* m_batchBuffers[ENDPOINT_BATCH_MAX] = {}; // Buffers for DequeueBatch, allocated when first used
 
     std::deque<InterfaceMessageInfo> m_queue;
 };
@@ -7,6 +7,8 @@
 #include <stdint.h>
 #include <string.h>
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include <vector>
 
 namespace Lemon {
@@ -18,12 +20,19 @@ enum CoreMessageIDs {
 
 using MessageRawDataObject = std::pair<uint8_t*, uint16_t>; // length, data
 
+// Objects are encoded in place with a fixed layout, so anything without a specialisation
+// (std::string, std::string_view, MessageRawDataObject) must be trivially copyable
+template <typename T> inline constexpr bool IsFlatMessageObject = std::is_trivially_copyable_v<T>;
+
 class Message final {
     friend class Interface;
     friend class Endpoint;
 
   public:
-    template <typename T> static uint16_t GetSize(const T& obj) { return sizeof(obj); }
+    template <typename T> static uint16_t GetSize(const T& obj) {
+        static_assert(IsFlatMessageObject<T>, "Message objects must be trivially copyable");
+        return sizeof(obj);
+    }
 
     template <typename... T> inline static uint16_t GetSize(const T&... objects) { return (GetSize(objects) + ...); }
 
@@ -62,7 +71,20 @@ class Message final {
 
     Message(uint8_t* data, uint16_t size, uint64_t id) : m_id(id), m_size(size), m_data(data) {}
 
-    explicit Message(const Message& m) : m_id(m.m_id), m_size(m.m_size), m_data(new uint8_t[m.m_size]) {
+    /////////////////////////////
+    /// \brief Encode objects into a buffer owned by the caller
+    ///
+    /// \param buffer Buffer of at least size bytes, e.g. on the stack
+    /// \param size Size of the encoded objects, see GetSize()
+    /////////////////////////////
+    template <typename... T> static void Encode(uint8_t* buffer, uint16_t size, const T&... objects) {
+        Message m(buffer, size, 0, objects...);
+        m.m_data = nullptr; // Do not free the buffer
+    }
+
+    explicit Message(const Message& m)
+        : m_id(m.m_id), m_size(m.m_size), m_data(new uint8_t[m.m_size]), m_memory(m.m_memory),
+          m_memorySize(m.m_memorySize) {
         memcpy(m_data, m.m_data, m_size);
     }
 
@@ -70,9 +92,13 @@ class Message final {
         m_id = m.m_id;
         m_size = m.m_size;
         m_data = m.m_data;
+        m_memory = m.m_memory;
+        m_memorySize = m.m_memorySize;
 
         m.m_size = 0;
         m.m_data = nullptr;
+        m.m_memory = nullptr;
+        m.m_memorySize = 0;
 
         return *this;
     }
@@ -81,8 +107,25 @@ class Message final {
         m_id = id;
         m_size = size;
         m_data = data;
+        m_memory = nullptr;
+        m_memorySize = 0;
+    }
+
+    /////////////////////////////
+    /// \brief Attach memory to the message
+    ///
+    /// The memory is handed to the receiver without being copied and must be a whole mapping
+    /// (e.g. from mmap). Private anonymous memory is moved and unmapped from the sender,
+    /// shared memory is shared with the receiver. The receiver unmaps it with munmap once done with it.
+    /////////////////////////////
+    inline void AttachMemory(void* memory, size_t size) {
+        m_memory = memory;
+        m_memorySize = size;
     }
 
+    inline void* memory() const { return m_memory; }
+    inline size_t memorySize() const { return m_memorySize; }
+
     template <typename... T> long Decode(T&... objects) const {
         if (!m_data) {
             return ErrorBufferNotInitialized;
@@ -111,8 +154,13 @@ class Message final {
     uint16_t m_size;
     uint8_t* m_data;
 
+    void* m_memory = nullptr; // Memory attached to the message, not owned by the message
+    size_t m_memorySize = 0;
+
     Message& operator=(const Message& m);
     template <typename T> void Insert(uint16_t& pos, const T& obj) {
+        static_assert(IsFlatMessageObject<T>, "Message objects must be trivially copyable");
+
         memcpy(&m_data[pos], &obj, sizeof(T));
         pos += sizeof(T);
     }
@@ -120,13 +168,14 @@ class Message final {
     template <> void Insert(uint16_t& pos, const std::string& obj);
 
     template <typename O> long Decode(uint16_t& pos, O& o) const {
-        uint8_t* currentData = m_data + pos;
+        static_assert(IsFlatMessageObject<O>, "Message objects must be trivially copyable");
 
         if (pos + sizeof(O) > m_size) {
             return ErrorDecodeOutOfBounds;
         }
 
-        o = *(O*)currentData;
+        // Objects are not aligned within the message
+        memcpy(&o, m_data + pos, sizeof(O));
         pos += sizeof(O);
 
         return 0;
@@ -149,11 +198,19 @@ template <> uint16_t Message::GetSize<MessageRawDataObject>(const MessageRawData
 
 template <> uint16_t Message::GetSize<std::string>(const std::string& obj);
 
+template <> uint16_t Message::GetSize<std::string_view>(const std::string_view& obj);
+
 template <> void Message::Insert<MessageRawDataObject>(uint16_t& pos, const MessageRawDataObject& obj);
 
 template <> void Message::Insert<std::string>(uint16_t& pos, const std::string& obj);
 
+template <> void Message::Insert<std::string_view>(uint16_t& pos, const std::string_view& obj);
+
 template <> long Message::Decode<MessageRawDataObject>(uint16_t& pos, MessageRawDataObject& obj) const;
 
 template <> long Message::Decode<std::string>(uint16_t& pos, std::string& obj) const;
+
+// Decodes a string without copying it, the view points into the message
+// and is only valid for as long as the message is
+template <> long Message::Decode<std::string_view>(uint16_t& pos, std::string_view& obj) const;
 } // namespace Lemon
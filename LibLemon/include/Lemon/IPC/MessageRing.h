@@ -0,0 +1,98 @@
+#pragma once
+
+#include <Lemon/System/ABI/MessageRing.h>
+
+#include <stdint.h>
+#include <string.h>
+
+namespace Lemon {
+// One direction of the shared message rings of an endpoint (see EndpointMapRing)
+class MessageRing final {
+public:
+    MessageRing() = default;
+
+    MessageRing(uintptr_t base, uint32_t offset) : m_header(reinterpret_cast<MessageRingHeader*>(base + offset)) {
+        // Keep our own copy as the peer can write to the header
+        m_slotCount = m_header->slotCount;
+        m_slotSize = m_header->slotSize;
+    }
+
+    inline bool IsValid() const { return m_header && m_slotCount; }
+
+    // Whether the reader has mapped the ring and is not waiting on a response through the kernel
+    inline bool CanWrite() const {
+        return (__atomic_load_n(&m_header->flags, __ATOMIC_ACQUIRE) & MESSAGE_RING_READER_MAPPED) &&
+               !__atomic_load_n(&m_header->callPending, __ATOMIC_ACQUIRE);
+    }
+
+    // Whether messages were queued through the kernel or the writer has gone away,
+    // in either case the endpoint has to be read through the kernel
+    inline bool KernelPending() const {
+        return __atomic_load_n(&m_header->queued, __ATOMIC_ACQUIRE) ||
+               (__atomic_load_n(&m_header->flags, __ATOMIC_ACQUIRE) & MESSAGE_RING_WRITER_CLOSED);
+    }
+
+    // Amount of messages in the kernel queue of the reader
+    inline uint32_t KernelQueued() const { return __atomic_load_n(&m_header->queued, __ATOMIC_ACQUIRE); }
+
+    /////////////////////////////
+    /// \brief Write a message to the ring
+    ///
+    /// \return 1 if the reader has to be woken with EndpointNotify, 0 if not, -1 if the message does not fit
+    /////////////////////////////
+    inline int Write(uint64_t id, const uint8_t* data, uint16_t size) {
+        if (size > m_slotSize - sizeof(MessageRingSlot)) {
+            return -1;
+        }
+
+        uint32_t tail = m_header->tail;
+        if (tail - __atomic_load_n(&m_header->head, __ATOMIC_ACQUIRE) >= m_slotCount) {
+            return -1; // Full
+        }
+
+        MessageRingSlot* slot = Slot(tail);
+        slot->id = id;
+        slot->size = size;
+        memcpy(slot->data, data, size);
+
+        // Ordered against the kernel setting readerWaiting before checking the ring
+        __atomic_store_n(&m_header->tail, tail + 1, __ATOMIC_SEQ_CST);
+        return __atomic_load_n(&m_header->readerWaiting, __ATOMIC_SEQ_CST) ? 1 : 0;
+    }
+
+    /////////////////////////////
+    /// \brief Read a message from the ring
+    ///
+    /// \param data Buffer of at least the message size of the endpoint
+    ///
+    /// \return 1 on success, 0 if the ring is empty
+    /////////////////////////////
+    inline int Read(uint64_t& id, uint8_t* data, uint16_t& size) {
+        uint32_t head = m_header->head;
+        if (head == __atomic_load_n(&m_header->tail, __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+
+        MessageRingSlot* slot = Slot(head);
+        id = slot->id;
+        size = slot->size;
+        if (size > m_slotSize - sizeof(MessageRingSlot)) {
+            size = m_slotSize - sizeof(MessageRingSlot);
+        }
+        memcpy(data, slot->data, size);
+
+        __atomic_store_n(&m_header->head, head + 1, __ATOMIC_RELEASE);
+        return 1;
+    }
+
+private:
+    inline MessageRingSlot* Slot(uint32_t counter) {
+        return reinterpret_cast<MessageRingSlot*>(reinterpret_cast<uint8_t*>(m_header + 1) +
+                                                  static_cast<size_t>(counter % m_slotCount) * m_slotSize);
+    }
+
+    MessageRingHeader* m_header = nullptr;
+    uint32_t m_slotCount = 0;
+    uint32_t m_slotSize = 0;
+};
+} // namespace Lemon
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdint.h>
+
 enum SoundEncoding {
     PCMS16LE = 0, // PCM signed 16-bit little endian
     PCMS20LE = 1,
@@ -12,14 +14,31 @@ enum AudioMixerIoCtl {
     IoCtlMixerGetMasterVolume = 0x1001,
 };
 
+// Each open of /dev/snd/pcm is a stream of the kernel mixer,
+// which converts it to the format and rate of the output and adds it to every other stream.
+// Streams start out in the format of the output.
 enum AudioOutputIoCtl {
-    IoCtlOutputSetVolume = 0x1000,
+    IoCtlOutputSetVolume = 0x1000, // Volume of the stream, as a percentage
     IoCtlOutputGetVolume = 0x1001,
     IoCtlOutputGetEncoding = 0x1002,
     IoCtlOutputGetSampleRate = 0x1003,
     IoCtlOutputSetNumberOfChannels = 0x1004,
     IoCtlOutputGetNumberOfChannels = 0x1005,
     IoCtlOutputSetAsync = 0x1006,
+    IoCtlOutputMapRing = 0x1007,     // Map the ring of the stream into the caller, arg points to an AudioRingInfo
+    IoCtlOutputGetPosition = 0x1008, // Offset into the ring the mixer reads from next
+    IoCtlOutputCommit = 0x1009,      // arg is the amount of bytes written to the ring since the last commit
+    IoCtlOutputSetSampleRate = 0x100A,
+    IoCtlOutputSetEncoding = 0x100B,
+};
+
+// Samples are queued in the ring of the stream, either by write()
+// or by writing them into the mapped ring and committing them.
+// Changing the format of the stream drops anything queued.
+struct AudioRingInfo {
+    uint64_t base;       // Address of the ring in the caller
+    uint32_t size;       // Size of the ring in bytes
+    uint32_t periodSize; // Bytes the mixer takes at a time
 };
 
 #define LEMON_ABI_AUDIO_ENCODING_COUNT 2
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+
+#define DISK_LATENCY_BUCKETS 20 // Buckets of the latency histograms of DiskStatistics
+
+// Filled by RequestDeviceGetDiskStatistics, counters are since the disk was found
+struct DiskStatistics {
+    // Transfers carried out by the driver, one transfer may carry several merged requests
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t bytesRead;
+    uint64_t bytesWritten;
+    uint64_t errors; // Transfers the driver failed
+
+    uint64_t requests;       // Requests submitted to the disk's queue
+    uint64_t mergedRequests; // Requests carried out as part of an earlier request's transfer
+    uint64_t queueTimeUs;    // Total time requests waited in the queue before being dispatched
+
+    uint32_t queued;            // Requests currently waiting in the queue
+    uint32_t inFlight;          // Transfers currently being carried out by the driver
+    uint32_t inFlightHighWater; // Most transfers carried out by the driver at once
+    uint32_t reserved;
+
+    uint64_t busyUs;     // Time with at least one transfer in flight
+    uint64_t inFlightUs; // Total time taken by every transfer, over elapsed time this is the average queue depth
+
+    // Bucket n counts transfers that took less than 2^n microseconds, the last bucket counts the rest
+    uint64_t readLatency[DISK_LATENCY_BUCKETS];
+    uint64_t writeLatency[DISK_LATENCY_BUCKETS];
+};
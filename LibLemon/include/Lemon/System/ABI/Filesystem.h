@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdint.h>
+
+// Directory entry filled by SYS_READDIR_BATCH, matches fs_dirent_t in the kernel
+typedef struct LemonDirent {
+    uint32_t inode; // Inode number
+    uint32_t type;  // DT_* type, DT_UNKNOWN if the filesystem does not give it
+    char name[255]; // Null terminated filename
+} lemon_dirent_t;
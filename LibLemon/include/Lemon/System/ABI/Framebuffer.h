@@ -6,4 +6,12 @@ typedef struct FBInfo {
     uint16_t bpp;    // Resolution depth/bits per pixel
 
     uint32_t pitch; // Video mode pitch
+
+    uint32_t pageCount; // Pages of the mapped framebuffer, each is pitch * height bytes
 } __attribute__((packed)) fb_info_t;
+
+// ioctls of /dev/fb0
+enum FramebufferIoCtl {
+    IoCtlFramebufferFlip = 0x1000,    // Scan out of the page in arg on the next vertical blank
+    IoCtlFramebufferGetPage = 0x1001, // Page being scanned out of
+};
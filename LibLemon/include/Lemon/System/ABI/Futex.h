@@ -0,0 +1,16 @@
+#pragma once
+
+// Operations of SYS_FUTEX, the values match Linux
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
+#define FUTEX_REQUEUE 3
+#define FUTEX_CMP_REQUEUE 4
+#define FUTEX_WAIT_BITSET 9
+#define FUTEX_WAKE_BITSET 10
+
+// The futex is only used by the calling process,
+// otherwise futexes in shared memory are matched across processes
+#define FUTEX_PRIVATE_FLAG 128
+#define FUTEX_CMD_MASK (~FUTEX_PRIVATE_FLAG)
+
+#define FUTEX_BITSET_MATCH_ANY 0xffffffff
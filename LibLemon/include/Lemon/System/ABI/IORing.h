@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdint.h>
+
+// Submission and completion rings shared between a process and the kernel (see SYS_IORING_CREATE)
+//
+// The process writes submissions to the submission ring and calls SYS_IORING_ENTER,
+// which runs every submitted operation in one call. Operations that cannot complete straight away
+// (e.g. reading a socket with no data) are kept by the kernel and completed on a later SYS_IORING_ENTER,
+// including whilst it waits for completions. Completions are written to the completion ring
+// in the order operations complete, matched to submissions with userData.
+
+#define IORING_MAX_ENTRIES 4096 // Most submission ring entries, the completion ring has twice as many
+
+// Operations
+#define IORING_OP_NOP 0
+#define IORING_OP_READ 1   // read(fd, addr, len), or pread at offset with IORING_SUBMIT_OFFSET
+#define IORING_OP_WRITE 2  // write(fd, addr, len), or pwrite at offset with IORING_SUBMIT_OFFSET
+#define IORING_OP_ACCEPT 3 // accept(fd, nullptr, nullptr), opFlags are the handle's mode
+#define IORING_OP_RECV 4   // recv(fd, addr, len, opFlags)
+#define IORING_OP_SEND 5   // send(fd, addr, len, opFlags)
+#define IORING_OP_POLL 6   // Wait for the poll events in opFlags on fd, result is the returned events
+
+// Submission flags
+#define IORING_SUBMIT_OFFSET 0x1 // Use offset instead of (and without changing) the file position
+
+struct IORingHeader {
+    uint32_t sqHead; // Next submission read by the kernel, only written by the kernel
+    uint32_t sqTail; // Next submission written by the process, only written by the process
+    uint32_t sqMask; // Entries - 1
+    uint32_t sqEntries;
+
+    uint32_t cqHead; // Next completion read by the process, only written by the process
+    uint32_t cqTail; // Next completion written by the kernel, only written by the kernel
+    uint32_t cqMask;
+    uint32_t cqEntries;
+
+    uint32_t pending; // Operations waiting to complete
+    uint8_t reserved[28];
+};
+
+static_assert(sizeof(IORingHeader) == 64);
+
+struct IORingSubmission {
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t reserved;
+    int32_t fd;
+    uint64_t offset;
+    uint64_t addr; // Buffer
+    uint32_t len;
+    uint32_t opFlags;
+    uint64_t userData; // Copied to the completion
+};
+
+static_assert(sizeof(IORingSubmission) == 40);
+
+struct IORingCompletion {
+    uint64_t userData;
+    int64_t result; // What the equivalent syscall would return, negative error code on failure
+};
+
+static_assert(sizeof(IORingCompletion) == 16);
+
+// Filled by SYS_IORING_CREATE
+struct IORingInfo {
+    uint64_t base; // Address of the rings in the process
+    uint64_t size; // Size of the mapping
+    uint32_t sqOffset; // Offset of the IORingSubmission array
+    uint32_t cqOffset; // Offset of the IORingCompletion array
+};
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdint.h>
+
+#define ENDPOINT_BATCH_MAX 64 // Most messages moved by one SYS_ENDPOINT_QUEUE_BATCH or SYS_ENDPOINT_DEQUEUE_BATCH
+
+// Message of SYS_ENDPOINT_QUEUE_BATCH, SYS_ENDPOINT_DEQUEUE_BATCH and SYS_ENDPOINT_CALL_TIMEOUT
+struct EndpointMessageDescriptor {
+    uint64_t id;   // Set by the kernel on dequeue
+    uint64_t data; // Pointer to the message data, on dequeue a buffer of at least the maximum message size
+
+    // Memory attached to the message, 0 for none. On queue this must be a whole mapping, shared mappings are
+    // shared with the receiver and private anonymous mappings are moved (unmapped from the sender).
+    // On dequeue the kernel maps the memory into the receiver and sets these.
+    uint64_t memory;
+    uint64_t memorySize;
+
+    uint16_t size; // Set by the kernel on dequeue
+    uint8_t reserved[6];
+};
+
+static_assert(sizeof(EndpointMessageDescriptor) == 40);
+
+#define ENDPOINT_LATENCY_BUCKETS 16 // Buckets of the call latency histogram of EndpointStatistics
+
+// Filled by SYS_ENDPOINT_STATISTICS, counters are since the endpoint was created
+struct EndpointStatistics {
+    int64_t handle; // Handle ID of the endpoint in its process
+    uint16_t msgSize;
+    uint8_t reserved[6];
+
+    // Messages sent and received through the kernel queue (including calls and responses)
+    uint64_t messagesSent;
+    uint64_t bytesSent;
+    uint64_t messagesReceived;
+    uint64_t bytesReceived;
+
+    // Messages written to and read from the shared rings, these wrap at 2^32
+    uint32_t ringSent;
+    uint32_t ringReceived;
+
+    uint32_t queued;          // Messages currently waiting in the kernel queue
+    uint32_t queueHighWater;  // Most messages that have been waiting in the kernel queue at once
+    uint32_t queueLimit;      // Messages the endpoint may currently queue on its peer
+    uint32_t queueLimitMax;
+
+    uint64_t calls;       // Calls made on the endpoint that were answered
+    uint64_t callTimeouts; // Calls that timed out
+
+    // Bucket n counts answered calls that took less than 2^n microseconds, the last bucket counts the rest
+    uint64_t callLatency[ENDPOINT_LATENCY_BUCKETS];
+};
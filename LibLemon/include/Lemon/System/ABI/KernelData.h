@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+
+// Read only pages the kernel maps into every process at KERNEL_DATA_ADDRESS,
+// so that the clock and PID can be read without a system call.
+// The first page is shared by every process, the second belongs to the process.
+#define KERNEL_DATA_ADDRESS 0x7FBFFFE000 // Just below the dynamic linker
+#define KERNEL_DATA_SIZE 0x2000
+#define KERNEL_DATA_PROCESS_OFFSET 0x1000
+
+// Boot time clock, updated by the kernel on every timer tick.
+// The TSC is used to find the time since the last tick:
+//     ns = uptimeNs + ((MIN(TSC - tsc, maxTSCDelta) * tscMult) >> tscShift)
+// If sequence is odd or changes whilst being read, the clock is being updated and has to be read again.
+typedef struct {
+    uint32_t sequence;
+    uint32_t tscShift;
+    uint64_t uptimeNs;    // Time since boot at the last tick
+    uint64_t tsc;         // TSC at the last tick
+    uint64_t tscMult;     // 0 if the TSC cannot be used (not invariant or not calibrated yet)
+    uint64_t maxTSCDelta; // TSC cycles in a tick, so the clock never passes the next tick
+} lemon_clock_data_t;
+
+// At KERNEL_DATA_ADDRESS + KERNEL_DATA_PROCESS_OFFSET
+typedef struct {
+    int32_t pid;
+} lemon_process_data_t;
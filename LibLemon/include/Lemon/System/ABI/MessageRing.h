@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+
+// Shared message rings of a MessageEndpoint pair (see SYS_ENDPOINT_MAP_RING)
+//
+// There is one ring for each direction, messages are written in place by the sending process
+// and read in place by the receiving process. Each ring has one writer and one reader.
+// The kernel is only entered to wake the reader (SYS_ENDPOINT_NOTIFY) and for messages
+// sent through the kernel queue (SYS_ENDPOINT_QUEUE and SYS_ENDPOINT_CALL).
+
+#define MESSAGE_RING_SIZE 0x10000 // Size of a ring (excluding the header) before rounding to a whole page
+#define MESSAGE_RING_MIN_SLOTS 4
+#define MESSAGE_RING_MAX_SLOTS 256
+
+// Flags of a ring
+#define MESSAGE_RING_READER_MAPPED 0x1 // The reader has mapped the ring, otherwise messages must go through the kernel
+#define MESSAGE_RING_WRITER_CLOSED 0x2 // The writing endpoint has been destroyed
+
+struct MessageRingHeader {
+    uint32_t head; // Slot counter of the next message to be read, only written by the reader
+    uint32_t tail; // Slot counter of the next message to be written, only written by the writer
+    uint32_t slotCount;
+    uint32_t slotSize; // Size of each slot including the MessageRingSlot
+    uint32_t flags;
+
+    // Set by the kernel when the reader waits on the endpoint,
+    // the writer should call SYS_ENDPOINT_NOTIFY after writing if it is set
+    uint32_t readerWaiting;
+    // Messages in the kernel queue of the reader, read with SYS_ENDPOINT_DEQUEUE
+    uint32_t queued;
+    // The reader is waiting on a response in SYS_ENDPOINT_CALL, messages must go through the kernel
+    uint32_t callPending;
+
+    uint8_t reserved[32];
+};
+
+static_assert(sizeof(MessageRingHeader) == 64);
+
+struct MessageRingSlot {
+    uint64_t id;
+    uint16_t size;
+    uint8_t reserved[6];
+    uint8_t data[];
+};
+
+static_assert(sizeof(MessageRingSlot) == 16);
+
+// Filled by SYS_ENDPOINT_MAP_RING
+struct MessageRingInfo {
+    uint64_t base; // Address of the rings in the process
+    uint64_t size; // Size of the mapping, unmap with munmap once done with the endpoint
+    uint32_t rxOffset; // Offset of the MessageRingHeader of the ring the endpoint reads
+    uint32_t txOffset; // Offset of the MessageRingHeader of the ring the endpoint writes
+};
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <abi-bits/pid_t.h>
+#include <stdint.h>
+
+// System metrics kept up to date by the kernel in read only pages,
+// mapped into a process with SYS_MAP_METRICS so monitors can read them without a system call.
+#define METRICS_MAX_CPUS 64
+#define METRICS_MAX_PROCESSES 256
+#define METRICS_NAME_LENGTH 32
+
+// How often the kernel updates the metrics
+#define METRICS_UPDATE_INTERVAL_US 100000
+
+typedef struct {
+    uint64_t busyUs; // Time spent running threads since boot (in microseconds)
+    uint64_t idleUs; // Time spent idle since boot (in microseconds)
+
+    uint64_t contextSwitches;
+    uint64_t migrations;     // Amount of threads migrated onto this CPU
+    uint32_t runQueueLength; // Amount of threads (including blocked threads) queued
+    uint16_t id;             // APIC ID of the CPU
+} lemon_metrics_cpu_t;
+
+// Sizes are in KB, as in lemon_memory_info_t
+typedef struct {
+    uint64_t totalMem;
+    uint64_t usedMem;
+
+    uint64_t kernelHeap;
+    uint64_t pageCache;
+    uint64_t blockCache;
+    uint64_t anonymous;
+    uint64_t swapPool;
+    uint64_t swapped;
+    uint64_t swapDisk;
+} lemon_metrics_memory_t;
+
+typedef struct {
+    pid_t pid;
+    uint32_t threadCount;
+    uint8_t state;
+    uint8_t isCPUIdle;
+
+    char name[METRICS_NAME_LENGTH]; // Truncated process name
+
+    uint64_t runningTime; // Seconds since the process was created
+    uint64_t activeUs;    // CPU time used (in microseconds)
+
+    uint64_t usedMem; // Resident set in bytes
+    uint64_t ipcMem;  // Kernel memory held by messages queued on the endpoints of the process, in bytes
+
+    uint64_t contextSwitches;
+    uint64_t migrations;
+
+    uint64_t ipcMessagesSent;
+    uint64_t ipcMessagesReceived;
+    uint64_t ioReadBytes;  // Bytes read by read syscalls
+    uint64_t ioWriteBytes; // Bytes written by write syscalls
+} lemon_metrics_process_t;
+
+// If sequence is odd or changes whilst being read, the metrics are being updated and have to be read again.
+typedef struct {
+    uint32_t sequence;
+    uint32_t cpuCount;
+    uint32_t processCount; // Processes in processes, the rest are left out if there are more than METRICS_MAX_PROCESSES
+    uint32_t reserved;
+
+    uint64_t uptimeUs; // Time since boot when the metrics were updated
+
+    lemon_metrics_memory_t memory;
+    lemon_metrics_cpu_t cpus[METRICS_MAX_CPUS];
+    lemon_metrics_process_t processes[METRICS_MAX_PROCESSES];
+} lemon_metrics_t;
+
+#define METRICS_SIZE ((sizeof(lemon_metrics_t) + 0xFFF) & ~0xFFFUL)
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdint.h>
+
+// Lemon specific interface ioctls, in the SIOCDEVPRIVATE range
+#define SIOCSIFCONFIG 0x89F0 // Set the address, subnet mask and gateway of an interface at once
+
+// Used by SIOCSIFCONFIG, addresses are in network byte order
+struct InterfaceConfiguration {
+    char name[16];       // Interface name
+    uint32_t address;    // Interface IP address
+    uint32_t subnetMask; // Subnet mask
+    uint32_t gateway;    // Default gateway, 0 for none
+};
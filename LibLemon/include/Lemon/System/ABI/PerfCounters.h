@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+
+// Hardware events that can be counted
+enum {
+    PerfEventCycles = 0,
+    PerfEventInstructions = 1,
+    PerfEventCacheMisses = 2, // Last level cache misses
+    PerfEventBranchMisses = 3,
+    PerfEventCount,
+};
+
+#define PERF_EVENT_BIT(event) (1U << (event))
+
+// Operations of SYS_PERF_COUNTERS
+#define PERF_COUNTERS_START 0 // Start counting events of the calling thread, the counts are reset
+#define PERF_COUNTERS_STOP 1  // Stop counting, the counts can still be read
+#define PERF_COUNTERS_READ 2  // Read the counts of the calling thread
+
+// Filled by PERF_COUNTERS_START
+typedef struct {
+    uint32_t events; // Events being counted, events requested but not supported by the CPU are left out
+    // Counter of each event for rdpmc, -1 if the event is not counted.
+    // Counters are saved and restored on context switches so rdpmc reads the count of the calling thread.
+    int32_t rdpmcIndex[PerfEventCount];
+    uint32_t counterWidth; // Bits of the counters, rdpmc values wrap past this
+} lemon_perf_counters_t;
@@ -1,6 +1,16 @@
 #pragma once
 
 #include <abi-bits/pid_t.h>
+#include <stdint.h>
+
+// Scheduling classes, in order of priority
+enum {
+    SchedulingClassRealtime = 0,    // Always runs before other classes, requires root
+    SchedulingClassInteractive = 1, // Latency sensitive threads (e.g. compositor, audio)
+    SchedulingClassNormal = 2,      // Default scheduling class
+    SchedulingClassBatch = 3,       // Background work, runs with longer timeslices
+    SchedulingClassCount,
+};
 
 typedef struct LemonProcessInfo {
     pid_t pid; // Process ID
@@ -18,5 +28,60 @@ typedef struct LemonProcessInfo {
     uint64_t activeUs;
     bool isCPUIdle = false; // Whether or not the process is an idle process
 
-    uint64_t usedMem; // Used memory in KB
+    uint64_t usedMem;   // Memory mapped into the process (resident set) in bytes
+    uint64_t sharedMem; // Part of usedMem in shared mappings, in bytes
+    uint64_t cowMem;    // Part of usedMem shared copy on write (e.g. after fork), in bytes
+    uint64_t ipcMem;    // Kernel memory held by messages queued on the endpoints of the process, in bytes
+
+    uint64_t migrations; // Amount of times threads of the process have moved between CPUs
+
+    uint64_t contextSwitches;     // Amount of times threads of the process have been switched out
+    uint64_t voluntarySwitches;   // Switches caused by blocking or yielding
+    uint64_t involuntarySwitches; // Switches caused by the timeslice running out
+    uint64_t runQueueWaitUs;      // Total time spent runnable but waiting for a CPU (in microseconds)
+    uint64_t maxRunQueueWaitUs;   // Longest time a thread has waited for a CPU (in microseconds)
 } lemon_process_info_t;
+
+typedef struct LemonCPUInfo {
+    uint16_t id; // APIC ID of the CPU
+
+    uint64_t busyUs; // Time spent running threads since boot (in microseconds)
+    uint64_t idleUs; // Time spent idle since boot (in microseconds)
+
+    uint64_t contextSwitches; // Amount of context switches on this CPU
+    uint64_t migrations;      // Amount of threads migrated onto this CPU
+    uint64_t cacheMigrations; // Migrations from a CPU not sharing a last level cache
+
+    uint32_t runQueueLength; // Amount of threads (including blocked threads) queued
+
+    uint32_t numaNode;       // NUMA node of the CPU
+    uint64_t nodeMigrations; // Migrations from a CPU on another NUMA node
+} lemon_cpu_info_t;
+
+// System wide breakdown of physical memory use, all sizes are in KB
+typedef struct LemonMemoryInfo {
+    uint64_t totalMem; // Usable physical memory
+    uint64_t usedMem;  // Allocated physical memory, including memory not in any of the below
+
+    uint64_t kernelHeap; // Kernel heap (kmalloc), excluding the block cache
+    uint64_t pageCache;  // Cached pages of mapped files
+    uint64_t blockCache; // Filesystem block caches
+    uint64_t anonymous;  // Process memory not backed by a file
+    uint64_t swapPool;   // Memory used to hold compressed swapped out pages
+    uint64_t swapped;    // Swapped out memory (uncompressed size)
+    uint64_t swapDisk;   // Swapped out memory written to the swap partition
+} lemon_memory_info_t;
+
+#define SPAWN_ACTIONS_MAX 64
+
+// File actions of SYS_SPAWN, applied in order to the handles inherited by the child
+enum {
+    SpawnActionDup2 = 0,  // Make newFd refer to what fd does, with close on exec cleared
+    SpawnActionClose = 1, // Close fd, does nothing if fd is not open
+};
+
+typedef struct LemonSpawnAction {
+    int type;
+    int fd;
+    int newFd; // Only used by SpawnActionDup2
+} lemon_spawn_action_t;
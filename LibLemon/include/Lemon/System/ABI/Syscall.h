@@ -109,3 +109,36 @@
 #define SYS_EPOLL_CREATE 108
 #define SYS_EPOLL_CTL 109
 #define SYS_EPOLL_WAIT 110
+#define SYS_SET_SCHEDULING_CLASS 112
+#define SYS_GET_SCHEDULING_CLASS 113
+#define SYS_GET_CPU_INFO 114
+#define SYS_SET_AFFINITY 115
+#define SYS_GET_AFFINITY 116
+#define SYS_GET_MEMORY_INFO 117
+#define SYS_FUTEX 118
+#define SYS_ENDPOINT_MAP_RING 119
+#define SYS_ENDPOINT_NOTIFY 120
+#define SYS_ENDPOINT_QUEUE_BATCH 121
+#define SYS_ENDPOINT_DEQUEUE_BATCH 122
+#define SYS_ENDPOINT_CALL_TIMEOUT 123
+#define SYS_ENDPOINT_STATISTICS 124
+#define SYS_FSYNC 125
+#define SYS_READV 126
+#define SYS_WRITEV 127
+#define SYS_PREADV 128
+#define SYS_PWRITEV 129
+#define SYS_IORING_CREATE 130
+#define SYS_IORING_ENTER 131
+#define SYS_READDIR_BATCH 132
+#define SYS_SENDFILE 133
+#define SYS_SENDMMSG 134
+#define SYS_RECVMMSG 135
+#define SYS_SPAWN 136
+#define SYS_PERF_COUNTERS 137
+#define SYS_MAP_METRICS 138
+#define SYS_WAIT_SET_CREATE 139
+#define SYS_WAIT_SET_ADD 140
+#define SYS_WAIT_SET_REMOVE 141
+#define SYS_WAIT_SET_WAIT 142
+#define SYS_GROW_SHARED_MEMORY 143
+#define SYS_REGISTER_SERVICE 144
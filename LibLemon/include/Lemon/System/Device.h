@@ -1,5 +1,6 @@
 #pragma once
 
+#include <Lemon/System/ABI/Disk.h>
 #include <lemon/syscall.h>
 #include <stddef.h>
 
@@ -16,6 +17,7 @@ enum DeviceManagementRequests {
     RequestDeviceGetType,
     RequestDeviceGetChildCount,
     RequestDeviceEnumerateChildren,
+    RequestDeviceGetDiskStatistics,
 };
 
 enum DeviceType {
@@ -44,4 +46,7 @@ long ResolveDevice(const char* path);
 long DeviceGetName(int64_t id, char* name, size_t nameBufferSize);
 long DeviceGetInstanceName(int64_t id, char* name, size_t nameBufferSize);
 long DeviceGetType(int64_t id);
+
+// Get the I/O counters of a storage device (DeviceTypeStorageDevice)
+long DeviceGetDiskStatistics(int64_t id, DiskStatistics& stats);
 } // namespace Lemon
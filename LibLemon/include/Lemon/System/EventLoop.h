@@ -0,0 +1,107 @@
+#pragma once
+
+#include <Lemon/System/Waitable.h>
+
+#include <functional>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace Lemon {
+/////////////////////////////
+/// \brief Waits on IPC endpoints, file descriptors and timers at once
+///
+/// Everything watched is waited on with a single SysKernelObjectWait, with the timeout set by the next timer,
+/// so an application does not need a thread (or a polling timeout) for each thing it waits on.
+/// Callbacks are run on the thread calling Run or RunOnce, which may add and remove watches and timers.
+/////////////////////////////
+class EventLoop final {
+public:
+    EventLoop();
+    ~EventLoop();
+
+    /////////////////////////////
+    /// \brief Watch a waitable (e.g. an endpoint or interface)
+    ///
+    /// The kernel does not say which object woke the loop, so onReady is called every time the loop wakes
+    /// and should poll without blocking.
+    /////////////////////////////
+    void Watch(Waitable* waitable, std::function<void()> onReady);
+    void Unwatch(Waitable* waitable);
+
+    /////////////////////////////
+    /// \brief Watch a file descriptor
+    ///
+    /// \param onReadable Called when fd is readable or hung up
+    /////////////////////////////
+    void WatchFile(int fd, std::function<void()> onReadable);
+    void UnwatchFile(int fd);
+
+    /////////////////////////////
+    /// \brief Call a function after an interval
+    ///
+    /// \param interval Time in microseconds
+    /// \param repeat Call every interval until removed
+    ///
+    /// \return ID of the timer
+    /////////////////////////////
+    int AddTimer(long interval, bool repeat, std::function<void()> callback);
+    void RemoveTimer(int id);
+
+    /////////////////////////////
+    /// \brief Run a function on the loop thread
+    ///
+    /// Can be called from any thread, the loop is woken to run it.
+    /////////////////////////////
+    void Post(std::function<void()> function);
+
+    /////////////////////////////
+    /// \brief Wait once and run the callbacks of anything ready
+    ///
+    /// \param timeout Most time to wait in microseconds, negative to wait until something is ready
+    /////////////////////////////
+    void RunOnce(long timeout = -1);
+
+    // Run until Stop is called
+    void Run();
+    // Can be called from any thread
+    void Stop();
+
+private:
+    struct WaitableWatch {
+        Waitable* waitable;
+        std::function<void()> onReady;
+    };
+
+    struct FileWatch {
+        int fd;
+        std::function<void()> onReadable;
+    };
+
+    struct Timer {
+        uint64_t due; // Microseconds since boot
+        long interval;
+        bool repeat;
+        std::function<void()> callback;
+    };
+
+    // Run due timers, returning the time until the next one or -1 if there are none
+    long RunTimers();
+    // Read everything from the wake pipe then run the posted functions
+    void RunPosted();
+
+    std::vector<WaitableWatch> m_waitables;
+    std::vector<FileWatch> m_files;
+
+    std::map<int, Timer> m_timers;
+    int m_nextTimer = 1;
+
+    int m_wakeRead = -1; // Written to by Post and Stop
+    int m_wakeWrite = -1;
+
+    std::mutex m_postedLock;
+    std::vector<std::function<void()>> m_posted;
+
+    bool m_running = false;
+};
+} // namespace Lemon
@@ -9,4 +9,7 @@
 
 namespace Lemon{
     long MapFramebuffer(void** ptr, FBInfo& fbInfo);
+
+    // Scan out of a page of the framebuffer on the next vertical blank
+    long FlipFramebuffer(unsigned page);
 }
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <Lemon/System/ABI/IORing.h>
+#include <Lemon/Types.h>
+#include <lemon/syscall.h>
+
+namespace Lemon {
+/////////////////////////////
+/// \brief IORingCreate (entries, info)
+///
+/// Create submission and completion rings mapped into the process (see Lemon/System/ABI/IORing.h)
+///
+/// \param entries Submission ring entries, rounded up to a power of two
+/// \param info Populated with the address and layout of the rings
+///
+/// \return Handle ID of the rings on success, negative error code on failure
+/////////////////////////////
+__attribute__((always_inline)) inline handle_t IORingCreate(uint32_t entries, IORingInfo& info) {
+    return syscall(SYS_IORING_CREATE, entries, &info);
+}
+
+/////////////////////////////
+/// \brief IORingEnter (ring, minComplete, timeout)
+///
+/// Run the operations in the submission ring
+///
+/// \param ring Handle ID of the rings
+/// \param minComplete Wait until at least this many completions are in the completion ring
+/// \param timeout Most time to wait in microseconds, negative to wait forever
+///
+/// \return Amount of submissions consumed on success, negative error code on failure
+/////////////////////////////
+__attribute__((always_inline)) inline long IORingEnter(handle_t ring, uint32_t minComplete, long timeout) {
+    return syscall(SYS_IORING_ENTER, ring, minComplete, timeout);
+}
+} // namespace Lemon
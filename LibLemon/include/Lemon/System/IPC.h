@@ -1,8 +1,12 @@
 #pragma once
 
+#include <Lemon/System/ABI/IPC.h>
+#include <Lemon/System/ABI/MessageRing.h>
 #include <Lemon/Types.h>
 #include <lemon/syscall.h>
 
+#include <sys/types.h>
+
 namespace Lemon {
 struct LemonEndpointInfo {
     uint16_t msgSize;
@@ -20,6 +24,19 @@ struct LemonEndpointInfo {
 /////////////////////////////
 inline handle_t CreateService(const char* name) { return syscall(SYS_CREATE_SERVICE, name); }
 
+/////////////////////////////
+/// \brief RegisterService (name) - Register a service ahead of time
+///
+/// Register a service so it can be started on demand. Connections to the service wait for its interfaces
+/// to be created, and the first connection signals the returned handle (see WaitForKernelObject).
+/// The service is created as usual by the process providing it.
+///
+/// \param name (const char*) Service name to be used, must be unique
+///
+/// \return Handle ID on success, error code on failure
+/////////////////////////////
+inline handle_t RegisterService(const char* name) { return syscall(SYS_REGISTER_SERVICE, name); }
+
 /////////////////////////////
 /// \brief CreateInterface (service, name, msgSize) - Create a new interface
 ///
@@ -127,6 +144,23 @@ __attribute__((always_inline)) inline long EndpointCall(handle_t endpoint, uint6
     return syscall(SYS_ENDPOINT_CALL, endpoint, id, data, rID, rData, size);
 }
 
+/////////////////////////////
+/// \brief EndpointCallTimeout (endpoint, call, response, timeout)
+///
+/// Send a message and wait for the response, giving up after the timeout
+///
+/// \param endpoint (handle_t) Handle ID of specified endpoint
+/// \param call (EndpointMessageDescriptor*) Message to send
+/// \param response (EndpointMessageDescriptor*) ID of expected response and data buffer, the size is filled in
+/// \param timeout (int64_t) Timeout in us, -1 for no timeout
+///
+/// \return 0 on success, -ETIMEDOUT on timeout, negative error code on failure
+/////////////////////////////
+__attribute__((always_inline)) inline long EndpointCallTimeout(handle_t endpoint, const EndpointMessageDescriptor& call,
+                                                               EndpointMessageDescriptor& response, int64_t timeout) {
+    return syscall(SYS_ENDPOINT_CALL_TIMEOUT, endpoint, &call, &response, timeout);
+}
+
 /////////////////////////////
 /// \brief SysEndpointInfo (endpoint, info)
 ///
@@ -140,4 +174,72 @@ __attribute__((always_inline)) inline long EndpointCall(handle_t endpoint, uint6
 __attribute__((always_inline)) inline long EndpointInfo(handle_t endp, LemonEndpointInfo& info) {
     return syscall(SYS_ENDPOINT_INFO, endp, &info);
 }
+
+/////////////////////////////
+/// \brief EndpointMapRing (endpoint, info)
+///
+/// Map the shared message rings of an endpoint (see Lemon/IPC/MessageRing.h)
+///
+/// \param endpoint Endpoint handle
+/// \param info Populated with the address and layout of the rings
+///
+/// \return 0 on success, negative error code on failure
+/////////////////////////////
+__attribute__((always_inline)) inline long EndpointMapRing(handle_t endp, MessageRingInfo& info) {
+    return syscall(SYS_ENDPOINT_MAP_RING, endp, &info);
+}
+
+/////////////////////////////
+/// \brief EndpointNotify (endpoint)
+///
+/// Wake the peer of an endpoint after writing to its ring
+///
+/// \param endpoint Endpoint handle
+///
+/// \return 0 on success, negative error code on failure
+/////////////////////////////
+__attribute__((always_inline)) inline long EndpointNotify(handle_t endp) { return syscall(SYS_ENDPOINT_NOTIFY, endp); }
+
+/////////////////////////////
+/// \brief EndpointQueueBatch (endpoint, messages, count) - Queue several messages on an endpoint
+///
+/// \param endpoint (handle_t) Handle ID of specified endpoint
+/// \param messages (EndpointMessageDescriptor*) Messages to queue
+/// \param count (unsigned) Amount of messages, at most ENDPOINT_BATCH_MAX
+///
+/// \return Amount of messages queued, negative error code on failure
+/////////////////////////////
+__attribute__((always_inline)) inline long EndpointQueueBatch(handle_t endpoint, const EndpointMessageDescriptor* messages,
+                                                              unsigned count) {
+    return syscall(SYS_ENDPOINT_QUEUE_BATCH, endpoint, messages, count);
+}
+
+/////////////////////////////
+/// \brief EndpointDequeueBatch (endpoint, messages, count) - Dequeue several messages from an endpoint
+///
+/// \param endpoint (handle_t) Handle ID of specified endpoint
+/// \param messages (EndpointMessageDescriptor*) Message buffers, the ID and size of each message are filled in
+/// \param count (unsigned) Amount of buffers, at most ENDPOINT_BATCH_MAX
+///
+/// \return Amount of messages dequeued (0 on empty), negative error code on failure
+/////////////////////////////
+__attribute__((always_inline)) inline long EndpointDequeueBatch(handle_t endpoint, EndpointMessageDescriptor* messages,
+                                                                unsigned count) {
+    return syscall(SYS_ENDPOINT_DEQUEUE_BATCH, endpoint, messages, count);
+}
+
+/////////////////////////////
+/// \brief EndpointGetStatistics (pid, handle, stats)
+///
+/// Get the message counters of the first endpoint of a process with a handle ID of at least \a handle
+///
+/// \param pid PID of the process, 0 for the calling process
+/// \param handle Handle ID to start looking from, pass the last returned ID + 1 to get the next endpoint
+/// \param stats Filled with the counters of the endpoint
+///
+/// \return Handle ID of the endpoint on success, -ENOENT if there are no more endpoints, negative error code on failure
+/////////////////////////////
+__attribute__((always_inline)) inline long EndpointGetStatistics(pid_t pid, handle_t handle, EndpointStatistics& stats) {
+    return syscall(SYS_ENDPOINT_STATISTICS, pid, handle, &stats);
+}
 } // namespace Lemon
@@ -34,6 +34,46 @@ inline long WaitForKernelObject(const handle_t* const objects, const size_t coun
     return syscall(SYS_KERNELOBJECT_WAIT, objects, count, timeout);
 }
 
+/////////////////////////////
+/// \brief Create a wait set
+///
+/// Objects stay in a wait set between waits, so waiting only costs as much as the objects which are ready.
+///
+/// \return Handle of the wait set, negative error code on failure
+/////////////////////////////
+inline handle_t CreateWaitSet() { return syscall(SYS_WAIT_SET_CREATE); }
+
+/////////////////////////////
+/// \brief Add an object to a wait set
+///
+/// The wait set keeps the object until it is removed, even once the handle is closed.
+///
+/// \return negative error code on failure
+/////////////////////////////
+inline long WaitSetAdd(const handle_t set, const handle_t obj) { return syscall(SYS_WAIT_SET_ADD, set, obj); }
+
+/////////////////////////////
+/// \brief Remove an object from a wait set
+///
+/// \return negative error code on failure
+/////////////////////////////
+inline long WaitSetRemove(const handle_t set, const handle_t obj) { return syscall(SYS_WAIT_SET_REMOVE, set, obj); }
+
+/////////////////////////////
+/// \brief Wait on a wait set
+///
+/// Objects may be reported when they are not ready, and are reported again whilst they stay ready.
+///
+/// \param ready Filled with the handles of ready objects
+/// \param count Size of ready
+/// \param timeout Timeout in us, 0 to return immediately and negative to wait indefinitely
+///
+/// \return Amount of handles stored in ready, negative error code on failure
+/////////////////////////////
+inline long WaitSetWait(const handle_t set, handle_t* ready, const int count, const long timeout) {
+    return syscall(SYS_WAIT_SET_WAIT, set, ready, count, timeout);
+}
+
 /////////////////////////////
 /// \brief DestroyKObject (object)
 ///
@@ -0,0 +1,39 @@
+#pragma once
+
+#ifndef __lemon__
+#error "Lemon OS Only"
+#endif
+
+#include <Lemon/System/ABI/Metrics.h>
+
+namespace Lemon {
+/////////////////////////////
+/// \brief System metrics maintained by the kernel
+///
+/// CPU time of each CPU, memory use and the statistics of each process,
+/// in read only pages the kernel updates every METRICS_UPDATE_INTERVAL_US.
+/// Once mapped, reading them does not need a system call.
+/////////////////////////////
+class SystemMetrics final {
+public:
+    /////////////////////////////
+    /// \brief Map the metrics into the process
+    ///
+    /// \return 0 on success, -1 on failure with errno set
+    /////////////////////////////
+    int Map();
+
+    /////////////////////////////
+    /// \brief Copy a consistent snapshot of the metrics
+    ///
+    /// Only the first processCount entries of processes are copied.
+    /// The metrics must have been mapped.
+    /////////////////////////////
+    void Read(lemon_metrics_t& snapshot) const;
+
+    inline bool IsMapped() const { return m_metrics; }
+
+private:
+    const lemon_metrics_t* m_metrics = nullptr;
+};
+} // namespace Lemon
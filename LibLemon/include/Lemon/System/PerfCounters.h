@@ -0,0 +1,49 @@
+#pragma once
+
+#ifndef __lemon__
+#error "Lemon OS Only"
+#endif
+
+#include <Lemon/System/ABI/PerfCounters.h>
+
+#include <stdint.h>
+
+namespace Lemon {
+/////////////////////////////
+/// \brief Hardware performance counters of the calling thread
+///
+/// Counts cycles, instructions, cache misses and branch misses whilst the calling thread is running,
+/// in both user space and the kernel. Only one set of counters exists per thread.
+/// Where the kernel allows it the counts are read with rdpmc instead of a system call.
+/////////////////////////////
+class PerfCounters final {
+public:
+    static constexpr uint32_t allEvents = (1U << PerfEventCount) - 1;
+
+    /////////////////////////////
+    /// \brief Start counting, resetting the counts
+    ///
+    /// \param events Mask of PERF_EVENT_BIT, events the CPU cannot count are left out (see Events())
+    ///
+    /// \return 0 on success, -1 on failure with errno set (EOPNOTSUPP if no events can be counted)
+    /////////////////////////////
+    int Start(uint32_t events = allEvents);
+    void Stop();
+
+    /////////////////////////////
+    /// \brief Get the counts of the calling thread
+    ///
+    /// \param counts Filled with the count of each event, 0 for events that are not counted
+    /////////////////////////////
+    void Read(uint64_t counts[PerfEventCount]) const;
+
+    inline uint32_t Events() const { return m_info.events; }
+    inline bool IsCounting(int event) const { return m_info.events & PERF_EVENT_BIT(event); }
+
+    static const char* EventName(int event);
+
+private:
+    lemon_perf_counters_t m_info = {};
+    bool m_useRdpmc = false;
+};
+} // namespace Lemon
@@ -4,6 +4,8 @@
 #error "Lemon OS Only"
 #endif
 
+#include <Lemon/System/ABI/Process.h>
+
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/types.h>
@@ -12,3 +14,23 @@
 
 pid_t lemon_spawn(const char* path, int argc, char* const argv[], int flags = 0);
 pid_t lemon_spawn(const char* path, int argc, char* const argv[], int flags, char** envp);
+
+namespace Lemon {
+/////////////////////////////
+/// \brief Start a child process running an executable
+///
+/// The child is created directly from the executable rather than forking the address space of the caller,
+/// so this is much cheaper than fork followed by exec.
+/// The child inherits the handles (except those with close on exec set) and working directory of the caller.
+///
+/// \param path Path of the executable, PATH is not searched
+/// \param argv Null terminated argument list
+/// \param envp Null terminated environment, if null the environment of the caller is used
+/// \param actions File actions applied in order to the handles of the child (e.g. to redirect stdout)
+/// \param actionCount Amount of file actions, at most SPAWN_ACTIONS_MAX
+///
+/// \return PID of the child on success, -1 on failure with errno set
+/////////////////////////////
+pid_t Spawn(const char* path, char* const argv[], char* const envp[] = nullptr,
+            const lemon_spawn_action_t* actions = nullptr, size_t actionCount = 0);
+} // namespace Lemon
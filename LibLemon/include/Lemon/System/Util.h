@@ -5,6 +5,7 @@
 #endif
 
 #include <Lemon/System/Info.h>
+#include <Lemon/System/ABI/Filesystem.h>
 #include <Lemon/System/ABI/Process.h>
 
 #include <sys/types.h>
@@ -24,6 +25,47 @@ namespace Lemon{
     /////////////////////////////
     long InterruptThread(pid_t tid);
 
+    /////////////////////////////
+    /// \brief Set the scheduling class of a thread
+    ///
+    /// \param tid Thread ID, 0 for the calling thread
+    /// \param schedClass Scheduling class (e.g. SchedulingClassInteractive)
+    ///
+    /// \return 0 on success, -1 on failure (errno is set)
+    /////////////////////////////
+    long SetSchedulingClass(pid_t tid, int schedClass);
+
+    /////////////////////////////
+    /// \brief Get the scheduling class of a thread
+    ///
+    /// \param tid Thread ID, 0 for the calling thread
+    ///
+    /// \return Scheduling class on success, -1 on failure (errno is set)
+    /////////////////////////////
+    long GetSchedulingClass(pid_t tid);
+
+    /////////////////////////////
+    /// \brief Set the CPUs a thread may run on
+    ///
+    /// CPUs isolated with the isolcpus= boot option are only used by threads that ask for them.
+    ///
+    /// \param tid Thread ID, 0 for the calling thread
+    /// \param mask Mask of CPUs (bit n for CPU n), 0 to allow any CPU that is not isolated
+    ///
+    /// \return 0 on success, -1 on failure (errno is set)
+    /////////////////////////////
+    long SetAffinity(pid_t tid, uint64_t mask);
+
+    /////////////////////////////
+    /// \brief Get the CPUs a thread may run on
+    ///
+    /// \param tid Thread ID, 0 for the calling thread
+    /// \param mask Set to the mask of CPUs the thread may run on
+    ///
+    /// \return 0 on success, -1 on failure (errno is set)
+    /////////////////////////////
+    long GetAffinity(pid_t tid, uint64_t& mask);
+
     /////////////////////////////
     /// \brief Get information about process
     ///
@@ -56,4 +98,37 @@ namespace Lemon{
     /// \param list Reference to a std::vector<lemon_process_info_t>
     /////////////////////////////
     void GetProcessList(std::vector<lemon_process_info_t>& list);
+
+    /////////////////////////////
+    /// \brief Get scheduler statistics for a CPU
+    ///
+    /// \param cpu Index of the CPU (0 to cpuCount - 1, see SysInfo())
+    /// \param info Reference to CPU info structure
+    ///
+    /// \return 0 on success, -1 on failure (errno is set)
+    /////////////////////////////
+    int GetCPUInfo(unsigned cpu, lemon_cpu_info_t& info);
+
+    /////////////////////////////
+    /// \brief Get a breakdown of physical memory use
+    ///
+    /// \param info Reference to memory info structure
+    ///
+    /// \return 0 on success, -1 on failure (errno is set)
+    /////////////////////////////
+    int GetMemoryInfo(lemon_memory_info_t& info);
+
+    /////////////////////////////
+    /// \brief Read several directory entries
+    ///
+    /// Reads from the file position of fd, which is an opaque cursor,
+    /// so should not be mixed with readdir on the same file descriptor.
+    ///
+    /// \param fd File descriptor of directory
+    /// \param entries Filled with the entries read
+    /// \param count Size of entries
+    ///
+    /// \return Amount of entries read, 0 at the end of the directory, -1 on failure (errno is set)
+    /////////////////////////////
+    long ReadDirBatch(int fd, lemon_dirent_t* entries, size_t count);
 }
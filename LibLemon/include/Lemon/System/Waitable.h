@@ -21,12 +21,21 @@ public:
     virtual ~Waitable();
 };
 
+/////////////////////////////
+/// \brief Waits on several waitables at once
+///
+/// The handles are kept in a kernel wait set, so a wait only costs as much as the handles which are ready.
+/// RepopulateHandles must be called whenever the handles of a waitable change.
+/////////////////////////////
 class Waiter {
     std::list<Waitable*> waitingOn;
     std::list<Waitable*> waitingOnAll;
-    std::vector<handle_t> handles;
+    std::vector<handle_t> handles; // Sorted, everything in the wait set
+    Handle waitSet;
 
 public:
+    Waiter();
+
     void RepopulateHandles();
 
     /////////////////////////////
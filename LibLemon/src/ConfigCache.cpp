@@ -0,0 +1,298 @@
+#include <Lemon/Core/ConfigCache.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CONFIG_CACHE_MAGIC 0x4346434c // LCFC
+#define CONFIG_CACHE_VERSION 1
+
+namespace Lemon {
+
+namespace {
+
+uint64_t HashBytes(const uint8_t* data, size_t size) {
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * 0x100000001b3;
+    }
+
+    return hash;
+}
+
+// Caches are named by a hash of the path of their source
+std::string CachePath(const char* path) {
+    char name[sizeof(CONFIG_CACHE_DIR) + 24];
+    snprintf(name, sizeof(name), CONFIG_CACHE_DIR "/%016lx",
+             HashBytes(reinterpret_cast<const uint8_t*>(path), strlen(path)));
+
+    return name;
+}
+
+int IdentifySource(const char* path, ConfigCache::Source& source) {
+    source.valid = false;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size <= 0) {
+        close(fd);
+        return 1;
+    }
+
+    // Mapped so the pages come straight from the page cache, the parser will use them next if the cache is stale
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return 1;
+    }
+
+    source.inode = st.st_ino;
+    source.size = st.st_size;
+    source.hash = HashBytes(reinterpret_cast<const uint8_t*>(data), st.st_size);
+    source.valid = true;
+
+    munmap(data, st.st_size);
+    return 0;
+}
+
+} // namespace
+
+void ConfigCache::Builder::BeginSection(std::string_view name) {
+    m_section++;
+    m_sectionName = Intern(name);
+    m_sectionNameLength = name.length();
+}
+
+void ConfigCache::Builder::AddString(std::string_view key, std::string_view value) { Add(key, TypeString, 0, value); }
+
+void ConfigCache::Builder::AddSigned(std::string_view key, long value) {
+    Add(key, TypeSigned, static_cast<uint64_t>(value));
+}
+
+void ConfigCache::Builder::AddUnsigned(std::string_view key, unsigned long value) { Add(key, TypeUnsigned, value); }
+
+void ConfigCache::Builder::AddFloat(std::string_view key, double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    Add(key, TypeFloat, bits);
+}
+
+void ConfigCache::Builder::AddBool(std::string_view key, bool value) { Add(key, TypeBool, value); }
+
+void ConfigCache::Builder::Add(std::string_view key, ValueType type, uint64_t value, std::string_view str) {
+    Record record = {
+        .section = m_section,
+        .type = type,
+        .sectionName = m_sectionName,
+        .sectionNameLength = m_sectionNameLength,
+        .key = Intern(key),
+        .keyLength = static_cast<uint32_t>(key.length()),
+        .str = Intern(str),
+        .strLength = static_cast<uint32_t>(str.length()),
+        .value = value,
+    };
+
+    m_records.push_back(record);
+}
+
+uint32_t ConfigCache::Builder::Intern(std::string_view str) {
+    uint32_t offset = m_strings.length();
+    m_strings.append(str);
+
+    return offset;
+}
+
+ConfigCache::~ConfigCache() { Close(); }
+
+int ConfigCache::Open(const char* path, Source& source) {
+    Close();
+
+    if (IdentifySource(path, source)) {
+        return 1;
+    }
+
+    int fd = open(CachePath(path).c_str(), O_RDONLY);
+    if (fd < 0) {
+        return 1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) || static_cast<size_t>(st.st_size) < sizeof(Header)) {
+        close(fd);
+        return 1;
+    }
+
+    void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return 1;
+    }
+
+    m_mapping = mapping;
+    m_mappingSize = st.st_size;
+
+    m_header = reinterpret_cast<const Header*>(mapping);
+    m_records = reinterpret_cast<const Record*>(m_header + 1);
+    m_strings = reinterpret_cast<const char*>(m_records + m_header->recordCount);
+
+    if (Validate(path, source)) {
+        Close();
+        return 1;
+    }
+
+    return 0;
+}
+
+void ConfigCache::Save(const char* path, const Source& source, const Builder& builder) {
+    Close();
+
+    Header header = {
+        .magic = CONFIG_CACHE_MAGIC,
+        .version = CONFIG_CACHE_VERSION,
+        .sourceInode = source.inode,
+        .sourceSize = source.size,
+        .sourceHash = source.hash,
+        .recordCount = static_cast<uint32_t>(builder.m_records.size()),
+        .pathLength = static_cast<uint32_t>(strlen(path)),
+        .stringsSize = 0,
+        .reserved = 0,
+    };
+
+    // The path goes before the other strings, so move them all along
+    std::vector<Record> records = builder.m_records;
+    for (Record& record : records) {
+        record.sectionName += header.pathLength;
+        record.key += header.pathLength;
+        record.str += header.pathLength;
+    }
+    header.stringsSize = header.pathLength + builder.m_strings.length();
+
+    size_t recordsSize = records.size() * sizeof(Record);
+    m_data.resize(sizeof(Header) + recordsSize + header.stringsSize);
+
+    uint8_t* data = m_data.data();
+    memcpy(data, &header, sizeof(Header));
+    if (recordsSize) {
+        memcpy(data + sizeof(Header), records.data(), recordsSize);
+    }
+    memcpy(data + sizeof(Header) + recordsSize, path, header.pathLength);
+    memcpy(data + sizeof(Header) + recordsSize + header.pathLength, builder.m_strings.data(),
+           builder.m_strings.length());
+
+    m_header = reinterpret_cast<const Header*>(data);
+    m_records = reinterpret_cast<const Record*>(m_header + 1);
+    m_strings = reinterpret_cast<const char*>(m_records + m_header->recordCount);
+
+    if (!source.valid) {
+        return;
+    }
+
+    if (mkdir(CONFIG_CACHE_DIR, 0777) && errno != EEXIST) {
+        return;
+    }
+
+    // Written elsewhere then renamed so nobody maps a partially written cache
+    std::string cachePath = CachePath(path);
+    std::string tempPath = cachePath + "." + std::to_string(getpid());
+
+    int fd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return;
+    }
+
+    bool written = write(fd, m_data.data(), m_data.size()) == static_cast<ssize_t>(m_data.size());
+    close(fd);
+
+    if (!written || rename(tempPath.c_str(), cachePath.c_str())) {
+        unlink(tempPath.c_str());
+    }
+}
+
+ConfigCache::Entry ConfigCache::operator[](size_t index) const {
+    const Record& record = m_records[index];
+
+    Entry entry = {
+        .section = record.section,
+        .type = static_cast<ValueType>(record.type),
+        .sectionName = std::string_view(m_strings + record.sectionName, record.sectionNameLength),
+        .key = std::string_view(m_strings + record.key, record.keyLength),
+        .str = std::string_view(m_strings + record.str, record.strLength),
+        .value = {},
+    };
+
+    switch (record.type) {
+    case TypeSigned:
+        entry.value.sLong = static_cast<long>(record.value);
+        break;
+    case TypeUnsigned:
+        entry.value.uLong = record.value;
+        break;
+    case TypeFloat:
+        memcpy(&entry.value.dbl, &record.value, sizeof(double));
+        break;
+    case TypeBool:
+        entry.value.boolean = record.value;
+        break;
+    }
+
+    return entry;
+}
+
+void ConfigCache::Close() {
+    if (m_mapping) {
+        munmap(m_mapping, m_mappingSize);
+        m_mapping = nullptr;
+    }
+
+    m_data.clear();
+    m_header = nullptr;
+    m_records = nullptr;
+    m_strings = nullptr;
+}
+
+int ConfigCache::Validate(const char* path, const Source& source) const {
+    if (m_header->magic != CONFIG_CACHE_MAGIC || m_header->version != CONFIG_CACHE_VERSION) {
+        return 1;
+    }
+
+    if (m_header->sourceInode != source.inode || m_header->sourceSize != source.size ||
+        m_header->sourceHash != source.hash) {
+        return 1; // Out of date
+    }
+
+    // Everything has to be within the file, it could have been truncated
+    uint64_t recordsSize = static_cast<uint64_t>(m_header->recordCount) * sizeof(Record);
+    if (sizeof(Header) + recordsSize + m_header->stringsSize > m_mappingSize) {
+        return 1;
+    }
+
+    // Caches are named by a hash of the path, make sure this is not another config
+    if (m_header->pathLength > m_header->stringsSize ||
+        std::string_view(m_strings, m_header->pathLength) != std::string_view(path)) {
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < m_header->recordCount; i++) {
+        const Record& record = m_records[i];
+        if (static_cast<uint64_t>(record.sectionName) + record.sectionNameLength > m_header->stringsSize ||
+            static_cast<uint64_t>(record.key) + record.keyLength > m_header->stringsSize ||
+            static_cast<uint64_t>(record.str) + record.strLength > m_header->stringsSize ||
+            record.type > TypeBool) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+} // namespace Lemon
@@ -1,5 +1,6 @@
 #include <Lemon/Core/ConfigManager.h>
 
+#include <Lemon/Core/ConfigCache.h>
 #include <Lemon/Core/Logger.h>
 #include <Lemon/Core/JSON.h>
 
@@ -8,40 +9,83 @@
 namespace Lemon {
 
 void ConfigManager::LoadJSONConfig(const std::string& path) {
-    JSONParser parser(path.c_str());
-
-    std::function<void(const std::string&, JSONValue&)> readObject;
-    readObject = [this, &readObject](const std::string& configPrefix, JSONValue& object) -> void {
-        assert(object.IsObject());
-        auto& obj = *object.data.object;
-        for (auto& val : obj) {
-            if (val.second.IsObject()) {
+    ConfigCache cache;
+    ConfigCache::Source source;
+    if (cache.Open(path.c_str(), source)) {
+        // Not cached or the config has changed, flatten it into a new cache
+        JSONParser parser(path.c_str());
+
+        auto root = parser.Parse();
+        if(!root.IsObject()){
+            Logger::Warning("[ConfigManager] Failed to laod JSON config at {}", path);
+            return;
+        }
+
+        ConfigCache::Builder builder;
+        std::function<void(const std::string&, JSONValue&)> readObject;
+        readObject = [&builder, &readObject](const std::string& configPrefix, JSONValue& object) -> void {
+            assert(object.IsObject());
+            for (auto& val : object.AsObject()) {
                 // We add the key to the prefix.
                 // Config keys will look like this
                 //     object.subobject.key
-                readObject(configPrefix + val.first + ".", val.second);
-            } else if(auto it = m_entries.find(configPrefix + val.first); it != m_entries.end()) {
-                ConfigValue& configEntry = it->second; // Make sure the config entry exists
-                if(std::holds_alternative<long>(configEntry)){
-                    configEntry = val.second.AsSignedNumber();
-                } else if(std::holds_alternative<unsigned long>(configEntry)){
-                    configEntry = val.second.AsUnsignedNumber();
-                } else if(std::holds_alternative<bool>(configEntry)){
-                    configEntry = val.second.AsBool();
-                } else if(std::holds_alternative<std::string>(configEntry)){
-                    configEntry = val.second.AsString();
+                std::string key = configPrefix + std::string(val.key);
+                if (val.value.IsObject()) {
+                    readObject(key + ".", val.value);
+                } else if (val.value.IsString()) {
+                    builder.AddString(key, val.value.AsStringView());
+                } else if (val.value.IsBool()) {
+                    builder.AddBool(key, val.value.AsBool());
+                } else if (val.value.IsNumber() && val.value.IsFloat()) {
+                    builder.AddFloat(key, val.value.AsFloat());
+                } else if (val.value.IsNumber() && val.value.IsSigned()) {
+                    builder.AddSigned(key, val.value.AsSignedNumber());
+                } else if (val.value.IsNumber()) {
+                    builder.AddUnsigned(key, val.value.AsUnsignedNumber());
                 }
             }
-        }
-    };
+        };
 
-    auto root = parser.Parse();
-    if(!root.IsObject()){
-        Logger::Warning("[ConfigManager] Failed to laod JSON config at {}", path);
-        return;
+        readObject("", root);
+        cache.Save(path.c_str(), source, builder);
     }
 
-    readObject("", root);
+    for (size_t i = 0; i < cache.size(); i++) {
+        ConfigCache::Entry entry = cache[i];
+
+        auto it = m_entries.find(std::string(entry.key));
+        if (it == m_entries.end()) {
+            continue;
+        }
+
+        ConfigValue& configEntry = it->second; // Make sure the config entry exists
+        bool isNumber = entry.type == ConfigCache::TypeSigned || entry.type == ConfigCache::TypeUnsigned ||
+                        entry.type == ConfigCache::TypeFloat;
+        if(std::holds_alternative<std::string>(configEntry)){
+            if(entry.type == ConfigCache::TypeString){
+                configEntry = std::string(entry.str);
+            }
+        } else if(std::holds_alternative<bool>(configEntry)){
+            if(entry.type == ConfigCache::TypeBool){
+                configEntry = entry.value.boolean;
+            }
+        } else if(!isNumber){
+            continue; // Ignore values of the wrong type
+        } else if(std::holds_alternative<long>(configEntry)){
+            configEntry = entry.type == ConfigCache::TypeFloat ? static_cast<long>(entry.value.dbl) : entry.value.sLong;
+        } else if(std::holds_alternative<unsigned long>(configEntry)){
+            configEntry =
+                entry.type == ConfigCache::TypeFloat ? static_cast<unsigned long>(entry.value.dbl) : entry.value.uLong;
+        } else if(std::holds_alternative<double>(configEntry)){
+            if(entry.type == ConfigCache::TypeFloat){
+                configEntry = entry.value.dbl;
+            } else if(entry.type == ConfigCache::TypeSigned){
+                configEntry = static_cast<double>(entry.value.sLong);
+            } else {
+                configEntry = static_cast<double>(entry.value.uLong);
+            }
+        }
+    }
 }
 
-} // namespace Lemon
\ No newline at end of file
+} // namespace Lemon
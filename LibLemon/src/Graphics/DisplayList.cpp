@@ -0,0 +1,221 @@
+#include <Lemon/Graphics/DisplayList.h>
+
+#include <Lemon/Core/Unicode.h>
+#include <Lemon/Graphics/Graphics.h>
+
+#include <algorithm>
+#include <atomic>
+#include <ctype.h>
+#include <thread>
+
+namespace Lemon::Graphics {
+
+// Clips may be INT_MAX wide, so edges are worked out without overflowing
+static Rect Intersect(const Rect& a, const Rect& b) {
+    long left = std::max<long>(a.x, b.x);
+    long top = std::max<long>(a.y, b.y);
+    long right = std::min<long>(static_cast<long>(a.x) + a.width, static_cast<long>(b.x) + b.width);
+    long bottom = std::min<long>(static_cast<long>(a.y) + a.height, static_cast<long>(b.y) + b.height);
+
+    return {static_cast<int>(left), static_cast<int>(top), static_cast<int>(std::max(right - left, 0L)),
+            static_cast<int>(std::max(bottom - top, 0L))};
+}
+
+static inline bool Contains(const Rect& outer, const Rect& inner) {
+    return inner.x >= outer.x && inner.y >= outer.y &&
+           static_cast<long>(inner.x) + inner.width <= static_cast<long>(outer.x) + outer.width &&
+           static_cast<long>(inner.y) + inner.height <= static_cast<long>(outer.y) + outer.height;
+}
+
+void DisplayList::Clear() {
+    m_commands.clear();
+    m_text.clear();
+}
+
+void DisplayList::Record(Command& command, const Rect& rect) {
+    command.bounds = Intersect(rect, command.clip);
+    if (command.bounds.width > 0 && command.bounds.height > 0) {
+        m_commands.push_back(command);
+    }
+}
+
+void DisplayList::DrawRect(const Rect& rect, const RGBAColour& colour, const Rect& clip) {
+    Command command = {.type = CommandRect, .clip = clip, .colour = colour};
+    Record(command, rect);
+}
+
+void DisplayList::DrawRoundedRect(const Rect& rect, const RGBAColour& colour, int topLeftRadius, int topRightRadius,
+                                  int bottomRightRadius, int bottomLeftRadius, const Rect& clip) {
+    Command command = {.type = CommandRoundedRect, .clip = clip, .colour = colour, .pos = rect.pos, .region = rect};
+    command.radii[0] = topLeftRadius;
+    command.radii[1] = topRightRadius;
+    command.radii[2] = bottomRightRadius;
+    command.radii[3] = bottomLeftRadius;
+
+    // The corners are antialiased just outside the rect
+    Record(command, {rect.x - 1, rect.y - 1, rect.width + 2, rect.height + 2});
+}
+
+void DisplayList::DrawString(const std::string& str, const Vector2i& pos, const RGBAColour& colour, const Rect& clip,
+                             Font* font) {
+    int width = GetTextLength(str.c_str(), font);
+    int height = 12; // Bitmap font
+
+    if (font && font->glyphs) {
+        // Drawing only has to read the cache
+        static thread_local std::vector<int32_t> codepoints;
+        UTF8ToUTF32(str.data(), str.length(), codepoints);
+        for (int cp : codepoints) {
+            if (cp >= 0x80 || isprint(cp)) {
+                font->glyphs->Get(font, cp);
+            }
+        }
+
+        // Glyphs can reach past their advance, and kerning can pull them either way
+        width += font->lineHeight * 2;
+        height = font->lineHeight;
+    }
+
+    Command command = {.type = CommandString, .clip = clip, .colour = colour, .pos = pos, .text = m_text.size()};
+    command.font = font;
+
+    size_t commandCount = m_commands.size();
+    Record(command, {pos.x - (height / 2), pos.y, width, height});
+    if (m_commands.size() > commandCount) {
+        m_text.append(str.c_str());
+        m_text.push_back('\0');
+    }
+}
+
+void DisplayList::RecordBlit(CommandType type, const Surface* src, const Vector2i& offset, const Rect& region,
+                             const Rect& clip) {
+    Rect sourceRegion = Intersect(region, {0, 0, src->width, src->height});
+    Vector2i pos = offset + (sourceRegion.pos - region.pos);
+
+    Command command = {.type = type, .clip = clip, .pos = pos, .region = sourceRegion};
+    command.src = src;
+    Record(command, {pos, sourceRegion.size});
+}
+
+void DisplayList::Blit(const Surface* src, const Vector2i& offset, const Rect& region, const Rect& clip) {
+    RecordBlit(CommandBlit, src, offset, region, clip);
+}
+
+void DisplayList::AlphaBlit(const Surface* src, const Vector2i& offset, const Rect& region, const Rect& clip) {
+    RecordBlit(CommandAlphaBlit, src, offset, region, clip);
+}
+
+void DisplayList::Cull() {
+    m_culled.assign(m_commands.size(), false);
+
+    // Rects and blits write every pixel they touch without blending
+    std::vector<Rect> occluders;
+    for (size_t i = m_commands.size(); i-- > 0;) {
+        const Command& command = m_commands[i];
+
+        for (const Rect& occluder : occluders) {
+            if (Contains(occluder, command.bounds)) {
+                m_culled[i] = true;
+                break;
+            }
+        }
+
+        if (!m_culled[i] && (command.type == CommandRect || command.type == CommandBlit) &&
+            occluders.size() < DISPLAY_LIST_MAX_OCCLUDERS) {
+            occluders.push_back(command.bounds);
+        }
+    }
+}
+
+void DisplayList::Execute(Surface* surface, int threads) {
+    if (m_commands.empty()) {
+        return;
+    }
+
+    Cull();
+
+    size_t bandCount = (surface->height + DISPLAY_LIST_BAND_HEIGHT - 1) / DISPLAY_LIST_BAND_HEIGHT;
+    m_bands.resize(bandCount);
+    for (std::vector<uint32_t>& band : m_bands) {
+        band.clear();
+    }
+
+    for (uint32_t i = 0; i < m_commands.size(); i++) {
+        if (m_culled[i]) {
+            continue;
+        }
+
+        Rect bounds = Intersect(m_commands[i].bounds, {0, 0, surface->width, surface->height});
+        if (bounds.width <= 0 || bounds.height <= 0) {
+            continue;
+        }
+
+        size_t last = bounds.bottom() / DISPLAY_LIST_BAND_HEIGHT;
+        for (size_t band = bounds.top() / DISPLAY_LIST_BAND_HEIGHT; band <= last; band++) {
+            m_bands[band].push_back(i);
+        }
+    }
+
+    std::atomic<size_t> nextBand = 0;
+    auto drawBands = [&]() {
+        for (size_t band = nextBand++; band < bandCount; band = nextBand++) {
+            int top = band * DISPLAY_LIST_BAND_HEIGHT;
+            DrawBand(surface, band, top, std::min(top + DISPLAY_LIST_BAND_HEIGHT, surface->height));
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (int i = 1; i < threads && static_cast<size_t>(i) < bandCount; i++) {
+        workers.emplace_back(drawBands);
+    }
+    drawBands();
+
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+
+void DisplayList::DrawBand(Surface* surface, size_t band, int top, int bottom) {
+    for (uint32_t i : m_bands[band]) {
+        const Command& command = m_commands[i];
+
+        // Only rows are limited, so horizontal clipping is left exactly as the immediate functions do it
+        Rect clip = command.clip;
+        if (static_cast<long>(clip.y) + clip.height > bottom) {
+            clip.height = bottom - clip.y;
+        }
+        if (clip.y < top) {
+            clip.top(top);
+        }
+
+        switch (command.type) {
+        case CommandRect:
+            Graphics::DrawRect(command.bounds, command.colour, surface, clip);
+            break;
+        case CommandRoundedRect:
+            Graphics::DrawRoundedRect(command.region, command.colour, command.radii[0], command.radii[1],
+                                      command.radii[2], command.radii[3], surface, clip);
+            break;
+        case CommandString:
+            Graphics::DrawString(m_text.c_str() + command.text, command.pos.x, command.pos.y, command.colour,
+                                 surface, clip, command.font);
+            break;
+        case CommandBlit:
+        case CommandAlphaBlit: {
+            Rect bounds = Intersect(command.bounds, clip);
+            if (bounds.width <= 0 || bounds.height <= 0) {
+                break;
+            }
+
+            Rect region = {command.region.pos + (bounds.pos - command.pos), bounds.size};
+            if (command.type == CommandBlit) {
+                surface->Blit(command.src, bounds.pos, region);
+            } else {
+                surface->AlphaBlit(command.src, bounds.pos, region);
+            }
+            break;
+        }
+        }
+    }
+}
+} // namespace Lemon::Graphics
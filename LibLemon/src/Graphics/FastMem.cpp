@@ -0,0 +1,191 @@
+#include <Lemon/Graphics/Graphics.h>
+
+#include "FastMem.h"
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define CPUID_7_EBX_AVX2 (1 << 5)
+#define CPUID_7_EBX_ERMS (1 << 9)
+#define CPUID_7_EBX_SHA (1 << 29)
+
+#define XCR0_SSE_STATE (1 << 1)
+#define XCR0_AVX_STATE (1 << 2)
+
+// Implementations of each kernel, the SSE2 ones are the baseline until the CPU has been checked
+struct GraphicsKernels {
+    void (*copy)(void* dest, const void* src, size_t count);
+    void (*fill)(void* dest, uint32_t c, size_t count);
+    void (*blend)(uint32_t* dest, const uint32_t* src, size_t count);
+    void (*blendFill)(uint32_t* dest, uint32_t colour, size_t count);
+    void (*yuvToRGB)(uint32_t* dest, const uint8_t* y, const uint8_t* u, const uint8_t* v, size_t count);
+};
+
+static CPUFeatures cpuFeatures = {};
+
+static void CopySSE2(void* dest, const void* src, size_t count) {
+    // memcpy_sse2_stream copies nothing when given less than a vector
+    if (count < 4) {
+        uint32_t* d = reinterpret_cast<uint32_t*>(dest);
+        const uint32_t* s = reinterpret_cast<const uint32_t*>(src);
+        while (count--) {
+            *(d++) = *(s++);
+        }
+        return;
+    }
+
+    memcpy_sse2_stream(dest, src, count);
+}
+
+static void CopyERMS(void* dest, const void* src, size_t count) {
+    size_t size = count * 4;
+    asm volatile("rep movsb" : "+D"(dest), "+S"(src), "+c"(size)::"memory");
+}
+
+__attribute__((target("avx2"))) static void CopyAVX2(void* dest, const void* src, size_t count) {
+    uint32_t* d = reinterpret_cast<uint32_t*>(dest);
+    const uint32_t* s = reinterpret_cast<const uint32_t*>(src);
+
+    // Streaming stores have to be aligned
+    for (; count && (reinterpret_cast<uintptr_t>(d) & 0x1f); count--) {
+        *(d++) = *(s++);
+    }
+
+    for (; count >= 8; count -= 8, d += 8, s += 8) {
+        _mm256_stream_si256(reinterpret_cast<__m256i*>(d), _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s)));
+    }
+    _mm_sfence();
+
+    while (count--) {
+        *(d++) = *(s++);
+    }
+}
+
+static void FillSSE2(void* dest, uint32_t c, size_t count) {
+    uint32_t* d = reinterpret_cast<uint32_t*>(dest);
+
+    __m128i value = _mm_set1_epi32(c);
+    for (; count >= 4; count -= 4, d += 4) {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(d), value);
+    }
+
+    while (count--) {
+        *(d++) = c;
+    }
+}
+
+__attribute__((target("avx2"))) static void FillAVX2(void* dest, uint32_t c, size_t count) {
+    uint32_t* d = reinterpret_cast<uint32_t*>(dest);
+
+    __m256i value = _mm256_set1_epi32(c);
+    for (; count >= 8; count -= 8, d += 8) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(d), value);
+    }
+
+    while (count--) {
+        *(d++) = c;
+    }
+}
+
+static void CopyScalar(void* dest, const void* src, size_t count) {
+    uint32_t* d = reinterpret_cast<uint32_t*>(dest);
+    const uint32_t* s = reinterpret_cast<const uint32_t*>(src);
+    while (count--) {
+        *(d++) = *(s++);
+    }
+}
+
+static void FillScalar(void* dest, uint32_t c, size_t count) {
+    uint32_t* d = reinterpret_cast<uint32_t*>(dest);
+    while (count--) {
+        *(d++) = c;
+    }
+}
+
+static void BlendScalar(uint32_t* dest, const uint32_t* src, size_t count) {
+    while (count--) {
+        *dest = Lemon::Graphics::AlphaBlendInt(*dest, *(src++));
+        dest++;
+    }
+}
+
+static void BlendFillScalar(uint32_t* dest, uint32_t colour, size_t count) {
+    while (count--) {
+        *dest = Lemon::Graphics::AlphaBlendInt(*dest, colour);
+        dest++;
+    }
+}
+
+static const GraphicsKernels scalarKernels = {CopyScalar, FillScalar, BlendScalar, BlendFillScalar, yuvtorgb_scalar};
+static const GraphicsKernels sse2Kernels = {CopySSE2, FillSSE2, alphablend_sse2, alphafill_sse2, yuvtorgb_sse2};
+static const GraphicsKernels avx2Kernels = {CopyAVX2, FillAVX2, alphablend_avx2, alphafill_avx2, yuvtorgb_avx2};
+
+static GraphicsKernels kernels = sse2Kernels;
+static GraphicsKernels selectedKernels = sse2Kernels; // Picked at startup
+
+// Runs before the constructors of applications, so nothing is drawn before the kernels are picked
+__attribute__((constructor(101))) static void SelectGraphicsKernels() {
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return;
+    }
+    bool osxsave = (ecx & bit_OSXSAVE) && (ecx & bit_AVX);
+
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        return;
+    }
+    cpuFeatures.erms = ebx & CPUID_7_EBX_ERMS;
+    cpuFeatures.sha = ebx & CPUID_7_EBX_SHA;
+
+    // The OS has to save the upper halves of the YMM registers on a context switch
+    if (osxsave && (ebx & CPUID_7_EBX_AVX2)) {
+        uint32_t xcr0, xcr0High;
+        asm volatile("xgetbv" : "=a"(xcr0), "=d"(xcr0High) : "c"(0));
+        cpuFeatures.avx2 = (xcr0 & (XCR0_SSE_STATE | XCR0_AVX_STATE)) == (XCR0_SSE_STATE | XCR0_AVX_STATE);
+    }
+
+    if (cpuFeatures.avx2) {
+        kernels = avx2Kernels;
+    } else if (cpuFeatures.erms) {
+        kernels.copy = CopyERMS;
+    }
+    selectedKernels = kernels;
+}
+
+namespace Lemon::Graphics {
+bool UseGraphicsKernels(GraphicsKernelSet set) {
+    switch (set) {
+    case KernelsAuto:
+        kernels = selectedKernels;
+        return true;
+    case KernelsScalar:
+        kernels = scalarKernels;
+        return true;
+    case KernelsSSE2:
+        kernels = sse2Kernels;
+        return true;
+    case KernelsAVX2:
+        if (!cpuFeatures.avx2) {
+            return false;
+        }
+        kernels = avx2Kernels;
+        return true;
+    }
+
+    return false;
+}
+} // namespace Lemon::Graphics
+
+const CPUFeatures& GetCPUFeatures() { return cpuFeatures; }
+
+void memcpy_optimized(void* dest, const void* src, size_t count) { kernels.copy(dest, src, count); }
+
+void memset32_optimized(void* dest, uint32_t c, size_t count) { kernels.fill(dest, c, count); }
+
+void alphablend_optimized(uint32_t* dest, const uint32_t* src, size_t count) { kernels.blend(dest, src, count); }
+
+void alphafill_optimized(uint32_t* dest, uint32_t colour, size_t count) { kernels.blendFill(dest, colour, count); }
+
+void yuvtorgb_optimized(uint32_t* dest, const uint8_t* y, const uint8_t* u, const uint8_t* v, size_t count) {
+    kernels.yuvToRGB(dest, y, u, v, count);
+}
@@ -0,0 +1,169 @@
+#include <Lemon/Graphics/Graphics.h>
+
+#include "FastMem.h"
+
+#include <immintrin.h>
+
+// AlphaBlendInt is done in single precision floats, four or eight pixels at a time.
+// Every intermediate value is an integer below 2^24 so is exact,
+// and the quotient is corrected to match the integer division.
+
+static inline __m128 BlendChannelSSE2(__m128i dest, __m128i src, int shift, __m128 mulDestAlpha, __m128 mulAlpha,
+                                      __m128 resultAlpha, __m128 resultReciprocal) {
+    const __m128i channelMask = _mm_set1_epi32(0xff);
+    const __m128 one = _mm_set1_ps(1);
+
+    __m128 d = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(dest, shift), channelMask));
+    __m128 s = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(src, shift), channelMask));
+    __m128 n = _mm_add_ps(_mm_mul_ps(d, mulDestAlpha), _mm_mul_ps(s, mulAlpha));
+
+    // Truncated quotient is off by at most one
+    __m128 q = _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_mul_ps(n, resultReciprocal)));
+    __m128 product = _mm_mul_ps(q, resultAlpha);
+    q = _mm_add_ps(q, _mm_and_ps(_mm_cmple_ps(_mm_add_ps(product, resultAlpha), n), one));
+    q = _mm_sub_ps(q, _mm_and_ps(_mm_cmpgt_ps(product, n), one));
+    return q;
+}
+
+static inline __m128i BlendSSE2(__m128i dest, __m128i src) {
+    __m128i srcAlphaInt = _mm_srli_epi32(src, 24);
+    __m128i destAlphaInt = _mm_srli_epi32(dest, 24);
+    __m128 alpha = _mm_cvtepi32_ps(srcAlphaInt);
+    __m128 destAlpha = _mm_cvtepi32_ps(destAlphaInt);
+
+    __m128 mulAlpha = _mm_mul_ps(alpha, _mm_set1_ps(256));
+    __m128 mulDestAlpha = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(255), alpha), destAlpha);
+    __m128 resultAlpha = _mm_add_ps(mulAlpha, mulDestAlpha);
+    __m128 resultReciprocal = _mm_div_ps(_mm_set1_ps(1), resultAlpha);
+
+    __m128i result = _mm_slli_epi32(_mm_cvttps_epi32(_mm_mul_ps(resultAlpha, _mm_set1_ps(1.f / 256))), 24);
+    for (int shift = 0; shift < 24; shift += 8) {
+        __m128 c = BlendChannelSSE2(dest, src, shift, mulDestAlpha, mulAlpha, resultAlpha, resultReciprocal);
+        result = _mm_or_si128(result, _mm_slli_epi32(_mm_cvttps_epi32(c), shift));
+    }
+
+    // Transparent pixels keep dest, opaque pixels or those over nothing take src
+    __m128i keepDest = _mm_cmpeq_epi32(srcAlphaInt, _mm_setzero_si128());
+    __m128i takeSrc =
+        _mm_or_si128(_mm_cmpeq_epi32(srcAlphaInt, _mm_set1_epi32(0xff)), _mm_cmpeq_epi32(destAlphaInt, _mm_setzero_si128()));
+    result = _mm_or_si128(_mm_and_si128(takeSrc, src), _mm_andnot_si128(takeSrc, result));
+    return _mm_or_si128(_mm_and_si128(keepDest, dest), _mm_andnot_si128(keepDest, result));
+}
+
+void alphablend_sse2(uint32_t* dest, const uint32_t* src, size_t count) {
+    for (; count >= 4; count -= 4, dest += 4, src += 4) {
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+        __m128i alpha = _mm_srli_epi32(s, 24);
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(alpha, _mm_setzero_si128())) == 0xffff) {
+            continue; // Fully transparent, dest does not change
+        } else if (_mm_movemask_epi8(_mm_cmpeq_epi32(alpha, _mm_set1_epi32(0xff))) == 0xffff) {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dest), s);
+            continue;
+        }
+
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dest));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest), BlendSSE2(d, s));
+    }
+
+    for (; count; count--, dest++, src++) {
+        *dest = Lemon::Graphics::AlphaBlendInt(*dest, *src);
+    }
+}
+
+__attribute__((target("avx2"))) static inline __m256 BlendChannelAVX2(__m256i dest, __m256i src, int shift,
+                                                                      __m256 mulDestAlpha, __m256 mulAlpha,
+                                                                      __m256 resultAlpha, __m256 resultReciprocal) {
+    const __m256i channelMask = _mm256_set1_epi32(0xff);
+    const __m256 one = _mm256_set1_ps(1);
+
+    __m256 d = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(dest, shift), channelMask));
+    __m256 s = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(src, shift), channelMask));
+    __m256 n = _mm256_add_ps(_mm256_mul_ps(d, mulDestAlpha), _mm256_mul_ps(s, mulAlpha));
+
+    __m256 q = _mm256_cvtepi32_ps(_mm256_cvttps_epi32(_mm256_mul_ps(n, resultReciprocal)));
+    __m256 product = _mm256_mul_ps(q, resultAlpha);
+    q = _mm256_add_ps(q, _mm256_and_ps(_mm256_cmp_ps(_mm256_add_ps(product, resultAlpha), n, _CMP_LE_OQ), one));
+    q = _mm256_sub_ps(q, _mm256_and_ps(_mm256_cmp_ps(product, n, _CMP_GT_OQ), one));
+    return q;
+}
+
+__attribute__((target("avx2"))) static inline __m256i BlendAVX2(__m256i dest, __m256i src) {
+    __m256i srcAlphaInt = _mm256_srli_epi32(src, 24);
+    __m256i destAlphaInt = _mm256_srli_epi32(dest, 24);
+    __m256 alpha = _mm256_cvtepi32_ps(srcAlphaInt);
+    __m256 destAlpha = _mm256_cvtepi32_ps(destAlphaInt);
+
+    __m256 mulAlpha = _mm256_mul_ps(alpha, _mm256_set1_ps(256));
+    __m256 mulDestAlpha = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(255), alpha), destAlpha);
+    __m256 resultAlpha = _mm256_add_ps(mulAlpha, mulDestAlpha);
+    __m256 resultReciprocal = _mm256_div_ps(_mm256_set1_ps(1), resultAlpha);
+
+    __m256i result =
+        _mm256_slli_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(resultAlpha, _mm256_set1_ps(1.f / 256))), 24);
+    for (int shift = 0; shift < 24; shift += 8) {
+        __m256 c = BlendChannelAVX2(dest, src, shift, mulDestAlpha, mulAlpha, resultAlpha, resultReciprocal);
+        result = _mm256_or_si256(result, _mm256_slli_epi32(_mm256_cvttps_epi32(c), shift));
+    }
+
+    __m256i keepDest = _mm256_cmpeq_epi32(srcAlphaInt, _mm256_setzero_si256());
+    __m256i takeSrc = _mm256_or_si256(_mm256_cmpeq_epi32(srcAlphaInt, _mm256_set1_epi32(0xff)),
+                                      _mm256_cmpeq_epi32(destAlphaInt, _mm256_setzero_si256()));
+    result = _mm256_blendv_epi8(result, src, takeSrc);
+    return _mm256_blendv_epi8(result, dest, keepDest);
+}
+
+__attribute__((target("avx2"))) void alphablend_avx2(uint32_t* dest, const uint32_t* src, size_t count) {
+    for (; count >= 8; count -= 8, dest += 8, src += 8) {
+        __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src));
+        __m256i alpha = _mm256_srli_epi32(s, 24);
+
+        if (_mm256_testz_si256(alpha, alpha)) {
+            continue; // Fully transparent, dest does not change
+        } else if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(alpha, _mm256_set1_epi32(0xff))) == -1) {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest), s);
+            continue;
+        }
+
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dest));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest), BlendAVX2(d, s));
+    }
+
+    alphablend_sse2(dest, src, count);
+}
+
+void alphafill_sse2(uint32_t* dest, uint32_t colour, size_t count) {
+    if ((colour >> 24) == 0) {
+        return;
+    } else if ((colour >> 24) == 0xff) {
+        memset32_optimized(dest, colour, count);
+        return;
+    }
+
+    __m128i s = _mm_set1_epi32(colour);
+    for (; count >= 4; count -= 4, dest += 4) {
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dest));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest), BlendSSE2(d, s));
+    }
+
+    for (; count; count--, dest++) {
+        *dest = Lemon::Graphics::AlphaBlendInt(*dest, colour);
+    }
+}
+
+__attribute__((target("avx2"))) void alphafill_avx2(uint32_t* dest, uint32_t colour, size_t count) {
+    if ((colour >> 24) == 0) {
+        return;
+    } else if ((colour >> 24) == 0xff) {
+        memset32_optimized(dest, colour, count);
+        return;
+    }
+
+    __m256i s = _mm256_set1_epi32(colour);
+    for (; count >= 8; count -= 8, dest += 8) {
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dest));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest), BlendAVX2(d, s));
+    }
+
+    alphafill_sse2(dest, colour, count);
+}
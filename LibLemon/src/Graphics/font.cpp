@@ -1,8 +1,11 @@
 #include <Lemon/Graphics/Font.h>
 
+#include <Lemon/Core/StartupProfile.h>
+
 #include <ft2build.h>
 #include FT_FREETYPE_H
 
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
 #include <cstdio>
@@ -10,6 +13,11 @@
 #include <unordered_map>
 #include <string>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 namespace Lemon::Graphics {
 const char* FontException::errorStrings[] = {
     "Unknown Font Error",      "Failed to open font file", "Freetype error on loading font",
@@ -19,28 +27,73 @@ const char* FontException::errorStrings[] = {
 int fontState = 0;
 Font* mainFont = nullptr;
 
+struct FontFile {
+    const uint8_t* data;
+    size_t size;
+};
+
 static FT_Library library;
 static std::unordered_map<std::string, Font*>* fonts =
     nullptr; // Clang appears to call InitializeFonts before the constructor for the map
+static std::unordered_map<std::string, FontFile>* fontFiles = nullptr;
+
+// Font files are mapped rather than read by FreeType, so every process using a font shares the pages
+// of the file in the page cache and a font loaded at several sizes is only mapped once.
+static const FontFile* MapFontFile(const char* path) {
+    if (auto it = fontFiles->find(path); it != fontFiles->end()) {
+        return &it->second;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size <= 0) {
+        close(fd);
+        return nullptr;
+    }
+
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping keeps the file open
+    if (data == MAP_FAILED) {
+        return nullptr;
+    }
+
+    FontFile file = {.data = reinterpret_cast<const uint8_t*>(data), .size = static_cast<size_t>(st.st_size)};
+    return &fontFiles->insert({path, file}).first->second;
+}
 
 void RefreshFonts() {
     if (library)
         FT_Done_FreeType(library);
+    library = nullptr;
     fontState = 0;
 }
 
-__attribute__((constructor)) void InitializeFonts() {
+// Called on first use rather than at startup, so programs which never draw text do not load any fonts
+void InitializeFonts() {
+    if (fontState) {
+        return; // Already loaded, or failed and using the bitmap font
+    }
     fontState = -1;
 
     if (FT_Init_FreeType(&library)) {
         printf("Error initializing freetype");
+        library = nullptr;
         return;
     }
 
-    fonts = new std::unordered_map<std::string, Font*>{};
+    if (!fonts) {
+        fonts = new std::unordered_map<std::string, Font*>{};
+        fontFiles = new std::unordered_map<std::string, FontFile>{};
+    }
 
-    mainFont = LoadFont("/system/lemon/resources/fonts/notosans.otf", "default", 10);
-    if(!mainFont) {
+    try {
+        mainFont = LoadFont("/system/lemon/resources/fonts/notosans.otf", "default", 10);
+    } catch (const FontException& e) {
+        fprintf(stderr, "Warning: failed to load the default font: %s\n", e.what());
         return;
     }
 
@@ -48,10 +101,24 @@ __attribute__((constructor)) void InitializeFonts() {
 }
 
 Font* LoadFont(const char* path, const char* id, int sz) {
+    StartupProfile::Scope profile("LoadFont");
+
+    InitializeFonts();
+    if (!library) {
+        throw FontException(FontException::FontLoadError);
+    }
+
     Font* font = new Font;
     FT_Face face;
 
-    if (int err = FT_New_Face(library, path, 0, &face)) {
+    int err;
+    if (const FontFile* file = MapFontFile(path)) {
+        err = FT_New_Memory_Face(library, file->data, file->size, 0, &face);
+    } else {
+        err = FT_New_Face(library, path, 0, &face);
+    }
+
+    if (err) {
         // Freetype Error loading custom font from memory
         throw FontException(FontException::FontLoadError, err);
         return nullptr;
@@ -86,6 +153,7 @@ Font* LoadFont(const char* path, const char* id, int sz) {
     font->tabWidth = 4;
 
     font->face = face;
+    font->glyphs = new GlyphCache(std::max(GLYPH_ATLAS_MIN_WIDTH, font->pixelHeight * 2));
 
     assert(fonts);
     fonts->insert({font->id, font});
@@ -93,7 +161,73 @@ Font* LoadFont(const char* path, const char* id, int sz) {
     return font;
 }
 
+const Glyph* GlyphCache::Get(Font* font, uint32_t codepoint) {
+    if (codepoint < 128 && m_ascii[codepoint]) {
+        return m_ascii[codepoint];
+    }
+
+    auto it = m_glyphs.find(codepoint);
+    if (it == m_glyphs.end()) {
+        Glyph glyph;
+        if (!Rasterise(font, codepoint, glyph)) {
+            return nullptr;
+        }
+
+        it = m_glyphs.insert({codepoint, glyph}).first;
+    }
+
+    // References to elements of an unordered_map survive rehashing
+    if (codepoint < 128) {
+        m_ascii[codepoint] = &it->second;
+    }
+    return &it->second;
+}
+
+bool GlyphCache::Rasterise(Font* font, uint32_t codepoint, Glyph& glyph) {
+    FT_Face face = (FT_Face)font->face;
+
+    glyph.index = FT_Get_Char_Index(face, codepoint);
+    if (FT_Load_Glyph(face, glyph.index, FT_LOAD_RENDER)) {
+        return false;
+    }
+
+    const FT_Bitmap& bitmap = face->glyph->bitmap;
+    glyph.top = face->glyph->bitmap_top;
+    glyph.width = std::min<int>(bitmap.width, m_atlasWidth);
+    glyph.height = bitmap.rows;
+    glyph.advance = face->glyph->advance.x >> 6;
+
+    // Start a new shelf when the glyph does not fit on this one
+    if (m_shelfX + glyph.width > m_atlasWidth) {
+        m_shelfY += m_shelfHeight;
+        m_shelfX = 0;
+        m_shelfHeight = 0;
+    }
+
+    glyph.atlasX = m_shelfX;
+    glyph.atlasY = m_shelfY;
+    m_shelfX += glyph.width;
+    m_shelfHeight = std::max(m_shelfHeight, glyph.height);
+
+    size_t atlasSize = static_cast<size_t>(m_shelfY + m_shelfHeight) * m_atlasWidth;
+    if (m_atlas.size() < atlasSize) {
+        m_atlas.resize(atlasSize);
+    }
+
+    for (int i = 0; i < glyph.height; i++) {
+        memcpy(&m_atlas[(glyph.atlasY + i) * m_atlasWidth + glyph.atlasX], bitmap.buffer + i * bitmap.pitch,
+               glyph.width);
+    }
+
+    return true;
+}
+
 Font* GetFont(const char* id) {
+    InitializeFonts();
+    if (!fonts) {
+        return mainFont;
+    }
+
     Font* font;
     try {
         font = fonts->at(id);
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
 #include <assert.h>
 
 #include "FastMem.h"
@@ -96,6 +97,37 @@ void DrawRectOutline(int x, int y, int width, int height, uint8_t r, uint8_t g,
     DrawRect(x + width - 1, y + 1, 1, height - 2, r, g, b, surface, mask);
 }
 
+void DrawMask8(int x, int y, const uint8_t* rows, int stride, int height, const RGBAColour& colour, surface_t* surface,
+               const Rect& mask) {
+    int top = std::max({y, mask.y, 0});
+    int bottom = std::min({y + height, mask.y + mask.height, surface->height});
+    int left = std::max({x, mask.x, 0});
+    int right = std::min({x + 8, mask.x + mask.width, surface->width});
+    if (top >= bottom || left >= right) {
+        return;
+    }
+
+    // Clear the bits of clipped columns, so nothing within the rows needs checking
+    unsigned columns = (0xffu >> (left - x)) & (0xffu << (8 - (right - x)));
+    uint32_t colour_i = RGBAColour::ToARGB(colour);
+    uint32_t* buffer = reinterpret_cast<uint32_t*>(surface->buffer);
+
+    for (int row = top; row < bottom; row++) {
+        unsigned bits = rows[(row - y) * stride] & columns;
+        uint32_t* line = buffer + row * surface->width + x;
+
+        while (bits) {
+            int start = __builtin_clz(bits) - 24;
+            int length = __builtin_clz(~((bits << start) << 24));
+
+            for (int i = start; i < start + length; i++) {
+                line[i] = colour_i;
+            }
+            bits &= ~((0xffu >> start) & ~(0xffu >> (start + length)));
+        }
+    }
+}
+
 uint32_t Interpolate(double q11, double q21, double q12, double q22, double x, double y) {
     double val1 = q11;
     double val2 = q21;
@@ -190,68 +222,61 @@ void DrawGradientVertical(int x, int y, int width, int height, rgba_colour_t c1,
     }
 }
 
+// Largest integer whose square is at most n
+static inline int SquareRoot(int n) {
+    int root = sqrt(n);
+    while (root * root > n) {
+        root--;
+    }
+    while ((root + 1) * (root + 1) <= n) {
+        root++;
+    }
+    return root;
+}
+
 static void DrawCircleQuadrant(int x, int y, uint8_t r, uint8_t g, uint8_t b, int radius, int quadrant,
                                surface_t* surface, const Rect& mask) {
+    // Clipped once, so each row is a span and a few edge pixels
     int maxWidth = std::min(surface->width, mask.x + mask.width);
     int maxHeight = std::min(surface->height, mask.y + mask.height);
     int minX = std::max(0, mask.x);
     int minY = std::max(0, mask.y);
 
-    // int radiusSquared = radius * radius; // For the pythagorean equ
     uint32_t colour_i = 0xFF000000 | (r << 16) | (g << 8) | b;
+    bool leftSide = quadrant == 2 || quadrant == 3;
 
-    for (int i = radius; i >= 0; i--) {
-        int iSquared = i * i;
-        int yOffset;
-        int yPos;
-
-        if (quadrant <= 2) {
-            yPos = (y + radius - i);
-            yOffset = surface->width * yPos;
-        } else {
-            yPos = (y + i);
-            yOffset = surface->width * yPos;
-        }
+    // j is the distance from the centre along the row, the column at j = 0 is filled by the rect on the left side
+    int minJ = leftSide ? 1 : 0;
+    auto column = [&](int j) -> int { return leftSide ? (x + radius - j) : (x + j - 1); };
 
-        if(yPos > maxHeight || yPos < minY){
+    for (int i = radius; i >= 0; i--) {
+        int yPos = (quadrant <= 2) ? (y + radius - i) : (y + i);
+        if (yPos >= maxHeight || yPos < minY) {
             continue;
         }
+        uint32_t* row = reinterpret_cast<uint32_t*>(surface->buffer) + surface->width * yPos;
 
-        for (int j = radius; j >= 0; j--) {
-            int jSquared = j * j;
-            double dist = sqrt(iSquared + jSquared);
-            double opacity = std::clamp(0.5 - (dist - (radius + 0.5)), 0.0, 1.0);
+        // Pixels within radius of the centre are opaque, those within radius + 1 are antialiased
+        int iSquared = i * i;
+        int opaqueJ = SquareRoot(radius * radius - iSquared);
+        int edgeJ = std::min(radius, SquareRoot((radius + 1) * (radius + 1) - iSquared - 1));
+
+        if (opaqueJ >= minJ) {
+            int spanStart = std::max(std::min(column(minJ), column(opaqueJ)), minX);
+            int spanEnd = std::min(std::max(column(minJ), column(opaqueJ)) + 1, maxWidth);
+            if (spanEnd > spanStart) {
+                memset32_optimized(row + spanStart, colour_i, spanEnd - spanStart);
+            }
+        }
 
-            if (opacity <= 0) {
+        for (int j = std::max(opaqueJ + 1, minJ); j <= edgeJ; j++) {
+            int xPos = column(j);
+            if (xPos >= maxWidth || xPos < minX) {
                 continue;
             }
 
-            int xPos;
-            if (quadrant == 1 || quadrant == 4) {
-                xPos = x + j - 1;
-
-                if(xPos > maxWidth || xPos < minX){
-                    continue;
-                }
-
-                uint32_t& pixel = reinterpret_cast<uint32_t*>(surface->buffer)[yOffset + xPos];
-                pixel = AlphaBlendF(pixel, r, g, b, opacity);
-            } else {
-                xPos = x + radius - j;
-
-                if(xPos > maxWidth || xPos < minX){
-                    continue;
-                }
-
-                uint32_t& pixel = reinterpret_cast<uint32_t*>(surface->buffer)[yOffset + xPos];
-
-                if (opacity >= 1) { // That should be all opaque pixels on this row
-                    memset32_optimized(&pixel, colour_i, j);
-                    break;
-                }
-
-                pixel = AlphaBlendF(pixel, r, g, b, opacity);
-            }
+            double opacity = std::clamp(radius + 1 - sqrt(iSquared + j * j), 0.0, 1.0);
+            row[xPos] = AlphaBlendF(row[xPos], r, g, b, opacity);
         }
     }
 }
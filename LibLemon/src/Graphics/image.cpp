@@ -6,8 +6,13 @@
 #include <math.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <emmintrin.h>
+#include <vector>
+
 #include <zlib.h>
 #include <png.h>
 #include <jpeglib.h>
@@ -70,147 +75,225 @@ int LoadImage(const char* path, surface_t* surface) {
     return r;
 }
 
-int LoadImage(const char* path, int x, int y, int w, int h, surface_t* surface, bool preserveAspectRatio) {
-    FILE* imageFile = fopen(path, "rb");
+// Source pixel and the weight out of 256 given to the one after it, for a pixel of the scaled image
+struct ScaleStep {
+    int index;
+    int next;
+    int weight;
+};
 
-    if (!imageFile) {
-        return -1; // Error opening image file
-    }
+static inline ScaleStep ScaleStepAt(int i, double scale, int srcSize) {
+    double pos = i / scale;
+    int index = std::min(static_cast<int>(pos), srcSize - 1);
+    int weight = std::min(static_cast<int>((pos - index) * 256), 256);
 
-    char sig[8];
+    return {index, std::min(index + 1, srcSize - 1), weight};
+}
 
-    fseek(imageFile, 0, SEEK_SET);
+static void ImageScale(int srcWidth, int srcHeight, int w, int h, bool preserveAspectRatio, double& xScale,
+                       double& yScale) {
+    xScale = static_cast<double>(w) / srcWidth;
+    yScale = static_cast<double>(h) / srcHeight;
 
-    if (!fread(sig, 8, 1, imageFile)) {
-        fclose(imageFile);
-        return -2; // Could not read first 8 bytes of image
+    // Fill the area, cropping the right and bottom
+    if (preserveAspectRatio) {
+        xScale = yScale = std::max(xScale, yScale);
     }
+}
 
-    int type = IdentifyImage(sig); // Identify Image Type
-
-    if (type == Image_Unknown) { // Unknown Image Type
-        fclose(imageFile);
-        return type;
+// Bilinearly sample a row of the scaled image between two source rows, rowWeight being that of nextRow out of 256
+static void ScaleRow(uint32_t* dest, const uint32_t* row, const uint32_t* nextRow, int rowWeight,
+                     const ScaleStep* columns, int count) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(128);
+
+    for (int i = 0; i < count; i++) {
+        const ScaleStep& column = columns[i];
+
+        // The four weights add to 256, so the weighted sum of each channel fits in 16 bits
+        int topRight = (column.weight * (256 - rowWeight) + 128) >> 8;
+        int topLeft = 256 - rowWeight - topRight;
+        int bottomRight = (column.weight * rowWeight + 128) >> 8;
+        int bottomLeft = rowWeight - bottomRight;
+
+        __m128i top = _mm_unpacklo_epi8(
+            _mm_set_epi32(0, 0, static_cast<int>(row[column.next]), static_cast<int>(row[column.index])), zero);
+        __m128i bottom = _mm_unpacklo_epi8(
+            _mm_set_epi32(0, 0, static_cast<int>(nextRow[column.next]), static_cast<int>(nextRow[column.index])),
+            zero);
+
+        __m128i sum = _mm_add_epi16(
+            _mm_mullo_epi16(top, _mm_set_epi16(topRight, topRight, topRight, topRight, topLeft, topLeft, topLeft,
+                                               topLeft)),
+            _mm_mullo_epi16(bottom, _mm_set_epi16(bottomRight, bottomRight, bottomRight, bottomRight, bottomLeft,
+                                                  bottomLeft, bottomLeft, bottomLeft)));
+        sum = _mm_add_epi16(sum, _mm_srli_si128(sum, 8));
+        sum = _mm_srli_epi16(_mm_add_epi16(sum, round), 8);
+
+        dest[i] = _mm_cvtsi128_si32(_mm_packus_epi16(sum, zero));
     }
+}
 
-    surface_t surf;
-    int r = LoadImage(imageFile, &surf);
-
-    if (r)
-        return r;
-
-    double xScale = ((double)w) / surf.width;
-    double yScale = (((double)h) / surf.height);
-    double xOffset = 0;
-
-    if (preserveAspectRatio) {
-        if (yScale > xScale)
-            xScale = yScale;
-        else
-            yScale = xScale;
+/////////////////////////////
+/// \brief Scale an image into the w by h area of surface at x, y
+///
+/// \param getRow Returns the source row asked for or nullptr on error. Rows are asked for in increasing order,
+/// and only the last two are used at once, so they can be decoded as they are needed.
+/////////////////////////////
+template <typename GetRow>
+static int ScaleImage(int srcWidth, int srcHeight, int x, int y, int w, int h, surface_t* surface,
+                      bool preserveAspectRatio, GetRow getRow) {
+    double xScale, yScale;
+    ImageScale(srcWidth, srcHeight, w, h, preserveAspectRatio, xScale, yScale);
+
+    int columnCount = std::min(w, surface->width - x);
+    int rowCount = std::min(h, surface->height - y);
+    if (columnCount <= 0 || rowCount <= 0) {
+        return 0;
     }
 
-    uint8_t* srcBuffer = surf.buffer;
-
-    if (!surface->buffer) { // Allocate new surface if needed
-        *surface = {.width = w + x, .height = h + y, .depth = 32, .buffer = new uint8_t[(w + x) * (h + y) * 4]};
+    std::vector<ScaleStep> columns(columnCount);
+    for (int j = 0; j < columnCount; j++) {
+        columns[j] = ScaleStepAt(j, xScale, srcWidth);
     }
 
-    uint32_t* destBuffer = (uint32_t*)surface->buffer;
+    uint32_t* dest = reinterpret_cast<uint32_t*>(surface->buffer) + y * surface->width + x;
+    for (int i = 0; i < rowCount; i++, dest += surface->width) {
+        ScaleStep step = ScaleStepAt(i, yScale, srcHeight);
 
-    for (int i = 0; i < h && i + y < surface->height; i++) {
-        double _yval = ((double)i) / yScale;
-        if (ceil(_yval) >= surf.height)
-            break;
-        for (int j = 0; j < w && j + x < surface->width; j++) {
-            double _xval = xOffset + ((double)+j) / xScale;
-            if (ceil(_xval) >= surf.width)
-                break;
-            uint32_t offset = (y + i) * surface->width + x + j;
-
-            long b = Interpolate(srcBuffer[((int)floor(_yval) * surf.width + (int)floor(_xval)) * 4],
-                                 srcBuffer[((int)floor(_yval) * surf.width + (int)ceil(_xval)) * 4],
-                                 srcBuffer[((int)ceil(_yval) * surf.width + (int)floor(_xval)) * 4],
-                                 srcBuffer[((int)ceil(_yval) * surf.width + (int)ceil(_xval)) * 4], _xval, _yval);
-            long g = Interpolate(srcBuffer[((int)floor(_yval) * surf.width + (int)floor(_xval)) * 4 + 1],
-                                 srcBuffer[((int)floor(_yval) * surf.width + (int)ceil(_xval)) * 4 + 1],
-                                 srcBuffer[((int)floor(_yval) * surf.width + (int)ceil(_xval)) * 4 + 1],
-                                 srcBuffer[((int)ceil(_yval) * surf.width + (int)ceil(_xval)) * 4 + 1], _xval, _yval);
-            long r = Interpolate(srcBuffer[((int)floor(_yval) * surf.width + (int)floor(_xval)) * 4 + 2],
-                                 srcBuffer[((int)floor(_yval) * surf.width + (int)ceil(_xval)) * 4 + 2],
-                                 srcBuffer[((int)floor(_yval) * surf.width + (int)ceil(_xval)) * 4 + 2],
-                                 srcBuffer[((int)ceil(_yval) * surf.width + (int)ceil(_xval)) * 4 + 2], _xval, _yval);
-            long a = Interpolate(srcBuffer[((int)floor(_yval) * surf.width + (int)floor(_xval)) * 4 + 3],
-                                 srcBuffer[((int)floor(_yval) * surf.width + (int)ceil(_xval)) * 4 + 3],
-                                 srcBuffer[((int)floor(_yval) * surf.width + (int)ceil(_xval)) * 4 + 3],
-                                 srcBuffer[((int)ceil(_yval) * surf.width + (int)ceil(_xval)) * 4 + 3], _xval, _yval);
-
-            destBuffer[offset] = (a << 24) | (r << 16) | (g << 8) | b;
+        const uint32_t* row = getRow(step.index);
+        const uint32_t* nextRow = getRow(step.next);
+        if (!row || !nextRow) {
+            return -3; // Error decoding image
         }
-    }
 
-    free(srcBuffer);
-    fclose(imageFile);
+        ScaleRow(dest, row, nextRow, step.weight, columns.data(), columnCount);
+    }
 
     return 0;
 }
 
-int LoadPNGImage(FILE* f, surface_t* surface) {
-    png_structp png = nullptr;
-    png_infop info = nullptr;
-
-    png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
-    if (!png)
-        return -10;
-
-    info = png_create_info_struct(png);
-    if (!info)
-        return -11;
-
-    int e = setjmp(png_jmpbuf(png));
-    if (e) {
-        printf("[LibLemon] LoadPNGImage: setjmp error %d\n", 0);
-        return e;
+// libpng longjmps on errors, so calls which may fail are kept in functions without any objects to destroy
+static bool ReadPNGInfo(png_structp png, png_infop info, FILE* f) {
+    if (setjmp(png_jmpbuf(png))) {
+        return false;
     }
 
     png_init_io(png, f);
-    png_set_sig_bytes(png, 8); // ftell(f));
+    png_set_sig_bytes(png, 8);
 
     png_read_info(png, info);
 
-    png_uint_32 width = png_get_image_width(png, info);
-    png_uint_32 height = png_get_image_height(png, info);
-
-    if (png_get_color_type(png, info) == PNG_COLOR_TYPE_PALETTE)
+    // Have libpng give 8-bit BGRA whatever the format of the image
+    png_byte colourType = png_get_color_type(png, info);
+    if (colourType == PNG_COLOR_TYPE_PALETTE) {
         png_set_palette_to_rgb(png);
+    } else if (colourType == PNG_COLOR_TYPE_GRAY || colourType == PNG_COLOR_TYPE_GRAY_ALPHA) {
+        png_set_expand_gray_1_2_4_to_8(png);
+        png_set_gray_to_rgb(png);
+    }
 
-    if (png_get_color_type(png, info) == PNG_COLOR_TYPE_RGB)
+    if (png_get_valid(png, info, PNG_INFO_tRNS)) {
+        png_set_tRNS_to_alpha(png);
+    } else if (!(colourType & PNG_COLOR_MASK_ALPHA)) {
         png_set_filler(png, 0xff, PNG_FILLER_AFTER);
+    }
 
+    png_set_strip_16(png);
     png_set_bgr(png);
+    png_set_interlace_handling(png);
 
-    assert(width < INT_MAX);
-    assert(height < INT_MAX);
+    png_read_update_info(png, info);
+    return true;
+}
 
-    surface_t _surface = {.width = static_cast<int>(width),
-                          .height = static_cast<int>(height),
-                          .depth = 32,
-                          .buffer = (uint8_t*)malloc(width * height * 4)};
-    *surface = _surface;
+static bool ReadPNGRow(png_structp png, png_bytep row) {
+    if (setjmp(png_jmpbuf(png))) {
+        return false;
+    }
 
-    png_bytep rowPointers[height];
+    png_read_row(png, row, nullptr);
+    return true;
+}
 
-    for (png_uint_32 i = 0; i < height; i++) {
-        rowPointers[i] = surface->buffer + i * surface->width * 4;
-        png_read_row(png, rowPointers[i], NULL);
+static bool ReadPNGImage(png_structp png, png_bytepp rows) {
+    if (setjmp(png_jmpbuf(png))) {
+        return false;
     }
 
-    png_destroy_read_struct(&png, &info, nullptr);
+    png_read_image(png, rows);
+    return true;
+}
 
-    return 0;
+// Decode a PNG a row at a time straight into the scaled image, only keeping the two rows being sampled
+static int LoadPNGImageScaled(FILE* f, int x, int y, int w, int h, surface_t* surface, bool preserveAspectRatio) {
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    if (!png)
+        return -10;
+
+    png_infop info = png_create_info_struct(png);
+    if (!info) {
+        png_destroy_read_struct(&png, nullptr, nullptr);
+        return -11;
+    }
+
+    if (!ReadPNGInfo(png, info, f)) {
+        png_destroy_read_struct(&png, &info, nullptr);
+        return -12;
+    }
+
+    int width = png_get_image_width(png, info);
+    int height = png_get_image_height(png, info);
+    size_t rowBytes = png_get_rowbytes(png, info);
+
+    int e;
+    if (png_get_interlace_type(png, info) != PNG_INTERLACE_NONE) {
+        // Every pass covers the whole image, so it has to be decoded in full
+        uint8_t* buffer = new uint8_t[rowBytes * height];
+        png_bytepp rows = new png_bytep[height];
+        for (int i = 0; i < height; i++) {
+            rows[i] = buffer + i * rowBytes;
+        }
+
+        if (ReadPNGImage(png, rows)) {
+            e = ScaleImage(width, height, x, y, w, h, surface, preserveAspectRatio,
+                           [&](int row) { return reinterpret_cast<const uint32_t*>(rows[row]); });
+        } else {
+            e = -3;
+        }
+
+        delete[] rows;
+        delete[] buffer;
+    } else {
+        uint8_t* window[2] = {new uint8_t[rowBytes], new uint8_t[rowBytes]};
+        int rowsRead = 0;
+
+        // Rows not sampled still have to be read to get past them
+        e = ScaleImage(width, height, x, y, w, h, surface, preserveAspectRatio,
+                       [&](int row) -> const uint32_t* {
+                           for (; rowsRead <= row; rowsRead++) {
+                               if (!ReadPNGRow(png, window[rowsRead & 1])) {
+                                   return nullptr;
+                               }
+                           }
+                           return reinterpret_cast<const uint32_t*>(window[row & 1]);
+                       });
+
+        delete[] window[0];
+        delete[] window[1];
+    }
+
+    png_destroy_read_struct(&png, &info, nullptr);
+    return e;
 }
 
-int LoadJPEGImage(FILE* f, Surface* surface) {
+/////////////////////////////
+/// \brief Decode a JPEG no smaller than it would be scaled to
+///
+/// libjpeg can scale down by 1/2, 1/4 or 1/8 while decoding, skipping most of the work
+/// for detail that scaling would lose anyway. Decodes at full size when w or h is 0.
+/////////////////////////////
+static int DecodeJPEGImage(FILE* f, surface_t* surface, int w, int h, bool preserveAspectRatio) {
     jpeg_decompress_struct cInfo;
 
     fseek(f, 0, SEEK_SET);
@@ -226,10 +309,24 @@ int LoadJPEGImage(FILE* f, Surface* surface) {
 
     cInfo.out_color_space = JCS_EXT_BGRA;
 
+    if (w > 0 && h > 0) {
+        double xScale, yScale;
+        ImageScale(cInfo.image_width, cInfo.image_height, w, h, preserveAspectRatio, xScale, yScale);
+
+        unsigned scaleDenom = 8;
+        while (scaleDenom > 1 && scaleDenom * std::max(xScale, yScale) > 1) {
+            scaleDenom /= 2;
+        }
+
+        cInfo.scale_num = 1;
+        cInfo.scale_denom = scaleDenom;
+    }
+
     jpeg_start_decompress(&cInfo);
 
     surface->width = cInfo.output_width;
     surface->height = cInfo.output_height;
+    surface->depth = 32;
 
     surface->buffer = new uint8_t[surface->width * surface->height * 4];
 
@@ -244,6 +341,175 @@ int LoadJPEGImage(FILE* f, Surface* surface) {
     return 0;
 }
 
+int LoadImage(const char* path, int x, int y, int w, int h, surface_t* surface, bool preserveAspectRatio) {
+    FILE* imageFile = fopen(path, "rb");
+
+    if (!imageFile) {
+        return -1; // Error opening image file
+    }
+
+    char sig[8];
+
+    fseek(imageFile, 0, SEEK_SET);
+
+    if (!fread(sig, 8, 1, imageFile)) {
+        fclose(imageFile);
+        return -2; // Could not read first 8 bytes of image
+    }
+
+    int type = IdentifyImage(sig); // Identify Image Type
+
+    if (type == Image_Unknown) { // Unknown Image Type
+        fclose(imageFile);
+        return type;
+    }
+
+    surface_t original = *surface;
+    if (!surface->buffer) { // Allocate new surface if needed
+        *surface = {.width = w + x, .height = h + y, .depth = 32, .buffer = new uint8_t[(w + x) * (h + y) * 4]};
+    }
+
+    int r;
+    if (type == Image_PNG) {
+        r = LoadPNGImageScaled(imageFile, x, y, w, h, surface, preserveAspectRatio);
+    } else {
+        surface_t surf;
+        if (type == Image_JPEG) {
+            r = DecodeJPEGImage(imageFile, &surf, w, h, preserveAspectRatio);
+        } else {
+            r = LoadBitmapImage(imageFile, &surf);
+        }
+
+        if (!r) {
+            r = ScaleImage(surf.width, surf.height, x, y, w, h, surface, preserveAspectRatio, [&](int row) {
+                return reinterpret_cast<const uint32_t*>(surf.buffer) + row * surf.width;
+            });
+
+            if (type == Image_JPEG) {
+                delete[] surf.buffer;
+            } else {
+                free(surf.buffer);
+            }
+        }
+    }
+
+    fclose(imageFile);
+
+    if (r && !original.buffer) {
+        delete[] surface->buffer;
+        *surface = original;
+    }
+
+    return r;
+}
+
+int GetImageSize(const char* path, int& width, int& height) {
+    FILE* imageFile = fopen(path, "rb");
+    if (!imageFile) {
+        return -1; // Error opening image file
+    }
+
+    // Enough for the PNG signature and IHDR chunk or the bitmap headers
+    uint8_t header[sizeof(bitmap_file_header_t) + sizeof(bitmap_info_header_t)];
+    if (!fread(header, sizeof(header), 1, imageFile)) {
+        fclose(imageFile);
+        return -2;
+    }
+
+    int type = IdentifyImage(header);
+    if (type == Image_PNG) {
+        // The IHDR chunk always comes first, its big endian width and height follow the chunk length and type
+        auto readBE32 = [&](int offset) -> uint32_t {
+            return (header[offset] << 24) | (header[offset + 1] << 16) | (header[offset + 2] << 8) | header[offset + 3];
+        };
+        width = readBE32(16);
+        height = readBE32(20);
+    } else if (type == Image_JPEG) {
+        jpeg_decompress_struct cInfo;
+
+        struct jpeg_error_mgr err;
+        jpeg_std_error(&err);
+
+        cInfo.err = &err;
+        jpeg_create_decompress(&cInfo);
+
+        fseek(imageFile, 0, SEEK_SET);
+        jpeg_stdio_src(&cInfo, imageFile);
+        jpeg_read_header(&cInfo, TRUE);
+
+        width = cInfo.image_width;
+        height = cInfo.image_height;
+
+        jpeg_destroy_decompress(&cInfo);
+    } else if (type == Image_BMP) {
+        bitmap_info_header_t info;
+        memcpy(&info, header + sizeof(bitmap_file_header_t), sizeof(info));
+
+        width = info.width;
+        height = abs(info.height); // Negative for top down bitmaps
+    } else {
+        fclose(imageFile);
+        return -4; // Unknown image type
+    }
+
+    fclose(imageFile);
+    return (width > 0 && height > 0) ? 0 : -3;
+}
+
+int LoadPNGImage(FILE* f, surface_t* surface) {
+    png_structp png = nullptr;
+    png_infop info = nullptr;
+
+    png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    if (!png)
+        return -10;
+
+    info = png_create_info_struct(png);
+    if (!info) {
+        png_destroy_read_struct(&png, nullptr, nullptr);
+        return -11;
+    }
+
+    if (!ReadPNGInfo(png, info, f)) {
+        printf("[LibLemon] LoadPNGImage: Error reading header\n");
+        png_destroy_read_struct(&png, &info, nullptr);
+        return -12;
+    }
+
+    png_uint_32 width = png_get_image_width(png, info);
+    png_uint_32 height = png_get_image_height(png, info);
+
+    assert(width < INT_MAX);
+    assert(height < INT_MAX);
+
+    surface_t _surface = {.width = static_cast<int>(width),
+                          .height = static_cast<int>(height),
+                          .depth = 32,
+                          .buffer = (uint8_t*)malloc(width * height * 4)};
+
+    png_bytepp rowPointers = new png_bytep[height];
+
+    for (png_uint_32 i = 0; i < height; i++) {
+        rowPointers[i] = _surface.buffer + i * _surface.width * 4;
+    }
+
+    bool read = ReadPNGImage(png, rowPointers);
+
+    png_destroy_read_struct(&png, &info, nullptr);
+    delete[] rowPointers;
+
+    if (!read) {
+        printf("[LibLemon] LoadPNGImage: Error decoding image\n");
+        free(_surface.buffer);
+        return -3;
+    }
+
+    *surface = _surface;
+    return 0;
+}
+
+int LoadJPEGImage(FILE* f, Surface* surface) { return DecodeJPEGImage(f, surface, 0, 0, false); }
+
 int SavePNGImage(FILE* f, surface_t* surface, bool writeTransparency) {
     png_structp png = nullptr;
     png_infop info = nullptr;
@@ -2,12 +2,12 @@ global memcpy_sse2:function
 global memset32_sse2:function
 global memset64_sse2:function
 global memcpy_sse2_unaligned:function
-global memcpy_optimized:function
+global memcpy_sse2_stream:function
 
 section .text
 
 ; (void* dest (rdi), void* src (rsi), uint64_t count (rdx))
-memcpy_optimized:
+memcpy_sse2_stream:
 	mov rcx, rdx
 	shr rcx, 2 ; Get number of 16 byte chunks
 
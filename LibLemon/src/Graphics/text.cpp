@@ -7,7 +7,9 @@
 #include <ft2build.h>
 #include FT_FREETYPE_H
 
+#include <algorithm>
 #include <ctype.h>
+#include <string.h>
 
 extern uint8_t font_default[];
 
@@ -15,6 +17,33 @@ namespace Lemon::Graphics {
 extern int fontState;
 extern Font* mainFont;
 
+// Blend the bitmap of a cached glyph with its top left at x, y, only touching pixels within top <= y < bottom,
+// left <= x and within the surface
+static void DrawGlyph(const GlyphCache& cache, const Glyph& glyph, int x, int y, uint8_t r, uint8_t g, uint8_t b,
+                      surface_t* surface, int left, int top, int bottom) {
+    top = std::max({top, y, 0});
+    bottom = std::min({bottom, y + glyph.height, surface->height});
+    left = std::max({left, x, 0});
+    int right = std::min(x + glyph.width, surface->width);
+
+    uint32_t colour_i = 0xFF000000 | (r << 16) | (g << 8) | b;
+    uint32_t* buffer = (uint32_t*)surface->buffer;
+
+    for (int row = top; row < bottom; row++) {
+        const uint8_t* coverage =
+            cache.Atlas() + (glyph.atlasY + row - y) * cache.AtlasWidth() + glyph.atlasX + (left - x);
+        uint32_t* pixel = buffer + row * surface->width + left;
+
+        for (int col = left; col < right; col++, coverage++, pixel++) {
+            if (*coverage == 255) {
+                *pixel = colour_i;
+            } else if (*coverage) {
+                *pixel = AlphaBlendInt(*pixel, RGBAColour::ToARGB({r, g, b, *coverage}));
+            }
+        }
+    }
+}
+
 int DrawChar(int character, int x, int y, uint8_t r, uint8_t g, uint8_t b, surface_t* surface, rect_t limits,
              Font* font) {
     if (!isprint(character)) {
@@ -24,70 +53,35 @@ int DrawChar(int character, int x, int y, uint8_t r, uint8_t g, uint8_t b, surfa
     if (y >= surface->height || x >= surface->width || y >= limits.height || x >= limits.width)
         return 0;
 
-    if (fontState == -1) { //
-        character &= 0x7F;
-
-        for (int i = 0; i < 12; i++) {
-            uint8_t line = font_default[i * 128 + character];
-
-            for (int j = 0; j < 8; j++) {
-                if (line & 0x80)
-                    DrawRect(j + x, i + y, 1, 1, r, g, b, surface);
-                line <<= 1; // Shift line left by one
-            }
-        }
+    if (fontState == -1) {
+        // Each row of a glyph is a byte, with the rows of every glyph side by side
+        DrawMask8(x, y, &font_default[character & 0x7F], 128, 12, {r, g, b, 0xff}, surface, limits);
         return 8;
     } else if (fontState != 1 || !font->face)
         InitializeFonts();
 
-    uint32_t colour_i = 0xFF000000 | (r << 16) | (g << 8) | b;
-    uint32_t* buffer = (uint32_t*)surface->buffer;
-
-    FT_Face face = (FT_Face)font->face;
-    if (int err = FT_Load_Char(face, character, FT_LOAD_RENDER)) {
+    const Glyph* glyph = font->glyphs->Get(font, character);
+    if (!glyph) {
         return 0;
     }
 
-    int maxHeight = font->lineHeight - (font->height - face->glyph->bitmap_top);
-
-    if (y + maxHeight >= limits.y + limits.height) {
-        maxHeight = limits.y + limits.height - y;
-    }
-
-    if (y + maxHeight >= surface->height) {
-        maxHeight = surface->height - y;
-    }
-
-    if (y < 0 && -y > maxHeight) {
-        return 0;
-    }
+    DrawGlyph(*font->glyphs, *glyph, x, y + font->height - glyph->top, r, g, b, surface, 0,
+              limits.y, std::min(y + font->lineHeight, limits.y + limits.height));
+    return glyph->advance;
+}
 
-    int i = 0;
-    if (y < 0) {
-        i = -y;
-    }
+// Decode str up to the first newline (text is only drawn and measured up to it), reading at most maxBytes.
+// The codepoints are in a buffer kept between calls, so only valid until the next call on the same thread.
+static const std::vector<int32_t>& DecodeLine(const char* str, size_t maxBytes) {
+    static thread_local std::vector<int32_t> codepoints;
 
-    if (y + (font->height - face->glyph->bitmap_top) < limits.y) {
-        i = limits.y - (y + (font->height - face->glyph->bitmap_top));
+    size_t length = strnlen(str, maxBytes);
+    if (const char* newline = reinterpret_cast<const char*>(memchr(str, '\n', length)); newline) {
+        length = newline - str;
     }
 
-    for (; i < static_cast<int>(face->glyph->bitmap.rows) && i < maxHeight; i++) {
-        if (y + i < 0)
-            continue;
-
-        uint32_t yOffset = (i + y + (font->height - face->glyph->bitmap_top)) * (surface->width);
-        for (unsigned int j = 0; j < face->glyph->bitmap.width && static_cast<long>(j) + x < surface->width;
-             j++) {
-            if (x + static_cast<long>(j) < 0)
-                continue;
-            if (face->glyph->bitmap.buffer[i * face->glyph->bitmap.width + j] == 255)
-                buffer[yOffset + (j + x)] = colour_i;
-            else if (face->glyph->bitmap.buffer[i * face->glyph->bitmap.width + j] > 0) {
-                buffer[yOffset + (j + x)] = AlphaBlendInt(buffer[yOffset + (j + x)], RGBAColour::ToARGB({r, g, b, face->glyph->bitmap.buffer[i * face->glyph->bitmap.width + j]}));
-            }
-        }
-    }
-    return face->glyph->advance.x >> 6;
+    UTF8ToUTF32(str, length, codepoints);
+    return codepoints;
 }
 
 int DrawChar(int character, int x, int y, uint8_t r, uint8_t g, uint8_t b, surface_t* surface, Font* font) {
@@ -98,7 +92,10 @@ int DrawChar(int character, int x, int y, rgba_colour_t col, surface_t* surface,
     return DrawChar(character, x, y, col.r, col.g, col.b, surface, font);
 }
 
-Font* DefaultFont() { return mainFont; }
+Font* DefaultFont() {
+    InitializeFonts();
+    return mainFont;
+}
 
 int DrawString(const char* str, int x, int y, uint8_t r, uint8_t g, uint8_t b, surface_t* surface, rect_t limits,
                Font* font) {
@@ -116,29 +113,16 @@ int DrawString(const char* str, int x, int y, uint8_t r, uint8_t g, uint8_t b, s
     } else if (fontState != 1 || !font->face)
         InitializeFonts();
 
-    uint32_t colour_i = 0xFF000000 | (r << 16) | (g << 8) | b;
-    uint32_t* buffer = (uint32_t*)surface->buffer;
-
-    unsigned int maxHeight = font->lineHeight;
-
-    if (y < 0 && static_cast<unsigned>(-y) > maxHeight) {
-        return 0;
-    }
-
-    if (y + static_cast<int>(maxHeight) >= limits.y + limits.height) {
-        maxHeight = limits.y + limits.height - y;
-    }
-
-    if (y + static_cast<int>(maxHeight) >= surface->height) {
-        maxHeight = surface->height - y;
-    }
+    // Glyphs are clipped to the line
+    int bottom = std::min(y + font->lineHeight, limits.y + limits.height);
 
     FT_Face face = (FT_Face)font->face;
+    GlyphCache& cache = *font->glyphs;
 
     unsigned int lastGlyph = 0;
     int xOffset = x;
 
-    auto codepoints = UTF8ToUTF32(str);
+    const auto& codepoints = DecodeLine(str, SIZE_MAX);
     for(int cp : codepoints) {
         if(cp < 0x80) {
             // Make sure the codepoint is ASCII,
@@ -150,57 +134,25 @@ int DrawString(const char* str, int x, int y, uint8_t r, uint8_t g, uint8_t b, s
             }
         }
 
-        unsigned int glyph = FT_Get_Char_Index(face, cp);
-        if (FT_HAS_KERNING(face) && lastGlyph) {
-            FT_Vector delta;
-
-            FT_Get_Kerning(face, lastGlyph, glyph, FT_KERNING_DEFAULT, &delta);
-            xOffset += delta.x >> 6;
-        }
-        lastGlyph = glyph;
-
-        if (int err = FT_Load_Glyph(face, glyph, FT_LOAD_RENDER)) {
+        const Glyph* glyph = cache.Get(font, cp);
+        if (!glyph) {
             continue;
         }
 
-        if (xOffset + (face->glyph->advance.x >> 6) < limits.x) {
-            xOffset += face->glyph->advance.x >> 6;
-            continue;
-        }
+        if (FT_HAS_KERNING(face) && lastGlyph) {
+            FT_Vector delta;
 
-        unsigned i = 0;
-        if (y < 0) {
-            i = -y;
+            FT_Get_Kerning(face, lastGlyph, glyph->index, FT_KERNING_DEFAULT, &delta);
+            xOffset += delta.x >> 6;
         }
+        lastGlyph = glyph->index;
 
-        if (y + (font->height - face->glyph->bitmap_top) < limits.y) {
-            i = limits.y - (y + (font->height - face->glyph->bitmap_top));
+        if (xOffset + glyph->advance >= limits.x) {
+            DrawGlyph(cache, *glyph, xOffset, y + font->height - glyph->top, r, g, b, surface,
+                      limits.x, limits.y, bottom);
         }
 
-        for (; i < face->glyph->bitmap.rows && i + (font->height - face->glyph->bitmap_top) < maxHeight;
-             i++) {
-            uint32_t yOffset = (i + y + (font->height - face->glyph->bitmap_top)) * (surface->width);
-
-            unsigned j = 0;
-            if (xOffset < 0) {
-                j = -x;
-            }
-
-            if (xOffset < limits.x) {
-                j = limits.x - xOffset;
-            }
-
-            for (; j < face->glyph->bitmap.width && (xOffset + static_cast<long>(j)) < surface->width; j++) {
-                unsigned off = yOffset + (j + xOffset);
-                if (face->glyph->bitmap.buffer[i * face->glyph->bitmap.width + j] == 255)
-                    buffer[off] = colour_i;
-                else if (face->glyph->bitmap.buffer[i * face->glyph->bitmap.width + j]) {
-                    buffer[off] = AlphaBlendInt(buffer[off], RGBAColour::ToARGB({r, g, b, face->glyph->bitmap.buffer[i * face->glyph->bitmap.width + j]}));
-                }
-            }
-        }
-
-        xOffset += face->glyph->advance.x >> 6;
+        xOffset += glyph->advance;
     }
     return xOffset - x;
 }
@@ -233,15 +185,15 @@ int GetCharWidth(int c, Font* font) {
         return 0;
     }
 
-    FT_Face face = (FT_Face)font->face;
-    if (int err = FT_Load_Char(face, c, FT_LOAD_ADVANCE_ONLY)) {
+    const Glyph* glyph = font->glyphs->Get(font, c);
+    if (!glyph) {
         return 0;
     }
 
-    return face->glyph->advance.x >> 6;
+    return glyph->advance;
 }
 
-int GetCharWidth(char c) { return GetCharWidth(c, mainFont); }
+int GetCharWidth(char c) { return GetCharWidth(c, DefaultFont()); }
 
 int GetTextLength(const char* str, size_t n, Font* font) {
     if (fontState != 1 && fontState != -1)
@@ -250,12 +202,11 @@ int GetTextLength(const char* str, size_t n, Font* font) {
         return strlen(str) * 8;
     }
 
-    FT_Face face = (FT_Face)font->face;
-
     size_t len = 0;
     size_t i = 0;
 
-    auto codepoints = UTF8ToUTF32(str);
+    // A codepoint is at most 4 bytes
+    const auto& codepoints = DecodeLine(str, n < SIZE_MAX / 4 ? n * 4 : SIZE_MAX);
     for(int cp : codepoints) {
         if(i++ >= n) {
             break;
@@ -275,12 +226,12 @@ int GetTextLength(const char* str, size_t n, Font* font) {
             }
         }
 
-        if (int err = FT_Load_Char(face, cp, FT_LOAD_ADVANCE_ONLY)) {
-            str++;
+        const Glyph* glyph = font->glyphs->Get(font, cp);
+        if (!glyph) {
             continue;
         }
 
-        len += face->glyph->advance.x >> 6;
+        len += glyph->advance;
     }
 
     return len;
@@ -288,7 +239,7 @@ int GetTextLength(const char* str, size_t n, Font* font) {
 
 int GetTextLength(const char* str, Font* font) { return GetTextLength(str, strlen(str), font); }
 
-int GetTextLength(const char* str, size_t n) { return GetTextLength(str, n, mainFont); }
+int GetTextLength(const char* str, size_t n) { return GetTextLength(str, n, DefaultFont()); }
 
 int GetTextLength(const char* str) { return GetTextLength(str, strlen(str)); }
 
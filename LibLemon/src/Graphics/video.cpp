@@ -0,0 +1,196 @@
+#include <Lemon/Graphics/Video.h>
+
+#include "FastMem.h"
+
+#include <algorithm>
+#include <immintrin.h>
+
+// Samples gathered from the source rows before being converted together
+#define VIDEO_CONVERT_CHUNK 256
+
+// BT.601 limited range to RGB in 6-bit fixed point, 16-bit lanes are wide enough for everything
+// except blue, which saturates only where the result would be above 255 anyway
+#define YUV_LUMA 75    // 1.164, rounded up so that white is 255
+#define YUV_V_RED 102  // 1.596
+#define YUV_V_GREEN 52 // 0.813
+#define YUV_U_GREEN 25 // 0.391
+#define YUV_U_BLUE 129 // 2.018
+
+static inline uint32_t ClampChannel(int c) { return std::clamp(c, 0, 255); }
+
+void yuvtorgb_scalar(uint32_t* dest, const uint8_t* y, const uint8_t* u, const uint8_t* v, size_t count) {
+    for (; count; count--) {
+        int luma = (*(y++) - 16) * YUV_LUMA + 32;
+        int cb = *(u++) - 128;
+        int cr = *(v++) - 128;
+
+        uint32_t r = ClampChannel((luma + YUV_V_RED * cr) >> 6);
+        uint32_t g = ClampChannel((luma - YUV_V_GREEN * cr - YUV_U_GREEN * cb) >> 6);
+        uint32_t b = ClampChannel((luma + YUV_U_BLUE * cb) >> 6);
+        *(dest++) = 0xff000000 | (r << 16) | (g << 8) | b;
+    }
+}
+
+void yuvtorgb_sse2(uint32_t* dest, const uint8_t* y, const uint8_t* u, const uint8_t* v, size_t count) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_set1_epi16(128);
+
+    for (; count >= 8; count -= 8, dest += 8, y += 8, u += 8, v += 8) {
+        __m128i luma = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(y)), zero);
+        __m128i cb = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(u)), zero), bias);
+        __m128i cr = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(v)), zero), bias);
+
+        luma = _mm_add_epi16(_mm_mullo_epi16(_mm_sub_epi16(luma, _mm_set1_epi16(16)), _mm_set1_epi16(YUV_LUMA)),
+                             _mm_set1_epi16(32));
+
+        __m128i r = _mm_srai_epi16(_mm_adds_epi16(luma, _mm_mullo_epi16(cr, _mm_set1_epi16(YUV_V_RED))), 6);
+        __m128i g = _mm_srai_epi16(_mm_subs_epi16(_mm_subs_epi16(luma, _mm_mullo_epi16(cr, _mm_set1_epi16(YUV_V_GREEN))),
+                                                  _mm_mullo_epi16(cb, _mm_set1_epi16(YUV_U_GREEN))),
+                                   6);
+        __m128i b = _mm_srai_epi16(_mm_adds_epi16(luma, _mm_mullo_epi16(cb, _mm_set1_epi16(YUV_U_BLUE))), 6);
+
+        // Packing clamps to 0-255
+        __m128i bg = _mm_unpacklo_epi8(_mm_packus_epi16(b, b), _mm_packus_epi16(g, g));
+        __m128i ra = _mm_unpacklo_epi8(_mm_packus_epi16(r, r), _mm_set1_epi8(-1));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest), _mm_unpacklo_epi16(bg, ra));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 4), _mm_unpackhi_epi16(bg, ra));
+    }
+
+    yuvtorgb_scalar(dest, y, u, v, count);
+}
+
+__attribute__((target("avx2"))) void yuvtorgb_avx2(uint32_t* dest, const uint8_t* y, const uint8_t* u,
+                                                   const uint8_t* v, size_t count) {
+    const __m256i bias = _mm256_set1_epi16(128);
+
+    for (; count >= 16; count -= 16, dest += 16, y += 16, u += 16, v += 16) {
+        __m256i luma = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(y)));
+        __m256i cb = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(u))), bias);
+        __m256i cr = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(v))), bias);
+
+        luma = _mm256_add_epi16(
+            _mm256_mullo_epi16(_mm256_sub_epi16(luma, _mm256_set1_epi16(16)), _mm256_set1_epi16(YUV_LUMA)),
+            _mm256_set1_epi16(32));
+
+        __m256i r = _mm256_srai_epi16(_mm256_adds_epi16(luma, _mm256_mullo_epi16(cr, _mm256_set1_epi16(YUV_V_RED))), 6);
+        __m256i g = _mm256_srai_epi16(
+            _mm256_subs_epi16(_mm256_subs_epi16(luma, _mm256_mullo_epi16(cr, _mm256_set1_epi16(YUV_V_GREEN))),
+                              _mm256_mullo_epi16(cb, _mm256_set1_epi16(YUV_U_GREEN))),
+            6);
+        __m256i b = _mm256_srai_epi16(_mm256_adds_epi16(luma, _mm256_mullo_epi16(cb, _mm256_set1_epi16(YUV_U_BLUE))), 6);
+
+        // Packs and unpacks work within each 128-bit lane,
+        // so the low lane ends up with pixels 0-3 and 4-7, the high lane with 8-11 and 12-15
+        __m256i bg = _mm256_unpacklo_epi8(_mm256_packus_epi16(b, b), _mm256_packus_epi16(g, g));
+        __m256i ra = _mm256_unpacklo_epi8(_mm256_packus_epi16(r, r), _mm256_set1_epi8(-1));
+        __m256i low = _mm256_unpacklo_epi16(bg, ra);
+        __m256i high = _mm256_unpackhi_epi16(bg, ra);
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest), _mm256_permute2x128_si256(low, high, 0x20));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + 8), _mm256_permute2x128_si256(low, high, 0x31));
+    }
+
+    yuvtorgb_sse2(dest, y, u, v, count);
+}
+
+namespace Lemon::Graphics {
+
+size_t VideoFrameSize(int format, int width, int height) {
+    if (width <= 0 || height <= 0) {
+        return 0;
+    }
+
+    size_t pixels = static_cast<size_t>(width) * height;
+    switch (format) {
+    case VideoFormatRGB32:
+        return pixels * 4;
+    case VideoFormatYUV420:
+        return pixels + 2 * static_cast<size_t>((width + 1) / 2) * ((height + 1) / 2);
+    default:
+        return 0;
+    }
+}
+
+VideoFrame VideoFrameLayout(int format, int width, int height, uint8_t* buffer) {
+    VideoFrame frame = {.format = format, .width = width, .height = height, .planes = {}, .strides = {}};
+    frame.planes[0] = buffer;
+
+    if (format == VideoFormatYUV420) {
+        int chromaWidth = (width + 1) / 2;
+        int chromaHeight = (height + 1) / 2;
+
+        frame.strides[0] = width;
+        frame.strides[1] = frame.strides[2] = chromaWidth;
+        frame.planes[1] = buffer + static_cast<size_t>(width) * height;
+        frame.planes[2] = frame.planes[1] + static_cast<size_t>(chromaWidth) * chromaHeight;
+    } else {
+        frame.strides[0] = width * 4;
+    }
+
+    return frame;
+}
+
+void DrawVideoFrame(const VideoFrame& frame, const Rect& dest, Surface* surface, const Rect& clip) {
+    if (frame.width <= 0 || frame.height <= 0 || dest.width <= 0 || dest.height <= 0) {
+        return;
+    }
+
+    int left = std::max({dest.left(), clip.left(), 0});
+    int top = std::max({dest.top(), clip.top(), 0});
+    int right = std::min({dest.right(), clip.right(), surface->width - 1});
+    int bottom = std::min({dest.bottom(), clip.bottom(), surface->height - 1});
+    if (left > right || top > bottom) {
+        return;
+    }
+
+    // Source position of each destination pixel in 16.16 fixed point
+    uint64_t stepX = (static_cast<uint64_t>(frame.width) << 16) / dest.width;
+    uint64_t stepY = (static_cast<uint64_t>(frame.height) << 16) / dest.height;
+    uint64_t startX = (left - dest.x) * stepX;
+    int count = right - left + 1;
+
+    for (int row = top; row <= bottom; row++) {
+        int sy = ((row - dest.y) * stepY) >> 16;
+        uint32_t* out = reinterpret_cast<uint32_t*>(surface->buffer) + static_cast<size_t>(row) * surface->width + left;
+
+        if (frame.format == VideoFormatRGB32) {
+            const uint32_t* src = reinterpret_cast<const uint32_t*>(frame.planes[0] + sy * frame.strides[0]);
+            if (frame.width == dest.width) {
+                memcpy_optimized(out, src + (left - dest.x), count);
+                continue;
+            }
+
+            uint64_t sx = startX;
+            for (int i = 0; i < count; i++, sx += stepX) {
+                out[i] = src[sx >> 16];
+            }
+            continue;
+        }
+
+        const uint8_t* ySrc = frame.planes[0] + sy * frame.strides[0];
+        const uint8_t* uSrc = frame.planes[1] + (sy >> 1) * frame.strides[1];
+        const uint8_t* vSrc = frame.planes[2] + (sy >> 1) * frame.strides[2];
+
+        // Gather the samples of each pixel so they can be converted a vector at a time
+        uint8_t y[VIDEO_CONVERT_CHUNK];
+        uint8_t u[VIDEO_CONVERT_CHUNK];
+        uint8_t v[VIDEO_CONVERT_CHUNK];
+
+        uint64_t sx = startX;
+        for (int done = 0; done < count;) {
+            int n = std::min(count - done, VIDEO_CONVERT_CHUNK);
+            for (int i = 0; i < n; i++, sx += stepX) {
+                int x = sx >> 16;
+                y[i] = ySrc[x];
+                u[i] = uSrc[x >> 1];
+                v[i] = vSrc[x >> 1];
+            }
+
+            yuvtorgb_optimized(out + done, y, u, v, n);
+            done += n;
+        }
+    }
+}
+
+} // namespace Lemon::Graphics
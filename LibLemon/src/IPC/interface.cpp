@@ -6,6 +6,9 @@
 #include <Lemon/System/IPC.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+
+#include <algorithm>
 
 namespace Lemon {
 const char* const EndpointException::errorStrings[] = {
@@ -54,6 +57,11 @@ long Interface::Poll(Lemon::Handle& client, Message& m) {
             m_rawEndpoints.push_back(newIf);
             m_endpoints.push_back(Handle(newIf));
 
+            // Clients only write into the ring once we have mapped it
+            if (MessageRingInfo info; !EndpointMapRing(newIf, info)) {
+                m_rings[newIf] = {info, MessageRing(info.base, info.rxOffset)};
+            }
+
             for (Waiter* waiter : waiters) {
                 waiter->RepopulateHandles(); // Repopulate handles
             }
@@ -65,33 +73,55 @@ long Interface::Poll(Lemon::Handle& client, Message& m) {
 
         client = front.client;
         m.Set(front.data, front.length, front.id);
+        m.AttachMemory(front.memory, front.memorySize);
 
         m_queue.pop_front();
         return 1;
     }
 
-    for (auto it = m_endpoints.begin(); !m_endpoints.empty() && it != m_endpoints.end(); it++) {
-        InterfaceMessageInfo msg{*it, 0, nullptr, 0};
+    for (auto it = m_endpoints.begin(); it != m_endpoints.end();) {
+        InterfaceMessageInfo msg{*it, 0, nullptr, 0, nullptr, 0};
 
-        while (long ret = EndpointDequeue(it->get(), &msg.id, &msg.length, m_dataBuffer)) {
-            if (ret < 0) { // We have probably disconnected
-                m_endpoints.erase(it);
-                RepopulateRawHandles();
+        if (auto ring = m_rings.find(it->get()); ring != m_rings.end()) {
+            while (ring->second.second.Read(msg.id, m_dataBuffer, msg.length)) {
+                msg.data = m_dataBuffer;
+                m_queue.push_back(msg);
 
-                msg.id = MessagePeerDisconnect;
-                m_queue.push_back(std::move(msg));
+                m_dataBuffer = new uint8_t[m_msgSize];
+            }
 
-                for (Waiter* waiter : waiters) {
-                    waiter->RepopulateHandles();
-                }
-                break;
+            if (!ring->second.second.KernelPending()) {
+                it++;
+                continue; // Nothing in the kernel queue
             }
+        }
 
-            msg.data = m_dataBuffer;
-            m_queue.push_back(msg);
+        // Start with one message, take more at once whilst the queue stays deep
+        unsigned batchSize = 1;
+        long ret;
+        while ((ret = DequeueBatch(*it, batchSize)) == batchSize) {
+            batchSize = std::min(batchSize * 2, static_cast<unsigned>(ENDPOINT_BATCH_MAX));
+        }
 
-            m_dataBuffer = new uint8_t[m_msgSize];
+        if (ret < 0) { // We have probably disconnected
+            if (auto ring = m_rings.find(it->get()); ring != m_rings.end()) {
+                munmap(reinterpret_cast<void*>(ring->second.first.base), ring->second.first.size);
+                m_rings.erase(ring);
+            }
+
+            msg.id = MessagePeerDisconnect;
+            m_queue.push_back(std::move(msg));
+
+            it = m_endpoints.erase(it);
+            RepopulateRawHandles();
+
+            for (Waiter* waiter : waiters) {
+                waiter->RepopulateHandles();
+            }
+            continue;
         }
+
+        it++;
     }
 
     if (m_queue.size() > 0) {
@@ -99,6 +129,7 @@ long Interface::Poll(Lemon::Handle& client, Message& m) {
 
         client = std::move(front.client);
         m.Set(front.data, front.length, front.id);
+        m.AttachMemory(front.memory, front.memorySize);
 
         m_queue.pop_front();
         return 1;
@@ -107,6 +138,31 @@ long Interface::Poll(Lemon::Handle& client, Message& m) {
     }
 }
 
+long Interface::DequeueBatch(const Handle& client, unsigned count) {
+    EndpointMessageDescriptor batch[ENDPOINT_BATCH_MAX];
+    for (unsigned i = 0; i < count; i++) {
+        if (!m_batchBuffers[i]) {
+            m_batchBuffers[i] = new uint8_t[m_msgSize];
+        }
+
+        batch[i] = {.id = 0,
+                    .data = reinterpret_cast<uintptr_t>(m_batchBuffers[i]),
+                    .memory = 0,
+                    .memorySize = 0,
+                    .size = 0,
+                    .reserved = {}};
+    }
+
+    long ret = EndpointDequeueBatch(client.get(), batch, count);
+    for (long i = 0; i < ret; i++) {
+        m_queue.push_back({client, batch[i].id, m_batchBuffers[i], batch[i].size,
+                           reinterpret_cast<void*>(batch[i].memory), batch[i].memorySize});
+        m_batchBuffers[i] = nullptr; // Now owned by the message
+    }
+
+    return ret;
+}
+
 void Interface::RepopulateRawHandles() {
     m_rawEndpoints.clear();
     for (auto& handle : m_endpoints) {
@@ -13,6 +13,10 @@ template <> void Message::Insert<std::string>(uint16_t& pos, const std::string&
     Message::Insert(pos, MessageRawDataObject((uint8_t*)obj.data(), obj.length()));
 }
 
+template <> void Message::Insert<std::string_view>(uint16_t& pos, const std::string_view& obj) {
+    Message::Insert(pos, MessageRawDataObject((uint8_t*)obj.data(), obj.length()));
+}
+
 template <> uint16_t Message::GetSize<MessageRawDataObject>(const MessageRawDataObject& obj) {
     return sizeof(uint16_t) + obj.second; // 2 byte length + data
 }
@@ -21,6 +25,10 @@ template <> uint16_t Message::GetSize<std::string>(const std::string& obj) {
     return sizeof(uint16_t) + obj.length(); // 2 byte length + data
 }
 
+template <> uint16_t Message::GetSize<std::string_view>(const std::string_view& obj) {
+    return sizeof(uint16_t) + obj.length(); // 2 byte length + data
+}
+
 template <> long Message::Decode<MessageRawDataObject>(uint16_t& pos, MessageRawDataObject& obj) const {
     if (pos + sizeof(uint16_t) > m_size) { // First check if the 2 bytes of length fits
         return ErrorDecodeOutOfBounds;
@@ -59,4 +67,23 @@ template <> long Message::Decode<std::string>(uint16_t& pos, std::string& obj) c
 
     return 0;
 }
+
+template <> long Message::Decode<std::string_view>(uint16_t& pos, std::string_view& obj) const {
+    if (pos + sizeof(uint16_t) > m_size) { // First check if the 2 bytes of length fits
+        return ErrorDecodeOutOfBounds;
+    }
+
+    uint16_t size;
+    memcpy(&size, m_data + pos, sizeof(uint16_t));
+    pos += sizeof(uint16_t);
+
+    if (pos + size > m_size) { // Now check if the length is within the bounds of the message
+        return ErrorDecodeOutOfBounds;
+    }
+
+    obj = std::string_view(reinterpret_cast<const char*>(m_data + pos), size);
+    pos += size;
+
+    return 0;
+}
 } // namespace Lemon
@@ -1,6 +1,9 @@
 #include <Lemon/Core/IconManager.h>
 
+#include <Lemon/Core/SharedMemory.h>
+#include <Lemon/Core/StartupProfile.h>
 #include <Lemon/Graphics/Graphics.h>
+#include <Lemon/Services/lemon.lemonwm.h>
 
 namespace Lemon {
 IconManager* IconManager::m_instance = nullptr;
@@ -42,82 +45,112 @@ IconManager* IconManager::Instance() {
     return m_instance;
 }
 
+// Directories tried for each icon size, scaling if necessary
+static const char* const iconDirectories[][3] = {
+    {"16", "32", "64"},
+    {"32", "64", "16"},
+    {"64", "32", "16"},
+};
+
 const Surface* IconManager::GetIcon(const std::string& name, IconSize preferredSize) {
     Icon& icon = m_icons[name];
 
+    Surface* surface;
+    const Surface* missing;
+    int size;
     if (preferredSize == IconSize16x16) {
-        if (icon.icon16.buffer) {
-            return &icon.icon16;
-        }
+        surface = &icon.icon16;
+        missing = &m_missingIcon.icon16;
+        size = 16;
+    } else if (preferredSize == IconSize32x32) {
+        surface = &icon.icon32;
+        missing = &m_missingIcon.icon32;
+        size = 32;
+    } else if (preferredSize == IconSize64x64) {
+        surface = &icon.icon64;
+        missing = &m_missingIcon.icon64;
+        size = 64;
+    } else {
+        assert(!"Invalid icon preferred size!");
+        return nullptr;
+    }
 
-        // Try all sizes if unsuccessful, scale if necessary
-        if (!Lemon::Graphics::LoadImage((std::string("/system/lemon/resources/icons/16/") + name + ".png").c_str(), 0,
-                                        0, 16, 16, &icon.icon16, false)) {
-            return &icon.icon16;
-        }
+    if (surface->buffer) {
+        return surface;
+    }
 
-        if (!Lemon::Graphics::LoadImage((std::string("/system/lemon/resources/icons/32/") + name + ".png").c_str(), 0,
-                                        0, 16, 16, &icon.icon16, false)) {
-            return &icon.icon16;
+    for (const char* directory : iconDirectories[preferredSize]) {
+        if (LoadImage(std::string("/system/lemon/resources/icons/") + directory + "/" + name + ".png", size, size,
+                      surface)) {
+            return surface;
         }
+    }
 
-        if (!Lemon::Graphics::LoadImage((std::string("/system/lemon/resources/icons/64/") + name + ".png").c_str(), 0,
-                                        0, 16, 16, &icon.icon16, false)) {
-            return &icon.icon16;
-        }
+    return missing; // Unsuccessful
+}
 
-        return &m_missingIcon.icon16; // Unsuccessful
-    }
+const Surface* IconManager::GetImage(const std::string& path, int width, int height) {
+    std::string key = path + ":" + std::to_string(width) + "x" + std::to_string(height);
 
-    if (preferredSize == IconSize32x32) {
-        if (icon.icon32.buffer) {
-            return &icon.icon32;
-        }
+    Surface& image = m_images[key];
+    if (image.buffer) {
+        return &image;
+    }
 
-        // Try all sizes if unsuccessful, scale if necessary
-        if (!Lemon::Graphics::LoadImage((std::string("/system/lemon/resources/icons/32/") + name + ".png").c_str(), 0,
-                                        0, 32, 32, &icon.icon32, false)) {
-            return &icon.icon32;
-        }
+    if (!LoadImage(path, width, height, &image)) {
+        m_images.erase(key);
+        return nullptr;
+    }
 
-        if (!Lemon::Graphics::LoadImage((std::string("/system/lemon/resources/icons/64/") + name + ".png").c_str(), 0,
-                                        0, 32, 32, &icon.icon32, false)) {
-            return &icon.icon32;
-        }
+    return &image;
+}
 
-        if (!Lemon::Graphics::LoadImage((std::string("/system/lemon/resources/icons/16/") + name + ".png").c_str(), 0,
-                                        0, 32, 32, &icon.icon32, false)) {
-            return &icon.icon32;
-        }
+bool IconManager::LoadImage(const std::string& path, int width, int height, Surface* surface) {
+    StartupProfile::Scope profile("IconManager");
 
-        return &m_missingIcon.icon32; // Unsuccessful
+    if (LoadSharedImage(path, width, height, surface)) {
+        return true;
     }
 
-    if (preferredSize == IconSize64x64) {
-        if (icon.icon64.buffer) {
-            return &icon.icon64;
-        }
+    return !Graphics::LoadImage(path.c_str(), 0, 0, width, height, surface, false);
+}
 
-        // Try all sizes if unsuccessful, scale if necessary
-        if (!Lemon::Graphics::LoadImage((std::string("/system/lemon/resources/icons/64/") + name + ".png").c_str(), 0,
-                                        0, 64, 64, &icon.icon64, false)) {
-            return &icon.icon64;
-        }
+bool IconManager::LoadSharedImage(const std::string& path, int width, int height, Surface* surface) {
+    std::scoped_lock lock(m_imageCacheMutex);
 
-        if (!Lemon::Graphics::LoadImage((std::string("/system/lemon/resources/icons/32/") + name + ".png").c_str(), 0,
-                                        0, 64, 64, &icon.icon64, false)) {
-            return &icon.icon64;
+    if (!m_imageCache) {
+        if (m_imageCacheUnavailable) {
+            return false;
         }
 
-        if (!Lemon::Graphics::LoadImage((std::string("/system/lemon/resources/icons/16/") + name + ".png").c_str(), 0,
-                                        0, 64, 64, &icon.icon64, false)) {
-            return &icon.icon64;
+        try {
+            m_imageCache = new LemonWMServerEndpoint("lemon.lemonwm/Instance");
+        } catch (const EndpointException*) {
+            m_imageCacheUnavailable = true; // LemonWM probably hasnt started yet
+            return false;
         }
+    }
+
+    LemonWMServer::GetImageResponse response;
+    try {
+        response = m_imageCache->GetImage(path, width, height);
+    } catch (const std::exception&) {
+        return false;
+    }
 
-        return &m_missingIcon.icon64; // Unsuccessful
+    if (response.status) {
+        return false;
     }
 
-    assert(!"Invalid icon preferred size!");
-    return nullptr;
+    void* buffer = MapSharedMemory(response.bufferKey);
+    if (!buffer) {
+        return false;
+    }
+
+    *surface = {.width = response.width,
+                .height = response.height,
+                .depth = 32,
+                .buffer = reinterpret_cast<uint8_t*>(buffer)};
+    return true;
 }
 } // namespace Lemon
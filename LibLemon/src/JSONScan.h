@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+/////////////////////////////
+/// \brief Find the structural characters of a JSON document
+///
+/// Fills index with the offset of every {, }, [, ], : and , outside of strings,
+/// both quotes of every string and the first character of every number or literal, in order.
+/// The document is classified 64 bytes at a time into bitmasks, so whitespace
+/// and the contents of strings are never looked at one byte at a time.
+///
+/// \return 0 on success, 1 if a string is not terminated
+/////////////////////////////
+int json_index_optimized(const char* data, size_t length, std::vector<uint32_t>& index);
+
+// Implementations picked between, AVX2 must only be used when GetCPUFeatures().avx2 is set
+int json_index_sse2(const char* data, size_t length, std::vector<uint32_t>& index);
+int json_index_avx2(const char* data, size_t length, std::vector<uint32_t>& index);
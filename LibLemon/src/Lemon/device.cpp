@@ -59,4 +59,13 @@ long DeviceGetType(int64_t id) {
 
     return ret;
 }
+
+long DeviceGetDiskStatistics(int64_t id, DiskStatistics& stats) {
+    if (long e = syscall(SYS_DEVICE_MANAGEMENT, RequestDeviceGetDiskStatistics, id, &stats); e) {
+        errno = -e;
+        return -1;
+    }
+
+    return 0;
+}
 } // namespace Lemon
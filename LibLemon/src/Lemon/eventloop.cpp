@@ -0,0 +1,188 @@
+#include <Lemon/System/EventLoop.h>
+
+#include <Lemon/System/KernelObject.h>
+
+#include <algorithm>
+#include <assert.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace Lemon {
+static uint64_t NowUs() {
+    timespec t;
+    clock_gettime(CLOCK_BOOTTIME, &t);
+    return t.tv_sec * 1000000ULL + t.tv_nsec / 1000;
+}
+
+EventLoop::EventLoop() {
+    int fds[2];
+    int e = pipe(fds);
+    assert(!e);
+
+    m_wakeRead = fds[0];
+    m_wakeWrite = fds[1];
+    fcntl(m_wakeRead, F_SETFL, fcntl(m_wakeRead, F_GETFL) | O_NONBLOCK);
+    fcntl(m_wakeWrite, F_SETFL, fcntl(m_wakeWrite, F_GETFL) | O_NONBLOCK);
+}
+
+EventLoop::~EventLoop() {
+    close(m_wakeRead);
+    close(m_wakeWrite);
+}
+
+void EventLoop::Watch(Waitable* waitable, std::function<void()> onReady) {
+    m_waitables.push_back({waitable, std::move(onReady)});
+}
+
+void EventLoop::Unwatch(Waitable* waitable) {
+    m_waitables.erase(std::remove_if(m_waitables.begin(), m_waitables.end(),
+                                     [waitable](const WaitableWatch& w) { return w.waitable == waitable; }),
+                      m_waitables.end());
+}
+
+void EventLoop::WatchFile(int fd, std::function<void()> onReadable) {
+    m_files.push_back({fd, std::move(onReadable)});
+}
+
+void EventLoop::UnwatchFile(int fd) {
+    m_files.erase(
+        std::remove_if(m_files.begin(), m_files.end(), [fd](const FileWatch& f) { return f.fd == fd; }),
+        m_files.end());
+}
+
+int EventLoop::AddTimer(long interval, bool repeat, std::function<void()> callback) {
+    int id = m_nextTimer++;
+    m_timers[id] = {NowUs() + std::max(interval, 0L), interval, repeat, std::move(callback)};
+
+    return id;
+}
+
+void EventLoop::RemoveTimer(int id) { m_timers.erase(id); }
+
+void EventLoop::Post(std::function<void()> function) {
+    {
+        std::lock_guard lock(m_postedLock);
+        m_posted.push_back(std::move(function));
+    }
+
+    // Only has to make the pipe readable, a full pipe already is
+    char c = 0;
+    write(m_wakeWrite, &c, 1);
+}
+
+void EventLoop::RunOnce(long timeout) {
+    long wait = RunTimers();
+    if (timeout >= 0 && (wait < 0 || timeout < wait)) {
+        wait = timeout;
+    }
+
+    // A timeout of 0 waits forever, so the wait is skipped when something is already due
+    if (wait) {
+        std::vector<handle_t> handles;
+        for (WaitableWatch& w : m_waitables) {
+            w.waitable->GetAllHandles(handles);
+        }
+
+        for (FileWatch& f : m_files) {
+            handles.push_back(f.fd);
+        }
+        handles.push_back(m_wakeRead);
+
+        WaitForKernelObject(handles.data(), handles.size(), wait);
+    }
+
+    RunPosted();
+
+    // Callbacks may change the watches, so run them from copies
+    if (m_files.size()) {
+        std::vector<pollfd> pollFds;
+        for (FileWatch& f : m_files) {
+            pollFds.push_back({.fd = f.fd, .events = POLLIN, .revents = 0});
+        }
+
+        if (poll(pollFds.data(), pollFds.size(), 0) > 0) {
+            std::vector<FileWatch> files = m_files;
+            for (size_t i = 0; i < files.size(); i++) {
+                if (pollFds[i].revents) {
+                    files[i].onReadable();
+                }
+            }
+        }
+    }
+
+    std::vector<WaitableWatch> waitables = m_waitables;
+    for (WaitableWatch& w : waitables) {
+        w.onReady();
+    }
+
+    RunTimers();
+}
+
+void EventLoop::Run() {
+    m_running = true;
+    while (m_running) {
+        RunOnce();
+    }
+}
+
+void EventLoop::Stop() {
+    Post([this]() { m_running = false; });
+}
+
+long EventLoop::RunTimers() {
+    uint64_t now = NowUs();
+
+    std::vector<int> due;
+    for (auto& [id, timer] : m_timers) {
+        if (timer.due <= now) {
+            due.push_back(id);
+        }
+    }
+
+    for (int id : due) {
+        auto it = m_timers.find(id);
+        if (it == m_timers.end()) {
+            continue; // Removed by another callback
+        }
+
+        std::function<void()> callback = it->second.callback;
+        if (it->second.repeat) {
+            // Skip intervals that have already passed rather than running the timer several times
+            it->second.due = std::max(it->second.due + it->second.interval, now + 1);
+        } else {
+            m_timers.erase(it);
+        }
+
+        callback();
+    }
+
+    long next = -1;
+    now = NowUs();
+    for (auto& [id, timer] : m_timers) {
+        long left = (timer.due > now) ? static_cast<long>(timer.due - now) : 0;
+        if (next < 0 || left < next) {
+            next = left;
+        }
+    }
+
+    return next;
+}
+
+void EventLoop::RunPosted() {
+    char buffer[64];
+    while (read(m_wakeRead, buffer, sizeof(buffer)) > 0)
+        ;
+
+    std::vector<std::function<void()>> posted;
+    {
+        std::lock_guard lock(m_postedLock);
+        posted.swap(m_posted);
+    }
+
+    for (auto& function : posted) {
+        function();
+    }
+}
+} // namespace Lemon
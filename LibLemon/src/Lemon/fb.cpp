@@ -1,13 +1,30 @@
 #include <lemon/syscall.h>
 
 #include <Lemon/Core/Framebuffer.h>
+
+#include <algorithm>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <sys/ioctl.h>
 
 namespace Lemon {
     
 long MapFramebuffer(void** ptr, FBInfo& fbInfo) { return syscall(SYS_MAP_FB, ptr, &fbInfo); }
 
+long FlipFramebuffer(unsigned page) {
+    static int fbDevice = -1;
+    if (fbDevice < 0 && (fbDevice = open("/dev/fb0", O_RDWR)) < 0) {
+        return -errno;
+    }
+
+    if (ioctl(fbDevice, IoCtlFramebufferFlip, page) < 0) {
+        return -errno;
+    }
+    return 0;
+}
+
 Surface* CreateFramebufferSurface() {
     Surface* surface = (Surface*)malloc(sizeof(Surface));
 
@@ -26,4 +43,22 @@ void CreateFramebufferSurface(Surface& surface) {
     surface.height = fbInfo.height;
     surface.depth = fbInfo.bpp;
 }
+
+int CreateFramebufferPages(Surface* pages, int maxPages) {
+    FBInfo fbInfo;
+    uint8_t* buffer;
+
+    long error = MapFramebuffer(reinterpret_cast<void**>(&buffer), fbInfo);
+    assert(!error && buffer);
+
+    int pageCount = std::min<int>(fbInfo.pageCount, maxPages);
+    for (int i = 0; i < pageCount; i++) {
+        pages[i].buffer = buffer + static_cast<size_t>(fbInfo.pitch) * fbInfo.height * i;
+        pages[i].width = fbInfo.width;
+        pages[i].height = fbInfo.height;
+        pages[i].depth = fbInfo.bpp;
+    }
+
+    return pageCount;
+}
 } // namespace Lemon
\ No newline at end of file
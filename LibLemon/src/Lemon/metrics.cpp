@@ -0,0 +1,45 @@
+#include <Lemon/System/Metrics.h>
+#include <lemon/syscall.h>
+
+#include <algorithm>
+
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+
+namespace Lemon {
+int SystemMetrics::Map() {
+    uintptr_t address;
+    if (long e = syscall(SYS_MAP_METRICS, &address); e < 0) {
+        errno = -e;
+        return -1;
+    }
+
+    m_metrics = reinterpret_cast<const lemon_metrics_t*>(address);
+    return 0;
+}
+
+void SystemMetrics::Read(lemon_metrics_t& snapshot) const {
+    const lemon_metrics_t* m = m_metrics;
+
+    // The kernel makes the sequence odd whilst updating the metrics
+    for (;;) {
+        uint32_t sequence = __atomic_load_n(&m->sequence, __ATOMIC_ACQUIRE);
+        if (sequence & 1) {
+            asm volatile("pause");
+            continue;
+        }
+
+        memcpy(&snapshot.cpuCount, &m->cpuCount, offsetof(lemon_metrics_t, processes) - offsetof(lemon_metrics_t, cpuCount));
+        uint32_t count = std::min<uint32_t>(snapshot.processCount, METRICS_MAX_PROCESSES);
+        memcpy(snapshot.processes, m->processes, count * sizeof(lemon_metrics_process_t));
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&m->sequence, __ATOMIC_RELAXED) == sequence) {
+            snapshot.sequence = sequence;
+            snapshot.processCount = count;
+            return;
+        }
+    }
+}
+} // namespace Lemon
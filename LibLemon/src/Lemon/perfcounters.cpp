@@ -0,0 +1,62 @@
+#include <Lemon/System/PerfCounters.h>
+#include <lemon/syscall.h>
+
+#include <errno.h>
+
+namespace Lemon {
+static inline uint64_t ReadPMC(uint32_t index) {
+    uint32_t low, high;
+    asm volatile("rdpmc" : "=a"(low), "=d"(high) : "c"(index));
+    return (static_cast<uint64_t>(high) << 32) | low;
+}
+
+int PerfCounters::Start(uint32_t events) {
+    if (long e = syscall(SYS_PERF_COUNTERS, PERF_COUNTERS_START, events, &m_info); e < 0) {
+        m_info.events = 0;
+        errno = -e;
+        return -1;
+    }
+
+    // rdpmc is only used if the kernel keeps every counter for this thread
+    m_useRdpmc = true;
+    for (int i = 0; i < PerfEventCount; i++) {
+        if (IsCounting(i) && m_info.rdpmcIndex[i] < 0) {
+            m_useRdpmc = false;
+        }
+    }
+
+    return 0;
+}
+
+void PerfCounters::Stop() {
+    syscall(SYS_PERF_COUNTERS, PERF_COUNTERS_STOP);
+    m_useRdpmc = false;
+}
+
+void PerfCounters::Read(uint64_t counts[PerfEventCount]) const {
+    if (!m_useRdpmc) {
+        syscall(SYS_PERF_COUNTERS, PERF_COUNTERS_READ, counts);
+        return;
+    }
+
+    uint64_t mask = (m_info.counterWidth >= 64) ? ~0ULL : ((1ULL << m_info.counterWidth) - 1);
+    for (int i = 0; i < PerfEventCount; i++) {
+        counts[i] = IsCounting(i) ? (ReadPMC(m_info.rdpmcIndex[i]) & mask) : 0;
+    }
+}
+
+const char* PerfCounters::EventName(int event) {
+    switch (event) {
+    case PerfEventCycles:
+        return "cycles";
+    case PerfEventInstructions:
+        return "instructions";
+    case PerfEventCacheMisses:
+        return "cache-misses";
+    case PerfEventBranchMisses:
+        return "branch-misses";
+    default:
+        return "unknown";
+    }
+}
+} // namespace Lemon
@@ -13,6 +13,17 @@ int64_t CreateSharedMemory(uint64_t size, uint64_t flags) {
     return key;
 }
 
+int64_t ReserveSharedMemory(uint64_t size, uint64_t reserve, uint64_t flags) {
+    int64_t key;
+    long ret = syscall(SYS_CREATE_SHARED_MEMORY, &key, size, flags | SMEM_FLAGS_RESERVE, /*recipient*/ 0, reserve);
+    if (ret < 0) {
+        return ret;
+    }
+    return key;
+}
+
+long GrowSharedMemory(int64_t key, uint64_t size) { return syscall(SYS_GROW_SHARED_MEMORY, key, size); }
+
 void* MapSharedMemory(int64_t key) {
     volatile void* ptr;
     syscall(SYS_MAP_SHARED_MEMORY, &ptr, key, 0);
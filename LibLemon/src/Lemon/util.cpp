@@ -1,3 +1,4 @@
+#include <Lemon/System/Spawn.h>
 #include <Lemon/System/Util.h>
 #include <lemon/syscall.h>
 
@@ -28,6 +29,17 @@ pid_t lemon_spawn(const char* path, int argc, const char* const argv[], int flag
 }
 
 namespace Lemon {
+pid_t Spawn(const char* path, char* const argv[], char* const envp[], const lemon_spawn_action_t* actions,
+            size_t actionCount) {
+    pid_t ret = syscall(SYS_SPAWN, path, argv, envp ? envp : environ, actions, actionCount);
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+
+    return ret;
+}
+
 void Yield() { syscall(SYS_YIELD); }
 
 long InterruptThread(pid_t tid) {
@@ -39,6 +51,43 @@ long InterruptThread(pid_t tid) {
     return 0;
 }
 
+long SetSchedulingClass(pid_t tid, int schedClass) {
+    if (long e = syscall(SYS_SET_SCHEDULING_CLASS, tid, schedClass); e < 0) {
+        errno = -e;
+        return -1;
+    }
+
+    return 0;
+}
+
+long GetSchedulingClass(pid_t tid) {
+    long ret = syscall(SYS_GET_SCHEDULING_CLASS, tid);
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+
+    return ret;
+}
+
+long SetAffinity(pid_t tid, uint64_t mask) {
+    if (long e = syscall(SYS_SET_AFFINITY, tid, mask); e < 0) {
+        errno = -e;
+        return -1;
+    }
+
+    return 0;
+}
+
+long GetAffinity(pid_t tid, uint64_t& mask) {
+    if (long e = syscall(SYS_GET_AFFINITY, tid, &mask); e < 0) {
+        errno = -e;
+        return -1;
+    }
+
+    return 0;
+}
+
 int GetProcessInfo(pid_t pid, lemon_process_info_t& pInfo) {
     long ret = -1;
     if ((ret = syscall(SYS_GET_PROCESS_INFO, pid, &pInfo))) {
@@ -69,4 +118,32 @@ void GetProcessList(std::vector<lemon_process_info_t>& list) {
         list.push_back(pInfo);
     }
 }
+
+int GetCPUInfo(unsigned cpu, lemon_cpu_info_t& info) {
+    if (long ret = syscall(SYS_GET_CPU_INFO, cpu, &info); ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+
+    return 0;
+}
+
+int GetMemoryInfo(lemon_memory_info_t& info) {
+    if (long ret = syscall(SYS_GET_MEMORY_INFO, &info); ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+
+    return 0;
+}
+
+long ReadDirBatch(int fd, lemon_dirent_t* entries, size_t count) {
+    long ret = syscall(SYS_READDIR_BATCH, fd, entries, count);
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+
+    return ret;
+}
 } // namespace Lemon
@@ -2,6 +2,10 @@
 
 #include <Lemon/System/KernelObject.h>
 
+#include <algorithm>
+#include <iterator>
+#include <assert.h>
+
 namespace Lemon {
 void Waitable::Wait(long timeout) { WaitForKernelObject(GetHandle(), timeout); }
 
@@ -11,19 +15,25 @@ Waitable::~Waitable() {
     }
 }
 
+Waiter::Waiter() {
+    handle_t set = CreateWaitSet();
+    assert(set > 0);
+
+    waitSet = Handle(set);
+}
+
 void Waiter::WaitOn(Waitable* waitable) {
     waitingOn.push_back(waitable);
-    handles.push_back(waitable->GetHandle());
-
     waitable->waiters.push_back(this);
+
+    RepopulateHandles();
 }
 
 void Waiter::WaitOnAll(Waitable* waitable) {
     waitingOnAll.push_back(waitable);
-
-    waitable->GetAllHandles(handles); // Get all handles
-
     waitable->waiters.push_back(this);
+
+    RepopulateHandles();
 }
 
 void Waiter::StopWaitingOn(Waitable* waitable) {
@@ -42,20 +52,41 @@ void Waiter::StopWaitingOnAll(Waitable* waitable) {
 
 void Waiter::Wait(long timeout) {
     if (handles.size()) {
-        WaitForKernelObject(handles.data(), handles.size(), timeout);
+        // Only whether something is ready matters, the waitables are polled afterwards
+        handle_t ready[16];
+        WaitSetWait(waitSet.get(), ready, 16, (timeout > 0) ? timeout : -1);
     }
 }
 
 void Waiter::RepopulateHandles() {
-    handles.clear();
-
+    std::vector<handle_t> newHandles;
     for (auto& waitable : waitingOn) {
-        handles.push_back(waitable->GetHandle());
+        newHandles.push_back(waitable->GetHandle());
     }
 
     for (auto& waitable : waitingOnAll) {
-        waitable->GetAllHandles(handles);
+        waitable->GetAllHandles(newHandles);
     }
+
+    std::sort(newHandles.begin(), newHandles.end());
+    newHandles.erase(std::unique(newHandles.begin(), newHandles.end()), newHandles.end());
+
+    // Only the difference is passed to the kernel
+    std::vector<handle_t> changed;
+    std::set_difference(handles.begin(), handles.end(), newHandles.begin(), newHandles.end(),
+                        std::back_inserter(changed));
+    for (handle_t h : changed) {
+        WaitSetRemove(waitSet.get(), h);
+    }
+
+    changed.clear();
+    std::set_difference(newHandles.begin(), newHandles.end(), handles.begin(), handles.end(),
+                        std::back_inserter(changed));
+    for (handle_t h : changed) {
+        WaitSetAdd(waitSet.get(), h);
+    }
+
+    handles = std::move(newHandles);
 }
 
 Waiter::~Waiter() {
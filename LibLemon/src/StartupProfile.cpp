@@ -0,0 +1,127 @@
+#include <Lemon/Core/StartupProfile.h>
+
+#include <mutex>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace Lemon {
+namespace StartupProfile {
+
+struct Phase {
+    const char* name;
+    unsigned count;
+    uint64_t us;
+};
+
+static int profileFd = -1;
+static bool exitWhenFinished = false;
+static uint64_t loadedAt = 0;
+
+static std::mutex phasesLock;
+static Phase phases[STARTUP_PROFILE_MAX_PHASES];
+static int phaseCount = 0;
+
+static thread_local Scope* currentScope = nullptr;
+
+// Runs before the constructors of applications, so dynamic loading is all that happened before it
+__attribute__((constructor(101))) static void InitializeStartupProfile() {
+    const char* fd = getenv(STARTUP_PROFILE_FD_ENV);
+    if (!fd) {
+        return;
+    }
+
+    loadedAt = Now();
+    profileFd = atoi(fd);
+    exitWhenFinished = getenv(STARTUP_PROFILE_EXIT_ENV);
+
+    // Only this program is profiled, not anything it starts (e.g. the shell of Terminal)
+    fcntl(profileFd, F_SETFD, FD_CLOEXEC);
+    unsetenv(STARTUP_PROFILE_FD_ENV);
+    unsetenv(STARTUP_PROFILE_EXIT_ENV);
+}
+
+bool Enabled() { return profileFd >= 0; }
+
+uint64_t Now() {
+    timespec t;
+    clock_gettime(CLOCK_BOOTTIME, &t);
+    return t.tv_sec * 1000000ULL + t.tv_nsec / 1000;
+}
+
+static void Record(const char* name, uint64_t us) {
+    std::scoped_lock lock(phasesLock);
+
+    for (int i = 0; i < phaseCount; i++) {
+        if (!strcmp(phases[i].name, name)) {
+            phases[i].count++;
+            phases[i].us += us;
+            return;
+        }
+    }
+
+    if (phaseCount < STARTUP_PROFILE_MAX_PHASES) {
+        phases[phaseCount++] = {name, 1, us};
+    }
+}
+
+Scope::Scope(const char* name) : m_name(name) {
+    if (!Enabled()) {
+        return;
+    }
+
+    m_start = Now();
+    m_parent = currentScope;
+    currentScope = this;
+}
+
+Scope::~Scope() {
+    if (!m_start) {
+        return;
+    }
+
+    uint64_t elapsed = Now() - m_start;
+    currentScope = m_parent;
+    if (m_parent) {
+        m_parent->m_nested += elapsed;
+    }
+
+    if (Enabled()) {
+        Record(m_name, elapsed - m_nested);
+    }
+}
+
+void Finish() {
+    if (!Enabled()) {
+        return;
+    }
+
+    uint64_t paintedAt = Now();
+
+    FILE* out = fdopen(profileFd, "w");
+    profileFd = -1; // Nothing else is recorded
+    if (!out) {
+        return;
+    }
+
+    fprintf(out, "loaded %lu\n", loadedAt);
+    {
+        std::scoped_lock lock(phasesLock);
+        for (int i = 0; i < phaseCount; i++) {
+            fprintf(out, "phase %s %u %lu\n", phases[i].name, phases[i].count, phases[i].us);
+        }
+    }
+    fprintf(out, "painted %lu\n", paintedAt);
+    fclose(out);
+
+    if (exitWhenFinished) {
+        _exit(0);
+    }
+}
+
+} // namespace StartupProfile
+} // namespace Lemon
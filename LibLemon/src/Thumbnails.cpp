@@ -0,0 +1,274 @@
+#include <Lemon/Core/Thumbnails.h>
+
+#include <Lemon/Graphics/Graphics.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <lemon/syscall.h>
+
+#define THUMBNAIL_MAGIC 0x424d4854 // THMB
+#define THUMBNAIL_VERSION 1
+#define THUMBNAIL_WAKE_INTERVAL 10000 // us between calling onReady whilst thumbnails have not been taken
+
+namespace Lemon {
+
+namespace {
+
+// On disk format, the header is followed by the path of the image then the pixels
+struct ThumbnailHeader {
+    uint32_t magic;
+    uint32_t version;
+
+    uint64_t sourceInode;
+    uint64_t sourceSize;
+
+    uint32_t width;
+    uint32_t height;
+    uint32_t pathLength;
+    uint32_t reserved;
+};
+
+uint64_t HashPath(const std::string& path) {
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325;
+    for (char c : path) {
+        hash = (hash ^ static_cast<uint8_t>(c)) * 0x100000001b3;
+    }
+
+    return hash;
+}
+
+// Thumbnails are named by a hash of the path of their image
+std::string CachePath(const std::string& path) {
+    char name[sizeof(THUMBNAIL_CACHE_DIR) + 24];
+    snprintf(name, sizeof(name), THUMBNAIL_CACHE_DIR "/%016lx", HashPath(path));
+
+    return name;
+}
+
+bool ReadAll(int fd, void* buffer, size_t size) {
+    return read(fd, buffer, size) == static_cast<ssize_t>(size);
+}
+
+// Read the saved thumbnail of the image at path, if it was made from the image as it is now
+bool LoadCached(const std::string& path, const struct stat& st, Surface& surface) {
+    int fd = open(CachePath(path).c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    ThumbnailHeader header;
+    if (!ReadAll(fd, &header, sizeof(header)) || header.magic != THUMBNAIL_MAGIC ||
+        header.version != THUMBNAIL_VERSION || header.sourceInode != static_cast<uint64_t>(st.st_ino) ||
+        header.sourceSize != static_cast<uint64_t>(st.st_size) || header.width != THUMBNAIL_SIZE ||
+        header.height != THUMBNAIL_SIZE || header.pathLength != path.length()) {
+        close(fd);
+        return false;
+    }
+
+    // Thumbnails are named by a hash of the path, make sure this is not another image
+    std::string cachedPath(header.pathLength, '\0');
+    if (!ReadAll(fd, cachedPath.data(), header.pathLength) || cachedPath != path) {
+        close(fd);
+        return false;
+    }
+
+    surface = {.width = THUMBNAIL_SIZE, .height = THUMBNAIL_SIZE, .depth = 32, .buffer = nullptr};
+    surface.buffer = new uint8_t[surface.BufferSize()];
+    if (!ReadAll(fd, surface.buffer, surface.BufferSize())) {
+        delete[] surface.buffer;
+        surface.buffer = nullptr;
+
+        close(fd);
+        return false;
+    }
+
+    close(fd);
+    return true;
+}
+
+// Failing to save is ignored, the image will be decoded again next time
+void SaveCached(const std::string& path, const struct stat& st, const Surface& surface) {
+    if (mkdir(THUMBNAIL_CACHE_DIR, 0777) && errno != EEXIST) {
+        return;
+    }
+
+    ThumbnailHeader header = {
+        .magic = THUMBNAIL_MAGIC,
+        .version = THUMBNAIL_VERSION,
+        .sourceInode = static_cast<uint64_t>(st.st_ino),
+        .sourceSize = static_cast<uint64_t>(st.st_size),
+        .width = static_cast<uint32_t>(surface.width),
+        .height = static_cast<uint32_t>(surface.height),
+        .pathLength = static_cast<uint32_t>(path.length()),
+        .reserved = 0,
+    };
+
+    std::vector<uint8_t> data(sizeof(header) + path.length() + surface.BufferSize());
+    memcpy(data.data(), &header, sizeof(header));
+    memcpy(data.data() + sizeof(header), path.data(), path.length());
+    memcpy(data.data() + sizeof(header) + path.length(), surface.buffer, surface.BufferSize());
+
+    // Written elsewhere then renamed so nobody reads a partially written thumbnail
+    std::string cachePath = CachePath(path);
+    std::string tempPath =
+        cachePath + "." + std::to_string(getpid()) + "." + std::to_string(syscall(SYS_GETTID));
+
+    int fd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return;
+    }
+
+    bool written = write(fd, data.data(), data.size()) == static_cast<ssize_t>(data.size());
+    close(fd);
+
+    if (!written || rename(tempPath.c_str(), cachePath.c_str())) {
+        unlink(tempPath.c_str());
+    }
+}
+
+} // namespace
+
+ThumbnailGenerator::ThumbnailGenerator(std::function<void()> onReady) : m_onReady(std::move(onReady)) {}
+
+ThumbnailGenerator::~ThumbnailGenerator() {
+    {
+        std::lock_guard lock(m_lock);
+        m_stop = true;
+    }
+    m_requestAdded.notify_all();
+
+    for (auto& worker : m_workers) {
+        worker.join();
+    }
+
+    for (auto& thumbnail : m_completed) {
+        delete[] thumbnail.surface.buffer;
+    }
+}
+
+bool ThumbnailGenerator::IsImage(const char* name) {
+    const char* ext = strrchr(name, '.');
+    if (!ext) {
+        return false;
+    }
+
+    return !strcasecmp(ext, ".png") || !strcasecmp(ext, ".jpg") || !strcasecmp(ext, ".jpeg") ||
+           !strcasecmp(ext, ".bmp");
+}
+
+void ThumbnailGenerator::Request(const std::string& path) {
+    {
+        std::lock_guard lock(m_lock);
+        if (m_workers.empty()) {
+            for (int i = 0; i < THUMBNAIL_WORKERS; i++) {
+                m_workers.emplace_back(&ThumbnailGenerator::Worker, this);
+            }
+        }
+
+        m_requests.push_back(path);
+    }
+
+    m_requestAdded.notify_one();
+}
+
+void ThumbnailGenerator::Cancel() {
+    std::lock_guard lock(m_lock);
+    m_requests.clear();
+
+    for (auto& thumbnail : m_completed) {
+        delete[] thumbnail.surface.buffer;
+    }
+    m_completed.clear();
+
+    m_generation++;
+}
+
+void ThumbnailGenerator::TakeCompleted(std::vector<Thumbnail>& thumbnails) {
+    std::lock_guard lock(m_lock);
+    thumbnails.insert(thumbnails.end(), std::make_move_iterator(m_completed.begin()),
+                      std::make_move_iterator(m_completed.end()));
+    m_completed.clear();
+}
+
+void ThumbnailGenerator::Worker() {
+    std::unique_lock lock(m_lock);
+    for (;;) {
+        m_requestAdded.wait(lock, [this]() { return m_stop || !m_requests.empty(); });
+        if (m_stop) {
+            return;
+        }
+
+        std::string path = std::move(m_requests.back());
+        m_requests.pop_back();
+        uint64_t generation = m_generation;
+
+        lock.unlock();
+        Surface surface;
+        bool generated = Generate(path, surface);
+        lock.lock();
+
+        if (!generated) {
+            continue;
+        } else if (generation != m_generation) {
+            delete[] surface.buffer; // Cancelled whilst we were decoding
+            continue;
+        }
+
+        m_completed.push_back({std::move(path), surface});
+        if (!m_notifying) {
+            m_notifying = true;
+
+            lock.unlock();
+            Notify();
+            lock.lock();
+        }
+    }
+}
+
+void ThumbnailGenerator::Notify() {
+    // The thread being woken may not have been waiting, so keep waking it until the thumbnails have been taken
+    for (;;) {
+        m_onReady();
+        usleep(THUMBNAIL_WAKE_INTERVAL);
+
+        std::lock_guard lock(m_lock);
+        if (m_stop || m_completed.empty()) {
+            m_notifying = false;
+            return;
+        }
+    }
+}
+
+bool ThumbnailGenerator::Generate(const std::string& path, Surface& surface) {
+    struct stat st;
+    if (stat(path.c_str(), &st) || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+
+    if (LoadCached(path, st, surface)) {
+        return true;
+    }
+
+    // Images are decoded at the size they are drawn, rather than decoding the whole image then scaling it
+    surface = {.width = THUMBNAIL_SIZE, .height = THUMBNAIL_SIZE, .depth = 32, .buffer = nullptr};
+    surface.buffer = new uint8_t[surface.BufferSize()];
+    memset(surface.buffer, 0, surface.BufferSize());
+
+    if (Graphics::LoadImage(path.c_str(), 0, 0, THUMBNAIL_SIZE, THUMBNAIL_SIZE, &surface, true)) {
+        delete[] surface.buffer;
+        surface.buffer = nullptr;
+        return false;
+    }
+
+    SaveCached(path, st, surface);
+    return true;
+}
+
+} // namespace Lemon
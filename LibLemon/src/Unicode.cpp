@@ -1,102 +1,233 @@
 #include <Lemon/Core/Unicode.h>
 
+#include "Graphics/FastMem.h"
+
+#include <immintrin.h>
 #include <stdio.h>
 
+// Ways a pair of bytes can be invalid UTF-8, looked up by the high and low nibbles of the
+// first byte and the high nibble of the second. A pair is invalid when all three share a bit.
+#define UTF8_TOO_SHORT (1 << 0)      // Lead byte followed by a lead byte or ASCII
+#define UTF8_TOO_LONG (1 << 1)       // ASCII followed by a continuation byte
+#define UTF8_OVERLONG_3 (1 << 2)     // 11100000 100_____
+#define UTF8_TOO_LARGE (1 << 3)      // 11110100 1001____, 11110100 101_____ or 11110101+
+#define UTF8_SURROGATE (1 << 4)      // 11101101 101_____
+#define UTF8_OVERLONG_2 (1 << 5)     // 1100000_ 10______
+#define UTF8_TOO_LARGE_1000 (1 << 6) // 11110101+ 1000____
+#define UTF8_OVERLONG_4 (1 << 6)     // 11110000 1000____
+#define UTF8_TWO_CONTS (1 << 7)      // Continuation byte following a continuation byte outside a sequence
+#define UTF8_CARRY (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS) // Do not depend on the low nibble
+
 namespace Lemon {
 
-std::vector<int32_t> UTF8ToUTF32(const std::string& utf8String) {
-    std::vector<int32_t> codepoints;
-    for(unsigned i = 0; i < utf8String.length(); i++) {
-        int c = utf8String[i];
-        
-        // Check amount of bytes in code point
-        if((c & 0xF8) == 0xF0) {
-            // 11110xxx
-            // 4 bytes
-            if(i + 3 >= utf8String.length()) {
-                codepoints.push_back(0);
-                continue; // Invalid code point
+namespace {
+
+inline bool IsContinuation(uint8_t c) { return (c & 0xC0) == 0x80; }
+
+/////////////////////////////
+/// \brief Decode the sequence starting at s[i], which is not ASCII
+///
+/// i is moved past the sequence, or past the first byte when it is invalid.
+/////////////////////////////
+int32_t DecodeSequence(const uint8_t* s, size_t length, size_t& i) {
+    uint8_t c = s[i];
+    size_t remaining = length - i;
+
+    if ((c & 0xE0) == 0xC0) {
+        // 110xxxxx
+        // 2 bytes
+        if (remaining >= 2 && IsContinuation(s[i + 1])) {
+            int32_t codepoint = ((c & 0x1f) << 6) | (s[i + 1] & 0x3f);
+            if (codepoint >= 0x80) {
+                i += 2;
+                return codepoint;
+            }
+        }
+    } else if ((c & 0xF0) == 0xE0) {
+        // 1110xxxx
+        // 3 bytes
+        if (remaining >= 3 && IsContinuation(s[i + 1]) && IsContinuation(s[i + 2])) {
+            int32_t codepoint = ((c & 0xf) << 12) | ((s[i + 1] & 0x3f) << 6) | (s[i + 2] & 0x3f);
+            if (codepoint >= 0x800 && (codepoint < 0xD800 || codepoint > 0xDFFF)) {
+                i += 3;
+                return codepoint;
             }
+        }
+    } else if ((c & 0xF8) == 0xF0) {
+        // 11110xxx
+        // 4 bytes
+        if (remaining >= 4 && IsContinuation(s[i + 1]) && IsContinuation(s[i + 2]) && IsContinuation(s[i + 3])) {
+            int32_t codepoint =
+                ((c & 0x7) << 18) | ((s[i + 1] & 0x3f) << 12) | ((s[i + 2] & 0x3f) << 6) | (s[i + 3] & 0x3f);
+            if (codepoint >= 0x10000 && codepoint <= 0x10FFFF) {
+                i += 4;
+                return codepoint;
+            }
+        }
+    }
+
+    i++;
+    return UNICODE_REPLACEMENT_CHARACTER;
+}
+
+size_t ASCIIPrefixSSE2(const uint8_t* s, size_t length) {
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        unsigned mask = _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i)));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
 
-            int codepoint = 0;
-            codepoint |= ((c & 0x7U) << 18);
+    for (; i < length && s[i] < 0x80; i++)
+        ;
+    return i;
+}
 
-            c = utf8String[++i];
-            codepoint |= ((c & 0x3fU) << 12);
+__attribute__((target("avx2"))) size_t ASCIIPrefixAVX2(const uint8_t* s, size_t length) {
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        unsigned mask = _mm256_movemask_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i)));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
 
-            c = utf8String[++i];
-            codepoint |= ((c & 0x3fU) << 6);
+    return i + ASCIIPrefixSSE2(s + i, length - i);
+}
 
-            c = utf8String[++i];
-            codepoint |= (c & 0x3fU);
-            
-            codepoints.push_back(codepoint);
-        } else if((c & 0xF0) == 0xE0) {
-            // 1110xxxx
-            // 3 bytes
+// Right shift each byte by 4
+inline __m128i HighNibbles(__m128i v) { return _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0f)); }
 
-            if(i + 2 >= utf8String.length()) {
-                codepoints.push_back(0);
-                continue; // Invalid code point
-            }
+/////////////////////////////
+/// \brief Check a block of 16 bytes, following the block previous
+///
+/// Every pair of adjacent bytes is checked using lookup tables, then continuation bytes
+/// are checked to be the second and third after a three or four byte lead.
+/// Returns non-zero bytes where there is an error.
+/////////////////////////////
+inline __m128i Validate16(__m128i input, __m128i previous) {
+    const __m128i byte1HighTable =
+        _mm_setr_epi8(UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+                      UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+                      UTF8_TOO_SHORT | UTF8_OVERLONG_2, UTF8_TOO_SHORT,
+                      UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+                      UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4);
+    const __m128i byte1LowTable = _mm_setr_epi8(
+        UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4, UTF8_CARRY | UTF8_OVERLONG_2, UTF8_CARRY,
+        UTF8_CARRY, UTF8_CARRY | UTF8_TOO_LARGE, UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000);
+    const __m128i byte2HighTable = _mm_setr_epi8(
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE, UTF8_TOO_SHORT,
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT);
 
-            int codepoint = 0;
-            codepoint |= ((c & 0xfU) << 12);
+    __m128i previous1 = _mm_alignr_epi8(input, previous, 15);
+    __m128i special =
+        _mm_and_si128(_mm_and_si128(_mm_shuffle_epi8(byte1HighTable, HighNibbles(previous1)),
+                                    _mm_shuffle_epi8(byte1LowTable, _mm_and_si128(previous1, _mm_set1_epi8(0x0f)))),
+                      _mm_shuffle_epi8(byte2HighTable, HighNibbles(input)));
 
-            c = utf8String[++i];
-            codepoint |= ((c & 0x3fU) << 6);
+    // Only bytes two after a 111_____ lead or three after a 1111____ lead get the top bit set
+    __m128i third = _mm_subs_epu8(_mm_alignr_epi8(input, previous, 14), _mm_set1_epi8(static_cast<char>(0xe0 - 0x80)));
+    __m128i fourth = _mm_subs_epu8(_mm_alignr_epi8(input, previous, 13), _mm_set1_epi8(static_cast<char>(0xf0 - 0x80)));
+    __m128i mustBeContinuation = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8(static_cast<char>(0x80)));
 
-            c = utf8String[++i];
-            codepoint |= (c & 0x3fU);
+    return _mm_xor_si128(mustBeContinuation, special);
+}
 
-            codepoints.push_back(codepoint);
-        } else if((c & 0xE0) == 0xC0) {
-            // 110xxxxx
-            // 2 bytes
+// Non-zero when the block ends part way through a sequence
+inline __m128i Incomplete16(__m128i input) {
+    const __m128i maxValues = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0xf0 - 1, 0xe0 - 1,
+                                            0xc0 - 1);
+    return _mm_subs_epu8(input, maxValues);
+}
 
-            if(i + 1 >= utf8String.length()) {
-                codepoints.push_back(0);
-                continue; // Invalid code point
-            }
+} // namespace
 
-            int codepoint = 0;
-            codepoint |= ((c & 0x1fU) << 6);
+std::vector<int32_t> UTF8ToUTF32(const std::string& utf8String) {
+    std::vector<int32_t> codepoints;
+    UTF8ToUTF32(utf8String.data(), utf8String.length(), codepoints);
+    return codepoints;
+}
+
+void UTF8ToUTF32(const char* str, size_t length, std::vector<int32_t>& codepoints) {
+    const uint8_t* s = reinterpret_cast<const uint8_t*>(str);
 
-            c = utf8String[++i];
-            codepoint |= (c & 0x3fU);
+    // There are never more codepoints than bytes
+    codepoints.resize(length);
+    int32_t* out = codepoints.data();
+
+    size_t i = 0;
+    while (i < length) {
+        // Widen 16 ASCII bytes at a time
+        for (; i + 16 <= length; i += 16, out += 16) {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+            if (_mm_movemask_epi8(bytes)) {
+                break;
+            }
+
+            __m128i* dest = reinterpret_cast<__m128i*>(out);
+            _mm_storeu_si128(dest, _mm_cvtepu8_epi32(bytes));
+            _mm_storeu_si128(dest + 1, _mm_cvtepu8_epi32(_mm_srli_si128(bytes, 4)));
+            _mm_storeu_si128(dest + 2, _mm_cvtepu8_epi32(_mm_srli_si128(bytes, 8)));
+            _mm_storeu_si128(dest + 3, _mm_cvtepu8_epi32(_mm_srli_si128(bytes, 12)));
+        }
 
-            codepoints.push_back(codepoint);
+        if (i >= length) {
+            break;
+        } else if (s[i] < 0x80) {
+            *(out++) = s[i++];
         } else {
-            // 0xxxxxxx
-            // 1 byte
-            
-            codepoints.push_back(c);
+            *(out++) = DecodeSequence(s, length, i);
         }
     }
 
-    return codepoints;
+    codepoints.resize(out - codepoints.data());
 }
 
-unsigned UTF8Strlen(const std::string& utf8String) {
-    unsigned length = 0;
-    for(unsigned i = 0; i < utf8String.length(); i++, length++) {
-        int c = utf8String[i];
-        
-        // Check amount of bytes in code point
-        if((c & 0xF8) == 0xF0) {
-            i += 3;
-        } else if((c & 0xF0) == 0xE0) {
-            // 1110xxxx
-            // 3 bytes
-            i += 2;
-        } else if((c & 0xE0) == 0xC0) {
-            // 110xxxxx
-            // 2 bytes
-            i += 1;
+unsigned UTF8Strlen(const std::string& utf8String) { return UTF8Strlen(utf8String.data(), utf8String.length()); }
+
+size_t UTF8Strlen(const char* str, size_t length) {
+    const uint8_t* s = reinterpret_cast<const uint8_t*>(str);
+
+    if (UTF8Validate(str, length)) {
+        // Every byte that is not a continuation byte (10xxxxxx) starts a codepoint,
+        // as signed bytes continuation bytes are those from -128 to -65
+        size_t count = 0;
+        size_t i = 0;
+        for (; i + 16 <= length; i += 16) {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+            count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpgt_epi8(bytes, _mm_set1_epi8(-65))));
+        }
+
+        for (; i < length; i++) {
+            count += !IsContinuation(s[i]);
+        }
+
+        return count;
+    }
+
+    // Count the codepoints UTF8ToUTF32 would give, each byte of an invalid sequence is its own U+FFFD
+    size_t count = 0;
+    for (size_t i = 0; i < length; count++) {
+        if (s[i] < 0x80) {
+            i++;
+        } else {
+            DecodeSequence(s, length, i);
         }
     }
 
-    return length;
+    return count;
 }
 
 unsigned UTF8SkipCodepoints(const std::string& utf8String, long n) {
@@ -104,29 +235,92 @@ unsigned UTF8SkipCodepoints(const std::string& utf8String, long n) {
         n = UTF8Strlen(utf8String) - n;
     }
 
-    unsigned i = 0;
-    for(; i < utf8String.length() && n > 0; i++, n--) {
-        int c = utf8String[i];
-        
-        // Check amount of bytes in code point
-        if((c & 0xF8) == 0xF0) {
-            i += 3;
-        } else if((c & 0xF0) == 0xE0) {
-            // 1110xxxx
-            // 3 bytes
-            i += 2;
-        } else if((c & 0xE0) == 0xC0) {
-            // 110xxxxx
-            // 2 bytes
-            i += 1;
+    // Step over codepoints the same way UTF8ToUTF32 decodes them
+    const uint8_t* s = reinterpret_cast<const uint8_t*>(utf8String.data());
+    size_t i = 0;
+    for(; i < utf8String.length() && n > 0; n--) {
+        if(s[i] < 0x80) {
+            i++;
+        } else {
+            DecodeSequence(s, utf8String.length(), i);
+        }
+    }
+
+    return i;
+}
+
+bool UTF8Validate(const char* str, size_t length) {
+    const uint8_t* s = reinterpret_cast<const uint8_t*>(str);
+
+    __m128i error = _mm_setzero_si128();
+    __m128i previous = _mm_setzero_si128();
+    __m128i previousIncomplete = _mm_setzero_si128();
+
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        // Skip 32 bytes of ASCII at a time, only needing to check nothing was left incomplete before them
+        if (i + 32 <= length) {
+            __m128i first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+            __m128i second = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i + 16));
+            if (!_mm_movemask_epi8(_mm_or_si128(first, second))) {
+                error = _mm_or_si128(error, previousIncomplete);
+                previous = second;
+                previousIncomplete = _mm_setzero_si128();
+
+                i += 16;
+                continue;
+            }
         }
+
+        __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+        if (!_mm_movemask_epi8(input)) {
+            error = _mm_or_si128(error, previousIncomplete);
+        } else {
+            error = _mm_or_si128(error, Validate16(input, previous));
+        }
+
+        previous = input;
+        previousIncomplete = Incomplete16(input);
+    }
+
+    // The rest is padded with zeros, being ASCII anything incomplete at the end is an error
+    uint8_t last[16] = {};
+    for (size_t j = 0; i + j < length; j++) {
+        last[j] = s[i + j];
     }
 
-    if(i > utf8String.length()) {
-        i = utf8String.length();
+    __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(last));
+    error = _mm_or_si128(error, Validate16(input, previous));
+    error = _mm_or_si128(error, Validate16(_mm_setzero_si128(), input));
+
+    return _mm_test_all_zeros(error, error);
+}
+
+size_t ASCIIPrefix(const char* str, size_t length) {
+    const uint8_t* s = reinterpret_cast<const uint8_t*>(str);
+    if (GetCPUFeatures().avx2) {
+        return ASCIIPrefixAVX2(s, length);
+    }
+
+    return ASCIIPrefixSSE2(s, length);
+}
+
+size_t ASCIIPrintablePrefix(const char* str, size_t length) {
+    const uint8_t* s = reinterpret_cast<const uint8_t*>(str);
+
+    // Adding 0x60 moves ' ' to '~' to the bottom of the signed range (-128 to -34)
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i bytes = _mm_add_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i)), _mm_set1_epi8(0x60));
+        unsigned printable = _mm_movemask_epi8(_mm_cmplt_epi8(bytes, _mm_set1_epi8(-33)));
+        if (printable != 0xffff) {
+            return i + __builtin_ctz(~printable);
+        }
     }
 
+    for (; i < length && s[i] >= ' ' && s[i] <= '~'; i++)
+        ;
     return i;
 }
 
-};
\ No newline at end of file
+};
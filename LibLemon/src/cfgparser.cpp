@@ -1,45 +1,61 @@
 #include <Lemon/Core/CFGParser.h>
 
+#include <Lemon/Core/ConfigCache.h>
+
 enum ParserState {
     ParserStateHeading,
     ParserStateName,
     ParserStateValue,
 };
 
-CFGParser::CFGParser(const char* path) {
-    cfgFile = fopen(path, "r");
+CFGParser::CFGParser(const char* path) : cfgPath(path) {}
+
+void CFGParser::Parse() {
+    Lemon::ConfigCache cache;
+    Lemon::ConfigCache::Source source;
+    if (!cache.Open(cfgPath.c_str(), source)) {
+        uint32_t section = UINT32_MAX;
+        for (size_t i = 0; i < cache.size(); i++) {
+            Lemon::ConfigCache::Entry entry = cache[i];
+            if (entry.section != section) {
+                items.push_back({std::string(entry.sectionName), {}});
+                section = entry.section;
+            }
+
+            items.back().second.push_back({std::string(entry.key), std::string(entry.str)});
+        }
+        return;
+    }
 
+    FILE* cfgFile = fopen(cfgPath.c_str(), "r");
     if (!cfgFile) {
-        printf("CFGParser: Failed to open %s!\n", path);
+        printf("CFGParser: Failed to open %s!\n", cfgPath.c_str());
         return;
     }
 
     fseek(cfgFile, 0, SEEK_END);
 
     size_t cfgSize = ftell(cfgFile);
+    cfgData.resize(cfgSize);
 
-    if (cfgSize <= 0x8000) {
-        cfgData.resize(cfgSize);
+    fseek(cfgFile, 0, SEEK_SET);
+    cfgData.resize(fread(cfgData.data(), 1, cfgSize, cfgFile));
+    fclose(cfgFile);
 
-        fseek(cfgFile, 0, SEEK_SET);
+    ParseData();
 
-        fread(cfgData.data(), cfgSize, 1, cfgFile);
-    } else {
-        char buf[512];
-        while (fread(buf, 512, 1, cfgFile)) {
-            cfgData.insert(cfgData.end(), buf, buf + 512);
+    Lemon::ConfigCache::Builder builder;
+    for (auto& heading : items) {
+        builder.BeginSection(heading.first);
+        for (auto& item : heading.second) {
+            builder.AddString(item.name, item.value);
         }
     }
+    cache.Save(cfgPath.c_str(), source, builder);
 }
 
-CFGParser::~CFGParser() {
-    if (cfgFile) {
-        fclose(cfgFile);
-    }
-}
-
-void CFGParser::Parse() {
-    if (!cfgFile || !cfgData.size())
+void CFGParser::ParseData() {
+    if (!cfgData.size())
         return;
 
     int state = ParserStateName;
@@ -61,8 +77,9 @@ void CFGParser::Parse() {
                 break;
             }
         case '#':
-            while (it != cfgData.end() && (c = *it++) != '\n')
-                ;
+            // Stop before the newline so the loop does not skip the character after it
+            while (it + 1 != cfgData.end() && *(it + 1) != '\n')
+                it++;
             [[fallthrough]];
         case '\n':
             if (state == ParserStateValue) {
@@ -72,10 +89,10 @@ void CFGParser::Parse() {
                 item.value = value;
 
                 // Trim whitespaces, tabs and carriage returns
-                item.name.erase(0, name.find_first_not_of(" \t\r"));
-                item.name.erase(name.find_last_not_of(" \t\r") + 1);
-                item.value.erase(0, value.find_first_not_of(" \t\r"));
-                item.value.erase(value.find_last_not_of(" \t\r") + 1);
+                item.name.erase(0, item.name.find_first_not_of(" \t\r"));
+                item.name.erase(item.name.find_last_not_of(" \t\r") + 1);
+                item.value.erase(0, item.value.find_first_not_of(" \t\r"));
+                item.value.erase(item.value.find_last_not_of(" \t\r") + 1);
 
                 values.push_back(item);
             } else if (state == ParserStateName) {
@@ -3,317 +3,649 @@
 #include <Lemon/Core/Format.h>
 #include <Lemon/Core/Logger.h>
 
+#include "JSONScan.h"
+
+#include <algorithm>
+#include <climits>
+#include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 //#define LIBLEMON_DEBUG_JSON 1
 
+// Documents nested any deeper are rejected rather than overflowing the stack
+#define JSON_MAX_DEPTH 256
+
 namespace Lemon {
-JSONParser::JSONParser(std::string_view& v) : BasicLexer(v) {}
+namespace {
+
+// Builds the document in the arena of the parser.
+// Values are gathered on scratch stacks until their array or object ends,
+// then copied into the arena in one go.
+class DocumentBuilder final : public JSONHandler {
+public:
+    DocumentBuilder(JSONParser& parser) : m_parser(parser) {}
+
+    bool OnNull() override { return Push(JSONValue()); }
+    bool OnBool(bool value) override { return Push(JSONValue(value)); }
+    bool OnSigned(long value) override { return Push(JSONValue(value)); }
+    bool OnUnsigned(unsigned long value) override { return Push(JSONValue(value)); }
+    bool OnFloat(double value) override { return Push(JSONValue(value)); }
+    bool OnString(std::string_view value) override { return Push(JSONValue(Store(value))); }
+
+    bool OnObjectStart() override {
+        m_containers.push_back(true);
+        return true;
+    }
 
-JSONParser::JSONParser(const char* path) {
-    FILE* file = fopen(path, "r");
-    if (!file) {
-        printf("[LibLemon] Warning: Failed to open JSON file '%s' for reading!\n", path);
-        return;
+    bool OnKey(std::string_view key) override {
+        m_keys.push_back(Store(key));
+        return true;
     }
 
-    fseek(file, 0, SEEK_END);
+    bool OnObjectEnd(size_t memberCount) override {
+        auto first = m_members.end() - memberCount;
+        auto last = m_members.end();
 
-    size_t len = ftell(file);
+        // Stable so that when a key is repeated the last value wins
+        std::stable_sort(first, last, [](const JSONMember& l, const JSONMember& r) { return l.key < r.key; });
 
-    if (len <= 0x1000) {
-        buffer.resize(len);
+        JSONObject object = {nullptr, 0};
+        if (memberCount) {
+            object.members = m_parser.Arena().Allocate<JSONMember>(memberCount);
+        }
 
-        fseek(file, 0, SEEK_SET);
+        for (auto it = first; it != last; it++) {
+            if (it + 1 != last && (it + 1)->key == it->key) {
+                continue;
+            }
 
-        fread(buffer.data(), 1, len, file);
-    } else {
-        fseek(file, 0, SEEK_SET);
+            new (&object.members[object.count++]) JSONMember(*it);
+        }
+
+        m_members.erase(first, last);
+        m_containers.pop_back();
+        return Push(JSONValue(object));
+    }
+
+    bool OnArrayStart() override {
+        m_containers.push_back(false);
+        return true;
+    }
 
-        char buf[0x1000];
-        while (size_t sz = fread(buf, 0x1000, 1, file)) {
-            buffer.insert(buffer.end(), buf, buf + sz);
+    bool OnArrayEnd(size_t count) override {
+        JSONArray array = {nullptr, count};
+        if (count) {
+            array.values = m_parser.Arena().Allocate<JSONValue>(count);
+            std::uninitialized_copy(m_values.end() - count, m_values.end(), array.values);
         }
+
+        m_values.resize(m_values.size() - count);
+        m_containers.pop_back();
+        return Push(JSONValue(array));
     }
 
-    buffer.push_back(0);
-    fclose(file);
+    inline JSONValue Root() const { return m_root; }
+
+private:
+    bool Push(const JSONValue& value) {
+        if (m_containers.empty()) {
+            m_root = value;
+        } else if (m_containers.back()) {
+            m_members.push_back({m_keys.back(), value});
+            m_keys.pop_back();
+        } else {
+            m_values.push_back(value);
+        }
+
+        return true;
+    }
+
+    // Strings in the source can be used where they are,
+    // those with escape sequences have been decoded elsewhere and need copying
+    std::string_view Store(std::string_view str) {
+        if (str.empty() || m_parser.IsInSource(str.data())) {
+            return str;
+        }
+
+        char* copy = m_parser.Arena().Allocate<char>(str.length());
+        std::copy(str.begin(), str.end(), copy);
+        return std::string_view(copy, str.length());
+    }
+
+    JSONParser& m_parser;
+    JSONValue m_root;
+
+    std::vector<bool> m_containers; // True for objects, false for arrays
+    std::vector<JSONValue> m_values;
+    std::vector<JSONMember> m_members;
+    std::vector<JSONKey> m_keys;
+};
+
+int ParseHex(const char* it, uint32_t& value) {
+    value = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = it[i];
+        value <<= 4;
+
+        if (c >= '0' && c <= '9') {
+            value |= c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            value |= c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            value |= c - 'A' + 10;
+        } else {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void AppendUTF8(std::string& str, uint32_t codepoint) {
+    if (codepoint < 0x80) {
+        str += static_cast<char>(codepoint);
+    } else if (codepoint < 0x800) {
+        str += static_cast<char>(0xc0 | (codepoint >> 6));
+        str += static_cast<char>(0x80 | (codepoint & 0x3f));
+    } else if (codepoint < 0x10000) {
+        str += static_cast<char>(0xe0 | (codepoint >> 12));
+        str += static_cast<char>(0x80 | ((codepoint >> 6) & 0x3f));
+        str += static_cast<char>(0x80 | (codepoint & 0x3f));
+    } else {
+        str += static_cast<char>(0xf0 | (codepoint >> 18));
+        str += static_cast<char>(0x80 | ((codepoint >> 12) & 0x3f));
+        str += static_cast<char>(0x80 | ((codepoint >> 6) & 0x3f));
+        str += static_cast<char>(0x80 | (codepoint & 0x3f));
+    }
+}
+
+} // namespace
+
+JSONMember* JSONObject::find(std::string_view key) const {
+    JSONMember* it =
+        std::lower_bound(begin(), end(), key, [](const JSONMember& m, std::string_view k) { return m.key < k; });
+    if (it != end() && it->key == key) {
+        return it;
+    }
+
+    return end();
+}
+
+void* JSONArena::Allocate(size_t size, size_t alignment) {
+    uintptr_t pos = (reinterpret_cast<uintptr_t>(m_pos) + alignment - 1) & ~(alignment - 1);
+    if (!m_pos || pos + size > reinterpret_cast<uintptr_t>(m_end)) {
+        size_t blockSize = std::max(m_nextBlockSize, size + alignment);
+        m_blocks.push_back(std::unique_ptr<uint8_t[]>(new uint8_t[blockSize]));
+
+        m_pos = m_blocks.back().get();
+        m_end = m_pos + blockSize;
+        m_nextBlockSize = std::min<size_t>(m_nextBlockSize * 2, 0x10000);
+
+        pos = (reinterpret_cast<uintptr_t>(m_pos) + alignment - 1) & ~(alignment - 1);
+    }
+
+    m_pos = reinterpret_cast<uint8_t*>(pos + size);
+    return reinterpret_cast<void*>(pos);
+}
+
+JSONParser::JSONParser(const std::string_view& v) : BasicLexer(v) {}
 
-    sv = std::string_view(buffer.data());
+JSONParser::JSONParser(const char* path) {
+    it = sv.begin();
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("[LibLemon] Warning: Failed to open JSON file '%s' for reading!\n", path);
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size <= 0) {
+        close(fd);
+        return;
+    }
+
+    void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping keeps the file open
+    if (mapping == MAP_FAILED) {
+        printf("[LibLemon] Warning: Failed to map JSON file '%s'!\n", path);
+        return;
+    }
+
+    m_mapping = mapping;
+    m_mappingSize = st.st_size;
+
+    sv = std::string_view(reinterpret_cast<const char*>(mapping), m_mappingSize);
     it = sv.begin();
 }
 
+JSONParser::~JSONParser() {
+    if (m_mapping) {
+        munmap(const_cast<void*>(m_mapping), m_mappingSize);
+    }
+}
+
 JSONValue JSONParser::Parse() {
-    JSONValue v = JSONValue();
+    DocumentBuilder builder(*this);
+    if (Parse(builder)) {
+        return JSONValue();
+    }
+
+    return builder.Root();
+}
+
+int JSONParser::Parse(JSONHandler& handler) {
+    Restart();
+
+    if (sv.empty() || sv.size() > UINT32_MAX) {
+        return 1;
+    }
+
+    if (json_index_optimized(sv.data(), sv.size(), m_structurals)) {
+#ifdef LIBLEMON_DEBUG_JSON
+        printf("Unterminated string.\n");
+#endif
+        return 1;
+    }
+    m_nextStructural = 0;
 
-    if (sv.empty()) {
-        return v;
+    if (ParseValue(handler, 0)) {
+        return 1;
     }
-    EatWhitespace();
 
-    return ParseObject();
+    if (m_nextStructural != m_structurals.size()) {
+#ifdef LIBLEMON_DEBUG_JSON
+        printf("Unexpected characters after the document, offset %u.\n", m_structurals[m_nextStructural]);
+#endif
+        return 1;
+    }
+
+    return 0;
 }
 
-std::string JSONParser::ParseString() {
-    if (!EatOne('"')) {
-        return "";
+bool JSONParser::NextStructural() {
+    if (m_nextStructural >= m_structurals.size()) {
+        it = sv.end();
+        return false;
     }
 
-    std::string str;
-    char c;
-    while (!End()) {
-        c = Eat();
+    it = sv.begin() + m_structurals[m_nextStructural++];
+    return true;
+}
 
-        if (c == '"') {
-            return str;
-        }
+bool JSONParser::AtScalarEnd() const {
+    if (it >= sv.end()) {
+        return true;
+    }
+
+    switch (*it) {
+    case ' ':
+    case '\t':
+    case '\n':
+    case '\r':
+    case ',':
+    case ']':
+    case '}':
+    case ':':
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool JSONParser::EatLiteral(std::string_view word) {
+    if (!std::string_view(it, sv.end() - it).starts_with(word)) {
+        return false;
+    }
+
+    const char* start = it;
+    it += word.length();
+    if (!AtScalarEnd()) {
+        it = start;
+        return false;
+    }
+
+    return true;
+}
+
+int JSONParser::ParseString(std::string_view& str) {
+    // The scan found both quotes, the closing one is the next structural character
+    const char* start = it + 1;
+    if (!NextStructural() || *it != '"') {
+        return 1;
+    }
+    const char* end = it++;
+
+    // Most strings have no escape sequences, so they can be used straight from the source
+    const char* escape = reinterpret_cast<const char*>(memchr(start, '\\', end - start));
+    if (!escape) {
+        str = std::string_view(start, end - start);
+        return 0;
+    }
 
-        if (End()) {
-            return str; // Unterminated string
+    m_scratch.assign(start, escape);
+    for (const char* p = escape; p < end;) {
+        char c = *p++;
+        if (c != '\\') {
+            m_scratch += c;
+            continue;
         }
 
-        if (c == '\\') { // Control character
-            c = Eat();
-            switch (c) {
-            case '"':
-                str += '"';
-                break;
-            case '\\':
-                str += '\\';
-                break;
-            case '/':
-                str += '/';
-                break;
-            case 'b':
-                str += '\b';
-                break;
-            case 'f':
-                str += '\f';
-                break;
-            case 'n':
-                str += '\n';
-                break;
-            case 'r':
-                str += '\r';
-                break;
-            case 't':
-                str += '\t';
-                break;
-            default: // Invalid escape character
+        c = *p++; // A backslash cannot be last, it would have escaped the closing quote
+        switch (c) {
+        case '"':
+            m_scratch += '"';
+            break;
+        case '\\':
+            m_scratch += '\\';
+            break;
+        case '/':
+            m_scratch += '/';
+            break;
+        case 'b':
+            m_scratch += '\b';
+            break;
+        case 'f':
+            m_scratch += '\f';
+            break;
+        case 'n':
+            m_scratch += '\n';
+            break;
+        case 'r':
+            m_scratch += '\r';
+            break;
+        case 't':
+            m_scratch += '\t';
+            break;
+        case 'u': {
+            uint32_t codepoint;
+            if (end - p < 4 || ParseHex(p, codepoint)) {
+                return 1;
+            }
+            p += 4;
+
+            // Characters outside of the BMP are escaped as a surrogate pair
+            uint32_t low;
+            if (codepoint >= 0xd800 && codepoint < 0xdc00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u' &&
+                !ParseHex(p + 2, low) && low >= 0xdc00 && low < 0xe000) {
+                codepoint = 0x10000 + ((codepoint - 0xd800) << 10) + (low - 0xdc00);
+                p += 6;
+            }
+
+            AppendUTF8(m_scratch, codepoint);
+            break;
+        }
+        default: // Invalid escape character
 #ifdef LIBLEMON_DEBUG_JSON
-                printf("Invalid escape sequence '\\%c', line %d.\n", c, line);
+            printf("Invalid escape sequence '\\%c', offset %ld.\n", c, p - sv.begin());
 #endif
-                return "";
-            }
-        } else {
-            str += c;
+            return 1;
         }
     }
 
-    return "";
+    str = m_scratch;
+    return 0;
 }
 
-int JSONParser::ParseValue(JSONValue& val) {
-    EatWhitespace();
+int JSONParser::ParseNumber(JSONHandler& handler) {
+    const char* start = it;
 
-    char c = Peek();
-    JSONValue& v = val;
+    bool negative = false;
+    if (*it == '-') {
+        negative = true;
+        it++;
+    }
 
-    if (isdigit(c) || c == '-') {
-        bool negative = false;
-        if (c == '-') {
-            negative = true;
-            Eat();
-            c = Peek();
+    const char* digits = it;
+    unsigned long value = 0;
+    bool isFloat = false;
+    while (it < sv.end() && isdigit(*it)) {
+        unsigned digit = *it - '0';
+        if (value > (ULONG_MAX - digit) / 10) {
+            isFloat = true; // Too large for an integer
         }
 
-        if (c == '0' && Peek(1) != '.') { // Number, Leading zeros are not allowed unless value == 0 or is a decimal
-            v = JSONValue(0L);
-
-            Eat();
-        } else {
-            std::string_view num = EatWhile([](char c) -> bool { return isdigit(c) || c == '.'; });
+        value = value * 10 + digit;
+        it++;
+    }
 
-            if (size_t pt = num.find('.'); pt != num.npos) { // Check for a decimal point
-                if (num.find('.', pt + 1) != num.npos) {
+    if (it == digits) {
 #ifdef LIBLEMON_DEBUG_JSON
-                    printf("Expected no more than one '.', line %d.\n", line);
+        printf("Expected digits, offset %ld.\n", it - sv.begin());
 #endif
-                    return 1; // We can't have more than one decimal point
-                }
-
-                if (!negative) {
-                    v = JSONValue(std::stof(std::string(num)));
-                } else {
-                    v = JSONValue(-std::stof(std::string(num)));
-                }
-            } else {
+        return 1;
+    }
 
-                if (!negative) {
-                    v = JSONValue(std::stoul(std::string(num)));
-                } else {
-                    v = JSONValue(-std::stol(std::string(num)));
-                }
-            }
-        }
-    } else if (c == '"') { // String
-        v = JSONValue(ParseString());
-    } else if (c == '{') { // Object
-        v = ParseObject();
+    if (it < sv.end() && *it == '.') {
+        isFloat = true;
 
-        if (v.IsNull()) {
-            return 1; // Should not be null
+        digits = ++it;
+        while (it < sv.end() && isdigit(*it)) {
+            it++;
         }
-    } else if (c == '[') { // Array
-        v = ParseArray();
 
-        if (v.IsNull()) {
-            return 1; // Should not be null
+        if (it == digits) {
+            return 1;
         }
-    } else if (c == 't') {
-        if (!EatWord("true")) {
-            return 1; // Unknown word
+    }
+
+    if (it < sv.end() && (*it == 'e' || *it == 'E')) {
+        isFloat = true;
+
+        if (++it < sv.end() && (*it == '+' || *it == '-')) {
+            it++;
         }
 
-        v = JSONValue(true);
-    } else if (c == 'f') {
-        if (!EatWord("false")) {
-            return 1; // Unknown word
+        digits = it;
+        while (it < sv.end() && isdigit(*it)) {
+            it++;
         }
 
-        v = JSONValue(false);
-    } else if (c == 'n') {
-        if (!EatWord("null")) {
-            return 1; // Unknown word
+        if (it == digits) {
+            return 1;
         }
+    }
 
-        v = JSONValue(); // One of the only times there should be null
-    } else {
+    if (!AtScalarEnd()) {
 #ifdef LIBLEMON_DEBUG_JSON
-        printf("Unknown leading value character '%c', line %d.\n", c, line);
+        printf("Unexpected character '%c' in number, offset %ld.\n", *it, it - sv.begin());
 #endif
+        return 1;
     }
 
-    return 0;
+    if (!isFloat) {
+        if (!negative) {
+            return !handler.OnUnsigned(value);
+        } else if (value <= static_cast<unsigned long>(LONG_MAX) + 1) {
+            return !handler.OnSigned(static_cast<long>(0 - value));
+        }
+    }
+
+    // The source is not null terminated, so copy the number for strtod
+    char buffer[64];
+    size_t length = it - start;
+    if (length >= sizeof(buffer)) {
+        return !handler.OnFloat(strtod(std::string(start, length).c_str(), nullptr));
+    }
+
+    std::copy(start, it, buffer);
+    buffer[length] = 0;
+    return !handler.OnFloat(strtod(buffer, nullptr));
 }
 
-JSONValue JSONParser::ParseObject() {
-    EatWhitespace();
+int JSONParser::ParseValue(JSONHandler& handler, int depth) {
+    if (!NextStructural()) {
+        return 1;
+    }
+
+    char c = *it;
+    if (isdigit(c) || c == '-') {
+        return ParseNumber(handler);
+    } else if (c == '"') { // String
+        std::string_view str;
+        if (ParseString(str)) {
+            return 1;
+        }
+
+        return !handler.OnString(str);
+    } else if (c == '{') { // Object
+        return ParseObject(handler, depth + 1);
+    } else if (c == '[') { // Array
+        return ParseArray(handler, depth + 1);
+    } else if (EatLiteral("true")) {
+        return !handler.OnBool(true);
+    } else if (EatLiteral("false")) {
+        return !handler.OnBool(false);
+    } else if (EatLiteral("null")) {
+        return !handler.OnNull();
+    }
 
-    if (!EatOne('{')) {
 #ifdef LIBLEMON_DEBUG_JSON
-        printf("Expected {, line %d.\n", line);
+    printf("Unknown leading value character '%c', offset %ld.\n", c, it - sv.begin());
 #endif
-        return JSONValue();
+    return 1;
+}
+
+int JSONParser::ParseObject(JSONHandler& handler, int depth) {
+    if (depth > JSON_MAX_DEPTH) {
+        return 1;
     }
 
-    std::map<JSONKey, JSONValue> values;
-    while (!End()) {
-        EatWhitespace();
+    if (!handler.OnObjectStart()) {
+        return 1;
+    }
+
+    if (m_nextStructural < m_structurals.size() && sv[m_structurals[m_nextStructural]] == '}') {
+        m_nextStructural++;
+        return !handler.OnObjectEnd(0);
+    }
 
-        std::string key = ParseString();
-        if (!key.length()) {
+    size_t count = 0;
+    while (true) {
+        std::string_view key;
+        if (!NextStructural() || *it != '"' || ParseString(key)) {
 #ifdef LIBLEMON_DEBUG_JSON
-            printf("Key is empty, line %d.\n", line);
+            printf("Expected key, offset %ld.\n", it - sv.begin());
 #endif
-            return JSONValue();
+            return 1;
         }
 
-        EatWhitespace();
+        if (!handler.OnKey(key)) {
+            return 1;
+        }
 
-        if (!EatOne(':')) {
+        if (!NextStructural() || *it != ':') {
 #ifdef LIBLEMON_DEBUG_JSON
-            printf("Expected :, line %d.\n", line);
+            printf("Expected :, offset %ld.\n", it - sv.begin());
 #endif
-            return JSONValue();
+            return 1;
         }
 
-        JSONValue v;
-        if (ParseValue(v)) {
-            return JSONValue(); // Error parsing value
+        if (ParseValue(handler, depth)) {
+            return 1; // Error parsing value
         }
+        count++;
 
-        values[key] = std::move(v);
-
-        EatWhitespace();
+        if (!NextStructural()) {
+            return 1;
+        }
 
-        char c = Peek();
-        if (c != ',') { // If there is a comma keep going, otherwise break
+        if (*it == '}') {
+            return !handler.OnObjectEnd(count);
+        } else if (*it != ',') { // If there is a comma keep going
 #ifdef LIBLEMON_DEBUG_JSON
-            printf("End of object '%c', line %d.\n", c, line);
+            printf("Expected }, offset %ld.\n", it - sv.begin());
 #endif
-            break;
-        } else {
-            Eat();
+            return 1;
         }
     }
+}
 
-    EatWhitespace();
-    if (!EatOne('}')) {
-#ifdef LIBLEMON_DEBUG_JSON
-        printf("Expected }, line %d.\n", line);
-#endif
-        return JSONValue();
+int JSONParser::ParseArray(JSONHandler& handler, int depth) {
+    if (depth > JSON_MAX_DEPTH) {
+        return 1;
     }
 
-    return JSONValue(std::move(values));
-}
-
-JSONValue JSONParser::ParseArray() {
-    if (!EatOne('[')) {
-#ifdef LIBLEMON_DEBUG_JSON
-        printf("Expected [, line %d.\n", line);
-#endif
-        return JSONValue();
+    if (!handler.OnArrayStart()) {
+        return 1;
     }
 
-    std::vector<JSONValue> values;
-    while (!End()) {
-        EatWhitespace();
+    if (m_nextStructural < m_structurals.size() && sv[m_structurals[m_nextStructural]] == ']') {
+        m_nextStructural++;
+        return !handler.OnArrayEnd(0);
+    }
 
-        JSONValue v;
-        if (ParseValue(v)) {
-            return JSONValue(); // Error parsing value
+    size_t count = 0;
+    while (true) {
+        if (ParseValue(handler, depth)) {
+            return 1; // Error parsing value
         }
+        count++;
 
-        values.push_back(std::move(v));
-
-        EatWhitespace();
-
-        char c = Peek();
-        if (c != ',') { // If there is a comma keep going, otherwise break
-            break;
-        } else {
-            Eat();
+        if (!NextStructural()) {
+            return 1;
         }
-    }
 
-    EatWhitespace();
-    if (!EatOne(']')) {
+        if (*it == ']') {
+            return !handler.OnArrayEnd(count);
+        } else if (*it != ',') { // If there is a comma keep going
 #ifdef LIBLEMON_DEBUG_JSON
-        printf("Expected ], line %d.\n", line);
+            printf("Expected ], offset %ld.\n", it - sv.begin());
 #endif
-        return JSONValue();
+            return 1;
+        }
     }
-
-    return JSONValue(std::move(values));
 }
 
-
 static void IndentLine(FILE* f, int indent) {
     while(indent--) {
         fputs("    ", f);
     }
 };
 
+static void EmitString(FILE* file, std::string_view str) {
+    fputc('"', file);
+    for (char c : str) {
+        switch (c) {
+        case '"':
+            fputs("\\\"", file);
+            break;
+        case '\\':
+            fputs("\\\\", file);
+            break;
+        case '\n':
+            fputs("\\n", file);
+            break;
+        case '\r':
+            fputs("\\r", file);
+            break;
+        case '\t':
+            fputs("\\t", file);
+            break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                fprintf(file, "\\u%04x", c);
+            } else {
+                fputc(c, file);
+            }
+        }
+    }
+    fputc('"', file);
+}
+
 static int EmitValue(FILE* file, JSONValue* val, int indent);
 static int EmitArray(FILE* file, JSONValue* array, int indent) {
     fputs("[\n", file);
 
-    auto& v = *array->data.array;
+    JSONArray v = array->AsArray();
     for(unsigned i = 0; i < v.size(); i++) {
         IndentLine(file, indent + 1);
-        EmitValue(file, &v.at(i), indent + 1);
+        EmitValue(file, &v[i], indent + 1);
 
         if(i != v.size() - 1) {
             // Place a comma if not last value in array
@@ -331,13 +663,20 @@ static int EmitArray(FILE* file, JSONValue* array, int indent) {
 static int EmitObject(FILE* file, JSONValue* object, int indent) {
     fputs("{\n", file);
 
-    for(std::pair<const JSONKey, JSONValue>& v : *object->data.object) {
+    JSONObject members = object->AsObject();
+    for(JSONMember& v : members) {
         IndentLine(file, indent + 1);
-        fmt::print(file, "\"{}\" : ", v.first);
-        EmitValue(file, object, indent + 1);
-        fputs(",\n", file);
+        EmitString(file, v.key);
+        fputs(" : ", file);
+        EmitValue(file, &v.value, indent + 1);
+
+        if(&v != members.end() - 1) {
+            fputc(',', file);
+        }
+        fputc('\n', file);
     }
 
+    IndentLine(file, indent);
     fputc('}', file);
     return 0;
 };
@@ -360,7 +699,7 @@ static int EmitValue(FILE* file, JSONValue* val, int indent) {
             fputs("false", file);
         }
     } else if(val->IsString()) {
-        fmt::print(file, "{}", val->AsString());
+        EmitString(file, val->AsStringView());
     } else if(val->IsArray()) {
         EmitArray(file, val, indent);
     } else if(val->IsObject()) {
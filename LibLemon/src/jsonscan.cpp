@@ -0,0 +1,188 @@
+#include "JSONScan.h"
+
+#include "Graphics/FastMem.h"
+
+#include <immintrin.h>
+#include <string.h>
+
+namespace {
+
+// Characters of a 64 byte block, one bit each
+struct BlockMasks {
+    uint64_t quote;
+    uint64_t backslash;
+    uint64_t op; // {, }, [, ], : and ,
+    uint64_t whitespace;
+};
+
+// Carried over from one block to the next
+struct ScanState {
+    uint64_t escaped = 0;  // The first character of the block is escaped
+    uint64_t inString = 0; // All ones if the block starts inside a string
+    uint64_t scalar = 0;   // The last character of the previous block was part of a number or literal
+};
+
+inline BlockMasks ClassifySSE2(const char* block) {
+    BlockMasks masks = {};
+    for (int i = 0; i < 4; i++) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + i * 16));
+
+        // [ and ] are { and } without bit 5 set
+        __m128i brackets = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        __m128i op = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(brackets, _mm_set1_epi8('{')), _mm_cmpeq_epi8(brackets, _mm_set1_epi8('}'))),
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')), _mm_cmpeq_epi8(v, _mm_set1_epi8(','))));
+        __m128i whitespace = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+
+        int shift = i * 16;
+        masks.quote |= static_cast<uint64_t>(static_cast<uint16_t>(
+                           _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')))))
+                       << shift;
+        masks.backslash |= static_cast<uint64_t>(static_cast<uint16_t>(
+                               _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\\')))))
+                           << shift;
+        masks.op |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(op))) << shift;
+        masks.whitespace |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(whitespace))) << shift;
+    }
+
+    return masks;
+}
+
+__attribute__((target("avx2"))) inline BlockMasks ClassifyAVX2(const char* block) {
+    BlockMasks masks = {};
+    for (int i = 0; i < 2; i++) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + i * 32));
+
+        __m256i brackets = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+        __m256i op = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(brackets, _mm256_set1_epi8('{')),
+                                                     _mm256_cmpeq_epi8(brackets, _mm256_set1_epi8('}'))),
+                                     _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(':')),
+                                                     _mm256_cmpeq_epi8(v, _mm256_set1_epi8(','))));
+        __m256i whitespace = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                                                             _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+                                             _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                                                             _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))));
+
+        int shift = i * 32;
+        masks.quote |= static_cast<uint64_t>(static_cast<uint32_t>(
+                           _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')))))
+                       << shift;
+        masks.backslash |= static_cast<uint64_t>(static_cast<uint32_t>(
+                               _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')))))
+                           << shift;
+        masks.op |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(op))) << shift;
+        masks.whitespace |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(whitespace)))
+                            << shift;
+    }
+
+    return masks;
+}
+
+// Characters preceded by a backslash which is not itself escaped
+inline uint64_t FindEscaped(uint64_t backslash, ScanState& state) {
+    uint64_t escaped = state.escaped;
+    state.escaped = 0;
+
+    // Backslashes are rare enough outside of a few strings that walking them is cheapest
+    backslash &= ~escaped;
+    while (backslash) {
+        int i = __builtin_ctzll(backslash);
+        backslash &= backslash - 1;
+
+        if (escaped & (1ULL << i)) {
+            continue; // An escaped backslash escapes nothing
+        } else if (i == 63) {
+            state.escaped = 1;
+        } else {
+            escaped |= 1ULL << (i + 1);
+        }
+    }
+
+    return escaped;
+}
+
+// Each bit becomes the XOR of itself and every bit below it
+inline uint64_t PrefixXOR(uint64_t x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+// Write the offsets of the structural characters of the block to out, returns how many were written
+inline size_t IndexBlock(const BlockMasks& masks, ScanState& state, uint32_t base, uint32_t* out) {
+    uint64_t quotes = masks.quote & ~FindEscaped(masks.backslash, state);
+
+    // Set from each opening quote up to but not including the closing quote
+    uint64_t inString = PrefixXOR(quotes) ^ state.inString;
+    state.inString = static_cast<uint64_t>(static_cast<int64_t>(inString) >> 63);
+
+    // Numbers and literals are runs of anything else, only their first character is needed
+    uint64_t scalar = ~(masks.op | masks.whitespace | quotes | inString);
+    uint64_t scalarStarts = scalar & ~((scalar << 1) | state.scalar);
+    state.scalar = scalar >> 63;
+
+    uint64_t structurals = quotes | (masks.op & ~inString) | scalarStarts;
+
+    size_t count = 0;
+    while (structurals) {
+        out[count++] = base + __builtin_ctzll(structurals);
+        structurals &= structurals - 1;
+    }
+
+    return count;
+}
+
+template <BlockMasks (*Classify)(const char*)>
+__attribute__((always_inline)) inline int IndexDocument(const char* data, size_t length,
+                                                        std::vector<uint32_t>& index) {
+    ScanState state;
+    size_t count = 0;
+
+    // Each block adds at most 64 entries
+    index.resize(length / 8 + 64);
+
+    size_t offset = 0;
+    for (; offset < length; offset += 64) {
+        if (index.size() - count < 64) {
+            index.resize(index.size() * 2);
+        }
+
+        if (length - offset >= 64) {
+            count += IndexBlock(Classify(data + offset), state, offset, index.data() + count);
+        } else {
+            // Whitespace does not change anything
+            char last[64];
+            memset(last, ' ', 64);
+            memcpy(last, data + offset, length - offset);
+
+            count += IndexBlock(Classify(last), state, offset, index.data() + count);
+        }
+    }
+
+    index.resize(count);
+    return state.inString ? 1 : 0;
+}
+
+} // namespace
+
+int json_index_sse2(const char* data, size_t length, std::vector<uint32_t>& index) {
+    return IndexDocument<ClassifySSE2>(data, length, index);
+}
+
+__attribute__((target("avx2"))) int json_index_avx2(const char* data, size_t length, std::vector<uint32_t>& index) {
+    return IndexDocument<ClassifyAVX2>(data, length, index);
+}
+
+int json_index_optimized(const char* data, size_t length, std::vector<uint32_t>& index) {
+    if (GetCPUFeatures().avx2) {
+        return json_index_avx2(data, length, index);
+    }
+
+    return json_index_sse2(data, length, index);
+}
@@ -1,91 +1,420 @@
 #include <Lemon/Core/Rotate.h>
 #include <Lemon/Core/SHA.h>
 
+#include "Graphics/FastMem.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <immintrin.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#define SHA256_READ_SIZE 65536 // Files that cannot be mapped are read in pieces this size
+#define SHA256_LANES 8         // Buffers hashed at once by HashMany
+
+namespace {
+
+const uint32_t initialHash[8]{
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+alignas(16) const uint32_t constants[64]{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+void TransformScalar(uint32_t state[8], const uint8_t* data, size_t blocks) {
+    for (; blocks; blocks--, data += SHA256_CHUNK_SIZE) {
+        uint32_t w[64];
 
-#include <sstream>
+        for (int i = 0; i < 16; i++) {
+            uint32_t word;
+            memcpy(&word, data + i * sizeof(uint32_t), sizeof(uint32_t));
+            w[i] = __builtin_bswap32(word); // data is big endian so convert to little endian
+        }                                   // Copy chunk (512 bits/64 bytes) into first 16 bytes of w
 
-SHA256::SHA256() { memcpy(hash, initialHash, SHA256_HASH_SIZE); }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 =
+                rotateRight<uint32_t>(w[i - 15], 7) ^ rotateRight<uint32_t>(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 =
+                rotateRight<uint32_t>(w[i - 2], 17) ^ rotateRight<uint32_t>(w[i - 2], 19) ^ (w[i - 2] >> 10);
 
-void SHA256::Transform(const uint8_t* data) {
-    uint32_t w[64];
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t t[8];
+        for (int i = 0; i < 8; i++) {
+            t[i] = state[i];
+        }
+
+        for (int i = 0; i < 64; i++) {
+            uint32_t s1 =
+                rotateRight<uint32_t>(t[4], 6) ^ rotateRight<uint32_t>(t[4], 11) ^ rotateRight<uint32_t>(t[4], 25);
+            uint32_t s0 =
+                rotateRight<uint32_t>(t[0], 2) ^ rotateRight<uint32_t>(t[0], 13) ^ rotateRight<uint32_t>(t[0], 22);
+            uint32_t temp1 = t[7] + s1 + SHA2_CHOOSE(t[4], t[5], t[6]) + constants[i] + w[i];
+            uint32_t temp2 = s0 + SHA2_MAJOR(t[0], t[1], t[2]);
 
-    for (int i = 0; i < 16; i++) {
-        w[i] = __builtin_bswap32(
-            reinterpret_cast<const uint32_t*>(data)[i]); // data is big endian so convert to little endian
-    }                                                    // Copy chunk (512 bits/64 bytes) into first 16 bytes of w
+            t[7] = t[6];
+            t[6] = t[5];
+            t[5] = t[4];
+            t[4] = t[3] + temp1;
+            t[3] = t[2];
+            t[2] = t[1];
+            t[1] = t[0];
+            t[0] = temp1 + temp2;
+        }
+
+        for (int i = 0; i < 8; i++) {
+            state[i] += t[i];
+        }
+    }
+}
+
+// The SHA extensions do two rounds at a time, with the state split as ABEF and CDGH
+__attribute__((target("sha,sse4.1"))) void TransformSHANI(uint32_t state[8], const uint8_t* data, size_t blocks) {
+    const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    __m128i cdab = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[0])), 0xb1);
+    __m128i hgfe = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[4])), 0x1b);
+    __m128i abef = _mm_alignr_epi8(cdab, hgfe, 8);
+    __m128i cdgh = _mm_blend_epi16(hgfe, cdab, 0xf0);
+
+    for (; blocks; blocks--, data += SHA256_CHUNK_SIZE) {
+        __m128i abefSaved = abef;
+        __m128i cdghSaved = cdgh;
+
+        __m128i m[4]; // Message schedule, four words at a time
+        for (int i = 0; i < 4; i++) {
+            m[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data) + i), byteSwap);
+        }
+
+#pragma GCC unroll 16
+        for (int i = 0; i < 16; i++) {
+            __m128i words = _mm_add_epi32(m[i & 3], _mm_load_si128(reinterpret_cast<const __m128i*>(constants) + i));
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, words);
+
+            // The four words needed four rounds from now replace the ones we just used
+            if (i < 12) {
+                __m128i next = _mm_add_epi32(_mm_sha256msg1_epu32(m[i & 3], m[(i + 1) & 3]),
+                                             _mm_alignr_epi8(m[(i + 3) & 3], m[(i + 2) & 3], 4));
+                m[i & 3] = _mm_sha256msg2_epu32(next, m[(i + 3) & 3]);
+            }
+
+            abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(words, 0x0e));
+        }
+
+        abef = _mm_add_epi32(abef, abefSaved);
+        cdgh = _mm_add_epi32(cdgh, cdghSaved);
+    }
+
+    __m128i feba = _mm_shuffle_epi32(abef, 0x1b);
+    __m128i dchg = _mm_shuffle_epi32(cdgh, 0xb1);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[0]), _mm_blend_epi16(feba, dchg, 0xf0));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[4]), _mm_alignr_epi8(dchg, feba, 8));
+}
+
+__attribute__((target("avx2"))) inline __m256i RotateRightAVX2(__m256i x, int n) {
+    return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+}
+
+// Load words first to first + 7 from the block of each lane, so each vector holds one word from every lane
+__attribute__((target("avx2"))) inline void LoadWordsAVX2(const uint8_t* const blocks[SHA256_LANES], int first,
+                                                          __m256i words[8]) {
+    const __m256i byteSwap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12, 3, 2, 1, 0, 7, 6,
+                                              5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+
+    __m256i r[8];
+    for (int i = 0; i < 8; i++) {
+        r[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(blocks[i] + first * sizeof(uint32_t)));
+    }
+
+    // Transpose the 8x8 words
+    __m256i t[8];
+    for (int i = 0; i < 8; i += 2) {
+        t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+        t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+    }
+
+    __m256i u[8];
+    for (int i = 0; i < 8; i += 4) {
+        u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+        u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+        u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+        u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+    }
+
+    for (int i = 0; i < 4; i++) {
+        words[i] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u[i], u[i + 4], 0x20), byteSwap);
+        words[i + 4] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u[i], u[i + 4], 0x31), byteSwap);
+    }
+}
+
+/////////////////////////////
+/// \brief Hash a block from each of 8 buffers at once
+///
+/// state holds each word of the state for every lane. Lanes not set in active are left as they are.
+/////////////////////////////
+__attribute__((target("avx2"))) void TransformAVX2(__m256i state[8], const uint8_t* const blocks[SHA256_LANES],
+                                                   __m256i active) {
+    __m256i w[64];
+    LoadWordsAVX2(blocks, 0, w);
+    LoadWordsAVX2(blocks, 8, w + 8);
 
     for (int i = 16; i < 64; i++) {
-        uint32_t s0 = rotateRight<uint32_t>(w[i - 15], 7) ^ rotateRight<uint32_t>(w[i - 15], 18) ^ (w[i - 15] >> 3);
-        uint32_t s1 = rotateRight<uint32_t>(w[i - 2], 17) ^ rotateRight<uint32_t>(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(RotateRightAVX2(w[i - 15], 7), RotateRightAVX2(w[i - 15], 18)),
+                                      _mm256_srli_epi32(w[i - 15], 3));
+        __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(RotateRightAVX2(w[i - 2], 17), RotateRightAVX2(w[i - 2], 19)),
+                                      _mm256_srli_epi32(w[i - 2], 10));
 
-        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        w[i] = _mm256_add_epi32(_mm256_add_epi32(w[i - 16], s0), _mm256_add_epi32(w[i - 7], s1));
     }
 
-    uint32_t t[8];
+    __m256i t[8];
     for (int i = 0; i < 8; i++) {
-        t[i] = hash[i];
+        t[i] = state[i];
     }
 
     for (int i = 0; i < 64; i++) {
-        uint32_t s1 =
-            rotateRight<uint32_t>(t[4], 6) ^ rotateRight<uint32_t>(t[4], 11) ^ rotateRight<uint32_t>(t[4], 25);
-        uint32_t s0 =
-            rotateRight<uint32_t>(t[0], 2) ^ rotateRight<uint32_t>(t[0], 13) ^ rotateRight<uint32_t>(t[0], 22);
-        uint32_t temp1 = t[7] + s1 + SHA2_CHOOSE(t[4], t[5], t[6]) + constants[i] + w[i];
-        uint32_t temp2 = s0 + SHA2_MAJOR(t[0], t[1], t[2]);
+        __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(RotateRightAVX2(t[4], 6), RotateRightAVX2(t[4], 11)),
+                                      RotateRightAVX2(t[4], 25));
+        __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(RotateRightAVX2(t[0], 2), RotateRightAVX2(t[0], 13)),
+                                      RotateRightAVX2(t[0], 22));
+        __m256i choose = _mm256_xor_si256(_mm256_and_si256(t[4], t[5]), _mm256_andnot_si256(t[4], t[6]));
+        __m256i major = _mm256_or_si256(_mm256_and_si256(t[0], t[1]),
+                                        _mm256_and_si256(t[2], _mm256_or_si256(t[0], t[1])));
+
+        __m256i temp1 = _mm256_add_epi32(_mm256_add_epi32(t[7], s1), _mm256_add_epi32(choose, w[i]));
+        temp1 = _mm256_add_epi32(temp1, _mm256_set1_epi32(constants[i]));
+        __m256i temp2 = _mm256_add_epi32(s0, major);
 
         t[7] = t[6];
         t[6] = t[5];
         t[5] = t[4];
-        t[4] = t[3] + temp1;
+        t[4] = _mm256_add_epi32(t[3], temp1);
         t[3] = t[2];
         t[2] = t[1];
         t[1] = t[0];
-        t[0] = temp1 + temp2;
+        t[0] = _mm256_add_epi32(temp1, temp2);
     }
 
-    for (unsigned i = 0; i < SHA256_HASH_SIZE / sizeof(uint32_t); i++) {
-        hash[i] += t[i];
+    for (int i = 0; i < 8; i++) {
+        state[i] = _mm256_blendv_epi8(state[i], _mm256_add_epi32(state[i], t[i]), active);
     }
 }
 
+// Hash the whole chunks of up to 8 buffers, the state of each lane is written to states
+__attribute__((target("avx2"))) void HashChunksAVX2(const uint8_t* const data[SHA256_LANES],
+                                                    const size_t blocks[SHA256_LANES], uint32_t states[][8],
+                                                    int lanes) {
+    alignas(32) static const uint8_t emptyBlock[SHA256_CHUNK_SIZE] = {};
+
+    __m256i state[8];
+    for (int i = 0; i < 8; i++) {
+        state[i] = _mm256_set1_epi32(initialHash[i]);
+    }
+
+    size_t maxBlocks = *std::max_element(blocks, blocks + lanes);
+    for (size_t b = 0; b < maxBlocks; b++) {
+        const uint8_t* laneBlocks[SHA256_LANES];
+        alignas(32) uint32_t active[SHA256_LANES];
+        for (int l = 0; l < SHA256_LANES; l++) {
+            bool hasBlock = l < lanes && b < blocks[l];
+
+            laneBlocks[l] = hasBlock ? data[l] + b * SHA256_CHUNK_SIZE : emptyBlock;
+            active[l] = hasBlock ? 0xffffffff : 0;
+        }
+
+        TransformAVX2(state, laneBlocks, _mm256_load_si256(reinterpret_cast<const __m256i*>(active)));
+    }
+
+    alignas(32) uint32_t words[SHA256_LANES];
+    for (int i = 0; i < 8; i++) {
+        _mm256_store_si256(reinterpret_cast<__m256i*>(words), state[i]);
+        for (int l = 0; l < lanes; l++) {
+            states[l][i] = words[l];
+        }
+    }
+}
+
+} // namespace
+
+SHA256::SHA256() { Reset(); }
+
+void SHA256::Transform(uint32_t state[8], const uint8_t* data, size_t blocks) {
+    static const auto transform = GetCPUFeatures().sha ? TransformSHANI : TransformScalar;
+    transform(state, data, blocks);
+}
+
+void SHA256::Reset() {
+    memcpy(hash, initialHash, SHA256_HASH_SIZE);
+    length = 0;
+}
+
 void SHA256::Update(const void* _data, size_t count) {
     const uint8_t* data = static_cast<const uint8_t*>(_data);
-    memcpy(hash, initialHash, SHA256_HASH_SIZE);
 
-    unsigned index = count;
-    while (index >= SHA256_CHUNK_SIZE) {
-        Transform(data);
+    size_t buffered = length % SHA256_CHUNK_SIZE;
+    length += count;
+
+    // Fill up what is left over from last time first
+    if (buffered) {
+        size_t amount = std::min(count, SHA256_CHUNK_SIZE - buffered);
+        memcpy(buffer + buffered, data, amount);
+
+        data += amount;
+        count -= amount;
+        if (buffered + amount < SHA256_CHUNK_SIZE) {
+            return;
+        }
+
+        Transform(hash, buffer, 1);
+    }
+
+    size_t blocks = count / SHA256_CHUNK_SIZE;
+    if (blocks) {
+        Transform(hash, data, blocks);
+
+        data += blocks * SHA256_CHUNK_SIZE;
+        count -= blocks * SHA256_CHUNK_SIZE;
+    }
+
+    memcpy(buffer, data, count);
+}
+
+void SHA256::GetDigest(uint8_t digest[SHA256_HASH_SIZE]) const {
+    uint32_t state[8];
+    memcpy(state, hash, SHA256_HASH_SIZE);
+
+    // Padded with a 1 bit then zeros up to the length in bits at the end of the last chunk
+    uint8_t padding[SHA256_CHUNK_SIZE * 2] = {};
+    size_t buffered = length % SHA256_CHUNK_SIZE;
+    memcpy(padding, buffer, buffered);
+    padding[buffered] = 0x80; // Append a 1 on the end
 
-        index -= SHA256_CHUNK_SIZE;
-        data += SHA256_CHUNK_SIZE;
+    size_t blocks = (buffered + 1 + sizeof(uint64_t) > SHA256_CHUNK_SIZE) ? 2 : 1;
+    uint64_t bigeCount = __builtin_bswap64(length * 8);
+    memcpy(&padding[blocks * SHA256_CHUNK_SIZE - sizeof(uint64_t)], &bigeCount, sizeof(uint64_t));
+    Transform(state, padding, blocks);
+
+    for (int i = 0; i < 8; i++) {
+        uint32_t word = __builtin_bswap32(state[i]);
+        memcpy(digest + i * sizeof(uint32_t), &word, sizeof(uint32_t));
     }
+}
+
+std::string SHA256::GetHash() const {
+    static const char hexDigits[] = "0123456789abcdef";
 
-    uint8_t buffer[SHA256_CHUNK_SIZE];
-    memcpy(buffer, data, index);
+    uint8_t digest[SHA256_HASH_SIZE];
+    GetDigest(digest);
+
+    std::string hex(SHA256_HASH_SIZE * 2, '0');
+    for (int i = 0; i < SHA256_HASH_SIZE; i++) {
+        hex[i * 2] = hexDigits[digest[i] >> 4];
+        hex[i * 2 + 1] = hexDigits[digest[i] & 0xf];
+    }
+    return hex;
+}
+
+int SHA256::HashFile(const char* path, uint8_t digest[SHA256_HASH_SIZE]) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st)) {
+        int e = errno;
+        close(fd);
+        errno = e;
+        return -1;
+    }
+
+    SHA256 sha;
+    void* data = MAP_FAILED;
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
 
-    buffer[index++] = 0x80; // Append a 1 on the end
+    if (data != MAP_FAILED) {
+        sha.Update(data, st.st_size);
+        munmap(data, st.st_size);
+    } else {
+        // Not something we can map (e.g. a device or pipe), read it instead
+        std::vector<uint8_t> chunk(SHA256_READ_SIZE);
 
-    while (SHA256_CHUNK_SIZE - index != sizeof(uint64_t)) {
-        buffer[index++] = 0;
+        ssize_t r;
+        while ((r = read(fd, chunk.data(), chunk.size())) > 0) {
+            sha.Update(chunk.data(), r);
+        }
 
-        if (index >= SHA256_CHUNK_SIZE) {
-            index = 0;
-            Transform(buffer);
+        if (r < 0) {
+            int e = errno;
+            close(fd);
+            errno = e;
+            return -1;
         }
     }
 
-    uint64_t bigeCount = __builtin_bswap64(count * 8);
-    memcpy(&buffer[index], &bigeCount, sizeof(uint64_t));
-    Transform(buffer);
+    close(fd);
+    sha.GetDigest(digest);
+    return 0;
 }
 
-std::string SHA256::GetHash() {
-    std::stringstream stream;
-    for (int i = 0; i < 8; i++) {
-        stream << std::hex << hash[i];
+void SHA256::HashMany(const void* const* data, const size_t* lengths, uint8_t (*digests)[SHA256_HASH_SIZE],
+                      size_t count) {
+    // A single stream with the SHA extensions is quicker than the lanes
+    if (GetCPUFeatures().sha || !GetCPUFeatures().avx2) {
+        for (size_t i = 0; i < count; i++) {
+            SHA256 sha;
+            sha.Update(data[i], lengths[i]);
+            sha.GetDigest(digests[i]);
+        }
+        return;
+    }
+
+    // Longest first so buffers of similar length end up in the same group
+    std::vector<size_t> order(count);
+    for (size_t i = 0; i < count; i++) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [lengths](size_t l, size_t r) { return lengths[l] > lengths[r]; });
+
+    for (size_t group = 0; group < count; group += SHA256_LANES) {
+        int lanes = std::min<size_t>(SHA256_LANES, count - group);
+
+        const uint8_t* laneData[SHA256_LANES];
+        size_t laneBlocks[SHA256_LANES];
+        for (int l = 0; l < lanes; l++) {
+            laneData[l] = static_cast<const uint8_t*>(data[order[group + l]]);
+            laneBlocks[l] = lengths[order[group + l]] / SHA256_CHUNK_SIZE;
+        }
+
+        uint32_t states[SHA256_LANES][8];
+        HashChunksAVX2(laneData, laneBlocks, states, lanes);
+
+        // Whatever is left over is less than a chunk, finish each on its own
+        for (int l = 0; l < lanes; l++) {
+            size_t index = order[group + l];
+            size_t hashed = laneBlocks[l] * SHA256_CHUNK_SIZE;
+
+            SHA256 sha;
+            memcpy(sha.hash, states[l], SHA256_HASH_SIZE);
+            sha.length = hashed;
+            sha.Update(laneData[l] + hashed, lengths[index] - hashed);
+            sha.GetDigest(digests[index]);
+        }
     }
-    return stream.str();
 }
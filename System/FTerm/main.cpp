@@ -1,5 +1,8 @@
+#include <algorithm>
 #include <cassert>
 #include <cstdlib>
+#include <cstring>
+#include <mutex>
 #include <thread>
 #include <vector>
 
@@ -21,6 +24,7 @@
 #include "fterm.h"
 
 #define SCROLLBACK_BUFFER_MAX 400
+#define PTY_READ_SIZE 16384
 
 using namespace Lemon;
 
@@ -54,54 +58,197 @@ struct TerminalChar {
 
 using TerminalLine = std::vector<TerminalChar>;
 
-std::vector<TerminalLine> scrollbackBuffer;
+// Lines are kept in a ring, once full the oldest line is reused rather than every line being moved up
+class Scrollback {
+public:
+    inline size_t Size() const { return m_lines.size(); }
+
+    // Line i from the oldest
+    inline TerminalLine& operator[](size_t i) { return m_lines[(m_head + i) % m_lines.size()]; }
+
+    // Add a blank line after the newest
+    void PushBack(int width) {
+        if (m_lines.size() < SCROLLBACK_BUFFER_MAX) {
+            m_lines.push_back(TerminalLine(width, TerminalChar(0)));
+            return;
+        }
+
+        TerminalLine& ln = m_lines[m_head];
+        m_head = (m_head + 1) % m_lines.size();
+
+        ln.assign(width, TerminalChar(0));
+    }
+
+    // Replace everything with blank lines
+    void Reset(int lines, int width) {
+        m_lines.assign(lines, TerminalLine(width, TerminalChar(0)));
+        m_head = 0;
+    }
+
+private:
+    std::vector<TerminalLine> m_lines;
+    size_t m_head = 0; // Index of the oldest line
+};
+
+Scrollback scrollbackBuffer;
+
+// Cells changed since they were last drawn, one for each cell on screen
+std::vector<uint8_t> dirtyCells;
+int pendingScroll = 0; // Lines the screen has scrolled since it was last drawn
+
+Vector2i drawnCursorPosition = {1, 1};
+
+// Coverage of each pixel of every printable ASCII glyph, one cell after another
+std::vector<uint8_t> glyphAtlas;
+
+void MarkAllDirty() {
+    dirtyCells.assign(terminalSize.x * terminalSize.y, 1);
+    pendingScroll = 0;
+}
+
+void MarkDirty(int cursorX, int cursorY) {
+    if (cursorX >= 1 && cursorX <= terminalSize.x && cursorY >= 1 && cursorY <= terminalSize.y) {
+        dirtyCells[(cursorY - 1) * terminalSize.x + (cursorX - 1)] = 1;
+    }
+}
+
+void MarkLinesDirty(int firstY, int lastY) {
+    firstY = std::max(firstY, 1);
+    lastY = std::min(lastY, terminalSize.y);
+    if (firstY <= lastY) {
+        std::fill(dirtyCells.begin() + (firstY - 1) * terminalSize.x, dirtyCells.begin() + lastY * terminalSize.x, 1);
+    }
+}
 
 TerminalLine& GetLine(int cursorY) {
-    assert(scrollbackBuffer.size() >= static_cast<unsigned>(terminalSize.y));
+    assert(scrollbackBuffer.Size() >= static_cast<unsigned>(terminalSize.y));
 
     // Cursor starts at (1, 1)
-    TerminalLine& ln = scrollbackBuffer[scrollbackBuffer.size() - terminalSize.y + (cursorY - 1)];
+    TerminalLine& ln = scrollbackBuffer[scrollbackBuffer.Size() - terminalSize.y + (cursorY - 1)];
 
     // Ensure the line is the right size
     if (ln.size() != static_cast<unsigned>(terminalSize.x))
-        ln.resize(terminalSize.x);
+        ln.resize(terminalSize.x, TerminalChar(0));
     return ln;
 }
 
-inline auto FirstLine() { return scrollbackBuffer.begin() + (scrollbackBuffer.size() - terminalSize.y); }
+// The font is fixed, so each glyph is drawn once in white on black and the result used as its coverage
+void BuildGlyphAtlas() {
+    Surface cell = {.width = characterSize.x,
+                    .height = characterSize.y,
+                    .depth = 32,
+                    .buffer = new uint8_t[characterSize.x * characterSize.y * 4]};
+
+    int cellArea = characterSize.x * characterSize.y;
+    glyphAtlas.resize(('~' - ' ' + 1) * cellArea);
+    for (int ch = ' '; ch <= '~'; ch++) {
+        Lemon::Graphics::DrawRect(0, 0, cell.width, cell.height, {0, 0, 0, 0xff}, &cell);
+        Lemon::Graphics::DrawChar(ch, 0, 0, {0xff, 0xff, 0xff, 0xff}, &cell, terminalFont);
+
+        const uint32_t* pixels = reinterpret_cast<const uint32_t*>(cell.buffer);
+        uint8_t* coverage = &glyphAtlas[(ch - ' ') * cellArea];
+        for (int i = 0; i < cellArea; i++) {
+            coverage[i] = pixels[i] & 0xff;
+        }
+    }
+
+    delete[] cell.buffer;
+}
+
+static inline uint32_t MixColour(uint32_t background, uint32_t foreground, uint32_t coverage) {
+    uint32_t r = (((background >> 16) & 0xff) * (255 - coverage) + ((foreground >> 16) & 0xff) * coverage) / 255;
+    uint32_t g = (((background >> 8) & 0xff) * (255 - coverage) + ((foreground >> 8) & 0xff) * coverage) / 255;
+    uint32_t b = ((background & 0xff) * (255 - coverage) + (foreground & 0xff) * coverage) / 255;
+    return 0xff000000 | (r << 16) | (g << 8) | b;
+}
+
+// Every pixel of the cell is written once, rather than filling the background then blending the glyph over it
+void DrawCell(const TerminalChar& c, int x, int y) {
+    uint32_t background = RGBAColour::ToARGB(c.background);
+    uint32_t foreground = RGBAColour::ToARGB(c.foreground);
+
+    int cellArea = characterSize.x * characterSize.y;
+    const uint8_t* coverage = (c.ch > ' ' && c.ch <= '~') ? &glyphAtlas[(c.ch - ' ') * cellArea] : nullptr;
+
+    uint32_t* row = reinterpret_cast<uint32_t*>(renderSurface.buffer) + y * renderSurface.width + x;
+    for (int i = 0; i < characterSize.y; i++, row += renderSurface.width) {
+        if (!coverage) {
+            std::fill(row, row + characterSize.x, background);
+            continue;
+        }
+
+        for (int j = 0; j < characterSize.x; j++) {
+            uint32_t a = *(coverage++);
+            row[j] = (a == 0) ? background : ((a == 0xff) ? foreground : MixColour(background, foreground, a));
+        }
+    }
+}
 
 void Paint() {
-    assert(scrollbackBuffer.size() >= static_cast<unsigned>(terminalSize.y));
-
-    Vector2i screenPos = {0, 0};
-    for (unsigned i = scrollbackBuffer.size() - terminalSize.y; i < scrollbackBuffer.size(); i++) {
-        screenPos.x = 0;
-        for (auto& c : scrollbackBuffer[i]) {
-            Lemon::Graphics::DrawRect(Rect{screenPos, characterSize}, c.background, &renderSurface);
-            Lemon::Graphics::DrawChar(c.ch, screenPos.x, screenPos.y, c.foreground, &renderSurface, terminalFont);
-            screenPos.x += characterSize.x;
+    assert(scrollbackBuffer.Size() >= static_cast<unsigned>(terminalSize.y));
+
+    int pitch = renderSurface.width * 4;
+    int top = renderSurface.height; // Pixel rows changed in the render surface
+    int bottom = 0;
+
+    // Text still on screen after scrolling is moved up in one go,
+    // scrolling a whole screen or more has already marked every cell
+    if (pendingScroll > 0 && pendingScroll < terminalSize.y) {
+        int scrollPixels = pendingScroll * characterSize.y;
+        int textHeight = terminalSize.y * characterSize.y;
+        memmove(renderSurface.buffer, renderSurface.buffer + scrollPixels * pitch,
+                static_cast<size_t>(textHeight - scrollPixels) * pitch);
+
+        top = 0;
+        bottom = textHeight;
+    }
+
+    // The old cursor moved up with the text
+    MarkDirty(drawnCursorPosition.x, drawnCursorPosition.y - pendingScroll);
+    MarkDirty(cursorPosition.x, cursorPosition.y);
+    pendingScroll = 0;
+
+    for (int y = 1; y <= terminalSize.y; y++) {
+        uint8_t* dirty = &dirtyCells[(y - 1) * terminalSize.x];
+        if (std::find(dirty, dirty + terminalSize.x, 1) == dirty + terminalSize.x) {
+            continue;
+        }
+
+        TerminalLine& ln = GetLine(y);
+        for (int x = 0; x < terminalSize.x; x++) {
+            if (dirty[x]) {
+                DrawCell(ln[x], x * characterSize.x, (y - 1) * characterSize.y);
+                dirty[x] = 0;
+            }
         }
-        screenPos.y += characterSize.y;
+
+        top = std::min(top, (y - 1) * characterSize.y);
+        bottom = std::max(bottom, y * characterSize.y);
     }
 
     Lemon::Graphics::DrawRect(
         Rect{{(cursorPosition.x - 1) * characterSize.x, (cursorPosition.y - 1) * characterSize.y}, characterSize},
         currentForegroundColour, &renderSurface);
-	
-	framebufferSurface.Blit(&renderSurface);
+    drawnCursorPosition = cursorPosition;
+
+    // Reading the framebuffer is slow, so only changed rows are copied to it from the render surface
+    if (top < bottom) {
+        framebufferSurface.Blit(&renderSurface, {0, top}, {0, top, renderSurface.width, bottom - top});
+    }
 }
 
 void ClearScrollbackBuffer() {
-    scrollbackBuffer = std::vector<TerminalLine>(terminalSize.y, TerminalLine(terminalSize.x, TerminalChar(0)));
+    scrollbackBuffer.Reset(terminalSize.y, terminalSize.x);
+    MarkAllDirty();
 }
 
 void AddLine() {
-    if (scrollbackBuffer.size() < SCROLLBACK_BUFFER_MAX) {
-        scrollbackBuffer.push_back(TerminalLine(terminalSize.x, TerminalChar(0)));
-    } else {
-        scrollbackBuffer.erase(scrollbackBuffer.begin());
-        scrollbackBuffer.push_back(TerminalLine(terminalSize.x, TerminalChar(0)));
-    }
+    scrollbackBuffer.PushBack(terminalSize.x);
+
+    // Cells move up with their lines
+    std::copy(dirtyCells.begin() + terminalSize.x, dirtyCells.end(), dirtyCells.begin());
+    std::fill(dirtyCells.end() - terminalSize.x, dirtyCells.end(), 1);
+    pendingScroll++;
 }
 
 void AdvanceCursorY() {
@@ -130,6 +277,7 @@ void PutChar(char ch) {
 
     TerminalLine& line = GetLine(cursorPosition.y);
     line.at(cursorPosition.x - 1) = TerminalChar(ch);
+    MarkDirty(cursorPosition.x, cursorPosition.y);
 }
 
 // Print a char on screen and advance the cursor
@@ -270,9 +418,10 @@ void ParseChar(char ch) {
                     ln.insert(ln.end(), terminalSize.x - (cursorPosition.x - 1), TerminalChar(0));
 
                     assert(ln.size() == static_cast<unsigned>(terminalSize.x));
-                    scrollbackBuffer.erase(FirstLine() + (cursorPosition.y - 1) + 1, scrollbackBuffer.end());
-                    scrollbackBuffer.insert(scrollbackBuffer.end(), terminalSize.y - (cursorPosition.y - 1),
-                                            TerminalLine(terminalSize.x, TerminalChar(0)));
+                    for (int y = cursorPosition.y + 1; y <= terminalSize.y; y++) {
+                        GetLine(y).assign(terminalSize.x, TerminalChar(0));
+                    }
+                    MarkLinesDirty(cursorPosition.y, terminalSize.y);
                     break;
                 case 1: // Clear screen and move cursor
                 case 2: // Same as 1 but delete everything in the scrollback buffer
@@ -304,6 +453,8 @@ void ParseChar(char ch) {
                     ln.insert(ln.end(), terminalSize.x - (cursorPosition.x - 1), TerminalChar(0));
                     break;
                 }
+
+                MarkLinesDirty(cursorPosition.y, cursorPosition.y);
                 break;
             }
             case ANSI_CSI_IL: // Insert blank lines
@@ -322,7 +473,9 @@ void ParseChar(char ch) {
                     amount = atoi(escapeBuffer.c_str());
                 }
 
-                scrollbackBuffer.insert(scrollbackBuffer.end(), amount, TerminalLine(terminalSize.x, TerminalChar(0)));
+                while (amount-- > 0) {
+                    AddLine();
+                }
                 break;
             }
             case ANSI_CSI_SD: { // Scroll Down
@@ -331,7 +484,16 @@ void ParseChar(char ch) {
                     amount = atoi(escapeBuffer.c_str());
                 }
 
-                scrollbackBuffer.insert(FirstLine(), amount, TerminalLine(terminalSize.x, TerminalChar(0)));
+                // Move the lines on screen down, leaving blank lines at the top
+                amount = std::min(amount, terminalSize.y);
+                for (int y = terminalSize.y; y > amount; y--) {
+                    std::swap(GetLine(y), GetLine(y - amount));
+                }
+
+                for (int y = 1; y <= amount; y++) {
+                    GetLine(y).assign(terminalSize.x, TerminalChar(0));
+                }
+                MarkLinesDirty(1, terminalSize.y);
                 break;
             }
             default:
@@ -413,10 +575,10 @@ void* PTYThread() {
     pollfd pollFd = {.fd = ptyMasterFd, .events = POLLIN};
     while (isOpen) {
         if (poll(&pollFd, 1, 500000) > 0) {
-            char buf[512];
+            static char buf[PTY_READ_SIZE]; // Read as much as the PTY has at once
             ssize_t r;
             bufferMutex.lock();
-            while ((r = read(ptyMasterFd, buf, 512)) > 0) {
+            while ((r = read(ptyMasterFd, buf, PTY_READ_SIZE)) > 0) {
                 int i = 0;
                 while (r--) {
                     ParseChar(buf[i++]);
@@ -475,9 +637,14 @@ int main(int argc, char** argv) {
     terminalSize =
         Vector2i{renderSurface.width / characterSize.x, renderSurface.height / characterSize.y};
 
+    BuildGlyphAtlas();
+
+    // Clear the framebuffer outside of the text
+    Lemon::Graphics::DrawRect(0, 0, renderSurface.width, renderSurface.height, defaultBackgroundColour, &renderSurface);
+    framebufferSurface.Blit(&renderSurface);
+
     ClearScrollbackBuffer();
-    assert(FirstLine() == scrollbackBuffer.begin());
-    assert(&GetLine(1) == &scrollbackBuffer.at(0));
+    assert(&GetLine(1) == &scrollbackBuffer[0]);
 
     int ptySlaveFd = -1;
 
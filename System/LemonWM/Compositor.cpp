@@ -2,14 +2,62 @@
 
 #include "WM.h"
 
+#include <Lemon/Core/Framebuffer.h>
 #include <Lemon/Core/Logger.h>
 #include <Lemon/Graphics/Graphics.h>
+#include <Lemon/System/Info.h>
+#include <Lemon/System/Util.h>
+
+#include <algorithm>
+#include <cassert>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
 
 //#define COMPOSITOR_DEBUG
 
 using namespace Lemon;
 
-Compositor::Compositor(const Surface& displaySurface) : m_displaySurface(displaySurface) {
+// Upper bounds of the frame time histogram buckets in microseconds, anything longer goes in the last
+static const long frameTimeBuckets[COMPOSITOR_FRAME_TIME_BUCKETS - 1] = {2000, 4000, 8000, 12000, 16667, 33333, 50000};
+
+static inline long NanosecondsBetween(const timespec& start, const timespec& end) {
+    return (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
+}
+
+// Get the time since since, and set since to now
+static inline long NanosecondsSince(timespec& since) {
+    timespec now;
+    clock_gettime(CLOCK_BOOTTIME, &now);
+
+    long ns = NanosecondsBetween(since, now);
+    since = now;
+    return ns;
+}
+
+static const char* phaseNames[PhaseCount] = {"clipping", "background", "windows", "decorations", "cursor", "present"};
+
+// Get the overlap of two rects, which has no area if they do not overlap
+static inline Rect Overlap(const Rect& a, const Rect& b) {
+    Rect r;
+    r.x = std::max(a.left(), b.left());
+    r.y = std::max(a.top(), b.top());
+    r.width = std::min(a.right(), b.right()) - r.x + 1;
+    r.height = std::min(a.bottom(), b.bottom()) - r.y + 1;
+    return r;
+}
+
+Compositor::Compositor(const Surface* displayPages, int pageCount) : m_pageCount(pageCount) {
+    assert(pageCount > 0 && pageCount <= COMPOSITOR_MAX_PAGES);
+    for (int i = 0; i < pageCount; i++) {
+        m_displayPages[i] = displayPages[i];
+    }
+
+    // Present to the page off screen
+    m_backPage = (pageCount > 1) ? 1 : 0;
+    m_displaySurface = m_displayPages[m_backPage];
+    const Surface& displaySurface = m_displaySurface;
+
     // Create a backbuffer surface for rendering
     m_renderSurface = displaySurface;
     m_wallpaper = displaySurface;
@@ -28,34 +76,62 @@ Compositor::Compositor(const Surface& displaySurface) : m_displaySurface(display
         m_cursorResize = m_cursorNormal;
     }
 
-    clock_gettime(CLOCK_BOOTTIME, &m_lastRender);
+    // Large enough for either cursor
+    int cursorBufferSize = std::max(m_cursorNormal.BufferSize(), m_cursorResize.BufferSize());
+    m_cursorBuffer.buffer = new uint8_t[cursorBufferSize];
+
+    clock_gettime(CLOCK_BOOTTIME, &m_statsStart);
+
+    // The main thread composites tiles too
+    int threadCount = std::clamp<int>(Lemon::SysInfo().cpuCount, 1, COMPOSITOR_MAX_THREADS);
+    for (int i = 1; i < threadCount; i++) {
+        m_workers.push_back(std::thread(&Compositor::TileWorker, this));
+    }
 }
 
-void Compositor::Render() {
-    if (m_displayFramerate) {
-        timespec cTime;
-        clock_gettime(CLOCK_BOOTTIME, &cTime);
+Compositor::~Compositor() {
+    {
+        std::scoped_lock lock(m_tileMutex);
+        m_stopWorkers = true;
+    }
+    m_tilesReady.notify_all();
 
-        unsigned long renderTime =
-            (cTime.tv_nsec - m_lastRender.tv_nsec) + (cTime.tv_sec - m_lastRender.tv_sec) * 1000000000L;
-        m_fCount++;
+    for (std::thread& worker : m_workers) {
+        worker.join();
+    }
+}
 
-        if (renderTime > 1000000000 && m_fCount) {
+bool Compositor::Render() {
+    timespec frameStart;
+    clock_gettime(CLOCK_BOOTTIME, &frameStart);
 
-            if (renderTime)
-                m_fRate = 1000000000 / (renderTime / m_fCount);
-            m_fCount = 0;
-            renderTime = 0;
-            m_lastRender = cTime;
+    if (m_displayFramerate && NanosecondsBetween(m_statsStart, frameStart) >= 1000000000) {
+        m_fRate = 0;
+        for (int i = 0; i < COMPOSITOR_FRAME_TIME_BUCKETS; i++) {
+            m_fRate += m_frameTimes[i];
+            m_shownFrameTimes[i] = m_frameTimes[i];
+            m_frameTimes[i] = 0;
         }
-    }
 
-    Vector2i mousePos = WM::Instance().Input().mouse.pos;
-    if (mousePos != m_lastMousePos) {
-        Invalidate({m_lastMousePos, m_cursorCurrent->width, m_cursorCurrent->height});
-        m_lastMousePos = mousePos;
+        unsigned frames = std::max(m_fRate, 1);
+        for (int i = 0; i < PhaseCount; i++) {
+            m_shownFrame.phases[i] = m_frameTotals.phases[i] / frames;
+        }
+        m_shownFrame.bytes = m_frameTotals.bytes / frames;
+        m_shownFrame.clipRects = m_frameTotals.clipRects / frames;
+        m_shownFrame.damageRects = m_frameTotals.damageRects / frames;
+        m_frameTotals = {};
+
+        m_statsStart = frameStart;
+        m_statsChanged = true;
     }
 
+    // Each phase is timed while the HUD is shown
+    bool tracing = m_displayFramerate;
+    FrameTrace frame = {};
+    frame.start = frameStart.tv_sec * 1000000 + frameStart.tv_nsec / 1000;
+    timespec phaseStart = frameStart;
+
     m_renderMutex.lock();
 
     if (m_wallpaperThread.joinable() && m_wallpaperStatus) {
@@ -63,9 +139,10 @@ void Compositor::Render() {
     }
 
     if (m_invalidateAll) {
-        RecalculateBackgroundClipping();
-        RecalculateWindowClipping();
-        RecalculateRenderClipping();
+        RecalculateClipping(Region({Vector2i{0, 0}, Vector2i{m_renderSurface.width, m_renderSurface.height}}));
+        RebuildClipRects();
+        m_clippingDamage.Clear();
+        m_windowDamage.clear();
 
         // We fill the areas of the screen being redrawn in debug mode
         // This happens before the render surface is blitted to the display surface
@@ -74,161 +151,608 @@ void Compositor::Render() {
                                   &m_displaySurface);
 #endif
 
-        if (m_wallpaper.buffer) {
-            m_renderSurface.Blit(&m_wallpaper);
+    } else {
+        if (!m_clippingDamage.IsEmpty()) {
+            // Rebuilding the clip rects forgets which were waiting to be drawn
+            Region pending = m_clippingDamage;
             for (BackgroundClipRect& rect : m_backgroundRects) {
-#ifdef COMPOSITOR_DEBUG
-                Lemon::Graphics::DrawRectOutline(rect.rect, {255, 255, 0, 255}, &m_renderSurface);
-#endif
-                rect.invalid = false;
+                if (rect.invalid) {
+                    pending.Union(rect.rect);
+                }
+            }
+
+            for (WindowClipRect& rect : m_windowClipRects) {
+                if (rect.invalid) {
+                    pending.Union(rect.rect);
+                }
+            }
+
+            RecalculateClipping(m_clippingDamage);
+            RebuildClipRects();
+            m_clippingDamage.Clear();
+
+            for (const Rect& rect : pending.Rects()) {
+                Invalidate(rect);
             }
         }
-    } else {
+
         for (WMWindow* win : WM::Instance().m_windows) {
             if (win->IsDirtyAndClear()) {
-                // If the window is transparent, we will need to invalidate
-                // any rects underneath the window
-
-                // If the window is occluded, we will need to invalidate any rects
-                // above the clip
-
-                // Otherwise, just set the window rect as invalid
-                // and move on
+                // If the window is translucent or beneath something translucent,
+                // whatever overlaps it has to be redrawn with it.
+                // Otherwise just redraw the clips of the window
+                for (auto& r : m_windowClipRects) {
+                    if (r.win != win || r.type != WindowClipRect::TypeWindow) {
+                        continue;
+                    }
 
-                if(win->IsTransparent()) for(auto& r : m_windowClipRects) {
-                    if(r.win == win) {
+                    if (r.translucent || r.occluded) {
                         Invalidate(r.rect);
-                    }
-                } else for(auto& r : m_windowClipRects) {
-                    if(r.win == win) {
-                        if(r.occluded) {
-                            Invalidate(r.rect);
-                        } else {
-                            r.invalid = true;
-                        }
+                    } else {
+                        r.invalid = true;
                     }
                 }
-                
             }
         }
-    }
 
-    if (m_wallpaper.buffer) {
-        for (BackgroundClipRect& rect : m_backgroundRects) {
-            if (!rect.invalid) {
-                continue;
+        // Only what the client changed is drawn, unless something beneath or above shows through
+        for (const auto& [win, rect] : m_windowDamage) {
+            for (size_t i = 0; i < m_windowClipRects.size(); i++) {
+                WindowClipRect& r = m_windowClipRects[i];
+                if (r.win != win || r.type != WindowClipRect::TypeWindow || r.invalid || !RectsOverlap(r.rect, rect)) {
+                    continue;
+                }
+
+                Rect overlap = Overlap(r.rect, rect);
+                if (r.translucent || r.occluded) {
+                    Invalidate(overlap);
+                } else {
+                    m_partialClips.push_back({i, overlap});
+                }
             }
+        }
+        m_windowDamage.clear();
+    }
 
-            m_renderSurface.Blit(&m_wallpaper, rect.rect.pos, rect.rect);
+    WM& wm = WM::Instance();
+    bool contextMenuMoved = m_contextMenuBounds.pos != wm.m_contextMenu.bounds.pos ||
+                            m_contextMenuBounds.size != wm.m_contextMenu.bounds.size;
+    if (m_contextMenuDrawn && (!wm.m_showContextMenu || contextMenuMoved)) {
+        Invalidate(m_contextMenuBounds); // Remove it from where it was
+        m_contextMenuDrawn = false;
+    }
 
-#ifdef COMPOSITOR_DEBUG
-            Lemon::Graphics::DrawRectOutline(rect.rect, {255, 0, 0, 255}, &m_renderSurface);
-#endif
+    // Damage is worked out here, the drawing itself is split into tiles
+    long invalidArea = 0;
+    if (m_invalidateAll) {
+        invalidArea = static_cast<long>(m_renderSurface.width) * m_renderSurface.height;
+        AddDamage({Vector2i{0, 0}, Vector2i{m_renderSurface.width, m_renderSurface.height}});
+        frame.clipRects = m_backgroundRects.size() + m_windowClipRects.size();
+    } else {
+        if (m_wallpaper.buffer) {
+            for (BackgroundClipRect& rect : m_backgroundRects) {
+                if (rect.invalid) {
+                    invalidArea += static_cast<long>(rect.rect.width) * rect.rect.height;
+                    AddDamage(rect.rect);
+                    frame.clipRects++;
+                }
+            }
+        }
 
-            rect.invalid = false;
+        for (PartialClip& partial : m_partialClips) {
+            invalidArea += static_cast<long>(partial.rect.width) * partial.rect.height;
+            AddDamage(partial.rect);
+            frame.clipRects++;
+        }
+
+        for (WindowClipRect& rect : m_windowClipRects) {
+            if (rect.invalid) {
+                invalidArea += static_cast<long>(rect.rect.width) * rect.rect.height;
+                AddDamage(rect.rect);
+                frame.clipRects++;
+            }
         }
     }
+    frame.bytes = invalidArea * 4;
 
-    for (auto it = m_windowClipRects.begin(); it != m_windowClipRects.end();) {
-        WMWindow* win = it->win;
+    // Keep clients from swapping the buffers being drawn from
+    for (WindowClipRect& rect : m_windowClipRects) {
+        if (rect.type != WindowClipRect::TypeWindow) {
+            continue;
+        }
 
-        if (m_invalidateAll || it->invalid) { // Window buffer not dirty, only draw invalid clips
-            if (it->type == WindowClipRect::TypeWindowDecoration) {
-                win->DrawDecorationClip(it->rect, &m_renderSurface);
-            } else {
-                win->DrawClip(it->rect, &m_renderSurface);
+        if (m_invalidateAll || rect.invalid) {
+            if (m_drawnWindows.empty() || m_drawnWindows.back() != rect.win) {
+                rect.win->BeginDraw();
+                m_drawnWindows.push_back(rect.win);
             }
+        }
+    }
+
+    for (PartialClip& partial : m_partialClips) {
+        WMWindow* win = m_windowClipRects[partial.clip].win;
+        if (std::find(m_drawnWindows.begin(), m_drawnWindows.end(), win) == m_drawnWindows.end()) {
+            win->BeginDraw();
+            m_drawnWindows.push_back(win);
+        }
+    }
+
+    if (tracing) {
+        frame.phases[PhaseClipping] = NanosecondsSince(phaseStart) / 1000;
+        for (std::atomic<long>& phase : m_tilePhases) {
+            phase = 0;
+        }
+    }
+
+    if (invalidArea > 0) {
+        RenderTiles(invalidArea);
+    }
+    m_partialClips.clear();
+
+    if (tracing) {
+        frame.phases[PhaseBackground] = m_tilePhases[PhaseBackground] / 1000;
+        frame.phases[PhaseWindows] = m_tilePhases[PhaseWindows] / 1000;
+        frame.phases[PhaseDecorations] = m_tilePhases[PhaseDecorations] / 1000;
+    }
 
 #ifdef COMPOSITOR_DEBUG
-            Lemon::Graphics::DrawRect(it->rect, {255, 0, 0, 255}, &m_displaySurface);
-            if(it->type == WindowClipRect::TypeWindowDecoration)
-                Lemon::Graphics::DrawRectOutline(it->rect, {128, 128, 255, 255}, &m_renderSurface);
+    if (m_wallpaper.buffer) {
+        for (BackgroundClipRect& rect : m_backgroundRects) {
+            if (m_invalidateAll) {
+                Lemon::Graphics::DrawRectOutline(rect.rect, {255, 255, 0, 255}, &m_renderSurface);
+            } else if (rect.invalid) {
+                Lemon::Graphics::DrawRectOutline(rect.rect, {255, 0, 0, 255}, &m_renderSurface);
+            }
+        }
+    }
+
+    for (WindowClipRect& rect : m_windowClipRects) {
+        if (m_invalidateAll || rect.invalid) {
+            Lemon::Graphics::DrawRect(rect.rect, {255, 0, 0, 255}, &m_displaySurface);
+            if(rect.type == WindowClipRect::TypeWindowDecoration)
+                Lemon::Graphics::DrawRectOutline(rect.rect, {128, 128, 255, 255}, &m_renderSurface);
             else
-                Lemon::Graphics::DrawRectOutline(it->rect, {0, 0, 255, 255}, &m_renderSurface);
+                Lemon::Graphics::DrawRectOutline(rect.rect, {0, 0, 255, 255}, &m_renderSurface);
+        }
+    }
 #endif
 
-            it->invalid = false;
-            it++;
-        } else {
-            it++;
-        }
+    for (BackgroundClipRect& rect : m_backgroundRects) {
+        rect.invalid = false;
+    }
+
+    for (WindowClipRect& rect : m_windowClipRects) {
+        rect.invalid = false;
     }
 
-    if (WM::Instance().m_showContextMenu) {
-        Lemon::Graphics::DrawRoundedRect(WM::Instance().m_contextMenu.bounds, WMWindow::theme.titlebarColour, 5, 5, 5,
-                                         5, &m_renderSurface);
-        for (const auto& ent : WM::Instance().m_contextMenu.entries) {
+    for (WMWindow* win : m_drawnWindows) {
+        win->EndDraw();
+    }
+    m_drawnWindows.clear();
+
+    // Overlays stay on the render surface, so they are only drawn again when they change or are drawn over,
+    // otherwise there would be a frame to present every frame
+    if (wm.m_showContextMenu && (!m_contextMenuDrawn || DamageOverlaps(wm.m_contextMenu.bounds))) {
+        Lemon::Graphics::DrawRoundedRect(wm.m_contextMenu.bounds, WMWindow::theme.titlebarColour, 5, 5, 5, 5,
+                                         &m_renderSurface);
+        for (const auto& ent : wm.m_contextMenu.entries) {
             const Vector2i& pos = ent.bounds.pos;
             Lemon::Graphics::DrawString(ent.text.c_str(), pos.x, pos.y, GUI::Theme::Current().ColourText(),
                                         &m_renderSurface);
         }
+        AddDamage(wm.m_contextMenu.bounds);
+
+        m_contextMenuDrawn = true;
+        m_contextMenuBounds = wm.m_contextMenu.bounds;
     }
 
-    m_renderSurface.AlphaBlit(m_cursorCurrent, mousePos);
+    Rect frameStatsRect = {Vector2i{0, 0}, Vector2i{COMPOSITOR_FRAME_STATS_WIDTH, COMPOSITOR_FRAME_STATS_HEIGHT}};
+    if (m_displayFramerate && (m_statsChanged || DamageOverlaps(frameStatsRect))) {
+        DrawFrameStats(frameStatsRect);
+        AddDamage(frameStatsRect);
+        m_statsChanged = false;
+    }
+
+    // The cursor is never drawn to the render surface, so moving it needs no compositing.
+    // It is put straight onto the display surface, and the render surface has what was under it
+    Surface* cursor = m_cursorCurrent;
+    Vector2i mousePos = WM::Instance().Input().mouse.pos;
+    Rect cursorRect = {mousePos, Vector2i{cursor->width, cursor->height}};
+    bool drawCursor = m_pageCursors[m_backPage] != cursor || m_pageCursorPositions[m_backPage] != mousePos;
+    bool presented = drawCursor;
 
-    if (m_displayFramerate) {
-        Lemon::Graphics::DrawRect(0, 0, 80, 18, 0, 0, 0, &m_renderSurface);
-        Lemon::Graphics::DrawString(std::to_string(m_fRate).c_str(), 0, 0, 255, 255, 255, &m_renderSurface);
+    if (tracing) {
+        NanosecondsSince(phaseStart); // Overlays are not counted
     }
 
-    // Copy the render surface to the display surface
-    // Generally actually faster than copying each individual clip region
-    m_displaySurface.Blit(&m_renderSurface);
-    m_invalidateAll = false;
+    // Copy what changed from the render surface to the display surface,
+    // the display surface is uncached so copying everything every frame is expensive
+    if (m_invalidateAll || (m_pageCount > 1 && m_backPageStale)) {
+        m_displaySurface.Blit(&m_renderSurface);
+        drawCursor = presented = true;
+        frame.bytes += static_cast<uint64_t>(m_displaySurface.width) * m_displaySurface.height * 4;
+        frame.damageRects = 1;
+    } else {
+        auto present = [&](const Rect& r) {
+            m_displaySurface.Blit(&m_renderSurface, r.pos, r);
+            if (RectsOverlap(r, cursorRect)) {
+                drawCursor = true; // Drawn over the cursor
+            }
+            presented = true;
+            frame.bytes += static_cast<uint64_t>(r.width) * r.height * 4;
+            frame.damageRects++;
+        };
+
+        for (const Rect& r : m_damage) {
+            present(r);
+        }
+
+        if (m_pageCount > 1) {
+            for (const Rect& r : m_lastDamage) {
+                present(r);
+            }
+        }
+
+        // Put back what was under the cursor when it was last drawn to this page
+        if (drawCursor && m_pageCursors[m_backPage]) {
+            const Surface* lastCursor = m_pageCursors[m_backPage];
+            Rect lastCursorRect = {m_pageCursorPositions[m_backPage], Vector2i{lastCursor->width, lastCursor->height}};
+            m_displaySurface.Blit(&m_renderSurface, lastCursorRect.pos, lastCursorRect);
+        }
+    }
+
+    if (tracing) {
+        frame.phases[PhasePresent] = NanosecondsSince(phaseStart) / 1000;
+    }
+
+    if (drawCursor) {
+        DrawCursor(cursor, cursorRect);
+        m_pageCursors[m_backPage] = cursor;
+        m_pageCursorPositions[m_backPage] = mousePos;
+        frame.bytes += static_cast<uint64_t>(cursor->width) * cursor->height * 4;
+    }
+
+    if (tracing) {
+        frame.phases[PhaseCursor] = NanosecondsSince(phaseStart) / 1000;
+    }
+
+    // With nothing presented there is nothing to flip to
+    if (m_pageCount > 1 && presented) {
+        if (long error = Lemon::FlipFramebuffer(m_backPage); error) {
+            Logger::Warning("Failed to flip framebuffer: {}, presenting to the page on screen", strerror(-error));
+
+            m_backPage = (m_backPage + 1) % m_pageCount;
+            m_displaySurface = m_displayPages[m_backPage];
+            m_pageCount = 1;
+            m_invalidateAll = true;
+        } else {
+            m_backPage = (m_backPage + 1) % m_pageCount;
+            m_displaySurface = m_displayPages[m_backPage];
+
+            m_backPageStale = m_invalidateAll;
+            m_lastDamage.swap(m_damage);
+            m_invalidateAll = false;
+        }
+    } else {
+        m_invalidateAll = false;
+    }
+    m_damage.clear();
+
+    if (tracing && presented) {
+        frame.phases[PhasePresent] += NanosecondsSince(phaseStart) / 1000;
+
+        long frameTime = NanosecondsBetween(frameStart, phaseStart) / 1000;
+        int bucket = 0;
+        while (bucket < COMPOSITOR_FRAME_TIME_BUCKETS - 1 && frameTime > frameTimeBuckets[bucket]) {
+            bucket++;
+        }
+        m_frameTimes[bucket]++;
+
+        RecordFrame(frame);
+    }
 
     m_renderMutex.unlock();
+    return presented;
+}
+
+void Compositor::RecordFrame(const FrameTrace& frame) {
+    for (int i = 0; i < PhaseCount; i++) {
+        m_frameTotals.phases[i] += frame.phases[i];
+    }
+    m_frameTotals.bytes += frame.bytes;
+    m_frameTotals.clipRects += frame.clipRects;
+    m_frameTotals.damageRects += frame.damageRects;
+
+    if (m_trace.size() < COMPOSITOR_TRACE_FRAMES) {
+        m_trace.push_back(frame);
+    } else {
+        m_trace[m_traceNext] = frame;
+    }
+    m_traceNext = (m_traceNext + 1) % COMPOSITOR_TRACE_FRAMES;
+}
+
+int Compositor::DumpTrace(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        return errno;
+    }
+
+    fprintf(file, "start_us");
+    for (const char* name : phaseNames) {
+        fprintf(file, ",%s_us", name);
+    }
+    fprintf(file, ",bytes,clip_rects,damage_rects\n");
+
+    // Once the ring is full the oldest frame is the next to be replaced
+    size_t first = (m_trace.size() < COMPOSITOR_TRACE_FRAMES) ? 0 : m_traceNext;
+    for (size_t i = 0; i < m_trace.size(); i++) {
+        const FrameTrace& frame = m_trace[(first + i) % m_trace.size()];
+
+        fprintf(file, "%lu", frame.start);
+        for (uint32_t phase : frame.phases) {
+            fprintf(file, ",%u", phase);
+        }
+        fprintf(file, ",%lu,%u,%u\n", frame.bytes, frame.clipRects, frame.damageRects);
+    }
+
+    if (fclose(file)) {
+        return errno;
+    }
+    return 0;
+}
+
+bool Compositor::DamageOverlaps(const Rect& rect) const {
+    for (const Rect& r : m_damage) {
+        if (RectsOverlap(r, rect)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void Compositor::DrawFrameStats(const Rect& rect) {
+    Lemon::Graphics::DrawRect(rect, {0, 0, 0, 255}, &m_renderSurface);
+    Lemon::Graphics::DrawString((std::to_string(m_fRate) + " fps").c_str(), rect.x + 2, rect.y, 255, 255, 255,
+                                &m_renderSurface);
+
+    unsigned mostFrames = 1;
+    for (unsigned frames : m_shownFrameTimes) {
+        mostFrames = std::max(mostFrames, frames);
+    }
+
+    // A bar for each bucket, green for frames within a 60Hz refresh, yellow within two and red beyond
+    int barWidth = (rect.width - 2) / COMPOSITOR_FRAME_TIME_BUCKETS;
+    int barsTop = rect.y + 18;
+    int barsHeight = 30;
+    for (int i = 0; i < COMPOSITOR_FRAME_TIME_BUCKETS; i++) {
+        int height = m_shownFrameTimes[i] * barsHeight / mostFrames;
+        if (m_shownFrameTimes[i] && !height) {
+            height = 1;
+        }
+
+        RGBAColour colour = {192, 0, 0, 255};
+        if (i < COMPOSITOR_FRAME_TIME_BUCKETS - 1 && frameTimeBuckets[i] <= 16667) {
+            colour = {0, 192, 0, 255};
+        } else if (i < COMPOSITOR_FRAME_TIME_BUCKETS - 1 && frameTimeBuckets[i] <= 33333) {
+            colour = {192, 192, 0, 255};
+        }
+
+        Lemon::Graphics::DrawRect(rect.x + 2 + i * barWidth, barsTop + barsHeight - height, barWidth - 1, height,
+                                  colour, &m_renderSurface);
+    }
+
+    // Average time spent in each phase
+    int y = barsTop + barsHeight + 2;
+    for (int i = 0; i < PhaseCount; i++) {
+        Lemon::Graphics::DrawString(phaseNames[i], rect.x + 2, y, 255, 255, 255, &m_renderSurface);
+        Lemon::Graphics::DrawString((std::to_string(m_shownFrame.phases[i]) + " us").c_str(), rect.x + 100, y, 255,
+                                    255, 255, &m_renderSurface);
+        y += 16;
+    }
+
+    std::string counts = std::to_string(m_shownFrame.bytes / 1024) + " KB, " +
+                         std::to_string(m_shownFrame.clipRects) + " clips, " +
+                         std::to_string(m_shownFrame.damageRects) + " rects";
+    Lemon::Graphics::DrawString(counts.c_str(), rect.x + 2, y, 255, 255, 255, &m_renderSurface);
+}
+
+void Compositor::DrawCursor(const Surface* cursor, const Rect& rect) {
+    Rect clipped = Overlap(rect, {Vector2i{0, 0}, Vector2i{m_renderSurface.width, m_renderSurface.height}});
+    if (clipped.width <= 0 || clipped.height <= 0) {
+        return;
+    }
+
+    // Blend in system memory, reading back from the display surface is slow
+    m_cursorBuffer.width = clipped.width;
+    m_cursorBuffer.height = clipped.height;
+    m_cursorBuffer.Blit(&m_renderSurface, {0, 0}, clipped);
+    m_cursorBuffer.AlphaBlit(cursor, {0, 0}, {clipped.pos - rect.pos, clipped.size});
+
+    m_displaySurface.Blit(&m_cursorBuffer, clipped.pos, {Vector2i{0, 0}, clipped.size});
 }
 
 void Compositor::InvalidateAll() { m_invalidateAll = true; }
 
-void Compositor::Invalidate(const Rect& rect) {
-    if (m_invalidateAll) {
+void Compositor::InvalidateWindowRect(WMWindow* window, const Rect& rect) { m_windowDamage.push_back({window, rect}); }
+
+void Compositor::RenderTiles(long invalidArea) {
+    // Waking the workers costs more than drawing a little on this thread
+    if (m_workers.empty() || invalidArea < COMPOSITOR_PARALLEL_MIN_AREA) {
+        RenderTile({Vector2i{0, 0}, Vector2i{m_renderSurface.width, m_renderSurface.height}});
         return;
     }
 
-    for (auto& bgRect : m_backgroundRects) {
-        if (bgRect.invalid) {
-            continue;
-        }
+    // Rows of the surface are contiguous, so tiles span the width of the screen
+    int tileCount = (m_workers.size() + 1) * COMPOSITOR_TILES_PER_THREAD;
+    int tileHeight = std::max((m_renderSurface.height + tileCount - 1) / tileCount, COMPOSITOR_MIN_TILE_HEIGHT);
 
-        if (bgRect.rect.Intersects(rect)) {
-            bgRect.invalid = true; // Set bg rect as invalid
+    std::unique_lock lock(m_tileMutex);
+    m_tiles.clear();
+    for (int y = 0; y < m_renderSurface.height; y += tileHeight) {
+        m_tiles.push_back({Vector2i{0, y}, Vector2i{m_renderSurface.width, std::min(tileHeight, m_renderSurface.height - y)}});
+    }
+
+    m_nextTile = 0;
+    m_tilesRemaining = m_tiles.size();
+    m_tileFrame++;
+    m_tilesReady.notify_all();
+
+    RenderQueuedTiles(lock);
+    m_tilesDone.wait(lock, [this]() -> bool { return m_tilesRemaining == 0; });
+}
+
+void Compositor::RenderQueuedTiles(std::unique_lock<std::mutex>& lock) {
+    while (m_nextTile < m_tiles.size()) {
+        Rect tile = m_tiles[m_nextTile++];
+
+        lock.unlock();
+        RenderTile(tile);
+        lock.lock();
+
+        if (--m_tilesRemaining == 0) {
+            m_tilesDone.notify_all();
         }
+    }
+}
 
-        for (auto& wRect : m_windowClipRects) {
-            if (wRect.rect.Intersects(bgRect.rect)) {
-                wRect.invalid = true;
+void Compositor::RenderTile(const Rect& tile) {
+    // Phases are summed locally, so the atomics are only touched once per tile
+    bool tracing = m_displayFramerate;
+    long phases[PhaseCount] = {};
+    timespec phaseStart;
+    if (tracing) {
+        clock_gettime(CLOCK_BOOTTIME, &phaseStart);
+    }
+
+    if (m_wallpaper.buffer) {
+        if (m_invalidateAll) {
+            m_renderSurface.Blit(&m_wallpaper, tile.pos, tile);
+        } else {
+            for (const BackgroundClipRect& rect : m_backgroundRects) {
+                Rect overlap = Overlap(rect.rect, tile);
+                if (rect.invalid && overlap.width > 0 && overlap.height > 0) {
+                    m_renderSurface.Blit(&m_wallpaper, overlap.pos, overlap);
+                }
             }
         }
+
+        if (tracing) {
+            phases[PhaseBackground] += NanosecondsSince(phaseStart);
+        }
     }
 
-    for (auto& wRect : m_windowClipRects) {
-        if (wRect.invalid) {
-            for (auto* bgRect : wRect.win->occludedBackgroundRects) {
-                bgRect->invalid = true;
-            }
+    for (const WindowClipRect& rect : m_windowClipRects) {
+        if (!m_invalidateAll && !rect.invalid) {
+            continue;
+        }
 
-            for (auto* oRect : wRect.win->occludedWindowRects) {
-                oRect->invalid = true;
-            }
+        Rect overlap = Overlap(rect.rect, tile);
+        if (overlap.width <= 0 || overlap.height <= 0) {
             continue;
         }
 
-        if (wRect.rect.Intersects(rect)) {
-            wRect.invalid = true;
-            for (auto* bgRect : wRect.win->occludedBackgroundRects) {
-                bgRect->invalid = true;
+        if (rect.type == WindowClipRect::TypeWindowDecoration) {
+            rect.win->DrawDecorationClip(overlap, &m_renderSurface);
+            if (tracing) {
+                phases[PhaseDecorations] += NanosecondsSince(phaseStart);
             }
-
-            for (auto* oRect : wRect.win->occludedWindowRects) {
-                oRect->invalid = true;
+        } else {
+            rect.win->DrawClip(overlap, &m_renderSurface, rect.translucent);
+            if (tracing) {
+                phases[PhaseWindows] += NanosecondsSince(phaseStart);
             }
         }
     }
 
-    for(auto& rRect : m_renderClipRects) {
-        if(rRect.rect.Intersects(rect)) {
-            rRect.invalid = true;
+    for (const PartialClip& partial : m_partialClips) {
+        Rect overlap = Overlap(partial.rect, tile);
+        if (overlap.width > 0 && overlap.height > 0) {
+            m_windowClipRects[partial.clip].win->DrawClip(overlap, &m_renderSurface, false);
+        }
+    }
+
+    if (tracing) {
+        phases[PhaseWindows] += NanosecondsSince(phaseStart);
+
+        m_tilePhases[PhaseBackground] += phases[PhaseBackground];
+        m_tilePhases[PhaseWindows] += phases[PhaseWindows];
+        m_tilePhases[PhaseDecorations] += phases[PhaseDecorations];
+    }
+}
+
+void Compositor::TileWorker() {
+    if (Lemon::SetSchedulingClass(0, SchedulingClassInteractive)) {
+        Logger::Warning("Failed to set scheduling class of tile worker: {}", strerror(errno));
+    }
+
+    unsigned long frame = 0;
+    std::unique_lock lock(m_tileMutex);
+    for (;;) {
+        m_tilesReady.wait(lock, [&]() -> bool { return m_tileFrame != frame || m_stopWorkers; });
+        if (m_stopWorkers) {
+            return;
+        }
+
+        frame = m_tileFrame;
+        RenderQueuedTiles(lock);
+    }
+}
+
+void Compositor::AddDamage(Rect rect) {
+    rect = Overlap(rect, {Vector2i{0, 0}, Vector2i{m_renderSurface.width, m_renderSurface.height}});
+    if (rect.width <= 0 || rect.height <= 0) {
+        return;
+    }
+
+    for (auto it = m_damage.begin(); it != m_damage.end(); it++) {
+        Rect bounds;
+        bounds.x = std::min(rect.left(), it->left());
+        bounds.y = std::min(rect.top(), it->top());
+        bounds.width = std::max(rect.right(), it->right()) - bounds.x + 1;
+        bounds.height = std::max(rect.bottom(), it->bottom()) - bounds.y + 1;
+
+        // Copying the bounding box is no more work than copying both,
+        // which also covers one containing the other
+        if (static_cast<long>(bounds.width) * bounds.height <=
+            static_cast<long>(rect.width) * rect.height + static_cast<long>(it->width) * it->height) {
+            m_damage.erase(it);
+            AddDamage(bounds); // The bounding box may now overlap other regions
+            return;
+        }
+    }
+
+    m_damage.push_back(rect);
+}
+
+void Compositor::Invalidate(const Rect& rect) {
+    if (m_invalidateAll) {
+        return;
+    }
+
+    // Redrawing something translucent or beneath something translucent
+    // means redrawing everything it overlaps
+    std::vector<Rect> pending = {rect};
+    while (!pending.empty()) {
+        Rect r = pending.back();
+        pending.pop_back();
+
+        for (auto& bgRect : m_backgroundRects) {
+            if (!bgRect.invalid && RectsOverlap(bgRect.rect, r)) {
+                bgRect.invalid = true;
+                if (bgRect.occluded) {
+                    pending.push_back(bgRect.rect);
+                }
+            }
+        }
+
+        for (auto& wRect : m_windowClipRects) {
+            if (!wRect.invalid && RectsOverlap(wRect.rect, r)) {
+                wRect.invalid = true;
+                if (wRect.occluded || wRect.translucent) {
+                    pending.push_back(wRect.rect);
+                }
+            }
         }
     }
 }
@@ -254,135 +778,89 @@ void Compositor::SetWallpaper(const std::string& path) {
     m_wallpaperThread = std::move(wallpaperThread);
 }
 
-void Compositor::RecalculateWindowClipping() {
-    m_windowClipRects.clear();
+void Compositor::InvalidateClipping(const Rect& rect) {
+    m_clippingDamage.Union(Overlap(rect, {Vector2i{0, 0}, Vector2i{m_renderSurface.width, m_renderSurface.height}}));
+}
 
-    for (WMWindow* win : WM::Instance().m_windows) {
-        win->occludedBackgroundRects.clear();
-        win->occludedWindowRects.clear();
+void Compositor::RecalculateClipping(const Region& damage) {
+    Region visible = damage; // Not covered by an opaque window above
 
-        if (win->IsMinimized()) {
+    auto& windows = WM::Instance().m_windows;
+    for (auto it = windows.rbegin(); it != windows.rend(); it++) {
+        WMWindow* win = *it;
+
+        win->contentClip.Subtract(damage);
+        win->decorationClip.Subtract(damage);
+        if (win->IsMinimized() || visible.IsEmpty()) {
             continue;
         }
 
-    retry:
-        for (auto it = m_windowClipRects.begin(); it != m_windowClipRects.end(); it++) {
-            if (win->IsTransparent() && win->GetContentRect().Contains(it->rect)) {
-                continue;
-            }
+        Region content(win->GetContentRect());
 
-            if (it->rect.Intersects(win->GetContentRect())) {
-                auto result = it->SplitModify(win->GetContentRect());
-
-                if (!win->IsTransparent()) {
-                    m_windowClipRects.erase(it);
-                }
-
-                m_windowClipRects.splice(m_windowClipRects.end(), std::move(result));
-                goto retry;
-            }
-        }
+        Region contentClip = content;
+        contentClip.Intersect(visible);
+        win->contentClip.Union(contentClip);
 
         if (win->ShouldDrawDecoration()) {
-            auto decorationRects =
-                WindowClipRect{win->GetRect(), win, WindowClipRect::TypeWindowDecoration, true}.Split(win->GetContentRect());
-
-            for (auto& rect : decorationRects) {
-                for (auto it = m_windowClipRects.begin(); it != m_windowClipRects.end(); it++) {
-                    // Decoration rects are treated as transparent
-                    if (rect.rect.Contains(it->rect)) {
-                        rect.occluded = true;
-                        continue;
-                    }
-
-                    if (it->rect.Intersects(rect.rect)) {
-                        auto result = it->SplitModify(rect.rect);
-                        // Instead of removing the clip, mark it as occluded
-                        it->occluded = true;
-
-                        m_windowClipRects.splice(m_windowClipRects.end(), std::move(result));
-                        goto retry;
-                    }
-                }
-            }
-
-            m_windowClipRects.splice(m_windowClipRects.end(), std::move(decorationRects));
+            Region decorationClip(win->GetRect());
+            decorationClip.Subtract(content);
+            decorationClip.Intersect(visible);
+            win->decorationClip.Union(decorationClip);
         }
 
-        m_windowClipRects.push_back({win->GetContentRect(), win, WindowClipRect::TypeWindow});
-
-        if (win->IsTransparent()) {
-            for (auto& bgRect : m_backgroundRects) {
-                if (bgRect.rect.Intersects(win->GetContentRect())) {
-                    win->occludedBackgroundRects.push_back(&bgRect);
-                }
-            }
-
-            for (auto& bgRect : m_windowClipRects) {
-                if (bgRect.rect.Intersects(win->GetContentRect())) {
-                    win->occludedWindowRects.push_back(&bgRect);
-                }
-            }
+        // Decoration is left out as it is drawn over the windows below
+        if (!win->IsTransparent()) {
+            visible.Subtract(content);
+        } else {
+            visible.Subtract(win->GetOpaqueRegion());
         }
     }
+
+    m_backgroundClip.Subtract(damage);
+    m_backgroundClip.Union(visible);
 }
 
-void Compositor::RecalculateBackgroundClipping() {
-    m_backgroundRects.clear();
+void Compositor::RebuildClipRects() {
+    m_windowClipRects.clear();
 
-    m_backgroundRects.push_back({Rect{0, 0, m_displaySurface.width, m_displaySurface.height}, true});
+    // Walk down from the top to find what is beneath something translucent
+    Region translucent;
 
     auto& windows = WM::Instance().m_windows;
-    for (WMWindow* win : windows) {
-        if (win->IsMinimized()) {
-            continue;
-        }
+    for (auto it = windows.rbegin(); it != windows.rend(); it++) {
+        WMWindow* win = *it;
 
-        std::list<Rect> splitDecorationRects;
-        if (win->ShouldDrawDecoration()) {
-            splitDecorationRects = win->GetRect().Split(win->GetContentRect());
+        for (const Rect& r : win->decorationClip.Rects()) {
+            m_windowClipRects.push_back(
+                {r, win, WindowClipRect::TypeWindowDecoration, false, translucent.Intersects(r), true});
         }
 
-    retry:
-        for (auto it = m_backgroundRects.begin(); it != m_backgroundRects.end(); it++) {
-            if (win->ShouldDrawDecoration()) {
-                for (auto& dRect : splitDecorationRects) {
-                    if (it->rect.Intersects(dRect) && !dRect.Contains(it->rect)) {
-                        auto result = it->SplitModify(dRect);
-
-                        m_backgroundRects.splice(m_backgroundRects.end(), std::move(result));
-                        goto retry;
-                    }
-                }
-            }
-
-            if (win->IsTransparent() && win->GetContentRect().Contains(it->rect)) {
-                continue; // Background rect entirely within transparent window
-            }
+        // Transparent windows are only blended outside of their opaque region
+        Region blendedClip;
+        Region copiedClip = win->contentClip;
+        if (win->IsTransparent()) {
+            blendedClip = win->contentClip;
+            copiedClip.Intersect(win->GetOpaqueRegion());
+            blendedClip.Subtract(copiedClip);
+        }
 
-            if (it->rect.Intersects(win->GetContentRect())) {
-                auto result = it->SplitModify(win->GetContentRect());
+        for (const Rect& r : copiedClip.Rects()) {
+            m_windowClipRects.push_back({r, win, WindowClipRect::TypeWindow, false, translucent.Intersects(r), false});
+        }
 
-                if (!win->IsTransparent()) {
-                    m_backgroundRects.erase(it);
-                }
-                m_backgroundRects.splice(m_backgroundRects.end(), std::move(result));
-                goto retry;
-            }
+        for (const Rect& r : blendedClip.Rects()) {
+            m_windowClipRects.push_back({r, win, WindowClipRect::TypeWindow, false, translucent.Intersects(r), true});
         }
-    }
-}
 
-void Compositor::RecalculateRenderClipping() {
-    m_renderClipRects.clear();
-    for(auto& rect : m_backgroundRects) {
-        m_renderClipRects.push_back({rect.rect, true});
+        translucent.Union(win->decorationClip);
+        translucent.Union(blendedClip);
     }
 
-    for(auto& rect : m_windowClipRects) {
-        // Ignore transparent clip rects
-        if(rect.type == WindowClipRect::TypeWindow && !rect.win->IsTransparent()) {
-            m_renderClipRects.push_back({rect.rect, true});
-        }
+    // Drawn from the bottom up
+    std::reverse(m_windowClipRects.begin(), m_windowClipRects.end());
+
+    m_backgroundRects.clear();
+    for (const Rect& r : m_backgroundClip.Rects()) {
+        m_backgroundRects.push_back({r, false, translucent.Intersects(r)});
     }
 }
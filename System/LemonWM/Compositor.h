@@ -1,78 +1,50 @@
 #pragma once
 
+#include "Region.h"
+
 #include <Lemon/Graphics/Surface.h>
 #include <Lemon/Graphics/Types.h>
 
 #include <atomic>
+#include <condition_variable>
 #include <ctime>
-#include <list>
+#include <mutex>
 #include <thread>
+#include <vector>
+
+#define COMPOSITOR_MAX_PAGES 2 // Framebuffer pages flipped between
+
+#define COMPOSITOR_MAX_THREADS 8              // Threads compositing tiles, including the main thread
+#define COMPOSITOR_TILES_PER_THREAD 2         // More tiles than threads, so uneven tiles balance out
+#define COMPOSITOR_MIN_TILE_HEIGHT 32
+#define COMPOSITOR_PARALLEL_MIN_AREA (256 * 256) // Invalid pixels worth waking the workers for
+
+#define COMPOSITOR_FRAME_TIME_BUCKETS 8
+#define COMPOSITOR_FRAME_STATS_WIDTH 200
+#define COMPOSITOR_FRAME_STATS_HEIGHT 164
+
+#define COMPOSITOR_TRACE_FRAMES 1024 // Frames kept for the trace while the HUD is shown
+#define COMPOSITOR_TRACE_PATH "/tmp/lemonwm-trace.csv"
+
+enum CompositorPhase {
+    PhaseClipping, // Recalculating clipping and working out what to draw
+    PhaseBackground,
+    PhaseWindows,
+    PhaseDecorations,
+    PhaseCursor,
+    PhasePresent, // Copying to the display surface and flipping
+    PhaseCount,
+};
 
-template <typename T, class... D> std::list<T> SplitModify(Rect& victim, const Rect& cut, D... extraData) {
-    std::list<T> clips;
-
-    if (cut.left() > victim.left() && cut.left() <= victim.right()) { // Clip left edge
-        Rect clip;
-        clip.top(victim.top());
-        clip.left(victim.left());
-        clip.bottom(victim.bottom());
-        clip.right(cut.left() - 1); // Left of cutting rect's left edge
-
-        victim.left(cut.left());
-
-        if (clip.width > 0) {
-            clips.push_back(T{clip, extraData...});
-        }
-    }
-
-    if (cut.top() > victim.top() && cut.top() <= victim.bottom()) { // Clip top edge
-        Rect clip;
-        clip.top(victim.top());
-        clip.left(victim.left());
-        clip.bottom(cut.top() - 1); // Above cutting rect's top edge
-        clip.right(victim.right());
-
-        victim.top(cut.top());
-
-        if (clip.height > 0) {
-            clips.push_back(T{clip, extraData...});
-        }
-    }
-
-    if (cut.right() >= victim.left() && cut.right() < victim.right()) { // Clip right edge
-        Rect clip;
-        clip.top(victim.top());
-        clip.left(cut.right() + 1);
-        clip.bottom(victim.bottom());
-        clip.right(victim.right());
-
-        victim.right(cut.right());
-
-        if (clip.width > 0) {
-            clips.push_back(T{clip, extraData...});
-        }
-    }
-
-    if (cut.bottom() >= victim.top() && cut.bottom() < victim.bottom()) { // Clip bottom edge
-        Rect clip;
-        clip.top(cut.bottom() + 1);
-        clip.left(victim.left());
-        clip.bottom(victim.bottom());
-        clip.right(victim.right());
-
-        victim.bottom(cut.bottom());
-
-        if (clip.height > 0) {
-            clips.push_back(T{clip, extraData...});
-        }
-    }
-
-    return clips;
-}
-
-template <typename T, class... D> inline std::list<T> Split(Rect victim, const Rect& cut, D... extraData){
-    return SplitModify<T, D...>(victim, cut, extraData...);
-}
+// Timing and counts of a presented frame
+struct FrameTrace {
+    uint64_t start; // Microseconds since boot
+    // Microseconds spent in each phase, drawing phases are summed over the threads drawing tiles
+    uint32_t phases[PhaseCount];
+    uint64_t bytes;       // Written to the render and display surfaces
+    uint32_t clipRects;   // Background and window clips drawn
+    uint32_t damageRects; // Rects copied to the display surface
+};
 
 struct WindowClipRect {
     Rect rect;
@@ -82,63 +54,142 @@ struct WindowClipRect {
         TypeWindowDecoration,
     } type = TypeWindow;
     bool invalid = true;
-    bool occluded = false;
+    bool occluded = false; // Beneath decoration or a transparent window
+    // Whatever is beneath shows through, decoration is drawn over the windows below for the rounded corners
+    bool translucent = false;
+};
 
-    std::list<WindowClipRect> SplitModify(const Rect& cut) { return ::SplitModify<WindowClipRect>(rect, cut, win, type, true, occluded); }
-    std::list<WindowClipRect> Split(const Rect& cut) { return ::Split<WindowClipRect>(rect, cut, win, type, true, occluded); }
+// Part of a window clip to be drawn
+struct PartialClip {
+    size_t clip; // Index in the window clip rects
+    Rect rect;
 };
 
 struct BackgroundClipRect {
     Rect rect;
     bool invalid = true;
-
-    std::list<BackgroundClipRect> SplitModify(const Rect& cut) { return ::SplitModify<BackgroundClipRect, bool>(rect, cut, true); }
-    std::list<BackgroundClipRect> Split(const Rect& cut) { return ::Split<BackgroundClipRect, bool>(rect, cut, true); }
+    bool occluded = false;
 };
 
 class Compositor {
 public:
-    Compositor(const Surface& displaySurface);
-
-    void Render();
+    /////////////////////////////
+    /// \brief Compositor constructor
+    ///
+    /// With more than one page, each frame is presented to the page not on screen, which is then flipped to.
+    ///
+    /// \param displayPages Pages of the framebuffer, the first being on screen
+    /////////////////////////////
+    Compositor(const Surface* displayPages, int pageCount);
+    ~Compositor();
+
+    /////////////////////////////
+    /// \brief Draw what changed since the last frame and present it
+    ///
+    /// \return Whether anything was presented, nothing is when nothing changed
+    /////////////////////////////
+    bool Render();
 
     inline Vector2i GetScreenBounds() const { return {m_renderSurface.width, m_renderSurface.height}; }
 
     void InvalidateAll();
     void Invalidate(const Rect& rect);
     void InvalidateWindow(class WMWindow* window);
+    // Redraw only rect of the window content, in screen coordinates
+    void InvalidateWindowRect(class WMWindow* window, const Rect& rect);
+    // Windows within rect were moved, resized, restacked, shown or hidden, recalculate clipping there
+    void InvalidateClipping(const Rect& rect);
 
     void SetWallpaper(const std::string& path);
-    void SetShouldDisplayFramerate(bool value) { m_displayFramerate = value; }
+    // Show the HUD with frame times and where they are spent, frames are traced while it is shown
+    void SetShouldDisplayFramerate(bool value) {
+        m_displayFramerate = value;
+        InvalidateAll();
+    }
+    inline bool ShouldDisplayFramerate() const { return m_displayFramerate; }
+
+    /////////////////////////////
+    /// \brief Write the traced frames to a file as CSV, oldest first
+    ///
+    /// \return 0 on success, otherwise an error code
+    /////////////////////////////
+    int DumpTrace(const char* path);
 
     inline void SetNormalCursor() { m_cursorCurrent = &m_cursorNormal; }
     inline void SetResizeCursor() { m_cursorCurrent = &m_cursorResize; }
 
 private:
-    void RecalculateWindowClipping();
-    void RecalculateBackgroundClipping();
-    void RecalculateRenderClipping();
-
-    void InvalidateBackgroundRect(BackgroundClipRect& bgRect);
-    void InvalidateWindowRect(WindowClipRect& wRect);
-    void InvalidateDecorationRect(WindowClipRect& dRect);
+    /////////////////////////////
+    /// \brief Recalculate the clip regions of the windows and background within damage
+    ///
+    /// Nothing outside of damage changes, so only it is walked down through the windows.
+    /////////////////////////////
+    void RecalculateClipping(const Region& damage);
+    // Rebuild the clip rects drawn from, from the clip regions
+    void RebuildClipRects();
+
+    // Add a region drawn to the render surface this frame, to be copied to the display surface
+    void AddDamage(Rect rect);
+
+    // Blend the cursor with what is under it on the render surface, and put it on the display surface
+    void DrawCursor(const Surface* cursor, const Rect& rect);
+    // Whether rect overlaps anything drawn this frame
+    bool DamageOverlaps(const Rect& rect) const;
+    // Draw the framerate, a histogram of frame times and the average time of each phase over the last second
+    void DrawFrameStats(const Rect& rect);
+    // Keep a presented frame for the trace and the HUD
+    void RecordFrame(const FrameTrace& frame);
+
+    /////////////////////////////
+    /// \brief Draw the invalid background and window clips
+    ///
+    /// The screen is split into tiles which are drawn by the workers and this thread.
+    /// Clips are drawn in order within each tile, so tiles never touch the same pixels.
+    ///
+    /// \param invalidArea Pixels to be drawn, too few and the workers are left asleep
+    /////////////////////////////
+    void RenderTiles(long invalidArea);
+    // Take and draw tiles until there are none left, m_tileMutex must be held
+    void RenderQueuedTiles(std::unique_lock<std::mutex>& lock);
+    void RenderTile(const Rect& tile);
+    void TileWorker();
 
     bool m_invalidateAll = true;
     bool m_displayFramerate = false;
 
-    Vector2i m_lastMousePos = {0, 0};
     Surface m_cursorNormal; // Normal mouse cursor
     Surface m_cursorResize; // Window resize mouse cursor
     Surface* m_cursorCurrent = &m_cursorNormal; // Current mouse cursor
+    Surface m_cursorBuffer; // Cursor blended with what is beneath it
 
-    // Used for framerate counter
-    timespec m_lastRender;
-    long m_avgFrametime = 0;
-    long m_fCount = 0;
+    // Used for the frame time histogram
+    timespec m_statsStart;
+    unsigned m_frameTimes[COMPOSITOR_FRAME_TIME_BUCKETS] = {}; // Frames presented this second by render time
+    unsigned m_shownFrameTimes[COMPOSITOR_FRAME_TIME_BUCKETS] = {}; // Last second, as shown
     int m_fRate = 0;
+    bool m_statsChanged = false;
+
+    FrameTrace m_frameTotals = {}; // Summed over the frames this second
+    FrameTrace m_shownFrame = {};  // Averaged over the last second, as shown
+    std::vector<FrameTrace> m_trace; // Ring of the last COMPOSITOR_TRACE_FRAMES frames
+    size_t m_traceNext = 0;
+    // Drawing time of the current frame in nanoseconds, summed over the tiles
+    std::atomic<long> m_tilePhases[PhaseCount];
+
+    bool m_contextMenuDrawn = false; // Whether the context menu is on the render surface
+    Rect m_contextMenuBounds = {Vector2i{0, 0}, Vector2i{0, 0}};
 
     Surface m_renderSurface;  // Backbuffer to render to
-    Surface m_displaySurface; // Display mapped surface
+    Surface m_displaySurface; // Display mapped surface, the page being presented to when flipping
+    Surface m_displayPages[COMPOSITOR_MAX_PAGES];
+    int m_pageCount = 1;
+    int m_backPage = 0; // Page being presented to
+    // What the back page is missing, as it was presented to the other page last frame
+    std::vector<Rect> m_lastDamage;
+    bool m_backPageStale = true;
+    // Cursor last drawn to each page and where, nullptr if none has been
+    const Surface* m_pageCursors[COMPOSITOR_MAX_PAGES] = {};
+    Vector2i m_pageCursorPositions[COMPOSITOR_MAX_PAGES];
 
     Surface m_wallpaper = {}; // Wallpaper surface
     std::thread m_wallpaperThread;
@@ -146,9 +197,28 @@ private:
     std::mutex m_renderMutex; // Currently only used for the wallpaper for invalidation
     std::mutex m_wallpaperMutex;
 
-    std::list<BackgroundClipRect> m_backgroundRects;
-    std::list<WindowClipRect> m_windowClipRects;
-    // Clip rects used when determining which parts of the screen
-    // to copy to the framebuffer
-    std::list<BackgroundClipRect> m_renderClipRects;
+    Region m_backgroundClip; // Not covered by an opaque window
+    Region m_clippingDamage; // Where clipping has to be recalculated before the next frame
+
+    std::vector<BackgroundClipRect> m_backgroundRects;
+    // Bottom to top, the order they are drawn in
+    std::vector<WindowClipRect> m_windowClipRects;
+    // Regions of the render surface drawn to this frame,
+    // overlapping regions are merged when their bounding box is no larger than the two
+    std::vector<Rect> m_damage;
+    std::vector<class WMWindow*> m_drawnWindows; // Windows being drawn from this frame
+    // Parts of windows the clients reported changed
+    std::vector<std::pair<class WMWindow*, Rect>> m_windowDamage;
+    // Parts of clips to be drawn this frame, of opaque clips with nothing translucent above
+    std::vector<PartialClip> m_partialClips;
+
+    std::vector<std::thread> m_workers;
+    std::mutex m_tileMutex;
+    std::condition_variable m_tilesReady; // Workers wait for a new frame
+    std::condition_variable m_tilesDone;
+    std::vector<Rect> m_tiles;
+    size_t m_nextTile = 0;
+    size_t m_tilesRemaining = 0;
+    unsigned long m_tileFrame = 0;
+    bool m_stopWorkers = false;
 };
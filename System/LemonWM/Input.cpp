@@ -37,20 +37,27 @@ void InputManager::Poll() {
         }
     };
 
-    if (Lemon::MousePacket mousePacket; Lemon::PollMouse(mousePacket)) {
+    // Movement is sent once for all the packets, unless a button changes
+    // in which case the movement before it is sent first so the press is where it happened
+    bool moved = false;
+    Lemon::MousePacket mousePacket;
+    while (Lemon::PollMouse(mousePacket)) {
+        Vector2i lastPos = mouse.pos;
         mouse.pos.x = std::max(0, std::min(mouse.pos.x + mousePacket.xMovement, m_mouseBounds.x));
         mouse.pos.y = std::max(0, std::min(mouse.pos.y + mousePacket.yMovement, m_mouseBounds.y));
+        moved = moved || mouse.pos != lastPos;
 
-        handlePacketPress(mousePacket);
-
-        while (Lemon::PollMouse(mousePacket)) {
-            mouse.pos.x = std::max(0, std::min(mouse.pos.x + mousePacket.xMovement, m_mouseBounds.x));
-            mouse.pos.y = std::max(0, std::min(mouse.pos.y + mousePacket.yMovement, m_mouseBounds.y));
-
-            handlePacketPress(mousePacket); // If necessary send a mouse press event for each packet, however only send
-                                            // move event after processing all packets
+        bool buttonsChanged = (!!(mousePacket.buttons & Lemon::MouseButton::Left)) != mouse.left ||
+                              (!!(mousePacket.buttons & Lemon::MouseButton::Right)) != mouse.right;
+        if (buttonsChanged && moved) {
+            WM::Instance().OnMouseMove();
+            moved = false;
         }
 
+        handlePacketPress(mousePacket);
+    }
+
+    if (moved) {
         WM::Instance().OnMouseMove();
     }
 
@@ -4,10 +4,14 @@
 #include <Lemon/Core/Framebuffer.h>
 #include <Lemon/Core/Logger.h>
 #include <Lemon/System/Spawn.h>
+#include <Lemon/System/Util.h>
+
+#include <errno.h>
+#include <string.h>
 
 int main() {
-    Surface displaySurface;
-    Lemon::CreateFramebufferSurface(displaySurface);
+    Surface displayPages[COMPOSITOR_MAX_PAGES];
+    int pageCount = Lemon::CreateFramebufferPages(displayPages, COMPOSITOR_MAX_PAGES);
 
     Lemon::Logger::Debug("Initializing LemonWM...");
 
@@ -20,7 +24,7 @@ int main() {
 
     config.LoadJSONConfig("/system/lemon/lemonwm.json");
 
-    WM wm(displaySurface);
+    WM wm(displayPages, pageCount);
 
     wm.Compositor().SetWallpaper(config.GetConfigProperty<std::string>("backgroundImage"));
     wm.Compositor().SetShouldDisplayFramerate(config.GetConfigProperty<bool>("displayFramerate"));
@@ -28,6 +32,11 @@ int main() {
     
     wm.enableWindowTransparency = config.GetConfigProperty<bool>("enableWindowTransparency");
 
+    // Compositing is latency sensitive, run ahead of normal threads
+    if (Lemon::SetSchedulingClass(0, SchedulingClassInteractive)) {
+        Lemon::Logger::Warning("Failed to set scheduling class: {}", strerror(errno));
+    }
+
     wm.Run();
     return 0;
 }
@@ -0,0 +1,218 @@
+#include "Region.h"
+
+#include <algorithm>
+
+Region::Region(const Rect& rect) {
+    if (rect.width > 0 && rect.height > 0) {
+        m_rects.push_back(rect);
+        m_bounds = rect;
+    }
+}
+
+bool Region::Intersects(const Rect& rect) const {
+    if (IsEmpty() || !RectsOverlap(m_bounds, rect)) {
+        return false;
+    }
+
+    for (const Rect& r : m_rects) {
+        if (r.top() > rect.bottom()) {
+            break; // Sorted by top, nothing further down can overlap
+        }
+
+        if (RectsOverlap(r, rect)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void Region::Union(const Region& other) {
+    if (other.IsEmpty()) {
+        return;
+    } else if (IsEmpty()) {
+        *this = other;
+        return;
+    }
+
+    Combine(other, OpUnion);
+}
+
+void Region::Subtract(const Region& other) {
+    if (IsEmpty() || other.IsEmpty() || !RectsOverlap(m_bounds, other.m_bounds)) {
+        return;
+    }
+
+    Combine(other, OpSubtract);
+}
+
+void Region::Intersect(const Region& other) {
+    if (IsEmpty() || other.IsEmpty() || !RectsOverlap(m_bounds, other.m_bounds)) {
+        Clear();
+        return;
+    }
+
+    Combine(other, OpIntersect);
+}
+
+void Region::Translate(const Vector2i& offset) {
+    for (Rect& r : m_rects) {
+        r.pos = r.pos + offset;
+    }
+    m_bounds.pos = m_bounds.pos + offset;
+}
+
+void Region::BandSpans(const std::vector<Rect>& rects, size_t& index, int y, std::vector<Span>& spans) {
+    spans.clear();
+
+    while (index < rects.size() && rects[index].bottom() < y) {
+        index++;
+    }
+
+    if (index >= rects.size() || rects[index].top() > y) {
+        return; // y is between bands
+    }
+
+    int bandTop = rects[index].top();
+    for (size_t i = index; i < rects.size() && rects[i].top() == bandTop; i++) {
+        spans.push_back({rects[i].left(), rects[i].right() + 1});
+    }
+}
+
+void Region::CombineSpans(const std::vector<Span>& a, const std::vector<Span>& b, Operation op,
+                          std::vector<Span>& result) {
+    result.clear();
+
+    switch (op) {
+    case OpUnion: {
+        size_t i = 0, j = 0;
+        while (i < a.size() || j < b.size()) {
+            Span next;
+            if (j >= b.size() || (i < a.size() && a[i].left < b[j].left)) {
+                next = a[i++];
+            } else {
+                next = b[j++];
+            }
+
+            if (!result.empty() && next.left <= result.back().right) {
+                result.back().right = std::max(result.back().right, next.right);
+            } else {
+                result.push_back(next);
+            }
+        }
+        break;
+    }
+    case OpSubtract: {
+        size_t j = 0;
+        for (const Span& span : a) {
+            while (j < b.size() && b[j].right <= span.left) {
+                j++;
+            }
+
+            int left = span.left;
+            for (size_t k = j; k < b.size() && b[k].left < span.right; k++) {
+                if (b[k].left > left) {
+                    result.push_back({left, b[k].left});
+                }
+                left = std::max(left, b[k].right);
+            }
+
+            if (left < span.right) {
+                result.push_back({left, span.right});
+            }
+        }
+        break;
+    }
+    case OpIntersect: {
+        size_t i = 0, j = 0;
+        while (i < a.size() && j < b.size()) {
+            int left = std::max(a[i].left, b[j].left);
+            int right = std::min(a[i].right, b[j].right);
+            if (left < right) {
+                result.push_back({left, right});
+            }
+
+            if (a[i].right < b[j].right) {
+                i++;
+            } else {
+                j++;
+            }
+        }
+        break;
+    }
+    }
+}
+
+void Region::Combine(const Region& other, Operation op) {
+    // The result can only change from one band to the next at the edge of a band in either region
+    std::vector<int> edges;
+    edges.reserve((m_rects.size() + other.m_rects.size()) * 2);
+    for (const Rect& r : m_rects) {
+        edges.push_back(r.top());
+        edges.push_back(r.bottom() + 1);
+    }
+    for (const Rect& r : other.m_rects) {
+        edges.push_back(r.top());
+        edges.push_back(r.bottom() + 1);
+    }
+
+    std::sort(edges.begin(), edges.end());
+    edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+    std::vector<Rect> result;
+    std::vector<Span> a, b, spans, previous;
+    size_t aIndex = 0, bIndex = 0;
+
+    size_t previousBand = 0; // Index of the first rect of the last band in result
+    int previousBottom = 0;  // Exclusive
+
+    for (size_t e = 0; e + 1 < edges.size(); e++) {
+        int top = edges[e];
+        int bottom = edges[e + 1];
+
+        BandSpans(m_rects, aIndex, top, a);
+        BandSpans(other.m_rects, bIndex, top, b);
+        CombineSpans(a, b, op, spans);
+
+        if (spans.empty()) {
+            continue;
+        }
+
+        // Grow the band above when it has the same spans
+        if (previousBand < result.size() && previousBottom == top && spans == previous) {
+            for (size_t i = previousBand; i < result.size(); i++) {
+                result[i].height += bottom - top;
+            }
+            previousBottom = bottom;
+            continue;
+        }
+
+        previousBand = result.size();
+        previousBottom = bottom;
+        for (const Span& span : spans) {
+            result.push_back({Vector2i{span.left, top}, Vector2i{span.right - span.left, bottom - top}});
+        }
+        previous.swap(spans);
+    }
+
+    m_rects.swap(result);
+    UpdateBounds();
+}
+
+void Region::UpdateBounds() {
+    if (m_rects.empty()) {
+        return;
+    }
+
+    int left = m_rects.front().left();
+    int right = m_rects.front().right();
+    for (const Rect& r : m_rects) {
+        left = std::min(left, r.left());
+        right = std::max(right, r.right());
+    }
+
+    m_bounds.x = left;
+    m_bounds.y = m_rects.front().top();
+    m_bounds.width = right - left + 1;
+    m_bounds.height = m_rects.back().bottom() - m_bounds.y + 1;
+}
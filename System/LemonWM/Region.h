@@ -0,0 +1,64 @@
+#pragma once
+
+#include <Lemon/Graphics/Rect.h>
+
+#include <stddef.h>
+#include <vector>
+
+// Whether two rects share any pixels
+inline bool RectsOverlap(const Rect& a, const Rect& b) {
+    return a.left() <= b.right() && b.left() <= a.right() && a.top() <= b.bottom() && b.top() <= a.bottom();
+}
+
+/////////////////////////////
+/// \brief Set of pixels stored as y-x banded rects, like X11 regions
+///
+/// Rects are sorted by top then left. Rects in a band share the same top and height
+/// and never overlap or touch, bands never overlap and touching bands with the same spans are merged.
+/////////////////////////////
+class Region {
+public:
+    Region() = default;
+    Region(const Rect& rect);
+
+    inline const std::vector<Rect>& Rects() const { return m_rects; }
+    inline bool IsEmpty() const { return m_rects.empty(); }
+    // Bounding box of the region, only meaningful when the region is not empty
+    inline const Rect& Bounds() const { return m_bounds; }
+
+    inline void Clear() { m_rects.clear(); }
+
+    bool Intersects(const Rect& rect) const;
+
+    void Union(const Region& other);
+    void Subtract(const Region& other);
+    void Intersect(const Region& other);
+
+    void Translate(const Vector2i& offset);
+
+private:
+    // Horizontal run of pixels within a band, right is exclusive
+    struct Span {
+        int left;
+        int right;
+
+        inline bool operator==(const Span& other) const { return left == other.left && right == other.right; }
+    };
+
+    enum Operation {
+        OpUnion,
+        OpSubtract,
+        OpIntersect,
+    };
+
+    // Spans of the band of rects covering y, index is kept between calls with increasing y
+    static void BandSpans(const std::vector<Rect>& rects, size_t& index, int y, std::vector<Span>& spans);
+    static void CombineSpans(const std::vector<Span>& a, const std::vector<Span>& b, Operation op,
+                             std::vector<Span>& result);
+
+    void Combine(const Region& other, Operation op);
+    void UpdateBounds();
+
+    std::vector<Rect> m_rects;
+    Rect m_bounds = {Vector2i{0, 0}, Vector2i{0, 0}};
+};
@@ -2,17 +2,19 @@
 
 #include <Lemon/Core/Keyboard.h>
 #include <Lemon/Core/Logger.h>
+#include <Lemon/Core/SharedMemory.h>
 #include <Lemon/Core/Shell.h>
 #include <Lemon/GUI/WindowServer.h>
 
 #include <cassert>
+#include <string.h>
 #include <unistd.h>
 
 WM* WM::m_instance = nullptr;
 
-WM::WM(const Surface& displaySurface)
+WM::WM(const Surface* displayPages, int pageCount)
     : m_messageInterface(Lemon::Handle(Lemon::CreateService("lemon.lemonwm")), "Instance", 512),
-      m_compositor(displaySurface), m_input({displaySurface.width, displaySurface.height}) {
+      m_compositor(displayPages, pageCount), m_input({displayPages[0].width, displayPages[0].height}) {
     assert(m_instance == nullptr);
 
     m_instance = this;
@@ -25,9 +27,15 @@ WM::WM(const Surface& displaySurface)
 }
 
 void WM::Run() {
+    // Messages from clients wake the WM when it is idle
+    Lemon::Waiter waiter;
+    waiter.WaitOnAll(&m_messageInterface);
+
     for (;;) {
-        clock_gettime(CLOCK_BOOTTIME, &m_lastUpdate);
+        timespec frameStart;
+        clock_gettime(CLOCK_BOOTTIME, &frameStart);
 
+        // Everything that arrived since the last frame is handled first, so it is all drawn in one frame
         Lemon::Handle client;
         Lemon::Message message;
         while (m_messageInterface.Poll(client, message)) {
@@ -37,19 +45,38 @@ void WM::Run() {
         }
 
         m_input.Poll();
-        m_compositor.Render();
+
+        // One message a frame for each window with events
+        for (WMWindow* win : m_windows) {
+            win->FlushEvents();
+        }
+
+        bool presented = m_compositor.Render();
 
         if (m_targetFramerate <= 0) {
+            if (!presented) {
+                waiter.Wait(WM_IDLE_POLL_INTERVAL);
+            }
             continue; // Do not limit framerate
         }
 
+        // Frames start on a fixed cadence, when the page flip waited for vertical blank
+        // the next is usually already due
         timespec timeSinceBoot;
         clock_gettime(CLOCK_BOOTTIME, &timeSinceBoot);
 
-        long timeDiff = (timeSinceBoot.tv_sec - m_lastUpdate.tv_sec) * 1000000000UL +
-                        (timeSinceBoot.tv_nsec - m_lastUpdate.tv_nsec);
-        if (timeDiff && timeDiff < m_targetFrameIntervalThreshold) {
-            usleep((m_targetFrameInterval - timeDiff) / 1000); // Sleep the remaining time
+        long remaining = m_targetFrameInterval - ((timeSinceBoot.tv_sec - frameStart.tv_sec) * 1000000000L +
+                                                  (timeSinceBoot.tv_nsec - frameStart.tv_nsec));
+        if (remaining <= 0) {
+            continue;
+        }
+
+        if (presented) {
+            usleep(remaining / 1000); // Anything arriving meanwhile waits for the next frame
+        } else {
+            // Nothing changed, so sleep until a client sends something
+            // or it is time to check input and the window buffers again
+            waiter.Wait(remaining / 1000);
         }
     }
 }
@@ -219,6 +246,17 @@ void WM::OnKeyUpdate(int key, bool isPressed) {
         Lemon::Shell::ToggleMenu();
     }
 
+    // Alt+F9 toggles the compositor HUD, Alt+F10 writes out the frames traced while it was shown
+    if (key == KEY_F9 && m_input.keyboard.alt && !isPressed) {
+        m_compositor.SetShouldDisplayFramerate(!m_compositor.ShouldDisplayFramerate());
+    } else if (key == KEY_F10 && m_input.keyboard.alt && !isPressed) {
+        if (int error = m_compositor.DumpTrace(COMPOSITOR_TRACE_PATH); error) {
+            Logger::Warning("Failed to write frame trace to {}: {}", COMPOSITOR_TRACE_PATH, strerror(error));
+        } else {
+            Logger::Debug("Wrote frame trace to {}", COMPOSITOR_TRACE_PATH);
+        }
+    }
+
     if (!m_activeWindow) {
         return;
     }
@@ -288,7 +326,7 @@ void WM::SetActiveWindow(WMWindow* win) {
         m_windows.remove(win);
         m_windows.push_back(win); // Place the new active window on top
 
-        m_compositor.InvalidateAll(); // Recalculate clipping
+        m_compositor.InvalidateClipping(win->GetRect()); // Recalculate clipping
         BroadcastWindowState(m_activeWindow);
     }
 }
@@ -301,7 +339,7 @@ void WM::DestroyWindow(WMWindow* win) {
     assert(win);
     m_windows.remove(win);
 
-    m_compositor.InvalidateAll();
+    m_compositor.InvalidateClipping(win->GetRect());
     BroadcastDestroyedWindow(win);
 
     delete win;
@@ -344,10 +382,11 @@ void WM::BroadcastDestroyedWindow(WMWindow* win) {
 }
 
 void WM::OnCreateWindow(const Lemon::Handle& client, int32_t x, int32_t y, int32_t width, int32_t height,
-                        uint32_t flags, const std::string& title) {
+                        uint32_t flags, std::string_view title) {
     Lemon::Logger::Debug("Creating window: '{}' {}x{} at {}x{}", title, width, height, x, y);
 
-    WMWindow* win = new WMWindow(client, NextWindowID(), title, Vector2i{x, y}, Vector2i{width, height}, flags);
+    WMWindow* win =
+        new WMWindow(client, NextWindowID(), std::string(title), Vector2i{x, y}, Vector2i{width, height}, flags);
 
     m_windows.push_back(win);
     SetActiveWindow(win);
@@ -366,14 +405,14 @@ void WM::OnDestroyWindow(const Lemon::Handle&, int64_t windowID) {
     DestroyWindow(win);
 }
 
-void WM::OnSetTitle(const Lemon::Handle&, int64_t windowID, const std::string& title) {
+void WM::OnSetTitle(const Lemon::Handle&, int64_t windowID, std::string_view title) {
     WMWindow* win = GetWindowFromID(windowID);
     if (!win) {
         Lemon::Logger::Warning("OnSetTitle: Invalid Window ID: {}", windowID);
         return;
     }
 
-    win->SetTitle(title);
+    win->SetTitle(std::string(title));
 }
 
 void WM::OnUpdateFlags(const Lemon::Handle&, int64_t windowID, uint32_t flags) {
@@ -428,7 +467,7 @@ void WM::OnMinimize(const Lemon::Handle&, int64_t windowID, bool minimized) {
 }
 
 void WM::OnDisplayContextMenu(const Lemon::Handle&, int64_t windowID, int32_t x, int32_t y,
-                              const std::string& entries) {
+                              std::string_view entries) {
     WMWindow* win = GetWindowFromID(windowID);
     if (!win) {
         Lemon::Logger::Warning("OnDisplayContextMenu: Invalid Window ID: {}", windowID);
@@ -445,15 +484,16 @@ void WM::OnDisplayContextMenu(const Lemon::Handle&, int64_t windowID, int32_t x,
     size_t oldPos = 0;
     size_t pos = 0;
     Vector2i entryPos = m_contextMenu.bounds.pos + Vector2i{5, 6};
-    while ((pos = entries.find(";", oldPos)) != std::string::npos) {
-        size_t cPos = entries.find(",", oldPos);
-        if (cPos >= pos || cPos == std::string::npos) {
-            m_contextMenu.entries.push_back(WMContextMenuEntry{
-                0, entries.substr(oldPos, pos), {entryPos, CONTEXT_MENU_ITEM_WIDTH, CONTEXT_MENU_ITEM_HEIGHT}});
+    while ((pos = entries.find(';', oldPos)) != std::string_view::npos) {
+        size_t cPos = entries.find(',', oldPos);
+        if (cPos >= pos || cPos == std::string_view::npos) {
+            m_contextMenu.entries.push_back(WMContextMenuEntry{0,
+                                                               std::string(entries.substr(oldPos, pos)),
+                                                               {entryPos, CONTEXT_MENU_ITEM_WIDTH, CONTEXT_MENU_ITEM_HEIGHT}});
         } else {
             m_contextMenu.entries.push_back(
-                WMContextMenuEntry{std::stoi(entries.substr(oldPos, cPos)),
-                                   entries.substr(cPos + 1, pos - (cPos + 1)),
+                WMContextMenuEntry{std::stoi(std::string(entries.substr(oldPos, cPos))),
+                                   std::string(entries.substr(cPos + 1, pos - (cPos + 1))),
                                    {entryPos, CONTEXT_MENU_ITEM_WIDTH, CONTEXT_MENU_ITEM_HEIGHT}});
         }
 
@@ -475,13 +515,23 @@ void WM::OnPong(const Lemon::Handle&, int64_t windowID) {
     }
 }
 
-void WM::OnSetSystemTheme(const Lemon::Handle&, const std::string& path) { m_systemTheme = path; }
+void WM::OnSetSystemTheme(const Lemon::Handle&, std::string_view path) {
+    m_systemTheme = path;
+
+    // Clients are sent the theme parsed here
+    GUI::Theme::Current().Update(m_systemTheme);
+}
 
 void WM::OnGetSystemTheme(const Lemon::Handle& client) {
     Lemon::Message m = Lemon::Message(LemonWMServer::ResponseGetSystemTheme, m_systemTheme);
     Lemon::Endpoint(client).Queue(m);
 }
 
+void WM::OnGetSystemThemeData(const Lemon::Handle& client) {
+    Lemon::Message m = Lemon::Message(LemonWMServer::ResponseGetSystemThemeData, GUI::Theme::Current().Serialize());
+    Lemon::Endpoint(client).Queue(m);
+}
+
 void WM::OnPeerDisconnect(const Lemon::Handle& client) {
     Lemon::Logger::Debug("Disconnected from {}", (long)client.get());
 
@@ -525,3 +575,102 @@ void WM::OnSubscribeToWindowEvents(const Lemon::Handle& client) {
 
     m_wmEventSubscribers.push_back(std::move(endp));
 }
+
+void WM::OnCommit(const Lemon::Handle&, int64_t windowID, std::string_view damage) {
+    WMWindow* win = GetWindowFromID(windowID);
+    if (!win) {
+        Lemon::Logger::Warning("OnCommit: Invalid Window ID: {}", windowID);
+        return;
+    }
+
+    win->Commit(damage);
+}
+
+void WM::OnSetOpaqueRegion(const Lemon::Handle&, int64_t windowID, std::string_view region) {
+    WMWindow* win = GetWindowFromID(windowID);
+    if (!win) {
+        Lemon::Logger::Warning("OnSetOpaqueRegion: Invalid Window ID: {}", windowID);
+        return;
+    }
+
+    win->SetOpaqueRegion(region);
+}
+
+void WM::OnGetImage(const Lemon::Handle& client, std::string_view path, int32_t width, int32_t height) {
+    std::string key = std::string(path) + ":" + std::to_string(width) + "x" + std::to_string(height);
+
+    auto it = m_sharedImages.find(key);
+    if (it == m_sharedImages.end()) {
+        SharedImage image = {.status = 0, .bufferKey = 0, .width = width, .height = height};
+        size_t size = static_cast<size_t>(width) * height * 4;
+
+        if (path.compare(0, strlen(WM_SHARED_IMAGE_PREFIX), WM_SHARED_IMAGE_PREFIX) ||
+            path.find("..") != std::string_view::npos) {
+            image.status = -EACCES;
+        } else if (width <= 0 || height <= 0) {
+            image.status = -EINVAL;
+        } else if (m_sharedImageBytes + size > WM_SHARED_IMAGE_CACHE_SIZE) {
+            image.status = -ENOMEM; // Clients decode it themselves
+        } else {
+            image.bufferKey = Lemon::CreateSharedMemory(size, SMEM_FLAGS_SHARED);
+
+            Surface surface = {.width = width,
+                               .height = height,
+                               .depth = 32,
+                               .buffer = reinterpret_cast<uint8_t*>(Lemon::MapSharedMemory(image.bufferKey))};
+            // New shared memory is already zeroed by the kernel
+
+            image.status = Graphics::LoadImage(std::string(path).c_str(), 0, 0, width, height, &surface, false);
+            if (image.status) {
+                Lemon::UnmapSharedMemory(surface.buffer, image.bufferKey);
+                Lemon::DestroySharedMemory(image.bufferKey);
+                image.bufferKey = 0;
+            } else {
+                m_sharedImageBytes += size;
+            }
+        }
+
+        it = m_sharedImages.emplace(std::move(key), image).first;
+    }
+
+    const SharedImage& image = it->second;
+    Lemon::EndpointQueue(client.get(), LemonWMServer::ResponseGetImage,
+                         LemonWMServer::GetImageResponse{image.status, image.bufferKey, image.width, image.height});
+}
+
+void WM::OnCreateVideoSurface(const Lemon::Handle& client, int64_t windowID, uint32_t format, int32_t width,
+                              int32_t height) {
+    WMWindow* win = GetWindowFromID(windowID);
+    if (!win) {
+        Lemon::Logger::Warning("OnCreateVideoSurface: Invalid Window ID: {}", windowID);
+        Lemon::EndpointQueue(client.get(), LemonWMServer::ResponseCreateVideoSurface,
+                             LemonWMServer::CreateVideoSurfaceResponse{-ENOENT, 0});
+        return;
+    }
+
+    int64_t bufferKey = 0;
+    int32_t status = win->CreateVideoSurface(static_cast<int>(format), width, height, bufferKey);
+    Lemon::EndpointQueue(client.get(), LemonWMServer::ResponseCreateVideoSurface,
+                         LemonWMServer::CreateVideoSurfaceResponse{status, bufferKey});
+}
+
+void WM::OnDestroyVideoSurface(const Lemon::Handle&, int64_t windowID) {
+    WMWindow* win = GetWindowFromID(windowID);
+    if (!win) {
+        Lemon::Logger::Warning("OnDestroyVideoSurface: Invalid Window ID: {}", windowID);
+        return;
+    }
+
+    win->DestroyVideoSurface();
+}
+
+void WM::OnPresentVideoFrame(const Lemon::Handle&, int64_t windowID, int32_t x, int32_t y, int32_t width,
+                             int32_t height) {
+    WMWindow* win = GetWindowFromID(windowID);
+    if (!win) {
+        Lemon::Logger::Warning("OnPresentVideoFrame: Invalid Window ID: {}", windowID);
+        return;
+    }
+
+    win->PresentVideoFrame({x, y, width, height});
+}
@@ -9,10 +9,20 @@
 #include <Lemon/Services/lemon.lemonwm.h>
 
 #include <list>
+#include <map>
 
 #define CONTEXT_MENU_ITEM_WIDTH 100
 #define CONTEXT_MENU_ITEM_HEIGHT 20
 
+// How often input and window buffers are checked in us when idle without a framerate limit,
+// neither wakes the WM by itself
+#define WM_IDLE_POLL_INTERVAL 1000
+
+// Only theme resources are decoded for other processes, as any process can map the shared memory
+#define WM_SHARED_IMAGE_PREFIX "/system/lemon/resources/"
+// Limit in bytes of the decoded images shared with clients, which are kept until the WM exits
+#define WM_SHARED_IMAGE_CACHE_SIZE (16 * 1024 * 1024)
+
 struct WMContextMenuEntry {
     int id;
     std::string text;
@@ -48,7 +58,6 @@ public:
         m_targetFramerate = fps;
         if (fps > 0) {
             m_targetFrameInterval = 1000000000 / fps;
-            m_targetFrameIntervalThreshold = m_targetFrameInterval / 3 * 2;
         }
     }
 
@@ -57,7 +66,7 @@ public:
 private:
     static WM* m_instance;
 
-    WM(const Surface& displaySurface);
+    WM(const Surface* displayPages, int pageCount);
 
     WMWindow* GetWindowFromID(int64_t id);
 
@@ -69,29 +78,36 @@ private:
     void BroadcastDestroyedWindow(WMWindow* win);
 
     void OnCreateWindow(const Lemon::Handle& client, int32_t x, int32_t y, int32_t width, int32_t height,
-                        uint32_t flags, const std::string& title) override;
+                        uint32_t flags, std::string_view title) override;
     void OnDestroyWindow(const Lemon::Handle& client, int64_t windowID) override;
-    void OnSetTitle(const Lemon::Handle& client, int64_t windowID, const std::string& title) override;
+    void OnSetTitle(const Lemon::Handle& client, int64_t windowID, std::string_view title) override;
     void OnUpdateFlags(const Lemon::Handle& client, int64_t windowID, uint32_t flags) override;
     void OnRelocate(const Lemon::Handle& client, int64_t windowID, int32_t x, int32_t y) override;
     void OnGetPosition(const Lemon::Handle& client, int64_t windowID) override;
     void OnResize(const Lemon::Handle& client, int64_t windowID, int32_t width, int32_t height) override;
     void OnMinimize(const Lemon::Handle& client, int64_t windowID, bool minimized) override;
     void OnDisplayContextMenu(const Lemon::Handle& client, int64_t windowID, int32_t x, int32_t y,
-                              const std::string& entries) override;
+                              std::string_view entries) override;
     void OnPong(const Lemon::Handle& client, int64_t windowID) override;
 
-    void OnSetSystemTheme(const Lemon::Handle& client, const std::string& path) override;
+    void OnSetSystemTheme(const Lemon::Handle& client, std::string_view path) override;
     void OnGetSystemTheme(const Lemon::Handle& client) override;
+    void OnGetSystemThemeData(const Lemon::Handle& client) override;
 
     void OnPeerDisconnect(const Lemon::Handle& client) override;
     void OnGetScreenBounds(const Lemon::Handle& client) override;
     void OnReloadConfig(const Lemon::Handle& client) override;
     void OnSubscribeToWindowEvents(const Lemon::Handle& client) override;
-
-    timespec m_lastUpdate;
-    long m_targetFramerate = 0;              // Used for framerate limiter
-    long m_targetFrameIntervalThreshold = 0; // The maximum time difference to thread sleep
+    void OnCommit(const Lemon::Handle& client, int64_t windowID, std::string_view damage) override;
+    void OnSetOpaqueRegion(const Lemon::Handle& client, int64_t windowID, std::string_view region) override;
+    void OnGetImage(const Lemon::Handle& client, std::string_view path, int32_t width, int32_t height) override;
+    void OnCreateVideoSurface(const Lemon::Handle& client, int64_t windowID, uint32_t format, int32_t width,
+                              int32_t height) override;
+    void OnDestroyVideoSurface(const Lemon::Handle& client, int64_t windowID) override;
+    void OnPresentVideoFrame(const Lemon::Handle& client, int64_t windowID, int32_t x, int32_t y, int32_t width,
+                             int32_t height) override;
+
+    long m_targetFramerate = 0; // Used for framerate limiter
     long m_targetFrameInterval = 0;
 
     std::string m_systemTheme = "/system/lemon/resources/themes/default.json";
@@ -120,4 +136,15 @@ private:
     } m_contextMenu;
 
     std::list<std::unique_ptr<LemonWMClientEndpoint>> m_wmEventSubscribers;
+
+    // Image decoded into shared memory once for every process, failed loads are kept too
+    struct SharedImage {
+        int32_t status;
+        int64_t bufferKey;
+        int32_t width;
+        int32_t height;
+    };
+
+    std::map<std::string, SharedImage> m_sharedImages; // Keyed by path and size
+    size_t m_sharedImageBytes = 0;
 };
\ No newline at end of file
@@ -4,8 +4,29 @@
 
 #include <Lemon/Core/SharedMemory.h>
 
+#include <errno.h>
+#include <mutex>
+
 WindowTheme WMWindow::theme;
 
+// FreeType renders glyphs into a slot shared by everyone using the font
+static std::mutex titleFontMutex;
+
+// Draw the part of a window button within clip
+static void DrawButtonClip(const Rect& button, const Rect& source, const Rect& clip, Surface* surface) {
+    int left = std::max(button.left(), clip.left());
+    int top = std::max(button.top(), clip.top());
+    int right = std::min(button.right(), clip.right());
+    int bottom = std::min(button.bottom(), clip.bottom());
+    if (left > right || top > bottom) {
+        return;
+    }
+
+    surface->AlphaBlit(&WMWindow::theme.windowButtons, {left, top},
+                       {Vector2i{source.x + left - button.x, source.y + top - button.y},
+                        Vector2i{right - left + 1, bottom - top + 1}});
+}
+
 WMWindow::WMWindow(const Handle& endpoint, int64_t id, const std::string& title, const Vector2i& pos,
                    const Vector2i& size, int flags)
     : LemonWMClientEndpoint(endpoint), m_id(id), m_title(title), m_size(size), m_rect(Rect{pos, size}) {
@@ -15,9 +36,11 @@ WMWindow::WMWindow(const Handle& endpoint, int64_t id, const std::string& title,
     UpdateWindowRects();
 
     SetFlags(flags);
-    WM::Instance().Compositor().InvalidateAll();
+    WM::Instance().Compositor().InvalidateClipping(m_rect);
 }
 
+WMWindow::~WMWindow() { ReleaseVideoBuffer(); }
+
 void WMWindow::DrawDecorationClip(const Rect& clip, Surface* surface) {
     if (!ShouldDrawDecoration()) {
         return;
@@ -27,6 +50,7 @@ void WMWindow::DrawDecorationClip(const Rect& clip, Surface* surface) {
         Graphics::DrawRoundedRect(m_titlebarRect, theme.titlebarColour, theme.cornerRadius, theme.cornerRadius, 0, 0,
                                   surface, clip);
 
+        std::scoped_lock lockFont(titleFontMutex);
         Graphics::DrawString(m_title.c_str(), m_titlebarRect.pos.x + theme.cornerRadius + 2,
                              m_titlebarRect.pos.y + (m_titlebarRect.size.y - Graphics::DefaultFont()->pixelHeight) / 2,
                              {0xff, 0xff, 0xff, 0xff}, surface, clip);
@@ -47,29 +71,74 @@ void WMWindow::DrawDecorationClip(const Rect& clip, Surface* surface) {
         minimizeButtonSourceRect.y += theme.windowButtons.height / 2;
     }
 
-    if (clip.Contains(m_closeRect)) {
-        surface->AlphaBlit(&theme.windowButtons, m_closeRect.pos, closeButtonSourceRect);
+    // The compositor may split the buttons between clips
+    DrawButtonClip(m_closeRect, closeButtonSourceRect, clip, surface);
+    DrawButtonClip(m_minimizeRect, minimizeButtonSourceRect, clip, surface);
+}
+
+void WMWindow::BeginDraw() {
+    m_buffer->drawing = 1;
+    m_windowSurface.buffer = m_buffer->currentBuffer ? (m_buffer2) : (m_buffer1);
+
+    if (m_videoBuffer) {
+        m_videoBuffer->drawing = 1;
+        m_currentVideoFrame = m_videoBuffer->currentFrame % VIDEO_BUFFER_FRAMES;
     }
+}
+
+void WMWindow::EndDraw() {
+    m_buffer->drawing = 0;
 
-    if (clip.Contains(m_minimizeRect)) {
-        surface->AlphaBlit(&theme.windowButtons, m_minimizeRect.pos, minimizeButtonSourceRect);
+    if (m_videoBuffer) {
+        m_videoBuffer->drawing = 0;
     }
 }
 
-void WMWindow::DrawClip(const Rect& clip, Surface* surface) {
-    m_buffer->drawing = 1;
-    m_windowSurface.buffer = m_buffer->currentBuffer ? (m_buffer2) : (m_buffer1);
+void WMWindow::DrawClip(const Rect& clip, Surface* surface, bool blend) {
+    if (!m_videoBuffer || m_videoRect.width <= 0 || m_videoRect.height <= 0) {
+        DrawContentClip(clip, surface, blend);
+        return;
+    }
 
+    Rect video = m_videoRect;
+    video.pos += m_contentRect.pos;
+
+    int left = std::max(video.left(), clip.left());
+    int top = std::max(video.top(), clip.top());
+    int right = std::min(video.right(), clip.right());
+    int bottom = std::min(video.bottom(), clip.bottom());
+    if (left > right || top > bottom) {
+        DrawContentClip(clip, surface, blend);
+        return;
+    }
+
+    // Only draw the content around the video, which is opaque
+    if (top > clip.top()) {
+        DrawContentClip({clip.x, clip.y, clip.width, top - clip.top()}, surface, blend);
+    }
+    if (bottom < clip.bottom()) {
+        DrawContentClip({clip.x, bottom + 1, clip.width, clip.bottom() - bottom}, surface, blend);
+    }
+    if (left > clip.left()) {
+        DrawContentClip({clip.x, top, left - clip.left(), bottom - top + 1}, surface, blend);
+    }
+    if (right < clip.right()) {
+        DrawContentClip({right + 1, top, clip.right() - right, bottom - top + 1}, surface, blend);
+    }
+
+    Graphics::DrawVideoFrame(m_videoFrames[m_currentVideoFrame], video, surface,
+                             {left, top, right - left + 1, bottom - top + 1});
+}
+
+void WMWindow::DrawContentClip(const Rect& clip, Surface* surface, bool blend) {
     Rect clipCopy = clip;
     clipCopy.pos -= m_contentRect.pos;
 
-    if(IsTransparent()){
+    if (blend) {
         surface->AlphaBlit(&m_windowSurface, clip.pos, clipCopy);
     } else {
         surface->Blit(&m_windowSurface, clip.pos, clipCopy);
     }
-
-    m_buffer->drawing = 0;
 }
 
 int WMWindow::GetResizePoint(Vector2i absolutePosition) const {
@@ -101,24 +170,181 @@ Vector2i WMWindow::NewWindowSizeFromRect(const Rect& rect) const {
 }
 
 void WMWindow::Relocate(int x, int y) {
+    Rect oldRect = m_rect;
     m_rect.pos = {x, y};
 
     UpdateWindowRects();
 
-    WM::Instance().Compositor().InvalidateAll(); // Window position changed, recaclulate clipping
+    // Window position changed, recalculate clipping where it was and where it is
+    WM::Instance().Compositor().InvalidateClipping(oldRect);
+    WM::Instance().Compositor().InvalidateClipping(m_rect);
 }
 
 void WMWindow::Resize(int width, int height) {
-    long e = Lemon::DestroySharedMemory(m_bufferKey);
-    assert(!e);
-
+    Rect oldRect = m_rect;
     m_size = {width, height};
 
     CreateWindowBuffer();
     Queue(Lemon::Message(LemonWMServer::ResponseResize, LemonWMServer::ResizeResponse{m_bufferKey}));
     UpdateWindowRects();
 
-    WM::Instance().Compositor().InvalidateAll(); // Window size changed, recaclulate clipping
+    // Window size changed, recalculate clipping
+    WM::Instance().Compositor().InvalidateClipping(oldRect);
+    WM::Instance().Compositor().InvalidateClipping(m_rect);
+}
+
+void WMWindow::Commit(std::string_view damage) {
+    for (size_t i = 0; i + sizeof(GUI::WindowRect) <= damage.length(); i += sizeof(GUI::WindowRect)) {
+        GUI::WindowRect d;
+        memcpy(&d, damage.data() + i, sizeof(GUI::WindowRect));
+
+        InvalidateContent(Rect{Vector2i{d.x, d.y}, Vector2i{d.width, d.height}});
+    }
+}
+
+void WMWindow::InvalidateContent(Rect rect) {
+    Rect content = {Vector2i{0, 0}, m_size};
+    if (rect.width <= 0 || rect.height <= 0 || !RectsOverlap(rect, content)) {
+        return;
+    }
+
+    // Clip to the window content
+    rect.left(std::max(rect.left(), 0));
+    rect.top(std::max(rect.top(), 0));
+    rect.right(std::min(rect.right(), content.right()));
+    rect.bottom(std::min(rect.bottom(), content.bottom()));
+
+    rect.pos = rect.pos + m_contentRect.pos;
+    WM::Instance().Compositor().InvalidateWindowRect(this, rect);
+}
+
+void WMWindow::SetOpaqueRegion(std::string_view region) {
+    m_opaqueRegion.Clear();
+    for (size_t i = 0; i + sizeof(GUI::WindowRect) <= region.length(); i += sizeof(GUI::WindowRect)) {
+        GUI::WindowRect r;
+        memcpy(&r, region.data() + i, sizeof(GUI::WindowRect));
+
+        m_opaqueRegion.Union(Rect{Vector2i{r.x, r.y}, Vector2i{r.width, r.height}});
+    }
+
+    WM::Instance().Compositor().InvalidateClipping(m_contentRect); // What is drawn beneath changes
+}
+
+Region WMWindow::GetOpaqueRegion() const {
+    if (!IsTransparent() || m_opaqueRegion.IsEmpty()) {
+        return {};
+    }
+
+    Region opaque = m_opaqueRegion;
+    opaque.Intersect(Rect{Vector2i{0, 0}, m_size});
+    opaque.Translate(m_contentRect.pos);
+    return opaque;
+}
+
+int WMWindow::CreateVideoSurface(int format, int width, int height, int64_t& bufferKey) {
+    if (width <= 0 || height <= 0 || width > WINDOW_MAX_VIDEO_SIZE || height > WINDOW_MAX_VIDEO_SIZE) {
+        return -EINVAL;
+    }
+
+    size_t frameSize = Graphics::VideoFrameSize(format, width, height);
+    if (!frameSize) {
+        return -EINVAL;
+    }
+
+    DestroyVideoSurface();
+
+    // Each frame aligned to 32 bytes
+    size_t headerSize = (sizeof(GUI::VideoBuffer) + 0x1F) & (~0x1FULL);
+    frameSize = (frameSize + 0x1F) & (~0x1FULL);
+
+    m_videoBufferKey = Lemon::CreateSharedMemory(headerSize + frameSize * VIDEO_BUFFER_FRAMES, SMEM_FLAGS_SHARED);
+    if (m_videoBufferKey <= 0) {
+        m_videoBufferKey = 0;
+        return -ENOMEM;
+    }
+    m_videoBuffer = reinterpret_cast<GUI::VideoBuffer*>(Lemon::MapSharedMemory(m_videoBufferKey));
+
+    memset(m_videoBuffer, 0, sizeof(GUI::VideoBuffer));
+    m_videoBuffer->format = format;
+    m_videoBuffer->width = width;
+    m_videoBuffer->height = height;
+
+    // The client can write anything to the header, so only the current frame is read back from it
+    for (int i = 0; i < VIDEO_BUFFER_FRAMES; i++) {
+        m_videoBuffer->frameOffsets[i] = headerSize + frameSize * i;
+        m_videoFrames[i] = Graphics::VideoFrameLayout(format, width, height,
+                                                      reinterpret_cast<uint8_t*>(m_videoBuffer) + headerSize + frameSize * i);
+    }
+    m_currentVideoFrame = 0;
+
+    // Nothing is shown until the first frame is presented
+    m_videoRect = {0, 0, 0, 0};
+
+    bufferKey = m_videoBufferKey;
+    return 0;
+}
+
+void WMWindow::DestroyVideoSurface() {
+    if (!m_videoBuffer) {
+        return;
+    }
+
+    InvalidateContent(m_videoRect); // Show the content beneath again
+    ReleaseVideoBuffer();
+}
+
+void WMWindow::ReleaseVideoBuffer() {
+    if (!m_videoBuffer) {
+        return;
+    }
+
+    Lemon::UnmapSharedMemory(m_videoBuffer, m_videoBufferKey);
+    Lemon::DestroySharedMemory(m_videoBufferKey);
+
+    m_videoBuffer = nullptr;
+    m_videoBufferKey = 0;
+    m_videoRect = {0, 0, 0, 0};
+}
+
+void WMWindow::PresentVideoFrame(const Rect& rect) {
+    if (!m_videoBuffer) {
+        return;
+    }
+
+    if (rect.pos != m_videoRect.pos || rect.size != m_videoRect.size) {
+        InvalidateContent(m_videoRect);
+        m_videoRect = rect;
+    }
+
+    InvalidateContent(m_videoRect);
+}
+
+void WMWindow::SendEvent(const Lemon::LemonEvent& event) {
+    timespec now;
+    clock_gettime(CLOCK_BOOTTIME, &now);
+    uint64_t timestamp = now.tv_sec * 1000000 + now.tv_nsec / 1000;
+
+    if (event.event == Lemon::EventMouseMoved && !m_pendingEvents.empty() &&
+        m_pendingEvents.back().event == Lemon::EventMouseMoved) {
+        m_pendingEvents.back() = {event.event, event.data, timestamp};
+        return;
+    }
+
+    if (m_pendingEvents.size() >= WINDOW_MAX_BATCHED_EVENTS) {
+        FlushEvents();
+    }
+
+    m_pendingEvents.push_back({event.event, event.data, timestamp});
+}
+
+void WMWindow::FlushEvents() {
+    if (m_pendingEvents.empty()) {
+        return;
+    }
+
+    LemonWMClientEndpoint::SendEvents(m_id, std::string_view(reinterpret_cast<const char*>(m_pendingEvents.data()),
+                                                             m_pendingEvents.size() * sizeof(Lemon::WindowEvent)));
+    m_pendingEvents.clear();
 }
 
 void WMWindow::SetTitle(const std::string& title) {
@@ -135,9 +361,12 @@ void WMWindow::SetFlags(int flags) {
 
     const int invalidatingFlags = GUI::WindowFlag_NoDecoration | GUI::WindowFlag_Transparent;
     if ((oldFlags & invalidatingFlags) != (m_flags & invalidatingFlags)) {
+        Rect oldRect = m_rect;
         UpdateWindowRects();
 
-        WM::Instance().Compositor().InvalidateAll(); // We will need to recalculate clipping
+        // We will need to recalculate clipping
+        WM::Instance().Compositor().InvalidateClipping(oldRect);
+        WM::Instance().Compositor().InvalidateClipping(m_rect);
     }
 }
 
@@ -154,7 +383,7 @@ void WMWindow::Minimize(bool minimized) {
 
     m_minimized = minimized;
 
-    WM::Instance().Compositor().InvalidateAll(); // Window state changed, recaclulate clipping
+    WM::Instance().Compositor().InvalidateClipping(m_rect); // Window state changed, recalculate clipping
     WM::Instance().BroadcastWindowState(this);
 }
 
@@ -189,18 +418,41 @@ void WMWindow::UpdateWindowRects() {
 void WMWindow::CreateWindowBuffer() {
     // Size of each buffer for the window
     // Aligned to 32 bytes
-    unsigned bufferSize = (m_size.x * m_size.y * 4 + 0x1F) & (~0x1FULL);
-    if(m_bufferKey){
-        Lemon::UnmapSharedMemory(m_buffer, m_bufferKey);
+    uint64_t headerSize = ((sizeof(GUI::WindowBuffer) + 0x1F) & (~0x1FULL));
+    uint64_t bufferSize = (static_cast<uint64_t>(m_size.x) * m_size.y * 4 + 0x1F) & (~0x1FULL);
+    uint64_t size = headerSize + bufferSize * 2;
+
+    // Keep the buffer whilst the window fits in it, growing it in place where we can.
+    // Grow with some headroom so an interactive resize does not grow it on every step.
+    bool reuse = m_bufferKey && size <= m_bufferCommitted;
+    if (m_bufferKey && !reuse && size <= m_bufferReserved) {
+        uint64_t committed = std::min(m_bufferReserved, size + size / 4);
+        if (!Lemon::GrowSharedMemory(m_bufferKey, committed)) {
+            m_bufferCommitted = committed;
+            reuse = true;
+        }
     }
 
-    m_bufferKey = Lemon::CreateSharedMemory(((sizeof(GUI::WindowBuffer) + 0x1F) & (~0x1FULL)) + bufferSize * 2,
-                                            SMEM_FLAGS_SHARED);
-    m_buffer = reinterpret_cast<GUI::WindowBuffer*>(Lemon::MapSharedMemory(m_bufferKey));
+    if (!reuse) {
+        if (m_bufferKey) {
+            // Destroyed once the client has unmapped it too
+            Lemon::UnmapSharedMemory(m_buffer, m_bufferKey);
+        }
+
+        // Reserve enough for the window to cover the screen, only the committed part uses memory
+        Vector2i screen = WM::Instance().Compositor().GetScreenBounds();
+        m_bufferReserved = std::max(
+            size, headerSize + ((static_cast<uint64_t>(screen.x) * screen.y * 4 + 0x1F) & ~uint64_t{0x1F}) * 2);
+        m_bufferCommitted = size;
+
+        m_bufferKey = Lemon::ReserveSharedMemory(m_bufferCommitted, m_bufferReserved, SMEM_FLAGS_SHARED);
+        m_buffer = reinterpret_cast<GUI::WindowBuffer*>(Lemon::MapSharedMemory(m_bufferKey));
+    }
 
+    // The old contents are left in a reused buffer, the client redraws everything after resizing
     memset(m_buffer, 0, sizeof(GUI::WindowBuffer));
-    m_buffer->buffer1Offset = ((sizeof(GUI::WindowBuffer) + 0x1F) & (~0x1FULL));
-    m_buffer->buffer2Offset = ((sizeof(GUI::WindowBuffer) + 0x1F) & (~0x1FULL)) + bufferSize;
+    m_buffer->buffer1Offset = headerSize;
+    m_buffer->buffer2Offset = headerSize + bufferSize;
 
     m_buffer1 = reinterpret_cast<uint8_t*>(m_buffer) + m_buffer->buffer1Offset;
     m_buffer2 = reinterpret_cast<uint8_t*>(m_buffer) + m_buffer->buffer2Offset;
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "Region.h"
+
 #include <Lemon/GUI/Window.h>
 #include <Lemon/Graphics/Types.h>
 
@@ -9,6 +11,8 @@
 #define MIN_WINDOW_RESIZE_WIDTH 50
 #define MIN_WINDOW_RESIZE_HEIGHT 50
 
+#define WINDOW_MAX_VIDEO_SIZE 4096 // Largest width or height of a video surface
+
 using namespace Lemon;
 
 struct WindowTheme {
@@ -37,9 +41,16 @@ class WMWindow : public LemonWMClientEndpoint {
 public:
     WMWindow(const Handle& endpoint, int64_t id, const std::string& title, const Vector2i& pos, const Vector2i& size,
              int flags);
+    ~WMWindow();
 
+    // Both may be called from several compositor threads at once, each with its own clip
     void DrawDecorationClip(const Rect& clip, Surface* surface);
-    void DrawClip(const Rect& clip, Surface* surface);
+    // Must be between BeginDraw and EndDraw, the video is drawn over the content
+    void DrawClip(const Rect& clip, Surface* surface, bool blend);
+
+    // Keep the client from swapping buffers or video frames whilst the window is drawn
+    void BeginDraw();
+    void EndDraw();
 
     inline int64_t GetID() const { return m_id; }
     inline int GetFlags() const { return m_flags; }
@@ -88,9 +99,49 @@ public:
         return isDirty;
     }
 
-    inline void SendEvent(const Lemon::LemonEvent& event) {
-        LemonWMClientEndpoint::SendEvent(m_id, event.event, event.data);
-    }
+    /////////////////////////////
+    /// \brief Redraw what the client changed in its last frame
+    ///
+    /// \param damage WindowRects relative to the window content
+    /////////////////////////////
+    void Commit(std::string_view damage);
+
+    /////////////////////////////
+    /// \brief Set the parts of a transparent window the client says are always opaque
+    ///
+    /// \param region WindowRects relative to the window content
+    /////////////////////////////
+    void SetOpaqueRegion(std::string_view region);
+    // Opaque region in screen coordinates, clipped to the content. Empty unless the window is transparent
+    Region GetOpaqueRegion() const;
+
+    /////////////////////////////
+    /// \brief Create a video surface for the client to present frames to, replacing any existing one
+    ///
+    /// Frames are scaled and converted straight onto the render surface as the window is drawn,
+    /// skipping the window buffer.
+    ///
+    /// \return 0 on success, otherwise a negative error code
+    /////////////////////////////
+    int CreateVideoSurface(int format, int width, int height, int64_t& bufferKey);
+    void DestroyVideoSurface();
+
+    /////////////////////////////
+    /// \brief Show the current video frame
+    ///
+    /// \param rect Where to scale the frame to, relative to the window content
+    /////////////////////////////
+    void PresentVideoFrame(const Rect& rect);
+
+    /////////////////////////////
+    /// \brief Queue an event for the client
+    ///
+    /// Events are sent in a batch once a frame. Mouse movement replaces
+    /// the previous event if it was also mouse movement, so the rest stay in order.
+    /////////////////////////////
+    void SendEvent(const Lemon::LemonEvent& event);
+    // Send the events queued this frame
+    void FlushEvents();
 
     void Relocate(int x, int y);
     inline void Relocate(const Vector2i& pos) { Relocate(pos.x, pos.y); };
@@ -103,22 +154,40 @@ public:
 
     static WindowTheme theme;
 
-    // Used when invalidating transparent windows
-    std::list<struct BackgroundClipRect*> occludedBackgroundRects;
-    std::list<struct WindowClipRect*> occludedWindowRects;
-    std::list<struct WindowClipRect*> occludedWindowDecorationRects;
+    // Parts of the window not covered by opaque windows above, kept by the compositor
+    Region contentClip;
+    Region decorationClip;
 
 private:
     void UpdateWindowRects();
     void CreateWindowBuffer();
+    void ReleaseVideoBuffer();
 
-    // Shared memory key for buffer
+    // Redraw rect of the content, relative to the content
+    void InvalidateContent(Rect rect);
+    // Draw the window buffer within clip
+    void DrawContentClip(const Rect& clip, Surface* surface, bool blend);
+
+    // Shared memory key for buffer, the same key is kept across resizes whilst the window fits
     int64_t m_bufferKey = 0;
+    uint64_t m_bufferCommitted = 0; // Bytes of the buffer backed by memory
+    uint64_t m_bufferReserved = 0;  // Bytes the buffer can be grown to without a new key
     GUI::WindowBuffer* m_buffer;
     uint8_t* m_buffer1;
     uint8_t* m_buffer2;
     Surface m_windowSurface;
 
+    Region m_opaqueRegion; // Relative to the content
+
+    // Video over the content, latched by BeginDraw
+    int64_t m_videoBufferKey = 0;
+    GUI::VideoBuffer* m_videoBuffer = nullptr;
+    Graphics::VideoFrame m_videoFrames[VIDEO_BUFFER_FRAMES]; // Laid out here, never read from the shared header
+    int m_currentVideoFrame = 0;
+    Rect m_videoRect = {0, 0, 0, 0}; // Relative to the content
+
+    std::vector<Lemon::WindowEvent> m_pendingEvents;
+
     int64_t m_id;
 
     std::string m_title;
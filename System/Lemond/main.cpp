@@ -1,62 +1,178 @@
+#include <Lemon/System/IPC.h>
+#include <Lemon/System/KernelObject.h>
 #include <Lemon/System/Spawn.h>
 #include <Lemon/System/Util.h>
 #include <Lemon/Core/JSON.h>
 #include <Lemon/Core/SHA.h>
 
+#include <fcntl.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <sys/wait.h>
 
+#include <algorithm>
+#include <list>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
-#include <list>
 
 struct Service {
 	std::string name;
 	std::string target;
+	std::string after; // Name of the service this one is started after, empty if none
+	std::string provides; // Name of the kernel service it creates, registered at boot when set
+	bool onDemand = false; // Started by the first connection to provides rather than at boot
 
 	enum {
 		StateStarting,
 		StateRunning,
 		StateError,
 		StateStopped,
+		StateWaiting, // Registered, waiting for a connection to start it
 	} state = StateStarting;
 
 	pid_t pid = -1;
+	handle_t handle = 0; // Registered kernel service
+
+	std::vector<Service*> dependents; // Services started once this one has been
+	uint64_t spawnStart = 0; // Microseconds since boot
+	uint64_t spawnEnd = 0;
 };
 
-std::multimap<std::string, Service> waitingServices;
 std::list<Service> services;
+std::mutex servicesLock; // Held when changing the state or pid of a service once boot services are started
+
+int bootTrace = -1; // Kernel boot timeline, see Kernel/include/BootTrace.h
+
+// Add a point to the boot timeline in /dev/boottrace
+void TraceBoot(const char* event, const std::string& name = ""){
+	if(bootTrace < 0){
+		return;
+	}
+
+	std::string line = std::string("lemond: ") + event + (name.empty() ? "" : " ") + name + "\n";
+	write(bootTrace, line.c_str(), line.length());
+}
+
+static uint64_t NowUs(){
+	timespec t;
+	clock_gettime(CLOCK_BOOTTIME, &t);
+	return t.tv_sec * 1000000ULL + t.tv_nsec / 1000;
+}
+
+// Start a service, then start everything waiting on it in parallel
+void StartService(Service* srv){
+	char* const argv[] = { (char*) srv->name.c_str() };
+
+	std::unique_lock lock(servicesLock);
+
+	srv->spawnStart = NowUs();
+	pid_t pid = lemon_spawn(srv->target.c_str(), 1, argv, 1);
+	srv->spawnEnd = NowUs();
 
-void StartService(Service& srv){
-	char* const argv[] = { (char*) srv.name.c_str() };
-	pid_t pid = lemon_spawn(srv.target.c_str(), 1, argv, 1);
 	if(pid <= 0){
-		printf("[lemond] Error: Failed to start '%s'!\n", srv.name.c_str());
+		printf("[lemond] Error: Failed to start '%s'!\n", srv->name.c_str());
+		srv->state = Service::StateError;
+		return; // Its dependents are not started either
+	}
+
+	srv->pid = pid;
+	srv->state = Service::StateRunning;
+	lock.unlock();
+
+	TraceBoot("started", srv->name);
+
+	std::vector<std::thread> threads;
+	for(Service* dependent : srv->dependents){
+		threads.emplace_back(StartService, dependent);
+	}
+
+	for(auto& thread : threads){
+		thread.join();
+	}
+}
+
+// Start a service once something connects to the kernel service it provides
+void ActivateService(Service* srv){
+	if(long ret = Lemon::WaitForKernelObject(srv->handle, 0); ret){
+		printf("[lemond] Error: Failed waiting on '%s': %ld\n", srv->name.c_str(), ret);
 		return;
 	}
 
-	srv.pid = pid;
+	TraceBoot("activated", srv->name);
+	StartService(srv);
+}
+
+// Register the kernel service provided by srv so connections to it wait for the service to start.
+// On demand services are then started by the first connection.
+bool RegisterService(Service* srv){
+	handle_t handle = Lemon::RegisterService(srv->provides.c_str());
+	if(handle <= 0){
+		printf("[lemond] Warning: Failed to register '%s' for '%s': %d\n", srv->provides.c_str(), srv->name.c_str(), handle);
+		return false;
+	}
+
+	srv->handle = handle;
+	if(srv->onDemand){
+		srv->state = Service::StateWaiting;
+		std::thread(ActivateService, srv).detach();
+	}
+
+	return true;
+}
+
+// Print when each service was started, relative to the start of lemond
+void PrintBootTimeline(uint64_t start){
+	std::vector<Service*> started;
+	for(auto& srv : services){
+		if(srv.spawnStart){
+			started.push_back(&srv);
+		}
+	}
+
+	std::sort(started.begin(), started.end(), [](Service* l, Service* r){ return l->spawnStart < r->spawnStart; });
 
-	auto range = waitingServices.equal_range(srv.name);
-	for(auto it = range.first; it != range.second; it++){
-		services.push_back(it->second);
-		StartService(it->second);
+	printf("[lemond] Boot timeline (lemond started %.2f ms after boot):\n", start / 1000.0);
+	for(Service* srv : started){
+		printf("[lemond]   %8.2f ms  %-16s %s (spawn took %.2f ms)\n", (srv->spawnStart - start) / 1000.0,
+			srv->name.c_str(), (srv->state == Service::StateRunning) ? "started" : "failed",
+			(srv->spawnEnd - srv->spawnStart) / 1000.0);
+	}
+	for(auto& srv : services){
+		if(srv.state == Service::StateWaiting){
+			printf("[lemond]   %-16s will be started when '%s' is used\n", srv.name.c_str(), srv.provides.c_str());
+		}
+	}
+	for(auto& srv : services){
+		if(!srv.spawnStart && srv.state == Service::StateStarting){
+			auto dependency = std::find_if(services.begin(), services.end(), [&srv](Service& s){ return s.name == srv.after; });
+			if(dependency == services.end() || !dependency->onDemand){
+				printf("[lemond]   Warning: '%s' was never started, are its dependencies circular?\n", srv.name.c_str());
+			}
+		}
 	}
+	printf("[lemond] Boot services started in %.2f ms\n", (NowUs() - start) / 1000.0);
 }
 
 int main(int, char**){
+	uint64_t start = NowUs();
+
+	bootTrace = open("/dev/boottrace", O_WRONLY | O_CLOEXEC);
+	TraceBoot("running");
+
 	setenv("HOME", "/system", 1); // Default home
 	setenv("PATH", "/system/bin:/system/lemon:/initrd", 1); // Default path
 
 	Lemon::JSONParser confParser = Lemon::JSONParser("/system/lemon/lemond.json");
 	auto json = confParser.Parse();
     if(json.IsObject()){
-        std::map<Lemon::JSONKey, Lemon::JSONValue>& values = *json.data.object;
+        Lemon::JSONObject values = json.AsObject();
 
-		if(auto it = values.find("environment"); it != values.end() && it->second.IsArray()){
-			std::vector<Lemon::JSONValue>& env = *it->second.data.array;
+		if(auto it = values.find("environment"); it != values.end() && it->value.IsArray()){
+			Lemon::JSONArray env = it->value.AsArray();
 
 			for(auto& v : env){
 				std::string str;
@@ -112,14 +228,14 @@ int main(int, char**){
 
 		auto root = json.Parse();
 		if(root.IsObject()){
-			auto& values = *root.data.object;
+			Lemon::JSONObject values = root.AsObject();
 
 			std::string name;
 			std::string target;
-			if(auto it = values.find("target"); it == values.end() || !it->second.IsString()){ // Check for valid name field
+			if(auto it = values.find("target"); it == values.end() || !it->value.IsString()){ // Check for valid name field
 				printf("[Lemond] Warning: Empty or invalid target for '%s'\n", ent->d_name);
 				continue;
-			} else if(auto it = values.find("name"); it == values.end() || !it->second.IsString()){ // Check for valid target field
+			} else if(auto it = values.find("name"); it == values.end() || !it->value.IsString()){ // Check for valid target field
 				printf("[Lemond] Warning: Empty or invalid name for '%s'\n", ent->d_name);
 				continue;
 			}
@@ -128,12 +244,22 @@ int main(int, char**){
 
 			srv.name = values.at("name").AsString();
 			srv.target = values.at("target").AsString();
-			if(auto it = values.find("after"); it != values.end() && it->second.IsString()){ // The service is waiting for another
-				std::string after = it->second.AsString();
-				waitingServices.insert({ std::move(after), std::move(srv) });
-			} else {
-				services.push_back(std::move(srv));
+			if(auto it = values.find("after"); it != values.end() && it->value.IsString()){ // The service is waiting for another
+				srv.after = it->value.AsString();
+			}
+			if(auto it = values.find("provides"); it != values.end() && it->value.IsString()){
+				srv.provides = it->value.AsString();
+			}
+			if(auto it = values.find("ondemand"); it != values.end() && it->value.IsBool()){
+				srv.onDemand = it->value.AsBool();
 			}
+
+			if(srv.onDemand && srv.provides.empty()){
+				printf("[Lemond] Warning: '%s' is started on demand but does not provide a service, starting at boot\n", ent->d_name);
+				srv.onDemand = false;
+			}
+
+			services.push_back(std::move(srv));
 		}
 	}
 
@@ -143,20 +269,74 @@ int main(int, char**){
 		return 2;
 	}
 
+	// Register the kernel services first so that connecting to one waits for it to be started,
+	// rather than failing because the service providing it has not been started yet
 	for(auto& srv : services){
-		StartService(srv);
+		if(!srv.provides.empty() && !RegisterService(&srv)){
+			srv.onDemand = false;
+		}
 	}
 
+	// Services that do not wait on another are all started at once,
+	// the rest are started as soon as the service they are waiting on has been
+	std::vector<Service*> independent;
+	for(auto& srv : services){
+		if(srv.onDemand && srv.after.empty()){
+			continue; // Started by ActivateService
+		} else if(srv.after.empty()){
+			independent.push_back(&srv);
+			continue;
+		}
+
+		auto dependency = std::find_if(services.begin(), services.end(), [&srv](Service& s){ return s.name == srv.after; });
+		if(dependency == services.end() || &*dependency == &srv){
+			printf("[lemond] Warning: '%s' is waiting on unknown service '%s', starting anyway\n", srv.name.c_str(), srv.after.c_str());
+			if(!srv.onDemand){
+				independent.push_back(&srv);
+			}
+		} else if(srv.onDemand){
+			printf("[lemond] Warning: '%s' is started on demand, ignoring 'after'\n", srv.name.c_str());
+		} else {
+			dependency->dependents.push_back(&srv);
+		}
+	}
+
+	std::vector<std::thread> threads;
+	for(Service* srv : independent){
+		threads.emplace_back(StartService, srv);
+	}
+
+	for(auto& thread : threads){
+		thread.join();
+	}
+
+	TraceBoot("boot services started");
+	PrintBootTimeline(start);
+
+	close(bootTrace);
+	bootTrace = -1;
+
 	while(1){
 		if(pid_t pid = waitpid(-1, nullptr, 0); pid > 0){
+			std::scoped_lock lock(servicesLock);
 			for(auto it = services.begin(); it != services.end(); it++){
 				Service& svc = *it;
 				if(svc.pid == pid){
 					printf("[lemond] Warning: '%s' (pid %d) closed.\n", svc.name.c_str(), svc.pid);
+					svc.state = Service::StateStopped;
+					svc.pid = -1;
+
+					if(svc.handle > 0){
+						// Closing the handle removes the kernel service so that it can be created again
+						Lemon::DestroyKObject(svc.handle);
+						svc.handle = 0;
+					}
+
+					if(svc.onDemand){
+						RegisterService(&svc); // Started again by the next connection
+					}
+					break;
 				}
-				
-				services.erase(it);
-				break;
 			}
 		}
 	}
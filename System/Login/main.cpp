@@ -65,34 +65,34 @@ int main(int, char**){
 
 	auto json = cfgParser.Parse();
 	if(json.IsObject()){
-        std::map<Lemon::JSONKey, Lemon::JSONValue>& root = *json.data.object;
+        Lemon::JSONObject root = json.AsObject();
 
-		if(auto it = root.find("users"); it != root.end() && it->second.IsArray()){
-			for(Lemon::JSONValue& v : *it->second.data.array){
+		if(auto it = root.find("users"); it != root.end() && it->value.IsArray()){
+			for(Lemon::JSONValue& v : it->value.AsArray()){
 				if(v.IsObject()){
 					User u;
-					std::map<Lemon::JSONKey, Lemon::JSONValue>& values = *v.data.object;
+					Lemon::JSONObject values = v.AsObject();
 
-					if(auto it = values.find("name"); it != values.end() && it->second.IsString()){
-						u.username = it->second.AsString();
+					if(auto it = values.find("name"); it != values.end() && it->value.IsString()){
+						u.username = it->value.AsString();
 					} else {
 						continue;
 					}
 
-					if(auto it = values.find("hash"); it != values.end() && it->second.IsString()){
-						u.hash = it->second.AsString();
+					if(auto it = values.find("hash"); it != values.end() && it->value.IsString()){
+						u.hash = it->value.AsString();
 					} else {
 						continue;
 					}
 
-					if(auto it = values.find("uid"); it != values.end() && it->second.IsNumber()){
-						u.uid = it->second.AsSignedNumber();
+					if(auto it = values.find("uid"); it != values.end() && it->value.IsNumber()){
+						u.uid = it->value.AsSignedNumber();
 					} else {
 						continue;
 					}
 
-					if(auto it = values.find("gid"); it != values.end() && it->second.IsNumber()){
-						u.gid = it->second.AsSignedNumber();
+					if(auto it = values.find("gid"); it != values.end() && it->value.IsNumber()){
+						u.gid = it->value.AsSignedNumber();
 					} else {
 						continue;
 					}
@@ -18,6 +18,7 @@ enum {
 };
 
 enum {
+    DHCPOptionPad = 0,
     DHCPOptionSubnetMask = 1, // Request Subnet Mask
     DHCPOptionDefaultGateway = 3, // Request gateway
     DHCPOptionDNS = 6, // Request DNS servers
@@ -27,6 +28,9 @@ enum {
     DHCPOptionMessageType = 53,
     DHCPOptionServerIdentifier = 54,
     DHCPOptionParameterRequestList = 55,
+    DHCPOptionRenewalTime = 58, // T1
+    DHCPOptionRebindingTime = 59, // T2
+    DHCPOptionEnd = 255,
 };
 
 enum {
@@ -1,277 +1,387 @@
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 
 #include <arpa/inet.h>
 #include <net/if.h>
 
-#include <linux/route.h>
 #include <linux/sockios.h>
 
+#include <Lemon/System/ABI/Network.h>
+
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
-#include <math.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <string>
-#include <string_view>
 #include <vector>
 
 #include "dhcp.h"
 
+#define DHCP_RETRANSMIT_MIN 4000000ULL  // First retransmission after 4 seconds, doubled each time (RFC 2131 4.1)
+#define DHCP_RETRANSMIT_MAX 64000000ULL // Up to 64 seconds
+#define DHCP_REQUEST_ATTEMPTS 4         // REQUESTs sent for an offer before starting again with a DISCOVER
+#define DHCP_RENEW_MIN 60000000ULL      // Shortest wait between REQUESTs when renewing or rebinding
+#define DHCP_DEFAULT_LEASE 86400        // Lease time in seconds if the server gives none
+
 sockaddr_in dhcpClientAddress;
 sockaddr_in dhcpServerAddress;
-int dhcpResponseTimeout = 8; // 8 seconds
 
-void SendDHCPMessage(int sock, DHCPHeader& header, std::vector<void*>& options) {
-    uint8_t* headerOptions = header.options;
+static uint64_t NowUs() {
+    timespec t;
+    clock_gettime(CLOCK_BOOTTIME, &t);
+    return t.tv_sec * 1000000ULL + t.tv_nsec / 1000;
+}
 
-    for (void* p : options) {
-        DHCPOption<0>* opt = (DHCPOption<0>*)p;
+static void PrintAddress(const char* name, uint32_t address) {
+    printf("%s: %d.%d.%d.%d\n", name, address & 0xff, (address >> 8) & 0xff, (address >> 16) & 0xff,
+           (address >> 24) & 0xff);
+}
+
+static uint8_t* PutOption(uint8_t* p, uint8_t code, const void* data, uint8_t length) {
+    p[0] = code;
+    p[1] = length;
+    memcpy(p + 2, data, length);
+
+    return p + 2 + length;
+}
 
-        memcpy(headerOptions, opt, opt->length + sizeof(DHCPOption<0>));
+// Everything we use from a DHCP reply, addresses are in network byte order
+struct DHCPReply {
+    int type = 0;
+    uint32_t yourIP = 0;
+    uint32_t serverID = 0;
+    uint32_t subnetMask = 0;
+    uint32_t defaultGateway = 0;
+    uint32_t dnsServer = 0;
+    uint32_t leaseTime = DHCP_DEFAULT_LEASE; // Seconds
+    uint32_t renewalTime = 0;
+    uint32_t rebindingTime = 0;
+};
 
-        headerOptions += opt->length + sizeof(DHCPOption<0>);
+static bool ParseReply(DHCPHeader& header, size_t length, DHCPReply& reply) {
+    if (length < offsetof(DHCPHeader, options) || header.op != BootPReply || header.htype != DHCPHardwareTypeEthernet ||
+        header.cookie != DHCP_MAGIC_COOKIE) {
+        return false;
     }
 
-    *headerOptions = 0xFF; // End mark
-    headerOptions++;
+    reply.yourIP = header.yourIP;
+    reply.serverID = header.serverIP;
+
+    size_t end = std::min(length - offsetof(DHCPHeader, options), sizeof(header.options));
+    size_t i = 0;
+    while (i < end && header.options[i] != DHCPOptionEnd) {
+        if (header.options[i] == DHCPOptionPad) {
+            i++;
+            continue;
+        }
+
+        if (i + 2 > end || i + 2 + header.options[i + 1] > end) {
+            break; // Truncated
+        }
+
+        uint8_t code = header.options[i];
+        uint8_t optionLength = header.options[i + 1];
+        const uint8_t* data = header.options + i + 2;
 
-    sendto(sock, &header, sizeof(DHCPHeader), 0, (sockaddr*)&dhcpServerAddress, sizeof(sockaddr_in));
+        uint32_t value = 0;
+        if (optionLength >= 4) {
+            memcpy(&value, data, 4); // Only the first address of a list is used
+        }
+
+        switch (code) {
+        case DHCPOptionMessageType:
+            if (optionLength == 1) {
+                reply.type = data[0];
+            }
+            break;
+        case DHCPOptionSubnetMask:
+            reply.subnetMask = value;
+            break;
+        case DHCPOptionDefaultGateway:
+            reply.defaultGateway = value;
+            break;
+        case DHCPOptionDNS:
+            reply.dnsServer = value;
+            break;
+        case DHCPOptionServerIdentifier:
+            reply.serverID = value;
+            break;
+        case DHCPOptionIPLeaseTime:
+            reply.leaseTime = ntohl(value);
+            break;
+        case DHCPOptionRenewalTime:
+            reply.renewalTime = ntohl(value);
+            break;
+        case DHCPOptionRebindingTime:
+            reply.rebindingTime = ntohl(value);
+            break;
+        }
+
+        i += 2 + optionLength;
+    }
+
+    return reply.type != 0;
 }
 
+// Acquires and keeps a DHCP lease for one interface.
+// Nothing blocks, the interface is driven by replies arriving on its socket and by its deadline passing.
 class NetworkInterface {
-    std::string_view name;
-    int sock;
-    bool leaseAcquired = false;
-
 public:
-    uint32_t interfaceIP;
-    uint32_t defaultGateway;
-    uint32_t subnetMask;
-    uint32_t dnsServer;
-
-    enum InterfaceState {
-        InterfaceUninitialized,
-        InterfaceInitialized,
+    enum State {
+        StateSelecting,  // DISCOVER sent, waiting for an OFFER
+        StateRequesting, // REQUEST sent for an offer, waiting for an ACK
+        StateBound,      // Lease acquired, waiting for T1
+        StateRenewing,   // REQUEST sent to the server that gave us the lease
+        StateRebinding,  // REQUEST broadcast to any server
     };
 
-    std::vector<uint32_t> dnsServers;
-    NetworkInterface(const char* ifName, int ifSocket) {
-        name = strdup(ifName);
-        sock = ifSocket;
-
+    NetworkInterface(const char* ifName, int ifSocket) : name(ifName), sock(ifSocket) {
         printf("Initializing interface %s!\n", ifName);
+
+        ifreq req;
+        memset(&req, 0, sizeof(ifreq));
+        strncpy(req.ifr_name, name.c_str(), IFNAMSIZ - 1);
+        if (ioctl(sock, SIOCGIFHWADDR, &req)) {
+            fprintf(stderr, "Failed to retrieve MAC address for %s: %s\n", name.c_str(), strerror(errno));
+        }
+        memcpy(mac, req.ifr_hwaddr.sa_data, 6);
     }
 
-    void AcquireLease() {
-        timespec t;
-        clock_gettime(CLOCK_BOOTTIME, &t);
+    ~NetworkInterface() { close(sock); }
 
-        DHCPHeader header;
-        memset(&header, 0, sizeof(DHCPHeader));
+    inline int Socket() const { return sock; }
+    inline uint64_t Deadline() const { return deadline; }
 
-        header.op = BootPRequest;
-        header.htype = DHCPHardwareTypeEthernet;
-        header.hlen = 6; // MAC addresses are 6 bytes long
-        header.hops = 0;
-        header.xID = rand() * ((t.tv_sec << 1) ^ t.tv_nsec); // Generate random id
-        header.secs = 0;
-        header.flags = DHCP_FLAG_BROADCAST;
-        header.clientIP = 0; // Don't worry about endianess 0.0.0.0 is symmetrical
-        header.yourIP = 0;
-        header.serverIP = 0;
-        header.gatewayIP = 0;
-
-        struct ifreq req;
-        strncpy(req.ifr_name, name.data(), 16);
-        if(ioctl(sock, SIOCGIFHWADDR, &req)) {
-			fprintf(stderr, "Failed to retrieve MAC address for %s: %s\n", this->name.data(), strerror(errno));
-			return;
-		}
-        memcpy(header.clientAddress, req.ifr_hwaddr.sa_data, 6);
+    // Start again with a DISCOVER
+    void Start() {
+        state = StateSelecting;
+        xID = rand();
+        attempts = 0;
 
-        header.cookie = DHCP_MAGIC_COOKIE;
+        Send(DHCPMessageTypeDiscover, dhcpServerAddress);
+        ScheduleRetransmit();
+    }
 
-        std::vector<void*> options;
+    // Handle every reply waiting on the socket
+    void OnReceive() {
+        for (;;) {
+            DHCPHeader header;
+            sockaddr_in address;
+            socklen_t addressLength = sizeof(sockaddr_in);
+
+            ssize_t len =
+                recvfrom(sock, &header, sizeof(DHCPHeader), 0, reinterpret_cast<sockaddr*>(&address), &addressLength);
+            if (len < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    fprintf(stderr, "DHCP recvfrom error on %s: %s\n", name.c_str(), strerror(errno));
+                }
+                return;
+            }
 
-        DHCPOption<1> dhcpMessage;
-        dhcpMessage.length = 1;
-        dhcpMessage.optionCode = DHCPOptionMessageType;
-        dhcpMessage.data[0] = DHCPMessageTypeDiscover;
+            DHCPReply reply;
+            if (!ParseReply(header, len, reply) || header.xID != xID || memcmp(header.clientAddress, mac, 6)) {
+                continue; // Not for us
+            }
 
-        DHCPOption<3> dhcpParameters;
-        dhcpParameters.length = 3;
-        dhcpParameters.optionCode = DHCPOptionParameterRequestList;
-        dhcpParameters.data[0] = DHCPOptionSubnetMask;
-        dhcpParameters.data[1] = DHCPOptionDefaultGateway;
-        dhcpParameters.data[2] = DHCPOptionDNS;
+            OnReply(reply);
+        }
+    }
 
-        options = {&dhcpMessage, &dhcpParameters};
+    // The deadline has passed
+    void OnTimer(uint64_t now) {
+        switch (state) {
+        case StateSelecting:
+            Send(DHCPMessageTypeDiscover, dhcpServerAddress);
+            ScheduleRetransmit();
+            break;
+        case StateRequesting:
+            if (++attempts >= DHCP_REQUEST_ATTEMPTS) {
+                Start(); // The server has gone quiet, look for another
+                break;
+            }
 
-        SendDHCPMessage(sock, header, options);
+            Send(DHCPMessageTypeRequest, dhcpServerAddress);
+            ScheduleRetransmit();
+            break;
+        case StateBound:
+            state = StateRenewing;
+            [[fallthrough]];
+        case StateRenewing:
+            if (now >= rebindAt) {
+                state = StateRebinding;
+                OnTimer(now);
+                break;
+            }
 
-        DHCPHeader recvHeader;
-        sockaddr_in recvAddr;
-        socklen_t recvLen = sizeof(sockaddr_in);
+            Send(DHCPMessageTypeRequest, Unicast(lease.serverID));
+            ScheduleRenewal(now, rebindAt);
+            break;
+        case StateRebinding:
+            if (now >= expiresAt) {
+                fprintf(stderr, "DHCP lease for %s expired\n", name.c_str());
 
-        ssize_t len =
-            recvfrom(sock, &recvHeader, sizeof(DHCPHeader), 0, reinterpret_cast<sockaddr*>(&recvAddr), &recvLen);
-        while (len < 0) {
-            if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                fprintf(stderr, "Failed to acquire DHCP lease for %s, recvfrom error: %s\n", this->name.data(),
-                        strerror(errno));
-                return;
+                lease = DHCPReply{};
+                Apply();
+                Start();
+                break;
             }
 
-            timespec currentTime;
-            clock_gettime(CLOCK_BOOTTIME, &currentTime);
-            if (currentTime.tv_sec - t.tv_sec >= dhcpResponseTimeout) {
-                fprintf(stderr, "Failed to acquire DHCP lease for %s: timed out waiting for OFFER after %i seconds\n",
-                        this->name.data(), dhcpResponseTimeout);
+            Send(DHCPMessageTypeRequest, dhcpServerAddress);
+            ScheduleRenewal(now, expiresAt);
+            break;
+        }
+    }
+
+private:
+    void OnReply(const DHCPReply& reply) {
+        if (state == StateSelecting) {
+            if (reply.type != DHCPMessageTypeOffer) {
                 return;
             }
 
-            usleep(100000); // Wait 100 ms for response
-
-            len = recvfrom(sock, &recvHeader, sizeof(DHCPHeader), 0, reinterpret_cast<sockaddr*>(&recvAddr), &recvLen);
-        }
+            offer = reply;
+            state = StateRequesting;
+            attempts = 0;
 
-        if (recvHeader.cookie != DHCP_MAGIC_COOKIE) {
-            fprintf(stderr, "Failed to acquire DHCP lease for %s, invalid magic cookie: %x\n", this->name.data(),
-                    (uint32_t)recvHeader.cookie);
+            Send(DHCPMessageTypeRequest, dhcpServerAddress);
+            ScheduleRetransmit();
             return;
+        } else if (state == StateBound) {
+            return; // Nothing outstanding
         }
 
-        if (recvHeader.htype != 1) { // Check for Ethernet HTYPE
-            fprintf(stderr, "Failed to acquire DHCP lease for %s, invalid HTYPE: %x\n", this->name.data(),
-                    recvHeader.htype);
-            return;
-        }
+        if (reply.type == DHCPMessageTypeNotAcknowledged) {
+            fprintf(stderr, "DHCP server refused the lease for %s\n", name.c_str());
 
-        if (recvHeader.op != BootPReply) { // Check for Ethernet HTYPE
-            fprintf(stderr, "Failed to acquire DHCP lease for %s, expected BOOTPREPLY, received opcode %x\n",
-                    this->name.data(), recvHeader.op);
+            if (lease.yourIP) {
+                lease = DHCPReply{};
+                Apply();
+            }
+            Start();
+            return;
+        } else if (reply.type != DHCPMessageTypeAcknowledge) {
             return;
         }
 
-        clock_gettime(CLOCK_BOOTTIME, &t);
+        bool changed = reply.yourIP != lease.yourIP || reply.subnetMask != lease.subnetMask ||
+                       reply.defaultGateway != lease.defaultGateway;
+        lease = reply;
 
-        header.clientIP = recvHeader.yourIP; // Request the IP from the offer
-        header.serverIP = recvHeader.serverIP;
+        uint64_t now = NowUs();
+        uint64_t leaseUs = lease.leaseTime * 1000000ULL;
+        renewAt = now + (lease.renewalTime ? lease.renewalTime * 1000000ULL : leaseUs / 2);
+        rebindAt = now + (lease.rebindingTime ? lease.rebindingTime * 1000000ULL : leaseUs * 7 / 8);
+        expiresAt = now + leaseUs;
 
-        header.flags = 0;
+        state = StateBound;
+        deadline = renewAt;
 
-        DHCPOption<0>* option = reinterpret_cast<DHCPOption<0>*>(recvHeader.options);
-        while (option->optionCode != 0xff /* end marker */ &&
-               reinterpret_cast<void*>(option) < recvHeader.options + 312) {
-            switch (option->optionCode) {
-            case DHCPOptionSubnetMask:
-                if (option->length == 4 /* IP address length */) {
-                    subnetMask = *reinterpret_cast<uint32_t*>(option->data);
-                }
-                break;
-            case DHCPOptionDefaultGateway:
-                if (option->length == 4 /* IP address length */) {
-                    defaultGateway = *reinterpret_cast<uint32_t*>(option->data);
-                }
-                break;
-            case DHCPOptionDNS:
-                if (option->length == 4 /* IP address length */) {
-                    dnsServer = *reinterpret_cast<uint32_t*>(option->data);
-                }
-                break;
-            }
+        if (changed) {
+            printf("received dhcp response:\n");
+            PrintAddress("IP Address", lease.yourIP);
+            PrintAddress("Subnet Mask", lease.subnetMask);
+            PrintAddress("Default Gateway", lease.defaultGateway);
+            PrintAddress("DNS Server", lease.dnsServer);
 
-            option = reinterpret_cast<DHCPOption<0>*>(option->data + option->length);
+            Apply();
         }
+    }
 
-        dhcpMessage.length = 1;
-        dhcpMessage.optionCode = DHCPOptionMessageType;
-        dhcpMessage.data[0] = DHCPMessageTypeRequest;
-
-        DHCPOption<4> dhcpIPRequest;
-        dhcpIPRequest.length = 4;
-        dhcpIPRequest.optionCode = DHCPOptionRequestIPAddress;
-        *reinterpret_cast<uint32_t*>(dhcpIPRequest.data) = recvHeader.yourIP; // Request the IP from the offer
+    // Push the address, subnet mask and gateway to the kernel in one go
+    void Apply() {
+        InterfaceConfiguration config;
+        memset(&config, 0, sizeof(InterfaceConfiguration));
 
-        DHCPOption<4> dhcpServer;
-        dhcpServer.length = 4;
-        dhcpServer.optionCode = DHCPOptionServerIdentifier;
-        *reinterpret_cast<uint32_t*>(dhcpServer.data) = recvHeader.serverIP; // Use the server IP from the offer
+        strncpy(config.name, name.c_str(), sizeof(config.name) - 1);
+        config.address = lease.yourIP;
+        config.subnetMask = lease.subnetMask;
+        config.gateway = lease.defaultGateway;
 
-        options = {&dhcpMessage, &dhcpIPRequest, &dhcpServer};
+        if (ioctl(sock, SIOCSIFCONFIG, &config)) {
+            fprintf(stderr, "Failed to configure %s: %s\n", name.c_str(), strerror(errno));
+        }
+    }
 
-        SendDHCPMessage(sock, header, options);
+    void Send(int type, const sockaddr_in& destination) {
+        DHCPHeader header = {};
 
-        len = recvfrom(sock, &recvHeader, sizeof(DHCPHeader), 0, reinterpret_cast<sockaddr*>(&recvAddr), &recvLen);
-        while (len < 0) {
-            if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                fprintf(stderr, "Failed to acquire DHCP lease for %s, recvfrom error: %s\n", this->name.data(),
-                        strerror(errno));
-                return;
-            }
+        header.op = BootPRequest;
+        header.htype = DHCPHardwareTypeEthernet;
+        header.hlen = 6; // MAC addresses are 6 bytes long
+        header.xID = xID;
+        header.cookie = DHCP_MAGIC_COOKIE;
+        memcpy(header.clientAddress, mac, 6);
 
-            timespec currentTime;
-            clock_gettime(CLOCK_BOOTTIME, &currentTime);
-            if (currentTime.tv_sec - t.tv_sec >= dhcpResponseTimeout) {
-                fprintf(stderr, "Failed to acquire DHCP lease for %s: timed out waiting for ACK after %i seconds\n",
-                        this->name.data(), dhcpResponseTimeout);
-                return;
-            }
+        uint8_t messageType = type;
+        uint8_t* p = PutOption(header.options, DHCPOptionMessageType, &messageType, 1);
 
-            usleep(100000); // Wait 100 ms for response
+        if (state == StateSelecting || state == StateRequesting) {
+            header.flags = DHCP_FLAG_BROADCAST; // We have no address to receive a unicast reply on
+        } else {
+            header.clientIP = lease.yourIP; // Renewing the lease we hold
+        }
 
-            len = recvfrom(sock, &recvHeader, sizeof(DHCPHeader), 0, reinterpret_cast<sockaddr*>(&recvAddr), &recvLen);
+        if (state == StateRequesting) {
+            p = PutOption(p, DHCPOptionRequestIPAddress, &offer.yourIP, 4); // Request the IP from the offer
+            p = PutOption(p, DHCPOptionServerIdentifier, &offer.serverID, 4);
         }
 
-        interfaceIP = recvHeader.yourIP;
-        leaseAcquired = true;
-
-        printf("received dhcp response:\n\
-IP Address: %d.%d.%d.%d\n\
-Subnet Mask: %d.%d.%d.%d\n\
-Default Gateway: %d.%d.%d.%d\n\
-DNS Server: %d.%d.%d.%d\n",
-               interfaceIP & 0xff, (interfaceIP >> 8) & 0xff, (interfaceIP >> 16) & 0xff, (interfaceIP >> 24) & 0xff,
-               subnetMask & 0xff, (subnetMask >> 8) & 0xff, (subnetMask >> 16) & 0xff, (subnetMask >> 24) & 0xff,
-               defaultGateway & 0xff, (defaultGateway >> 8) & 0xff, (defaultGateway >> 16) & 0xff,
-               (defaultGateway >> 24) & 0xff, dnsServer & 0xff, (dnsServer >> 8) & 0xff, (dnsServer >> 16) & 0xff,
-               (dnsServer >> 24) & 0xff);
-    }
+        const uint8_t parameters[] = {DHCPOptionSubnetMask, DHCPOptionDefaultGateway, DHCPOptionDNS,
+                                      DHCPOptionIPLeaseTime};
+        p = PutOption(p, DHCPOptionParameterRequestList, parameters, sizeof(parameters));
 
-    void ConfigureInterface() {
-        if (!leaseAcquired) {
-            AcquireLease();
+        *p = DHCPOptionEnd;
 
-            if (!leaseAcquired) {
-                return; // Failed to acquire lease
-            }
+        if (sendto(sock, &header, sizeof(DHCPHeader), 0, reinterpret_cast<const sockaddr*>(&destination),
+                   sizeof(sockaddr_in)) < 0) {
+            fprintf(stderr, "Failed to send DHCP message on %s: %s\n", name.c_str(), strerror(errno));
         }
+    }
 
-        ifreq ifRequest;
-
-        strncpy(ifRequest.ifr_name, name.data(), 16);
+    // Exponential backoff with up to a second either way so clients booted together spread out
+    void ScheduleRetransmit() {
+        uint64_t delay = std::min(DHCP_RETRANSMIT_MIN << std::min(attempts, 4U), DHCP_RETRANSMIT_MAX);
+        if (state == StateSelecting) {
+            attempts++;
+        }
 
-        ifRequest.ifr_netmask.sa_family = AF_INET;
-        reinterpret_cast<sockaddr_in*>(&ifRequest.ifr_netmask)->sin_addr.s_addr = subnetMask;
-        ioctl(sock, SIOCSIFNETMASK, &ifRequest);
+        deadline = NowUs() + delay - 1000000 + (rand() % 2000000);
+    }
 
-        rtentry route;
-        route.rt_gateway.sa_family = AF_INET;
-        route.rt_flags = RTF_GATEWAY | RTF_UP;
-        reinterpret_cast<sockaddr_in*>(&route.rt_gateway)->sin_addr.s_addr = defaultGateway;
-        route.rt_dev = const_cast<char*>(name.data());
-        ioctl(sock, SIOCADDRT, &route);
+    // Half of the time left until limit, but no less than a minute (RFC 2131 4.4.5)
+    void ScheduleRenewal(uint64_t now, uint64_t limit) {
+        deadline = std::min<uint64_t>(limit, now + std::max<uint64_t>((limit - now) / 2, DHCP_RENEW_MIN));
+    }
 
-        ifRequest.ifr_addr.sa_family = AF_INET;
-        reinterpret_cast<sockaddr_in*>(&ifRequest.ifr_addr)->sin_addr.s_addr = interfaceIP;
-        ioctl(sock, SIOCSIFADDR, &ifRequest);
+    static sockaddr_in Unicast(uint32_t server) {
+        sockaddr_in address = dhcpServerAddress;
+        address.sin_addr.s_addr = server;
+        return address;
     }
 
-    ~NetworkInterface() { close(sock); }
+    std::string name;
+    int sock;
+    uint8_t mac[6] = {};
+
+    State state = StateSelecting;
+    uint32_t xID = 0;
+    unsigned attempts = 0;
+    uint64_t deadline = 0;
+
+    DHCPReply offer;
+    DHCPReply lease; // yourIP is 0 until a lease has been acquired
+
+    uint64_t renewAt = 0;
+    uint64_t rebindAt = 0;
+    uint64_t expiresAt = 0;
 };
 
 std::vector<NetworkInterface*> interfaces;
@@ -282,6 +392,8 @@ int main() {
         return 1;
     }
 
+    srand(NowUs());
+
     dhcpClientAddress.sin_family = AF_INET;
     dhcpClientAddress.sin_addr.s_addr = INADDR_ANY;
     dhcpClientAddress.sin_port = htons(68);
@@ -290,9 +402,17 @@ int main() {
     dhcpServerAddress.sin_family = AF_INET;
     dhcpServerAddress.sin_port = htons(67);
 
+    int epoll = epoll_create1(0);
+    if (epoll < 0) {
+        perror("Error creating epoll");
+        return 1;
+    }
+
     while (dirent* entry = readdir(netFS)) {
         if (strcmp(entry->d_name, "..") == 0 || strcmp(entry->d_name, ".") == 0) {
             continue; // Ignore . and ..
+        } else if (strcmp(entry->d_name, "lo") == 0) {
+            continue; // Loopback is configured by the kernel
         }
 
         int sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
@@ -314,12 +434,62 @@ int main() {
             continue;
         }
 
-        interfaces.push_back(new NetworkInterface(entry->d_name, sock));
+        NetworkInterface* netIf = new NetworkInterface(entry->d_name, sock);
+
+        epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = netIf;
+        if (epoll_ctl(epoll, EPOLL_CTL_ADD, sock, &event)) {
+            fprintf(stderr, "Error watching interface '%s': %s\n", entry->d_name, strerror(errno));
+
+            delete netIf;
+            continue;
+        }
+
+        interfaces.push_back(netIf);
     }
+    closedir(netFS);
 
+    if (interfaces.empty()) {
+        return 0;
+    }
+
+    // All interfaces acquire their leases at the same time
     for (auto& netIf : interfaces) {
-        netIf->ConfigureInterface();
+        netIf->Start();
+    }
+
+    epoll_event events[8];
+    for (;;) {
+        uint64_t now = NowUs();
+        uint64_t next = UINT64_MAX;
+        for (auto& netIf : interfaces) {
+            next = std::min(next, netIf->Deadline());
+        }
+
+        // Sleep until a reply arrives or the nearest deadline passes
+        int timeout = -1;
+        if (next != UINT64_MAX) {
+            timeout = (next > now) ? static_cast<int>(std::min<uint64_t>((next - now + 999) / 1000, INT32_MAX)) : 0;
+        }
+
+        int count = epoll_wait(epoll, events, 8, timeout);
+        if (count < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            return 1;
+        }
+
+        for (int i = 0; i < count; i++) {
+            reinterpret_cast<NetworkInterface*>(events[i].data.ptr)->OnReceive();
+        }
+
+        now = NowUs();
+        for (auto& netIf : interfaces) {
+            if (netIf->Deadline() <= now) {
+                netIf->OnTimer(now);
+            }
+        }
     }
 
     return 0;
-}
\ No newline at end of file
+}
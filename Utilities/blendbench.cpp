@@ -0,0 +1,260 @@
+#include <Lemon/Graphics/Graphics.h>
+#include <Lemon/Graphics/Surface.h>
+#include <Lemon/System/PerfCounters.h>
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <vector>
+
+// Source images with the mixes of alpha seen when blitting cursors, icons and transparent windows
+enum Pattern {
+    PatternTranslucent, // Every pixel partly transparent
+    PatternEdges,       // Mostly transparent or opaque with antialiased edges, like a cursor or icon
+    PatternOpaque,
+    PatternTransparent,
+};
+
+struct Result {
+    const char* name;
+    uint64_t scalarUs;
+    uint64_t simdUs;
+    uint64_t pixels;
+    uint64_t scalarEvents[PerfEventCount] = {};
+    uint64_t simdEvents[PerfEventCount] = {};
+};
+
+static std::vector<Result> results;
+
+static int width = 1024;
+static int height = 768;
+static unsigned iterations = 100;
+static bool machineReadable = false;
+static bool countEvents = false;
+
+static Lemon::PerfCounters perfCounters;
+
+static uint32_t randomState = 0x12345678;
+
+static uint32_t Random() {
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return randomState;
+}
+
+static uint64_t NowUs() {
+    timespec t;
+    clock_gettime(CLOCK_BOOTTIME, &t);
+    return t.tv_sec * 1000000ULL + t.tv_nsec / 1000;
+}
+
+// Add the events counted since start to total
+static void AddEvents(uint64_t* total, const uint64_t* start) {
+    uint64_t now[PerfEventCount];
+    perfCounters.Read(now);
+    for (int i = 0; i < PerfEventCount; i++) {
+        total[i] += now[i] - start[i];
+    }
+}
+
+static void PrintEvents(const char* mode, const uint64_t* events, uint64_t pixels) {
+    printf("  %-6s", mode);
+    for (int i = 0; i < PerfEventCount; i++) {
+        if (perfCounters.IsCounting(i)) {
+            printf("  %8.3f %s/px", static_cast<double>(events[i]) / pixels, Lemon::PerfCounters::EventName(i));
+        }
+    }
+
+    if (perfCounters.IsCounting(PerfEventCycles) && perfCounters.IsCounting(PerfEventInstructions) &&
+        events[PerfEventCycles]) {
+        printf("  %5.2f IPC", static_cast<double>(events[PerfEventInstructions]) / events[PerfEventCycles]);
+    }
+    printf("\n");
+}
+
+static void Fill(Surface& surface, Pattern pattern) {
+    uint32_t* pixels = reinterpret_cast<uint32_t*>(surface.buffer);
+    for (int i = 0; i < surface.width * surface.height; i++) {
+        uint32_t colour = Random() & 0xffffff;
+        uint32_t alpha;
+
+        switch (pattern) {
+        case PatternTranslucent:
+            alpha = 1 + Random() % 254;
+            break;
+        case PatternEdges: {
+            // Runs of transparent and opaque pixels with a few partly transparent in between
+            int x = i % surface.width;
+            if (x % 64 == 31 || x % 64 == 32) {
+                alpha = Random() & 0xff;
+            } else {
+                alpha = (x % 64 < 32) ? 0 : 0xff;
+            }
+            break;
+        }
+        case PatternOpaque:
+            alpha = 0xff;
+            break;
+        case PatternTransparent:
+        default:
+            alpha = 0;
+            break;
+        }
+
+        pixels[i] = (alpha << 24) | colour;
+    }
+}
+
+static int Run(const char* name, Pattern pattern) {
+    Surface src = {.width = width, .height = height, .buffer = new uint8_t[width * height * 4]};
+    Surface background = {.width = width, .height = height, .buffer = new uint8_t[width * height * 4]};
+    Surface scalar = {.width = width, .height = height, .buffer = new uint8_t[width * height * 4]};
+    Surface simd = {.width = width, .height = height, .buffer = new uint8_t[width * height * 4]};
+
+    Fill(src, pattern);
+    Fill(background, PatternTranslucent);
+
+    const uint32_t* srcPixels = reinterpret_cast<uint32_t*>(src.buffer);
+    uint32_t* scalarPixels = reinterpret_cast<uint32_t*>(scalar.buffer);
+    unsigned pixelCount = width * height;
+
+    Result result = {name, 0, 0, static_cast<uint64_t>(pixelCount) * iterations};
+    uint64_t startEvents[PerfEventCount];
+
+    // Blending over the same dest again would soon leave it opaque, so it is reset each iteration
+    uint64_t scalarUs = 0;
+    for (unsigned n = 0; n < iterations; n++) {
+        scalar.Blit(&background);
+
+        if (countEvents) {
+            perfCounters.Read(startEvents);
+        }
+
+        uint64_t start = NowUs();
+        for (unsigned i = 0; i < pixelCount; i++) {
+            scalarPixels[i] = Lemon::Graphics::AlphaBlendInt(scalarPixels[i], srcPixels[i]);
+        }
+        scalarUs += NowUs() - start;
+
+        if (countEvents) {
+            AddEvents(result.scalarEvents, startEvents);
+        }
+    }
+
+    uint64_t simdUs = 0;
+    for (unsigned n = 0; n < iterations; n++) {
+        simd.Blit(&background);
+
+        if (countEvents) {
+            perfCounters.Read(startEvents);
+        }
+
+        uint64_t start = NowUs();
+        simd.AlphaBlit(&src, {0, 0});
+        simdUs += NowUs() - start;
+
+        if (countEvents) {
+            AddEvents(result.simdEvents, startEvents);
+        }
+    }
+
+    int e = 0;
+    if (memcmp(scalar.buffer, simd.buffer, scalar.BufferSize())) {
+        fprintf(stderr, "blendbench: %s: AlphaBlit differs from AlphaBlendInt\n", name);
+        e = 1;
+    }
+
+    delete[] src.buffer;
+    delete[] background.buffer;
+    delete[] scalar.buffer;
+    delete[] simd.buffer;
+
+    if (!scalarUs) {
+        scalarUs = 1;
+    }
+    if (!simdUs) {
+        simdUs = 1;
+    }
+    result.scalarUs = scalarUs;
+    result.simdUs = simdUs;
+    results.push_back(result);
+
+    if (!machineReadable) {
+        printf("%-12s scalar %8.1f Mpx/s  simd %8.1f Mpx/s  %5.2fx\n", name,
+               static_cast<double>(pixelCount) * iterations / scalarUs,
+               static_cast<double>(pixelCount) * iterations / simdUs, static_cast<double>(scalarUs) / simdUs);
+
+        if (countEvents) {
+            PrintEvents("scalar", result.scalarEvents, result.pixels);
+            PrintEvents("simd", result.simdEvents, result.pixels);
+        }
+    }
+    return e;
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "w:h:n:mp")) >= 0) {
+        switch (opt) {
+        case 'w':
+            width = strtol(optarg, NULL, 10);
+            break;
+        case 'h':
+            height = strtol(optarg, NULL, 10);
+            break;
+        case 'n':
+            iterations = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            machineReadable = true;
+            break;
+        case 'p':
+            countEvents = true;
+            break;
+        case '?':
+            printf("Usage: %s [-w width] [-h height] [-n iterations] [-m] [-p]\n"
+                   "  -w  Width of the surfaces blended (default 1024)\n"
+                   "  -h  Height of the surfaces blended (default 768)\n"
+                   "  -n  Times each surface is blended (default 100)\n"
+                   "  -m  Machine readable output, one line of test,pixels,scalar us,simd us for each test\n"
+                   "  -p  Count hardware events (cycles, instructions, cache misses, branch misses) per pixel,\n"
+                   "      with -m the scalar then simd count of each event is added to the end of each line\n",
+                   argv[0]);
+            return 2;
+        }
+    }
+
+    if (width <= 0 || height <= 0 || !iterations) {
+        fprintf(stderr, "blendbench: Width, height and iterations must be more than 0\n");
+        return 2;
+    }
+
+    if (countEvents && perfCounters.Start()) {
+        perror("blendbench: Failed to start performance counters");
+        countEvents = false;
+    }
+
+    int e = Run("translucent", PatternTranslucent);
+    e |= Run("edges", PatternEdges);
+    e |= Run("opaque", PatternOpaque);
+    e |= Run("transparent", PatternTransparent);
+
+    if (machineReadable) {
+        for (const Result& r : results) {
+            printf("%s,%lu,%lu,%lu", r.name, r.pixels, r.scalarUs, r.simdUs);
+            if (countEvents) {
+                for (int i = 0; i < PerfEventCount; i++) {
+                    printf(",%lu,%lu", r.scalarEvents[i], r.simdEvents[i]);
+                }
+            }
+            printf("\n");
+        }
+    }
+
+    return e;
+}
@@ -0,0 +1,298 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <Lemon/Core/Benchmark.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+using Lemon::Benchmark::NowUs;
+
+static Lemon::Benchmark::Totals results(18);
+
+static std::string directory = ".";
+static size_t fileSize = 16 * 1024 * 1024;
+static size_t blockSize = 4096;
+static unsigned fileCount = 1000;
+static unsigned randomOps = 4096;
+static const char* latencyFile = nullptr;
+
+// Deterministic so runs can be compared
+static uint64_t randomState = 0x9E3779B97F4A7C15ULL;
+static uint64_t Random() {
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 7;
+    randomState ^= randomState << 17;
+    return randomState;
+}
+
+static int Fail(const char* what, const std::string& path) {
+    fprintf(stderr, "fsbench: %s %s: %s\n", what, path.c_str(), strerror(errno));
+    return -1;
+}
+
+static int SequentialWrite(const std::string& path, uint8_t* buffer) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return Fail("Failed to create", path);
+    }
+
+    uint64_t start = NowUs();
+    size_t done = 0;
+    uint64_t ops = 0;
+    while (done < fileSize) {
+        ssize_t ret = write(fd, buffer, std::min(blockSize, fileSize - done));
+        if (ret <= 0) {
+            close(fd);
+            return Fail("Failed to write", path);
+        }
+
+        done += ret;
+        ops++;
+    }
+
+    // Include writing back to the device, the block cache would otherwise hide the disk
+    fsync(fd);
+    results.Report("seq-write", ops, done, NowUs() - start);
+
+    close(fd);
+    return 0;
+}
+
+static int SequentialRead(const std::string& path, uint8_t* buffer) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return Fail("Failed to open", path);
+    }
+
+    uint64_t start = NowUs();
+    size_t done = 0;
+    uint64_t ops = 0;
+    ssize_t ret;
+    while ((ret = read(fd, buffer, blockSize)) > 0) {
+        done += ret;
+        ops++;
+    }
+
+    if (ret < 0) {
+        close(fd);
+        return Fail("Failed to read", path);
+    }
+    results.Report("seq-read", ops, done, NowUs() - start);
+
+    close(fd);
+    return 0;
+}
+
+static int RandomIO(const std::string& path, uint8_t* buffer, bool write) {
+    int fd = open(path.c_str(), write ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        return Fail("Failed to open", path);
+    }
+
+    size_t blocks = fileSize / blockSize;
+    if (!blocks) {
+        close(fd);
+        return 0;
+    }
+
+    uint64_t start = NowUs();
+    for (unsigned i = 0; i < randomOps; i++) {
+        off_t offset = (Random() % blocks) * blockSize;
+
+        ssize_t ret = write ? pwrite(fd, buffer, blockSize, offset) : pread(fd, buffer, blockSize, offset);
+        if (ret < 0) {
+            close(fd);
+            return Fail(write ? "Failed to write" : "Failed to read", path);
+        }
+    }
+
+    if (write) {
+        fsync(fd);
+    }
+    results.Report(write ? "rand-write" : "rand-read", randomOps, static_cast<uint64_t>(randomOps) * blockSize,
+                   NowUs() - start);
+
+    close(fd);
+    return 0;
+}
+
+static int Metadata(const std::string& base) {
+    if (mkdir(base.c_str(), 0755) && errno != EEXIST) {
+        return Fail("Failed to create directory", base);
+    }
+
+    std::vector<std::string> paths;
+    for (unsigned i = 0; i < fileCount; i++) {
+        paths.push_back(base + "/f" + std::to_string(i));
+    }
+
+    uint64_t start = NowUs();
+    for (const std::string& path : paths) {
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return Fail("Failed to create", path);
+        }
+        close(fd);
+    }
+    results.Report("create", fileCount, 0, NowUs() - start);
+
+    start = NowUs();
+    for (const std::string& path : paths) {
+        struct stat st;
+        if (stat(path.c_str(), &st)) {
+            return Fail("Failed to stat", path);
+        }
+    }
+    results.Report("stat", fileCount, 0, NowUs() - start);
+
+    start = NowUs();
+    DIR* dir = opendir(base.c_str());
+    if (!dir) {
+        return Fail("Failed to open directory", base);
+    }
+
+    uint64_t entries = 0;
+    while (readdir(dir)) {
+        entries++;
+    }
+    closedir(dir);
+    results.Report("readdir", entries, 0, NowUs() - start);
+
+    start = NowUs();
+    for (const std::string& path : paths) {
+        if (unlink(path.c_str())) {
+            return Fail("Failed to unlink", path);
+        }
+    }
+    results.Report("unlink", fileCount, 0, NowUs() - start);
+
+    rmdir(base.c_str());
+    return 0;
+}
+
+// Read the same blocks twice, the first pass is uncached unless the file has been read recently
+static int Latency(const std::string& path, uint8_t* buffer) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return Fail("Failed to open", path);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < static_cast<off_t>(blockSize)) {
+        fprintf(stderr, "fsbench: %s is too small for the latency test\n", path.c_str());
+        close(fd);
+        return -1;
+    }
+
+    size_t blocks = st.st_size / blockSize;
+    unsigned ops = std::min<size_t>(randomOps, blocks);
+
+    // Spread the reads over the file without repeating a block
+    std::vector<off_t> offsets;
+    for (unsigned i = 0; i < ops; i++) {
+        offsets.push_back((i * (blocks / ops) + Random() % (blocks / ops)) * blockSize);
+    }
+
+    const char* names[] = {"read-uncached", "read-cached"};
+    for (const char* name : names) {
+        uint64_t start = NowUs();
+        for (off_t offset : offsets) {
+            if (pread(fd, buffer, blockSize, offset) < 0) {
+                close(fd);
+                return Fail("Failed to read", path);
+            }
+        }
+        results.Report(name, ops, static_cast<uint64_t>(ops) * blockSize, NowUs() - start);
+    }
+
+    close(fd);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "d:s:b:n:r:u:m")) >= 0) {
+        switch (opt) {
+        case 'd':
+            directory = optarg;
+            break;
+        case 's':
+            fileSize = strtoul(optarg, NULL, 10) * 1024 * 1024;
+            break;
+        case 'b':
+            blockSize = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            fileCount = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            randomOps = strtoul(optarg, NULL, 10);
+            break;
+        case 'u':
+            latencyFile = optarg;
+            break;
+        case 'm':
+            results.machineReadable = true;
+            break;
+        case '?':
+            printf("Usage: %s [-d dir] [-s size] [-b block size] [-n files] [-r ops] [-u file] [-m]\n"
+                   "  -d  Directory on the volume to test (default .)\n"
+                   "  -s  Size of the test file in MB (default 16)\n"
+                   "  -b  Size of each read and write in bytes (default 4096)\n"
+                   "  -n  Files to create for the metadata tests (default 1000)\n"
+                   "  -r  Random reads and writes (default 4096)\n"
+                   "  -u  File for the cached and uncached latency test, ideally not read since boot\n"
+                   "      (default the test file, which will already be cached)\n"
+                   "  -m  Machine readable output, one line of test,ops,bytes,us for each test\n",
+                   argv[0]);
+            return 2;
+        }
+    }
+
+    if (!blockSize || !randomOps) {
+        fprintf(stderr, "fsbench: Block size and random ops must not be 0\n");
+        return 2;
+    }
+
+    uint8_t* buffer = new uint8_t[blockSize];
+    for (size_t i = 0; i < blockSize; i++) {
+        buffer[i] = Random();
+    }
+
+    std::string dataPath = directory + "/fsbench." + std::to_string(getpid());
+    std::string metaPath = dataPath + ".d";
+
+    int e = SequentialWrite(dataPath, buffer);
+    if (!e) {
+        e = SequentialRead(dataPath, buffer);
+    }
+    if (!e) {
+        e = RandomIO(dataPath, buffer, false);
+    }
+    if (!e) {
+        e = RandomIO(dataPath, buffer, true);
+    }
+    if (!e) {
+        e = Latency(latencyFile ? latencyFile : dataPath, buffer);
+    }
+    unlink(dataPath.c_str());
+
+    if (!e) {
+        e = Metadata(metaPath);
+    }
+
+    results.Finish();
+
+    delete[] buffer;
+    return e ? 1 : 0;
+}
@@ -0,0 +1,214 @@
+#include <Lemon/System/Device.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+struct DiskEntry {
+    int64_t id;
+    std::string name;
+    DiskStatistics stats;
+};
+
+static uint64_t Now() {
+    timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static std::vector<DiskEntry> GetDisks() {
+    std::vector<DiskEntry> disks;
+
+    long deviceCount = Lemon::GetRootDeviceCount();
+    if (deviceCount <= 0) {
+        return disks;
+    }
+
+    std::vector<int64_t> devices(deviceCount);
+    deviceCount = Lemon::EnumerateRootDevices(0, deviceCount, devices.data());
+
+    for (long i = 0; i < deviceCount; i++) {
+        if (Lemon::DeviceGetType(devices[i]) != Lemon::DeviceTypeStorageDevice) {
+            continue;
+        }
+
+        DiskEntry entry = {.id = devices[i], .name = "", .stats = {}};
+
+        char name[NAME_MAX];
+        if (!Lemon::DeviceGetInstanceName(devices[i], name, NAME_MAX)) {
+            entry.name = name;
+        }
+
+        if (!Lemon::DeviceGetDiskStatistics(devices[i], entry.stats)) {
+            disks.push_back(std::move(entry));
+        }
+    }
+
+    return disks;
+}
+
+// Smallest latency bucket holding at least the given fraction of transfers
+static unsigned LatencyPercentile(const uint64_t* latency, unsigned percent) {
+    uint64_t total = 0;
+    for (unsigned i = 0; i < DISK_LATENCY_BUCKETS; i++) {
+        total += latency[i];
+    }
+
+    uint64_t count = 0;
+    for (unsigned i = 0; i < DISK_LATENCY_BUCKETS; i++) {
+        count += latency[i];
+        if (count * 100 >= total * percent) {
+            return i;
+        }
+    }
+
+    return DISK_LATENCY_BUCKETS - 1;
+}
+
+static void PrintHistogram(const char* name, const uint64_t* latency) {
+    printf("    %s:\n", name);
+    for (unsigned i = 0; i < DISK_LATENCY_BUCKETS; i++) {
+        if (!latency[i]) {
+            continue;
+        }
+
+        if (i == DISK_LATENCY_BUCKETS - 1) {
+            printf("        >= %7luus  %lu\n", 1UL << (i - 1), latency[i]);
+        } else {
+            printf("        <  %7luus  %lu\n", 1UL << i, latency[i]);
+        }
+    }
+}
+
+// Difference of every counter in s since last, the current values (queued, in flight) are left as is
+static DiskStatistics Difference(const DiskStatistics& s, const DiskStatistics& last) {
+    DiskStatistics d = s;
+
+    d.reads -= last.reads;
+    d.writes -= last.writes;
+    d.bytesRead -= last.bytesRead;
+    d.bytesWritten -= last.bytesWritten;
+    d.errors -= last.errors;
+    d.requests -= last.requests;
+    d.mergedRequests -= last.mergedRequests;
+    d.queueTimeUs -= last.queueTimeUs;
+    d.busyUs -= last.busyUs;
+    d.inFlightUs -= last.inFlightUs;
+
+    for (unsigned i = 0; i < DISK_LATENCY_BUCKETS; i++) {
+        d.readLatency[i] -= last.readLatency[i];
+        d.writeLatency[i] -= last.writeLatency[i];
+    }
+
+    return d;
+}
+
+static void PrintDisk(const DiskEntry& disk, const DiskStatistics& s, uint64_t elapsedUs, bool histogram) {
+    double seconds = elapsedUs / 1000000.0;
+
+    printf("%-8s  %8.1f  %8.1f  %9.1f  %9.1f  %6lu  %3u/%-3u/%-3u  %5.1f%%  %6.2f  %8lu", disk.name.c_str(),
+           s.reads / seconds, s.writes / seconds, s.bytesRead / 1024.0 / seconds, s.bytesWritten / 1024.0 / seconds,
+           s.errors, s.queued, s.inFlight, s.inFlightHighWater, s.busyUs * 100.0 / elapsedUs,
+           static_cast<double>(s.inFlightUs) / elapsedUs, s.requests ? s.queueTimeUs / s.requests : 0);
+
+    if (s.reads) {
+        printf("  <%lu/<%luus", 1UL << LatencyPercentile(s.readLatency, 50),
+               1UL << LatencyPercentile(s.readLatency, 99));
+    } else {
+        printf("  -");
+    }
+
+    if (s.writes) {
+        printf("  <%lu/<%luus", 1UL << LatencyPercentile(s.writeLatency, 50),
+               1UL << LatencyPercentile(s.writeLatency, 99));
+    } else {
+        printf("  -");
+    }
+    printf("\n");
+
+    if (histogram) {
+        if (s.reads) {
+            PrintHistogram("Read latency", s.readLatency);
+        }
+
+        if (s.writes) {
+            PrintHistogram("Write latency", s.writeLatency);
+        }
+    }
+}
+
+static void PrintHeader() {
+    printf("Disk:     Reads/s:  Writes/s: KB read/s: KB wrtn/s: Errors: Queue/In flight/Max:  Busy:  Depth:  Wait (us):  "
+           "Read (p50/p99):  Write (p50/p99):\n");
+}
+
+int main(int argc, char** argv) {
+    bool histogram = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "l")) >= 0) {
+        switch (opt) {
+        case 'l':
+            histogram = true;
+            break;
+        case '?':
+            printf("Usage: %s [-l] [interval]\n"
+                   "  -l        Show the latency histograms of each disk\n"
+                   "  interval  Print the activity of each interval in seconds, rather than since boot\n",
+                   argv[0]);
+            return 2;
+        }
+    }
+
+    long interval = 0;
+    if (optind < argc) {
+        interval = strtol(argv[optind], NULL, 10);
+        if (interval <= 0) {
+            printf("%s: Invalid interval '%s'\n", argv[0], argv[optind]);
+            return 2;
+        }
+    }
+
+    std::vector<DiskEntry> disks = GetDisks();
+    uint64_t lastTime = Now();
+
+    if (!interval) {
+        PrintHeader();
+        for (const DiskEntry& disk : disks) {
+            PrintDisk(disk, disk.stats, lastTime, histogram); // Counters start at boot
+        }
+
+        return 0;
+    }
+
+    for (;;) {
+        sleep(interval);
+
+        std::vector<DiskEntry> current = GetDisks();
+        uint64_t time = Now();
+
+        PrintHeader();
+        for (const DiskEntry& disk : current) {
+            DiskStatistics s = disk.stats;
+            for (const DiskEntry& last : disks) {
+                if (last.id == disk.id) {
+                    s = Difference(disk.stats, last.stats);
+                    break;
+                }
+            }
+
+            PrintDisk(disk, s, time - lastTime, histogram);
+        }
+        printf("\n");
+
+        disks = std::move(current);
+        lastTime = time;
+    }
+}
@@ -0,0 +1,124 @@
+#include <Lemon/System/IPC.h>
+#include <Lemon/System/Util.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <vector>
+
+struct EndpointEntry {
+    lemon_process_info_t* process;
+    EndpointStatistics stats;
+
+    uint64_t Messages() const {
+        return stats.messagesSent + stats.messagesReceived + stats.ringSent + stats.ringReceived;
+    }
+};
+
+// Smallest latency bucket holding at least the given fraction of calls
+static unsigned LatencyPercentile(const EndpointStatistics& stats, unsigned percent) {
+    uint64_t total = 0;
+    for (unsigned i = 0; i < ENDPOINT_LATENCY_BUCKETS; i++) {
+        total += stats.callLatency[i];
+    }
+
+    uint64_t count = 0;
+    for (unsigned i = 0; i < ENDPOINT_LATENCY_BUCKETS; i++) {
+        count += stats.callLatency[i];
+        if (count * 100 >= total * percent) {
+            return i;
+        }
+    }
+
+    return ENDPOINT_LATENCY_BUCKETS - 1;
+}
+
+static void PrintHistogram(const EndpointStatistics& stats) {
+    for (unsigned i = 0; i < ENDPOINT_LATENCY_BUCKETS; i++) {
+        if (!stats.callLatency[i]) {
+            continue;
+        }
+
+        if (i == ENDPOINT_LATENCY_BUCKETS - 1) {
+            printf("        >= %7luus  %lu\n", 1UL << (i - 1), stats.callLatency[i]);
+        } else {
+            printf("        <  %7luus  %lu\n", 1UL << i, stats.callLatency[i]);
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    bool histogram = false;
+    pid_t onlyPID = -1;
+    size_t limit = SIZE_MAX;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "lp:n:")) >= 0) {
+        switch (opt) {
+        case 'l':
+            histogram = true;
+            break;
+        case 'p':
+            onlyPID = strtol(optarg, NULL, 10);
+            break;
+        case 'n':
+            limit = strtoul(optarg, NULL, 10);
+            break;
+        case '?':
+            printf("Usage: %s [-l] [-p pid] [-n count]\n"
+                   "  -l  Show the call latency histogram of each endpoint\n"
+                   "  -p  Only show the endpoints of a process\n"
+                   "  -n  Only show the busiest count endpoints\n",
+                   argv[0]);
+            return 2;
+        }
+    }
+
+    std::vector<lemon_process_info_t> procs;
+    Lemon::GetProcessList(procs);
+
+    std::vector<EndpointEntry> endpoints;
+    for (lemon_process_info_t& proc : procs) {
+        if (onlyPID >= 0 && proc.pid != onlyPID) {
+            continue;
+        }
+
+        EndpointEntry entry = {.process = &proc, .stats = {}};
+        for (long handle = 0; (handle = Lemon::EndpointGetStatistics(proc.pid, handle, entry.stats)) >= 0; handle++) {
+            endpoints.push_back(entry);
+        }
+    }
+
+    // Busiest endpoints first
+    std::sort(endpoints.begin(), endpoints.end(),
+              [](const EndpointEntry& l, const EndpointEntry& r) { return l.Messages() > r.Messages(); });
+
+    printf("Process:        PID:  Handle:  Sent:     Received:  Bytes (tx/rx):      Ring (tx/rx):       Queue (max/limit):  "
+           "Calls:   Latency (p50/p99):\n\n");
+    for (size_t i = 0; i < endpoints.size() && i < limit; i++) {
+        const EndpointEntry& e = endpoints[i];
+        const EndpointStatistics& s = e.stats;
+
+        printf("%14s  %4d  %7ld  %8lu  %9lu  %8lu/%-8lu  %8u/%-8u  %4u/%-4u/%-6u      %7lu", e.process->name,
+               e.process->pid, s.handle, s.messagesSent, s.messagesReceived, s.bytesSent, s.bytesReceived, s.ringSent,
+               s.ringReceived, s.queued, s.queueHighWater, s.queueLimit, s.calls);
+
+        if (s.calls) {
+            printf("  <%lu/<%luus", 1UL << LatencyPercentile(s, 50), 1UL << LatencyPercentile(s, 99));
+        }
+
+        if (s.callTimeouts) {
+            printf("  (%lu timed out)", s.callTimeouts);
+        }
+        printf("\n");
+
+        if (histogram && s.calls) {
+            PrintHistogram(s);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,447 @@
+#include <sys/socket.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <Lemon/Core/Benchmark.h>
+
+#include <algorithm>
+#include <vector>
+
+// The first byte sent on each TCP connection tells the server which test it is for
+enum TestType : uint8_t {
+    TestStream = 'S',   // Followed by the length, the server reads that much and sends one byte back
+    TestRequest = 'R',  // Followed by the message size, the server echoes each message
+    TestConnect = 'C',  // Closed straight away
+};
+
+#define UDP_END_SEQUENCE 0xFFFFFFFFU // Asks the server for the amount of datagrams received since the last one
+
+using Lemon::Benchmark::NowUs;
+
+static Lemon::Benchmark::Totals results(14);
+
+static const char* serverAddress = "127.0.0.1";
+static uint16_t port = 5201;
+static size_t streamSize = 64 * 1024 * 1024;
+static size_t blockSize = 65536;
+static size_t messageSize = 64;
+static unsigned requestOps = 10000;
+static unsigned datagramCount = 100000;
+static unsigned connectionCount = 1000;
+
+static int Fail(const char* what) {
+    fprintf(stderr, "netbench: %s: %s\n", what, strerror(errno));
+    return -1;
+}
+
+static sockaddr_in Address(const char* ip) {
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = ip ? inet_addr(ip) : INADDR_ANY;
+    return addr;
+}
+
+// Keep going after short reads and writes
+static bool ReadAll(int fd, void* buffer, size_t len) {
+    uint8_t* p = reinterpret_cast<uint8_t*>(buffer);
+    while (len) {
+        ssize_t ret = read(fd, p, len);
+        if (ret <= 0) {
+            return false;
+        }
+
+        p += ret;
+        len -= ret;
+    }
+
+    return true;
+}
+
+static bool WriteAll(int fd, const void* buffer, size_t len) {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(buffer);
+    while (len) {
+        ssize_t ret = write(fd, p, len);
+        if (ret <= 0) {
+            return false;
+        }
+
+        p += ret;
+        len -= ret;
+    }
+
+    return true;
+}
+
+static void ServeConnection(int fd, uint8_t* buffer) {
+    uint8_t type;
+    if (!ReadAll(fd, &type, 1)) {
+        return;
+    }
+
+    if (type == TestStream) {
+        uint64_t length;
+        if (!ReadAll(fd, &length, sizeof(length))) {
+            return;
+        }
+
+        while (length) {
+            ssize_t ret = read(fd, buffer, std::min<uint64_t>(length, blockSize));
+            if (ret <= 0) {
+                return;
+            }
+            length -= ret;
+        }
+
+        uint8_t done = 0;
+        WriteAll(fd, &done, 1);
+    } else if (type == TestRequest) {
+        uint32_t size;
+        if (!ReadAll(fd, &size, sizeof(size)) || size > blockSize) {
+            return;
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        while (ReadAll(fd, buffer, size) && WriteAll(fd, buffer, size)) {
+        }
+    }
+}
+
+// Handle one client test at a time until killed
+static int Server(uint8_t* buffer) {
+    int tcp = socket(AF_INET, SOCK_STREAM, 0);
+    int udp = socket(AF_INET, SOCK_DGRAM, 0);
+    if (tcp < 0 || udp < 0) {
+        return Fail("Failed to create socket");
+    }
+
+    sockaddr_in addr = Address(nullptr);
+    if (bind(tcp, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) ||
+        bind(udp, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))) {
+        return Fail("Failed to bind");
+    }
+
+    if (listen(tcp, 128)) {
+        return Fail("Failed to listen");
+    }
+
+    if (!results.machineReadable) {
+        printf("netbench: Listening on port %u\n", port);
+    }
+
+    uint64_t datagrams = 0;
+
+    for (;;) {
+        pollfd fds[2] = {{tcp, POLLIN, 0}, {udp, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return Fail("Failed to poll");
+        }
+
+        if (fds[1].revents & POLLIN) {
+            sockaddr_in client;
+            socklen_t clientLen = sizeof(client);
+
+            ssize_t ret = recvfrom(udp, buffer, blockSize, 0, reinterpret_cast<sockaddr*>(&client), &clientLen);
+            uint32_t sequence;
+            if (ret >= static_cast<ssize_t>(sizeof(sequence))) {
+                memcpy(&sequence, buffer, sizeof(sequence));
+
+                if (sequence == UDP_END_SEQUENCE) {
+                    sendto(udp, &datagrams, sizeof(datagrams), 0, reinterpret_cast<sockaddr*>(&client), clientLen);
+                    datagrams = 0;
+                } else {
+                    datagrams++;
+                }
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(tcp, nullptr, nullptr);
+            if (fd >= 0) {
+                ServeConnection(fd, buffer);
+                close(fd);
+            }
+        }
+    }
+}
+
+static int Connect(bool noDelay) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return Fail("Failed to create socket");
+    }
+
+    if (noDelay) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    sockaddr_in addr = Address(serverAddress);
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))) {
+        close(fd);
+        return Fail("Failed to connect");
+    }
+
+    return fd;
+}
+
+// Bulk transfer to the server, timed until the server has read all of it
+static int Stream(uint8_t* buffer) {
+    int fd = Connect(false);
+    if (fd < 0) {
+        return -1;
+    }
+
+    uint8_t header[1 + sizeof(uint64_t)] = {TestStream};
+    uint64_t length = streamSize;
+    memcpy(header + 1, &length, sizeof(length));
+
+    uint64_t start = NowUs();
+    if (!WriteAll(fd, header, sizeof(header))) {
+        close(fd);
+        return Fail("Failed to send");
+    }
+
+    size_t done = 0;
+    uint64_t ops = 0;
+    while (done < streamSize) {
+        size_t len = std::min(blockSize, streamSize - done);
+        if (!WriteAll(fd, buffer, len)) {
+            close(fd);
+            return Fail("Failed to send");
+        }
+
+        done += len;
+        ops++;
+    }
+
+    uint8_t ack;
+    if (!ReadAll(fd, &ack, 1)) {
+        close(fd);
+        return Fail("Failed to receive");
+    }
+    results.Report("tcp-stream", ops, done, NowUs() - start);
+
+    close(fd);
+    return 0;
+}
+
+// Round trips of one message each way, one at a time
+static int RequestResponse(uint8_t* buffer) {
+    int fd = Connect(true);
+    if (fd < 0) {
+        return -1;
+    }
+
+    uint8_t header[1 + sizeof(uint32_t)] = {TestRequest};
+    uint32_t size = messageSize;
+    memcpy(header + 1, &size, sizeof(size));
+    if (!WriteAll(fd, header, sizeof(header))) {
+        close(fd);
+        return Fail("Failed to send");
+    }
+
+    std::vector<uint32_t> latencies;
+    latencies.reserve(requestOps);
+
+    uint64_t start = NowUs();
+    for (unsigned i = 0; i < requestOps; i++) {
+        uint64_t sent = NowUs();
+        if (!WriteAll(fd, buffer, messageSize) || !ReadAll(fd, buffer, messageSize)) {
+            close(fd);
+            return Fail("Failed to exchange");
+        }
+        latencies.push_back(NowUs() - sent);
+    }
+    results.Report("tcp-rr", requestOps, static_cast<uint64_t>(requestOps) * messageSize * 2, NowUs() - start);
+
+    close(fd);
+
+    std::sort(latencies.begin(), latencies.end());
+    if (!results.machineReadable && latencies.size()) {
+        printf("%-14s p50 %u us  p99 %u us  max %u us\n", "tcp-rr", latencies[latencies.size() / 2],
+               latencies[latencies.size() * 99 / 100], latencies.back());
+    }
+    return 0;
+}
+
+// Datagrams sent as fast as possible, the server reports how many arrived
+static int DatagramRate(uint8_t* buffer) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        return Fail("Failed to create socket");
+    }
+
+    sockaddr_in addr = Address(serverAddress);
+    size_t size = std::max(messageSize, sizeof(uint32_t));
+
+    uint64_t start = NowUs();
+    for (uint32_t i = 0; i < datagramCount; i++) {
+        memcpy(buffer, &i, sizeof(i));
+        if (sendto(fd, buffer, size, 0, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 && errno != ENOBUFS) {
+            close(fd);
+            return Fail("Failed to send");
+        }
+    }
+    uint64_t elapsed = NowUs() - start;
+
+    // Datagrams can be dropped, the end marker included, so ask a few times
+    uint64_t received = 0;
+    bool answered = false;
+    for (int attempt = 0; attempt < 3 && !answered; attempt++) {
+        uint32_t end = UDP_END_SEQUENCE;
+        sendto(fd, &end, sizeof(end), 0, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+
+        pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, 1000) > 0 && recv(fd, &received, sizeof(received), 0) == static_cast<ssize_t>(sizeof(received))) {
+            answered = true;
+        }
+    }
+
+    close(fd);
+
+    results.Report("udp-send", datagramCount, static_cast<uint64_t>(datagramCount) * size, elapsed);
+    if (!answered) {
+        fprintf(stderr, "netbench: No reply from the server for the received datagram count\n");
+        return -1;
+    }
+    results.Report("udp-recv", received, received * size, elapsed);
+    return 0;
+}
+
+// Connections set up and torn down one after the other
+static int ConnectionRate() {
+    uint64_t start = NowUs();
+    for (unsigned i = 0; i < connectionCount; i++) {
+        int fd = Connect(true);
+        if (fd < 0) {
+            return -1;
+        }
+
+        uint8_t type = TestConnect;
+        WriteAll(fd, &type, 1);
+        close(fd);
+    }
+    results.Report("tcp-connect", connectionCount, 0, NowUs() - start);
+
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    bool server = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "sa:p:l:b:r:n:u:c:m")) >= 0) {
+        switch (opt) {
+        case 's':
+            server = true;
+            break;
+        case 'a':
+            serverAddress = optarg;
+            break;
+        case 'p':
+            port = strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            streamSize = strtoul(optarg, NULL, 10) * 1024 * 1024;
+            break;
+        case 'b':
+            blockSize = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            messageSize = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            requestOps = strtoul(optarg, NULL, 10);
+            break;
+        case 'u':
+            datagramCount = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            connectionCount = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            results.machineReadable = true;
+            break;
+        case '?':
+            printf("Usage: %s -s [-p port] [-b block size]\n"
+                   "       %s [-a address] [-p port] [-l size] [-b block size] [-r size] [-n ops] [-u count] [-c count] "
+                   "[-m] [test...]\n"
+                   "  -s  Run the server\n"
+                   "  -a  Address of the server (default 127.0.0.1)\n"
+                   "  -p  Port of the server (default 5201)\n"
+                   "  -l  Amount to send for the stream test in MB (default 64)\n"
+                   "  -b  Size of each write for the stream test in bytes (default 65536)\n"
+                   "  -r  Size of each request, response and datagram in bytes (default 64)\n"
+                   "  -n  Requests for the request/response test (default 10000)\n"
+                   "  -u  Datagrams for the UDP test (default 100000)\n"
+                   "  -c  Connections for the connection test (default 1000)\n"
+                   "  -m  Machine readable output, one line of test,ops,bytes,us for each test\n"
+                   "Tests are stream, rr, udp and connect, all of them are run by default\n",
+                   argv[0], argv[0]);
+            return 2;
+        }
+    }
+
+    if (!blockSize || !messageSize || messageSize > blockSize) {
+        fprintf(stderr, "netbench: Sizes must not be 0 and requests must fit in a block\n");
+        return 2;
+    }
+
+    uint8_t* buffer = new uint8_t[blockSize];
+    memset(buffer, 0xA5, blockSize);
+
+    if (server) {
+        return Server(buffer) ? 1 : 0;
+    }
+
+    std::vector<const char*> tests;
+    for (int i = optind; i < argc; i++) {
+        tests.push_back(argv[i]);
+    }
+    if (tests.empty()) {
+        tests = {"stream", "rr", "udp", "connect"};
+    }
+
+    int e = 0;
+    for (const char* test : tests) {
+        if (!strcmp(test, "stream")) {
+            e = Stream(buffer);
+        } else if (!strcmp(test, "rr")) {
+            e = RequestResponse(buffer);
+        } else if (!strcmp(test, "udp")) {
+            e = DatagramRate(buffer);
+        } else if (!strcmp(test, "connect")) {
+            e = ConnectionRate();
+        } else {
+            fprintf(stderr, "netbench: Unknown test '%s'\n", test);
+            e = -1;
+        }
+
+        if (e) {
+            break;
+        }
+    }
+
+    results.Finish();
+
+    delete[] buffer;
+    return e ? 1 : 0;
+}
@@ -0,0 +1,272 @@
+#include <cxxabi.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#define PROFILE_DEVICE "/dev/profile"
+
+struct Function {
+    uint64_t self = 0;  // Samples where it was running
+    uint64_t total = 0; // Samples where it was running or on the stack
+    std::map<std::string, uint64_t> callers;
+};
+
+static std::map<std::string, Function> functions;
+static uint64_t sampleCount = 0;
+static uint64_t droppedCount = 0;
+
+static bool callGraph = false;
+static bool kernelOnly = false;
+static pid_t onlyPID = -1;
+static unsigned limit = 30;
+
+static volatile bool interrupted = false;
+
+// Kernel frames are symbol+0xoffset, user frames are addresses so they are grouped by process
+static std::string FunctionName(const char* frame, const char* process) {
+    if (!strncmp(frame, "0x", 2)) {
+        return std::string("[") + process + "]";
+    }
+
+    std::string symbol = frame;
+    if (size_t plus = symbol.rfind("+0x"); plus != std::string::npos) {
+        symbol.resize(plus);
+    }
+
+    int status;
+    if (char* demangled = abi::__cxa_demangle(symbol.c_str(), nullptr, nullptr, &status); demangled) {
+        symbol = demangled;
+        free(demangled);
+    }
+
+    return symbol;
+}
+
+static void AddSample(char* line) {
+    char* save;
+    if (line[0] == '#') {
+        unsigned cpu;
+        unsigned long dropped;
+        if (sscanf(line, "# %u dropped %lu", &cpu, &dropped) == 2) {
+            droppedCount += dropped;
+        }
+        return;
+    }
+
+    // <cpu> <pid> <tid> <process> <k|u> <frame>...
+    char* cpu = strtok_r(line, " ", &save);
+    char* pid = strtok_r(nullptr, " ", &save);
+    char* tid = strtok_r(nullptr, " ", &save);
+    char* process = strtok_r(nullptr, " ", &save);
+    char* mode = strtok_r(nullptr, " ", &save);
+    if (!cpu || !pid || !tid || !process || !mode) {
+        return;
+    }
+
+    if ((onlyPID >= 0 && atoi(pid) != onlyPID) || (kernelOnly && *mode != 'k')) {
+        return;
+    }
+
+    sampleCount++;
+
+    std::vector<std::string> stack;
+    while (char* frame = strtok_r(nullptr, " ", &save)) {
+        stack.push_back(FunctionName(frame, process));
+    }
+
+    if (stack.empty()) {
+        return;
+    }
+
+    functions[stack.front()].self++;
+
+    // Recursive functions are only counted once
+    std::set<std::string> seen;
+    for (size_t i = 0; i < stack.size(); i++) {
+        Function& function = functions[stack[i]];
+        if (seen.insert(stack[i]).second) {
+            function.total++;
+        }
+
+        if (i + 1 < stack.size()) {
+            function.callers[stack[i + 1]]++;
+        }
+    }
+}
+
+static int ReadSamples(int fd, std::string& partial) {
+    static char buffer[65536];
+    for (;;) {
+        ssize_t r = read(fd, buffer, sizeof(buffer));
+        if (r < 0) {
+            perror("prof: Failed to read " PROFILE_DEVICE);
+            return -1;
+        } else if (r == 0) {
+            return 0;
+        }
+
+        partial.append(buffer, r);
+
+        size_t start = 0;
+        size_t end;
+        while ((end = partial.find('\n', start)) != std::string::npos) {
+            partial[end] = 0;
+            AddSample(partial.data() + start);
+            start = end + 1;
+        }
+        partial.erase(0, start);
+    }
+}
+
+static double Percent(uint64_t count) { return sampleCount ? count * 100.0 / sampleCount : 0; }
+
+static void PrintProfile() {
+    std::vector<std::pair<std::string, Function*>> sorted;
+    for (auto& [name, function] : functions) {
+        sorted.push_back({name, &function});
+    }
+
+    printf("%lu samples", sampleCount);
+    if (droppedCount) {
+        printf(" (%lu dropped)", droppedCount);
+    }
+    printf("\n\n");
+
+    std::sort(sorted.begin(), sorted.end(), [](auto& l, auto& r) { return l.second->self > r.second->self; });
+
+    printf("Flat profile:\n");
+    printf("%7s %7s %9s  %s\n", "self%", "total%", "samples", "function");
+    for (unsigned i = 0; i < sorted.size() && i < limit; i++) {
+        Function* function = sorted[i].second;
+        if (!function->self) {
+            break;
+        }
+
+        printf("%6.2f%% %6.2f%% %9lu  %s\n", Percent(function->self), Percent(function->total), function->self,
+               sorted[i].first.c_str());
+    }
+
+    if (!callGraph) {
+        return;
+    }
+
+    std::sort(sorted.begin(), sorted.end(), [](auto& l, auto& r) { return l.second->total > r.second->total; });
+
+    printf("\nCall graph (callers of each function):\n");
+    for (unsigned i = 0; i < sorted.size() && i < limit; i++) {
+        Function* function = sorted[i].second;
+        printf("%6.2f%% %s\n", Percent(function->total), sorted[i].first.c_str());
+
+        std::vector<std::pair<std::string, uint64_t>> callers(function->callers.begin(), function->callers.end());
+        std::sort(callers.begin(), callers.end(), [](auto& l, auto& r) { return l.second > r.second; });
+        for (auto& [caller, count] : callers) {
+            printf("          %9lu  <- %s\n", count, caller.c_str());
+        }
+    }
+}
+
+static bool Control(int fd, const char* command) {
+    if (write(fd, command, strlen(command)) < 0) {
+        fprintf(stderr, "prof: Failed to %s profiling: %s\n", command, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char** argv) {
+    unsigned seconds = 5;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "+t:gkp:n:")) >= 0) {
+        switch (opt) {
+        case 't':
+            seconds = strtoul(optarg, nullptr, 10);
+            break;
+        case 'g':
+            callGraph = true;
+            break;
+        case 'k':
+            kernelOnly = true;
+            break;
+        case 'p':
+            onlyPID = atoi(optarg);
+            break;
+        case 'n':
+            limit = strtoul(optarg, nullptr, 10);
+            break;
+        case '?':
+            printf("Usage: %s [-t seconds] [-g] [-k] [-p pid] [-n count] [program [args]...]\n"
+                   "  -t  Seconds to profile for if no program is given (default 5)\n"
+                   "  -g  Sample kernel call stacks and print a call graph\n"
+                   "  -k  Only count samples taken in the kernel\n"
+                   "  -p  Only count samples of a process\n"
+                   "  -n  Functions to show (default 30)\n"
+                   "The whole system is sampled on every scheduler tick, until the program exits if one is given.\n"
+                   "User addresses are not resolved, so user time is counted against the process.\n",
+                   argv[0]);
+            return 2;
+        }
+    }
+
+    int fd = open(PROFILE_DEVICE, O_RDWR);
+    if (fd < 0) {
+        perror("prof: Failed to open " PROFILE_DEVICE);
+        return 1;
+    }
+
+    signal(SIGINT, [](int) { interrupted = true; });
+
+    if (!Control(fd, callGraph ? "start stack" : "start")) {
+        return 1;
+    }
+
+    // Samples are read as they come in so the buffers do not fill up
+    std::string partial;
+    if (optind < argc) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fd);
+            execvp(argv[optind], argv + optind);
+            perror("prof: exec");
+            _exit(127);
+        } else if (pid < 0) {
+            perror("prof: fork");
+            Control(fd, "stop");
+            return 1;
+        }
+
+        while (!interrupted && waitpid(pid, nullptr, WNOHANG) == 0) {
+            usleep(100000);
+            if (ReadSamples(fd, partial)) {
+                break;
+            }
+        }
+    } else {
+        for (unsigned i = 0; i < seconds * 10 && !interrupted; i++) {
+            usleep(100000);
+            if (ReadSamples(fd, partial)) {
+                break;
+            }
+        }
+    }
+
+    Control(fd, "stop");
+    ReadSamples(fd, partial);
+    close(fd);
+
+    PrintProfile();
+    return 0;
+}
@@ -8,9 +8,32 @@ int main(int argc, char** argv){
     std::vector<lemon_process_info_t> procs;
     Lemon::GetProcessList(procs);
 
-    printf("Process:        PID:   Uptime:\n\n");
+    printf("Process:        PID:   Uptime:  VCSW:     ICSW:     Wait (avg/max):\n\n");
     for(lemon_process_info_t proc : procs){
-        printf("%14s  %4d  %lus\n", proc.name, proc.pid, proc.runningTime);
+        uint64_t averageWaitUs = 0;
+        if(proc.contextSwitches){
+            averageWaitUs = proc.runQueueWaitUs / proc.contextSwitches;
+        }
+
+        printf("%14s  %4d  %6lus  %8lu  %8lu  %lu/%luus\n", proc.name, proc.pid, proc.runningTime,
+               proc.voluntarySwitches, proc.involuntarySwitches, averageWaitUs, proc.maxRunQueueWaitUs);
+    }
+
+    lemon_sysinfo_t sysInfo = Lemon::SysInfo();
+
+    printf("\nCPU:  Busy:  Switches:  Migrations:  Queued:\n\n");
+    for(unsigned i = 0; i < sysInfo.cpuCount; i++){
+        lemon_cpu_info_t cpu;
+        if(Lemon::GetCPUInfo(i, cpu)){
+            break;
+        }
+
+        unsigned busyPercent = 0;
+        if(cpu.busyUs + cpu.idleUs){
+            busyPercent = cpu.busyUs * 100 / (cpu.busyUs + cpu.idleUs);
+        }
+
+        printf("%4u  %4u%%  %9lu  %11lu  %7u\n", i, busyPercent, cpu.contextSwitches, cpu.migrations, cpu.runQueueLength);
     }
 
     return 0;
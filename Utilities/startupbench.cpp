@@ -0,0 +1,200 @@
+#include <Lemon/Core/StartupProfile.h>
+
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+// Time spent in each phase of one launch, in microseconds
+using Breakdown = std::map<std::string, uint64_t>;
+
+static std::vector<std::string> phaseNames; // In the order they were first seen
+
+static unsigned runs = 10;
+static int timeout = 10; // Seconds to wait for the first paint
+static bool machineReadable = false;
+
+static uint64_t NowUs() {
+    timespec t;
+    clock_gettime(CLOCK_BOOTTIME, &t);
+    return t.tv_sec * 1000000ULL + t.tv_nsec / 1000;
+}
+
+static void AddPhase(Breakdown& breakdown, const std::string& name, uint64_t us) {
+    if (std::find(phaseNames.begin(), phaseNames.end(), name) == phaseNames.end()) {
+        phaseNames.push_back(name);
+    }
+
+    breakdown[name] += us;
+}
+
+// Launch the program and read its startup profile, returns false if it did not paint in time
+static bool Launch(char** argv, Breakdown& breakdown) {
+    int fds[2];
+    if (pipe(fds)) {
+        perror("startupbench: pipe");
+        return false;
+    }
+
+    uint64_t start = NowUs();
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+
+        char fd[16];
+        snprintf(fd, sizeof(fd), "%d", fds[1]);
+        setenv(STARTUP_PROFILE_FD_ENV, fd, 1);
+        setenv(STARTUP_PROFILE_EXIT_ENV, "1", 1);
+
+        execvp(argv[0], argv);
+        perror("startupbench: exec");
+        _exit(127);
+    } else if (pid < 0) {
+        perror("startupbench: fork");
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+
+    close(fds[1]);
+
+    std::string report;
+    uint64_t deadline = start + timeout * 1000000ULL;
+    for (;;) {
+        uint64_t now = NowUs();
+        pollfd pfd = {.fd = fds[0], .events = POLLIN, .revents = 0};
+        if (now >= deadline || poll(&pfd, 1, (deadline - now) / 1000) <= 0) {
+            break;
+        }
+
+        char buffer[512];
+        ssize_t r = read(fds[0], buffer, sizeof(buffer));
+        if (r <= 0) {
+            break; // Written and closed, or the program exited
+        }
+        report.append(buffer, r);
+    }
+    close(fds[0]);
+
+    if (report.find("painted") == std::string::npos) {
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+
+        fprintf(stderr, "startupbench: %s did not paint a window within %d s\n", argv[0], timeout);
+        return false;
+    }
+    waitpid(pid, nullptr, 0);
+
+    uint64_t loaded = 0;
+    uint64_t painted = 0;
+    uint64_t phaseTotal = 0;
+
+    // Loading, then the phases LibLemon timed in the order they started, then everything else the program did
+    std::vector<std::pair<std::string, uint64_t>> phases;
+    char* save = nullptr;
+    for (char* line = strtok_r(report.data(), "\n", &save); line; line = strtok_r(nullptr, "\n", &save)) {
+        char name[64];
+        unsigned count;
+        unsigned long value;
+        if (sscanf(line, "loaded %lu", &value) == 1) {
+            loaded = value;
+        } else if (sscanf(line, "painted %lu", &value) == 1) {
+            painted = value;
+        } else if (sscanf(line, "phase %63s %u %lu", name, &count, &value) == 3) {
+            phases.push_back({name, value});
+            phaseTotal += value;
+        }
+    }
+
+    AddPhase(breakdown, "exec+load", loaded - start);
+    for (auto& [name, us] : phases) {
+        AddPhase(breakdown, name, us);
+    }
+
+    AddPhase(breakdown, "other", (painted - loaded > phaseTotal) ? (painted - loaded - phaseTotal) : 0);
+    AddPhase(breakdown, "total", painted - start);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "+n:t:m")) >= 0) {
+        switch (opt) {
+        case 'n':
+            runs = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            timeout = strtol(optarg, NULL, 10);
+            break;
+        case 'm':
+            machineReadable = true;
+            break;
+        case '?':
+            printf("Usage: %s [-n runs] [-t timeout] [-m] program [args]...\n"
+                   "  -n  Times the program is launched (default 10)\n"
+                   "  -t  Seconds to wait for each launch to paint (default 10)\n"
+                   "  -m  Machine readable output, one line of run,phase,us for each phase of each launch\n"
+                   "The program is closed once it has painted its first window.\n",
+                   argv[0]);
+            return 2;
+        }
+    }
+
+    if (optind >= argc || !runs || timeout <= 0) {
+        fprintf(stderr, "startupbench: Nothing to launch, see %s -?\n", argv[0]);
+        return 2;
+    }
+
+    std::vector<Breakdown> results;
+    for (unsigned i = 0; i < runs; i++) {
+        Breakdown breakdown;
+        if (!Launch(argv + optind, breakdown)) {
+            return 1;
+        }
+
+        results.push_back(std::move(breakdown));
+    }
+
+    // "other" and "total" are reported last
+    phaseNames.erase(std::remove(phaseNames.begin(), phaseNames.end(), "other"), phaseNames.end());
+    phaseNames.erase(std::remove(phaseNames.begin(), phaseNames.end(), "total"), phaseNames.end());
+    phaseNames.push_back("other");
+    phaseNames.push_back("total");
+
+    if (machineReadable) {
+        for (unsigned i = 0; i < results.size(); i++) {
+            for (const std::string& name : phaseNames) {
+                printf("%u,%s,%lu\n", i, name.c_str(), results[i][name]);
+            }
+        }
+        return 0;
+    }
+
+    // The first launch is usually the only one reading from disk, so it is shown apart from the rest
+    printf("%s, %u launches (ms)\n", argv[optind], runs);
+    printf("%-14s %9s %9s %9s\n", "phase", "first", "median", "min");
+    for (const std::string& name : phaseNames) {
+        std::vector<uint64_t> times;
+        for (Breakdown& breakdown : results) {
+            times.push_back(breakdown[name]);
+        }
+        uint64_t first = times.front();
+        std::sort(times.begin(), times.end());
+
+        printf("%-14s %9.2f %9.2f %9.2f\n", name.c_str(), first / 1000.0, times[times.size() / 2] / 1000.0,
+               times.front() / 1000.0);
+    }
+
+    return 0;
+}